@@ -18,6 +18,7 @@ yellow = lambda text: f"\033[0;33m{text}\033[0m"
 class Mode(Enum):
     multicore = auto()
     singlecore = auto()
+    sweep = auto()
 
 
 @dataclass
@@ -50,14 +51,36 @@ class Hardware:
     cpu_threads: int
 
 
+@dataclass
+class SweepPoint:
+    fuzzers_used: int
+    cpus: List[int]
+    smt: bool  # some of the cpus are SMT siblings of each other
+    numa_nodes: int  # how many NUMA nodes the cpus are spread over
+    execs_per_sec: float
+    efficiency: float  # execs_per_sec / (fuzzers_used * execs_per_sec of one fuzzer)
+    marginal: float  # the same for the fuzzers added since the previous point
+    overhead: Dict[str, float]  # time_* shares of fuzzer_stats, averaged over the fuzzers
+
+
+@dataclass
+class Sweep:
+    cpu_cores: int
+    numa_nodes: int
+    knee: int  # the most fuzzers that still scaled with at least --knee efficiency
+    points: List[SweepPoint]
+
+
 @dataclass
 class Results:
     config: Optional[Config]
     hardware: Optional[Hardware]
     targets: Dict[str, Dict[str, Optional[Run]]]
+    sweeps: Dict[str, Sweep]
 
 
-all_modes = [Mode.singlecore, Mode.multicore]
+all_modes = [Mode.singlecore, Mode.multicore, Mode.sweep]
+default_modes = [Mode.singlecore.name, Mode.multicore.name]
 all_targets = [
     Target(source=Path("../utils/persistent_mode/test-instr.c").resolve(), binary=Path("test-instr-persist-shmem")),
     Target(source=Path("../test-instr.c").resolve(), binary=Path("test-instr"))
@@ -75,10 +98,14 @@ parser.add_argument("-b", "--basedir", help="directory to use for temp files", t
 parser.add_argument("-d", "--debug", help="show verbose debugging output", action="store_true")
 parser.add_argument("-r", "--runs", help="how many runs to average results over", type=int, default=3)
 parser.add_argument("-f", "--fuzzers", help="how many afl-fuzz workers to use", type=int, default=cpu_count)
-parser.add_argument("-m", "--mode", help="pick modes", action="append", default=modes, choices=modes)
+parser.add_argument("-m", "--mode", help="pick modes", action="append", default=default_modes, choices=modes)
 parser.add_argument("-c", "--comment", help="add a comment about your setup", type=str, default="")
 parser.add_argument("--cpu", help="override the detected CPU model name", type=str, default="")
 parser.add_argument("--mhz", help="override the detected CPU MHz", type=str, default="")
+parser.add_argument("--sweep-step", help="sweep every n fuzzers instead of powers of two and the topology limits",
+                    type=int, default=0)
+parser.add_argument("--knee", help="efficiency below which the sweep stops counting as linear scaling", type=float,
+                    default=0.9)
 parser.add_argument(
     "-t", "--target", help="pick targets", action="append", default=["test-instr-persist-shmem"], choices=targets
 )
@@ -87,13 +114,13 @@ args = parser.parse_args()
 # it should override the default.  Seems like we have to remove the default to get that and have correct help text?
 if len(args.target) > 1:
     args.target = args.target[1:]
-if len(args.mode) > 2:
-    args.mode = args.mode[2:]
+if len(args.mode) > len(default_modes):
+    args.mode = args.mode[len(default_modes):]
 
 chosen_modes = [mode for mode in all_modes if mode.name in args.mode]
 chosen_targets = [target for target in all_targets if str(target.binary) in args.target]
 results = Results(config=None, hardware=None, targets={
-    str(t.binary): {m.name: None for m in chosen_modes} for t in chosen_targets}
+    str(t.binary): {m.name: None for m in chosen_modes} for t in chosen_targets}, sweeps={}
                   )
 debug = lambda text: args.debug and print(blue(text))
 
@@ -199,6 +226,60 @@ async def describe_afl_config() -> str:
         return "none"
 
 
+async def stats_shares(filename: str, prefix: str) -> Dict[str, float]:
+    """Return the percentages in a file whose key starts with prefix, e.g. the time_* shares of fuzzer_stats."""
+    with open(filename, "r") as fh:
+        kv_pairs = (line.split(": ", 1) for line in fh if ": " in line)
+        return {k.rstrip(): float(v.strip()[:-1]) for k, v in kv_pairs
+                if k.startswith(prefix) and v.strip().endswith("%")}
+
+
+def read_cpu_list(filename: str) -> List[int]:
+    """Parse a sysfs cpu list such as '0-3,8-11'."""
+    cpus: List[int] = []
+    with open(filename, "r") as fh:
+        for part in fh.read().strip().split(","):
+            if part:
+                first, _, last = part.partition("-")
+                cpus.extend(range(int(first), int(last or first) + 1))
+    return cpus
+
+
+def cpu_topology() -> Tuple[List[int], Dict[int, Tuple[int, int]], int]:
+    """Order the online CPUs for the sweep: one thread of every physical core, NUMA node by node, then their SMT
+    siblings. Also return the (node, core) of every CPU and the number of physical cores."""
+    sysfs = Path("/sys/devices/system/cpu")
+    cpus = read_cpu_list(str(sysfs / "online"))
+    where: Dict[int, Tuple[int, int]] = {}
+    for cpu in cpus:
+        topo = sysfs / f"cpu{cpu}" / "topology"
+        try:
+            core = int((topo / "physical_package_id").read_text()) << 16 | int((topo / "core_id").read_text())
+        except (OSError, ValueError):
+            core = cpu
+        node = next((int(n.name[4:]) for n in (sysfs / f"cpu{cpu}").glob("node[0-9]*")), 0)
+        where[cpu] = (node, core)
+    rank: Dict[int, int] = {}
+    seen: Dict[Tuple[int, int], int] = {}
+    for cpu in sorted(cpus):
+        rank[cpu] = seen.get(where[cpu], 0)
+        seen[where[cpu]] = rank[cpu] + 1
+    order = sorted(cpus, key=lambda c: (rank[c], where[c][0], c))
+    return order, where, len(seen)
+
+
+def sweep_counts(order: List[int], where: Dict[int, Tuple[int, int]], cores: int, limit: int) -> List[int]:
+    """Powers of two, plus where the sweep runs out of physical cores of the first node and of all nodes."""
+    if args.sweep_step > 0:
+        counts = set(range(args.sweep_step, limit + 1, args.sweep_step)) | {1}
+    else:
+        counts = {1 << i for i in range(limit.bit_length()) if 1 << i <= limit}
+        counts.add(sum(1 for c in order[:cores] if where[c][0] == where[order[0]][0]))
+        counts.add(cores)
+    counts.add(limit)
+    return sorted(c for c in counts if 1 <= c <= limit)
+
+
 async def save_benchmark_results() -> None:
     """Append a single row to the benchmark results in JSON Lines format (which is simple to write and diff)."""
     with open("benchmark-results.jsonl", "a") as jsonfile:
@@ -230,6 +311,80 @@ async def save_benchmark_results() -> None:
         print(comparisonfile.read())
 
 
+async def run_fuzzers(binary: str, outdir: str, count: int, cpus: Optional[List[int]] = None) -> Tuple[
+        Decimal, Decimal, Dict[str, float]]:
+    """Run count fuzzers at once, bound to cpus if given, and return the sum of their execs_per_sec and execs_done
+    and their average time_* shares."""
+    fuzzers = range(0, count)
+    cmds = []
+    for fuzzer_idx, afl in enumerate(fuzzers):
+        name = ["-o", outdir, "-M" if fuzzer_idx == 0 else "-S", str(afl)]
+        bind = ["-b", str(cpus[fuzzer_idx])] if cpus else []
+        cmds.append(
+            ["afl-fuzz", "-i", f"{args.basedir}/in"] + name + bind + ["-s", "123", "-V10", "-D", f"./{binary}"])
+    # Prepare the afl-fuzz tasks, and then block while waiting for them to finish.
+    fuzztasks = [run_command(cmds[cpu]) for cpu in fuzzers]
+    await asyncio.gather(*fuzztasks)
+    afl_versions = await colon_values(f"{outdir}/0/fuzzer_stats", "afl_version")
+    if results.config:
+        results.config.afl_version = afl_versions[0]
+    # Our score is the sum of all execs_per_sec entries in fuzzer_stats files for the run.
+    sectasks = [colon_values(f"{outdir}/{afl}/fuzzer_stats", "execs_per_sec") for afl in fuzzers]
+    all_execs_per_sec = await asyncio.gather(*sectasks)
+    execs = sum([Decimal(count[0]) for count in all_execs_per_sec])
+    # Also gather execs_total and total_run_time for this run.
+    exectasks = [colon_values(f"{outdir}/{afl}/fuzzer_stats", "execs_done") for afl in fuzzers]
+    all_execs_total = await asyncio.gather(*exectasks)
+    execs_done = sum([Decimal(count[0]) for count in all_execs_total])
+    # And where afl-fuzz spent its time, to tell the target slowing down from afl-fuzz doing so.
+    all_shares = await asyncio.gather(*[stats_shares(f"{outdir}/{afl}/fuzzer_stats", "time_") for afl in fuzzers])
+    overhead = {k: round(sum(s.get(k, 0.0) for s in all_shares) / count, 2) for k in all_shares[0]}
+    return (execs, execs_done, overhead)
+
+
+async def run_sweep(binary: str) -> None:
+    """Run 1 to --fuzzers fuzzers, each bound to its own CPU, physical cores first, and report how well they scale."""
+    order, where, cores = cpu_topology()
+    limit = min(args.fuzzers, len(order))
+    nodes = len({node for node, _ in where.values()})
+    print(blue(f" [*] Sweeping 1 to {limit} fuzzers over {cores} cores, {len(order)} threads, {nodes} NUMA nodes."))
+    outdir = f"{args.basedir}/out-{Mode.sweep.name}-{binary}"
+    points: List[SweepPoint] = []
+    for count in sweep_counts(order, where, cores, limit):
+        cpus = order[:count]
+        runs = []
+        overheads: List[Dict[str, float]] = []
+        for run_idx in range(0, args.runs):
+            print(gray(f" [*] sweep {binary} {count} fuzzers run {run_idx + 1} of {args.runs}, execs/s: "), end="",
+                  flush=True)
+            shutil.rmtree(outdir, ignore_errors=True)
+            (execs, _, overhead) = await run_fuzzers(binary, outdir, count, cpus)
+            print(green(execs))
+            runs.append(execs)
+            overheads.append(overhead)
+        execs_per_sec = float(round(Decimal(sum(runs) / len(runs)), 2))
+        base = points[0].execs_per_sec if points else execs_per_sec
+        prev = points[-1] if points else None
+        marginal = 1.0
+        if prev and base:
+            marginal = (execs_per_sec - prev.execs_per_sec) / ((count - prev.fuzzers_used) * base)
+        points.append(SweepPoint(
+            fuzzers_used=count, cpus=cpus, smt=len({where[c] for c in cpus}) < count,
+            numa_nodes=len({where[c][0] for c in cpus}), execs_per_sec=execs_per_sec,
+            efficiency=round(execs_per_sec / (count * base), 3) if base else 0.0, marginal=round(marginal, 3),
+            overhead={k: round(sum(o[k] for o in overheads) / len(overheads), 2) for k in overheads[0]}))
+    knee = max((p.fuzzers_used for p in points if p.efficiency >= args.knee), default=1)
+    results.sweeps[binary] = Sweep(cpu_cores=cores, numa_nodes=nodes, knee=knee, points=points)
+    results.targets[binary][Mode.sweep.name] = Run(execs_per_sec=points[-1].execs_per_sec, execs_total=0,
+                                                   fuzzers_used=points[-1].fuzzers_used)
+    print(" [*] fuzzers | cpus          | execs/s      | efficiency | marginal | time_target")
+    for p in points:
+        kind = ("smt" if p.smt else "cores") + (f", {p.numa_nodes} nodes" if p.numa_nodes > 1 else "")
+        print(f"     {p.fuzzers_used:7} | {kind:13} | {p.execs_per_sec:12.2f} | {p.efficiency:10.3f} | "
+              f"{p.marginal:8.3f} | {p.overhead.get('time_target', 0.0):10.2f}%")
+    print(f" [*] Scaling is at least {args.knee:.0%} efficient up to {green(knee)} fuzzers (--knee to change).")
+
+
 async def main() -> None:
     try:
         await clean_up_tempfiles()
@@ -258,33 +413,19 @@ async def main() -> None:
                 print(blue(f" [*] Using {args.fuzzers} fuzzers for multicore fuzzing "), end="")
                 print(blue(
                     "(use --fuzzers to override)." if args.fuzzers == cpu_count else f"(the default is {cpu_count})"))
+            if mode == Mode.sweep:
+                await run_sweep(binary)
+                continue
             execs_per_sec, execs_total = ([] for _ in range(2))
             for run_idx in range(0, args.runs):
                 print(gray(f" [*] {mode.name} {binary} run {run_idx + 1} of {args.runs}, execs/s: "), end="",
                       flush=True)
                 fuzzers = range(0, args.fuzzers if mode == Mode.multicore else 1)
                 outdir = f"{args.basedir}/out-{mode.name}-{binary}"
-                cmds = []
-                for fuzzer_idx, afl in enumerate(fuzzers):
-                    name = ["-o", outdir, "-M" if fuzzer_idx == 0 else "-S", str(afl)]
-                    cmds.append(
-                        ["afl-fuzz", "-i", f"{args.basedir}/in"] + name + ["-s", "123", "-V10", "-D", f"./{binary}"])
-                # Prepare the afl-fuzz tasks, and then block while waiting for them to finish.
-                fuzztasks = [run_command(cmds[cpu]) for cpu in fuzzers]
-                await asyncio.gather(*fuzztasks)
-                afl_versions = await colon_values(f"{outdir}/0/fuzzer_stats", "afl_version")
-                if results.config:
-                    results.config.afl_version = afl_versions[0]
-                # Our score is the sum of all execs_per_sec entries in fuzzer_stats files for the run.
-                sectasks = [colon_values(f"{outdir}/{afl}/fuzzer_stats", "execs_per_sec") for afl in fuzzers]
-                all_execs_per_sec = await asyncio.gather(*sectasks)
-                execs = sum([Decimal(count[0]) for count in all_execs_per_sec])
+                (execs, execs_done, _) = await run_fuzzers(binary, outdir, len(fuzzers))
                 print(green(execs))
                 execs_per_sec.append(execs)
-                # Also gather execs_total and total_run_time for this run.
-                exectasks = [colon_values(f"{outdir}/{afl}/fuzzer_stats", "execs_done") for afl in fuzzers]
-                all_execs_total = await asyncio.gather(*exectasks)
-                execs_total.append(sum([Decimal(count[0]) for count in all_execs_total]))
+                execs_total.append(execs_done)
 
             # (Using float() because Decimal() is not JSON-serializable.)
             avg_afl_execs_per_sec = round(Decimal(sum(execs_per_sec) / len(execs_per_sec)), 2)
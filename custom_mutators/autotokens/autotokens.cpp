@@ -15,7 +15,6 @@ extern "C" {
 
 #include <iostream>
 #include <fstream>
-#include <unordered_map>
 #include <vector>
 #include <regex>
 
@@ -72,22 +71,101 @@ static u32        extras_cnt, a_extras_cnt;
 static u64        all_spaces, all_tabs, all_lf, all_ws;
 static u64        all_structure_items;
 static u64        fuzz_count;
-static unordered_map<string, vector<u32> *> file_mapping;
-static unordered_map<u32, vector<u32> *>    id_mapping;
-static unordered_map<string, u32>           token_to_id;
-static unordered_map<u32, string>           id_to_token;
-static string                               output;
-static regex                               *regex_comment_custom;
+static string     output;
+static regex     *regex_comment_custom;
 // multiline requires g++-11 libs :(
 static regex regex_comment_star(
     "/\\*([:print:]|\n)*?\\*/",
     regex_constants::optimize /* | regex_constants::multiline */);
-static regex        regex_word("[A-Za-z0-9_$.-]+", regex::optimize);
-static regex        regex_whitespace(R"([ \t]+)", regex::optimize);
-static vector<u32> *s;  // the structure of the currently selected input
+static regex regex_word("[A-Za-z0-9_$.-]+", regex::optimize);
+static regex regex_whitespace(R"([ \t]+)", regex::optimize);
+
+/* Every token is stored once: token id i is the tok_len[i] bytes at
+   tok_off[i] in tok_arena. tok_hash is an open addressing table of the
+   token ids + 1 (0 = empty) by the hash of their bytes. */
+
+static string      tok_arena;
+static vector<u32> tok_off, tok_len, tok_hash;
+
+/* The structure of a queue entry is its token ids, a span of the flat
+   streams array. entries[] is indexed by queue entry id, off SPAN_UNKNOWN
+   means not analyzed yet, len 0 that the entry has no structure. */
+
+struct span {
+  u32 off, len;
+};
+
+#define SPAN_UNKNOWN 0xffffffff
+
+static vector<u32>  streams;
+static vector<span> entries;
+static vector<u32>  structures;  // entries with a structure, for splicing
+static span        *s;  // the structure of the currently selected input
+
+/* The structure being mutated. It keeps its memory from call to call, so a
+   fuzz call copies the tokens but does not allocate. */
+
+static vector<u32> m;
 
 // FUNCTIONS
 
+static void tok_rehash() {
+  u32 size = MAX(1024, (u32)tok_hash.size() * 2), mask = size - 1;
+
+  tok_hash.assign(size, 0);
+
+  for (u32 id = 0; id < current_id; ++id) {
+    u32 i = hash64((u8 *)tok_arena.data() + tok_off[id], tok_len[id],
+                   HASH_CONST) &
+            mask;
+    while (tok_hash[i]) {
+      i = (i + 1) & mask;
+    }
+
+    tok_hash[i] = id + 1;
+  }
+}
+
+/* The id of the token of len bytes at ptr, a new one if it was not seen
+   yet. */
+
+static u32 tok_intern(const char *ptr, u32 len) {
+  if ((current_id + 1) * 2 > tok_hash.size()) { tok_rehash(); }
+
+  u32 mask = tok_hash.size() - 1,
+      i = hash64((u8 *)ptr, len, HASH_CONST) & mask;
+
+  while (tok_hash[i]) {
+    u32 id = tok_hash[i] - 1;
+    if (tok_len[id] == len &&
+        !memcmp(tok_arena.data() + tok_off[id], ptr, len)) {
+      return id;
+    }
+
+    i = (i + 1) & mask;
+  }
+
+  tok_hash[i] = current_id + 1;
+  tok_off.push_back(tok_arena.size());
+  tok_len.push_back(len);
+  tok_arena.append(ptr, len);
+
+  return current_id++;
+}
+
+/* Add a structure of cnt token ids for the current queue entry. */
+
+static void structure_add(span *entry, const u32 *ids, u32 cnt) {
+  entry->off = streams.size();
+  entry->len = cnt;
+  streams.insert(streams.end(), ids, ids + cnt);
+
+  structures.push_back(afl_ptr->queue_cur->id);
+  ++valid_structures;
+  all_structure_items += cnt;
+  s = entry;
+}
+
 /* This function is called once after everything is set up but before
    any fuzzing attempt has been performed.
    This is called in afl_custom_queue_get() */
@@ -107,7 +185,7 @@ static void first_run(void *data) {
 
       while (extras_cnt < afl_ptr->extras_cnt) {
         u32 ok = 1, l = afl_ptr->extras[extras_cnt].len;
-        u8 *buf, *ptr = afl_ptr->extras[extras_cnt].data;
+        u8 *ptr = afl_ptr->extras[extras_cnt].data;
 
         for (u32 i = 0; i < l; ++i) {
           if (!isascii((int)ptr[i]) && !isprint((int)ptr[i])) {
@@ -117,13 +195,7 @@ static void first_run(void *data) {
         }
 
         if (ok) {
-          buf = (u8 *)malloc(afl_ptr->extras[extras_cnt].len + 1);
-          memcpy(buf, afl_ptr->extras[extras_cnt].data,
-                 afl_ptr->extras[extras_cnt].len);
-          buf[afl_ptr->extras[extras_cnt].len] = 0;
-          token_to_id[(char *)buf] = current_id;
-          id_to_token[current_id] = (char *)buf;
-          ++current_id;
+          tok_intern((char *)ptr, l);
           ++valid;
         }
 
@@ -177,7 +249,7 @@ static void first_run(void *data) {
 
 static u32 good_whitespace_or_singleval() {
   u32 i = rand_below(afl_ptr, current_id);
-  if (id_to_token[i].size() == 1) { return i; }
+  if (tok_len[i] == 1) { return i; }
   i = rand_below(afl_ptr, all_ws);
   if (i < all_spaces) {
     return 0;
@@ -216,8 +288,9 @@ extern "C" size_t afl_custom_fuzz(my_mutator_t *data, u8 *buf, size_t buf_size,
     return 0;
   }
 
-  vector<u32> m = *s;  // copy of the structure we will modify
-  u32         i, m_size = (u32)m.size();
+  u32 i, m_size = s->len;
+
+  m.assign(streams.begin() + s->off, streams.begin() + s->off + m_size);
 
   u32 rounds =
       MIN(change_max,
@@ -240,14 +313,19 @@ extern "C" size_t afl_custom_fuzz(my_mutator_t *data, u8 *buf, size_t buf_size,
       case 0 ... 9: {
         pos = rand_below(afl_ptr, m_size);
         u32 cur_item = m[pos];
+
+        /* draw from the same side of whitespace_ids right away, the ids of
+           whitespace are a dozen out of possibly millions */
         do {
-          new_item = rand_below(afl_ptr, current_id);
+          if (cur_item > whitespace_ids) {
+            new_item = whitespace_ids + 1 +
+                       rand_below(afl_ptr, current_id - whitespace_ids - 1);
 
-        } while (unlikely(
+          } else {
+            new_item = rand_below(afl_ptr, whitespace_ids + 1);
+          }
 
-            new_item == cur_item ||
-            ((whitespace_ids < new_item && whitespace_ids >= cur_item) ||
-             (whitespace_ids >= new_item && whitespace_ids < cur_item))));
+        } while (unlikely(new_item == cur_item));
 
         // DEBUGF(stderr, "MUT: %u -> %u\n", cur_item, new_item);
         m[pos] = new_item;
@@ -256,11 +334,7 @@ extern "C" size_t afl_custom_fuzz(my_mutator_t *data, u8 *buf, size_t buf_size,
 
       /* INSERT (m_size +1 so we insert also after last place) */
       case 10 ... 13: {
-        do {
-          new_item = rand_below(afl_ptr, current_id);
-
-        } while (unlikely(new_item >= whitespace_ids));
-
+        new_item = rand_below(afl_ptr, whitespace_ids);
         u32 pos = rand_below(afl_ptr, m_size + 1);
         m.insert(m.begin() + pos, new_item);
         ++m_size;
@@ -272,12 +346,15 @@ extern "C" size_t afl_custom_fuzz(my_mutator_t *data, u8 *buf, size_t buf_size,
 #if AUTOTOKENS_SPLICE_DISABLE != 1
       /* SPLICING */
       case 14 ... 22: {
-        u32  strategy = rand_below(afl_ptr, 4), dst_off, n;
-        auto src = id_mapping[rand_below(afl_ptr, valid_structures)];
-        u32  src_size = src->size();
-        u32  src_off = rand_below(afl_ptr, src_size - AUTOTOKENS_SPLICE_MIN);
-        u32  rand_r = 1 + MAX(AUTOTOKENS_SPLICE_MIN,
-                              MIN(AUTOTOKENS_SPLICE_MAX, src_size - src_off));
+        u32   strategy = rand_below(afl_ptr, 4), dst_off, n;
+        span *src_span =
+            &entries[structures[rand_below(afl_ptr, valid_structures)]];
+        const u32 *src = streams.data() + src_span->off;
+        u32        src_size = src_span->len;
+
+        u32 src_off = rand_below(afl_ptr, src_size - AUTOTOKENS_SPLICE_MIN);
+        u32 rand_r = 1 + MAX(AUTOTOKENS_SPLICE_MIN,
+                             MIN(AUTOTOKENS_SPLICE_MAX, src_size - src_off));
 
         switch (strategy) {
           // insert
@@ -286,8 +363,7 @@ extern "C" size_t afl_custom_fuzz(my_mutator_t *data, u8 *buf, size_t buf_size,
             n = AUTOTOKENS_SPLICE_MIN +
                 rand_below(afl_ptr, MIN(AUTOTOKENS_SPLICE_MAX,
                                         rand_r - AUTOTOKENS_SPLICE_MIN));
-            m.insert(m.begin() + dst_off, src->begin() + src_off,
-                     src->begin() + src_off + n);
+            m.insert(m.begin() + dst_off, src + src_off, src + src_off + n);
             m_size += n;
             // DEBUGF(stderr, "SPLICE-INS: %u at %u\n", n, dst_off);
 
@@ -304,8 +380,7 @@ extern "C" size_t afl_custom_fuzz(my_mutator_t *data, u8 *buf, size_t buf_size,
                         MIN(m_size - dst_off - AUTOTOKENS_SPLICE_MIN,
                             src_size - src_off - AUTOTOKENS_SPLICE_MIN)));
 
-            copy(src->begin() + src_off, src->begin() + src_off + n,
-                 m.begin() + dst_off);
+            memcpy(m.data() + dst_off, src + src_off, n * sizeof(u32));
 
             // DEBUGF(stderr, "SPLICE-MUT: %u at %u\n", n, dst_off);
             break;
@@ -342,13 +417,15 @@ extern "C" size_t afl_custom_fuzz(my_mutator_t *data, u8 *buf, size_t buf_size,
 
   /* Now we create the output */
 
-  output = "";
+  output.clear();
   u32 prev_size = 1, was_whitespace = 1;
 
   for (i = 0; i < m_size; ++i) {
+    u32 id = m[i];
+
     if (likely(i + 1 < m_size)) {
-      u32 this_size = id_to_token[m[i]].size();
-      u32 is_whitespace = m[i] < whitespace_ids;
+      u32 this_size = tok_len[id];
+      u32 is_whitespace = id < whitespace_ids;
 
       /* The output we are generating might need repairing.
          General rule: two items that have a size larger than 2 are strings
@@ -356,14 +433,15 @@ extern "C" size_t afl_custom_fuzz(my_mutator_t *data, u8 *buf, size_t buf_size,
          between. */
       if (unlikely(!(prev_size == 1 || was_whitespace || this_size == 1 ||
                      is_whitespace))) {
-        output += id_to_token[good_whitespace_or_singleval()];
+        u32 ws = good_whitespace_or_singleval();
+        output.append(tok_arena, tok_off[ws], tok_len[ws]);
       }
 
       prev_size = this_size;
       was_whitespace = is_whitespace;
     }
 
-    output += id_to_token[m[i]];
+    output.append(tok_arena, tok_off[id], tok_len[id]);
   }
 
   u32 mutated_size = (u32)output.size();
@@ -488,7 +566,7 @@ extern "C" unsigned char afl_custom_queue_get(void                *data,
 
     while (extras_cnt < afl_ptr->extras_cnt) {
       u32 ok = 1, l = afl_ptr->extras[extras_cnt].len;
-      u8 *buf, *ptr = afl_ptr->extras[extras_cnt].data;
+      u8 *ptr = afl_ptr->extras[extras_cnt].data;
 
       for (u32 i = 0; i < l; ++i) {
         if (!isascii((int)ptr[i]) && !isprint((int)ptr[i])) {
@@ -497,15 +575,7 @@ extern "C" unsigned char afl_custom_queue_get(void                *data,
         }
       }
 
-      if (ok) {
-        buf = (u8 *)malloc(afl_ptr->extras[extras_cnt].len + 1);
-        memcpy(buf, afl_ptr->extras[extras_cnt].data,
-               afl_ptr->extras[extras_cnt].len);
-        buf[afl_ptr->extras[extras_cnt].len] = 0;
-        token_to_id[(char *)buf] = current_id;
-        id_to_token[current_id] = (char *)buf;
-        ++current_id;
-      }
+      if (ok) { tok_intern((char *)ptr, l); }
 
       ++extras_cnt;
     }
@@ -521,19 +591,19 @@ extern "C" unsigned char afl_custom_queue_get(void                *data,
         }
       }
 
-      if (ok) {
-        token_to_id[(char *)ptr] = current_id;
-        id_to_token[current_id] = (char *)ptr;
-        ++current_id;
-      }
+      if (ok) { tok_intern((char *)ptr, l); }
 
       ++a_extras_cnt;
     }
   }
 
-  vector<u32> *structure = NULL;
-  string       fn = (char *)filename;
-  auto         entry = file_mapping.find(fn);
+  u32 qid = afl_ptr->queue_cur->id;
+
+  if (entries.size() <= qid) {
+    entries.resize(MAX(qid + 1, afl_ptr->queued_items), span{SPAN_UNKNOWN, 0});
+  }
+
+  span *entry = &entries[qid];
 
   // if there is only one active queue item at start and it is very small
   // the we create once a structure randomly.
@@ -541,25 +611,20 @@ extern "C" unsigned char afl_custom_queue_get(void                *data,
     if (current_id > whitespace_ids + 6 && afl_ptr->active_items == 1 &&
         afl_ptr->queue_cur->len < AFL_TXT_MIN_LEN) {
       DEBUGF(stderr, "Creating an entry from thin air...\n");
-      structure = new vector<u32>();
-      u32 item, prev, cnt = current_id >> 1;
-      structure->reserve(cnt + 4);
+      vector<u32> structure;
+      u32         item, prev, cnt = current_id >> 1;
+      structure.reserve(cnt + 4);
       for (u32 i = 0; i < cnt; i++) {
         item = rand_below(afl_ptr, current_id);
-        if (i && id_to_token[item].length() > 1 &&
-            id_to_token[prev].length() > 1) {
-          structure->push_back(good_whitespace_or_singleval());
+        if (i && tok_len[item] > 1 && tok_len[prev] > 1) {
+          structure.push_back(good_whitespace_or_singleval());
         }
 
-        structure->push_back(item);
+        structure.push_back(item);
         prev = item;
       }
 
-      s = structure;
-      file_mapping[fn] = structure;
-      id_mapping[valid_structures] = structure;
-      ++valid_structures;
-      all_structure_items += structure->size();
+      structure_add(entry, structure.data(), structure.size());
 
       return 1;
     }
@@ -567,18 +632,18 @@ extern "C" unsigned char afl_custom_queue_get(void                *data,
     create_from_thin_air = 0;
   }
 
-  if (entry == file_mapping.end()) {
+  if (entry->off == SPAN_UNKNOWN) {
     // this input file was not analyzed for tokens yet, so let's do it!
     size_t len = afl_ptr->queue_cur->len;
 
     if (len < AFL_TXT_MIN_LEN) {
-      file_mapping[fn] = structure;  // NULL ptr so we don't read the file again
+      *entry = span{0, 0};  // so we don't read the file again
       s = NULL;
       DEBUGF(stderr, "Too short (%lu) %s\n", len, filename);
       return 1;
 
     } else if (len > AFL_TXT_MAX_LEN) {
-      file_mapping[fn] = structure;  // NULL ptr so we don't read the file again
+      *entry = span{0, 0};  // so we don't read the file again
       s = NULL;
       DEBUGF(stderr, "Too long (%lu) %s\n", len, filename);
       return 1;
@@ -598,7 +663,7 @@ extern "C" unsigned char afl_custom_queue_get(void                *data,
 
       // we want at least 95% of text characters ...
       if (((len * AFL_TXT_MIN_PERCENT) / 100) > valid_chars) {
-        file_mapping[fn] = NULL;
+        *entry = span{0, 0};
         s = NULL;
         DEBUGF(stderr, "Not text (%lu) %s\n", len, filename);
         return 1;
@@ -729,7 +794,7 @@ extern "C" unsigned char afl_custom_queue_get(void                *data,
     }
 
     if (tokens.size() < AUTOTOKENS_SIZE_MIN) {
-      file_mapping[fn] = NULL;
+      *entry = span{0, 0};
       s = NULL;
       DEBUGF(stderr, "too few tokens\n");
       return 1;
@@ -737,41 +802,28 @@ extern "C" unsigned char afl_custom_queue_get(void                *data,
 
     /* Now we transform the tokens into an ID list and saved that */
 
-    structure = new vector<u32>();
-    u32 id;
+    vector<u32> structure;
+    structure.reserve(tokens.size());
 
     for (u32 i = 0; i < tokens.size(); ++i) {
-      if ((id = token_to_id[tokens[i]]) == 0) {
-        // First time we see this token, add it to the list
-        token_to_id[tokens[i]] = current_id;
-        id_to_token[current_id] = tokens[i];
-        structure->push_back(current_id);
-        ++current_id;
-
-      } else {
-        structure->push_back(id);
-      }
+      structure.push_back(tok_intern(tokens[i].data(), tokens[i].size()));
     }
 
-    // save the token structure to the file mapping
-    file_mapping[fn] = structure;
-    id_mapping[valid_structures] = structure;
-    ++valid_structures;
-    s = structure;
-    all_structure_items += structure->size();
+    // save the token structure of the queue entry
+    structure_add(entry, structure.data(), structure.size());
 
     // we are done!
     DEBUGF(stderr, "DONE! We have %lu tokens in the structure\n",
-           structure->size());
+           structure.size());
 
   } else {
-    if (entry->second == NULL) {
+    if (!entry->len) {
       DEBUGF(stderr, "Skipping %s\n", filename);
       s = NULL;
       return 1;
     }
 
-    s = entry->second;
+    s = entry;
     DEBUGF(stderr, "OK %s\n", filename);
   }
 
@@ -830,49 +882,17 @@ extern "C" my_mutator_t *afl_custom_init(afl_state *afl, unsigned int seed) {
   // set common whitespace tokens
   // we deliberately do not put uncommon ones here to these will count as
   // identifier tokens.
-  token_to_id[" "] = current_id;
-  id_to_token[current_id] = " ";
-  ++current_id;
-  token_to_id["\t"] = current_id;
-  id_to_token[current_id] = "\t";
-  ++current_id;
-  token_to_id["\n"] = current_id;
-  id_to_token[current_id] = "\n";
-  ++current_id;
-  token_to_id["\r\n"] = current_id;
-  id_to_token[current_id] = "\r\n";
-  ++current_id;
-  token_to_id[" \n"] = current_id;
-  id_to_token[current_id] = " \n";
-  ++current_id;
-  token_to_id["  "] = current_id;
-  id_to_token[current_id] = "  ";
-  ++current_id;
-  token_to_id["\t\t"] = current_id;
-  id_to_token[current_id] = "\t\t";
-  ++current_id;
-  token_to_id["\n\n"] = current_id;
-  id_to_token[current_id] = "\n\n";
-  ++current_id;
-  token_to_id["\r\n\r\n"] = current_id;
-  id_to_token[current_id] = "\r\n\r\n";
-  ++current_id;
-  token_to_id["    "] = current_id;
-  id_to_token[current_id] = "    ";
-  ++current_id;
-  token_to_id["\t\t\t\t"] = current_id;
-  id_to_token[current_id] = "\t\t\t\t";
-  ++current_id;
-  token_to_id["\n\n\n\n"] = current_id;
-  id_to_token[current_id] = "\n\n\n\n";
-  ++current_id;
+  static const char *whitespace[] = {
+      " ",  "\t", "\n",       "\r\n", " \n",     "  ",
+      "\t\t", "\n\n", "\r\n\r\n", "    ", "\t\t\t\t", "\n\n\n\n"};
+
+  for (auto ws : whitespace) {
+    tok_intern(ws, strlen(ws));
+  }
+
   whitespace_ids = current_id;
-  token_to_id["\""] = current_id;
-  id_to_token[current_id] = "\"";
-  ++current_id;
-  token_to_id["'"] = current_id;
-  id_to_token[current_id] = "'";
-  ++current_id;
+  tok_intern("\"", 1);
+  tok_intern("'", 1);
 
   return data;
 }
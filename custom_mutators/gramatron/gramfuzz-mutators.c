@@ -5,209 +5,83 @@
 #include "afl-fuzz.h"
 #include "gramfuzz.h"
 
-Array *performRandomMutation(state *pda, Array *input) {
-  terminal *term_ptr;
-  // terminal *prev_ptr;
-  Array *mutated;
-  Array *sliced;
-
+void performRandomMutation(automaton *pda, Array *input, Array *out) {
   // Get offset at which to generate new input and slice it
-  int idx = rand_below(global_afl, input->used);
-  sliced = slice(input, idx);
-  // print_repr(sliced, "Slice");
+  size_t idx = rand_below(global_afl, input->used);
+  slice(out, input, idx);
 
-  // prev_ptr = & input->start[idx - 1];
-  // printf("\nState:%s Symbol:%s", prev_ptr->state, prev_ptr->symbol);
   // Reset current state to that of the slice's last member
-  term_ptr = &input->start[idx];
-  curr_state = term_ptr->state;
-  // printf("\nState:%s Symbol:%s", curr_state, term_ptr->symbol);
+  curr_state = pda->src[input->start[idx]];
 
   // Set the next available cell to the one adjacent to this chosen point
-  mutated = gen_input(pda, sliced);
-  return mutated;
+  gen_input(pda, out);
 }
 
 // Tries to perform splice operation between two automaton walks
-UT_icd intpair_icd = {sizeof(intpair_t), NULL, NULL, NULL};
-
-Array *performSpliceOne(Array *originput, IdxMap_new *statemap_orig,
-                        Array *splicecand) {
-  UT_array  *stateptr, *pairs;
-  intpair_t  ip;
-  intpair_t *cand;
-
-  terminal *term_ptr;
-  Array    *prefix;
-  int       state;
-
-  // Initialize the dynamic holding the splice indice pairs
-  utarray_new(pairs, &intpair_icd);
-  // print_repr(originput, "Orig");
-  // print_repr(splicecand, "SpliceCand");
-
-  // Iterate through the splice candidate identifying potential splice points
-  // and pushing pair (orig_idx, splice_idx) to a dynamic array
-  for (int x = 0; x < splicecand->used; x++) {
-    term_ptr = &splicecand->start[x];
-    stateptr = statemap_orig[term_ptr->state].nums;
-    int length = utarray_len(stateptr);
-    if (length) {
-      int *splice_idx =
-          (int *)utarray_eltptr(stateptr, rand_below(global_afl, length));
-      ip.orig_idx = *splice_idx;
-      ip.splice_idx = x;
-      utarray_push_back(pairs, &ip);
-    }
+void performSpliceOne(Array *originput, StateMap *statemap_orig,
+                      Array *splicecand, Array *out) {
+  u32 x, s, cnt = 0, pick;
+
+  // Count the splice points, positions of the splice candidate in a state
+  // that the original walk also passes
+  for (x = 0; x < splicecand->used; x++) {
+    s = pda->src[splicecand->start[x]];
+    cnt += statemap_orig->off[s + 1] > statemap_orig->off[s];
   }
 
-  // Pick a random pair
-  int length = utarray_len(pairs);
-  cand = (intpair_t *)utarray_eltptr(pairs, rand_below(global_afl, length));
-  // printf("\n Orig_idx:%d Splice_idx:%d", cand->orig_idx, cand->splice_idx);
-
-  // Perform the splicing
-  prefix = slice(originput, cand->orig_idx);
-  Array *spliced = spliceGF(prefix, splicecand, cand->splice_idx);
-  // print_repr(spliced, "Spliced");
-  //
-  utarray_free(pairs);
-
-  return spliced;
-}
-
-UT_array **get_dupes(Array *input, int *recur_len) {
-  // Variables related to finding duplicates
-  int         offset = 0;
-  int         state;
-  terminal   *term_ptr;
-  IdxMap_new *idxMapPtr;
-  UT_array  **recurIdx;
-
-  // Declare the Recursive Map Table
-  IdxMap_new *idxmapStart =
-      (IdxMap_new *)malloc(sizeof(IdxMap_new) * numstates);
-  //
-  // UT_array *(recurIdx[numstates]);
-  recurIdx = malloc(sizeof(UT_array *) * numstates);
-
-  for (int x = 0; x < numstates; x++) {
-    idxMapPtr = &idxmapStart[x];
-    utarray_new(idxMapPtr->nums, &ut_int_icd);
-  }
-
-  // Obtain frequency distribution of states
-  while (offset < input->used) {
-    term_ptr = &input->start[offset];
-    state = term_ptr->state;
-    // int num = atoi(state + 1);
-    idxMapPtr = &idxmapStart[state];
-    utarray_push_back(idxMapPtr->nums, &offset);
-    offset += 1;
+  if (!cnt) {
+    out->used = 0;
+    gen_input(pda, out);
+    return;
   }
 
-  // Retrieve the duplicated states
-  offset = 0;
-  while (offset < numstates) {
-    idxMapPtr = &idxmapStart[offset];
-    int length = utarray_len(idxMapPtr->nums);
-    if (length >= 2) {
-      recurIdx[*recur_len] = idxMapPtr->nums;
-      *recur_len += 1;
+  // Pick a random one, and a random position of its state in the original
+  pick = rand_below(global_afl, cnt);
+  for (x = 0;; x++) {
+    s = pda->src[splicecand->start[x]];
+    if (statemap_orig->off[s + 1] > statemap_orig->off[s] && !pick--) {
+      break;
     }
-
-    // else {
-
-    //     utarray_free(idxMapPtr->nums);
-    // }
-    offset += 1;
   }
 
-  if (*recur_len) {
-    // Declare the return struct
-    // We use this struct so that we save the reference to IdxMap_new and free
-    // it after we have used it in doMult
-    // Get_Dupes_Ret* getdupesret =
-    // (Get_Dupes_Ret*)malloc(sizeof(Get_Dupes_Ret));
-    return recurIdx;
-    // getdupesret->idxmap = idxmapStart;
-    // getdupesret->recurIdx = recurIdx;
-    // return getdupesret;
+  u32 orig_idx =
+      statemap_orig->idx[statemap_orig->off[s] +
+                         rand_below(global_afl, statemap_orig->off[s + 1] -
+                                                    statemap_orig->off[s])];
 
-  } else {
-    return NULL;
-  }
+  // Perform the splicing
+  slice(out, originput, orig_idx);
+  spliceGF(out, splicecand, x);
 }
 
-Array *doMult(Array *input, UT_array **recur, int recurlen) {
-  int       offset = 0;
-  int       idx = rand_below(global_afl, recurlen);
-  UT_array *recurMap = recur[idx];
-  UT_array *recurPtr;
-  Array    *prefix;
-  Array    *postfix;
-  Array    *feature;
+void doMult(Array *input, StateMap *statemap, Array *out) {
+  u32 state = statemap->recur[rand_below(global_afl, statemap->recur_len)];
+  u32 firstIdx, secondIdx;
 
   // Choose two indices to get the recursive feature
-  int recurIndices = utarray_len(recurMap);
-  int firstIdx = 0;
-  int secondIdx = 0;
-  getTwoIndices(recurMap, recurIndices, &firstIdx, &secondIdx);
+  getTwoIndices(statemap, state, &firstIdx, &secondIdx);
 
   // Perform the recursive mut
-  // print_repr(input, "Orig");
-  prefix = slice(input, firstIdx);
-  // print_repr(prefix, "Prefix");
+  slice(out, input, firstIdx);
   if (firstIdx < secondIdx) {
-    feature = carve(input, firstIdx, secondIdx);
+    concatPrefixFeature(out, input, firstIdx, secondIdx);
 
   } else {
-    feature = carve(input, secondIdx, firstIdx);
+    concatPrefixFeature(out, input, secondIdx, firstIdx);
   }
 
-  // print_repr(feature, "Feature");
-  concatPrefixFeature(prefix, feature);
-
-  // GC allocated structures
-  free(feature->start);
-  free(feature);
-  // for(int x = 0; x < recurlen; x++) {
-
-  //     utarray_free(recur[x]);
-  // }
-  // free(recur);
-  // print_repr(prefix, "Concat");
-  return spliceGF(prefix, input, secondIdx);
+  spliceGF(out, input, secondIdx);
 }
 
-void getTwoIndices(UT_array *recur, int recurlen, int *firstIdx,
-                   int *secondIdx) {
-  int ArrayRecurIndices[recurlen];
-  int offset = 0, *p;
-  // Unroll into an array
-  for (p = (int *)utarray_front(recur); p != NULL;
-       p = (int *)utarray_next(recur, p)) {
-    ArrayRecurIndices[offset] = *p;
-    offset += 1;
-  }
-
-  /*Source:
-   * https://www.geeksforgeeks.org/shuffle-a-given-array-using-fisher-yates-shuffle-algorithm/
-   */
-  for (int i = offset - 1; i > 0; i--) {
-    // Pick a random index from 0 to i
-    int j = rand_below(global_afl, i + 1);
+/* Two different random walk offsets of state */
+void getTwoIndices(StateMap *statemap, u32 state, u32 *firstIdx,
+                   u32 *secondIdx) {
+  u32 *idx = statemap->idx + statemap->off[state];
+  u32  len = statemap->off[state + 1] - statemap->off[state];
+  u32  a = rand_below(global_afl, len), b = rand_below(global_afl, len - 1);
 
-    // Swap arr[i] with the element at random index
-    swap(&ArrayRecurIndices[i], &ArrayRecurIndices[j]);
-  }
-
-  *firstIdx = ArrayRecurIndices[0];
-  *secondIdx = ArrayRecurIndices[1];
-}
+  if (b >= a) { b++; }
 
-void swap(int *a, int *b) {
-  int temp = *a;
-  *a = *b;
-  *b = temp;
+  *firstIdx = idx[a];
+  *secondIdx = idx[b];
 }
@@ -13,128 +13,103 @@
 /* Dynamic Array for adding to the input repr
  * */
 void initArray(Array *a, size_t initialSize) {
-  a->start = (terminal *)calloc(1, sizeof(terminal) * initialSize);
+  a->start = (u32 *)malloc(sizeof(u32) * initialSize);
   a->used = 0;
   a->size = initialSize;
   a->inputlen = 0;
 }
 
-void insertArray(Array *a, int state, char *symbol, size_t symbol_len,
-                 int trigger_idx) {
-  // a->used is the number of used entries, because a->array[a->used++] updates
-  // a->used only *after* the array has been accessed. Therefore a->used can go
-  // up to a->size
-  terminal *term_ptr;
-  if (a->used == a->size) {
-    a->size = a->size * sizeof(terminal);
-    a->start = (terminal *)realloc(a->start, a->size * sizeof(terminal));
+static void growArray(Array *a, size_t need) {
+  if (a->size >= need) { return; }
+  while (a->size < need) {
+    a->size *= 2;
   }
 
-  // Add the element
-  term_ptr = &a->start[a->used];
-  term_ptr->state = state;
-  term_ptr->symbol = symbol;
-  term_ptr->symbol_len = symbol_len;
-  term_ptr->trigger_idx = trigger_idx;
+  a->start = (u32 *)realloc(a->start, a->size * sizeof(u32));
+}
 
-  // Increment the pointer
-  a->used += 1;
-  a->inputlen += symbol_len;
+void insertArray(Array *a, u32 trans) {
+  growArray(a, a->used + 1);
+  a->start[a->used++] = trans;
+  a->inputlen += pda->term_len[trans];
 }
 
-void freeArray(Array *a) {
-  terminal *ptr;
-  for (int x = 0; x < a->used; x++) {
-    ptr = &a->start[x];
-    free(ptr);
+/* Appends the transitions from up to to of walk src */
+void appendArray(Array *a, Array *src, size_t from, size_t to) {
+  growArray(a, a->used + to - from);
+  memcpy(a->start + a->used, src->start + from, (to - from) * sizeof(u32));
+  a->used += to - from;
+  for (size_t x = from; x < to; x++) {
+    a->inputlen += pda->term_len[src->start[x]];
   }
+}
 
+void freeArray(Array *a) {
+  free(a->start);
   a->start = NULL;
-  a->used = a->size = 0;
+  a->used = a->size = a->inputlen = 0;
 }
 
-/* Dynamic array for adding indices of states/recursive features
- * Source:
- * https://stackoverflow.com/questions/3536153/c-dynamically-growing-array
- */
-void initArrayIdx(IdxMap *a, size_t initialSize) {
-  a->array = (int *)malloc(initialSize * sizeof(int));
-  a->used = 0;
-  a->size = initialSize;
+/* Statemap of a walk, built with a counting sort over the states */
+void initStateMap(StateMap *m) {
+  m->off = (u32 *)malloc((numstates + 1) * sizeof(u32));
+  m->recur = (u32 *)malloc(numstates * sizeof(u32));
+  m->idx = NULL;
+  m->idx_size = 0;
+  m->recur_len = 0;
 }
 
-void insertArrayIdx(IdxMap *a, int idx) {
-  // a->used is the number of used entries, because a->array[a->used++] updates
-  // a->used only *after* the array has been accessed. Therefore a->used can go
-  // up to a->size
-  if (a->used == a->size) {
-    a->size *= 2;
-    a->array = (int *)realloc(a->array, a->size * sizeof(int));
-  }
+void buildStateMap(StateMap *m, Array *walk) {
+  u32 s, x;
 
-  a->array[a->used++] = idx;
-}
+  if (m->idx_size < walk->used) {
+    m->idx_size = walk->used;
+    m->idx = (u32 *)realloc(m->idx, m->idx_size * sizeof(u32));
+  }
 
-void freeArrayIdx(IdxMap *a) {
-  free(a->array);
-  a->array = NULL;
-  a->used = a->size = 0;
-}
+  memset(m->off, 0, (numstates + 1) * sizeof(u32));
+  for (x = 0; x < walk->used; x++) {
+    m->off[pda->src[walk->start[x]] + 1]++;
+  }
 
-/* Dynamic array for adding potential splice points
- */
-void initArraySplice(SpliceCandArray *a, size_t initialSize) {
-  a->start = (SpliceCand *)malloc(initialSize * sizeof(SpliceCand));
-  a->used = 0;
-  a->size = initialSize;
-}
+  m->recur_len = 0;
+  for (s = 0; s < numstates; s++) {
+    if (m->off[s + 1] >= 2) { m->recur[m->recur_len++] = s; }
+    m->off[s + 1] += m->off[s];
+  }
 
-void insertArraySplice(SpliceCandArray *a, Candidate *candidate, int idx) {
-  // a->used is the number of used entries, because a->array[a->used++] updates
-  // a->used only *after* the array has been accessed. Therefore a->used can go
-  // up to a->size
-  SpliceCand *candptr;
-  if (a->used == a->size) {
-    a->size = a->size * sizeof(SpliceCand);
-    a->start = (SpliceCand *)realloc(a->start, a->size * sizeof(SpliceCand));
+  // fill in from the back, so each state's offsets end up in order
+  for (x = walk->used; x > 0; x--) {
+    s = pda->src[walk->start[x - 1]];
+    m->idx[--m->off[s + 1]] = x - 1;
   }
 
-  // Add the element
-  candptr = &a->start[a->used];
-  candptr->splice_cand = candidate;
-  candptr->idx = idx;
-  a->used += 1;
+  // off[s + 1] now is the start of state s, shift back
+  memmove(m->off, m->off + 1, numstates * sizeof(u32));
+  m->off[numstates] = walk->used;
 }
 
-void freeArraySplice(IdxMap *a) {
-  free(a->array);
-  a->array = NULL;
-  a->used = a->size = 0;
+void freeStateMap(StateMap *m) {
+  free(m->off);
+  free(m->idx);
+  free(m->recur);
 }
 
-int fact(int n) {
-  int i, f = 1;
-  for (i = 1; i <= n; i++) {
-    f *= i;
+/* Writes the input of the walk to buf, which takes inputlen + 1 bytes */
+void unparse_walk_into(Array *input, u8 *buf) {
+  for (size_t x = 0; x < input->used; x++) {
+    u32 t = input->start[x];
+    memcpy(buf, pda->terms + pda->term_off[t], pda->term_len[t]);
+    buf += pda->term_len[t];
   }
 
-  return f;
+  *buf = 0;
 }
 
 /* Uses the walk to create the input in-memory */
 u8 *unparse_walk(Array *input) {
-  terminal *term_ptr;
-  int       offset = 0;
-  u8       *unparsed = (u8 *)malloc(input->inputlen + 1);
-  term_ptr = &input->start[offset];
-  strcpy(unparsed, term_ptr->symbol);
-  offset += 1;
-  while (offset < input->used) {
-    term_ptr = &input->start[offset];
-    strcat(unparsed, term_ptr->symbol);
-    offset += 1;
-  }
-
+  u8 *unparsed = (u8 *)malloc(input->inputlen + 1);
+  unparse_walk_into(input, unparsed);
   return unparsed;
 }
 
@@ -153,59 +128,49 @@ void write_input(Array *input, u8 *fn) {
 
   // Write the length parameters
   fwrite(&input->used, sizeof(size_t), 1, fp);
-  fwrite(&input->size, sizeof(size_t), 1, fp);
   fwrite(&input->inputlen, sizeof(size_t), 1, fp);
 
-  // Write the dynamic array to file
-  fwrite(input->start, input->size * sizeof(terminal), 1, fp);
-  // printf("\nUsed:%zu Size:%zu Inputlen:%zu", input->used, input->size,
-  // input->inputlen);
+  // Write the transitions to file
+  fwrite(input->start, input->used * sizeof(u32), 1, fp);
   fclose(fp);
 }
 
-Array *parse_input(state *pda, FILE *fp) {
-  terminal *term;
-  state    *state_ptr;
-  trigger  *trigger;
-  int       trigger_idx;
-  Array    *input = (Array *)calloc(1, sizeof(Array));
+Array *parse_input(automaton *pda, FILE *fp) {
+  Array *input = (Array *)calloc(1, sizeof(Array));
+  size_t used, inputlen;
 
   // Read the length parameters
-  fread(&input->used, sizeof(size_t), 1, fp);
-  fread(&input->size, sizeof(size_t), 1, fp);
-  fread(&input->inputlen, sizeof(size_t), 1, fp);
-
-  terminal *start_ptr = (terminal *)calloc(input->size, sizeof(terminal));
-  if (!start_ptr) {
-    fprintf(stderr, "alloc failed!\n");
+  if (fread(&used, sizeof(size_t), 1, fp) != 1 ||
+      fread(&inputlen, sizeof(size_t), 1, fp) != 1) {
+    free(input);
     return NULL;
   }
 
-  // Read the dynamic array to memory
-  fread(start_ptr, input->size * sizeof(terminal), 1, fp);
-  // Update the pointers to the terminals since they would have
-  // changed
-  int idx = 0;
-  while (idx < input->used) {
-    terminal *term = &start_ptr[idx];
-    // Find the state
-    state_ptr = pda + term->state;
-    // Find the trigger and update the terminal address
-    trigger_idx = term->trigger_idx;
-    trigger = (state_ptr->ptr) + trigger_idx;
-    term->symbol = trigger->term;
-    idx += 1;
+  initArray(input, used ? used : 1);
+
+  // Read the transitions to memory
+  if (fread(input->start, sizeof(u32), used, fp) != used) {
+    freeArray(input);
+    free(input);
+    return NULL;
   }
 
-  input->start = start_ptr;
-  // printf("\nUsed:%zu Size:%zu Inputlen:%zu", input->used, input->size,
-  // input->inputlen);
+  input->used = used;
+  for (size_t x = 0; x < used; x++) {
+    if (input->start[x] >= pda->trans_cnt) {
+      freeArray(input);
+      free(input);
+      return NULL;
+    }
+
+    input->inputlen += pda->term_len[input->start[x]];
+  }
 
   return input;
 }
 
 // Read the input representation into memory
-Array *read_input(state *pda, u8 *fn) {
+Array *read_input(automaton *pda, u8 *fn) {
   FILE *fp;
   fp = fopen(fn, "rb");
   if (fp == NULL) {
@@ -215,5 +180,13 @@ Array *read_input(state *pda, u8 *fn) {
 
   Array *res = parse_input(pda, fp);
   fclose(fp);
+  if (!res) {
+    fprintf(stderr,
+            "\n File '%s' is not a walk of this automaton (or one written by "
+            "an older gramatron), exiting\n",
+            fn);
+    exit(1);
+  }
+
   return res;
 }
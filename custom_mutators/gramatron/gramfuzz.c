@@ -20,13 +20,11 @@ typedef struct my_mutator {
   Array *mutated_walk;
   Array *orig_walk;
 
-  IdxMap_new *statemap;  // Keeps track of the statemap
-  UT_array  **recurIdx;
-  // Get_Dupes_Ret* getdupesret; // Recursive feature map
-  int recurlen;
+  StateMap statemap;  // Keeps track of the statemap of orig_walk
+
+  Array **walks;  // the walks of the queue entries by id, read on first use
+  u32     walks_size;
 
-  int mut_alloced;
-  int orig_alloced;
   int mut_idx;  // Signals the current mutator being used, used to cycle through
                 // each mutator
 
@@ -34,11 +32,12 @@ typedef struct my_mutator {
 
 } my_mutator_t;
 
-state *create_pda(u8 *automaton_file) {
+automaton *create_pda(u8 *automaton_file) {
   struct json_object *parsed_json;
-  state              *pda;
+  automaton          *pda;
   json_object        *source_obj, *attr;
-  int                 arraylen, ii, ii2, trigger_len, error;
+  int                 ii, trigger_len;
+  u32                 trans_cnt = 0, terms_len = 0, t;
 
   printf("\n[GF] Automaton file passed:%s", automaton_file);
   // parsed_json =
@@ -60,50 +59,59 @@ state *create_pda(u8 *automaton_file) {
   numstates = atoi(json_object_get_string(source_obj)) + 1;
   printf("\tNumStates=%d\n", numstates);
 
-  // Allocate state space for each pda state
-  pda = (state *)calloc(atoi(json_object_get_string(source_obj)) + 1,
-                        sizeof(state));
+  pda = (automaton *)calloc(1, sizeof(automaton));
+  pda->trans_off = (u32 *)calloc(numstates + 1, sizeof(u32));
 
-  // Getting PDA representation
+  // Getting PDA representation, first the number of transitions of each
+  // state and the size of all terminals
   source_obj = json_object_object_get(parsed_json, "pda");
-  enum json_type type;
   json_object_object_foreach(source_obj, key, val) {
-    state   *state_ptr;
-    trigger *trigger_ptr;
-    int      offset;
-
-    // Get the correct offset into the pda to store state information
-    state_ptr = pda;
-    offset = atoi(key);
-    state_ptr += offset;
-    // Store state string
-    state_ptr->state_name = offset;
-
-    // Create trigger array of structs
     trigger_len = json_object_array_length(val);
-    state_ptr->trigger_len = trigger_len;
-    trigger_ptr = (trigger *)calloc(trigger_len, sizeof(trigger));
-    state_ptr->ptr = trigger_ptr;
+    pda->trans_off[atoi(key) + 1] = trigger_len;
+    trans_cnt += trigger_len;
 
     for (ii = 0; ii < trigger_len; ii++) {
-      json_object *obj = json_object_array_get_idx(val, ii);
-      // Get all the trigger trigger attributes
-      attr = json_object_array_get_idx(obj, 0);
-      (trigger_ptr)->id = strdup(json_object_get_string(attr));
+      attr = json_object_array_get_idx(json_object_array_get_idx(val, ii), 2);
+      terms_len += strlen(json_object_get_string(attr));
+    }
+  }
+
+  for (ii = 0; ii < numstates; ii++) {
+    pda->trans_off[ii + 1] += pda->trans_off[ii];
+  }
+
+  pda->trans_cnt = trans_cnt;
+  pda->src = (u32 *)malloc(trans_cnt * sizeof(u32));
+  pda->dest = (u32 *)malloc(trans_cnt * sizeof(u32));
+  pda->term_off = (u32 *)malloc(trans_cnt * sizeof(u32));
+  pda->term_len = (u32 *)malloc(trans_cnt * sizeof(u32));
+  pda->terms = (u8 *)malloc(terms_len + 1);
+  terms_len = 0;
 
+  // Then the transitions, into the slots of their state
+  json_object_object_foreach(source_obj, key2, val2) {
+    int offset = atoi(key2);
+
+    trigger_len = json_object_array_length(val2);
+    t = pda->trans_off[offset];
+
+    for (ii = 0; ii < trigger_len; ii++, t++) {
+      json_object *obj = json_object_array_get_idx(val2, ii);
+      const char  *term;
+
+      // Get all the trigger attributes, the id is not needed
       attr = json_object_array_get_idx(obj, 1);
-      trigger_ptr->dest = atoi(json_object_get_string(attr));
+      pda->src[t] = offset;
+      pda->dest[t] = atoi(json_object_get_string(attr));
 
       attr = json_object_array_get_idx(obj, 2);
-      if (!strcmp("\\n", json_object_get_string(attr))) {
-        trigger_ptr->term = strdup("\n");
+      term = json_object_get_string(attr);
+      if (!strcmp("\\n", term)) { term = "\n"; }
 
-      } else {
-        trigger_ptr->term = strdup(json_object_get_string(attr));
-      }
-
-      trigger_ptr->term_len = strlen(trigger_ptr->term);
-      trigger_ptr++;
+      pda->term_off[t] = terms_len;
+      pda->term_len[t] = strlen(term);
+      memcpy(pda->terms + terms_len, term, pda->term_len[t]);
+      terms_len += pda->term_len[t];
     }
   }
 
@@ -113,6 +121,25 @@ state *create_pda(u8 *automaton_file) {
   return pda;
 }
 
+/* The walk of queue entry q, read from its .aut file the first time */
+static Array *get_walk(my_mutator_t *data, struct queue_entry *q) {
+  if (q->id >= data->walks_size) {
+    u32 size = MAX(q->id + 1, data->walks_size * 2);
+    data->walks = (Array **)realloc(data->walks, size * sizeof(Array *));
+    memset(data->walks + data->walks_size, 0,
+           (size - data->walks_size) * sizeof(Array *));
+    data->walks_size = size;
+  }
+
+  if (!data->walks[q->id]) {
+    u8 *automaton_fn = alloc_printf("%s.aut", q->fname);
+    data->walks[q->id] = read_input(pda, automaton_fn);
+    ck_free(automaton_fn);
+  }
+
+  return data->walks[q->id];
+}
+
 my_mutator_t *afl_custom_init(afl_state_t *afl, unsigned int seed) {
   my_mutator_t *data = calloc(1, sizeof(my_mutator_t));
   if (!data) {
@@ -128,21 +155,7 @@ my_mutator_t *afl_custom_init(afl_state_t *afl, unsigned int seed) {
   data->afl = afl;
   global_afl = afl;  // dirty
   data->seed = seed;
-
-  data->mut_alloced = 0;
-  data->orig_alloced = 0;
   data->mut_idx = 0;
-  data->recurlen = 0;
-
-  // data->mutator_buf = NULL;
-  // data->unparsed_input = NULL;
-  // data->mutated_walk = NULL;
-  // data->orig_walk = NULL;
-  //
-  // data->statemap = NULL;  // Keeps track of the statemap
-  // data->recur_idx = NULL; // Will keep track of recursive feature indices
-  // u32 recur_len = 0;       // The number of recursive features
-  // data->mutator_buf = NULL;
 
   char *automaton_file = getenv("GRAMATRON_AUTOMATION");
   if (automaton_file) {
@@ -155,36 +168,28 @@ my_mutator_t *afl_custom_init(afl_state_t *afl, unsigned int seed) {
     exit(-1);
   }
 
+  data->mutated_walk = (Array *)calloc(1, sizeof(Array));
+  initArray(data->mutated_walk, INIT_SIZE);
+  initStateMap(&data->statemap);
+
   return data;
 }
 
 size_t afl_custom_fuzz(my_mutator_t *data, uint8_t *buf, size_t buf_size,
                        u8 **out_buf, uint8_t *add_buf, size_t add_buf_size,
                        size_t max_size) {
-  u8 *unparsed_input;
-
-  // Pick a mutator
-  // int choice = rand() % MUTATORS;
-  // data->mut_idx = 1;
-  // GC old mutant
-  if (data->mut_alloced) {
-    free(data->mutated_walk->start);
-    free(data->mutated_walk);
-    data->mut_alloced = 0;
-  };
+  Array *mutated = data->mutated_walk;
 
-  // printf("\nChoice:%d", choice);
+  // The mutant is built in the same walk every time
+  mutated->used = mutated->inputlen = 0;
 
   if (data->mut_idx == 0) {  // Perform random mutation
-    data->mutated_walk = performRandomMutation(pda, data->orig_walk);
-    data->mut_alloced = 1;
+    performRandomMutation(pda, data->orig_walk, mutated);
 
   } else if (data->mut_idx == 1 &&
 
-             data->recurlen) {  // Perform recursive mutation
-    data->mutated_walk =
-        doMult(data->orig_walk, data->recurIdx, data->recurlen);
-    data->mut_alloced = 1;
+             data->statemap.recur_len) {  // Perform recursive mutation
+    doMult(data->orig_walk, &data->statemap, mutated);
 
   } else if (data->mut_idx == 2) {  // Perform splice mutation
 
@@ -192,28 +197,13 @@ size_t afl_custom_fuzz(my_mutator_t *data, uint8_t *buf, size_t buf_size,
     u32                 tid = rand_below(global_afl, data->afl->queued_items);
     struct queue_entry *q = data->afl->queue_buf[tid];
 
-    // Read the input representation for the splice candidate
-    u8    *automaton_fn = alloc_printf("%s.aut", q->fname);
-    Array *spliceCandidate = read_input(pda, automaton_fn);
-
-    if (spliceCandidate) {
-      data->mutated_walk =
-          performSpliceOne(data->orig_walk, data->statemap, spliceCandidate);
-      data->mut_alloced = 1;
-      free(spliceCandidate->start);
-      free(spliceCandidate);
-
-    } else {
-      data->mutated_walk = gen_input(pda, NULL);
-      data->mut_alloced = 1;
-    }
-
-    ck_free(automaton_fn);
+    // The walk of the splice candidate
+    performSpliceOne(data->orig_walk, &data->statemap, get_walk(data, q),
+                     mutated);
 
   } else {  // Generate an input from scratch
 
-    data->mutated_walk = gen_input(pda, NULL);
-    data->mut_alloced = 1;
+    gen_input(pda, mutated);
   }
 
   // Cycle to the next mutator
@@ -224,11 +214,17 @@ size_t afl_custom_fuzz(my_mutator_t *data, uint8_t *buf, size_t buf_size,
     data->mut_idx += 1;
 
   // Unparse the mutated automaton walk
-  if (data->unparsed_input) { free(data->unparsed_input); }
-  data->unparsed_input = unparse_walk(data->mutated_walk);
+  data->unparsed_input =
+      afl_realloc((void **)&data->unparsed_input, mutated->inputlen + 1);
+  if (unlikely(!data->unparsed_input)) {
+    *out_buf = NULL;
+    return 0;
+  }
+
+  unparse_walk_into(mutated, data->unparsed_input);
   *out_buf = data->unparsed_input;
 
-  return data->mutated_walk->inputlen;
+  return mutated->inputlen;
 }
 
 /**
@@ -256,7 +252,9 @@ u8 afl_custom_queue_new_entry(my_mutator_t  *data,
     write_input(data->mutated_walk, automaton_fn);
 
   } else {
-    new_input = gen_input(pda, NULL);
+    new_input = (Array *)calloc(1, sizeof(Array));
+    initArray(new_input, INIT_SIZE);
+    gen_input(pda, new_input);
     write_input(new_input, automaton_fn);
 
     // Update the placeholder file
@@ -271,7 +269,7 @@ u8 afl_custom_queue_new_entry(my_mutator_t  *data,
     int written = write(fd, unparsed_input, new_input->inputlen + 1);
     close(fd);
 
-    free(new_input->start);
+    freeArray(new_input);
     free(new_input);
     free(unparsed_input);
   }
@@ -291,74 +289,13 @@ u8 afl_custom_queue_new_entry(my_mutator_t  *data,
  *     False(0) otherwise.
  */
 uint8_t afl_custom_queue_get(my_mutator_t *data, const uint8_t *filename) {
-  // get the filename
-  u8         *automaton_fn = alloc_printf("%s.aut", filename);
-  IdxMap_new *statemap_ptr;
-  terminal   *term_ptr;
-  int         state;
-
-  // TODO: I don't think we need to update pointers when reading back
-  // Probably build two different versions of read_input one for flushing
-  // inputs to disk and the other that
-  if (data->orig_alloced) {
-    free(data->orig_walk->start);
-    free(data->orig_walk);
-    data->orig_alloced = 0;
-  }
-
-  if (data->statemap) {
-    for (int x = 0; x < numstates; x++) {
-      utarray_free(data->statemap[x].nums);
-    }
-
-    free(data->statemap);
-  }
+  (void)filename;
 
-  if (data->recurIdx) {
-    data->recurlen = 0;
-    free(data->recurIdx);
-  }
-
-  data->orig_walk = read_input(pda, automaton_fn);
-  data->orig_alloced = 1;
+  data->orig_walk = get_walk(data, data->afl->queue_cur);
 
-  // Create statemap for the fuzz candidate
-  IdxMap_new *statemap_start =
-      (IdxMap_new *)malloc(sizeof(IdxMap_new) * numstates);
-  for (int x = 0; x < numstates; x++) {
-    statemap_ptr = &statemap_start[x];
-    utarray_new(statemap_ptr->nums, &ut_int_icd);
-  }
+  // Create statemap for the fuzz candidate, with its recursive features
+  buildStateMap(&data->statemap, data->orig_walk);
 
-  int offset = 0;
-  while (offset < data->orig_walk->used) {
-    term_ptr = &data->orig_walk->start[offset];
-    state = term_ptr->state;
-    statemap_ptr = &statemap_start[state];
-    utarray_push_back(statemap_ptr->nums, &offset);
-    offset += 1;
-  }
-
-  data->statemap = statemap_start;
-
-  // Create recursive feature map (if it exists)
-  data->recurIdx = malloc(sizeof(UT_array *) * numstates);
-  // Retrieve the duplicated states
-  offset = 0;
-  while (offset < numstates) {
-    statemap_ptr = &data->statemap[offset];
-    int length = utarray_len(statemap_ptr->nums);
-    if (length >= 2) {
-      data->recurIdx[data->recurlen] = statemap_ptr->nums;
-      data->recurlen += 1;
-    }
-
-    offset += 1;
-  }
-
-  // data->getdupesret = get_dupes(data->orig_walk, &data->recurlen);
-
-  ck_free(automaton_fn);
   return 1;
 }
 
@@ -369,6 +306,18 @@ uint8_t afl_custom_queue_get(my_mutator_t *data, const uint8_t *filename) {
  */
 
 void afl_custom_deinit(my_mutator_t *data) {
+  for (u32 i = 0; i < data->walks_size; i++) {
+    if (data->walks[i]) {
+      freeArray(data->walks[i]);
+      free(data->walks[i]);
+    }
+  }
+
+  free(data->walks);
+  freeArray(data->mutated_walk);
+  free(data->mutated_walk);
+  freeStateMap(&data->statemap);
+  afl_free(data->unparsed_input);
   free(data->mutator_buf);
   free(data);
 }
@@ -4,9 +4,6 @@
 
 #include <json-c/json.h>
 #include <unistd.h>
-#include "hashmap.h"
-#include "uthash.h"
-#include "utarray.h"
 
 #define INIT_INPUTS 100  // No. of initial inputs to be generated
 
@@ -15,7 +12,6 @@
 
 #define INIT_SIZE 100  // Initial size of the dynamic array holding the input
 
-#define SPLICE_CORPUS 10000
 #define RECUR_THRESHOLD 6
 #define SIZE_THRESHOLD 2048
 
@@ -25,33 +21,22 @@
 
 afl_state_t *global_afl;
 
-typedef struct trigger {
-  char  *id;
-  int    dest;
-  char  *term;
-  size_t term_len;
+/* The automaton compiled into flat arrays. The transitions out of state s
+   are trans_off[s] up to trans_off[s + 1], transition t goes from src[t] to
+   dest[t] and emits the term_len[t] bytes at terms + term_off[t]. All
+   transitions of a state are equally likely, so picking one is a single
+   rand_below() over its range. */
 
-} trigger;
+typedef struct automaton {
+  u32 *trans_off;
+  u32 *src;
+  u32 *dest;
+  u32 *term_off;
+  u32 *term_len;
+  u8  *terms;
+  u32  trans_cnt;
 
-typedef struct state {
-  int      state_name;   // Integer State name
-  int      trigger_len;  // Number of triggers associated with this state
-  trigger *ptr;          // Pointer to beginning of the list of triggers
-
-} state;
-
-typedef struct terminal {
-  int    state;
-  int    trigger_idx;
-  size_t symbol_len;
-  char  *symbol;
-
-} terminal;
-
-typedef struct buckethash {
-  int freq;
-
-} buckethash;
+} automaton;
 
 int init_state;
 int curr_state;
@@ -62,134 +47,63 @@ int numstates;
 / DYNAMIC ARRAY FOR WALKS
 *****************/
 
-typedef struct {
-  size_t    used;
-  size_t    size;
-  size_t    inputlen;
-  terminal *start;
-
-} Array;
-
-/*****************
-/ DYNAMIC ARRAY FOR STATEMAPS/RECURSION MAPS
-*****************/
+/* A walk is the list of transitions it took, inputlen the length of the
+   input it unparses to. */
 
 typedef struct {
-  int   *array;
   size_t used;
   size_t size;
+  size_t inputlen;
+  u32   *start;
 
-} IdxMap;
-
-typedef struct {
-  UT_array *nums;
-
-} IdxMap_new;
-
-typedef struct {
-  IdxMap_new *idxmap;
-  UT_array  **recurIdx;
-
-} Get_Dupes_Ret;
-
-/* Candidate Struct */
-typedef struct {
-  Array      *walk;
-  IdxMap_new *statemap;
-
-} Candidate;
-
-/* Splice Mutation helpers*/
-typedef struct {
-  Candidate *splice_cand;
-  int        idx;
-
-} SpliceCand;
-
-typedef struct {
-  SpliceCand *start;
-  size_t      used;
-  size_t      size;
+} Array;
 
-} SpliceCandArray;
+/*****************
+/ STATEMAPS/RECURSION MAPS
+*****************/
 
-// Initialize dynamic array for potential splice points
-SpliceCand potential[SPLICE_CORPUS];
+/* Where the states occur in a walk: the walk offsets of state s are
+   idx[off[s]] up to idx[off[s + 1]], in order. recur lists the recur_len
+   states that occur at least twice. */
 
 typedef struct {
-  int orig_idx;
-  int splice_idx;
-
-} intpair_t;
+  u32 *off;
+  u32 *idx;
+  u32 *recur;
+  u32  recur_len;
+  u32  idx_size;
 
-// Initialize dynamic array for potential splice points
-// SpliceCand potential[SPLICE_CORPUS];
-// IdxMap_new* rcuridx[STATES];
+} StateMap;
 
 /* Prototypes*/
-Array     *slice(Array *, int);
-state     *create_pda(u8 *);
-Array     *gen_input(state *, Array *);
-Array     *gen_input_count(state *, Array *, int *);
-int        updatebucket(map_t, int);
-void       itoa(int, char *, int);
-void       strrreverse(char *, char *);
-void       dbg_hashmap(map_t);
+automaton *create_pda(u8 *);
+void       gen_input(automaton *, Array *);
 void       print_repr(Array *, char *);
-int        isSatisfied(map_t);
-char      *get_state(char *);
-Candidate *gen_candidate(Array *);
-
-Array *spliceGF(Array *, Array *, int);
-Array *performSpliceOne(Array *, IdxMap_new *, Array *);
-/* Mutation Methods*/
-Array     *performRandomMutation(state *, Array *);
-Array     *performRandomMutationCount(state *, Array *, int *);
-Array     *performSpliceMutationBench(state *, Array *, Candidate **);
-UT_array **get_dupes(Array *, int *);
-Array     *doMult(Array *, UT_array **, int);
-Array     *doMultBench(Array *, UT_array **, int);
-
-/* Benchmarks*/
-void SpaceBenchmark(char *);
-void GenInputBenchmark(char *, char *);
-void RandomMutationBenchmark(char *, char *);
-void MutationAggrBenchmark(char *, char *);
-void SpliceMutationBenchmark(char *, char *);
-void SpliceMutationBenchmarkOne(char *, char *);
-void RandomRecursiveBenchmark(char *, char *);
-
-/* Testers */
-void SanityCheck(char *);
+
+/* Mutation Methods, they build the mutant in out */
+void performRandomMutation(automaton *, Array *, Array *);
+void performSpliceOne(Array *, StateMap *, Array *, Array *);
+void doMult(Array *, StateMap *, Array *);
 
 /*Helpers*/
 void   initArray(Array *, size_t);
-void   insertArray(Array *, int, char *, size_t, int);
+void   insertArray(Array *, u32);
+void   appendArray(Array *, Array *, size_t, size_t);
 void   freeArray(Array *);
-void   initArrayIdx(IdxMap *, size_t);
-void   insertArrayIdx(IdxMap *, int);
-void   freeArrayIdx(IdxMap *);
-void   initArraySplice(SpliceCandArray *, size_t);
-void   insertArraySplice(SpliceCandArray *, Candidate *, int);
-void   freeArraySplice(IdxMap *);
-void   getTwoIndices(UT_array *, int, int *, int *);
-void   swap(int *, int *);
-Array *slice_inverse(Array *, int);
-void   concatPrefixFeature(Array *, Array *);
-void   concatPrefixFeatureBench(Array *, Array *);
-Array *carve(Array *, int, int);
-int    fact(int);
-
-void                add_to_corpus(struct json_object *, Array *);
-struct json_object *term_to_json(terminal *);
+void   slice(Array *, Array *, size_t);
+void   spliceGF(Array *, Array *, size_t);
+void   concatPrefixFeature(Array *, Array *, size_t, size_t);
+void   initStateMap(StateMap *);
+void   buildStateMap(StateMap *, Array *);
+void   freeStateMap(StateMap *);
+void   getTwoIndices(StateMap *, u32, u32 *, u32 *);
 
 /* Gramatron specific prototypes */
+void   unparse_walk_into(Array *, u8 *);
 u8    *unparse_walk(Array *);
-Array *performSpliceGF(state *, Array *, afl_state_t *);
-void   dump_input(u8 *, char *, int *);
 void   write_input(Array *, u8 *);
-Array *read_input(state *, u8 *);
-state *pda;
+Array *read_input(automaton *, u8 *);
+automaton *pda;
 
 // // AFL-specific struct
 // typedef uint8_t  u8;
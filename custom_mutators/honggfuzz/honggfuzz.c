@@ -10,6 +10,7 @@
 
 uint8_t          *queue_input;
 size_t            queue_input_size;
+uint8_t          *mangle_scratch;
 afl_state_t      *afl_struct;
 run_t             run;
 honggfuzz_t       global;
@@ -31,7 +32,9 @@ my_mutator_t *afl_custom_init(afl_state_t *afl, unsigned int seed) {
     return NULL;
   }
 
-  if ((data->mutator_buf = malloc(MAX_FILE)) == NULL) {
+  if ((data->mutator_buf = malloc(MAX_FILE)) == NULL ||
+      (mangle_scratch = malloc(MAX_FILE)) == NULL) {
+    free(data->mutator_buf);
     free(data);
     perror("mutator_buf alloc");
     return NULL;
@@ -123,6 +126,8 @@ size_t afl_custom_fuzz(my_mutator_t *data, uint8_t *buf, size_t buf_size,
  * @param data The data ptr from afl_custom_init
  */
 void afl_custom_deinit(my_mutator_t *data) {
+  free(mangle_scratch);
+  mangle_scratch = NULL;
   free(data->mutator_buf);
   free(data);
 }
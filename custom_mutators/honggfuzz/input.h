@@ -73,6 +73,7 @@ static void __attribute__((unused)) __clang_cleanup_func(void (^*dfunc)(void)) {
 extern uint8_t     *queue_input;
 extern size_t       queue_input_size;
 extern afl_state_t *afl_struct;
+extern uint8_t     *mangle_scratch; /* MAX_FILE bytes for mangle_MemCopy() */
 
 inline void wmb() {
 }
@@ -99,17 +100,22 @@ static inline void util_turnToPrintable(uint8_t *buf, size_t sz) {
   for (size_t i = 0; i < sz; i++)
     buf[i] = buf[i] % 95 + 32;
 }
+/* eight bytes per random word instead of a rand_below() for each */
 static inline void util_rndBuf(uint8_t *buf, size_t sz) {
-  if (sz == 0) return;
-  for (size_t i = 0; i < sz; i++)
-    buf[i] = (uint8_t)rand_below(afl_struct, 256);
+  for (size_t i = 0; i < sz; i += 8) {
+    uint64_t r = rand_word(afl_struct);
+    memcpy(buf + i, &r, HF_MIN(sz - i, 8));
+  }
 }
 static inline uint8_t util_rndPrintable() {
   return 32 + rand_below(afl_struct, 127 - 32);
 }
 static inline void util_rndBufPrintable(uint8_t *buf, size_t sz) {
-  for (size_t i = 0; i < sz; i++)
-    buf[i] = util_rndPrintable();
+  uint64_t r = 0;
+  for (size_t i = 0; i < sz; i++, r >>= 8) {
+    if (!(i & 7)) { r = rand_word(afl_struct); }
+    buf[i] = 32 + (((r & 0xff) * (127 - 32)) >> 8);
+  }
 }
 
 #endif
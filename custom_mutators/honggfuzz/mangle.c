@@ -153,6 +153,14 @@ static void mangle_MemSwap(run_t *run, bool printable HF_ATTR_UNUSED) {
 
   if (off1 == off2) { return; }
 
+  /* AFL++: apart from each other, the ranges go through the scratch buffer */
+  if (off1 + len <= off2 || off2 + len <= off1) {
+    memcpy(mangle_scratch, &run->dynfile->data[off1], len);
+    memcpy(&run->dynfile->data[off1], &run->dynfile->data[off2], len);
+    memcpy(&run->dynfile->data[off2], mangle_scratch, len);
+    return;
+  }
+
   for (size_t i = 0; i < (len / 2); i++) {
     /*
      * First - from the head, next from the tail. Don't worry about layout of
@@ -173,11 +181,9 @@ static void mangle_MemCopy(run_t *run, bool printable HF_ATTR_UNUSED) {
   size_t off = mangle_getOffSet(run);
   size_t len = mangle_getLen(run->dynfile->size - off);
 
-  /* Use a temp buf, as Insert/Inflate can change source bytes */
-  uint8_t *tmpbuf = (uint8_t *)util_Malloc(len);
-  defer {
-    free(tmpbuf);
-  };
+  /* Use a temp buf, as Insert/Inflate can change source bytes. AFL++: the
+     scratch buffer of the custom mutator instead of a malloc() per call */
+  uint8_t *tmpbuf = mangle_scratch;
 
   memmove(tmpbuf, &run->dynfile->data[off], len);
 
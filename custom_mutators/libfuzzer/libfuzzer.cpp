@@ -5,6 +5,10 @@
 // #include "config.h"
 // #include "debug.h"
 #include "afl-fuzz.h"
+#include "cmplog.h"
+
+/* operand pairs of the cmplog map kept per queue entry, of each kind */
+#define CMP_POOL_MAX 4096
 
 #ifdef INTROSPECTION
 const char *introspection_ptr;
@@ -19,6 +23,11 @@ extern "C" int    LLVMFuzzerRunDriver(int *argc, char ***argv,
 extern "C" void   LLVMFuzzerMyInit(int (*UserCb)(const uint8_t *Data,
                                                size_t         Size),
                                    unsigned int Seed);
+extern "C" void   LLVMFuzzerMyAddWord(const uint8_t *Data, size_t Size);
+extern "C" void   LLVMFuzzerMyAddCmp(size_t Idx, uint64_t Arg1, uint64_t Arg2,
+                                     size_t Size);
+extern "C" void   LLVMFuzzerMyAddCmpWord(size_t Idx, const uint8_t *Arg1,
+                                         const uint8_t *Arg2, size_t Size);
 
 typedef struct my_mutator {
   afl_state_t *afl;
@@ -26,8 +35,26 @@ typedef struct my_mutator {
   unsigned int seed;
   unsigned int extras_cnt, a_extras_cnt;
 
+  /* the comparisons of the last cmplog run, taken for cmp_entry */
+  struct queue_entry    *cmp_entry;
+  struct cmp_operands   *ins;
+  u8                    *ins_size;
+  u32                    ins_cnt;
+  struct cmpfn_operands *rtn;
+  u32                    rtn_cnt;
+  u64                    rand_state;
+
 } my_mutator_t;
 
+/* afl-fuzz does not export its random functions to custom mutators */
+
+static u32 rand_pick(my_mutator_t *data, u32 limit) {
+  data->rand_state ^= data->rand_state << 13;
+  data->rand_state ^= data->rand_state >> 7;
+  data->rand_state ^= data->rand_state << 17;
+  return (u32)((data->rand_state >> 32) % limit);
+}
+
 extern "C" int dummy(const uint8_t *Data, size_t Size) {
   (void)(Data);
   (void)(Size);
@@ -48,8 +75,24 @@ extern "C" my_mutator_t *afl_custom_init(afl_state_t *afl, unsigned int seed) {
     return NULL;
   }
 
+  data->ins = (struct cmp_operands *)malloc(CMP_POOL_MAX *
+                                            sizeof(struct cmp_operands));
+  data->ins_size = (u8 *)malloc(CMP_POOL_MAX);
+  data->rtn = (struct cmpfn_operands *)malloc(CMP_POOL_MAX *
+                                              sizeof(struct cmpfn_operands));
+  if (!data->ins || !data->ins_size || !data->rtn) {
+    free(data->ins);
+    free(data->ins_size);
+    free(data->rtn);
+    free(data->mutator_buf);
+    free(data);
+    perror("cmp pool alloc");
+    return NULL;
+  }
+
   data->afl = afl;
   data->seed = seed;
+  data->rand_state = 0x9e3779b97f4a7c15ULL ^ seed;
   afl_struct = afl;
 
   /*
@@ -66,46 +109,99 @@ extern "C" my_mutator_t *afl_custom_init(afl_state_t *afl, unsigned int seed) {
   return data;
 }
 
-/* When a new queue entry is added we check if there are new dictionary
-   entries to add to honggfuzz structure */
-#if 0
-extern "C" uint8_t afl_custom_queue_new_entry(my_mutator_t * data,
-                                              const uint8_t *filename_new_queue,
-                                              const uint8_t *filename_orig_queue) {
-
-  while (data->extras_cnt < afl_struct->extras_cnt) {
-
-    /*
-        memcpy(run.global->mutate.dictionary[run.global->mutate.dictionaryCnt].val,
-               afl_struct->extras[data->extras_cnt].data,
-               afl_struct->extras[data->extras_cnt].len);
-        run.global->mutate.dictionary[run.global->mutate.dictionaryCnt].len =
-            afl_struct->extras[data->extras_cnt].len;
-        run.global->mutate.dictionaryCnt++;
-    */
-    data->extras_cnt++;
+/* Hand the dictionary tokens afl-fuzz got since the last call to the
+   manual dictionary of libfuzzer, tokens longer than a libfuzzer Word are
+   left out. */
+
+static void import_extras(my_mutator_t *data) {
+  afl_state_t *afl = data->afl;
+
+  while (data->extras_cnt < afl->extras_cnt) {
+    struct extra_data *e = &afl->extras[data->extras_cnt++];
+    LLVMFuzzerMyAddWord(e->data, e->len);
+  }
 
+  while (data->a_extras_cnt < afl->a_extras_cnt) {
+    struct auto_extra_data *e = &afl->a_extras[data->a_extras_cnt++];
+    LLVMFuzzerMyAddWord(e->data, e->len);
   }
+}
+
+/* Copy the operand pairs that differ out of the cmplog map once per queue
+   entry. input-to-state ran just before, so the map is about this entry or
+   one of its colorized variants. With more pairs than the pool holds a
+   random part of the keys is taken. */
+
+static void import_cmps(my_mutator_t *data) {
+  afl_state_t    *afl = data->afl;
+  struct cmp_map *map = afl->shm.cmp_map;
+  u32             w = afl->cmplog_map_w, h = afl->cmplog_map_h, k, i, n, s;
+
+  if (!map || !w || data->cmp_entry == afl->queue_cur) { return; }
 
-  while (data->a_extras_cnt < afl_struct->a_extras_cnt) {
+  data->cmp_entry = afl->queue_cur;
+  data->ins_cnt = data->rtn_cnt = 0;
+  s = rand_pick(data, w);
 
-    /*
-        memcpy(run.global->mutate.dictionary[run.global->mutate.dictionaryCnt].val,
-               afl_struct->a_extras[data->a_extras_cnt].data,
-               afl_struct->a_extras[data->a_extras_cnt].len);
-        run.global->mutate.dictionary[run.global->mutate.dictionaryCnt].len =
-            afl_struct->a_extras[data->a_extras_cnt].len;
-        run.global->mutate.dictionaryCnt++;
-        data->a_extras_cnt++;
-    */
+  for (k = 0; k < w; ++k) {
+    u32                key = (s + k) & (w - 1);
+    struct cmp_header *hdr = &map->headers[key];
 
+    if (!hdr->hits) { continue; }
+
+    u32 size = SHAPE_BYTES(hdr->shape);
+
+    if (hdr->type == CMP_TYPE_INS) {
+      struct cmp_operands *row = cmp_map_row(map, w, h, key);
+
+      if (size > 8) { continue; }
+      n = MIN((u32)hdr->hits, h);
+
+      for (i = 0; i < n && data->ins_cnt < CMP_POOL_MAX; ++i) {
+        if (row[i].v0 == row[i].v1) { continue; }
+        data->ins_size[data->ins_cnt] = size;
+        data->ins[data->ins_cnt++] = row[i];
+      }
+
+    } else {
+      struct cmpfn_operands *row =
+          (struct cmpfn_operands *)cmp_map_row(map, w, h, key);
+
+      n = MIN((u32)hdr->hits, h / 2);
+
+      for (i = 0; i < n && data->rtn_cnt < CMP_POOL_MAX; ++i) {
+        u32 len = MIN(MIN(row[i].v0_len, row[i].v1_len), (u8)31);
+        if (!len || !memcmp(row[i].v0, row[i].v1, len)) { continue; }
+        data->rtn[data->rtn_cnt] = row[i];
+        data->rtn[data->rtn_cnt++].v0_len = len;
+      }
+    }
+
+    if (data->ins_cnt == CMP_POOL_MAX && data->rtn_cnt == CMP_POOL_MAX) {
+      break;
+    }
   }
+}
 
-  return 0;
+/* Fill the tables of recent compares of libfuzzer, which only have 32
+   slots each, with a random pick of the pool before every mutation. */
+
+static void fill_torc(my_mutator_t *data) {
+  u32 i, j;
+
+  for (i = 0; i < 32 && data->ins_cnt; ++i) {
+    j = rand_pick(data, data->ins_cnt);
+    LLVMFuzzerMyAddCmp(i, data->ins[j].v0, data->ins[j].v1,
+                       data->ins_size[j]);
+  }
 
+  for (i = 0; i < 32 && data->rtn_cnt; ++i) {
+    j = rand_pick(data, data->rtn_cnt);
+    LLVMFuzzerMyAddCmpWord(i, data->rtn[j].v0, data->rtn[j].v1,
+                           data->rtn[j].v0_len);
+  }
 }
 
-#endif
 /* we could set only_printable if is_ascii is set ... let's see
 uint8_t afl_custom_queue_get(void *data, const uint8_t *filename) {
 
@@ -121,6 +217,10 @@ extern "C" size_t afl_custom_fuzz(my_mutator_t *data, uint8_t *buf,
                                   size_t buf_size, u8 **out_buf,
                                   uint8_t *add_buf, size_t add_buf_size,
                                   size_t max_size) {
+  import_extras(data);
+  import_cmps(data);
+  fill_torc(data);
+
   memcpy(data->mutator_buf, buf, buf_size);
   size_t ret = LLVMFuzzerMutate(data->mutator_buf, buf_size, max_size);
 
@@ -141,6 +241,9 @@ extern "C" const char *afl_custom_introspection(my_mutator_t *data) {
  * @param data The data ptr from afl_custom_init
  */
 extern "C" void afl_custom_deinit(my_mutator_t *data) {
+  free(data->ins);
+  free(data->ins_size);
+  free(data->rtn);
   free(data->mutator_buf);
   free(data);
 }
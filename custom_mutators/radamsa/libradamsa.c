@@ -3801,6 +3801,7 @@ static word *genstart;
 static word *memstart;
 static word *memend;
 static hval  max_heap_mb; /* max heap size in MB */
+static word  min_heap_words; /* AFL++: heap size gc() keeps at least */
 static int
     breaked; /* set in signal handler, passed over to owl in thread switch */
 static word           state; /* IFALSE | previous program state across runs */
@@ -3970,7 +3971,8 @@ static word *gc(int size, word *regs) {
         breaked |= 8; /* will be passed over to mcp at thread switch. may cause
                          owl<->gc loop if handled poorly on lisp side! */
 
-    } else if (nfree > (heapsize / 3)) {
+    } else if (nfree > (heapsize / 3) &&
+               heapsize / W > min_heap_words) {
       /* decrease heap size if more than 33% is free by 10% of the free space */
       wdiff dec = -(nfree / 10);
       wdiff new = nfree - dec;
@@ -53325,19 +53327,28 @@ static int secondary(int nargs, char **argv) {
 
 */
 
-void radamsa_init(void) {
-  int nobjs = 0, nwords = 0;
+/* AFL++: start with a heap of at least heap_mb MB and never shrink it below
+   that, so the calls do not keep resizing and moving it */
+void radamsa_init_heap(size_t heap_mb) {
+  int  nobjs = 0, nwords = 0;
+  word min_words = heap_mb * 1024 * 1024 / W;
   hp = (byte *)&heap; /* builtin heap */
   state = IFALSE;
   heap_metrics(&nwords, &nobjs);
   max_heap_mb = (W == 4) ? 4096 : 65535;
   nwords += nobjs + INITCELLS;
+  if ((word)nwords < min_words) nwords = min_words;
+  min_heap_words = min_words;
   memstart = genstart = fp = (word *)realloc(NULL, (nwords + MEMPAD) * W);
   if (!memstart) return;
   memend = memstart + nwords - MEMPAD;
   state = (word)load_heap(nobjs);
 }
 
+void radamsa_init(void) {
+  radamsa_init_heap(0);
+}
+
 /* bvec → value library call test with preserved state */
 static word library_call(word val) {
   word program_state = state;
@@ -9,6 +9,8 @@
 #include "radamsa.h"
 #include "afl-fuzz.h"
 
+#define RADAMSA_HEAP_MB 8
+
 typedef struct my_mutator {
   afl_state_t *afl;
   u8          *mutator_buf;
@@ -33,7 +35,10 @@ my_mutator_t *afl_custom_init(afl_state_t *afl, unsigned int seed) {
   data->afl = afl;
   data->seed = seed;
 
-  radamsa_init();
+  /* a heap that stays big enough spares the calls most of the garbage
+     collections and the resizing of the heap */
+  char *heap_mb = getenv("RADAMSA_HEAP_MB");
+  radamsa_init_heap(heap_mb ? atoi(heap_mb) : RADAMSA_HEAP_MB);
 
   return data;
 }
@@ -3,6 +3,9 @@
 
 void radamsa_init(void);
 
+/* like radamsa_init(), with a heap that never gets smaller than heap_mb MB */
+void radamsa_init_heap(size_t heap_mb);
+
 size_t radamsa(uint8_t *ptr, size_t len, uint8_t *target, size_t max,
                unsigned int seed);
 
@@ -5,10 +5,12 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <signal.h>
 #include "config.h"
 #include "debug.h"
 #include "afl-fuzz.h"
 #include "common.h"
+#include "cmplog.h"
 
 afl_state_t *afl_struct;
 
@@ -19,6 +21,36 @@ afl_state_t *afl_struct;
     {}
 #endif
 
+#define SYMCC_RESULTS_MAX 4096  // testcases held for afl_custom_fuzz()
+
+/* With SYMCC_WORKERS=n up to n runs of the symcc target go on in the
+   background instead of one blocking run per new queue entry. The entries
+   wait in todo[], those that hit cmplog keys input-to-state gave up on in
+   todo[0] before the others. Finished runs are reaped whenever afl-fuzz
+   calls in, and their testcases are handed out by afl_custom_fuzz() from
+   memory. */
+
+struct concolic_worker {
+  pid_t pid;      /* the symcc run, 0 if idle     */
+  u8   *out_dir;  /* its SYMCC_OUTPUT_DIR         */
+  u8   *input;    /* the testcase it runs on      */
+  u8  **argv;     /* with @@ replaced by input    */
+  u8    use_file; /* argv has input, else stdin   */
+
+};
+
+struct concolic_result {
+  u8 *buf;
+  u32 len;
+
+};
+
+struct id_fifo {
+  u32 *id;
+  u32  head, cnt, size;
+
+};
+
 typedef struct my_mutator {
   afl_state_t *afl;
   u8          *mutator_buf;
@@ -27,8 +59,39 @@ typedef struct my_mutator {
   u8          *target;
   uint32_t     seed;
 
+  u32                     workers;
+  struct concolic_worker *worker;
+  struct id_fifo          todo[2];
+  u8                     *started;  // by queue entry id
+  u32                     started_size;
+  struct concolic_result *res;
+  u32                     res_cnt;
+  u8                     *res_last;  // given out by the last fuzz call
+
 } my_mutator_t;
 
+static void fifo_push(struct id_fifo *f, u32 id) {
+  if (f->head + f->cnt == f->size) {
+    if (f->head) {
+      memmove(f->id, f->id + f->head, f->cnt * sizeof(u32));
+      f->head = 0;
+
+    } else {
+      f->size = f->size ? f->size * 2 : 64;
+      f->id = realloc(f->id, f->size * sizeof(u32));
+      if (!f->id) { PFATAL("todo alloc"); }
+    }
+  }
+
+  f->id[f->head + f->cnt++] = id;
+}
+
+static s64 fifo_pop(struct id_fifo *f) {
+  if (!f->cnt) { return -1; }
+  --f->cnt;
+  return f->id[f->head++];
+}
+
 my_mutator_t *afl_custom_init(afl_state_t *afl, unsigned int seed) {
   if (getenv("AFL_CUSTOM_MUTATOR_ONLY"))
     FATAL("the symcc module cannot be used with AFL_CUSTOM_MUTATOR_ONLY.");
@@ -85,9 +148,198 @@ my_mutator_t *afl_custom_init(afl_state_t *afl, unsigned int seed) {
 
   DBG("out_dir=%s, target=%s\n", data->out_dir, data->target);
 
+  u8 *tmp;
+  if ((tmp = getenv("SYMCC_WORKERS"))) { data->workers = atoi(tmp); }
+
+  if (data->workers) {
+    data->worker = calloc(data->workers, sizeof(struct concolic_worker));
+    data->res = calloc(SYMCC_RESULTS_MAX, sizeof(struct concolic_result));
+    if (!data->worker || !data->res) { PFATAL("worker alloc"); }
+
+    for (u32 i = 0; i < data->workers; ++i) {
+      struct concolic_worker *w = &data->worker[i];
+
+      w->out_dir = alloc_printf("%s/worker%u", data->out_dir, i);
+      if (mkdir(w->out_dir, 0755))
+        PFATAL("Could not create directory %s", w->out_dir);
+      w->input = alloc_printf("%s/.input", w->out_dir);
+    }
+  }
+
   return data;
 }
 
+/* Did the cmplog run of the current entry hit keys that input-to-state gave
+   up on? In the custom mutator stage cmp_map still has a run of it. */
+
+static u8 concolic_gave_up_keys(afl_state_t *afl) {
+  struct cmp_map *m = afl->shm.cmp_map;
+
+  if (!m || !afl->pass_stats) { return 0; }
+
+  for (u32 k = 0; k < afl->cmplog_map_w; ++k) {
+    if (m->headers[k].hits && afl->pass_stats[k].faileds >= CMPLOG_FAIL_MAX) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* Start a run of queue entry id on worker w, unless it had one already */
+
+static void worker_start(my_mutator_t *data, struct concolic_worker *w,
+                         u32 id) {
+  struct queue_entry *q = afl_struct->queue_buf[id];
+  s32                 fd;
+  ssize_t             len;
+
+  if (id >= data->started_size) {
+    u32 size = MAX(id + 1, data->started_size * 2);
+    data->started = realloc(data->started, size);
+    if (!data->started) { PFATAL("worker alloc"); }
+    memset(data->started + data->started_size, 0, size - data->started_size);
+    data->started_size = size;
+  }
+
+  if (data->started[id]) { return; }
+  data->started[id] = 1;
+
+  if (!w->argv) {
+    // the target gets the testcase of the worker where afl-fuzz has @@,
+    // which is only known once afl-fuzz is set up. With a shared memory
+    // testcase afl-fuzz drops fsrv.out_file, the @@ file still has the
+    // name it had before.
+    u8  cur[PATH_MAX];
+    u8 *file = afl_struct->fsrv.out_file;
+    u32 argc = 0;
+
+    if (!file) {
+      snprintf(cur, sizeof(cur), "%s/.cur_input", afl_struct->tmp_dir);
+      file = cur;
+    }
+
+    while (afl_struct->argv[argc]) {
+      ++argc;
+    }
+
+    w->argv = malloc((argc + 1) * sizeof(u8 *));
+    if (!w->argv) { PFATAL("worker alloc"); }
+
+    for (u32 j = 0; j <= argc; ++j) {
+      w->argv[j] = (u8 *)afl_struct->argv[j];
+      if (j && afl_struct->argv[j] &&
+          !strncmp(afl_struct->argv[j], file, strlen(file))) {
+        w->argv[j] = w->input;
+        w->use_file = 1;
+      }
+    }
+  }
+
+  fd = open(q->fname, O_RDONLY);
+  if (fd < 0) { return; }
+  len = read(fd, data->mutator_buf, MAX_FILE);
+  close(fd);
+  if (len <= 0) { return; }
+
+  fd = open(w->input, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) { PFATAL("Could not create %s", w->input); }
+  ck_write(fd, data->mutator_buf, len, w->input);
+  close(fd);
+
+  w->pid = fork();
+
+  if (w->pid < 0) {
+    w->pid = 0;
+    return;
+  }
+
+  if (w->pid) {
+    DBG("worker %ld: %s\n", (long)(w - data->worker), q->fname);
+    return;
+  }
+
+  setenv("SYMCC_OUTPUT_DIR", w->out_dir, 1);
+
+  if (!w->use_file) {
+    unsetenv("SYMCC_INPUT_FILE");
+    fd = open(w->input, O_RDONLY);
+    if (fd < 0) { exit(-1); }
+    dup2(fd, 0);
+    close(fd);
+
+  } else {
+    setenv("SYMCC_INPUT_FILE", w->input, 1);
+  }
+
+  close(1);
+  close(2);
+  dup2(afl_struct->fsrv.dev_null_fd, 1);
+  dup2(afl_struct->fsrv.dev_null_fd, 2);
+
+  execvp(data->target, (char **)w->argv);
+  exit(-1);
+}
+
+/* Take the testcases of the finished run of worker w */
+
+static void worker_reap(my_mutator_t *data, struct concolic_worker *w) {
+  struct dirent **nl;
+  s32             i, items = scandir(w->out_dir, &nl, NULL, NULL);
+
+  for (i = 0; i < items; ++i) {
+    struct stat st;
+    u8         *fn = alloc_printf("%s/%s", w->out_dir, nl[i]->d_name);
+
+    if (nl[i]->d_name[0] != '.' && stat(fn, &st) == 0 &&
+        S_ISREG(st.st_mode)) {
+      if (st.st_size && data->res_cnt < SYMCC_RESULTS_MAX) {
+        u32 len = MIN(st.st_size, MAX_FILE);
+        u8 *buf = malloc(len);
+        s32 fd = open(fn, O_RDONLY);
+
+        if (buf && fd >= 0 && read(fd, buf, len) == len) {
+          data->res[data->res_cnt].buf = buf;
+          data->res[data->res_cnt].len = len;
+          ++data->res_cnt;
+
+        } else {
+          free(buf);
+        }
+
+        if (fd >= 0) { close(fd); }
+      }
+
+      unlink(fn);
+    }
+
+    ck_free(fn);
+    free(nl[i]);
+  }
+
+  if (items >= 0) { free(nl); }
+}
+
+/* Reap the finished runs and give the idle workers the next entries */
+
+static void pool_poll(my_mutator_t *data) {
+  for (u32 i = 0; i < data->workers; ++i) {
+    struct concolic_worker *w = &data->worker[i];
+
+    if (w->pid && waitpid(w->pid, NULL, WNOHANG) == w->pid) {
+      w->pid = 0;
+      worker_reap(data, w);
+    }
+
+    while (!w->pid) {
+      s64 id = fifo_pop(&data->todo[0]);
+      if (id < 0) { id = fifo_pop(&data->todo[1]); }
+      if (id < 0) { break; }
+      worker_start(data, w, (u32)id);
+    }
+  }
+}
+
 /* When a new queue entry is added we run this input with the symcc
    instrumented binary */
 uint8_t afl_custom_queue_new_entry(my_mutator_t  *data,
@@ -95,6 +347,21 @@ uint8_t afl_custom_queue_new_entry(my_mutator_t  *data,
                                    const uint8_t *filename_orig_queue) {
   int         pipefd[2];
   struct stat st;
+
+  if (data->workers) {
+    // the hook only gets the file name, it is the one of a recent entry
+    for (s64 i = (s64)afl_struct->queued_items - 1; i >= 0; --i) {
+      if (afl_struct->queue_buf[i]->fname == filename_new_queue) {
+        fifo_push(&data->todo[1], (u32)i);
+        break;
+      }
+    }
+
+    // the runs start from afl_custom_fuzz_count(), afl-fuzz may not be set
+    // up yet
+    return 0;
+  }
+
   ACTF("Queueing to symcc: %s", filename_new_queue);
   u8 *fn = alloc_printf("%s", filename_new_queue);
   if (!(stat(fn, &st) == 0 && S_ISREG(st.st_mode) && st.st_size)) {
@@ -199,6 +466,19 @@ uint8_t afl_custom_queue_new_entry(my_mutator_t  *data,
 
 uint32_t afl_custom_fuzz_count(my_mutator_t *data, const u8 *buf,
                                size_t buf_size) {
+  if (data->workers) {
+    u32 id = afl_struct->queue_cur->id;
+
+    if ((id >= data->started_size || !data->started[id]) &&
+        concolic_gave_up_keys(afl_struct)) {
+      fifo_push(&data->todo[0], id);
+    }
+
+    pool_poll(data);
+    DBG("%u testcases from symcc workers\n", data->res_cnt);
+    return data->res_cnt;
+  }
+
   uint32_t        count = 0, i;
   struct dirent **nl;
   int32_t         items = scandir(data->out_dir, &nl, NULL, NULL);
@@ -228,6 +508,17 @@ uint32_t afl_custom_fuzz_count(my_mutator_t *data, const u8 *buf,
 size_t afl_custom_fuzz(my_mutator_t *data, uint8_t *buf, size_t buf_size,
                        u8 **out_buf, uint8_t *add_buf, size_t add_buf_size,
                        size_t max_size) {
+  if (data->workers) {
+    free(data->res_last);
+    data->res_last = NULL;
+
+    if (!data->res_cnt) { return 0; }
+
+    struct concolic_result *r = &data->res[--data->res_cnt];
+    data->res_last = *out_buf = r->buf;
+    return MIN(r->len, max_size);
+  }
+
   struct dirent **nl;
   int32_t         i, done = 0, items = scandir(data->out_dir, &nl, NULL, NULL);
   ssize_t         size = 0;
@@ -269,6 +560,18 @@ size_t afl_custom_fuzz(my_mutator_t *data, uint8_t *buf, size_t buf_size,
  * @param data The data ptr from afl_custom_init
  */
 void afl_custom_deinit(my_mutator_t *data) {
+  for (u32 i = 0; i < data->workers; ++i) {
+    if (data->worker[i].pid) {
+      kill(data->worker[i].pid, SIGKILL);
+      waitpid(data->worker[i].pid, NULL, 0);
+    }
+  }
+
+  while (data->res_cnt) {
+    free(data->res[--data->res_cnt].buf);
+  }
+
+  free(data->res_last);
   free(data->mutator_buf);
   free(data);
 }
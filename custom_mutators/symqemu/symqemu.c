@@ -6,20 +6,49 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <ctype.h>
+#include <signal.h>
 #include "config.h"
 #include "debug.h"
 #include "afl-fuzz.h"
 #include "common.h"
+#include "cmplog.h"
 
 afl_state_t *afl_struct;
 static u32   debug = 0;
 static u32   found_items = 0;
 
 #define SYMQEMU_LOCATION "symqemu"
+#define SYMQEMU_RESULTS_MAX 4096  // testcases held for afl_custom_fuzz()
 
 #define DBG(x...) \
   if (debug) { fprintf(stderr, x); }
 
+/* With SYMQEMU_WORKERS=n up to n symqemu runs go on in the background.
+   The queue entries to run wait in todo[], those that hit cmplog keys
+   input-to-state gave up on in todo[0] before the others. Finished runs are
+   reaped whenever afl-fuzz calls in, and their testcases are handed out by
+   afl_custom_fuzz() from memory, so afl-fuzz never waits for the solver. */
+
+struct concolic_worker {
+  pid_t pid;      /* the symqemu run, 0 if idle   */
+  u8   *out_dir;  /* its SYMCC_OUTPUT_DIR         */
+  u8   *input;    /* the testcase it runs on      */
+  u8  **argv;     /* with @@ replaced by input    */
+
+};
+
+struct concolic_result {
+  u8 *buf;
+  u32 len;
+
+};
+
+struct id_fifo {
+  u32 *id;
+  u32  head, cnt, size;
+
+};
+
 typedef struct my_mutator {
   afl_state_t *afl;
   u32          all;
@@ -33,9 +62,39 @@ typedef struct my_mutator {
   u32          seed;
   u32          argc;
   u8         **argv;
+  u32          input_arg;  // index of @@ in argv, 0 if none
+
+  u32                     workers;
+  struct concolic_worker *worker;
+  struct id_fifo          todo[2];
+  struct concolic_result *res;
+  u32                     res_cnt;
+  u8                     *res_last;  // given out by the last fuzz call
 
 } my_mutator_t;
 
+static void fifo_push(struct id_fifo *f, u32 id) {
+  if (f->head + f->cnt == f->size) {
+    if (f->head) {
+      memmove(f->id, f->id + f->head, f->cnt * sizeof(u32));
+      f->head = 0;
+
+    } else {
+      f->size = f->size ? f->size * 2 : 64;
+      f->id = realloc(f->id, f->size * sizeof(u32));
+      if (!f->id) { PFATAL("todo alloc"); }
+    }
+  }
+
+  f->id[f->head + f->cnt++] = id;
+}
+
+static s64 fifo_pop(struct id_fifo *f) {
+  if (!f->cnt) { return -1; }
+  --f->cnt;
+  return f->id[f->head++];
+}
+
 my_mutator_t *afl_custom_init(afl_state_t *afl, unsigned int seed) {
   if (getenv("AFL_DEBUG")) debug = 1;
 
@@ -45,7 +104,8 @@ my_mutator_t *afl_custom_init(afl_state_t *afl, unsigned int seed) {
     return NULL;
   }
 
-  char *path = getenv("PATH");
+  // a copy, strtok() would cut PATH short for the symqemu runs
+  char *path = strdup(getenv("PATH") ? getenv("PATH") : "");
   char *exec_name = "symqemu-x86_64";
   char *token = strtok(path, ":");
   char  exec_path[4096];
@@ -60,6 +120,7 @@ my_mutator_t *afl_custom_init(afl_state_t *afl, unsigned int seed) {
     token = strtok(NULL, ":");
   }
 
+  free(path);
   if (!data->symqemu) FATAL("symqemu binary %s not found", exec_name);
   DBG("Found %s\n", data->symqemu);
 
@@ -111,6 +172,7 @@ my_mutator_t *afl_custom_init(afl_state_t *afl, unsigned int seed) {
       }
 
       if (strcmp(data->argv[index], "@@") == 0) {
+        data->input_arg = index;
         if (!data->input_file) {
           u32 ilen = strlen(symqemu_path) + 32;
           data->input_file = malloc(ilen);
@@ -144,6 +206,43 @@ my_mutator_t *afl_custom_init(afl_state_t *afl, unsigned int seed) {
   if (getenv("SYMQEMU_LATE")) { data->late = 1; }
   if (data->input_file) { setenv("SYMCC_INPUT_FILE", data->input_file, 1); }
 
+  if ((tmp = getenv("SYMQEMU_WORKERS"))) { data->workers = atoi(tmp); }
+
+  if (data->workers) {
+    if (data->input_file && !data->input_arg && data->workers > 1) {
+      WARNF(
+          "the target reads a fixed input file, SYMQEMU_WORKERS is limited "
+          "to 1");
+      data->workers = 1;
+    }
+
+    data->worker = calloc(data->workers, sizeof(struct concolic_worker));
+    data->res = calloc(SYMQEMU_RESULTS_MAX, sizeof(struct concolic_result));
+    if (!data->worker || !data->res) { PFATAL("worker alloc"); }
+
+    for (u32 i = 0; i < data->workers; ++i) {
+      struct concolic_worker *w = &data->worker[i];
+
+      w->out_dir = alloc_printf("%s/worker%u", symqemu_path, i);
+      (void)mkdir(w->out_dir, 0755);
+
+      w->argv = malloc((data->argc + 1) * sizeof(u8 *));
+      if (!w->argv) { PFATAL("worker alloc"); }
+      memcpy(w->argv, data->argv, (data->argc + 1) * sizeof(u8 *));
+
+      if (data->input_arg) {
+        w->input = alloc_printf("%s/.input.%u", symqemu_path, i);
+        w->argv[data->input_arg] = w->input;
+
+      } else if (data->input_file) {
+        w->input = data->input_file;
+
+      } else {
+        w->input = alloc_printf("%s/.stdin.%u", symqemu_path, i);
+      }
+    }
+  }
+
   DBG("out_dir=%s, target=%s, input_file=%s, argc=%u\n", data->out_dir,
       data->target,
       data->input_file ? (char *)data->input_file : (char *)"<stdin>",
@@ -176,7 +275,9 @@ inline u64 get_cur_time(void) {
   return (tv.tv_sec * 1000ULL) + (tv.tv_usec / 1000);
 }
 
-u32 afl_custom_fuzz_count(my_mutator_t *data, const u8 *buf, size_t buf_size) {
+/* Is the current queue entry one to run symqemu on? */
+
+static u8 concolic_wanted(my_mutator_t *data) {
   if (likely((!afl_struct->queue_cur->favored && !data->all) ||
              afl_struct->queue_cur->was_fuzzed)) {
     return 0;
@@ -189,6 +290,152 @@ u32 afl_custom_fuzz_count(my_mutator_t *data, const u8 *buf, size_t buf_size) {
     }
   }
 
+  return 1;
+}
+
+/* Did the cmplog run of the current entry hit keys that input-to-state gave
+   up on? In the custom mutator stage cmp_map still has a run of it. */
+
+static u8 concolic_gave_up_keys(afl_state_t *afl) {
+  struct cmp_map *m = afl->shm.cmp_map;
+
+  if (!m || !afl->pass_stats) { return 0; }
+
+  for (u32 k = 0; k < afl->cmplog_map_w; ++k) {
+    if (m->headers[k].hits && afl->pass_stats[k].faileds >= CMPLOG_FAIL_MAX) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* Start a symqemu run of queue entry id on worker w */
+
+static void worker_start(my_mutator_t *data, struct concolic_worker *w,
+                         u32 id) {
+  struct queue_entry *q = afl_struct->queue_buf[id];
+  s32                 fd;
+  ssize_t             len;
+
+  fd = open(q->fname, O_RDONLY);
+  if (fd < 0) { return; }
+  len = read(fd, data->mutator_buf, MAX_FILE);
+  close(fd);
+  if (len <= 0) { return; }
+
+  fd = open(w->input, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) { PFATAL("Could not create %s", w->input); }
+  ck_write(fd, data->mutator_buf, len, w->input);
+  close(fd);
+
+  w->pid = fork();
+
+  if (w->pid < 0) {
+    w->pid = 0;
+    return;
+  }
+
+  if (w->pid) {
+    DBG("worker %ld: %s\n", (long)(w - data->worker), q->fname);
+    return;
+  }
+
+  setenv("SYMCC_OUTPUT_DIR", w->out_dir, 1);
+
+  if (!data->input_file || afl_struct->fsrv.use_stdin) {
+    fd = open(w->input, O_RDONLY);
+    if (fd < 0) { exit(-1); }
+    dup2(fd, 0);
+    close(fd);
+  }
+
+  if (data->input_arg) { setenv("SYMCC_INPUT_FILE", w->input, 1); }
+
+  if (!debug) {
+    close(1);
+    close(2);
+    dup2(afl_struct->fsrv.dev_null_fd, 1);
+    dup2(afl_struct->fsrv.dev_null_fd, 2);
+  }
+
+  execvp((char *)w->argv[0], (char **)w->argv);
+  exit(-1);
+}
+
+/* Take the testcases of the finished run of worker w */
+
+static void worker_reap(my_mutator_t *data, struct concolic_worker *w) {
+  struct dirent **nl;
+  s32             i, items = scandir(w->out_dir, &nl, NULL, NULL);
+  char            source_name[4096];
+
+  for (i = 0; i < items; ++i) {
+    struct stat st;
+    snprintf(source_name, sizeof(source_name), "%s/%s", w->out_dir,
+             nl[i]->d_name);
+
+    // symqemu output files start with a digit
+    if (isdigit(nl[i]->d_name[0]) && stat(source_name, &st) == 0 &&
+        S_ISREG(st.st_mode) && st.st_size &&
+        data->res_cnt < SYMQEMU_RESULTS_MAX) {
+      u32 len = MIN(st.st_size, MAX_FILE);
+      u8 *buf = malloc(len);
+      s32 fd = open(source_name, O_RDONLY);
+
+      if (buf && fd >= 0 && read(fd, buf, len) == len) {
+        data->res[data->res_cnt].buf = buf;
+        data->res[data->res_cnt].len = len;
+        ++data->res_cnt;
+
+      } else {
+        free(buf);
+      }
+
+      if (fd >= 0) { close(fd); }
+    }
+
+    if (nl[i]->d_name[0] != '.') { unlink(source_name); }
+    free(nl[i]);
+  }
+
+  if (items >= 0) { free(nl); }
+}
+
+/* Reap the finished runs and give the idle workers the next entries */
+
+static void pool_poll(my_mutator_t *data) {
+  for (u32 i = 0; i < data->workers; ++i) {
+    struct concolic_worker *w = &data->worker[i];
+
+    if (w->pid && waitpid(w->pid, NULL, WNOHANG) == w->pid) {
+      w->pid = 0;
+      worker_reap(data, w);
+    }
+
+    while (!w->pid) {
+      s64 id = fifo_pop(&data->todo[0]);
+      if (id < 0) { id = fifo_pop(&data->todo[1]); }
+      if (id < 0) { break; }
+      worker_start(data, w, (u32)id);
+    }
+  }
+}
+
+u32 afl_custom_fuzz_count(my_mutator_t *data, const u8 *buf, size_t buf_size) {
+  if (data->workers) {
+    if (concolic_wanted(data)) {
+      fifo_push(&data->todo[concolic_gave_up_keys(afl_struct) ? 0 : 1],
+                afl_struct->queue_cur->id);
+    }
+
+    pool_poll(data);
+    DBG("%u testcases from symqemu workers\n", data->res_cnt);
+    return data->res_cnt;
+  }
+
+  if (!concolic_wanted(data)) { return 0; }
+
   int         pipefd[2];
   struct stat st;
 
@@ -295,6 +542,20 @@ u32 afl_custom_fuzz_count(my_mutator_t *data, const u8 *buf, size_t buf_size) {
 size_t afl_custom_fuzz(my_mutator_t *data, u8 *buf, size_t buf_size,
                        u8 **out_buf, u8 *add_buf, size_t add_buf_size,
                        size_t max_size) {
+  if (data->workers) {
+    free(data->res_last);
+    data->res_last = NULL;
+
+    if (!data->res_cnt) {
+      *out_buf = NULL;
+      return 0;
+    }
+
+    struct concolic_result *r = &data->res[--data->res_cnt];
+    data->res_last = *out_buf = r->buf;
+    return MIN(r->len, max_size);
+  }
+
   struct dirent **nl;
   s32             done = 0, i, items = scandir(data->out_dir, &nl, NULL, NULL);
   char            source_name[4096];
@@ -345,6 +606,18 @@ got_an_issue:
  * @param data The data ptr from afl_custom_init
  */
 void afl_custom_deinit(my_mutator_t *data) {
+  for (u32 i = 0; i < data->workers; ++i) {
+    if (data->worker[i].pid) {
+      kill(data->worker[i].pid, SIGKILL);
+      waitpid(data->worker[i].pid, NULL, 0);
+    }
+  }
+
+  while (data->res_cnt) {
+    free(data->res[--data->res_cnt].buf);
+  }
+
+  free(data->res_last);
   free(data->mutator_buf);
   free(data);
 }
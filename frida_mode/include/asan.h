@@ -3,12 +3,20 @@
 
 #include "frida-gumjs.h"
 
+/* Most instructions looked at for a batch */
+#define ASAN_BATCH_MAX 16
+
 extern gboolean asan_initialized;
+extern gboolean asan_batch;
 
-void asan_config(void);
-void asan_init(void);
-void asan_arch_init(void);
-void asan_instrument(const cs_insn *instr, GumStalkerIterator *iterator);
+void     asan_config(void);
+void     asan_init(void);
+void     asan_arch_init(void);
+void     asan_instrument(const cs_insn *instr, GumStalkerIterator *iterator,
+                         gboolean begin);
+gboolean asan_shadow_ok(gsize address, gsize size);
+gboolean asan_batch_merge(gssize *lo, gssize *hi, gssize lo_new,
+                          gssize hi_new);
 void asan_exclude_module_by_symbol(gchar *symbol_name);
 
 #endif
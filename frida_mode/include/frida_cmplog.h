@@ -2,12 +2,14 @@
 #define _CMPLOG_H
 
 extern struct cmp_map *__afl_cmp_map;
+extern gboolean        cmplog_filter;
 
 void cmplog_config(void);
 void cmplog_init(void);
 
 /* Functions to be implemented by the different architectures */
-void cmplog_instrument(const cs_insn *instr, GumStalkerIterator *iterator);
+void cmplog_instrument(const cs_insn *instr, GumStalkerIterator *iterator,
+                       gboolean begin);
 
 gboolean cmplog_is_readable(guint64 addr, size_t size);
 
@@ -16,6 +16,7 @@ extern char    *instrument_coverage_unstable_filename;
 extern gboolean instrument_coverage_insn;
 extern char    *instrument_regs_filename;
 extern gboolean instrument_suppress;
+extern gboolean instrument_liveness;
 
 extern gboolean instrument_use_fixed_seed;
 extern guint64  instrument_fixed_seed;
@@ -5,6 +5,7 @@
 
 extern gboolean prefetch_enable;
 extern gboolean prefetch_backpatch;
+extern char    *prefetch_cache_file;
 
 void prefetch_config(void);
 void prefetch_init(void);
@@ -7,6 +7,7 @@ extern gboolean ranges_debug_maps;
 extern gboolean ranges_inst_libs;
 extern gboolean ranges_inst_jit;
 extern gboolean ranges_inst_dynamic_load;
+extern char    *ranges_inst_file;
 
 void ranges_config(void);
 void ranges_init(void);
@@ -20,4 +21,7 @@ void ranges_exclude();
 void ranges_add_include(GumMemoryRange *range);
 void ranges_add_exclude(GumMemoryRange *range);
 
+void ranges_add_block(GumAddress address);
+void ranges_reload(void);
+
 #endif
@@ -393,6 +393,15 @@ enum {
 
 typedef void (*seccomp_child_func_t)(int event_fd, void *ctx);
 
+typedef struct {
+  struct seccomp_notif  req;
+  GumReturnAddressArray frames;
+  char                  path[512];
+
+} seccomp_ring_entry_t;
+
+typedef void (*seccomp_ring_callback_t)(seccomp_ring_entry_t *entry);
+
 typedef void (*seccomp_filter_callback_t)(struct seccomp_notif      *req,
                                           struct seccomp_notif_resp *resp,
                                           GumReturnAddressArray     *frames);
@@ -404,8 +413,8 @@ void seccomp_atomic_wait(volatile bool *ptr, bool val);
 void seccomp_callback_parent(void);
 void seccomp_callback_initialize(void);
 
-void seccomp_child_run(seccomp_child_func_t child_func, void *ctx, pid_t *child,
-                       int *event_fd);
+void seccomp_child_run(seccomp_child_func_t child_func, void *ctx,
+                       bool share_vm, pid_t *child, int *event_fd);
 void seccomp_child_wait(int event_fd);
 
 int  seccomp_event_create(void);
@@ -418,6 +427,11 @@ void seccomp_filter_child_install(void);
 void seccomp_filter_run(int fd, seccomp_filter_callback_t callback);
 
 void seccomp_print(char *format, ...);
+void seccomp_print_flush(void);
+
+void seccomp_ring_start(seccomp_ring_callback_t callback);
+void seccomp_ring_push(struct seccomp_notif  *req,
+                       GumReturnAddressArray *frames);
 
 void seccomp_socket_create(int *sock);
 void seccomp_socket_send(int sockfd, int fd);
@@ -43,6 +43,7 @@ G_DECLARE_FINAL_TYPE(GumAflStalkerStats, gum_afl_stalker_stats, GUM,
 
 extern char   *stats_filename;
 extern guint64 stats_interval;
+extern guint64 stats_sample;
 
 void stats_config(void);
 void stats_init(void);
@@ -54,4 +55,9 @@ void stats_collect_arch(const cs_insn *instr, gboolean begin);
 void stats_write_arch(stats_data_t *data);
 void stats_on_fork(void);
 
+void stats_sample_init(void);
+void stats_sample_block(GumAddress address, gpointer code);
+void stats_sample_on_fork(void);
+void stats_sample_write(void);
+
 #endif
@@ -1,3 +1,4 @@
+#include <dlfcn.h>
 #include "frida-gumjs.h"
 
 #include "asan.h"
@@ -6,9 +7,12 @@
 
 static gboolean asan_enabled = FALSE;
 gboolean        asan_initialized = FALSE;
+gboolean        asan_batch = FALSE;
+static gsize    asan_shadow_offset = 0;
 
 void asan_config(void) {
   if (getenv("AFL_USE_FASAN") != NULL) { asan_enabled = TRUE; }
+  asan_batch = (getenv("AFL_FRIDA_ASAN_BATCH") != NULL);
 }
 
 void asan_init(void) {
@@ -18,7 +22,60 @@ void asan_init(void) {
   if (asan_enabled) {
     asan_arch_init();
     asan_initialized = TRUE;
+
+    /* Set by the DSO to where the shadow of address 0 is, fixed or not */
+    gsize *shadow =
+        dlsym(RTLD_DEFAULT, "__asan_shadow_memory_dynamic_address");
+    if (shadow != NULL) { asan_shadow_offset = *shadow; }
+  }
+
+  FOKF(cBLU "Instrumentation" cRST " - " cGRN "asan batch:" cYEL " [%c]",
+       asan_batch ? 'X' : ' ');
+  FOKF(cBLU "Instrumentation" cRST " - " cGRN "asan shadow:" cYEL
+            " [0x%016" G_GSIZE_MODIFIER "x]",
+       asan_shadow_offset);
+}
+
+/*
+ * The check the compiler inlines: each shadow byte is 0 if its 8 byte granule
+ * may be accessed in full, k if only its first k bytes may and negative if
+ * none may. Anything but a clean pass is left to __asan_loadN/__asan_storeN,
+ * which check again and report.
+ */
+gboolean asan_shadow_ok(gsize address, gsize size) {
+  gsize end = address + size;
+  gint8 shadow;
+
+  if (asan_shadow_offset == 0 || size == 0 || end < address) { return FALSE; }
+
+  for (gsize granule = address & ~(gsize)7; granule < end; granule += 8) {
+    shadow = *(gint8 *)GSIZE_TO_POINTER((granule >> 3) + asan_shadow_offset);
+    if (shadow == 0) { continue; }
+    if (shadow < 0) { return FALSE; }
+    if (MIN(end, granule + 8) - granule > (gsize)shadow) { return FALSE; }
   }
+
+  return TRUE;
+}
+
+/*
+ * Whether [lo, hi) may be merged with the range of offsets [*lo, *hi) already
+ * checked, if so the latter is widened. Only overlapping or adjacent ones are,
+ * the check must not cover bytes which aren't accessed.
+ */
+gboolean asan_batch_merge(gssize *lo, gssize *hi, gssize lo_new,
+                          gssize hi_new) {
+  if (*lo == *hi) {
+    *lo = lo_new;
+    *hi = hi_new;
+    return TRUE;
+  }
+
+  if (lo_new > *hi || hi_new < *lo) { return FALSE; }
+
+  *lo = MIN(*lo, lo_new);
+  *hi = MAX(*hi, hi_new);
+  return TRUE;
 }
 
 static gboolean asan_exclude_module(const GumModuleDetails *details,
@@ -4,7 +4,9 @@
 #include "util.h"
 
 #if defined(__arm__)
-void asan_instrument(const cs_insn *instr, GumStalkerIterator *iterator) {
+void asan_instrument(const cs_insn *instr, GumStalkerIterator *iterator,
+                     gboolean begin) {
+  UNUSED_PARAMETER(begin);
   UNUSED_PARAMETER(instr);
   UNUSED_PARAMETER(iterator);
   if (asan_initialized) {
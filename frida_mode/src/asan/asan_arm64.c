@@ -13,12 +13,24 @@ typedef struct {
 
 } asan_ctx_t;
 
-typedef void (*asan_loadN_t)(gsize address, uint8_t size);
-typedef void (*asan_storeN_t)(gsize address, uint8_t size);
+typedef struct {
+  arm64_reg base;
+  gssize    load_lo, load_hi;
+  gssize    store_lo, store_hi;
+
+} asan_batch_t;
+
+typedef void (*asan_loadN_t)(gsize address, gsize size);
+typedef void (*asan_storeN_t)(gsize address, gsize size);
 
 asan_loadN_t  asan_loadN = NULL;
 asan_storeN_t asan_storeN = NULL;
 
+/* The instructions of the block being compiled already checked by a batch */
+static __thread GumAddress batched[ASAN_BATCH_MAX];
+static __thread guint      batched_count = 0;
+static __thread csh        capstone = 0;
+
 static void asan_callout(GumCpuContext *ctx, gpointer user_data) {
   asan_ctx_t   *asan_ctx = (asan_ctx_t *)user_data;
   cs_arm64_op  *operand = &asan_ctx->operand;
@@ -35,6 +47,8 @@ static void asan_callout(GumCpuContext *ctx, gpointer user_data) {
 
   address = base + index + mem->disp;
 
+  if (asan_shadow_ok(address, asan_ctx->size)) { return; }
+
   if ((operand->access & CS_AC_READ) == CS_AC_READ) {
     asan_loadN(address, asan_ctx->size);
   }
@@ -44,15 +58,209 @@ static void asan_callout(GumCpuContext *ctx, gpointer user_data) {
   }
 }
 
-void asan_instrument(const cs_insn *instr, GumStalkerIterator *iterator) {
-  UNUSED_PARAMETER(iterator);
+static void asan_callout_batch(GumCpuContext *ctx, gpointer user_data) {
+  asan_batch_t *batch = (asan_batch_t *)user_data;
+  gsize         base = ctx_read_reg(ctx, batch->base);
+  gsize         address;
+  gsize         size;
+
+  if (batch->load_hi != batch->load_lo) {
+    address = base + batch->load_lo;
+    size = batch->load_hi - batch->load_lo;
+    if (!asan_shadow_ok(address, size)) { asan_loadN(address, size); }
+  }
 
-  cs_arm64     arm64 = instr->detail->arm64;
-  cs_arm64_op *operand;
-  asan_ctx_t  *ctx;
+  if (batch->store_hi != batch->store_lo) {
+    address = base + batch->store_lo;
+    size = batch->store_hi - batch->store_lo;
+    if (!asan_shadow_ok(address, size)) { asan_storeN(address, size); }
+  }
+}
+
+/* x0 to x30 as 1 to 31 (whichever half is named) and sp as 32, otherwise 0 */
+static guint asan_reg_family(arm64_reg reg) {
+  if (reg >= ARM64_REG_X0 && reg <= ARM64_REG_X28) {
+    return reg - ARM64_REG_X0 + 1;
+
+  } else if (reg >= ARM64_REG_W0 && reg <= ARM64_REG_W30) {
+    return reg - ARM64_REG_W0 + 1;
+
+  } else if (reg == ARM64_REG_X29) {
+    return 30;
+
+  } else if (reg == ARM64_REG_X30) {
+    return 31;
+
+  } else if (reg == ARM64_REG_SP || reg == ARM64_REG_WSP) {
+    return 32;
+
+  } else {
+    return 0;
+  }
+}
+
+/*
+ * The only memory operand of instr, if it is a plain [base, #disp] access
+ * which can go into a batch. Those writing back the base are left alone.
+ */
+static cs_arm64_op *asan_batch_operand(const cs_insn *instr) {
+  cs_arm64    *arm64 = &instr->detail->arm64;
+  cs_arm64_op *found = NULL;
+
+  if (arm64->writeback) { return NULL; }
+
+  for (uint8_t i = 0; i < arm64->op_count; i++) {
+    if (arm64->operands[i].type != ARM64_OP_MEM) { continue; }
+    if (found != NULL) { return NULL; }
+    found = &arm64->operands[i];
+  }
+
+  if (found == NULL || found->mem.index != ARM64_REG_INVALID ||
+      asan_reg_family(found->mem.base) == 0) {
+    return NULL;
+  }
+
+  return found;
+}
+
+static gboolean asan_batch_writes(const cs_insn *insn, guint family) {
+  cs_regs regs_read, regs_write;
+  uint8_t read_count, write_count;
+
+  if (cs_regs_access(capstone, insn, regs_read, &read_count, regs_write,
+                     &write_count) != CS_ERR_OK) {
+    return TRUE;
+  }
+
+  for (uint8_t i = 0; i < write_count; i++) {
+    if (asan_reg_family(regs_write[i]) == family) { return TRUE; }
+  }
+
+  return FALSE;
+}
+
+static gboolean asan_batch_ends(const cs_insn *insn) {
+  return cs_insn_group(capstone, insn, CS_GRP_JUMP) ||
+         cs_insn_group(capstone, insn, CS_GRP_CALL) ||
+         cs_insn_group(capstone, insn, CS_GRP_RET) ||
+         cs_insn_group(capstone, insn, CS_GRP_INT) ||
+         cs_insn_group(capstone, insn, CS_GRP_BRANCH_RELATIVE) ||
+         insn->id == ARM64_INS_SVC || insn->id == ARM64_INS_BRK;
+}
+
+static gboolean asan_is_batched(GumAddress address) {
+  for (guint i = 0; i < batched_count; i++) {
+    if (batched[i] == address) { return TRUE; }
+  }
+
+  return FALSE;
+}
+
+/* Forget the batched instructions up to address, the block is past them */
+static void asan_batched_prune(GumAddress address) {
+  guint count = 0;
+
+  for (guint i = 0; i < batched_count; i++) {
+    if (batched[i] > address) { batched[count++] = batched[i]; }
+  }
+
+  batched_count = count;
+}
+
+/*
+ * Starting at instr, collect the accesses relative to the same base register
+ * up to the next branch or write to it, so that a single callout before instr
+ * checks them all. Returns NULL if there is nothing to merge instr with.
+ */
+static asan_batch_t *asan_batch_collect(const cs_insn *instr,
+                                        cs_arm64_op   *operand) {
+  guint          family = asan_reg_family(operand->mem.base);
+  const uint8_t *code = GSIZE_TO_POINTER(instr->address);
+  uint64_t       address = instr->address;
+  gsize          page_size = gum_query_page_size();
+  size_t         size = page_size - (address & (page_size - 1));
+  asan_batch_t   batch = {.base = operand->mem.base};
+  cs_insn       *insn;
+  cs_arm64_op   *op;
+  gssize         lo, hi;
+  gboolean       merged;
+  guint          count = batched_count;
+  asan_batch_t  *ctx;
+
+  if (capstone == 0) {
+    if (cs_open(CS_ARCH_ARM64, GUM_DEFAULT_CS_ENDIAN, &capstone) !=
+        CS_ERR_OK) {
+      FFATAL("Failed to cs_open");
+    }
+
+    cs_option(capstone, CS_OPT_DETAIL, CS_OPT_ON);
+  }
+
+  insn = cs_malloc(capstone);
+
+  for (guint i = 0; i < ASAN_BATCH_MAX &&
+                    cs_disasm_iter(capstone, &code, &size, &address, insn);
+       i++) {
+    op = asan_batch_operand(insn);
+
+    if (op != NULL && asan_reg_family(op->mem.base) == family &&
+        !asan_is_batched(insn->address)) {
+      lo = op->mem.disp;
+      hi = lo + ctx_get_size(insn, &insn->detail->arm64.operands[0]);
+      merged = TRUE;
+
+      if ((op->access & CS_AC_READ) == CS_AC_READ) {
+        merged &= asan_batch_merge(&batch.load_lo, &batch.load_hi, lo, hi);
+      }
+
+      if ((op->access & CS_AC_WRITE) == CS_AC_WRITE) {
+        merged &= asan_batch_merge(&batch.store_lo, &batch.store_hi, lo, hi);
+      }
+
+      if (merged && i != 0 && batched_count < ASAN_BATCH_MAX) {
+        batched[batched_count++] = insn->address;
+      }
+    }
+
+    if (asan_batch_ends(insn) || asan_batch_writes(insn, family)) { break; }
+  }
+
+  cs_free(insn, 1);
+
+  if (batched_count == count) { return NULL; }
+
+  ctx = g_malloc0(sizeof(asan_batch_t));
+  memcpy(ctx, &batch, sizeof(asan_batch_t));
+  return ctx;
+}
+
+void asan_instrument(const cs_insn *instr, GumStalkerIterator *iterator,
+                     gboolean begin) {
+  cs_arm64      arm64 = instr->detail->arm64;
+  cs_arm64_op  *operand;
+  asan_ctx_t   *ctx;
+  asan_batch_t *batch;
 
   if (!asan_initialized) return;
 
+  if (begin) { batched_count = 0; }
+
+  if (asan_batch) {
+    gboolean skip = asan_is_batched(instr->address);
+    asan_batched_prune(instr->address);
+    if (skip) { return; }
+
+    operand = asan_batch_operand(instr);
+    if (operand != NULL) {
+      batch = asan_batch_collect(instr, operand);
+      if (batch != NULL) {
+        gum_stalker_iterator_put_callout(iterator, asan_callout_batch, batch,
+                                         g_free);
+        return;
+      }
+    }
+  }
+
   for (uint8_t i = 0; i < arm64.op_count; i++) {
     operand = &arm64.operands[i];
 
@@ -7,15 +7,57 @@
 
 #if defined(__x86_64__)
 
-typedef void (*asan_loadN_t)(uint64_t address, uint8_t size);
-typedef void (*asan_storeN_t)(uint64_t address, uint8_t size);
+typedef struct {
+  x86_reg base;
+  gssize  load_lo, load_hi;
+  gssize  store_lo, store_hi;
+
+} asan_batch_t;
+
+typedef void (*asan_loadN_t)(uint64_t address, gsize size);
+typedef void (*asan_storeN_t)(uint64_t address, gsize size);
 
 asan_loadN_t  asan_loadN = NULL;
 asan_storeN_t asan_storeN = NULL;
 
-static void asan_callout(GumCpuContext *ctx, gpointer user_data) {
-  UNUSED_PARAMETER(user_data);
+/* The instructions of the block being compiled already checked by a batch */
+static __thread GumAddress batched[ASAN_BATCH_MAX];
+static __thread guint      batched_count = 0;
+static __thread csh        capstone = 0;
+
+static const x86_reg asan_reg_families[][5] = {
+
+    {X86_REG_RAX, X86_REG_EAX, X86_REG_AX, X86_REG_AL, X86_REG_AH},
+    {X86_REG_RBX, X86_REG_EBX, X86_REG_BX, X86_REG_BL, X86_REG_BH},
+    {X86_REG_RCX, X86_REG_ECX, X86_REG_CX, X86_REG_CL, X86_REG_CH},
+    {X86_REG_RDX, X86_REG_EDX, X86_REG_DX, X86_REG_DL, X86_REG_DH},
+    {X86_REG_RSP, X86_REG_ESP, X86_REG_SP, X86_REG_SPL},
+    {X86_REG_RBP, X86_REG_EBP, X86_REG_BP, X86_REG_BPL},
+    {X86_REG_RSI, X86_REG_ESI, X86_REG_SI, X86_REG_SIL},
+    {X86_REG_RDI, X86_REG_EDI, X86_REG_DI, X86_REG_DIL},
+    {X86_REG_R8, X86_REG_R8D, X86_REG_R8W, X86_REG_R8B},
+    {X86_REG_R9, X86_REG_R9D, X86_REG_R9W, X86_REG_R9B},
+    {X86_REG_R10, X86_REG_R10D, X86_REG_R10W, X86_REG_R10B},
+    {X86_REG_R11, X86_REG_R11D, X86_REG_R11W, X86_REG_R11B},
+    {X86_REG_R12, X86_REG_R12D, X86_REG_R12W, X86_REG_R12B},
+    {X86_REG_R13, X86_REG_R13D, X86_REG_R13W, X86_REG_R13B},
+    {X86_REG_R14, X86_REG_R14D, X86_REG_R14W, X86_REG_R14B},
+    {X86_REG_R15, X86_REG_R15D, X86_REG_R15W, X86_REG_R15B},
+
+};
+
+static void asan_check(gsize address, gsize size, uint8_t access) {
+  if (asan_shadow_ok(address, size)) { return; }
+
+  if (access == CS_AC_READ) {
+    asan_loadN(address, size);
 
+  } else if (access == CS_AC_WRITE) {
+    asan_storeN(address, size);
+  }
+}
+
+static void asan_callout(GumCpuContext *ctx, gpointer user_data) {
   cs_x86_op  *operand = (cs_x86_op *)user_data;
   x86_op_mem *mem = &operand->mem;
   gsize       base = 0;
@@ -30,24 +72,201 @@ static void asan_callout(GumCpuContext *ctx, gpointer user_data) {
   address = base + (mem->scale * index) + mem->disp;
   size = operand->size;
 
-  if (operand->access == CS_AC_READ) {
-    asan_loadN(address, size);
+  asan_check(address, size, operand->access);
+}
 
-  } else if (operand->access == CS_AC_WRITE) {
-    asan_storeN(address, size);
+static void asan_callout_batch(GumCpuContext *ctx, gpointer user_data) {
+  asan_batch_t *batch = (asan_batch_t *)user_data;
+  gsize         base = ctx_read_reg(ctx, batch->base);
+
+  if (batch->load_hi != batch->load_lo) {
+    asan_check(base + batch->load_lo, batch->load_hi - batch->load_lo,
+               CS_AC_READ);
+  }
+
+  if (batch->store_hi != batch->store_lo) {
+    asan_check(base + batch->store_lo, batch->store_hi - batch->store_lo,
+               CS_AC_WRITE);
+  }
+}
+
+static guint asan_reg_family(x86_reg reg) {
+  for (guint i = 0; i < G_N_ELEMENTS(asan_reg_families); i++) {
+    for (guint j = 0; j < G_N_ELEMENTS(asan_reg_families[i]); j++) {
+      if (asan_reg_families[i][j] == X86_REG_INVALID) { break; }
+      if (asan_reg_families[i][j] == reg) { return i + 1; }
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * The only memory operand of instr, if it is a plain [base + disp] access
+ * which can go into a batch.
+ */
+static cs_x86_op *asan_batch_operand(const cs_insn *instr) {
+  cs_x86    *x86 = &instr->detail->x86;
+  cs_x86_op *found = NULL;
+
+  if (instr->id == X86_INS_LEA || instr->id == X86_INS_NOP) { return NULL; }
+
+  /* String instructions access rcx elements */
+  if (x86->prefix[0] != 0) { return NULL; }
+
+  for (uint8_t i = 0; i < x86->op_count; i++) {
+    if (x86->operands[i].type != X86_OP_MEM) { continue; }
+    if (found != NULL) { return NULL; }
+    found = &x86->operands[i];
+  }
+
+  if (found == NULL ||
+      (found->access != CS_AC_READ && found->access != CS_AC_WRITE) ||
+      found->mem.segment != X86_REG_INVALID ||
+      found->mem.index != X86_REG_INVALID ||
+      asan_reg_family(found->mem.base) == 0) {
+    return NULL;
+  }
+
+  return found;
+}
+
+static gboolean asan_batch_writes(const cs_insn *insn, guint family) {
+  cs_regs regs_read, regs_write;
+  uint8_t read_count, write_count;
+
+  if (cs_regs_access(capstone, insn, regs_read, &read_count, regs_write,
+                     &write_count) != CS_ERR_OK) {
+    return TRUE;
+  }
+
+  for (uint8_t i = 0; i < write_count; i++) {
+    if (asan_reg_family(regs_write[i]) == family) { return TRUE; }
+  }
+
+  return FALSE;
+}
+
+static gboolean asan_batch_ends(const cs_insn *insn) {
+  return cs_insn_group(capstone, insn, CS_GRP_JUMP) ||
+         cs_insn_group(capstone, insn, CS_GRP_CALL) ||
+         cs_insn_group(capstone, insn, CS_GRP_RET) ||
+         cs_insn_group(capstone, insn, CS_GRP_INT) ||
+         cs_insn_group(capstone, insn, CS_GRP_IRET) ||
+         insn->id == X86_INS_SYSCALL || insn->id == X86_INS_SYSENTER;
+}
+
+static gboolean asan_is_batched(GumAddress address) {
+  for (guint i = 0; i < batched_count; i++) {
+    if (batched[i] == address) { return TRUE; }
   }
+
+  return FALSE;
 }
 
-void asan_instrument(const cs_insn *instr, GumStalkerIterator *iterator) {
-  UNUSED_PARAMETER(iterator);
+/* Forget the batched instructions up to address, the block is past them */
+static void asan_batched_prune(GumAddress address) {
+  guint count = 0;
 
-  cs_x86      x86 = instr->detail->x86;
-  cs_x86_op  *operand;
-  x86_op_mem *mem;
-  cs_x86_op  *ctx;
+  for (guint i = 0; i < batched_count; i++) {
+    if (batched[i] > address) { batched[count++] = batched[i]; }
+  }
+
+  batched_count = count;
+}
+
+/*
+ * Starting at instr, collect the accesses relative to the same base register
+ * up to the next branch or write to it, so that a single callout before instr
+ * checks them all. Returns NULL if there is nothing to merge instr with.
+ */
+static asan_batch_t *asan_batch_collect(const cs_insn *instr,
+                                        cs_x86_op     *operand) {
+  guint          family = asan_reg_family(operand->mem.base);
+  const uint8_t *code = GSIZE_TO_POINTER(instr->address);
+  uint64_t       address = instr->address;
+  gsize          page_size = gum_query_page_size();
+  size_t         size = page_size - (address & (page_size - 1));
+  asan_batch_t   batch = {.base = operand->mem.base};
+  cs_insn       *insn;
+  cs_x86_op     *op;
+  gssize         lo, hi;
+  gboolean       merged;
+  guint          count = batched_count;
+  asan_batch_t  *ctx;
+
+  if (capstone == 0) {
+    if (cs_open(CS_ARCH_X86, GUM_CPU_MODE, &capstone) != CS_ERR_OK) {
+      FFATAL("Failed to cs_open");
+    }
+
+    cs_option(capstone, CS_OPT_DETAIL, CS_OPT_ON);
+  }
+
+  insn = cs_malloc(capstone);
+
+  for (guint i = 0; i < ASAN_BATCH_MAX &&
+                    cs_disasm_iter(capstone, &code, &size, &address, insn);
+       i++) {
+    op = asan_batch_operand(insn);
+
+    if (op != NULL && asan_reg_family(op->mem.base) == family &&
+        !asan_is_batched(insn->address)) {
+      lo = op->mem.disp;
+      hi = lo + op->size;
+
+      if (op->access == CS_AC_WRITE) {
+        merged = asan_batch_merge(&batch.store_lo, &batch.store_hi, lo, hi);
+
+      } else {
+        merged = asan_batch_merge(&batch.load_lo, &batch.load_hi, lo, hi);
+      }
+
+      if (merged && i != 0 && batched_count < ASAN_BATCH_MAX) {
+        batched[batched_count++] = insn->address;
+      }
+    }
+
+    if (asan_batch_ends(insn) || asan_batch_writes(insn, family)) { break; }
+  }
+
+  cs_free(insn, 1);
+
+  if (batched_count == count) { return NULL; }
+
+  ctx = g_malloc0(sizeof(asan_batch_t));
+  memcpy(ctx, &batch, sizeof(asan_batch_t));
+  return ctx;
+}
+
+void asan_instrument(const cs_insn *instr, GumStalkerIterator *iterator,
+                     gboolean begin) {
+  cs_x86        x86 = instr->detail->x86;
+  cs_x86_op    *operand;
+  x86_op_mem   *mem;
+  cs_x86_op    *ctx;
+  asan_batch_t *batch;
 
   if (!asan_initialized) return;
 
+  if (begin) { batched_count = 0; }
+
+  if (asan_batch) {
+    gboolean skip = asan_is_batched(instr->address);
+    asan_batched_prune(instr->address);
+    if (skip) { return; }
+
+    operand = asan_batch_operand(instr);
+    if (operand != NULL) {
+      batch = asan_batch_collect(instr, operand);
+      if (batch != NULL) {
+        gum_stalker_iterator_put_callout(iterator, asan_callout_batch, batch,
+                                         g_free);
+        return;
+      }
+    }
+  }
+
   if (instr->id == X86_INS_LEA) return;
 
   if (instr->id == X86_INS_NOP) return;
@@ -38,7 +38,9 @@ static void asan_callout(GumCpuContext *ctx, gpointer user_data) {
   }
 }
 
-void asan_instrument(const cs_insn *instr, GumStalkerIterator *iterator) {
+void asan_instrument(const cs_insn *instr, GumStalkerIterator *iterator,
+                     gboolean begin) {
+  UNUSED_PARAMETER(begin);
   UNUSED_PARAMETER(iterator);
 
   cs_x86      x86 = instr->detail->x86;
@@ -13,6 +13,7 @@
 #define MAX_MEMFD_SIZE (64UL << 10)
 
 extern struct cmp_map *__afl_cmp_map;
+gboolean               cmplog_filter = TRUE;
 static GArray         *cmplog_ranges = NULL;
 static GHashTable     *hash_yes = NULL;
 static GHashTable     *hash_no = NULL;
@@ -53,6 +54,7 @@ static void cmplog_get_ranges(void) {
 }
 
 void cmplog_config(void) {
+  cmplog_filter = (getenv("AFL_FRIDA_CMPLOG_NO_FILTER") == NULL);
 }
 
 void cmplog_init(void) {
@@ -61,6 +63,9 @@ void cmplog_init(void) {
 
   if (__afl_cmp_map == NULL) { return; }
 
+  FOKF(cBLU "Instrumentation" cRST " - " cGRN "cmplog filter:" cYEL " [%c]",
+       cmplog_filter ? 'X' : ' ');
+
   cmplog_get_ranges();
 
   FVERBOSE("Cmplog Ranges");
@@ -4,9 +4,11 @@
 #include "util.h"
 
 #if defined(__arm__)
-void cmplog_instrument(const cs_insn *instr, GumStalkerIterator *iterator) {
+void cmplog_instrument(const cs_insn *instr, GumStalkerIterator *iterator,
+                       gboolean begin) {
   UNUSED_PARAMETER(instr);
   UNUSED_PARAMETER(iterator);
+  UNUSED_PARAMETER(begin);
   if (__afl_cmp_map == NULL) { return; }
   FFATAL("CMPLOG mode not supported on this architecture");
 }
@@ -29,6 +29,20 @@ typedef struct {
 
 } cmplog_pair_ctx_t;
 
+  #define CMPLOG_FAMILY_SP 32
+  #define CMPLOG_STEP_MAX 16
+
+/*
+ * What the block compiled so far tells us about the registers, one bit per
+ * register family: whether it holds a value which can't depend on the input
+ * (set from an immediate or a pc relative address), whether it was only
+ * stepped by a constant (a loop counter) and whether it was written at all.
+ */
+static __thread guint64 const_regs = 0;
+static __thread guint64 step_regs = 0;
+static __thread guint64 written_regs = 0;
+static __thread csh     capstone = 0;
+
 static gboolean cmplog_read_mem(GumCpuContext *ctx, uint8_t size,
                                 arm64_op_mem *mem, gsize *val) {
   gsize base = 0;
@@ -222,6 +236,184 @@ static void cmplog_instrument_cmp_sub_put_callout(GumStalkerIterator *iterator,
                                    g_free);
 }
 
+static guint cmplog_reg_family(arm64_reg reg) {
+  if (reg >= ARM64_REG_X0 && reg <= ARM64_REG_X28) {
+    return reg - ARM64_REG_X0 + 1;
+
+  } else if (reg >= ARM64_REG_W0 && reg <= ARM64_REG_W30) {
+    return reg - ARM64_REG_W0 + 1;
+
+  } else if (reg == ARM64_REG_X29) {
+    return 30;
+
+  } else if (reg == ARM64_REG_X30) {
+    return 31;
+
+  } else if (reg == ARM64_REG_SP || reg == ARM64_REG_WSP) {
+    return CMPLOG_FAMILY_SP;
+
+  } else {
+    return 0;
+  }
+}
+
+static gboolean cmplog_is_const(cs_arm64_op *operand) {
+  guint family;
+
+  if (operand->type == ARM64_OP_IMM) { return TRUE; }
+  if (operand->type != ARM64_OP_REG) { return FALSE; }
+
+  if (operand->reg == ARM64_REG_XZR || operand->reg == ARM64_REG_WZR) {
+    return TRUE;
+  }
+
+  family = cmplog_reg_family(operand->reg);
+  if (family == 0) { return FALSE; }
+
+  return (const_regs & (1ULL << family)) != 0;
+}
+
+static gboolean cmplog_is_step(cs_arm64_op *operand) {
+  guint family;
+
+  if (operand->type != ARM64_OP_REG) { return FALSE; }
+
+  family = cmplog_reg_family(operand->reg);
+  if (family == 0) { return FALSE; }
+
+  return (step_regs & (1ULL << family)) != 0;
+}
+
+/*
+ * Whether the compare can't tell us anything about the input: both sides are
+ * constant, it is between a register and itself, it involves the stack
+ * pointer, or a loop counter is checked against its bound.
+ */
+static gboolean cmplog_filtered(cs_arm64_op *operand1, cs_arm64_op *operand2) {
+  guint family1 = 0, family2 = 0;
+
+  if (operand1->type == ARM64_OP_REG) {
+    family1 = cmplog_reg_family(operand1->reg);
+  }
+
+  if (operand2->type == ARM64_OP_REG) {
+    family2 = cmplog_reg_family(operand2->reg);
+  }
+
+  if (family1 == CMPLOG_FAMILY_SP || family2 == CMPLOG_FAMILY_SP) {
+    return TRUE;
+  }
+
+  if (family1 != 0 && family1 == family2) { return TRUE; }
+
+  if (cmplog_is_const(operand1) && cmplog_is_const(operand2)) { return TRUE; }
+
+  if (cmplog_is_step(operand1) && cmplog_is_const(operand2)) { return TRUE; }
+  if (cmplog_is_step(operand2) && cmplog_is_const(operand1)) { return TRUE; }
+
+  return FALSE;
+}
+
+/*
+ * A register stepped by a small constant which wasn't otherwise written to in
+ * the block is most likely a loop counter. Stepping a value loaded in the
+ * block (e.g. subtracting '0' from a digit) doesn't count.
+ */
+static guint64 cmplog_step(guint family, int64_t imm) {
+  if (const_regs & (1ULL << family)) { return 0; }
+  if (imm < -CMPLOG_STEP_MAX || imm > CMPLOG_STEP_MAX) { return 0; }
+  if ((written_regs & ~step_regs) & (1ULL << family)) { return 0; }
+  return 1ULL << family;
+}
+
+/* Update what we know about the registers instr writes to */
+static void cmplog_track(const cs_insn *instr) {
+  cs_arm64    *arm64 = &instr->detail->arm64;
+  cs_arm64_op *ops = arm64->operands;
+  cs_regs      regs_read, regs_write;
+  uint8_t      read_count, write_count;
+  guint        family = 0;
+  guint64      bit, is_const = 0, is_step = 0;
+
+  if (cs_regs_access(capstone, instr, regs_read, &read_count, regs_write,
+                     &write_count) != CS_ERR_OK) {
+    const_regs = 0;
+    step_regs = 0;
+    written_regs = G_MAXUINT64;
+    return;
+  }
+
+  if (arm64->op_count != 0 && ops[0].type == ARM64_OP_REG) {
+    family = cmplog_reg_family(ops[0].reg);
+  }
+
+  bit = 1ULL << family;
+
+  if (family != 0 && family != CMPLOG_FAMILY_SP) {
+    switch (instr->id) {
+      case ARM64_INS_MOV:
+      case ARM64_INS_MOVZ:
+      case ARM64_INS_MOVN:
+        if (arm64->op_count == 2 && cmplog_is_const(&ops[1])) {
+          is_const = bit;
+        }
+
+        break;
+
+      case ARM64_INS_MOVK:
+        is_const = const_regs & bit;
+        break;
+
+      case ARM64_INS_ADR:
+      case ARM64_INS_ADRP:
+        is_const = bit;
+        break;
+
+      case ARM64_INS_ADD:
+      case ARM64_INS_SUB:
+        if (arm64->op_count != 3 || ops[2].type != ARM64_OP_IMM ||
+            ops[2].shift.type != ARM64_SFT_INVALID) {
+          break;
+        }
+
+        if (cmplog_is_const(&ops[1])) {
+          is_const = bit;
+
+        } else if (ops[1].type == ARM64_OP_REG &&
+                   cmplog_reg_family(ops[1].reg) == family) {
+          is_step = cmplog_step(
+              family, instr->id == ARM64_INS_ADD ? ops[2].imm : -ops[2].imm);
+        }
+
+        break;
+
+      case ARM64_INS_EOR:
+      case ARM64_INS_SUBS:
+        /* eor xN, xM, xM */
+        if (arm64->op_count == 3 && ops[1].type == ARM64_OP_REG &&
+            ops[2].type == ARM64_OP_REG && ops[1].reg == ops[2].reg) {
+          is_const = bit;
+        }
+
+        break;
+
+      default:
+        break;
+    }
+  }
+
+  for (uint8_t i = 0; i < write_count; i++) {
+    family = cmplog_reg_family(regs_write[i]);
+    if (family == 0) { continue; }
+    const_regs &= ~(1ULL << family);
+    step_regs &= ~(1ULL << family);
+    written_regs |= 1ULL << family;
+  }
+
+  const_regs |= is_const;
+  step_regs |= is_step;
+}
+
 static void cmplog_instrument_cmp_sub(const cs_insn      *instr,
                                       GumStalkerIterator *iterator) {
   cs_arm64     arm64 = instr->detail->arm64;
@@ -270,16 +462,36 @@ static void cmplog_instrument_cmp_sub(const cs_insn      *instr,
   if (operand1->type == ARM64_OP_INVALID) return;
   if (operand2->type == ARM64_OP_INVALID) return;
 
+  if (cmplog_filter && cmplog_filtered(operand1, operand2)) { return; }
+
   size = ctx_get_size(instr, &arm64.operands[0]);
 
   cmplog_instrument_cmp_sub_put_callout(iterator, operand1, operand2, size);
 }
 
-void cmplog_instrument(const cs_insn *instr, GumStalkerIterator *iterator) {
+void cmplog_instrument(const cs_insn *instr, GumStalkerIterator *iterator,
+                       gboolean begin) {
   if (__afl_cmp_map == NULL) return;
 
+  if (begin) {
+    const_regs = 0;
+    step_regs = 0;
+    written_regs = 0;
+  }
+
+  if (cmplog_filter && capstone == 0) {
+    if (cs_open(CS_ARCH_ARM64, GUM_DEFAULT_CS_ENDIAN, &capstone) !=
+        CS_ERR_OK) {
+      FFATAL("Failed to cs_open");
+    }
+
+    cs_option(capstone, CS_OPT_DETAIL, CS_OPT_ON);
+  }
+
   cmplog_instrument_call(instr, iterator);
   cmplog_instrument_cmp_sub(instr, iterator);
+
+  if (cmplog_filter) { cmplog_track(instr); }
 }
 
 #endif
@@ -28,6 +28,43 @@ typedef struct {
 
 } cmplog_pair_ctx_t;
 
+/*
+ * What the block compiled so far tells us about the registers, one bit per
+ * register family: whether it holds a value which can't depend on the input
+ * (set from an immediate or a rip relative address), whether it holds the
+ * stack guard or another thread local, whether it was only stepped by a
+ * constant (a loop counter) and whether it was written at all.
+ */
+static __thread guint32 const_regs = 0;
+static __thread guint32 guard_regs = 0;
+static __thread guint32 step_regs = 0;
+static __thread guint32 written_regs = 0;
+static __thread csh     capstone = 0;
+
+static const x86_reg cmplog_reg_families[][5] = {
+
+    {X86_REG_RAX, X86_REG_EAX, X86_REG_AX, X86_REG_AL, X86_REG_AH},
+    {X86_REG_RBX, X86_REG_EBX, X86_REG_BX, X86_REG_BL, X86_REG_BH},
+    {X86_REG_RCX, X86_REG_ECX, X86_REG_CX, X86_REG_CL, X86_REG_CH},
+    {X86_REG_RDX, X86_REG_EDX, X86_REG_DX, X86_REG_DL, X86_REG_DH},
+    {X86_REG_RSP, X86_REG_ESP, X86_REG_SP, X86_REG_SPL},
+    {X86_REG_RBP, X86_REG_EBP, X86_REG_BP, X86_REG_BPL},
+    {X86_REG_RSI, X86_REG_ESI, X86_REG_SI, X86_REG_SIL},
+    {X86_REG_RDI, X86_REG_EDI, X86_REG_DI, X86_REG_DIL},
+    {X86_REG_R8, X86_REG_R8D, X86_REG_R8W, X86_REG_R8B},
+    {X86_REG_R9, X86_REG_R9D, X86_REG_R9W, X86_REG_R9B},
+    {X86_REG_R10, X86_REG_R10D, X86_REG_R10W, X86_REG_R10B},
+    {X86_REG_R11, X86_REG_R11D, X86_REG_R11W, X86_REG_R11B},
+    {X86_REG_R12, X86_REG_R12D, X86_REG_R12W, X86_REG_R12B},
+    {X86_REG_R13, X86_REG_R13D, X86_REG_R13W, X86_REG_R13B},
+    {X86_REG_R14, X86_REG_R14D, X86_REG_R14W, X86_REG_R14B},
+    {X86_REG_R15, X86_REG_R15D, X86_REG_R15W, X86_REG_R15B},
+
+};
+
+  #define CMPLOG_FAMILY_RSP 5
+  #define CMPLOG_STEP_MAX 16
+
 static gboolean cmplog_read_mem(GumCpuContext *ctx, uint8_t size,
                                 x86_op_mem *mem, gsize *val) {
   gsize base = 0;
@@ -207,6 +244,194 @@ static void cmplog_instrument_cmp_sub_put_callout(GumStalkerIterator *iterator,
                                    g_free);
 }
 
+static guint cmplog_reg_family(x86_reg reg) {
+  for (guint i = 0; i < G_N_ELEMENTS(cmplog_reg_families); i++) {
+    for (guint j = 0; j < G_N_ELEMENTS(cmplog_reg_families[i]); j++) {
+      if (cmplog_reg_families[i][j] == X86_REG_INVALID) { break; }
+      if (cmplog_reg_families[i][j] == reg) { return i + 1; }
+    }
+  }
+
+  return 0;
+}
+
+static gboolean cmplog_is_const(cs_x86_op *operand) {
+  guint family;
+
+  if (operand->type == X86_OP_IMM) { return TRUE; }
+  if (operand->type != X86_OP_REG) { return FALSE; }
+
+  family = cmplog_reg_family(operand->reg);
+  if (family == 0) { return FALSE; }
+
+  return (const_regs & (1U << family)) != 0;
+}
+
+static gboolean cmplog_is_step(cs_x86_op *operand) {
+  guint family;
+
+  if (operand->type != X86_OP_REG) { return FALSE; }
+
+  family = cmplog_reg_family(operand->reg);
+  if (family == 0) { return FALSE; }
+
+  return (step_regs & (1U << family)) != 0;
+}
+
+static gboolean cmplog_is_guard(cs_x86_op *operand) {
+  guint family;
+
+  if (operand->type != X86_OP_REG) { return FALSE; }
+
+  family = cmplog_reg_family(operand->reg);
+  if (family == 0) { return FALSE; }
+
+  return (guard_regs & (1U << family)) != 0;
+}
+
+/*
+ * Whether the compare can't tell us anything about the input: both sides are
+ * constant, it is between a register and itself, it involves the stack
+ * pointer or the stack guard, or a loop counter is checked against its bound.
+ */
+static gboolean cmplog_filtered(cs_x86_op *operand1, cs_x86_op *operand2) {
+  guint family1 = 0, family2 = 0;
+
+  if (operand1->type == X86_OP_REG) {
+    family1 = cmplog_reg_family(operand1->reg);
+  }
+
+  if (operand2->type == X86_OP_REG) {
+    family2 = cmplog_reg_family(operand2->reg);
+  }
+
+  if (family1 == CMPLOG_FAMILY_RSP || family2 == CMPLOG_FAMILY_RSP) {
+    return TRUE;
+  }
+
+  if (family1 != 0 && family1 == family2) { return TRUE; }
+
+  if (cmplog_is_guard(operand1) || cmplog_is_guard(operand2)) { return TRUE; }
+
+  if (cmplog_is_const(operand1) && cmplog_is_const(operand2)) { return TRUE; }
+
+  if (cmplog_is_step(operand1) && cmplog_is_const(operand2)) { return TRUE; }
+  if (cmplog_is_step(operand2) && cmplog_is_const(operand1)) { return TRUE; }
+
+  return FALSE;
+}
+
+/*
+ * A register stepped by a small constant which wasn't otherwise written to in
+ * the block is most likely a loop counter. Stepping a value loaded in the
+ * block (e.g. subtracting '0' from a digit) doesn't count.
+ */
+static guint32 cmplog_step(guint family, int64_t imm) {
+  if (const_regs & (1U << family)) { return 0; }
+  if (imm < -CMPLOG_STEP_MAX || imm > CMPLOG_STEP_MAX) { return 0; }
+  if ((written_regs & ~step_regs) & (1U << family)) { return 0; }
+  return 1U << family;
+}
+
+/* Update what we know about the registers instr writes to */
+static void cmplog_track(const cs_insn *instr) {
+  cs_x86    *x86 = &instr->detail->x86;
+  cs_x86_op *dst = &x86->operands[0];
+  cs_x86_op *src = &x86->operands[1];
+  cs_regs    regs_read, regs_write;
+  uint8_t    read_count, write_count;
+  guint      family = 0;
+  guint32    is_const = 0, is_guard = 0, is_step = 0;
+
+  if (cs_regs_access(capstone, instr, regs_read, &read_count, regs_write,
+                     &write_count) != CS_ERR_OK) {
+    const_regs = 0;
+    guard_regs = 0;
+    step_regs = 0;
+    written_regs = G_MAXUINT32;
+    return;
+  }
+
+  if (x86->op_count != 0 && dst->type == X86_OP_REG) {
+    family = cmplog_reg_family(dst->reg);
+  }
+
+  if (family != 0 && x86->op_count == 2) {
+    guint32 bit = 1U << family;
+
+    switch (instr->id) {
+      case X86_INS_MOV:
+      case X86_INS_MOVABS:
+        /* Partial writes keep the rest of the register */
+        if (cmplog_is_const(src) && (dst->size >= 4 || (const_regs & bit))) {
+          is_const = bit;
+
+        } else if (src->type == X86_OP_MEM &&
+                   src->mem.segment != X86_REG_INVALID && dst->size == 8) {
+          is_guard = bit;
+        }
+
+        break;
+
+      case X86_INS_LEA:
+        if (src->mem.base == X86_REG_RIP && src->mem.index == X86_REG_INVALID) {
+          is_const = bit;
+        }
+
+        break;
+
+      case X86_INS_XOR:
+      case X86_INS_SUB:
+        if (src->type == X86_OP_REG && cmplog_reg_family(src->reg) == family) {
+          is_const = bit;
+
+        } else if (src->type == X86_OP_IMM && (const_regs & bit)) {
+          is_const = bit;
+
+        } else if (src->type == X86_OP_IMM && instr->id == X86_INS_SUB) {
+          is_step = cmplog_step(family, -src->imm);
+        }
+
+        break;
+
+      case X86_INS_ADD:
+        if (src->type == X86_OP_IMM && (const_regs & bit)) {
+          is_const = bit;
+
+        } else if (src->type == X86_OP_IMM) {
+          is_step = cmplog_step(family, src->imm);
+        }
+
+        break;
+
+      default:
+        break;
+    }
+
+  } else if (family != 0 && x86->op_count == 1 &&
+             (instr->id == X86_INS_INC || instr->id == X86_INS_DEC)) {
+    if (const_regs & (1U << family)) {
+      is_const = 1U << family;
+
+    } else {
+      is_step = cmplog_step(family, 1);
+    }
+  }
+
+  for (uint8_t i = 0; i < write_count; i++) {
+    family = cmplog_reg_family(regs_write[i]);
+    if (family == 0) { continue; }
+    const_regs &= ~(1U << family);
+    guard_regs &= ~(1U << family);
+    step_regs &= ~(1U << family);
+    written_regs |= 1U << family;
+  }
+
+  const_regs |= is_const;
+  guard_regs |= is_guard;
+  step_regs |= is_step;
+}
+
 static void cmplog_instrument_cmp_sub(const cs_insn      *instr,
                                       GumStalkerIterator *iterator) {
   cs_x86     x86 = instr->detail->x86;
@@ -241,14 +466,43 @@ static void cmplog_instrument_cmp_sub(const cs_insn      *instr,
   /* Both operands are the same size */
   if (operand1->size == 1) { return; }
 
+  /* We would read these relative to the wrong base */
+  if ((operand1->type == X86_OP_MEM) &&
+      (operand1->mem.segment != X86_REG_INVALID))
+    return;
+
+  if ((operand2->type == X86_OP_MEM) &&
+      (operand2->mem.segment != X86_REG_INVALID))
+    return;
+
+  if (cmplog_filter && cmplog_filtered(operand1, operand2)) { return; }
+
   cmplog_instrument_cmp_sub_put_callout(iterator, operand1, operand2);
 }
 
-void cmplog_instrument(const cs_insn *instr, GumStalkerIterator *iterator) {
+void cmplog_instrument(const cs_insn *instr, GumStalkerIterator *iterator,
+                       gboolean begin) {
   if (__afl_cmp_map == NULL) return;
 
+  if (begin) {
+    const_regs = 0;
+    guard_regs = 0;
+    step_regs = 0;
+    written_regs = 0;
+  }
+
+  if (cmplog_filter && capstone == 0) {
+    if (cs_open(CS_ARCH_X86, GUM_CPU_MODE, &capstone) != CS_ERR_OK) {
+      FFATAL("Failed to cs_open");
+    }
+
+    cs_option(capstone, CS_OPT_DETAIL, CS_OPT_ON);
+  }
+
   cmplog_instrument_call(instr, iterator);
   cmplog_instrument_cmp_sub(instr, iterator);
+
+  if (cmplog_filter) { cmplog_track(instr); }
 }
 
 #endif
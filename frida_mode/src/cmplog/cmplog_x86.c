@@ -248,7 +248,9 @@ static void cmplog_instrument_cmp_sub(const cs_insn      *instr,
   cmplog_instrument_cmp_sub_put_callout(iterator, operand1, operand2);
 }
 
-void cmplog_instrument(const cs_insn *instr, GumStalkerIterator *iterator) {
+void cmplog_instrument(const cs_insn *instr, GumStalkerIterator *iterator,
+                       gboolean begin) {
+  UNUSED_PARAMETER(begin);
   if (__afl_cmp_map == NULL) return;
 
   cmplog_instrument_call(instr, iterator);
@@ -28,6 +28,7 @@ gboolean instrument_unique = false;
 guint64  instrument_hash_zero = 0;
 guint64  instrument_hash_seed = 0;
 gboolean instrument_suppress = false;
+gboolean instrument_liveness = true;
 
 gboolean instrument_use_fixed_seed = FALSE;
 guint64  instrument_fixed_seed = 0;
@@ -195,6 +196,9 @@ static void instrument_basic_block(GumStalkerIterator *iterator,
       prefetch_write(GSIZE_TO_POINTER(instr->address));
 #endif
 
+      ranges_add_block(GUM_ADDRESS(instr->address));
+      stats_sample_block(GUM_ADDRESS(instr->address), instrument_cur(output));
+
       if (likely(!excluded)) {
         if (likely(instrument_optimize)) {
           instrument_coverage_optimize(instr, output);
@@ -217,8 +221,8 @@ static void instrument_basic_block(GumStalkerIterator *iterator,
     }
 
     if (likely(!excluded)) {
-      asan_instrument(instr, iterator);
-      cmplog_instrument(instr, iterator);
+      asan_instrument(instr, iterator, begin);
+      cmplog_instrument(instr, iterator, begin);
     }
 
     instrument_cache(instr, output);
@@ -248,6 +252,7 @@ void instrument_config(void) {
   instrument_coverage_insn = (getenv("AFL_FRIDA_INST_INSN") != NULL);
   instrument_regs_filename = getenv("AFL_FRIDA_INST_REGS_FILE");
   instrument_suppress = (getenv("AFL_FRIDA_INST_NO_SUPPRESS") == NULL);
+  instrument_liveness = (getenv("AFL_FRIDA_INST_NO_LIVENESS") == NULL);
 
   instrument_debug_config();
   instrument_coverage_config();
@@ -279,6 +284,8 @@ void instrument_init(void) {
 
   FOKF(cBLU "Instrumentation" cRST " - " cGRN "suppression:" cYEL " [%c]",
        instrument_suppress ? 'X' : ' ');
+  FOKF(cBLU "Instrumentation" cRST " - " cGRN "liveness:" cYEL " [%c]",
+       instrument_liveness ? 'X' : ' ');
 
   if (instrument_tracing && instrument_optimize) {
     WARNF("AFL_FRIDA_INST_TRACE implies AFL_FRIDA_INST_NO_OPTIMIZE");
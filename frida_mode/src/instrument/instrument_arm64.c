@@ -18,9 +18,11 @@
 
 #if defined(__aarch64__)
 
-gboolean           instrument_cache_enabled = FALSE;
-gsize              instrument_cache_size = 0;
 static GHashTable *coverage_blocks = NULL;
+static __thread csh capstone_live = 0;
+
+  /* Instructions looked at for liveness */
+  #define LIVE_MAX_INSNS 32
 
 __attribute__((aligned(0x1000))) static guint8 area_ptr_dummy[MAP_INITIAL_SIZE];
 
@@ -252,10 +254,10 @@ static void instrument_coverage_switch(GumStalkerObserver *self,
                                        gpointer *target) {
   UNUSED_PARAMETER(self);
   UNUSED_PARAMETER(from_address);
-  UNUSED_PARAMETER(start_address);
 
   cs_insn *insn = NULL;
   gboolean deterministic = FALSE;
+  gboolean indirect = FALSE;
   gsize    fixup_offset;
 
   if (!g_hash_table_contains(coverage_blocks, GSIZE_TO_POINTER(*target)) &&
@@ -266,8 +268,22 @@ static void instrument_coverage_switch(GumStalkerObserver *self,
 
   insn = instrument_disassemble(from_insn);
   deterministic = instrument_is_deterministic(insn);
+  if (insn != NULL) {
+    indirect = insn->id == ARM64_INS_BR || insn->id == ARM64_INS_BLR ||
+               insn->id == ARM64_INS_RET;
+  }
+
   cs_free(insn, 1);
 
+  /*
+   * Indirect branches enter the block at its start, where the registers are
+   * restored. Those entries can go in the cache for instrument_cache() to find
+   * with the offset we apply below.
+   */
+  indirect =
+      indirect &&
+      g_hash_table_contains(coverage_blocks, GSIZE_TO_POINTER(*target));
+
   /*
    * If the branch is deterministic, then we should start execution at the
    * begining of the block. From here, we will branch and skip the coverage
@@ -275,7 +291,10 @@ static void instrument_coverage_switch(GumStalkerObserver *self,
    * Otherwise, if the branch is non-deterministic, then we need to branch
    * part way into the block to where the coverage instrumentation starts.
    */
-  if (deterministic) { return; }
+  if (deterministic) {
+    if (indirect) { instrument_cache_insert(start_address, *target); }
+    return;
+  }
 
   /*
    * Since each block is prefixed with a restoration prologue, we need to be
@@ -309,6 +328,8 @@ static void instrument_coverage_switch(GumStalkerObserver *self,
   fixup_offset = GUM_RESTORATION_PROLOG_SIZE +
                  G_STRUCT_OFFSET(afl_log_code_asm_t, restoration_prolog);
   *target = (guint8 *)*target + fixup_offset;
+
+  if (indirect) { instrument_cache_insert(start_address, *target); }
 }
 
 static void instrument_coverage_suppress_init(void) {
@@ -351,9 +372,39 @@ static bool instrument_patch_ardp(guint32 *patch, GumAddress insn,
   return true;
 }
 
+  #define INSN_IDX(field) \
+    (offsetof(afl_log_code_asm_t, field) / sizeof(uint32_t))
+  #define INSN_COUNT (sizeof(afl_log_code_asm_t) / sizeof(uint32_t))
+
+/*
+ * Without suppression the branch over the coverage code and the restoration
+ * prolog behind it are left out, and if x0 and x1 are dead so is saving and
+ * restoring them.
+ */
+static gboolean instrument_inline_skip(gsize idx, gboolean save) {
+  if (!instrument_suppress && idx < INSN_IDX(stp_x0_x1)) { return TRUE; }
+
+  if (!save && (idx == INSN_IDX(stp_x0_x1) || idx == INSN_IDX(ldp_x0_x1))) {
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+static GumAddress instrument_inline_addr(GumAddress code_addr, gsize idx,
+                                         gboolean save) {
+  for (gsize i = 0; i < idx; i++) {
+    if (!instrument_inline_skip(i, save)) { code_addr += sizeof(uint32_t); }
+  }
+
+  return code_addr;
+}
+
 bool instrument_write_inline(GumArm64Writer *cw, GumAddress code_addr,
-                             guint64 area_offset, gsize area_offset_ror) {
+                             guint64 area_offset, gsize area_offset_ror,
+                             gboolean save) {
   afl_log_code code = {0};
+  uint32_t    *insns = (uint32_t *)code.bytes;
   code.code = template;
 
   /*
@@ -366,7 +417,7 @@ bool instrument_write_inline(GumArm64Writer *cw, GumAddress code_addr,
 
   if (!instrument_patch_ardp(
           &code.code.adrp_x0_prev_loc1,
-          code_addr + offsetof(afl_log_code, code.adrp_x0_prev_loc1),
+          instrument_inline_addr(code_addr, INSN_IDX(adrp_x0_prev_loc1), save),
           GUM_ADDRESS(instrument_previous_pc_addr))) {
     return false;
   }
@@ -383,27 +434,26 @@ bool instrument_write_inline(GumArm64Writer *cw, GumAddress code_addr,
 
   if (!instrument_patch_ardp(
           &code.code.adrp_x1_area_ptr,
-          code_addr + offsetof(afl_log_code, code.adrp_x1_area_ptr),
+          instrument_inline_addr(code_addr, INSN_IDX(adrp_x1_area_ptr), save),
           GUM_ADDRESS(__afl_area_ptr))) {
     return false;
   }
 
   if (!instrument_patch_ardp(
           &code.code.adrp_x0_prev_loc2,
-          code_addr + offsetof(afl_log_code, code.adrp_x0_prev_loc2),
+          instrument_inline_addr(code_addr, INSN_IDX(adrp_x0_prev_loc2), save),
           GUM_ADDRESS(instrument_previous_pc_addr))) {
     return false;
   }
 
   code.code.mov_x1_curr_loc_shr_1 |= (area_offset_ror << 5);
 
-  if (instrument_suppress) {
-    gum_arm64_writer_put_bytes(cw, code.bytes, sizeof(afl_log_code));
+  /* The branch skips two instructions less */
+  if (!save) { code.code.b_imm8 -= 2; }
 
-  } else {
-    size_t offset = offsetof(afl_log_code, code.stp_x0_x1);
-    gum_arm64_writer_put_bytes(cw, &code.bytes[offset],
-                               sizeof(afl_log_code) - offset);
+  for (gsize i = 0; i < INSN_COUNT; i++) {
+    if (instrument_inline_skip(i, save)) { continue; }
+    gum_arm64_writer_put_bytes(cw, (guint8 *)&insns[i], sizeof(uint32_t));
   }
 
   return true;
@@ -431,6 +481,95 @@ bool instrument_write_inline_long(GumArm64Writer *cw, GumAddress code_addr,
   return true;
 }
 
+static guint instrument_live_reg(arm64_reg reg) {
+  switch (reg) {
+    case ARM64_REG_X0:
+    case ARM64_REG_W0:
+      return 1;
+    case ARM64_REG_X1:
+    case ARM64_REG_W1:
+      return 2;
+    default:
+      return 0;
+  }
+}
+
+/*
+ * Whether the code at the start of the block (up to its first branch) may
+ * read x0 or x1 before it overwrites both of them. The coverage code doesn't
+ * touch the flags. Writes to a W register clear the upper half, so replace the
+ * whole register, but those which only insert bits into it don't.
+ */
+static gboolean instrument_coverage_live(const cs_insn *instr) {
+  guint          live = 3;
+  guint          known = 0;
+  const uint8_t *code = GSIZE_TO_POINTER(instr->address);
+  uint64_t       address = instr->address;
+  gsize          page_size = gum_query_page_size();
+  size_t         size = page_size - (address & (page_size - 1));
+  cs_insn       *insn;
+  cs_regs        regs_read, regs_write;
+  uint8_t        read_count, write_count;
+
+  if (!instrument_liveness) { return TRUE; }
+
+  if (capstone_live == 0) {
+    if (cs_open(CS_ARCH_ARM64, GUM_DEFAULT_CS_ENDIAN, &capstone_live) !=
+        CS_ERR_OK) {
+      FFATAL("Failed to cs_open");
+    }
+
+    cs_option(capstone_live, CS_OPT_DETAIL, CS_OPT_ON);
+  }
+
+  insn = cs_malloc(capstone_live);
+
+  for (guint i = 0; i < LIVE_MAX_INSNS && known != 3 &&
+                    cs_disasm_iter(capstone_live, &code, &size, &address, insn);
+       i++) {
+    guint writes = 0;
+
+    if (cs_regs_access(capstone_live, insn, regs_read, &read_count, regs_write,
+                       &write_count) != CS_ERR_OK) {
+      break;
+    }
+
+    for (uint8_t j = 0; j < read_count; j++) {
+      known |= instrument_live_reg(regs_read[j]);
+    }
+
+    if (cs_insn_group(capstone_live, insn, CS_GRP_JUMP) ||
+        cs_insn_group(capstone_live, insn, CS_GRP_CALL) ||
+        cs_insn_group(capstone_live, insn, CS_GRP_RET) ||
+        cs_insn_group(capstone_live, insn, CS_GRP_INT) ||
+        cs_insn_group(capstone_live, insn, CS_GRP_BRANCH_RELATIVE) ||
+        insn->id == ARM64_INS_SVC || insn->id == ARM64_INS_BRK) {
+      break;
+    }
+
+    switch (insn->id) {
+      case ARM64_INS_MOVK:
+      case ARM64_INS_BFI:
+      case ARM64_INS_BFM:
+      case ARM64_INS_BFXIL:
+        break;
+      default:
+        for (uint8_t j = 0; j < write_count; j++) {
+          writes |= instrument_live_reg(regs_write[j]);
+        }
+
+        break;
+    }
+
+    live &= ~(writes & ~known);
+    known |= writes;
+  }
+
+  cs_free(insn, 1);
+
+  return live != 0;
+}
+
 void instrument_coverage_optimize(const cs_insn    *instr,
                                   GumStalkerOutput *output) {
   afl_log_code    code = {0};
@@ -488,7 +627,8 @@ void instrument_coverage_optimize(const cs_insn    *instr,
 
   code.code = template;
 
-  if (!instrument_write_inline(cw, code_addr, area_offset, area_offset_ror)) {
+  if (!instrument_write_inline(cw, code_addr, area_offset, area_offset_ror,
+                               instrument_coverage_live(instr))) {
     if (!instrument_write_inline_long(cw, code_addr, area_offset,
                                       area_offset_ror)) {
       FATAL("Failed to write inline instrumentation");
@@ -524,22 +664,6 @@ gpointer instrument_cur(GumStalkerOutput *output) {
   return gum_arm64_writer_cur(output->writer.arm64);
 }
 
-void instrument_cache_config(void) {
-}
-
-void instrument_cache_init(void) {
-}
-
-void instrument_cache_insert(gpointer real_address, gpointer code_address) {
-  UNUSED_PARAMETER(real_address);
-  UNUSED_PARAMETER(code_address);
-}
-
-void instrument_cache(const cs_insn *instr, GumStalkerOutput *output) {
-  UNUSED_PARAMETER(instr);
-  UNUSED_PARAMETER(output);
-}
-
 void instrument_write_regs(GumCpuContext *cpu_context, gpointer user_data) {
   int fd = (int)(size_t)user_data;
   instrument_regs_format(
@@ -0,0 +1,180 @@
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "instrument.h"
+#include "util.h"
+
+#if defined(__aarch64__)
+
+  #define INVALID 1
+  #define DEFAULT_CACHE_SIZE (256ULL << 20)
+
+  /* Stalker saves x16, x17 here when it branches to the start of a block */
+  #define FRAME_SIZE (16 + GUM_RED_ZONE_SIZE)
+
+gboolean         instrument_cache_enabled = TRUE;
+gsize            instrument_cache_size = DEFAULT_CACHE_SIZE;
+static gpointer *map_base = MAP_FAILED;
+
+void instrument_cache_config(void) {
+  instrument_cache_enabled = (getenv("AFL_FRIDA_INST_NO_CACHE") == NULL);
+
+  if (getenv("AFL_FRIDA_INST_CACHE_SIZE") != NULL) {
+    if (!instrument_cache_enabled) {
+      FFATAL(
+          "AFL_FRIDA_INST_CACHE_SIZE incomatible with "
+          "AFL_FRIDA_INST_NO_CACHE");
+    }
+
+    instrument_cache_size =
+        util_read_address("AFL_FRIDA_INST_CACHE_SIZE", DEFAULT_CACHE_SIZE);
+    util_log2(instrument_cache_size);
+  }
+}
+
+void instrument_cache_init(void) {
+  FOKF(cBLU "Instrumentation" cRST " - " cGRN "cache:" cYEL " [%c]",
+       instrument_cache_enabled ? 'X' : ' ');
+  if (!instrument_cache_enabled) { return; }
+
+  FOKF(cBLU "Instrumentation" cRST " - " cGRN "cache size:" cYEL " [0x%016lX]",
+       instrument_cache_size);
+
+  const struct rlimit data_limit = {.rlim_cur = RLIM_INFINITY,
+                                    .rlim_max = RLIM_INFINITY};
+
+  if (setrlimit(RLIMIT_AS, &data_limit) != 0) {
+    FFATAL("Failed to setrlimit: %d", errno);
+  }
+
+  map_base =
+      gum_memory_allocate(NULL, instrument_cache_size, instrument_cache_size,
+                          GUM_PAGE_READ | GUM_PAGE_WRITE);
+  if (map_base == MAP_FAILED) { FFATAL("Failed to map segment: %d", errno); }
+
+  FOKF(cBLU "Instrumentation" cRST " - " cGRN "cache addr:" cYEL " [0x%016lX]",
+       GUM_ADDRESS(map_base));
+}
+
+static gpointer *instrument_cache_get_addr(gpointer addr) {
+  gsize mask = (instrument_cache_size / sizeof(gpointer)) - 1;
+  return &map_base[GPOINTER_TO_SIZE(addr) & mask];
+}
+
+void instrument_cache_insert(gpointer real_address, gpointer code_address) {
+  if (!instrument_cache_enabled) { return; }
+
+  gpointer *target = instrument_cache_get_addr(real_address);
+  if (*target == code_address) {
+    return;
+
+  } else if (*target == NULL) {
+    *target = code_address;
+
+  } else {
+    *target = GSIZE_TO_POINTER(INVALID);
+  }
+}
+
+static guint32 instrument_cache_reg(arm64_reg reg) {
+  if (reg >= ARM64_REG_X0 && reg <= ARM64_REG_X28) {
+    return reg - ARM64_REG_X0;
+
+  } else if (reg == ARM64_REG_X29) {
+    return 29;
+
+  } else if (reg == ARM64_REG_X30) {
+    return 30;
+
+  } else {
+    FFATAL("Unexpected register: %d", reg);
+  }
+}
+
+/*
+ * The cache holds the address of the instrumented block including the
+ * restoration prolog, which reloads x16 and x17 from beyond the red-zone and
+ * pops them from the stack. We save them there ourselves and use them as
+ * scratch registers for the lookup, so on a hit we can branch straight to the
+ * block. On a miss we restore them and fall through to the code Stalker
+ * writes for the branch. We only use instructions which leave the condition
+ * flags alone, since the target may yet depend on them.
+ */
+static void instrument_cache_write(const cs_insn *instr, arm64_reg target,
+                                   GumStalkerOutput *output) {
+  GumArm64Writer *cw = output->writer.arm64;
+  guint32         rn = instrument_cache_reg(target);
+  guint32         bits = util_log2(instrument_cache_size / sizeof(gpointer));
+  gconstpointer   miss = cw->code;
+
+  gum_arm64_writer_put_stp_reg_reg_reg_offset(cw, ARM64_REG_X16, ARM64_REG_X17,
+                                              ARM64_REG_SP, -FRAME_SIZE,
+                                              GUM_INDEX_PRE_ADJUST);
+
+  /*
+   * &map_base[GPOINTER_TO_SIZE(addr) & MAP_MASK]; The target register may be
+   * x16 or x17 itself, it is read before either is written to.
+   */
+
+  /* ubfiz x16, xN, #3, #bits */
+  gum_arm64_writer_put_instruction(cw, 0xd3400000 | (61 << 16) |
+                                           ((bits - 1) << 10) | (rn << 5) | 16);
+  gum_arm64_writer_put_ldr_reg_address(cw, ARM64_REG_X17,
+                                       GUM_ADDRESS(map_base));
+
+  /* ldr x16, [x17, x16] */
+  gum_arm64_writer_put_instruction(cw, 0xf8606800 | (16 << 16) | (17 << 5) |
+                                           16);
+
+  /* Test if its set, i.e. neither NULL nor INVALID: lsr x17, x16, #1 */
+  gum_arm64_writer_put_instruction(cw, 0xd340fc00 | (1 << 16) | (16 << 5) |
+                                           17);
+  gum_arm64_writer_put_cbz_reg_label(cw, ARM64_REG_X17, miss);
+
+  /* A call needs the real return address, as Stalker would have set it */
+  if (instr->id == ARM64_INS_BLR) {
+    gum_arm64_writer_put_ldr_reg_address(
+        cw, ARM64_REG_X30, GUM_ADDRESS(instr->address + instr->size));
+  }
+
+  gum_arm64_writer_put_br_reg(cw, ARM64_REG_X16);
+
+  /* Tidy up our mess and let FRIDA handle it */
+  gum_arm64_writer_put_label(cw, miss);
+  gum_arm64_writer_put_ldp_reg_reg_reg_offset(cw, ARM64_REG_X16, ARM64_REG_X17,
+                                              ARM64_REG_SP, FRAME_SIZE,
+                                              GUM_INDEX_POST_ADJUST);
+}
+
+void instrument_cache(const cs_insn *instr, GumStalkerOutput *output) {
+  cs_arm64 *arm64 = &instr->detail->arm64;
+
+  if (!instrument_cache_enabled) { return; }
+
+  switch (instr->id) {
+    case ARM64_INS_BR:
+    case ARM64_INS_BLR:
+      if (arm64->op_count != 1 || arm64->operands[0].type != ARM64_OP_REG) {
+        FFATAL("Unexpected operands");
+      }
+
+      instrument_cache_write(instr, arm64->operands[0].reg, output);
+      break;
+
+    case ARM64_INS_RET:
+      if (arm64->op_count == 0) {
+        instrument_cache_write(instr, ARM64_REG_X30, output);
+
+      } else {
+        instrument_cache_write(instr, arm64->operands[0].reg, output);
+      }
+
+      break;
+
+    default:
+      return;
+  }
+}
+
+#endif
+
@@ -54,8 +54,9 @@ typedef union {
 
 } jcc_insn;
 
+/* The blocks starting with coverage code, mapped to its size */
 static GHashTable *coverage_blocks = NULL;
-static GHashTable *coverage_blocks_long = NULL;
+static __thread csh capstone_live = 0;
 
 gboolean instrument_is_coverage_optimize_supported(void) {
   return true;
@@ -65,195 +66,115 @@ static gboolean instrument_coverage_in_range(gssize offset) {
   return (offset >= G_MININT32 && offset <= G_MAXINT32);
 }
 
-  #pragma pack(push, 1)
+/*
+ * cur_location = (block_address >> 4) ^ (block_address << 8);
+ * shared_mem[cur_location ^ prev_location]++;
+ * prev_location = cur_location >> 1;
+ *
+ * The coverage code is put together from the pieces below. RAX, RBX and the
+ * flags are only saved (beyond the red-zone) and restored if the block may
+ * still need them, see instrument_coverage_live().
+ */
+
+  #define LIVE_RAX 1
+  #define LIVE_RBX 2
+  #define LIVE_FLAGS 4
+  #define LIVE_ALL (LIVE_RAX | LIVE_RBX | LIVE_FLAGS)
+
+  /* Instructions looked at for liveness */
+  #define LIVE_MAX_INSNS 32
+
+static const guint8 mov_rsp_88_rax[] = {0x48, 0x89, 0x84, 0x24,
+                                        0x78, 0xFF, 0xFF, 0xFF};
+static const guint8 lahf[] = {0x9f};
+static const guint8 mov_rsp_90_rax[] = {0x48, 0x89, 0x84, 0x24,
+                                        0x70, 0xFF, 0xFF, 0xFF};
+static const guint8 mov_rsp_98_rbx[] = {0x48, 0x89, 0x9C, 0x24,
+                                        0x68, 0xFF, 0xFF, 0xFF};
+
+static const guint8 mov_rbx_rsp_98[] = {0x48, 0x8B, 0x9C, 0x24,
+                                        0x68, 0xFF, 0xFF, 0xFF};
+static const guint8 mov_rax_rsp_90[] = {0x48, 0x8B, 0x84, 0x24,
+                                        0x70, 0xFF, 0xFF, 0xFF};
+static const guint8 sahf[] = {0x9e};
+static const guint8 mov_rax_rsp_88[] = {0x48, 0x8B, 0x84, 0x24,
+                                        0x78, 0xFF, 0xFF, 0xFF};
+
+static const guint8 mov_eax_rip_prev_loc[] = {0x8b, 0x05}; /* + disp32 */
+static const guint8 mov_rax_imm[] = {0x48, 0xb8};          /* + imm64 */
+static const guint8 mov_eax_ptr_rax[] = {0x8b, 0x00};
+static const guint8 xor_eax_imm[] = {0x35};                /* + imm32 */
+static const guint8 lea_rbx_rip_area_ptr[] = {0x48, 0x8d, 0x1d}; /* + disp32 */
+static const guint8 mov_rbx_imm[] = {0x48, 0xbb};          /* + imm64 */
+static const guint8 add_rax_rbx[] = {0x48, 0x01, 0xd8};
+
+static const guint8 mov_bl_ptr_rax[] = {0x8a, 0x18};
+static const guint8 add_bl_1[] = {0x80, 0xc3, 0x01};
+static const guint8 adc_bl_0[] = {0x80, 0xd3, 0x00};
+static const guint8 mov_ptr_rax_bl[] = {0x88, 0x18};
+
+/* + disp32 + imm32 */
+static const guint8 mov_rip_prev_loc_imm[] = {0xc7, 0x05};
+/* + imm32 */
+static const guint8 mov_ptr_rax_imm[] = {0xc7, 0x00};
 
 typedef struct {
-  // cur_location = (block_address >> 4) ^ (block_address << 8);
-  // shared_mem[cur_location ^ prev_location]++;
-  // prev_location = cur_location >> 1;
+  guint8 bytes[128];
+  gsize  len;
 
-  // mov    QWORD PTR [rsp-0x88],rax
-  // lahf
-  // mov    QWORD PTR [rsp-0x90],rax
-  // mov    QWORD PTR [rsp-0x98],rbx
-
-  // mov    eax,DWORD PTR [rip+0x1312334]
-  // xor    eax,0x3f77
-
-  // lea    rbx,[rip+0x132338]
-  // add    rax,rbx
-
-  // mov    bl,BYTE PTR [rax]
-  // add    bl,0x1
-  // adc    bl,0x0
-  // mov    BYTE PTR [rax],bl
-
-  // mov    rbx,QWORD PTR [rsp-0x98]
-  // mov    rax,QWORD PTR [rsp-0x90]
-  // sahf
-  // mov    rax,QWORD PTR [rsp-0x88]
-
-  // mov    DWORD PTR [rip+0x13122f8],0x9fbb
-
-  uint8_t mov_rax_rsp_88[8];
-  uint8_t lahf;
-  uint8_t mov_rax_rsp_90[8];
-  uint8_t mov_rbx_rsp_98[8];
-
-  uint8_t mov_eax_prev_loc[6];
-  uint8_t xor_eax_curr_loc[5];
-
-  uint8_t lea_rbx_area_ptr[7];
-  uint8_t add_rax_rbx[3];
-
-  uint8_t mov_rbx_ptr_rax[2];
-  uint8_t add_bl_1[3];
-  uint8_t adc_bl_0[3];
-  uint8_t mov_ptr_rax_rbx[2];
-
-  uint8_t mov_rsp_98_rbx[8];
-  uint8_t mov_rsp_90_rax[8];
-  uint8_t sahf;
-  uint8_t mov_rsp_88_rax[8];
-
-  uint8_t mov_prev_loc_curr_loc_shr1[10];
-
-} afl_log_code_asm_t;
-
-typedef struct {
-  // cur_location = (block_address >> 4) ^ (block_address << 8);
-  // shared_mem[cur_location ^ prev_location]++;
-  // prev_location = cur_location >> 1;
-
-  // mov    QWORD PTR [rsp-0x88],rax
-  // lahf
-  // mov    QWORD PTR [rsp-0x90],rax
-  // mov    QWORD PTR [rsp-0x98],rbx
-
-  // mov    rax, 0xXXXXXXXXXXXXXXXXX                          /* p_prev_loc */
-  // mov    eax, dword ptr [rax]                                /* prev_loc */
-  // xor    eax,0x3f77                                           /* cur_loc */
-
-  // mov    rbx, 0xXXXXXXXXXXXXXXXXX                                 /* map */
-  // add    rax,rbx
-
-  // mov    bl,BYTE PTR [rax]
-  // add    bl,0x1
-  // adc    bl,0x0
-  // mov    BYTE PTR [rax],bl
-
-  // mov    rax, 0xXXXXXXXXXXXXXXXXX                          /* p_prev_loc */
-  // mov    dword ptr [rax], 0xXXXXXXXXX                        /* prev_loc */
-
-  // mov    rbx,QWORD PTR [rsp-0x98]
-  // mov    rax,QWORD PTR [rsp-0x90]
-  // sahf
-  // mov    rax,QWORD PTR [rsp-0x88]
-
-  uint8_t mov_rax_rsp_88[8];
-  uint8_t lahf;
-  uint8_t mov_rax_rsp_90[8];
-  uint8_t mov_rbx_rsp_98[8];
-
-  uint8_t mov_rax_prev_loc_ptr1[10];
-  uint8_t mov_eax_prev_loc[2];
-  uint8_t xor_eax_curr_loc[5];
-
-  uint8_t mov_rbx_map_ptr[10];
-  uint8_t add_rax_rbx[3];
-
-  uint8_t mov_rbx_ptr_rax[2];
-  uint8_t add_bl_1[3];
-  uint8_t adc_bl_0[3];
-  uint8_t mov_ptr_rax_rbx[2];
-
-  uint8_t mov_rax_prev_loc_ptr2[10];
-  uint8_t mov_prev_loc_curr_loc_shr1[6];
-
-  uint8_t mov_rsp_98_rbx[8];
-  uint8_t mov_rsp_90_rax[8];
-  uint8_t sahf;
-  uint8_t mov_rsp_88_rax[8];
-
-} afl_log_code_asm_long_t;
-
-  #pragma pack(pop)
-
-static const afl_log_code_asm_t template =
-    {
-
-        .mov_rax_rsp_88 = {0x48, 0x89, 0x84, 0x24, 0x78, 0xFF, 0xFF, 0xFF},
-        .lahf = 0x9f,
-        .mov_rax_rsp_90 = {0x48, 0x89, 0x84, 0x24, 0x70, 0xFF, 0xFF, 0xFF},
-        .mov_rbx_rsp_98 = {0x48, 0x89, 0x9C, 0x24, 0x68, 0xFF, 0xFF, 0xFF},
-
-        .mov_eax_prev_loc = {0x8b, 0x05},
-        .xor_eax_curr_loc = {0x35},
-        .lea_rbx_area_ptr = {0x48, 0x8d, 0x1d},
-        .add_rax_rbx = {0x48, 0x01, 0xd8},
-
-        .mov_rbx_ptr_rax = {0x8a, 0x18},
-        .add_bl_1 = {0x80, 0xc3, 0x01},
-        .adc_bl_0 = {0x80, 0xd3, 0x00},
-        .mov_ptr_rax_rbx = {0x88, 0x18},
-
-        .mov_rsp_98_rbx = {0x48, 0x8B, 0x9C, 0x24, 0x68, 0xFF, 0xFF, 0xFF},
-        .mov_rsp_90_rax = {0x48, 0x8B, 0x84, 0x24, 0x70, 0xFF, 0xFF, 0xFF},
-        .sahf = 0x9e,
-        .mov_rsp_88_rax = {0x48, 0x8B, 0x84, 0x24, 0x78, 0xFF, 0xFF, 0xFF},
-
-        .mov_prev_loc_curr_loc_shr1 = {0xc7, 0x05},
+} afl_log_code;
 
+static void instrument_put(afl_log_code *code, const guint8 *bytes,
+                           gsize len) {
+  memcpy(&code->bytes[code->len], bytes, len);
+  code->len += len;
 }
 
-;
-
-static const afl_log_code_asm_long_t template_long =
-    {
-
-        .mov_rax_rsp_88 = {0x48, 0x89, 0x84, 0x24, 0x78, 0xFF, 0xFF, 0xFF},
-        .lahf = 0x9f,
-        .mov_rax_rsp_90 = {0x48, 0x89, 0x84, 0x24, 0x70, 0xFF, 0xFF, 0xFF},
-        .mov_rbx_rsp_98 = {0x48, 0x89, 0x9C, 0x24, 0x68, 0xFF, 0xFF, 0xFF},
-
-        .mov_rax_prev_loc_ptr1 = {0x48, 0xB8, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-                                  0xFF, 0xFF, 0xFF},
-        .mov_eax_prev_loc = {0x8b, 0x00},
-        .xor_eax_curr_loc = {0x35},
-
-        .mov_rbx_map_ptr = {0x48, 0xBB, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-                            0xFF, 0xFF},
-        .add_rax_rbx = {0x48, 0x01, 0xd8},
+static void instrument_put_u32(afl_log_code *code, guint32 val) {
+  instrument_put(code, (guint8 *)&val, sizeof(val));
+}
 
-        .mov_rbx_ptr_rax = {0x8a, 0x18},
-        .add_bl_1 = {0x80, 0xc3, 0x01},
-        .adc_bl_0 = {0x80, 0xd3, 0x00},
-        .mov_ptr_rax_rbx = {0x88, 0x18},
+static void instrument_put_u64(afl_log_code *code, guint64 val) {
+  instrument_put(code, (guint8 *)&val, sizeof(val));
+}
 
-        .mov_rax_prev_loc_ptr2 = {0x48, 0xB8, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-                                  0xFF, 0xFF, 0xFF},
-        .mov_prev_loc_curr_loc_shr1 = {0xc7, 0x00, 0xFF, 0xFF, 0xFF, 0xFF},
+static void instrument_put_save(afl_log_code *code, guint live) {
+  if (live & LIVE_RAX) {
+    instrument_put(code, mov_rsp_88_rax, sizeof(mov_rsp_88_rax));
+  }
 
-        .mov_rsp_98_rbx = {0x48, 0x8B, 0x9C, 0x24, 0x68, 0xFF, 0xFF, 0xFF},
-        .mov_rsp_90_rax = {0x48, 0x8B, 0x84, 0x24, 0x70, 0xFF, 0xFF, 0xFF},
-        .sahf = 0x9e,
-        .mov_rsp_88_rax = {0x48, 0x8B, 0x84, 0x24, 0x78, 0xFF, 0xFF, 0xFF},
+  if (live & LIVE_FLAGS) {
+    instrument_put(code, lahf, sizeof(lahf));
+    instrument_put(code, mov_rsp_90_rax, sizeof(mov_rsp_90_rax));
+  }
 
+  if (live & LIVE_RBX) {
+    instrument_put(code, mov_rsp_98_rbx, sizeof(mov_rsp_98_rbx));
+  }
 }
 
-;
-
-typedef union {
-  afl_log_code_asm_t code;
-  uint8_t            bytes[0];
+static void instrument_put_restore(afl_log_code *code, guint live) {
+  if (live & LIVE_RBX) {
+    instrument_put(code, mov_rbx_rsp_98, sizeof(mov_rbx_rsp_98));
+  }
 
-} afl_log_code;
+  if (live & LIVE_FLAGS) {
+    instrument_put(code, mov_rax_rsp_90, sizeof(mov_rax_rsp_90));
+    instrument_put(code, sahf, sizeof(sahf));
+  }
 
-typedef union {
-  afl_log_code_asm_long_t code;
-  uint8_t                 bytes[0];
+  if (live & LIVE_RAX) {
+    instrument_put(code, mov_rax_rsp_88, sizeof(mov_rax_rsp_88));
+  }
+}
 
-} afl_log_code_long;
+static void instrument_put_increment(afl_log_code *code) {
+  instrument_put(code, add_rax_rbx, sizeof(add_rax_rbx));
+  instrument_put(code, mov_bl_ptr_rax, sizeof(mov_bl_ptr_rax));
+  instrument_put(code, add_bl_1, sizeof(add_bl_1));
+  instrument_put(code, adc_bl_0, sizeof(adc_bl_0));
+  instrument_put(code, mov_ptr_rax_bl, sizeof(mov_ptr_rax_bl));
+}
 
 void instrument_coverage_optimize_init(void) {
   FVERBOSE("__afl_area_ptr: %p", __afl_area_ptr);
@@ -269,19 +190,17 @@ static void instrument_coverage_switch_insn(GumStalkerObserver *self,
 
   cs_x86    *x86;
   cs_x86_op *op;
-  bool       is_short = false;
-  bool       is_long = false;
+  gsize      size;
 
   if (from_insn == NULL) { return; }
 
   x86 = &from_insn->detail->x86;
   op = x86->operands;
 
-  is_short = g_hash_table_contains(coverage_blocks, GSIZE_TO_POINTER(*target));
-  is_long =
-      g_hash_table_contains(coverage_blocks_long, GSIZE_TO_POINTER(*target));
+  size = GPOINTER_TO_SIZE(
+      g_hash_table_lookup(coverage_blocks, GSIZE_TO_POINTER(*target)));
 
-  if (!is_short && !is_long) { return; }
+  if (size == 0) { return; }
 
   switch (from_insn->id) {
     case X86_INS_CALL:
@@ -297,32 +216,13 @@ static void instrument_coverage_switch_insn(GumStalkerObserver *self,
 
       break;
     case X86_INS_RET:
-      if (is_short) {
-        instrument_cache_insert(start_address,
-                                (guint8 *)*target + sizeof(afl_log_code));
-
-      } else if (is_long) {
-        instrument_cache_insert(start_address,
-                                (guint8 *)*target + sizeof(afl_log_code_long));
-
-      } else {
-        FATAL("Something has gone wrong here!");
-      }
-
+      instrument_cache_insert(start_address, (guint8 *)*target + size);
       break;
     default:
       return;
   }
 
-  if (is_short) {
-    *target = (guint8 *)*target + sizeof(afl_log_code);
-
-  } else if (is_long) {
-    *target = (guint8 *)*target + sizeof(afl_log_code_long);
-
-  } else {
-    FATAL("Something has gone wrong here!");
-  }
+  *target = (guint8 *)*target + size;
 }
 
 cs_insn *instrument_disassemble(gconstpointer address) {
@@ -363,151 +263,232 @@ static void instrument_coverage_suppress_init(void) {
   if (coverage_blocks == NULL) {
     FATAL("Failed to g_hash_table_new, errno: %d", errno);
   }
-
-  coverage_blocks_long = g_hash_table_new(g_direct_hash, g_direct_equal);
-  if (coverage_blocks_long == NULL) {
-    FATAL("Failed to g_hash_table_new, errno: %d", errno);
-  }
 }
 
-bool instrument_write_inline(GumX86Writer *cw, GumAddress code_addr,
-                             guint32 area_offset, guint32 area_offset_ror) {
-  afl_log_code code = {0};
+static gboolean instrument_write_inline(afl_log_code *code,
+                                        GumAddress code_addr,
+                                        guint32 area_offset,
+                                        guint32 area_offset_ror, guint live) {
+  gssize disp;
+
+  code->len = 0;
+  instrument_put_save(code, live);
+
+  /* mov eax, dword ptr [rip + prev_loc] */
+  instrument_put(code, mov_eax_rip_prev_loc, sizeof(mov_eax_rip_prev_loc));
+  disp = GPOINTER_TO_SIZE(instrument_previous_pc_addr) -
+         (code_addr + code->len + sizeof(gint32));
+  if (!instrument_coverage_in_range(disp)) { return false; }
+  instrument_put_u32(code, (gint32)disp);
+
+  /* xor eax, curr_loc */
+  instrument_put(code, xor_eax_imm, sizeof(xor_eax_imm));
+  instrument_put_u32(code, area_offset);
+
+  /* lea rbx, [rip + area_ptr] */
+  instrument_put(code, lea_rbx_rip_area_ptr, sizeof(lea_rbx_rip_area_ptr));
+  disp = GPOINTER_TO_SIZE(__afl_area_ptr) -
+         (code_addr + code->len + sizeof(gint32));
+  if (!instrument_coverage_in_range(disp)) { return false; }
+  instrument_put_u32(code, (gint32)disp);
+
+  instrument_put_increment(code);
+  instrument_put_restore(code, live);
+
+  /* mov dword ptr [rip + prev_loc], curr_loc >> 1 */
+  instrument_put(code, mov_rip_prev_loc_imm, sizeof(mov_rip_prev_loc_imm));
+  disp = GPOINTER_TO_SIZE(instrument_previous_pc_addr) -
+         (code_addr + code->len + sizeof(gint32) + sizeof(guint32));
+  if (!instrument_coverage_in_range(disp)) { return false; }
+  instrument_put_u32(code, (gint32)disp);
+  instrument_put_u32(code, area_offset_ror);
 
-  code.code = template;
+  return true;
+}
 
-  gssize prev_loc_value =
-      GPOINTER_TO_SIZE(instrument_previous_pc_addr) -
-      (code_addr + offsetof(afl_log_code, code.mov_prev_loc_curr_loc_shr1) +
-       sizeof(code.code.mov_prev_loc_curr_loc_shr1));
-  gssize prev_loc_value_offset =
-      offsetof(afl_log_code, code.mov_prev_loc_curr_loc_shr1) +
-      sizeof(code.code.mov_prev_loc_curr_loc_shr1) - sizeof(gint) -
-      sizeof(guint32);
-  if (!instrument_coverage_in_range(prev_loc_value)) { return false; }
+static void instrument_write_inline_long(afl_log_code *code,
+                                         guint32       area_offset,
+                                         guint32 area_offset_ror, guint live) {
+  code->len = 0;
+  instrument_put_save(code, live);
 
-  *((gint *)&code.bytes[prev_loc_value_offset]) = (gint)prev_loc_value;
+  /* mov rax, p_prev_loc; mov eax, dword ptr [rax]; xor eax, curr_loc */
+  instrument_put(code, mov_rax_imm, sizeof(mov_rax_imm));
+  instrument_put_u64(code, GPOINTER_TO_SIZE(instrument_previous_pc_addr));
+  instrument_put(code, mov_eax_ptr_rax, sizeof(mov_eax_ptr_rax));
+  instrument_put(code, xor_eax_imm, sizeof(xor_eax_imm));
+  instrument_put_u32(code, area_offset);
 
-  /* mov_eax_prev_loc */
+  /* mov rbx, map */
+  instrument_put(code, mov_rbx_imm, sizeof(mov_rbx_imm));
+  instrument_put_u64(code, GPOINTER_TO_SIZE(__afl_area_ptr));
 
-  gssize prev_loc_value2 =
-      GPOINTER_TO_SIZE(instrument_previous_pc_addr) -
-      (code_addr + offsetof(afl_log_code, code.mov_eax_prev_loc) +
-       sizeof(code.code.mov_eax_prev_loc));
-  gssize prev_loc_value_offset2 =
-      offsetof(afl_log_code, code.mov_eax_prev_loc) +
-      sizeof(code.code.mov_eax_prev_loc) - sizeof(gint);
-  if (!instrument_coverage_in_range(prev_loc_value)) { return false; }
+  instrument_put_increment(code);
 
-  *((gint *)&code.bytes[prev_loc_value_offset2]) = (gint)prev_loc_value2;
+  /* mov rax, p_prev_loc; mov dword ptr [rax], curr_loc >> 1 */
+  instrument_put(code, mov_rax_imm, sizeof(mov_rax_imm));
+  instrument_put_u64(code, GPOINTER_TO_SIZE(instrument_previous_pc_addr));
+  instrument_put(code, mov_ptr_rax_imm, sizeof(mov_ptr_rax_imm));
+  instrument_put_u32(code, area_offset_ror);
 
-  /* xor_eax_curr_loc */
+  instrument_put_restore(code, live);
+}
 
-  gssize xor_curr_loc_offset = offsetof(afl_log_code, code.xor_eax_curr_loc) +
-                               sizeof(code.code.xor_eax_curr_loc) -
-                               sizeof(guint32);
+/* Put the coverage code for address, as it will run at code_addr, in code */
+static void instrument_coverage_write(GumAddress address, GumAddress code_addr,
+                                      guint live, afl_log_code *code) {
+  guint64 area_offset = (guint32)instrument_get_offset_hash(address);
+  gsize   map_size_pow2;
+  guint32 area_offset_ror;
 
-  *((guint32 *)&code.bytes[xor_curr_loc_offset]) = area_offset;
+  map_size_pow2 = util_log2(__afl_map_size);
+  area_offset_ror = (guint32)util_rotate(instrument_get_offset_hash(address), 1,
+                                         map_size_pow2);
 
-  /* lea_rbx_area_ptr */
+  if (!instrument_write_inline(code, code_addr, area_offset, area_offset_ror,
+                               live)) {
+    instrument_write_inline_long(code, area_offset, area_offset_ror, live);
+  }
+}
 
-  gssize lea_rbx_area_ptr_offset =
-      offsetof(afl_log_code, code.lea_rbx_area_ptr) +
-      sizeof(code.code.lea_rbx_area_ptr) - sizeof(guint32);
+static guint instrument_live_reg(x86_reg reg) {
+  switch (reg) {
+    case X86_REG_RAX:
+    case X86_REG_EAX:
+    case X86_REG_AX:
+    case X86_REG_AH:
+    case X86_REG_AL:
+      return LIVE_RAX;
+    case X86_REG_RBX:
+    case X86_REG_EBX:
+    case X86_REG_BX:
+    case X86_REG_BH:
+    case X86_REG_BL:
+      return LIVE_RBX;
+    case X86_REG_EFLAGS:
+      return LIVE_FLAGS;
+    default:
+      return 0;
+  }
+}
 
-  gssize lea_rbx_area_ptr_value =
-      (GPOINTER_TO_SIZE(__afl_area_ptr) -
-       (code_addr + offsetof(afl_log_code, code.lea_rbx_area_ptr) +
-        sizeof(code.code.lea_rbx_area_ptr)));
+/*
+ * Which of RAX, RBX and the flags the code at the start of the block (up to
+ * its first branch) may read before it overwrites them. Anything the code
+ * doesn't overwrite for sure is live. Only 32 and 64-bit writes replace a
+ * whole register, and only a few instructions set all of the flags LAHF
+ * saves. OF is left out, the coverage code has never preserved it.
+ */
+static guint instrument_coverage_live(const cs_insn *instr) {
+  guint          live = LIVE_ALL;
+  guint          known = 0;
+  const uint8_t *code = GSIZE_TO_POINTER(instr->address);
+  uint64_t       address = instr->address;
+  gsize          page_size = gum_query_page_size();
+  size_t         size = page_size - (address & (page_size - 1));
+  cs_insn       *insn;
+  cs_regs        regs_read, regs_write;
+  uint8_t        read_count, write_count;
+
+  if (!instrument_liveness) { return LIVE_ALL; }
+
+  if (capstone_live == 0) {
+    if (cs_open(CS_ARCH_X86, GUM_CPU_MODE, &capstone_live) != CS_ERR_OK) {
+      FFATAL("Failed to cs_open");
+    }
 
-  if (!instrument_coverage_in_range(lea_rbx_area_ptr_value)) { return false; }
+    cs_option(capstone_live, CS_OPT_DETAIL, CS_OPT_ON);
+  }
 
-  *((guint32 *)&code.bytes[lea_rbx_area_ptr_offset]) = lea_rbx_area_ptr_value;
+  insn = cs_malloc(capstone_live);
 
-  /* mov_prev_loc_curr_loc_shr1 */
+  for (guint i = 0; i < LIVE_MAX_INSNS && known != LIVE_ALL &&
+                    cs_disasm_iter(capstone_live, &code, &size, &address, insn);
+       i++) {
+    guint    reads = 0;
+    guint    writes = 0;
+    uint64_t eflags = insn->detail->x86.eflags;
 
-  gssize curr_loc_shr_1_offset =
-      offsetof(afl_log_code, code.mov_prev_loc_curr_loc_shr1) +
-      sizeof(code.code.mov_prev_loc_curr_loc_shr1) - sizeof(guint32);
+    if (cs_regs_access(capstone_live, insn, regs_read, &read_count, regs_write,
+                       &write_count) != CS_ERR_OK) {
+      break;
+    }
 
-  *((guint32 *)&code.bytes[curr_loc_shr_1_offset]) = (guint32)(area_offset_ror);
+    for (uint8_t j = 0; j < read_count; j++) {
+      reads |= instrument_live_reg(regs_read[j]);
+    }
 
-  if (instrument_suppress) {
-    if (!g_hash_table_add(coverage_blocks, GSIZE_TO_POINTER(cw->code))) {
-      FATAL("Failed - g_hash_table_add");
+    if (eflags & (X86_EFLAGS_TEST_CF | X86_EFLAGS_TEST_PF | X86_EFLAGS_TEST_AF |
+                  X86_EFLAGS_TEST_ZF | X86_EFLAGS_TEST_SF | X86_EFLAGS_PRIOR_CF |
+                  X86_EFLAGS_PRIOR_PF | X86_EFLAGS_PRIOR_AF |
+                  X86_EFLAGS_PRIOR_ZF | X86_EFLAGS_PRIOR_SF)) {
+      reads |= LIVE_FLAGS;
     }
-  }
 
-  gum_x86_writer_put_bytes(cw, code.bytes, sizeof(afl_log_code));
-  return true;
-}
+    known |= reads;
 
-bool instrument_write_inline_long(GumX86Writer *cw, guint32 area_offset,
-                                  guint32 area_offset_ror) {
-  afl_log_code_long code = {0};
-  code.code = template_long;
-
-  /* mov_rax_prev_loc_ptr1 */
-  gssize mov_rax_prev_loc_ptr1_offset =
-      offsetof(afl_log_code_long, code.mov_rax_prev_loc_ptr1) +
-      sizeof(code.code.mov_rax_prev_loc_ptr1) - sizeof(gsize);
-  *((gsize *)&code.bytes[mov_rax_prev_loc_ptr1_offset]) =
-      GPOINTER_TO_SIZE(instrument_previous_pc_addr);
-
-  /* xor_eax_curr_loc */
-  gssize xor_eax_curr_loc_offset =
-      offsetof(afl_log_code_long, code.xor_eax_curr_loc) +
-      sizeof(code.code.xor_eax_curr_loc) - sizeof(guint32);
-  *((guint32 *)&code.bytes[xor_eax_curr_loc_offset]) = area_offset;
-
-  /* mov_rbx_map_ptr */
-  gsize mov_rbx_map_ptr_offset =
-      offsetof(afl_log_code_long, code.mov_rbx_map_ptr) +
-      sizeof(code.code.mov_rbx_map_ptr) - sizeof(gsize);
-  *((gsize *)&code.bytes[mov_rbx_map_ptr_offset]) =
-      GPOINTER_TO_SIZE(__afl_area_ptr);
-
-  /* mov_rax_prev_loc_ptr2 */
-  gssize mov_rax_prev_loc_ptr2_offset =
-      offsetof(afl_log_code_long, code.mov_rax_prev_loc_ptr2) +
-      sizeof(code.code.mov_rax_prev_loc_ptr2) - sizeof(gsize);
-  *((gsize *)&code.bytes[mov_rax_prev_loc_ptr2_offset]) =
-      GPOINTER_TO_SIZE(instrument_previous_pc_addr);
-
-  /* mov_prev_loc_curr_loc_shr1 */
-  gssize mov_prev_loc_curr_loc_shr1_offset =
-      offsetof(afl_log_code_long, code.mov_prev_loc_curr_loc_shr1) +
-      sizeof(code.code.mov_prev_loc_curr_loc_shr1) - sizeof(guint32);
-  *((guint32 *)&code.bytes[mov_prev_loc_curr_loc_shr1_offset]) =
-      (guint32)(area_offset_ror);
+    if (cs_insn_group(capstone_live, insn, CS_GRP_JUMP) ||
+        cs_insn_group(capstone_live, insn, CS_GRP_CALL) ||
+        cs_insn_group(capstone_live, insn, CS_GRP_RET) ||
+        cs_insn_group(capstone_live, insn, CS_GRP_INT) ||
+        cs_insn_group(capstone_live, insn, CS_GRP_IRET) ||
+        insn->id == X86_INS_SYSCALL || insn->id == X86_INS_SYSENTER) {
+      break;
+    }
 
-  if (instrument_suppress) {
-    if (!g_hash_table_add(coverage_blocks_long, GSIZE_TO_POINTER(cw->code))) {
-      FATAL("Failed - g_hash_table_add");
+    /* CMOVcc keeps the lower half of its destination if not taken */
+    if (!cs_insn_group(capstone_live, insn, X86_GRP_CMOV)) {
+      for (uint8_t j = 0; j < write_count; j++) {
+        switch (regs_write[j]) {
+          case X86_REG_RAX:
+          case X86_REG_EAX:
+          case X86_REG_RBX:
+          case X86_REG_EBX:
+            writes |= instrument_live_reg(regs_write[j]);
+            break;
+          default:
+            break;
+        }
+      }
     }
+
+    switch (insn->id) {
+      case X86_INS_ADD:
+      case X86_INS_AND:
+      case X86_INS_CMP:
+      case X86_INS_OR:
+      case X86_INS_SUB:
+      case X86_INS_TEST:
+      case X86_INS_XOR:
+        writes |= LIVE_FLAGS;
+        break;
+      default:
+        break;
+    }
+
+    live &= ~(writes & ~known);
+    known |= writes;
   }
 
-  gum_x86_writer_put_bytes(cw, code.bytes, sizeof(afl_log_code_long));
-  return true;
+  cs_free(insn, 1);
+
+  return live;
 }
 
-static void instrument_coverage_write(GumAddress        address,
-                                      GumStalkerOutput *output) {
-  GumX86Writer *cw = output->writer.x86;
-  guint64       area_offset = (guint32)instrument_get_offset_hash(address);
-  gsize         map_size_pow2;
-  guint32       area_offset_ror;
-  GumAddress    code_addr = cw->pc;
+static void instrument_coverage_put(GumX86Writer *cw, GumAddress address,
+                                    guint live) {
+  afl_log_code code;
 
-  map_size_pow2 = util_log2(__afl_map_size);
-  area_offset_ror = (guint32)util_rotate(instrument_get_offset_hash(address), 1,
-                                         map_size_pow2);
+  instrument_coverage_write(address, cw->pc, live, &code);
 
-  if (!instrument_write_inline(cw, code_addr, area_offset, area_offset_ror)) {
-    if (!instrument_write_inline_long(cw, area_offset, area_offset_ror)) {
-      FATAL("Failed to write inline instrumentation");
+  if (instrument_suppress) {
+    if (!g_hash_table_insert(coverage_blocks, GSIZE_TO_POINTER(cw->code),
+                             GSIZE_TO_POINTER(code.len))) {
+      FATAL("Failed - g_hash_table_insert");
     }
   }
+
+  gum_x86_writer_put_bytes(cw, code.bytes, code.len);
 }
 
 void instrument_coverage_optimize(const cs_insn    *instr,
@@ -527,7 +508,8 @@ void instrument_coverage_optimize(const cs_insn    *instr,
 
   if (instrument_suppress) { instrument_coverage_suppress_init(); }
 
-  instrument_coverage_write(GUM_ADDRESS(instr->address), output);
+  instrument_coverage_put(cw, GUM_ADDRESS(instr->address),
+                          instrument_coverage_live(instr));
 }
 
 void instrument_coverage_optimize_insn(const cs_insn    *instr,
@@ -604,16 +586,21 @@ void instrument_coverage_optimize_insn(const cs_insn    *instr,
       return;
   }
 
-  taken.distance = sizeof(afl_log_code);
-  not_taken.distance = sizeof(afl_log_code);
+  afl_log_code code;
 
   // gum_x86_writer_put_breakpoint(cw);
 
+  instrument_coverage_write(GUM_ADDRESS(instr->address),
+                            cw->pc + sizeof(jcc_insn), LIVE_ALL, &code);
+  taken.distance = code.len;
   gum_x86_writer_put_bytes(cw, taken.bytes, sizeof(jcc_insn));
-  instrument_coverage_write(GUM_ADDRESS(instr->address), output);
+  gum_x86_writer_put_bytes(cw, code.bytes, code.len);
 
+  instrument_coverage_write(GUM_ADDRESS(instr->address + instr->size),
+                            cw->pc + sizeof(jcc_insn), LIVE_ALL, &code);
+  not_taken.distance = code.len;
   gum_x86_writer_put_bytes(cw, not_taken.bytes, sizeof(jcc_insn));
-  instrument_coverage_write(GUM_ADDRESS(instr->address + instr->size), output);
+  gum_x86_writer_put_bytes(cw, code.bytes, code.len);
 
   FVERBOSE("Instrument - 0x%016lx: %s %s", instr->address, instr->mnemonic,
            instr->op_str);
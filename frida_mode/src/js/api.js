@@ -84,6 +84,13 @@ class Afl {
         Afl.jsApiSetCacheDisable();
     }
 
+    /**
+     * See `AFL_FRIDA_CMPLOG_NO_FILTER`.
+     */
+    static setCmplogFilterDisable() {
+        Afl.jsApiSetCmplogFilterDisable();
+    }
+
     /**
      * See `AFL_FRIDA_DEBUG_MAPS`.
      */
@@ -201,6 +208,13 @@ class Afl {
         Afl.jsApiSetInstrumentSeed(seed);
     }
 
+    /*
+     * See `AFL_FRIDA_INST_NO_LIVENESS`
+     */
+    static setInstrumentLivenessDisable() {
+        Afl.jsApiSetInstrumentLivenessDisable();
+    }
+
     /*
      * See `AFL_FRIDA_INST_NO_SUPPRESS`
      */
@@ -278,6 +292,15 @@ class Afl {
         Afl.jsApiSetPrefetchBackpatchDisable();
     }
 
+    /**
+     * See `AFL_FRIDA_INST_PREFETCH_CACHE`. This function takes a single
+     * `string` as an argument.
+     */
+    static setPrefetchCacheFile(file) {
+        const buf = Memory.allocUtf8String(file);
+        Afl.jsApiSetPrefetchCacheFile(buf);
+    }
+
     /**
      * See `AFL_FRIDA_INST_NO_PREFETCH`.
      */
@@ -333,6 +356,14 @@ class Afl {
         Afl.jsApiSetStatsInterval(interval);
     }
 
+    /**
+     * See `AFL_FRIDA_STATS_SAMPLE`. This function takes a `number` as an
+     * argument
+     */
+    static setStatsSample(sample) {
+        Afl.jsApiSetStatsSample(sample);
+    }
+
     /**
      * See `AFL_FRIDA_OUTPUT_STDERR`. This function takes a single `string` as
      * an argument.
@@ -387,6 +418,7 @@ Afl.jsApiDone = Afl.jsApiGetFunction("js_api_done", "void", []);
 Afl.jsApiError = Afl.jsApiGetFunction("js_api_error", "void", ["pointer"]);
 Afl.jsApiSetBackpatchDisable = Afl.jsApiGetFunction("js_api_set_backpatch_disable", "void", []);
 Afl.jsApiSetCacheDisable = Afl.jsApiGetFunction("js_api_set_cache_disable", "void", []);
+Afl.jsApiSetCmplogFilterDisable = Afl.jsApiGetFunction("js_api_set_cmplog_filter_disable", "void", []);
 Afl.jsApiSetDebugMaps = Afl.jsApiGetFunction("js_api_set_debug_maps", "void", []);
 Afl.jsApiSetEntryPoint = Afl.jsApiGetFunction("js_api_set_entrypoint", "void", ["pointer"]);
 Afl.jsApiSetInstrumentCacheSize = Afl.jsApiGetFunction("js_api_set_instrument_cache_size", "void", ["size_t"]);
@@ -396,6 +428,7 @@ Afl.jsApiSetInstrumentDebugFile = Afl.jsApiGetFunction("js_api_set_instrument_de
 Afl.jsApiSetInstrumentInstructions = Afl.jsApiGetFunction("js_api_set_instrument_instructions", "void", []);
 Afl.jsApiSetInstrumentJit = Afl.jsApiGetFunction("js_api_set_instrument_jit", "void", []);
 Afl.jsApiSetInstrumentLibraries = Afl.jsApiGetFunction("js_api_set_instrument_libraries", "void", []);
+Afl.jsApiSetInstrumentLivenessDisable = Afl.jsApiGetFunction("js_api_set_instrument_liveness_disable", "void", []);
 Afl.jsApiSetInstrumentNoDynamicLoad = Afl.jsApiGetFunction("js_api_set_instrument_no_dynamic_load", "void", []);
 Afl.jsApiSetInstrumentNoOptimize = Afl.jsApiGetFunction("js_api_set_instrument_no_optimize", "void", []);
 Afl.jsApiSetInstrumentRegsFile = Afl.jsApiGetFunction("js_api_set_instrument_regs_file", "void", ["pointer"]);
@@ -411,6 +444,7 @@ Afl.jsApiSetPersistentDebug = Afl.jsApiGetFunction("js_api_set_persistent_debug"
 Afl.jsApiSetPersistentHook = Afl.jsApiGetFunction("js_api_set_persistent_hook", "void", ["pointer"]);
 Afl.jsApiSetPersistentReturn = Afl.jsApiGetFunction("js_api_set_persistent_return", "void", ["pointer"]);
 Afl.jsApiSetPrefetchBackpatchDisable = Afl.jsApiGetFunction("js_api_set_prefetch_backpatch_disable", "void", []);
+Afl.jsApiSetPrefetchCacheFile = Afl.jsApiGetFunction("js_api_set_prefetch_cache_file", "void", ["pointer"]);
 Afl.jsApiSetPrefetchDisable = Afl.jsApiGetFunction("js_api_set_prefetch_disable", "void", []);
 Afl.jsApiSetSeccompFile = Afl.jsApiGetFunction("js_api_set_seccomp_file", "void", ["pointer"]);
 Afl.jsApiSetStalkerAdjacentBlocks = Afl.jsApiGetFunction("js_api_set_stalker_adjacent_blocks", "void", ["uint32"]);
@@ -418,6 +452,7 @@ Afl.jsApiSetStalkerCallback = Afl.jsApiGetFunction("js_api_set_stalker_callback"
 Afl.jsApiSetStalkerIcEntries = Afl.jsApiGetFunction("js_api_set_stalker_ic_entries", "void", ["uint32"]);
 Afl.jsApiSetStatsFile = Afl.jsApiGetFunction("js_api_set_stats_file", "void", ["pointer"]);
 Afl.jsApiSetStatsInterval = Afl.jsApiGetFunction("js_api_set_stats_interval", "void", ["uint64"]);
+Afl.jsApiSetStatsSample = Afl.jsApiGetFunction("js_api_set_stats_sample", "void", ["uint64"]);
 Afl.jsApiSetStdErr = Afl.jsApiGetFunction("js_api_set_stderr", "void", ["pointer"]);
 Afl.jsApiSetStdOut = Afl.jsApiGetFunction("js_api_set_stdout", "void", ["pointer"]);
 Afl.jsApiSetTraceable = Afl.jsApiGetFunction("js_api_set_traceable", "void", []);
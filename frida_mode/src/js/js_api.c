@@ -1,5 +1,6 @@
 
 #include "entry.h"
+#include "frida_cmplog.h"
 #include "instrument.h"
 #include "js.h"
 #include "output.h"
@@ -23,6 +24,11 @@ __attribute__((visibility("default"))) void js_api_error(char *msg) {
   FFATAL("%s", msg);
 }
 
+__attribute__((visibility("default"))) void js_api_set_cmplog_filter_disable(
+    void) {
+  cmplog_filter = FALSE;
+}
+
 __attribute__((visibility("default"))) void js_api_set_entrypoint(
     void *address) {
   if (address == NULL) {
@@ -109,6 +115,11 @@ js_api_set_prefetch_backpatch_disable(void) {
   prefetch_backpatch = FALSE;
 }
 
+__attribute__((visibility("default"))) void js_api_set_prefetch_cache_file(
+    char *path) {
+  prefetch_cache_file = g_strdup(path);
+}
+
 __attribute__((visibility("default"))) void js_api_set_instrument_instructions(
     void) {
   instrument_coverage_insn = TRUE;
@@ -171,6 +182,11 @@ __attribute__((visibility("default"))) void js_api_set_stats_interval(
   stats_interval = interval;
 }
 
+__attribute__((visibility("default"))) void js_api_set_stats_sample(
+    uint64_t sample) {
+  stats_sample = sample;
+}
+
 __attribute__((visibility("default"))) void js_api_set_persistent_hook(
     void *address) {
   if (address == NULL) {
@@ -212,6 +228,11 @@ __attribute__((visibility("default"))) void js_api_set_instrument_cache_size(
   instrument_cache_size = size;
 }
 
+__attribute__((visibility("default"))) void
+js_api_set_instrument_liveness_disable(void) {
+  instrument_liveness = false;
+}
+
 __attribute__((visibility("default"))) void
 js_api_set_instrument_suppress_disable(void) {
   instrument_suppress = false;
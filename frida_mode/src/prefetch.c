@@ -1,10 +1,16 @@
 #include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+  #include <link.h>
+#endif
 
 #include "frida-gumjs.h"
 
 #include "entry.h"
 #include "intercept.h"
 #include "prefetch.h"
+#include "ranges.h"
 #include "shm.h"
 #include "stalker.h"
 #include "util.h"
@@ -13,31 +19,47 @@
 #define PREFETCH_SIZE 65536
 #define PREFETCH_ENTRIES ((PREFETCH_SIZE - sizeof(size_t)) / sizeof(void *))
 
-#define BP_SIZE 524288
+/*
+ * The backpatch log is only reserved address space, shared with the children
+ * like the rest. Its pages are backed once a child writes to them, so it grows
+ * with the number of backpatches instead of dropping those past a fixed size.
+ */
+#define BP_SIZE (256UL << 20)
 
 typedef struct {
   size_t count;
   void  *entry[PREFETCH_ENTRIES];
 
-  guint8 backpatch_data[BP_SIZE];
-  gsize  backpatch_size;
+  gsize backpatch_size;
 
 } prefetch_data_t;
 
+typedef struct {
+  GumAddress base;
+  gsize      size;
+  gchar     *key;
+
+} prefetch_module_t;
+
 gboolean prefetch_enable = TRUE;
 gboolean prefetch_backpatch = TRUE;
+char    *prefetch_cache_file = NULL;
 
 static prefetch_data_t *prefetch_data = NULL;
+static guint8          *backpatch_data = NULL;
 
 static GHashTable *cant_prefetch = NULL;
 
+static GArray *cache_modules = NULL;
+static FILE   *cache_out = NULL;
+static gboolean cache_loaded = FALSE;
+
 static void gum_afl_stalker_backpatcher_notify(GumStalkerObserver *self,
                                                const GumBackpatch *backpatch,
                                                gsize               size) {
   UNUSED_PARAMETER(self);
   if (!entry_run) { return; }
-  gsize remaining =
-      sizeof(prefetch_data->backpatch_data) - prefetch_data->backpatch_size;
+  gsize remaining = BP_SIZE - prefetch_data->backpatch_size;
 
   gpointer from = gum_stalker_backpatch_get_from(backpatch);
   gpointer to = gum_stalker_backpatch_get_to(backpatch);
@@ -51,12 +73,11 @@ static void gum_afl_stalker_backpatcher_notify(GumStalkerObserver *self,
   if (sizeof(gsize) + size > remaining) { return; }
 
   gsize *dst_backpatch_size =
-      (gsize *)&prefetch_data->backpatch_data[prefetch_data->backpatch_size];
+      (gsize *)&backpatch_data[prefetch_data->backpatch_size];
   *dst_backpatch_size = size;
   prefetch_data->backpatch_size += sizeof(gsize);
 
-  memcpy(&prefetch_data->backpatch_data[prefetch_data->backpatch_size],
-         backpatch, size);
+  memcpy(&backpatch_data[prefetch_data->backpatch_size], backpatch, size);
   prefetch_data->backpatch_size += size;
 }
 
@@ -117,6 +138,201 @@ static gboolean prefetch_is_executable(void *address) {
   return ctx.executable;
 }
 
+/*
+ * AFL_FRIDA_INST_PREFETCH_CACHE: the blocks the parent prefetched are also
+ * written to a file, as an offset into their module. The module is known by
+ * its GNU build-id, or by its path, size and modification time if it has
+ * none. The next afl-fuzz run, or a restarted forkserver, prefetches them
+ * again before its first fork rather than having each of them compiled by a
+ * child first. Blocks of modules which changed or are gone are skipped.
+ * Backpatches refer to the code of the stalker itself, so they can't be kept.
+ */
+#if defined(__linux__)
+static gchar *prefetch_build_id(GumAddress base) {
+  ElfW(Ehdr) *ehdr = GSIZE_TO_POINTER(base);
+  ElfW(Phdr) *phdr;
+  GString    *id = NULL;
+
+  if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0) { return NULL; }
+
+  phdr = GSIZE_TO_POINTER(base + ehdr->e_phoff);
+
+  /* The notes are mapped at their vaddr relative to the lowest segment */
+  GumAddress bias = base;
+  for (ElfW(Half) i = 0; i < ehdr->e_phnum; i++) {
+    if (phdr[i].p_type == PT_LOAD) {
+      bias = base - (phdr[i].p_vaddr & ~(ElfW(Addr))(getpagesize() - 1));
+      break;
+    }
+  }
+
+  for (ElfW(Half) i = 0; i < ehdr->e_phnum && id == NULL; i++) {
+    if (phdr[i].p_type != PT_NOTE) { continue; }
+
+    guint8 *note = GSIZE_TO_POINTER(bias + phdr[i].p_vaddr);
+    guint8 *end = note + phdr[i].p_memsz;
+
+    while (note + sizeof(ElfW(Nhdr)) <= end) {
+      ElfW(Nhdr) *nhdr = (ElfW(Nhdr) *)note;
+      guint8     *name = note + sizeof(ElfW(Nhdr));
+      guint8     *desc = name + ((nhdr->n_namesz + 3) & ~3);
+
+      if (desc + nhdr->n_descsz > end) { break; }
+
+      if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 &&
+          memcmp(name, "GNU", 4) == 0) {
+        id = g_string_new("build-id:");
+        for (ElfW(Word) j = 0; j < nhdr->n_descsz; j++) {
+          g_string_append_printf(id, "%02x", desc[j]);
+        }
+
+        break;
+      }
+
+      note = desc + ((nhdr->n_descsz + 3) & ~3);
+    }
+  }
+
+  return id == NULL ? NULL : g_string_free(id, FALSE);
+}
+
+#endif
+
+static gboolean prefetch_add_module(const GumModuleDetails *details,
+                                    gpointer                user_data) {
+  UNUSED_PARAMETER(user_data);
+  prefetch_module_t module = {.base = details->range->base_address,
+                              .size = details->range->size,
+                              .key = NULL};
+  struct stat       st;
+
+#if defined(__linux__)
+  module.key = prefetch_build_id(module.base);
+#endif
+
+  if (module.key == NULL) {
+    if (details->path == NULL || stat(details->path, &st) != 0) { return TRUE; }
+
+    /* The path goes last, it may contain spaces */
+    module.key = g_strdup_printf("file:%" G_GINT64_MODIFIER
+                                 "x:%" G_GINT64_MODIFIER "x:%s",
+                                 (guint64)st.st_size, (guint64)st.st_mtime,
+                                 details->path);
+  }
+
+  g_array_append_val(cache_modules, module);
+  return TRUE;
+}
+
+static void prefetch_cache_modules(void) {
+  if (cache_modules != NULL) {
+    for (guint i = 0; i < cache_modules->len; i++) {
+      g_free(g_array_index(cache_modules, prefetch_module_t, i).key);
+    }
+
+    g_array_free(cache_modules, TRUE);
+  }
+
+  cache_modules = g_array_new(false, false, sizeof(prefetch_module_t));
+  gum_process_enumerate_modules(prefetch_add_module, NULL);
+}
+
+static prefetch_module_t *prefetch_cache_module(GumAddress address) {
+  for (guint i = 0; i < cache_modules->len; i++) {
+    prefetch_module_t *module =
+        &g_array_index(cache_modules, prefetch_module_t, i);
+    if (address >= module->base && address < module->base + module->size) {
+      return module;
+    }
+  }
+
+  return NULL;
+}
+
+static void prefetch_cache_write(void *addr) {
+  prefetch_module_t *module;
+
+  if (cache_out == NULL) { return; }
+
+  module = prefetch_cache_module(GUM_ADDRESS(addr));
+  if (module == NULL) {
+    /* Loaded since we last looked */
+    prefetch_cache_modules();
+    module = prefetch_cache_module(GUM_ADDRESS(addr));
+    if (module == NULL) { return; }
+  }
+
+  fprintf(cache_out, "%s %" G_GINT64_MODIFIER "x\n", module->key,
+          GUM_ADDRESS(addr) - module->base);
+}
+
+static gboolean prefetch_add_executable(const GumRangeDetails *details,
+                                        gpointer               user_data) {
+  GArray *executable = (GArray *)user_data;
+  g_array_append_val(executable, *details->range);
+  return TRUE;
+}
+
+static void prefetch_cache_read(void) {
+  GumStalker *stalker = stalker_get();
+  GHashTable *modules;
+  GArray     *executable;
+  gchar      *contents = NULL;
+  gchar     **lines;
+  GError     *error = NULL;
+  guint       count = 0;
+
+  cache_loaded = TRUE;
+
+  if (!g_file_get_contents(prefetch_cache_file, &contents, NULL, &error)) {
+    /* Nothing cached yet */
+    g_error_free(error);
+    return;
+  }
+
+  prefetch_cache_modules();
+
+  modules = g_hash_table_new(g_str_hash, g_str_equal);
+  for (guint i = 0; i < cache_modules->len; i++) {
+    prefetch_module_t *module =
+        &g_array_index(cache_modules, prefetch_module_t, i);
+    g_hash_table_insert(modules, module->key, module);
+  }
+
+  /* Looking up each block in the memory map on its own takes too long */
+  executable = g_array_new(false, false, sizeof(GumMemoryRange));
+  gum_process_enumerate_ranges(GUM_PAGE_EXECUTE, prefetch_add_executable,
+                               executable);
+
+  lines = g_strsplit(contents, "\n", -1);
+  for (gchar **line = lines; *line != NULL; line++) {
+    gchar *offset = strrchr(*line, ' ');
+    if (offset == NULL) { continue; }
+
+    *offset++ = '\0';
+    prefetch_module_t *module = g_hash_table_lookup(modules, *line);
+    if (module == NULL) { continue; }
+
+    GumAddress address = module->base + g_ascii_strtoull(offset, NULL, 16);
+    for (guint i = 0; i < executable->len; i++) {
+      GumMemoryRange *range = &g_array_index(executable, GumMemoryRange, i);
+      if (!GUM_MEMORY_RANGE_INCLUDES(range, address)) { continue; }
+
+      gum_stalker_prefetch(stalker, GSIZE_TO_POINTER(address), 1);
+      ranges_add_block(address);
+      count++;
+      break;
+    }
+  }
+
+  g_strfreev(lines);
+  g_array_free(executable, TRUE);
+  g_hash_table_destroy(modules);
+  g_free(contents);
+
+  FVERBOSE("Prefetched %u blocks from %s", count, prefetch_cache_file);
+}
+
 static void prefetch_read_blocks(void) {
   GumStalker *stalker = stalker_get();
   if (prefetch_data == NULL) return;
@@ -126,6 +342,8 @@ static void prefetch_read_blocks(void) {
 
     if (prefetch_is_executable(addr)) {
       gum_stalker_prefetch(stalker, addr, 1);
+      ranges_add_block(GUM_ADDRESS(addr));
+      prefetch_cache_write(addr);
 
     } else {
       /*
@@ -145,6 +363,8 @@ static void prefetch_read_blocks(void) {
    * refilled by the child.
    */
   prefetch_data->count = 0;
+
+  if (cache_out != NULL) { fflush(cache_out); }
 }
 
 static void prefetch_read_patches(void) {
@@ -155,7 +375,7 @@ static void prefetch_read_patches(void) {
   for (gsize remaining = prefetch_data->backpatch_size - offset;
        remaining > sizeof(gsize);
        remaining = prefetch_data->backpatch_size - offset) {
-    gsize *src_backpatch_data = (gsize *)&prefetch_data->backpatch_data[offset];
+    gsize *src_backpatch_data = (gsize *)&backpatch_data[offset];
     gsize  size = *src_backpatch_data;
     offset += sizeof(gsize);
 
@@ -163,7 +383,7 @@ static void prefetch_read_patches(void) {
       FFATAL("Incomplete backpatch entry");
     }
 
-    backpatch = (GumBackpatch *)&prefetch_data->backpatch_data[offset];
+    backpatch = (GumBackpatch *)&backpatch_data[offset];
 
     gpointer from = gum_stalker_backpatch_get_from(backpatch);
     gpointer to = gum_stalker_backpatch_get_to(backpatch);
@@ -198,6 +418,7 @@ static void prefetch_read_patches(void) {
  * Read the IPC region one block at the time and prefetch it
  */
 void prefetch_read(void) {
+  if (prefetch_cache_file != NULL && !cache_loaded) { prefetch_cache_read(); }
   prefetch_read_blocks();
   prefetch_read_patches();
 }
@@ -208,14 +429,17 @@ void prefetch_config(void) {
   if (prefetch_enable) {
     prefetch_backpatch =
         (getenv("AFL_FRIDA_INST_NO_PREFETCH_BACKPATCH") == NULL);
+    prefetch_cache_file = getenv("AFL_FRIDA_INST_PREFETCH_CACHE");
 
   } else {
     prefetch_backpatch = FALSE;
+    prefetch_cache_file = NULL;
   }
 }
 
 static int prefetch_on_fork(void) {
-  prefetch_read();
+  if (prefetch_enable) { prefetch_read(); }
+  ranges_reload();
   return fork();
 }
 
@@ -231,8 +455,15 @@ void prefetch_init(void) {
   FOKF(cBLU "Instrumentation" cRST " - " cGRN "prefetch_backpatch:" cYEL
             " [%c]",
        prefetch_backpatch ? 'X' : ' ');
+  FOKF(cBLU "Instrumentation" cRST " - " cGRN "prefetch cache:" cYEL " [%s]",
+       prefetch_cache_file == NULL ? " " : prefetch_cache_file);
+
+  /* The parent also checks AFL_FRIDA_INST_RANGES_FILE before each fork */
+  if (!prefetch_enable) {
+    if (ranges_inst_file != NULL) { prefetch_hook_fork(); }
+    return;
+  }
 
-  if (!prefetch_enable) { return; }
   /*
    * Make our shared memory, we can attach before we fork, just like AFL does
    * with the coverage bitmap region and fork will take care of ensuring both
@@ -240,6 +471,13 @@ void prefetch_init(void) {
    */
   prefetch_data = shm_create(sizeof(prefetch_data_t));
 
+  if (prefetch_cache_file != NULL) {
+    cache_out = fopen(prefetch_cache_file, "a");
+    if (cache_out == NULL) {
+      FFATAL("Failed to open %s, errno: %d", prefetch_cache_file, errno);
+    }
+  }
+
   prefetch_hook_fork();
 
   cant_prefetch = g_hash_table_new(g_direct_hash, g_direct_equal);
@@ -249,6 +487,12 @@ void prefetch_init(void) {
 
   if (!prefetch_backpatch) { return; }
 
+  backpatch_data = mmap(NULL, BP_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (backpatch_data == MAP_FAILED) {
+    FFATAL("Failed to mmap backpatch log, errno: %d", errno);
+  }
+
   GumStalkerObserver          *observer = stalker_get_observer();
   GumStalkerObserverInterface *iface = GUM_STALKER_OBSERVER_GET_IFACE(observer);
   iface->notify_backpatch = gum_afl_stalker_backpatcher_notify;
@@ -1,5 +1,8 @@
+#include <sys/stat.h>
+
 #include "frida-gumjs.h"
 
+#include "entry.h"
 #include "lib.h"
 #include "ranges.h"
 #include "stalker.h"
@@ -18,6 +21,7 @@ gboolean ranges_debug_maps = FALSE;
 gboolean ranges_inst_libs = FALSE;
 gboolean ranges_inst_jit = FALSE;
 gboolean ranges_inst_dynamic_load = TRUE;
+char    *ranges_inst_file = NULL;
 
 static GArray *module_ranges = NULL;
 static GArray *libs_ranges = NULL;
@@ -27,28 +31,47 @@ static GArray *exclude_ranges = NULL;
 static GArray *ranges = NULL;
 static GArray *whole_memory_ranges = NULL;
 
-static void convert_address_token(gchar *token, GumMemoryRange *range) {
-  gchar **tokens;
-  int     token_count;
+/*
+ * AFL_FRIDA_INST_RANGES_FILE: the ranges instrumented at startup, the part of
+ * them the file leaves out and the blocks the parent has compiled, which are
+ * all that a changed file needs to invalidate.
+ */
+static GArray     *inst_ranges = NULL;
+static GArray     *file_excluded = NULL;
+static GHashTable *file_blocks = NULL;
+static struct stat file_stat;
+
+/*
+ * The token parsers only warn, so that a bad AFL_FRIDA_INST_RANGES_FILE seen
+ * on a reload can leave the previous ranges in place. At startup the caller
+ * makes a failure fatal.
+ */
+static gboolean convert_address_token(gchar *token, GumMemoryRange *range) {
+  gchar  **tokens;
+  int      token_count;
+  gboolean ok = FALSE;
   tokens = g_strsplit(token, "-", 2);
   for (token_count = 0; tokens[token_count] != NULL; token_count++) {}
 
   if (token_count != 2) {
-    FFATAL("Invalid range (should have two addresses seperated by a '-'): %s\n",
+    FWARNF("Invalid range (should have two addresses seperated by a '-'): %s\n",
            token);
+    goto out;
   }
 
   gchar *from_str = tokens[0];
   gchar *to_str = tokens[1];
 
   if (!g_str_has_prefix(from_str, "0x")) {
-    FFATAL("Invalid range: %s - Start address should have 0x prefix: %s\n",
+    FWARNF("Invalid range: %s - Start address should have 0x prefix: %s\n",
            token, from_str);
+    goto out;
   }
 
   if (!g_str_has_prefix(to_str, "0x")) {
-    FFATAL("Invalid range: %s - End address should have 0x prefix: %s\n", token,
+    FWARNF("Invalid range: %s - End address should have 0x prefix: %s\n", token,
            to_str);
+    goto out;
   }
 
   from_str = &from_str[2];
@@ -56,41 +79,49 @@ static void convert_address_token(gchar *token, GumMemoryRange *range) {
 
   for (char *c = from_str; *c != '\0'; c++) {
     if (!g_ascii_isxdigit(*c)) {
-      FFATAL("Invalid range: %s - Start address not formed of hex digits: %s\n",
+      FWARNF("Invalid range: %s - Start address not formed of hex digits: %s\n",
              token, from_str);
+      goto out;
     }
   }
 
   for (char *c = to_str; *c != '\0'; c++) {
     if (!g_ascii_isxdigit(*c)) {
-      FFATAL("Invalid range: %s - End address not formed of hex digits: %s\n",
+      FWARNF("Invalid range: %s - End address not formed of hex digits: %s\n",
              token, to_str);
+      goto out;
     }
   }
 
   guint64 from = g_ascii_strtoull(from_str, NULL, 16);
   if (from == 0) {
-    FFATAL("Invalid range: %s - Start failed hex conversion: %s\n", token,
+    FWARNF("Invalid range: %s - Start failed hex conversion: %s\n", token,
            from_str);
+    goto out;
   }
 
   guint64 to = g_ascii_strtoull(to_str, NULL, 16);
   if (to == 0) {
-    FFATAL("Invalid range: %s - End failed hex conversion: %s\n", token,
+    FWARNF("Invalid range: %s - End failed hex conversion: %s\n", token,
            to_str);
+    goto out;
   }
 
   if (from >= to) {
-    FFATAL("Invalid range: %s - Start (0x%016" G_GINT64_MODIFIER
+    FWARNF("Invalid range: %s - Start (0x%016" G_GINT64_MODIFIER
            "x) must be less than end "
            "(0x%016" G_GINT64_MODIFIER "x)\n",
            token, from, to);
+    goto out;
   }
 
   range->base_address = from;
   range->size = to - from;
+  ok = TRUE;
 
+out:
   g_strfreev(tokens);
+  return ok;
 }
 
 static gboolean convert_name_token_for_module(const GumModuleDetails *details,
@@ -110,28 +141,34 @@ static gboolean convert_name_token_for_module(const GumModuleDetails *details,
   return false;
 }
 
-static void convert_name_token(gchar *token, GumMemoryRange *range) {
+static gboolean convert_name_token(gchar *token, GumMemoryRange *range) {
   gchar             *suffix = g_strconcat("/", token, NULL);
   convert_name_ctx_t ctx = {.suffix = suffix, .range = range, .done = false};
 
   gum_process_enumerate_modules(convert_name_token_for_module, &ctx);
-  if (!ctx.done) { FFATAL("Failed to resolve module: %s\n", token); }
   g_free(suffix);
+  if (!ctx.done) { FWARNF("Failed to resolve module: %s\n", token); }
+  return ctx.done;
 }
 
-static void convert_token(gchar *token, GumMemoryRange *range) {
+static gboolean convert_token(gchar *token, GumMemoryRange *range) {
+  gboolean ok;
+
   if (g_str_has_prefix(token, "0x")) {
-    convert_address_token(token, range);
+    ok = convert_address_token(token, range);
 
   }
 
   else {
-    convert_name_token(token, range);
+    ok = convert_name_token(token, range);
   }
 
+  if (!ok) { return FALSE; }
+
   FVERBOSE("Converted token: %s -> 0x%016" G_GINT64_MODIFIER
            "x-0x%016" G_GINT64_MODIFIER "x\n",
            token, range->base_address, range->base_address + range->size);
+  return TRUE;
 }
 
 gint range_sort(gconstpointer a, gconstpointer b) {
@@ -204,31 +241,38 @@ static GArray *collect_module_ranges(void) {
   return result;
 }
 
-static void check_for_overlaps(GArray *array) {
+static gboolean check_for_overlaps(GArray *array) {
   for (guint i = 1; i < array->len; i++) {
     GumMemoryRange *prev = &g_array_index(array, GumMemoryRange, i - 1);
     GumMemoryRange *curr = &g_array_index(array, GumMemoryRange, i);
     GumAddress      prev_limit = prev->base_address + prev->size;
     GumAddress      curr_limit = curr->base_address + curr->size;
     if (prev_limit > curr->base_address) {
-      FFATAL("Overlapping ranges 0x%016" G_GINT64_MODIFIER
+      FWARNF("Overlapping ranges 0x%016" G_GINT64_MODIFIER
              "x-0x%016" G_GINT64_MODIFIER "x 0x%016" G_GINT64_MODIFIER
              "x-0x%016" G_GINT64_MODIFIER "x",
              prev->base_address, prev_limit, curr->base_address, curr_limit);
+      return FALSE;
     }
   }
+
+  return TRUE;
 }
 
 void ranges_add_include(GumMemoryRange *range) {
   g_array_append_val(include_ranges, *range);
   g_array_sort(include_ranges, range_sort);
-  check_for_overlaps(include_ranges);
+  if (!check_for_overlaps(include_ranges)) {
+    FFATAL("Invalid include range");
+  }
 }
 
 void ranges_add_exclude(GumMemoryRange *range) {
   g_array_append_val(exclude_ranges, *range);
   g_array_sort(exclude_ranges, range_sort);
-  check_for_overlaps(exclude_ranges);
+  if (!check_for_overlaps(exclude_ranges)) {
+    FFATAL("Invalid exclude range");
+  }
 }
 
 static GArray *collect_ranges(char *env_key) {
@@ -250,13 +294,16 @@ static GArray *collect_ranges(char *env_key) {
     ;
 
   for (i = 0; i < token_count; i++) {
-    convert_token(tokens[i], &range);
+    if (!convert_token(tokens[i], &range)) {
+      FFATAL("Invalid range in %s", env_key);
+    }
+
     g_array_append_val(result, range);
   }
 
   g_array_sort(result, range_sort);
 
-  check_for_overlaps(result);
+  if (!check_for_overlaps(result)) { FFATAL("Invalid ranges in %s", env_key); }
 
   print_ranges(env_key, result);
 
@@ -474,6 +521,127 @@ static GArray *merge_ranges(GArray *a) {
   return result;
 }
 
+static GArray *copy_ranges(GArray *a) {
+  GArray *result = g_array_sized_new(false, false, sizeof(GumMemoryRange),
+                                     a->len);
+  g_array_append_vals(result, a->data, a->len);
+  return result;
+}
+
+/*
+ * Read AFL_FRIDA_INST_RANGES_FILE, tokens as in AFL_FRIDA_INST_RANGES
+ * separated by commas or white space, those starting with '!' are excluded.
+ */
+static gboolean read_file_ranges(GArray **inc, GArray **exc) {
+  gchar         *contents = NULL;
+  gchar        **tokens;
+  GError        *error = NULL;
+  GumMemoryRange range;
+  gboolean       ok = TRUE;
+
+  if (!g_file_get_contents(ranges_inst_file, &contents, NULL, &error)) {
+    FWARNF("Failed to read %s: %s", ranges_inst_file, error->message);
+    g_error_free(error);
+    return FALSE;
+  }
+
+  *inc = g_array_new(false, false, sizeof(GumMemoryRange));
+  *exc = g_array_new(false, false, sizeof(GumMemoryRange));
+
+  tokens = g_strsplit_set(contents, ", \t\r\n", -1);
+
+  for (gchar **t = tokens; *t != NULL; t++) {
+    gchar  *token = *t;
+    GArray *dst = *inc;
+
+    if (*token == '\0') { continue; }
+
+    if (*token == '!') {
+      dst = *exc;
+      token++;
+    }
+
+    if (!convert_token(token, &range)) {
+      ok = FALSE;
+      break;
+    }
+
+    g_array_append_val(dst, range);
+  }
+
+  g_strfreev(tokens);
+  g_free(contents);
+
+  if (ok) {
+    g_array_sort(*inc, range_sort);
+    g_array_sort(*exc, range_sort);
+    ok = check_for_overlaps(*inc) && check_for_overlaps(*exc);
+  }
+
+  if (!ok) {
+    g_array_free(*inc, TRUE);
+    g_array_free(*exc, TRUE);
+  }
+
+  return ok;
+}
+
+/*
+ * The ranges instrumented at startup which the file does not select, the
+ * file can only narrow down what the stalker follows.
+ */
+static GArray *collect_file_excluded(GArray *inc, GArray *exc) {
+  GArray *kept;
+  GArray *rest;
+  GArray *base;
+  GArray *left;
+  GArray *result;
+
+  if (inc->len == 0) {
+    kept = copy_ranges(inst_ranges);
+
+  } else {
+    base = copy_ranges(inst_ranges);
+    kept = intersect_ranges(base, inc);
+    g_array_free(base, TRUE);
+  }
+
+  rest = subtract_ranges(kept, exc);
+  base = copy_ranges(inst_ranges);
+  left = subtract_ranges(base, rest);
+  result = merge_ranges(left);
+
+  g_array_free(left, TRUE);
+  g_array_free(base, TRUE);
+  g_array_free(rest, TRUE);
+  g_array_free(kept, TRUE);
+
+  print_ranges("file", result);
+  return result;
+}
+
+static void init_file_ranges(GArray *instrumented) {
+  GArray *inc;
+  GArray *exc;
+
+  if (ranges_inst_file == NULL) { return; }
+
+  if (stat(ranges_inst_file, &file_stat) != 0) {
+    FFATAL("Failed to stat %s, errno: %d", ranges_inst_file, errno);
+  }
+
+  if (!read_file_ranges(&inc, &exc)) {
+    FFATAL("Invalid ranges in %s", ranges_inst_file);
+  }
+
+  inst_ranges = copy_ranges(instrumented);
+  file_excluded = collect_file_excluded(inc, exc);
+  file_blocks = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+  g_array_free(exc, TRUE);
+  g_array_free(inc, TRUE);
+}
+
 void ranges_print_debug_maps(void) {
   FVERBOSE("Maps");
   gum_process_enumerate_ranges(GUM_PAGE_NO_ACCESS, print_ranges_callback, NULL);
@@ -487,6 +655,8 @@ void ranges_config(void) {
     ranges_inst_dynamic_load = FALSE;
   }
 
+  ranges_inst_file = getenv("AFL_FRIDA_INST_RANGES_FILE");
+
   if (ranges_debug_maps) { ranges_print_debug_maps(); }
 
   include_ranges = collect_ranges("AFL_FRIDA_INST_RANGES");
@@ -536,6 +706,8 @@ void ranges_init(void) {
   step4 = subtract_ranges(step3, jit_ranges);
   print_ranges("step4", step4);
 
+  init_file_ranges(step4);
+
   /*
    * After step 4 we have the total ranges to be instrumented, we now subtract
    * that either from the original ranges of the modules or from the whole
@@ -562,11 +734,9 @@ void ranges_init(void) {
   ranges_exclude();
 }
 
-gboolean range_is_excluded(GumAddress address) {
-  if (ranges == NULL) { return false; }
-
-  for (guint i = 0; i < ranges->len; i++) {
-    GumMemoryRange *curr = &g_array_index(ranges, GumMemoryRange, i);
+static gboolean ranges_contain(GArray *array, GumAddress address) {
+  for (guint i = 0; i < array->len; i++) {
+    GumMemoryRange *curr = &g_array_index(array, GumMemoryRange, i);
     GumAddress      curr_limit = curr->base_address + curr->size;
 
     if (address < curr->base_address) { return false; }
@@ -577,6 +747,75 @@ gboolean range_is_excluded(GumAddress address) {
   return false;
 }
 
+gboolean range_is_excluded(GumAddress address) {
+  if (ranges == NULL) { return false; }
+
+  if (file_excluded != NULL && ranges_contain(file_excluded, address)) {
+    return true;
+  }
+
+  return ranges_contain(ranges, address);
+}
+
+void ranges_add_block(GumAddress address) {
+  if (file_blocks == NULL || entry_run) { return; }
+
+  g_hash_table_add(file_blocks, GSIZE_TO_POINTER(address));
+}
+
+/*
+ * Called by the parent before each fork. If AFL_FRIDA_INST_RANGES_FILE was
+ * replaced, only the blocks it (de)selects are invalidated, so that the next
+ * child compiles them again with or without instrumentation.
+ */
+void ranges_reload(void) {
+  struct stat    st;
+  GArray        *inc;
+  GArray        *exc;
+  GArray        *old;
+  GHashTableIter iter;
+  gpointer       key;
+  guint          invalidated = 0;
+  GumStalker    *stalker = stalker_get();
+
+  if (file_blocks == NULL) { return; }
+
+  if (stat(ranges_inst_file, &st) != 0) { return; }
+
+  if (st.st_mtime == file_stat.st_mtime && st.st_size == file_stat.st_size &&
+      st.st_ino == file_stat.st_ino) {
+    return;
+  }
+
+  file_stat = st;
+
+  if (!read_file_ranges(&inc, &exc)) {
+    FWARNF("Keeping the previous ranges of %s", ranges_inst_file);
+    return;
+  }
+
+  old = file_excluded;
+  file_excluded = collect_file_excluded(inc, exc);
+
+  g_hash_table_iter_init(&iter, file_blocks);
+  while (g_hash_table_iter_next(&iter, &key, NULL)) {
+    GumAddress address = GUM_ADDRESS(key);
+
+    if (ranges_contain(old, address) !=
+        ranges_contain(file_excluded, address)) {
+      gum_stalker_invalidate(stalker, key);
+      invalidated++;
+    }
+  }
+
+  FVERBOSE("Reloaded %s, invalidated %u blocks", ranges_inst_file,
+           invalidated);
+
+  g_array_free(old, TRUE);
+  g_array_free(exc, TRUE);
+  g_array_free(inc, TRUE);
+}
+
 void ranges_exclude() {
   GumMemoryRange *r;
   GumStalker     *stalker = stalker_get();
@@ -8,17 +8,14 @@
   #include "seccomp.h"
   #include "util.h"
 
-static void seccomp_callback_filter(struct seccomp_notif      *req,
-                                    struct seccomp_notif_resp *resp,
-                                    GumReturnAddressArray     *frames) {
-  GumDebugSymbolDetails details = {0};
+/* Runs in the writer, see seccomp_ring.c */
+static void seccomp_callback_write(seccomp_ring_entry_t *entry) {
+  struct seccomp_notif  *req = &entry->req;
+  GumReturnAddressArray *frames = &entry->frames;
+  GumDebugSymbolDetails  details = {0};
+
   if (req->data.nr == SYS_OPENAT) {
-  #if UINTPTR_MAX == 0xffffffffffffffffu
-    seccomp_print("SYS_OPENAT: (%s)\n", (char *)req->data.args[1]);
-  #endif
-  #if UINTPTR_MAX == 0xffffffff
-    seccomp_print("SYS_OPENAT: (%s)\n", (char *)(__u32)req->data.args[1]);
-  #endif
+    seccomp_print("SYS_OPENAT: (%s)\n", entry->path);
   }
 
   seccomp_print(
@@ -60,6 +57,12 @@ static void seccomp_callback_filter(struct seccomp_notif      *req,
   }
 
   #endif
+}
+
+static void seccomp_callback_filter(struct seccomp_notif      *req,
+                                    struct seccomp_notif_resp *resp,
+                                    GumReturnAddressArray     *frames) {
+  seccomp_ring_push(req, frames);
 
   resp->error = 0;
   resp->val = 0;
@@ -83,8 +86,9 @@ void seccomp_callback_parent(void) {
   pid_t child = -1;
   int   child_fd = -1;
 
+  seccomp_ring_start(seccomp_callback_write);
   seccomp_socket_create(sock);
-  seccomp_child_run(seccomp_callback_child, sock, &child, &child_fd);
+  seccomp_child_run(seccomp_callback_child, sock, true, &child, &child_fd);
 
   if (dup2(child_fd, SECCOMP_PARENT_EVENT_FD) < 0) { FFATAL("dup2"); }
 
@@ -31,8 +31,8 @@ static int seccomp_child_func(void *ctx) {
   return 0;
 }
 
-void seccomp_child_run(seccomp_child_func_t child_func, void *ctx, pid_t *child,
-                       int *event_fd) {
+void seccomp_child_run(seccomp_child_func_t child_func, void *ctx,
+                       bool share_vm, pid_t *child, int *event_fd) {
   int fd = seccomp_event_create();
 
   seccomp_child_func_ctx_t *child_ctx =
@@ -41,7 +41,9 @@ void seccomp_child_run(seccomp_child_func_t child_func, void *ctx, pid_t *child,
   child_ctx->ctx = ctx;
   child_ctx->event_fd = fd;
 
-  int flags = CLONE_VM | CLONE_UNTRACED;
+  /* No exit signal, so that the target doesn't reap it with wait() */
+  int flags = CLONE_UNTRACED;
+  if (share_vm) { flags |= CLONE_VM; }
 
   char *stack =
       (char *)mmap(NULL, SECCOMP_CHILD_STACK_SIZE, PROT_READ | PROT_WRITE,
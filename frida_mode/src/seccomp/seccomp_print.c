@@ -5,20 +5,38 @@
   #include "seccomp.h"
   #include "util.h"
 
-static void seccomp_print_v(int fd, char *format, va_list ap) {
+  #define SECCOMP_PRINT_BUFFER_SIZE (64UL << 10)
+
+/* The writer collects the lines of a batch here and writes them in one go */
+static char   seccomp_print_buffer[SECCOMP_PRINT_BUFFER_SIZE];
+static size_t seccomp_print_len = 0;
+
+void seccomp_print_flush(void) {
+  if (seccomp_print_len == 0) { return; }
+  IGNORED_RETURN(
+      write(SECCOMP_OUTPUT_FILE_FD, seccomp_print_buffer, seccomp_print_len));
+  seccomp_print_len = 0;
+}
+
+static void seccomp_print_v(char *format, va_list ap) {
   char buffer[4096] = {0};
   int  len;
 
   if (vsnprintf(buffer, sizeof(buffer) - 1, format, ap) < 0) { return; }
 
   len = strnlen(buffer, sizeof(buffer));
-  IGNORED_RETURN(write(fd, buffer, len));
+  if (seccomp_print_len + len > sizeof(seccomp_print_buffer)) {
+    seccomp_print_flush();
+  }
+
+  memcpy(&seccomp_print_buffer[seccomp_print_len], buffer, len);
+  seccomp_print_len += len;
 }
 
 void seccomp_print(char *format, ...) {
   va_list ap;
   va_start(ap, format);
-  seccomp_print_v(SECCOMP_OUTPUT_FILE_FD, format, ap);
+  seccomp_print_v(format, ap);
   va_end(ap);
 }
 
@@ -0,0 +1,147 @@
+#if defined(__linux__) && !defined(__ANDROID__)
+
+  #include <errno.h>
+  #include <poll.h>
+  #include <stdio.h>
+  #include <string.h>
+  #include <sys/mman.h>
+  #include <unistd.h>
+
+  #include "seccomp.h"
+  #include "util.h"
+
+  /* Entries, must be a power of two */
+  #define SECCOMP_RING_SIZE 1024
+  /* How often the writer checks whether the target is still around */
+  #define SECCOMP_RING_POLL_MS 500
+
+/*
+ * The supervisor used to print each syscall, symbols and all, while the
+ * target waited for its reply. Now it only copies the notification and the
+ * backtrace into this ring and lets the target carry on. A writer process
+ * started before the filter is installed empties the ring in batches, so the
+ * symbol look-ups and writes to the log are off the target's path. The
+ * supervisor fills and the writer empties the ring, each moving only its own
+ * index, so neither needs a lock. The eventfds are only used to wake one up
+ * when the other has been waiting on an empty or a full ring.
+ */
+typedef struct {
+  volatile guint64     head;            /* next entry to read           */
+  volatile guint64     tail;            /* next entry to write          */
+  volatile gboolean    writer_sleeping;
+  volatile gboolean    supervisor_waiting;
+  seccomp_ring_entry_t entries[SECCOMP_RING_SIZE];
+
+} seccomp_ring_t;
+
+static seccomp_ring_t *seccomp_ring = MAP_FAILED;
+static int             seccomp_ring_data_fd = -1;
+static int             seccomp_ring_space_fd = -1;
+
+static void seccomp_ring_drain(seccomp_ring_callback_t callback) {
+  guint64 head = __atomic_load_n(&seccomp_ring->head, __ATOMIC_RELAXED);
+  guint64 tail = __atomic_load_n(&seccomp_ring->tail, __ATOMIC_ACQUIRE);
+
+  for (; head != tail; head++) {
+    callback(&seccomp_ring->entries[head & (SECCOMP_RING_SIZE - 1)]);
+    __atomic_store_n(&seccomp_ring->head, head + 1, __ATOMIC_SEQ_CST);
+  }
+
+  seccomp_print_flush();
+
+  if (__atomic_load_n(&seccomp_ring->supervisor_waiting, __ATOMIC_SEQ_CST)) {
+    seccomp_event_signal(seccomp_ring_space_fd);
+  }
+}
+
+static void seccomp_ring_writer(int event_fd, void *ctx) {
+  seccomp_ring_callback_t callback = (seccomp_ring_callback_t)ctx;
+  pid_t                   target = getppid();
+  struct pollfd           pfd = {.fd = seccomp_ring_data_fd, .events = POLLIN};
+
+  seccomp_event_signal(event_fd);
+
+  while (true) {
+    seccomp_ring_drain(callback);
+
+    __atomic_store_n(&seccomp_ring->writer_sleeping, TRUE, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&seccomp_ring->tail, __ATOMIC_SEQ_CST) ==
+        __atomic_load_n(&seccomp_ring->head, __ATOMIC_RELAXED)) {
+      int ret = poll(&pfd, 1, SECCOMP_RING_POLL_MS);
+      if (ret < 0 && errno != EINTR) { FFATAL("seccomp_ring - poll"); }
+
+      if (ret > 0) { seccomp_event_wait(seccomp_ring_data_fd); }
+
+      /* We were re-parented, the target is gone */
+      if (ret == 0 && getppid() != target) {
+        seccomp_ring_drain(callback);
+        _exit(0);
+      }
+    }
+
+    __atomic_store_n(&seccomp_ring->writer_sleeping, FALSE, __ATOMIC_SEQ_CST);
+  }
+}
+
+void seccomp_ring_start(seccomp_ring_callback_t callback) {
+  int event_fd = -1;
+
+  seccomp_ring = mmap(NULL, sizeof(seccomp_ring_t), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (seccomp_ring == MAP_FAILED) { FFATAL("seccomp_ring - mmap"); }
+
+  seccomp_ring_data_fd = seccomp_event_create();
+  seccomp_ring_space_fd = seccomp_event_create();
+
+  /*
+   * The writer gets a copy of the address space, so that it can allocate and
+   * look up symbols without getting in the way of the target, and only
+   * shares the ring with it.
+   */
+  seccomp_child_run(seccomp_ring_writer, callback, false, NULL, &event_fd);
+  seccomp_child_wait(event_fd);
+}
+
+void seccomp_ring_push(struct seccomp_notif  *req,
+                       GumReturnAddressArray *frames) {
+  guint64               tail = seccomp_ring->tail;
+  seccomp_ring_entry_t *entry;
+
+  while (tail - __atomic_load_n(&seccomp_ring->head, __ATOMIC_SEQ_CST) ==
+         SECCOMP_RING_SIZE) {
+    __atomic_store_n(&seccomp_ring->supervisor_waiting, TRUE,
+                     __ATOMIC_SEQ_CST);
+
+    if (tail - __atomic_load_n(&seccomp_ring->head, __ATOMIC_SEQ_CST) ==
+        SECCOMP_RING_SIZE) {
+      seccomp_event_wait(seccomp_ring_space_fd);
+    }
+
+    __atomic_store_n(&seccomp_ring->supervisor_waiting, FALSE,
+                     __ATOMIC_SEQ_CST);
+  }
+
+  entry = &seccomp_ring->entries[tail & (SECCOMP_RING_SIZE - 1)];
+  memcpy(&entry->req, req, sizeof(struct seccomp_notif));
+
+  entry->frames.len = MIN(frames->len, GUM_MAX_BACKTRACE_DEPTH);
+  memcpy(entry->frames.items, frames->items,
+         entry->frames.len * sizeof(GumReturnAddress));
+
+  /* The target may change the path once it carries on, take a copy now */
+  entry->path[0] = '\0';
+  if (req->data.nr == SYS_OPENAT) {
+    strncpy(entry->path, (char *)(uintptr_t)req->data.args[1],
+            sizeof(entry->path) - 1);
+    entry->path[sizeof(entry->path) - 1] = '\0';
+  }
+
+  __atomic_store_n(&seccomp_ring->tail, tail + 1, __ATOMIC_SEQ_CST);
+
+  if (__atomic_load_n(&seccomp_ring->writer_sleeping, __ATOMIC_SEQ_CST)) {
+    seccomp_event_signal(seccomp_ring_data_fd);
+  }
+}
+
+#endif
@@ -55,7 +55,12 @@ void stats_write(void) {
   g_free(date_string);
   g_date_time_unref(date_time);
 
-  stats_write_arch(stats_data);
+  if (stats_sample == 0) {
+    stats_write_arch(stats_data);
+
+  } else {
+    stats_sample_write();
+  }
 
   memcpy(&stats_data->prev, &stats_data->curr, sizeof(stats_t));
 }
@@ -272,6 +277,7 @@ static void stats_observer_init(GumStalkerObserver *observer) {
 void stats_config(void) {
   stats_filename = getenv("AFL_FRIDA_STATS_FILE");
   stats_interval = util_read_num("AFL_FRIDA_STATS_INTERVAL", 10);
+  stats_sample = util_read_num("AFL_FRIDA_STATS_SAMPLE", 0);
 }
 
 void stats_init(void) {
@@ -288,6 +294,12 @@ void stats_init(void) {
         "AFL_FRIDA_STATS_INTERVAL is");
   }
 
+  if (stats_sample != 0 && stats_filename == NULL) {
+    FFATAL(
+        "AFL_FRIDA_STATS_FILE must be specified if "
+        "AFL_FRIDA_STATS_SAMPLE is");
+  }
+
   stats_interval_us = stats_interval * MICRO_TO_SEC;
 
   if (stats_filename == NULL) { return; }
@@ -304,11 +316,15 @@ void stats_init(void) {
 
   g_free(path);
 
+  stats_data = shm_create(sizeof(stats_data_t));
+
+  /* Sampling replaces the accounting of each instruction and transition */
+  stats_sample_init();
+  if (stats_sample != 0) { return; }
+
   GumStalkerObserver *observer = stalker_get_observer();
   stats_observer_init(observer);
 
-  stats_data = shm_create(sizeof(stats_data_t));
-
   starts_arch_init();
 }
 
@@ -328,10 +344,12 @@ void stats_print(char *format, ...) {
 
 void stats_on_fork(void) {
   stats_write();
+  stats_sample_on_fork();
 }
 
 void stats_collect(const cs_insn *instr, gboolean begin) {
   if (!entry_compiled) { return; }
   if (stats_filename == NULL) { return; }
+  if (stats_sample != 0) { return; }
   stats_collect_arch(instr, begin);
 }
@@ -0,0 +1,354 @@
+#include <errno.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+#if defined(__linux__)
+  #include <ucontext.h>
+#endif
+
+#include "frida-gumjs.h"
+
+#include "shm.h"
+#include "stats.h"
+#include "util.h"
+
+/*
+ * AFL_FRIDA_STATS_SAMPLE: rather than accounting for every instruction and
+ * transition, a profiling timer interrupts the child every so often and we
+ * count the block it was executing. Since the child runs the instrumented
+ * copies of the blocks, we keep a table of where the code of each block
+ * starts, sorted by the address of the code, and attribute a sample to the
+ * closest block before it. Samples taken outside of the stalker (e.g. in
+ * excluded ranges or in FRIDA itself) are counted by the address itself.
+ */
+
+#define SAMPLE_BLOCKS_MAX (1UL << 20)
+#define SAMPLE_SLOTS (1UL << 16)
+#define SAMPLE_PROBES 16
+#define SAMPLE_BLOCK_SIZE_MAX 4096
+#define SAMPLE_MODULE_TOP 10
+
+typedef struct {
+  GumAddress code;
+  GumAddress address;
+
+} sample_block_t;
+
+typedef struct {
+  guint64 address;
+  guint64 count;
+
+} sample_slot_t;
+
+typedef struct {
+  guint64       total;
+  guint64       dropped;
+  sample_slot_t slots[SAMPLE_SLOTS];
+
+} sample_data_t;
+
+typedef struct {
+  GumAddress base;
+  gsize      size;
+  gchar     *name;
+  guint64    count;
+  GArray    *slots;
+
+} sample_module_t;
+
+guint64 stats_sample = 0;
+
+static sample_block_t *blocks = MAP_FAILED;
+static guint64         blocks_count = 0;
+static gboolean        blocks_busy = FALSE;
+static GMutex          blocks_mutex;
+static sample_data_t  *sample_data = MAP_FAILED;
+
+/* The block whose code contains pc, or 0 if there is none */
+static GumAddress stats_sample_lookup(GumAddress pc) {
+  guint64 lo = 0, hi = __atomic_load_n(&blocks_count, __ATOMIC_ACQUIRE);
+
+  while (lo < hi) {
+    guint64 mid = lo + (hi - lo) / 2;
+    if (blocks[mid].code <= pc) {
+      lo = mid + 1;
+
+    } else {
+      hi = mid;
+    }
+  }
+
+  if (lo == 0) { return 0; }
+  if (pc - blocks[lo - 1].code >= SAMPLE_BLOCK_SIZE_MAX) { return 0; }
+  return blocks[lo - 1].address;
+}
+
+static void stats_sample_count(GumAddress address) {
+  guint64 hash = (address >> 2) * 0x9e3779b97f4a7c15ULL;
+
+  for (guint i = 0; i < SAMPLE_PROBES; i++) {
+    sample_slot_t *slot = &sample_data->slots[(hash + i) & (SAMPLE_SLOTS - 1)];
+    guint64        expected = 0;
+
+    if (__atomic_load_n(&slot->address, __ATOMIC_RELAXED) == address ||
+        __atomic_compare_exchange_n(&slot->address, &expected, address, FALSE,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED) ||
+        expected == address) {
+      __atomic_add_fetch(&slot->count, 1, __ATOMIC_RELAXED);
+      return;
+    }
+  }
+
+  __atomic_add_fetch(&sample_data->dropped, 1, __ATOMIC_RELAXED);
+}
+
+static void stats_sample_handler(int sig, siginfo_t *info, void *context) {
+  GumAddress pc = 0, address;
+
+  UNUSED_PARAMETER(sig);
+  UNUSED_PARAMETER(info);
+
+#if defined(__linux__) && defined(__x86_64__)
+  pc = ((ucontext_t *)context)->uc_mcontext.gregs[REG_RIP];
+#elif defined(__linux__) && defined(__i386__)
+  pc = ((ucontext_t *)context)->uc_mcontext.gregs[REG_EIP];
+#elif defined(__linux__) && defined(__aarch64__)
+  pc = ((ucontext_t *)context)->uc_mcontext.pc;
+#else
+  UNUSED_PARAMETER(context);
+#endif
+
+  __atomic_add_fetch(&sample_data->total, 1, __ATOMIC_RELAXED);
+
+  /* The table is being shuffled, the lookup could go anywhere */
+  if (__atomic_load_n(&blocks_busy, __ATOMIC_ACQUIRE)) {
+    __atomic_add_fetch(&sample_data->dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  address = stats_sample_lookup(pc);
+  stats_sample_count(address == 0 ? pc : address);
+}
+
+void stats_sample_init(void) {
+  struct sigaction sa = {0};
+
+  FOKF(cBLU "Stats" cRST " - " cGRN "sample:" cYEL " [%" G_GINT64_MODIFIER
+            "u]",
+       stats_sample);
+
+  if (stats_sample == 0) { return; }
+
+#if !defined(__linux__) || defined(__arm__)
+  FFATAL("AFL_FRIDA_STATS_SAMPLE is only supported on Linux x86/x64/aarch64");
+#endif
+
+  blocks = mmap(NULL, SAMPLE_BLOCKS_MAX * sizeof(sample_block_t),
+                PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (blocks == MAP_FAILED) { FFATAL("Failed to map sample blocks"); }
+
+  sample_data = shm_create(sizeof(sample_data_t));
+
+  sa.sa_sigaction = stats_sample_handler;
+  sa.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGPROF, &sa, NULL) < 0) {
+    FFATAL("Failed to sigaction: %d", errno);
+  }
+}
+
+void stats_sample_block(GumAddress address, gpointer code) {
+  sample_block_t block = {.code = GUM_ADDRESS(code), .address = address};
+  guint64        lo = 0, hi;
+
+  if (stats_sample == 0) { return; }
+
+  g_mutex_lock(&blocks_mutex);
+
+  hi = blocks_count;
+  if (hi == SAMPLE_BLOCKS_MAX) {
+    g_mutex_unlock(&blocks_mutex);
+    return;
+  }
+
+  /* Blocks are mostly written one after the other, so usually we append */
+  if (hi == 0 || blocks[hi - 1].code < block.code) {
+    blocks[hi] = block;
+    __atomic_store_n(&blocks_count, hi + 1, __ATOMIC_RELEASE);
+    g_mutex_unlock(&blocks_mutex);
+    return;
+  }
+
+  while (lo < hi) {
+    guint64 mid = lo + (hi - lo) / 2;
+    if (blocks[mid].code < block.code) {
+      lo = mid + 1;
+
+    } else {
+      hi = mid;
+    }
+  }
+
+  __atomic_store_n(&blocks_busy, TRUE, __ATOMIC_RELEASE);
+
+  if (blocks[lo].code == block.code) {
+    /* The code was recycled for another block */
+    blocks[lo] = block;
+
+  } else {
+    memmove(&blocks[lo + 1], &blocks[lo],
+            (blocks_count - lo) * sizeof(sample_block_t));
+    blocks[lo] = block;
+    __atomic_store_n(&blocks_count, blocks_count + 1, __ATOMIC_RELEASE);
+  }
+
+  __atomic_store_n(&blocks_busy, FALSE, __ATOMIC_RELEASE);
+
+  g_mutex_unlock(&blocks_mutex);
+}
+
+void stats_sample_on_fork(void) {
+  guint64          usec = stats_sample;
+  struct itimerval timer = {
+
+      .it_interval = {.tv_sec = usec / 1000000, .tv_usec = usec % 1000000},
+      .it_value = {.tv_sec = usec / 1000000, .tv_usec = usec % 1000000}};
+
+  if (stats_sample == 0) { return; }
+
+  /* Timers aren't inherited by the child */
+  if (setitimer(ITIMER_PROF, &timer, NULL) < 0) {
+    FFATAL("Failed to setitimer: %d", errno);
+  }
+}
+
+static gboolean stats_sample_add_module(const GumModuleDetails *details,
+                                        gpointer                user_data) {
+  GArray         *modules = (GArray *)user_data;
+  sample_module_t module = {.base = details->range->base_address,
+                            .size = details->range->size,
+                            .name = g_strdup(details->name),
+                            .count = 0,
+                            .slots = NULL};
+
+  g_array_append_val(modules, module);
+  return TRUE;
+}
+
+static gint stats_sample_sort(gconstpointer a, gconstpointer b) {
+  const sample_slot_t *sa = (const sample_slot_t *)a;
+  const sample_slot_t *sb = (const sample_slot_t *)b;
+
+  if (sa->count > sb->count) { return -1; }
+  if (sa->count < sb->count) { return 1; }
+  return 0;
+}
+
+static gint stats_sample_sort_modules(gconstpointer a, gconstpointer b) {
+  const sample_module_t *ma = (const sample_module_t *)a;
+  const sample_module_t *mb = (const sample_module_t *)b;
+
+  if (ma->count > mb->count) { return -1; }
+  if (ma->count < mb->count) { return 1; }
+  return 0;
+}
+
+static void stats_sample_write_stat(char *label, guint64 value,
+                                    guint64 total) {
+  stats_print("%-30s %10" G_GINT64_MODIFIER "u ", label, value);
+  if (total == 0) {
+    stats_print("(--.--%%)\n");
+
+  } else {
+    stats_print("(%5.2f%%)\n", ((float)value * 100) / total);
+  }
+}
+
+/*
+ * Write the modules by the number of samples taken in them, each with its
+ * hottest blocks as offsets which can be used for AFL_FRIDA_INST_RANGES.
+ */
+void stats_sample_write(void) {
+  GArray          *modules;
+  sample_module_t  unknown = {.name = "[unknown]", .count = 0};
+  sample_module_t *module;
+  guint64          total, dropped;
+
+  if (stats_sample == 0) { return; }
+
+  total = __atomic_load_n(&sample_data->total, __ATOMIC_RELAXED);
+  dropped = __atomic_load_n(&sample_data->dropped, __ATOMIC_RELAXED);
+
+  modules = g_array_new(FALSE, FALSE, sizeof(sample_module_t));
+  gum_process_enumerate_modules(stats_sample_add_module, modules);
+
+  unknown.slots = g_array_new(FALSE, FALSE, sizeof(sample_slot_t));
+
+  for (gsize i = 0; i < SAMPLE_SLOTS; i++) {
+    sample_slot_t slot = sample_data->slots[i];
+    if (slot.count == 0) { continue; }
+
+    module = &unknown;
+    for (guint j = 0; j < modules->len; j++) {
+      sample_module_t *m = &g_array_index(modules, sample_module_t, j);
+      if (slot.address >= m->base && slot.address < m->base + m->size) {
+        module = m;
+        break;
+      }
+    }
+
+    if (module->slots == NULL) {
+      module->slots = g_array_new(FALSE, FALSE, sizeof(sample_slot_t));
+    }
+
+    module->count += slot.count;
+    g_array_append_val(module->slots, slot);
+  }
+
+  g_array_append_val(modules, unknown);
+  g_array_sort(modules, stats_sample_sort_modules);
+
+  stats_print("Samples\n");
+  stats_print("-------\n");
+  stats_sample_write_stat("Total", total, total);
+  stats_sample_write_stat("Dropped", dropped, total);
+  stats_print("\n");
+
+  for (guint i = 0; i < modules->len; i++) {
+    module = &g_array_index(modules, sample_module_t, i);
+    if (module->count == 0) { continue; }
+    stats_sample_write_stat(module->name, module->count, total);
+  }
+
+  stats_print("\n");
+
+  for (guint i = 0; i < modules->len; i++) {
+    module = &g_array_index(modules, sample_module_t, i);
+    if (module->count == 0) { continue; }
+
+    g_array_sort(module->slots, stats_sample_sort);
+
+    stats_print("%s (0x%016" G_GINT64_MODIFIER "x)\n", module->name,
+                module->base);
+
+    for (guint j = 0; j < module->slots->len && j < SAMPLE_MODULE_TOP; j++) {
+      sample_slot_t *slot = &g_array_index(module->slots, sample_slot_t, j);
+      stats_print("  +0x%08" G_GINT64_MODIFIER "x %10" G_GINT64_MODIFIER
+                  "u (%5.2f%%)\n",
+                  slot->address - module->base, slot->count,
+                  ((float)slot->count * 100) / module->count);
+    }
+
+    stats_print("\n");
+  }
+
+  for (guint i = 0; i < modules->len; i++) {
+    module = &g_array_index(modules, sample_module_t, i);
+    if (module->slots != NULL) { g_array_free(module->slots, TRUE); }
+    if (module->name != unknown.name) { g_free(module->name); }
+  }
+
+  g_array_free(modules, TRUE);
+}
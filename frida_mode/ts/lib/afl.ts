@@ -91,6 +91,13 @@ class Afl {
         Afl.jsApiSetCacheDisable();
     }
 
+    /**
+     * See `AFL_FRIDA_CMPLOG_NO_FILTER`.
+     */
+    public static setCmplogFilterDisable(): void {
+        Afl.jsApiSetCmplogFilterDisable();
+    }
+
     /**
      * See `AFL_FRIDA_DEBUG_MAPS`.
      */
@@ -208,6 +215,13 @@ class Afl {
         Afl.jsApiSetInstrumentSeed(seed);
     }
 
+    /*
+     * See `AFL_FRIDA_INST_NO_LIVENESS`
+     */
+    public static setInstrumentLivenessDisable(): void {
+        Afl.jsApiSetInstrumentLivenessDisable();
+    }
+
     /*
      * See `AFL_FRIDA_INST_NO_SUPPRESS`
      */
@@ -285,6 +299,15 @@ class Afl {
         Afl.jsApiSetPrefetchBackpatchDisable();
     }
 
+    /**
+     * See `AFL_FRIDA_INST_PREFETCH_CACHE`. This function takes a single
+     * `string` as an argument.
+     */
+    public static setPrefetchCacheFile(file: string): void {
+        const buf = Memory.allocUtf8String(file);
+        Afl.jsApiSetPrefetchCacheFile(buf);
+    }
+
     /**
      * See `AFL_FRIDA_INST_NO_PREFETCH`.
      */
@@ -340,6 +363,14 @@ class Afl {
         Afl.jsApiSetStatsInterval(interval);
     }
 
+    /**
+     * See `AFL_FRIDA_STATS_SAMPLE`. This function takes a `number` as an
+     * argument
+     */
+    public static setStatsSample(sample: number): void {
+        Afl.jsApiSetStatsSample(sample);
+    }
+
     /**
      * See `AFL_FRIDA_OUTPUT_STDERR`. This function takes a single `string` as
      * an argument.
@@ -404,6 +435,11 @@ class Afl {
         "void",
         []);
 
+    private static readonly jsApiSetCmplogFilterDisable = Afl.jsApiGetFunction(
+        "js_api_set_cmplog_filter_disable",
+        "void",
+        []);
+
     private static readonly jsApiSetDebugMaps = Afl.jsApiGetFunction(
         "js_api_set_debug_maps",
         "void",
@@ -465,6 +501,11 @@ class Afl {
         "void",
         ["pointer"]);
 
+    private static readonly jsApiSetInstrumentLivenessDisable = Afl.jsApiGetFunction(
+        "js_api_set_instrument_liveness_disable",
+        "void",
+        []);
+
     private static readonly jsApiSetInstrumentSeed = Afl.jsApiGetFunction(
         "js_api_set_instrument_seed",
         "void",
@@ -525,6 +566,11 @@ class Afl {
         "void",
         []);
 
+    private static readonly jsApiSetPrefetchCacheFile = Afl.jsApiGetFunction(
+        "js_api_set_prefetch_cache_file",
+        "void",
+        ["pointer"]);
+
     private static readonly jsApiSetPrefetchDisable = Afl.jsApiGetFunction(
         "js_api_set_prefetch_disable",
         "void",
@@ -560,6 +606,11 @@ class Afl {
         "void",
         ["uint64"]);
 
+    private static readonly jsApiSetStatsSample = Afl.jsApiGetFunction(
+        "js_api_set_stats_sample",
+        "void",
+        ["uint64"]);
+
     private static readonly jsApiSetStdErr = Afl.jsApiGetFunction(
         "js_api_set_stderr",
         "void",
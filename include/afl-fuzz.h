@@ -182,65 +182,412 @@ struct skipdet_global {
 };
 
 struct queue_entry {
-  u8 *fname; /* File name for the test case      */
-  u32 len;   /* Input length                     */
-  u32 id;    /* entry number in queue_buf        */
+  /* What the passes over the whole queue read, create_weight_tree() with
+     calculate_score() and cull_queue(): one cache line, see add_to_queue(). */
 
-  u8 colorized,   /* Do not run redqueen stage again  */
-      cal_failed; /* Calibration failed?              */
+  u64 exec_us,      /* Execution time (us)              */
+      n_fuzz_entry; /* Key (trace checksum) in n_fuzz   */
+
+  double perf_score, /* performance score                */
+      weight;
+
+  u32 bitmap_size, /* Number of bits set in bitmap     */
+      fuzz_level,  /* Number of fuzzing iterations     */
+      fav_idx,     /* Map byte it got favored for      */
+      tc_ref,      /* Trace bytes ref count            */
+      id,          /* entry number in queue_buf        */
+      focus_hits;  /* Bytes set in the focus set       */
 
-  bool trim_done,   /* Trimmed?                         */
+  bool favored,     /* Currently favored?               */
       was_fuzzed,   /* historical, but needed for MOpt  */
+      disabled,     /* Is disabled from fuzz selection  */
+      fs_redundant, /* Marked as redundant in the fs?   */
+      plan_share,   /* Ours in the sync plan?           */
       passed_det,   /* Deterministic stages passed?     */
       has_new_cov,  /* Triggers new coverage?           */
-      var_behavior, /* Variable behavior?               */
-      favored,      /* Currently favored?               */
-      fs_redundant, /* Marked as redundant in the fs?   */
-      is_ascii,     /* Is the input just ascii text?    */
-      disabled;     /* Is disabled from fuzz selection  */
+      var_behavior; /* Variable behavior?               */
+
+  /* the rest of calculate_score(), and its ENERGY schedule */
+
+  u64 handicap,   /* Number of queue cycles behind    */
+      depth,      /* Path depth                       */
+      fuzz_us,    /* Time spent fuzzing it (decayed)  */
+      fuzz_execs; /* Execs done fuzzing it (decayed)  */
+
+  u32 fuzz_finds; /* Finds from fuzzing it (decayed)  */
+  u32 len;        /* Input length                     */
+
+  /* only needed for the entry at hand */
+
+  u8 *fname; /* File name for the test case      */
+
+  u8 colorized,   /* Do not run redqueen stage again  */
+      cal_failed; /* Calibration failed?              */
+
+  bool trim_done, /* Trimmed?                         */
+      is_ascii,   /* Is the input just ascii text?    */
+      hints_done, /* Field hints recorded?            */
+      cksum_done, /* Checksum fields looked for?      */
+      seed_link;  /* Symlink to a streamed seed?      */
 
-  u32 bitmap_size, /* Number of bits set in bitmap     */
 #ifdef INTROSPECTION
-      stats_selected, /* stats: how often selected        */
+  u32 stats_selected, /* stats: how often selected        */
       stats_skipped,  /* stats: how often skipped         */
       stats_finds,    /* stats: # of saved finds          */
       stats_crashes,  /* stats: # of saved crashes        */
-      stats_tmouts,   /* stats: # of saved timeouts       */
+      stats_tmouts;   /* stats: # of saved timeouts       */
 #endif
-      fuzz_level,   /* Number of fuzzing iterations     */
-      n_fuzz_entry; /* offset in n_fuzz                 */
 
-  u64 exec_us,       /* Execution time (us)              */
-      handicap,      /* Number of queue cycles behind    */
-      depth,         /* Path depth                       */
-      exec_cksum,    /* Checksum of the execution trace  */
-      custom,        /* Marker for custom mutators       */
-      stats_mutated; /* stats: # of mutations performed  */
+  u64 exec_cksum,     /* Checksum of the execution trace  */
+      custom,         /* Marker for custom mutators       */
+      input_hash,     /* hash64() of the input, or 0      */
+      stats_mutated;  /* stats: # of mutations performed  */
 
-  u8 *trace_mini; /* Trace bytes, if kept             */
-  u32 tc_ref;     /* Trace bytes ref count            */
+  u32 trace_mini; /* Arena slot + 1 of trace bytes    */
+  u64 write_seq;  /* Writer job of the file, or 0     */
+  u8 *pack_data;  /* Contents in -i pack, till pivot  */
 
 #ifdef INTROSPECTION
   u32 bitsmap_size;
 #endif
 
-  double perf_score, /* performance score                */
-      weight;
-
   u8 *testcase_buf; /* The testcase buffer, if loaded.  */
+  u8 *large_map;    /* Mapping of a large input, if any */
+  u8  testcase_ref; /* Cache hit since the last sweep?  */
 
-  u8             *cmplog_colorinput; /* the result buf of colorization   */
-  struct tainted *taint;             /* Taint information from CmpLog    */
+  struct cmplog_color *cmplog_color; /* kept colorization, if cached    */
 
   struct queue_entry *mother; /* queue entry this based on        */
 
   struct skipdet_entry *skipdet_e;
+
+  u8 *byte_imp; /* BYTE_IMP_* flags per input byte */
+
+  struct fs_hint *hints;     /* Field hints, sorted by offset    */
+  u32             hints_cnt; /* Number of them                   */
+
+  struct custom_meta *custom_meta; /* Of custom mutators, by meta_idx */
+
+  struct cksum_fix *cksum; /* Checksum fields, inner ones first */
+  u32               cksum_cnt; /* Number of them                 */
+
+  u32 trim_pre, /* Leading bytes as in trimmed mother */
+      trim_suf; /* Trailing bytes as in it            */
+} __attribute__((aligned(64)));
+
+/* AFL_CUSTOM_MUTATOR_BANDIT: the finds per exec of each custom mutator and
+   of the built-in havoc, the last arm, and the share of the budget they
+   got for the current queue entry. */
+
+struct custom_arm {
+  double finds, execs; /* Decayed like AFL_HAVOC_BANDIT    */
+  double share;        /* Times the static budget          */
+  u8     active;       /* Budget can be moved to/from it   */
+};
+
+struct custom_bandit {
+  double            total; /* Execs since the last halving     */
+  u32               arms;
+  struct custom_arm arm[];
+};
+
+/* AFL_STAGE_BUDGET: the stage groups, their finds and execs from
+   stage_finds[] and stage_cycles[] with decay, and the budget each gets.
+   Trimming finds nothing itself and counts the bytes it removed of the
+   bytes it was given instead. */
+
+enum {
+
+  /* 00 */ BUDGET_DET,
+  /* 01 */ BUDGET_HAVOC,
+  /* 02 */ BUDGET_SPLICE,
+  /* 03 */ BUDGET_REDQUEEN,
+  /* 04 */ BUDGET_CUSTOM,
+  /* 05 */ BUDGET_TRIM,
+
+  BUDGET_NUM_MAX
+
+};
+
+struct stage_budget {
+  double finds[BUDGET_NUM_MAX], /* Decayed                          */
+      execs[BUDGET_NUM_MAX],
+      share[BUDGET_NUM_MAX];    /* Times the static budget          */
+  u64 seen_finds[BUDGET_NUM_MAX], /* Totals at the last update      */
+      seen_execs[BUDGET_NUM_MAX];
+  u64 next;                     /* total_execs of the next update   */
+};
+
+/* AFL_POST_PROCESS_CACHE: the post processed test cases, direct mapped by
+   the hash of the input. */
+
+struct pp_cache_entry {
+  u64 key;
+  u32 len;
+  u8 *buf;
+};
+
+struct pp_cache {
+  u32                   cnt;
+  u64                   hits, misses;
+  struct pp_cache_entry e[];
+};
+
+/* Metadata a custom mutator attached to a queue entry, see
+   afl_custom_queue_meta(). */
+
+struct custom_meta {
+  u8 *buf;
+  u32 len;
+};
+
+/* AFL_CHECKSUM_FIXUP: a checksum field of a queue entry. The bytes from
+   start to end (0: the end of the input) are summed up with algo, the field
+   itself counting as zeros, and the result is written to off, byte swapped
+   first if swap is set. */
+
+enum {
+
+  /* 00 */ CKSUM_CRC32,
+  /* 01 */ CKSUM_CRC32C,
+  /* 02 */ CKSUM_ADLER32,
+  /* 03 */ CKSUM_INET,
+  /* 04 */ CKSUM_ALGOS
+
+};
+
+struct cksum_fix {
+  u32 off, start, end;
+  u8  algo, width, be, swap;
+};
+
+/* What is known about the bytes of a queue entry. Colorization and the
+   skipdet inference both find the bytes that can be changed without
+   changing the path, each consults what the other found. The map is kept
+   in queue/.state/byte_importance/ and survives a resume. */
+
+#define BYTE_IMP_SEEN 1    /* the byte was tested               */
+#define BYTE_IMP_NEUTRAL 2 /* changing it kept the path         */
+
+/* An afl-analyze -o export in AFL_ANALYZE_DIR (see include/analysis.h). An
+   entry with the same contents and no map of its own starts with one made
+   from it: the no-op bytes are neutral, all others were tested. */
+
+struct analysis_ref {
+  u64 cksum;
+  u32 len;
+  u8 *fname;
+};
+
+/* The calibration index, queue/.state/calibration, gets a record for every
+   calibration: which input was calibrated and what calibrate_case() found,
+   followed by the nonzero bytes of the classified map of its last run as
+   cnt u32 offsets and cnt u8 values. One with id CAL_INDEX_VAR lists the
+   variable map bytes instead. A resumed session looks its entries up by
+   content, the last record for an input counts, and takes them from there
+   instead of calibrating them. */
+
+#define CAL_INDEX_MAGIC 0x41464c63
+#define CAL_INDEX_VAR 0xffffffff
+#define CAL_INDEX_REC_SIZE(cnt) \
+  ((sizeof(struct cal_index_rec) + (u64)(cnt) * 5 + 7) & ~(u64)7)
+
+struct cal_index_rec {
+  u32 id, len;                 /* queue entry and its length       */
+  u64 hash;                    /* hash64() of its content          */
+  u64 exec_cksum, exec_us;     /* calibration results              */
+  u32 bitmap_size, cnt;        /* covered bytes, map bytes stored  */
+  u8  var_behavior, has_new_cov, pad[6];
+};
+
+/* The sync manifest, queue/.state/sync_manifest, gets a record for every
+   entry added to the queue, in that order: its id, its length, the path it
+   took, as checksum and as the cnt nonzero bytes of its classified map in
+   cnt u32 offsets and cnt u8 values, and then its file name, padded to 8
+   bytes. Entries queued before their first run, like the initial inputs,
+   have cnt 0. Peers that sync from this instance read it from where they
+   stopped last time instead of listing the queue directory, and if the
+   header says it is the same target, they do not run entries that bring
+   nothing new to their map. The header also has a stamp of the session
+   that wrote it, so they notice when it is started over. */
+
+#define SYNC_MANIFEST_MAGIC 0x41464c74
+#define SYNC_REC_SIZE(name_len, cnt)                                  \
+  ((sizeof(struct sync_rec) + (u64)(cnt) * 5 + (u64)(name_len) + 7) & \
+   ~(u64)7)
+
+struct sync_manifest_hdr {
+  u32 magic, map_size;
+  u64 session;                 /* stamp of the writing session     */
+  u64 target;                  /* hash64() of the target binary    */
+};
+
+struct sync_rec {
+  u64 cksum;                   /* hash64() of the rest of the record */
+  u32 id, len;                 /* queue entry and its length       */
+  u32 name_len, cnt;           /* name length, map bytes stored    */
+  u64 exec_cksum;              /* checksum of the path taken       */
+};
+
+/* What .synced/<peer> keeps: next_id first, as older versions did, then
+   how far the manifest of the peer was read. */
+
+struct sync_pos {
+  u32 next_id, pad;            /* first queue id not synced yet    */
+  u64 session, off;            /* manifest session and offset      */
+};
+
+/* With AFL_SHARED_VIRGIN, the instances of one sync directory keep the
+   virgin bits of what they queued, the hangs and the crashes in one file,
+   <sync_dir>/.shared_virgin, which they all mmap() and update with atomic
+   operations. The maps follow the header at SHARED_VIRGIN_OFF, in that
+   order. Every instance holds a shared flock() on it, so the first one to
+   come finds no lock and starts it over. */
+
+#define SHARED_VIRGIN_MAGIC 0x41464c76
+#define SHARED_VIRGIN_OFF 64
+#define SHARED_VIRGIN_BITS 0
+#define SHARED_VIRGIN_TMOUT 1
+#define SHARED_VIRGIN_CRASH 2
+
+#define SHARED_VIRGIN_MAP(afl, which)         \
+  ((afl)->shared_virgin + SHARED_VIRGIN_OFF + \
+   (u64)(which) * (afl)->fsrv.map_size)
+
+struct shared_virgin_hdr {
+  u32 magic, map_size;
+  u64 target;                  /* hash64() of the target binary    */
+};
+
+/* Along with fuzz_bitmap, write_bitmap() leaves <out_dir>/coverage_state:
+   the virgin bits, hang and crash maps in that order after this header.
+   Given to -B, it starts a new instance of the same target with all three,
+   and the dry run takes the entries the calibration index next to it knows
+   from there, after checking a sample of them. */
+
+#define COVERAGE_STATE_MAGIC 0x41464c73
+
+struct coverage_state_hdr {
+  u32 magic, map_size;
+  u64 target;                  /* hash64() of the target binary    */
+};
+
+/* AFL_CRASH_DEDUP keeps the signatures of the crashes and hangs any instance
+   of the sync directory saved in <sync_dir>/.crash_sigs, an open addressing
+   set of CRASH_SIGS_SLOTS u64 that the instances fill with compare and swap,
+   0 being a free slot. It is set up like .shared_virgin. */
+
+/* With AFL_STATS_PAGE, <out_dir>/fuzzer_stats.page holds the main numbers
+   of fuzzer_stats in binary, rewritten in place with every UI update. The
+   writer makes seq odd before and even again after an update, so a reader
+   copies the page until seq is the same even value before and after. Times
+   are in milliseconds, the last_* ones since the epoch. */
+
+#define STATS_PAGE_MAGIC 0x41464c73
+#define STATS_PAGE_VERSION 1
+#define STATS_PAGE_SIZE 4096
+
+struct stats_page {
+  u32 magic, version;
+  u32 seq, fuzzer_pid;
+  u64 start_time, last_update, run_time;
+  u64 cycles_done, cycles_wo_finds, execs_done;
+  u64 saved_crashes, saved_hangs;
+  u64 last_find, last_crash, last_hang;
+  u32 corpus_count, corpus_favored, corpus_found, corpus_imported;
+  u32 corpus_variable, max_depth, cur_item, pending_favs;
+  u32 pending_total, edges_found, total_edges, var_byte_count;
+  u32 exec_timeout, slowest_exec_ms;
+  double execs_per_sec, stability, bitmap_cvg;
+};
+
+/* plot_data.bin has the numbers of plot_data in PLOT_BIN_SLOTS buckets of
+   width seconds of run time each, with their minimum and maximum over the
+   plot updates that fell into the bucket. When the run outgrows the last
+   bucket, pairs of buckets are merged and the width doubles, so the file
+   keeps its size however long the run goes on. It is mmap()ed and updated
+   with the same seqlock as the stats page; afl-status -p turns the files of
+   one or more instances into plot_data text for afl-plot. */
+
+#define PLOT_BIN_MAGIC 0x41464c62
+#define PLOT_BIN_VERSION 1
+
+enum {
+
+  /* 00 */ PLOT_CYCLES,
+  /* 01 */ PLOT_CUR_ITEM,
+  /* 02 */ PLOT_CORPUS,
+  /* 03 */ PLOT_PENDING,
+  /* 04 */ PLOT_FAVS,
+  /* 05 */ PLOT_CVG,
+  /* 06 */ PLOT_CRASHES,
+  /* 07 */ PLOT_HANGS,
+  /* 08 */ PLOT_DEPTH,
+  /* 09 */ PLOT_EPS,
+  /* 10 */ PLOT_EXECS,
+  /* 11 */ PLOT_EDGES,
+  /* 12 */ PLOT_FIELDS
+
+};
+
+struct plot_bin_hdr {
+  u32 magic, version;
+  u32 seq, slots;
+  u32 width, used;                     /* seconds per bucket, in use    */
+  u64 start_time;                      /* run start, ms since the epoch */
+};
+
+struct plot_bin_slot {
+  u32    samples, time;                /* updates, run time of the last */
+  double eps_sum;                      /* for the mean execs/sec        */
+  double min[PLOT_FIELDS], max[PLOT_FIELDS];
+};
+
+#define PLOT_BIN_SIZE(slots) \
+  (sizeof(struct plot_bin_hdr) + (u64)(slots) * sizeof(struct plot_bin_slot))
+
+/* With AFL_SYNC_PLAN, the main node writes sync_plan to its output
+   directory whenever it syncs: the names of the secondary nodes that
+   updated their stats lately, sorted, each followed by a 0 byte and padded
+   to 8 bytes together, then a slot for every queue entry with its path
+   checksum and the node it goes to, sorted by checksum. Entries are handed
+   out heaviest first to the node with the least weight so far, so the
+   shares weigh about the same. Secondaries pick the entries of their share
+   more often, see SYNC_PLAN_PREFER. */
+
+#define SYNC_PLAN_MAGIC 0x41464c70
+
+struct sync_plan_hdr {
+  u32 magic, nodes;
+  u64 target;                  /* hash64() of the target binary    */
+  u32 names_len, cnt;          /* padded length of names, slots    */
+};
+
+struct sync_plan_slot {
+  u64 cksum;                   /* exec_cksum of the entry          */
+  u32 node, pad;               /* index of the node in the names   */
+};
+
+/* Results of the parallel dry run besides the fsrv_run_result_t ones */
+
+#define CAL_PENDING 0xff    /* left to calibrate_case()          */
+#define CAL_FROM_INDEX 0xfe /* taken from the calibration index  */
+
+/* Slot of the path frequency table, an open addressing hash table keyed by
+   the full checksum of the classified trace. A zero cksum marks an empty
+   slot. */
+
+struct n_fuzz_slot {
+  u64 cksum; /* Trace checksum of a queued path  */
+  u32 hits;  /* Executions that took this path   */
 };
 
 struct extra_data {
   u8 *data;    /* Dictionary token data            */
   u32 len;     /* Dictionary token length          */
   u32 hit_cnt; /* Use count in the corpus          */
+  u32 rank;    /* Rank from the dictionary, or 0   */
+  u8  top;     /* Among the top ranked tokens?     */
 };
 
 struct auto_extra_data {
@@ -249,6 +596,15 @@ struct auto_extra_data {
   u32 hit_cnt;              /* Use count in the corpus          */
 };
 
+/* Hash index over the tokens of extras[] or a_extras[], case-insensitive, so
+   that looking up a token does not scan the whole list. Chained by slot. */
+
+struct token_index {
+  u32 *head; /* Bucket heads, slot + 1 or 0      */
+  u32 *next; /* Next slot in the chain, + 1 or 0 */
+  u32  mask; /* Number of buckets - 1            */
+};
+
 /* Fuzzing stages */
 
 enum {
@@ -282,6 +638,74 @@ enum {
 
 };
 
+/* With AFL_METRICS_PORT, a thread serves Prometheus metrics from this
+   block. Only the fuzzing thread writes it, see METRICS_ADD, the serving
+   thread reads it with atomic loads. Histogram bucket i counts the values up
+   to the base of the histogram << i, the last one all larger values. Runs
+   are counted by the stage_short their stage had, in the order the stages
+   first came up. */
+
+#define METRICS_BUCKETS 18
+#define METRICS_EXEC_BASE 16   /* us, exec latency histogram       */
+#define METRICS_SYNC_BASE 1000 /* us, sync duration histogram      */
+#define METRICS_STAGES 48
+#define METRICS_STAGE_LEN 16
+
+#define METRICS_ADD(p, v) __atomic_store_n((p), *(p) + (v), __ATOMIC_RELAXED)
+
+struct afl_metrics {
+  u64 exec_hist[METRICS_BUCKETS], exec_sum_us;
+  u64 sync_hist[METRICS_BUCKETS], sync_sum_us;
+  u64 cmplog_runs, cmplog_us;
+  u64 cache_hits, cache_misses;
+  u64 stage_execs[METRICS_STAGES];
+  u8  stage_names[METRICS_STAGES][METRICS_STAGE_LEN];
+  u32 stages, stage_cur;       /* stage names known, current one   */
+  u8 *stage_last;              /* stage_short of stage_cur         */
+  u64 execs_done, cycles_done, corpus_count, saved_crashes, saved_hangs;
+  u64 edges_found;
+  struct fsrv_latency *fsrv_latency; /* AFL_FSRV_LATENCY, if set   */
+  s32 sock;                    /* listening socket                 */
+};
+
+/* AFL_ADAPTIVE_TIMEOUT: exec times of the runs that finished within
+   exec_tmout, or within hang_tmout after timing out, in log buckets that
+   are halved at each adjustment. Genuine hangs only count in tmouts. */
+
+struct tmout_hist {
+  u32 bucket[TMOUT_HIST_BUCKETS];
+  u64 runs,   /* runs since the last adjustment   */
+      slow,   /* timeouts that were no hangs      */
+      tmouts; /* runs that timed out              */
+};
+
+static inline void metrics_observe(u64 *hist, u64 *sum, u64 val, u64 base) {
+  u32 i = val <= base ? 0 : 64 - __builtin_clzll((val - 1) / base);
+
+  if (i >= METRICS_BUCKETS) { i = METRICS_BUCKETS - 1; }
+  METRICS_ADD(hist + i, 1);
+  METRICS_ADD(sum, val);
+}
+
+/* Where the wall time goes, see phase_enter(). Each tick is booked to the
+   innermost phase running, so the target's run time during a calibration
+   counts as PHASE_TARGET and the phases add up to the whole run. */
+
+enum {
+
+  /* 00 */ PHASE_OTHER,     /* UI, stats, queue upkeep, ...      */
+  /* 01 */ PHASE_TARGET,    /* waiting for the target            */
+  /* 02 */ PHASE_POSTPROC,  /* classify, has_new_bits, saving    */
+  /* 03 */ PHASE_MUTATE,    /* fuzz_one() outside the above      */
+  /* 04 */ PHASE_SYNC,
+  /* 05 */ PHASE_TRIM,
+  /* 06 */ PHASE_CALIBRATE,
+  /* 07 */ PHASE_CMPLOG,    /* colorization and input-to-state   */
+
+  PHASE_NUM_MAX
+
+};
+
 /* Stage value types */
 
 enum {
@@ -292,23 +716,16 @@ enum {
 
 };
 
-#define operator_num 19
+/* MOpt has a swarm position for each havoc operator, MUT_MAX in
+   afl-mutations.h, which asserts that the two agree. */
+
+#define operator_num 37
 #define swarm_num 5
 #define period_core 500000
 
 #define RAND_C (rand() % 1000 * 0.001)
 #define v_max 1
 #define v_min 0.05
-#define limit_time_bound 1.1
-#define SPLICE_CYCLES_puppet_up 25
-#define SPLICE_CYCLES_puppet_low 5
-#define STAGE_RANDOMBYTE 12
-#define STAGE_DELETEBYTE 13
-#define STAGE_Clone75 14
-#define STAGE_OverWrite75 15
-#define STAGE_OverWriteExtra 16
-#define STAGE_InsertExtra 17
-#define STAGE_Splice 18
 #define period_pilot 50000
 // LS:add
 //#define interval_time 3600
@@ -323,8 +740,9 @@ enum {
   /* 04 */ COE,     /* Cut-Off Exponential schedule     */
   /* 05 */ LIN,     /* Linear schedule                  */
   /* 06 */ QUAD,    /* Quadratic schedule               */
-  /* 07 */ RARE,    /* Rare edges                       */
-  /* 08 */ SEEK,    /* EXPLORE that ignores timings     */
+  /* 07 */ ENERGY,  /* Finds per CPU second             */
+  /* 08 */ RARE,    /* Rare edges                       */
+  /* 09 */ SEEK,    /* EXPLORE that ignores timings     */
 
   POWER_SCHEDULES_NUM
 
@@ -379,6 +797,8 @@ enum {
   /* 14 */ PY_FUNC_FUZZ_SEND,
   /* 15 */ PY_FUNC_SPLICE_OPTOUT,
   /* 16 */ PY_FUNC_POST_RUN,
+  /* 17 */ PY_FUNC_FUZZ_BATCH,
+  /* 18 */ PY_FUNC_FUZZ_INTO,
   PY_FUNC_COUNT
 
 };
@@ -400,26 +820,15 @@ typedef struct py_mutator {
   u8    *havoc_buf;
   size_t havoc_size;
 
+  /* fuzz_into() memoryviews and what they are over */
+  PyObject *in_view, *add_view, *out_view;
+  u8       *in_ptr, *add_ptr, *out_ptr;
+  size_t    in_size, add_size, out_size;
+
 } py_mutator_t;
 
 #endif
 
-typedef struct MOpt_globals {
-  u64  *finds;
-  u64  *finds_v2;
-  u64  *cycles;
-  u64  *cycles_v2;
-  u64  *cycles_v3;
-  u32   is_pilot_mode;
-  u64  *pTime;
-  u64   period;
-  char *havoc_stagename;
-  char *splice_stageformat;
-  char *havoc_stagenameshort;
-  char *splice_stagenameshort;
-
-} MOpt_globals_t;
-
 extern char *power_names[POWER_SCHEDULES_NUM];
 
 typedef struct afl_env_vars {
@@ -432,14 +841,29 @@ typedef struct afl_env_vars {
       afl_keep_timeouts, afl_no_crash_readme, afl_ignore_timeouts,
       afl_no_startup_calibration, afl_no_warn_instability,
       afl_post_process_keep_original, afl_crashing_seeds_as_new_crash,
-      afl_final_sync, afl_ignore_seed_problems;
+      afl_final_sync, afl_ignore_seed_problems, afl_pipeline, afl_memfd_input,
+      afl_persistent_tune, afl_fauxsrv_template, afl_shm_hugepages,
+      afl_shared_virgin, afl_sync_plan, afl_queue_store, afl_crash_dedup,
+      afl_stats_page, afl_adaptive_timeout, afl_havoc_bandit,
+      afl_custom_mutator_bandit, *afl_post_process_cache,
+      afl_shm_full_write, afl_splice_cover, afl_field_hints,
+      afl_checksum_fixup, afl_target_novelty, afl_intel_pt, afl_fsrv_latency,
+      afl_async_writes, afl_state_dirs, afl_stage_budget,
+      afl_hang_check_async;
 
   u8 *afl_tmpdir, *afl_custom_mutator_library, *afl_python_module, *afl_path,
       *afl_hang_tmout, *afl_forksrv_init_tmout, *afl_preload,
       *afl_max_det_extras, *afl_statsd_host, *afl_statsd_port,
-      *afl_crash_exitcode, *afl_statsd_tags_flavor, *afl_testcache_size,
-      *afl_testcache_entries, *afl_child_kill_signal, *afl_fsrv_kill_signal,
-      *afl_target_env, *afl_persistent_record, *afl_exit_on_time;
+      *afl_crash_exitcode, *afl_statsd_tags_flavor, *afl_metrics_host,
+      *afl_metrics_port, *afl_seed_batch, *afl_testcache_size,
+      *afl_testcache_entries,
+      *afl_child_kill_signal, *afl_fsrv_kill_signal,
+      *afl_target_env, *afl_persistent_record, *afl_exit_on_time,
+      *afl_fsrv_workers, *afl_cmplog_map_w, *afl_cmplog_map_h,
+      *afl_cmplog_cache_size,
+      *afl_pc_filter_file, *afl_analyze_dir, *afl_checkpoint,
+      *afl_hang_watchdog, *afl_custom_mutator_threads, *afl_intel_pt_threads,
+      *afl_record, *afl_replay, *afl_map_size_max, *afl_large_inputs;
 
   s32 afl_pizza_mode;
 
@@ -450,9 +874,49 @@ struct afl_pass_stat {
   u8 faileds;
 };
 
+struct cmplog_solved {
+  u64 fp;
+  u64 cycle;
+};
+
 struct foreign_sync {
-  u8    *dir;
-  time_t mtime;
+  u8          *dir;
+  time_t       mtime;
+  struct pack *pack;                    /* dir is a tar file            */
+  u32          pack_done;               /* its members imported         */
+};
+
+/* An extra forkserver of the target that runs havoc execs in parallel to the
+   others (AFL_FSRV_WORKERS), with its own coverage map and testcase. */
+
+struct fsrv_worker {
+  afl_forkserver_t fsrv;
+  sharedmem_t      shm, shm_fuzz;
+
+  u8 *buf;      /* the testcase it is running       */
+  u32 len;      /* its length                       */
+  u64 start_us; /* when that exec was started       */
+  u8  busy;     /* an exec is outstanding           */
+  u32 mut_lo, mut_hi; /* afl->mut_lo/hi of that testcase */
+
+  u8 *cal_trace; /* first map of the entry it calibrates */
+};
+
+/* A timeout waiting for its run with hang_tmout (AFL_HANG_CHECK_ASYNC). */
+
+struct hang_suspect {
+  u8 *buf;              /* the test case                    */
+  u32 len;              /* its length                       */
+  u8 *trace;            /* the map as the first run died    */
+  u8  op[NAME_MAX + 1]; /* describe_op() when it was found  */
+};
+
+struct hang_check {
+  struct fsrv_worker  w;                   /* the spare forkserver */
+  struct hang_suspect q[HANG_CHECK_QUEUE]; /* q[head] runs first   */
+  u32                 head, cnt;
+  u8                 *trace;               /* map of the next one  */
+  u64                 sigs[HANG_SIGS_SLOTS]; /* of the saved hangs */
 };
 
 typedef struct afl_state {
@@ -462,8 +926,35 @@ typedef struct afl_state {
   afl_forkserver_t fsrv;
   sharedmem_t      shm;
   sharedmem_t     *shm_fuzz;
+  sharedmem_t     *shm_batch;
+  sharedmem_t     *shm_pipe;
+  sharedmem_t     *shm_hints;
+  sharedmem_t     *shm_virgin;
   afl_env_vars_t   afl_env;
 
+  struct fsrv_worker *workers; /* extra forkservers for havoc     */
+  u32                 workers_cnt, workers_next;
+  u8                 *saved_main_map; /* fsrv map while on another one  */
+  struct hang_check  *hang_check;     /* AFL_HANG_CHECK_ASYNC          */
+  void               *result_nyx_runner; /* Nyx runner of that map       */
+  u8                  buckets_lost; /* all targets store hit counts  */
+
+  u8  pipe_running, pipe_done; /* 1 + slot of the pipelined run   */
+  u8  pipe_fault[2];           /* results of the two slots        */
+  u32 pipe_next;               /* slot of the next pipelined run  */
+  u32 pipe_mut_lo[2], pipe_mut_hi[2]; /* afl->mut_lo/hi of the slots */
+  u64 pipe_start_us;           /* when the running one started    */
+
+  u8 *loop_tune_buf;   /* AFL_PERSISTENT_TUNE reference   */
+  u32 loop_tune_len,   /* its length                      */
+      loop_tune_cnt,   /* current loop count, 0 = off     */
+      loop_tune_bad,   /* lowest count that leaked state  */
+      loop_tune_clean, /* clean checks at the current one */
+      loop_tune_next,  /* iteration of the next run       */
+      state_leaks;     /* checks that found leaked state  */
+  u64 loop_tune_at,    /* total_execs of the next check   */
+      loop_tune_cksum; /* reference trace of a new child  */
+
   char **argv; /* argv if needed */
 
   /* MOpt:
@@ -474,10 +965,8 @@ typedef struct afl_state {
       most_time, most_execs_key, most_execs, old_hit_count, force_ui_update,
       prev_run_time;
 
-  MOpt_globals_t mopt_globals_core, mopt_globals_pilot;
-
-  s32 limit_time_puppet, SPLICE_CYCLES_puppet, limit_time_sig, key_puppet,
-      key_module;
+  s32 limit_time_puppet, limit_time_sig, key_puppet,
+      key_module; /* 0: pilot swarms, 1: core         */
 
   double w_init, w_end, w_now;
 
@@ -489,21 +978,18 @@ typedef struct afl_state {
 
   double x_now[swarm_num][operator_num], L_best[swarm_num][operator_num],
       eff_best[swarm_num][operator_num], G_best[operator_num],
-      v_now[swarm_num][operator_num], probability_now[swarm_num][operator_num],
-      swarm_fitness[swarm_num];
+      v_now[swarm_num][operator_num], swarm_fitness[swarm_num];
 
   u64 stage_finds_puppet[swarm_num][operator_num], /* Patterns found per
                                                             fuzz stage    */
       stage_finds_puppet_v2[swarm_num][operator_num],
       stage_cycles_puppet_v2[swarm_num][operator_num],
-      stage_cycles_puppet_v3[swarm_num][operator_num],
       stage_cycles_puppet[swarm_num][operator_num],
       operator_finds_puppet[operator_num],
       core_operator_finds_puppet[operator_num],
       core_operator_finds_puppet_v2[operator_num],
       core_operator_cycles_puppet[operator_num],
-      core_operator_cycles_puppet_v2[operator_num],
-      core_operator_cycles_puppet_v3[operator_num]; /* Execs per fuzz stage */
+      core_operator_cycles_puppet_v2[operator_num]; /* Execs per operator */
 
   double period_pilot_tmp;
   s32    key_lv;
@@ -572,14 +1058,85 @@ typedef struct afl_state {
       *virgin_tmout, /* Bits we haven't seen in tmouts   */
       *virgin_crash; /* Bits we haven't seen in crashes  */
 
-  double *alias_probability; /* alias weighted probabilities     */
-  u32    *alias_table;       /* alias weighted random lookup table */
-  u32     active_items;      /* enabled entries in the queue     */
+  double *weight_tree;    /* Fenwick tree over selection weights */
+  double *weight_leaf;    /* selection weight per queue entry */
+  u32     weight_items,   /* entries in weight_tree           */
+      weight_updates;     /* point updates since last rebuild */
+  double  weight_avg[3];  /* exec_us, bitmap and top averages */
+  u32     active_items;   /* enabled entries in the queue     */
 
   u8 *var_bytes; /* Bytes that appear to be variable */
 
-#define N_FUZZ_SIZE (1 << 21)
-  u32 *n_fuzz;
+  struct n_fuzz_slot *n_fuzz; /* path frequencies, FAST..RARE     */
+  u32 n_fuzz_size,            /* slots in n_fuzz, a power of two  */
+      n_fuzz_count;           /* occupied slots in n_fuzz         */
+  u8 *path_bloom;             /* summaries of queued paths        */
+
+  u8  *trace_mini_arena;   /* mmap()ed file with trace_mini    */
+  s32  trace_mini_fd;      /* fd backing trace_mini_arena      */
+
+  u8 *state_flags;         /* mmap()ed queue/.state/flags      */
+  s32 state_flags_fd;      /* fd backing it                    */
+  u32 state_flags_cnt,     /* Entries it has room for          */
+      state_flags_old_cnt; /* Entries of state_flags_old       */
+  u8 *state_flags_old;     /* Flags of the session resumed     */
+  u32  trace_mini_len,     /* bytes per trace_mini slot        */
+      trace_mini_slots,    /* slots mapped in the arena        */
+      trace_mini_used,     /* slots handed out so far          */
+      trace_mini_free_cnt; /* entries in trace_mini_free       */
+  u32 *trace_mini_free;    /* recycled trace_mini slots        */
+
+  s32  cal_index_fd,     /* calibration index being written  */
+      cal_index_old_fd;  /* index of the resumed session     */
+  u8  *cal_index_old;    /* mmap()ed index being resumed     */
+  u64  cal_index_old_len; /* and its length                  */
+  u64 *cal_index_off;    /* record offsets + 1 by input hash */
+  u32  cal_index_mask;   /* slots in cal_index_off - 1       */
+  u8  *cal_index_buf;    /* record being assembled           */
+
+  s32 sync_manifest_fd;  /* sync manifest being written      */
+  u8 *sync_manifest_buf; /* record being assembled           */
+  u64 sync_target;       /* hash64() of the target binary    */
+  u64 sync_skipped;      /* sync entries with nothing new    */
+
+  s32 shared_virgin_fd;  /* AFL_SHARED_VIRGIN maps, locked   */
+  u8 *shared_virgin;     /* mmap()ed maps of the host        */
+  u8 *virgin_host;       /* what we know of its virgin bits  */
+  u64 shared_skipped;    /* own finds a peer had already     */
+
+  s32  crash_sigs_fd;    /* AFL_CRASH_DEDUP set, locked      */
+  u64 *crash_sigs;       /* its mmap()ed slots               */
+  u64  crash_dups;       /* crashes and hangs a peer had     */
+  u64  hang_dups;        /* hangs stuck where a saved one is */
+
+  u8 *queue_store;       /* AFL_QUEUE_STORE blob directory   */
+
+  struct stats_page  *stats_page; /* AFL_STATS_PAGE, mmap()ed     */
+  struct plot_bin_hdr *plot_bin;  /* plot_data.bin, mmap()ed       */
+  struct afl_metrics *metrics;    /* AFL_METRICS_PORT counters     */
+  struct tmout_hist  *tmout_hist; /* AFL_ADAPTIVE_TIMEOUT samples  */
+  struct mut_bandit  *mut_bandit; /* AFL_HAVOC_BANDIT posteriors   */
+  struct mut_bandit  *mut_mopt;   /* -L: picks of the current swarm */
+  struct custom_bandit *custom_bandit; /* AFL_CUSTOM_MUTATOR_BANDIT */
+  struct stage_budget  *stage_budget;  /* AFL_STAGE_BUDGET             */
+  struct replay_log    *replay;        /* AFL_RECORD or AFL_REPLAY     */
+  struct writer        *writer;        /* AFL_ASYNC_WRITES thread      */
+  struct seed_stream   *seed_stream;   /* AFL_SEED_BATCH walker        */
+  u8                   *seed_ref;      /* Streamed seed being run      */
+  struct pack          *in_pack;       /* -i is a tar file             */
+
+  u64 queue_write_seq; /* Writer job of the next queue file */
+
+  u64 checkpoint_ms,   /* AFL_CHECKPOINT interval (ms)     */
+      checkpoint_last, /* Time of the last checkpoint      */
+      checkpoint_seq;  /* Sequence number of the next one  */
+
+  u64 energy_us,    /* Time in fuzz_one() (decayed)     */
+      energy_execs, /* Execs in fuzz_one() (decayed)    */
+      energy_finds; /* Finds in fuzz_one() (decayed)    */
+
+  double sync_plan_boost; /* weight factor of our plan share */
+  u32    sync_plan_share; /* entries in our plan share       */
 
   volatile u8 stop_soon, /* Ctrl-C pressed?                  */
       clear_screen;      /* Window resized?                  */
@@ -599,6 +1156,7 @@ typedef struct afl_state {
       useless_at_start,   /* Number of useless starting paths */
       var_byte_count,     /* Bitmap bytes with var behavior   */
       current_entry,      /* Current queue entry ID           */
+      supervise_cnt,      /* -j: instances to start           */
       havoc_div,          /* Cycle count divisor for havoc    */
       max_det_extras,     /* deterministic extra count (dicts)*/
       stored_num,         /* LS:the idx of store files        */
@@ -642,15 +1200,19 @@ typedef struct afl_state {
   u32 slowest_exec_ms, /* Slowest testcase non hang in ms  */
       subseq_tmouts;   /* Number of timeouts in a row      */
 
+  u64 phase_ticks[PHASE_NUM_MAX], /* Time spent in each phase     */
+      phase_last;                 /* Clock at the last switch     */
+  u8 phase;                       /* Phase running now            */
+
   u8 *stage_name,     /* Name of the current fuzz stage   */
       *stage_short,   /* Short stage name                 */
-      *syncing_party; /* Currently syncing with...        */
+      *syncing_party, /* Currently syncing with...        */
+      *syncing_meta;  /* ...and the metadata of its entry */
 
   u8 stage_name_buf[STAGE_BUF_SIZE]; /* reused stagename buf with len 64 */
 
   u32 stage_cur, stage_max; /* Stage progression                */
   s32 splicing_with;        /* Splicing with which test case?   */
-  s64 smallest_favored;     /* smallest queue id favored        */
 
   u32 main_node_id, main_node_max; /*   Main instance job splitting    */
 
@@ -664,14 +1226,19 @@ typedef struct afl_state {
   u64 stage_finds[32],  /* Patterns found per fuzz stage    */
       stage_cycles[32]; /* Execs per fuzz stage             */
 
-  u32 rand_cnt; /* Random number counter            */
+  u32 rand_cnt,  /* Random number counter            */
+      rand_left; /* Unused words in rand_block       */
 
   /*  unsigned long rand_seed[3]; would also work */
   AFL_RAND_RETURN rand_seed[3];
   s64             init_seed;
 
+  u64 rand_lane[4][RAND_LANES];     /* xoshiro256** states, by word    */
+  u64 rand_block[RAND_BLOCK_WORDS]; /* Random words, used from the top */
+
   u64 total_cal_us,     /* Total calibration time (us)      */
       total_cal_cycles; /* Total calibration cycles         */
+  u32 cal_stable;       /* Calibrations since instability   */
 
   u64 total_bitmap_size,    /* Total bit count for all bitmaps  */
       total_bitmap_entries; /* Number of bitmaps counted        */
@@ -685,19 +1252,32 @@ typedef struct afl_state {
 
   struct queue_entry *queue, /* Fuzzing queue (linked list)      */
       *queue_cur,            /* Current offset within the queue  */
-      *queue_top;            /* Top of the list                  */
+      *queue_top,            /* Top of the list                  */
+      *queue_next;           /* Pre-drawn next pick, prefetched  */
 
   // growing buf
   struct queue_entry **queue_buf;
 
   struct queue_entry **top_rated; /* Top entries for bitmap bytes */
 
+  u32 mut_lo, mut_hi; /* What the run changed of queue_cur */
+
+  u32 *cover_edges;     /* Bytes with a top_rated[] entry   */
+  u32  cover_edges_cnt; /* Number of them                   */
+
   struct extra_data *extras;     /* Extra tokens to fuzz with        */
   u32                extras_cnt; /* Total number of tokens read      */
 
+  u32 *extras_top;     /* Indices of the top ranked tokens */
+  u32  extras_top_cnt; /* Number of them, 0 if unranked    */
+
   struct auto_extra_data
       a_extras[MAX_AUTO_EXTRAS]; /* Automatically selected extras    */
   u32 a_extras_cnt;              /* Total number of tokens available */
+  u8  a_extras_dirty;            /* a_extras[] needs sorting anew?   */
+
+  struct token_index extras_idx,   /* Index over extras[]              */
+      a_extras_idx;                /* Index over a_extras[]            */
 
   /* afl_postprocess API - Now supported via custom mutators */
 
@@ -714,12 +1294,21 @@ typedef struct afl_state {
   u32 cmplog_prev_timed_out;
   u32 cmplog_max_filesize;
   u32 cmplog_lvl;
+  u32 cmplog_map_w, cmplog_map_h; /* negotiated cmp_map geometry */
+  u64 cmplog_start_us;            /* when the cmplog run started    */
   u32 colorize_success;
   u8  cmplog_enable_arith, cmplog_enable_transform, cmplog_enable_scale,
       cmplog_enable_xtreme_transform, cmplog_random_colorization;
 
   struct afl_pass_stat *pass_stats;
+  struct cmplog_solved *cmplog_solved;
   struct cmp_map       *orig_cmp_map;
+  u32                  *cmplog_keys;     /* delta mode: keys to scan     */
+  u32                   cmplog_orig_cnt; /* touched_cnt after orig_buf   */
+  u8                    cmplog_delta;    /* maps clean outside the list  */
+
+  struct cmplog_color *cmplog_lru, *cmplog_lru_tail; /* colorizations     */
+  u64 cmplog_cache_size, cmplog_cache_max; /* bytes, AFL_CMPLOG_CACHE_SIZE */
 
   u8 describe_op_buf_256[256]; /* describe_op will use this to return a string
                                   up to 256 */
@@ -749,6 +1338,9 @@ typedef struct afl_state {
   u64 stats_last_stats_ms, stats_last_plot_ms, stats_last_queue_ms,
       stats_last_ms, stats_last_execs;
 
+  /* AFL_PC_FILTER_FILE as the forkservers last read it */
+  u64 pc_filter_last_ms, pc_filter_mtime, pc_filter_size, pc_filter_ino;
+
   /* StatsD */
   u64                statsd_last_send_ms;
   struct sockaddr_in statsd_server;
@@ -770,6 +1362,8 @@ typedef struct afl_state {
 
   u8 *out_scratch_buf;
 
+  u8 *custom_batch_buf;
+
   u8 *eff_buf;
 
   u8 *in_buf;
@@ -778,11 +1372,18 @@ typedef struct afl_state {
 
   u8 *ex_buf;
 
+  u8 *its_index_buf;
+
+  u8 *its_num_buf;
+
   u8 *testcase_buf, *splicecase_buf;
 
   u32 custom_mutators_count;
+  u32 custom_meta_cnt; /* Custom mutators with queue metadata */
 
   struct custom_mutator *current_custom_fuzz;
+  struct custom_mutator *custom_pp_last; /* Last with post processing  */
+  struct pp_cache       *pp_cache;       /* AFL_POST_PROCESS_CACHE     */
 
   list_t custom_mutator_list;
 
@@ -790,12 +1391,29 @@ typedef struct afl_state {
    * they do not call another function */
   u8 *map_tmp_buf;
 
+  /* incremental cull_queue(): lowest map byte whose top_rated[] changed since
+     the last cull, and for every map byte the byte whose favored entry
+     covers it (CULL_UNCOVERED if none) */
+  u32  cull_from;
+  u32 *cull_cover;
+
+  /* the favored entries cull_queue() left not fuzzed, fav_idx << 32 | id,
+     fuzzed in that order before the weight tree is drawn from again */
+  u64 *pending_fav;
+  u32  pending_fav_cnt, pending_fav_pos;
+
   /* queue entries ready for splicing count (len > 4) */
   u32 ready_for_splicing_count;
 
   /* min/max length for generated fuzzing inputs */
   u32 min_length, max_length;
 
+  /* AFL_LARGE_INPUTS: the longest queue entry, MAX_FILE without, and the
+     window of the entry being fuzzed if it is longer than MAX_FILE */
+  u32             max_input;
+  struct fs_patch large;
+  u8             *large_buf;
+
   /* This is the user specified maximum size to use for the testcase cache */
   u64 q_testcase_max_cache_size;
 
@@ -805,20 +1423,21 @@ typedef struct afl_state {
   /* How much of the testcase cache is used so far */
   u64 q_testcase_cache_size;
 
-  /* highest cache count so far */
-  u32 q_testcase_max_cache_count;
-
   /* How many queue entries currently have cached testcases */
   u32 q_testcase_cache_count;
 
-  /* the smallest id currently known free entry */
-  u32 q_testcase_smallest_free;
+  /* Clock hand into q_testcase_cache for eviction */
+  u32 q_testcase_clock;
+
+  /* Recycled testcase buffers per size class, and their total size */
+  u8 *q_testcase_pool[TESTCASE_CLASSES];
+  u64 q_testcase_pool_size;
 
   /* How often did we evict from the cache (for statistics only) */
   u32 q_testcase_evictions;
 
-  /* Refs to each queue entry with cached testcase (for eviction, if cache_count
-   * is too large) */
+  /* Refs to each queue entry with cached testcase, the first cache_count
+   * slots are in use (for eviction, if cache_count is too large) */
   struct queue_entry **q_testcase_cache;
 
   /* Global Profile Data for deterministic/havoc-splice stage */
@@ -826,6 +1445,9 @@ typedef struct afl_state {
 
   struct skipdet_global *skipdet_g;
 
+  struct analysis_ref *analyses; /* AFL_ANALYZE_DIR exports        */
+  u32                  analyses_cnt;
+
 #ifdef INTROSPECTION
   char  mutation[8072];
   char  m_tmp[4096];
@@ -842,7 +1464,9 @@ struct custom_mutator {
   u8         *post_process_buf;
   u8          stacked_custom_prob, stacked_custom;
 
-  void *data; /* custom mutator data ptr */
+  void          *data; /* custom mutator data ptr */
+  struct mutpool *pool; /* threads running afl_custom_fuzz */
+  u32 meta_idx; /* slot in queue_entry.custom_meta */
 
   /* hooks for the custom mutator function */
 
@@ -893,6 +1517,20 @@ struct custom_mutator {
    */
   void (*afl_custom_splice_optout)(void *data);
 
+  /**
+   * Declare afl_custom_fuzz() thread safe
+   *
+   * Empty dummy function. Its presence tells afl-fuzz that with
+   * AFL_CUSTOM_MUTATOR_THREADS it may call afl_custom_fuzz() from several
+   * threads at once, with the same data pointer and while the other hooks
+   * run on the main thread. out_buf has to stay valid until the next call
+   * from the same thread.
+   *
+   * @param data pointer returned in afl_custom_init by this custom mutator
+   * @noreturn
+   */
+  void (*afl_custom_thread_safe)(void *data);
+
   /**
    * Perform custom mutations on a given input
    *
@@ -914,6 +1552,32 @@ struct custom_mutator {
   size_t (*afl_custom_fuzz)(void *data, u8 *buf, size_t buf_size, u8 **out_buf,
                             u8 *add_buf, size_t add_buf_size, size_t max_size);
 
+  /**
+   * Perform up to max_cnt custom mutations on a given input at once, instead
+   * of one per afl_custom_fuzz() call. The mutated outputs are written back
+   * to back into arena, and their sizes to sizes[]. afl-fuzz runs them in
+   * testcase batches when the target supports it.
+   *
+   * (Optional)
+   *
+   * @param[in] data Pointer returned in afl_custom_init by this custom mutator
+   * @param[in] buf Pointer to the input data to be mutated
+   * @param[in] buf_size Size of the input data
+   * @param[in] add_buf Buffer containing an additional test case (splicing)
+   * @param[in] add_buf_size Size of the additional test case
+   * @param[in] max_size Maximum size of one mutated output
+   * @param[out] arena Buffer for the mutated outputs, under afl-fuzz memory
+   * mgmt.
+   * @param[in] arena_size Size of arena, the sizes must not add up to more
+   * @param[out] sizes Size of each mutated output, 0 skips that one
+   * @param[in] max_cnt Maximum number of mutated outputs
+   * @return Number of mutated outputs, 0 ends the stage for this entry
+   */
+  u32 (*afl_custom_fuzz_batch)(void *data, u8 *buf, size_t buf_size,
+                               u8 *add_buf, size_t add_buf_size,
+                               size_t max_size, u8 *arena, size_t arena_size,
+                               size_t *sizes, u32 max_cnt);
+
   /**
    * Describe the current testcase, generated by the last mutation.
    * This will be called, for example, to give the written testcase a name
@@ -952,6 +1616,26 @@ struct custom_mutator {
   size_t (*afl_custom_post_process)(void *data, u8 *buf, size_t buf_size,
                                     u8 **out_buf);
 
+  /**
+   * Like afl_custom_post_process(), but writes the processed test case into
+   * out, which afl-fuzz provides. If this is the last post processor and the
+   * target takes its input via shared memory, out is the shared memory test
+   * case itself, so nothing is copied. Used instead of
+   * afl_custom_post_process() if both are present.
+   *
+   * (Optional)
+   *
+   * @param[in] data pointer returned in afl_custom_init by this custom mutator
+   * @param[in] buf Buffer containing the test case to be executed
+   * @param[in] buf_size Size of the test case
+   * @param[out] out Buffer for the processed test case
+   * @param[in] out_size Size of out
+   * @return Size of the processed test case, 0 to not run it.
+   */
+  size_t (*afl_custom_post_process_into)(void *data, const u8 *buf,
+                                         size_t buf_size, u8 *out,
+                                         size_t out_size);
+
   /**
    * This method is called at the start of each trimming operation and receives
    * the initial buffer. It should return the amount of iteration steps possible
@@ -1051,6 +1735,43 @@ struct custom_mutator {
    */
   u8 (*afl_custom_queue_get)(void *data, const u8 *filename);
 
+  /**
+   * Like afl_custom_queue_get(), with the metadata the mutator attached to
+   * the queue entry with afl_custom_queue_meta(). The metadata stays valid
+   * while the entry is fuzzed. If trimming changes the entry, this is called
+   * again with the new metadata, the return value is then ignored.
+   *
+   * (Optional)
+   *
+   * @param data pointer returned in afl_custom_init by this custom mutator
+   * @param filename File name of the test case in the queue entry
+   * @param meta The metadata, NULL if there is none
+   * @param meta_size Size of the metadata
+   * @return Return True(1) if the fuzzer will fuzz the queue entry, and
+   *     False(0) otherwise.
+   */
+  u8 (*afl_custom_queue_get_meta)(void *data, const u8 *filename,
+                                  const u8 *meta, size_t meta_size);
+
+  /**
+   * Attach metadata to a queue entry, e.g. the parsed form of the input, so
+   * it doesn't have to be read and parsed again. Called once for each new
+   * queue entry and after trimming changed one. afl-fuzz keeps the metadata
+   * next to the queue, so it is taken over instead when resuming and when
+   * syncing from an instance with the same custom mutator.
+   *
+   * (Optional)
+   *
+   * @param data pointer returned in afl_custom_init by this custom mutator
+   * @param filename File name of the queue entry
+   * @param buf The input of the queue entry
+   * @param buf_size Size of the input
+   * @param[out] meta The metadata, under your memory mgmt.
+   * @return Size of the metadata, 0 for none
+   */
+  size_t (*afl_custom_queue_meta)(void *data, const u8 *filename,
+                                  const u8 *buf, size_t buf_size, u8 **meta);
+
   /**
    * This method can be used if you want to send data to the target yourself,
    * e.g. via IPC. This replaces some usage of utils/afl_proxy but requires
@@ -1105,8 +1826,28 @@ void afl_states_clear_screen(void);
 /* Sets the skip flag on all states */
 void afl_states_request_skip(void);
 
+/* Record the shmem segments in the output dir, for restarts */
+void shm_keep(afl_state_t *afl, sharedmem_t *shm, u8 *who, u8 *what);
+
 /* Setup shmem for testcase delivery */
 void setup_testcase_shmem(afl_state_t *afl);
+void setup_large_inputs(afl_state_t *afl);
+
+/* Setup shmem for AFL_FIELD_HINTS */
+void setup_field_hints(afl_state_t *afl);
+
+/* Setup shmem for AFL_TARGET_NOVELTY */
+void setup_target_novelty(afl_state_t *afl);
+
+/* Copy virgin_bits to the target for AFL_TARGET_NOVELTY */
+void target_novelty_sync(afl_state_t *afl);
+void var_byte_ignore(afl_state_t *afl, u32 i);
+
+/* Start the AFL_FSRV_WORKERS forkservers */
+void setup_fsrv_workers(afl_state_t *afl);
+
+/* Start the spare forkserver of AFL_HANG_CHECK_ASYNC */
+void setup_hang_check(afl_state_t *afl);
 
 void read_afl_environment(afl_state_t *, char **);
 
@@ -1119,6 +1860,33 @@ u8   trim_case_custom(afl_state_t *, struct queue_entry *q, u8 *in_buf,
                       struct custom_mutator *mutator);
 void run_afl_custom_queue_new_entry(afl_state_t *, struct queue_entry *, u8 *,
                                     u8 *);
+void custom_meta_new(afl_state_t *, struct queue_entry *, u8 *, u8 *);
+void custom_meta_update(afl_state_t *, struct queue_entry *, u8 *);
+void custom_meta_free(afl_state_t *, struct queue_entry *);
+
+/* Custom mutator threads */
+void mutpool_init(afl_state_t *, struct custom_mutator *);
+void mutpool_start(afl_state_t *, struct mutpool *, u8 *, u32, u32);
+u8  *mutpool_get(struct mutpool *, u32 *);
+void mutpool_stop(struct mutpool *);
+void mutpool_destroy(struct mutpool *);
+
+/* AFL_ASYNC_WRITES */
+
+void writer_init(afl_state_t *);
+u64  writer_create(struct writer *, u8 *, u8 *, u32);
+u64  writer_unlink(struct writer *, u8 *);
+void writer_wait(struct writer *, u64);
+void writer_destroy(struct writer *);
+
+/* -j */
+
+void supervise(afl_state_t *, int, char **, int, const char *);
+
+/* AFL_SEED_BATCH */
+
+void seed_stream_open(afl_state_t *, u8 *, u8);
+void seed_stream_ingest(afl_state_t *);
 
 /* Python */
 #ifdef USE_PYTHON
@@ -1148,17 +1916,38 @@ void        deinit_py(void *);
 void mark_as_det_done(afl_state_t *, struct queue_entry *);
 void mark_as_variable(afl_state_t *, struct queue_entry *);
 void mark_as_redundant(afl_state_t *, struct queue_entry *, u8);
+void queue_state_load(afl_state_t *);
+u8   queue_state_old(afl_state_t *, u8 *);
+u8  *byte_imp_get(afl_state_t *, struct queue_entry *, u8 *);
+u8   byte_imp_complete(struct queue_entry *);
+void byte_imp_save(afl_state_t *, struct queue_entry *, u8 *);
+void load_analyses(afl_state_t *);
 void add_to_queue(afl_state_t *, u8 *, u32, u8);
+void queue_store_init(afl_state_t *);
+u64  write_queue_file(afl_state_t *, u8 *, u8 *, u32);
 void destroy_queue(afl_state_t *);
 void update_bitmap_score(afl_state_t *, struct queue_entry *);
+u32  splice_partner(afl_state_t *);
 void cull_queue(afl_state_t *);
+s64  next_pending_favored(afl_state_t *);
 u32  calculate_score(afl_state_t *, struct queue_entry *);
+u8  *get_trace_mini(afl_state_t *, struct queue_entry *);
+void destroy_trace_mini_arena(afl_state_t *);
+void resize_trace_mini_arena(afl_state_t *);
+void n_fuzz_init(afl_state_t *);
+void n_fuzz_add(afl_state_t *, u64);
+void n_fuzz_hit(afl_state_t *, u64);
+void n_fuzz_set(afl_state_t *, u64, u32);
+void energy_account(afl_state_t *, struct queue_entry *, u64, u64, u32);
+u32  n_fuzz_hits(afl_state_t *, u64);
 
 /* Bitmap */
 
 void write_bitmap(afl_state_t *);
+void load_bitmap(afl_state_t *);
 u32  count_bits(afl_state_t *, u8 *);
 u32  count_bytes(afl_state_t *, u8 *);
+u32  count_focus_bytes(afl_state_t *, u8 *);
 u32  count_non_255_bytes(afl_state_t *, u8 *);
 void simplify_trace(afl_state_t *, u8 *);
 #ifdef WORD_SIZE_64
@@ -1167,13 +1956,23 @@ void discover_word(u8 *ret, u64 *current, u64 *virgin);
 void discover_word(u8 *ret, u32 *current, u32 *virgin);
 #endif
 void init_count_class16(void);
+void init_classify_kernel(void);
+void select_map_kernels(afl_state_t *);
 void minimize_bits(afl_state_t *, u8 *, u8 *);
+void grow_maps(afl_state_t *, u32, u32);
+void map_grow(afl_state_t *, u32);
 #ifndef SIMPLE_FILES
 u8 *describe_op(afl_state_t *, u8, size_t);
 #endif
 u8 save_if_interesting(afl_state_t *, void *, u32, u8);
+u8 hang_check_add(afl_state_t *, u8 *, u32);
+void hang_check_done(afl_state_t *, struct hang_suspect *, u8);
 u8 has_new_bits(afl_state_t *, u8 *);
 u8 has_new_bits_unclassified(afl_state_t *, u8 *);
+u8 classify_has_new_bits(afl_state_t *, u8 *, u64 *);
+u8 has_new_bits_shared(afl_state_t *, u8 *);
+u64 hash_trace(u8 *, u32);
+u64 hash_trace_bits(afl_forkserver_t *);
 #ifndef AFL_SHOWMAP
 void classify_counts(afl_forkserver_t *);
 #endif
@@ -1185,7 +1984,11 @@ void load_extras(afl_state_t *, u8 *);
 void dedup_extras(afl_state_t *);
 void deunicode_extras(afl_state_t *);
 void add_extra(afl_state_t *afl, u8 *mem, u32 len);
+u32  add_extras_autodict(afl_state_t *afl, u8 *dict, u32 len);
+u8   load_note_autodict(afl_state_t *afl, u8 *fn);
+void rank_extras(afl_state_t *);
 void maybe_add_auto(afl_state_t *, u8 *, u32);
+void sort_auto_extras(afl_state_t *);
 void save_auto(afl_state_t *);
 void load_auto(afl_state_t *);
 void destroy_extras(afl_state_t *);
@@ -1196,6 +1999,8 @@ void load_stats_file(afl_state_t *);
 void write_setup_file(afl_state_t *, u32, char **);
 void write_stats_file(afl_state_t *, u32, double, double, double);
 void maybe_update_plot_file(afl_state_t *, u32, double, double);
+void stats_page_open(afl_state_t *);
+void plot_bin_open(afl_state_t *);
 void write_queue_stats(afl_state_t *);
 void show_stats(afl_state_t *);
 void show_stats_normal(afl_state_t *);
@@ -1209,42 +2014,96 @@ int  statsd_socket_init(afl_state_t *afl);
 int  statsd_send_metric(afl_state_t *afl);
 int  statsd_format_metric(afl_state_t *afl, char *buff, size_t bufflen);
 
+/* Metrics */
+
+void metrics_init(afl_state_t *afl);
+void metrics_stage(afl_state_t *afl);
+void metrics_publish(afl_state_t *afl, u32 t_bytes);
+
+/* Checkpoint */
+
+void checkpoint_write(afl_state_t *);
+void checkpoint_load(afl_state_t *);
+
+/* Record and replay */
+
+void replay_init(afl_state_t *);
+void replay_point(afl_state_t *);
+u8   replay_pick(afl_state_t *);
+void replay_mode(afl_state_t *);
+void replay_record_sync(afl_state_t *, u8 *party, u8 *mem, u32 len);
+void replay_done(afl_state_t *);
+
+/* Field hints */
+
+void hints_get(afl_state_t *, struct queue_entry *, u8 *);
+void hints_free(struct queue_entry *);
+u32  hints_havoc(afl_state_t *, struct queue_entry *, u8 *, u32, u32 *);
+
+/* Checksum fixups */
+
+void cksum_detect(afl_state_t *, struct cmp_map *, u8 *, u32);
+u8   cksum_fixup(afl_state_t *, u8 *, u32);
+void cksum_free(struct queue_entry *);
+
 /* Run */
 
+void tmout_adapt(afl_state_t *);
 void sync_fuzzers(afl_state_t *);
+void sync_manifest_add(afl_state_t *, u32, u8 *, u32, u8 *);
 u32  write_to_testcase(afl_state_t *, void **, u32, u32);
 u8   calibrate_case(afl_state_t *, struct queue_entry *, u8 *, u32, u8);
+void calibrate_workers(afl_state_t *, struct queue_entry **, u8 *, u32);
+void cal_index_write(afl_state_t *, void *, u32);
+void cal_index_add(afl_state_t *, struct queue_entry *, u8 *);
+void fuzz_fsrv_start(afl_state_t *);
 u8   trim_case(afl_state_t *, struct queue_entry *, u8 *);
 u8   common_fuzz_stuff(afl_state_t *, u8 *, u32);
+u8   common_fuzz_result(afl_state_t *, u8 *, u32, u8);
+u8   common_fuzz_batch(afl_state_t *, u8 **, u32 *, u32);
+u8   parallel_fuzz_stuff(afl_state_t *, u8 *, u32);
+u8   flush_fsrv_workers(afl_state_t *);
+void hang_check_poll(afl_state_t *);
+void hang_check_drain(afl_state_t *);
+void pc_filter_check(afl_state_t *);
 fsrv_run_result_t fuzz_run_target(afl_state_t *, afl_forkserver_t *fsrv, u32);
+u8                fuzz_run_start(afl_state_t *, afl_forkserver_t *fsrv);
+fsrv_run_result_t fuzz_run_finish(afl_state_t *, afl_forkserver_t *fsrv, u32,
+                                  u64);
 
 /* Fuzz one */
 
 u8   fuzz_one_original(afl_state_t *);
-u8   pilot_fuzzing(afl_state_t *);
-u8   core_fuzzing(afl_state_t *);
-void pso_updating(afl_state_t *);
 u8   fuzz_one(afl_state_t *);
 
 /* Init */
 
 #ifdef HAVE_AFFINITY
 void bind_to_free_cpu(afl_state_t *);
+u32  cpu_siblings(s32, s32 *, u32);
 #endif
 void   setup_post(afl_state_t *);
 void   read_testcases(afl_state_t *, u8 *);
 void   perform_dry_run(afl_state_t *);
 void   pivot_inputs(afl_state_t *);
+void   hash_target(afl_state_t *);
+void   sync_manifest_open(afl_state_t *);
+void   shared_virgin_open(afl_state_t *);
+void   crash_sigs_open(afl_state_t *);
 u32    find_start_position(afl_state_t *);
 void   find_timeout(afl_state_t *);
 double get_runnable_processes(void);
 void   nuke_resume_dir(afl_state_t *);
 int    check_main_node_exists(afl_state_t *);
 u32    select_next_queue_entry(afl_state_t *afl);
-void   create_alias_table(afl_state_t *afl);
+void   create_weight_tree(afl_state_t *afl);
+void   update_weight_tree(afl_state_t *afl);
+void   update_queue_weight(afl_state_t *afl, struct queue_entry *q);
 void   setup_dirs_fds(afl_state_t *);
 void   setup_cmdline_file(afl_state_t *, char **);
 void   setup_stdio_file(afl_state_t *);
+u8     setup_memfd_file(afl_state_t *);
+void   setup_fauxsrv_template(afl_state_t *, u8 *);
 void   check_crash_handling(void);
 void   check_cpu_governor(afl_state_t *);
 void   get_core_count(afl_state_t *);
@@ -1263,7 +2122,12 @@ char *get_fuzzing_state(afl_state_t *afl);
 
 /* CmpLog */
 
-u8 common_fuzz_cmplog_stuff(afl_state_t *afl, u8 *out_buf, u32 len);
+u8   common_fuzz_cmplog_stuff(afl_state_t *afl, u8 *out_buf, u32 len);
+u8   cmplog_run_start(afl_state_t *afl, u8 *out_buf, u32 len);
+u8   cmplog_run_finish(afl_state_t *afl);
+void cmplog_map_request(afl_state_t *afl);
+void cmplog_map_negotiate(afl_state_t *afl);
+void cmplog_switch_check(afl_state_t *afl);
 
 /* RedQueen */
 u8 input_to_state_stage(afl_state_t *afl, u8 *orig_buf, u8 *buf, u32 len);
@@ -1271,6 +2135,9 @@ u8 input_to_state_stage(afl_state_t *afl, u8 *orig_buf, u8 *buf, u32 len);
 /* our RNG wrapper */
 AFL_RAND_RETURN rand_next(afl_state_t *afl);
 
+/* refill afl->rand_block */
+void rand_fill(afl_state_t *afl);
+
 /* probability between 0.0 and 1.0 */
 double rand_next_percent(afl_state_t *afl);
 
@@ -1283,32 +2150,34 @@ void plot_profile_data(afl_state_t *, struct queue_entry *);
 
 /**** Inline routines ****/
 
-/* Generate a random number (from 0 to limit - 1). This may
-   have slight bias. */
+/* The next word of the random block. */
+
+static inline u64 rand_word(afl_state_t *afl) {
+  if (unlikely(!afl->rand_left)) { rand_fill(afl); }
+  return afl->rand_block[--afl->rand_left];
+}
+
+/* Generate a random number (from 0 to limit - 1), without bias. */
 
 static inline u32 rand_below(afl_state_t *afl, u32 limit) {
   if (unlikely(limit <= 1)) return 0;
 
-  /* The boundary not being necessarily a power of 2,
-     we need to ensure the result uniformity. */
-  if (unlikely(!afl->rand_cnt--) && likely(!afl->fixed_seed)) {
-    ck_read(afl->fsrv.dev_urandom_fd, &afl->rand_seed, sizeof(afl->rand_seed),
-            "/dev/urandom");
-    // srandom(afl->rand_seed[0]);
-    afl->rand_cnt = (RESEED_RNG / 2) + (afl->rand_seed[1] % RESEED_RNG);
-  }
+  /* Lemire's multiply and shift: the high half of a 32 bit random number
+     times limit. Products whose low half falls below 2^32 % limit would
+     make some results more likely, they are drawn again, which only costs
+     a division when the low half is below limit. See:
+     https://arxiv.org/abs/1805.10941 */
 
-  /* Modulo is biased - we don't want our fuzzing to be biased so let's do it
-   right. See:
-   https://stackoverflow.com/questions/10984974/why-do-people-say-there-is-modulo-bias-when-using-a-random-number-generator
-   */
-  u64 unbiased_rnd;
-  do {
-    unbiased_rnd = rand_next(afl);
+  u64 m = (u64)(u32)rand_word(afl) * limit;
 
-  } while (unlikely(unbiased_rnd >= (UINT64_MAX - (UINT64_MAX % limit))));
+  if (unlikely((u32)m < limit)) {
+    u32 t = -limit % limit;
+    while ((u32)m < t) {
+      m = (u64)(u32)rand_word(afl) * limit;
+    }
+  }
 
-  return unbiased_rnd % limit;
+  return m >> 32;
 }
 
 /* we prefer lower range values here */
@@ -1333,6 +2202,27 @@ static inline u32 rand_below_datalen(afl_state_t *afl, u32 limit) {
   return 1;  // cannot be reached
 }
 
+/* Pick a dictionary token for havoc. With a ranked dictionary half of the
+   picks are among the top ranked tokens, see rank_extras(). */
+
+static inline u32 rand_extra(afl_state_t *afl) {
+  if (unlikely(afl->extras_top_cnt) && rand_below(afl, 2)) {
+    return afl->extras_top[rand_below(afl, afl->extras_top_cnt)];
+  }
+
+  return rand_below(afl, afl->extras_cnt);
+}
+
+/* With AFL_ASYNC_WRITES the file of a queue entry may still be in the
+   writer, wait for it before reading or replacing the file. */
+
+static inline void queue_file_wait(afl_state_t *afl, struct queue_entry *q) {
+  if (unlikely(q->write_seq)) {
+    writer_wait(afl->writer, q->write_seq);
+    q->write_seq = 0;
+  }
+}
+
 static inline s64 rand_get_seed(afl_state_t *afl) {
   if (unlikely(afl->fixed_seed)) { return afl->init_seed; }
   return afl->rand_seed[0];
@@ -1344,6 +2234,32 @@ void rand_set_seed(afl_state_t *afl, s64 init_seed);
 /* Find first power of two greater or equal to val (assuming val under
    2^63). */
 
+/* A cheap clock for phase_enter(): the TSC where there is one, only the
+   ratios between the phases are reported. */
+
+static inline u64 phase_clock(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/* Book the time since the last switch to the phase that ran and start
+   phase. Returns the phase that ran, to be restored when phase is done. */
+
+static inline u8 phase_enter(afl_state_t *afl, u8 phase) {
+  u64 now = phase_clock();
+  u8  prev = afl->phase;
+
+  afl->phase_ticks[prev] += now - afl->phase_last;
+  afl->phase_last = now;
+  afl->phase = phase;
+  return prev;
+}
+
 static inline u64 next_p2(u64 val) {
   u64 ret = 1;
   while (val > ret) {
@@ -1357,6 +2273,9 @@ static inline u64 next_p2(u64 val) {
   Increases the refcount. */
 u8 *queue_testcase_get(afl_state_t *afl, struct queue_entry *q);
 
+/* Asks the kernel to read the file of an entry that is not cached yet */
+void queue_testcase_prefetch(afl_state_t *afl, struct queue_entry *q);
+
 /* If trimming changes the testcase size we have to reload it */
 void queue_testcase_retake(afl_state_t *afl, struct queue_entry *q,
                            u32 old_len);
@@ -32,7 +32,7 @@
 #include <inttypes.h>
 #include "afl-fuzz.h"
 
-#define MUT_STRATEGY_ARRAY_SIZE 256
+#define MUT_STRATEGY_ARRAY_SIZE 256 /* afl_mutate() draws a byte for it */
 
 enum {
 
@@ -78,6 +78,9 @@ enum {
 
 };
 
+/* MOpt keeps a swarm position per mutator, see operator_num in afl-fuzz.h */
+_Static_assert(MUT_MAX == operator_num, "operator_num must equal MUT_MAX");
+
 #define MUT_TXT_ARRAY_SIZE 200
 u32 text_array[MUT_TXT_ARRAY_SIZE] = {MUT_FLIPBIT,
                                       MUT_FLIPBIT,
@@ -1828,9 +1831,22 @@ inline u32 afl_mutate(afl_state_t *afl, u8 *buf, u32 len, u32 steps,
     }
   }
 
+  /* The strategy table index of a step is a byte of a random word drawn
+     once for eight steps, not a rand_below() of its own. */
+
+  u64 schedule = 0;
+  u32 scheduled = 0;
+
   for (u32 step = 0; step < steps; ++step) {
   retry_havoc_step: {
-    u32 r = rand_below(afl, MUT_STRATEGY_ARRAY_SIZE), item;
+    if (unlikely(!scheduled)) {
+      schedule = rand_word(afl);
+      scheduled = 8;
+    }
+
+    u32 r = (u8)schedule, item;
+    schedule >>= 8;
+    --scheduled;
 
     switch (mutation_array[r]) {
       case MUT_FLIPBIT: {
@@ -2399,7 +2415,7 @@ inline u32 afl_mutate(afl_state_t *afl, u8 *buf, u32 len, u32 steps,
 
         /* Use the dictionary. */
 
-        u32 use_extra = rand_below(afl, afl->extras_cnt);
+        u32 use_extra = rand_extra(afl);
         u32 extra_len = afl->extras[use_extra].len;
 
         if (unlikely(extra_len > len)) { goto retry_havoc_step; }
@@ -2413,7 +2429,7 @@ inline u32 afl_mutate(afl_state_t *afl, u8 *buf, u32 len, u32 steps,
       case MUT_EXTRA_INSERT: {
         if (unlikely(!afl->extras_cnt)) { goto retry_havoc_step; }
 
-        u32 use_extra = rand_below(afl, afl->extras_cnt);
+        u32 use_extra = rand_extra(afl);
         u32 extra_len = afl->extras[use_extra].len;
         if (unlikely(len + extra_len >= max_len)) { goto retry_havoc_step; }
 
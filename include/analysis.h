@@ -0,0 +1,53 @@
+/*
+   american fuzzy lop++ - afl-analyze export header
+   ------------------------------------------------
+
+   Originally written by Michal Zalewski
+
+   Now maintained by Marc Heuse <mh@mh-sec.de>,
+                     Heiko Eißfeldt <heiko.eissfeldt@hexco.de>,
+                     Andrea Fioraldi <andreafioraldi@gmail.com>,
+                     Dominik Maier <mail@dmnk.co>
+
+   Copyright 2016, 2017 Google Inc. All rights reserved.
+   Copyright 2019-2024 AFLplusplus Project. All rights reserved.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at:
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+   The classification afl-analyze -o writes, and that afl-fuzz reads from
+   AFL_ANALYZE_DIR: the header, then a byte per input byte with its RESP_*
+   type in the low nibble. Bit 7 flips from one run of bytes to the next,
+   as in the analysis afl-analyze prints. The checksum is hash64() of the
+   input with HASH_CONST, so an export only applies to the same contents.
+
+ */
+
+#ifndef _AFL_ANALYSIS_H
+#define _AFL_ANALYSIS_H
+
+#include "types.h"
+
+/* Constants used for describing byte behavior. */
+
+#define RESP_NONE 0x00     /* Changing byte is a no-op.         */
+#define RESP_MINOR 0x01    /* Some changes have no effect.      */
+#define RESP_VARIABLE 0x02 /* Changes produce variable paths.   */
+#define RESP_FIXED 0x03    /* Changes produce fixed patterns.   */
+
+#define RESP_LEN 0x04     /* Potential length field            */
+#define RESP_CKSUM 0x05   /* Potential checksum                */
+#define RESP_SUSPECT 0x06 /* Potential "suspect" blob          */
+
+#define ANALYSIS_MAGIC 0x41464c41
+
+struct analysis_hdr {
+  u32 magic, len;
+  u64 cksum;
+};
+
+#endif
+
@@ -32,14 +32,27 @@
 
 #define CMPLOG_LVL_MAX 3
 
+/* default and largest geometry, AFL_CMPLOG_MAP_W/_H can ask for less */
 #define CMP_MAP_W 65536
 #define CMP_MAP_H 32
 #define CMP_MAP_RTN_H (CMP_MAP_H / 2)
+#define CMP_MAP_W_MIN 256
+#define CMP_MAP_H_MIN 4
 
 #define SHAPE_BYTES(x) (x + 1)
 
 #define CMP_TYPE_INS 1
 #define CMP_TYPE_RTN 2
+#define CMP_TYPE_SWITCH 3
+
+/* A CMP_TYPE_SWITCH key logs a switch with all its cases at once. Its row
+   is taken as u64 slots: the first h get the switch value of each hit, the
+   other 3 * h the cases, packed SHAPE_BYTES(shape) bytes each in host byte
+   order. id is the number of cases there, the runtime copies up to
+   CMP_SWITCH_CASES(h, size) of them when it initializes the key. */
+
+#define CMP_SWITCH_CASES(h, size) \
+  ((h) * (sizeof(struct cmp_operands) - sizeof(u64)) / (size))
 
 struct cmp_header {
   unsigned hits : 24;
@@ -70,11 +83,68 @@ struct cmpfn_operands {
 
 typedef struct cmp_operands cmp_map_list[CMP_MAP_H];
 
+/* the magic the runtime puts into delta when it keeps the touched list */
+#define CMPLOG_DELTA_MAGIC 0xde17a5e7
+
+/* the magic the runtime puts into toggle when afl-fuzz asked for it with
+   CMPLOG_SWITCH_ENV_VAR: the main forkserver then also does the cmplog runs,
+   those it is asked for with FS_RUN_CMPLOG, no second one is needed */
+#define CMPLOG_SWITCH_MAGIC 0xc3915a17
+
+#define CMPLOG_GEOM(w, h) ((((u32)w) << 8) | (u32)(h))
+
 struct cmp_map {
   struct cmp_header   headers[CMP_MAP_W];
   struct cmp_operands log[CMP_MAP_W][CMP_MAP_H];
+
+  /* Delta mode: if afl-fuzz asks for it via CMPLOG_MAP_ENV_VAR the runtime
+     appends every key whose header it (re)initializes to touched[], so
+     afl-fuzz only has to reset, copy and scan these instead of the whole
+     map. touched_cnt can exceed the width, then the list is incomplete. */
+  u32 delta;
+  u32 geom;
+  u32 toggle;
+  u32 touched_cnt;
+  u32 touched[CMP_MAP_W];
+};
+
+/* The same layout for a negotiated geometry of w keys (CMP_MAP_W_MIN..
+   CMP_MAP_W) with h logged hits each (CMP_MAP_H_MIN..CMP_MAP_H), both
+   powers of two: w headers, w rows of h operands and the delta area. The
+   shared memory always has the size of struct cmp_map, so a runtime that
+   does not know about the geometry (qemu, frida, older builds) and keeps
+   using the default one stays inside of it. Only the touched pages count
+   anyway. */
+
+struct cmp_delta {
+  u32 delta;
+  u32 geom;
+  u32 toggle;
+  u32 touched_cnt;
+  u32 touched[];
 };
 
+#define CMP_MAP_LOG_OFF(w) ((size_t)(w) * sizeof(struct cmp_header))
+#define CMP_MAP_DELTA_OFF(w, h) \
+  (CMP_MAP_LOG_OFF(w) + (size_t)(w) * (h) * sizeof(struct cmp_operands))
+
+static inline struct cmp_operands *cmp_map_row(struct cmp_map *map, u32 w,
+                                               u32 h, u32 key) {
+  return (struct cmp_operands *)((u8 *)map + CMP_MAP_LOG_OFF(w)) +
+         (size_t)key * h;
+}
+
+/* the row of key as the u64 slots of a CMP_TYPE_SWITCH key */
+static inline u64 *cmp_map_slots(struct cmp_map *map, u32 w, u32 h, u32 key) {
+  return (u64 *)((u8 *)map + CMP_MAP_LOG_OFF(w) +
+                 (size_t)key * h * sizeof(struct cmp_operands));
+}
+
+static inline struct cmp_delta *cmp_map_delta(struct cmp_map *map, u32 w,
+                                              u32 h) {
+  return (struct cmp_delta *)((u8 *)map + CMP_MAP_DELTA_OFF(w, h));
+}
+
 /* Execs the child */
 
 struct afl_forkserver;
@@ -39,12 +39,55 @@
 
 #define STRINGIFY_VAL_SIZE_MAX (16)
 
+/* see elf_map_notes() */
+typedef void (*map_note_cb)(void *ptr, u32 type, u32 value, u32 flags,
+                            u8 *data, u32 len);
+
 u32  check_binary_signatures(u8 *fn);
+u32  predict_map_size(u8 *fn, u32 *flags);
+u8   elf_map_notes(u8 *fn, map_note_cb cb, void *ptr);
+
+/* The lowest hit count of a bucket that an AFL_LLVM_BUCKETED_COUNTS target
+   stores instead of the count, for the tools with their own count classes. */
+
+static inline u8 bucket_count(u8 bucket) {
+  static const u8 count[8] = {1, 2, 3, 4, 8, 16, 32, 128};
+  return bucket ? count[__builtin_ctz(bucket)] : 0;
+}
+
+/* A corpus in an uncompressed tar file, which -i of afl-fuzz and afl-showmap
+   and -F of afl-fuzz take instead of a directory. The file is mapped once
+   and the test cases are read from the mapping; tar files only grow at the
+   end (tar -r), see pack_update(). */
+
+struct pack_entry {
+  u8 *name;                             /* path in the archive          */
+  u64 off;                              /* contents, in the file        */
+  u32 len;                              /* up to MAX_FILE               */
+};
+
+struct pack {
+  u8                *fn, *map;
+  u64                map_len, end;      /* end: after the last member   */
+  struct pack_entry *ent;
+  u32                cnt;
+};
+
+struct pack *pack_open(u8 *fn);
+u32          pack_update(struct pack *p);
+void         pack_close(struct pack *p);
+
 void detect_file_args(char **argv, u8 *prog_in, bool *use_stdin);
 void print_suggested_envs(char *mispelled_env);
 void check_environment_vars(char **env);
 void set_sanitizer_defaults();
 
+/* crash reports the sanitizers and afl-compiler-rt write to prefix.<pid> */
+void crash_report_setup(u8 *prefix);
+u8  *crash_report_read(u8 *prefix, s32 pid);
+u32  crash_report_signature(u8 *report, u8 signal, u32 frames, u8 *sig,
+                            u32 size);
+
 char **argv_cpy_dup(int argc, char **argv);
 void   argv_cpy_free(char **argv);
 
@@ -96,6 +139,11 @@ u64 get_cur_time(void);
 
 u64 get_cur_time_us(void);
 
+/* Percentage of wall time over the CPU time a busy loop of target_ms got,
+   as afl-gotcpu and afl-fuzz -j measure CPU contention */
+
+u32 measure_preemption(u32 target_ms);
+
 /* Describe integer. The buf should be
    at least 6 bytes to fit all ints we randomly see.
    Will return buf for convenience. */
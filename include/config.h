@@ -85,6 +85,22 @@
 /* Maximum allowed fails per CMP value. Default: 96 */
 #define CMPLOG_FAIL_MAX 96
 
+/* Colorization of a queue entry stops once the target ran for about this
+   many microseconds for it, but not before this many execs.
+   Default: 2 seconds, 1024 execs */
+#define CMPLOG_COLORIZE_US (2 * 1000 * 1000)
+#define CMPLOG_COLORIZE_MIN 1024U
+
+/* Operand pairs input-to-state went through are skipped for other queue
+   entries for this many queue cycles, remembered in a table of this many
+   (power of two) slots. Default: 2 cycles, 65536 slots */
+#define CMPLOG_SOLVED_CYCLES 2
+#define CMPLOG_SOLVED_SIZE 65536
+
+/* Colorizations of queue entries kept for their next input-to-state stage,
+   in MB (AFL_CMPLOG_CACHE_SIZE). Default: 64 */
+#define CMPLOG_CACHE_SIZE 64
+
 /* -------------------------------------*/
 /* Now non-cmplog configuration options */
 /* -------------------------------------*/
@@ -119,6 +135,14 @@
   #define ALWAYS_COLORED 1
 #endif
 
+/* How often afl-fuzz looks whether AFL_PC_FILTER_FILE changed, for targets
+   that can reload it */
+#define PC_FILTER_CHECK_SEC 5
+
+/* How much more an entry whose coverage lies all in the focus set of
+   AFL_PC_FILTER_FOCUS weighs in the schedule */
+#define FOCUS_BOOST 8
+
 /* StatsD config
    Config can be adjusted via AFL_STATSD_HOST and AFL_STATSD_PORT environment
    variable.
@@ -127,6 +151,12 @@
 #define STATSD_DEFAULT_PORT 8125
 #define STATSD_DEFAULT_HOST "127.0.0.1"
 
+/* Address the AFL_METRICS_PORT endpoint listens on unless AFL_METRICS_HOST
+   is set, and the size of its replies. */
+
+#define METRICS_DEFAULT_HOST "127.0.0.1"
+#define METRICS_REPLY_MAX 65536
+
 /* If you want to have the original afl internal memory corruption checks.
    Disabled by default for speed. it is better to use "make ASAN_BUILD=1". */
 
@@ -147,6 +177,16 @@
 
 #define EXEC_TM_ROUND 20U
 
+/* AFL_ADAPTIVE_TIMEOUT: runs between two adjustments, the percentile of
+   their exec times (in 1/1000) and the multiple of it that becomes the
+   timeout. The histogram has 2^TMOUT_HIST_BITS buckets per power of two: */
+
+#define TMOUT_ADAPT_RUNS 20000
+#define TMOUT_ADAPT_PERMILLE 999
+#define TMOUT_ADAPT_MULT 2
+#define TMOUT_HIST_BITS 2
+#define TMOUT_HIST_BUCKETS (32 << TMOUT_HIST_BITS)
+
 /* 64bit arch MACRO */
 #if (defined(__x86_64__) || defined(__arm64__) || defined(__aarch64__))
   #define WORD_SIZE_64 1
@@ -171,6 +211,22 @@
 #define CAL_CYCLES 7U
 #define CAL_CYCLES_LONG 12U
 
+/* Once this many calibrations in a row found no variable behavior, a new
+   test case is done after CAL_CYCLES_EARLY runs that all take its path: */
+
+#define CAL_STABLE_STREAK 32U
+#define CAL_CYCLES_EARLY 3U
+
+/* Entries of the calibration index a resumed session runs again to see if
+   it still fits the target: */
+
+#define CAL_INDEX_SAMPLES 16U
+
+/* Most map bytes a sync manifest record carries, larger paths are left for
+   the peers to run: */
+
+#define SYNC_MANIFEST_MAX_CNT 16384U
+
 /* Number of subsequent timeouts before abandoning an input file: */
 
 #define TMOUT_LIMIT 250U
@@ -180,6 +236,12 @@
 #define KEEP_UNIQUE_HANG 500U
 #define KEEP_UNIQUE_CRASH 10000U
 
+/* Timeouts AFL_HANG_CHECK_ASYNC holds for their run with the hang timeout,
+   and the slots of its set of hang signatures, a power of two: */
+
+#define HANG_CHECK_QUEUE 16
+#define HANG_SIGS_SLOTS (1U << 10)
+
 /* Baseline number of random tweaks during a single 'havoc' stage: */
 
 #define HAVOC_CYCLES 256U
@@ -199,6 +261,36 @@
 #define POWER_BETA 1U
 #define MAX_FACTOR (POWER_BETA * 32)
 
+/* The ENERGY schedule: an entry's own record counts as much as the prior
+   from its path rarity once it was fuzzed for ENERGY_PRIOR_US, records are
+   halved past ENERGY_WINDOW_US (the queue totals past 16 times that), and
+   a path hit ENERGY_RARE_HITS times gets the average prior: */
+
+#define ENERGY_PRIOR_US 2000000ULL
+#define ENERGY_WINDOW_US 60000000ULL
+#define ENERGY_RARE_HITS 32U
+
+/* AFL_HAVOC_BANDIT: execs between rebuilds of the operator table, operator
+   tries after which the counts are halved, and the least weight an operator
+   keeps relative to the average (times its share in the static array).
+   The last two also apply to the mutators of AFL_CUSTOM_MUTATOR_BANDIT: */
+
+#define MUT_BANDIT_REBUILD 4096U
+#define MUT_BANDIT_WINDOW 1000000U
+#define MUT_BANDIT_FLOOR 0.1
+
+/* AFL_STAGE_BUDGET: execs between updates, the decay of the counts per
+   update, the execs of the average rate each stage group starts with, the
+   range of its budget relative to the static one, and the part of its
+   input trimming has to remove to keep all of its budget: */
+
+#define STAGE_BUDGET_PERIOD 100000ULL
+#define STAGE_BUDGET_DECAY 0.9
+#define STAGE_BUDGET_PRIOR 20000.0
+#define STAGE_BUDGET_MIN 0.1
+#define STAGE_BUDGET_MAX 4.0
+#define STAGE_BUDGET_TRIM_GAIN 0.05
+
 /* Maximum stacking for havoc-stage tweaks. The actual value is calculated
    like this:
 
@@ -229,6 +321,10 @@
 #define SKIP_NFAV_OLD_PROB 95 /* ...no new favs, cur entry already fuzzed */
 #define SKIP_NFAV_NEW_PROB 75 /* ...no new favs, cur entry not fuzzed yet */
 
+/* ...but only in queues of more than this many entries: */
+
+#define SKIP_NFAV_MIN_ITEMS 10
+
 /* Splicing cycle count: */
 
 #define SPLICE_CYCLES 15
@@ -237,6 +333,61 @@
 
 #define SPLICE_HAVOC 32
 
+/* One in this many havoc steps mutates a field of the entry's field hints
+   (AFL_FIELD_HINTS) instead of a random spot: */
+
+#define HINT_HAVOC_CHANCE 4
+
+/* Edges to try for a partner with AFL_SPLICE_COVER before falling back to a
+   random one: */
+
+#define SPLICE_COVER_TRIES 16
+
+/* Most mutated outputs afl_custom_fuzz_batch() is asked for at once, and the
+   size of the arena they are written to: */
+
+#define CUSTOM_BATCH_MAX 64U
+#define CUSTOM_BATCH_ARENA (4 * 1024 * 1024)
+
+/* Most threads AFL_CUSTOM_MUTATOR_THREADS may ask for, the mutations each one
+   keeps ready, and how many splice partners they get per queue entry: */
+
+#define MUTPOOL_THREADS_MAX 64
+#define MUTPOOL_SLOTS 16
+#define MUTPOOL_SPLICE 8
+
+/* The flag bytes of the queue entries in queue/.state/flags, the magic the
+   file starts with, and the entries it grows by at a time: */
+
+#define STATE_DET_DONE 1
+#define STATE_VARIABLE 2
+#define STATE_REDUNDANT 4
+
+#define STATE_FLAGS_MAGIC 0x53464c41  /* "AFLS" */
+#define STATE_FLAGS_CHUNK 65536
+
+/* How deep AFL_SEED_BATCH descends into subdirectories of the input: */
+
+#define SEED_STREAM_DEPTH 32
+
+/* Writes AFL_ASYNC_WRITES may have outstanding before afl-fuzz waits: */
+
+#define WRITER_JOBS 64
+
+/* Most entries AFL_POST_PROCESS_CACHE may ask for: */
+
+#define PP_CACHE_MAX (1U << 20)
+
+/* AFL_CHECKSUM_FIXUP: cmplog runs of changed copies of a queue entry to
+   find its checksum fields, most fields kept per queue entry, how far from
+   a field the data it covers may begin, and how often a value may occur in
+   the input to still be looked at as a stored checksum: */
+
+#define CKSUM_PROBES 8
+#define CKSUM_FIX_MAX 8
+#define CKSUM_GAP 128
+#define CKSUM_HITS 8
+
 /* Maximum offset for integer addition / subtraction stages: */
 
 #define ARITH_MAX 35
@@ -258,6 +409,11 @@
 
 #define TMIN_MAX_FILE (10 * 1024 * 1024L)
 
+/* With AFL_LARGE_INPUTS, queue entries beyond MAX_FILE are mutated in a
+   window of this many bytes (at most MAX_FILE): */
+
+#define LARGE_WINDOW (64 * 1024)
+
 /* Block normalization steps for afl-tmin: */
 
 #define TMIN_SET_MIN_SIZE 4
@@ -310,6 +466,12 @@
 #define PLOT_UPDATE_SEC 5
 #define QUEUE_UPDATE_SEC 1800
 
+/* Buckets of plot_data.bin and the run time (sec) each one starts with, the
+   width doubles whenever the run outgrows the last bucket: */
+
+#define PLOT_BIN_SLOTS 1024
+#define PLOT_BIN_WIDTH 10
+
 /* Smoothing divisor for CPU load and exec speed stats (1 - no smoothing). */
 
 #define AVG_SMOOTHING 16
@@ -323,6 +485,18 @@
 
 #define SYNC_TIME (30 * 60 * 1000)
 
+/* With AFL_SYNC_PLAN, the share of selections (percent) a secondary node
+   spends on the entries the plan of the main node gives it, and for how
+   long after its last stats update (seconds) a node still gets a share: */
+
+#define SYNC_PLAN_PREFER 75
+#define SYNC_PLAN_ALIVE_SEC 600
+
+/* Slots of the crash and hang signature set of AFL_CRASH_DEDUP, a power of
+   two (8 bytes each): */
+
+#define CRASH_SIGS_SLOTS (1U << 20)
+
 /* Output directory reuse grace period (minutes): */
 
 #define OUTPUT_GRACE 25
@@ -383,6 +557,12 @@
 
 #define RESEED_RNG 2500000
 
+/* Random numbers are made RAND_BLOCK_WORDS 64 bit words at a time, by
+   RAND_LANES generators side by side so the loop vectorizes: */
+
+#define RAND_BLOCK_WORDS 256
+#define RAND_LANES 4
+
 /* The default maximum testcase cache size in MB, 0 = disable.
    A value between 50 and 250 is a good default value. Note that the
    number of entries will be auto assigned if not specified via the
@@ -390,6 +570,35 @@
 
 #define TESTCASE_CACHE_SIZE 50
 
+/* Testcase cache buffers are rounded up to size classes (powers of two,
+   starting with 1 << TESTCASE_MIN_SHIFT bytes) and recycled per class: */
+
+#define TESTCASE_MIN_SHIFT 6
+#define TESTCASE_CLASSES 26
+
+/* Maximum number of extra forkservers for AFL_FSRV_WORKERS: */
+
+#define FSRV_WORKERS_MAX 64
+
+/* Intel PT coverage (AFL_INTEL_PT): size of the trace buffer of a run (a
+   power of two number of pages, runs that trace more are cut off), number
+   of TNT bits that tell blocks apart (see include/fsipt.h), the smallest
+   trace chunk worth handing to a decode thread and the maximum number of
+   decode threads: */
+
+#define INTEL_PT_AUX_SIZE (4 * 1024 * 1024)
+#define INTEL_PT_HISTORY 8
+#define INTEL_PT_CHUNK_MIN (64 * 1024)
+#define INTEL_PT_THREADS_MAX 16
+
+/* Persistent loop count tuning (AFL_PERSISTENT_TUNE): minimum number of execs
+   between two checks, clean checks in a row before the loop count is doubled,
+   and the largest loop count it is raised to: */
+
+#define LOOP_TUNE_INTERVAL 5000
+#define LOOP_TUNE_CLEAN 3
+#define LOOP_TUNE_MAX (1 << 20)
+
 /* Maximum line length passed from GCC to 'as' and used for parsing
    configuration files: */
 
@@ -403,6 +612,61 @@
 
 #define SHM_FUZZ_ENV_VAR "__AFL_SHM_FUZZ_ID"
 
+/* Environment variable used to pass the dirty line map SHM ID to the called
+   program (see AFL_LLVM_DIRTY_LINES). */
+
+#define DIRTY_SHM_ENV_VAR "__AFL_DIRTY_SHM_ID"
+
+/* Granularity of the dirty line map: one byte for every 1 << DIRTY_LINE_SHIFT
+   bytes of the coverage map, i.e. one per 64 byte cache line. */
+
+#define DIRTY_LINE_SHIFT 6
+#define DIRTY_LINES_SIZE(x) \
+  (((x) + (1U << DIRTY_LINE_SHIFT) - 1) >> DIRTY_LINE_SHIFT)
+
+/* Environment variable used to pass the SHM ID of the testcase batches
+   (FS_OPT_BATCH, see include/fsbatch.h) to the called program. */
+
+#define SHM_BATCH_ENV_VAR "__AFL_SHM_BATCH_ID"
+
+/* Maximum number of testcases in a batch, the number of coverage map words
+   a batch can return and the bytes available for the testcases after the
+   first one: */
+
+#define FS_BATCH_MAX 64
+#define FS_BATCH_DELTAS (1 << 19)
+#define FS_BATCH_DATA (4 * 1024 * 1024)
+
+/* Environment variable used to pass the fd of the forkserver doorbell (see
+   include/fsdoorbell.h) to the called program, and how often a doorbell is
+   polled before going to sleep on it when there is more than one CPU: */
+
+#define DOORBELL_ENV_VAR "__AFL_DOORBELL_FD"
+#define FS_DOORBELL_SPIN 1000
+
+/* Environment variable used to pass the SHM ID of the two testcase and map
+   slots for pipelined runs (AFL_PIPELINE, see include/fsdoorbell.h): */
+
+#define SHM_PIPE_ENV_VAR "__AFL_SHM_PIPE_ID"
+
+/* Environment variable used to pass the SHM ID of the field hints
+   (AFL_FIELD_HINTS, see include/fshints.h) to the called program, and how
+   many hints a run can give: */
+
+#define HINT_SHM_ENV_VAR "__AFL_HINT_SHM_ID"
+#define FS_HINTS_MAX 1024
+
+/* Environment variable used to pass the SHM ID of the copy of the virgin
+   map the target checks its runs against (AFL_TARGET_NOVELTY, see
+   include/fsvirgin.h): */
+
+#define VIRGIN_SHM_ENV_VAR "__AFL_VIRGIN_SHM_ID"
+
+/* How many ticks of the forkserver watchdog timer make up one exec timeout;
+   a hanging run is stopped at most timeout / FSRV_TIMEOUT_TICKS late: */
+
+#define FSRV_TIMEOUT_TICKS 8
+
 /* Other less interesting, internal-only variables. */
 
 #define CLANG_ENV_VAR "__AFL_CLANG_MODE"
@@ -415,6 +679,21 @@
 #define PERSIST_SIG "##SIG_AFL_PERSISTENT##"
 #define DEFER_SIG "##SIG_AFL_DEFER_FORKSRV##"
 
+/* ELF notes the LTO and PCGUARD passes leave in a target so that the tools
+   can size the map and load the autodictionary without running it. Each is
+   named MAP_NOTE_NAME, has a MAP_NOTE_* type and as desc a u32 value, u32
+   MAP_NOTE_F_* flags and the data of the type. */
+
+#define MAP_NOTE_SECTION ".note.afl"
+#define MAP_NOTE_NAME "AFL"
+#define MAP_NOTE_FINAL_LOC 1 /* value: __afl_final_loc of an LTO build */
+#define MAP_NOTE_GUARDS 2    /* value: guards of a PCGUARD module      */
+#define MAP_NOTE_DICT 3      /* value: length of the data, which is
+                                the LTO autodictionary                */
+
+#define MAP_NOTE_F_NGRAM 1 /* the runtime rounds the map for N-grams */
+#define MAP_NOTE_F_DICT 2  /* an autodictionary is built in          */
+
 /* Distinctive bitmap signature used to indicate failed execution: */
 
 #define EXEC_FAIL_SIG 0xfee1dead
@@ -473,12 +752,66 @@
 
 #define HASH_CONST 0xa5b35705
 
+/* Point updates of the queue selection weights allowed before all of them
+   are recomputed, as a fraction (1/n) of the queue size: */
+
+#define WEIGHT_STALE_DIV 8
+
+/* Marker for map bytes not covered by a favored entry in cull_queue(): */
+
+#define CULL_UNCOVERED 0xffffffff
+
+/* Queue entries are allocated this many at a time, so that passes over the
+   queue walk contiguous memory: */
+
+#define QUEUE_SLAB 256
+
+/* Initial number of trace_mini slots in the per-instance arena file. The
+   arena doubles whenever it runs full: */
+
+#define TRACE_MINI_ARENA_SLOTS 256
+
+/* Initial number of slots (a power of two) in the path frequency table of
+   the FAST..RARE schedules. The table doubles whenever it is 3/4 full: */
+
+#define N_FUZZ_SIZE_INIT (1 << 12)
+
+/* Size (log2, in bits) of the bloom filter over the summaries of all queued
+   paths. The FAST..RARE schedules only use the path frequencies of queue
+   entries, so executions whose summary is not in the filter skip the full
+   map hash. 1 << 20 bits keep the filter at 128 kB: */
+
+#define PATH_BLOOM_POW2 20
+
 /* Constants for afl-gotcpu to control busy loop timing: */
 
 #define CTEST_TARGET_MS 5000
 #define CTEST_CORE_TRG_MS 1000
 #define CTEST_BUSY_CYCLES (10 * 1000 * 1000)
 
+/* The preemption (wall time over CPU time, in percent) below which
+   afl-gotcpu rates a core as available and from which as overbooked: */
+
+#define CTEST_AVAILABLE 110
+#define CTEST_OVERBOOKED 250
+
+/* afl-fuzz -j looks at its instances every SUPERVISE_CHECK_SEC seconds. An
+   instance whose fuzzer_stats were not updated for SUPERVISE_STALL_SEC is
+   restarted, one that exits within SUPERVISE_QUICK_SEC of its start
+   SUPERVISE_QUICK_EXITS times in a row is given up. The CPUs of the
+   instances are probed for SUPERVISE_PROBE_MS, SUPERVISE_PARK_CHECKS
+   overbooked checks in a row stop the last secondary, SUPERVISE_RESUME_CHECKS
+   available ones start it again: */
+
+#define SUPERVISE_CHECK_SEC 10
+#define SUPERVISE_PROBE_MS 250
+#define SUPERVISE_STALL_SEC (15 * 60)
+#define SUPERVISE_KILL_SEC 10
+#define SUPERVISE_QUICK_SEC 30
+#define SUPERVISE_QUICK_EXITS 3
+#define SUPERVISE_PARK_CHECKS 6
+#define SUPERVISE_RESUME_CHECKS 30
+
 /* Enable NeverZero counters in QEMU mode */
 
 #define AFL_QEMU_NOT_ZERO
@@ -486,6 +819,25 @@
 /* AFL RedQueen */
 
 #define CMPLOG_SHM_ENV_VAR "__AFL_CMPLOG_SHM_ID"
+#define CMPLOG_MAP_ENV_VAR "__AFL_CMPLOG_MAP"
+#define CMPLOG_SWITCH_ENV_VAR "__AFL_CMPLOG_SWITCH"
+
+/* Environment variable with the path afl-tmin and afl-triage have the
+   sanitizers write their reports to (log_path), afl-compiler-rt writes the
+   faulting PC there too: */
+
+#define CRASH_SIG_ENV_VAR "__AFL_CRASH_SIG"
+
+/* Environment variable afl-fuzz passes AFL_HANG_WATCHDOG on in, as
+   "<soft ms>,<idle ms>". A run the watchdog of afl-compiler-rt stopped dies
+   by SIGVTALRM. The idle time if it is not given (milliseconds): */
+
+#define HANG_WATCHDOG_ENV_VAR "__AFL_HANG_WATCHDOG"
+#define HANG_WATCHDOG_IDLE 20
+
+/* Maximum size of a crash report that is read back: */
+
+#define CRASH_REPORT_MAX (64 * 1024)
 
 /* CPU Affinity lockfile env var */
 
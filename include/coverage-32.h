@@ -15,10 +15,7 @@ inline u32 classify_word(u32 word) {
   return word;
 }
 
-void simplify_trace(afl_state_t *afl, u8 *bytes) {
-  u32 *mem = (u32 *)bytes;
-  u32  i = (afl->fsrv.map_size >> 2);
-
+static inline void simplify_words(u32 *mem, u32 i) {
   while (i--) {
     /* Optimize for sparse bitmaps. */
 
@@ -38,10 +35,23 @@ void simplify_trace(afl_state_t *afl, u8 *bytes) {
   }
 }
 
-inline void classify_counts(afl_forkserver_t *fsrv) {
-  u32 *mem = (u32 *)fsrv->trace_bits;
-  u32  i = (fsrv->map_size >> 2);
+void simplify_trace(afl_state_t *afl, u8 *bytes) {
+  u32 *mem = (u32 *)bytes;
+  u32  i = (afl->fsrv.map_size >> 2);
+
+  if (afl->fsrv.use_dirty_lines && bytes == afl->fsrv.trace_bits) {
+    u32 line = 0, start, cnt;
+
+    while ((cnt = next_dirty_run(&afl->fsrv, &line, &start, i, sizeof(u32)))) {
+      simplify_words(mem + start, cnt);
+    }
 
+  } else {
+    simplify_words(mem, i);
+  }
+}
+
+static inline void classify_words(u32 *mem, u32 i) {
   while (i--) {
     /* Optimize for sparse bitmaps. */
 
@@ -51,6 +61,25 @@ inline void classify_counts(afl_forkserver_t *fsrv) {
   }
 }
 
+inline void classify_counts(afl_forkserver_t *fsrv) {
+  u32 *mem = (u32 *)fsrv->trace_bits;
+  u32  i = (fsrv->map_size >> 2);
+
+  /* the target stores the buckets itself */
+  if (fsrv->bucketed_counts) { return; }
+
+  if (fsrv->use_dirty_lines) {
+    u32 line = 0, start, cnt;
+
+    while ((cnt = next_dirty_run(fsrv, &line, &start, i, sizeof(u32)))) {
+      classify_words(mem + start, cnt);
+    }
+
+  } else {
+    classify_words(mem, i);
+  }
+}
+
 /* Updates the virgin bits, then reflects whether a new count or a new tuple is
  * seen in ret. */
 inline void discover_word(u8 *ret, u32 *current, u32 *virgin) {
@@ -88,3 +117,64 @@ inline u32 skim(const u32 *virgin, const u32 *current, const u32 *current_end) {
 
   return 0;
 }
+
+/* Fused classify_counts() + has_new_bits(), see coverage-64.h. There are no
+   vector kernels for 32 bit builds. */
+
+static inline u64 summary_word(u32 word, u32 idx) {
+  u64 x = (word ^ ((u64)idx * 0x9E3779B97F4A7C15ULL)) * 0xff51afd7ed558ccdULL;
+  return x ^ (x >> 32);
+}
+
+static u8 classify_discover(u32 *current, u32 *virgin, u32 words, u32 base,
+                            u64 *summary) {
+  u8  ret = 0;
+  u64 sum = 0;
+
+  for (u32 i = 0; i < words; ++i, ++current, ++virgin) {
+    if (unlikely(*current)) {
+      *current = classify_word(*current);
+      sum += summary_word(*current, base + i);
+      discover_word(&ret, current, virgin);
+    }
+  }
+
+  *summary += sum;
+  return ret;
+}
+
+/* The fused pass without the classifying, for maps the target stores the
+   buckets in already (AFL_LLVM_BUCKETED_COUNTS). */
+
+static u8 discover_summary(u32 *current, u32 *virgin, u32 words, u32 base,
+                           u64 *summary) {
+  u8  ret = 0;
+  u64 sum = 0;
+
+  for (u32 i = 0; i < words; ++i, ++current, ++virgin) {
+    if (unlikely(*current)) {
+      sum += summary_word(*current, base + i);
+      discover_word(&ret, current, virgin);
+    }
+  }
+
+  *summary += sum;
+  return ret;
+}
+
+void init_classify_kernel(void) {
+}
+
+/* There are no map size specialized passes for 32 bit builds, the size
+   stays 0. See coverage-64.h. */
+
+static struct {
+  u32 size;
+  u8 (*discover)(u32 *current, u32 *virgin);
+  u8 (*classify_discover)(u32 *current, u32 *virgin, u64 *summary);
+  u32 (*count)(u32 *mem);
+} map_kernels;
+
+void select_map_kernels(afl_state_t *afl) {
+  (void)afl;
+}
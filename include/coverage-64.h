@@ -1,13 +1,29 @@
 #include "config.h"
 #include "types.h"
 
-#if (defined(__AVX512F__) && defined(__AVX512DQ__)) || defined(__AVX2__)
+#if (defined(__AVX512F__) && defined(__AVX512DQ__)) || defined(__AVX2__) || \
+    (defined(__x86_64__) && defined(__GNUC__))
   #include <immintrin.h>
 #endif
 
 u32 skim(const u64 *virgin, const u64 *current, const u64 *current_end);
 u64 classify_word(u64 word);
 
+/* The passes over the whole map for the common map sizes, with the word
+   count a constant so that the loops are unrolled and have no bound to load.
+   select_map_kernels() picks the ones for the map size of the target after
+   the forkserver handshake; the callers check map_kernels.size and go by
+   the generic loops for other sizes, dirty line runs and other maps. */
+
+static struct {
+  u32 size;
+  void (*classify)(u64 *mem);
+  void (*simplify)(u64 *mem);
+  u8 (*discover)(u64 *current, u64 *virgin);
+  u8 (*classify_discover)(u64 *current, u64 *virgin, u64 *summary);
+  u32 (*count)(u32 *mem);
+} map_kernels;
+
 inline u64 classify_word(u64 word) {
   u16 mem16[4];
   memcpy(mem16, &word, sizeof(mem16));
@@ -21,10 +37,7 @@ inline u64 classify_word(u64 word) {
   return word;
 }
 
-void simplify_trace(afl_state_t *afl, u8 *bytes) {
-  u64 *mem = (u64 *)bytes;
-  u32  i = (afl->fsrv.map_size >> 3);
-
+static inline void simplify_words(u64 *mem, u32 i) {
   while (i--) {
     /* Optimize for sparse bitmaps. */
 
@@ -48,10 +61,29 @@ void simplify_trace(afl_state_t *afl, u8 *bytes) {
   }
 }
 
-inline void classify_counts(afl_forkserver_t *fsrv) {
-  u64 *mem = (u64 *)fsrv->trace_bits;
-  u32  i = (fsrv->map_size >> 3);
+/* With dirty line tracking only the dirty lines are simplified; clean lines
+   stay zero and are skipped by has_new_bits() as well. */
+
+void simplify_trace(afl_state_t *afl, u8 *bytes) {
+  u64 *mem = (u64 *)bytes;
+  u32  i = (afl->fsrv.map_size >> 3);
+
+  if (afl->fsrv.use_dirty_lines && bytes == afl->fsrv.trace_bits) {
+    u32 line = 0, start, cnt;
+
+    while ((cnt = next_dirty_run(&afl->fsrv, &line, &start, i, sizeof(u64)))) {
+      simplify_words(mem + start, cnt);
+    }
+
+  } else if (map_kernels.size == afl->fsrv.map_size) {
+    map_kernels.simplify(mem);
 
+  } else {
+    simplify_words(mem, i);
+  }
+}
+
+static inline void classify_words(u64 *mem, u32 i) {
   while (i--) {
     /* Optimize for sparse bitmaps. */
 
@@ -61,6 +93,28 @@ inline void classify_counts(afl_forkserver_t *fsrv) {
   }
 }
 
+inline void classify_counts(afl_forkserver_t *fsrv) {
+  u64 *mem = (u64 *)fsrv->trace_bits;
+  u32  i = (fsrv->map_size >> 3);
+
+  /* the target stores the buckets itself */
+  if (fsrv->bucketed_counts) { return; }
+
+  if (fsrv->use_dirty_lines) {
+    u32 line = 0, start, cnt;
+
+    while ((cnt = next_dirty_run(fsrv, &line, &start, i, sizeof(u64)))) {
+      classify_words(mem + start, cnt);
+    }
+
+  } else if (map_kernels.size == fsrv->map_size) {
+    map_kernels.classify(mem);
+
+  } else {
+    classify_words(mem, i);
+  }
+}
+
 /* Updates the virgin bits, then reflects whether a new count or a new tuple is
  * seen in ret. */
 inline void discover_word(u8 *ret, u64 *current, u64 *virgin) {
@@ -162,3 +216,296 @@ inline u32 skim(const u64 *virgin, const u64 *current, const u64 *current_end) {
 }
 
 #endif
+
+/* Fused classify_counts() + has_new_bits(): classifies the hit counts in
+   current[] in place and merges them into virgin[] within a single pass, so
+   the trace map is only streamed through the cache once per exec. Returns
+   the same values as has_new_bits(). The vector kernels are selected at
+   runtime by init_classify_kernel(), the scalar one is the portable
+   fallback.
+
+   While at it, a cheap summary of the classified map is accumulated into
+   *summary. It is a sum over the nonzero words keyed by their index (base
+   is the index of current[0]), so it does not depend on the order in which
+   the words are visited and sparse passes give the same value as a full
+   one. */
+
+static inline u64 summary_word(u64 word, u32 idx) {
+  u64 x = (word ^ ((u64)idx * 0x9E3779B97F4A7C15ULL)) * 0xff51afd7ed558ccdULL;
+  return x ^ (x >> 32);
+}
+
+static inline u8 classify_discover_scalar(u64 *current, u64 *virgin,
+                                          u32 words, u32 base, u64 *summary) {
+  u8  ret = 0;
+  u64 sum = 0;
+
+  for (u32 i = 0; i < words; ++i, ++current, ++virgin) {
+    if (unlikely(*current)) {
+      *current = classify_word(*current);
+      sum += summary_word(*current, base + i);
+      discover_word(&ret, current, virgin);
+    }
+  }
+
+  *summary += sum;
+  return ret;
+}
+
+/* The fused pass without the classifying, for maps the target stores the
+   buckets in already (AFL_LLVM_BUCKETED_COUNTS). */
+
+static u8 discover_summary(u64 *current, u64 *virgin, u32 words, u32 base,
+                           u64 *summary) {
+  u8  ret = 0;
+  u64 sum = 0;
+
+  for (u32 i = 0; i < words; ++i, ++current, ++virgin) {
+    if (unlikely(*current)) {
+      sum += summary_word(*current, base + i);
+      discover_word(&ret, current, virgin);
+    }
+  }
+
+  *summary += sum;
+  return ret;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+
+/* Hit count classes computed per byte via two nibble lookups: bytes >= 16
+   are fully determined by their high nibble, smaller ones by the low one. */
+  #define CLASS_LUT_LO \
+    0, 1, 2, 4, 8, 8, 8, 8, 16, 16, 16, 16, 16, 16, 16, 16
+  #define CLASS_LUT_HI                                                      \
+    0, 32, 64, 64, 64, 64, 64, 64, (char)128, (char)128, (char)128, (char)128, \
+        (char)128, (char)128, (char)128, (char)128
+
+__attribute__((target("avx2"))) static inline u8 classify_discover_avx2(
+    u64 *current, u64 *virgin, u32 words, u32 base, u64 *summary) {
+  const __m256i lut_lo = _mm256_setr_epi8(CLASS_LUT_LO, CLASS_LUT_LO);
+  const __m256i lut_hi = _mm256_setr_epi8(CLASS_LUT_HI, CLASS_LUT_HI);
+  const __m256i nibble = _mm256_set1_epi8(0x0f);
+  const __m256i zeroes = _mm256_setzero_si256();
+  const __m256i ones = _mm256_set1_epi8(-1);
+
+  u32 i = words >> 2, idx = base;
+  u8  ret = 0;
+  u64 sum = 0;
+
+  for (; i; --i, current += 4, virgin += 4, idx += 4) {
+    __m256i cur = _mm256_loadu_si256((__m256i *)current);
+
+    /* All bytes are zero. */
+    if (likely(_mm256_testz_si256(cur, cur))) continue;
+
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(cur, 4), nibble);
+    __m256i lo = _mm256_and_si256(cur, nibble);
+    __m256i cls =
+        _mm256_or_si256(_mm256_shuffle_epi8(lut_hi, hi),
+                        _mm256_and_si256(_mm256_shuffle_epi8(lut_lo, lo),
+                                         _mm256_cmpeq_epi8(hi, zeroes)));
+    _mm256_storeu_si256((__m256i *)current, cls);
+
+    for (u32 j = 0; j < 4; ++j) {
+      if (current[j]) { sum += summary_word(current[j], idx + j); }
+    }
+
+    __m256i vir = _mm256_loadu_si256((__m256i *)virgin);
+
+    /* Nothing new in this chunk. */
+    if (likely(_mm256_testz_si256(cls, vir))) continue;
+
+    if (likely(ret < 2)) {
+      /* A hit byte that is still pristine in virgin[] is a new tuple. */
+      __m256i fresh = _mm256_andnot_si256(_mm256_cmpeq_epi8(cls, zeroes),
+                                          _mm256_cmpeq_epi8(vir, ones));
+      ret = _mm256_movemask_epi8(fresh) ? 2 : 1;
+    }
+
+    _mm256_storeu_si256((__m256i *)virgin, _mm256_andnot_si256(cls, vir));
+  }
+
+  *summary += sum;
+
+  u8 tail = classify_discover_scalar(current, virgin, words & 3, idx, summary);
+  return tail > ret ? tail : ret;
+}
+
+__attribute__((target("avx512f,avx512bw"))) static inline u8
+classify_discover_avx512(u64 *current, u64 *virgin, u32 words, u32 base,
+                         u64 *summary) {
+  const __m512i lut_lo =
+      _mm512_broadcast_i32x4(_mm_setr_epi8(CLASS_LUT_LO));
+  const __m512i lut_hi =
+      _mm512_broadcast_i32x4(_mm_setr_epi8(CLASS_LUT_HI));
+  const __m512i nibble = _mm512_set1_epi8(0x0f);
+  const __m512i ones = _mm512_set1_epi8(-1);
+
+  u32 i = words >> 3, idx = base;
+  u8  ret = 0;
+  u64 sum = 0;
+
+  for (; i; --i, current += 8, virgin += 8, idx += 8) {
+    __m512i cur = _mm512_loadu_si512((void *)current);
+
+    /* All bytes are zero. */
+    if (likely(!_mm512_test_epi64_mask(cur, cur))) continue;
+
+    __m512i   hi = _mm512_and_si512(_mm512_srli_epi16(cur, 4), nibble);
+    __m512i   lo = _mm512_and_si512(cur, nibble);
+    __mmask64 small = _mm512_testn_epi8_mask(hi, hi);
+    __m512i   cls = _mm512_or_si512(_mm512_shuffle_epi8(lut_hi, hi),
+                                    _mm512_maskz_shuffle_epi8(small, lut_lo, lo));
+    _mm512_storeu_si512((void *)current, cls);
+
+    for (u32 j = 0; j < 8; ++j) {
+      if (current[j]) { sum += summary_word(current[j], idx + j); }
+    }
+
+    __m512i vir = _mm512_loadu_si512((void *)virgin);
+
+    /* Nothing new in this chunk. */
+    if (likely(!_mm512_test_epi64_mask(cls, vir))) continue;
+
+    if (likely(ret < 2)) {
+      /* A hit byte that is still pristine in virgin[] is a new tuple. */
+      ret = _mm512_mask_cmpeq_epi8_mask(_mm512_test_epi8_mask(cls, cls), vir,
+                                        ones)
+                ? 2
+                : 1;
+    }
+
+    _mm512_storeu_si512((void *)virgin, _mm512_andnot_si512(cls, vir));
+  }
+
+  *summary += sum;
+
+  u8 tail = classify_discover_scalar(current, virgin, words & 7, idx, summary);
+  return tail > ret ? tail : ret;
+}
+
+  #undef CLASS_LUT_LO
+  #undef CLASS_LUT_HI
+
+#endif
+
+static u8 (*classify_discover)(u64 *, u64 *, u32, u32,
+                               u64 *) = classify_discover_scalar;
+
+void init_classify_kernel(void) {
+#if defined(__x86_64__) && defined(__GNUC__)
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx512bw")) {
+    classify_discover = classify_discover_avx512;
+
+  } else if (__builtin_cpu_supports("avx2")) {
+    classify_discover = classify_discover_avx2;
+  }
+
+#endif
+}
+
+static inline u8 discover_words(u64 *current, u64 *virgin, u32 i) {
+  u8 ret = 0;
+
+  while (i--) {
+    if (unlikely(*current)) discover_word(&ret, current, virgin);
+
+    current++;
+    virgin++;
+  }
+
+  return ret;
+}
+
+/* The generated ones for map sizes of MAP_KERNELS(), see
+   select_map_kernels(). */
+
+#if defined(__x86_64__) && defined(__GNUC__)
+  #define MAP_KERNELS_SIMD(size)                                               \
+    __attribute__((target("avx2"))) static u8 classify_discover_avx2_##size(   \
+        u64 *current, u64 *virgin, u64 *summary) {                             \
+      return classify_discover_avx2(current, virgin, (size) >> 3, 0, summary); \
+    }                                                                          \
+    __attribute__((target("avx512f,avx512bw"))) static u8                      \
+        classify_discover_avx512_##size(u64 *current, u64 *virgin,             \
+                                        u64 *summary) {                        \
+      return classify_discover_avx512(current, virgin, (size) >> 3, 0,         \
+                                      summary);                                \
+    }
+#else
+  #define MAP_KERNELS_SIMD(size)
+#endif
+
+#define MAP_KERNELS(size)                                                      \
+  static void classify_##size(u64 *mem) {                                      \
+    classify_words(mem, (size) >> 3);                                          \
+  }                                                                            \
+  static void simplify_##size(u64 *mem) {                                      \
+    simplify_words(mem, (size) >> 3);                                          \
+  }                                                                            \
+  static u8 discover_##size(u64 *current, u64 *virgin) {                       \
+    return discover_words(current, virgin, (size) >> 3);                       \
+  }                                                                            \
+  static u8 classify_discover_scalar_##size(u64 *current, u64 *virgin,         \
+                                            u64 *summary) {                    \
+    return classify_discover_scalar(current, virgin, (size) >> 3, 0,           \
+                                    summary);                                  \
+  }                                                                            \
+  static u32 count_##size(u32 *mem) {                                          \
+    return count_bytes_words(mem, (size) >> 2);                                \
+  }                                                                            \
+  MAP_KERNELS_SIMD(size)
+
+MAP_KERNELS(65536)
+MAP_KERNELS(262144)
+MAP_KERNELS(1048576)
+MAP_KERNELS(8388608)
+
+#undef MAP_KERNELS
+#undef MAP_KERNELS_SIMD
+
+void select_map_kernels(afl_state_t *afl) {
+  u32 size = afl->fsrv.map_size;
+
+  memset(&map_kernels, 0, sizeof(map_kernels));
+
+  if (size != afl->fsrv.real_map_size) { return; }
+
+#if defined(__x86_64__) && defined(__GNUC__)
+  #define MAP_KERNELS_SIMD(n)                                                  \
+    if (classify_discover == classify_discover_avx512) {                       \
+      map_kernels.classify_discover = classify_discover_avx512_##n;            \
+    } else if (classify_discover == classify_discover_avx2) {                  \
+      map_kernels.classify_discover = classify_discover_avx2_##n;              \
+    }
+#else
+  #define MAP_KERNELS_SIMD(n)
+#endif
+
+#define MAP_KERNELS(n)                                                         \
+  case n:                                                                      \
+    map_kernels.classify = classify_##n;                                       \
+    map_kernels.simplify = simplify_##n;                                       \
+    map_kernels.discover = discover_##n;                                       \
+    map_kernels.classify_discover = classify_discover_scalar_##n;              \
+    map_kernels.count = count_##n;                                             \
+    MAP_KERNELS_SIMD(n)                                                        \
+    break;
+
+  switch (size) {
+    MAP_KERNELS(65536)
+    MAP_KERNELS(262144)
+    MAP_KERNELS(1048576)
+    MAP_KERNELS(8388608)
+    default:
+      return;
+  }
+
+#undef MAP_KERNELS
+#undef MAP_KERNELS_SIMD
+
+  map_kernels.size = size;
+}
@@ -30,6 +30,10 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <time.h>
+#ifdef __linux__
+  #include <pthread.h>
+#endif
 
 #include "types.h"
 
@@ -95,6 +99,85 @@ nyx_plugin_handler_t *afl_load_libnyx_plugin(u8 *libnyx_binary);
 
 #endif
 
+/* Where a testcase differs from a base buffer of len bytes: only within
+   [lo, hi), and hi is UINT32_MAX if its length changed at lo. */
+
+struct fs_diff {
+  u8 *base;
+  u32 len, lo, hi;
+};
+
+/* A testcase that is file with the cut bytes at off replaced by the buffer
+   written, max bytes at most (AFL_LARGE_INPUTS). len is the length of the
+   buffer that went in. */
+
+struct fs_patch {
+  u8 *file;
+  u32 file_len, off, cut, max, len;
+};
+
+/* How many bytes of the file after the cut a patch with len bytes keeps. */
+
+static inline u32 fs_patch_tail(struct fs_patch *p, u32 len) {
+  u32 head = p->off + len, tail = p->file_len - p->off - p->cut;
+
+  return head < p->max ? MIN(tail, p->max - head) : 0;
+}
+
+/* AFL_FSRV_LATENCY: where the time of a forkserver round trip goes. afl-fuzz
+   times clearing the map (RESET), asking for a run until it has the pid
+   (START) and from there until it has the status (WAIT). Over the doorbell
+   the forkserver adds its own CLOCK_MONOTONIC timestamps, which split the
+   round trip into the wakeup of the forkserver (REQUEST), fork() or the
+   SIGCONT of a stopped persistent child (FORK, RESUME), the run until
+   waitpid() returns (RUN) and the way back of the status (STATUS). Runs that
+   timed out are left out. Bucket i counts the times up to
+   FSRV_LAT_BASE << i ns, the last one all longer ones. */
+
+enum {
+
+  /* 00 */ FSRV_LAT_RESET,
+  /* 01 */ FSRV_LAT_START,
+  /* 02 */ FSRV_LAT_WAIT,
+  /* 03 */ FSRV_LAT_REQUEST,
+  /* 04 */ FSRV_LAT_FORK,
+  /* 05 */ FSRV_LAT_RESUME,
+  /* 06 */ FSRV_LAT_RUN,
+  /* 07 */ FSRV_LAT_STATUS,
+  /* 08 */ FSRV_LAT_NUM
+
+};
+
+#define FSRV_LAT_BUCKETS 20
+#define FSRV_LAT_BASE 1000                                  /* ns          */
+
+static const char *const fsrv_lat_names[FSRV_LAT_NUM] = {
+    "reset", "start", "wait", "request", "fork", "resume", "run", "status"};
+
+struct fsrv_latency {
+  u64 hist[FSRV_LAT_NUM][FSRV_LAT_BUCKETS];
+  u64 sum_ns[FSRV_LAT_NUM];
+};
+
+static inline u64 fsrv_lat_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Only afl-fuzz writes, the metrics thread reads with atomic loads. */
+
+static inline void fsrv_lat_add(struct fsrv_latency *lat, u32 phase, u64 ns) {
+  u32 i =
+      ns <= FSRV_LAT_BASE ? 0 : 64 - __builtin_clzll((ns - 1) / FSRV_LAT_BASE);
+
+  if (i >= FSRV_LAT_BUCKETS) { i = FSRV_LAT_BUCKETS - 1; }
+  __atomic_store_n(&lat->hist[phase][i], lat->hist[phase][i] + 1,
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&lat->sum_ns[phase], lat->sum_ns[phase] + ns,
+                   __ATOMIC_RELAXED);
+}
+
 typedef struct afl_forkserver {
   /* a program that includes afl-forkserver needs to define these */
 
@@ -116,6 +199,8 @@ typedef struct afl_forkserver {
   u32 init_tmout;    /* Configurable init timeout (ms)   */
   u32 map_size;      /* map size used by the target      */
   u32 real_map_size; /* real map size, unaligned         */
+  u32 map_cap;       /* map size it may grow to, or 0    */
+  u32 map_grown;     /* real_map_size it grew to, or 0   */
   u32 snapshot;      /* is snapshot feature used         */
   u64 mem_limit;     /* Memory cap for child (MB)        */
 
@@ -132,6 +217,8 @@ typedef struct afl_forkserver {
 
   u8 last_kill_signal; /* Signal that killed the child     */
 
+  s32 last_child_pid; /* PID of the child of the last run */
+
   bool use_shmem_fuzz; /* use shared mem for test cases    */
 
   bool support_shmem_fuzz; /* set by afl-fuzz                  */
@@ -146,10 +233,17 @@ typedef struct afl_forkserver {
 
   bool cs_mode; /* if running in CoreSight mode or not */
 
+  bool ipt_mode;   /* Intel PT coverage (AFL_INTEL_PT)  */
+  u32  ipt_type;   /* perf type of the intel_pt PMU     */
+  u64  ipt_config; /* perf config of the traces         */
+  u32  ipt_threads; /* trace decode threads             */
+
   bool use_stdin; /* use stdin for sending data       */
 
   bool no_unlink; /* do not unlink cur_input          */
 
+  bool use_memfd; /* out_fd is a memfd behind out_file */
+
   bool uses_asan; /* Target uses ASAN?                */
 
   bool debug; /* debug mode?                      */
@@ -157,12 +251,89 @@ typedef struct afl_forkserver {
   bool uses_crash_exitcode; /* Custom crash exitcode specified? */
   u8   crash_exitcode;      /* The crash exitcode specified     */
 
+  bool hang_watchdog; /* SIGVTALRM deaths are timeouts    */
+
   u32 *shmem_fuzz_len; /* length of the fuzzing test case  */
 
   u8 *shmem_fuzz; /* allocated memory for fuzzing     */
 
+  struct fs_diff shmem_fuzz_diff, /* shmem_fuzz, if base is set       */
+      write_diff;                 /* next testcase, from the caller   */
+
+  struct fs_patch shmem_fuzz_patch, /* shmem_fuzz, if file is set       */
+      patch;                        /* next testcase, from the caller   */
+
+  u32 shmem_fuzz_max; /* room in shmem_fuzz               */
+
+  u8 *dirty_lines; /* SHM with dirty line map, if any  */
+
+  bool use_dirty_lines; /* target maintains dirty_lines     */
+
+  u64 *touched_lines; /* dirty_lines, one bit per line    */
+  u32  touched_words; /* u64 words of touched_lines       */
+  bool touched_valid; /* touched_lines are of this run    */
+
+  bool bucketed_counts; /* buckets instead of hit counts    */
+  bool buckets_lost;    /* target dropped them, stay off    */
+
+  bool reset_full_map; /* trace_bits changed outside a run */
+
+  struct fs_batch *batch; /* SHM for testcase batches, if any */
+
+  struct fs_virgin *virgin; /* SHM for AFL_TARGET_NOVELTY, if any */
+
+  bool support_batch; /* set by afl-fuzz                  */
+
+  bool use_batch; /* target runs testcase batches     */
+
+  u32 batch_cnt; /* testcases queued for the batch    */
+
+  u32 batch_done; /* testcases run by the last batch  */
+
+  u32 batch_data; /* bytes used in batch->data        */
+
+  struct fs_doorbell *doorbell; /* shared control channel, if any   */
+
+  s32 doorbell_fd; /* memfd behind doorbell            */
+
+  bool use_doorbell; /* doorbell replaces the pipes      */
+
+  u32 doorbell_st; /* messages read from the doorbell  */
+
+  u32 doorbell_spin; /* polls before sleeping on a bell  */
+
+  struct fs_pipe *pipe; /* SHM for pipelined runs, if any   */
+
+  bool support_pipeline; /* set by afl-fuzz                  */
+
+  bool use_pipeline; /* target runs from pipeline slots  */
+
+  u32 pipe_slot; /* 1 + slot of the next run, 0 = main */
+
+  s32 cpu_bind; /* CPU of the forkserver, -1 = ours */
+
+  struct fsrv_latency *latency; /* AFL_FSRV_LATENCY, shared by dups */
+
+  u64 lat_go, lat_pid; /* when the last run was asked for  */
+
+  s32 epoll_fd; /* waits on status pipe and timer   */
+
+  s32 timer_fd; /* periodic timeout watchdog        */
+
+  u32 timer_tick_ms; /* current watchdog period          */
+
   char *cmplog_binary; /* the name of the cmplog binary    */
 
+  bool cmplog_switch; /* target switches cmplog per run   */
+
+  bool cmplog_run; /* next run is a cmplog one         */
+
+  bool pc_filter_reloadable; /* target reloads AFL_PC_FILTER_FILE */
+
+  bool pc_filter_reload; /* next run reloads the filter      */
+
+  u32 focus_start, focus_end; /* map bytes AFL_PC_FILTER_FOCUS sets */
+
   /* persistent mode replay functionality */
   u32 persistent_record; /* persistent replay setting        */
 #ifdef AFL_PERSISTENT_RECORD
@@ -179,7 +350,8 @@ typedef struct afl_forkserver {
 
   u8 *afl_ptr; /* for autodictionary: afl ptr      */
 
-  void (*add_extra_func)(void *afl_ptr, u8 *mem, u32 len);
+  /* adds an autodictionary, returns the number of entries */
+  u32 (*add_dict_func)(void *afl_ptr, u8 *dict, u32 len);
 
   u8 child_kill_signal;
   u8 fsrv_kill_signal;
@@ -200,6 +372,9 @@ typedef struct afl_forkserver {
   bool                  nyx_use_tmp_workdir;
   char                 *nyx_tmp_workdir_path;
   s32                   nyx_log_fd;
+  u32                   nyx_tmout;       /* timeout last set on the runner   */
+  bool                  nyx_async;       /* nyx_exec() runs on nyx_thread    */
+  pthread_t             nyx_thread;
 #endif
 
 } afl_forkserver_t;
@@ -217,6 +392,7 @@ typedef enum fsrv_run_result {
 
 void afl_fsrv_init(afl_forkserver_t *fsrv);
 void afl_fsrv_init_dup(afl_forkserver_t *fsrv_to, afl_forkserver_t *from);
+void afl_fsrv_ipt_setup(afl_forkserver_t *fsrv);
 void afl_fsrv_start(afl_forkserver_t *fsrv, char **argv,
                     volatile u8 *stop_soon_p, u8 debug_child_output);
 u32  afl_fsrv_get_mapsize(afl_forkserver_t *fsrv, char **argv,
@@ -224,9 +400,24 @@ u32  afl_fsrv_get_mapsize(afl_forkserver_t *fsrv, char **argv,
 void afl_fsrv_write_to_testcase(afl_forkserver_t *fsrv, u8 *buf, size_t len);
 fsrv_run_result_t afl_fsrv_run_target(afl_forkserver_t *fsrv, u32 timeout,
                                       volatile u8 *stop_soon_p);
+u8                afl_fsrv_run_start(afl_forkserver_t *fsrv,
+                                     volatile u8      *stop_soon_p);
+fsrv_run_result_t afl_fsrv_run_finish(afl_forkserver_t *fsrv, u32 timeout,
+                                      volatile u8 *stop_soon_p);
+u8                afl_fsrv_run_done(afl_forkserver_t *fsrv);
+u32  afl_fsrv_batch_add(afl_forkserver_t *fsrv, u8 *buf, u32 len);
+fsrv_run_result_t afl_fsrv_run_batch(afl_forkserver_t *fsrv, u32 timeout,
+                                     volatile u8 *stop_soon_p);
+void              afl_fsrv_batch_trace(afl_forkserver_t *fsrv, u32 idx);
+void              afl_fsrv_pack_dirty(afl_forkserver_t *fsrv);
+void              afl_fsrv_buckets_off(afl_forkserver_t *fsrv);
 void              afl_fsrv_killall(void);
 void              afl_fsrv_deinit(afl_forkserver_t *fsrv);
 void              afl_fsrv_kill(afl_forkserver_t *fsrv);
+u64  afl_fsrv_lat_quantile(struct fsrv_latency *lat, u32 phase, double q);
+#ifdef __linux__
+void afl_fsrv_nyx_async(afl_forkserver_t *fsrv);
+#endif
 
 #ifdef __APPLE__
   #define MSG_FORK_ON_APPLE                                                    \
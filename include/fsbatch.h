@@ -0,0 +1,67 @@
+/*
+   american fuzzy lop++ - forkserver batch header
+   ----------------------------------------------
+
+   Originally written by Michal Zalewski
+
+   Forkserver design by Jann Horn <jannhorn@googlemail.com>
+
+   Now maintained by Marc Heuse <mh@mh-sec.de>,
+                     Heiko Eißfeldt <heiko.eissfeldt@hexco.de>,
+                     Andrea Fioraldi <andreafioraldi@gmail.com>,
+                     Dominik Maier <mail@dmnk.co>
+
+   Copyright 2016, 2017 Google Inc. All rights reserved.
+   Copyright 2019-2024 AFLplusplus Project. All rights reserved.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at:
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+   Layout of the shared memory used by the FS_OPT_BATCH forkserver
+   extension, shared between afl-fuzz and the persistent mode runtime.
+
+   afl-fuzz writes the first testcase of a batch to the shared memory
+   testcase as usual and the others to data[]. The target runs them back to
+   back within one go/status round trip: after each testcase but the last it
+   appends the non-zero 32 bit words of the coverage map to delta[], clears
+   them, records its run time, sets done and copies the next testcase in.
+   The status afl-fuzz gets belongs to testcase done, whose coverage is
+   still in the map. The target ends a batch early when delta[] could not
+   take two more full maps.
+
+   With the dirty line map (FS_OPT_DIRTYLINES) the target only looks at the
+   lines flagged and resets their flags as it clears them, so that the ones
+   left flagged are those of testcase done.
+
+ */
+
+#ifndef _AFL_FSBATCH_H
+#define _AFL_FSBATCH_H
+
+#include "config.h"
+#include "types.h"
+
+struct fs_batch_delta {
+  u32 idx;                                /* word index into the map    */
+  u32 val;                                /* the word's value           */
+
+};
+
+struct fs_batch {
+  u32 count;                              /* testcases, 0 = no batch    */
+  u32 done;                               /* testcases finished         */
+  u32 deltas;                             /* entries used in delta[]    */
+  u32 off[FS_BATCH_MAX];                  /* testcase offsets in data[] */
+  u32 len[FS_BATCH_MAX];                  /* testcase lengths           */
+  u32 delta_end[FS_BATCH_MAX];            /* end of each one's deltas   */
+  u32 us[FS_BATCH_MAX];                   /* run time of each one       */
+  struct fs_batch_delta delta[FS_BATCH_DELTAS];
+  u8                    data[FS_BATCH_DATA];
+
+};
+
+#endif
+
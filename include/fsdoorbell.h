@@ -0,0 +1,189 @@
+/*
+   american fuzzy lop++ - forkserver doorbell header
+   -------------------------------------------------
+
+   Originally written by Michal Zalewski
+
+   Forkserver design by Jann Horn <jannhorn@googlemail.com>
+
+   Now maintained by Marc Heuse <mh@mh-sec.de>,
+                     Heiko Eißfeldt <heiko.eissfeldt@hexco.de>,
+                     Andrea Fioraldi <andreafioraldi@gmail.com>,
+                     Dominik Maier <mail@dmnk.co>
+
+   Copyright 2016, 2017 Google Inc. All rights reserved.
+   Copyright 2019-2024 AFLplusplus Project. All rights reserved.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at:
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+   Shared memory control channel for the forkserver (Linux only), used
+   instead of the pipes once the handshake is done.
+
+   afl-fuzz passes a memfd in DOORBELL_ENV_VAR. A runtime that supports it
+   sets magic before sending its hello, and afl-fuzz sets accepted before
+   its reply to the options, after which both sides switch over. For every
+   run afl-fuzz stores was_killed and rings go, the forkserver then stores
+   pid and rings st, and later status and rings st again. A bell is a
+   counter that is bumped, the other side spins on it for a bit and then
+   sleeps on it as a futex; the sleeping flag tells whether a wakeup call
+   is needed.
+
+   With AFL_PIPELINE afl-fuzz also passes a struct fs_pipe in
+   SHM_PIPE_ENV_VAR, two testcase slots each followed by a coverage map, so
+   it can write and later process one testcase while the target runs the
+   other. A runtime that maps it sets pipeline. Every run then reads slot: 0
+   runs the shared memory testcase on the main map as usual, 1 + n the
+   testcase of slot n on the map of slot n. Either way the target copies the
+   testcase to a private buffer and never writes to the shared memory
+   testcase.
+
+   A persistent mode target stores its __AFL_LOOP() count as loop_max when a
+   child enters the loop, and after every run how many iterations the child
+   has finished as loop_iter. If afl-fuzz sets loop_cnt, children leave the
+   loop after that many iterations instead (AFL_PERSISTENT_TUNE).
+
+   A code coverage target that filters with AFL_PC_FILTER_FILE sets filter.
+   afl-fuzz then sets FS_RUN_FILTER in was_killed when the file changed, and
+   the forkserver applies the new file to the children it forks from then on,
+   over the pipes as well as over the doorbell.
+
+   With AFL_PC_FILTER_FOCUS the filters do not disable coverage, the target
+   instead gives the guards they select the map indices from focus_start to
+   before focus_end, which afl-fuzz then prefers in its scheduling.
+
+   With AFL_FSRV_LATENCY afl-fuzz sets timing and clears the timestamps
+   before it rings go. The forkserver then stores when it woke up (t_go),
+   when the child was forked or resumed (t_forked, resumed is set for a
+   SIGCONT) and when waitpid() returned (t_exited), in CLOCK_MONOTONIC ns.
+
+   With AFL_MAP_SIZE_MAX the coverage map is map_cap bytes large, of which
+   afl-fuzz at first only looks at the size the target announced. A child
+   that loads an instrumented library afterwards numbers its guards behind
+   the others as long as they fit and stores the size it now needs as
+   map_grow, afl-fuzz then grows its maps after the run.
+
+   A target whose modules all have AFL_LLVM_BUCKETED_COUNTS sets buckets, and
+   afl-fuzz then takes the map as classified. Either side clears it when the
+   map is to get hit counts again: a child that loads a module without the
+   buckets, or afl-fuzz for a forkserver that has to agree with the others.
+   The forkserver checks it before every fork, afl-fuzz after every run.
+
+ */
+
+#ifndef _AFL_FSDOORBELL_H
+#define _AFL_FSDOORBELL_H
+
+#include "config.h"
+#include "types.h"
+
+#define FS_DOORBELL_MAGIC 0x41464c44
+
+struct fs_doorbell {
+  u32 magic;                              /* set by the target          */
+  u32 accepted;                           /* set by afl-fuzz            */
+  u32 go, go_sleeping;                    /* afl-fuzz -> forkserver     */
+  u32 st, st_sleeping;                    /* forkserver -> afl-fuzz     */
+  u32 was_killed;
+  s32 pid;
+  s32 status;
+  u32 pipeline;                           /* set by the target          */
+  u32 slot;                               /* set by afl-fuzz            */
+  u32 loop_max;                           /* set by the target          */
+  u32 loop_iter;                          /* set by the target          */
+  u32 loop_cnt;                           /* set by afl-fuzz            */
+  u32 filter;                             /* set by the target          */
+  u32 focus_start, focus_end;             /* set by the target          */
+  u32 timing;                             /* set by afl-fuzz            */
+  u32 resumed;                            /* set by the target          */
+  u64 t_go, t_forked, t_exited;           /* set by the target          */
+  u32 map_cap;                            /* set by afl-fuzz            */
+  u32 map_grow;                           /* set by the target          */
+  u32 buckets;                            /* set by the target          */
+};
+
+struct fs_pipe {
+  u32 map_size;                           /* of each of the two maps    */
+  u32 len[2];
+  u8  data[2][MAX_FILE];
+} __attribute__((aligned(64)));
+
+/* The coverage map of a slot, after the testcases. */
+
+#define FS_PIPE_MAP(p, n) \
+  ((u8 *)(p) + sizeof(struct fs_pipe) + (size_t)(n) * (p)->map_size)
+#define FS_PIPE_SIZE(map_size) (sizeof(struct fs_pipe) + 2 * (size_t)(map_size))
+
+#ifdef __linux__
+
+  #include <errno.h>
+  #include <time.h>
+  #include <unistd.h>
+  #include <linux/futex.h>
+  #include <sys/syscall.h>
+
+static inline u64 fs_doorbell_now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline u64 fs_doorbell_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void fs_doorbell_ring(u32 *bell, u32 *sleeping) {
+  __atomic_add_fetch(bell, 1, __ATOMIC_SEQ_CST);
+
+  if (__atomic_load_n(sleeping, __ATOMIC_SEQ_CST)) {
+    syscall(SYS_futex, bell, FUTEX_WAKE, 1, NULL, NULL, 0);
+  }
+}
+
+/* Wait until the bell is no longer at old, spinning spin times first and
+   then sleeping until deadline_us (CLOCK_MONOTONIC, 0 = no limit). Returns
+   1 once it rang and 0 on timeout or signal. */
+
+static inline u32 fs_doorbell_wait(u32 *bell, u32 *sleeping, u32 old,
+                                   u32 spin, u64 deadline_us) {
+  struct timespec ts, *tsp = NULL;
+  u32             ret = 1;
+
+  while (spin--) {
+    if (__atomic_load_n(bell, __ATOMIC_ACQUIRE) != old) { return 1; }
+  #if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+  #endif
+  }
+
+  if (deadline_us) {
+    ts.tv_sec = deadline_us / 1000000;
+    ts.tv_nsec = (deadline_us % 1000000) * 1000;
+    tsp = &ts;
+  }
+
+  __atomic_store_n(sleeping, 1, __ATOMIC_SEQ_CST);
+
+  while (__atomic_load_n(bell, __ATOMIC_SEQ_CST) == old) {
+    /* FUTEX_WAIT_BITSET takes an absolute CLOCK_MONOTONIC timeout */
+    if (syscall(SYS_futex, bell, FUTEX_WAIT_BITSET, old, tsp, NULL,
+                FUTEX_BITSET_MATCH_ANY) < 0 &&
+        errno != EAGAIN) {
+      ret = __atomic_load_n(bell, __ATOMIC_SEQ_CST) != old;
+      break;
+    }
+  }
+
+  __atomic_store_n(sleeping, 0, __ATOMIC_SEQ_CST);
+  return ret;
+}
+
+#endif
+
+#endif
+
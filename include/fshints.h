@@ -0,0 +1,65 @@
+/*
+   american fuzzy lop++ - field hints header
+   -----------------------------------------
+
+   Originally written by Michal Zalewski
+
+   Now maintained by Marc Heuse <mh@mh-sec.de>,
+                     Heiko Eißfeldt <heiko.eissfeldt@hexco.de>,
+                     Andrea Fioraldi <andreafioraldi@gmail.com>,
+                     Dominik Maier <mail@dmnk.co>
+
+   Copyright 2016, 2017 Google Inc. All rights reserved.
+   Copyright 2019-2024 AFLplusplus Project. All rights reserved.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at:
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+   Layout of the shared memory for field hints (AFL_FIELD_HINTS), shared
+   between afl-fuzz and the runtime.
+
+   A harness calls __AFL_HINT_FIELD(offset, len, TYPE) for the fields it
+   parses out of the testcase. afl-fuzz sets on for one run of a queue
+   entry, and while it is set the runtime appends every hint to hint[].
+   cnt keeps counting past FS_HINTS_MAX, the hints after that are lost.
+   With on clear a hint costs the target one load and a branch.
+
+ */
+
+#ifndef _AFL_FSHINTS_H
+#define _AFL_FSHINTS_H
+
+#include "config.h"
+#include "types.h"
+
+/* The field types, the TYPE of __AFL_HINT_FIELD() without the prefix. */
+
+#define FS_HINT_BLOB 0   /* opaque bytes                     */
+#define FS_HINT_INT 1    /* little endian integer            */
+#define FS_HINT_INT_BE 2 /* big endian integer               */
+#define FS_HINT_LEN 3    /* little endian length field       */
+#define FS_HINT_LEN_BE 4 /* big endian length field          */
+#define FS_HINT_MAGIC 5  /* must stay as it is               */
+#define FS_HINT_CKSUM 6  /* checksum over other fields       */
+#define FS_HINT_TEXT 7   /* printable text                   */
+#define FS_HINT_TYPES 8
+
+struct fs_hint {
+  u32 off;                                /* offset into the testcase   */
+  u32 len;                                /* field length               */
+  u32 type;                               /* FS_HINT_*                  */
+
+};
+
+struct fs_hints {
+  u32            on;                      /* record hints of this run   */
+  u32            cnt;                     /* hints the run gave         */
+  struct fs_hint hint[FS_HINTS_MAX];
+
+};
+
+#endif
+
@@ -0,0 +1,335 @@
+/*
+   american fuzzy lop++ - Intel PT trace decoder
+   ---------------------------------------------
+
+   Originally written by Michal Zalewski
+
+   Forkserver design by Jann Horn <jannhorn@googlemail.com>
+
+   Now maintained by Marc Heuse <mh@mh-sec.de>,
+                     Heiko Eißfeldt <heiko.eissfeldt@hexco.de>,
+                     Andrea Fioraldi <andreafioraldi@gmail.com>,
+                     Dominik Maier <mail@dmnk.co>
+
+   Copyright 2016, 2017 Google Inc. All rights reserved.
+   Copyright 2019-2024 AFLplusplus Project. All rights reserved.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at:
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+   Turns the Intel PT packets of a run (AFL_INTEL_PT) into the usual coverage
+   map, without the binary at hand: there is no disassembly, so the packets
+   stand in for the branches.
+
+   A TIP packet (the target of an indirect branch, call, far transfer or
+   uncompressed return) starts a new block, and the edge into it, hashed
+   from where we were and the new IP, is counted. Every TNT bit (a
+   conditional branch or compressed return, taken or not) counts the block
+   we are in as told apart by the last TIP target and the last
+   INTEL_PT_HISTORY TNT bits since then, so a loop saturates into one
+   counter instead of a new one for each iteration.
+
+   All state is reset at each PSB packet. That loses the edges across them,
+   but a chunk of the trace that starts at a PSB decodes the same on its
+   own as within the whole trace, so traces can be split at PSBs and the
+   chunks decoded in parallel.
+
+ */
+
+#ifndef _AFL_FSIPT_H
+#define _AFL_FSIPT_H
+
+#include <string.h>
+
+#include "config.h"
+#include "types.h"
+
+#define IPT_PSB_LEN 16
+
+static const u8 ipt_psb[IPT_PSB_LEN] = {0x02, 0x82, 0x02, 0x82, 0x02, 0x82,
+                                        0x02, 0x82, 0x02, 0x82, 0x02, 0x82,
+                                        0x02, 0x82, 0x02, 0x82};
+
+struct ipt_decoder {
+  u8 *map;
+  u32 map_size;
+  u32 ctx;                                /* hash of the last TIP target */
+  u32 hist;                               /* recent TNT bits, marker bit */
+  u64 last_ip;                            /* for IP compression          */
+
+};
+
+static inline u32 ipt_mix(u64 x) {
+  return (u32)((x * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+static inline void ipt_hit(struct ipt_decoder *d, u32 h) {
+  u8 *c = &d->map[((u64)h * d->map_size) >> 32];
+
+  if (*c != 255) { ++*c; }
+}
+
+static inline u32 ipt_block(struct ipt_decoder *d) {
+  return ipt_mix(((u64)d->hist << 32) | d->ctx);
+}
+
+static inline void ipt_reset(struct ipt_decoder *d) {
+  d->ctx = 0;
+  d->hist = 1;
+  d->last_ip = 0;
+}
+
+/* The n TNT bits in the low bits of tnt, the oldest one the highest. */
+
+static inline void ipt_tnt(struct ipt_decoder *d, u64 tnt, u32 n) {
+  while (n--) {
+    d->hist = (d->hist << 1) | ((tnt >> n) & 1);
+
+    if (d->hist >> (INTEL_PT_HISTORY + 1)) {
+      d->hist = (d->hist & ((1U << INTEL_PT_HISTORY) - 1)) |
+                (1U << INTEL_PT_HISTORY);
+    }
+
+    ipt_hit(d, ipt_block(d));
+  }
+}
+
+/* The first PSB at or after p, or end. */
+
+static inline u8 *ipt_next_psb(u8 *p, u8 *end) {
+  while (p + IPT_PSB_LEN <= end) {
+    p = memchr(p, 0x02, end - p - IPT_PSB_LEN + 1);
+    if (!p) { break; }
+    if (!memcmp(p, ipt_psb, IPT_PSB_LEN)) { return p; }
+    ++p;
+  }
+
+  return end;
+}
+
+/* Length of a packet with a 0x02 header byte, 0 if unknown. */
+
+static inline u32 ipt_ext_len(u8 b) {
+  if ((b & 0x1f) == 0x12) { return b & 0x60 ? 10 : 6; }  /* PTW */
+
+  switch (b) {
+    case 0x23:                                            /* PSBEND */
+    case 0xf3:                                            /* OVF */
+    case 0x83:                                            /* TraceStop */
+    case 0x62:
+    case 0xe2:                                            /* EXSTOP */
+    case 0x33:
+    case 0xb3:                                            /* BEP */
+      return 2;
+    case 0x63:                                            /* BBP */
+      return 3;
+    case 0x03:                                            /* CBR */
+    case 0x22:                                            /* PWRE */
+    case 0x13:                                            /* CFE */
+      return 4;
+    case 0x73:                                            /* TMA */
+    case 0xc8:                                            /* VMCS */
+    case 0xa2:                                            /* PWRX */
+      return 7;
+    case 0x43:                                            /* PIP */
+    case 0xa3:                                            /* LTNT */
+      return 8;
+    case 0xc2:                                            /* MWAIT */
+      return 10;
+    case 0xc3:                                            /* MNT */
+    case 0x53:                                            /* EVD */
+      return 11;
+    case 0x82:                                            /* PSB */
+      return IPT_PSB_LEN;
+    default:
+      return 0;
+  }
+}
+
+/* Decode [p, end) into d->map. Unknown or cut off packets skip ahead to the
+   next PSB. */
+
+static inline void ipt_decode(struct ipt_decoder *d, u8 *p, u8 *end) {
+  u8 *next;
+  u64 ip;
+  u32 len, n;
+  u8  b, in_psb = 0;
+
+  ipt_reset(d);
+
+  while (p < end) {
+    b = *p;
+
+    if (!b) {                                             /* PAD */
+      ++p;
+      continue;
+    }
+
+    if (!(b & 1) && b != 0x02) {                          /* short TNT */
+      n = 31 - __builtin_clz(b >> 1);
+      ipt_tnt(d, b >> 1, n);
+      ++p;
+      continue;
+    }
+
+    if (b == 0x02) {
+      if (p + 2 > end) { break; }
+      len = ipt_ext_len(p[1]);
+      if (!len) { goto resync; }
+      if (p + len > end) { break; }
+
+      switch (p[1]) {
+        case 0x82:
+          if (memcmp(p, ipt_psb, IPT_PSB_LEN)) { goto resync; }
+          ipt_reset(d);
+          in_psb = 1;
+          break;
+
+        case 0x23:
+          in_psb = 0;
+          break;
+
+        case 0xf3:                 /* packets were lost, start over at the
+                                      next IP we are told about */
+          d->ctx = 0;
+          d->hist = 1;
+          break;
+
+        case 0xa3: {
+          u64 tnt = 0;
+          memcpy(&tnt, p + 2, 6);
+          if (tnt) { ipt_tnt(d, tnt, 63 - __builtin_clzll(tnt)); }
+          break;
+        }
+
+        default:
+          break;
+      }
+
+      p += len;
+      continue;
+    }
+
+    if ((b & 0x1f) == 0x19) {
+      if (b == 0x19) {
+        len = 8;                                          /* TSC */
+      } else if (b == 0x59 || b == 0x99) {
+        len = 2;                                          /* MTC, MODE */
+      } else {
+        goto resync;
+      }
+
+      if (p + len > end) { break; }
+      p += len;
+      continue;
+    }
+
+    if ((b & 3) == 3) {                                   /* CYC */
+      next = p + 1;
+      if (b & 4) {
+        while (next < end && (*next & 1)) {
+          ++next;
+        }
+
+        ++next;
+      }
+
+      p = next;
+      continue;
+    }
+
+    switch (b & 0x1f) {
+      case 0x0d:                                          /* TIP */
+      case 0x11:                                          /* TIP.PGE */
+      case 0x01:                                          /* TIP.PGD */
+      case 0x1d:                                          /* FUP */
+        break;
+
+      default:
+        goto resync;
+    }
+
+    /* the IP packets: the payload replaces the low bytes of the last IP */
+
+    switch (b >> 5) {
+      case 0:
+        len = 0;
+        break;
+      case 1:
+        len = 2;
+        break;
+      case 2:
+        len = 4;
+        break;
+      case 3:
+      case 4:
+        len = 6;
+        break;
+      case 6:
+        len = 8;
+        break;
+      default:
+        goto resync;
+    }
+
+    if (p + 1 + len > end) { break; }
+
+    if (!len) {                            /* IP suppressed, e.g. leaving
+                                              the traced ranges */
+      p += 1;
+      continue;
+    }
+
+    ip = 0;
+    memcpy(&ip, p + 1, len);
+
+    if ((b >> 5) == 3) {
+      if (ip & (1ULL << 47)) { ip |= 0xffff000000000000ULL; }
+
+    } else if (len < 8) {
+      ip |= d->last_ip & ~((1ULL << (len * 8)) - 1);
+    }
+
+    d->last_ip = ip;
+    p += 1 + len;
+
+    switch (b & 0x1f) {
+      case 0x0d: {
+        u32 cur = ipt_mix(ip);
+        ipt_hit(d, ipt_block(d) ^ (cur >> 1));
+        d->ctx = cur;
+        d->hist = 1;
+        break;
+      }
+
+      case 0x11:
+        d->ctx = ipt_mix(ip);
+        d->hist = 1;
+        ipt_hit(d, d->ctx);
+        break;
+
+      case 0x1d:
+        /* the IP at a PSB, or where an interrupt or exception hit */
+        if (in_psb) {
+          d->ctx = ipt_mix(ip);
+          d->hist = 1;
+        }
+
+        break;
+
+      default:
+        break;
+    }
+
+    continue;
+
+  resync:
+    p = ipt_next_psb(p + 1, end);
+  }
+}
+
+#endif
+
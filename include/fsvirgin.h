@@ -0,0 +1,53 @@
+/*
+   american fuzzy lop++ - target novelty header
+   --------------------------------------------
+
+   Originally written by Michal Zalewski
+
+   Now maintained by Marc Heuse <mh@mh-sec.de>,
+                     Heiko Eißfeldt <heiko.eissfeldt@hexco.de>,
+                     Andrea Fioraldi <andreafioraldi@gmail.com>,
+                     Dominik Maier <mail@dmnk.co>
+
+   Copyright 2016, 2017 Google Inc. All rights reserved.
+   Copyright 2019-2024 AFLplusplus Project. All rights reserved.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at:
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+   Layout of the shared memory for AFL_TARGET_NOVELTY, shared between
+   afl-fuzz and the persistent mode runtime.
+
+   afl-fuzz keeps a copy of its virgin_bits in map[] and refreshes it when a
+   run found something new. It clears verdict before each run. At the end of
+   a persistent loop iteration the runtime compares the classified coverage
+   map with the copy, the way has_new_bits() does, and sets the verdict.
+   afl-fuzz only trusts FS_VIRGIN_BORING, so a target that stopped early, or
+   that does not know about this, costs the usual check. As the virgin map
+   only loses bits, a stale copy can only make the target answer
+   FS_VIRGIN_NEW more often.
+
+ */
+
+#ifndef _AFL_FSVIRGIN_H
+#define _AFL_FSVIRGIN_H
+
+#include "types.h"
+
+#define FS_VIRGIN_UNKNOWN 0 /* no verdict for this run          */
+#define FS_VIRGIN_BORING 1  /* nothing that is not in map[]     */
+#define FS_VIRGIN_NEW 2     /* new bits, or could not tell      */
+
+struct fs_virgin {
+  u32 size;                               /* bytes map[] can hold       */
+  u32 map_size;                           /* bytes of map[] valid       */
+  u32 verdict;                            /* FS_VIRGIN_* of the last run */
+  u32 pad;
+  u8  map[];                              /* copy of virgin_bits        */
+
+};
+
+#endif
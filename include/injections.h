@@ -0,0 +1,83 @@
+/*
+   american fuzzy lop++ - injection markers header
+   -----------------------------------------------
+
+   Originally written by Michal Zalewski
+
+   Now maintained by Marc Heuse <mh@mh-sec.de>,
+                     Heiko Eißfeldt <heiko.eissfeldt@hexco.de>,
+                     Andrea Fioraldi <andreafioraldi@gmail.com>,
+                     Dominik Maier <mail@dmnk.co>
+
+   Copyright 2016, 2017 Google Inc. All rights reserved.
+   Copyright 2019-2024 AFLplusplus Project. All rights reserved.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at:
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+   The markers of the injection detection (AFL_LLVM_INJECTIONS_*), shared
+   between afl-fuzz, which adds them to its dictionary, and the hooks in
+   the runtime, which abort when a string passed to an instrumented
+   function contains one of them unescaped.
+
+   A hook only looks for the markers of its own table. injection_find()
+   leaves the scan to strstr(), which the C libraries vectorize and select
+   for the CPU at load time; on glibc with AVX2 or AVX-512 that is several
+   times faster than a portable SSE2 scan for strings longer than a few
+   dozen bytes.
+
+ */
+
+#ifndef _AFL_INJECTIONS_H
+#define _AFL_INJECTIONS_H
+
+#include <string.h>
+#include "types.h"
+
+struct injection_marker {
+  const char *str;
+  u32         len;
+};
+
+#define INJECTION_MARKER(s) \
+  { s, sizeof(s) - 1 }
+
+#define INJECTION_CNT(tab) (sizeof(tab) / sizeof(tab[0]))
+
+// Marker: ADD_TO_INJECTIONS
+
+static const struct injection_marker injection_sql[] = {
+
+    INJECTION_MARKER("'\"\"'")
+
+};
+
+static const struct injection_marker injection_ldap[] = {
+
+    INJECTION_MARKER("*)(1=*))(|")
+
+};
+
+static const struct injection_marker injection_xss[] = {
+
+    INJECTION_MARKER("1\"><\"")
+
+};
+
+/* Returns whether the zero terminated s contains a marker of tab. */
+
+static inline u8 injection_find(const u8 *s, const struct injection_marker *tab,
+                                u32 cnt) {
+  u32 i;
+
+  for (i = 0; i < cnt; ++i) {
+    if (strstr((const char *)s, tab[i].str)) { return 1; }
+  }
+
+  return 0;
+}
+
+#endif
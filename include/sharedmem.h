@@ -30,6 +30,11 @@
 
 #include "types.h"
 
+/* The directory in the output directory of afl-fuzz with the records of its
+   shared memory segments, see afl_shm_init(). */
+
+#define SHM_KEEP_DIR ".shm"
+
 typedef struct sharedmem {
   // extern unsigned char *trace_bits;
 
@@ -39,10 +44,13 @@ typedef struct sharedmem {
   char g_shm_file_path[L_tmpnam];
   int  cmplog_g_shm_fd;
   char cmplog_g_shm_file_path[L_tmpnam];
+  int  dirty_g_shm_fd;
+  char dirty_g_shm_file_path[L_tmpnam];
 /* ========================================= */
 #else
   s32 shm_id; /* ID of the SHM region              */
   s32 cmplog_shm_id;
+  s32 dirty_shm_id;
 #endif
 
   u8 *map; /* shared memory region */
@@ -51,11 +59,25 @@ typedef struct sharedmem {
 
   int             cmplog_mode;
   int             shmemfuzz_mode;
+  int             batch_mode; /* testcase batches (FS_OPT_BATCH) */
+  int             pipe_mode;  /* pipelined runs (AFL_PIPELINE)   */
+  int             hints_mode; /* field hints (AFL_FIELD_HINTS)   */
+  int             virgin_mode; /* virgin map copy (AFL_TARGET_NOVELTY) */
   struct cmp_map *cmp_map;
 
+  int    dirty_mode; /* also create a dirty line map    */
+  u8    *dirty_map;  /* one byte per map cache line     */
+  size_t dirty_size; /* allocated size of dirty_map     */
+
+  int huge_mode; /* try huge pages for map, cmp_map  */
+  int huge_maps; /* how many of them got hugetlb     */
+
+  u8 *keep_fn; /* record of the segments, or NULL  */
+
 } sharedmem_t;
 
 u8  *afl_shm_init(sharedmem_t *, size_t, unsigned char non_instrumented_mode);
 void afl_shm_deinit(sharedmem_t *);
+u32  afl_shm_reclaim(u8 *dir, u64 *bytes);
 
 #endif
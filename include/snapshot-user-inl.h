@@ -0,0 +1,610 @@
+/*
+   american fuzzy lop++ - userspace snapshot routines
+   --------------------------------------------------
+
+   Originally written by Michal Zalewski
+
+   Forkserver design by Jann Horn <jannhorn@googlemail.com>
+
+   Now maintained by Marc Heuse <mh@mh-sec.de>,
+                     Heiko Eißfeldt <heiko.eissfeldt@hexco.de>,
+                     Andrea Fioraldi <andreafioraldi@gmail.com>,
+                     Dominik Maier <mail@dmnk.co>
+
+   Copyright 2016, 2017 Google Inc. All rights reserved.
+   Copyright 2019-2024 AFLplusplus Project. All rights reserved.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at:
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+   Snapshots of the forkserver child without the snapshot LKM
+   (AFL_USERSPACE_SNAPSHOT, Linux with glibc).
+
+   afl_usnap_take() saves the registers and a copy of all private writable
+   mappings, and write protects them with an asynchronous userfaultfd (Linux
+   6.7+), which makes the kernel note written pages instead of delivering
+   faults. When the target then calls exit(0), the pages written since (as
+   found by the PAGEMAP_SCAN ioctl) are copied back, brk is reset, mappings and file descriptors that were not
+   there are dropped and the file offsets restored, then the child stops
+   itself like a persistent mode target. The next run starts over at the
+   snapshot. Whenever that cannot be undone (threads, a saved mapping went
+   away or changed, a saved fd was closed), or on exit with another status,
+   the exit just goes through and the forkserver forks a new child.
+
+   This all runs on a stack of its own in a shared mapping, which the
+   snapshot does not cover.
+
+ */
+
+#ifndef _AFL_SNAPSHOT_USER_INL_H
+#define _AFL_SNAPSHOT_USER_INL_H
+
+#include <fcntl.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#include <linux/userfaultfd.h>
+
+#include "types.h"
+
+/* From linux/fs.h and linux/userfaultfd.h of Linux 6.7, for older headers */
+
+#ifndef PAGEMAP_SCAN
+struct page_region {
+  u64 start, end, categories;
+};
+
+struct pm_scan_arg {
+  u64 size, flags, start, end, walk_end, vec, vec_len, max_pages;
+  u64 category_inverted, category_mask, category_anyof_mask, return_mask;
+};
+
+  #define PAGEMAP_SCAN _IOWR('f', 16, struct pm_scan_arg)
+  #define PM_SCAN_CHECK_WPASYNC (1 << 1)
+  #define PAGE_IS_WPALLOWED (1 << 0)
+  #define PAGE_IS_WRITTEN (1 << 1)
+#endif
+
+#ifndef UFFD_FEATURE_WP_ASYNC
+  #define UFFD_FEATURE_WP_UNPOPULATED (1 << 13)
+  #define UFFD_FEATURE_WP_ASYNC (1 << 15)
+#endif
+
+#define AFL_USNAP_UFFD_FEATURES \
+  (UFFD_FEATURE_WP_ASYNC | UFFD_FEATURE_WP_UNPOPULATED)
+
+#define AFL_USNAP_RANGES 4096
+#define AFL_USNAP_FDS 1024
+#define AFL_USNAP_REGIONS 4096
+#define AFL_USNAP_MAPS (1024 * 1024)
+#define AFL_USNAP_STACK (256 * 1024)
+
+struct afl_usnap_range {
+  uintptr_t start, end;
+  u8       *copy;                       /* saved pages if writable    */
+};
+
+struct afl_usnap {
+  sigjmp_buf env;                       /* the snapshot registers     */
+  ucontext_t exit_ctx, restore_ctx;
+
+  s32       pagemap_fd, uffd;
+  uintptr_t page_size, brk;
+
+  u8    *copy;                          /* all saved pages            */
+  size_t copy_size;
+
+  u32                    ranges_cnt;
+  struct afl_usnap_range ranges[AFL_USNAP_RANGES];
+
+  u32   fds_cnt;
+  s32   fds[AFL_USNAP_FDS];
+  off_t fds_off[AFL_USNAP_FDS];         /* -1 if not seekable         */
+  u8    fds_seen[AFL_USNAP_FDS];
+
+  struct page_region regions[AFL_USNAP_REGIONS];
+  char               buf[AFL_USNAP_MAPS];   /* maps, fds, stat      */
+  u8 stack[AFL_USNAP_STACK] __attribute__((aligned(16)));
+};
+
+static struct afl_usnap *afl_usnap;
+
+struct afl_usnap_dirent {
+  u64            d_ino;
+  s64            d_off;
+  unsigned short d_reclen;
+  unsigned char  d_type;
+  char           d_name[];
+};
+
+/* Read a whole /proc file into u->buf, returns its length or -1. */
+
+static ssize_t afl_usnap_read(const char *path) {
+  ssize_t len = 0, r;
+  s32     fd = open(path, O_RDONLY | O_CLOEXEC);
+
+  if (fd < 0) { return -1; }
+
+  while ((r = read(fd, afl_usnap->buf + len, AFL_USNAP_MAPS - 1 - len)) > 0) {
+    len += r;
+  }
+
+  close(fd);
+  if (r < 0 || len >= AFL_USNAP_MAPS - 1) { return -1; }
+
+  afl_usnap->buf[len] = 0;
+  return len;
+}
+
+/* Parse the next line of /proc/self/maps, returns where the line after it
+   starts or NULL at the end. */
+
+static char *afl_usnap_maps_line(char *p, uintptr_t *start, uintptr_t *end,
+                                 u8 *writable, u8 *private) {
+  if (!*p) { return NULL; }
+
+  *start = strtoull(p, &p, 16);
+  *end = strtoull(p + 1, &p, 16);
+  *writable = p[1] == 'r' && p[2] == 'w';
+  *private = p[4] == 'p';
+
+  while (*p && *p != '\n') {
+    ++p;
+  }
+
+  return *p ? p + 1 : p;
+}
+
+/* Is this range (inside) one of our own mappings? */
+
+static inline u8 afl_usnap_ours(uintptr_t start, uintptr_t end) {
+  uintptr_t u = (uintptr_t)afl_usnap, c = (uintptr_t)afl_usnap->copy;
+
+  return (start < u + sizeof(struct afl_usnap) && end > u) ||
+         (c && start < c + afl_usnap->copy_size && end > c);
+}
+
+/* Is any saved range inside [start, end)? */
+
+static u8 afl_usnap_known(uintptr_t start, uintptr_t end) {
+  for (u32 i = 0; i < afl_usnap->ranges_cnt; ++i) {
+    if (afl_usnap->ranges[i].start < end && afl_usnap->ranges[i].end > start) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* The number of threads from /proc/self/stat, 0 on error. */
+
+static u32 afl_usnap_threads(void) {
+  char *p;
+  u32   i;
+
+  if (afl_usnap_read("/proc/self/stat") < 0 ||
+      !(p = strrchr(afl_usnap->buf, ')'))) {
+    return 0;
+  }
+
+  /* num_threads is the 20th field, the 18th after the command */
+  for (i = 0; i < 18 && p; ++i) {
+    p = strchr(p + 1, ' ');
+  }
+
+  return p ? (u32)strtoul(p + 1, NULL, 10) : 0;
+}
+
+/* Call fn on every open file descriptor but the one that lists them, stops
+   and returns 0 as soon as fn does. */
+
+static u8 afl_usnap_each_fd(u8 (*fn)(s32)) {
+  s32  dir = open("/proc/self/fd", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  long len, pos;
+  u8   ret = 1;
+
+  if (dir < 0) { return 0; }
+
+  while (ret && (len = syscall(SYS_getdents64, dir, afl_usnap->buf,
+                               AFL_USNAP_MAPS)) > 0) {
+    for (pos = 0; ret && pos < len;) {
+      struct afl_usnap_dirent *d =
+          (struct afl_usnap_dirent *)(afl_usnap->buf + pos);
+      pos += d->d_reclen;
+
+      if (d->d_name[0] >= '0' && d->d_name[0] <= '9') {
+        s32 fd = atoi(d->d_name);
+        if (fd != dir) { ret = fn(fd); }
+      }
+    }
+  }
+
+  close(dir);
+  return ret;
+}
+
+static u8 afl_usnap_save_fd(s32 fd) {
+  if (afl_usnap->fds_cnt == AFL_USNAP_FDS) { return 0; }
+
+  afl_usnap->fds[afl_usnap->fds_cnt] = fd;
+  afl_usnap->fds_off[afl_usnap->fds_cnt++] = lseek(fd, 0, SEEK_CUR);
+  return 1;
+}
+
+static u8 afl_usnap_saved_fd(s32 fd) {
+  for (u32 i = 0; i < afl_usnap->fds_cnt; ++i) {
+    if (afl_usnap->fds[i] == fd) { return 1; }
+  }
+
+  return 0;
+}
+
+static u8 afl_usnap_close_fd(s32 fd) {
+  if (!afl_usnap_saved_fd(fd)) { close(fd); }
+  return 1;
+}
+
+/* Are all saved fds still open? */
+
+static u8 afl_usnap_seen_fd(s32 fd) {
+  for (u32 i = 0; i < afl_usnap->fds_cnt; ++i) {
+    if (afl_usnap->fds[i] == fd) { afl_usnap->fds_seen[i] = 1; }
+  }
+
+  return 1;
+}
+
+static u8 afl_usnap_fds_open(void) {
+  memset(afl_usnap->fds_seen, 0, afl_usnap->fds_cnt);
+  if (!afl_usnap_each_fd(afl_usnap_seen_fd)) { return 0; }
+
+  for (u32 i = 0; i < afl_usnap->fds_cnt; ++i) {
+    if (!afl_usnap->fds_seen[i]) { return 0; }
+  }
+
+  return 1;
+}
+
+/* Find the pages of [start, end) in the given categories (or not in them, if
+   inverted), from *next on. Returns the number of regions found, -1 if part
+   of the range is not write protected by our userfaultfd, and sets *next to
+   where to continue, end when done. */
+
+static long afl_usnap_scan(uintptr_t *next, uintptr_t end, u64 categories,
+                           u8 inverted) {
+  struct pm_scan_arg arg;
+  long               ret;
+
+  memset(&arg, 0, sizeof(arg));
+  arg.size = sizeof(arg);
+  arg.flags = PM_SCAN_CHECK_WPASYNC;
+  arg.start = *next;
+  arg.end = end;
+  arg.vec = (uintptr_t)afl_usnap->regions;
+  arg.vec_len = AFL_USNAP_REGIONS;
+  arg.category_inverted = inverted ? categories : 0;
+  arg.category_mask = categories;
+  arg.return_mask = categories;
+
+  ret = ioctl(afl_usnap->pagemap_fd, PAGEMAP_SCAN, &arg);
+  *next = arg.walk_end;
+  return ret;
+}
+
+/* Write protect pages again, once they hold their snapshot contents. */
+
+static u8 afl_usnap_protect(uintptr_t start, uintptr_t end) {
+  struct uffdio_writeprotect wp = {
+
+      .range = {.start = start, .len = end - start},
+      .mode = UFFDIO_WRITEPROTECT_MODE_WP};
+
+  return !ioctl(afl_usnap->uffd, UFFDIO_WRITEPROTECT, &wp);
+}
+
+/* Is all of a saved writable range still write protected by us? */
+
+static u8 afl_usnap_tracked(struct afl_usnap_range *r) {
+  uintptr_t next = r->start;
+
+  while (next < r->end) {
+    if (afl_usnap_scan(&next, r->end, PAGE_IS_WPALLOWED, 1)) { return 0; }
+  }
+
+  return 1;
+}
+
+/* Copy back every page of a saved writable range that was written. */
+
+static u8 afl_usnap_restore_range(struct afl_usnap_range *r) {
+  uintptr_t next = r->start, start, end;
+  long      cnt, i;
+
+  while (next < r->end) {
+    if ((cnt = afl_usnap_scan(&next, r->end, PAGE_IS_WRITTEN, 0)) < 0) {
+      return 0;
+    }
+
+    for (i = 0; i < cnt; ++i) {
+      start = afl_usnap->regions[i].start;
+      end = afl_usnap->regions[i].end;
+      memcpy((void *)start, r->copy + (start - r->start), end - start);
+      if (!afl_usnap_protect(start, end)) { return 0; }
+    }
+  }
+
+  return 1;
+}
+
+/* Restart the target at the snapshot. Runs on our own stack, and goes back
+   to exit() if the snapshot cannot be restored. As everything after the
+   memory restore must not fail, all checks come first. */
+
+static void afl_usnap_restore(void) {
+  struct afl_usnap *u = afl_usnap;
+  uintptr_t         start, end, covered;
+  u8                writable, private;
+  char             *p;
+  u32               i;
+
+  if (afl_usnap_threads() != 1 || !afl_usnap_fds_open()) { goto no_restore; }
+
+  if ((uintptr_t)syscall(SYS_brk, u->brk) != u->brk) { goto no_restore; }
+
+  if (afl_usnap_read("/proc/self/maps") < 0) { goto no_restore; }
+
+  /* every saved writable range must still be there, writable and tracked */
+
+  for (i = 0; i < u->ranges_cnt; ++i) {
+    struct afl_usnap_range *r = &u->ranges[i];
+    if (!r->copy) { continue; }
+
+    covered = 0;
+    p = u->buf;
+    while ((p = afl_usnap_maps_line(p, &start, &end, &writable, &private))) {
+      if (writable && private && start < r->end && end > r->start) {
+        covered += MIN(end, r->end) - MAX(start, r->start);
+      }
+    }
+
+    if (covered != r->end - r->start || !afl_usnap_tracked(r)) {
+      goto no_restore;
+    }
+  }
+
+  /* from here on we do not go back: drop the new mappings and fds, copy the
+     pages back and start tracking anew */
+
+  p = u->buf;
+  while ((p = afl_usnap_maps_line(p, &start, &end, &writable, &private))) {
+    if (!afl_usnap_known(start, end) && !afl_usnap_ours(start, end)) {
+      munmap((void *)start, end - start);
+    }
+  }
+
+  afl_usnap_each_fd(afl_usnap_close_fd);
+
+  for (i = 0; i < u->fds_cnt; ++i) {
+    if (u->fds_off[i] >= 0) { lseek(u->fds[i], u->fds_off[i], SEEK_SET); }
+  }
+
+  for (i = 0; i < u->ranges_cnt; ++i) {
+    if (u->ranges[i].copy && !afl_usnap_restore_range(&u->ranges[i])) {
+      _exit(1);
+    }
+  }
+
+  /* tell the forkserver the run is done, like persistent mode does */
+
+  raise(SIGSTOP);
+  siglongjmp(u->env, 1);
+
+no_restore:
+  setcontext(&u->exit_ctx);
+}
+
+static void afl_usnap_on_exit(int status, void *arg) {
+  (void)arg;
+
+  /* comes back only if the snapshot could not be restored */
+  if (!status && afl_usnap) {
+    swapcontext(&afl_usnap->exit_ctx, &afl_usnap->restore_ctx);
+  }
+}
+
+/* Open a userfaultfd for asynchronous write protection, -1 if the kernel
+   cannot do that. */
+
+static s32 afl_usnap_uffd(void) {
+  struct uffdio_api api = {.api = UFFD_API,
+                           .features = AFL_USNAP_UFFD_FEATURES};
+  s32 uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK |
+                                          UFFD_USER_MODE_ONLY);
+
+  if (uffd < 0) { return -1; }
+
+  if (ioctl(uffd, UFFDIO_API, &api) ||
+      (api.features & AFL_USNAP_UFFD_FEATURES) != AFL_USNAP_UFFD_FEATURES) {
+    close(uffd);
+    return -1;
+  }
+
+  return uffd;
+}
+
+/* Start tracking writes to [start, end). */
+
+static u8 afl_usnap_register(s32 uffd, uintptr_t start, uintptr_t end) {
+  struct uffdio_register reg = {
+
+      .range = {.start = start, .len = end - start},
+      .mode = UFFDIO_REGISTER_MODE_WP};
+
+  return !ioctl(uffd, UFFDIO_REGISTER, &reg);
+}
+
+/* Can this kernel track written pages for us? Checked once in the
+   forkserver. */
+
+static u8 afl_usnap_supported(void) {
+  long page_size = sysconf(_SC_PAGESIZE);
+  s32  uffd = afl_usnap_uffd(), pagemap_fd = -1;
+  u8  *page = MAP_FAILED;
+  u8   ret = 0;
+
+  if (uffd >= 0) {
+    pagemap_fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    page = (u8 *)mmap(NULL, page_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  }
+
+  if (pagemap_fd >= 0 && page != MAP_FAILED &&
+      afl_usnap_register(uffd, (uintptr_t)page,
+                         (uintptr_t)page + page_size)) {
+    struct uffdio_writeprotect wp = {
+
+        .range = {.start = (uintptr_t)page, .len = page_size},
+        .mode = UFFDIO_WRITEPROTECT_MODE_WP};
+    struct page_region region;
+    struct pm_scan_arg arg = {.size = sizeof(arg),
+                              .flags = PM_SCAN_CHECK_WPASYNC,
+                              .start = (uintptr_t)page,
+                              .end = (uintptr_t)page + page_size,
+                              .vec = (uintptr_t)&region,
+                              .vec_len = 1,
+                              .category_mask = PAGE_IS_WRITTEN,
+                              .return_mask = PAGE_IS_WRITTEN};
+
+    if (!ioctl(uffd, UFFDIO_WRITEPROTECT, &wp)) {
+      page[0] = 1;
+      ret = ioctl(pagemap_fd, PAGEMAP_SCAN, &arg) == 1;
+    }
+  }
+
+  if (page != MAP_FAILED) { munmap(page, page_size); }
+  if (pagemap_fd >= 0) { close(pagemap_fd); }
+  if (uffd >= 0) { close(uffd); }
+
+  return ret;
+}
+
+/* Set up the snapshot state, save the mappings and fds and register the exit
+   hook; the pages themselves are copied by afl_usnap_take(). */
+
+static u8 afl_usnap_init(void) {
+  struct afl_usnap *u;
+  uintptr_t         start, end;
+  u8                writable, private;
+  char             *p;
+  u8               *copy;
+  u32               i;
+
+  u = (struct afl_usnap *)mmap(NULL, sizeof(struct afl_usnap),
+                               PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (u == MAP_FAILED) { return 0; }
+
+  afl_usnap = u;
+  u->page_size = sysconf(_SC_PAGESIZE);
+  u->pagemap_fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+  u->uffd = afl_usnap_uffd();
+
+  /* the exit hook goes into libc's memory, so it must be in the snapshot */
+  if (u->pagemap_fd < 0 || u->uffd < 0 || on_exit(afl_usnap_on_exit, NULL) ||
+      afl_usnap_read("/proc/self/maps") < 0) {
+    goto fail;
+  }
+
+  u->brk = (uintptr_t)syscall(SYS_brk, 0);
+
+  p = u->buf;
+  while ((p = afl_usnap_maps_line(p, &start, &end, &writable, &private))) {
+    if (afl_usnap_ours(start, end)) { continue; }
+    if (u->ranges_cnt == AFL_USNAP_RANGES) { goto fail; }
+
+    u->ranges[u->ranges_cnt].start = start;
+    u->ranges[u->ranges_cnt].end = end;
+    u->ranges[u->ranges_cnt].copy = (u8 *)(uintptr_t)(writable && private);
+    if (writable && private) { u->copy_size += end - start; }
+    ++u->ranges_cnt;
+  }
+
+  u->copy = (u8 *)mmap(NULL, u->copy_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (u->copy == MAP_FAILED) {
+    u->copy = NULL;
+    goto fail;
+  }
+
+  for (i = 0, copy = u->copy; i < u->ranges_cnt; ++i) {
+    if (u->ranges[i].copy) {
+      if (!afl_usnap_register(u->uffd, u->ranges[i].start, u->ranges[i].end)) {
+        goto fail;
+      }
+
+      u->ranges[i].copy = copy;
+      copy += u->ranges[i].end - u->ranges[i].start;
+    }
+  }
+
+  if (!afl_usnap_each_fd(afl_usnap_save_fd)) { goto fail; }
+
+  getcontext(&u->restore_ctx);
+  u->restore_ctx.uc_stack.ss_sp = u->stack;
+  u->restore_ctx.uc_stack.ss_size = AFL_USNAP_STACK;
+  u->restore_ctx.uc_link = NULL;
+  makecontext(&u->restore_ctx, afl_usnap_restore, 0);
+
+  return 1;
+
+fail:
+  /* without the state the exit hook just lets every exit through */
+  afl_usnap = NULL;
+  if (u->pagemap_fd >= 0) { close(u->pagemap_fd); }
+  if (u->uffd >= 0) { close(u->uffd); }
+  if (u->copy) { munmap(u->copy, u->copy_size); }
+  munmap(u, sizeof(struct afl_usnap));
+  return 0;
+}
+
+/* Take the snapshot in the forkserver child. Returns 0 when the snapshot was
+   taken or could not be, and 1 when the target was just restored to it. */
+
+static int afl_usnap_take(void) {
+  struct afl_usnap *u;
+  u32               i;
+
+  if (!afl_usnap_init()) { return 0; }
+
+  u = afl_usnap;
+  if (sigsetjmp(u->env, 1)) { return 1; }
+
+  /* the stack as it is now comes back at every restore */
+
+  for (i = 0; i < u->ranges_cnt; ++i) {
+    if (u->ranges[i].copy) {
+      memcpy(u->ranges[i].copy, (void *)u->ranges[i].start,
+             u->ranges[i].end - u->ranges[i].start);
+      if (!afl_usnap_protect(u->ranges[i].start, u->ranges[i].end)) {
+        afl_usnap = NULL;
+        return 0;
+      }
+    }
+  }
+
+  return 0;
+}
+
+#endif
+
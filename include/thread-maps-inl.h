@@ -0,0 +1,227 @@
+/*
+   american fuzzy lop++ - per thread coverage maps
+   -----------------------------------------------
+
+   Copyright 2019-2024 AFLplusplus Project. All rights reserved.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at:
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+   Thread maps for targets built with AFL_LLVM_THREAD_MAPS.
+
+   That instrumentation counts into __afl_thread_area_ptr where it is set and
+   into __afl_area_ptr otherwise. afl-cc links such targets with
+   --wrap=pthread_create,--wrap=pthread_exit, so every thread they start runs
+   with a map of its own that no other thread writes to. The maps are added
+   to __afl_area_ptr, saturating at 255, when the thread ends, at the
+   __AFL_LOOP() boundaries and when the target exits. The main thread and
+   threads started by libraries that were not linked this way count into the
+   shared map as with AFL_LLVM_THREADSAFE_INST.
+
+   Nothing here links against libpthread: without --wrap there are no
+   __real_ functions and the __wrap_ ones are never called.
+
+ */
+
+#ifndef _AFL_THREAD_MAPS_INL_H
+#define _AFL_THREAD_MAPS_INL_H
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "types.h"
+
+/* The thread maps cover the largest map the forkserver can announce, only
+   the pages that are written to get memory. */
+
+#define AFL_TMAP_SIZE FS_OPT_MAX_MAPSIZE
+
+struct afl_tmap {
+  u64             *map;
+  struct afl_tmap *next, **pprev;
+};
+
+struct afl_tmap_start {
+  void *(*fn)(void *);
+  void            *arg;
+  struct afl_tmap *tm;
+};
+
+__thread u8 *__afl_thread_area_ptr __attribute__((tls_model("initial-exec")));
+
+static __thread struct afl_tmap *afl_tmap_self;
+static struct afl_tmap          *afl_tmaps;
+static u8                        afl_tmaps_lock;
+
+extern int __afl_thread_maps_instrumented __attribute__((weak));
+
+int __real_pthread_create(pthread_t *, const pthread_attr_t *,
+                          void *(*)(void *), void *) __attribute__((weak));
+void __real_pthread_exit(void *) __attribute__((weak, noreturn));
+
+static void afl_tmaps_acquire(void) {
+  while (__atomic_test_and_set(&afl_tmaps_lock, __ATOMIC_ACQUIRE)) {}
+}
+
+static void afl_tmaps_release(void) {
+  __atomic_clear(&afl_tmaps_lock, __ATOMIC_RELEASE);
+}
+
+/* Move the counts of one thread map into the shared map. The owner keeps
+   counting, the exchange takes each word whole, so nothing gets lost. */
+
+static void afl_tmap_merge(struct afl_tmap *tm) {
+  u32 size = __afl_map_size < AFL_TMAP_SIZE ? __afl_map_size : AFL_TMAP_SIZE;
+  u32 i, j, words = (size + 7) >> 3;
+  u64 v;
+
+  for (i = 0; i < words; ++i) {
+    if (!__atomic_load_n(tm->map + i, __ATOMIC_RELAXED)) { continue; }
+
+    v = __atomic_exchange_n(tm->map + i, 0, __ATOMIC_RELAXED);
+
+    for (j = 0; v; ++j, v >>= 8) {
+      u8 *dst = __afl_area_ptr + (i << 3) + j;
+      u32 cnt = v & 0xff;
+      u8  old, new;
+
+      if (!cnt) { continue; }
+
+      old = __atomic_load_n(dst, __ATOMIC_RELAXED);
+
+      do {
+        new = old + cnt > 255 ? 255 : old + cnt;
+
+      } while (!__atomic_compare_exchange_n(dst, &old, new, 1, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED));
+    }
+  }
+}
+
+/* Called at the __AFL_LOOP() boundaries and on exit. */
+
+static void afl_tmaps_merge(void) {
+  struct afl_tmap *tm;
+
+  if (!__atomic_load_n(&afl_tmaps, __ATOMIC_RELAXED)) { return; }
+
+  afl_tmaps_acquire();
+  for (tm = afl_tmaps; tm; tm = tm->next) {
+    afl_tmap_merge(tm);
+  }
+
+  afl_tmaps_release();
+}
+
+__attribute__((destructor)) static void afl_tmaps_fini(void) {
+  afl_tmaps_merge();
+}
+
+static struct afl_tmap *afl_tmap_new(void) {
+  struct afl_tmap *tm;
+
+  if (!&__afl_thread_maps_instrumented || __afl_map_size > AFL_TMAP_SIZE) {
+    return NULL;
+  }
+
+  tm = calloc(1, sizeof(struct afl_tmap));
+  if (!tm) { return NULL; }
+
+  tm->map = mmap(NULL, AFL_TMAP_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+  if (tm->map == MAP_FAILED) {
+    free(tm);
+    return NULL;
+  }
+
+  /* known before the thread runs, so a loop boundary cannot miss it */
+
+  afl_tmaps_acquire();
+  tm->next = afl_tmaps;
+  tm->pprev = &afl_tmaps;
+  if (afl_tmaps) { afl_tmaps->pprev = &tm->next; }
+  afl_tmaps = tm;
+  afl_tmaps_release();
+
+  return tm;
+}
+
+static void afl_tmap_free(struct afl_tmap *tm) {
+  afl_tmaps_acquire();
+  afl_tmap_merge(tm);
+  *tm->pprev = tm->next;
+  if (tm->next) { tm->next->pprev = tm->pprev; }
+  afl_tmaps_release();
+
+  munmap(tm->map, AFL_TMAP_SIZE);
+  free(tm);
+}
+
+/* The thread is done; what it runs from now on, like TLS destructors,
+   counts into the shared map. */
+
+static void afl_tmap_done(void) {
+  struct afl_tmap *tm = afl_tmap_self;
+
+  if (!tm) { return; }
+
+  __afl_thread_area_ptr = NULL;
+  afl_tmap_self = NULL;
+  afl_tmap_free(tm);
+}
+
+static void *afl_tmap_run(void *arg) {
+  struct afl_tmap_start st = *(struct afl_tmap_start *)arg;
+  void                 *ret;
+
+  free(arg);
+
+  afl_tmap_self = st.tm;
+  __afl_thread_area_ptr = (u8 *)st.tm->map;
+
+  ret = st.fn(st.arg);
+
+  afl_tmap_done();
+  return ret;
+}
+
+int __wrap_pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+                          void *(*fn)(void *), void *arg) {
+  struct afl_tmap_start *st;
+  struct afl_tmap       *tm = afl_tmap_new();
+  int                    ret;
+
+  if (!tm) { return __real_pthread_create(thread, attr, fn, arg); }
+
+  st = malloc(sizeof(struct afl_tmap_start));
+
+  if (!st) {
+    afl_tmap_free(tm);
+    return __real_pthread_create(thread, attr, fn, arg);
+  }
+
+  st->fn = fn;
+  st->arg = arg;
+  st->tm = tm;
+
+  ret = __real_pthread_create(thread, attr, afl_tmap_run, st);
+
+  if (ret) {
+    free(st);
+    afl_tmap_free(tm);
+  }
+
+  return ret;
+}
+
+void __wrap_pthread_exit(void *ret) {
+  afl_tmap_done();
+  __real_pthread_exit(ret);
+}
+
+#endif
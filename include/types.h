@@ -56,6 +56,9 @@ typedef uint128_t         u128;
 #define FS_OPT_AUTODICT 0x10000000
 #define FS_OPT_SHDMEM_FUZZ 0x01000000
 #define FS_OPT_NEWCMPLOG 0x02000000
+#define FS_OPT_DIRTYLINES 0x04000000
+// never sent along with FS_OPT_DIRTYLINES, 0x0f000000 is the old workaround
+#define FS_OPT_BATCH 0x08000000
 #define FS_OPT_OLD_AFLPP_WORKAROUND 0x0f000000
 // FS_OPT_MAX_MAPSIZE is 8388608 = 0x800000 = 2^23 = 1 << 23
 #define FS_OPT_MAX_MAPSIZE ((0x00fffffeU >> 1) + 1)
@@ -63,6 +66,14 @@ typedef uint128_t         u128;
 #define FS_OPT_SET_MAPSIZE(x) \
   (x <= 1 || x > FS_OPT_MAX_MAPSIZE ? 0 : ((x - 1) << 1))
 
+/* Sent along with the run request (was_killed) to a target that switches
+   cmplog per run, see CMPLOG_SWITCH_MAGIC */
+#define FS_RUN_CMPLOG 0x40000000
+
+/* Sent along with the run request to a target that set filter in the
+   doorbell: read AFL_PC_FILTER_FILE again before the next fork */
+#define FS_RUN_FILTER 0x20000000
+
 typedef unsigned long long u64;
 
 typedef int8_t  s8;
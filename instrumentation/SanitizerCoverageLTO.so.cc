@@ -197,6 +197,8 @@ class ModuleSanitizerCoverageLTO
   void CreateFunctionLocalArrays(Function &F, ArrayRef<BasicBlock *> AllBlocks);
   void InjectCoverageAtBlock(Function &F, BasicBlock &BB, size_t Idx,
                              bool IsLeafFunc = true);
+  void     readLayoutProfile(const char *path);
+  uint32_t NextID();
   //  std::pair<Value *, Value *> CreateSecStartEnd(Module &M, const char
   //  *Section,
   //                                                Type *Ty);
@@ -240,6 +242,20 @@ class ModuleSanitizerCoverageLTO
   uint64_t                         map_addr = 0;
   const char                      *skip_nozero = NULL;
   const char                      *use_threadsafe_counters = nullptr;
+  const char                      *dom_prune = nullptr;
+  const char                      *lto_layout = nullptr;
+  bool                             layout_static = false;
+  std::vector<uint32_t>            hot_rank;  // by default ID, 0 if cold
+  uint32_t                         hot_cnt = 0;
+  uint32_t                         cold_cnt = 0;
+  uint32_t                         first_id = 0;
+  uint32_t                         max_id = 0;
+  uint32_t                         pruned = 0;
+  uint32_t                         always_hit = 0;
+  unsigned int                     ngram_size = 0;
+  GlobalVariable                  *AFLPrevNgram = NULL;
+  Value                           *Ngram = NULL;  // of the current function
+  std::vector<Instruction *>       NgramMasks;  // set once the IDs are known
   std::vector<BasicBlock *>        BlockList;
   DenseMap<Value *, std::string *> valueMap;
   std::vector<std::string>         dictionary;
@@ -316,6 +332,34 @@ llvmGetPassPluginInfo() {
           }};
 }
 
+// AFL_LLVM_LTO_LAYOUT=static: a static estimate of how often the code of F
+// runs, its direct calls weighted by the loop depth of the call sites.
+static void orderFunctionsByHeat(std::vector<Function *> &Functions) {
+  DenseMap<Function *, uint64_t> Heat;
+
+  for (auto *F : Functions) {
+    if (F->isDeclaration()) continue;
+
+    DominatorTree DT(*F);
+    LoopInfo      LI(DT);
+
+    for (auto &BB : *F) {
+      uint64_t weight = 1ULL << (3 * std::min(LI.getLoopDepth(&BB), 7U));
+
+      for (auto &I : BB) {
+        CallBase *CB = dyn_cast<CallBase>(&I);
+        if (!CB || !CB->getCalledFunction()) continue;
+        Heat[CB->getCalledFunction()] += weight;
+      }
+    }
+  }
+
+  std::stable_sort(Functions.begin(), Functions.end(),
+                   [&Heat](Function *A, Function *B) {
+                     return Heat.lookup(A) > Heat.lookup(B);
+                   });
+}
+
 PreservedAnalyses ModuleSanitizerCoverageLTO::run(Module                &M,
                                                   ModuleAnalysisManager &MAM) {
   ModuleSanitizerCoverageLTO ModuleSancov(Options);
@@ -394,6 +438,8 @@ bool ModuleSanitizerCoverageLTO::instrumentModule(
 
   skip_nozero = getenv("AFL_LLVM_SKIP_NEVERZERO");
   use_threadsafe_counters = getenv("AFL_LLVM_THREADSAFE_INST");
+  dom_prune = getenv("AFL_LLVM_DOM_PRUNE");
+  ngram_size = getNgramSize();
 
   if ((ptr = getenv("AFL_LLVM_LTO_STARTID")) != NULL)
     if ((afl_global_id = atoi(ptr)) < 0)
@@ -401,6 +447,16 @@ bool ModuleSanitizerCoverageLTO::instrumentModule(
 
   if (afl_global_id < 4) { afl_global_id = 4; }
 
+  first_id = afl_global_id + 1;
+  max_id = afl_global_id;
+
+  if ((lto_layout = getenv("AFL_LLVM_LTO_LAYOUT")) != NULL && *lto_layout) {
+    if (!strcmp(lto_layout, "1") || !strcasecmp(lto_layout, "static"))
+      layout_static = true;
+    else
+      readLayoutProfile(lto_layout);
+  }
+
   if ((ptr = getenv("AFL_LLVM_DOCUMENT_IDS")) != NULL) {
     dFile.open(ptr, std::ofstream::out | std::ofstream::app);
     if (dFile.is_open()) WARNF("Cannot access document file %s", ptr);
@@ -448,6 +504,8 @@ bool ModuleSanitizerCoverageLTO::instrumentModule(
         ConstantExpr::getIntToPtr(MapAddr, PointerType::getUnqual(Int8Tyi));
   }
 
+  if (ngram_size) AFLPrevNgram = createNgramState(M);
+
   Zero = ConstantInt::get(Int8Tyi, 0);
   One = ConstantInt::get(Int8Tyi, 1);
 
@@ -870,12 +928,31 @@ bool ModuleSanitizerCoverageLTO::instrumentModule(
   // SanCovTracePCGuard =
   //    M.getOrInsertFunction(SanCovTracePCGuardName, VoidTy, Int32PtrTy);
 
+  std::vector<Function *> Functions;
   for (auto &F : M)
-    instrumentFunction(F, DTCallback, PDTCallback);
+    Functions.push_back(&F);
+
+  if (layout_static) orderFunctionsByHeat(Functions);
+
+  for (auto *F : Functions)
+    instrumentFunction(*F, DTCallback, PDTCallback);
 
   // AFL++ START
   if (dFile.is_open()) dFile.close();
 
+  // the N-gram edges go up to the IDs rounded up to a power of two, minus one
+  if (ngram_size) {
+    uint32_t mask = max_id;
+
+    for (uint32_t shift = 1; shift < 32; shift <<= 1)
+      mask |= mask >> shift;
+
+    for (auto *I : NgramMasks)
+      I->setOperand(1, ConstantInt::get(Int32Tyi, mask));
+
+    max_id = mask;
+  }
+
   if (!getenv("AFL_LLVM_LTO_SKIPINIT") &&
       (!getenv("AFL_LLVM_LTO_DONTWRITEID") || dictionary.size() || map_addr)) {
     // yes we could create our own function, insert it into ctors ...
@@ -910,9 +987,9 @@ bool ModuleSanitizerCoverageLTO::instrumentModule(
     }
 
     if (getenv("AFL_LLVM_LTO_DONTWRITEID") == NULL) {
-      uint32_t write_loc = afl_global_id;
+      uint32_t write_loc = max_id;
 
-      write_loc = (((afl_global_id + 8) >> 3) << 3);
+      write_loc = (((max_id + 8) >> 3) << 3);
 
       GlobalVariable *AFLFinalLoc =
           new GlobalVariable(M, Int32Tyi, true, GlobalValue::ExternalLinkage, 0,
@@ -920,6 +997,11 @@ bool ModuleSanitizerCoverageLTO::instrumentModule(
       ConstantInt *const_loc = ConstantInt::get(Int32Tyi, write_loc);
       StoreInst   *StoreFinalLoc = IRB.CreateStore(const_loc, AFLFinalLoc);
       ModuleSanitizerCoverageLTO::SetNoSanitizeMetadata(StoreFinalLoc);
+
+      GlobalVariable *MapNote =
+          createMapNote(M, MAP_NOTE_FINAL_LOC, write_loc,
+                        dictionary.size() ? MAP_NOTE_F_DICT : 0);
+      if (MapNote) GlobalsToAppendToCompilerUsed.push_back(MapNote);
     }
 
     if (dictionary.size()) {
@@ -960,21 +1042,35 @@ bool ModuleSanitizerCoverageLTO::instrumentModule(
         StoreInst *StoreDictLen = IRB.CreateStore(const_len, AFLDictionaryLen);
         ModuleSanitizerCoverageLTO::SetNoSanitizeMetadata(StoreDictLen);
 
-        ArrayType *ArrayTy = ArrayType::get(IntegerType::get(Ctx, 8), offset);
-        GlobalVariable *AFLInternalDictionary = new GlobalVariable(
-            M, ArrayTy, true, GlobalValue::ExternalLinkage,
-            ConstantDataArray::get(Ctx,
-                                   *(new ArrayRef<char>(ptrhld.get(), offset))),
-            "__afl_internal_dictionary");
-        AFLInternalDictionary->setInitializer(ConstantDataArray::get(
-            Ctx, *(new ArrayRef<char>(ptrhld.get(), offset))));
-        AFLInternalDictionary->setConstant(true);
-
         GlobalVariable *AFLDictionary = new GlobalVariable(
             M, PointerType::get(Int8Tyi, 0), false,
             GlobalValue::ExternalLinkage, 0, "__afl_dictionary");
 
-        Value *AFLDictOff = IRB.CreateGEP(Int8Ty, AFLInternalDictionary, Zero);
+        // in an ELF note the tools can read it from the binary, and the
+        // runtime sends it from there to those that do not
+        GlobalVariable *DictNote = createMapNote(
+            M, MAP_NOTE_DICT, offset, 0, StringRef(ptrhld.get(), offset));
+        Value *AFLDictOff;
+
+        if (DictNote) {
+          GlobalsToAppendToCompilerUsed.push_back(DictNote);
+          AFLDictOff = IRB.CreateConstInBoundsGEP2_32(DictNote->getValueType(),
+                                                      DictNote, 0, 6);
+
+        } else {
+          ArrayType *ArrayTy =
+              ArrayType::get(IntegerType::get(Ctx, 8), offset);
+          GlobalVariable *AFLInternalDictionary = new GlobalVariable(
+              M, ArrayTy, true, GlobalValue::ExternalLinkage,
+              ConstantDataArray::get(
+                  Ctx, *(new ArrayRef<char>(ptrhld.get(), offset))),
+              "__afl_internal_dictionary");
+          AFLInternalDictionary->setInitializer(ConstantDataArray::get(
+              Ctx, *(new ArrayRef<char>(ptrhld.get(), offset))));
+          AFLInternalDictionary->setConstant(true);
+          AFLDictOff = IRB.CreateGEP(Int8Ty, AFLInternalDictionary, Zero);
+        }
+
         Value *AFLDictPtr =
             IRB.CreatePointerCast(AFLDictOff, PointerType::get(Int8Tyi, 0));
         StoreInst *StoreDict = IRB.CreateStore(AFLDictPtr, AFLDictionary);
@@ -1000,6 +1096,14 @@ bool ModuleSanitizerCoverageLTO::instrumentModule(
       OKF("Instrumented %u locations (%u selects) without collisions (%llu "
           "collisions have been avoided) (%s mode).",
           inst, select_cnt, calculateCollisions(inst), modeline);
+      if (dom_prune) {
+        OKF("Pruned %u locations that always count like another one.",
+            pruned);
+      }
+
+      if (always_hit) {
+        OKF("Left out %u locations that every input hits alike.", always_hit);
+      }
     }
   }
 
@@ -1134,7 +1238,7 @@ void ModuleSanitizerCoverageLTO::instrumentFunction(
 
         if (FuncName.compare(StringRef("__afl_coverage_interesting"))) continue;
 
-        Value *val = ConstantInt::get(Int32Ty, ++afl_global_id);
+        Value *val = ConstantInt::get(Int32Ty, NextID());
         callInst->setOperand(1, val);
         ++inst;
       }
@@ -1157,8 +1261,8 @@ void ModuleSanitizerCoverageLTO::instrumentFunction(
         ++select_cnt;
 
         if (t->getTypeID() == llvm::Type::IntegerTyID) {
-          Value *val1 = ConstantInt::get(Int32Ty, ++afl_global_id);
-          Value *val2 = ConstantInt::get(Int32Ty, ++afl_global_id);
+          Value *val1 = ConstantInt::get(Int32Ty, NextID());
+          Value *val2 = ConstantInt::get(Int32Ty, NextID());
           result = IRB.CreateSelect(condition, val1, val2);
           skip_next = 1;
           inst += 2;
@@ -1179,14 +1283,14 @@ void ModuleSanitizerCoverageLTO::instrumentFunction(
                   FixedVectorType::get(Int32Ty, elements);
               Value *x, *y;
 
-              Value *val1 = ConstantInt::get(Int32Ty, ++afl_global_id);
-              Value *val2 = ConstantInt::get(Int32Ty, ++afl_global_id);
+              Value *val1 = ConstantInt::get(Int32Ty, NextID());
+              Value *val2 = ConstantInt::get(Int32Ty, NextID());
               x = IRB.CreateInsertElement(GuardPtr1, val1, (uint64_t)0);
               y = IRB.CreateInsertElement(GuardPtr2, val2, (uint64_t)0);
 
               for (uint64_t i = 1; i < elements; i++) {
-                val1 = ConstantInt::get(Int32Ty, ++afl_global_id);
-                val2 = ConstantInt::get(Int32Ty, ++afl_global_id);
+                val1 = ConstantInt::get(Int32Ty, NextID());
+                val2 = ConstantInt::get(Int32Ty, NextID());
                 x = IRB.CreateInsertElement(GuardPtr1, val1, i);
                 y = IRB.CreateInsertElement(GuardPtr2, val2, i);
               }
@@ -1268,10 +1372,69 @@ void ModuleSanitizerCoverageLTO::instrumentFunction(
     }
   }
 
+  if (dom_prune)
+    pruned += pruneEquivalentBlocks(BlocksToInstrument, DT, PDT);
+
+  // the blocks deepest in loops first, so they share the map cache lines
+  if (layout_static) {
+    LoopInfo LI(*DT);
+    std::stable_sort(BlocksToInstrument.begin(), BlocksToInstrument.end(),
+                     [&LI](BasicBlock *A, BasicBlock *B) {
+                       return LI.getLoopDepth(A) > LI.getLoopDepth(B);
+                     });
+  }
+
+  always_hit += dropAlwaysHitBlocks(&F, BlocksToInstrument);
+
   InjectCoverage(F, BlocksToInstrument, IsLeafFunc);
   InjectCoverageForIndirectCalls(F, IndirCalls);
 }
 
+// AFL_LLVM_LTO_LAYOUT=<file>: read an afl-showmap map of a build without
+// AFL_LLVM_LTO_LAYOUT and give the edges it hit the first IDs, the most hit
+// first. The other edges follow in their usual order.
+void ModuleSanitizerCoverageLTO::readLayoutProfile(const char *path) {
+  std::ifstream                               fp(path);
+  std::string                                 line;
+  std::vector<std::pair<uint32_t, uint32_t>> hits;
+  unsigned int                                id, cnt;
+
+  if (!fp.is_open()) FATAL("Unable to open AFL_LLVM_LTO_LAYOUT file %s", path);
+
+  while (std::getline(fp, line))
+    if (sscanf(line.c_str(), "%u:%u", &id, &cnt) == 2 && cnt && id >= first_id)
+      hits.push_back(std::make_pair(cnt, id));
+
+  std::stable_sort(hits.begin(), hits.end(),
+                   [](const std::pair<uint32_t, uint32_t> &A,
+                      const std::pair<uint32_t, uint32_t> &B) {
+                     return A.first > B.first;
+                   });
+
+  for (auto &H : hits) {
+    if (H.second >= hot_rank.size()) hot_rank.resize(H.second + 1);
+    if (!hot_rank[H.second]) hot_rank[H.second] = ++hot_cnt;
+  }
+
+  if (!be_quiet)
+    OKF("Using the edge profile %s, %u edges go first.", path, hot_cnt);
+}
+
+// Hands out the edge IDs: in order, or by the AFL_LLVM_LTO_LAYOUT profile.
+uint32_t ModuleSanitizerCoverageLTO::NextID() {
+  uint32_t id = ++afl_global_id;
+
+  if (hot_cnt) {
+    if (id < hot_rank.size() && hot_rank[id])
+      id = first_id + hot_rank[id] - 1;
+    else
+      id = first_id + hot_cnt + cold_cnt++;
+  }
+
+  if (id > max_id) max_id = id;
+  return id;
+}
+
 GlobalVariable *ModuleSanitizerCoverageLTO::CreateFunctionLocalArrayInSection(
     size_t NumElements, Function &F, Type *Ty, const char *Section) {
   ArrayType *ArrayTy = ArrayType::get(Ty, NumElements);
@@ -1348,6 +1511,8 @@ bool ModuleSanitizerCoverageLTO::InjectCoverage(
   if (AllBlocks.empty()) return false;
   CreateFunctionLocalArrays(F, AllBlocks);
 
+  if (ngram_size) Ngram = prepareNgram(F, AFLPrevNgram);
+
   for (size_t i = 0, N = AllBlocks.size(); i < N; i++) {
     // AFL++ START
     if (BlockList.size()) {
@@ -1370,6 +1535,9 @@ bool ModuleSanitizerCoverageLTO::InjectCoverage(
     InjectCoverageAtBlock(F, *AllBlocks[i], i, IsLeafFunc);
   }
 
+  if (Ngram) promoteNgram(F, Ngram, AFLPrevNgram);
+  Ngram = NULL;
+
   return true;
 }
 
@@ -1420,18 +1588,27 @@ void ModuleSanitizerCoverageLTO::InjectCoverageAtBlock(Function   &F,
 
   if (Options.TracePCGuard) {
     // AFL++ START
-    ++afl_global_id;
+    uint32_t id = NextID();
 
     if (dFile.is_open()) {
       unsigned long long int moduleID =
           (((unsigned long long int)(rand() & 0xffffffff)) << 32) | getpid();
       dFile << "ModuleID=" << moduleID << " Function=" << F.getName().str()
-            << " edgeID=" << afl_global_id << "\n";
+            << " edgeID=" << id << " Block=" << Idx << "\n";
     }
 
     /* Set the ID of the inserted basic block */
 
-    ConstantInt *CurLoc = ConstantInt::get(Int32Tyi, afl_global_id);
+    Value *CurLoc = ConstantInt::get(Int32Tyi, id);
+
+    if (Ngram) {
+      // the mask is set when all IDs are known
+      Value *Hash = emitNgram(IRB, Ngram, CurLoc, ngram_size);
+      auto  *Mask = BinaryOperator::CreateAnd(
+          Hash, ConstantInt::get(Int32Tyi, 0), "", &*IRB.GetInsertPoint());
+      NgramMasks.push_back(Mask);
+      CurLoc = IRB.CreateXor(CurLoc, Mask);
+    }
 
     /* Load SHM pointer */
 
@@ -12,6 +12,7 @@
 
 #include "llvm/Transforms/Instrumentation/SanitizerCoverage.h"
 #include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/SmallVector.h"
 #if LLVM_VERSION_MAJOR >= 15
   #if LLVM_VERSION_MAJOR < 17
@@ -70,6 +71,7 @@
 #endif
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Transforms/Utils/ModuleUtils.h"
+#include "llvm/Transforms/Utils/PromoteMemToReg.h"
 
 #include "config.h"
 #include "debug.h"
@@ -95,6 +97,9 @@ const char SanCovTraceSwitchName[] = "__sanitizer_cov_trace_switch";
 const char SanCovModuleCtorTracePcGuardName[] =
     "sancov.module_ctor_trace_pc_guard";
 const char SanCovTracePCGuardInitName[] = "__sanitizer_cov_trace_pc_guard_init";
+const char SanCovModuleCtorBucketedName[] =
+    "sancov.module_ctor_trace_pc_guard_buckets";
+const char AFLBucketedGuardInitName[] = "__afl_bucketed_guard_init";
 
 const char SanCovTracePCGuardName[] = "__sanitizer_cov_trace_pc_guard";
 
@@ -107,6 +112,13 @@ const char SanCovLowestStackName[] = "__sancov_lowest_stack";
 
 static const char *skip_nozero;
 static const char *use_threadsafe_counters;
+static const char *dirty_lines;
+static const char *bucketed_counts;
+static const char *dom_prune;
+static const char *loop_compress;
+static const char *thread_maps;
+static unsigned int ngram_size;
+static uint64_t     map_addr;
 
 namespace {
 
@@ -149,6 +161,8 @@ class ModuleSanitizerCoverageAFL
                                  uint32_t special);
   void InjectCoverageAtBlock(Function &F, BasicBlock &BB, size_t Idx,
                              bool IsLeafFunc = true);
+  AllocaInst *InjectLoopCoverageAtBlock(Function &F, Loop &L, BasicBlock &BB,
+                                        size_t Idx);
   Function *CreateInitCallsForSections(Module &M, const char *CtorName,
                                        const char *InitFunctionName, Type *Ty,
                                        const char *Section);
@@ -164,6 +178,72 @@ class ModuleSanitizerCoverageAFL
 #endif
   }
 
+  /* The map to count into: __afl_thread_area_ptr of the thread, if it has
+     one (AFL_LLVM_THREAD_MAPS), else __afl_area_ptr. A fixed map address
+     (AFL_LLVM_MAP_ADDR) is a constant instead. */
+  Value *LoadMapPtr(IRBuilderBase &IRB) {
+    if (map_addr) {
+      return ConstantExpr::getIntToPtr(ConstantInt::get(Int64Ty, map_addr),
+                                       PointerType::get(Int8Ty, 0));
+    }
+
+    LoadInst *MapPtr = IRB.CreateLoad(PointerType::get(Int8Ty, 0), AFLMapPtr);
+    SetNoSanitizeMetadata(MapPtr);
+    if (!thread_maps) return MapPtr;
+
+    LoadInst *ThreadPtr =
+        IRB.CreateLoad(PointerType::get(Int8Ty, 0), AFLThreadMapPtr);
+    SetNoSanitizeMetadata(ThreadPtr);
+    return IRB.CreateSelect(IRB.CreateIsNotNull(ThreadPtr), ThreadPtr, MapPtr);
+  }
+
+  /* Flags the map cache line of CurLoc in __afl_dirty_ptr. */
+  void MarkDirtyLine(IRBuilderBase &IRB, Value *CurLoc) {
+    if (!dirty_lines) return;
+
+    Value    *Line = IRB.CreateLShr(CurLoc, DIRTY_LINE_SHIFT);
+    LoadInst *DirtyPtr =
+        IRB.CreateLoad(PointerType::get(IRB.getInt8Ty(), 0), AFLDirtyPtr);
+    SetNoSanitizeMetadata(DirtyPtr);
+    StoreInst *StoreDirty = IRB.CreateStore(
+        One, IRB.CreateGEP(IRB.getInt8Ty(), DirtyPtr, Line));
+    SetNoSanitizeMetadata(StoreDirty);
+  }
+
+  /* AFL_LLVM_BUCKETED_COUNTS: adds Add to the hit count of CurLoc in
+     __afl_count_ptr, saturating at 255, and stores its bucket from
+     __afl_bucket_lut to MapPtrIdx. The count is taken as 0 while the map
+     byte is, so clearing the map between runs resets it. Masks instead of
+     selects, InjectCoverage() would instrument those as it walks on. */
+  void StoreBucket(IRBuilderBase &IRB, Value *MapPtrIdx, Value *CurLoc,
+                   Value *Add) {
+    LoadInst *Bucket = IRB.CreateLoad(Int8Ty, MapPtrIdx);
+    SetNoSanitizeMetadata(Bucket);
+    LoadInst *CountPtr =
+        IRB.CreateLoad(PointerType::get(Int8Ty, 0), AFLCountPtr);
+    SetNoSanitizeMetadata(CountPtr);
+    Value    *CountIdx = IRB.CreateGEP(Int8Ty, CountPtr, CurLoc);
+    LoadInst *Count = IRB.CreateLoad(Int8Ty, CountIdx);
+    SetNoSanitizeMetadata(Count);
+
+    Value *Valid = IRB.CreateSExt(IRB.CreateICmpNE(Bucket, Zero), Int8Ty);
+    Value *Old = IRB.CreateZExt(IRB.CreateAnd(Count, Valid), Int32Ty);
+    Value *Sum = IRB.CreateAdd(Old, Add);
+    Value *Over = IRB.CreateSExt(
+        IRB.CreateICmpUGT(Sum, ConstantInt::get(Int32Ty, 255)), Int32Ty);
+    Value *NewCount = IRB.CreateTrunc(IRB.CreateOr(Sum, Over), Int8Ty);
+
+    StoreInst *StoreCount = IRB.CreateStore(NewCount, CountIdx);
+    SetNoSanitizeMetadata(StoreCount);
+
+    Value    *Lut = IRB.CreatePointerCast(AFLBucketLut, Int8PtrTy);
+    LoadInst *NewBucket = IRB.CreateLoad(
+        Int8Ty, IRB.CreateGEP(Int8Ty, Lut, IRB.CreateZExt(NewCount, Int32Ty)));
+    SetNoSanitizeMetadata(NewBucket);
+    StoreInst *StoreCtx = IRB.CreateStore(NewBucket, MapPtrIdx);
+    SetNoSanitizeMetadata(StoreCtx);
+  }
+
   std::string     getSectionName(const std::string &Section) const;
   std::string     getSectionStart(const std::string &Section) const;
   std::string     getSectionEnd(const std::string &Section) const;
@@ -189,8 +269,16 @@ class ModuleSanitizerCoverageAFL
 
   SanitizerCoverageOptions Options;
 
-  uint32_t        instr = 0, selects = 0, unhandled = 0;
+  uint32_t        instr = 0, selects = 0, unhandled = 0, pruned = 0;
+  uint32_t        guards = 0;  // for the map note
   GlobalVariable *AFLMapPtr = NULL;
+  GlobalVariable *AFLDirtyPtr = NULL;
+  GlobalVariable *AFLCountPtr = NULL;
+  GlobalVariable *AFLBucketLut = NULL;
+  GlobalVariable *AFLThreadMapPtr = NULL;
+  GlobalVariable *AFLPrevNgram = NULL;
+  GlobalVariable *AFLNgramMask = NULL;
+  Value          *Ngram = NULL;  // N-gram hash of the current function
   ConstantInt    *One = NULL;
   ConstantInt    *Zero = NULL;
 };
@@ -311,10 +399,59 @@ bool ModuleSanitizerCoverageAFL::instrumentModule(
 
   skip_nozero = getenv("AFL_LLVM_SKIP_NEVERZERO");
   use_threadsafe_counters = getenv("AFL_LLVM_THREADSAFE_INST");
+  dirty_lines = getenv("AFL_LLVM_DIRTY_LINES");
+  bucketed_counts = getenv("AFL_LLVM_BUCKETED_COUNTS");
+  dom_prune = getenv("AFL_LLVM_DOM_PRUNE");
+  loop_compress = getenv("AFL_LLVM_LOOP_COMPRESS");
+  thread_maps = getenv("AFL_LLVM_THREAD_MAPS");
+  // the main thread still counts into the shared map
+  if (thread_maps) use_threadsafe_counters = thread_maps;
+  ngram_size = getNgramSize();
 
   initInstrumentList();
   scanForDangerousFunctions(&M);
 
+  // the counts behind the buckets are not updated atomically
+  if (bucketed_counts && use_threadsafe_counters) {
+    if (!be_quiet)
+      WARNF("AFL_LLVM_BUCKETED_COUNTS is ignored with %s",
+            thread_maps ? "AFL_LLVM_THREAD_MAPS" : "AFL_LLVM_THREADSAFE_INST");
+    bucketed_counts = NULL;
+  }
+
+  map_addr = 0;
+
+  if (const char *ptr = getenv("AFL_LLVM_MAP_ADDR")) {
+    if (!*ptr || !strcmp(ptr, "0") || !strcmp(ptr, "0x0")) {
+      map_addr = 0;
+
+    } else if (strncmp(ptr, "0x", 2) != 0) {
+      map_addr = 0x10000;  // the default
+
+    } else {
+      map_addr = strtoull(ptr, NULL, 16);
+      if (map_addr < 0x100 || map_addr > 0xffffffff00000000) {
+        FATAL(
+            "AFL_LLVM_MAP_ADDR must be a value between 0x100 and "
+            "0xffffffff00000000");
+      }
+    }
+  }
+
+  // new threads count into maps of their own
+  if (map_addr && thread_maps) {
+    if (!be_quiet)
+      WARNF("AFL_LLVM_MAP_ADDR is ignored with AFL_LLVM_THREAD_MAPS");
+    map_addr = 0;
+  }
+
+  // the N-gram edge of a loop block changes with every iteration
+  if (ngram_size && loop_compress) {
+    if (!be_quiet)
+      WARNF("AFL_LLVM_LOOP_COMPRESS is ignored with AFL_LLVM_NGRAM_SIZE");
+    loop_compress = NULL;
+  }
+
   C = &(M.getContext());
   DL = &M.getDataLayout();
   CurModule = &M;
@@ -345,6 +482,63 @@ bool ModuleSanitizerCoverageAFL::instrumentModule(
   One = ConstantInt::get(IntegerType::getInt8Ty(Ctx), 1);
   Zero = ConstantInt::get(IntegerType::getInt8Ty(Ctx), 0);
 
+  if (thread_maps) {
+    AFLThreadMapPtr = new GlobalVariable(
+        M, PointerType::get(Int8Ty, 0), false, GlobalValue::ExternalLinkage, 0,
+        "__afl_thread_area_ptr", nullptr, GlobalValue::InitialExecTLSModel);
+
+    /* tells the runtime to give the threads of this binary their own maps */
+    GlobalVariable *ThreadMapsMarker = new GlobalVariable(
+        M, Int32Ty, true, GlobalValue::WeakAnyLinkage,
+        ConstantInt::get(Int32Ty, 1), "__afl_thread_maps_instrumented");
+    GlobalsToAppendToCompilerUsed.push_back(ThreadMapsMarker);
+  }
+
+  if (map_addr) {
+    /* tells the runtime where to map the coverage map, before any
+       instrumented code runs */
+    GlobalVariable *MapAddrMarker = new GlobalVariable(
+        M, Int64Ty, true, GlobalValue::WeakAnyLinkage,
+        ConstantInt::get(Int64Ty, map_addr), "__afl_map_addr_instrumented");
+    GlobalsToAppendToCompilerUsed.push_back(MapAddrMarker);
+  }
+
+  if (ngram_size) {
+    AFLPrevNgram = createNgramState(M);
+    AFLNgramMask = new GlobalVariable(M, Int32Ty, false,
+                                      GlobalValue::ExternalLinkage, 0,
+                                      "__afl_ngram_mask");
+
+    /* tells the runtime to size the map for the N-gram edges */
+    GlobalVariable *NgramMarker = new GlobalVariable(
+        M, Int32Ty, true, GlobalValue::WeakAnyLinkage,
+        ConstantInt::get(Int32Ty, 1), "__afl_ngram_instrumented");
+    GlobalsToAppendToCompilerUsed.push_back(NgramMarker);
+  }
+
+  if (dirty_lines) {
+    AFLDirtyPtr =
+        new GlobalVariable(M, PointerType::get(Int8Ty, 0), false,
+                           GlobalValue::ExternalLinkage, 0, "__afl_dirty_ptr");
+
+    /* tells the runtime that this binary maintains the dirty line map */
+    GlobalVariable *DirtyMarker = new GlobalVariable(
+        M, Int32Ty, true, GlobalValue::WeakAnyLinkage,
+        ConstantInt::get(Int32Ty, 1), "__afl_dirty_lines_instrumented");
+    GlobalsToAppendToCompilerUsed.push_back(DirtyMarker);
+  }
+
+  if (bucketed_counts) {
+    AFLCountPtr =
+        new GlobalVariable(M, PointerType::get(Int8Ty, 0), false,
+                           GlobalValue::ExternalLinkage, 0, "__afl_count_ptr");
+    /* not constant, the runtime turns it into the identity when the map
+       has to get hit counts after all */
+    AFLBucketLut = new GlobalVariable(M, ArrayType::get(Int8Ty, 256), false,
+                                      GlobalValue::ExternalLinkage, 0,
+                                      "__afl_bucket_lut");
+  }
+
   // Make sure smaller parameters are zero-extended to i64 if required by the
   // target ABI.
   AttributeList SanCovTraceCmpZeroExtAL;
@@ -398,15 +592,27 @@ bool ModuleSanitizerCoverageAFL::instrumentModule(
 
   Function *Ctor = nullptr;
 
+  /* a bucketed module registers its guards as such, the runtime only keeps
+     the buckets if all modules do. Its own ctor name keeps the linker from
+     merging it with the ctor of a plain object in the same module. */
   if (FunctionGuardArray)
-    Ctor = CreateInitCallsForSections(M, SanCovModuleCtorTracePcGuardName,
-                                      SanCovTracePCGuardInitName, Int32PtrTy,
-                                      SanCovGuardsSectionName);
+    Ctor = CreateInitCallsForSections(
+        M,
+        bucketed_counts ? SanCovModuleCtorBucketedName
+                        : SanCovModuleCtorTracePcGuardName,
+        bucketed_counts ? AFLBucketedGuardInitName : SanCovTracePCGuardInitName,
+        Int32PtrTy, SanCovGuardsSectionName);
 
   if (Ctor && debug) {
     fprintf(stderr, "SANCOV: installed pcguard_init in ctor\n");
   }
 
+  if (guards) {
+    GlobalVariable *MapNote = createMapNote(M, MAP_NOTE_GUARDS, guards,
+                                            ngram_size ? MAP_NOTE_F_NGRAM : 0);
+    if (MapNote) GlobalsToAppendToUsed.push_back(MapNote);
+  }
+
   appendToUsed(M, GlobalsToAppendToUsed);
   appendToCompilerUsed(M, GlobalsToAppendToCompilerUsed);
 
@@ -426,6 +632,10 @@ bool ModuleSanitizerCoverageAFL::instrumentModule(
       OKF("Instrumented %u locations with no collisions (%s mode) of which are "
           "%u handled and %u unhandled selects.",
           instr, modeline, selects, unhandled);
+      if (dom_prune) {
+        OKF("Pruned %u locations that always count like another one.",
+            pruned);
+      }
     }
   }
 
@@ -573,6 +783,9 @@ void ModuleSanitizerCoverageAFL::instrumentFunction(
     */
   }
 
+  if (dom_prune)
+    pruned += pruneEquivalentBlocks(BlocksToInstrument, DT, PDT);
+
   if (debug) {
     fprintf(stderr, "SanitizerCoveragePCGUARD: instrumenting %s in %s\n",
             F.getName().str().c_str(), F.getParent()->getName().str().c_str());
@@ -653,9 +866,11 @@ GlobalVariable *ModuleSanitizerCoverageAFL::CreatePCArray(
 
 void ModuleSanitizerCoverageAFL::CreateFunctionLocalArrays(
     Function &F, ArrayRef<BasicBlock *> AllBlocks, uint32_t special) {
-  if (Options.TracePCGuard)
+  if (Options.TracePCGuard) {
     FunctionGuardArray = CreateFunctionLocalArrayInSection(
         AllBlocks.size() + special, F, Int32Ty, SanCovGuardsSectionName);
+    guards += AllBlocks.size() + special;
+  }
 }
 
 bool ModuleSanitizerCoverageAFL::InjectCoverage(
@@ -862,20 +1077,20 @@ bool ModuleSanitizerCoverageAFL::InjectCoverage(
 
         /* Load SHM pointer */
 
-        LoadInst *MapPtr =
-            IRB.CreateLoad(PointerType::get(Int8Ty, 0), AFLMapPtr);
-        ModuleSanitizerCoverageAFL::SetNoSanitizeMetadata(MapPtr);
+        Value *MapPtr = LoadMapPtr(IRB);
 
         while (1) {
           /* Get CurLoc */
           LoadInst *CurLoc = nullptr;
-          Value    *MapPtrIdx = nullptr;
+          Value    *MapPtrIdx = nullptr, *Loc = nullptr;
 
           /* Load counter for CurLoc */
           if (!vector_cnt) {
             CurLoc = IRB.CreateLoad(IRB.getInt32Ty(), result);
             ModuleSanitizerCoverageAFL::SetNoSanitizeMetadata(CurLoc);
             MapPtrIdx = IRB.CreateGEP(Int8Ty, MapPtr, CurLoc);
+            MarkDirtyLine(IRB, CurLoc);
+            Loc = CurLoc;
 
           } else {
             auto element = IRB.CreateExtractElement(result, vector_cur++);
@@ -883,6 +1098,8 @@ bool ModuleSanitizerCoverageAFL::InjectCoverage(
             auto elementld = IRB.CreateLoad(IRB.getInt32Ty(), elementptr);
             ModuleSanitizerCoverageAFL::SetNoSanitizeMetadata(elementld);
             MapPtrIdx = IRB.CreateGEP(Int8Ty, MapPtr, elementld);
+            MarkDirtyLine(IRB, elementld);
+            Loc = elementld;
           }
 
           if (use_threadsafe_counters) {
@@ -892,6 +1109,9 @@ bool ModuleSanitizerCoverageAFL::InjectCoverage(
 #endif
                                 llvm::AtomicOrdering::Monotonic);
 
+          } else if (bucketed_counts) {
+            StoreBucket(IRB, MapPtrIdx, Loc, ConstantInt::get(Int32Ty, 1));
+
           } else {
             LoadInst *Counter = IRB.CreateLoad(IRB.getInt8Ty(), MapPtrIdx);
             ModuleSanitizerCoverageAFL::SetNoSanitizeMetadata(Counter);
@@ -930,10 +1150,39 @@ bool ModuleSanitizerCoverageAFL::InjectCoverage(
 
   if (AllBlocks.empty() && !special && !local_selects) return false;
 
-  if (!AllBlocks.empty())
+  if (AllBlocks.empty()) return true;
+
+  if (!loop_compress) {
+    Ngram = ngram_size ? prepareNgram(F, AFLPrevNgram) : NULL;
+
     for (size_t i = 0, N = AllBlocks.size(); i < N; i++)
       InjectCoverageAtBlock(F, *AllBlocks[i], i, IsLeafFunc);
 
+    if (Ngram) promoteNgram(F, Ngram, AFLPrevNgram);
+    Ngram = NULL;
+
+    return true;
+  }
+
+  DominatorTree                 DT(F);
+  LoopInfo                      LI(DT);
+  DenseMap<Loop *, bool>        Compressible;
+  SmallVector<AllocaInst *, 16> Counts;
+
+  for (size_t i = 0, N = AllBlocks.size(); i < N; i++) {
+    Loop *L = LI.getLoopFor(AllBlocks[i]);
+
+    if (L && !Compressible.count(L)) Compressible[L] = isLoopCompressible(L);
+
+    if (L && Compressible[L])
+      Counts.push_back(InjectLoopCoverageAtBlock(F, *L, *AllBlocks[i], i));
+    else
+      InjectCoverageAtBlock(F, *AllBlocks[i], i, IsLeafFunc);
+  }
+
+  // the new code did not change the CFG, DT is still good
+  if (!Counts.empty()) PromoteMemToReg(Counts, DT);
+
   return true;
 }
 
@@ -1063,17 +1312,26 @@ void ModuleSanitizerCoverageAFL::InjectCoverageAtBlock(Function   &F,
                       ConstantInt::get(IntptrTy, Idx * 4)),
         Int32PtrTy);
 
-    LoadInst *CurLoc = IRB.CreateLoad(IRB.getInt32Ty(), GuardPtr);
-    ModuleSanitizerCoverageAFL::SetNoSanitizeMetadata(CurLoc);
+    LoadInst *Guard = IRB.CreateLoad(IRB.getInt32Ty(), GuardPtr);
+    ModuleSanitizerCoverageAFL::SetNoSanitizeMetadata(Guard);
+    Value *CurLoc = Guard;
+
+    if (Ngram) {
+      LoadInst *Mask = IRB.CreateLoad(Int32Ty, AFLNgramMask);
+      ModuleSanitizerCoverageAFL::SetNoSanitizeMetadata(Mask);
+      CurLoc = IRB.CreateXor(
+          Guard,
+          IRB.CreateAnd(emitNgram(IRB, Ngram, Guard, ngram_size), Mask));
+    }
 
     /* Load SHM pointer */
 
-    LoadInst *MapPtr = IRB.CreateLoad(PointerType::get(Int8Ty, 0), AFLMapPtr);
-    ModuleSanitizerCoverageAFL::SetNoSanitizeMetadata(MapPtr);
+    Value *MapPtr = LoadMapPtr(IRB);
 
     /* Load counter for CurLoc */
 
     Value *MapPtrIdx = IRB.CreateGEP(Int8Ty, MapPtr, CurLoc);
+    MarkDirtyLine(IRB, CurLoc);
 
     if (use_threadsafe_counters) {
       IRB.CreateAtomicRMW(llvm::AtomicRMWInst::BinOp::Add, MapPtrIdx, One,
@@ -1082,6 +1340,9 @@ void ModuleSanitizerCoverageAFL::InjectCoverageAtBlock(Function   &F,
 #endif
                           llvm::AtomicOrdering::Monotonic);
 
+    } else if (bucketed_counts) {
+      StoreBucket(IRB, MapPtrIdx, CurLoc, ConstantInt::get(Int32Ty, 1));
+
     } else {
       LoadInst *Counter = IRB.CreateLoad(IRB.getInt8Ty(), MapPtrIdx);
       ModuleSanitizerCoverageAFL::SetNoSanitizeMetadata(Counter);
@@ -1108,6 +1369,80 @@ void ModuleSanitizerCoverageAFL::InjectCoverageAtBlock(Function   &F,
   }
 }
 
+// AFL_LLVM_LOOP_COMPRESS: count the runs of BB, a block of the compressible
+// loop L, in a local that starts at 0 in the preheader, and add it to the map
+// in every exit block. The add saturates at 255 so the count lands in the
+// same count_class_lookup bucket as increments that are never wrapped, the
+// NeverZero carry is not needed as a nonzero counter cannot become 0.
+// Returns the local, which the caller promotes to a register.
+AllocaInst *ModuleSanitizerCoverageAFL::InjectLoopCoverageAtBlock(
+    Function &F, Loop &L, BasicBlock &BB, size_t Idx) {
+  BasicBlock &EntryBB = F.getEntryBlock();
+  IRBuilder<> AllocaIRB(&EntryBB, EntryBB.begin());
+  AllocaInst *Count = AllocaIRB.CreateAlloca(Int32Ty);
+
+  IRBuilder<> PreIRB(L.getLoopPreheader()->getTerminator());
+  PreIRB.CreateStore(ConstantInt::get(Int32Ty, 0), Count);
+
+  IRBuilder<> IRB(&*BB.getFirstInsertionPt());
+  IRB.CreateStore(IRB.CreateAdd(IRB.CreateLoad(Int32Ty, Count),
+                                ConstantInt::get(Int32Ty, 1)),
+                  Count);
+
+  SmallVector<BasicBlock *, 8> Exits;
+  L.getUniqueExitBlocks(Exits);
+
+  for (auto *Exit : Exits) {
+    IRBuilder<> ExitIRB(&*Exit->getFirstInsertionPt());
+
+    Value *GuardPtr = ExitIRB.CreateIntToPtr(
+        ExitIRB.CreateAdd(
+            ExitIRB.CreatePointerCast(FunctionGuardArray, IntptrTy),
+            ConstantInt::get(IntptrTy, Idx * 4)),
+        Int32PtrTy);
+
+    LoadInst *CurLoc = ExitIRB.CreateLoad(Int32Ty, GuardPtr);
+    ModuleSanitizerCoverageAFL::SetNoSanitizeMetadata(CurLoc);
+
+    Value *MapPtr = LoadMapPtr(ExitIRB);
+
+    Value *MapPtrIdx = ExitIRB.CreateGEP(Int8Ty, MapPtr, CurLoc);
+    MarkDirtyLine(ExitIRB, CurLoc);
+
+    Value *Runs = ExitIRB.CreateLoad(Int32Ty, Count);
+    Value *Max = ConstantInt::get(Int32Ty, 255);
+
+    if (use_threadsafe_counters) {
+      Value *Incr = ExitIRB.CreateSelect(ExitIRB.CreateICmpUGT(Runs, Max), Max,
+                                         Runs);
+      ExitIRB.CreateAtomicRMW(llvm::AtomicRMWInst::BinOp::Add, MapPtrIdx,
+                              ExitIRB.CreateTrunc(Incr, Int8Ty),
+#if LLVM_VERSION_MAJOR >= 13
+                              llvm::MaybeAlign(1),
+#endif
+                              llvm::AtomicOrdering::Monotonic);
+
+    } else if (bucketed_counts) {
+      StoreBucket(ExitIRB, MapPtrIdx, CurLoc, Runs);
+
+    } else {
+      LoadInst *Counter = ExitIRB.CreateLoad(Int8Ty, MapPtrIdx);
+      ModuleSanitizerCoverageAFL::SetNoSanitizeMetadata(Counter);
+
+      Value *Sum =
+          ExitIRB.CreateAdd(ExitIRB.CreateZExt(Counter, Int32Ty), Runs);
+      Sum = ExitIRB.CreateSelect(ExitIRB.CreateICmpUGT(Sum, Max), Max, Sum);
+
+      StoreInst *StoreCtx =
+          ExitIRB.CreateStore(ExitIRB.CreateTrunc(Sum, Int8Ty), MapPtrIdx);
+      ModuleSanitizerCoverageAFL::SetNoSanitizeMetadata(StoreCtx);
+    }
+  }
+
+  ++instr;
+  return Count;
+}
+
 std::string ModuleSanitizerCoverageAFL::getSectionName(
     const std::string &Section) const {
   if (TargetTriple.isOSBinFormatCOFF()) {
@@ -21,7 +21,12 @@
   #ifndef __USE_GNU
     #define __USE_GNU
   #endif
+  #include <ctype.h>
   #include <dlfcn.h>
+  #include <sys/stat.h>
+  #ifdef __linux__
+    #include <link.h>
+  #endif
 
 __attribute__((weak)) void __sanitizer_symbolize_pc(void *, const char *fmt,
                                                     char  *out_buf,
@@ -34,6 +39,11 @@ __attribute__((weak)) void __sanitizer_symbolize_pc(void *, const char *fmt,
 #include "config.h"
 #include "types.h"
 #include "cmplog.h"
+#include "fsbatch.h"
+#include "fsdoorbell.h"
+#include "fshints.h"
+#include "fsvirgin.h"
+#include "injections.h"
 #include "llvm-alternative-coverage.h"
 
 #define XXH_INLINE_ALL
@@ -57,9 +67,16 @@ __attribute__((weak)) void __sanitizer_symbolize_pc(void *, const char *fmt,
 #endif
 #ifndef USEMMAP
   #include <sys/shm.h>
+#else
+  #include <sys/stat.h>
 #endif
 #include <sys/wait.h>
+#include <sys/time.h>
+#include <time.h>
 #include <sys/types.h>
+#ifdef __linux__
+  #include <ucontext.h>
+#endif
 
 #if !__GNUC__
   #include "llvm/Config/llvm-config.h"
@@ -67,6 +84,10 @@ __attribute__((weak)) void __sanitizer_symbolize_pc(void *, const char *fmt,
 
 #ifdef __linux__
   #include "snapshot-inl.h"
+  #ifdef __GLIBC__
+    #include "snapshot-user-inl.h"
+    #define AFL_USERSPACE_SNAPSHOT
+  #endif
 #endif
 
 /* This is a somewhat ugly hack for the experimental 'trace-pc-guard' mode.
@@ -109,12 +130,89 @@ static u32 __afl_fuzz_len_dummy;
 u32       *__afl_fuzz_len = &__afl_fuzz_len_dummy;
 int        __afl_sharedmem_fuzzing __attribute__((weak));
 
+/* Dirty line map, written by AFL_LLVM_DIRTY_LINES instrumentation which also
+   defines __afl_dirty_lines_instrumented. The initial one covers the largest
+   map size the forkserver can announce. */
+static u8  __afl_dirty_initial[DIRTY_LINES_SIZE(FS_OPT_MAX_MAPSIZE)];
+u8        *__afl_dirty_ptr = __afl_dirty_initial;
+static u8  __afl_dirty_shm;
+
+/* AFL_LLVM_BUCKETED_COUNTS instrumentation, whose modules register with
+   __afl_bucketed_guard_init(), keeps the hit counts here and stores their
+   bucket from __afl_bucket_lut into the map. A count is only valid while its
+   map byte is set, so clearing the map resets the counts. The map only has
+   buckets while every module is bucketed and afl-fuzz agreed in the doorbell
+   handshake, else the table is turned into the identity and the map gets
+   hit counts like from any other module. */
+
+u8 __afl_bucket_lut[256] = {
+
+    [0] = 0,
+    [1] = 1,
+    [2] = 2,
+    [3] = 4,
+    [4 ... 7] = 8,
+    [8 ... 15] = 16,
+    [16 ... 31] = 32,
+    [32 ... 127] = 64,
+    [128 ... 255] = 128
+
+};
+
+static u8  __afl_count_initial[MAP_INITIAL_SIZE];
+u8        *__afl_count_ptr = __afl_count_initial;
+static u32 __afl_count_size = MAP_INITIAL_SIZE;
+static u32 __afl_bucket_modules, __afl_plain_modules;
+static u8  __afl_buckets, __afl_buckets_raw;
+
+/* Testcase batches (FS_OPT_BATCH) and the position in the current one. */
+
+static struct fs_batch *__afl_batch;
+static u32              __afl_batch_pos;
+static u64              __afl_batch_time;
+
+/* Field hints (AFL_FIELD_HINTS) the harness gives with __AFL_HINT_FIELD(). */
+
+static struct fs_hints *__afl_hints;
+
+/* afl-fuzz's virgin map, to tell it whether a run found something new
+   (AFL_TARGET_NOVELTY). */
+
+static struct fs_virgin *__afl_virgin;
+
+/* Shared memory control channel instead of the pipes, if afl-fuzz offers
+   one and accepts (Linux only). */
+
+static struct fs_doorbell *__afl_doorbell;
+
+/* The forkserver children snapshot themselves (AFL_USERSPACE_SNAPSHOT). */
+
+static u8 __afl_usnap;
+
+/* Pipelined runs (AFL_PIPELINE): the two slots, and the shared memory
+   testcase and main map which the slot 0 runs use. The harness sees a
+   private copy of the testcase. */
+
+static struct fs_pipe *__afl_pipe;
+static u8             *__afl_pipe_shm_ptr, *__afl_pipe_area_ptr;
+static u32            *__afl_pipe_shm_len;
+
+static inline u64 __afl_batch_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+extern int __afl_dirty_lines_instrumented __attribute__((weak));
+extern const u64 __afl_map_addr_instrumented __attribute__((weak));
+
 u32 __afl_final_loc;
 u32 __afl_map_size = MAP_SIZE;
 u32 __afl_dictionary_len;
 u64 __afl_map_addr;
 u32 __afl_first_final_loc;
 
+#include "thread-maps-inl.h"
+
 #ifdef __AFL_CODE_COVERAGE
 typedef struct afl_module_info_t afl_module_info_t;
 
@@ -136,6 +234,9 @@ struct afl_module_info_t {
 
   u8 mapped;
 
+  // Guard IDs before AFL_PC_FILTER_FILE is applied, to apply another one
+  u32 *guards;
+
   afl_module_info_t *next;
 };
 
@@ -149,15 +250,64 @@ afl_module_info_t *__afl_module_info = NULL;
 u32        __afl_pcmap_size = 0;
 uintptr_t *__afl_pcmap_ptr = NULL;
 
+/* The AFL_PC_FILTER_FILE image, as make_symbol_list.py --pack writes it and
+   as the text format is turned into: a header, the modules, then for each
+   module its ranges of module relative PCs, sorted and not overlapping. The
+   module names are NUL terminated strings somewhere in the image. A module
+   with a build-id only filters the module with that build-id, one without
+   filters the modules whose path contains its name. */
+
+#define FILTER_PC_MAGIC "AFLPCF1"
+
+typedef struct {
+  char magic[8];
+  u32  modules;
+  u32  reserved;
+
+} FilterPCHeader;
+
+typedef struct {
+  u64 ranges_off; /* image offset of the ranges, 8 byte aligned */
+  u64 ranges_cnt;
+  u32 name_off;
+  u32 build_id_len; /* 0 if not known */
+  u8  build_id[32];
+
+} FilterPCModule;
+
 typedef struct {
-  uintptr_t start;
-  u32       len;
+  u64 start, end;
+
+} FilterPCRange;
+
+const u8 *__afl_filter_pcs = NULL;
+size_t    __afl_filter_pcs_size = 0;
+
+/* the image is mapped from the file rather than allocated */
+static u8 __afl_filter_pcs_mmapped;
+
+/* afl-fuzz can ask for the file to be read again with FS_RUN_FILTER */
+static u8 __afl_filter_reloadable;
+
+/* The last ID of the dense range the guards the filters keep are renumbered
+   to, and whether a module that is not renumbered rules that out. */
+static u32 __afl_compact_loc;
+static u8  __afl_compact_off;
+
+/* AFL_PC_FILTER_FOCUS: the filters do not disable guards, the map indices
+   from __afl_focus_start to before __afl_focus_end are those they select */
+static u8  __afl_focus;
+static u32 __afl_focus_start, __afl_focus_end;
+
+static void afl_pc_focus_layout(void);
 
-} FilterPCEntry;
+/* The functions the filters disabled all guards of, as sorted and merged
+   ranges of absolute addresses. The cmplog hooks called from them do not
+   log, unless AFL_PC_FILTER_CMPLOG_ALL is set. */
+static FilterPCRange *__afl_cmp_skip;
+static u32            __afl_cmp_skip_cnt;
 
-u32            __afl_filter_pcs_size = 0;
-FilterPCEntry *__afl_filter_pcs = NULL;
-u8            *__afl_filter_pcs_module = NULL;
+static void afl_pc_filter_reload(void);
 
 #endif  // __AFL_CODE_COVERAGE
 
@@ -173,14 +323,37 @@ static int __afl_selective_coverage_temp = 1;
 PREV_LOC_T __afl_prev_loc[NGRAM_SIZE_MAX];
 PREV_LOC_T __afl_prev_caller[CTX_MAX_K];
 u32        __afl_prev_ctx;
+u64        __afl_prev_ngram;
 #else
 __thread PREV_LOC_T __afl_prev_loc[NGRAM_SIZE_MAX];
 __thread PREV_LOC_T __afl_prev_caller[CTX_MAX_K];
 __thread u32        __afl_prev_ctx;
+__thread u64        __afl_prev_ngram;
 #endif
 
+/* AFL_LLVM_NGRAM_SIZE with PCGUARD counts into the guard ID xor'ed with the
+   N-gram hash masked by __afl_ngram_mask, which __afl_ngram_fit() makes the
+   size of the map minus one. Until then it is 0 and the edges are the plain
+   guards. */
+
+extern int __afl_ngram_instrumented __attribute__((weak));
+u32        __afl_ngram_mask;
+
 struct cmp_map *__afl_cmp_map;
 struct cmp_map *__afl_cmp_map_backup;
+static u8       __afl_cmplog_delta;
+
+/* CMPLOG_SWITCH_ENV_VAR: the cmplog map, which __afl_cmp_map only points to
+   in the runs afl-fuzz asks for with FS_RUN_CMPLOG */
+static struct cmp_map *__afl_cmp_map_switch;
+
+/* the negotiated cmp_map geometry, see cmplog.h */
+static u32                  __afl_cmp_map_w = CMP_MAP_W;
+static u32                  __afl_cmp_map_h = CMP_MAP_H;
+static struct cmp_operands *__afl_cmp_log;
+static struct cmp_delta    *__afl_cmp_delta;
+
+#define CMP_LOG(k) (__afl_cmp_log + (k) * __afl_cmp_map_h)
 
 /* Child pid? */
 
@@ -212,6 +385,23 @@ u32 __afl_already_initialized_init;
 
 static int __afl_dummy_fd[2] = {2, 2};
 
+/* Pages area_is_valid() found readable in the current run, so compares of
+   the same buffers do not probe them again. Direct mapped, an entry is the
+   page address with the low bit set. Emptied for every persistent mode
+   iteration, as the target may unmap buffers between runs. */
+
+#define CMPLOG_PAGES 64
+
+static uintptr_t __afl_cmplog_pages[CMPLOG_PAGES];
+static uintptr_t __afl_page_mask;
+static u32       __afl_page_shift;
+
+static inline void cmplog_pages_reset(void) {
+  if (unlikely(__afl_cmp_map != NULL)) {
+    memset(__afl_cmplog_pages, 0, sizeof(__afl_cmplog_pages));
+  }
+}
+
 /* ensure we kill the child on termination */
 
 static void at_exit(int signal) {
@@ -257,6 +447,137 @@ static void send_forkserver_error(int error) {
   if (write(FORKSRV_FD + 1, (char *)&status, 4) != 4) { return; }
 }
 
+/* PCGUARD N-gram edges reach up to the guard IDs rounded up to a power of
+   two, minus one. */
+
+static void __afl_ngram_fit(void) {
+  u32 mask = __afl_final_loc;
+
+  if (!&__afl_ngram_instrumented || !mask) { return; }
+
+  mask |= mask >> 1;
+  mask |= mask >> 2;
+  mask |= mask >> 4;
+  mask |= mask >> 8;
+  mask |= mask >> 16;
+  __afl_final_loc = __afl_ngram_mask = mask;
+}
+
+/* A PCGUARD target built with AFL_LLVM_MAP_ADDR counts into the fixed map
+   address without a pointer load, so the range must be mapped before any
+   instrumented code runs: __afl_auto_first() reserves it, the guards of
+   each module grow it, and __afl_map_shm() puts the shared map in its
+   place. There is no pointer to redirect if the range is taken, so the
+   target stops with an error then instead of writing into foreign memory. */
+
+static u32 __afl_map_reserved;
+
+static void __afl_map_fixed_fit(u32 size) {
+  u8 *want, *ptr;
+  u32 len;
+
+  if (&__afl_ngram_instrumented) {
+    u32 pow2 = 1;
+    while (pow2 < size) {
+      pow2 <<= 1;
+    }
+    size = pow2;
+  }
+
+  size = (size + 0xffff) & ~0xffffU;
+  if (size <= __afl_map_reserved) { return; }
+
+  want = (u8 *)__afl_map_addr + __afl_map_reserved;
+  len = size - __afl_map_reserved;
+  ptr = (u8 *)mmap(want, len, PROT_READ | PROT_WRITE,
+                   MAP_FIXED_NOREPLACE | MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (ptr != want) {
+    if (ptr != MAP_FAILED) { munmap(ptr, len); }
+    fprintf(stderr,
+            "[-] FATAL: the fixed coverage map at 0x%llx is taken, rebuild "
+            "the target with another AFL_LLVM_MAP_ADDR.\n",
+            __afl_map_addr);
+    send_forkserver_error(FS_ERROR_MAP_ADDR);
+    _exit(1);
+  }
+
+  __afl_map_reserved = size;
+}
+
+/* The hit counts of AFL_LLVM_BUCKETED_COUNTS need one byte per map byte. */
+
+static void __afl_count_fit(void) {
+  if (!__afl_bucket_modules || __afl_map_size <= __afl_count_size) { return; }
+
+  u8 *counts = (u8 *)calloc(__afl_map_size, 1);
+
+  if (!counts) {
+    fprintf(stderr,
+            "Error: AFL++ could not acquire %u bytes of memory, exiting!\n",
+            __afl_map_size);
+    exit(-1);
+  }
+
+  memcpy(counts, __afl_count_ptr, __afl_count_size);
+  if (__afl_count_ptr != __afl_count_initial) { free(__afl_count_ptr); }
+
+  __afl_count_ptr = counts;
+  __afl_count_size = __afl_map_size;
+}
+
+/* The map gets hit counts from now on. convert also turns the buckets the
+   current run stored so far into its counts, for a child that loads a
+   module without buckets. afl-fuzz learns it from the doorbell after the
+   run, the forkserver before it forks the next child. */
+
+static void __afl_buckets_off(u8 convert) {
+  u32 i;
+
+  for (i = 0; i < 256; ++i) {
+    __afl_bucket_lut[i] = i;
+  }
+
+  __afl_buckets = 0;
+  __afl_buckets_raw = 1;
+
+  if (convert && __afl_area_ptr != __afl_area_ptr_dummy) {
+    u32 end = MIN(__afl_map_size, __afl_count_size);
+
+    for (i = 0; i < end; ++i) {
+      if (__afl_area_ptr[i]) { __afl_area_ptr[i] = __afl_count_ptr[i]; }
+    }
+  }
+
+  if (__afl_doorbell) {
+    __atomic_store_n(&__afl_doorbell->buckets, 0, __ATOMIC_RELEASE);
+  }
+}
+
+/* A module registers its guards, the map has buckets while all of them are
+   bucketed. Once off they stay off, even if only bucketed modules follow. */
+
+static void __afl_buckets_register(u8 bucketed) {
+  if (bucketed) {
+    ++__afl_bucket_modules;
+    if (!__afl_buckets_raw) { __afl_buckets = 1; }
+    __afl_count_fit();
+
+  } else {
+    ++__afl_plain_modules;
+  }
+
+  if (__afl_buckets && __afl_plain_modules) {
+    if (__afl_debug) {
+      fprintf(stderr,
+              "DEBUG: a module has no AFL_LLVM_BUCKETED_COUNTS, the map gets "
+              "hit counts\n");
+    }
+
+    __afl_buckets_off(__afl_already_initialized_forkserver);
+  }
+}
+
 /* SHM fuzzing setup. */
 
 static void __afl_map_shm_fuzz() {
@@ -281,8 +602,16 @@ static void __afl_map_shm_fuzz() {
       exit(1);
     }
 
-    map =
-        (u8 *)mmap(0, MAX_FILE + sizeof(u32), PROT_READ, MAP_SHARED, shm_fd, 0);
+    /* writable, batches copy their testcases in here; it is larger than
+       MAX_FILE with AFL_LARGE_INPUTS */
+    struct stat st;
+    size_t      size = MAX_FILE + sizeof(u32);
+
+    if (!fstat(shm_fd, &st) && (size_t)st.st_size > size) {
+      size = st.st_size;
+    }
+
+    map = (u8 *)mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
 
 #else
     u32 shm_id = atoi(id_str);
@@ -312,152 +641,559 @@ static void __afl_map_shm_fuzz() {
   }
 }
 
-/* SHM setup. */
+/* Map the shared memory for testcase batches, on failure we just do not
+   take part in batching. */
 
-static void __afl_map_shm(void) {
-  if (__afl_already_initialized_shm) return;
-  __afl_already_initialized_shm = 1;
+static void __afl_map_shm_batch(void) {
+  char *id_str = getenv(SHM_BATCH_ENV_VAR);
+  u8   *map = NULL;
 
-  // if we are not running in afl ensure the map exists
-  if (!__afl_area_ptr) { __afl_area_ptr = __afl_area_ptr_dummy; }
+  if (!id_str) { return; }
 
-  char *id_str = getenv(SHM_ENV_VAR);
+#ifdef USEMMAP
+  int shm_fd = shm_open(id_str, O_RDWR, DEFAULT_PERMISSION);
+  if (shm_fd == -1) { return; }
 
-  if (__afl_final_loc) {
-    __afl_map_size = ++__afl_final_loc;  // as we count starting 0
+  map = (u8 *)mmap(0, sizeof(struct fs_batch), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, shm_fd, 0);
+  close(shm_fd);
 
-    if (getenv("AFL_DUMP_MAP_SIZE")) {
-      printf("%u\n", __afl_map_size);
-      exit(-1);
-    }
+#else
+  map = (u8 *)shmat(atoi(id_str), NULL, 0);
 
-    if (__afl_final_loc > MAP_SIZE) {
-      char *ptr;
-      u32   val = 0;
-      if ((ptr = getenv("AFL_MAP_SIZE")) != NULL) { val = atoi(ptr); }
-      if (val < __afl_final_loc) {
-        if (__afl_final_loc > FS_OPT_MAX_MAPSIZE) {
-          if (!getenv("AFL_QUIET"))
-            fprintf(stderr,
-                    "Error: AFL++ tools *require* to set AFL_MAP_SIZE to %u "
-                    "to be able to run this instrumented program!\n",
-                    __afl_final_loc);
+#endif
 
-          if (id_str) {
-            send_forkserver_error(FS_ERROR_MAP_SIZE);
-            exit(-1);
-          }
+  if (!map || map == (void *)-1) {
+    if (__afl_debug) { fprintf(stderr, "DEBUG: could not map the batch\n"); }
+    return;
+  }
 
-        } else {
-          if (__afl_final_loc > MAP_INITIAL_SIZE && !getenv("AFL_QUIET")) {
-            fprintf(stderr,
-                    "Warning: AFL++ tools might need to set AFL_MAP_SIZE to %u "
-                    "to be able to run this instrumented program if this "
-                    "crashes!\n",
-                    __afl_final_loc);
-          }
-        }
-      }
-    }
+  __afl_batch = (struct fs_batch *)map;
 
-  } else {
-    if (getenv("AFL_DUMP_MAP_SIZE")) {
-      printf("%u\n", MAP_SIZE);
-      exit(-1);
-    }
+  if (__afl_debug) { fprintf(stderr, "DEBUG: using testcase batches\n"); }
+}
+
+/* Map the shared memory for field hints, on failure the hints of the
+   harness are just dropped. */
+
+static void __afl_map_shm_hints(void) {
+  char *id_str = getenv(HINT_SHM_ENV_VAR);
+  u8   *map = NULL;
+
+  if (!id_str) { return; }
+
+#ifdef USEMMAP
+  int shm_fd = shm_open(id_str, O_RDWR, DEFAULT_PERMISSION);
+  if (shm_fd == -1) { return; }
+
+  map = (u8 *)mmap(0, sizeof(struct fs_hints), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, shm_fd, 0);
+  close(shm_fd);
+  if (map == MAP_FAILED) { map = NULL; }
+
+#else
+  map = (u8 *)shmat(atoi(id_str), NULL, 0);
+
+#endif
+
+  if (!map || map == (void *)-1) {
+    if (__afl_debug) { fprintf(stderr, "DEBUG: could not map the hints\n"); }
+    return;
   }
 
-  if (__afl_sharedmem_fuzzing && (!id_str || !getenv(SHM_FUZZ_ENV_VAR) ||
-                                  fcntl(FORKSRV_FD, F_GETFD) == -1 ||
-                                  fcntl(FORKSRV_FD + 1, F_GETFD) == -1)) {
+  __afl_hints = (struct fs_hints *)map;
+
+  if (__afl_debug) { fprintf(stderr, "DEBUG: recording field hints\n"); }
+}
+
+/* Map the copy of the virgin map (AFL_TARGET_NOVELTY), on failure afl-fuzz
+   just checks every run itself. */
+
+static void __afl_map_shm_virgin(void) {
+  char             *id_str = getenv(VIRGIN_SHM_ENV_VAR);
+  struct fs_virgin *v = NULL;
+
+  if (!id_str) { return; }
+
+#ifdef USEMMAP
+  size_t size;
+  int    shm_fd = shm_open(id_str, O_RDWR, DEFAULT_PERMISSION);
+  if (shm_fd == -1) { return; }
+
+  /* the header tells how large the map is */
+  v = (struct fs_virgin *)mmap(0, sizeof(struct fs_virgin), PROT_READ,
+                               MAP_SHARED, shm_fd, 0);
+  if (v == MAP_FAILED) {
+    close(shm_fd);
+    return;
+  }
+
+  size = sizeof(struct fs_virgin) + v->size;
+  munmap((void *)v, sizeof(struct fs_virgin));
+  v = (struct fs_virgin *)mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                               shm_fd, 0);
+  close(shm_fd);
+  if (v == MAP_FAILED) { v = NULL; }
+
+#else
+  v = (struct fs_virgin *)shmat(atoi(id_str), NULL, 0);
+
+#endif
+
+  if (!v || v == (void *)-1) {
     if (__afl_debug) {
-      fprintf(stderr,
-              "DEBUG: running not inside afl-fuzz, disabling shared memory "
-              "testcases\n");
+      fprintf(stderr, "DEBUG: could not map the virgin map\n");
     }
 
-    __afl_sharedmem_fuzzing = 0;
+    return;
   }
 
-  if (!id_str) {
-    u32 val = 0;
-    u8 *ptr;
+  __afl_virgin = v;
 
-    if ((ptr = getenv("AFL_MAP_SIZE")) != NULL) { val = atoi(ptr); }
+  if (__afl_debug) { fprintf(stderr, "DEBUG: checking for new coverage\n"); }
+}
 
-    if (val > MAP_INITIAL_SIZE) {
-      __afl_map_size = val;
+/* The bucket of a hit count, as classify_counts() in afl-fuzz has it. */
 
-    } else {
-      if (__afl_first_final_loc > MAP_INITIAL_SIZE) {
-        // done in second stage constructor
-        __afl_map_size = __afl_first_final_loc;
+static inline u8 __afl_count_class(u8 cnt) {
+  if (cnt <= 2) { return cnt; }
+  if (cnt == 3) { return 4; }
+  if (cnt <= 7) { return 8; }
+  if (cnt <= 15) { return 16; }
+  if (cnt <= 31) { return 32; }
+  if (cnt <= 127) { return 64; }
+  return 128;
+}
 
-      } else {
-        __afl_map_size = MAP_INITIAL_SIZE;
+/* Whether map bytes [i, end) have a bucket that is still virgin. i is a
+   multiple of 64. */
+
+static inline u32 __afl_virgin_range(u8 *map, u8 *virgin, u32 i, u32 end) {
+  u32 j;
+
+  for (; i < end; i += 64) {
+    /* most of the map is untouched, skip it a cache line at a time */
+
+    if (i + 64 <= end) {
+      u64 *line = (u64 *)(map + i);
+
+      if (!(line[0] | line[1] | line[2] | line[3] | line[4] | line[5] |
+            line[6] | line[7])) {
+        continue;
       }
     }
 
-    if (__afl_map_size > MAP_INITIAL_SIZE && __afl_final_loc < __afl_map_size) {
-      __afl_final_loc = __afl_map_size;
-    }
+    for (j = i; j < i + 64 && j < end; ++j) {
+      if (!map[j]) { continue; }
 
-    if (__afl_debug) {
-      fprintf(stderr, "DEBUG: (0) init map size is %u to %p\n", __afl_map_size,
-              __afl_area_ptr_dummy);
+      if (__afl_buckets) {
+        if (map[j] & virgin[j]) { return 1; }
+
+      } else if (__afl_count_class(map[j]) & virgin[j]) {
+        return 1;
+      }
     }
   }
 
-  /* If we're running under AFL, attach to the appropriate region, replacing the
-     early-stage __afl_area_initial region that is needed to allow some really
-     hacky .init code to work correctly in projects such as OpenSSL. */
+  return 0;
+}
 
-  if (__afl_debug) {
-    fprintf(
-        stderr,
-        "DEBUG: (1) id_str %s, __afl_area_ptr %p, __afl_area_initial %p, "
-        "__afl_area_ptr_dummy %p, __afl_map_addr 0x%llx, MAP_SIZE %u, "
-        "__afl_final_loc %u, __afl_map_size %u, max_size_forkserver %u/0x%x\n",
-        id_str == NULL ? "<null>" : id_str, __afl_area_ptr, __afl_area_initial,
-        __afl_area_ptr_dummy, __afl_map_addr, MAP_SIZE, __afl_final_loc,
-        __afl_map_size, FS_OPT_MAX_MAPSIZE, FS_OPT_MAX_MAPSIZE);
+/* The verdict on this run for afl-fuzz: does the map have anything that is
+   not in its virgin map? With the dirty line map only the flagged lines can
+   have coverage. */
+
+static u32 __afl_virgin_check(void) {
+  struct fs_virgin *v = __afl_virgin;
+  u8               *map = __afl_area_ptr;
+
+  if (__atomic_load_n(&v->map_size, __ATOMIC_ACQUIRE) < __afl_map_size) {
+    return FS_VIRGIN_NEW;
   }
 
-  if (id_str) {
-    if (__afl_area_ptr && __afl_area_ptr != __afl_area_initial &&
-        __afl_area_ptr != __afl_area_ptr_dummy) {
-      if (__afl_map_addr) {
-        munmap((void *)__afl_map_addr, __afl_final_loc);
+  if (__afl_dirty_shm) {
+    u8 *dirty = __afl_dirty_ptr;
+    u32 lines = DIRTY_LINES_SIZE(__afl_map_size), l, i;
 
-      } else {
-        free(__afl_area_ptr);
+    for (l = 0; l < lines; ++l) {
+      if (!(l & 7) && l + 8 <= lines && !*(u64 *)(dirty + l)) {
+        l += 7;
+        continue;
       }
 
-      __afl_area_ptr = __afl_area_ptr_dummy;
+      if (dirty[l]) {
+        i = l << DIRTY_LINE_SHIFT;
+        if (__afl_virgin_range(
+                map, v->map, i,
+                MIN(i + (1U << DIRTY_LINE_SHIFT), __afl_map_size))) {
+          return FS_VIRGIN_NEW;
+        }
+      }
     }
 
-#ifdef USEMMAP
-    const char    *shm_file_path = id_str;
-    int            shm_fd = -1;
-    unsigned char *shm_base = NULL;
+    return FS_VIRGIN_BORING;
+  }
 
-    /* create the shared memory segment as if it was a file */
-    shm_fd = shm_open(shm_file_path, O_RDWR, DEFAULT_PERMISSION);
-    if (shm_fd == -1) {
-      fprintf(stderr, "shm_open() failed\n");
-      send_forkserver_error(FS_ERROR_SHM_OPEN);
-      exit(1);
-    }
+  return __afl_virgin_range(map, v->map, 0, __afl_map_size) ? FS_VIRGIN_NEW
+                                                             : FS_VIRGIN_BORING;
+}
 
-    /* map the shared memory segment to the address space of the process */
+/* Map the slots for pipelined runs and tell afl-fuzz that we can use them.
+   The batches, selective coverage and the dirty line map all work on the
+   one main map, so they do not pipeline. */
+
+static void __afl_map_shm_pipe(void) {
+#ifdef __linux__
+  char           *id_str = getenv(SHM_PIPE_ENV_VAR);
+  struct fs_pipe *pipe = NULL;
+
+  if (!id_str || !__afl_sharedmem_fuzzing || __afl_dirty_shm ||
+      __afl_selective_coverage || __afl_map_addr) {
+    return;
+  }
+
+  #ifdef USEMMAP
+  size_t size;
+  int    shm_fd = shm_open(id_str, O_RDWR, DEFAULT_PERMISSION);
+  if (shm_fd == -1) { return; }
+
+  /* the header tells how large the maps are */
+  pipe = (struct fs_pipe *)mmap(0, sizeof(struct fs_pipe), PROT_READ,
+                                MAP_SHARED, shm_fd, 0);
+  if (pipe == MAP_FAILED) {
+    close(shm_fd);
+    return;
+  }
+
+  size = FS_PIPE_SIZE(pipe->map_size);
+  munmap((void *)pipe, sizeof(struct fs_pipe));
+  pipe = (struct fs_pipe *)mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                                shm_fd, 0);
+  close(shm_fd);
+  if (pipe == MAP_FAILED) { return; }
+
+  #else
+  pipe = (struct fs_pipe *)shmat(atoi(id_str), NULL, 0);
+  if (pipe == (void *)-1) { return; }
+
+  #endif
+
+  if (pipe->map_size < __afl_map_size) {
+  #ifdef USEMMAP
+    munmap((void *)pipe, size);
+  #else
+    shmdt((void *)pipe);
+  #endif
+    return;
+  }
+
+  __afl_pipe = pipe;
+  __afl_doorbell->pipeline = 1;
+
+  if (__afl_debug) { fprintf(stderr, "DEBUG: using pipelined runs\n"); }
+#endif
+}
+
+/* Switch the harness over to a private copy of the testcase once afl-fuzz
+   accepted the doorbell, or drop the slots. */
+
+static void __afl_start_pipe(void) {
+  static u32 len;
+  u8        *buf;
+
+  if (!__afl_fuzz_ptr || !__afl_doorbell) {
+    __afl_pipe = NULL;
+    return;
+  }
+
+  if (!(buf = (u8 *)malloc(MAX_FILE))) {
+    fprintf(stderr, "Error: AFL++ could not allocate the testcase copy\n");
+    _exit(1);
+  }
+
+  __afl_pipe_shm_ptr = __afl_fuzz_ptr;
+  __afl_pipe_shm_len = __afl_fuzz_len;
+  __afl_pipe_area_ptr = __afl_area_ptr;
+  __afl_fuzz_ptr = buf;
+  __afl_fuzz_len = &len;
+}
+
+/* Take the testcase and map of the slot that afl-fuzz set for this run. */
+
+static void __afl_pipe_select(void) {
+  u32 slot = __atomic_load_n(&__afl_doorbell->slot, __ATOMIC_ACQUIRE);
+
+  if (slot) {
+    *__afl_fuzz_len = __afl_pipe->len[slot - 1];
+    memcpy(__afl_fuzz_ptr, __afl_pipe->data[slot - 1], *__afl_fuzz_len);
+    __afl_area_ptr = FS_PIPE_MAP(__afl_pipe, slot - 1);
+
+  } else {
+    *__afl_fuzz_len = *__afl_pipe_shm_len;
+    memcpy(__afl_fuzz_ptr, __afl_pipe_shm_ptr, *__afl_fuzz_len);
+    __afl_area_ptr = __afl_pipe_area_ptr;
+  }
+}
+
+/* Map the doorbell afl-fuzz passed and tell it that we can use it. */
+
+static void __afl_map_doorbell(void) {
+#ifdef __linux__
+  char *fd_str = getenv(DOORBELL_ENV_VAR);
+
+  if (!fd_str) { return; }
+
+  int   fd = atoi(fd_str);
+  void *map = mmap(NULL, sizeof(struct fs_doorbell), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+
+  close(fd);
+  unsetenv(DOORBELL_ENV_VAR);
+  if (map == MAP_FAILED) { return; }
+
+  __afl_doorbell = (struct fs_doorbell *)map;
+  __afl_map_shm_pipe();
+  __atomic_store_n(&__afl_doorbell->magic, FS_DOORBELL_MAGIC, __ATOMIC_SEQ_CST);
+#endif
+}
+
+/* Move the non-zero words in [i, end) of the map to the batch deltas. */
+
+static inline void __afl_batch_words(struct fs_batch *b, u32 *map, u32 i,
+                                     u32 end) {
+  for (; i < end; ++i) {
+    /* most of the map is untouched, skip it a cache line at a time */
+
+    if (!(i & 15) && i + 16 <= end) {
+      u64 *line = (u64 *)(map + i);
+
+      if (!(line[0] | line[1] | line[2] | line[3] | line[4] | line[5] |
+            line[6] | line[7])) {
+        i += 15;
+        continue;
+      }
+    }
+
+    if (map[i]) {
+      b->delta[b->deltas].idx = i;
+      b->delta[b->deltas].val = map[i];
+      ++b->deltas;
+      map[i] = 0;
+    }
+  }
+}
+
+/* Called instead of stopping after a run in persistent mode: if there is
+   another testcase in the current batch, save the coverage of this one as
+   deltas, load the next one and return 1. With the dirty line map only the
+   lines the run flagged are looked at, and their flags are reset, so that
+   afl-fuzz sees the lines of the last testcase only. */
+
+static u32 __afl_batch_next(void) {
+  struct fs_batch *b = __afl_batch;
+  u32              next = __afl_batch_pos + 1;
+  u32              words = (__afl_map_size + 3) >> 2;
+  u32             *map = (u32 *)__afl_area_ptr;
+  u64              now;
+
+  if (next >= b->count || b->deltas + 2 * words > FS_BATCH_DELTAS) {
+    return 0;
+  }
+
+  if (__afl_dirty_shm) {
+    u8 *dirty = __afl_dirty_ptr;
+    u32 lines = DIRTY_LINES_SIZE(__afl_map_size), l, i;
+
+    for (l = 0; l < lines; ++l) {
+      if (!(l & 7) && l + 8 <= lines && !*(u64 *)(dirty + l)) {
+        l += 7;
+        continue;
+      }
+
+      if (dirty[l]) {
+        dirty[l] = 0;
+        i = l << (DIRTY_LINE_SHIFT - 2);
+        __afl_batch_words(b, map, i,
+                          MIN(i + (1U << (DIRTY_LINE_SHIFT - 2)), words));
+      }
+    }
+
+    /* like afl-fuzz does, the first map byte is set outside of the
+       instrumentation */
+    dirty[0] = 1;
+
+  } else {
+    __afl_batch_words(b, map, 0, words);
+  }
+
+  now = __afl_batch_now();
+  b->delta_end[__afl_batch_pos] = b->deltas;
+  b->us[__afl_batch_pos] = (u32)MIN(now - __afl_batch_time, 0xffffffffULL);
+  b->done = next;
+  __afl_batch_time = now;
+
+  *__afl_fuzz_len = b->len[next];
+  memcpy(__afl_fuzz_ptr, b->data + b->off[next], b->len[next]);
+
+  __afl_batch_pos = next;
+  return 1;
+}
+
+/* SHM setup. */
+
+static void __afl_map_shm(void) {
+  if (__afl_already_initialized_shm) return;
+  __afl_already_initialized_shm = 1;
+
+  // if we are not running in afl ensure the map exists
+  if (!__afl_area_ptr) { __afl_area_ptr = __afl_area_ptr_dummy; }
+
+  char *id_str = getenv(SHM_ENV_VAR);
+
+  __afl_ngram_fit();
+
+  if (__afl_final_loc) {
+    __afl_map_size = ++__afl_final_loc;  // as we count starting 0
+
+    if (getenv("AFL_DUMP_MAP_SIZE")) {
+      printf("%u\n", __afl_map_size);
+      exit(-1);
+    }
+
+    if (__afl_final_loc > MAP_SIZE) {
+      char *ptr;
+      u32   val = 0;
+      if ((ptr = getenv("AFL_MAP_SIZE")) != NULL) { val = atoi(ptr); }
+      if (val < __afl_final_loc) {
+        if (__afl_final_loc > FS_OPT_MAX_MAPSIZE) {
+          if (!getenv("AFL_QUIET"))
+            fprintf(stderr,
+                    "Error: AFL++ tools *require* to set AFL_MAP_SIZE to %u "
+                    "to be able to run this instrumented program!\n",
+                    __afl_final_loc);
+
+          if (id_str) {
+            send_forkserver_error(FS_ERROR_MAP_SIZE);
+            exit(-1);
+          }
+
+        } else {
+          if (__afl_final_loc > MAP_INITIAL_SIZE && !getenv("AFL_QUIET")) {
+            fprintf(stderr,
+                    "Warning: AFL++ tools might need to set AFL_MAP_SIZE to %u "
+                    "to be able to run this instrumented program if this "
+                    "crashes!\n",
+                    __afl_final_loc);
+          }
+        }
+      }
+    }
+
+  } else {
+    if (getenv("AFL_DUMP_MAP_SIZE")) {
+      printf("%u\n", MAP_SIZE);
+      exit(-1);
+    }
+  }
+
+  if (__afl_sharedmem_fuzzing && (!id_str || !getenv(SHM_FUZZ_ENV_VAR) ||
+                                  fcntl(FORKSRV_FD, F_GETFD) == -1 ||
+                                  fcntl(FORKSRV_FD + 1, F_GETFD) == -1)) {
+    if (__afl_debug) {
+      fprintf(stderr,
+              "DEBUG: running not inside afl-fuzz, disabling shared memory "
+              "testcases\n");
+    }
+
+    __afl_sharedmem_fuzzing = 0;
+  }
+
+  if (!id_str) {
+    u32 val = 0;
+    u8 *ptr;
+
+    if ((ptr = getenv("AFL_MAP_SIZE")) != NULL) { val = atoi(ptr); }
+
+    if (val > MAP_INITIAL_SIZE) {
+      __afl_map_size = val;
+
+    } else {
+      if (__afl_first_final_loc > MAP_INITIAL_SIZE) {
+        // done in second stage constructor
+        __afl_map_size = __afl_first_final_loc;
+
+      } else {
+        __afl_map_size = MAP_INITIAL_SIZE;
+      }
+    }
+
+    if (__afl_map_size > MAP_INITIAL_SIZE && __afl_final_loc < __afl_map_size) {
+      __afl_final_loc = __afl_map_size;
+    }
+
+    if (__afl_debug) {
+      fprintf(stderr, "DEBUG: (0) init map size is %u to %p\n", __afl_map_size,
+              __afl_area_ptr_dummy);
+    }
+  }
+
+  /* If we're running under AFL, attach to the appropriate region, replacing the
+     early-stage __afl_area_initial region that is needed to allow some really
+     hacky .init code to work correctly in projects such as OpenSSL. */
+
+  if (__afl_debug) {
+    fprintf(
+        stderr,
+        "DEBUG: (1) id_str %s, __afl_area_ptr %p, __afl_area_initial %p, "
+        "__afl_area_ptr_dummy %p, __afl_map_addr 0x%llx, MAP_SIZE %u, "
+        "__afl_final_loc %u, __afl_map_size %u, max_size_forkserver %u/0x%x\n",
+        id_str == NULL ? "<null>" : id_str, __afl_area_ptr, __afl_area_initial,
+        __afl_area_ptr_dummy, __afl_map_addr, MAP_SIZE, __afl_final_loc,
+        __afl_map_size, FS_OPT_MAX_MAPSIZE, FS_OPT_MAX_MAPSIZE);
+  }
+
+  if (id_str) {
+    if (__afl_map_reserved) {
+      munmap((void *)__afl_map_addr, __afl_map_reserved);
+      __afl_map_reserved = 0;
+      __afl_area_ptr = __afl_area_ptr_dummy;
+
+    } else if (__afl_area_ptr && __afl_area_ptr != __afl_area_initial &&
+               __afl_area_ptr != __afl_area_ptr_dummy) {
+      if (__afl_map_addr) {
+        munmap((void *)__afl_map_addr, __afl_final_loc);
+
+      } else {
+        free(__afl_area_ptr);
+      }
+
+      __afl_area_ptr = __afl_area_ptr_dummy;
+    }
+
+#ifdef USEMMAP
+    const char    *shm_file_path = id_str;
+    int            shm_fd = -1;
+    unsigned char *shm_base = NULL;
+    struct stat    st;
+    u32            len = __afl_map_size;
+
+    /* create the shared memory segment as if it was a file */
+    shm_fd = shm_open(shm_file_path, O_RDWR, DEFAULT_PERMISSION);
+    if (shm_fd == -1) {
+      fprintf(stderr, "shm_open() failed\n");
+      send_forkserver_error(FS_ERROR_SHM_OPEN);
+      exit(1);
+    }
+
+    /* with AFL_MAP_SIZE_MAX the map has room to grow, map all of it */
+    if (!fstat(shm_fd, &st) && st.st_size > len) { len = st.st_size; }
+
+    /* map the shared memory segment to the address space of the process */
     if (__afl_map_addr) {
-      shm_base =
-          mmap((void *)__afl_map_addr, __afl_map_size, PROT_READ | PROT_WRITE,
-               MAP_FIXED_NOREPLACE | MAP_SHARED, shm_fd, 0);
+      shm_base = mmap((void *)__afl_map_addr, len, PROT_READ | PROT_WRITE,
+                      MAP_FIXED_NOREPLACE | MAP_SHARED, shm_fd, 0);
 
     } else {
-      shm_base = mmap(0, __afl_map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
-                      shm_fd, 0);
+      shm_base = mmap(0, len, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
     }
 
     close(shm_fd);
@@ -509,6 +1245,10 @@ static void __afl_map_shm(void) {
 
     __afl_area_ptr[0] = 1;
 
+  } else if (__afl_map_reserved) {
+    __afl_map_fixed_fit(__afl_map_size);
+    __afl_area_ptr = (u8 *)__afl_map_addr;
+
   } else if ((!__afl_area_ptr || __afl_area_ptr == __afl_area_initial) &&
 
              __afl_map_addr) {
@@ -626,8 +1366,79 @@ static void __afl_map_shm(void) {
       send_forkserver_error(FS_ERROR_SHM_OPEN);
       _exit(1);
     }
+
+    /* afl-fuzz asks for the geometry and delta mode, see cmplog.h */
+    char *geom = getenv(CMPLOG_MAP_ENV_VAR);
+    u32   w = geom ? atoi(geom) : 0, h = 0;
+
+    if (geom && strchr(geom, ':')) { h = atoi(strchr(geom, ':') + 1); }
+
+    if (w >= CMP_MAP_W_MIN && w <= CMP_MAP_W && !(w & (w - 1)) &&
+        h >= CMP_MAP_H_MIN && h <= CMP_MAP_H && !(h & (h - 1))) {
+      __afl_cmp_map_w = w;
+      __afl_cmp_map_h = h;
+      __afl_cmplog_delta = 1;
+    }
+
+    __afl_cmp_log = cmp_map_row(__afl_cmp_map, __afl_cmp_map_w,
+                                __afl_cmp_map_h, 0);
+    __afl_cmp_delta =
+        cmp_map_delta(__afl_cmp_map, __afl_cmp_map_w, __afl_cmp_map_h);
+
+    if (__afl_cmplog_delta) {
+      __afl_cmp_delta->geom = CMPLOG_GEOM(__afl_cmp_map_w, __afl_cmp_map_h);
+      __afl_cmp_delta->delta = CMPLOG_DELTA_MAGIC;
+    }
+
+    if (__afl_cmplog_delta && getenv(CMPLOG_SWITCH_ENV_VAR)) {
+      __afl_cmp_map_switch = __afl_cmp_map;
+      __afl_cmp_map = __afl_cmp_map_backup = NULL;
+      __afl_cmp_delta->toggle = CMPLOG_SWITCH_MAGIC;
+    }
+  }
+
+  if (&__afl_dirty_lines_instrumented) {
+    if (__afl_map_size > FS_OPT_MAX_MAPSIZE) {
+      u8 *dirty_dummy = (u8 *)calloc(DIRTY_LINES_SIZE(__afl_map_size), 1);
+      if (dirty_dummy) { __afl_dirty_ptr = dirty_dummy; }
+    }
+
+    id_str = getenv(DIRTY_SHM_ENV_VAR);
+
+    if (id_str) {
+#ifdef USEMMAP
+      int         shm_fd = shm_open(id_str, O_RDWR, DEFAULT_PERMISSION);
+      u8         *shm_base = MAP_FAILED;
+      struct stat st;
+      u32         len = DIRTY_LINES_SIZE(__afl_map_size);
+
+      if (shm_fd != -1) {
+        if (!fstat(shm_fd, &st) && st.st_size > len) { len = st.st_size; }
+        shm_base = mmap(0, len, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+        close(shm_fd);
+      }
+
+#else
+      u8 *shm_base = (u8 *)shmat(atoi(id_str), NULL, 0);
+#endif
+
+      /* Not fatal, afl-fuzz just falls back to scanning the whole map. */
+
+      if (shm_base && shm_base != (void *)-1) {
+        __afl_dirty_ptr = shm_base;
+        __afl_dirty_shm = 1;
+
+      } else if (__afl_debug) {
+        fprintf(stderr, "DEBUG: could not map the dirty line map\n");
+      }
+    }
   }
 
+  __afl_count_fit();
+
+  __afl_map_shm_hints();
+  __afl_map_shm_virgin();
+
 #ifdef __AFL_CODE_COVERAGE
   char *pcmap_id_str = getenv("__AFL_PCMAP_SHM_ID");
 
@@ -684,6 +1495,11 @@ static void __afl_unmap_shm(void) {
   id_str = getenv(CMPLOG_SHM_ENV_VAR);
 
   if (id_str) {
+    if (__afl_cmp_map_switch) {
+      __afl_cmp_map = __afl_cmp_map_switch;
+      __afl_cmp_map_switch = NULL;
+    }
+
 #ifdef USEMMAP
 
     munmap((void *)__afl_cmp_map, __afl_map_size);
@@ -698,14 +1514,43 @@ static void __afl_unmap_shm(void) {
     __afl_cmp_map_backup = NULL;
   }
 
-  __afl_already_initialized_shm = 0;
-}
+  if (__afl_dirty_shm) {
+#ifdef USEMMAP
 
-#define write_error(text) write_error_with_location(text, __FILE__, __LINE__)
+    munmap((void *)__afl_dirty_ptr, DIRTY_LINES_SIZE(__afl_map_size));
 
-void write_error_with_location(char *text, char *filename, int linenumber) {
-  u8   *o = getenv("__AFL_OUT_DIR");
-  char *e = strerror(errno);
+#else
+
+    shmdt((void *)__afl_dirty_ptr);
+
+#endif
+
+    __afl_dirty_ptr = __afl_dirty_initial;
+    __afl_dirty_shm = 0;
+  }
+
+  if (__afl_hints) {
+#ifdef USEMMAP
+
+    munmap((void *)__afl_hints, sizeof(struct fs_hints));
+
+#else
+
+    shmdt((void *)__afl_hints);
+
+#endif
+
+    __afl_hints = NULL;
+  }
+
+  __afl_already_initialized_shm = 0;
+}
+
+#define write_error(text) write_error_with_location(text, __FILE__, __LINE__)
+
+void write_error_with_location(char *text, char *filename, int linenumber) {
+  u8   *o = getenv("__AFL_OUT_DIR");
+  char *e = strerror(errno);
 
   if (o) {
     char buf[4096];
@@ -724,6 +1569,212 @@ void write_error_with_location(char *text, char *filename, int linenumber) {
 }
 
 #ifdef __linux__
+/* For the crash signatures of afl-tmin (AFL_TMIN_SIGNATURE) and afl-triage:
+   a fatal signal that no sanitizer handles appends a report with the
+   faulting PC and its module as frame #0 to CRASH_SIG_ENV_VAR.<pid>, in the
+   format of the sanitizer reports. The handler then returns with the
+   default action restored, so the signal is raised again and kills the
+   child as before. */
+
+static char *__afl_crash_sig_path;
+
+/* dladdr() if the target has it, without needing _GNU_SOURCE or -ldl */
+
+struct __afl_dl_info {
+  const char *fname;
+  void       *fbase;
+  const char *sname;
+  void       *saddr;
+};
+
+extern int __afl_dladdr(const void *, struct __afl_dl_info *) __asm__("dladdr")
+    __attribute__((weak));
+
+static char *__afl_crash_sig_num(char *p, u64 v, u32 base) {
+  char tmp[24];
+  u32  n = 0;
+
+  do {
+    tmp[n++] = "0123456789abcdef"[v % base];
+    v /= base;
+
+  } while (v);
+
+  while (n) {
+    *p++ = tmp[--n];
+  }
+
+  return p;
+}
+
+static void __afl_crash_sig_handler(int sig, siginfo_t *si, void *ctx) {
+  char                 buf[2 * PATH_MAX + 64], *p;
+  u64                  pc = (u64)(uintptr_t)si->si_addr;
+  pid_t                pid = getpid();
+  int                  fd;
+  struct __afl_dl_info info;
+
+#if defined(__linux__) && defined(__x86_64__)
+  pc = ((ucontext_t *)ctx)->uc_mcontext.gregs[16];               /* RIP */
+#elif defined(__linux__) && defined(__i386__)
+  pc = ((ucontext_t *)ctx)->uc_mcontext.gregs[14];               /* EIP */
+#elif defined(__linux__) && defined(__aarch64__)
+  pc = ((ucontext_t *)ctx)->uc_mcontext.pc;
+#else
+  (void)ctx;
+#endif
+
+  p = stpcpy(buf, __afl_crash_sig_path);
+  *p++ = '.';
+  p = __afl_crash_sig_num(p, pid, 10);
+  *p = 0;
+
+  fd = open(buf, O_WRONLY | O_CREAT | O_APPEND, 0600);
+  if (fd < 0) { return; }
+
+  p = stpcpy(buf, "==");
+  p = __afl_crash_sig_num(p, pid, 10);
+  p = stpcpy(p, "==ERROR: AFL: signal ");
+  p = __afl_crash_sig_num(p, sig, 10);
+  p = stpcpy(p, "\n    #0 0x");
+  p = __afl_crash_sig_num(p, pc, 16);
+
+  /* the module and offset, as in unsymbolized sanitizer reports, hold
+     across runs with ASLR */
+
+  if (__afl_dladdr && __afl_dladdr((void *)(uintptr_t)pc, &info) &&
+      info.fname && strlen(info.fname) < PATH_MAX) {
+    p = stpcpy(p, "  (");
+    p = stpcpy(p, info.fname);
+    p = stpcpy(p, "+0x");
+    p = __afl_crash_sig_num(p, pc - (u64)(uintptr_t)info.fbase, 16);
+    *p++ = ')';
+  }
+
+  *p++ = '\n';
+
+  if (write(fd, buf, p - buf) < 0) {}
+  close(fd);
+}
+
+static void __afl_crash_sig_setup(void) {
+  static const int sigs[] = {SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT};
+  struct sigaction sa, old;
+  u32              i;
+
+  __afl_crash_sig_path = getenv(CRASH_SIG_ENV_VAR);
+  if (!__afl_crash_sig_path || strlen(__afl_crash_sig_path) >= PATH_MAX) {
+    return;
+  }
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = __afl_crash_sig_handler;
+  sa.sa_flags = SA_SIGINFO | SA_RESETHAND | SA_NODEFER;
+  sigemptyset(&sa.sa_mask);
+
+  for (i = 0; i < sizeof(sigs) / sizeof(sigs[0]); ++i) {
+    if (sigaction(sigs[i], NULL, &old) || old.sa_handler != SIG_DFL ||
+        (old.sa_flags & SA_SIGINFO)) {
+      continue;
+    }
+
+    sigaction(sigs[i], &sa, NULL);
+  }
+}
+
+/* The hang watchdog (AFL_HANG_WATCHDOG). Past the soft deadline in CPU time
+   the map is looked at every idle interval, and a run that touched no new
+   entries in one is taken to loop over known edges for good: it dies by
+   SIGVTALRM, which afl-fuzz counts as a timeout. It stays off if the target
+   handles SIGVTALRM itself, and with thread maps, whose counts only reach
+   the map at __AFL_LOOP() boundaries. */
+
+static struct itimerval __afl_watchdog;
+static u32              __afl_watchdog_seen;
+
+static u32 __afl_watchdog_count(void) {
+  u64 *map = (u64 *)__afl_area_ptr;
+  u32  i, cnt = 0, words = __afl_map_size >> 3;
+
+  for (i = 0; i < words; ++i) {
+    u64 w = map[i];
+
+    /* bit 7 of each byte that is not zero */
+    if (w) {
+      cnt += __builtin_popcountll(
+          (((w & 0x7f7f7f7f7f7f7f7fULL) + 0x7f7f7f7f7f7f7f7fULL) | w) &
+          0x8080808080808080ULL);
+    }
+  }
+
+  return cnt;
+}
+
+static void __afl_watchdog_handler(int sig) {
+  u32 seen;
+
+  (void)sig;
+
+  if (__afl_area_ptr == __afl_area_ptr_dummy ||
+      __atomic_load_n(&afl_tmaps, __ATOMIC_RELAXED)) {
+    return;
+  }
+
+  seen = __afl_watchdog_count();
+
+  if (seen != __afl_watchdog_seen) {
+    __afl_watchdog_seen = seen;
+    return;
+  }
+
+  signal(SIGVTALRM, SIG_DFL);
+  raise(SIGVTALRM);
+}
+
+/* Start the deadline for the run that follows, or stop it. */
+
+static void __afl_watchdog_arm(u8 on) {
+  struct itimerval off;
+
+  if (!__afl_watchdog.it_interval.tv_usec &&
+      !__afl_watchdog.it_interval.tv_sec) {
+    return;
+  }
+
+  __afl_watchdog_seen = (u32)-1;
+
+  memset(&off, 0, sizeof(off));
+  setitimer(ITIMER_VIRTUAL, on ? &__afl_watchdog : &off, NULL);
+}
+
+static void __afl_watchdog_setup(void) {
+  struct sigaction sa, old;
+  char            *ptr = getenv(HANG_WATCHDOG_ENV_VAR), *end;
+  u64              soft_ms, idle_ms = HANG_WATCHDOG_IDLE;
+
+  if (!ptr) { return; }
+
+  soft_ms = strtoull(ptr, &end, 10);
+  if (*end == ',') { idle_ms = strtoull(end + 1, NULL, 10); }
+  if (!soft_ms || !idle_ms) { return; }
+
+  if (sigaction(SIGVTALRM, NULL, &old) || old.sa_handler != SIG_DFL ||
+      (old.sa_flags & SA_SIGINFO)) {
+    return;
+  }
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = __afl_watchdog_handler;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGVTALRM, &sa, NULL);
+
+  __afl_watchdog.it_value.tv_sec = soft_ms / 1000;
+  __afl_watchdog.it_value.tv_usec = (soft_ms % 1000) * 1000;
+  __afl_watchdog.it_interval.tv_sec = idle_ms / 1000;
+  __afl_watchdog.it_interval.tv_usec = (idle_ms % 1000) * 1000;
+}
+
 static void __afl_start_snapshots(void) {
   static u8 tmp[4] = {0, 0, 0, 0};
   u32       status = 0;
@@ -742,6 +1793,7 @@ static void __afl_start_snapshots(void) {
   if (__afl_map_size <= FS_OPT_MAX_MAPSIZE)
     status |= (FS_OPT_SET_MAPSIZE(__afl_map_size) | FS_OPT_MAPSIZE);
   if (__afl_dictionary_len && __afl_dictionary) { status |= FS_OPT_AUTODICT; }
+  if (__afl_dirty_shm) { status |= FS_OPT_DIRTYLINES; }
   memcpy(tmp, &status, 4);
 
   if (write(FORKSRV_FD + 1, tmp, 4) != 4) { return; }
@@ -859,6 +1911,7 @@ static void __afl_start_snapshots(void) {
 
         close(FORKSRV_FD);
         close(FORKSRV_FD + 1);
+        __afl_watchdog_arm(1);
 
         if (!afl_snapshot_take(AFL_SNAPSHOT_MMAP | AFL_SNAPSHOT_FDS |
                                AFL_SNAPSHOT_REGS | AFL_SNAPSHOT_EXIT)) {
@@ -867,6 +1920,7 @@ static void __afl_start_snapshots(void) {
 
         __afl_area_ptr[0] = 1;
         memset(__afl_prev_loc, 0, NGRAM_SIZE_MAX * sizeof(PREV_LOC_T));
+        __afl_prev_ngram = 0;
 
         return;
       }
@@ -914,14 +1968,22 @@ static void __afl_start_forkserver(void) {
   if (__afl_already_initialized_forkserver) return;
   __afl_already_initialized_forkserver = 1;
 
+#ifdef __AFL_CODE_COVERAGE
+  afl_pc_focus_layout();
+#endif
+
   struct sigaction orig_action;
   sigaction(SIGTERM, NULL, &orig_action);
   old_sigterm_handler = orig_action.sa_handler;
   signal(SIGTERM, at_exit);
 
+  __afl_crash_sig_setup();
+  __afl_watchdog_setup();
+
 #ifdef __linux__
-  if (/*!is_persistent &&*/ !__afl_cmp_map && !getenv("AFL_NO_SNAPSHOT") &&
-      afl_snapshot_init() >= 0) {
+  if (/*!is_persistent &&*/ !__afl_cmp_map && !__afl_cmp_map_switch &&
+      !getenv("AFL_NO_SNAPSHOT") && afl_snapshot_init() >= 0) {
+    if (__afl_buckets) { __afl_buckets_off(0); }
     __afl_start_snapshots();
     return;
   }
@@ -946,12 +2008,62 @@ static void __afl_start_forkserver(void) {
   }
 
   if (__afl_sharedmem_fuzzing) { status_for_fsrv |= FS_OPT_SHDMEM_FUZZ; }
+  if (__afl_dirty_shm) { status_for_fsrv |= FS_OPT_DIRTYLINES; }
+
+  /* batches need a persistent loop and the shared memory testcase, and
+     afl-fuzz does not run the cmplog binary in batches */
+  if (is_persistent && __afl_sharedmem_fuzzing && !__afl_cmp_map) {
+    status_for_fsrv |= FS_OPT_BATCH;
+  }
+
+#ifdef AFL_USERSPACE_SNAPSHOT
+  /* without a persistent loop the children can snapshot themselves */
+  if (!is_persistent && getenv("AFL_USERSPACE_SNAPSHOT") &&
+      afl_usnap_supported()) {
+    __afl_usnap = 1;
+    status_for_fsrv |= FS_OPT_SNAPSHOT;
+  }
+
+#endif
+
   if (status_for_fsrv) {
     status_for_fsrv |= (FS_OPT_ENABLED | FS_OPT_NEWCMPLOG);
   }
 
+  /* together with the dirty lines and batches this would read as
+     FS_OPT_OLD_AFLPP_WORKAROUND, which afl-fuzz clears. Only the cmplog
+     binary is asked for FS_OPT_NEWCMPLOG, and that one has no batches. */
+  if ((status_for_fsrv & FS_OPT_OLD_AFLPP_WORKAROUND) ==
+      FS_OPT_OLD_AFLPP_WORKAROUND) {
+    status_for_fsrv &= ~FS_OPT_NEWCMPLOG;
+  }
+
   memcpy(tmp, &status_for_fsrv, 4);
 
+  __afl_map_doorbell();
+
+  /* the map only keeps the buckets if afl-fuzz knows about them */
+  if (__afl_buckets) {
+    if (__afl_doorbell) {
+      __afl_doorbell->buckets = 1;
+
+    } else {
+      __afl_buckets_off(0);
+    }
+  }
+
+#if defined(__AFL_CODE_COVERAGE) && defined(__linux__)
+  if (__afl_doorbell && __afl_filter_reloadable) {
+    __afl_doorbell->filter = 1;
+  }
+
+  if (__afl_doorbell && __afl_focus_end) {
+    __afl_doorbell->focus_start = __afl_focus_start;
+    __afl_doorbell->focus_end = __afl_focus_end;
+  }
+
+#endif
+
   /* Phone home and tell the parent that we're OK. If parent isn't there,
      assume we're not running in forkserver mode and just execute program. */
 
@@ -969,6 +2081,10 @@ static void __afl_start_forkserver(void) {
     if ((was_killed & (FS_OPT_ENABLED | FS_OPT_SHDMEM_FUZZ)) ==
         (FS_OPT_ENABLED | FS_OPT_SHDMEM_FUZZ)) {
       __afl_map_shm_fuzz();
+
+      if ((was_killed & FS_OPT_BATCH) == FS_OPT_BATCH) {
+        __afl_map_shm_batch();
+      }
     }
 
     if ((was_killed & (FS_OPT_ENABLED | FS_OPT_AUTODICT)) ==
@@ -1004,6 +2120,23 @@ static void __afl_start_forkserver(void) {
     }
   }
 
+  /* afl-fuzz accepted the doorbell before its reply, if at all */
+
+  if (__afl_doorbell &&
+      !__atomic_load_n(&__afl_doorbell->accepted, __ATOMIC_SEQ_CST)) {
+    munmap((void *)__afl_doorbell, sizeof(struct fs_doorbell));
+    __afl_doorbell = NULL;
+    if (__afl_buckets) { __afl_buckets_off(0); }
+  }
+
+  if (__afl_pipe) { __afl_start_pipe(); }
+
+#ifdef __linux__
+  pid_t afl_pid = getppid();
+  u32   go_seen = 0;
+  u32   spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? FS_DOORBELL_SPIN : 0;
+#endif
+
   while (1) {
     int status;
 
@@ -1012,6 +2145,20 @@ static void __afl_start_forkserver(void) {
     if (already_read_first) {
       already_read_first = 0;
 
+#ifdef __linux__
+    } else if (__afl_doorbell) {
+      /* sleep a second at a time to notice if afl-fuzz is gone */
+      struct fs_doorbell *db = __afl_doorbell;
+      while (!fs_doorbell_wait(&db->go, &db->go_sleeping, go_seen, spin,
+                               fs_doorbell_now_us() + 1000000)) {
+        if (getppid() != afl_pid) { _exit(1); }
+      }
+
+      ++go_seen;
+      was_killed = db->was_killed;
+      if (unlikely(db->timing)) { db->t_go = fs_doorbell_now_ns(); }
+#endif
+
     } else {
       if (read(FORKSRV_FD, &was_killed, 4) != 4) {
         // write_error("read from afl-fuzz");
@@ -1037,6 +2184,18 @@ static void __afl_start_forkserver(void) {
       counter++;
     }
 
+#endif
+
+    struct cmp_map *cmp_map = NULL;
+
+    if (__afl_cmp_map_switch) {
+      if (was_killed & FS_RUN_CMPLOG) { cmp_map = __afl_cmp_map_switch; }
+      was_killed &= ~FS_RUN_CMPLOG;
+    }
+
+#ifdef __AFL_CODE_COVERAGE
+    u32 filter_reload = was_killed & FS_RUN_FILTER;
+    was_killed &= ~FS_RUN_FILTER;
 #endif
 
     /* If we stopped the child in persistent mode, but there was a race
@@ -1051,6 +2210,58 @@ static void __afl_start_forkserver(void) {
       }
     }
 
+    /* A child keeps the cmplog map it was forked with, a stopped one that
+       does not have the one this run asks for is replaced. */
+
+    if (__afl_cmp_map_switch && cmp_map != __afl_cmp_map) {
+      if (child_stopped) {
+        child_stopped = 0;
+        kill(child_pid, SIGKILL);
+        if (waitpid(child_pid, &status, 0) < 0) {
+          write_error("waitpid for the cmplog switch");
+          _exit(1);
+        }
+      }
+
+      __afl_cmp_map = __afl_cmp_map_backup = cmp_map;
+    }
+
+#ifdef __AFL_CODE_COVERAGE
+    /* A new AFL_PC_FILTER_FILE, the stopped child has the old guards. */
+
+    if (filter_reload) {
+      if (child_stopped) {
+        child_stopped = 0;
+        kill(child_pid, SIGKILL);
+        if (waitpid(child_pid, &status, 0) < 0) {
+          write_error("waitpid for the filter reload");
+          _exit(1);
+        }
+      }
+
+      afl_pc_filter_reload();
+    }
+
+#endif
+
+    /* A child loaded a module without buckets, or afl-fuzz asks for hit
+       counts: the next children store them from the start, the stopped one
+       still has the buckets. */
+
+    if (unlikely(__afl_buckets) &&
+        !__atomic_load_n(&__afl_doorbell->buckets, __ATOMIC_ACQUIRE)) {
+      if (child_stopped) {
+        child_stopped = 0;
+        kill(child_pid, SIGKILL);
+        if (waitpid(child_pid, &status, 0) < 0) {
+          write_error("waitpid for the buckets switch");
+          _exit(1);
+        }
+      }
+
+      __afl_buckets_off(0);
+    }
+
     if (!child_stopped) {
       /* Once woken up, create a clone of our process. */
 
@@ -1070,6 +2281,12 @@ static void __afl_start_forkserver(void) {
 
         close(FORKSRV_FD);
         close(FORKSRV_FD + 1);
+        __afl_watchdog_arm(1);
+#ifdef AFL_USERSPACE_SNAPSHOT
+        /* every later run of this child comes back here */
+        if (__afl_usnap) { afl_usnap_take(); }
+#endif
+        if (__afl_pipe) { __afl_pipe_select(); }
         return;
       }
 
@@ -1079,16 +2296,28 @@ static void __afl_start_forkserver(void) {
 
       kill(child_pid, SIGCONT);
       child_stopped = 0;
+      if (__afl_doorbell) { __afl_doorbell->resumed = 1; }
     }
 
     /* In parent process: write PID to pipe, then wait for child. */
 
-    if (write(FORKSRV_FD + 1, &child_pid, 4) != 4) {
+    if (__afl_doorbell) {
+#ifdef __linux__
+      if (unlikely(__afl_doorbell->timing)) {
+        __afl_doorbell->t_forked = fs_doorbell_now_ns();
+      }
+
+      __afl_doorbell->pid = child_pid;
+      fs_doorbell_ring(&__afl_doorbell->st, &__afl_doorbell->st_sleeping);
+#endif
+
+    } else if (write(FORKSRV_FD + 1, &child_pid, 4) != 4) {
       write_error("write to afl-fuzz");
       _exit(1);
     }
 
-    if (waitpid(child_pid, &status, is_persistent ? WUNTRACED : 0) < 0) {
+    if (waitpid(child_pid, &status,
+                (is_persistent || __afl_usnap) ? WUNTRACED : 0) < 0) {
       write_error("waitpid");
       _exit(1);
     }
@@ -1101,13 +2330,53 @@ static void __afl_start_forkserver(void) {
 
     /* Relay wait status to pipe, then loop back. */
 
-    if (write(FORKSRV_FD + 1, &status, 4) != 4) {
+    if (__afl_doorbell) {
+#ifdef __linux__
+      if (unlikely(__afl_doorbell->timing)) {
+        __afl_doorbell->t_exited = fs_doorbell_now_ns();
+      }
+
+      __afl_doorbell->status = status;
+      fs_doorbell_ring(&__afl_doorbell->st, &__afl_doorbell->st_sleeping);
+#endif
+
+    } else if (write(FORKSRV_FD + 1, &status, 4) != 4) {
       write_error("writing to afl-fuzz");
       _exit(1);
     }
   }
 }
 
+/* Tell afl-fuzz the __AFL_LOOP() count when a child enters the loop, and
+   use the count afl-fuzz set instead, if any (include/fsdoorbell.h). */
+
+static u32 __afl_loop_start(u32 max_cnt) {
+  struct fs_doorbell *db = __afl_doorbell;
+  u32                 cnt;
+
+  if (!db) { return max_cnt; }
+
+  db->loop_max = max_cnt;
+  db->loop_iter = 0;
+  cnt = __atomic_load_n(&db->loop_cnt, __ATOMIC_RELAXED);
+
+  return cnt ? cnt : max_cnt;
+}
+
+/* Count the iteration that just finished for afl-fuzz. Returns 1 if that
+   reached the loop count afl-fuzz set, then the child leaves the loop. */
+
+static inline u32 __afl_loop_next(void) {
+  struct fs_doorbell *db = __afl_doorbell;
+  u32                 cnt;
+
+  if (!db) { return 0; }
+
+  cnt = __atomic_load_n(&db->loop_cnt, __ATOMIC_RELAXED);
+
+  return ++db->loop_iter >= cnt && cnt;
+}
+
 /* A simplified persistent mode handler, used as explained in
  * README.llvm.md. */
 
@@ -1121,22 +2390,55 @@ int __afl_persistent_loop(unsigned int max_cnt) {
        iteration, it's our job to erase any trace of whatever happened
        before the loop. */
 
+    afl_tmaps_merge();
     memset(__afl_area_ptr, 0, __afl_map_size);
     __afl_area_ptr[0] = 1;
     memset(__afl_prev_loc, 0, NGRAM_SIZE_MAX * sizeof(PREV_LOC_T));
+    __afl_prev_ngram = 0;
 
-    cycle_cnt = max_cnt;
+    cycle_cnt = __afl_loop_start(max_cnt);
     first_pass = 0;
     __afl_selective_coverage_temp = 1;
+    if (__afl_batch) { __afl_batch_time = __afl_batch_now(); }
+    __afl_watchdog_arm(1);
 
     return 1;
 
-  } else if (--cycle_cnt) {
+  } else if (!__afl_loop_next() && --cycle_cnt) {
+    cmplog_pages_reset();
+    afl_tmaps_merge();
+
+    if (__afl_batch && __afl_batch_next()) {
+      __afl_area_ptr[0] = 1;
+      memset(__afl_prev_loc, 0, NGRAM_SIZE_MAX * sizeof(PREV_LOC_T));
+      __afl_prev_ngram = 0;
+      __afl_selective_coverage_temp = 1;
+      __afl_watchdog_arm(1);
+
+      return 1;
+    }
+
+    /* the cmplog binary and pipelined runs do not use the main map as
+       afl-fuzz sees it */
+    if (__afl_virgin && !__afl_cmp_map && !__afl_pipe) {
+      __afl_virgin->verdict = __afl_virgin_check();
+    }
+
+    __afl_watchdog_arm(0);
     raise(SIGSTOP);
 
+    if (__afl_pipe) { __afl_pipe_select(); }
+
+    if (__afl_batch) {
+      __afl_batch_pos = 0;
+      __afl_batch_time = __afl_batch_now();
+    }
+
     __afl_area_ptr[0] = 1;
     memset(__afl_prev_loc, 0, NGRAM_SIZE_MAX * sizeof(PREV_LOC_T));
+    __afl_prev_ngram = 0;
     __afl_selective_coverage_temp = 1;
+    __afl_watchdog_arm(1);
 
     return 1;
 
@@ -1145,7 +2447,16 @@ int __afl_persistent_loop(unsigned int max_cnt) {
         follows the loop is not traced. We do that by pivoting back to the
         dummy output region. */
 
+    afl_tmaps_merge();
     __afl_area_ptr = __afl_area_ptr_dummy;
+    __afl_watchdog_arm(0);
+
+    /* a fixed map address cannot be pivoted, scratch memory replaces the
+       map there instead */
+    if (&__afl_map_addr_instrumented && __afl_already_initialized_shm) {
+      mmap((void *)__afl_map_addr, __afl_map_size, PROT_READ | PROT_WRITE,
+           MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
 
     return 0;
   }
@@ -1214,208 +2525,1147 @@ __attribute__((constructor(CTOR_PRIO))) void __afl_auto_early(void) {
   if (__afl_already_initialized_early) return;
   __afl_already_initialized_early = 1;
 
-  is_persistent = !!getenv(PERSIST_ENV_VAR);
+  is_persistent = !!getenv(PERSIST_ENV_VAR);
+
+  if (getenv("AFL_DISABLE_LLVM_INSTRUMENTATION")) return;
+
+  __afl_map_shm();
+}
+
+/* preset __afl_area_ptr #2 */
+
+__attribute__((constructor(1))) void __afl_auto_second(void) {
+  if (__afl_already_initialized_second) return;
+  __afl_already_initialized_second = 1;
+
+  if (getenv("AFL_DEBUG")) {
+    __afl_debug = 1;
+    fprintf(stderr, "DEBUG: debug enabled\n");
+    fprintf(stderr, "DEBUG: AFL++ afl-compiler-rt" VERSION "\n");
+  }
+
+  if (getenv("AFL_DISABLE_LLVM_INSTRUMENTATION")) return;
+  u8 *ptr;
+
+  if (__afl_final_loc > MAP_INITIAL_SIZE) {
+    __afl_first_final_loc = __afl_final_loc + 1;
+
+    if (__afl_area_ptr && __afl_area_ptr != __afl_area_initial)
+      free(__afl_area_ptr);
+
+    if (__afl_map_addr)
+      ptr = (u8 *)mmap((void *)__afl_map_addr, __afl_first_final_loc,
+                       PROT_READ | PROT_WRITE,
+                       MAP_FIXED_NOREPLACE | MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    else
+      ptr = (u8 *)malloc(__afl_first_final_loc);
+
+    if (ptr && (ssize_t)ptr != -1) {
+      __afl_area_ptr = ptr;
+      __afl_area_ptr_dummy = __afl_area_ptr;
+      __afl_area_ptr_backup = __afl_area_ptr;
+    }
+  }
+
+}  // ptr memleak report is a false positive
+
+/* preset __afl_area_ptr #1 - at constructor level 0 global variables have
+   not been set */
+
+__attribute__((constructor(0))) void __afl_auto_first(void) {
+  if (__afl_already_initialized_first) return;
+  __afl_already_initialized_first = 1;
+
+  /* the instrumentation writes there even when it is disabled */
+  if (&__afl_map_addr_instrumented && !__afl_map_addr) {
+    __afl_map_addr = __afl_map_addr_instrumented;
+    __afl_map_fixed_fit(MAP_INITIAL_SIZE);
+    __afl_area_ptr = __afl_area_ptr_backup = (u8 *)__afl_map_addr;
+  }
+
+  if (getenv("AFL_DISABLE_LLVM_INSTRUMENTATION")) return;
+
+  /*
+    u8 *ptr = (u8 *)malloc(MAP_INITIAL_SIZE);
+
+    if (ptr && (ssize_t)ptr != -1) {
+
+      __afl_area_ptr = ptr;
+      __afl_area_ptr_backup = __afl_area_ptr;
+
+    }
+
+  */
+
+}  // ptr memleak report is a false positive
+
+/* The following stuff deals with supporting -fsanitize-coverage=trace-pc-guard.
+   It remains non-operational in the traditional, plugin-backed LLVM mode.
+   For more info about 'trace-pc-guard', see README.llvm.md.
+
+   The first function (__sanitizer_cov_trace_pc_guard) is called back on every
+   edge (as opposed to every basic block). */
+
+void __sanitizer_cov_trace_pc_guard(uint32_t *guard) {
+  // For stability analysis, if you want to know to which function unstable
+  // edge IDs belong - uncomment, recompile+install llvm_mode, recompile
+  // the target. libunwind and libbacktrace are better solutions.
+  // Set AFL_DEBUG_CHILD=1 and run afl-fuzz with 2>file to capture
+  // the backtrace output
+  /*
+  uint32_t unstable[] = { ... unstable edge IDs };
+  uint32_t idx;
+  char bt[1024];
+  for (idx = 0; i < sizeof(unstable)/sizeof(uint32_t); i++) {
+
+    if (unstable[idx] == __afl_area_ptr[*guard]) {
+
+      int bt_size = backtrace(bt, 256);
+      if (bt_size > 0) {
+
+        char **bt_syms = backtrace_symbols(bt, bt_size);
+        if (bt_syms) {
+
+          fprintf(stderr, "DEBUG: edge=%u caller=%s\n", unstable[idx],
+  bt_syms[0]);
+          free(bt_syms);
+
+        }
+
+      }
+
+    }
+
+  }
+
+  */
+
+#if (LLVM_VERSION_MAJOR < 9)
+
+  __afl_area_ptr[*guard]++;
+
+#else
+
+  __afl_area_ptr[*guard] =
+      __afl_area_ptr[*guard] + 1 + (__afl_area_ptr[*guard] == 255 ? 1 : 0);
+
+#endif
+}
+
+#ifdef __AFL_CODE_COVERAGE
+/* Check that everything the image points to is within it. */
+
+static int afl_filter_valid(const u8 *img, size_t len) {
+  const FilterPCHeader *hdr = (const FilterPCHeader *)img;
+  const FilterPCModule *mod = (const FilterPCModule *)(hdr + 1);
+  u32                   i;
+
+  if (len < sizeof(FilterPCHeader) ||
+      memcmp(hdr->magic, FILTER_PC_MAGIC, sizeof(hdr->magic)) ||
+      hdr->modules > (len - sizeof(FilterPCHeader)) / sizeof(FilterPCModule)) {
+    return 0;
+  }
+
+  for (i = 0; i < hdr->modules; ++i) {
+    if ((mod[i].ranges_off & 7) || mod[i].ranges_off > len ||
+        mod[i].ranges_cnt > (len - mod[i].ranges_off) / sizeof(FilterPCRange) ||
+        mod[i].name_off >= len ||
+        !memchr(img + mod[i].name_off, 0, len - mod[i].name_off) ||
+        mod[i].build_id_len > sizeof(mod[i].build_id)) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+typedef struct {
+  u64   start, end;
+  char *name, *build_id;
+
+} FilterPCLine;
+
+static int afl_filter_line_cmp(const void *p1, const void *p2) {
+  const FilterPCLine *l1 = p1, *l2 = p2;
+  int                 r = strcmp(l1->name, l2->name);
+
+  if (!r) { r = strcmp(l1->build_id, l2->build_id); }
+  if (!r) { r = l1->start < l2->start ? -1 : l1->start > l2->start; }
+
+  return r;
+}
+
+static u32 afl_hex_bytes(const char *hex, u8 *out, u32 max) {
+  u32 n = 0;
+
+  while (n < max && isxdigit(hex[0]) && isxdigit(hex[1])) {
+    char byte[3] = {hex[0], hex[1], 0};
+    out[n++] = strtoul(byte, NULL, 16);
+    hex += 2;
+  }
+
+  return n;
+}
+
+/* Build the image from the text format of make_symbol_list.py, lines of
+   start, length, module, file, function and optionally the build-id, tab
+   separated. */
+
+static u8 *afl_filter_from_text(FILE *file, size_t *img_len) {
+  FilterPCLine   *lines = NULL;
+  FilterPCHeader *hdr;
+  FilterPCModule *mod;
+  FilterPCRange  *rng;
+  size_t          cnt = 0, alloc = 0, names = 0, i, j, len;
+  u32             modules = 0;
+  char           *line = NULL, *col[6];
+  size_t          line_len = 0;
+  u8             *img;
+
+  while (getline(&line, &line_len, file) > 0) {
+    line[strcspn(line, "\r\n")] = 0;
+
+    for (i = 0, col[0] = line; i < 5 && col[i]; ++i) {
+      col[i + 1] = strchr(col[i], '\t');
+      if (col[i + 1]) { *col[i + 1]++ = 0; }
+    }
+
+    if (i < 3) { continue; }
+    if (i < 5 || !col[5]) { col[5] = "-"; }
+
+    if (cnt == alloc) {
+      alloc = alloc ? alloc * 2 : 1024;
+      lines = realloc(lines, alloc * sizeof(FilterPCLine));
+      if (!lines) {
+        perror("Error allocating PC array");
+        return NULL;
+      }
+    }
+
+    lines[cnt].start = strtoull(col[0], NULL, 16);
+    lines[cnt].end = lines[cnt].start + strtoull(col[1], NULL, 10);
+    lines[cnt].name = strdup(col[2]);
+    lines[cnt].build_id = strdup(col[5]);
+    names += strlen(col[2]) + 1;
+    ++cnt;
+  }
+
+  free(line);
+
+  qsort(lines, cnt, sizeof(FilterPCLine), afl_filter_line_cmp);
+
+  for (i = 0; i < cnt; ++i) {
+    if (!i || strcmp(lines[i].name, lines[i - 1].name) ||
+        strcmp(lines[i].build_id, lines[i - 1].build_id)) {
+      ++modules;
+    }
+  }
+
+  len = sizeof(FilterPCHeader) + modules * sizeof(FilterPCModule);
+  len = (len + cnt * sizeof(FilterPCRange) + names + 7) & ~(size_t)7;
+  img = calloc(1, len);
+
+  if (!img) {
+    perror("Error allocating PC array");
+    return NULL;
+  }
+
+  hdr = (FilterPCHeader *)img;
+  memcpy(hdr->magic, FILTER_PC_MAGIC, sizeof(hdr->magic));
+  hdr->modules = modules;
+
+  mod = (FilterPCModule *)(hdr + 1) - 1;
+  rng = (FilterPCRange *)(mod + 1 + modules);
+  names = (u8 *)(rng + cnt) - img;
+
+  for (i = 0; i < cnt; ++i) {
+    if (!i || strcmp(lines[i].name, lines[i - 1].name) ||
+        strcmp(lines[i].build_id, lines[i - 1].build_id)) {
+      ++mod;
+      mod->ranges_off = (u8 *)rng - img;
+      mod->name_off = names;
+      mod->build_id_len =
+          afl_hex_bytes(lines[i].build_id, mod->build_id, sizeof(mod->build_id));
+      strcpy((char *)img + names, lines[i].name);
+      names += strlen(lines[i].name) + 1;
+
+    } else if (lines[i].start <= rng[-1].end) {
+      /* overlapping or adjacent, extend the previous range */
+
+      if (lines[i].end > rng[-1].end) { rng[-1].end = lines[i].end; }
+      continue;
+    }
+
+    rng->start = lines[i].start;
+    rng->end = lines[i].end;
+    ++rng;
+    ++mod->ranges_cnt;
+  }
+
+  for (j = 0; j < cnt; ++j) {
+    free(lines[j].name);
+    free(lines[j].build_id);
+  }
+
+  free(lines);
+
+  *img_len = len;
+  return img;
+}
+
+/* Read the filter file, NULL if it cannot be read. A corrupt binary file is
+   fatal unless it is reloaded, then the previous filter stays. */
+
+static u8 *afl_load_pc_filter(const char *filter_file, size_t *img_len,
+                              u8 *mmapped, u8 reload) {
+  struct stat st;
+  FILE       *file;
+  u8         *img;
+  int         fd;
+
+  fd = open(filter_file, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st)) {
+    perror("Error opening file");
+    if (fd >= 0) { close(fd); }
+    return NULL;
+  }
+
+  /* the binary format is used in place */
+
+  if ((size_t)st.st_size >= sizeof(FilterPCHeader)) {
+    img = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (img != MAP_FAILED) {
+      if (!memcmp(img, FILTER_PC_MAGIC, sizeof(FILTER_PC_MAGIC))) {
+        close(fd);
+
+        if (!afl_filter_valid(img, st.st_size)) {
+          fprintf(stderr, "ERROR: Corrupt AFL_PC_FILTER_FILE %s\n",
+                  filter_file);
+          if (!reload) { abort(); }
+          munmap(img, st.st_size);
+          return NULL;
+        }
+
+        *img_len = st.st_size;
+        *mmapped = 1;
+        return img;
+      }
+
+      munmap(img, st.st_size);
+    }
+  }
+
+  file = fdopen(fd, "r");
+  if (!file) {
+    perror("Error opening file");
+    close(fd);
+    return NULL;
+  }
+
+  img = afl_filter_from_text(file, img_len);
+  fclose(file);
+
+  *mmapped = 0;
+  return img;
+}
+
+void afl_read_pc_filter_file(const char *filter_file) {
+  __afl_filter_pcs = afl_load_pc_filter(filter_file, &__afl_filter_pcs_size,
+                                        &__afl_filter_pcs_mmapped, 0);
+}
+
+  #ifdef __linux__
+/* The GNU build-id in the notes from note to end. */
+
+static u32 afl_note_build_id(const u8 *note, const u8 *end, const u8 **id) {
+  while (note + sizeof(ElfW(Nhdr)) <= end) {
+    const ElfW(Nhdr) *nh = (const ElfW(Nhdr) *)note;
+    const u8 *name = note + sizeof(ElfW(Nhdr));
+    const u8 *desc = name + ((nh->n_namesz + 3) & ~3);
+
+    if (nh->n_type == NT_GNU_BUILD_ID && nh->n_namesz == 4 &&
+        !memcmp(name, "GNU", 4) && desc + nh->n_descsz <= end) {
+      *id = desc;
+      return nh->n_descsz;
+    }
+
+    note = desc + ((nh->n_descsz + 3) & ~3);
+  }
+
+  return 0;
+}
+
+/* What is added to the addresses of the module loaded at base. */
+
+static uintptr_t afl_module_bias(uintptr_t base) {
+  const ElfW(Ehdr) *eh = (const ElfW(Ehdr) *)base;
+  const ElfW(Phdr) *ph = (const ElfW(Phdr) *)(base + eh->e_phoff);
+  u32               i;
+
+  for (i = 0; i < eh->e_phnum; ++i) {
+    if (ph[i].p_type == PT_LOAD) {
+      return base - (ph[i].p_vaddr & ~(ph[i].p_align - 1));
+    }
+  }
+
+  return base;
+}
+
+  #endif
+
+/* The GNU build-id of the module loaded at base, from its program headers. */
+
+static u32 afl_module_build_id(uintptr_t base, const u8 **id) {
+  #ifdef __linux__
+  const ElfW(Ehdr) *eh = (const ElfW(Ehdr) *)base;
+  const ElfW(Phdr) *ph;
+  uintptr_t         bias;
+  u32               i, len;
+
+  if (!base || memcmp(eh->e_ident, ELFMAG, SELFMAG)) { return 0; }
+
+  ph = (const ElfW(Phdr) *)(base + eh->e_phoff);
+  bias = afl_module_bias(base);
+
+  for (i = 0; i < eh->e_phnum; ++i) {
+    if (ph[i].p_type != PT_NOTE) { continue; }
+
+    const u8 *note = (const u8 *)(bias + ph[i].p_vaddr);
+
+    if ((len = afl_note_build_id(note, note + ph[i].p_memsz, id))) {
+      return len;
+    }
+  }
+
+  #else
+  (void)base;
+  (void)id;
+  #endif
+
+  return 0;
+}
+
+/* The filter for a module, NULL if the file does not list it. */
+
+static const FilterPCModule *afl_filter_module(afl_module_info_t *mod_info) {
+  const FilterPCHeader *hdr = (const FilterPCHeader *)__afl_filter_pcs;
+  const FilterPCModule *mod = (const FilterPCModule *)(hdr + 1);
+  const u8             *id = NULL;
+  u32                   i, id_len;
+
+  id_len = afl_module_build_id(mod_info->base_address, &id);
+
+  for (i = 0; id_len && i < hdr->modules; ++i) {
+    if (mod[i].build_id_len == id_len && !memcmp(mod[i].build_id, id, id_len)) {
+      return mod + i;
+    }
+  }
+
+  /* a module with another build-id is not the one the filter was made for */
+
+  for (i = 0; i < hdr->modules; ++i) {
+    if ((!mod[i].build_id_len || !id_len) &&
+        strstr(mod_info->name,
+               (const char *)__afl_filter_pcs + mod[i].name_off)) {
+      return mod + i;
+    }
+  }
+
+  return NULL;
+}
+
+/* The ranges are looked up in the order of the PC table, which is mostly
+   ascending. So the search starts at the range of the previous PC, gallops
+   forward and ends with a branch-free binary search over what is left, a
+   merge of both lists for sorted PCs. *pos holds the range to start at and
+   gets the index of the range the PC may be in. */
+
+static u32 afl_locate(const u8 *img, const FilterPCModule *mod,
+                      uintptr_t needle, u64 *pos) {
+  const FilterPCRange *rng = (const FilterPCRange *)(img + mod->ranges_off);
+  const FilterPCRange *base;
+  u64                  cnt = mod->ranges_cnt, lo = *pos, hi, len, step = 1;
+
+  // all ranges before the start must end at or below the PC
+  if (lo > cnt || (lo && rng[lo - 1].end > needle)) { lo = 0; }
+
+  hi = lo;
+
+  while (hi < cnt && rng[hi].end <= needle) {
+    lo = hi + 1;
+    hi = lo + step;
+    step <<= 1;
+  }
+
+  hi = hi < cnt ? hi + 1 : cnt;
+
+  if (lo < hi) {
+    base = rng + lo;
+    len = hi - lo;
+
+    while (len > 1) {
+      u64 half = len >> 1;
+      base += base[half].end <= needle ? half : 0;
+      len -= half;
+    }
+
+    lo = base - rng + (base->end <= needle);
+  }
+
+  *pos = lo;
+  return lo < cnt && rng[lo].start <= needle;
+}
+
+u32 locate_in_pcs(const FilterPCModule *mod, uintptr_t needle, u64 *pos) {
+  return afl_locate(__afl_filter_pcs, mod, needle, pos);
+}
+
+static int afl_filter_range_cmp(const void *p1, const void *p2) {
+  const FilterPCRange *r1 = p1, *r2 = p2;
+
+  return r1->start < r2->start ? -1 : r1->start > r2->start;
+}
+
+/* The image of a filter for one module, from its ranges, which are sorted
+   and merged in place. */
+
+static u8 *afl_filter_image(const char *name, const u8 *id, u32 id_len,
+                            FilterPCRange *rng, u64 cnt, size_t *img_len) {
+  FilterPCHeader *hdr;
+  FilterPCModule *mod;
+  size_t          len, off = sizeof(FilterPCHeader) + sizeof(FilterPCModule);
+  u64             i, n = 0;
+  u8             *img;
+
+  qsort(rng, cnt, sizeof(FilterPCRange), afl_filter_range_cmp);
+
+  for (i = 0; i < cnt; ++i) {
+    if (n && rng[i].start <= rng[n - 1].end) {
+      if (rng[i].end > rng[n - 1].end) { rng[n - 1].end = rng[i].end; }
+
+    } else {
+      rng[n++] = rng[i];
+    }
+  }
+
+  len = (off + n * sizeof(FilterPCRange) + strlen(name) + 1 + 7) & ~(size_t)7;
+  img = calloc(1, len);
+  if (!img) { return NULL; }
+
+  hdr = (FilterPCHeader *)img;
+  memcpy(hdr->magic, FILTER_PC_MAGIC, sizeof(hdr->magic));
+  hdr->modules = 1;
+
+  mod = (FilterPCModule *)(hdr + 1);
+  mod->ranges_off = off;
+  mod->ranges_cnt = n;
+  mod->name_off = off + n * sizeof(FilterPCRange);
+  if (id_len <= sizeof(mod->build_id)) {
+    mod->build_id_len = id_len;
+    memcpy(mod->build_id, id, id_len);
+  }
+
+  memcpy(img + off, rng, n * sizeof(FilterPCRange));
+  strcpy((char *)img + mod->name_off, name);
+
+  *img_len = len;
+  return img;
+}
+
+  #ifdef __linux__
+/* AFL_PC_FILTER without the symbolizer of a sanitizer: the module relative
+   ranges of the functions in the symbol table of the module file whose name
+   contains the token. .symtab is used if there is one, .dynsym otherwise.
+   The DWARF line tables are not read, so file names do not match. Returns
+   -1 if the file cannot be read or is not the module that is loaded. */
+
+static s32 afl_elf_functions(afl_module_info_t *mod_info, const char *token,
+                             const u8 *id, u32 id_len, FilterPCRange **out,
+                             u64 *out_cnt) {
+  const ElfW(Ehdr) *eh;
+  const ElfW(Shdr) *sh, *symtab = NULL, *strtab;
+  const ElfW(Sym)  *sym;
+  FilterPCRange    *rng = NULL;
+  struct stat       st;
+  uintptr_t         bias = afl_module_bias(mod_info->base_address);
+  u64               i, cnt = 0, alloc = 0, syms;
+  u8               *elf;
+  int               fd;
+
+  // the main program is named as it was invoked
+  fd = open(mod_info->name, O_RDONLY);
+  if (fd < 0) { fd = open("/proc/self/exe", O_RDONLY); }
+  if (fd < 0) { return -1; }
+
+  if (fstat(fd, &st) || (size_t)st.st_size < sizeof(ElfW(Ehdr))) {
+    close(fd);
+    return -1;
+  }
+
+  elf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (elf == MAP_FAILED) { return -1; }
+
+  eh = (const ElfW(Ehdr) *)elf;
+  sh = (const ElfW(Shdr) *)(elf + eh->e_shoff);
+
+  if (memcmp(eh->e_ident, ELFMAG, SELFMAG) ||
+      eh->e_shentsize != sizeof(ElfW(Shdr)) || eh->e_shoff > st.st_size ||
+      eh->e_shnum > (st.st_size - eh->e_shoff) / sizeof(ElfW(Shdr))) {
+    goto bad;
+  }
+
+  for (i = 0; i < eh->e_shnum; ++i) {
+    if (sh[i].sh_offset > st.st_size ||
+        sh[i].sh_size > st.st_size - sh[i].sh_offset) {
+      if (sh[i].sh_type != SHT_NOBITS) { goto bad; }
+    }
+  }
+
+  // a file with another build-id is not the module that is loaded
+  if (id_len) {
+    for (i = 0; i < eh->e_shnum; ++i) {
+      const u8 *fid = NULL;
+
+      if (sh[i].sh_type == SHT_NOTE &&
+          afl_note_build_id(elf + sh[i].sh_offset,
+                            elf + sh[i].sh_offset + sh[i].sh_size,
+                            &fid) == id_len &&
+          !memcmp(fid, id, id_len)) {
+        break;
+      }
+    }
+
+    if (i == eh->e_shnum) { goto bad; }
+  }
+
+  for (i = 0; i < eh->e_shnum; ++i) {
+    if (sh[i].sh_type == SHT_SYMTAB) { symtab = sh + i; }
+    if (sh[i].sh_type == SHT_DYNSYM && !symtab) { symtab = sh + i; }
+  }
+
+  if (!symtab || symtab->sh_link >= eh->e_shnum) { goto bad; }
+
+  strtab = sh + symtab->sh_link;
+  sym = (const ElfW(Sym) *)(elf + symtab->sh_offset);
+  syms = symtab->sh_size / sizeof(ElfW(Sym));
+
+  for (i = 0; i < syms; ++i) {
+    // ELF32_ST_TYPE() is the same
+    if (ELF64_ST_TYPE(sym[i].st_info) != STT_FUNC || !sym[i].st_size ||
+        sym[i].st_shndx == SHN_UNDEF || sym[i].st_name >= strtab->sh_size ||
+        !memchr(elf + strtab->sh_offset + sym[i].st_name, 0,
+                strtab->sh_size - sym[i].st_name) ||
+        !strstr((const char *)elf + strtab->sh_offset + sym[i].st_name,
+                token)) {
+      continue;
+    }
+
+    if (cnt == alloc) {
+      FilterPCRange *more;
+
+      alloc = alloc ? alloc * 2 : 256;
+      more = realloc(rng, alloc * sizeof(FilterPCRange));
+      if (!more) { goto bad; }
+      rng = more;
+    }
+
+    rng[cnt].start = sym[i].st_value + bias - mod_info->base_address;
+    rng[cnt].end = rng[cnt].start + sym[i].st_size;
+    ++cnt;
+  }
+
+  munmap(elf, st.st_size);
+  *out = rng;
+  *out_cnt = cnt;
+  return 0;
+
+bad:
+  free(rng);
+  munmap(elf, st.st_size);
+  return -1;
+}
+
+  #endif
+
+/* AFL_PC_FILTER_CACHE: <dir>/<build-id>-<token hash>.pcf, the image of a
+   filter for the module, as AFL_PC_FILTER_FILE reads it too. */
+
+static char *afl_filter_cache_path(const u8 *id, u32 id_len,
+                                   const char *token) {
+  const char *dir = getenv("AFL_PC_FILTER_CACHE");
+  char       *path, *p;
+  u32         i;
+
+  if (!dir || !id_len) { return NULL; }
+
+  path = malloc(strlen(dir) + 2 * id_len + 24);
+  if (!path) { return NULL; }
+
+  p = path + sprintf(path, "%s/", dir);
+  for (i = 0; i < id_len; ++i) {
+    p += sprintf(p, "%02x", id[i]);
+  }
+
+  sprintf(p, "-%016llx.pcf",
+          (unsigned long long)XXH3_64bits(token, strlen(token)));
+
+  return path;
+}
+
+/* Write the cache file under another name first, other instances may be
+   starting at the same time. */
+
+static void afl_filter_cache_write(const char *path, const u8 *img,
+                                   size_t len) {
+  char   *tmp = malloc(strlen(path) + 16), *dir = getenv("AFL_PC_FILTER_CACHE");
+  ssize_t n = 0;
+  int                  fd;
+
+  if (!tmp) { return; }
+
+  mkdir(dir, 0755);
+  sprintf(tmp, "%s.%d", path, (int)getpid());
+
+  fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd >= 0) {
+    while ((size_t)n < len) {
+      ssize_t ret = write(fd, img + n, len - n);
+      if (ret <= 0) { break; }
+      n += ret;
+    }
+
+    close(fd);
+    if ((size_t)n != len || rename(tmp, path)) { unlink(tmp); }
+  }
+
+  free(tmp);
+}
+
+/* How AFL_PC_FILTER is applied to a module: with the image of the functions
+   it selects, from the cache or the ELF symbols, or with the symbolizer of
+   a sanitizer per PC, whose matches then go to the cache. */
+
+typedef struct {
+  u8            *img;
+  size_t         len;
+  u64            pos;
+  u8             mmapped;
+  const u8      *id;
+  u32            id_len;
+  char          *cache;
+  FilterPCRange *hits;
+  u64            hits_cnt, hits_alloc;
+
+} FilterPCSymbols;
+
+static void afl_symbols_open(FilterPCSymbols *sym, afl_module_info_t *mod_info,
+                             const char *token) {
+  const FilterPCModule *mod;
+
+  memset(sym, 0, sizeof(FilterPCSymbols));
+
+  sym->id_len = afl_module_build_id(mod_info->base_address, &sym->id);
+  if (sym->id_len > sizeof(mod->build_id)) { sym->id_len = 0; }
+  sym->cache = afl_filter_cache_path(sym->id, sym->id_len, token);
+
+  if (sym->cache && !access(sym->cache, R_OK) &&
+      (sym->img =
+           afl_load_pc_filter(sym->cache, &sym->len, &sym->mmapped, 1))) {
+    mod = (const FilterPCModule *)((const FilterPCHeader *)sym->img + 1);
+
+    if (((const FilterPCHeader *)sym->img)->modules == 1 &&
+        mod->build_id_len == sym->id_len &&
+        !memcmp(mod->build_id, sym->id, sym->id_len)) {
+      if (__afl_debug) {
+        fprintf(stderr, "DEBUG: AFL_PC_FILTER for %s from %s\n",
+                mod_info->name, sym->cache);
+      }
+
+      free(sym->cache);
+      sym->cache = NULL;
+      return;
+    }
+
+    if (sym->mmapped) {
+      munmap(sym->img, sym->len);
+
+    } else {
+      free(sym->img);
+    }
+
+    sym->img = NULL;
+  }
+
+  if (__sanitizer_symbolize_pc) { return; }
+
+  #ifdef __linux__
+  FilterPCRange *rng;
+  u64            cnt;
+
+  if (!afl_elf_functions(mod_info, token, sym->id, sym->id_len, &rng, &cnt)) {
+    sym->img = afl_filter_image(mod_info->name, sym->id, sym->id_len, rng,
+                                cnt, &sym->len);
+    sym->mmapped = 0;
+    free(rng);
+
+    if (sym->img && sym->cache) {
+      afl_filter_cache_write(sym->cache, sym->img, sym->len);
+    }
+  }
+
+  #endif
+
+  free(sym->cache);
+  sym->cache = NULL;
+
+  if (!sym->img) {
+    fprintf(stderr,
+            "WARNING: AFL_PC_FILTER cannot read the symbols of %s, it keeps "
+            "all of its coverage\n",
+            mod_info->name);
+  }
+}
+
+/* Whether the guard of a PC stays enabled, rel is the module relative PC. */
+
+static u8 afl_symbols_match(FilterPCSymbols *sym, const char *token,
+                            uintptr_t pc, uintptr_t rel) {
+  char PcDescr[1024];
+
+  if (sym->img) {
+    return afl_locate(sym->img,
+                      (const FilterPCModule *)((FilterPCHeader *)sym->img + 1),
+                      rel, &sym->pos);
+  }
+
+  if (!__sanitizer_symbolize_pc) { return 1; }
+
+  // This function is a part of the sanitizer run-time.
+  // To use it, link with AddressSanitizer or other sanitizer.
+  __sanitizer_symbolize_pc((void *)pc, "%p %F %L", PcDescr, sizeof(PcDescr));
+
+  if (!strstr(PcDescr, token)) { return 0; }
+
+  if (__afl_debug) {
+    fprintf(stderr, "DEBUG: Selective instrumentation match: %s (PC %p)\n",
+            PcDescr, (void *)pc);
+  }
+
+  if (sym->cache) {
+    if (sym->hits_cnt == sym->hits_alloc) {
+      FilterPCRange *more;
+
+      sym->hits_alloc = sym->hits_alloc ? sym->hits_alloc * 2 : 256;
+      more = realloc(sym->hits, sym->hits_alloc * sizeof(FilterPCRange));
+
+      if (!more) {
+        free(sym->cache);
+        sym->cache = NULL;
+        return 1;
+      }
+
+      sym->hits = more;
+    }
+
+    sym->hits[sym->hits_cnt].start = rel;
+    sym->hits[sym->hits_cnt++].end = rel + 1;
+  }
+
+  return 1;
+}
+
+/* Save what the symbolizer matched, so the next start needs no symbolizer. */
+
+static void afl_symbols_close(FilterPCSymbols *sym,
+                              afl_module_info_t *mod_info) {
+  if (sym->cache) {
+    u8    *img;
+    size_t len;
+
+    img = afl_filter_image(mod_info->name, sym->id, sym->id_len, sym->hits,
+                           sym->hits_cnt, &len);
+    if (img) {
+      afl_filter_cache_write(sym->cache, img, len);
+      free(img);
+    }
+  }
+
+  if (sym->mmapped) {
+    munmap(sym->img, sym->len);
 
-  if (getenv("AFL_DISABLE_LLVM_INSTRUMENTATION")) return;
+  } else {
+    free(sym->img);
+  }
 
-  __afl_map_shm();
+  free(sym->hits);
+  free(sym->cache);
 }
 
-/* preset __afl_area_ptr #2 */
+/* Set the guards of a module from the IDs it had before AFL_PC_FILTER_FILE,
+   disabling those the filter does not select. Without restore, the guards
+   it selects are left as they are. */
 
-__attribute__((constructor(1))) void __afl_auto_second(void) {
-  if (__afl_already_initialized_second) return;
-  __afl_already_initialized_second = 1;
+static void afl_pc_filter_apply(afl_module_info_t *mod_info, u8 restore) {
+  const PCTableEntry   *pcs = (const PCTableEntry *)mod_info->pcs_beg;
+  const FilterPCModule *filter =
+      __afl_filter_pcs ? afl_filter_module(mod_info) : NULL;
+  u64 filter_pos = 0;
+  u32 i, cnt = mod_info->stop - mod_info->start + 1;  // stop is the last
 
-  if (getenv("AFL_DEBUG")) {
-    __afl_debug = 1;
-    fprintf(stderr, "DEBUG: debug enabled\n");
-    fprintf(stderr, "DEBUG: AFL++ afl-compiler-rt" VERSION "\n");
+  if ((u64)((const PCTableEntry *)mod_info->pcs_end - pcs) < cnt) {
+    cnt = (const PCTableEntry *)mod_info->pcs_end - pcs;
   }
 
-  if (getenv("AFL_DISABLE_LLVM_INSTRUMENTATION")) return;
-  u8 *ptr;
+  if (filter && __afl_debug) {
+    fprintf(stderr, "DEBUG: PC filter for %s has %llu ranges\n",
+            mod_info->name, (unsigned long long)filter->ranges_cnt);
+  }
 
-  if (__afl_final_loc > MAP_INITIAL_SIZE) {
-    __afl_first_final_loc = __afl_final_loc + 1;
+  for (i = 0; i < cnt; ++i) {
+    // as in __sanitizer_cov_pcs_init, relative to the module
+    uintptr_t PC = pcs[i].PC - 1 - mod_info->base_address;
 
-    if (__afl_area_ptr && __afl_area_ptr != __afl_area_initial)
-      free(__afl_area_ptr);
+    if (!filter || locate_in_pcs(filter, PC, &filter_pos)) {
+      if (filter && __afl_debug)
+        fprintf(stderr,
+                "DEBUG: Selective instrumentation match: (PC %lx File "
+                "Index %llu PC Index %u)\n",
+                PC, (unsigned long long)filter_pos, i);
 
-    if (__afl_map_addr)
-      ptr = (u8 *)mmap((void *)__afl_map_addr, __afl_first_final_loc,
-                       PROT_READ | PROT_WRITE,
-                       MAP_FIXED_NOREPLACE | MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-    else
-      ptr = (u8 *)malloc(__afl_first_final_loc);
+      if (restore) { mod_info->start[i] = mod_info->guards[i]; }
 
-    if (ptr && (ssize_t)ptr != -1) {
-      __afl_area_ptr = ptr;
-      __afl_area_ptr_dummy = __afl_area_ptr;
-      __afl_area_ptr_backup = __afl_area_ptr;
+    } else {
+      // Null out the guard to disable this edge
+      mod_info->start[i] = 0;
     }
   }
+}
 
-}  // ptr memleak report is a false positive
+/* Keep the IDs the guards of a module have now. */
 
-/* preset __afl_area_ptr #1 - at constructor level 0 global variables have
-   not been set */
+static void afl_guards_copy(afl_module_info_t *mod_info) {
+  size_t guards_len = (mod_info->stop - mod_info->start + 1) * sizeof(u32);
 
-__attribute__((constructor(0))) void __afl_auto_first(void) {
-  if (__afl_already_initialized_first) return;
-  __afl_already_initialized_first = 1;
+  mod_info->guards = malloc(guards_len);
+  if (!mod_info->guards) {
+    perror("Error allocating the guard copy");
+    abort();
+  }
 
-  if (getenv("AFL_DISABLE_LLVM_INSTRUMENTATION")) return;
+  memcpy(mod_info->guards, mod_info->start, guards_len);
+}
 
-  /*
-    u8 *ptr = (u8 *)malloc(MAP_INITIAL_SIZE);
+/* Renumber the guards of a module that the filters left enabled to the next
+   IDs of the dense range, so the map only has to cover those. The IDs of a
+   module are above those of the modules before it and at least as many as
+   they kept, so the new IDs never collide with those of a module that is
+   still to be renumbered. */
 
-    if (ptr && (ssize_t)ptr != -1) {
+static void afl_pc_filter_compact(afl_module_info_t *mod_info, u32 first_id) {
+  const PCTableEntry *pcs = (const PCTableEntry *)mod_info->pcs_beg;
+  u32 i, cnt = mod_info->stop - mod_info->start + 1, kept;
+  u32 pcs_cnt = (const PCTableEntry *)mod_info->pcs_end - pcs;
 
-      __afl_area_ptr = ptr;
-      __afl_area_ptr_backup = __afl_area_ptr;
+  if (!__afl_compact_loc) { __afl_compact_loc = first_id - 1; }
+  kept = __afl_compact_loc;
+
+  for (i = 0; i < cnt; ++i) {
+    u32 id = mod_info->start[i] ? ++__afl_compact_loc : 0;
+
+    mod_info->start[i] = id;
+    if (mod_info->guards) { mod_info->guards[i] = id; }
 
+    if (id && __afl_pcmap_ptr && i < pcs_cnt) {
+      __afl_pcmap_ptr[id] = pcs[i].PC - 1 - mod_info->base_address;
     }
+  }
 
-  */
+  if (__afl_debug) {
+    fprintf(stderr, "DEBUG: compacted %s to %u of %u guards\n",
+            mod_info->name, __afl_compact_loc - kept, cnt);
+  }
+}
 
-}  // ptr memleak report is a false positive
+/* AFL_PC_FILTER_FOCUS: give the guards the filters selected the first IDs
+   and all other guards the IDs after them, over all modules at once, so
+   afl-fuzz can tell the focus set by the map index. The guards of a module
+   keep the IDs the filters left them until then. */
 
-/* The following stuff deals with supporting -fsanitize-coverage=trace-pc-guard.
-   It remains non-operational in the traditional, plugin-backed LLVM mode.
-   For more info about 'trace-pc-guard', see README.llvm.md.
+static void afl_pc_focus_layout(void) {
+  afl_module_info_t *mod_info;
+  u32                id, pass, i, cnt, pcs_cnt;
+  u8                 ok = !__afl_compact_off && !&__afl_ngram_instrumented;
 
-   The first function (__sanitizer_cov_trace_pc_guard) is called back on every
-   edge (as opposed to every basic block). */
+  if (!__afl_focus || !__afl_module_info) { return; }
 
-void __sanitizer_cov_trace_pc_guard(uint32_t *guard) {
-  // For stability analysis, if you want to know to which function unstable
-  // edge IDs belong - uncomment, recompile+install llvm_mode, recompile
-  // the target. libunwind and libbacktrace are better solutions.
-  // Set AFL_DEBUG_CHILD=1 and run afl-fuzz with 2>file to capture
-  // the backtrace output
-  /*
-  uint32_t unstable[] = { ... unstable edge IDs };
-  uint32_t idx;
-  char bt[1024];
-  for (idx = 0; i < sizeof(unstable)/sizeof(uint32_t); i++) {
+  for (mod_info = __afl_module_info; mod_info; mod_info = mod_info->next) {
+    if (!mod_info->mapped || !mod_info->guards) { ok = 0; }
+  }
 
-    if (unstable[idx] == __afl_area_ptr[*guard]) {
+  // without the layout, the coverage the filters disabled is given back
+  if (!ok) {
+    fprintf(stderr,
+            "WARNING: AFL_PC_FILTER_FOCUS cannot lay out the map (n-gram "
+            "coverage or modules it does not know), it is ignored\n");
 
-      int bt_size = backtrace(bt, 256);
-      if (bt_size > 0) {
+    for (mod_info = __afl_module_info; mod_info; mod_info = mod_info->next) {
+      if (mod_info->guards) {
+        memcpy(mod_info->start, mod_info->guards,
+               (mod_info->stop - mod_info->start + 1) * sizeof(u32));
+      }
+    }
 
-        char **bt_syms = backtrace_symbols(bt, bt_size);
-        if (bt_syms) {
+    return;
+  }
 
-          fprintf(stderr, "DEBUG: edge=%u caller=%s\n", unstable[idx],
-  bt_syms[0]);
-          free(bt_syms);
+  id = __afl_module_info->guards[0] - 1;
+  __afl_focus_start = id + 1;
 
+  for (pass = 0; pass < 2; ++pass) {
+    for (mod_info = __afl_module_info; mod_info; mod_info = mod_info->next) {
+      const PCTableEntry *pcs = (const PCTableEntry *)mod_info->pcs_beg;
+
+      cnt = mod_info->stop - mod_info->start + 1;
+      pcs_cnt = (const PCTableEntry *)mod_info->pcs_end - pcs;
+
+      for (i = 0; i < cnt; ++i) {
+        // the focus guards are the ones still set, then the others
+        if (pass ? mod_info->start[i] || !mod_info->guards[i]
+                 : !mod_info->start[i]) {
+          continue;
         }
 
-      }
+        mod_info->start[i] = ++id;
 
+        if (__afl_pcmap_ptr && i < pcs_cnt) {
+          __afl_pcmap_ptr[id] = pcs[i].PC - 1 - mod_info->base_address;
+        }
+      }
     }
 
+    if (!pass) { __afl_focus_end = id + 1; }
   }
 
-  */
+  __afl_final_loc = id;
+  if (__afl_already_initialized_shm) { __afl_map_size = __afl_final_loc + 1; }
 
-#if (LLVM_VERSION_MAJOR < 9)
+  if (__afl_debug) {
+    fprintf(stderr, "DEBUG: focus set is map %u-%u of %u\n",
+            __afl_focus_start, __afl_focus_end - 1, __afl_final_loc);
+  }
+}
 
-  __afl_area_ptr[*guard]++;
+/* Read AFL_PC_FILTER_FILE again for the children forked from now on. */
 
-#else
+/* Collect the functions of the mapped modules that have no guard left, by
+   the function entries of the PC tables. A function ends where the next
+   one starts, the last one a page after its last block. */
 
-  __afl_area_ptr[*guard] =
-      __afl_area_ptr[*guard] + 1 + (__afl_area_ptr[*guard] == 255 ? 1 : 0);
+static void afl_cmp_skip_build(void) {
+  afl_module_info_t *mod_info;
+  FilterPCRange     *fn;
+  u64                cnt = 0, n = 0, out = 0, max = 0, i, num, end;
 
-#endif
-}
+  free(__afl_cmp_skip);
+  __afl_cmp_skip = NULL;
+  __afl_cmp_skip_cnt = 0;
 
-#ifdef __AFL_CODE_COVERAGE
-void afl_read_pc_filter_file(const char *filter_file) {
-  FILE *file;
-  char  ch;
+  if (__afl_focus || getenv("AFL_PC_FILTER_CMPLOG_ALL")) { return; }
 
-  file = fopen(filter_file, "r");
-  if (file == NULL) {
-    perror("Error opening file");
-    return;
+  for (mod_info = __afl_module_info; mod_info; mod_info = mod_info->next) {
+    if (mod_info->mapped) {
+      cnt += (PCTableEntry *)mod_info->pcs_end -
+             (PCTableEntry *)mod_info->pcs_beg;
+    }
   }
 
-  // Check how many PCs we expect to read
-  while ((ch = fgetc(file)) != EOF) {
-    if (ch == '\n') { __afl_filter_pcs_size++; }
-  }
+  if (!cnt || !(fn = malloc(cnt * sizeof(FilterPCRange)))) { return; }
 
-  // Rewind to actually read the PCs
-  fseek(file, 0, SEEK_SET);
+  for (mod_info = __afl_module_info; mod_info; mod_info = mod_info->next) {
+    if (!mod_info->mapped) { continue; }
 
-  __afl_filter_pcs = malloc(__afl_filter_pcs_size * sizeof(FilterPCEntry));
-  if (!__afl_filter_pcs) {
-    perror("Error allocating PC array");
-    return;
-  }
+    PCTableEntry *pcs = (PCTableEntry *)mod_info->pcs_beg;
+    num = (PCTableEntry *)mod_info->pcs_end - pcs;
 
-  for (size_t i = 0; i < __afl_filter_pcs_size; i++) {
-    fscanf(file, "%lx", &(__afl_filter_pcs[i].start));
-    ch = fgetc(file);  // Read tab
-    fscanf(file, "%u", &(__afl_filter_pcs[i].len));
-    ch = fgetc(file);  // Read tab
-
-    if (!__afl_filter_pcs_module) {
-      // Read the module name and store it.
-      // TODO: We only support one module here right now although
-      // there is technically no reason to support multiple modules
-      // in one go.
-      size_t max_module_len = 255;
-      size_t i = 0;
-      __afl_filter_pcs_module = malloc(max_module_len);
-      while (i < max_module_len - 1 &&
-             (__afl_filter_pcs_module[i] = fgetc(file)) != '\t') {
-        ++i;
+    // end is 1 while the function has no guard left
+    for (i = 0; i < num; ++i) {
+      if (!i || (pcs[i].PCFlags & 1)) {
+        fn[n].start = pcs[i].PC;
+        fn[n++].end = 1;
       }
 
-      __afl_filter_pcs_module[i] = '\0';
-      fprintf(stderr, "DEBUGXXX: Read module name %s\n",
-              __afl_filter_pcs_module);
+      if (mod_info->start[i]) { fn[n - 1].end = 0; }
+      if (pcs[i].PC > max) { max = pcs[i].PC; }
+    }
+  }
+
+  qsort(fn, n, sizeof(FilterPCRange), afl_filter_range_cmp);
+
+  for (i = 0; i < n; ++i) {
+    if (!fn[i].end) { continue; }
+
+    end = i + 1 < n ? fn[i + 1].start : max + 4096;
+
+    if (out && fn[out - 1].end == fn[i].start) {
+      fn[out - 1].end = end;
+
+    } else {
+      fn[out].start = fn[i].start;
+      fn[out++].end = end;
     }
+  }
 
-    while ((ch = fgetc(file)) != '\n' && ch != EOF)
-      ;
+  if (!out) {
+    free(fn);
+    return;
   }
 
-  fclose(file);
+  __afl_cmp_skip = fn;
+  __afl_cmp_skip_cnt = out;
+
+  if (__afl_debug) {
+    fprintf(stderr, "DEBUG: cmplog skips %llu filtered address ranges\n",
+            out);
+  }
 }
 
-u32 locate_in_pcs(uintptr_t needle, u32 *index) {
-  size_t lower_bound = 0;
-  size_t upper_bound = __afl_filter_pcs_size - 1;
+static void afl_pc_filter_reload(void) {
+  const char *pc_filter_file = getenv("AFL_PC_FILTER_FILE");
+  size_t      img_len = 0;
+  u8          mmapped = 0;
+  u8         *img = afl_load_pc_filter(pc_filter_file, &img_len, &mmapped, 1);
+
+  if (!img) {
+    fprintf(stderr, "WARNING: Keeping the previous AFL_PC_FILTER_FILE\n");
+    return;
+  }
 
-  while (lower_bound < __afl_filter_pcs_size && lower_bound <= upper_bound) {
-    size_t current_index = lower_bound + (upper_bound - lower_bound) / 2;
+  if (__afl_filter_pcs_mmapped) {
+    munmap((void *)__afl_filter_pcs, __afl_filter_pcs_size);
 
-    if (__afl_filter_pcs[current_index].start <= needle) {
-      if (__afl_filter_pcs[current_index].start +
-              __afl_filter_pcs[current_index].len >
-          needle) {
-        // Hit
-        *index = current_index;
-        return 1;
+  } else {
+    free((void *)__afl_filter_pcs);
+  }
 
-      } else {
-        lower_bound = current_index + 1;
-      }
+  __afl_filter_pcs = img;
+  __afl_filter_pcs_size = img_len;
+  __afl_filter_pcs_mmapped = mmapped;
 
-    } else {
-      if (!current_index) { break; }
-      upper_bound = current_index - 1;
+  for (afl_module_info_t *mod_info = __afl_module_info; mod_info;
+       mod_info = mod_info->next) {
+    if (mod_info->mapped && mod_info->guards) {
+      afl_pc_filter_apply(mod_info, 1);
     }
   }
 
-  return 0;
+  afl_cmp_skip_build();
+
+  if (__afl_debug) {
+    fprintf(stderr, "DEBUG: reloaded AFL_PC_FILTER_FILE %s\n",
+            pc_filter_file);
+  }
 }
 
 void __sanitizer_cov_pcs_init(const uintptr_t *pcs_beg,
@@ -1476,6 +3726,19 @@ void __sanitizer_cov_pcs_init(const uintptr_t *pcs_beg,
     afl_read_pc_filter_file(pc_filter_file);
   }
 
+  // Renumber the guards that are left densely, unless a later filter is to
+  // enable guards that this one disables.
+  u8 compact = (pc_filter || pc_filter_file || __afl_filter_pcs) &&
+               !getenv("AFL_PC_FILTER_NO_COMPACT");
+
+  // In focus mode the map is laid out when the forkserver starts, the
+  // guards the filters disable get their IDs back then.
+  if ((pc_filter || pc_filter_file || __afl_filter_pcs) &&
+      getenv("AFL_PC_FILTER_FOCUS")) {
+    __afl_focus = 1;
+    compact = 0;
+  }
+
   // Now update the pcmap. If this is the last module coming in, after all
   // pre-loaded code, then this will also map all of our delayed previous
   // modules.
@@ -1495,9 +3758,17 @@ void __sanitizer_cov_pcs_init(const uintptr_t *pcs_beg,
     PCTableEntry *start = (PCTableEntry *)(mod_info->pcs_beg);
     PCTableEntry *end = (PCTableEntry *)(mod_info->pcs_end);
 
-    if (!*mod_info->stop) { continue; }
+    if (!*mod_info->stop) {
+      __afl_compact_off = 1;
+      continue;
+    }
+
+    u32             in_module_index = 0;
+    u32             orig_start_index = *mod_info->start;
+    FilterPCSymbols sym;
 
-    u32 in_module_index = 0;
+    if (pc_filter) { afl_symbols_open(&sym, mod_info, pc_filter); }
+    if (__afl_focus) { afl_guards_copy(mod_info); }
 
     while (start < end) {
       if (*mod_info->start + in_module_index >= __afl_map_size) {
@@ -1509,8 +3780,6 @@ void __sanitizer_cov_pcs_init(const uintptr_t *pcs_beg,
         abort();
       }
 
-      u32 orig_start_index = *mod_info->start;
-
       uintptr_t PC = start->PC;
 
       // This is what `GetPreviousInstructionPc` in sanitizer runtime does
@@ -1520,51 +3789,36 @@ void __sanitizer_cov_pcs_init(const uintptr_t *pcs_beg,
       // Calculate relative offset in module
       PC = PC - mod_info->base_address;
 
-      if (__afl_pcmap_ptr) {
+      if (__afl_pcmap_ptr && (!compact || __afl_compact_off)) {
         __afl_pcmap_ptr[orig_start_index + in_module_index] = PC;
       }
 
-      if (pc_filter) {
-        char PcDescr[1024];
-        // This function is a part of the sanitizer run-time.
-        // To use it, link with AddressSanitizer or other sanitizer.
-        __sanitizer_symbolize_pc((void *)start->PC, "%p %F %L", PcDescr,
-                                 sizeof(PcDescr));
-
-        if (strstr(PcDescr, pc_filter)) {
-          if (__afl_debug)
-            fprintf(
-                stderr,
-                "DEBUG: Selective instrumentation match: %s (PC %p Index %u)\n",
-                PcDescr, (void *)start->PC,
-                *(mod_info->start + in_module_index));
-          // No change to guard needed
-
-        } else {
-          // Null out the guard to disable this edge
-          *(mod_info->start + in_module_index) = 0;
-        }
-      }
-
-      if (__afl_filter_pcs && strstr(mod_info->name, __afl_filter_pcs_module)) {
-        u32 result_index;
-        if (locate_in_pcs(PC, &result_index)) {
-          if (__afl_debug)
-            fprintf(stderr,
-                    "DEBUG: Selective instrumentation match: (PC %lx File "
-                    "Index %u PC Index %u)\n",
-                    PC, result_index, in_module_index);
-
-        } else {
-          // Null out the guard to disable this edge
-          *(mod_info->start + in_module_index) = 0;
-        }
+      if (pc_filter && !afl_symbols_match(&sym, pc_filter, start->PC, PC)) {
+        // Null out the guard to disable this edge
+        *(mod_info->start + in_module_index) = 0;
       }
 
       start++;
       in_module_index++;
     }
 
+    if (pc_filter) { afl_symbols_close(&sym, mod_info); }
+
+    // The file filter works on a copy of the guards, so that a filter
+    // reloaded later can enable guards this one disables.
+    if (__afl_focus) {
+      if (__afl_filter_pcs) { afl_pc_filter_apply(mod_info, 0); }
+
+    } else if (pc_filter_file || __afl_filter_pcs) {
+      afl_guards_copy(mod_info);
+      afl_pc_filter_apply(mod_info, 1);
+      if (pc_filter_file) { __afl_filter_reloadable = 1; }
+    }
+
+    if (compact && !__afl_compact_off) {
+      afl_pc_filter_compact(mod_info, orig_start_index);
+    }
+
     mod_info->mapped = 1;
 
     if (__afl_debug) {
@@ -1574,16 +3828,59 @@ void __sanitizer_cov_pcs_init(const uintptr_t *pcs_beg,
               mod_info->name, in_module_index);
     }
   }
+
+  // The map now ends with the dense range, so the forkserver reports the
+  // smaller size and later modules continue after it.
+  if (compact && !__afl_compact_off && __afl_compact_loc &&
+      __afl_compact_loc < __afl_final_loc) {
+    __afl_final_loc = __afl_compact_loc;
+
+    if (__afl_already_initialized_shm) {
+      __afl_ngram_fit();
+      __afl_map_size = __afl_final_loc + 1;
+    }
+
+    if (__afl_debug) {
+      fprintf(stderr, "DEBUG: compacted map: __afl_final_loc = %u\n",
+              __afl_final_loc);
+    }
+  }
+
+  if (pc_filter || pc_filter_file || __afl_filter_pcs) { afl_cmp_skip_build(); }
 }
 
 #endif  // __AFL_CODE_COVERAGE
 
+/* Whether the guards of a library loaded after the forkserver is up fit
+   behind the others into the room afl-fuzz left in the shared map. Growing
+   means a new map layout, so the features which keep a copy of it or
+   derive the indices from the map size are left out. */
+
+static u8 __afl_map_growable(u32 guards) {
+#ifdef __AFL_CODE_COVERAGE
+  (void)guards;
+  return 0;
+#else
+  if (!__afl_doorbell || __afl_pipe || __afl_batch || __afl_virgin ||
+      &__afl_ngram_instrumented || &__afl_thread_maps_instrumented ||
+      __afl_area_ptr == __afl_area_ptr_dummy) {
+    return 0;
+  }
+
+  return (u64)__afl_final_loc + guards + 1 <=
+         __atomic_load_n(&__afl_doorbell->map_cap, __ATOMIC_RELAXED);
+#endif
+}
+
 /* Init callback. Populates instrumentation IDs. Note that we're using
    ID of 0 as a special value to indicate non-instrumented bits. That may
-   still touch the bitmap, but in a fairly harmless way. */
+   still touch the bitmap, but in a fairly harmless way. caller is the
+   module's ctor. */
 
-void __sanitizer_cov_trace_pc_guard_init(uint32_t *start, uint32_t *stop) {
+static void __afl_guard_init(uint32_t *start, uint32_t *stop, u8 bucketed,
+                             void *caller) {
   u32   inst_ratio = 100;
+  u8    grow = 0;
   char *x;
 
   _is_sancov = 1;
@@ -1603,14 +3900,20 @@ void __sanitizer_cov_trace_pc_guard_init(uint32_t *start, uint32_t *stop) {
         __afl_already_initialized_forkserver, *start);
   }
 
-  if (start == stop || *start) { return; }
+  if (start == stop) { return; }
+
+  /* also for the duplicate calls: a module that links bucketed and plain
+     objects calls both init functions for the same guards */
+  __afl_buckets_register(bucketed);
+
+  if (*start) { return; }
 
 #ifdef __AFL_CODE_COVERAGE
   u32               *orig_start = start;
   afl_module_info_t *mod_info = NULL;
 
   Dl_info dlinfo;
-  if (dladdr(__builtin_return_address(0), &dlinfo)) {
+  if (dladdr(caller, &dlinfo)) {
     if (__afl_already_initialized_forkserver) {
       fprintf(stderr, "[pcmap] Error: Module was not preloaded: %s\n",
               dlinfo.dli_fname);
@@ -1631,6 +3934,7 @@ void __sanitizer_cov_trace_pc_guard_init(uint32_t *start, uint32_t *stop) {
       mod_info->pcs_beg = NULL;
       mod_info->pcs_end = NULL;
       mod_info->mapped = 0;
+      mod_info->guards = NULL;
       mod_info->next = NULL;
 
       if (last_module_info) {
@@ -1650,6 +3954,9 @@ void __sanitizer_cov_trace_pc_guard_init(uint32_t *start, uint32_t *stop) {
     fprintf(stderr, "[pcmap] dladdr call failed\n");
   }
 
+  // the IDs of a module that is not known cannot be renumbered around
+  if (!mod_info) { __afl_compact_off = 1; }
+
 #endif  // __AFL_CODE_COVERAGE
 
   x = getenv("AFL_INST_RATIO");
@@ -1663,8 +3970,13 @@ void __sanitizer_cov_trace_pc_guard_init(uint32_t *start, uint32_t *stop) {
   }
 
   // If a dlopen of an instrumented library happens after the forkserver then
-  // we have a problem as we cannot increase the coverage map anymore.
-  if (__afl_already_initialized_forkserver) {
+  // we have a problem as we cannot increase the coverage map anymore, unless
+  // afl-fuzz left room for it (AFL_MAP_SIZE_MAX).
+  if (__afl_already_initialized_forkserver &&
+      __afl_map_growable(stop - start)) {
+    grow = 1;
+
+  } else if (__afl_already_initialized_forkserver) {
     if (!getenv("AFL_IGNORE_PROBLEMS")) {
       fprintf(
           stderr,
@@ -1741,7 +4053,19 @@ void __sanitizer_cov_trace_pc_guard_init(uint32_t *start, uint32_t *stop) {
             __afl_final_loc);
   }
 
+  if (grow) {
+    __afl_map_size = __afl_final_loc + 1;
+    __afl_count_fit();
+    __atomic_store_n(&__afl_doorbell->map_grow, __afl_map_size,
+                     __ATOMIC_RELEASE);
+    return;
+  }
+
+  if (__afl_map_reserved) { __afl_map_fixed_fit(__afl_final_loc + 1); }
+
   if (__afl_already_initialized_shm) {
+    __afl_ngram_fit();
+
     if (__afl_final_loc > __afl_map_size) {
       if (__afl_debug) {
         fprintf(stderr, "DEBUG: Reinit shm necessary (+%u)\n",
@@ -1756,8 +4080,56 @@ void __sanitizer_cov_trace_pc_guard_init(uint32_t *start, uint32_t *stop) {
   }
 }
 
+void __sanitizer_cov_trace_pc_guard_init(uint32_t *start, uint32_t *stop) {
+  __afl_guard_init(start, stop, 0, __builtin_return_address(0));
+}
+
+/* The same for AFL_LLVM_BUCKETED_COUNTS modules. */
+
+void __afl_bucketed_guard_init(uint32_t *start, uint32_t *stop) {
+  __afl_guard_init(start, stop, 1, __builtin_return_address(0));
+}
+
 ///// CmpLog instrumentation
 
+/* Whether a hook called from pc is to log nothing because the PC filters
+   disabled the function it is in. */
+
+#ifdef __AFL_CODE_COVERAGE
+static inline int cmplog_filtered(uintptr_t pc) {
+  u32 lo = 0, hi = __afl_cmp_skip_cnt;
+
+  if (likely(!hi)) { return 0; }
+
+  while (lo < hi) {
+    u32 mid = (lo + hi) >> 1;
+
+    if (__afl_cmp_skip[mid].end <= pc) {
+      lo = mid + 1;
+
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo < __afl_cmp_skip_cnt && __afl_cmp_skip[lo].start <= pc;
+}
+
+#else
+  #define cmplog_filtered(pc) 0
+#endif
+
+/* In delta mode list the keys whose header a run (re)initialized, see
+   struct cmp_map. */
+
+static inline void cmplog_touch(uintptr_t k) {
+  if (__afl_cmplog_delta) {
+    u32 n = __atomic_fetch_add(&__afl_cmp_delta->touched_cnt, 1,
+                               __ATOMIC_RELAXED);
+    if (likely(n < __afl_cmp_map_w)) { __afl_cmp_delta->touched[n] = k; }
+  }
+}
+
 void __cmplog_ins_hook1(uint8_t arg1, uint8_t arg2, uint8_t attr) {
   // fprintf(stderr, "hook1 arg0=%02x arg1=%02x attr=%u\n",
   //         (u8) arg1, (u8) arg2, attr);
@@ -1769,13 +4141,17 @@ void __cmplog_ins_hook1(uint8_t arg1, uint8_t arg2, uint8_t attr) {
   if (unlikely(!__afl_cmp_map || arg1 == arg2)) return;
 
   uintptr_t k = (uintptr_t)__builtin_return_address(0);
-  k = (uintptr_t)(default_hash((u8 *)&k, sizeof(uintptr_t)) & (CMP_MAP_W - 1));
+  if (unlikely(cmplog_filtered(k))) return;
+  k = (uintptr_t)(default_hash((u8 *)&k, sizeof(uintptr_t)) &
+                  (__afl_cmp_map_w - 1));
 
   u32 hits;
 
   if (__afl_cmp_map->headers[k].type != CMP_TYPE_INS) {
 
     __afl_cmp_map->headers[k].type = CMP_TYPE_INS;
+
+    cmplog_touch(k);
     hits = 0;
     __afl_cmp_map->headers[k].hits = 1;
     __afl_cmp_map->headers[k].shape = 0;
@@ -1788,9 +4164,9 @@ void __cmplog_ins_hook1(uint8_t arg1, uint8_t arg2, uint8_t attr) {
 
   __afl_cmp_map->headers[k].attribute = attr;
 
-  hits &= CMP_MAP_H - 1;
-  __afl_cmp_map->log[k][hits].v0 = arg1;
-  __afl_cmp_map->log[k][hits].v1 = arg2;
+  hits &= __afl_cmp_map_h - 1;
+  CMP_LOG(k)[hits].v0 = arg1;
+  CMP_LOG(k)[hits].v1 = arg2;
 
   */
 }
@@ -1799,12 +4175,15 @@ void __cmplog_ins_hook2(uint16_t arg1, uint16_t arg2, uint8_t attr) {
   if (unlikely(!__afl_cmp_map || arg1 == arg2)) return;
 
   uintptr_t k = (uintptr_t)__builtin_return_address(0);
-  k = (uintptr_t)(default_hash((u8 *)&k, sizeof(uintptr_t)) & (CMP_MAP_W - 1));
+  if (unlikely(cmplog_filtered(k))) return;
+  k = (uintptr_t)(default_hash((u8 *)&k, sizeof(uintptr_t)) &
+                  (__afl_cmp_map_w - 1));
 
   u32 hits;
 
   if (__afl_cmp_map->headers[k].type != CMP_TYPE_INS) {
     __afl_cmp_map->headers[k].type = CMP_TYPE_INS;
+    cmplog_touch(k);
     hits = 0;
     __afl_cmp_map->headers[k].hits = 1;
     __afl_cmp_map->headers[k].shape = 1;
@@ -1819,9 +4198,9 @@ void __cmplog_ins_hook2(uint16_t arg1, uint16_t arg2, uint8_t attr) {
 
   __afl_cmp_map->headers[k].attribute = attr;
 
-  hits &= CMP_MAP_H - 1;
-  __afl_cmp_map->log[k][hits].v0 = arg1;
-  __afl_cmp_map->log[k][hits].v1 = arg2;
+  hits &= __afl_cmp_map_h - 1;
+  CMP_LOG(k)[hits].v0 = arg1;
+  CMP_LOG(k)[hits].v1 = arg2;
 }
 
 void __cmplog_ins_hook4(uint32_t arg1, uint32_t arg2, uint8_t attr) {
@@ -1830,12 +4209,15 @@ void __cmplog_ins_hook4(uint32_t arg1, uint32_t arg2, uint8_t attr) {
   if (unlikely(!__afl_cmp_map || arg1 == arg2)) return;
 
   uintptr_t k = (uintptr_t)__builtin_return_address(0);
-  k = (uintptr_t)(default_hash((u8 *)&k, sizeof(uintptr_t)) & (CMP_MAP_W - 1));
+  if (unlikely(cmplog_filtered(k))) return;
+  k = (uintptr_t)(default_hash((u8 *)&k, sizeof(uintptr_t)) &
+                  (__afl_cmp_map_w - 1));
 
   u32 hits;
 
   if (__afl_cmp_map->headers[k].type != CMP_TYPE_INS) {
     __afl_cmp_map->headers[k].type = CMP_TYPE_INS;
+    cmplog_touch(k);
     hits = 0;
     __afl_cmp_map->headers[k].hits = 1;
     __afl_cmp_map->headers[k].shape = 3;
@@ -1850,9 +4232,9 @@ void __cmplog_ins_hook4(uint32_t arg1, uint32_t arg2, uint8_t attr) {
 
   __afl_cmp_map->headers[k].attribute = attr;
 
-  hits &= CMP_MAP_H - 1;
-  __afl_cmp_map->log[k][hits].v0 = arg1;
-  __afl_cmp_map->log[k][hits].v1 = arg2;
+  hits &= __afl_cmp_map_h - 1;
+  CMP_LOG(k)[hits].v0 = arg1;
+  CMP_LOG(k)[hits].v1 = arg2;
 }
 
 void __cmplog_ins_hook8(uint64_t arg1, uint64_t arg2, uint8_t attr) {
@@ -1861,12 +4243,15 @@ void __cmplog_ins_hook8(uint64_t arg1, uint64_t arg2, uint8_t attr) {
   if (unlikely(!__afl_cmp_map || arg1 == arg2)) return;
 
   uintptr_t k = (uintptr_t)__builtin_return_address(0);
-  k = (uintptr_t)(default_hash((u8 *)&k, sizeof(uintptr_t)) & (CMP_MAP_W - 1));
+  if (unlikely(cmplog_filtered(k))) return;
+  k = (uintptr_t)(default_hash((u8 *)&k, sizeof(uintptr_t)) &
+                  (__afl_cmp_map_w - 1));
 
   u32 hits;
 
   if (__afl_cmp_map->headers[k].type != CMP_TYPE_INS) {
     __afl_cmp_map->headers[k].type = CMP_TYPE_INS;
+    cmplog_touch(k);
     hits = 0;
     __afl_cmp_map->headers[k].hits = 1;
     __afl_cmp_map->headers[k].shape = 7;
@@ -1881,9 +4266,9 @@ void __cmplog_ins_hook8(uint64_t arg1, uint64_t arg2, uint8_t attr) {
 
   __afl_cmp_map->headers[k].attribute = attr;
 
-  hits &= CMP_MAP_H - 1;
-  __afl_cmp_map->log[k][hits].v0 = arg1;
-  __afl_cmp_map->log[k][hits].v1 = arg2;
+  hits &= __afl_cmp_map_h - 1;
+  CMP_LOG(k)[hits].v0 = arg1;
+  CMP_LOG(k)[hits].v1 = arg2;
 }
 
 #ifdef WORD_SIZE_64
@@ -1897,12 +4282,15 @@ void __cmplog_ins_hookN(uint128_t arg1, uint128_t arg2, uint8_t attr,
   if (unlikely(!__afl_cmp_map || arg1 == arg2)) return;
 
   uintptr_t k = (uintptr_t)__builtin_return_address(0);
-  k = (uintptr_t)(default_hash((u8 *)&k, sizeof(uintptr_t)) & (CMP_MAP_W - 1));
+  if (unlikely(cmplog_filtered(k))) return;
+  k = (uintptr_t)(default_hash((u8 *)&k, sizeof(uintptr_t)) &
+                  (__afl_cmp_map_w - 1));
 
   u32 hits;
 
   if (__afl_cmp_map->headers[k].type != CMP_TYPE_INS) {
     __afl_cmp_map->headers[k].type = CMP_TYPE_INS;
+    cmplog_touch(k);
     hits = 0;
     __afl_cmp_map->headers[k].hits = 1;
     __afl_cmp_map->headers[k].shape = size;
@@ -1917,13 +4305,13 @@ void __cmplog_ins_hookN(uint128_t arg1, uint128_t arg2, uint8_t attr,
 
   __afl_cmp_map->headers[k].attribute = attr;
 
-  hits &= CMP_MAP_H - 1;
-  __afl_cmp_map->log[k][hits].v0 = (u64)arg1;
-  __afl_cmp_map->log[k][hits].v1 = (u64)arg2;
+  hits &= __afl_cmp_map_h - 1;
+  CMP_LOG(k)[hits].v0 = (u64)arg1;
+  CMP_LOG(k)[hits].v1 = (u64)arg2;
 
   if (size > 7) {
-    __afl_cmp_map->log[k][hits].v0_128 = (u64)(arg1 >> 64);
-    __afl_cmp_map->log[k][hits].v1_128 = (u64)(arg2 >> 64);
+    CMP_LOG(k)[hits].v0_128 = (u64)(arg1 >> 64);
+    CMP_LOG(k)[hits].v1_128 = (u64)(arg2 >> 64);
   }
 }
 
@@ -1931,12 +4319,15 @@ void __cmplog_ins_hook16(uint128_t arg1, uint128_t arg2, uint8_t attr) {
   if (likely(!__afl_cmp_map)) return;
 
   uintptr_t k = (uintptr_t)__builtin_return_address(0);
-  k = (uintptr_t)(default_hash((u8 *)&k, sizeof(uintptr_t)) & (CMP_MAP_W - 1));
+  if (unlikely(cmplog_filtered(k))) return;
+  k = (uintptr_t)(default_hash((u8 *)&k, sizeof(uintptr_t)) &
+                  (__afl_cmp_map_w - 1));
 
   u32 hits;
 
   if (__afl_cmp_map->headers[k].type != CMP_TYPE_INS) {
     __afl_cmp_map->headers[k].type = CMP_TYPE_INS;
+    cmplog_touch(k);
     hits = 0;
     __afl_cmp_map->headers[k].hits = 1;
     __afl_cmp_map->headers[k].shape = 15;
@@ -1951,11 +4342,11 @@ void __cmplog_ins_hook16(uint128_t arg1, uint128_t arg2, uint8_t attr) {
 
   __afl_cmp_map->headers[k].attribute = attr;
 
-  hits &= CMP_MAP_H - 1;
-  __afl_cmp_map->log[k][hits].v0 = (u64)arg1;
-  __afl_cmp_map->log[k][hits].v1 = (u64)arg2;
-  __afl_cmp_map->log[k][hits].v0_128 = (u64)(arg1 >> 64);
-  __afl_cmp_map->log[k][hits].v1_128 = (u64)(arg2 >> 64);
+  hits &= __afl_cmp_map_h - 1;
+  CMP_LOG(k)[hits].v0 = (u64)arg1;
+  CMP_LOG(k)[hits].v1 = (u64)arg2;
+  CMP_LOG(k)[hits].v0_128 = (u64)(arg1 >> 64);
+  CMP_LOG(k)[hits].v1_128 = (u64)(arg2 >> 64);
 }
 
 #endif
@@ -2003,18 +4394,57 @@ void __sanitizer_cov_trace_const_cmp16(uint128_t arg1, uint128_t arg2) {
 
 #endif
 
+/* cmplog-switches: a switch on val, with the cnt cases of size bytes each
+   in the table, see CMP_TYPE_SWITCH. The cases are only copied when the key
+   is initialized, each further execution logs the value alone. */
+
+void __cmplog_switch_hook(uint64_t val, const void *table, uint32_t cnt,
+                          uint8_t size) {
+  if (unlikely(!__afl_cmp_map)) return;
+
+  uintptr_t k = (uintptr_t)__builtin_return_address(0);
+  if (unlikely(cmplog_filtered(k))) return;
+  k = (uintptr_t)(default_hash((u8 *)&k, sizeof(uintptr_t)) &
+                  (__afl_cmp_map_w - 1));
+
+  u64 *slot = (u64 *)CMP_LOG(k);
+  u32  hits;
+
+  if (__afl_cmp_map->headers[k].type != CMP_TYPE_SWITCH) {
+    u32 max = CMP_SWITCH_CASES(__afl_cmp_map_h, size);
+
+    __afl_cmp_map->headers[k].type = CMP_TYPE_SWITCH;
+    cmplog_touch(k);
+    hits = 0;
+    __afl_cmp_map->headers[k].hits = 1;
+    __afl_cmp_map->headers[k].shape = size - 1;
+    __afl_cmp_map->headers[k].attribute = 1;
+    __afl_cmp_map->headers[k].id = MIN(cnt, max);
+    memcpy(slot + __afl_cmp_map_h, table, MIN(cnt, max) * size);
+
+  } else {
+    hits = __afl_cmp_map->headers[k].hits++;
+  }
+
+  slot[hits & (__afl_cmp_map_h - 1)] = val;
+}
+
 void __sanitizer_cov_trace_switch(uint64_t val, uint64_t *cases) {
   if (likely(!__afl_cmp_map)) return;
+  if (unlikely(cmplog_filtered((uintptr_t)__builtin_return_address(0)))) {
+    return;
+  }
 
   for (uint64_t i = 0; i < cases[0]; i++) {
     uintptr_t k = (uintptr_t)__builtin_return_address(0) + i;
     k = (uintptr_t)(default_hash((u8 *)&k, sizeof(uintptr_t)) &
-                    (CMP_MAP_W - 1));
+                    (__afl_cmp_map_w - 1));
 
     u32 hits;
 
     if (__afl_cmp_map->headers[k].type != CMP_TYPE_INS) {
       __afl_cmp_map->headers[k].type = CMP_TYPE_INS;
+      cmplog_touch(k);
       hits = 0;
       __afl_cmp_map->headers[k].hits = 1;
       __afl_cmp_map->headers[k].shape = 7;
@@ -2029,9 +4459,9 @@ void __sanitizer_cov_trace_switch(uint64_t val, uint64_t *cases) {
 
     __afl_cmp_map->headers[k].attribute = 1;
 
-    hits &= CMP_MAP_H - 1;
-    __afl_cmp_map->log[k][hits].v0 = val;
-    __afl_cmp_map->log[k][hits].v1 = cases[i + 2];
+    hits &= __afl_cmp_map_h - 1;
+    CMP_LOG(k)[hits].v0 = val;
+    CMP_LOG(k)[hits].v1 = cases[i + 2];
   }
 }
 
@@ -2039,12 +4469,32 @@ __attribute__((weak)) void *__asan_region_is_poisoned(void *beg, size_t size) {
   return NULL;
 }
 
+static inline uintptr_t *cmplog_page(uintptr_t page) {
+  return &__afl_cmplog_pages[(page >> __afl_page_shift) & (CMPLOG_PAGES - 1)];
+}
+
 // POSIX shenanigan to see if an area is mapped.
 // If it is mapped as X-only, we have a problem, so maybe we should add a check
 // to avoid to call it on .text addresses
 static int area_is_valid(void *ptr, size_t len) {
   if (unlikely(!ptr || __asan_region_is_poisoned(ptr, len))) { return 0; }
 
+  if (unlikely(!__afl_page_mask)) {
+    __afl_page_mask = ~((uintptr_t)sysconf(_SC_PAGE_SIZE) - 1);
+    __afl_page_shift = __builtin_ctzl(__afl_page_mask);
+  }
+
+  char     *p = (char *)ptr;
+  uintptr_t first = (uintptr_t)p & __afl_page_mask;
+  uintptr_t last = ((uintptr_t)p + len - 1) & __afl_page_mask;
+  uintptr_t next = first + ~__afl_page_mask + 1;
+
+  // pages seen readable before need no syscall
+  if (*cmplog_page(first) == (first | 1)) {
+    if (last == first || *cmplog_page(last) == (last | 1)) { return (int)len; }
+    return (int)(next - (uintptr_t)p);
+  }
+
 #ifdef __HAIKU__
   long r = _kern_write(__afl_dummy_fd[1], -1, ptr, len);
 #elif defined(__OpenBSD__)
@@ -2055,22 +4505,24 @@ static int area_is_valid(void *ptr, size_t len) {
 
   if (r <= 0 || r > len) return 0;
 
+  *cmplog_page(first) = first | 1;
+
   // even if the write succeed this can be a false positive if we cross
   // a page boundary. who knows why.
 
-  char *p = (char *)ptr;
-  long  page_size = sysconf(_SC_PAGE_SIZE);
-  char *page = (char *)((uintptr_t)p & ~(page_size - 1)) + page_size;
-
-  if (page > p + len) {
+  if (last == first) {
     // no, not crossing a page boundary
     return (int)r;
 
+  } else if (*cmplog_page(last) == (last | 1)) {
+    // the next page was the first page of an earlier, valid area
+    return (int)len;
+
   } else {
     // yes it crosses a boundary, hence we can only return the length of
     // rest of the first page, we cannot detect if the next page is valid
     // or not, neither by SYS_write nor msync() :-(
-    return (int)(page - p);
+    return (int)(next - (uintptr_t)p);
   }
 }
 
@@ -2089,12 +4541,15 @@ void __cmplog_rtn_hook_strn(u8 *ptr1, u8 *ptr2, u64 len) {
   if (l < 2) return;
 
   uintptr_t k = (uintptr_t)__builtin_return_address(0);
-  k = (uintptr_t)(default_hash((u8 *)&k, sizeof(uintptr_t)) & (CMP_MAP_W - 1));
+  if (unlikely(cmplog_filtered(k))) return;
+  k = (uintptr_t)(default_hash((u8 *)&k, sizeof(uintptr_t)) &
+                  (__afl_cmp_map_w - 1));
 
   u32 hits;
 
   if (__afl_cmp_map->headers[k].type != CMP_TYPE_RTN) {
     __afl_cmp_map->headers[k].type = CMP_TYPE_RTN;
+    cmplog_touch(k);
     __afl_cmp_map->headers[k].hits = 1;
     __afl_cmp_map->headers[k].shape = l - 1;
     hits = 0;
@@ -2107,8 +4562,8 @@ void __cmplog_rtn_hook_strn(u8 *ptr1, u8 *ptr2, u64 len) {
     }
   }
 
-  struct cmpfn_operands *cmpfn = (struct cmpfn_operands *)__afl_cmp_map->log[k];
-  hits &= CMP_MAP_RTN_H - 1;
+  struct cmpfn_operands *cmpfn = (struct cmpfn_operands *)CMP_LOG(k);
+  hits &= (__afl_cmp_map_h >> 1) - 1;
 
   cmpfn[hits].v0_len = 0x80 + l;
   cmpfn[hits].v1_len = 0x80 + l;
@@ -2128,12 +4583,15 @@ void __cmplog_rtn_hook_str(u8 *ptr1, u8 *ptr2) {
   if (l < 3) return;
 
   uintptr_t k = (uintptr_t)__builtin_return_address(0);
-  k = (uintptr_t)(default_hash((u8 *)&k, sizeof(uintptr_t)) & (CMP_MAP_W - 1));
+  if (unlikely(cmplog_filtered(k))) return;
+  k = (uintptr_t)(default_hash((u8 *)&k, sizeof(uintptr_t)) &
+                  (__afl_cmp_map_w - 1));
 
   u32 hits;
 
   if (__afl_cmp_map->headers[k].type != CMP_TYPE_RTN) {
     __afl_cmp_map->headers[k].type = CMP_TYPE_RTN;
+    cmplog_touch(k);
     __afl_cmp_map->headers[k].hits = 1;
     __afl_cmp_map->headers[k].shape = l - 1;
     hits = 0;
@@ -2146,8 +4604,8 @@ void __cmplog_rtn_hook_str(u8 *ptr1, u8 *ptr2) {
     }
   }
 
-  struct cmpfn_operands *cmpfn = (struct cmpfn_operands *)__afl_cmp_map->log[k];
-  hits &= CMP_MAP_RTN_H - 1;
+  struct cmpfn_operands *cmpfn = (struct cmpfn_operands *)CMP_LOG(k);
+  hits &= (__afl_cmp_map_h >> 1) - 1;
 
   cmpfn[hits].v0_len = 0x80 + len1;
   cmpfn[hits].v1_len = 0x80 + len2;
@@ -2180,12 +4638,15 @@ void __cmplog_rtn_hook(u8 *ptr1, u8 *ptr2) {
 
   // fprintf(stderr, "RTN2 %u\n", len);
   uintptr_t k = (uintptr_t)__builtin_return_address(0);
-  k = (uintptr_t)(default_hash((u8 *)&k, sizeof(uintptr_t)) & (CMP_MAP_W - 1));
+  if (unlikely(cmplog_filtered(k))) return;
+  k = (uintptr_t)(default_hash((u8 *)&k, sizeof(uintptr_t)) &
+                  (__afl_cmp_map_w - 1));
 
   u32 hits;
 
   if (__afl_cmp_map->headers[k].type != CMP_TYPE_RTN) {
     __afl_cmp_map->headers[k].type = CMP_TYPE_RTN;
+    cmplog_touch(k);
     __afl_cmp_map->headers[k].hits = 1;
     __afl_cmp_map->headers[k].shape = len - 1;
     hits = 0;
@@ -2198,8 +4659,8 @@ void __cmplog_rtn_hook(u8 *ptr1, u8 *ptr2) {
     }
   }
 
-  struct cmpfn_operands *cmpfn = (struct cmpfn_operands *)__afl_cmp_map->log[k];
-  hits &= CMP_MAP_RTN_H - 1;
+  struct cmpfn_operands *cmpfn = (struct cmpfn_operands *)CMP_LOG(k);
+  hits &= (__afl_cmp_map_h >> 1) - 1;
 
   cmpfn[hits].v0_len = len;
   cmpfn[hits].v1_len = len;
@@ -2238,13 +4699,17 @@ void __cmplog_rtn_hook_n(u8 *ptr1, u8 *ptr2, u64 len) {
 
   // fprintf(stderr, "RTN2 %u\n", l);
   uintptr_t k = (uintptr_t)__builtin_return_address(0);
-  k = (uintptr_t)(default_hash((u8 *)&k, sizeof(uintptr_t)) & (CMP_MAP_W - 1));
+  if (unlikely(cmplog_filtered(k))) return;
+  k = (uintptr_t)(default_hash((u8 *)&k, sizeof(uintptr_t)) &
+                  (__afl_cmp_map_w - 1));
 
   u32 hits;
 
   if (__afl_cmp_map->headers[k].type != CMP_TYPE_RTN) {
 
     __afl_cmp_map->headers[k].type = CMP_TYPE_RTN;
+
+    cmplog_touch(k);
     __afl_cmp_map->headers[k].hits = 1;
     __afl_cmp_map->headers[k].shape = l - 1;
     hits = 0;
@@ -2261,8 +4726,8 @@ void __cmplog_rtn_hook_n(u8 *ptr1, u8 *ptr2, u64 len) {
 
   }
 
-  struct cmpfn_operands *cmpfn = (struct cmpfn_operands *)__afl_cmp_map->log[k];
-  hits &= CMP_MAP_RTN_H - 1;
+  struct cmpfn_operands *cmpfn = (struct cmpfn_operands *)CMP_LOG(k);
+  hits &= (__afl_cmp_map_h >> 1) - 1;
 
   cmpfn[hits].v0_len = l;
   cmpfn[hits].v1_len = l;
@@ -2354,6 +4819,23 @@ void __afl_coverage_off() {
   }
 }
 
+/* A field of the testcase the harness parsed, see __AFL_HINT_FIELD() and
+   include/fshints.h. Only recorded when afl-fuzz asks for it. */
+
+void __afl_hint_field(u32 off, u32 len, u32 type) {
+  struct fs_hints *h = __afl_hints;
+
+  if (likely(!h || !h->on)) { return; }
+
+  if (h->cnt < FS_HINTS_MAX) {
+    h->hint[h->cnt].off = off;
+    h->hint[h->cnt].len = len;
+    h->hint[h->cnt].type = type;
+  }
+
+  ++h->cnt;
+}
+
 // enable coverage
 void __afl_coverage_on() {
   if (likely(__afl_selective_coverage && __afl_selective_coverage_temp)) {
@@ -2367,7 +4849,11 @@ void __afl_coverage_discard() {
   memset(__afl_area_ptr_backup, 0, __afl_map_size);
   __afl_area_ptr_backup[0] = 1;
 
-  if (__afl_cmp_map) { memset(__afl_cmp_map, 0, sizeof(struct cmp_map)); }
+  /* keeps the delta mode touched list, the cleared keys stay listed */
+  if (__afl_cmp_map) {
+    memset(__afl_cmp_map, 0,
+           CMP_MAP_DELTA_OFF(__afl_cmp_map_w, __afl_cmp_map_h));
+  }
 }
 
 // discard the testcase
@@ -2396,7 +4882,8 @@ void __afl_set_persistent_mode(u8 mode) {
 
 void __afl_injection_sql(u8 *buf) {
   if (likely(buf)) {
-    if (unlikely(strstr((char *)buf, "'\"\"'"))) {
+    if (unlikely(injection_find(buf, injection_sql,
+                                INJECTION_CNT(injection_sql)))) {
       fprintf(stderr, "ALERT: Detected SQL injection in query: %s\n", buf);
       abort();
     }
@@ -2405,7 +4892,8 @@ void __afl_injection_sql(u8 *buf) {
 
 void __afl_injection_ldap(u8 *buf) {
   if (likely(buf)) {
-    if (unlikely(strstr((char *)buf, "*)(1=*))(|"))) {
+    if (unlikely(injection_find(buf, injection_ldap,
+                                INJECTION_CNT(injection_ldap)))) {
       fprintf(stderr, "ALERT: Detected LDAP injection in query: %s\n", buf);
       abort();
     }
@@ -2414,7 +4902,8 @@ void __afl_injection_ldap(u8 *buf) {
 
 void __afl_injection_xss(u8 *buf) {
   if (likely(buf)) {
-    if (unlikely(strstr((char *)buf, "1\"><\""))) {
+    if (unlikely(injection_find(buf, injection_xss,
+                                INJECTION_CNT(injection_xss)))) {
       fprintf(stderr, "ALERT: Detected XSS injection in content: %s\n", buf);
       abort();
     }
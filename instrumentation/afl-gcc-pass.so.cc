@@ -122,6 +122,26 @@
    If any block was instrumented in a function, an initializer for <B>
    needs to be introduced, loading it from <M> and inserting it in the
    entry edge for the entry block.
+
+   With AFL_GCC_PCGUARD set, the pass follows the PCGUARD mode of the
+   LLVM plugin instead.  Critical edges are split first, so that every
+   edge out of a branch leads to a block of its own, and the entry block
+   is instrumented too.  Each instrumented block gets a u32 guard in an
+   array <G> per function, in the __sancov_guards section, instead of a
+   random location number.  A constructor per translation unit passes
+   the bounds of that section to __sanitizer_cov_trace_pc_guard_init,
+   which numbers the guards of the whole module consecutively: no
+   collisions, and a map no larger than the number of edges.
+
+   The inline sequence for the guard <I> of a block is then:
+
+   Load <G>[<I>] to a temporary, and convert it to sizetype as the
+   index <I>.
+
+   Pointer-add <B> and <I>, and increment <*A>, as above.
+
+   __afl_prev_loc is not used.  In out-of-line mode, the call is to
+   __sanitizer_cov_trace_pc_guard (&<G>[<I>]).
 */
 
 #include "afl-gcc-common.h"
@@ -129,6 +149,10 @@
     60200 /* >= version 6.2.0 */
   #include "memmodel.h"
 #endif
+#include <flags.h>
+#include <cfghooks.h>
+#include <cgraph.h>
+#include <varasm.h>
 
 /* This plugin, being under the same license as GCC, satisfies the
    "GPL-compatible Software" definition in the GCC RUNTIME LIBRARY
@@ -162,6 +186,7 @@ struct afl_pass : afl_base_pass {
         out_of_line(getenv("AFL_GCC_OUT_OF_LINE")),
 #endif
         neverZero(!getenv("AFL_GCC_SKIP_NEVERZERO")),
+        pcguard(!!getenv("AFL_GCC_PCGUARD")),
         inst_blocks(0) {
 
     initInstrumentList();
@@ -177,6 +202,10 @@ struct afl_pass : afl_base_pass {
      around to zero?  */
   const bool neverZero;
 
+  /* Should we number edges with guards, like the LLVM PCGUARD mode,
+     instead of hashing random block locations?  */
+  const bool pcguard;
+
   /* Count instrumented blocks. */
   unsigned int inst_blocks;
 
@@ -190,17 +219,45 @@ struct afl_pass : afl_base_pass {
     tree ploc = NULL, indx = NULL, map = NULL, map_ptr = NULL, ntry = NULL,
          cntr = NULL, xaddc = NULL, xincr = NULL;
 
-    basic_block bb;
+    /* With pcguard, the guard array of this function.  */
+    tree guards = NULL;
+
+    if (pcguard) split_critical_edges_of(fn);
+
+    /* Pick the blocks first, the guard array needs to know how many.  */
+    auto_vec<basic_block> inst_bbs;
+    basic_block           bb;
     FOR_EACH_BB_FN(bb, fn) {
-      if (!instrument_block_p(bb)) continue;
+      if (pcguard ? guard_block_p(bb) : instrument_block_p(bb))
+        inst_bbs.safe_push(bb);
+    }
+
+    if (pcguard && !inst_bbs.is_empty())
+      guards = get_afl_guards_decl(inst_bbs.length());
 
+    unsigned ix;
+    FOR_EACH_VEC_ELT(inst_bbs, ix, bb) {
       /* Generate the block identifier.  */
-      unsigned bid = R(MAP_SIZE);
+      unsigned bid = pcguard ? 0 : R(MAP_SIZE);
       tree     bidt = build_int_cst(sizetype, bid);
 
+      /* With pcguard, the guard of the block: guards[ix].  */
+      tree guard = NULL;
+      if (pcguard)
+        guard = build4(ARRAY_REF, uint32_type_node, guards,
+                       build_int_cst(sizetype, ix), NULL_TREE, NULL_TREE);
+
       gimple_seq seq = NULL;
 
-      if (out_of_line) {
+      if (out_of_line && pcguard) {
+        static tree afl_trace_guard = get_afl_trace_guard_decl();
+
+        /* Call __sanitizer_cov_trace_pc_guard with &guards[ix].  */
+        gcall *call =
+            gimple_build_call(afl_trace_guard, 1, build_fold_addr_expr(guard));
+        gimple_seq_add_stmt(&seq, call);
+
+      } else if (out_of_line) {
         static tree afl_trace = get_afl_trace_decl();
 
         /* Call __afl_trace with bid, the new location;  */
@@ -208,23 +265,38 @@ struct afl_pass : afl_base_pass {
         gimple_seq_add_stmt(&seq, call);
 
       } else {
-        static tree afl_prev_loc = get_afl_prev_loc_decl();
         static tree afl_area_ptr = get_afl_area_ptr_decl();
 
-        /* Load __afl_prev_loc to a temporary ploc.  */
-        if (blocks == 0)
-          ploc = create_tmp_var(TREE_TYPE(afl_prev_loc), ".afl_prev_loc");
-        auto load_loc = gimple_build_assign(ploc, afl_prev_loc);
-        gimple_seq_add_stmt(&seq, load_loc);
-
-        /* Compute the index into the map referenced by area_ptr
-           that we're to update: indx = (sizetype) ploc ^ bid.  */
         if (blocks == 0) indx = create_tmp_var(TREE_TYPE(bidt), ".afl_index");
-        auto conv_ploc =
-            gimple_build_assign(indx, fold_convert(TREE_TYPE(indx), ploc));
-        gimple_seq_add_stmt(&seq, conv_ploc);
-        auto xor_loc = gimple_build_assign(indx, BIT_XOR_EXPR, indx, bidt);
-        gimple_seq_add_stmt(&seq, xor_loc);
+
+        if (pcguard) {
+          /* The guard holds the index into the map referenced by
+             area_ptr: indx = (sizetype) guards[ix].  */
+          if (blocks == 0)
+            ploc = create_tmp_var(uint32_type_node, ".afl_guard");
+          auto load_guard = gimple_build_assign(ploc, guard);
+          gimple_seq_add_stmt(&seq, load_guard);
+          auto conv_guard =
+              gimple_build_assign(indx, fold_convert(TREE_TYPE(indx), ploc));
+          gimple_seq_add_stmt(&seq, conv_guard);
+
+        } else {
+          static tree afl_prev_loc = get_afl_prev_loc_decl();
+
+          /* Load __afl_prev_loc to a temporary ploc.  */
+          if (blocks == 0)
+            ploc = create_tmp_var(TREE_TYPE(afl_prev_loc), ".afl_prev_loc");
+          auto load_loc = gimple_build_assign(ploc, afl_prev_loc);
+          gimple_seq_add_stmt(&seq, load_loc);
+
+          /* Compute the index into the map referenced by area_ptr
+             that we're to update: indx = (sizetype) ploc ^ bid.  */
+          auto conv_ploc =
+              gimple_build_assign(indx, fold_convert(TREE_TYPE(indx), ploc));
+          gimple_seq_add_stmt(&seq, conv_ploc);
+          auto xor_loc = gimple_build_assign(indx, BIT_XOR_EXPR, indx, bidt);
+          gimple_seq_add_stmt(&seq, xor_loc);
+        }
 
         /* Compute the address of that map element.  */
         if (blocks == 0) {
@@ -307,12 +379,16 @@ struct afl_pass : afl_base_pass {
           gimple_seq_add_stmt(&seq, incr_cntr);
         }
 
-        /* Store bid >> 1 in __afl_prev_loc.  */
-        auto shift_loc =
-            gimple_build_assign(ploc, build_int_cst(TREE_TYPE(ploc), bid >> 1));
-        gimple_seq_add_stmt(&seq, shift_loc);
-        auto store_loc = gimple_build_assign(afl_prev_loc, ploc);
-        gimple_seq_add_stmt(&seq, store_loc);
+        if (!pcguard) {
+          static tree afl_prev_loc = get_afl_prev_loc_decl();
+
+          /* Store bid >> 1 in __afl_prev_loc.  */
+          auto shift_loc = gimple_build_assign(
+              ploc, build_int_cst(TREE_TYPE(ploc), bid >> 1));
+          gimple_seq_add_stmt(&seq, shift_loc);
+          auto store_loc = gimple_build_assign(afl_prev_loc, ploc);
+          gimple_seq_add_stmt(&seq, store_loc);
+        }
       }
 
       /* Insert the generated sequence.  */
@@ -353,6 +429,11 @@ struct afl_pass : afl_base_pass {
   inline bool instrument_block_p(basic_block bb) {
     if (R(100) >= (long int)inst_ratio) return false;
 
+    return branch_target_p(bb);
+  }
+
+  /* Is BB entered from a block with more than one successor?  */
+  static inline bool branch_target_p(basic_block bb) {
     edge          e;
     edge_iterator ei;
     FOR_EACH_EDGE(e, ei, bb->preds)
@@ -361,6 +442,41 @@ struct afl_pass : afl_base_pass {
     return false;
   }
 
+  /* Decide whether to give block BB a guard.  With the critical edges
+     split, a block entered from a branch stands for that one edge, and
+     every other edge leaves a block with a single successor, that is
+     counted with it.  The first block counts the calls.  The ratio is
+     left to the runtime, which implements AFL_INST_RATIO for guards.  */
+  static inline bool guard_block_p(basic_block bb) {
+    edge          e;
+    edge_iterator ei;
+    FOR_EACH_EDGE(e, ei, bb->preds)
+    if (e->src == ENTRY_BLOCK_PTR_FOR_FN(cfun)) return true;
+
+    return branch_target_p(bb);
+  }
+
+  /* Split the critical edges of FN, the edges from a block with several
+     successors to a block with several predecessors, so that each of
+     them gets a block, and a guard, of its own.  Abnormal edges cannot
+     be split; they stay counted with their destination.  */
+  static void split_critical_edges_of(function *fn) {
+    auto_vec<edge> crit;
+    basic_block    bb;
+    FOR_EACH_BB_FN(bb, fn) {
+      edge          e;
+      edge_iterator ei;
+      FOR_EACH_EDGE(e, ei, bb->succs)
+      if (EDGE_CRITICAL_P(e) && !(e->flags & EDGE_ABNORMAL))
+        crit.safe_push(e);
+    }
+
+    unsigned ix;
+    edge     e;
+    FOR_EACH_VEC_ELT(crit, ix, e)
+    split_edge(e);
+  }
+
   /* Create and return a declaration for the __afl_trace rt function.  */
   static inline tree get_afl_trace_decl() {
     tree type =
@@ -406,6 +522,83 @@ struct afl_pass : afl_base_pass {
     return decl;
   }
 
+  /* Create and return a declaration for the
+     __sanitizer_cov_trace_pc_guard rt function.  */
+  static inline tree get_afl_trace_guard_decl() {
+    tree type = build_function_type_list(
+        void_type_node, build_pointer_type(uint32_type_node), NULL_TREE);
+    tree decl = build_fn_decl("__sanitizer_cov_trace_pc_guard", type);
+
+    TREE_PUBLIC(decl) = 1;
+    DECL_EXTERNAL(decl) = 1;
+    DECL_ARTIFICIAL(decl) = 1;
+
+    return decl;
+  }
+
+  /* Create and return the array of CNT guards of a function, zeroed
+     and placed in the __sancov_guards section.  It is marked used, so
+     that it is never taken for read-only and its loads folded to 0:
+     the runtime writes the guards before main.  */
+  static inline tree get_afl_guards_decl(unsigned cnt) {
+    tree type = build_array_type_nelts(uint32_type_node, cnt);
+    tree decl = build_decl(BUILTINS_LOCATION, VAR_DECL,
+                           create_tmp_var_name("__afl_guards"), type);
+    TREE_STATIC(decl) = 1;
+    TREE_ADDRESSABLE(decl) = 1;
+    DECL_ARTIFICIAL(decl) = 1;
+    DECL_IGNORED_P(decl) = 1;
+    DECL_PRESERVE_P(decl) = 1;
+    DECL_INITIAL(decl) = build_constructor(type, NULL);
+    set_decl_section_name(decl, "__sancov_guards");
+    varpool_node::finalize_decl(decl);
+
+    return decl;
+  }
+
+  /* Create and return a declaration for NAME, one of the bounds of the
+     __sancov_guards section the linker defines.  They are hidden, so
+     that every module passes its own section, and weak, so that
+     modules without any guards link as well.  */
+  static inline tree get_afl_guards_bound_decl(const char *name) {
+    tree decl = build_decl(BUILTINS_LOCATION, VAR_DECL, get_identifier(name),
+                           uint32_type_node);
+    TREE_PUBLIC(decl) = 1;
+    DECL_EXTERNAL(decl) = 1;
+    DECL_ARTIFICIAL(decl) = 1;
+    TREE_ADDRESSABLE(decl) = 1;
+    DECL_WEAK(decl) = 1;
+    DECL_VISIBILITY(decl) = VISIBILITY_HIDDEN;
+    DECL_VISIBILITY_SPECIFIED(decl) = 1;
+
+    return decl;
+  }
+
+  /* This is registered as a callback at the start of the IPA passes
+     with AFL_GCC_PCGUARD, when no function is being compiled, to add
+     the constructor that calls __sanitizer_cov_trace_pc_guard_init
+     with the bounds of the guards section, at priority 2 as in LLVM.
+     The first call numbers the guards of the whole module, the others
+     find them numbered and return.  */
+  static void build_guards_ctor(void *, void *) {
+    if (in_lto_p) return;
+
+    tree guard_ptr = build_pointer_type(uint32_type_node);
+    tree type = build_function_type_list(void_type_node, guard_ptr, guard_ptr,
+                                         NULL_TREE);
+    tree init = build_fn_decl("__sanitizer_cov_trace_pc_guard_init", type);
+    TREE_PUBLIC(init) = 1;
+    DECL_EXTERNAL(init) = 1;
+    DECL_ARTIFICIAL(init) = 1;
+
+    tree start = get_afl_guards_bound_decl("__start___sancov_guards");
+    tree stop = get_afl_guards_bound_decl("__stop___sancov_guards");
+    tree call = build_call_expr(init, 2, build_fold_addr_expr(start),
+                                build_fold_addr_expr(stop));
+
+    cgraph_build_static_cdtor('I', call, 2);
+  }
+
   /* This is registered as a plugin finalize callback, to print an
      instrumentation summary unless in quiet mode.  */
   static void plugin_finalize(void *, void *p) {
@@ -416,11 +609,11 @@ struct afl_pass : afl_base_pass {
       if (!self.inst_blocks)
         WARNF("No instrumentation targets found.");
       else
-        OKF("Instrumented %u locations (%s mode, %s, ratio %u%%).",
+        OKF("Instrumented %u locations (%s mode, %s%s, ratio %u%%).",
             self.inst_blocks,
             getenv("AFL_HARDEN") ? G_("hardened") : G_("non-hardened"),
             self.out_of_line ? G_("out of line") : G_("inline"),
-            self.inst_ratio);
+            self.pcguard ? G_(" pcguard") : "", self.inst_ratio);
     }
   }
 };
@@ -435,6 +628,9 @@ Set AFL_QUIET in the environment to silence it.\n\
 Set AFL_INST_RATIO in the environment to a number from 0 to 100\n\
 to control how likely a block will be chosen for instrumentation.\n\
 \n\
+Set AFL_GCC_PCGUARD in the environment for collision free edge\n\
+instrumentation with guards, like the PCGUARD mode of afl-clang-fast.\n\
+\n\
 Specify -frandom-seed for reproducible instrumentation.\n\
 "),
 
@@ -484,12 +680,16 @@ int plugin_init(struct plugin_name_args   *info,
   };
 
   register_callback(name, PLUGIN_PASS_MANAGER_SETUP, NULL, &pass_info);
+  if (aflp->pcguard)
+    register_callback(name, PLUGIN_ALL_IPA_PASSES_START,
+                      afl_pass::build_guards_ctor, NULL);
   register_callback(name, PLUGIN_FINISH, afl_pass::plugin_finalize,
                     pass_info.pass);
 
   if (!quiet)
-    ACTF(G_("%s instrumentation at ratio of %u%% in %s mode."),
-         aflp->out_of_line ? G_("Call-based") : G_("Inline"), inst_ratio,
+    ACTF(G_("%s%s instrumentation at ratio of %u%% in %s mode."),
+         aflp->out_of_line ? G_("Call-based") : G_("Inline"),
+         aflp->pcguard ? G_(" pcguard") : "", inst_ratio,
          getenv("AFL_HARDEN") ? G_("hardened") : G_("non-hardened"));
 
   return 0;
@@ -2,6 +2,7 @@
 
 #include "config.h"
 #include "debug.h"
+#include "llvm-alternative-coverage.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -13,8 +14,21 @@
 #include <string>
 #include <fstream>
 #include <cmath>
+#include <map>
+#include <set>
 
 #include <llvm/Support/raw_ostream.h>
+#include <llvm/ADT/DepthFirstIterator.h>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/Analysis/LoopInfo.h>
+#include <llvm/IR/IntrinsicInst.h>
+#include <llvm/Transforms/Utils/PromoteMemToReg.h>
+#if LLVM_VERSION_MAJOR < 17
+  #include <llvm/ADT/Triple.h>
+#else
+  #include <llvm/TargetParser/Triple.h>
+#endif
 
 #define IS_EXTERN extern
 #include "afl-llvm-common.h"
@@ -26,6 +40,9 @@ static std::list<std::string> allowListFunctions;
 static std::list<std::string> denyListFiles;
 static std::list<std::string> denyListFunctions;
 
+// AFL_LLVM_ALWAYS_HIT: the blocks to leave out, by function and position
+static std::map<std::string, std::set<unsigned int>> alwaysHitBlocks;
+
 char *getBBName(const llvm::BasicBlock *BB) {
   static char *name;
 
@@ -242,6 +259,74 @@ void initInstrumentList() {
       DEBUGF("loaded denylist with %zu file and %zu function entries\n",
              denyListFiles.size() / 4, denyListFunctions.size() / 4);
   }
+
+  char *always_hit = getenv("AFL_LLVM_ALWAYS_HIT");
+
+  if (always_hit) {
+    std::string   line;
+    std::ifstream fileStream;
+    size_t        entries = 0;
+    fileStream.open(always_hit);
+    if (!fileStream) report_fatal_error("Unable to open AFL_LLVM_ALWAYS_HIT");
+    getline(fileStream, line);
+
+    while (fileStream) {
+      std::size_t npos;
+      std::string original_line = line;
+
+      line.erase(std::remove_if(line.begin(), line.end(), ::isspace),
+                 line.end());
+
+      // remove # and following
+      if ((npos = line.find("#")) != std::string::npos)
+        line = line.substr(0, npos);
+
+      if (line.length() > 0) {
+        // function:block, the function name is the one of the IR
+        char         *end;
+        unsigned long block;
+
+        npos = line.rfind(":");
+        if (npos == std::string::npos || !npos || npos + 1 == line.length())
+          FATAL("invalid line in AFL_LLVM_ALWAYS_HIT: %s",
+                original_line.c_str());
+
+        block = strtoul(line.c_str() + npos + 1, &end, 10);
+        if (*end)
+          FATAL("invalid line in AFL_LLVM_ALWAYS_HIT: %s",
+                original_line.c_str());
+
+        alwaysHitBlocks[line.substr(0, npos)].insert(block);
+        ++entries;
+      }
+
+      getline(fileStream, line);
+    }
+
+    if (debug)
+      DEBUGF("loaded always hit list with %zu blocks of %zu functions\n",
+             entries, alwaysHitBlocks.size());
+  }
+}
+
+// Remove the blocks from Blocks that AFL_LLVM_ALWAYS_HIT lists for F, by
+// their position in Blocks, which is the one AFL_LLVM_DOCUMENT_IDS reports
+// in a build without the list. Returns how many were removed.
+unsigned int dropAlwaysHitBlocks(
+    llvm::Function *F, llvm::SmallVectorImpl<llvm::BasicBlock *> &Blocks) {
+  if (alwaysHitBlocks.empty()) return 0;
+
+  auto it = alwaysHitBlocks.find(F->getName().str());
+  if (it == alwaysHitBlocks.end()) return 0;
+
+  llvm::SmallVector<llvm::BasicBlock *, 16> Kept;
+
+  for (unsigned int i = 0; i < Blocks.size(); ++i)
+    if (!it->second.count(i)) Kept.push_back(Blocks[i]);
+
+  unsigned int dropped = Blocks.size() - Kept.size();
+  Blocks.assign(Kept.begin(), Kept.end());
+  return dropped;
 }
 
 void scanForDangerousFunctions(llvm::Module *M) {
@@ -493,3 +578,365 @@ unsigned long long int calculateCollisions(uint32_t edges) {
   unsigned long long int collisions = edges - (MAP_SIZE - empty);
   return collisions;
 }
+
+// Remove the blocks from Blocks whose counters only repeat what others
+// count (AFL_LLVM_DOM_PRUNE):
+//  * the entry block if it branches to blocks that only it leads to, it runs
+//    as often as they do together. This is the full dominator rule of the
+//    sancov pruning, which leaves the entry block out.
+//  * blocks that always run exactly as often as another one that stays: one
+//    that dominates them and that they post-dominate, in the same innermost
+//    loop.
+// Returns how many were removed.
+unsigned int pruneEquivalentBlocks(
+    llvm::SmallVectorImpl<llvm::BasicBlock *> &Blocks,
+    const llvm::DominatorTree *DT, const llvm::PostDominatorTree *PDT) {
+  llvm::SmallPtrSet<llvm::BasicBlock *, 32>                Want;
+  llvm::DenseMap<llvm::BasicBlock *, llvm::BasicBlock *> Rep;
+  llvm::LoopInfo                                           LI(*DT);
+  unsigned int                                             pruned = 0;
+
+  // blocks the dominator tree does not reach stay as they are
+  for (auto *BB : Blocks) {
+    Want.insert(BB);
+    Rep[BB] = BB;
+  }
+
+  llvm::BasicBlock *Entry = &DT->getRoot()->getParent()->getEntryBlock();
+
+  if (Want.count(Entry) && !llvm::succ_empty(Entry) &&
+      llvm::all_of(llvm::successors(Entry), [](const llvm::BasicBlock *SUCC) {
+        return SUCC->getSinglePredecessor() != nullptr;
+      })) {
+    Want.erase(Entry);
+    Rep[Entry] = nullptr;
+  }
+
+  // dominators come first, so their representative is known already
+  for (auto *Node : llvm::depth_first(DT->getRootNode())) {
+    llvm::BasicBlock *BB = Node->getBlock();
+    if (!Want.count(BB)) continue;
+
+    llvm::BasicBlock *R = BB;
+    llvm::Loop       *L = LI.getLoopFor(BB);
+
+    for (auto *Up = Node->getIDom(); Up; Up = Up->getIDom()) {
+      llvm::BasicBlock *A = Up->getBlock();
+      if (L && !L->contains(A)) break;
+      if (LI.getLoopFor(A) != L || !Want.count(A) || !PDT->dominates(BB, A))
+        continue;
+      R = Rep[A];
+      break;
+    }
+
+    Rep[BB] = R;
+  }
+
+  llvm::SmallVector<llvm::BasicBlock *, 16> Kept;
+
+  for (auto *BB : Blocks) {
+    if (Rep.lookup(BB) == BB)
+      Kept.push_back(BB);
+    else
+      pruned++;
+  }
+
+  Blocks.assign(Kept.begin(), Kept.end());
+  return pruned;
+}
+
+// True if the counters of the blocks of L can be kept in registers while the
+// loop runs and be added to the map on the way out (AFL_LLVM_LOOP_COMPRESS):
+// an innermost loop with a preheader to start the counts in and exit blocks
+// only it branches to, that calls nothing that could look at the map or not
+// return, so it is only left through its exit blocks.
+bool isLoopCompressible(const llvm::Loop *L) {
+  if (!L->getSubLoops().empty() || !L->getLoopPreheader() ||
+      !L->hasDedicatedExits())
+    return false;
+
+  for (auto *BB : L->getBlocks()) {
+    if (!llvm::isa<llvm::BranchInst>(BB->getTerminator()) &&
+        !llvm::isa<llvm::SwitchInst>(BB->getTerminator()))
+      return false;
+
+    for (auto &I : *BB)
+      if (llvm::isa<llvm::CallInst>(&I) && !llvm::isa<llvm::IntrinsicInst>(&I))
+        return false;
+  }
+
+  return true;
+}
+
+// N-gram coverage (AFL_LLVM_NGRAM_SIZE) keeps the last N - 1 locations in
+// one 64 bit word, __afl_prev_ngram: every location shifts it by 64 / (N - 1)
+// bits and adds itself, and what an older one still has there after N - 1
+// shifts is masked off. So each location is part of the hash for the next
+// N - 1 ones and then gone, the newer ones with more of their bits.
+
+unsigned int getNgramSize() {
+  char        *ptr = getenv("AFL_LLVM_NGRAM_SIZE");
+  unsigned int ngram_size = 0;
+
+  if (!ptr) ptr = getenv("AFL_NGRAM_SIZE");
+  if (!ptr) return 0;
+
+  if (sscanf(ptr, "%u", &ngram_size) != 1 || ngram_size < 2 ||
+      ngram_size > NGRAM_SIZE_MAX)
+    FATAL(
+        "Bad value of AFL_NGRAM_SIZE (must be between 2 and NGRAM_SIZE_MAX "
+        "(%u))",
+        NGRAM_SIZE_MAX);
+
+  return ngram_size;
+}
+
+llvm::GlobalVariable *createNgramState(llvm::Module &M) {
+  llvm::Type *Int64Ty = llvm::Type::getInt64Ty(M.getContext());
+
+#if defined(__ANDROID__) || defined(__HAIKU__) || defined(NO_TLS)
+  return new llvm::GlobalVariable(M, Int64Ty, false,
+                                  llvm::GlobalValue::ExternalLinkage, 0,
+                                  "__afl_prev_ngram");
+#else
+  return new llvm::GlobalVariable(
+      M, Int64Ty, false, llvm::GlobalValue::ExternalLinkage, 0,
+      "__afl_prev_ngram", 0, llvm::GlobalVariable::GeneralDynamicTLSModel, 0,
+      false);
+#endif
+}
+
+// The MAP_NOTE_* note that tells the tools the map size of the binary
+// without running it, see predict_map_size(). The linker puts the notes of
+// all modules together. Not for other object formats, there is no reader.
+// data follows value and flags in the desc, it is at field 6 of the note.
+llvm::GlobalVariable *createMapNote(llvm::Module &M, uint32_t type,
+                                    uint32_t value, uint32_t flags,
+                                    llvm::StringRef data) {
+  if (!llvm::Triple(M.getTargetTriple()).isOSBinFormatELF()) return nullptr;
+
+  llvm::LLVMContext &Ctx = M.getContext();
+  llvm::Type        *Int32Ty = llvm::Type::getInt32Ty(Ctx);
+  std::string        Desc = data.str();
+
+  Desc.resize((Desc.size() + 3) & ~(size_t)3);  // the padding of the desc
+
+  llvm::Constant *Fields[] = {
+      llvm::ConstantInt::get(Int32Ty, sizeof(MAP_NOTE_NAME)),
+      llvm::ConstantInt::get(Int32Ty, 8 + data.size()),
+      llvm::ConstantInt::get(Int32Ty, type),
+      llvm::ConstantDataArray::getString(Ctx, MAP_NOTE_NAME),
+      llvm::ConstantInt::get(Int32Ty, value),
+      llvm::ConstantInt::get(Int32Ty, flags),
+      llvm::ConstantDataArray::getString(Ctx, Desc, false)};
+  llvm::Constant *Note = llvm::ConstantStruct::getAnon(Ctx, Fields, true);
+
+  auto *GV = new llvm::GlobalVariable(M, Note->getType(), true,
+                                      llvm::GlobalValue::PrivateLinkage, Note,
+                                      "__afl_map_note");
+  GV->setSection(MAP_NOTE_SECTION);
+#if LLVM_VERSION_MAJOR >= 10
+  GV->setAlignment(llvm::Align(4));
+#else
+  GV->setAlignment(4);
+#endif
+  return GV;
+}
+
+static void setNoSanitize(llvm::Instruction *I) {
+  I->setMetadata(I->getModule()->getMDKindID("nosanitize"),
+                 llvm::MDNode::get(I->getContext(), None));
+}
+
+// Where the instrumentation of F keeps the hash: a local that promoteNgram()
+// turns into a register, or __afl_prev_ngram itself for the functions that
+// can be left other than through a return (exceptions, setjmp(), musttail
+// calls), where it could not be written back.
+llvm::Value *prepareNgram(llvm::Function &F, llvm::GlobalVariable *State) {
+  if (F.hasPersonalityFn()) return State;
+
+  for (auto &BB : F) {
+    for (auto &I : BB) {
+      if (llvm::isa<llvm::CallBrInst>(&I)) return State;
+
+      auto *CI = llvm::dyn_cast<llvm::CallInst>(&I);
+      if (CI && (CI->isMustTailCall() || CI->canReturnTwice())) return State;
+    }
+  }
+
+  llvm::IRBuilder<> IRB(&*F.getEntryBlock().begin());
+  return IRB.CreateAlloca(IRB.getInt64Ty(), nullptr, "afl_ngram");
+}
+
+// Adds the location CurLoc to the hash in Ngram and returns the hash of the
+// locations before it, folded to 32 bits.
+llvm::Value *emitNgram(llvm::IRBuilderBase &IRB, llvm::Value *Ngram,
+                       llvm::Value *CurLoc, unsigned int ngram_size) {
+  unsigned int   shift = 64 / (ngram_size - 1);
+  unsigned int   bits = shift * (ngram_size - 1);
+  llvm::LoadInst *Hash = IRB.CreateLoad(IRB.getInt64Ty(), Ngram);
+  setNoSanitize(Hash);
+
+  llvm::Value *Prev = IRB.CreateTrunc(
+      IRB.CreateXor(Hash, IRB.CreateLShr(Hash, 32)), IRB.getInt32Ty());
+  Prev = IRB.CreateXor(Prev, IRB.CreateLShr(Prev, 16));
+
+  // as in the classic mode, A->B and B->A differ
+  llvm::Value *Next =
+      IRB.CreateZExt(IRB.CreateLShr(CurLoc, 1), IRB.getInt64Ty());
+  if (shift < 64) Next = IRB.CreateXor(IRB.CreateShl(Hash, shift), Next);
+  if (bits < 64) Next = IRB.CreateAnd(Next, (1ULL << bits) - 1);
+
+  setNoSanitize(IRB.CreateStore(Next, Ngram));
+  return Prev;
+}
+
+// Calls into the runtime do not look at the hash.
+static bool isRuntimeCall(const llvm::CallInst *CI) {
+  const llvm::Function *Callee = CI->getCalledFunction();
+
+  if (llvm::isa<llvm::IntrinsicInst>(CI)) return true;
+  if (!Callee) return false;
+
+  llvm::StringRef Name = Callee->getName();
+  return !Name.find("__afl_") || !Name.find("__cmplog_") ||
+         !Name.find("__sanitizer_cov_");
+}
+
+// Once F is instrumented: reads __afl_prev_ngram into the local of
+// prepareNgram() on entry and after every call, writes it back before every
+// call and return, then turns the local into a register.
+void promoteNgram(llvm::Function &F, llvm::Value *Ngram,
+                  llvm::GlobalVariable *State) {
+  auto *Slot = llvm::dyn_cast<llvm::AllocaInst>(Ngram);
+  if (!Slot) return;
+
+  llvm::Type *Int64Ty = Slot->getAllocatedType();
+
+  auto copy = [&](llvm::Instruction *Before, llvm::Value *From,
+                  llvm::Value *To) {
+    llvm::IRBuilder<> IRB(Before);
+    llvm::LoadInst   *Hash = IRB.CreateLoad(Int64Ty, From);
+    setNoSanitize(Hash);
+    setNoSanitize(IRB.CreateStore(Hash, To));
+  };
+
+  copy(Slot->getNextNode(), State, Slot);
+
+  for (auto &BB : F) {
+    for (auto &I : BB) {
+      if (llvm::isa<llvm::ReturnInst>(&I)) {
+        copy(&I, Slot, State);
+        continue;
+      }
+
+      auto *CI = llvm::dyn_cast<llvm::CallInst>(&I);
+      if (!CI || isRuntimeCall(CI)) continue;
+
+      copy(CI, Slot, State);
+      copy(CI->getNextNode(), State, Slot);
+    }
+  }
+
+  // the new code did not change the CFG
+  llvm::DominatorTree DT(F);
+  llvm::PromoteMemToReg({Slot}, DT);
+
+  // no need to write back what was just read and not changed, or to read
+  // what is not used
+  llvm::SmallVector<llvm::Instruction *, 16> Unchanged;
+
+  for (auto *U : State->users()) {
+    auto *SI = llvm::dyn_cast<llvm::StoreInst>(U);
+    if (!SI || SI->getFunction() != &F) continue;
+
+    auto *LI = llvm::dyn_cast<llvm::LoadInst>(SI->getValueOperand());
+    if (!LI || LI->getPointerOperand() != State ||
+        LI->getParent() != SI->getParent())
+      continue;
+
+    bool written = false;
+    for (auto *I = LI->getNextNode(); I != SI; I = I->getNextNode())
+      if (I->mayWriteToMemory()) written = true;
+
+    if (!written) Unchanged.push_back(SI);
+  }
+
+  for (auto *I : Unchanged)
+    I->eraseFromParent();
+
+  Unchanged.clear();
+  for (auto *U : State->users()) {
+    auto *LI = llvm::dyn_cast<llvm::LoadInst>(U);
+    if (LI && LI->getFunction() == &F && LI->use_empty())
+      Unchanged.push_back(LI);
+  }
+
+  for (auto *I : Unchanged)
+    I->eraseFromParent();
+}
+
+// The laf-intel cost model (AFL_LLVM_LAF_COST=n): -1 when it is off, else the
+// loop depth from which on compares are not split, 0 for no such limit.
+
+int getLafCost() {
+  static int laf_cost = -2;
+
+  if (laf_cost == -2) {
+    char *ptr = getenv("AFL_LLVM_LAF_COST");
+
+    laf_cost = ptr ? atoi(ptr) : -1;
+    if (ptr && laf_cost < 0)
+      FATAL("Bad value of AFL_LLVM_LAF_COST (must be 0 or a loop depth)");
+  }
+
+  return laf_cost;
+}
+
+// True if V is computed from constants only, through arithmetic, casts,
+// selects and phis, like a loop counter: nothing the input can change.
+static bool isUntainted(llvm::Value                          *V,
+                        llvm::SmallPtrSetImpl<llvm::Value *> &Seen,
+                        unsigned int                          depth) {
+  if (llvm::isa<llvm::Constant>(V)) return true;
+
+  auto *I = llvm::dyn_cast<llvm::Instruction>(V);
+  if (!I || depth > 16) return false;
+
+  // a cycle through a phi, the values coming in from elsewhere decide
+  if (!Seen.insert(I).second) return true;
+
+  if (!llvm::isa<llvm::BinaryOperator>(I) && !llvm::isa<llvm::CastInst>(I) &&
+      !llvm::isa<llvm::SelectInst>(I) && !llvm::isa<llvm::PHINode>(I) &&
+      !llvm::isa<llvm::CmpInst>(I))
+    return false;
+
+  for (auto &Op : I->operands())
+    if (!isUntainted(Op, Seen, depth + 1)) return false;
+
+  return true;
+}
+
+// True if the laf-intel passes should leave I (a compare or a switch) alone
+// with AFL_LLVM_LAF_COST: it is in a loop nested at least that deep in LI,
+// which is empty unless the caller analyzed the function for it, or it only
+// looks at values the input has no part in. Splitting those makes for blocks
+// every run goes through alike, and they are the ones that run most often.
+bool isLafSkipped(llvm::Instruction *I, const llvm::LoopInfo &LI) {
+  int laf_cost = getLafCost();
+
+  if (laf_cost < 0) return false;
+
+  if (laf_cost > 0 && LI.getLoopDepth(I->getParent()) >= (unsigned)laf_cost)
+    return true;
+
+  llvm::SmallPtrSet<llvm::Value *, 16> Seen;
+
+  if (auto *SI = llvm::dyn_cast<llvm::SwitchInst>(I))
+    return isUntainted(SI->getCondition(), Seen, 0);
+
+  for (auto &Op : I->operands())
+    if (!isUntainted(Op, Seen, 0)) return false;
+
+  return true;
+}
@@ -22,6 +22,10 @@ typedef long double max_align_t;
 #include "llvm/IR/Module.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/MathExtras.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/Analysis/PostDominators.h"
+#include "llvm/Analysis/LoopInfo.h"
 #if LLVM_VERSION_MAJOR < 17
   #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #endif
@@ -55,6 +59,26 @@ void  initInstrumentList();
 bool  isInInstrumentList(llvm::Function *F, std::string Filename);
 unsigned long long int calculateCollisions(uint32_t edges);
 void                   scanForDangerousFunctions(llvm::Module *M);
+unsigned int           pruneEquivalentBlocks(
+              llvm::SmallVectorImpl<llvm::BasicBlock *> &Blocks,
+              const llvm::DominatorTree                 *DT,
+              const llvm::PostDominatorTree             *PDT);
+bool                   isLoopCompressible(const llvm::Loop *L);
+unsigned int           dropAlwaysHitBlocks(
+              llvm::Function                            *F,
+              llvm::SmallVectorImpl<llvm::BasicBlock *> &Blocks);
+unsigned int           getNgramSize();
+llvm::GlobalVariable  *createNgramState(llvm::Module &M);
+llvm::GlobalVariable  *createMapNote(llvm::Module &M, uint32_t type,
+                                     uint32_t value, uint32_t flags,
+                                     llvm::StringRef data = "");
+llvm::Value *prepareNgram(llvm::Function &F, llvm::GlobalVariable *State);
+llvm::Value *emitNgram(llvm::IRBuilderBase &IRB, llvm::Value *Ngram,
+                       llvm::Value *CurLoc, unsigned int ngram_size);
+void         promoteNgram(llvm::Function &F, llvm::Value *Ngram,
+                          llvm::GlobalVariable *State);
+int          getLafCost();
+bool         isLafSkipped(llvm::Instruction *I, const llvm::LoopInfo &LI);
 
 #ifndef IS_EXTERN
   #define IS_EXTERN
@@ -32,9 +32,12 @@
 #include <ctype.h>
 
 #include <list>
+#include <map>
 #include <string>
 #include <fstream>
 #include <set>
+#include <vector>
+#include <algorithm>
 
 #include "llvm/Config/llvm-config.h"
 #include "llvm/ADT/Statistic.h"
@@ -50,6 +53,7 @@
 #include "llvm/IR/Module.h"
 #include "llvm/IR/DebugInfo.h"
 #include "llvm/IR/CFG.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/Verifier.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/raw_ostream.h"
@@ -72,18 +76,35 @@ using namespace llvm;
 
 namespace {
 
+// What the ranking of a token is based on: how often it is compared, the
+// deepest loop it is compared in, and whether that happens in a function that
+// reads input or is called by one.
+struct DictToken {
+  u32  calls = 0;
+  u32  depth = 0;
+  bool input = false;
+};
+
 #if LLVM_VERSION_MAJOR >= 11 /* use new pass manager */
 class AFLdict2filePass : public PassInfoMixin<AFLdict2filePass> {
-  std::ofstream of;
-  void          dict2file(u8 *, u32);
+  std::ofstream                    of;
+  std::map<std::string, DictToken> tokens;
+  u32                              cur_depth = 0;
+  bool                             cur_input = false;
+  void                             dict2file(u8 *, u32);
+  void                             writeDict();
 
  public:
   AFLdict2filePass() {
 #else
 
 class AFLdict2filePass : public ModulePass {
-  std::ofstream of;
-  void          dict2file(u8 *, u32);
+  std::ofstream                    of;
+  std::map<std::string, DictToken> tokens;
+  u32                              cur_depth = 0;
+  bool                             cur_input = false;
+  void                             dict2file(u8 *, u32);
+  void                             writeDict();
 
  public:
   static char ID;
@@ -124,34 +145,83 @@ llvmGetPassPluginInfo() {
 char AFLdict2filePass::ID = 0;
 #endif
 
+// Functions that hand input to the target.
+static const char *inputFunctions[] = {
+    "read",     "pread",    "readv",    "fread",         "fread_unlocked",
+    "fgets",    "fgetc",    "getc",     "getc_unlocked", "_IO_getc",
+    "getchar",  "getline",  "getdelim", "recv",          "recvfrom",
+    "recvmsg",  "scanf",    "fscanf",   "LLVMFuzzerTestOneInput"};
+
+static bool isInputFunction(StringRef name) {
+  for (auto f : inputFunctions) {
+    if (name == f) { return true; }
+  }
+
+  return false;
+}
+
+// The rank afl-fuzz orders the tokens by, see rank_extras() there.
+static u32 dictRank(const DictToken &t) {
+  return std::min(t.calls, 1000U) * (1 + std::min(t.depth, 7U)) *
+         (t.input ? 4 : 1);
+}
+
 void AFLdict2filePass::dict2file(u8 *mem, u32 len) {
-  u32  i, j, binary = 0;
-  char line[MAX_AUTO_EXTRA * 8], tmp[8];
-
-  strcpy(line, "\"");
-  j = 1;
-  for (i = 0; i < len; i++) {
-    if (isprint(mem[i]) && mem[i] != '\\' && mem[i] != '"') {
-      line[j++] = mem[i];
-
-    } else {
-      if (i + 1 != len || mem[i] != 0 || binary || len == 4 || len == 8) {
-        line[j] = 0;
-        sprintf(tmp, "\\x%02x", (u8)mem[i]);
-        strcat(line, tmp);
-        j = strlen(line);
-      }
+  DictToken &t = tokens[std::string((char *)mem, len)];
+
+  ++t.calls;
+  t.depth = std::max(t.depth, cur_depth);
+  t.input |= cur_input;
+}
+
+// Write the tokens of this module, best ranked first, as
+// calls<n>_depth<n>[_input][<rank>]="token"; older afl-fuzz versions skip the
+// label and the rank.
+void AFLdict2filePass::writeDict() {
+  std::vector<std::pair<u32, const std::string *>> sorted;
+
+  for (auto &it : tokens) {
+    sorted.push_back(std::make_pair(dictRank(it.second), &it.first));
+  }
+
+  std::stable_sort(sorted.begin(), sorted.end(),
+                   [](const std::pair<u32, const std::string *> &a,
+                      const std::pair<u32, const std::string *> &b) {
+                     return a.first > b.first;
+                   });
+
+  for (auto &it : sorted) {
+    const DictToken &t = tokens[*it.second];
+    u8              *mem = (u8 *)it.second->data();
+    u32              i, j, len = it.second->size(), binary = 0;
+    char             line[MAX_AUTO_EXTRA * 8 + 64], tmp[8];
+
+    j = snprintf(line, 64, "calls%u_depth%u%s[%u]=\"", t.calls, t.depth,
+                 t.input ? "_input" : "", it.first);
+    for (i = 0; i < len; i++) {
+      if (isprint(mem[i]) && mem[i] != '\\' && mem[i] != '"') {
+        line[j++] = mem[i];
+
+      } else {
+        if (i + 1 != len || mem[i] != 0 || binary || len == 4 || len == 8) {
+          line[j] = 0;
+          sprintf(tmp, "\\x%02x", (u8)mem[i]);
+          strcat(line, tmp);
+          j = strlen(line);
+        }
 
-      binary = 1;
+        binary = 1;
+      }
     }
+
+    line[j] = 0;
+    strcat(line, "\"\n");
+    of << line;
+
+    if (!be_quiet) fprintf(stderr, "Found dictionary token: %s", line);
   }
 
-  line[j] = 0;
-  strcat(line, "\"\n");
-  of << line;
   of.flush();
-
-  if (!be_quiet) fprintf(stderr, "Found dictionary token: %s", line);
 }
 
 #if LLVM_VERSION_MAJOR >= 11 /* use new pass manager */
@@ -196,6 +266,37 @@ bool AFLdict2filePass::runOnModule(Module &M) {
   of.open(ptr, std::ofstream::out | std::ofstream::app);
   if (!of.is_open()) PFATAL("Could not open/create %s.", ptr);
 
+  /* Functions that read input and those they call directly */
+
+  std::set<Function *> inputRelated;
+
+  for (auto &F : M) {
+    bool reads = isInputFunction(F.getName()) && !F.isDeclaration();
+
+    for (auto &BB : F) {
+      for (auto &IN : BB) {
+        if (auto *CI = dyn_cast<CallInst>(&IN)) {
+          Function *Callee = CI->getCalledFunction();
+          if (Callee && isInputFunction(Callee->getName())) { reads = true; }
+        }
+      }
+    }
+
+    if (!reads) { continue; }
+
+    inputRelated.insert(&F);
+
+    for (auto &BB : F) {
+      for (auto &IN : BB) {
+        if (auto *CI = dyn_cast<CallInst>(&IN)) {
+          if (Function *Callee = CI->getCalledFunction()) {
+            inputRelated.insert(Callee);
+          }
+        }
+      }
+    }
+  }
+
   /* Instrument all the things! */
 
   for (auto &F : M) {
@@ -207,6 +308,11 @@ bool AFLdict2filePass::runOnModule(Module &M) {
     if (isIgnoreFunction(&F)) { continue; }
     if (!isInInstrumentList(&F, MNAME) || !F.size()) { continue; }
 
+    DominatorTree DT(F);
+    LoopInfo      LI(DT);
+
+    cur_input = inputRelated.count(&F);
+
     /*  Some implementation notes.
      *
      *  We try to handle 3 cases:
@@ -236,6 +342,8 @@ bool AFLdict2filePass::runOnModule(Module &M) {
      */
 
     for (auto &BB : F) {
+      cur_depth = LI.getLoopDepth(&BB);
+
       for (auto &IN : BB) {
         CallInst *callInst = nullptr;
         CmpInst  *cmpInst = nullptr;
@@ -621,6 +729,7 @@ bool AFLdict2filePass::runOnModule(Module &M) {
     }
   }
 
+  writeDict();
   of.close();
 
   /* Say something nice. */
@@ -629,7 +738,7 @@ bool AFLdict2filePass::runOnModule(Module &M) {
     if (!found)
       OKF("No entries for a dictionary found.");
     else
-      OKF("Wrote %d entries to the dictionary file.\n", found);
+      OKF("Wrote %zu entries to the dictionary file.\n", tokens.size());
   }
 
 #if LLVM_VERSION_MAJOR >= 11 /* use new pass manager */
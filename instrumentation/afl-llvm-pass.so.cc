@@ -271,11 +271,9 @@ bool AFLCoverage::runOnModule(Module &M) {
     }
   }
 
-  unsigned PrevLocSize = 0;
   unsigned PrevCallerSize = 0;
 
-  char *ngram_size_str = getenv("AFL_LLVM_NGRAM_SIZE");
-  if (!ngram_size_str) ngram_size_str = getenv("AFL_NGRAM_SIZE");
+  ngram_size = getNgramSize();
   char *ctx_k_str = getenv("AFL_LLVM_CTX_K");
   if (!ctx_k_str) ctx_k_str = getenv("AFL_CTX_K");
   ctx_str = getenv("AFL_LLVM_CTX");
@@ -284,23 +282,6 @@ bool AFLCoverage::runOnModule(Module &M) {
   bool instrument_ctx = ctx_str || caller_str;
 
 #ifdef AFL_HAVE_VECTOR_INTRINSICS
-  /* Decide previous location vector size (must be a power of two) */
-  VectorType *PrevLocTy = NULL;
-
-  if (ngram_size_str)
-    if (sscanf(ngram_size_str, "%u", &ngram_size) != 1 || ngram_size < 2 ||
-        ngram_size > NGRAM_SIZE_MAX)
-      FATAL(
-          "Bad value of AFL_NGRAM_SIZE (must be between 2 and NGRAM_SIZE_MAX "
-          "(%u))",
-          NGRAM_SIZE_MAX);
-
-  if (ngram_size == 1) ngram_size = 0;
-  if (ngram_size)
-    PrevLocSize = ngram_size - 1;
-  else
-    PrevLocSize = 1;
-
   /* Decide K-ctx vector size (must be a power of two) */
   VectorType *PrevCallerTy = NULL;
 
@@ -321,18 +302,6 @@ bool AFLCoverage::runOnModule(Module &M) {
   }
 
 #else
-  if (ngram_size_str)
-  #ifndef LLVM_VERSION_PATCH
-    FATAL(
-        "Sorry, NGRAM branch coverage is not supported with llvm version "
-        "%d.%d.%d!",
-        LLVM_VERSION_MAJOR, LLVM_VERSION_MINOR, 0);
-  #else
-    FATAL(
-        "Sorry, NGRAM branch coverage is not supported with llvm version "
-        "%d.%d.%d!",
-        LLVM_VERSION_MAJOR, LLVM_VERSION_MINOR, LLVM_VERSION_PATCH);
-  #endif
   if (ctx_k_str)
   #ifndef LLVM_VERSION_PATCH
     FATAL(
@@ -345,18 +314,6 @@ bool AFLCoverage::runOnModule(Module &M) {
         "%d.%d.%d!",
         LLVM_VERSION_MAJOR, LLVM_VERSION_MINOR, LLVM_VERSION_PATCH);
   #endif
-  PrevLocSize = 1;
-#endif
-
-#ifdef AFL_HAVE_VECTOR_INTRINSICS
-  int PrevLocVecSize = PowerOf2Ceil(PrevLocSize);
-  if (ngram_size)
-    PrevLocTy = VectorType::get(IntLocTy, PrevLocVecSize
-  #if LLVM_VERSION_MAJOR >= 12
-                                ,
-                                false
-  #endif
-    );
 #endif
 
 #ifdef AFL_HAVE_VECTOR_INTRINSICS
@@ -371,12 +328,13 @@ bool AFLCoverage::runOnModule(Module &M) {
 #endif
 
   /* Get globals for the SHM region and the previous location. Note that
-     __afl_prev_loc is thread-local. */
+     __afl_prev_loc and __afl_prev_ngram are thread-local. */
 
   GlobalVariable *AFLMapPtr =
       new GlobalVariable(M, PointerType::get(Int8Ty, 0), false,
                          GlobalValue::ExternalLinkage, 0, "__afl_area_ptr");
   GlobalVariable *AFLPrevLoc;
+  GlobalVariable *AFLPrevNgram = NULL;
   GlobalVariable *AFLPrevCaller;
   GlobalVariable *AFLContext = NULL;
 
@@ -390,30 +348,17 @@ bool AFLCoverage::runOnModule(Module &M) {
         GlobalVariable::GeneralDynamicTLSModel, 0, false);
 #endif
 
-#ifdef AFL_HAVE_VECTOR_INTRINSICS
-  if (ngram_size)
-  #if defined(__ANDROID__) || defined(__HAIKU__) || defined(NO_TLS)
-    AFLPrevLoc = new GlobalVariable(
-        M, PrevLocTy, /* isConstant */ false, GlobalValue::ExternalLinkage,
-        /* Initializer */ nullptr, "__afl_prev_loc");
-  #else
-    AFLPrevLoc = new GlobalVariable(
-        M, PrevLocTy, /* isConstant */ false, GlobalValue::ExternalLinkage,
-        /* Initializer */ nullptr, "__afl_prev_loc",
-        /* InsertBefore */ nullptr, GlobalVariable::GeneralDynamicTLSModel,
-        /* AddressSpace */ 0, /* IsExternallyInitialized */ false);
-  #endif
-  else
-#endif
 #if defined(__ANDROID__) || defined(__HAIKU__) || defined(NO_TLS)
-    AFLPrevLoc = new GlobalVariable(
-        M, Int32Ty, false, GlobalValue::ExternalLinkage, 0, "__afl_prev_loc");
+  AFLPrevLoc = new GlobalVariable(
+      M, Int32Ty, false, GlobalValue::ExternalLinkage, 0, "__afl_prev_loc");
 #else
   AFLPrevLoc = new GlobalVariable(
       M, Int32Ty, false, GlobalValue::ExternalLinkage, 0, "__afl_prev_loc", 0,
       GlobalVariable::GeneralDynamicTLSModel, 0, false);
 #endif
 
+  if (ngram_size) AFLPrevNgram = createNgramState(M);
+
 #ifdef AFL_HAVE_VECTOR_INTRINSICS
   if (ctx_k)
   #if defined(__ANDROID__) || defined(__HAIKU__) || defined(NO_TLS)
@@ -440,19 +385,9 @@ bool AFLCoverage::runOnModule(Module &M) {
 #endif
 
 #ifdef AFL_HAVE_VECTOR_INTRINSICS
-  /* Create the vector shuffle mask for updating the previous block history.
-     Note that the first element of the vector will store cur_loc, so just set
-     it to undef to allow the optimizer to do its thing. */
-
-  SmallVector<Constant *, 32> PrevLocShuffle = {UndefValue::get(Int32Ty)};
-
-  for (unsigned I = 0; I < PrevLocSize - 1; ++I)
-    PrevLocShuffle.push_back(ConstantInt::get(Int32Ty, I));
-
-  for (int I = PrevLocSize; I < PrevLocVecSize; ++I)
-    PrevLocShuffle.push_back(ConstantInt::get(Int32Ty, PrevLocSize));
-
-  Constant *PrevLocShuffleMask = ConstantVector::get(PrevLocShuffle);
+  /* Create the vector shuffle mask for updating the previous caller history.
+     Note that the first element of the vector will store the new context, so
+     just set it to undef to allow the optimizer to do its thing. */
 
   Constant                   *PrevCallerShuffleMask = NULL;
   SmallVector<Constant *, 32> PrevCallerShuffle = {UndefValue::get(Int32Ty)};
@@ -491,9 +426,14 @@ bool AFLCoverage::runOnModule(Module &M) {
     if (F.size() < function_minimum_size) { continue; }
 
     std::list<Value *> todo;
+    Value             *Ngram = NULL;  // N-gram hash of F
+
+    if (ngram_size) Ngram = prepareNgram(F, AFLPrevNgram);
+
     for (auto &BB : F) {
       BasicBlock::iterator IP = BB.getFirstInsertionPt();
-      IRBuilder<>          IRB(&(*IP));
+      if (Ngram && &*IP == Ngram) ++IP;
+      IRBuilder<> IRB(&(*IP));
 
       // Context sensitive coverage
       if (instrument_ctx && &BB == &F.getEntryBlock()) {
@@ -636,48 +576,31 @@ bool AFLCoverage::runOnModule(Module &M) {
 
 #endif
 
-      ConstantInt *CurLoc;
-
-#ifdef AFL_HAVE_VECTOR_INTRINSICS
-      if (ngram_size)
-        CurLoc = ConstantInt::get(IntLocTy, cur_loc);
-      else
-#endif
-        CurLoc = ConstantInt::get(Int32Ty, cur_loc);
+      ConstantInt *CurLoc = ConstantInt::get(Int32Ty, cur_loc);
 
       /* Load prev_loc */
 
-      LoadInst *PrevLoc;
+      Value *PrevLocTrans;
 
       if (ngram_size) {
-        PrevLoc = IRB.CreateLoad(
-#if LLVM_VERSION_MAJOR >= 14
-            PrevLocTy,
-#endif
-            AFLPrevLoc);
+        /* "For efficiency, we propose to hash the tuple as a key into the
+           hit_count map as (prev_block_trans << 1) ^ curr_block_trans, where
+           prev_block_trans = (block_trans_1 ^ ... ^ block_trans_(n-1)" -
+           here the hash of emitNgram() takes the place of the xor. */
+
+        PrevLocTrans = IRB.CreateAnd(
+            emitNgram(IRB, Ngram, CurLoc, ngram_size), map_size - 1);
 
       } else {
-        PrevLoc = IRB.CreateLoad(
+        LoadInst *PrevLoc = IRB.CreateLoad(
 #if LLVM_VERSION_MAJOR >= 14
             IRB.getInt32Ty(),
 #endif
             AFLPrevLoc);
-      }
-
-      PrevLoc->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
-      Value *PrevLocTrans;
-
-#ifdef AFL_HAVE_VECTOR_INTRINSICS
-      /* "For efficiency, we propose to hash the tuple as a key into the
-         hit_count map as (prev_block_trans << 1) ^ curr_block_trans, where
-         prev_block_trans = (block_trans_1 ^ ... ^ block_trans_(n-1)" */
-
-      if (ngram_size)
-        PrevLocTrans =
-            IRB.CreateZExt(IRB.CreateXorReduce(PrevLoc), IRB.getInt32Ty());
-      else
-#endif
+        PrevLoc->setMetadata(M.getMDKindID("nosanitize"),
+                             MDNode::get(C, None));
         PrevLocTrans = PrevLoc;
+      }
 
       if (instrument_ctx)
         PrevLocTrans =
@@ -694,21 +617,11 @@ bool AFLCoverage::runOnModule(Module &M) {
           AFLMapPtr);
       MapPtr->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
 
-      Value *MapPtrIdx;
-#ifdef AFL_HAVE_VECTOR_INTRINSICS
-      if (ngram_size)
-        MapPtrIdx = IRB.CreateGEP(
-            Int8Ty, MapPtr,
-            IRB.CreateZExt(
-                IRB.CreateXor(PrevLocTrans, IRB.CreateZExt(CurLoc, Int32Ty)),
-                Int32Ty));
-      else
-#endif
-        MapPtrIdx = IRB.CreateGEP(
+      Value *MapPtrIdx = IRB.CreateGEP(
 #if LLVM_VERSION_MAJOR >= 14
-            Int8Ty,
+          Int8Ty,
 #endif
-            MapPtr, IRB.CreateXor(PrevLocTrans, CurLoc));
+          MapPtr, IRB.CreateXor(PrevLocTrans, CurLoc));
 
       /* Update bitmap */
 
@@ -762,27 +675,11 @@ bool AFLCoverage::runOnModule(Module &M) {
 
       } /* non atomic case */
 
-      /* Update prev_loc history vector (by placing cur_loc at the head of the
-         vector and shuffle the other elements back by one) */
-
-      StoreInst *Store;
+      /* Update prev_loc, the N-gram hash already has cur_loc */
 
-#ifdef AFL_HAVE_VECTOR_INTRINSICS
-      if (ngram_size) {
-        Value *ShuffledPrevLoc = IRB.CreateShuffleVector(
-            PrevLoc, UndefValue::get(PrevLocTy), PrevLocShuffleMask);
-        Value *UpdatedPrevLoc = IRB.CreateInsertElement(
-            ShuffledPrevLoc, IRB.CreateLShr(CurLoc, (uint64_t)1), (uint64_t)0);
-
-        Store = IRB.CreateStore(UpdatedPrevLoc, AFLPrevLoc);
-        Store->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
-
-      } else
-#endif
-      {
-
-        Store = IRB.CreateStore(ConstantInt::get(Int32Ty, cur_loc >> 1),
-                                AFLPrevLoc);
+      if (!ngram_size) {
+        StoreInst *Store = IRB.CreateStore(
+            ConstantInt::get(Int32Ty, cur_loc >> 1), AFLPrevLoc);
         Store->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
       }
 
@@ -809,6 +706,8 @@ bool AFLCoverage::runOnModule(Module &M) {
       inst_blocks++;
     }
 
+    if (Ngram) promoteNgram(F, Ngram, AFLPrevNgram);
+
 #if 0
     if (use_threadsafe_counters) {                       /*Atomic NeverZero */
       // handle the list of registered blocks to instrument
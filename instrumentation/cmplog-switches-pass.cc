@@ -57,7 +57,10 @@
   #define nullptr 0
 #endif
 
+#include <algorithm>
+#include <map>
 #include <set>
+#include <vector>
 #include "afl-llvm-common.h"
 
 using namespace llvm;
@@ -212,6 +215,28 @@ bool CmplogSwitches::hookInstrs(Module &M) {
   Function *cmplogHookIns8 = cast<Function>(c8);
 #endif
 
+#if LLVM_VERSION_MAJOR >= 9
+  FunctionCallee
+#else
+  Constant *
+#endif
+      cs = M.getOrInsertFunction("__cmplog_switch_hook", VoidTy, Int64Ty,
+                                 PointerType::get(Int8Ty, 0), Int32Ty, Int8Ty
+#if LLVM_VERSION_MAJOR < 5
+                                 ,
+                                 NULL
+#endif
+      );
+#if LLVM_VERSION_MAJOR >= 9
+  FunctionCallee cmplogHookSwitch = cs;
+#else
+  Function *cmplogHookSwitch = cast<Function>(cs);
+#endif
+
+  /* the case tables of the switches, one per set of cases and size */
+  std::map<std::pair<unsigned, std::vector<uint64_t>>, GlobalVariable *>
+      caseTables;
+
   GlobalVariable *AFLCmplogPtr = M.getNamedGlobal("__afl_cmp_map");
 
   if (!AFLCmplogPtr) {
@@ -298,6 +323,51 @@ bool CmplogSwitches::hookInstrs(Module &M) {
 
       Value *CompareTo = Val;
 
+      /* Up to 64 bits the value is logged once per execution, with a
+         table of the cases the runtime copies into the log row of the
+         switch, instead of a compare per case. Switches with the same
+         cases share the table. */
+      if (cast_size <= 64) {
+        std::vector<uint64_t> cases;
+
+        for (SwitchInst::CaseIt i = SI->case_begin(), e = SI->case_end();
+             i != e; ++i) {
+#if LLVM_VERSION_MAJOR < 5
+          cases.push_back(i.getCaseValue()->getZExtValue());
+#else
+          cases.push_back(i->getCaseValue()->getZExtValue());
+#endif
+        }
+
+        std::sort(cases.begin(), cases.end());
+
+        GlobalVariable *&table = caseTables[std::make_pair(cast_size, cases)];
+
+        if (!table) {
+          IntegerType            *CaseTy = IntegerType::get(C, cast_size);
+          std::vector<Constant *> elems;
+
+          for (uint64_t v : cases) {
+            elems.push_back(ConstantInt::get(CaseTy, v));
+          }
+
+          ArrayType *TableTy = ArrayType::get(CaseTy, cases.size());
+          table = new GlobalVariable(M, TableTy, true,
+                                     GlobalValue::PrivateLinkage,
+                                     ConstantArray::get(TableTy, elems),
+                                     "__cmplog_switch_cases");
+        }
+
+        std::vector<Value *> args;
+        args.push_back(IRB.CreateZExt(Val, Int64Ty));
+        args.push_back(
+            IRB.CreatePointerCast(table, PointerType::get(Int8Ty, 0)));
+        args.push_back(ConstantInt::get(Int32Ty, cases.size()));
+        args.push_back(ConstantInt::get(Int8Ty, cast_size / 8));
+        IRB.CreateCall(cmplogHookSwitch, args);
+        continue;
+      }
+
       if (do_cast) {
         CompareTo =
             IRB.CreateIntCast(CompareTo, IntegerType::get(C, cast_size), false);
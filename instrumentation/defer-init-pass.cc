@@ -0,0 +1,267 @@
+/*
+   american fuzzy lop++ - LLVM deferred forkserver placement
+   ---------------------------------------------------------
+
+   Copyright 2019-2024 AFLplusplus Project. All rights reserved.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at:
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+   Inserts the deferred forkserver start (__afl_manual_init()) at the places
+   given in AFL_LLVM_DEFER_AT, a comma separated list of function[:callee].
+   With a callee the call goes in front of every call to callee in function,
+   otherwise at the entry of function. utils/defer_profile finds these
+   places for a target. __afl_manual_init() only acts on its first call, so
+   it is fine if a place is reached more than once.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+#include "llvm/Config/llvm-config.h"
+
+#include "llvm/IR/IRBuilder.h"
+#if LLVM_VERSION_MAJOR >= 11 /* use new pass manager */
+  #include "llvm/Passes/PassPlugin.h"
+  #include "llvm/Passes/PassBuilder.h"
+  #include "llvm/IR/PassManager.h"
+#else
+  #include "llvm/IR/LegacyPassManager.h"
+  #include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#endif
+#include "llvm/IR/Module.h"
+#include "llvm/Support/raw_ostream.h"
+#if LLVM_VERSION_MAJOR < 17
+  #include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#endif
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include "llvm/Pass.h"
+
+#if LLVM_VERSION_MAJOR >= 4 || \
+    (LLVM_VERSION_MAJOR == 3 && LLVM_VERSION_MINOR > 4)
+  #include "llvm/IR/Verifier.h"
+#else
+  #include "llvm/Analysis/Verifier.h"
+  #define nullptr 0
+#endif
+
+#include "config.h"
+#include "afl-llvm-common.h"
+
+using namespace llvm;
+
+namespace {
+
+#if LLVM_VERSION_MAJOR >= 11 /* use new pass manager */
+class DeferInit : public PassInfoMixin<DeferInit> {
+ public:
+  DeferInit() {
+#else
+class DeferInit : public ModulePass {
+ public:
+  static char ID;
+  DeferInit() : ModulePass(ID) {
+#endif
+
+  }
+
+#if LLVM_VERSION_MAJOR >= 11 /* use new pass manager */
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM);
+#else
+  bool runOnModule(Module &M) override;
+
+  #if LLVM_VERSION_MAJOR >= 4
+  StringRef getPassName() const override {
+  #else
+  const char *getPassName() const override {
+  #endif
+    return "Deferred forkserver placement";
+  }
+
+#endif
+
+ private:
+  bool insertInit(Module &M);
+};
+
+}  // namespace
+
+#if LLVM_MAJOR >= 11
+extern "C" ::llvm::PassPluginLibraryInfo LLVM_ATTRIBUTE_WEAK
+llvmGetPassPluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, "DeferInit", "v0.1",
+          /* lambda to insert our pass into the pass pipeline. */
+          [](PassBuilder &PB) {
+
+  #if LLVM_VERSION_MAJOR <= 13
+            using OptimizationLevel = typename PassBuilder::OptimizationLevel;
+  #endif
+            /* run before the inliner copies the places into callers */
+  #if LLVM_VERSION_MAJOR >= 12
+            PB.registerPipelineStartEPCallback(
+                [](ModulePassManager &MPM, OptimizationLevel OL) {
+                  MPM.addPass(DeferInit());
+                });
+  #else
+            PB.registerPipelineStartEPCallback(
+                [](ModulePassManager &MPM) { MPM.addPass(DeferInit()); });
+  #endif
+          }};
+}
+
+#else
+char DeferInit::ID = 0;
+#endif
+
+bool DeferInit::insertInit(Module &M) {
+  std::vector<std::pair<std::string, std::string> > places;
+  LLVMContext &C = M.getContext();
+  Type        *VoidTy = Type::getVoidTy(C);
+  bool         inserted = false;
+
+  if (!getenv("AFL_LLVM_DEFER_AT")) { return false; }
+
+  std::string spec = getenv("AFL_LLVM_DEFER_AT");
+  size_t      pos = 0;
+
+  while (pos <= spec.size()) {
+    size_t      end = spec.find(',', pos);
+    std::string place = spec.substr(pos, end - pos);
+    size_t      colon = place.find(':');
+
+    if (!place.empty()) {
+      if (colon == std::string::npos) {
+        places.push_back(std::make_pair(place, std::string()));
+
+      } else {
+        places.push_back(
+            std::make_pair(place.substr(0, colon), place.substr(colon + 1)));
+      }
+    }
+
+    if (end == std::string::npos) { break; }
+    pos = end + 1;
+  }
+
+#if LLVM_VERSION_MAJOR >= 9
+  FunctionCallee
+#else
+  Constant *
+#endif
+      c = M.getOrInsertFunction("__afl_manual_init", VoidTy
+#if LLVM_VERSION_MAJOR < 5
+                                ,
+                                NULL
+#endif
+      );
+#if LLVM_VERSION_MAJOR >= 9
+  FunctionCallee initFunc = c;
+#else
+  Function *initFunc = cast<Function>(c);
+#endif
+
+  for (auto &F : M) {
+    if (F.isDeclaration()) { continue; }
+
+    for (auto &place : places) {
+      if (F.getName().compare(place.first) != 0) { continue; }
+
+      if (place.second.empty()) {
+        IRBuilder<> IRB(&*F.getEntryBlock().getFirstInsertionPt());
+        IRB.CreateCall(initFunc);
+        inserted = true;
+
+        if (!be_quiet) {
+          errs() << "Deferred forkserver start at the entry of "
+                 << place.first << "\n";
+        }
+
+        continue;
+      }
+
+      std::vector<CallInst *> calls;
+
+      for (auto &BB : F) {
+        for (auto &IN : BB) {
+          CallInst *callInst = dyn_cast<CallInst>(&IN);
+          if (!callInst) { continue; }
+
+          Function *Callee = callInst->getCalledFunction();
+          if (!Callee || Callee->getName().compare(place.second) != 0) {
+            continue;
+          }
+
+          calls.push_back(callInst);
+        }
+      }
+
+      for (auto callInst : calls) {
+        IRBuilder<> IRB(callInst);
+        IRB.CreateCall(initFunc);
+        inserted = true;
+      }
+
+      if (!be_quiet && !calls.empty()) {
+        errs() << "Deferred forkserver start before " << calls.size()
+               << " call(s) of " << place.second << " in " << place.first
+               << "\n";
+      }
+    }
+  }
+
+  if (inserted) {
+    /* tell afl-fuzz that the forkserver starts late, like __AFL_INIT() */
+
+    Constant *sig = ConstantDataArray::getString(C, DEFER_SIG, true);
+    auto     *gv = new GlobalVariable(M, sig->getType(), true,
+                                      GlobalValue::PrivateLinkage, sig,
+                                      "__afl_defer_sig");
+    appendToUsed(M, {gv});
+  }
+
+  return inserted;
+}
+
+#if LLVM_VERSION_MAJOR >= 11 /* use new pass manager */
+PreservedAnalyses DeferInit::run(Module &M, ModuleAnalysisManager &MAM) {
+#else
+bool DeferInit::runOnModule(Module &M) {
+#endif
+
+  if (getenv("AFL_QUIET") != NULL) { be_quiet = 1; }
+
+  bool inserted = insertInit(M);
+#if LLVM_VERSION_MAJOR >= 11 /* use new pass manager */
+  auto PA = inserted ? PreservedAnalyses::none() : PreservedAnalyses::all();
+#endif
+  verifyModule(M);
+
+#if LLVM_VERSION_MAJOR >= 11 /* use new pass manager */
+  return PA;
+#else
+  return inserted;
+#endif
+}
+
+#if LLVM_VERSION_MAJOR < 11 /* use old pass manager */
+static void registerDeferInitPass(const PassManagerBuilder &,
+                                  legacy::PassManagerBase &PM) {
+  auto p = new DeferInit();
+  PM.add(p);
+}
+
+static RegisterStandardPasses RegisterDeferInitPass(
+    PassManagerBuilder::EP_ModuleOptimizerEarly, registerDeferInitPass);
+
+static RegisterStandardPasses RegisterDeferInitPass0(
+    PassManagerBuilder::EP_EnabledOnOptLevel0, registerDeferInitPass);
+
+#endif
@@ -204,6 +204,9 @@ bool SplitComparesTransform::simplifyFPCompares(Module &M) {
   for (auto &F : M) {
     if (!isInInstrumentList(&F, MNAME)) continue;
 
+    LoopInfo LI;
+    if (getLafCost() > 0 && !F.isDeclaration()) LI.analyze(DominatorTree(F));
+
     for (auto &BB : F) {
       for (auto &IN : BB) {
         CmpInst *selectcmpInst = nullptr;
@@ -225,6 +228,8 @@ bool SplitComparesTransform::simplifyFPCompares(Module &M) {
 
             if (TyOp0->isArrayTy() || TyOp0->isVectorTy()) { continue; }
 
+            if (isLafSkipped(selectcmpInst, LI)) { continue; }
+
             fcomps.push_back(selectcmpInst);
           }
         }
@@ -848,6 +853,9 @@ size_t SplitComparesTransform::splitFPCompares(Module &M) {
   for (auto &F : M) {
     if (!isInInstrumentList(&F, MNAME)) continue;
 
+    LoopInfo LI;
+    if (getLafCost() > 0 && !F.isDeclaration()) LI.analyze(DominatorTree(F));
+
     for (auto &BB : F) {
       for (auto &IN : BB) {
         CmpInst *selectcmpInst = nullptr;
@@ -871,6 +879,8 @@ size_t SplitComparesTransform::splitFPCompares(Module &M) {
 
             if (TyOp0->isArrayTy() || TyOp0->isVectorTy()) { continue; }
 
+            if (isLafSkipped(selectcmpInst, LI)) { continue; }
+
             fcomps.push_back(selectcmpInst);
           }
         }
@@ -1602,6 +1612,10 @@ bool SplitComparesTransform::runOnModule(Module &M) {
     for (auto &F : M) {
       if (!isInInstrumentList(&F, MNAME)) continue;
 
+      LoopInfo LI;
+      if (getLafCost() > 0 && !F.isDeclaration())
+        LI.analyze(DominatorTree(F));
+
       for (auto &BB : F) {
         for (auto &IN : BB) {
           if (auto CI = dyn_cast<CmpInst>(&IN)) {
@@ -1618,7 +1632,9 @@ bool SplitComparesTransform::runOnModule(Module &M) {
             auto iTy1 = dyn_cast<IntegerType>(op0->getType());
             if (iTy1 && isa<IntegerType>(op1->getType())) {
               unsigned bitw = iTy1->getBitWidth();
-              if (isSupportedBitWidth(bitw)) { worklist.push_back(CI); }
+              if (isSupportedBitWidth(bitw) && !isLafSkipped(CI, LI)) {
+                worklist.push_back(CI);
+              }
             }
           }
         }
@@ -336,11 +336,15 @@ bool SplitSwitchesTransform::splitSwitches(Module &M) {
   for (auto &F : M) {
     if (!isInInstrumentList(&F, MNAME)) continue;
 
+    LoopInfo LI;
+    if (getLafCost() > 0 && !F.isDeclaration()) LI.analyze(DominatorTree(F));
+
     for (auto &BB : F) {
       SwitchInst *switchInst = nullptr;
 
       if ((switchInst = dyn_cast<SwitchInst>(BB.getTerminator()))) {
         if (switchInst->getNumCases() < 1) continue;
+        if (isLafSkipped(switchInst, LI)) continue;
         switches.push_back(switchInst);
       }
     }
@@ -29,10 +29,22 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <stddef.h>
 #include <assert.h>
 #include <pthread.h>
+#include <sys/mman.h>
 
 #define REDZONE_SIZE 128
 // 50 mb quarantine
 #define QUARANTINE_MAX_BYTES 52428800
+// at most 1M chunks in quarantine, the ring takes 8 mb
+#define QUARANTINE_SLOTS (1 << 20)
+// a thread puts the chunks it frees into the quarantine this many at a time
+#define QUARANTINE_BATCH 32
+
+// chunks of up to 32 kb out of quarantine are kept per thread, in 12 classes
+// of 16 bytes to 32 kb, at most CACHE_MAX per class
+#define CACHE_MIN_SHIFT 4
+#define CACHE_CLASSES 12
+#define CACHE_MAX 32
+#define CLASS_SIZE(c) ((size_t)1 << (CACHE_MIN_SHIFT + (c)))
 
 #if __STDC_VERSION__ < 201112L || \
     (defined(__FreeBSD__) && __FreeBSD_version < 1200000)
@@ -84,47 +96,177 @@ void  dlfree(void *);
 
 int __libqasan_malloc_initialized;
 
-static struct chunk_begin *quarantine_top;
-static struct chunk_begin *quarantine_end;
-static size_t              quarantine_bytes;
+// the oldest chunk is at quarantine_ring[quarantine_tail]
+static struct chunk_begin **quarantine_ring;
+static size_t               quarantine_tail;
+static size_t               quarantine_count;
+static size_t               quarantine_bytes;
+static int                  quarantine_ready;
+static int                  quarantine_hugepages;
+
+struct thread_cache {
+  struct chunk_begin *free_list[CACHE_CLASSES];
+  unsigned            count[CACHE_CLASSES];
+  struct chunk_begin *pending[QUARANTINE_BATCH];
+  unsigned            pending_count;
+  int                 registered;
+};
 
-#ifdef __BIONIC__
-static pthread_mutex_t quarantine_lock;
-  #define LOCK_TRY pthread_mutex_trylock
-  #define LOCK_INIT pthread_mutex_init
-  #define LOCK_UNLOCK pthread_mutex_unlock
-#else
-static pthread_spinlock_t quarantine_lock;
-  #define LOCK_TRY pthread_spin_trylock
-  #define LOCK_INIT pthread_spin_init
-  #define LOCK_UNLOCK pthread_spin_unlock
-#endif
+static __thread struct thread_cache thread_cache;
+static pthread_key_t                thread_cache_key;
+
+// taken once per QUARANTINE_BATCH frees, and held while chunks are released,
+// a spinlock would burn the time slices of the waiters if the holder is
+// preempted
+static pthread_mutex_t quarantine_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// the size class of a chunk, -1 if it is not cached
+static int size_class(size_t size) {
+  int c = 0;
+
+  if (size > CLASS_SIZE(CACHE_CLASSES - 1)) return -1;
+
+  while (CLASS_SIZE(c) < size)
+    c++;
+
+  return c;
+}
+
+// the usable size of the chunk allocated for size
+static size_t chunk_capacity(size_t size) {
+  int c = size_class(size);
+
+  if (c >= 0) return CLASS_SIZE(c);
+
+  return (size + ALLOC_ALIGN_SIZE - 1) & ~(ALLOC_ALIGN_SIZE - 1);
+}
 
 // need qasan disabled
-static int quarantine_push(struct chunk_begin *ck) {
-  if (ck->requested_size >= QUARANTINE_MAX_BYTES) return 0;
+static void chunk_release(struct chunk_begin *ck, struct thread_cache *tc) {
+  int c = size_class(ck->requested_size);
 
-  if (LOCK_TRY(&quarantine_lock)) return 0;
+  if (!ck->aligned_orig && c >= 0 && tc->count[c] < CACHE_MAX) {
+    ck->next = tc->free_list[c];
+    tc->free_list[c] = ck;
+    tc->count[c]++;
+    return;
+  }
 
-  while (ck->requested_size + quarantine_bytes >= QUARANTINE_MAX_BYTES) {
-    struct chunk_begin *tmp = quarantine_end;
-    quarantine_end = tmp->prev;
+  if (ck->aligned_orig)
+    backend_free(ck->aligned_orig);
+  else
+    backend_free(ck);
+}
 
-    quarantine_bytes -= tmp->requested_size;
+// need qasan disabled
+static void quarantine_init(void) {
+  size_t len = QUARANTINE_SLOTS * sizeof(struct chunk_begin *);
+  void  *ring = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+  if (quarantine_hugepages)
+    ring = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
 
-    if (tmp->aligned_orig)
-      backend_free(tmp->aligned_orig);
-    else
-      backend_free(tmp);
+  if (ring == MAP_FAILED)
+    ring = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                -1, 0);
+
+#ifdef MADV_HUGEPAGE
+  if (ring != MAP_FAILED && quarantine_hugepages)
+    madvise(ring, len, MADV_HUGEPAGE);
+#endif
+
+  // without a ring, freed chunks are released right away
+  if (ring != MAP_FAILED) quarantine_ring = ring;
+  quarantine_ready = 1;
+}
+
+// need qasan disabled, moves the chunks the thread freed into the ring and
+// releases those which drop out of it
+static void quarantine_flush(struct thread_cache *tc) {
+  unsigned i;
+
+  pthread_mutex_lock(&quarantine_lock);
+
+  if (!quarantine_ready) quarantine_init();
+
+  for (i = 0; i < tc->pending_count; i++) {
+    struct chunk_begin *ck = tc->pending[i];
+
+    if (!quarantine_ring) {
+      chunk_release(ck, tc);
+      continue;
+    }
+
+    while (quarantine_count &&
+           (quarantine_count == QUARANTINE_SLOTS ||
+            ck->requested_size + quarantine_bytes >= QUARANTINE_MAX_BYTES)) {
+      struct chunk_begin *tmp = quarantine_ring[quarantine_tail];
+      quarantine_tail = (quarantine_tail + 1) % QUARANTINE_SLOTS;
+      quarantine_count--;
+
+      quarantine_bytes -= tmp->requested_size;
+      chunk_release(tmp, tc);
+    }
+
+    quarantine_ring[(quarantine_tail + quarantine_count) % QUARANTINE_SLOTS] =
+        ck;
+    quarantine_count++;
+    quarantine_bytes += ck->requested_size;
   }
 
-  ck->next = quarantine_top;
-  if (quarantine_top) quarantine_top->prev = ck;
-  quarantine_top = ck;
+  pthread_mutex_unlock(&quarantine_lock);
+
+  tc->pending_count = 0;
+}
 
-  LOCK_UNLOCK(&quarantine_lock);
+static void thread_cache_destroy(void *arg) {
+  struct thread_cache *tc = arg;
+  int                  c;
 
-  return 1;
+  int state = QASAN_SWAP(QASAN_DISABLED);  // disable qasan for this thread
+
+  quarantine_flush(tc);
+
+  for (c = 0; c < CACHE_CLASSES; c++) {
+    while (tc->free_list[c]) {
+      struct chunk_begin *ck = tc->free_list[c];
+      tc->free_list[c] = ck->next;
+      backend_free(ck);
+    }
+
+    tc->count[c] = 0;
+  }
+
+  QASAN_SWAP(state);
+}
+
+// need qasan disabled
+static struct thread_cache *thread_cache_get(void) {
+  struct thread_cache *tc = &thread_cache;
+
+  // so that the chunks are not lost when the thread exits
+  if (!tc->registered) {
+    tc->registered = 1;
+    pthread_setspecific(thread_cache_key, tc);
+  }
+
+  return tc;
+}
+
+// need qasan disabled
+static void quarantine_push(struct chunk_begin *ck) {
+  struct thread_cache *tc = thread_cache_get();
+
+  if (ck->requested_size >= QUARANTINE_MAX_BYTES) {
+    chunk_release(ck, tc);
+    return;
+  }
+
+  tc->pending[tc->pending_count++] = ck;
+  if (tc->pending_count == QUARANTINE_BATCH) quarantine_flush(tc);
 }
 
 void __libqasan_init_malloc(void) {
@@ -135,7 +277,8 @@ void __libqasan_init_malloc(void) {
   __lq_libc_free = dlsym(RTLD_NEXT, "free");
 #endif
 
-  LOCK_INIT(&quarantine_lock, PTHREAD_PROCESS_PRIVATE);
+  pthread_key_create(&thread_cache_key, thread_cache_destroy);
+  quarantine_hugepages = getenv("QASAN_HUGEPAGES") != NULL;
 
   __libqasan_malloc_initialized = 1;
   QASAN_LOG("\n");
@@ -170,15 +313,25 @@ void *__libqasan_malloc(size_t size) {
 #endif
   }
 
+  size_t              cap = chunk_capacity(size);
+  int                 c = size_class(size);
+  struct chunk_begin *p = NULL;
+
   int state = QASAN_SWAP(QASAN_DISABLED);  // disable qasan for this thread
 
-  struct chunk_begin *p = backend_malloc(sizeof(struct chunk_struct) + size);
+  if (c >= 0 && thread_cache.free_list[c]) {
+    p = thread_cache.free_list[c];
+    thread_cache.free_list[c] = p->next;
+    thread_cache.count[c]--;
+  }
+
+  if (!p) p = backend_malloc(sizeof(struct chunk_struct) + cap);
 
   QASAN_SWAP(state);
 
   if (!p) return NULL;
 
-  QASAN_UNPOISON(p, sizeof(struct chunk_struct) + size);
+  QASAN_UNPOISON(p, sizeof(struct chunk_struct) + cap);
 
   p->requested_size = size;
   p->aligned_orig = NULL;
@@ -186,12 +339,8 @@ void *__libqasan_malloc(size_t size) {
 
   QASAN_ALLOC(&p[1], (char *)&p[1] + size);
   QASAN_POISON(p->redzone, REDZONE_SIZE, ASAN_HEAP_LEFT_RZ);
-  if (size & (ALLOC_ALIGN_SIZE - 1))
-    QASAN_POISON((char *)&p[1] + size,
-                 (size & ~(ALLOC_ALIGN_SIZE - 1)) + 8 - size + REDZONE_SIZE,
-                 ASAN_HEAP_RIGHT_RZ);
-  else
-    QASAN_POISON((char *)&p[1] + size, REDZONE_SIZE, ASAN_HEAP_RIGHT_RZ);
+  QASAN_POISON((char *)&p[1] + size, cap - size + REDZONE_SIZE,
+               ASAN_HEAP_RIGHT_RZ);
 
   __builtin_memset(&p[1], 0xff, size);
 
@@ -216,22 +365,19 @@ void __libqasan_free(void *ptr) {
   size_t n = p->requested_size;
 
   QASAN_STORE(ptr, n);
-  int state = QASAN_SWAP(QASAN_DISABLED);  // disable qasan for this thread
-
-  if (!quarantine_push(p)) {
-    if (p->aligned_orig)
-      backend_free(p->aligned_orig);
-    else
-      backend_free(p);
-  }
-
-  QASAN_SWAP(state);
 
+  // poisoned before another thread can take it out of quarantine again
   if (n & (ALLOC_ALIGN_SIZE - 1))
     n = (n & ~(ALLOC_ALIGN_SIZE - 1)) + ALLOC_ALIGN_SIZE;
 
   QASAN_POISON(ptr, n, ASAN_HEAP_FREED);
   QASAN_DEALLOC(ptr);
+
+  int state = QASAN_SWAP(QASAN_DISABLED);  // disable qasan for this thread
+
+  quarantine_push(p);
+
+  QASAN_SWAP(state);
 }
 
 void *__libqasan_calloc(size_t nmemb, size_t size) {
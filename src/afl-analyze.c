@@ -34,6 +34,7 @@
 #include "sharedmem.h"
 #include "common.h"
 #include "forkserver.h"
+#include "analysis.h"
 
 #include <stdio.h>
 #include <unistd.h>
@@ -47,6 +48,7 @@
 #include <ctype.h>
 
 #include <sys/wait.h>
+#include <sys/mman.h>
 #include <sys/time.h>
 #ifndef USEMMAP
   #include <sys/shm.h>
@@ -82,16 +84,26 @@ static u32 map_size = MAP_SIZE;
 
 static afl_forkserver_t fsrv = {0}; /* The forkserver                     */
 
-/* Constants used for describing byte behavior. */
+/* The checksums of the four runs of every byte, in memory shared with the
+   workers of -j. Each of them has a forkserver of its own and takes the
+   next unit of bytes from work until there are none left; the classification
+   is done by the main process once all are done. With -b a unit whose bytes
+   can all be flipped, and all be raised by 0x10, without changing the path
+   is taken to be a no-op block without looking at its bytes. */
 
-#define RESP_NONE 0x00     /* Changing byte is a no-op.         */
-#define RESP_MINOR 0x01    /* Some changes have no effect.      */
-#define RESP_VARIABLE 0x02 /* Changes produce variable paths.   */
-#define RESP_FIXED 0x03    /* Changes produce fixed patterns.   */
+struct analyze_work {
+  u32 next;  /* next unit to analyze              */
+  u32 hangs; /* timeouts of the workers           */
+};
 
-#define RESP_LEN 0x04     /* Potential length field            */
-#define RESP_CKSUM 0x05   /* Potential checksum                */
-#define RESP_SUSPECT 0x06 /* Potential "suspect" blob          */
+static u32 jobs,                /* Workers (-j)                      */
+    probe_len,                  /* No-op probe block size (-b)       */
+    unit_len = 256;             /* Bytes a worker takes at a time    */
+static u64                 *cksums;
+static struct analyze_work *work;
+static u8                  *export_file; /* Classification export (-o) */
+static u8                   is_worker;
+static pid_t               *workers;
 
 /* Classify tuple counts. This is a slow & naive version, but good enough here.
  */
@@ -258,7 +270,7 @@ static void show_legend(void) {
 
 /* Interpret and report a pattern in the input file. */
 
-static void dump_hex(u32 len, u8 *b_data) {
+static void dump_hex(u32 len, u8 *b_data, u8 *exp_data) {
   u32 i;
 
   for (i = 0; i < len; i++) {
@@ -336,6 +348,8 @@ static void dump_hex(u32 len, u8 *b_data) {
       }
     }
 
+    if (exp_data) { memset(exp_data + i, rtype | (b_data[i] & 0x80), rlen); }
+
     /* Print out the entire run. */
 
 #ifdef USE_COLOR
@@ -429,43 +443,140 @@ static void dump_hex(u32 len, u8 *b_data) {
 #endif /* USE_COLOR */
 }
 
+/* Is the block from start to end a no-op? Two runs instead of four per
+   byte: all of it flipped, and all of it raised by 0x10. */
+
+static u8 probe_noop(u32 start, u32 end) {
+  u32 i;
+  u64 cksum;
+
+  for (i = start; i < end; i++) {
+    in_data[i] ^= 0xff;
+  }
+
+  cksum = analyze_run_target(in_data, in_len, 0);
+
+  for (i = start; i < end; i++) {
+    in_data[i] = (in_data[i] ^ 0xff) + 0x10;
+  }
+
+  if (cksum == orig_cksum) {
+    cksum = analyze_run_target(in_data, in_len, 0);
+  }
+
+  for (i = start; i < end; i++) {
+    in_data[i] -= 0x10;
+  }
+
+  return cksum == orig_cksum;
+}
+
+/* Run the four byte adjustments for the units that are left. */
+
+static void analyze_units(void) {
+  u32 unit, units = (in_len + unit_len - 1) / unit_len;
+
+  while ((unit = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED)) <
+         units) {
+    u32 i, start = unit * unit_len,
+           end = start + unit_len < in_len ? start + unit_len : in_len;
+
+    if (probe_len && probe_noop(start, end)) {
+      for (i = start * 4; i < end * 4; i++) {
+        cksums[i] = orig_cksum;
+      }
+
+      continue;
+    }
+
+    for (i = start; i < end; i++) {
+      u64 *c = cksums + i * 4;
+
+      /* Perform walking byte adjustments across the file. We perform four
+         operations designed to elicit some response from the underlying
+         code. */
+
+      in_data[i] ^= 0xff;
+      c[0] = analyze_run_target(in_data, in_len, 0);
+
+      in_data[i] ^= 0xfe;
+      c[1] = analyze_run_target(in_data, in_len, 0);
+
+      in_data[i] = (in_data[i] ^ 0x01) - 0x10;
+      c[2] = analyze_run_target(in_data, in_len, 0);
+
+      in_data[i] += 0x20;
+      c[3] = analyze_run_target(in_data, in_len, 0);
+      in_data[i] -= 0x10;
+    }
+  }
+
+  __atomic_add_fetch(&work->hangs, exec_hangs, __ATOMIC_RELAXED);
+}
+
+/* Write the classification for afl-fuzz (AFL_ANALYZE_DIR) and others. */
+
+static void write_export(u8 *exp_data) {
+  struct analysis_hdr hdr = {ANALYSIS_MAGIC, in_len, 0};
+  s32                 fd;
+
+  hdr.cksum = hash64(in_data, in_len, HASH_CONST);
+
+  unlink(export_file); /* Ignore errors */
+  fd = open(export_file, O_WRONLY | O_CREAT | O_EXCL, DEFAULT_PERMISSION);
+  if (fd < 0) { PFATAL("Unable to create '%s'", export_file); }
+
+  ck_write(fd, (u8 *)&hdr, sizeof(hdr), export_file);
+  ck_write(fd, exp_data, in_len, export_file);
+  close(fd);
+
+  OKF("Classification written to '%s'.", export_file);
+}
+
 /* Actually analyze! */
 
 static void analyze() {
-  u32 i;
-  u32 boring_len = 0, prev_xff = 0, prev_x01 = 0, prev_s10 = 0, prev_a10 = 0;
+  u32 i, boring_len = 0;
+  u64 prev_xff = 0, prev_x01 = 0, prev_s10 = 0, prev_a10 = 0;
 
-  u8 *b_data = ck_alloc(in_len + 1);
+  u8 *b_data, *exp_data = NULL;
   u8  seq_byte = 0;
 
-  b_data[in_len] = 0xff; /* Intentional terminator. */
-
-  ACTF("Analyzing input file (this may take a while)...\n");
+  if (!is_worker) {
+    ACTF("Analyzing input file (this may take a while)...\n");
 
 #ifdef USE_COLOR
-  show_legend();
+    show_legend();
 #endif /* USE_COLOR */
+  }
 
-  for (i = 0; i < in_len; i++) {
-    u64 xor_ff, xor_01, sub_10, add_10;
-    u8  xff_orig, x01_orig, s10_orig, a10_orig;
+  analyze_units();
 
-    /* Perform walking byte adjustments across the file. We perform four
-       operations designed to elicit some response from the underlying
-       code. */
+  if (is_worker) { return; }
 
-    in_data[i] ^= 0xff;
-    xor_ff = analyze_run_target(in_data, in_len, 0);
+  for (i = 1; i < jobs; i++) {
+    s32 status;
 
-    in_data[i] ^= 0xfe;
-    xor_01 = analyze_run_target(in_data, in_len, 0);
+    while (waitpid(workers[i], &status, 0) < 0) {
+      if (errno != EINTR) { PFATAL("waitpid() failed"); }
+    }
 
-    in_data[i] = (in_data[i] ^ 0x01) - 0x10;
-    sub_10 = analyze_run_target(in_data, in_len, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+      FATAL("Worker %u failed", i);
+    }
+  }
 
-    in_data[i] += 0x20;
-    add_10 = analyze_run_target(in_data, in_len, 0);
-    in_data[i] -= 0x10;
+  exec_hangs = work->hangs;
+
+  b_data = ck_alloc(in_len + 1);
+  b_data[in_len] = 0xff; /* Intentional terminator. */
+
+  if (export_file) { exp_data = ck_alloc(in_len); }
+
+  for (i = 0; i < in_len; i++) {
+    u64 xor_ff = cksums[i * 4], xor_01 = cksums[i * 4 + 1],
+        sub_10 = cksums[i * 4 + 2], add_10 = cksums[i * 4 + 3];
+    u8 xff_orig, x01_orig, s10_orig, a10_orig;
 
     /* Classify current behavior. */
 
@@ -504,7 +615,7 @@ static void analyze() {
     prev_a10 = add_10;
   }
 
-  dump_hex(in_len, b_data);
+  dump_hex(in_len, b_data, exp_data);
 
   SAYF("\n");
 
@@ -516,9 +627,64 @@ static void analyze() {
           exec_hangs);
   }
 
+  if (exp_data) {
+    write_export(exp_data);
+    ck_free(exp_data);
+  }
+
   ck_free(b_data);
 }
 
+/* Set up the shared results and fork the workers of -j, which go on from
+   here as the main process does, each with a forkserver of its own. */
+
+static void start_workers(void) {
+  u32   i;
+  s32   null_fd;
+  pid_t pid;
+
+  cksums = mmap(NULL, (size_t)in_len * 4 * sizeof(u64), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  work = mmap(NULL, sizeof(struct analyze_work), PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+  if (cksums == MAP_FAILED || work == MAP_FAILED) { PFATAL("mmap() failed"); }
+
+  if (probe_len) { unit_len = probe_len; }
+
+  if (jobs) {
+    ACTF("Starting %u workers...", jobs - 1);
+    workers = ck_alloc(jobs * sizeof(pid_t));
+  }
+
+  for (i = 1; i < jobs; ++i) {
+    fflush(stdout);
+    fflush(stderr);
+
+    pid = fork();
+    if (pid < 0) { PFATAL("fork() failed"); }
+
+    if (!pid) {
+      is_worker = 1;
+
+      /* they would only say the same as the main process */
+
+      null_fd = open("/dev/null", O_WRONLY);
+      if (null_fd < 0) { PFATAL("Unable to open /dev/null"); }
+      dup2(null_fd, 1);
+      close(null_fd);
+
+      if (fsrv.out_file) {
+        fsrv.out_file = alloc_printf("%s.%u", fsrv.out_file, i);
+      }
+
+      return;
+    }
+
+    workers[i] = pid;
+  }
+}
+
 /* Handle Ctrl-C and the like. */
 
 static void handle_stop_sig(int sig) {
@@ -657,7 +823,12 @@ static void usage(u8 *argv0) {
 
       "Analysis settings:\n"
 
-      "  -e            - look for edge coverage only, ignore hit counts\n\n"
+      "  -e            - look for edge coverage only, ignore hit counts\n"
+      "  -j jobs       - run that many forkservers in parallel\n"
+      "  -b bytes      - treat blocks of that size as no-ops without looking\n"
+      "                  at their bytes if two runs show no change\n"
+      "  -o file       - write the classification to this file, for\n"
+      "                  AFL_ANALYZE_DIR of afl-fuzz\n\n"
 
       "For additional tips, please consult %s/README.md.\n\n"
 
@@ -696,7 +867,7 @@ int main(int argc, char **argv_orig, char **envp) {
 
   afl_fsrv_init(&fsrv);
 
-  while ((opt = getopt(argc, argv, "+i:f:m:t:eAOQUWXYh")) > 0) {
+  while ((opt = getopt(argc, argv, "+i:f:m:t:o:j:b:eAOQUWXYh")) > 0) {
     switch (opt) {
       case 'i':
 
@@ -717,6 +888,27 @@ int main(int argc, char **argv_orig, char **envp) {
         edges_only = 1;
         break;
 
+      case 'o':
+
+        if (export_file) { FATAL("Multiple -o options not supported"); }
+        export_file = optarg;
+        break;
+
+      case 'j':
+
+        if (jobs) { FATAL("Multiple -j options not supported"); }
+        jobs = atoi(optarg);
+        if (jobs < 1 || jobs > 256) { FATAL("Bad value for -j"); }
+        if (jobs == 1) { jobs = 0; }
+        break;
+
+      case 'b':
+
+        if (probe_len) { FATAL("Multiple -b options not supported"); }
+        probe_len = atoi(optarg);
+        if (probe_len < 2) { FATAL("Bad value for -b"); }
+        break;
+
       case 'm': {
         u8 suffix = 'M';
 
@@ -879,6 +1071,13 @@ int main(int argc, char **argv_orig, char **envp) {
   atexit(at_exit_handler);
   setup_signal_handlers();
 
+#ifdef __linux__
+  if (jobs && fsrv.nyx_mode) { FATAL("-j is not supported in Nyx mode"); }
+#endif
+
+  read_initial_file();
+  start_workers();
+
   set_up_environment(argv);
 
 #ifdef __linux__
@@ -945,7 +1144,6 @@ int main(int argc, char **argv_orig, char **envp) {
   configure_afl_kill_signals(
       &fsrv, NULL, NULL, (fsrv.qemu_mode || unicorn_mode) ? SIGKILL : SIGTERM);
 
-  read_initial_file();
 #ifdef __linux__
   if (!fsrv.nyx_mode) { (void)check_binary_signatures(fsrv.target_path); }
 #else
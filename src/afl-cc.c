@@ -33,6 +33,7 @@
 #include <assert.h>
 #include <ctype.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 
 #if (LLVM_MAJOR - 0 == 0)
   #undef LLVM_MAJOR
@@ -150,7 +151,7 @@ typedef struct aflcc_state {
 
   u8 debug;
 
-  u8 compiler_mode, plusplus_mode, lto_mode;
+  u8 compiler_mode, plusplus_mode, lto_mode, thinlto_mode;
 
   u8 *lto_flag;
 
@@ -174,6 +175,14 @@ typedef struct aflcc_state {
   u8  use_stdin; /* dummy */
   u8 *argvnull;  /* dummy */
 
+  u8 **obj_dirs; /* where find_object() looks        */
+  u32  obj_dir_cnt;
+
+  u8  *cache_file; /* AFL_CC_CACHE                     */
+  u8 **cache_names, **cache_paths;
+  u32  cache_cnt;
+  u8   cache_dirty;
+
 } aflcc_state_t;
 
 void aflcc_state_init(aflcc_state_t *, u8 *argv0);
@@ -254,6 +263,7 @@ void add_real_argv0(aflcc_state_t *);
 void add_defs_common(aflcc_state_t *);
 void add_defs_selective_instr(aflcc_state_t *);
 void add_defs_persistent_mode(aflcc_state_t *);
+void add_defs_field_hints(aflcc_state_t *);
 void add_defs_fortify(aflcc_state_t *, u8);
 void add_defs_lsan_ctrl(aflcc_state_t *);
 
@@ -328,7 +338,7 @@ void aflcc_state_init(aflcc_state_t *aflcc, u8 *argv0) {
 }
 
 /*
-  Try to find a specific runtime we need, in here:
+  The directories to find a specific runtime we need in, in this order:
 
   1. firstly we check the $AFL_PATH environment variable location if set
   2. next we check argv[0] if it has path information and use it
@@ -337,111 +347,236 @@ void aflcc_state_init(aflcc_state_t *aflcc, u8 *argv0) {
      FreeBSD with procfs)
     a) and check here in ../lib/afl too
   4. we look into the AFL_PATH define (usually /usr/local/lib/afl)
-  5. we finally try the current directory
 
-  if all these attempts fail - we return NULL and the caller has to decide
-  what to do. Otherwise the path to obj would be allocated and returned.
+  and find_object() finally tries the current directory.
 */
-u8 *find_object(aflcc_state_t *aflcc, u8 *obj) {
-  u8 *argv0 = aflcc->argv0;
-
+static void object_dirs(aflcc_state_t *aflcc) {
   u8 *afl_path = getenv("AFL_PATH");
-  u8 *slash = NULL, *tmp;
+  u8 *slash;
+
+  aflcc->obj_dirs = ck_alloc(6 * sizeof(u8 *));
 
   if (afl_path) {
-    tmp = alloc_printf("%s/%s", afl_path, obj);
+    aflcc->obj_dirs[aflcc->obj_dir_cnt++] = ck_strdup(afl_path);
+  }
+
+  if (aflcc->argv0 && (slash = strrchr(aflcc->argv0, '/'))) {
+    aflcc->obj_dirs[aflcc->obj_dir_cnt++] =
+        alloc_printf("%.*s", (int)(slash - aflcc->argv0), aflcc->argv0);
+    aflcc->obj_dirs[aflcc->obj_dir_cnt++] = alloc_printf(
+        "%.*s/../lib/afl", (int)(slash - aflcc->argv0), aflcc->argv0);
 
-    if (aflcc->debug) DEBUGF("Trying %s\n", tmp);
+  }
 
-    if (!access(tmp, R_OK)) { return tmp; }
+#if defined(__FreeBSD__) || defined(__DragonFly__) || defined(__linux__) || \
+    defined(__ANDROID__) || defined(__NetBSD__)
+  #define HAS_PROC_FS 1
+#endif
+#ifdef HAS_PROC_FS
+  else if (aflcc->argv0) {
 
-    ck_free(tmp);
+    char *procname = NULL;
+  #if defined(__FreeBSD__) || defined(__DragonFly__)
+    procname = "/proc/curproc/file";
+  #elif defined(__linux__) || defined(__ANDROID__)
+    procname = "/proc/self/exe";
+  #elif defined(__NetBSD__)
+    procname = "/proc/curproc/exe";
+  #endif
+    if (procname) {
+      char    exepath[PATH_MAX];
+      ssize_t exepath_len = readlink(procname, exepath, sizeof(exepath));
+      if (exepath_len > 0 && exepath_len < PATH_MAX) {
+        exepath[exepath_len] = 0;
+        slash = strrchr(exepath, '/');
+
+        if (slash) {
+          *slash = 0;
+          aflcc->obj_dirs[aflcc->obj_dir_cnt++] = ck_strdup(exepath);
+          aflcc->obj_dirs[aflcc->obj_dir_cnt++] =
+              alloc_printf("%s/../lib/afl", exepath);
+        }
+      }
+    }
   }
 
-  if (argv0) {
-    slash = strrchr(argv0, '/');
+#endif
+#undef HAS_PROC_FS
 
-    if (slash) {
-      u8 *dir = ck_strdup(argv0);
+  aflcc->obj_dirs[aflcc->obj_dir_cnt++] = ck_strdup(AFL_PATH);
+}
 
-      slash = strrchr(dir, '/');
-      *slash = 0;
+/*
+  AFL_CC_CACHE=file keeps what find_object() found in the directories
+  above (or that an object is in none of them) across invocations, so a
+  build does not probe them again for every translation unit. Objects only
+  appear in or vanish from a directory by changing its mtime, so the file
+  is valid as long as the same directories have the same mtimes; otherwise
+  it is written anew, so it must not be in one of them. The current
+  directory is not cached, and nothing is if one of the directories is
+  relative to it.
+*/
+#ifdef __APPLE__
+  #define MTIME_NSEC(st) ((st).st_mtimespec.tv_nsec)
+#else
+  #define MTIME_NSEC(st) ((st).st_mtim.tv_nsec)
+#endif
 
-      tmp = alloc_printf("%s/%s", dir, obj);
+static void cache_add(aflcc_state_t *aflcc, u8 *obj, u8 *path) {
+  u32 cnt = aflcc->cache_cnt++;
 
-      if (aflcc->debug) DEBUGF("Trying %s\n", tmp);
+  aflcc->cache_names =
+      ck_realloc(aflcc->cache_names, aflcc->cache_cnt * sizeof(u8 *));
+  aflcc->cache_paths =
+      ck_realloc(aflcc->cache_paths, aflcc->cache_cnt * sizeof(u8 *));
+  aflcc->cache_names[cnt] = ck_strdup(obj);
+  aflcc->cache_paths[cnt] = path ? ck_strdup(path) : NULL;
+  aflcc->cache_dirty = 1;
+}
 
-      if (!access(tmp, R_OK)) {
-        ck_free(dir);
-        return tmp;
-      }
+static void cache_load(aflcc_state_t *aflcc) {
+  FILE              *f = fopen(aflcc->cache_file, "r");
+  char               line[PATH_MAX + 128], name[128];
+  unsigned long long sec, nsec;
+  struct stat        st;
+  u32                dirs = 0;
+  int                off;
 
-      ck_free(tmp);
-      tmp = alloc_printf("%s/../lib/afl/%s", dir, obj);
+  if (!f) {
+    aflcc->cache_dirty = 1;
+    return;
+  }
 
-      if (aflcc->debug) DEBUGF("Trying %s\n", tmp);
+  if (!fgets(line, sizeof(line), f) ||
+      strcmp(line, "# afl-cc object cache 1\n")) {
+    fclose(f);
+    return;
+  }
 
-      if (!access(tmp, R_OK)) {
-        ck_free(dir);
-        return tmp;
+  while (fgets(line, sizeof(line), f)) {
+    line[strcspn(line, "\n")] = 0;
+    off = 0;
+
+    if (sscanf(line, "dir %llu %llu %n", &sec, &nsec, &off) == 2 && off) {
+      if (dirs >= aflcc->obj_dir_cnt ||
+          strcmp(line + off, aflcc->obj_dirs[dirs])) {
+        goto invalid;
       }
 
-      ck_free(tmp);
-      ck_free(dir);
+      if (stat(aflcc->obj_dirs[dirs], &st)) {
+        if (sec || nsec) goto invalid;
+
+      } else if ((unsigned long long)st.st_mtime != sec ||
+                 (unsigned long long)MTIME_NSEC(st) != nsec) {
+        goto invalid;
+      }
 
+      ++dirs;
+
+    } else if (sscanf(line, "obj %127s %n", name, &off) == 1 && off &&
+               dirs == aflcc->obj_dir_cnt) {
+      cache_add(aflcc, name, strcmp(line + off, "-") ? (u8 *)line + off : NULL);
+
+    } else {
+      goto invalid;
     }
-#if defined(__FreeBSD__) || defined(__DragonFly__) || defined(__linux__) || \
-    defined(__ANDROID__) || defined(__NetBSD__)
-  #define HAS_PROC_FS 1
-#endif
-#ifdef HAS_PROC_FS
-    else {
+  }
 
-      char *procname = NULL;
-  #if defined(__FreeBSD__) || defined(__DragonFly__)
-      procname = "/proc/curproc/file";
-  #elif defined(__linux__) || defined(__ANDROID__)
-      procname = "/proc/self/exe";
-  #elif defined(__NetBSD__)
-      procname = "/proc/curproc/exe";
-  #endif
-      if (procname) {
-        char    exepath[PATH_MAX];
-        ssize_t exepath_len = readlink(procname, exepath, sizeof(exepath));
-        if (exepath_len > 0 && exepath_len < PATH_MAX) {
-          exepath[exepath_len] = 0;
-          slash = strrchr(exepath, '/');
+  fclose(f);
+  aflcc->cache_dirty = dirs != aflcc->obj_dir_cnt;
+  if (aflcc->cache_dirty) aflcc->cache_cnt = 0;
+  return;
 
-          if (slash) {
-            *slash = 0;
-            tmp = alloc_printf("%s/%s", exepath, obj);
+invalid:
+  fclose(f);
+  aflcc->cache_cnt = 0;
+  aflcc->cache_dirty = 1;
+}
 
-            if (!access(tmp, R_OK)) { return tmp; }
+/* Write the cache if it changed, replacing the file in one go. */
+static void cache_save(aflcc_state_t *aflcc) {
+  struct stat st;
+  FILE       *f;
+  u8         *tmp;
+  u32         i;
 
-            ck_free(tmp);
-            tmp = alloc_printf("%s/../lib/afl/%s", exepath, obj);
+  if (!aflcc->cache_file || !aflcc->cache_dirty) return;
 
-            if (aflcc->debug) DEBUGF("Trying %s\n", tmp);
+  tmp = alloc_printf("%s.%d", aflcc->cache_file, (int)getpid());
+  if (!(f = fopen(tmp, "w"))) {
+    ck_free(tmp);
+    return;
+  }
 
-            if (!access(tmp, R_OK)) { return tmp; }
+  fprintf(f, "# afl-cc object cache 1\n");
 
-            ck_free(tmp);
-          }
-        }
-      }
+  for (i = 0; i < aflcc->obj_dir_cnt; ++i) {
+    if (stat(aflcc->obj_dirs[i], &st)) memset(&st, 0, sizeof(st));
+    fprintf(f, "dir %llu %llu %s\n", (unsigned long long)st.st_mtime,
+            (unsigned long long)MTIME_NSEC(st), aflcc->obj_dirs[i]);
+  }
+
+  for (i = 0; i < aflcc->cache_cnt; ++i)
+    fprintf(f, "obj %s %s\n", aflcc->cache_names[i],
+            aflcc->cache_paths[i] ? aflcc->cache_paths[i] : (u8 *)"-");
+
+  if (fclose(f) || rename(tmp, aflcc->cache_file)) unlink(tmp);
+  ck_free(tmp);
+}
+
+/*
+  Try to find a specific runtime we need, in the directories above, then in
+  the current directory.
+
+  if all these attempts fail - we return NULL and the caller has to decide
+  what to do. Otherwise the path to obj would be allocated and returned.
+*/
+u8 *find_object(aflcc_state_t *aflcc, u8 *obj) {
+  u8 *tmp = NULL;
+  u32 i;
+
+  if (!aflcc->obj_dirs) {
+    object_dirs(aflcc);
+
+    if ((aflcc->cache_file = getenv("AFL_CC_CACHE"))) {
+      u8 *slash = strrchr(aflcc->cache_file, '/');
+
+      for (i = 0; i < aflcc->obj_dir_cnt; ++i)
+        if (aflcc->obj_dirs[i][0] != '/' ||
+            (slash && strlen(aflcc->obj_dirs[i]) ==
+                          (size_t)(slash - aflcc->cache_file) &&
+             !strncmp(aflcc->obj_dirs[i], aflcc->cache_file,
+                      slash - aflcc->cache_file)))
+          aflcc->cache_file = NULL;
+
+      if (aflcc->cache_file) cache_load(aflcc);
     }
+  }
 
-#endif
-#undef HAS_PROC_FS
+  for (i = 0; i < aflcc->cache_cnt; ++i) {
+    if (!strcmp(aflcc->cache_names[i], obj)) {
+      if (aflcc->debug) DEBUGF("Cached %s\n", obj);
+      if (aflcc->cache_paths[i]) return ck_strdup(aflcc->cache_paths[i]);
+      break;
+    }
   }
 
-  tmp = alloc_printf("%s/%s", AFL_PATH, obj);
+  if (i == aflcc->cache_cnt) {
+    for (i = 0; i < aflcc->obj_dir_cnt; ++i) {
+      tmp = alloc_printf("%s/%s", aflcc->obj_dirs[i], obj);
 
-  if (aflcc->debug) DEBUGF("Trying %s\n", tmp);
+      if (aflcc->debug) DEBUGF("Trying %s\n", tmp);
 
-  if (!access(tmp, R_OK)) { return tmp; }
+      if (!access(tmp, R_OK)) break;
+
+      ck_free(tmp);
+      tmp = NULL;
+    }
+
+    if (aflcc->cache_file) cache_add(aflcc, obj, tmp);
+    if (tmp) return tmp;
+  }
 
-  ck_free(tmp);
   tmp = alloc_printf("./%s", obj);
 
   if (aflcc->debug) DEBUGF("Trying %s\n", tmp);
@@ -967,6 +1102,20 @@ static void instrument_opt_mode_exclude(aflcc_state_t *aflcc) {
     FATAL("you cannot set CALLER and K-CTX together");
   }
 
+  if (aflcc->instrument_opt_mode == INSTRUMENT_OPT_NGRAM) {
+    if (aflcc->compiler_mode != LLVM && aflcc->compiler_mode != LTO)
+      FATAL("NGRAM can only be used in LLVM and LTO mode");
+
+    if (aflcc->instrument_mode != INSTRUMENT_CLASSIC &&
+        aflcc->instrument_mode != INSTRUMENT_PCGUARD &&
+        aflcc->instrument_mode != INSTRUMENT_LTO)
+      FATAL(
+          "NGRAM instrumentation can only be used with the LLVM CLASSIC, "
+          "PCGUARD and LTO instrumentation modes.");
+
+    return;
+  }
+
   if (aflcc->instrument_opt_mode && aflcc->compiler_mode != LLVM)
     FATAL("CTX, CALLER and NGRAM can only be used in LLVM mode");
 
@@ -1118,6 +1267,14 @@ void mode_final_checkout(aflcc_state_t *aflcc, int argc, char **argv) {
           "identify the correct -flto flag");
     else
       aflcc->compiler_mode = LTO;
+
+    if (getenv("AFL_LLVM_THINLTO")) {
+#if defined(AFL_CLANG_LDPATH) && LLVM_MAJOR >= 15
+      aflcc->thinlto_mode = 1;
+#else
+      FATAL("AFL_LLVM_THINLTO needs LLVM 15 or newer and lld");
+#endif
+    }
   }
 
   if (getenv("AFL_LLVM_SKIP_NEVERZERO") && getenv("AFL_LLVM_NOT_ZERO"))
@@ -1372,6 +1529,35 @@ void add_defs_persistent_mode(aflcc_state_t *aflcc) {
       "_I(); } while (0)");
 }
 
+/*
+  Macro def for field hints, see docs/env_variables.md (AFL_FIELD_HINTS). The
+  enum follows the FS_HINT_* types of include/fshints.h. Without the runtime
+  (afl-gcc and afl-clang) the hints go nowhere.
+*/
+void add_defs_field_hints(aflcc_state_t *aflcc) {
+  if (aflcc->compiler_mode == GCC || aflcc->compiler_mode == CLANG) {
+    insert_param(aflcc, "-D__AFL_HINT_FIELD(_O,_L,_T)=do {} while (0)");
+    return;
+  }
+
+  insert_param(
+      aflcc,
+      "-D__AFL_HINT_FIELD(_O,_L,_T)="
+      "do { enum { __afl_hint_BLOB, __afl_hint_INT, __afl_hint_INT_BE, "
+      "__afl_hint_LEN, __afl_hint_LEN_BE, __afl_hint_MAGIC, __afl_hint_CKSUM, "
+      "__afl_hint_TEXT }; "
+#ifdef __APPLE__
+      "__attribute__((visibility(\"default\"))) "
+      "void _H(unsigned int, unsigned int, unsigned int) "
+      "__asm__(\"___afl_hint_field\"); "
+#else
+      "__attribute__((visibility(\"default\"))) "
+      "void _H(unsigned int, unsigned int, unsigned int) "
+      "__asm__(\"__afl_hint_field\"); "
+#endif /* ^__APPLE__ */
+      "_H((_O), (_L), __afl_hint_##_T); } while (0)");
+}
+
 /*
   Control macro def of _FORTIFY_SOURCE. It will do nothing
   if we detect this routine has been called previously, or
@@ -1760,10 +1946,11 @@ void add_optimized_pcguard(aflcc_state_t *aflcc) {
 */
 param_st parse_linking_params(aflcc_state_t *aflcc, u8 *cur_argv, u8 scan,
                               u8 *skip_next, char **argv) {
-  if (aflcc->lto_mode && !strncmp(cur_argv, "-flto=thin", 10)) {
+  if (aflcc->lto_mode && !aflcc->thinlto_mode &&
+      !strncmp(cur_argv, "-flto=thin", 10)) {
     FATAL(
-        "afl-clang-lto cannot work with -flto=thin. Switch to -flto=full or "
-        "use afl-clang-fast!");
+        "afl-clang-lto cannot work with -flto=thin. Switch to -flto=full, "
+        "set AFL_LLVM_THINLTO or use afl-clang-fast!");
   }
 
   param_st final_ = PARAM_MISS;
@@ -1910,12 +2097,95 @@ void add_lto_linker(aflcc_state_t *aflcc) {
   free(ld_path);
 }
 
+#if defined(AFL_CLANG_LDPATH) && LLVM_MAJOR >= 15
+static int cmp_env(const void *a, const void *b) {
+  return strcmp(*(char **)a, *(char **)b);
+}
+
+/* FNV-1a, with a terminator so that "ab","c" and "a","bc" differ */
+static u64 hash_str(u64 h, u8 *s) {
+  while (*s)
+    h = (h ^ *s++) * 0x100000001b3ULL;
+
+  return (h ^ 0xff) * 0x100000001b3ULL;
+}
+
+/*
+  The ThinLTO cache key covers the bitcode and the codegen options, but not
+  the pass plugins or the AFL_LLVM_* settings they read. Keep one cache
+  directory per plugin build and setting, so a cached object always carries
+  the instrumentation the link asks for.
+*/
+static u8 *thinlto_cache_dir(u8 *dir, u8 *plugin) {
+  extern char **environ;
+  struct stat   st;
+  char        **env;
+  u64           h = 0xcbf29ce484222325ULL;
+  u32           i, n = 0;
+
+  for (i = 0; environ[i]; ++i)
+    if (!strncmp(environ[i], "AFL_LLVM_", 9)) { ++n; }
+
+  env = ck_alloc((n + 1) * sizeof(char *));
+
+  for (n = 0, i = 0; environ[i]; ++i)
+    if (!strncmp(environ[i], "AFL_LLVM_", 9)) { env[n++] = environ[i]; }
+
+  qsort(env, n, sizeof(char *), cmp_env);
+
+  h = hash_str(h, (u8 *)VERSION);
+  h = hash_str(h, plugin);
+  for (i = 0; i < n; ++i)
+    h = hash_str(h, (u8 *)env[i]);
+
+  if (!stat((char *)plugin, &st)) {
+    h ^= (u64)st.st_mtime + ((u64)st.st_size << 32);
+    h *= 0x100000001b3ULL;
+  }
+
+  ck_free(env);
+
+  return alloc_printf("-Wl,--thinlto-cache-dir=%s/%016llx", dir, h);
+}
+
+/*
+  AFL_LLVM_THINLTO: lld instruments every module in its own ThinLTO backend,
+  in parallel, with the PCGUARD pass. The guards are numbered by the runtime,
+  so the IDs stay unique across the modules however they are split.
+*/
+static void add_thinlto_passes(aflcc_state_t *aflcc) {
+  u8 *plugin = find_object(aflcc, "SanitizerCoveragePCGUARD.so");
+  u8 *jobs = getenv("AFL_LLVM_THINLTO"), *cache;
+
+  if (!plugin) { FATAL("Unable to find 'SanitizerCoveragePCGUARD.so'"); }
+
+  insert_param(aflcc, alloc_printf("-Wl,--load-pass-plugin=%s", plugin));
+
+  if (atoi(jobs) > 1) {
+    insert_param(aflcc, alloc_printf("-Wl,--thinlto-jobs=%d", atoi(jobs)));
+  }
+
+  if ((cache = getenv("AFL_LLVM_THINLTO_CACHE")) && *cache) {
+    insert_param(aflcc, thinlto_cache_dir(cache, plugin));
+  }
+
+  ck_free(plugin);
+}
+
+#endif
+
 /* Add params to launch SanitizerCoverageLTO.so when linking  */
 void add_lto_passes(aflcc_state_t *aflcc) {
 #if defined(AFL_CLANG_LDPATH) && LLVM_MAJOR >= 15
   // The NewPM implementation only works fully since LLVM 15.
-  insert_object(aflcc, "SanitizerCoverageLTO.so", "-Wl,--load-pass-plugin=%s",
-                0);
+  if (aflcc->thinlto_mode) {
+    add_thinlto_passes(aflcc);
+
+  } else {
+    insert_object(aflcc, "SanitizerCoverageLTO.so",
+                  "-Wl,--load-pass-plugin=%s", 0);
+  }
+
 #elif defined(AFL_CLANG_LDPATH) && LLVM_MAJOR >= 13
   insert_param(aflcc, "-Wl,--lto-legacy-pass-manager");
   insert_object(aflcc, "SanitizerCoverageLTO.so", "-Wl,-mllvm=-load=%s", 0);
@@ -2011,6 +2281,13 @@ void add_runtime(aflcc_state_t *aflcc) {
     insert_param(aflcc, "-ldl");
   #endif
 
+  #if !defined(__APPLE__)
+    // the runtime gives every new thread its own map
+    if (getenv("AFL_LLVM_THREAD_MAPS") && !aflcc->shared_linking &&
+        !aflcc->partial_linking)
+      insert_param(aflcc, "-Wl,--wrap=pthread_create,--wrap=pthread_exit");
+  #endif
+
   #if !defined(__APPLE__) && !defined(__sun)
     if (!aflcc->shared_linking && !aflcc->partial_linking)
       insert_object(aflcc, "dynamic_list.txt", "-Wl,--dynamic-list=%s", 0);
@@ -2261,6 +2538,7 @@ static void maybe_usage(aflcc_state_t *aflcc, int argc, char **argv) {
         "  [LLVM] LLVM:             %s%s\n"
         "      PCGUARD              %s    yes yes     module yes yes    "
         "yes\n"
+        "        - NGRAM-{2-16}\n"
         "      NATIVE               AVAILABLE    no  yes     no     no  "
         "part.  yes\n"
         "      CLASSIC              %s    no  yes     module yes yes    "
@@ -2272,6 +2550,7 @@ static void maybe_usage(aflcc_state_t *aflcc, int argc, char **argv) {
         "  [LTO] LLVM LTO:          %s%s\n"
         "      PCGUARD              DEFAULT      yes yes     yes    yes yes "
         "   yes\n"
+        "        - NGRAM-{2-16}\n"
         "      CLASSIC                           yes yes     yes    yes yes "
         "   yes\n"
         "  [GCC_PLUGIN] gcc plugin: %s%s\n"
@@ -2329,7 +2608,7 @@ static void maybe_usage(aflcc_state_t *aflcc, int argc, char **argv) {
         "(instrumentation/README.ctx.md)\n"
         "  CTX:     CLASSIC + full callee context "
         "(instrumentation/README.ctx.md)\n"
-        "  NGRAM-x: CLASSIC + previous path "
+        "  NGRAM-x: CLASSIC, PCGUARD or LTO + previous path "
         "((instrumentation/README.ngram.md)\n\n");
 
 #undef NATIVE_MSG
@@ -2362,6 +2641,8 @@ static void maybe_usage(aflcc_state_t *aflcc, int argc, char **argv) {
       SAYF(
           "Environment variables used:\n"
           "  AFL_CC: path to the C compiler to use\n"
+          "  AFL_CC_CACHE: file to keep where the AFL++ objects were found "
+          "in\n"
           "  AFL_CXX: path to the C++ compiler to use\n"
           "  AFL_DEBUG: enable developer debugging output\n"
           "  AFL_DONT_OPTIMIZE: disable optimization instead of -O3\n"
@@ -2387,6 +2668,7 @@ static void maybe_usage(aflcc_state_t *aflcc, int argc, char **argv) {
             "\nGCC Plugin-specific environment variables:\n"
             "  AFL_GCC_CMPLOG: log operands of comparisons (RedQueen mutator)\n"
             "  AFL_GCC_OUT_OF_LINE: disable inlined instrumentation\n"
+            "  AFL_GCC_PCGUARD: collision free edge coverage with guards\n"
             "  AFL_GCC_SKIP_NEVERZERO: do not skip zero on trace counters\n"
             "  AFL_GCC_INSTRUMENT_FILE: enable selective instrumentation by "
             "filename\n");
@@ -2407,10 +2689,31 @@ static void maybe_usage(aflcc_state_t *aflcc, int argc, char **argv) {
 
             COUNTER_BEHAVIOUR
 
+            "  AFL_LLVM_BUCKETED_COUNTS: store hit count buckets so afl-fuzz "
+            "need not\n"
+            "    classify the map (PCGUARD only)\n"
+            "  AFL_LLVM_DEFER_AT: start the forkserver at function[:callee],... "
+            "(see\n"
+            "    utils/defer_profile)\n"
             "  AFL_LLVM_DICT2FILE: generate an afl dictionary based on found "
             "comparisons\n"
             "  AFL_LLVM_DICT2FILE_NO_MAIN: skip parsing main() for the "
             "dictionary\n"
+            "  AFL_LLVM_DIRTY_LINES: track touched map cache lines so afl-fuzz "
+            "only\n"
+            "    processes those (PCGUARD only)\n"
+            "  AFL_LLVM_DOM_PRUNE: leave out counters that only repeat others "
+            "(PCGUARD\n"
+            "    and LTO)\n"
+            "  AFL_LLVM_LOOP_COMPRESS: count inner loops in registers, add to "
+            "the map\n"
+            "    on loop exit (PCGUARD only)\n"
+            "  AFL_LLVM_MAP_ADDR: count into a fixed map address, e.g. 0x10000 "
+            "(PCGUARD\n"
+            "    and LTO)\n"
+            "  AFL_LLVM_THREAD_MAPS: like AFL_LLVM_THREADSAFE_INST, but new "
+            "threads\n"
+            "    count into maps of their own (PCGUARD only)\n"
             "  AFL_LLVM_INJECTIONS_ALL: enables all injections hooking\n"
             "  AFL_LLVM_INJECTIONS_SQL: enables SQL injections hooking\n"
             "  AFL_LLVM_INJECTIONS_LDAP: enables LDAP injections hooking\n"
@@ -2422,6 +2725,9 @@ static void maybe_usage(aflcc_state_t *aflcc, int argc, char **argv) {
             "  AFL_LLVM_LAF_SPLIT_FLOATS: cascaded comparisons on floats\n"
             "  AFL_LLVM_LAF_TRANSFORM_COMPARES: cascade comparisons for string "
             "functions\n"
+            "  AFL_LLVM_LAF_COST: loop depth from which not to split, 0 for "
+            "none, also\n"
+            "    skips loop counters and leaves cmplog builds alone\n"
             "  AFL_LLVM_ALLOWLIST/AFL_LLVM_DENYLIST: enable "
             "instrument allow/\n"
             "    deny listing (selective instrumentation)\n");
@@ -2430,6 +2736,8 @@ static void maybe_usage(aflcc_state_t *aflcc, int argc, char **argv) {
         SAYF(
             "  AFL_LLVM_CMPLOG: log operands of comparisons (RedQueen "
             "mutator)\n"
+            "  AFL_CC_VARIANTS: also build these variants in parallel, e.g. "
+            "cmplog,laf,asan\n"
             "  AFL_LLVM_INSTRUMENT: set instrumentation mode:\n"
             "    CLASSIC, PCGUARD, LTO, GCC, CLANG, CALLER, CTX, NGRAM-2 "
             "..-16\n"
@@ -2440,7 +2748,8 @@ static void maybe_usage(aflcc_state_t *aflcc, int argc, char **argv) {
             "  AFL_LLVM_CTX: use full context sensitive coverage (for "
             "CLASSIC)\n"
             "  AFL_LLVM_NGRAM_SIZE: use ngram prev_loc count coverage (for "
-            "CLASSIC)\n"
+            "CLASSIC,\n"
+            "    PCGUARD and LTO)\n"
             "  AFL_LLVM_NO_RPATH: disable rpath setting for custom LLVM "
             "locations\n");
 
@@ -2459,6 +2768,16 @@ static void maybe_usage(aflcc_state_t *aflcc, int argc, char **argv) {
             "  AFL_LLVM_LTO_STARTID: from which ID to start counting from for "
             "a "
             "bb\n"
+            "  AFL_LLVM_LTO_LAYOUT: static or an afl-showmap file, give the "
+            "hot edges\n"
+            "    neighbouring IDs\n"
+            "  AFL_LLVM_ALWAYS_HIT: file of function:block entries not to "
+            "instrument\n"
+            "  AFL_LLVM_THINLTO: 1 or a job count, instrument with PCGUARD in "
+            "parallel\n"
+            "    ThinLTO backends (LLVM 15+)\n"
+            "  AFL_LLVM_THINLTO_CACHE: directory to cache unchanged ThinLTO "
+            "modules in\n"
             "  AFL_REAL_LD: use this lld linker instead of the compiled in "
             "path\n"
             "  AFL_LLVM_LTO_SKIPINIT: don't inject initialization code "
@@ -2770,6 +3089,290 @@ static void process_params(aflcc_state_t *aflcc, u8 scan, u32 argc,
   }
 }
 
+/** Variant builds -----BEGIN----- **/
+
+/*
+  AFL_CC_VARIANTS=cmplog,laf,asan,... builds the usual output and, next to
+  it, one for each variant, named with the variant before the extension
+  (foo.o -> foo.cmplog.o, fuzz -> fuzz.cmplog). Every build is this afl-cc
+  again, with the environment variable of the variant set, and all of them
+  run in parallel. An object of a single source goes through the front end
+  once, to bitcode that no pass has seen yet, and the plain, cmplog and laf
+  builds compile that bitcode with their passes. The sanitizer variants need
+  a front end run of their own, as clang marks the functions to instrument
+  there, so they start from the source right away. A link takes the variant
+  of each input that has one.
+*/
+
+static const struct {
+  const char *name, *env;
+  u8          front_end;  // needs its own front end run
+
+} cc_variants[] = {{"cmplog", "AFL_LLVM_CMPLOG", 0},
+                   {"laf", "AFL_LLVM_LAF_ALL", 0},
+                   {"asan", "AFL_USE_ASAN", 1},
+                   {"ubsan", "AFL_USE_UBSAN", 1},
+                   {"msan", "AFL_USE_MSAN", 1}};
+
+#define CC_VARIANTS_NUM (sizeof(cc_variants) / sizeof(cc_variants[0]))
+
+/* foo.o -> foo.<v>.o, fuzz -> fuzz.<v> */
+static u8 *variant_name(u8 *path, const char *v) {
+  u8 *base = (u8 *)strrchr((char *)path, '/'), *dot;
+
+  base = base ? base + 1 : path;
+  dot = (u8 *)strrchr((char *)base, '.');
+
+  if (!dot || dot == base) return alloc_printf("%s.%s", path, v);
+  return alloc_printf("%.*s.%s%s", (int)(dot - path), path, v, dot);
+}
+
+static u8 variant_is_source(u8 *arg) {
+  static const char *ext[] = {".c",  ".cc", ".cpp", ".cxx", ".c++",
+                              ".C",  ".m",  ".mm",  ".i",   ".ii"};
+  u8 *dot = (u8 *)strrchr((char *)arg, '.');
+  u32 i;
+
+  if (arg[0] == '-' || !dot || strchr((char *)dot, '/')) return 0;
+
+  for (i = 0; i < sizeof(ext) / sizeof(ext[0]); ++i)
+    if (!strcmp((char *)dot, ext[i])) return 1;
+
+  return 0;
+}
+
+/* Options whose value is the next argument. */
+static u8 variant_takes_value(u8 *arg) {
+  static const char *opts[] = {
+      "-o",         "-x",       "-MF",       "-MT",         "-MQ",
+      "-include",   "-imacros", "-isystem",  "-iquote",     "-idirafter",
+      "-I",         "-D",       "-U",        "-L",          "-Xclang",
+      "-Xlinker",   "-mllvm",   "-Xassembler", "-Xpreprocessor", "-target",
+      "-arch",      "-isysroot", "--sysroot", "-T",         "-z",
+      "-u",         "-e"};
+  u32 i;
+
+  for (i = 0; i < sizeof(opts) / sizeof(opts[0]); ++i)
+    if (!strcmp((char *)arg, opts[i])) return 1;
+
+  return 0;
+}
+
+static u8 variant_is_dep(u8 *arg) {
+  return !strcmp((char *)arg, "-MD") || !strcmp((char *)arg, "-MMD") ||
+         !strcmp((char *)arg, "-MP") || !strncmp((char *)arg, "-Wp,-M", 6);
+}
+
+/*
+  The arguments of one build: the output becomes out, the source becomes in
+  unless NULL, inputs get their variant v if it exists (a link), and with
+  !deps the dependency file options are left out, so only one build writes
+  it.
+*/
+static u8 **variant_args(int argc, char **argv, u8 *out, u8 *in,
+                         const char *v, u8 deps) {
+  u8 **args = ck_alloc((argc + 8) * sizeof(u8 *));
+  u8  *arg, *alt;
+  u32  cnt = 0;
+  int  i;
+
+  args[cnt++] = (u8 *)argv[0];
+
+  for (i = 1; i < argc; ++i) {
+    arg = (u8 *)argv[i];
+
+    if (!strncmp((char *)arg, "-o", 2)) {
+      if (!arg[2]) ++i;
+      args[cnt++] = (u8 *)"-o";
+      args[cnt++] = out;
+      continue;
+    }
+
+    if (!deps &&
+        (!strcmp((char *)arg, "-MF") || !strcmp((char *)arg, "-MT") ||
+         !strcmp((char *)arg, "-MQ"))) {
+      ++i;
+      continue;
+    }
+
+    if (!deps && variant_is_dep(arg)) continue;
+
+    if (variant_takes_value(arg) && i + 1 < argc) {
+      args[cnt++] = arg;
+      args[cnt++] = (u8 *)argv[++i];
+      continue;
+    }
+
+    if (in && variant_is_source(arg)) {
+      args[cnt++] = in;
+      continue;
+    }
+
+    if (v && arg[0] != '-') {
+      alt = variant_name(arg, v);
+
+      if (!access((char *)alt, R_OK)) {
+        args[cnt++] = alt;
+        continue;
+      }
+
+      ck_free(alt);
+    }
+
+    args[cnt++] = arg;
+  }
+
+  return args;
+}
+
+/* Run args in the background, with var set unless NULL. */
+static pid_t variant_spawn(u8 **args, const char *var) {
+  pid_t pid = fork();
+
+  if (pid < 0) PFATAL("fork() failed");
+
+  if (!pid) {
+    unsetenv("AFL_CC_VARIANTS");
+    setenv("AFL_QUIET", "1", 1);
+    if (var) setenv(var, "1", 1);
+
+    execvp((char *)args[0], (char **)args);
+    PFATAL("Oops, failed to execute '%s'", args[0]);
+  }
+
+  return pid;
+}
+
+static u8 variant_wait(pid_t pid) {
+  int status;
+
+  if (waitpid(pid, &status, 0) < 0) PFATAL("waitpid() failed");
+  return !WIFEXITED(status) || WEXITSTATUS(status);
+}
+
+/*
+  Build the output and its variants, returns the exit code, or -1 if this
+  is not a build they apply to (no -o, -S, ...).
+*/
+static int build_variants(aflcc_state_t *aflcc, int argc, char **argv) {
+  u8   *list = ck_strdup((u8 *)getenv("AFL_CC_VARIANTS")), *tok;
+  u8   *out = NULL, *bc = NULL, **args;
+  u8    chosen[CC_VARIANTS_NUM] = {0}, deps = 0, own_deps = 0, no_builtin = 0;
+  pid_t pids[CC_VARIANTS_NUM + 1];
+  u32   sources = 0, pid_cnt = 0, i;
+  int   j, ret = 0;
+
+  for (tok = (u8 *)strtok((char *)list, ","); tok;
+       tok = (u8 *)strtok(NULL, ",")) {
+    for (i = 0; i < CC_VARIANTS_NUM; ++i)
+      if (!strcmp((char *)tok, cc_variants[i].name)) break;
+
+    if (i == CC_VARIANTS_NUM)
+      FATAL("Unknown variant '%s' in AFL_CC_VARIANTS", tok);
+
+    chosen[i] = 1;
+    if (!cc_variants[i].front_end) no_builtin = 1;
+  }
+
+  ck_free(list);
+
+  for (j = 1; j < argc; ++j) {
+    u8 *arg = (u8 *)argv[j];
+
+    if (!strcmp((char *)arg, "-S") || !strcmp((char *)arg, "-x") ||
+        !strcmp((char *)arg, "-")) {
+      return -1;
+
+    } else if (!strcmp((char *)arg, "-o") && j + 1 < argc) {
+      out = (u8 *)argv[++j];
+
+    } else if (!strncmp((char *)arg, "-o", 2) && arg[2]) {
+      out = arg + 2;
+
+    } else if (!strcmp((char *)arg, "-MT") || !strcmp((char *)arg, "-MQ")) {
+      own_deps = 1;
+      ++j;
+
+    } else if (variant_is_dep(arg) || !strcmp((char *)arg, "-MF")) {
+      deps = 1;
+      if (arg[2] == 'F') ++j;
+
+    } else if (variant_takes_value(arg)) {
+      ++j;
+
+    } else if (variant_is_source(arg)) {
+      ++sources;
+    }
+  }
+
+  if (!out) return -1;
+
+  if (aflcc->have_c && sources == 1) {
+    /* the sanitizer variants from the source */
+
+    for (i = 0; i < CC_VARIANTS_NUM; ++i)
+      if (chosen[i] && cc_variants[i].front_end)
+        pids[pid_cnt++] = variant_spawn(
+            variant_args(argc, argv, variant_name(out, cc_variants[i].name),
+                         NULL, NULL, 0),
+            cc_variants[i].env);
+
+    /* the front end once, with the dependency file if any */
+
+    bc = alloc_printf("%s.%d.bc", out, (int)getpid());
+    args = variant_args(argc, argv, bc, NULL, NULL, 1);
+    for (i = 0; args[i]; ++i) {}
+    args[i++] = (u8 *)"-emit-llvm";
+    args[i++] = (u8 *)"-Xclang";
+    args[i++] = (u8 *)"-disable-llvm-passes";
+
+    if (deps && !own_deps) {
+      args[i++] = (u8 *)"-MT";
+      args[i++] = out;
+    }
+
+    if (variant_wait(
+            variant_spawn(args, no_builtin ? "AFL_NO_BUILTIN" : NULL))) {
+      ret = 1;
+
+    } else {
+      /* the others from the bitcode */
+
+      pids[pid_cnt++] =
+          variant_spawn(variant_args(argc, argv, out, bc, NULL, 0), NULL);
+
+      for (i = 0; i < CC_VARIANTS_NUM; ++i)
+        if (chosen[i] && !cc_variants[i].front_end)
+          pids[pid_cnt++] = variant_spawn(
+              variant_args(argc, argv, variant_name(out, cc_variants[i].name),
+                           bc, NULL, 0),
+              cc_variants[i].env);
+    }
+
+  } else {
+    /* a link, or several sources: each build on its own */
+
+    pids[pid_cnt++] =
+        variant_spawn(variant_args(argc, argv, out, NULL, NULL, 1), NULL);
+
+    for (i = 0; i < CC_VARIANTS_NUM; ++i)
+      if (chosen[i])
+        pids[pid_cnt++] = variant_spawn(
+            variant_args(argc, argv, variant_name(out, cc_variants[i].name),
+                         NULL, aflcc->have_c ? NULL : cc_variants[i].name, 0),
+            cc_variants[i].env);
+  }
+
+  for (i = 0; i < pid_cnt; ++i)
+    ret |= variant_wait(pids[i]);
+
+  if (bc) unlink((char *)bc);
+
+  return ret;
+}
+
+/** Variant builds -----END----- **/
+
 /* Process each of the existing argv, also add a few new args. */
 static void edit_params(aflcc_state_t *aflcc, u32 argc, char **argv,
                         char **envp) {
@@ -2795,21 +3398,29 @@ static void edit_params(aflcc_state_t *aflcc, u32 argc, char **argv,
       load_llvm_pass(aflcc, "afl-llvm-dict2file.so");
     }
 
-    // laf
-    if (getenv("LAF_SPLIT_SWITCHES") || getenv("AFL_LLVM_LAF_SPLIT_SWITCHES")) {
-      load_llvm_pass(aflcc, "split-switches-pass.so");
-    }
+    // laf, with AFL_LLVM_LAF_COST left to cmplog in a cmplog build
+    if (aflcc->cmplog_mode && getenv("AFL_LLVM_LAF_COST")) {
+      if (!be_quiet) {
+        ACTF("AFL_LLVM_LAF_COST: no laf-intel passes in the cmplog build");
+      }
 
-    if (getenv("LAF_TRANSFORM_COMPARES") ||
-        getenv("AFL_LLVM_LAF_TRANSFORM_COMPARES")) {
-      load_llvm_pass(aflcc, "compare-transform-pass.so");
-    }
+    } else {
+      if (getenv("LAF_SPLIT_SWITCHES") ||
+          getenv("AFL_LLVM_LAF_SPLIT_SWITCHES")) {
+        load_llvm_pass(aflcc, "split-switches-pass.so");
+      }
 
-    if (getenv("LAF_SPLIT_COMPARES") || getenv("AFL_LLVM_LAF_SPLIT_COMPARES") ||
-        getenv("AFL_LLVM_LAF_SPLIT_FLOATS")) {
-      load_llvm_pass(aflcc, "split-compares-pass.so");
-    }
+      if (getenv("LAF_TRANSFORM_COMPARES") ||
+          getenv("AFL_LLVM_LAF_TRANSFORM_COMPARES")) {
+        load_llvm_pass(aflcc, "compare-transform-pass.so");
+      }
 
+      if (getenv("LAF_SPLIT_COMPARES") ||
+          getenv("AFL_LLVM_LAF_SPLIT_COMPARES") ||
+          getenv("AFL_LLVM_LAF_SPLIT_FLOATS")) {
+        load_llvm_pass(aflcc, "split-compares-pass.so");
+      }
+    }
     // /laf
 
     if (aflcc->cmplog_mode) {
@@ -2826,7 +3437,8 @@ static void edit_params(aflcc_state_t *aflcc, u32 argc, char **argv,
     // #endif
 
     if (aflcc->lto_mode) {
-      insert_param(aflcc, aflcc->lto_flag);
+      insert_param(aflcc, aflcc->thinlto_mode ? (u8 *)"-flto=thin"
+                                             : aflcc->lto_flag);
 
       if (!aflcc->have_c) {
         add_lto_linker(aflcc);
@@ -2857,6 +3469,10 @@ static void edit_params(aflcc_state_t *aflcc, u32 argc, char **argv,
       load_llvm_pass(aflcc, "injection-pass.so");
     }
 
+    if (getenv("AFL_LLVM_DEFER_AT")) {
+      load_llvm_pass(aflcc, "defer-init-pass.so");
+    }
+
     // insert_param(aflcc, "-Qunused-arguments");
   }
 
@@ -2871,6 +3487,7 @@ static void edit_params(aflcc_state_t *aflcc, u32 argc, char **argv,
   add_defs_common(aflcc);
   add_defs_selective_instr(aflcc);
   add_defs_persistent_mode(aflcc);
+  add_defs_field_hints(aflcc);
 
   add_runtime(aflcc);
 
@@ -2898,6 +3515,16 @@ int main(int argc, char **argv, char **envp) {
 
   maybe_usage(aflcc, argc, argv);
 
+  if (getenv("AFL_CC_VARIANTS") && aflcc->compiler_mode == LLVM &&
+      !aflcc->lto_mode && !aflcc->preprocessor_only && !aflcc->passthrough &&
+      aflcc->non_dash) {
+    int ret = build_variants(aflcc, argc, argv);
+    if (ret >= 0) {
+      cache_save(aflcc);
+      return ret;
+    }
+  }
+
   mode_notification(aflcc);
 
   if (aflcc->debug) debugf_args(argc, argv);
@@ -2907,6 +3534,8 @@ int main(int argc, char **argv, char **envp) {
   if (aflcc->debug)
     debugf_args((s32)aflcc->cc_par_cnt, (char **)aflcc->cc_params);
 
+  cache_save(aflcc);
+
   if (aflcc->passthrough) {
     argv[0] = aflcc->cc_params[0];
     execvp(aflcc->cc_params[0], (char **)argv);
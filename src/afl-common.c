@@ -32,6 +32,7 @@
 #ifndef __USE_GNU
   #define __USE_GNU
 #endif
+#include <ctype.h>
 #include <string.h>
 #include <strings.h>
 #include <math.h>
@@ -49,6 +50,8 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <sched.h>
+#include <sys/resource.h>
 
 u8  be_quiet = 0;
 u8 *doc_path = "";
@@ -141,6 +144,165 @@ void set_sanitizer_defaults() {
   setenv("QASAN_SYMBOLIZE", "0", 0);
 }
 
+/* Points the sanitizers (log_path) and afl-compiler-rt (CRASH_SIG_ENV_VAR)
+   to prefix.<pid> for their crash reports. Call after
+   set_sanitizer_defaults(). */
+
+void crash_report_setup(u8 *prefix) {
+  static const char *san_opts[] = {"ASAN_OPTIONS", "UBSAN_OPTIONS",
+                                   "MSAN_OPTIONS", NULL};
+  u8                *x;
+  u32                i;
+
+  for (i = 0; san_opts[i]; ++i) {
+    x = getenv(san_opts[i]);
+    x = alloc_printf("%s%slog_path=%s", x ? x : (u8 *)"",
+                     x && *x && x[strlen(x) - 1] != ':' ? ":" : "", prefix);
+    setenv(san_opts[i], x, 1);
+    ck_free(x);
+  }
+
+  setenv(CRASH_SIG_ENV_VAR, prefix, 1);
+}
+
+/* Reads and removes the crash report of child pid, NULL if there is none.
+   The result is zero-terminated and has to be ck_free()d. */
+
+u8 *crash_report_read(u8 *prefix, s32 pid) {
+  u8         *fn = alloc_printf("%s.%d", prefix, pid), *buf = NULL;
+  s32         fd = open(fn, O_RDONLY);
+  ssize_t     len;
+  struct stat st;
+
+  unlink(fn);
+  ck_free(fn);
+
+  if (fd < 0) { return NULL; }
+
+  if (!fstat(fd, &st) && st.st_size > 0) {
+    if (st.st_size > CRASH_REPORT_MAX) { st.st_size = CRASH_REPORT_MAX; }
+    buf = ck_alloc(st.st_size + 1);
+    len = read(fd, buf, st.st_size);
+    buf[len > 0 ? len : 0] = 0;
+  }
+
+  close(fd);
+  return buf;
+}
+
+/* Copies the token at p that ends at a blank or at end into sig. */
+
+static u32 crash_report_token(u8 *p, u8 *end, u8 *sig, u32 len, u32 size) {
+  while (p < end && !isspace(*p) && *p != ')' && len < size - 2) {
+    sig[len++] = *p++;
+  }
+
+  return len;
+}
+
+/* The signature of a crash, as text in sig: the signal, the kind of error
+   and the first frames of the first stack in report. A frame is the
+   function and source location when the report is symbolized, else the
+   module base name and offset, else the address - these only hold for the
+   children of one forkserver. Frames in libc and the sanitizer runtimes
+   are skipped, so an abort() or a memcpy() counts where it was called
+   from. Returns the length of sig. */
+
+u32 crash_report_signature(u8 *report, u8 signal, u32 frames, u8 *sig,
+                           u32 size) {
+  u8 *line, *eol, *p, *q;
+  u32 len, found = 0;
+  u8  have_kind = 0;
+
+  len = snprintf((char *)sig, size, "%u", signal);
+
+  for (line = report; line && *line && found < frames && len < size - 2;
+       line = *eol ? eol + 1 : eol) {
+    eol = (u8 *)strchr((char *)line, '\n');
+    if (!eol) { eol = line + strlen((char *)line); }
+
+    /* the kind of error, up to the first address */
+
+    if (!have_kind) {
+      p = afl_memmem(line, eol - line, "ERROR: ", 7);
+      if (!p) { continue; }
+
+      sig[len++] = ':';
+      for (p += 7; p < eol && strncmp((char *)p, "0x", 2) && len < size / 2;
+           ++p) {
+        sig[len++] = *p;
+      }
+
+      while (len && sig[len - 1] == ' ') {
+        --len;
+      }
+
+      have_kind = 1;
+      continue;
+    }
+
+    /* the first stack of the report, frame by frame */
+
+    p = line + strspn((char *)line, " \t");
+
+    if (*p != '#') {
+      if (found) { break; }
+      continue;
+    }
+
+    if (afl_memmem(p, eol - p, "libc.so", 7) ||
+        afl_memmem(p, eol - p, "libc-", 5) ||
+        afl_memmem(p, eol - p, " in __asan_", 11) ||
+        afl_memmem(p, eol - p, " in __interceptor_", 18) ||
+        afl_memmem(p, eol - p, " in __sanitizer_", 16) ||
+        afl_memmem(p, eol - p, " in __ubsan_", 12)) {
+      continue;
+    }
+
+    sig[len++] = '|';
+
+    if ((q = afl_memmem(p, eol - p, " in ", 4))) {
+      /* function and file:line, without the directory */
+
+      len = crash_report_token(q + 4, eol, sig, len, size);
+      q += 4 + strcspn((char *)q + 4, " \n");
+
+      if (q < eol && *q == ' ') {
+        u8 *file = ++q;
+
+        while (q < eol && !isspace(*q) && *q != '(') {
+          if (*q++ == '/') { file = q; }
+        }
+
+        if (file < q) {
+          sig[len++] = ' ';
+          len = crash_report_token(file, q, sig, len, size);
+        }
+      }
+
+    } else if ((q = afl_memmem(p, eol - p, "(", 1)) &&
+               afl_memmem(q, eol - q, "+0x", 3)) {
+      /* (module+0xoffset), without the directory */
+
+      u8 *mod = ++q;
+
+      for (; q < eol && *q != ')'; ++q) {
+        if (*q == '/') { mod = q + 1; }
+      }
+
+      len = crash_report_token(mod, q, sig, len, size);
+
+    } else if ((q = afl_memmem(p, eol - p, " 0x", 3))) {
+      len = crash_report_token(q + 1, eol, sig, len, size);
+    }
+
+    ++found;
+  }
+
+  sig[len] = 0;
+  return len;
+}
+
 u32 check_binary_signatures(u8 *fn) {
   int ret = 0, fd = open(fn, O_RDONLY);
   if (fd < 0) { PFATAL("Unable to open '%s'", fn); }
@@ -186,6 +348,338 @@ u32 check_binary_signatures(u8 *fn) {
   return ret;
 }
 
+/* Reads a u32 or, in an ELF64, u64 field of an ELF header in host order. */
+
+static u64 elf_field(u8 *p, u8 is64) {
+  u32 v32;
+  u64 v64;
+
+  if (is64) {
+    memcpy(&v64, p, 8);
+    return v64;
+  }
+
+  memcpy(&v32, p, 4);
+  return v32;
+}
+
+/* Calls cb for each MAP_NOTE_* note the LTO and PCGUARD passes left in the
+   ELF binary fn, with its type, value, flags and the data after them.
+   Returns 0 if fn is no ELF file of the byte order of this host. */
+
+u8 elf_map_notes(u8 *fn, map_note_cb cb, void *ptr) {
+  struct stat st;
+  u8         *f, *sh, *note, *end;
+  u64         shoff, off, size, npad, shstr_off, shstr_size;
+  u32         shnum, shentsize, shstrndx, i, namesz, descsz, type, val[2];
+  u16         one = 1;
+  u8          is64, ret = 0;
+  s32         fd = open(fn, O_RDONLY);
+
+  if (fd < 0) { return 0; }
+
+  if (fstat(fd, &st) || st.st_size < 64) {
+    close(fd);
+    return 0;
+  }
+
+  f = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (f == MAP_FAILED) { return 0; }
+
+  if (memcmp(f, "\177ELF", 4) || f[4] < 1 || f[4] > 2 ||
+      f[5] != (*(u8 *)&one ? 1 : 2)) {
+    goto out;
+  }
+
+  is64 = f[4] == 2;
+  shoff = elf_field(f + (is64 ? 0x28 : 0x20), is64);
+  shentsize = *(u16 *)(f + (is64 ? 0x3a : 0x2e));
+  shnum = *(u16 *)(f + (is64 ? 0x3c : 0x30));
+  shstrndx = *(u16 *)(f + (is64 ? 0x3e : 0x32));
+
+  if (shentsize < (is64 ? 0x28U : 0x20U) || shstrndx >= shnum ||
+      shoff > (u64)st.st_size ||
+      (u64)shnum * shentsize > (u64)st.st_size - shoff) {
+    goto out;
+  }
+
+  sh = f + shoff + (u64)shstrndx * shentsize;
+  shstr_off = elf_field(sh + (is64 ? 0x18 : 0x10), is64);
+  shstr_size = elf_field(sh + (is64 ? 0x20 : 0x14), is64);
+  if (shstr_off > (u64)st.st_size || shstr_size > st.st_size - shstr_off) {
+    goto out;
+  }
+
+  ret = 1;
+
+  for (i = 0; i < shnum; ++i) {
+    sh = f + shoff + (u64)i * shentsize;
+    if (*(u32 *)(sh + 4) != 7 /* SHT_NOTE */ ||
+        *(u32 *)sh + sizeof(MAP_NOTE_SECTION) > shstr_size ||
+        memcmp(f + shstr_off + *(u32 *)sh, MAP_NOTE_SECTION,
+               sizeof(MAP_NOTE_SECTION))) {
+      continue;
+    }
+
+    off = elf_field(sh + (is64 ? 0x18 : 0x10), is64);
+    size = elf_field(sh + (is64 ? 0x20 : 0x14), is64);
+    if (off > (u64)st.st_size || size > st.st_size - off) { continue; }
+
+    for (note = f + off, end = note + size; end - note >= 12;) {
+      memcpy(&namesz, note, 4);
+      memcpy(&descsz, note + 4, 4);
+      memcpy(&type, note + 8, 4);
+      note += 12;
+
+      npad = ((u64)namesz + 3) & ~3ULL;
+      if (npad > (u64)(end - note) || descsz > (u64)(end - note) - npad) {
+        break;
+      }
+
+      if (namesz == sizeof(MAP_NOTE_NAME) && descsz >= 8 &&
+          !memcmp(note, MAP_NOTE_NAME, namesz)) {
+        memcpy(val, note + npad, 8);
+        cb(ptr, type, val[0], val[1], note + npad + 8, descsz - 8);
+      }
+
+      if ((((u64)descsz + 3) & ~3ULL) > (u64)(end - note) - npad) { break; }
+      note += npad + (((u64)descsz + 3) & ~3ULL);
+    }
+  }
+
+out:
+  munmap(f, st.st_size);
+  return ret;
+}
+
+struct map_prediction {
+  u32 loc, guards, flags;
+};
+
+static void predict_note(void *ptr, u32 type, u32 value, u32 flags, u8 *data,
+                         u32 len) {
+  struct map_prediction *p = ptr;
+
+  (void)data;
+  (void)len;
+
+  p->flags |= flags;
+
+  if (type == MAP_NOTE_FINAL_LOC) {
+    p->loc = MAX(p->loc, value);
+
+  } else if (type == MAP_NOTE_GUARDS) {
+    p->guards += value;
+  }
+}
+
+/* The map size the MAP_NOTE_* notes in the ELF binary fn predict, 0 if
+   there are none. flags gets the MAP_NOTE_F_* flags of them all. This is
+   what the target will ask for unless it loads more instrumented
+   libraries, the forkserver still has the last word. */
+
+u32 predict_map_size(u8 *fn, u32 *flags) {
+  struct map_prediction p = {0, 0, 0};
+  u32                   loc;
+
+  if (flags) { *flags = 0; }
+  if (!elf_map_notes(fn, predict_note, &p)) { return 0; }
+
+  /* the guards are numbered after the first 5 entries or the LTO IDs, and
+     the runtime counts one more when it maps the shm again for them */
+  loc = p.loc;
+  if (p.guards) { loc = MAX(loc, 5U) + p.guards + 1; }
+
+  if (loc && (p.flags & MAP_NOTE_F_NGRAM)) {
+    loc |= loc >> 1;
+    loc |= loc >> 2;
+    loc |= loc >> 4;
+    loc |= loc >> 8;
+    loc |= loc >> 16;
+  }
+
+  if (flags) { *flags = p.flags; }
+
+  /* as afl_fsrv_start() gets it: one more than the last ID, 64 byte steps */
+  if (!loc || loc >= (1U << 29)) { return 0; }
+  return (((loc + 1) + 63) >> 6) << 6;
+}
+
+/* A numeric field of a tar header, octal or GNU base-256. */
+
+static u64 tar_num(u8 *p, u32 len) {
+  u64 v = 0;
+
+  if (*p & 0x80) {
+    for (v = *p++ & 0x3f; --len; ++p) {
+      v = (v << 8) | *p;
+    }
+
+    return v;
+  }
+
+  for (; len && *p == ' '; --len) {
+    ++p;
+  }
+
+  for (; len && *p >= '0' && *p <= '7'; --len, ++p) {
+    v = v * 8 + *p - '0';
+  }
+
+  return v;
+}
+
+/* The checksum counts its own field as spaces. This also rejects the zero
+   blocks at the end of an archive. */
+
+static u8 tar_header_ok(u8 *h) {
+  u32 sum = 0, i;
+
+  for (i = 0; i < 512; ++i) {
+    sum += i >= 148 && i < 156 ? ' ' : h[i];
+  }
+
+  return sum == tar_num(h + 148, 8);
+}
+
+/* The path= record of a pax extended header, NULL if there is none. */
+
+static u8 *pax_path(u8 *d, u64 size) {
+  u8 *r, *kv, *end = d + size;
+  u64 len;
+
+  for (r = d; r < end; r += len) {
+    for (len = 0, kv = r; kv < end && isdigit(*kv); ++kv) {
+      len = len * 10 + *kv - '0';
+    }
+
+    if (!len || len > (u64)(end - r) || kv >= end || *kv++ != ' ') { break; }
+
+    if (r + len - kv > 6 && !memcmp(kv, "path=", 5)) {
+      return alloc_printf("%.*s", (int)(r + len - kv - 6), kv + 5);
+    }
+  }
+
+  return NULL;
+}
+
+/* Index the members of p that were appended since the last call, mapping
+   the file again if it grew. A member that is not complete yet is left for
+   the next call. Returns the number of new entries. */
+
+u32 pack_update(struct pack *p) {
+  struct stat st;
+  u8         *h, *name = NULL;
+  u64         pos, size, data;
+  u32         cnt = p->cnt;
+  s32         fd = open(p->fn, O_RDONLY);
+
+  if (fd < 0) { return 0; }
+
+  if (!fstat(fd, &st) && (u64)st.st_size > p->map_len) {
+    if (p->map) { munmap(p->map, p->map_len); }
+    p->map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    p->map_len = p->map == MAP_FAILED ? 0 : st.st_size;
+    if (!p->map_len) { p->map = NULL; }
+  }
+
+  close(fd);
+
+  for (pos = p->end; pos + 512 <= p->map_len; pos = data) {
+    h = p->map + pos;
+    if (!tar_header_ok(h)) { break; }
+
+    size = tar_num(h + 124, 12);
+    data = pos + 512;
+    if (size > p->map_len - data) { break; }
+
+    if (h[156] == 'L' || h[156] == 'x') {
+      /* GNU long name or pax header, for the member that follows */
+
+      if (name) { ck_free(name); }
+      name = h[156] == 'L'
+                 ? alloc_printf("%.*s", (int)strnlen(p->map + data, size),
+                                p->map + data)
+                 : pax_path(p->map + data, size);
+      data += (size + 511) & ~511ULL;
+      continue;
+    }
+
+    if (h[156] == '0' || h[156] == '\0' || h[156] == '7') {
+      struct pack_entry *e;
+
+      if (!afl_realloc((void **)&p->ent,
+                       (p->cnt + 1) * sizeof(struct pack_entry))) {
+        PFATAL("alloc");
+      }
+
+      e = &p->ent[p->cnt++];
+      e->off = data;
+      e->len = size > MAX_FILE ? MAX_FILE : size;
+
+      if (name) {
+        e->name = name;
+        name = NULL;
+
+      } else if (!memcmp(h + 257, "ustar", 6) && h[345]) {
+        e->name = alloc_printf("%.*s/%.*s", (int)strnlen(h + 345, 155),
+                               h + 345, (int)strnlen(h, 100), h);
+
+      } else {
+        e->name = alloc_printf("%.*s", (int)strnlen(h, 100), h);
+      }
+    }
+
+    if (name) {
+      ck_free(name);
+      name = NULL;
+    }
+
+    data += (size + 511) & ~511ULL;
+    p->end = MIN(data, p->map_len);
+  }
+
+  if (name) { ck_free(name); }
+
+  return p->cnt - cnt;
+}
+
+/* Map and index fn if it is an uncompressed tar file, else NULL. */
+
+struct pack *pack_open(u8 *fn) {
+  struct pack *p;
+  struct stat  st;
+
+  if (stat(fn, &st) || !S_ISREG(st.st_mode) || st.st_size < 512) {
+    return NULL;
+  }
+
+  p = ck_alloc(sizeof(struct pack));
+  p->fn = ck_strdup(fn);
+  pack_update(p);
+
+  if (!p->end) {
+    pack_close(p);
+    return NULL;
+  }
+
+  return p;
+}
+
+void pack_close(struct pack *p) {
+  u32 i;
+
+  for (i = 0; i < p->cnt; ++i) {
+    ck_free(p->ent[i].name);
+  }
+
+  afl_free(p->ent);
+  if (p->map) { munmap(p->map, p->map_len); }
+  ck_free(p->fn);
+  ck_free(p);
+}
+
 void detect_file_args(char **argv, u8 *prog_in, bool *use_stdin) {
   u32 i = 0;
   u8  cwd[PATH_MAX];
@@ -796,6 +1290,56 @@ u64 get_cur_time_us(void) {
   return (tv.tv_sec * 1000000ULL) + tv.tv_usec;
 }
 
+/* Get CPU usage in microseconds. */
+
+static u64 get_cpu_usage_us(void) {
+  struct rusage u;
+
+  getrusage(RUSAGE_SELF, &u);
+
+  return (u.ru_utime.tv_sec * 1000000ULL) + u.ru_utime.tv_usec +
+         (u.ru_stime.tv_sec * 1000000ULL) + u.ru_stime.tv_usec;
+}
+
+/* Measure preemption rate. */
+
+u32 measure_preemption(u32 target_ms) {
+  volatile u32 v1, v2 = 0;
+
+  u64 st_t, en_t, st_c, en_c, real_delta, slice_delta;
+  // s32 loop_repeats = 0;
+
+  st_t = get_cur_time_us();
+  st_c = get_cpu_usage_us();
+
+repeat_loop:
+
+  v1 = CTEST_BUSY_CYCLES;
+
+  while (v1--) {
+    v2++;
+  }
+
+  sched_yield();
+
+  en_t = get_cur_time_us();
+
+  if (en_t - st_t < target_ms * 1000) {
+    // loop_repeats++;
+    goto repeat_loop;
+  }
+
+  /* Let's see what percentage of this time we actually had a chance to
+     run, and how much time was spent in the penalty box. */
+
+  en_c = get_cpu_usage_us();
+
+  real_delta = (en_t - st_t) / 1000;
+  slice_delta = (en_c - st_c) / 1000;
+
+  return real_delta * 100 / slice_delta;
+}
+
 /* Describe integer. The buf should be
    at least 6 bytes to fit all ints we randomly see.
    Will return buf for convenience. */
@@ -32,6 +32,10 @@
 #include "common.h"
 #include "list.h"
 #include "forkserver.h"
+#include "fsbatch.h"
+#include "fsvirgin.h"
+#include "fsdoorbell.h"
+#include "fsipt.h"
 #include "hash.h"
 
 #include <stdio.h>
@@ -45,12 +49,18 @@
 #include <limits.h>
 #include <sys/time.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <sys/resource.h>
 #include <sys/select.h>
+#include <poll.h>
 #include <sys/stat.h>
 
 #ifdef __linux__
   #include <dlfcn.h>
+  #include <linux/perf_event.h>
+  #include <sys/epoll.h>
+  #include <sys/timerfd.h>
 
 /* function to load nyx_helper function from libnyx.so */
 
@@ -142,11 +152,24 @@ fail:
 
 void afl_nyx_runner_kill(afl_forkserver_t *fsrv) {
   if (fsrv->nyx_mode) {
-    if (fsrv->nyx_aux_string) { ck_free(fsrv->nyx_aux_string); }
+    /* the exec thread leaves once its request pipe is closed */
+    if (fsrv->nyx_async) {
+      if (fsrv->fsrv_ctl_fd >= 0) { close(fsrv->fsrv_ctl_fd); }
+      if (fsrv->fsrv_st_fd >= 0) { close(fsrv->fsrv_st_fd); }
+      fsrv->fsrv_ctl_fd = fsrv->fsrv_st_fd = -1;
+      pthread_join(fsrv->nyx_thread, NULL);
+      fsrv->nyx_async = false;
+    }
+
+    if (fsrv->nyx_aux_string) {
+      ck_free(fsrv->nyx_aux_string);
+      fsrv->nyx_aux_string = NULL;
+    }
 
     /* check if we actually got a valid nyx runner */
     if (fsrv->nyx_runner) {
       fsrv->nyx_handlers->nyx_shutdown(fsrv->nyx_runner);
+      fsrv->nyx_runner = NULL;
     }
 
     /* if we have use a tmp work dir we need to remove it */
@@ -203,6 +226,8 @@ void afl_fsrv_init(afl_forkserver_t *fsrv) {
   fsrv->nyx_use_tmp_workdir = false;
   fsrv->nyx_tmp_workdir_path = NULL;
   fsrv->nyx_log_fd = -1;
+  fsrv->nyx_tmout = 0;
+  fsrv->nyx_async = false;
 #endif
 
   // this structure needs default so we initialize it if this was not done
@@ -215,6 +240,7 @@ void afl_fsrv_init(afl_forkserver_t *fsrv) {
   /* Settings */
   fsrv->use_stdin = true;
   fsrv->no_unlink = false;
+  fsrv->use_memfd = false;
   fsrv->exec_tmout = EXEC_TIMEOUT;
   fsrv->init_tmout = EXEC_TIMEOUT * FORK_WAIT_MULT;
   fsrv->mem_limit = MEM_LIMIT;
@@ -223,11 +249,41 @@ void afl_fsrv_init(afl_forkserver_t *fsrv) {
 
   /* exec related stuff */
   fsrv->child_pid = -1;
+  fsrv->last_child_pid = -1;
   fsrv->map_size = get_map_size();
   fsrv->real_map_size = fsrv->map_size;
   fsrv->use_fauxsrv = false;
   fsrv->last_run_timed_out = false;
   fsrv->debug = false;
+  fsrv->dirty_lines = NULL;
+  fsrv->use_dirty_lines = false;
+  fsrv->touched_lines = NULL;
+  fsrv->touched_words = 0;
+  fsrv->touched_valid = false;
+  fsrv->bucketed_counts = false;
+  fsrv->buckets_lost = false;
+  fsrv->reset_full_map = true;
+  fsrv->map_cap = 0;
+  fsrv->map_grown = 0;
+  fsrv->shmem_fuzz_max = MAX_FILE;
+  fsrv->batch = NULL;
+  fsrv->virgin = NULL;
+  fsrv->support_batch = false;
+  fsrv->use_batch = false;
+  fsrv->batch_cnt = 0;
+  fsrv->batch_done = 0;
+  fsrv->batch_data = 0;
+  fsrv->doorbell = NULL;
+  fsrv->doorbell_fd = -1;
+  fsrv->use_doorbell = false;
+  fsrv->pipe = NULL;
+  fsrv->support_pipeline = false;
+  fsrv->use_pipeline = false;
+  fsrv->pipe_slot = 0;
+  fsrv->cpu_bind = -1;
+  fsrv->epoll_fd = -1;
+  fsrv->timer_fd = -1;
+  fsrv->timer_tick_ms = 0;
   fsrv->uses_crash_exitcode = false;
   fsrv->uses_asan = false;
 
@@ -249,8 +305,11 @@ void afl_fsrv_init_dup(afl_forkserver_t *fsrv_to, afl_forkserver_t *from) {
   fsrv_to->dev_urandom_fd = from->dev_urandom_fd;
   fsrv_to->out_fd = from->out_fd;  // not sure this is a good idea
   fsrv_to->no_unlink = from->no_unlink;
+  fsrv_to->use_memfd = from->use_memfd;
   fsrv_to->uses_crash_exitcode = from->uses_crash_exitcode;
   fsrv_to->crash_exitcode = from->crash_exitcode;
+  fsrv_to->cpu_bind = from->cpu_bind;
+  fsrv_to->hang_watchdog = from->hang_watchdog;
   fsrv_to->child_kill_signal = from->child_kill_signal;
   fsrv_to->fsrv_kill_signal = from->fsrv_kill_signal;
   fsrv_to->debug = from->debug;
@@ -258,11 +317,32 @@ void afl_fsrv_init_dup(afl_forkserver_t *fsrv_to, afl_forkserver_t *from) {
   // These are forkserver specific.
   fsrv_to->out_dir_fd = -1;
   fsrv_to->child_pid = -1;
+  fsrv_to->last_child_pid = -1;
   fsrv_to->use_fauxsrv = 0;
   fsrv_to->last_run_timed_out = 0;
 
   fsrv_to->init_child_func = from->init_child_func;
-  // Note: do not copy ->add_extra_func or ->persistent_record*
+  // Note: do not copy ->add_dict_func or ->persistent_record*
+
+  fsrv_to->latency = from->latency;
+
+  fsrv_to->map_cap = 0;
+  fsrv_to->map_grown = 0;
+  fsrv_to->bucketed_counts = false;
+  fsrv_to->buckets_lost = from->buckets_lost;
+  fsrv_to->doorbell = NULL;
+  fsrv_to->doorbell_fd = -1;
+  fsrv_to->use_doorbell = false;
+  fsrv_to->pipe = NULL;
+  fsrv_to->support_pipeline = false;
+  fsrv_to->use_pipeline = false;
+  fsrv_to->pipe_slot = 0;
+  fsrv_to->epoll_fd = -1;
+  fsrv_to->timer_fd = -1;
+  fsrv_to->timer_tick_ms = 0;
+  fsrv_to->touched_lines = NULL;
+  fsrv_to->touched_words = 0;
+  fsrv_to->touched_valid = false;
 
   list_append(&fsrv_list, fsrv_to);
 }
@@ -333,6 +413,510 @@ restart_select:
   return 0;  // not reached
 }
 
+#ifdef __linux__
+
+/* On Linux, the status pipe is waited on with an epoll set created once per
+   forkserver instead of a select() per exec. Timeouts do not arm a timer per
+   exec either: a timerfd in the same set ticks FSRV_TIMEOUT_TICKS times per
+   exec timeout, and a wait that sees a tick after its deadline gives up.
+   Runs are rarely long enough to see a tick at all. */
+
+static void epoll_setup(afl_forkserver_t *fsrv) {
+  struct epoll_event ev = {0};
+
+  if (fsrv->epoll_fd < 0) {
+    if ((fsrv->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+      PFATAL("epoll_create1() failed");
+    }
+
+    fsrv->timer_fd =
+        timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fsrv->timer_fd < 0) { PFATAL("timerfd_create() failed"); }
+
+    ev.events = EPOLLIN;
+    ev.data.fd = fsrv->timer_fd;
+    if (epoll_ctl(fsrv->epoll_fd, EPOLL_CTL_ADD, fsrv->timer_fd, &ev)) {
+      PFATAL("epoll_ctl() failed");
+    }
+
+    fsrv->timer_tick_ms = 0;
+  }
+
+  ev.events = EPOLLIN;
+  ev.data.fd = fsrv->fsrv_st_fd;
+  if (epoll_ctl(fsrv->epoll_fd, EPOLL_CTL_ADD, fsrv->fsrv_st_fd, &ev)) {
+    PFATAL("epoll_ctl() failed");
+  }
+}
+
+/* Only rearm the watchdog when the timeout itself changes. */
+
+static inline void epoll_set_tick(afl_forkserver_t *fsrv, u32 timeout_ms) {
+  u32 tick_ms = MAX(timeout_ms / FSRV_TIMEOUT_TICKS, 1U);
+
+  if (likely(tick_ms == fsrv->timer_tick_ms)) { return; }
+
+  struct itimerspec it;
+  it.it_value.tv_sec = it.it_interval.tv_sec = tick_ms / 1000;
+  it.it_value.tv_nsec = it.it_interval.tv_nsec = (tick_ms % 1000) * 1000000;
+
+  if (timerfd_settime(fsrv->timer_fd, 0, &it, NULL)) {
+    PFATAL("timerfd_settime() failed");
+  }
+
+  fsrv->timer_tick_ms = tick_ms;
+}
+
+/* The epoll counterpart of read_s32_timed() for the status pipe. */
+
+static u32 __attribute__((hot))
+epoll_read_s32_timed(afl_forkserver_t *fsrv, s32 *buf, u32 timeout_ms,
+                     volatile u8 *stop_soon_p) {
+  struct epoll_event evs[2];
+  u64                start = get_cur_time_us();
+  u64                deadline = start + timeout_ms * 1000ULL;
+  u64                ticks;
+  ssize_t            len_read;
+  s32                n, i;
+
+  epoll_set_tick(fsrv, timeout_ms);
+
+  while (1) {
+    n = epoll_wait(fsrv->epoll_fd, evs, 2, -1);
+
+    if (unlikely(n < 0)) {
+      if (likely(errno == EINTR)) { continue; }
+
+      *buf = -1;
+      return 0;
+    }
+
+    for (i = 0; i < n; ++i) {
+      if (evs[i].data.fd != fsrv->fsrv_st_fd) { continue; }
+
+    restart_read:
+      if (*stop_soon_p) {
+        // Early return - the user wants to quit.
+        return 0;
+      }
+
+      len_read = read(fsrv->fsrv_st_fd, (u8 *)buf, 4);
+
+      if (likely(len_read == 4)) {
+        u32 exec_ms = MIN(timeout_ms, (get_cur_time_us() - start) / 1000);
+
+        // ensure to report 1 ms has passed (0 is an error)
+        return exec_ms > 0 ? exec_ms : 1;
+
+      } else if (unlikely(len_read == -1 && errno == EINTR)) {
+        goto restart_read;
+      }
+
+      return 0;
+    }
+
+    /* only the watchdog ticked */
+
+    if (read(fsrv->timer_fd, &ticks, sizeof(ticks)) < 0 && errno != EAGAIN) {
+      *buf = -1;
+      return 0;
+    }
+
+    if (get_cur_time_us() >= deadline) {
+      *buf = -1;
+      return timeout_ms + 1;
+    }
+  }
+}
+
+static void epoll_remove(afl_forkserver_t *fsrv) {
+  if (fsrv->epoll_fd >= 0 && fsrv->fsrv_st_fd >= 0) {
+    epoll_ctl(fsrv->epoll_fd, EPOLL_CTL_DEL, fsrv->fsrv_st_fd, NULL);
+  }
+}
+
+static void epoll_close(afl_forkserver_t *fsrv) {
+  if (fsrv->epoll_fd >= 0) {
+    close(fsrv->timer_fd);
+    close(fsrv->epoll_fd);
+    fsrv->epoll_fd = fsrv->timer_fd = -1;
+  }
+}
+
+#else
+
+static void epoll_setup(afl_forkserver_t *fsrv) {
+  (void)fsrv;
+}
+
+static u32 epoll_read_s32_timed(afl_forkserver_t *fsrv, s32 *buf,
+                                u32 timeout_ms, volatile u8 *stop_soon_p) {
+  return read_s32_timed(fsrv->fsrv_st_fd, buf, timeout_ms, stop_soon_p);
+}
+
+static void epoll_remove(afl_forkserver_t *fsrv) {
+  (void)fsrv;
+}
+
+static void epoll_close(afl_forkserver_t *fsrv) {
+  (void)fsrv;
+}
+
+#endif
+
+/* The doorbell (include/fsdoorbell.h) is only available on Linux. */
+
+#ifdef __linux__
+
+/* Create the doorbell on the first start, and reset it for every start. */
+
+static void doorbell_setup(afl_forkserver_t *fsrv) {
+  if (!fsrv->doorbell) {
+    fsrv->doorbell_fd = syscall(SYS_memfd_create, "afl_doorbell", 0);
+    if (fsrv->doorbell_fd < 0) { return; }
+
+    if (ftruncate(fsrv->doorbell_fd, sizeof(struct fs_doorbell)) ||
+        (fsrv->doorbell = mmap(NULL, sizeof(struct fs_doorbell),
+                               PROT_READ | PROT_WRITE, MAP_SHARED,
+                               fsrv->doorbell_fd, 0)) == MAP_FAILED) {
+      close(fsrv->doorbell_fd);
+      fsrv->doorbell_fd = -1;
+      fsrv->doorbell = NULL;
+      return;
+    }
+
+    fsrv->doorbell_spin =
+        sysconf(_SC_NPROCESSORS_ONLN) > 1 ? FS_DOORBELL_SPIN : 0;
+  }
+
+  memset(fsrv->doorbell, 0, sizeof(struct fs_doorbell));
+  fsrv->doorbell->timing = !!fsrv->latency;
+  fsrv->doorbell->map_cap = fsrv->map_cap;
+  fsrv->doorbell_st = 0;
+}
+
+/* The doorbell counterpart of read_s32_timed() for the next message, which
+   is in *msg. A timeout_ms of 0 waits forever. As there is no EOF to tell us
+   that the forkserver died we look after it every now and then. */
+
+static u32 __attribute__((hot))
+doorbell_read_timed(afl_forkserver_t *fsrv, s32 *msg, s32 *buf,
+                    u32 timeout_ms, volatile u8 *stop_soon_p) {
+  struct fs_doorbell *db = fsrv->doorbell;
+  u64                 start = fs_doorbell_now_us(), now = start;
+  u64                 deadline = timeout_ms ? start + timeout_ms * 1000ULL : 0;
+
+  while (1) {
+    u64 slice = now + 100000;
+    if (deadline && deadline < slice) { slice = deadline; }
+
+    if (likely(fs_doorbell_wait(&db->st, &db->st_sleeping, fsrv->doorbell_st,
+                                fsrv->doorbell_spin, slice))) {
+      break;
+    }
+
+    if (*stop_soon_p) { return 0; }
+
+    siginfo_t info = {0};
+    if (waitid(P_PID, fsrv->fsrv_pid, &info, WEXITED | WNOHANG | WNOWAIT) ||
+        info.si_pid) {
+      return 0;
+    }
+
+    now = fs_doorbell_now_us();
+
+    if (deadline && now >= deadline) {
+      *buf = -1;
+      return timeout_ms + 1;
+    }
+  }
+
+  ++fsrv->doorbell_st;
+  *buf = __atomic_load_n(msg, __ATOMIC_ACQUIRE);
+
+  u32 exec_ms = MIN(timeout_ms ? timeout_ms : 0xffffffff,
+                    (fs_doorbell_now_us() - start) / 1000);
+
+  // ensure to report 1 ms has passed (0 is an error)
+  return exec_ms > 0 ? exec_ms : 1;
+}
+
+static inline void doorbell_ring_go(afl_forkserver_t *fsrv, u32 was_killed) {
+  if (unlikely(fsrv->latency)) {
+    fsrv->doorbell->t_go = 0;
+    fsrv->doorbell->t_forked = 0;
+    fsrv->doorbell->t_exited = 0;
+    fsrv->doorbell->resumed = 0;
+  }
+
+  fsrv->doorbell->was_killed = was_killed;
+  fsrv->doorbell->slot = fsrv->pipe_slot;
+  fs_doorbell_ring(&fsrv->doorbell->go, &fsrv->doorbell->go_sleeping);
+}
+
+#else
+
+static void doorbell_setup(afl_forkserver_t *fsrv) {
+  (void)fsrv;
+}
+
+static u32 doorbell_read_timed(afl_forkserver_t *fsrv, s32 *msg, s32 *buf,
+                               u32 timeout_ms, volatile u8 *stop_soon_p) {
+  (void)fsrv;
+  (void)msg;
+  (void)buf;
+  (void)timeout_ms;
+  (void)stop_soon_p;
+  return 0;
+}
+
+static inline void doorbell_ring_go(afl_forkserver_t *fsrv, u32 was_killed) {
+  (void)fsrv;
+  (void)was_killed;
+}
+
+#endif
+
+#ifdef __linux__
+
+/* Intel PT coverage for targets without instrumentation (AFL_INTEL_PT). The
+   faux forkserver stops each child right before its execv(), opens an
+   intel_pt perf event on it which starts tracing at the exec, lets it go and
+   decodes the trace into trace_bits once the child is gone (see
+   include/fsipt.h). Big traces are split at PSB packets and decoded on
+   ipt_threads threads, each into its own map, which are then added up. */
+
+  #define IPT_PMU_PATH "/sys/bus/event_source/devices/intel_pt"
+
+struct ipt_worker {
+  pthread_t          thread;
+  struct ipt_decoder dec;
+  u8                *start, *end;
+
+};
+
+struct ipt_trace {
+  s32                          fd;
+  struct perf_event_mmap_page *header;
+  u8                          *aux;
+
+};
+
+static struct ipt_worker ipt_workers[INTEL_PT_THREADS_MAX];
+static pthread_barrier_t ipt_go, ipt_done;
+static u32               ipt_page_size;
+
+/* Set the bits of a perf format field, e.g. "config:13", in config. */
+
+static void ipt_format(u8 *name, u64 *config) {
+  u8  path[PATH_MAX], buf[64];
+  u32 lo, hi;
+  s32 fd, len;
+
+  snprintf((char *)path, sizeof(path), IPT_PMU_PATH "/format/%s", name);
+  fd = open((char *)path, O_RDONLY);
+  if (fd < 0) { return; }
+  len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (len <= 0) { return; }
+  buf[len] = 0;
+
+  switch (sscanf((char *)buf, "config:%u-%u", &lo, &hi)) {
+    case 1:
+      hi = lo;
+      /* fall through */
+    case 2:
+      if (hi < 64) {
+        for (; lo <= hi; ++lo) {
+          *config |= 1ULL << lo;
+        }
+      }
+
+      break;
+    default:
+      break;
+  }
+}
+
+static s32 ipt_open(afl_forkserver_t *fsrv, pid_t pid) {
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = fsrv->ipt_type;
+  attr.config = fsrv->ipt_config;
+  attr.disabled = 1;
+  attr.enable_on_exec = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+
+  return syscall(SYS_perf_event_open, &attr, pid, -1, -1,
+                 PERF_FLAG_FD_CLOEXEC);
+}
+
+/* Called by afl-fuzz, checks that we can trace and sets up the config. */
+
+void afl_fsrv_ipt_setup(afl_forkserver_t *fsrv) {
+  u8  buf[32];
+  s32 fd, len;
+
+  fd = open(IPT_PMU_PATH "/type", O_RDONLY);
+  if (fd < 0) {
+    FATAL("AFL_INTEL_PT needs a CPU and kernel with Intel PT support (%s)",
+          IPT_PMU_PATH);
+  }
+
+  len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (len <= 0) { FATAL("Unable to read %s/type", IPT_PMU_PATH); }
+  buf[len] = 0;
+  fsrv->ipt_type = atoi((char *)buf);
+
+  /* branch tracing only, no timing packets */
+
+  fsrv->ipt_config = 0;
+  ipt_format((u8 *)"pt", &fsrv->ipt_config);
+  ipt_format((u8 *)"branch", &fsrv->ipt_config);
+
+  fd = ipt_open(fsrv, 0);
+  if (fd < 0) {
+    PFATAL(
+        "Unable to open an Intel PT perf event, check "
+        "/proc/sys/kernel/perf_event_paranoid");
+  }
+
+  close(fd);
+
+  if (!fsrv->ipt_threads) { fsrv->ipt_threads = 1; }
+  if (fsrv->ipt_threads > INTEL_PT_THREADS_MAX) {
+    fsrv->ipt_threads = INTEL_PT_THREADS_MAX;
+  }
+}
+
+static void *ipt_worker_main(void *arg) {
+  struct ipt_worker *w = arg;
+
+  while (1) {
+    pthread_barrier_wait(&ipt_go);
+    if (w->start < w->end) {
+      memset(w->dec.map, 0, w->dec.map_size);
+      ipt_decode(&w->dec, w->start, w->end);
+    }
+
+    pthread_barrier_wait(&ipt_done);
+  }
+
+  return NULL;
+}
+
+static void ipt_start_workers(afl_forkserver_t *fsrv) {
+  sigset_t all, old;
+  u32      i;
+
+  ipt_page_size = sysconf(_SC_PAGESIZE);
+
+  if (fsrv->ipt_threads < 2) { return; }
+
+  pthread_barrier_init(&ipt_go, NULL, fsrv->ipt_threads);
+  pthread_barrier_init(&ipt_done, NULL, fsrv->ipt_threads);
+
+  /* the signals are for the faux forkserver, not for the workers */
+
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+
+  for (i = 1; i < fsrv->ipt_threads; ++i) {
+    struct ipt_worker *w = &ipt_workers[i];
+
+    w->dec.map = ck_alloc(fsrv->map_size);
+    w->dec.map_size = fsrv->map_size;
+
+    if (pthread_create(&w->thread, NULL, ipt_worker_main, w)) {
+      PFATAL("pthread_create() failed");
+    }
+  }
+
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static void ipt_attach(afl_forkserver_t *fsrv, pid_t pid,
+                       struct ipt_trace *t) {
+  t->fd = ipt_open(fsrv, pid);
+  if (t->fd < 0) { PFATAL("Unable to open an Intel PT perf event"); }
+
+  t->header = mmap(NULL, 2 * ipt_page_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED, t->fd, 0);
+  if (t->header == MAP_FAILED) { PFATAL("Unable to map the perf buffer"); }
+
+  t->header->aux_offset = 2 * ipt_page_size;
+  t->header->aux_size = INTEL_PT_AUX_SIZE;
+
+  t->aux = mmap(NULL, INTEL_PT_AUX_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+                t->fd, t->header->aux_offset);
+  if (t->aux == MAP_FAILED) {
+    PFATAL("Unable to map the Intel PT buffer (check ulimit -l)");
+  }
+}
+
+/* Decode the trace of the child that is gone into trace_bits. */
+
+static void ipt_collect(afl_forkserver_t *fsrv, struct ipt_trace *t) {
+  static u8          warned;
+  struct ipt_decoder dec = {.map = fsrv->trace_bits,
+                            .map_size = fsrv->map_size};
+  u64                head;
+  u8                *end, *src, *dst;
+  u32                n = fsrv->ipt_threads, i, j;
+
+  head = __atomic_load_n(&t->header->aux_head, __ATOMIC_ACQUIRE);
+
+  if (head >= INTEL_PT_AUX_SIZE) {
+    head = INTEL_PT_AUX_SIZE;
+
+    if (!warned) {
+      WARNF("Intel PT trace buffer full, coverage of long runs is cut off.");
+      warned = 1;
+    }
+  }
+
+  end = t->aux + head;
+
+  if (n < 2 || head < 2 * INTEL_PT_CHUNK_MIN) {
+    ipt_decode(&dec, t->aux, end);
+
+  } else {
+    u8 *split = t->aux;
+
+    for (i = 1; i < n; ++i) {
+      split = ipt_next_psb(MAX(split, t->aux + head * i / n), end);
+      ipt_workers[i].start = split;
+      ipt_workers[i].end = end;
+      ipt_workers[i - 1].end = split;
+    }
+
+    pthread_barrier_wait(&ipt_go);
+    ipt_decode(&dec, t->aux, ipt_workers[0].end);
+    pthread_barrier_wait(&ipt_done);
+
+    for (i = 1; i < n; ++i) {
+      if (ipt_workers[i].start >= ipt_workers[i].end) { continue; }
+
+      src = ipt_workers[i].dec.map;
+      dst = fsrv->trace_bits;
+
+      for (j = 0; j < fsrv->map_size; ++j) {
+        if (src[j]) { dst[j] = MIN(255, dst[j] + src[j]); }
+      }
+    }
+  }
+
+  munmap(t->aux, INTEL_PT_AUX_SIZE);
+  munmap(t->header, 2 * ipt_page_size);
+  close(t->fd);
+}
+
+#endif
+
 /* Internal forkserver for non_instrumented_mode=1 and non-forkserver mode runs.
   It execvs for each fork, forwarding exit codes and child pids to afl. */
 
@@ -351,9 +935,15 @@ static void afl_fauxsrv_execv(afl_forkserver_t *fsrv, char **argv) {
 
   void (*old_sigchld_handler)(int) = signal(SIGCHLD, SIG_DFL);
 
+#ifdef __linux__
+  struct ipt_trace ipt;
+
+  if (fsrv->ipt_mode) { ipt_start_workers(fsrv); }
+#endif
+
   while (1) {
     uint32_t was_killed;
-    int      status;
+    int      status, reaped;
 
     /* Wait for parent by reading from the pipe. Exit if read fails. */
 
@@ -391,6 +981,11 @@ static void afl_fauxsrv_execv(afl_forkserver_t *fsrv, char **argv) {
       close(FORKSRV_FD);
       close(FORKSRV_FD + 1);
 
+#ifdef __linux__
+      /* wait for the tracer to attach */
+      if (fsrv->ipt_mode) { raise(SIGSTOP); }
+#endif
+
       // finally: exec...
       execv(fsrv->target_path, argv);
 
@@ -403,6 +998,27 @@ static void afl_fauxsrv_execv(afl_forkserver_t *fsrv, char **argv) {
       break;
     }
 
+    reaped = 0;
+
+#ifdef __linux__
+    ipt.fd = -1;
+
+    if (fsrv->ipt_mode) {
+      if (waitpid(child_pid, &status, WUNTRACED) < 0) {
+        PFATAL("waitpid() failed");
+      }
+
+      if (WIFSTOPPED(status)) {
+        ipt_attach(fsrv, child_pid, &ipt);
+        kill(child_pid, SIGCONT);
+
+      } else {
+        reaped = 1;
+      }
+    }
+
+#endif
+
     /* In parent process: write PID to AFL. */
 
     if (write(FORKSRV_FD + 1, &child_pid, 4) != 4) { exit(0); }
@@ -410,11 +1026,15 @@ static void afl_fauxsrv_execv(afl_forkserver_t *fsrv, char **argv) {
     /* after child exited, get and relay exit status to parent through waitpid.
      */
 
-    if (waitpid(child_pid, &status, 0) < 0) {
+    if (!reaped && waitpid(child_pid, &status, 0) < 0) {
       // Zombie Child could not be collected. Scary!
       WARNF("Fauxserver could not determine child's exit code. ");
     }
 
+#ifdef __linux__
+    if (ipt.fd >= 0) { ipt_collect(fsrv, &ipt); }
+#endif
+
     /* Relay wait status to AFL pipe, then loop back. */
 
     if (write(FORKSRV_FD + 1, &status, 4) != 4) { exit(1); }
@@ -436,8 +1056,7 @@ static void report_error_and_exit(int error) {
       FATAL(
           "the fuzzing target reports that hardcoded map address might be the "
           "reason the mmap of the shared memory failed. Solution: recompile "
-          "the target with either afl-clang-lto and do not set "
-          "AFL_LLVM_MAP_ADDR or recompile with afl-clang-fast.");
+          "the target with another AFL_LLVM_MAP_ADDR or without it.");
       break;
     case FS_ERROR_SHM_OPEN:
       FATAL("the fuzzing target reports that the shm_open() call failed.");
@@ -638,8 +1257,9 @@ void afl_fsrv_start(afl_forkserver_t *fsrv, char **argv,
         break;
     }
 
-    /* autodict in Nyx mode */
-    if (!ignore_autodict) {
+    /* autodict in Nyx mode, the extra runners of afl-fuzz have no use for
+       it */
+    if (!ignore_autodict && fsrv->add_dict_func) {
       char *x =
           alloc_printf("%s/workdir/dump/afl_autodict.txt", fsrv->out_dir_path);
       int nyx_autodict_fd = open(x, O_RDONLY);
@@ -674,14 +1294,7 @@ void afl_fsrv_start(afl_forkserver_t *fsrv, char **argv,
             }
           }
 
-          offset = 0;
-          while (offset < (u32)f_len &&
-                 (u8)dict[offset] + offset < (u32)f_len) {
-            fsrv->add_extra_func(fsrv->afl_ptr, dict + offset + 1,
-                                 (u8)dict[offset]);
-            offset += (1 + dict[offset]);
-            count++;
-          }
+          count = fsrv->add_dict_func(fsrv->afl_ptr, dict, f_len);
 
           if (!be_quiet) { ACTF("Loaded %u autodictionary entries", count); }
           ck_free(dict);
@@ -725,6 +1338,9 @@ void afl_fsrv_start(afl_forkserver_t *fsrv, char **argv,
 
   if (pipe(st_pipe) || pipe(ctl_pipe)) { PFATAL("pipe() failed"); }
 
+  doorbell_setup(fsrv);
+  fsrv->use_doorbell = false;
+
   fsrv->last_run_timed_out = 0;
   fsrv->fsrv_pid = fork();
 
@@ -739,10 +1355,25 @@ void afl_fsrv_start(afl_forkserver_t *fsrv, char **argv,
     sa.sa_handler = SIG_DFL;
     sigaction(SIGPIPE, &sa, NULL);
 
+#ifdef __linux__
+    if (fsrv->cpu_bind >= 0 && fsrv->cpu_bind < 1024) {
+      u64 mask[1024 / 64] = {0};
+      mask[fsrv->cpu_bind / 64] = 1ULL << (fsrv->cpu_bind % 64);
+      syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask); /* best effort */
+    }
+
+#endif
+
     struct rlimit r;
 
-    if (!fsrv->cmplog_binary) {
-      unsetenv(CMPLOG_SHM_ENV_VAR);  // we do not want that in non-cmplog fsrv
+    if (fsrv->cmplog_switch) {
+      setenv(CMPLOG_SWITCH_ENV_VAR, "1", 1);
+
+    } else {
+      unsetenv(CMPLOG_SWITCH_ENV_VAR);
+
+      // we do not want that in non-cmplog fsrv
+      if (!fsrv->cmplog_binary) { unsetenv(CMPLOG_SHM_ENV_VAR); }
     }
 
     /* Umpf. On OpenBSD, the default fd limit for root users is set to
@@ -802,6 +1433,15 @@ void afl_fsrv_start(afl_forkserver_t *fsrv, char **argv,
     close(st_pipe[0]);
     close(st_pipe[1]);
 
+    if (fsrv->doorbell_fd >= 0) {
+      char fd_buf[16];
+      snprintf(fd_buf, sizeof(fd_buf), "%d", fsrv->doorbell_fd);
+      setenv(DOORBELL_ENV_VAR, fd_buf, 1);
+
+    } else {
+      unsetenv(DOORBELL_ENV_VAR);
+    }
+
     close(fsrv->out_dir_fd);
     close(fsrv->dev_null_fd);
     close(fsrv->dev_urandom_fd);
@@ -844,6 +1484,7 @@ void afl_fsrv_start(afl_forkserver_t *fsrv, char **argv,
 
   fsrv->fsrv_ctl_fd = ctl_pipe[1];
   fsrv->fsrv_st_fd = st_pipe[0];
+  epoll_setup(fsrv);
 
   /* Wait for the fork server to come up, but don't wait too long. */
 
@@ -894,11 +1535,53 @@ void afl_fsrv_start(afl_forkserver_t *fsrv, char **argv,
     if ((status & FS_OPT_ERROR) == FS_OPT_ERROR)
       report_error_and_exit(FS_OPT_GET_ERROR(status));
 
+    fsrv->use_batch = 0;
+    fsrv->use_pipeline = 0;
+    fsrv->bucketed_counts = false;
+
     if ((status & FS_OPT_ENABLED) == FS_OPT_ENABLED) {
       // workaround for recent AFL++ versions
       if ((status & FS_OPT_OLD_AFLPP_WORKAROUND) == FS_OPT_OLD_AFLPP_WORKAROUND)
         status = (status & 0xf0ffffff);
 
+      /* the target switches over after reading our reply to its options */
+      if (fsrv->doorbell && fsrv->doorbell->magic == FS_DOORBELL_MAGIC &&
+          (status & (FS_OPT_SHDMEM_FUZZ | FS_OPT_AUTODICT))) {
+        __atomic_store_n(&fsrv->doorbell->accepted, 1, __ATOMIC_SEQ_CST);
+        fsrv->use_doorbell = true;
+        if (!be_quiet) { ACTF("Using DOORBELL feature."); }
+      }
+
+      /* the target stores buckets if all its modules do. Once it dropped
+         them a new forkserver is told to drop them before its first run. */
+      if (fsrv->use_doorbell && fsrv->doorbell->buckets) {
+        if (fsrv->buckets_lost) {
+          afl_fsrv_buckets_off(fsrv);
+
+        } else {
+          fsrv->bucketed_counts = true;
+          if (!be_quiet) { ACTF("Using BUCKETED COUNTS feature."); }
+        }
+      }
+
+      fsrv->pc_filter_reloadable = fsrv->doorbell &&
+                                   fsrv->doorbell->magic == FS_DOORBELL_MAGIC &&
+                                   fsrv->doorbell->filter;
+      if (fsrv->pc_filter_reloadable && !be_quiet) {
+        ACTF("Target reloads AFL_PC_FILTER_FILE when it changes.");
+      }
+
+      if (fsrv->doorbell && fsrv->doorbell->magic == FS_DOORBELL_MAGIC &&
+          fsrv->doorbell->focus_start < fsrv->doorbell->focus_end &&
+          fsrv->doorbell->focus_end <= fsrv->real_map_size) {
+        fsrv->focus_start = fsrv->doorbell->focus_start;
+        fsrv->focus_end = fsrv->doorbell->focus_end;
+        if (!be_quiet) {
+          ACTF("Focus set of AFL_PC_FILTER_FOCUS: map bytes %u to %u.",
+               fsrv->focus_start, fsrv->focus_end - 1);
+        }
+      }
+
       if ((status & FS_OPT_NEWCMPLOG) == 0 && fsrv->cmplog_binary) {
         if (fsrv->qemu_mode || fsrv->frida_mode) {
           report_error_and_exit(FS_ERROR_OLD_CMPLOG_QEMU);
@@ -918,8 +1601,14 @@ void afl_fsrv_start(afl_forkserver_t *fsrv, char **argv,
           fsrv->use_shmem_fuzz = 1;
           if (!be_quiet) { ACTF("Using SHARED MEMORY FUZZING feature."); }
 
+          if ((status & FS_OPT_BATCH) == FS_OPT_BATCH && fsrv->support_batch) {
+            fsrv->use_batch = 1;
+            if (!be_quiet) { ACTF("Using TESTCASE BATCHES feature."); }
+          }
+
           if ((status & FS_OPT_AUTODICT) == 0 || ignore_autodict) {
             u32 send_status = (FS_OPT_ENABLED | FS_OPT_SHDMEM_FUZZ);
+            if (fsrv->use_batch) { send_status |= FS_OPT_BATCH; }
             if (write(fsrv->fsrv_ctl_fd, &send_status, 4) != 4) {
               FATAL("Writing to forkserver failed.");
             }
@@ -932,6 +1621,13 @@ void afl_fsrv_start(afl_forkserver_t *fsrv, char **argv,
         }
       }
 
+      if ((status & FS_OPT_DIRTYLINES) == FS_OPT_DIRTYLINES &&
+          fsrv->dirty_lines) {
+        fsrv->use_dirty_lines = 1;
+        fsrv->reset_full_map = true;
+        if (!be_quiet) { ACTF("Using DIRTY LINES feature."); }
+      }
+
       if ((status & FS_OPT_MAPSIZE) == FS_OPT_MAPSIZE) {
         u32 tmp_map_size = FS_OPT_GET_MAPSIZE(status);
 
@@ -954,14 +1650,37 @@ void afl_fsrv_start(afl_forkserver_t *fsrv, char **argv,
         }
 
         fsrv->map_size = tmp_map_size;
+
+        /* a map that grew for libraries the children load keeps its size
+           (AFL_MAP_SIZE_MAX) */
+
+        if (fsrv->map_grown > fsrv->real_map_size) {
+          fsrv->real_map_size = fsrv->map_grown;
+          fsrv->map_size = (fsrv->map_grown + 63) & ~63U;
+        }
+      }
+
+      /* the batch must be able to hold two full maps */
+      if (fsrv->use_batch && (fsrv->map_size >> 2) * 2 > FS_BATCH_DELTAS) {
+        fsrv->use_batch = 0;
+      }
+
+      /* pipelined runs need the doorbell, the shared memory testcase and
+         slot maps that fit the target's map */
+      if (fsrv->support_pipeline && fsrv->use_doorbell &&
+          fsrv->use_shmem_fuzz && !fsrv->use_dirty_lines &&
+          fsrv->doorbell->pipeline && fsrv->pipe->map_size >= fsrv->map_size) {
+        fsrv->use_pipeline = 1;
+        if (!be_quiet) { ACTF("Using PIPELINE feature."); }
       }
 
       if ((status & FS_OPT_AUTODICT) == FS_OPT_AUTODICT) {
         if (!ignore_autodict) {
-          if (fsrv->add_extra_func == NULL || fsrv->afl_ptr == NULL) {
+          if (fsrv->add_dict_func == NULL || fsrv->afl_ptr == NULL) {
             // this is not afl-fuzz - or it is cmplog - we deny and return
             if (fsrv->use_shmem_fuzz) {
               status = (FS_OPT_ENABLED | FS_OPT_SHDMEM_FUZZ);
+              if (fsrv->use_batch) { status |= FS_OPT_BATCH; }
 
             } else {
               status = (FS_OPT_ENABLED);
@@ -978,6 +1697,7 @@ void afl_fsrv_start(afl_forkserver_t *fsrv, char **argv,
 
           if (fsrv->use_shmem_fuzz) {
             status = (FS_OPT_ENABLED | FS_OPT_AUTODICT | FS_OPT_SHDMEM_FUZZ);
+            if (fsrv->use_batch) { status |= FS_OPT_BATCH; }
 
           } else {
             status = (FS_OPT_ENABLED | FS_OPT_AUTODICT);
@@ -1016,14 +1736,7 @@ void afl_fsrv_start(afl_forkserver_t *fsrv, char **argv,
             }
           }
 
-          offset = 0;
-          while (offset < (u32)status &&
-                 (u8)dict[offset] + offset < (u32)status) {
-            fsrv->add_extra_func(fsrv->afl_ptr, dict + offset + 1,
-                                 (u8)dict[offset]);
-            offset += (1 + dict[offset]);
-            count++;
-          }
+          count = fsrv->add_dict_func(fsrv->afl_ptr, dict, status);
 
           if (!be_quiet) { ACTF("Loaded %u autodictionary entries", count); }
           ck_free(dict);
@@ -1235,8 +1948,10 @@ void afl_fsrv_kill(afl_forkserver_t *fsrv) {
     waitpid(fsrv->fsrv_pid, NULL, 0);
   }
 
+  epoll_remove(fsrv);
   close(fsrv->fsrv_ctl_fd);
   close(fsrv->fsrv_st_fd);
+  fsrv->fsrv_ctl_fd = fsrv->fsrv_st_fd = -1;
   fsrv->fsrv_pid = -1;
   fsrv->child_pid = -1;
 
@@ -1253,7 +1968,48 @@ u32 afl_fsrv_get_mapsize(afl_forkserver_t *fsrv, char **argv,
   return fsrv->map_size;
 }
 
-/* Delete the current testcase and write the buf to the testcase file */
+/* Put the patch of the caller with buf into the shared memory testcase. If
+   the last one was a patch of the same file whose window moved the rest of
+   it by as much, only the bytes between the start of the first and the end
+   of the last window are copied. Returns the length of the testcase. */
+
+static u32 fsrv_write_patch(afl_forkserver_t *fsrv, u8 *buf, u32 len) {
+  struct fs_patch *p = &fsrv->patch, *s = &fsrv->shmem_fuzz_patch;
+  u8              *shm = fsrv->shmem_fuzz;
+  u32              tail, end, lo, hi;
+
+  if (unlikely(len > p->max - p->off)) { len = p->max - p->off; }
+
+  tail = fs_patch_tail(p, len);
+  end = p->off + len + tail;
+
+  if (s->file == p->file && s->len - s->cut == len - p->cut) {
+    lo = MIN(s->off, p->off);
+    hi = MIN(MAX(s->off + s->len, p->off + len), end);
+
+  } else {
+    lo = 0;
+    hi = end;
+  }
+
+  if (lo < p->off) { memcpy(shm + lo, p->file + lo, p->off - lo); }
+  memcpy(shm + p->off, buf, len);
+  if (p->off + len < hi) {
+    memcpy(shm + p->off + len, p->file + p->off + p->cut,
+           hi - p->off - len);
+  }
+
+  *s = *p;
+  s->len = len;
+  fsrv->shmem_fuzz_diff.base = NULL;
+  return end;
+}
+
+/* Delete the current testcase and write the buf to the testcase file. With
+   the shared memory testcase and a write_diff from the caller on the same
+   base as the last one, only the bytes this testcase or the last one
+   changed are copied. With a patch from the caller, buf only replaces a
+   window of the file of the patch. */
 
 void __attribute__((hot))
 afl_fsrv_write_to_testcase(afl_forkserver_t *fsrv, u8 *buf, size_t len) {
@@ -1286,10 +2042,36 @@ afl_fsrv_write_to_testcase(afl_forkserver_t *fsrv, u8 *buf, size_t len) {
 #endif
 
   if (likely(fsrv->use_shmem_fuzz)) {
-    if (unlikely(len > MAX_FILE)) len = MAX_FILE;
+    struct fs_diff *d = &fsrv->write_diff, *s = &fsrv->shmem_fuzz_diff;
+
+    if (unlikely(len > fsrv->shmem_fuzz_max) && !fsrv->patch.file) {
+      len = fsrv->shmem_fuzz_max;
+    }
+
+    if (unlikely(fsrv->patch.file)) {
+      len = fsrv_write_patch(fsrv, buf, len);
+      fsrv->patch.file = NULL;
+
+    } else if (d->base && (len == d->len || d->hi == UINT32_MAX)) {
+      if (d->base == s->base && d->len == s->len) {
+        u32 lo = MIN(d->lo, s->lo), hi = MIN(MAX(d->hi, s->hi), len);
+        if (lo < hi) { memcpy(fsrv->shmem_fuzz + lo, buf + lo, hi - lo); }
 
+      } else {
+        memcpy(fsrv->shmem_fuzz, buf, len);
+      }
+
+      *s = *d;
+      fsrv->shmem_fuzz_patch.file = NULL;
+
+    } else {
+      memcpy(fsrv->shmem_fuzz, buf, len);
+      s->base = NULL;
+      fsrv->shmem_fuzz_patch.file = NULL;
+    }
+
+    d->base = NULL;
     *fsrv->shmem_fuzz_len = len;
-    memcpy(fsrv->shmem_fuzz, buf, len);
 #ifdef _DEBUG
     if (getenv("AFL_DEBUG")) {
       fprintf(stderr, "FS crc: %016llx len: %u\n",
@@ -1309,7 +2091,7 @@ afl_fsrv_write_to_testcase(afl_forkserver_t *fsrv, u8 *buf, size_t len) {
   } else {
     s32 fd = fsrv->out_fd;
 
-    if (!fsrv->use_stdin && fsrv->out_file) {
+    if (!fsrv->use_stdin && fsrv->out_file && !fsrv->use_memfd) {
       if (unlikely(fsrv->no_unlink)) {
         fd = open(fsrv->out_file, O_WRONLY | O_CREAT | O_TRUNC,
                   DEFAULT_PERMISSION);
@@ -1334,9 +2116,24 @@ afl_fsrv_write_to_testcase(afl_forkserver_t *fsrv, u8 *buf, size_t len) {
     }
 
     // fprintf(stderr, "WRITE %d %u\n", fd, len);
-    ck_write(fd, buf, len, fsrv->out_file);
+    if (unlikely(fsrv->patch.file)) {
+      struct fs_patch *p = &fsrv->patch;
+      u32              tail;
+
+      if (unlikely(len > p->max - p->off)) { len = p->max - p->off; }
+      tail = fs_patch_tail(p, len);
+
+      ck_write(fd, p->file, p->off, fsrv->out_file);
+      ck_write(fd, buf, len, fsrv->out_file);
+      ck_write(fd, p->file + p->off + p->cut, tail, fsrv->out_file);
+      len += p->off + tail;
+      p->file = NULL;
 
-    if (fsrv->use_stdin) {
+    } else {
+      ck_write(fd, buf, len, fsrv->out_file);
+    }
+
+    if (fsrv->use_stdin || fsrv->use_memfd) {
       if (ftruncate(fd, len)) { PFATAL("ftruncate() failed"); }
       lseek(fd, 0, SEEK_SET);
 
@@ -1346,92 +2143,358 @@ afl_fsrv_write_to_testcase(afl_forkserver_t *fsrv, u8 *buf, size_t len) {
   }
 }
 
+/* The forkserver that ran last. Forkservers can share a trace_bits map (e.g.
+   cmplog), and after another one ran the dirty lines are not reliable. */
+
+static afl_forkserver_t *last_run_fsrv;
+
+/* Zero only the map lines the previous run flagged as dirty, and reset those
+   flags. The instrumentation flags a line before it updates the counter, so
+   a run killed in between can only leave too many lines flagged. */
+
+static inline void reset_dirty_lines(afl_forkserver_t *fsrv) {
+  u8 *dirty = fsrv->dirty_lines;
+  u32 lines = DIRTY_LINES_SIZE(fsrv->map_size), l;
+
+  for (l = 0; l < lines; ++l) {
+    /* Skip clean lines eight at a time. */
+
+    if (!(l & 7) && l + 8 <= lines && !*(u64 *)(dirty + l)) {
+      l += 7;
+      continue;
+    }
+
+    if (dirty[l]) {
+      u32 offset = l << DIRTY_LINE_SHIFT;
+
+      memset(fsrv->trace_bits + offset, 0,
+             MIN(1U << DIRTY_LINE_SHIFT, fsrv->map_size - offset));
+      dirty[l] = 0;
+    }
+  }
+}
+
+/* Clear the coverage map before a run. With dirty line tracking this avoids
+   the full memset whenever possible. Line 0 always counts as dirty, the
+   runtime sets the first map byte outside of the instrumentation. */
+
+static inline void reset_trace_bits(afl_forkserver_t *fsrv) {
+  if (fsrv->use_dirty_lines) {
+    if (likely(!fsrv->reset_full_map && last_run_fsrv == fsrv)) {
+      reset_dirty_lines(fsrv);
+
+    } else {
+      memset(fsrv->trace_bits, 0, fsrv->map_size);
+      memset(fsrv->dirty_lines, 0, DIRTY_LINES_SIZE(fsrv->map_size));
+      fsrv->reset_full_map = false;
+    }
+
+    fsrv->dirty_lines[0] = 1;
+    fsrv->touched_valid = false;
+
+  } else {
+    memset(fsrv->trace_bits, 0, fsrv->map_size);
+  }
+
+  last_run_fsrv = fsrv;
+}
+
+/* Pack the dirty line flags of the last run into touched_lines, one bit per
+   line. The map passes of afl-fuzz scan these bits, a 64th of the map size,
+   instead of the flag bytes, an eighth of it; the bytes are read once per
+   run here. reset_trace_bits() marks the bits stale for the next run. */
+
+void afl_fsrv_pack_dirty(afl_forkserver_t *fsrv) {
+  u8 *dirty = fsrv->dirty_lines;
+  u32 lines = DIRTY_LINES_SIZE(fsrv->map_size), words = (lines + 63) >> 6, l;
+
+  if (unlikely(fsrv->touched_words < words)) {
+    fsrv->touched_lines = ck_realloc(fsrv->touched_lines, words * sizeof(u64));
+    fsrv->touched_words = words;
+  }
+
+  memset(fsrv->touched_lines, 0, words * sizeof(u64));
+
+  for (l = 0; l < lines; ++l) {
+    /* Skip clean lines eight at a time. */
+
+    if (!(l & 7) && l + 8 <= lines && !*(u64 *)(dirty + l)) {
+      l += 7;
+      continue;
+    }
+
+    if (dirty[l]) { fsrv->touched_lines[l >> 6] |= 1ULL << (l & 63); }
+  }
+
+  fsrv->touched_valid = true;
+}
+
+#ifdef __linux__
+/* Translate what nyx_exec() returned. */
+
+static fsrv_run_result_t nyx_result(enum NyxReturnValue ret_val,
+                                    volatile u8        *stop_soon_p) {
+  switch (ret_val) {
+    case Normal:
+      return FSRV_RUN_OK;
+    case Crash:
+    case Asan:
+      return FSRV_RUN_CRASH;
+    case Timeout:
+      return FSRV_RUN_TMOUT;
+    case InvalidWriteToPayload:
+      /* ??? */
+      FATAL("FixMe: Nyx InvalidWriteToPayload handler is missing");
+      break;
+    case Abort:
+      FATAL("Error: Nyx abort occurred...");
+    case IoError:
+      if (*stop_soon_p) {
+        return 0;
+
+      } else {
+        FATAL("Error: QEMU-Nyx has died...");
+      }
+
+      break;
+    case Error:
+      FATAL("Error: Nyx runtime error has occurred...");
+      break;
+  }
+
+  return FSRV_RUN_OK;
+}
+
+static void nyx_set_tmout(afl_forkserver_t *fsrv, u32 timeout) {
+  if (fsrv->nyx_tmout != timeout) {
+    fsrv->nyx_handlers->nyx_option_set_timeout(
+        fsrv->nyx_runner, timeout / 1000, (timeout % 1000) * 1000);
+    fsrv->nyx_handlers->nyx_option_apply(fsrv->nyx_runner);
+    fsrv->nyx_tmout = timeout;
+  }
+}
+
+struct nyx_thread_fds {
+  afl_forkserver_t *fsrv;
+  s32               req_fd, res_fd;
+};
+
+/* Run the execs afl_fsrv_run_start() asks for on a runner of its own. A
+   request is the timeout, the answer what nyx_exec() returned. */
+
+static void *nyx_exec_thread(void *arg) {
+  struct nyx_thread_fds *t = arg;
+  afl_forkserver_t      *fsrv = t->fsrv;
+  s32                    req_fd = t->req_fd, res_fd = t->res_fd;
+  u32                    timeout;
+  s32                    ret_val;
+
+  ck_free(t);
+
+  while (read(req_fd, &timeout, 4) == 4) {
+    nyx_set_tmout(fsrv, timeout);
+    ret_val = fsrv->nyx_handlers->nyx_exec(fsrv->nyx_runner);
+    if (write(res_fd, &ret_val, 4) != 4) { break; }
+  }
+
+  close(req_fd);
+  close(res_fd);
+  return NULL;
+}
+
+/* Let afl_fsrv_run_start() and afl_fsrv_run_finish() drive the Nyx runner of
+   fsrv, so that it runs while the caller goes on. They talk to the thread
+   doing the nyx_exec() calls through fsrv_ctl_fd and fsrv_st_fd, like to a
+   forkserver, so callers can poll() on fsrv_st_fd just the same. */
+
+void afl_fsrv_nyx_async(afl_forkserver_t *fsrv) {
+  struct nyx_thread_fds *t;
+  int                    req_pipe[2], res_pipe[2];
+  sigset_t               all, old;
+
+  if (!fsrv->nyx_mode || !fsrv->nyx_runner || fsrv->nyx_async) { return; }
+
+  if (pipe(req_pipe) || pipe(res_pipe)) { PFATAL("pipe() failed"); }
+
+  t = ck_alloc(sizeof(struct nyx_thread_fds));
+  t->fsrv = fsrv;
+  t->req_fd = req_pipe[0];
+  t->res_fd = res_pipe[1];
+  fsrv->fsrv_ctl_fd = req_pipe[1];
+  fsrv->fsrv_st_fd = res_pipe[0];
+
+  /* the signals stay with the fuzzing thread */
+
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+
+  if (pthread_create(&fsrv->nyx_thread, NULL, nyx_exec_thread, t)) {
+    FATAL("Unable to start the Nyx exec thread");
+  }
+
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  fsrv->nyx_async = true;
+}
+
+#endif
+
 /* Execute target application, monitoring for timeouts. Return status
    information. The called program will update afl->fsrv->trace_bits. */
 
 fsrv_run_result_t __attribute__((hot))
 afl_fsrv_run_target(afl_forkserver_t *fsrv, u32 timeout,
                     volatile u8 *stop_soon_p) {
-  s32 res;
-  u32 exec_ms;
-  u32 write_value = fsrv->last_run_timed_out;
-
 #ifdef __linux__
   if (fsrv->nyx_mode) {
-    static uint32_t last_timeout_value = 0;
-
-    if (last_timeout_value != timeout) {
-      fsrv->nyx_handlers->nyx_option_set_timeout(
-          fsrv->nyx_runner, timeout / 1000, (timeout % 1000) * 1000);
-      fsrv->nyx_handlers->nyx_option_apply(fsrv->nyx_runner);
-      last_timeout_value = timeout;
-    }
+    nyx_set_tmout(fsrv, timeout);
 
     enum NyxReturnValue ret_val =
         fsrv->nyx_handlers->nyx_exec(fsrv->nyx_runner);
 
     fsrv->total_execs++;
 
-    switch (ret_val) {
-      case Normal:
-        return FSRV_RUN_OK;
-      case Crash:
-      case Asan:
-        return FSRV_RUN_CRASH;
-      case Timeout:
-        return FSRV_RUN_TMOUT;
-      case InvalidWriteToPayload:
-        /* ??? */
-        FATAL("FixMe: Nyx InvalidWriteToPayload handler is missing");
-        break;
-      case Abort:
-        FATAL("Error: Nyx abort occurred...");
-      case IoError:
-        if (*stop_soon_p) {
-          return 0;
+    return nyx_result(ret_val, stop_soon_p);
+  }
 
-        } else {
-          FATAL("Error: QEMU-Nyx has died...");
-        }
+#endif
 
-        break;
-      case Error:
-        FATAL("Error: Nyx runtime error has occurred...");
-        break;
+  if (!afl_fsrv_run_start(fsrv, stop_soon_p)) { return 0; }
+
+  return afl_fsrv_run_finish(fsrv, timeout, stop_soon_p);
+}
+
+/* Book a finished run to fsrv->latency, and over the doorbell the steps the
+   forkserver took, if their timestamps are in order. */
+
+static void latency_record(afl_forkserver_t *fsrv) {
+  struct fsrv_latency *lat = fsrv->latency;
+  u64                  now = fsrv_lat_now();
+
+  fsrv_lat_add(lat, FSRV_LAT_WAIT, now - fsrv->lat_pid);
+
+#ifdef __linux__
+  struct fs_doorbell *db = fsrv->doorbell;
+
+  if (!fsrv->use_doorbell) { return; }
+
+  u64 t_go = __atomic_load_n(&db->t_go, __ATOMIC_ACQUIRE);
+  u64 t_forked = __atomic_load_n(&db->t_forked, __ATOMIC_ACQUIRE);
+  u64 t_exited = __atomic_load_n(&db->t_exited, __ATOMIC_ACQUIRE);
+
+  if (t_go < fsrv->lat_go || t_forked < t_go || t_exited < t_forked ||
+      now < t_exited) {
+    return;
+  }
+
+  fsrv_lat_add(lat, FSRV_LAT_REQUEST, t_go - fsrv->lat_go);
+  fsrv_lat_add(lat, db->resumed ? FSRV_LAT_RESUME : FSRV_LAT_FORK,
+               t_forked - t_go);
+  fsrv_lat_add(lat, FSRV_LAT_RUN, t_exited - t_forked);
+  fsrv_lat_add(lat, FSRV_LAT_STATUS, now - t_exited);
+#endif
+}
+
+/* The time within which a share q of the runs got through phase, in us, from
+   the upper bounds of the buckets. 0 if there were none. */
+
+u64 afl_fsrv_lat_quantile(struct fsrv_latency *lat, u32 phase, double q) {
+  u64 cnt = 0, seen = 0;
+  u32 i;
+
+  for (i = 0; i < FSRV_LAT_BUCKETS; ++i) {
+    cnt += __atomic_load_n(&lat->hist[phase][i], __ATOMIC_RELAXED);
+  }
+
+  if (!cnt) { return 0; }
+
+  for (i = 0; i < FSRV_LAT_BUCKETS - 1; ++i) {
+    seen += __atomic_load_n(&lat->hist[phase][i], __ATOMIC_RELAXED);
+    if (seen >= q * cnt) { break; }
+  }
+
+  return ((u64)FSRV_LAT_BASE << i) / 1000;
+}
+
+/* Start an exec on the forkserver without waiting for it to finish. Returns 0
+   if the user wants to quit. */
+
+u8 __attribute__((hot))
+afl_fsrv_run_start(afl_forkserver_t *fsrv, volatile u8 *stop_soon_p) {
+  s32 res;
+  u32 write_value = fsrv->last_run_timed_out;
+
+#ifdef __linux__
+  if (unlikely(fsrv->nyx_mode)) {
+    /* the runner keeps to the timeout itself */
+
+    if (!fsrv->nyx_async) { FATAL("BUG: Nyx runner without exec thread"); }
+    if ((res = write(fsrv->fsrv_ctl_fd, &fsrv->exec_tmout, 4)) != 4) {
+      if (*stop_soon_p) { return 0; }
+      RPFATAL(res, "Unable to start an exec on the Nyx runner");
     }
 
-    return FSRV_RUN_OK;
+    return 1;
   }
 
 #endif
+
+  if (unlikely(fsrv->cmplog_run)) { write_value |= FS_RUN_CMPLOG; }
+
+  if (unlikely(fsrv->pc_filter_reload)) {
+    write_value |= FS_RUN_FILTER;
+    fsrv->pc_filter_reload = false;
+  }
+
   /* After this memset, fsrv->trace_bits[] are effectively volatile, so we
      must prevent any earlier operations from venturing into that
      territory. */
 
+  if (fsrv->virgin) { fsrv->virgin->verdict = FS_VIRGIN_UNKNOWN; }
+
+  if (unlikely(fsrv->latency)) { fsrv->lat_go = fsrv_lat_now(); }
+
 #ifdef __linux__
   if (!fsrv->nyx_mode) {
-    memset(fsrv->trace_bits, 0, fsrv->map_size);
+    reset_trace_bits(fsrv);
     MEM_BARRIER();
   }
 
 #else
-  memset(fsrv->trace_bits, 0, fsrv->map_size);
+  reset_trace_bits(fsrv);
   MEM_BARRIER();
 #endif
 
+  if (unlikely(fsrv->latency)) {
+    u64 now = fsrv_lat_now();
+    fsrv_lat_add(fsrv->latency, FSRV_LAT_RESET, now - fsrv->lat_go);
+    fsrv->lat_go = now;
+  }
+
   /* we have the fork server (or faux server) up and running
   First, tell it if the previous run timed out. */
 
-  if ((res = write(fsrv->fsrv_ctl_fd, &write_value, 4)) != 4) {
-    if (*stop_soon_p) { return 0; }
-    RPFATAL(res, "Unable to request new process from fork server (OOM?)");
-  }
+  if (fsrv->use_doorbell) {
+    doorbell_ring_go(fsrv, write_value);
+    fsrv->last_run_timed_out = 0;
 
-  fsrv->last_run_timed_out = 0;
+    if (!doorbell_read_timed(fsrv, &fsrv->doorbell->pid, &fsrv->child_pid, 0,
+                             stop_soon_p)) {
+      if (*stop_soon_p) { return 0; }
+      FATAL("Unable to request new process from fork server (OOM?)");
+    }
 
-  if ((res = read(fsrv->fsrv_st_fd, &fsrv->child_pid, 4)) != 4) {
-    if (*stop_soon_p) { return 0; }
-    RPFATAL(res, "Unable to request new process from fork server (OOM?)");
+  } else {
+    if ((res = write(fsrv->fsrv_ctl_fd, &write_value, 4)) != 4) {
+      if (*stop_soon_p) { return 0; }
+      RPFATAL(res, "Unable to request new process from fork server (OOM?)");
+    }
+
+    fsrv->last_run_timed_out = 0;
+
+    if ((res = read(fsrv->fsrv_st_fd, &fsrv->child_pid, 4)) != 4) {
+      if (*stop_soon_p) { return 0; }
+      RPFATAL(res, "Unable to request new process from fork server (OOM?)");
+    }
   }
 
 #ifdef AFL_PERSISTENT_RECORD
@@ -1464,8 +2527,70 @@ afl_fsrv_run_target(afl_forkserver_t *fsrv, u32 timeout,
     FATAL("Fork server is misbehaving (OOM?)");
   }
 
-  exec_ms = read_s32_timed(fsrv->fsrv_st_fd, &fsrv->child_status, timeout,
-                           stop_soon_p);
+  if (unlikely(fsrv->latency)) {
+    fsrv->lat_pid = fsrv_lat_now();
+    fsrv_lat_add(fsrv->latency, FSRV_LAT_START, fsrv->lat_pid - fsrv->lat_go);
+  }
+
+  return 1;
+}
+
+/* Whether the exec started by afl_fsrv_run_start() is over, without waiting
+   for it: afl_fsrv_run_finish() then returns at once. */
+
+u8 afl_fsrv_run_done(afl_forkserver_t *fsrv) {
+  struct pollfd pfd;
+
+#ifdef __linux__
+  if (fsrv->use_doorbell) {
+    return __atomic_load_n(&fsrv->doorbell->st, __ATOMIC_ACQUIRE) !=
+           fsrv->doorbell_st;
+  }
+
+#endif
+
+  pfd.fd = fsrv->fsrv_st_fd;
+  pfd.events = POLLIN;
+  return poll(&pfd, 1, 0) > 0;
+}
+
+/* Wait for the exec started by afl_fsrv_run_start() and report its outcome,
+   killing the child after timeout ms. */
+
+fsrv_run_result_t __attribute__((hot))
+afl_fsrv_run_finish(afl_forkserver_t *fsrv, u32 timeout,
+                    volatile u8 *stop_soon_p) {
+  u32 exec_ms;
+  s32 res = 0;
+
+#ifdef __linux__
+  if (unlikely(fsrv->nyx_mode)) {
+    s32     ret_val;
+    ssize_t res;
+
+    while ((res = read(fsrv->fsrv_st_fd, &ret_val, 4)) < 0 && errno == EINTR) {
+      if (*stop_soon_p) { return 0; }
+    }
+
+    if (res != 4) {
+      if (*stop_soon_p) { return 0; }
+      FATAL("Lost the Nyx exec thread");
+    }
+
+    fsrv->total_execs++;
+    return nyx_result(ret_val, stop_soon_p);
+  }
+
+#endif
+
+  if (fsrv->use_doorbell) {
+    exec_ms = doorbell_read_timed(fsrv, &fsrv->doorbell->status,
+                                  &fsrv->child_status, timeout, stop_soon_p);
+
+  } else {
+    exec_ms = epoll_read_s32_timed(fsrv, &fsrv->child_status, timeout,
+                                   stop_soon_p);
+  }
 
   if (exec_ms > timeout) {
     /* If there was no response from forkserver after timeout seconds,
@@ -1478,7 +2603,15 @@ afl_fsrv_run_target(afl_forkserver_t *fsrv, u32 timeout,
     }
 
     fsrv->last_run_timed_out = 1;
-    if (read(fsrv->fsrv_st_fd, &fsrv->child_status, 4) < 4) { exec_ms = 0; }
+    if (fsrv->use_doorbell) {
+      if (!doorbell_read_timed(fsrv, &fsrv->doorbell->status,
+                               &fsrv->child_status, 0, stop_soon_p)) {
+        exec_ms = 0;
+      }
+
+    } else if ((res = read(fsrv->fsrv_st_fd, &fsrv->child_status, 4)) < 4) {
+      exec_ms = 0;
+    }
   }
 
   if (!exec_ms) {
@@ -1507,10 +2640,21 @@ afl_fsrv_run_target(afl_forkserver_t *fsrv, u32 timeout,
     RPFATAL(res, "Unable to communicate with fork server");
   }
 
+  fsrv->last_child_pid = fsrv->child_pid;
   if (!WIFSTOPPED(fsrv->child_status)) { fsrv->child_pid = -1; }
 
   fsrv->total_execs++;
 
+  /* the child loaded a module without buckets and switched to hit counts */
+  if (unlikely(fsrv->bucketed_counts) &&
+      !__atomic_load_n(&fsrv->doorbell->buckets, __ATOMIC_ACQUIRE)) {
+    afl_fsrv_buckets_off(fsrv);
+  }
+
+  if (unlikely(fsrv->latency) && !fsrv->last_run_timed_out) {
+    latency_record(fsrv);
+  }
+
   /* Any subsequent operations on fsrv->trace_bits must not be moved by the
      compiler below this point. Past this location, fsrv->trace_bits[]
      behave very normally and do not have to be treated as volatile. */
@@ -1530,6 +2674,13 @@ afl_fsrv_run_target(afl_forkserver_t *fsrv, u32 timeout,
     return FSRV_RUN_TMOUT;
   }
 
+  /* Or did the hang watchdog of the target stop it early? */
+  if (unlikely(fsrv->hang_watchdog && WIFSIGNALED(fsrv->child_status) &&
+               WTERMSIG(fsrv->child_status) == SIGVTALRM)) {
+    fsrv->last_kill_signal = SIGVTALRM;
+    return FSRV_RUN_TMOUT;
+  }
+
   /* Did we crash?
   In a normal case, (abort) WIFSIGNALED(child_status) will be set.
   MSAN in uses_asan mode uses a special exit code as it doesn't support
@@ -1581,11 +2732,168 @@ afl_fsrv_run_target(afl_forkserver_t *fsrv, u32 timeout,
   return FSRV_RUN_OK;
 }
 
+/* The maps have hit counts from now on, also after a restart: the target
+   switches before it forks its next child. */
+
+void afl_fsrv_buckets_off(afl_forkserver_t *fsrv) {
+  fsrv->bucketed_counts = false;
+  fsrv->buckets_lost = true;
+
+  if (fsrv->use_doorbell) {
+    __atomic_store_n(&fsrv->doorbell->buckets, 0, __ATOMIC_RELEASE);
+  }
+}
+
+/* Queue a testcase for the next batch (FS_OPT_BATCH). The first one goes to
+   the shared memory testcase, buf may already point there. Returns 0 if the
+   batch is full. */
+
+u32 afl_fsrv_batch_add(afl_forkserver_t *fsrv, u8 *buf, u32 len) {
+  struct fs_batch *b = fsrv->batch;
+  u32              i = fsrv->batch_cnt;
+
+  if (!i) {
+    if (buf != fsrv->shmem_fuzz) { memcpy(fsrv->shmem_fuzz, buf, len); }
+    *fsrv->shmem_fuzz_len = len;
+    fsrv->shmem_fuzz_diff.base = NULL;
+    b->len[0] = len;
+    fsrv->batch_cnt = 1;
+    fsrv->batch_data = 0;
+    return 1;
+  }
+
+  if (i >= FS_BATCH_MAX || len > FS_BATCH_DATA - fsrv->batch_data) {
+    return 0;
+  }
+
+  b->off[i] = fsrv->batch_data;
+  b->len[i] = len;
+  memcpy(b->data + fsrv->batch_data, buf, len);
+  fsrv->batch_data += len;
+  fsrv->batch_cnt = i + 1;
+  return 1;
+}
+
+/* Run the queued batch with a timeout of timeout ms per testcase. Afterwards
+   batch_done holds how many testcases were executed, all but the last of them
+   ran fine and the result returned is that of the last one. Their coverage
+   maps can be fetched with afl_fsrv_batch_trace(). The target times all
+   testcases but the last, which gets what is left of timeout * count. */
+
+fsrv_run_result_t afl_fsrv_run_batch(afl_forkserver_t *fsrv, u32 timeout,
+                                     volatile u8 *stop_soon_p) {
+  struct fs_batch  *b = fsrv->batch;
+  fsrv_run_result_t res;
+  u32               words = fsrv->map_size >> 2, i;
+  u32              *map = (u32 *)fsrv->trace_bits;
+
+  b->count = fsrv->batch_cnt;
+  b->done = 0;
+  b->deltas = 0;
+  MEM_BARRIER();
+
+  res = afl_fsrv_run_target(fsrv, timeout * fsrv->batch_cnt, stop_soon_p);
+
+  b->count = 0;
+  if (unlikely(b->done >= fsrv->batch_cnt)) { b->done = 0; }
+  fsrv->batch_done = b->done + 1;
+  fsrv->batch_cnt = 0;
+  fsrv->total_execs += b->done;
+
+  /* a testcase that took longer than timeout would have been killed, so it
+     ends the batch as a timeout */
+
+  for (i = 0; i < b->done; ++i) {
+    if (unlikely(b->us[i] > (u64)timeout * 1000)) {
+      fsrv->batch_done = i + 1;
+      fsrv->last_kill_signal = fsrv->child_kill_signal;
+      return FSRV_RUN_TMOUT;
+    }
+  }
+
+  /* the target leaves room to keep the last map as deltas as well. With
+     dirty line tracking the target reset the flags of the testcases before,
+     so only the lines of the last one are flagged. */
+
+  if (fsrv->use_dirty_lines) {
+    u8 *dirty = fsrv->dirty_lines;
+    u32 lines = DIRTY_LINES_SIZE(fsrv->map_size), l, end;
+
+    for (l = 0; l < lines; ++l) {
+      if (!(l & 7) && l + 8 <= lines && !*(u64 *)(dirty + l)) {
+        l += 7;
+        continue;
+      }
+
+      if (!dirty[l]) { continue; }
+
+      i = l << (DIRTY_LINE_SHIFT - 2);
+      end = MIN(i + (1U << (DIRTY_LINE_SHIFT - 2)), words);
+
+      for (; i < end; ++i) {
+        if (map[i]) {
+          b->delta[b->deltas].idx = i;
+          b->delta[b->deltas].val = map[i];
+          ++b->deltas;
+        }
+      }
+    }
+
+  } else {
+    for (i = 0; i < words; ++i) {
+      if (map[i]) {
+        b->delta[b->deltas].idx = i;
+        b->delta[b->deltas].val = map[i];
+        ++b->deltas;
+      }
+    }
+  }
+
+  b->delta_end[b->done] = b->deltas;
+
+  return res;
+}
+
+/* Load the coverage map of testcase idx of the last batch into trace_bits.
+   With dirty line tracking the lines it touched are flagged, as if it had
+   just run on its own. */
+
+void afl_fsrv_batch_trace(afl_forkserver_t *fsrv, u32 idx) {
+  struct fs_batch *b = fsrv->batch;
+  u32              i = idx ? b->delta_end[idx - 1] : 0;
+  u32             *map = (u32 *)fsrv->trace_bits;
+
+  /* the target's verdict is that of the last testcase only */
+  if (fsrv->virgin) { fsrv->virgin->verdict = FS_VIRGIN_UNKNOWN; }
+
+  if (fsrv->use_dirty_lines) {
+    reset_trace_bits(fsrv);
+
+    for (; i < b->delta_end[idx]; ++i) {
+      map[b->delta[i].idx] = b->delta[i].val;
+      fsrv->dirty_lines[(b->delta[i].idx << 2) >> DIRTY_LINE_SHIFT] = 1;
+    }
+
+    return;
+  }
+
+  memset(fsrv->trace_bits, 0, fsrv->map_size);
+
+  for (; i < b->delta_end[idx]; ++i) {
+    map[b->delta[i].idx] = b->delta[i].val;
+  }
+}
+
 void afl_fsrv_killall() {
   LIST_FOREACH(&fsrv_list, afl_forkserver_t, { afl_fsrv_kill(el); });
 }
 
 void afl_fsrv_deinit(afl_forkserver_t *fsrv) {
   afl_fsrv_kill(fsrv);
+  epoll_close(fsrv);
   list_remove(&fsrv_list, fsrv);
+
+  ck_free(fsrv->touched_lines);
+  fsrv->touched_lines = NULL;
+  fsrv->touched_words = 0;
 }
@@ -24,11 +24,57 @@
  */
 
 #include "afl-fuzz.h"
+#include "fsvirgin.h"
 #include <limits.h>
 #if !defined NAME_MAX
   #define NAME_MAX _XOPEN_NAME_MAX
 #endif
 
+/* The first line at or after l, below lines, whose bit in the packed line
+   map bits is set, or clear with flip ~0ULL. lines if there is none. */
+
+static inline u32 next_line_bit(u64 *bits, u32 l, u32 lines, u64 flip) {
+  while (l < lines) {
+    u64 w = (bits[l >> 6] ^ flip) & (~0ULL << (l & 63));
+
+    if (w) { return MIN((l & ~63U) + __builtin_ctzll(w), lines); }
+
+    l = (l | 63) + 1;
+  }
+
+  return lines;
+}
+
+/* With dirty line tracking (AFL_LLVM_DIRTY_LINES) only the map cache lines
+   marked in fsrv->dirty_lines can be non-zero. Finds the next run of dirty
+   lines at or after *line and returns it as *start and a count of map words
+   of word_size bytes, clamped to the first words map words. Returns 0 when
+   no dirty line is left. The lines are looked up in the packed bits of
+   afl_fsrv_pack_dirty(), 64 at a time. */
+
+static inline u32 next_dirty_run(afl_forkserver_t *fsrv, u32 *line, u32 *start,
+                                 u32 words, u32 word_size) {
+  u32 per_line = (1U << DIRTY_LINE_SHIFT) / word_size;
+  u32 lines = (words + per_line - 1) / per_line;
+  u32 l, e;
+
+  if (unlikely(!fsrv->touched_valid)) { afl_fsrv_pack_dirty(fsrv); }
+
+  l = next_line_bit(fsrv->touched_lines, *line, lines, 0);
+
+  if (l >= lines) {
+    *line = l;
+    return 0;
+  }
+
+  e = next_line_bit(fsrv->touched_lines, l + 1, lines, ~0ULL);
+
+  *line = e;
+  *start = l * per_line;
+
+  return MIN(e * per_line, words) - *start;
+}
+
 /* Write bitmap to file. The bitmap is useful mostly for the secret
    -B option, to focus a separate fuzzing session on a particular
    interesting input without rediscovering all the others. */
@@ -48,6 +94,79 @@ void write_bitmap(afl_state_t *afl) {
   ck_write(fd, afl->virgin_bits, afl->fsrv.map_size, fname);
 
   close(fd);
+
+  if (!afl->sync_target) { return; }
+
+  /* the coverage state is renamed into place, -B of a new instance may be
+     reading it right now */
+
+  struct coverage_state_hdr hdr = {COVERAGE_STATE_MAGIC, afl->fsrv.map_size,
+                                   afl->sync_target};
+  u8                        tmp[PATH_MAX];
+
+  snprintf(fname, PATH_MAX, "%s/coverage_state", afl->out_dir);
+  snprintf(tmp, PATH_MAX, "%s/.coverage_state.tmp", afl->out_dir);
+  fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, DEFAULT_PERMISSION);
+
+  if (fd < 0) { PFATAL("Unable to open '%s'", tmp); }
+
+  ck_write(fd, &hdr, sizeof(hdr), tmp);
+  ck_write(fd, afl->virgin_bits, afl->fsrv.map_size, tmp);
+  ck_write(fd, afl->virgin_tmout, afl->fsrv.map_size, tmp);
+  ck_write(fd, afl->virgin_crash, afl->fsrv.map_size, tmp);
+
+  close(fd);
+
+  if (rename(tmp, fname)) { PFATAL("Unable to rename '%s'", tmp); }
+}
+
+/* Set the virgin maps from the -B file: a map as write_bitmap() leaves in
+   fuzz_bitmap, or the coverage_state of an instance fuzzing the same target.
+   The calibration index of that instance is then read by the dry run like
+   the one of a resumed session. */
+
+void load_bitmap(afl_state_t *afl) {
+  struct coverage_state_hdr hdr;
+  struct stat               st;
+  u32                       map_size = afl->fsrv.map_size;
+  u8                       *fn = afl->in_bitmap, *slash;
+  s32                       fd = open(fn, O_RDONLY);
+
+  if (fd < 0 || fstat(fd, &st)) { PFATAL("Unable to open '%s'", fn); }
+
+  if (st.st_size < (off_t)sizeof(hdr) ||
+      read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+      hdr.magic != COVERAGE_STATE_MAGIC) {
+    close(fd);
+    read_bitmap(fn, afl->virgin_bits, map_size);
+    return;
+  }
+
+  if (hdr.map_size != map_size || !afl->sync_target ||
+      hdr.target != afl->sync_target ||
+      st.st_size != (off_t)(sizeof(hdr) + (u64)map_size * 3)) {
+    WARNF("'%s' is the coverage of another build of the target, ignoring it.",
+          fn);
+    close(fd);
+    return;
+  }
+
+  ck_read(fd, afl->virgin_bits, map_size, fn);
+  ck_read(fd, afl->virgin_tmout, map_size, fn);
+  ck_read(fd, afl->virgin_crash, map_size, fn);
+  close(fd);
+
+  OKF("Imported the coverage state of '%s', %u map bytes are covered.", fn,
+      count_non_255_bytes(afl, afl->virgin_bits));
+
+  if (afl->cal_index_old_fd < 0) {
+    slash = strrchr(fn, '/');
+    fn = slash ? alloc_printf("%.*s/queue/.state/calibration",
+                              (int)(slash - afl->in_bitmap), afl->in_bitmap)
+               : ck_strdup("queue/.state/calibration");
+    afl->cal_index_old_fd = open(fn, O_RDONLY);
+    ck_free(fn);
+  }
 }
 
 /* Count the number of bits set in the provided bitmap. Used for the status
@@ -77,14 +196,10 @@ u32 count_bits(afl_state_t *afl, u8 *mem) {
   return ret;
 }
 
-/* Count the number of bytes set in the bitmap. Called fairly sporadically,
-   mostly to update the status screen or calibrate and examine confirmed
-   new paths. */
+/* The bytes set in i words of a map, for count_bytes(). */
 
-u32 count_bytes(afl_state_t *afl, u8 *mem) {
-  u32 *ptr = (u32 *)mem;
-  u32  i = ((afl->fsrv.real_map_size + 3) >> 2);
-  u32  ret = 0;
+static inline u32 count_bytes_words(u32 *ptr, u32 i) {
+  u32 ret = 0;
 
   while (i--) {
     u32 v = *(ptr++);
@@ -99,6 +214,19 @@ u32 count_bytes(afl_state_t *afl, u8 *mem) {
   return ret;
 }
 
+/* Count the bytes set in the focus set of AFL_PC_FILTER_FOCUS, the part of
+   the map the target gave the guards its filters select. */
+
+u32 count_focus_bytes(afl_state_t *afl, u8 *mem) {
+  u32 i, ret = 0;
+
+  for (i = afl->fsrv.focus_start; i < afl->fsrv.focus_end; ++i) {
+    if (mem[i]) { ++ret; }
+  }
+
+  return ret;
+}
+
 /* Count the number of non-255 bytes set in the bitmap. Used strictly for the
    status screen, several calls per second or so. */
 
@@ -123,6 +251,63 @@ u32 count_non_255_bytes(afl_state_t *afl, u8 *mem) {
   return ret;
 }
 
+/* Checksum of the path of a run, over its classified trace map: the sum of
+   hash64() over the non-zero lines of 1 << DIRTY_LINE_SHIFT bytes, each
+   seeded with its index. Zero lines add nothing and the order of the lines
+   does not matter, so with dirty line tracking only the dirty lines are
+   hashed and the result is the same as over the whole map. */
+
+static inline u64 hash_line(u8 *line, u32 len, u32 idx) {
+  u32 i;
+
+  if (likely(len == 1U << DIRTY_LINE_SHIFT)) {
+    u64 *w = (u64 *)line, v = 0;
+
+    for (i = 0; i < len / sizeof(u64); ++i) {
+      v |= w[i];
+    }
+
+    if (!v) { return 0; }
+
+  } else {
+    for (i = 0; i < len && !line[i]; ++i) {}
+
+    if (i == len) { return 0; }
+  }
+
+  return hash64(line, len, HASH_CONST ^ idx);
+}
+
+u64 hash_trace(u8 *trace, u32 len) {
+  u32 step = 1U << DIRTY_LINE_SHIFT, off;
+  u64 cksum = HASH_CONST;
+
+  for (off = 0; off < len; off += step) {
+    cksum += hash_line(trace + off, MIN(step, len - off),
+                       off >> DIRTY_LINE_SHIFT);
+  }
+
+  return cksum;
+}
+
+u64 hash_trace_bits(afl_forkserver_t *fsrv) {
+  u32 step = 1U << DIRTY_LINE_SHIFT, line = 0, start, cnt, off;
+  u64 cksum = HASH_CONST;
+
+  if (!fsrv->use_dirty_lines) {
+    return hash_trace(fsrv->trace_bits, fsrv->map_size);
+  }
+
+  while ((cnt = next_dirty_run(fsrv, &line, &start, fsrv->map_size, 1))) {
+    for (off = start; off < start + cnt; off += step) {
+      cksum += hash_line(fsrv->trace_bits + off, MIN(step, start + cnt - off),
+                         off >> DIRTY_LINE_SHIFT);
+    }
+  }
+
+  return cksum;
+}
+
 /* Destructively simplify trace by eliminating hit count information
    and replacing it with 0x80 or 0x01 depending on whether the tuple
    is hit or not. Called on every new crash or timeout, should be
@@ -172,6 +357,32 @@ void init_count_class16(void) {
   #include "coverage-32.h"
 #endif
 
+/* Count the number of bytes set in the bitmap. Called fairly sporadically,
+   mostly to update the status screen or calibrate and examine confirmed
+   new paths. */
+
+u32 count_bytes(afl_state_t *afl, u8 *mem) {
+  u32 *ptr = (u32 *)mem;
+  u32  i = ((afl->fsrv.real_map_size + 3) >> 2);
+  u32  ret = 0;
+
+  if (afl->fsrv.use_dirty_lines && mem == afl->fsrv.trace_bits) {
+    u32 line = 0, start, cnt;
+
+    while ((cnt = next_dirty_run(&afl->fsrv, &line, &start, i, sizeof(u32)))) {
+      ret += count_bytes_words(ptr + start, cnt);
+    }
+
+    return ret;
+  }
+
+  if (map_kernels.size == afl->fsrv.real_map_size) {
+    return map_kernels.count(ptr);
+  }
+
+  return count_bytes_words(ptr, i);
+}
+
 /* Check if the current execution path brings anything new to the table.
    Update virgin bits to reflect the finds. Returns 1 if the only change is
    the hit-count for a particular tuple; 2 if there are new tuples seen.
@@ -198,11 +409,31 @@ inline u8 has_new_bits(afl_state_t *afl, u8 *virgin_map) {
 #endif /* ^WORD_SIZE_64 */
 
   u8 ret = 0;
-  while (i--) {
-    if (unlikely(*current)) discover_word(&ret, current, virgin);
 
-    current++;
-    virgin++;
+  if (afl->fsrv.use_dirty_lines) {
+    u32 line = 0, start, cnt;
+
+    while ((cnt = next_dirty_run(&afl->fsrv, &line, &start, i,
+                                 sizeof(*current)))) {
+      while (cnt--) {
+        if (unlikely(current[start])) {
+          discover_word(&ret, current + start, virgin + start);
+        }
+
+        ++start;
+      }
+    }
+
+  } else if (map_kernels.size == afl->fsrv.real_map_size) {
+    ret = map_kernels.discover(current, virgin);
+
+  } else {
+    while (i--) {
+      if (unlikely(*current)) discover_word(&ret, current, virgin);
+
+      current++;
+      virgin++;
+    }
   }
 
   if (unlikely(ret) && likely(virgin_map == afl->virgin_bits))
@@ -211,6 +442,59 @@ inline u8 has_new_bits(afl_state_t *afl, u8 *virgin_map) {
   return ret;
 }
 
+/* has_new_bits() for a map of AFL_SHARED_VIRGIN, which the other instances
+   update at the same time: bits are cleared with an atomic and, and the
+   return value goes by what they were before. The trace has to be
+   classified already. */
+
+u8 has_new_bits_shared(afl_state_t *afl, u8 *virgin_map) {
+#ifdef WORD_SIZE_64
+
+  u64 *current = (u64 *)afl->fsrv.trace_bits;
+  u64 *virgin = (u64 *)virgin_map;
+  u64  old;
+
+  u32 i = ((afl->fsrv.real_map_size + 7) >> 3);
+
+#else
+
+  u32 *current = (u32 *)afl->fsrv.trace_bits;
+  u32 *virgin = (u32 *)virgin_map;
+  u32  old;
+
+  u32 i = ((afl->fsrv.real_map_size + 3) >> 2);
+
+#endif /* ^WORD_SIZE_64 */
+
+  u32 line = 0, start = 0, cnt = i;
+  u8  ret = 0;
+
+  /* without dirty lines the whole map is one run */
+
+  if (afl->fsrv.use_dirty_lines) {
+    cnt = next_dirty_run(&afl->fsrv, &line, &start, i, sizeof(*current));
+  }
+
+  while (cnt) {
+    for (; cnt; --cnt, ++start) {
+      if (likely(!(current[start] &
+                   __atomic_load_n(virgin + start, __ATOMIC_RELAXED)))) {
+        continue;
+      }
+
+      old = __atomic_fetch_and(virgin + start, ~current[start],
+                               __ATOMIC_RELAXED);
+      discover_word(&ret, current + start, &old);
+    }
+
+    if (afl->fsrv.use_dirty_lines) {
+      cnt = next_dirty_run(&afl->fsrv, &line, &start, i, sizeof(*current));
+    }
+  }
+
+  return ret;
+}
+
 /* A combination of classify_counts and has_new_bits. If 0 is returned, then the
  * trace bits are kept as-is. Otherwise, the trace bits are overwritten with
  * classified values.
@@ -222,24 +506,103 @@ inline u8 has_new_bits(afl_state_t *afl, u8 *virgin_map) {
  * return has_new_bits(). */
 
 inline u8 has_new_bits_unclassified(afl_state_t *afl, u8 *virgin_map) {
+  if (afl->fsrv.bucketed_counts) { return has_new_bits(afl, virgin_map); }
+
   /* Handle the hot path first: no new coverage */
   u8 *end = afl->fsrv.trace_bits + afl->fsrv.map_size;
 
 #ifdef WORD_SIZE_64
 
-  if (!skim((u64 *)virgin_map, (u64 *)afl->fsrv.trace_bits, (u64 *)end))
-    return 0;
+  u64 *current = (u64 *)afl->fsrv.trace_bits;
+  u64 *virgin = (u64 *)virgin_map;
 
 #else
 
-  if (!skim((u32 *)virgin_map, (u32 *)afl->fsrv.trace_bits, (u32 *)end))
-    return 0;
+  u32 *current = (u32 *)afl->fsrv.trace_bits;
+  u32 *virgin = (u32 *)virgin_map;
 
 #endif /* ^WORD_SIZE_64 */
+
+  if (afl->fsrv.use_dirty_lines) {
+    u32 line = 0, start, cnt, found = 0;
+    u32 words = afl->fsrv.map_size / sizeof(*current);
+
+    while (!found && (cnt = next_dirty_run(&afl->fsrv, &line, &start, words,
+                                           sizeof(*current)))) {
+      found = skim(virgin + start, current + start, current + start + cnt);
+    }
+
+    if (!found) return 0;
+
+  } else if (!skim(virgin, current, (void *)end)) {
+    return 0;
+  }
+
   classify_counts(&afl->fsrv);
   return has_new_bits(afl, virgin_map);
 }
 
+/* classify_counts() and has_new_bits() fused into a single pass over the
+   trace map. Use this when the map has to be classified anyway, e.g. because
+   it gets hashed afterwards. A cheap summary of the classified map is stored
+   in *summary, see classify_discover(). */
+
+u8 classify_has_new_bits(afl_state_t *afl, u8 *virgin_map, u64 *summary) {
+#ifdef WORD_SIZE_64
+
+  u64 *current = (u64 *)afl->fsrv.trace_bits;
+  u64 *virgin = (u64 *)virgin_map;
+  u32  words = ((afl->fsrv.real_map_size + 7) >> 3);
+  u32  total = (afl->fsrv.map_size >> 3);
+
+#else
+
+  u32 *current = (u32 *)afl->fsrv.trace_bits;
+  u32 *virgin = (u32 *)virgin_map;
+  u32  words = ((afl->fsrv.real_map_size + 3) >> 2);
+  u32  total = (afl->fsrv.map_size >> 2);
+
+#endif /* ^WORD_SIZE_64 */
+
+  u8 ret = 0, bucketed = afl->fsrv.bucketed_counts;
+
+  *summary = 0;
+
+  if (afl->fsrv.use_dirty_lines) {
+    u32 line = 0, start, cnt;
+
+    while ((cnt = next_dirty_run(&afl->fsrv, &line, &start, words,
+                                 sizeof(*current)))) {
+      u8 tmp = (bucketed ? discover_summary : classify_discover)(
+          current + start, virgin + start, cnt, start, summary);
+      if (tmp > ret) { ret = tmp; }
+    }
+
+  } else if (bucketed) {
+    ret = discover_summary(current, virgin, words, 0, summary);
+
+  } else if (map_kernels.size == afl->fsrv.real_map_size) {
+    ret = map_kernels.classify_discover(current, virgin, summary);
+
+  } else {
+    ret = classify_discover(current, virgin, words, 0, summary);
+  }
+
+  /* Classify the alignment padding behind real_map_size as well. */
+
+  for (; words < total; ++words) {
+    if (unlikely(current[words])) {
+      if (!bucketed) { current[words] = classify_word(current[words]); }
+      *summary += summary_word(current[words], words);
+    }
+  }
+
+  if (unlikely(ret) && likely(virgin_map == afl->virgin_bits))
+    afl->bitmap_changed = 1;
+
+  return ret;
+}
+
 /* Compact trace bytes into a smaller bitmap. We effectively just drop the
    count information here. This is called only sporadically, for some
    new paths. */
@@ -253,6 +616,86 @@ void minimize_bits(afl_state_t *afl, u8 *dst, u8 *src) {
   }
 }
 
+/* Resizes the maps of the state that follow the map size. */
+
+void grow_maps(afl_state_t *afl, u32 old_map_size, u32 new_map_size) {
+  afl->virgin_bits = ck_realloc(afl->virgin_bits, new_map_size);
+  afl->virgin_tmout = ck_realloc(afl->virgin_tmout, new_map_size);
+  afl->virgin_crash = ck_realloc(afl->virgin_crash, new_map_size);
+  afl->var_bytes = ck_realloc(afl->var_bytes, new_map_size);
+  afl->top_rated = ck_realloc(afl->top_rated, new_map_size * sizeof(void *));
+  afl->clean_trace = ck_realloc(afl->clean_trace, new_map_size);
+  afl->clean_trace_custom = ck_realloc(afl->clean_trace_custom, new_map_size);
+  afl->first_trace = ck_realloc(afl->first_trace, new_map_size);
+  afl->map_tmp_buf = ck_realloc(afl->map_tmp_buf, new_map_size);
+
+  if (old_map_size < new_map_size) {
+    memset(afl->var_bytes + old_map_size, 0, new_map_size - old_map_size);
+    memset(afl->top_rated + old_map_size, 0,
+           (new_map_size - old_map_size) * sizeof(void *));
+    memset(afl->clean_trace + old_map_size, 0, new_map_size - old_map_size);
+    memset(afl->clean_trace_custom + old_map_size, 0,
+           new_map_size - old_map_size);
+    memset(afl->first_trace + old_map_size, 0, new_map_size - old_map_size);
+    memset(afl->map_tmp_buf + old_map_size, 0, new_map_size - old_map_size);
+  }
+}
+
+/* AFL_MAP_SIZE_MAX: a child loaded an instrumented library after the
+   forkserver was up and numbered its guards behind the others, up to size.
+   Its coverage is in the shared map already, which has room for it, so the
+   maps of the state grow in place: the new bytes are virgin and without a
+   top_rated entry, the trace_minis get the new bits as zeroes, and the
+   greedy pass of cull_queue() resumes at the old end. The forkserver keeps
+   the size across restarts. */
+
+void map_grow(afl_state_t *afl, u32 size) {
+  u32 old = afl->fsrv.map_size, new;
+
+  size = MIN(size, afl->fsrv.map_cap);
+  new = (size + 63) & ~63U;
+
+  if (afl->cmplog_binary && afl->cmplog_fsrv.real_map_size < size) {
+    afl->cmplog_fsrv.real_map_size = afl->cmplog_fsrv.map_grown = size;
+    afl->cmplog_fsrv.map_size = MAX(afl->cmplog_fsrv.map_size, new);
+  }
+
+  if (size <= afl->fsrv.real_map_size) { return; }
+
+  if (new > old) {
+    grow_maps(afl, old, new);
+    memset(afl->virgin_bits + old, 255, new - old);
+    memset(afl->virgin_tmout + old, 255, new - old);
+    memset(afl->virgin_crash + old, 255, new - old);
+
+    if (afl->cull_cover) {
+      afl->cull_cover = ck_realloc(afl->cull_cover, new * sizeof(u32));
+      memset(afl->cull_cover + old, 0, (new - old) * sizeof(u32));
+    }
+
+    if (afl->skipdet_g->virgin_det_bits) {
+      afl->skipdet_g->virgin_det_bits =
+          ck_realloc(afl->skipdet_g->virgin_det_bits, new);
+      memset(afl->skipdet_g->virgin_det_bits + old, 0, new - old);
+    }
+  }
+
+  afl->fsrv.map_size = new;
+  afl->fsrv.real_map_size = afl->fsrv.map_grown = size;
+  afl->cull_from = MIN(afl->cull_from, old);
+  resize_trace_mini_arena(afl);
+  select_map_kernels(afl);
+
+  /* the last run is classified with the new size, its dirty lines are
+     packed again */
+
+  afl->fsrv.touched_valid = false;
+
+  if (afl->afl_env.afl_no_ui) {
+    OKF("A library loaded late grew the map to %u bytes.", size);
+  }
+}
+
 #ifndef SIMPLE_FILES
 
 /* Construct a file name for a new test case, capturing the operation
@@ -273,6 +716,12 @@ u8 *describe_op(afl_state_t *afl, u8 new_bits, size_t max_description_len) {
   if (unlikely(afl->syncing_party)) {
     sprintf(ret, "sync:%s,src:%06u", afl->syncing_party, afl->syncing_case);
 
+  } else if (unlikely(afl->seed_ref)) {
+    snprintf(ret, real_max_len - strlen(",+tout,+cov"),
+             "time:%llu,execs:%llu,orig:%s",
+             get_cur_time() + afl->prev_run_time - afl->start_time,
+             afl->fsrv.total_execs, strrchr(afl->seed_ref, '/') + 1);
+
   } else {
     sprintf(ret, "src:%06u", afl->current_entry);
 
@@ -392,6 +841,163 @@ void write_crash_readme(afl_state_t *afl) {
   fclose(f);
 }
 
+/* Bloom filter over the map summaries of queued paths, two probes taken from
+   the two halves of the summary. */
+
+static inline u8 path_bloom_check(afl_state_t *afl, u64 summary) {
+  u32 mask = (1U << PATH_BLOOM_POW2) - 1;
+  u32 a = (u32)summary & mask, b = (u32)(summary >> 32) & mask;
+
+  return (afl->path_bloom[a >> 3] & (1 << (a & 7))) &&
+         (afl->path_bloom[b >> 3] & (1 << (b & 7)));
+}
+
+static inline void path_bloom_add(afl_state_t *afl, u64 summary) {
+  u32 mask = (1U << PATH_BLOOM_POW2) - 1;
+  u32 a = (u32)summary & mask, b = (u32)(summary >> 32) & mask;
+
+  afl->path_bloom[a >> 3] |= 1 << (a & 7);
+  afl->path_bloom[b >> 3] |= 1 << (b & 7);
+}
+
+/* With AFL_SHARED_VIRGIN, new bits of a run in virgin_host, or in
+   virgin_bits when syncing, go into the map of the host as well. An own
+   find only counts if no instance had it yet: otherwise it is left to be
+   synced from there, and virgin_bits stays as is so that it is imported.
+   The trace is classified. */
+
+static u8 shared_virgin_merge(afl_state_t *afl, u8 new_bits) {
+  u8 ret =
+      has_new_bits_shared(afl, SHARED_VIRGIN_MAP(afl, SHARED_VIRGIN_BITS));
+
+  if (afl->syncing_party) {
+    has_new_bits(afl, afl->virgin_host);
+    return new_bits;
+  }
+
+  if (!ret) {
+    ++afl->shared_skipped;
+    return 0;
+  }
+
+  has_new_bits(afl, afl->virgin_bits);
+  return ret;
+}
+
+/* has_new_bits() for the hang and crash maps, which are those of the host
+   with AFL_SHARED_VIRGIN. */
+
+static inline u8 has_new_fault_bits(afl_state_t *afl, u8 *virgin_map,
+                                    u32 which) {
+  if (unlikely(afl->shared_virgin)) {
+    return has_new_bits_shared(afl, SHARED_VIRGIN_MAP(afl, which));
+  }
+
+  return has_new_bits(afl, virgin_map);
+}
+
+/* Add sig to the set of slots slots, which other instances may share.
+   Returns 0 if it was there already. */
+
+static u8 sig_set_add(u64 *set, u32 slots, u64 sig) {
+  u64 cur;
+  u32 mask = slots - 1, i, n;
+
+  if (unlikely(!sig)) { sig = 1; }
+
+  for (i = sig & mask, n = 0; n < slots; i = (i + 1) & mask, ++n) {
+    cur = __atomic_load_n(set + i, __ATOMIC_RELAXED);
+
+    /* a failed swap leaves what another instance put there in cur */
+
+    if (!cur && __atomic_compare_exchange_n(set + i, &cur, sig, 0,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+      return 1;
+    }
+
+    if (cur == sig) { return 0; }
+  }
+
+  /* the set is full, keep what we get */
+
+  return 1;
+}
+
+/* With AFL_CRASH_DEDUP, add the signature of the crash or hang to the set
+   of the sync directory. Returns 0 if an instance had saved it already.
+   afl-fuzz sees no stack traces, so the signature is the checksum of the
+   simplified trace. */
+
+static u8 crash_sig_add(afl_state_t *afl, u64 sig) {
+  if (sig_set_add(afl->crash_sigs, CRASH_SIGS_SLOTS, sig)) { return 1; }
+
+  ++afl->crash_dups;
+  return 0;
+}
+
+/* Give the target the current virgin_bits (AFL_TARGET_NOVELTY). Until it
+   has them, or if the map outgrew the copy, it does not call a run boring. */
+
+void target_novelty_sync(afl_state_t *afl) {
+  struct fs_virgin *v = afl->fsrv.virgin;
+
+  if (likely(!v)) { return; }
+
+  if (unlikely(afl->fsrv.map_size > v->size)) {
+    v->map_size = 0;
+    return;
+  }
+
+  memcpy(v->map, afl->virgin_bits, afl->fsrv.map_size);
+  MEM_BARRIER();
+  v->map_size = afl->fsrv.map_size;
+}
+
+/* Mark map byte i as variable. A variable byte is ignored by has_new_bits()
+   from then on by setting it to fully discovered, in virgin_bits and, with
+   AFL_SHARED_VIRGIN, in the maps own finds are first checked against: it
+   would otherwise be new to the host time and again and go to calibration
+   for nothing. The target's copy is refreshed by target_novelty_sync(). */
+
+void var_byte_ignore(afl_state_t *afl, u32 i) {
+  afl->var_bytes[i] = 1;
+  afl->virgin_bits[i] = 0;
+
+  if (unlikely(afl->virgin_host)) { afl->virgin_host[i] = 0; }
+
+  if (unlikely(afl->shared_virgin)) {
+    u64 *word = (u64 *)SHARED_VIRGIN_MAP(afl, SHARED_VIRGIN_BITS) + (i >> 3);
+
+    __atomic_fetch_and(word, ~(0xffULL << ((i & 7) << 3)), __ATOMIC_RELAXED);
+  }
+}
+
+/* AFL_LARGE_INPUTS: during fuzz_one(), mem may be the window of a large
+   input, see large_window(). What is kept is the whole input, put together
+   here from the mapping of the entry, once for a find. */
+
+static u8 *large_input(afl_state_t *afl, u8 *mem, u32 *len) {
+  struct fs_patch *p = &afl->large;
+  u32              win = *len, tail;
+  u8              *buf;
+
+  if (likely(!p->file) || mem == afl->large_buf) { return mem; }
+
+  if (unlikely(win > p->max - p->off)) { win = p->max - p->off; }
+  tail = fs_patch_tail(p, win);
+  *len = p->off + win + tail;
+
+  buf = afl_realloc(AFL_BUF_PARAM(large), *len);
+  if (unlikely(!buf)) { PFATAL("alloc"); }
+
+  memcpy(buf, p->file, p->off);
+  memcpy(buf + p->off, mem, win);
+  memcpy(buf + p->off + win, p->file + p->off + p->cut, tail);
+
+  return buf;
+}
+
 /* Check if the result of an execve() during routine fuzzing is interesting,
    save or queue the input test case for further analysis if so. Returns 1 if
    entry is saved, 0 otherwise. */
@@ -403,53 +1009,95 @@ save_if_interesting(afl_state_t *afl, void *mem, u32 len, u8 fault) {
   if (unlikely(fault == FSRV_RUN_TMOUT && afl->afl_env.afl_ignore_timeouts)) {
     if (likely(afl->schedule >= FAST && afl->schedule <= RARE)) {
       classify_counts(&afl->fsrv);
-      u64 cksum = hash64(afl->fsrv.trace_bits, afl->fsrv.map_size, HASH_CONST);
+      u64 cksum = hash_trace_bits(&afl->fsrv);
 
-      // Saturated increment
-      if (likely(afl->n_fuzz[cksum % N_FUZZ_SIZE] < 0xFFFFFFFF))
-        afl->n_fuzz[cksum % N_FUZZ_SIZE]++;
+      n_fuzz_hit(afl, cksum);
     }
 
     return 0;
   }
 
+  /* the map as the target was killed, before it is classified */
+
+  if (unlikely(fault == FSRV_RUN_TMOUT && afl->hang_check) &&
+      afl->saved_hangs < KEEP_UNIQUE_HANG) {
+    memcpy(afl->hang_check->trace, afl->fsrv.trace_bits, afl->fsrv.map_size);
+  }
+
   u8  fn[PATH_MAX];
   u8 *queue_fn = "";
   u8 *store_fn = "";
   u8  new_bits = 0, keeping = 0, res, classified = 0, is_timeout = 0,
-     need_hash = 1;
+     need_hash = 1, discovered = 0, hang_async;
   s32 fd;
-  u64 cksum = 0;
+  u64 cksum = 0, summary = 0;
+  u8 *virgin = afl->virgin_bits;
+
+  /* Own finds are first checked against what we know the other instances
+     of the host have, see shared_virgin_merge(). */
+
+  if (unlikely(afl->shared_virgin) && !afl->syncing_party) {
+    virgin = afl->virgin_host;
+  }
 
   /* Update path frequency. */
 
   /* Generating a hash on every input is super expensive. Bad idea and should
      only be used for special schedules */
   if (likely(afl->schedule >= FAST && afl->schedule <= RARE)) {
-    classify_counts(&afl->fsrv);
+    if (likely(fault == afl->crash_mode)) {
+      /* The trace is classified for hashing anyway, so merge it into the
+         virgin map in the same pass. */
+      new_bits = classify_has_new_bits(afl, virgin, &summary);
+      discovered = 1;
+
+    } else {
+      classify_counts(&afl->fsrv);
+    }
+
     classified = 1;
     need_hash = 0;
 
-    cksum = hash64(afl->fsrv.trace_bits, afl->fsrv.map_size, HASH_CONST);
+    /* Only the frequencies of queued paths are ever read. A path without new
+       bits whose summary is not in the bloom filter cannot be one of them,
+       so the full hash is not needed. */
+    if (unlikely(!discovered || new_bits || path_bloom_check(afl, summary))) {
+      cksum = hash_trace_bits(&afl->fsrv);
 
-    /* Saturated increment */
-    if (likely(afl->n_fuzz[cksum % N_FUZZ_SIZE] < 0xFFFFFFFF))
-      afl->n_fuzz[cksum % N_FUZZ_SIZE]++;
+      n_fuzz_hit(afl, cksum);
+    }
   }
 
   if (likely(fault == afl->crash_mode)) {
     /* Keep only if there are new bits in the map, add to queue for
        future fuzzing, etc. */
 
-    if (likely(classified)) {
-      new_bits = has_new_bits(afl, afl->virgin_bits);
+    if (unlikely(discovered)) {
+      /* new_bits was already computed by classify_has_new_bits() above. */
+
+    } else if (likely(classified)) {
+      new_bits = has_new_bits(afl, virgin);
+
+    } else if (afl->fsrv.virgin && fault == FSRV_RUN_OK &&
+               afl->fsrv.virgin->verdict == FS_VIRGIN_BORING &&
+               virgin == afl->virgin_bits) {
+      /* the target found nothing that is not in its copy of virgin_bits,
+         new_bits stays 0 */
 
     } else {
-      new_bits = has_new_bits_unclassified(afl, afl->virgin_bits);
+      new_bits = has_new_bits_unclassified(afl, virgin);
 
       if (unlikely(new_bits)) { classified = 1; }
     }
 
+    if (unlikely(new_bits && afl->fsrv.virgin && virgin == afl->virgin_bits)) {
+      target_novelty_sync(afl);
+    }
+
+    if (unlikely(new_bits && afl->shared_virgin)) {
+      new_bits = shared_virgin_merge(afl, new_bits);
+    }
+
     //  LS:add store codes
 
     afl->relative_time =
@@ -528,6 +1176,8 @@ save_if_interesting(afl_state_t *afl, void *mem, u32 len, u8 fault) {
 
   save_to_queue:
 
+    mem = large_input(afl, mem, &len);
+
     if(afl->log_ndm){
       if (afl->splicing_with >= 0) {
             //        sprintf(ret + strlen(ret), "+%06d", afl->splicing_with);
@@ -565,11 +1215,21 @@ save_if_interesting(afl_state_t *afl, void *mem, u32 len, u8 fault) {
         alloc_printf("%s/queue/id_%06u", afl->out_dir, afl->queued_items);
 
 #endif /* ^!SIMPLE_FILES */
-    fd = open(queue_fn, O_WRONLY | O_CREAT | O_EXCL, DEFAULT_PERMISSION);
-    if (unlikely(fd < 0)) { PFATAL("Unable to create '%s'", queue_fn); }
-    ck_write(fd, mem, len, queue_fn);
-    close(fd);
+    /* a streamed seed is linked to, unless it is in a pack */
+
+    if (unlikely(afl->seed_ref) && !afl->in_pack) {
+      if (symlink(afl->seed_ref, queue_fn)) {
+        PFATAL("Unable to create '%s'", queue_fn);
+      }
+
+    } else {
+      afl->queue_write_seq = write_queue_file(afl, queue_fn, mem, len);
+    }
+
+    sync_manifest_add(afl, afl->queued_items, queue_fn, len,
+                      afl->fsrv.trace_bits);
     add_to_queue(afl, queue_fn, len, 0);
+    afl->queue_top->seed_link = afl->seed_ref && !afl->in_pack;
 
     if (unlikely(afl->fuzz_mode) &&
         likely(afl->switch_fuzz_mode && !afl->non_instrumented_mode)) {
@@ -607,15 +1267,15 @@ save_if_interesting(afl_state_t *afl, void *mem, u32 len, u8 fault) {
 
     if (unlikely(need_hash && new_bits)) {
       /* due to classify counts we have to recalculate the checksum */
-      afl->queue_top->exec_cksum =
-          hash64(afl->fsrv.trace_bits, afl->fsrv.map_size, HASH_CONST);
+      afl->queue_top->exec_cksum = hash_trace_bits(&afl->fsrv);
       need_hash = 0;
     }
 
     /* For AFLFast schedules we update the new queue entry */
     if (likely(cksum)) {
-      afl->queue_top->n_fuzz_entry = cksum % N_FUZZ_SIZE;
-      afl->n_fuzz[afl->queue_top->n_fuzz_entry] = 1;
+      afl->queue_top->n_fuzz_entry = cksum;
+      n_fuzz_add(afl, cksum);
+      if (likely(discovered)) { path_bloom_add(afl, summary); }
     }
 
     /* Try to calibrate inline; this also calls update_bitmap_score() when
@@ -630,6 +1290,8 @@ save_if_interesting(afl_state_t *afl, void *mem, u32 len, u8 fault) {
       queue_testcase_store_mem(afl, afl->queue_top, mem);
     }
 
+    custom_meta_new(afl, afl->queue_top, mem, afl->syncing_meta);
+
     keeping = 1;
   }
 
@@ -645,6 +1307,11 @@ save_if_interesting(afl_state_t *afl, void *mem, u32 len, u8 fault) {
 
       if (afl->saved_hangs >= KEEP_UNIQUE_HANG) { return keeping; }
 
+      /* With AFL_HANG_CHECK_ASYNC the hang is confirmed on a forkserver of
+         its own, and its signature only known then, see hang_check_done() */
+
+      hang_async = afl->hang_check && afl->fsrv.exec_tmout < afl->hang_tmout;
+
       if (likely(!afl->non_instrumented_mode)) {
         if (unlikely(!classified)) {
           classify_counts(&afl->fsrv);
@@ -653,7 +1320,14 @@ save_if_interesting(afl_state_t *afl, void *mem, u32 len, u8 fault) {
 
         simplify_trace(afl, afl->fsrv.trace_bits);
 
-        if (!has_new_bits(afl, afl->virgin_tmout)) { return keeping; }
+        if (!has_new_fault_bits(afl, afl->virgin_tmout, SHARED_VIRGIN_TMOUT)) {
+          return keeping;
+        }
+
+        if (unlikely(afl->crash_sigs) && !hang_async &&
+            !crash_sig_add(afl, hash_trace_bits(&afl->fsrv) ^ fault)) {
+          return keeping;
+        }
       }
 
       is_timeout = 0x80;
@@ -681,6 +1355,10 @@ save_if_interesting(afl_state_t *afl, void *mem, u32 len, u8 fault) {
          the target with a more generous timeout (unless the default timeout
          is already generous). */
 
+      mem = large_input(afl, mem, &len);
+
+      if (hang_async && hang_check_add(afl, mem, len)) { return keeping; }
+
       if (afl->fsrv.exec_tmout < afl->hang_tmout) {
         u8  new_fault;
         u32 tmp_len = write_to_testcase(afl, &mem, len, 0);
@@ -753,7 +1431,14 @@ save_if_interesting(afl_state_t *afl, void *mem, u32 len, u8 fault) {
 
         simplify_trace(afl, afl->fsrv.trace_bits);
 
-        if (!has_new_bits(afl, afl->virgin_crash)) { return keeping; }
+        if (!has_new_fault_bits(afl, afl->virgin_crash, SHARED_VIRGIN_CRASH)) {
+          return keeping;
+        }
+
+        if (unlikely(afl->crash_sigs) &&
+            !crash_sig_add(afl, hash_trace_bits(&afl->fsrv) ^ fault)) {
+          return keeping;
+        }
       }
 
       if (unlikely(!afl->saved_crashes) &&
@@ -821,10 +1506,17 @@ save_if_interesting(afl_state_t *afl, void *mem, u32 len, u8 fault) {
   /* If we're here, we apparently want to save the crash or hang
      test case, too. */
 
-  fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, DEFAULT_PERMISSION);
-  if (unlikely(fd < 0)) { PFATAL("Unable to create '%s'", fn); }
-  ck_write(fd, mem, len, fn);
-  close(fd);
+  mem = large_input(afl, mem, &len);
+
+  if (afl->writer) {
+    writer_create(afl->writer, fn, mem, len);
+
+  } else {
+    fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, DEFAULT_PERMISSION);
+    if (unlikely(fd < 0)) { PFATAL("Unable to create '%s'", fn); }
+    ck_write(fd, mem, len, fn);
+    close(fd);
+  }
 
 #ifdef __linux__
   if (afl->fsrv.nyx_mode && fault == FSRV_RUN_CRASH) {
@@ -834,9 +1526,12 @@ save_if_interesting(afl_state_t *afl, void *mem, u32 len, u8 fault) {
     fd = open(fn_log, O_WRONLY | O_CREAT | O_EXCL, DEFAULT_PERMISSION);
     if (unlikely(fd < 0)) { PFATAL("Unable to create '%s'", fn_log); }
 
+    /* the crash may have come from one of the AFL_FSRV_WORKERS runners */
+    void *runner = afl->result_nyx_runner ? afl->result_nyx_runner
+                                          : afl->fsrv.nyx_runner;
+
     u32 nyx_aux_string_len = afl->fsrv.nyx_handlers->nyx_get_aux_string(
-        afl->fsrv.nyx_runner, afl->fsrv.nyx_aux_string,
-        afl->fsrv.nyx_aux_string_len);
+        runner, afl->fsrv.nyx_aux_string, afl->fsrv.nyx_aux_string_len);
 
     ck_write(fd, afl->fsrv.nyx_aux_string, nyx_aux_string_len, fn_log);
     close(fd);
@@ -846,3 +1541,135 @@ save_if_interesting(afl_state_t *afl, void *mem, u32 len, u8 fault) {
 
   return keeping;
 }
+
+/* Queue the timeout mem for its run with hang_tmout on the spare forkserver
+   of AFL_HANG_CHECK_ASYNC, with the map of the run that timed out. Returns
+   0 if the queue is full, the caller then checks it itself. */
+
+u8 hang_check_add(afl_state_t *afl, u8 *mem, u32 len) {
+  struct hang_check   *hc = afl->hang_check;
+  struct hang_suspect *h;
+  u8                  *tmp;
+
+  if (hc->cnt == HANG_CHECK_QUEUE) { return 0; }
+
+  h = &hc->q[(hc->head + hc->cnt) % HANG_CHECK_QUEUE];
+
+  h->buf = afl_realloc((void **)&h->buf, len);
+  if (unlikely(!h->buf)) { PFATAL("alloc"); }
+  memcpy(h->buf, mem, len);
+  h->len = len;
+
+  /* the suspect takes the map, its old one is next */
+
+  if (unlikely(!h->trace)) {
+    h->trace = ck_alloc_nozero(afl->fsrv.map_size);
+  }
+
+  tmp = h->trace;
+  h->trace = hc->trace;
+  hc->trace = tmp;
+
+#ifndef SIMPLE_FILES
+  snprintf(h->op, sizeof(h->op), "%s",
+           describe_op(afl, 0, NAME_MAX - strlen("id:000000,")));
+#endif
+
+  ++hc->cnt;
+
+  if (!hc->w.busy) { hang_check_poll(afl); }
+
+  return 1;
+}
+
+/* The signature of a confirmed hang: the map entries whose counts still
+   changed between the kill of the first run and that of the longer one,
+   the edges the target was stuck in. A target that hangs without running
+   code, blocked in a syscall, changes none, the checksum of the simplified
+   trace is taken then. */
+
+static u64 hang_sig(afl_state_t *afl, u8 *first, afl_forkserver_t *fsrv) {
+  u64 *a = (u64 *)first, *b = (u64 *)fsrv->trace_bits, sig = 0;
+  u32  i, j, words = afl->fsrv.map_size >> 3;
+
+  for (i = 0; i < words; ++i) {
+    if (likely(a[i] == b[i])) { continue; }
+
+    for (j = i << 3; j < (i + 1) << 3; ++j) {
+      if (first[j] != fsrv->trace_bits[j]) {
+        sig = (sig ^ j) * 0x100000001b3ULL;
+      }
+    }
+  }
+
+  if (!sig) {
+    classify_counts(fsrv);
+    simplify_trace(afl, fsrv->trace_bits);
+    sig = hash_trace_bits(fsrv);
+  }
+
+  return sig ^ FSRV_RUN_TMOUT;
+}
+
+/* Take in the outcome fault of the run of suspect h on the spare forkserver.
+   A hang is saved as save_if_interesting() would have, unless a hang with
+   its signature was saved already. A crash goes to save_if_interesting(). */
+
+void hang_check_done(afl_state_t *afl, struct hang_suspect *h, u8 fault) {
+  struct hang_check *hc = afl->hang_check;
+  afl_forkserver_t  *fsrv = &hc->w.fsrv;
+  u8                 fn[PATH_MAX];
+  u64                sig;
+  s32                fd;
+
+  /* no target runs for a crash, the map is swapped back right after */
+
+  if (fault == FSRV_RUN_CRASH) {
+    u8 *map = afl->fsrv.trace_bits;
+
+    afl->fsrv.trace_bits = fsrv->trace_bits;
+    afl->fsrv.last_kill_signal = fsrv->last_kill_signal;
+    save_if_interesting(afl, h->buf, h->len, FSRV_RUN_CRASH);
+    afl->fsrv.trace_bits = map;
+    return;
+  }
+
+  if (fault != FSRV_RUN_TMOUT || afl->saved_hangs >= KEEP_UNIQUE_HANG) {
+    return;
+  }
+
+  sig = hang_sig(afl, h->trace, fsrv);
+
+  if (!sig_set_add(hc->sigs, HANG_SIGS_SLOTS, sig)) {
+    ++afl->hang_dups;
+    return;
+  }
+
+  if (unlikely(afl->crash_sigs) && !crash_sig_add(afl, sig)) { return; }
+
+#ifndef SIMPLE_FILES
+
+  snprintf(fn, PATH_MAX, "%s/hangs/id:%06llu,%s", afl->out_dir,
+           afl->saved_hangs, h->op);
+
+#else
+
+  snprintf(fn, PATH_MAX, "%s/hangs/id_%06llu", afl->out_dir,
+           afl->saved_hangs);
+
+#endif /* ^!SIMPLE_FILES */
+
+  ++afl->saved_hangs;
+
+  afl->last_hang_time = get_cur_time();
+
+  if (afl->writer) {
+    writer_create(afl->writer, fn, h->buf, h->len);
+
+  } else {
+    fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, DEFAULT_PERMISSION);
+    if (unlikely(fd < 0)) { PFATAL("Unable to create '%s'", fn); }
+    ck_write(fd, h->buf, h->len, fn);
+    close(fd);
+  }
+}
@@ -0,0 +1,368 @@
+/*
+ * This implements AFL_CHECKPOINT, a binary snapshot of the scheduling state
+ * that a resumed session (-i - or AFL_AUTORESUME) picks up after its dry run:
+ * the queue cycle and counters, the stage stats, the MOpt swarms, the path
+ * frequencies and what was done to each queue entry and dictionary token.
+ *
+ * There are two slots, fuzzer_checkpoint.0 and .1 in -o, written in turn
+ * and fsync()ed, so a crash or preemption mid write still leaves the other
+ * one intact. The slot with the highest sequence number that passes its
+ * checksum is loaded.
+ *
+ */
+
+#include "afl-fuzz.h"
+
+#define CHECKPOINT_MAGIC 0x4146434b
+#define CHECKPOINT_VERSION 2
+
+struct checkpoint_hdr {
+  u32 magic, version;
+  u64 seq, len, cksum;
+  u32 queued_items, extras_cnt, a_extras_cnt, n_fuzz_count;
+};
+
+struct checkpoint_globals {
+  u64 run_time, total_execs, queue_cycle, cycles_wo_finds, saved_crashes,
+      saved_hangs, saved_tmouts;
+  u64 stage_finds[32], stage_cycles[32];
+  u32 queued_discovered, queued_imported, max_depth, expand_havoc;
+  u32 havoc_div, pad;
+};
+
+/* Everything the MOpt swarms carry from one havoc stage to the next. */
+
+struct checkpoint_mopt {
+  s32 limit_time_puppet, limit_time_sig, key_puppet, key_module, g_now,
+      g_max, swarm_now, key_lv;
+  double w_now, period_pilot_tmp;
+  u64    total_puppet_find, temp_puppet_find, tmp_pilot_time, tmp_core_time;
+  double x_now[swarm_num][operator_num], L_best[swarm_num][operator_num],
+      eff_best[swarm_num][operator_num], G_best[operator_num],
+      v_now[swarm_num][operator_num], swarm_fitness[swarm_num];
+  u64 stage_finds_puppet[swarm_num][operator_num],
+      stage_finds_puppet_v2[swarm_num][operator_num],
+      stage_cycles_puppet_v2[swarm_num][operator_num],
+      stage_cycles_puppet[swarm_num][operator_num],
+      operator_finds_puppet[operator_num],
+      core_operator_finds_puppet[operator_num],
+      core_operator_finds_puppet_v2[operator_num],
+      core_operator_cycles_puppet[operator_num],
+      core_operator_cycles_puppet_v2[operator_num];
+};
+
+struct checkpoint_entry {
+  u64 input_hash, handicap, depth, stats_mutated;
+  u32 len, fuzz_level;
+  u8  was_fuzzed, passed_det, colorized, trim_done;
+  u32 pad;
+};
+
+/* Entries are matched up again by contents and length, as an in-place
+   resume reads queue/ back in reverse and renames what pivot_inputs() finds
+   out of order. The hash is kept until a trim changes the input. */
+
+static u64 entry_input_hash(afl_state_t *afl, struct queue_entry *q) {
+  if (!q->input_hash) {
+    u8 *buf = queue_testcase_get(afl, q);
+
+    q->input_hash = hash64(buf, q->len, HASH_CONST);
+  }
+
+  return q->input_hash;
+}
+
+struct checkpoint_key {
+  u64 hash;
+  u32 id;
+};
+
+static int key_cmp(const void *a, const void *b) {
+  u64 x = ((struct checkpoint_key *)a)->hash,
+      y = ((struct checkpoint_key *)b)->hash;
+
+  return x < y ? -1 : x > y;
+}
+
+#define MOPT_COPY(dst, src, field) \
+  memcpy(&(dst)->field, &(src)->field, sizeof((dst)->field))
+
+#define MOPT_FIELDS(dst, src)                                     \
+  do {                                                            \
+    MOPT_COPY(dst, src, limit_time_puppet);                       \
+    MOPT_COPY(dst, src, limit_time_sig);                          \
+    MOPT_COPY(dst, src, key_puppet);                              \
+    MOPT_COPY(dst, src, key_module);                              \
+    MOPT_COPY(dst, src, g_now);                                   \
+    MOPT_COPY(dst, src, g_max);                                   \
+    MOPT_COPY(dst, src, swarm_now);                               \
+    MOPT_COPY(dst, src, key_lv);                                  \
+    MOPT_COPY(dst, src, w_now);                                   \
+    MOPT_COPY(dst, src, period_pilot_tmp);                        \
+    MOPT_COPY(dst, src, total_puppet_find);                       \
+    MOPT_COPY(dst, src, temp_puppet_find);                        \
+    MOPT_COPY(dst, src, tmp_pilot_time);                          \
+    MOPT_COPY(dst, src, tmp_core_time);                           \
+    MOPT_COPY(dst, src, x_now);                                   \
+    MOPT_COPY(dst, src, L_best);                                  \
+    MOPT_COPY(dst, src, eff_best);                                \
+    MOPT_COPY(dst, src, G_best);                                  \
+    MOPT_COPY(dst, src, v_now);                                   \
+    MOPT_COPY(dst, src, swarm_fitness);                           \
+    MOPT_COPY(dst, src, stage_finds_puppet);                      \
+    MOPT_COPY(dst, src, stage_finds_puppet_v2);                   \
+    MOPT_COPY(dst, src, stage_cycles_puppet_v2);                  \
+    MOPT_COPY(dst, src, stage_cycles_puppet);                     \
+    MOPT_COPY(dst, src, operator_finds_puppet);                   \
+    MOPT_COPY(dst, src, core_operator_finds_puppet);              \
+    MOPT_COPY(dst, src, core_operator_finds_puppet_v2);           \
+    MOPT_COPY(dst, src, core_operator_cycles_puppet);             \
+    MOPT_COPY(dst, src, core_operator_cycles_puppet_v2);          \
+                                                                  \
+  } while (0)
+
+static u64 checkpoint_len(u32 queued, u32 extras, u32 a_extras, u32 n_fuzz) {
+  return sizeof(struct checkpoint_globals) + sizeof(struct checkpoint_mopt) +
+         (u64)n_fuzz * sizeof(struct n_fuzz_slot) +
+         (u64)queued * sizeof(struct checkpoint_entry) +
+         (u64)(extras + a_extras) * sizeof(u32);
+}
+
+/* Write the next slot. Called between two queue entries and on exit. */
+
+void checkpoint_write(afl_state_t *afl) {
+  struct checkpoint_hdr      hdr;
+  struct checkpoint_globals *g;
+  struct checkpoint_mopt    *m;
+  struct n_fuzz_slot        *slot;
+  struct checkpoint_entry   *e;
+  u32                       *hits;
+  u8                        *buf, *fn;
+  u32                        i;
+  s32                        fd;
+
+  sort_auto_extras(afl);
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = CHECKPOINT_MAGIC;
+  hdr.version = CHECKPOINT_VERSION;
+  hdr.seq = afl->checkpoint_seq;
+  hdr.queued_items = afl->queued_items;
+  hdr.extras_cnt = afl->extras_cnt;
+  hdr.a_extras_cnt = afl->a_extras_cnt;
+  hdr.n_fuzz_count = afl->n_fuzz_count;
+  hdr.len = checkpoint_len(hdr.queued_items, hdr.extras_cnt, hdr.a_extras_cnt,
+                           hdr.n_fuzz_count);
+
+  buf = ck_alloc(hdr.len);
+
+  g = (struct checkpoint_globals *)buf;
+  g->run_time = afl->prev_run_time + get_cur_time() - afl->start_time;
+  g->total_execs = afl->fsrv.total_execs;
+  g->queue_cycle = afl->queue_cycle;
+  g->cycles_wo_finds = afl->cycles_wo_finds;
+  g->saved_crashes = afl->saved_crashes;
+  g->saved_hangs = afl->saved_hangs;
+  g->saved_tmouts = afl->saved_tmouts;
+  memcpy(g->stage_finds, afl->stage_finds, sizeof(g->stage_finds));
+  memcpy(g->stage_cycles, afl->stage_cycles, sizeof(g->stage_cycles));
+  g->queued_discovered = afl->queued_discovered;
+  g->queued_imported = afl->queued_imported;
+  g->max_depth = afl->max_depth;
+  g->expand_havoc = afl->expand_havoc;
+  g->havoc_div = afl->havoc_div;
+
+  m = (struct checkpoint_mopt *)(g + 1);
+  MOPT_FIELDS(m, afl);
+
+  slot = (struct n_fuzz_slot *)(m + 1);
+  for (i = 0; i < afl->n_fuzz_size; ++i) {
+    if (afl->n_fuzz[i].cksum) { *slot++ = afl->n_fuzz[i]; }
+  }
+
+  e = (struct checkpoint_entry *)slot;
+  for (i = 0; i < hdr.queued_items; ++i, ++e) {
+    struct queue_entry *q = afl->queue_buf[i];
+
+    e->input_hash = entry_input_hash(afl, q);
+    e->handicap = q->handicap;
+    e->depth = q->depth;
+    e->stats_mutated = q->stats_mutated;
+    e->len = q->len;
+    e->fuzz_level = q->fuzz_level;
+    e->was_fuzzed = q->was_fuzzed;
+    e->passed_det = q->passed_det;
+    e->colorized = q->colorized;
+    e->trim_done = q->trim_done;
+  }
+
+  hits = (u32 *)e;
+  for (i = 0; i < hdr.extras_cnt; ++i) {
+    *hits++ = afl->extras[i].hit_cnt;
+  }
+
+  for (i = 0; i < hdr.a_extras_cnt; ++i) {
+    *hits++ = afl->a_extras[i].hit_cnt;
+  }
+
+  hdr.cksum = hash64(buf, hdr.len, HASH_CONST);
+
+  fn = alloc_printf("%s/fuzzer_checkpoint.%llu", afl->out_dir, hdr.seq & 1);
+  fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, DEFAULT_PERMISSION);
+  if (fd < 0) { PFATAL("Unable to create '%s'", fn); }
+
+  ck_write(fd, &hdr, sizeof(hdr), fn);
+  ck_write(fd, buf, hdr.len, fn);
+  if (fsync(fd)) { PFATAL("fsync() of '%s' failed", fn); }
+
+  close(fd);
+  ck_free(fn);
+  ck_free(buf);
+
+  ++afl->checkpoint_seq;
+  afl->checkpoint_last = get_cur_time();
+}
+
+/* Read one slot, NULL if it is missing, torn or of another version. */
+
+static u8 *checkpoint_read(afl_state_t *afl, u32 idx,
+                           struct checkpoint_hdr *hdr) {
+  struct stat st;
+  u8         *fn, *buf;
+  s32         fd;
+
+  fn = alloc_printf("%s/fuzzer_checkpoint.%u", afl->out_dir, idx);
+  fd = open(fn, O_RDONLY);
+  ck_free(fn);
+
+  if (fd < 0) { return NULL; }
+
+  if (fstat(fd, &st) || st.st_size < (off_t)sizeof(*hdr) ||
+      read(fd, hdr, sizeof(*hdr)) != sizeof(*hdr) ||
+      hdr->magic != CHECKPOINT_MAGIC || hdr->version != CHECKPOINT_VERSION ||
+      hdr->len != checkpoint_len(hdr->queued_items, hdr->extras_cnt,
+                                 hdr->a_extras_cnt, hdr->n_fuzz_count) ||
+      (u64)st.st_size != sizeof(*hdr) + hdr->len) {
+    close(fd);
+    return NULL;
+  }
+
+  buf = ck_alloc(hdr->len);
+
+  if (read(fd, buf, hdr->len) != (ssize_t)hdr->len ||
+      hash64(buf, hdr->len, HASH_CONST) != hdr->cksum) {
+    ck_free(buf);
+    buf = NULL;
+  }
+
+  close(fd);
+  return buf;
+}
+
+/* Restore the newest valid slot on top of what the dry run and
+   load_stats_file() set up. Entries that do not match are left alone. */
+
+void checkpoint_load(afl_state_t *afl) {
+  struct checkpoint_hdr      hdr[2];
+  struct checkpoint_globals *g;
+  struct checkpoint_mopt    *m;
+  struct n_fuzz_slot        *slot;
+  struct checkpoint_entry   *e;
+  struct checkpoint_key     *keys, key, *found;
+  u32                       *hits;
+  u8                        *buf[2];
+  u32                        i, cur, matched = 0;
+
+  buf[0] = checkpoint_read(afl, 0, &hdr[0]);
+  buf[1] = checkpoint_read(afl, 1, &hdr[1]);
+
+  if (!buf[0] && !buf[1]) {
+    WARNF("No valid checkpoint in '%s', starting from the stats file",
+          afl->out_dir);
+    return;
+  }
+
+  cur = !buf[0] || (buf[1] && hdr[1].seq > hdr[0].seq);
+  ck_free(buf[!cur]);
+
+  g = (struct checkpoint_globals *)buf[cur];
+  afl->prev_run_time = g->run_time;
+  afl->fsrv.total_execs = g->total_execs;
+  afl->queue_cycle = g->queue_cycle;
+  afl->cycles_wo_finds = g->cycles_wo_finds;
+  afl->saved_crashes = g->saved_crashes;
+  afl->saved_hangs = g->saved_hangs;
+  afl->saved_tmouts = g->saved_tmouts;
+  memcpy(afl->stage_finds, g->stage_finds, sizeof(g->stage_finds));
+  memcpy(afl->stage_cycles, g->stage_cycles, sizeof(g->stage_cycles));
+  afl->queued_discovered = g->queued_discovered;
+  afl->queued_imported = g->queued_imported;
+  afl->max_depth = g->max_depth;
+  afl->expand_havoc = g->expand_havoc;
+  afl->havoc_div = g->havoc_div;
+
+  /* The swarms only carry over if -L was given both times. */
+
+  m = (struct checkpoint_mopt *)(g + 1);
+  if (afl->limit_time_sig && m->limit_time_sig) {
+    MOPT_FIELDS(afl, m);
+    afl->last_limit_time_start = get_cur_time();
+  }
+
+  slot = (struct n_fuzz_slot *)(m + 1);
+  for (i = 0; i < hdr[cur].n_fuzz_count; ++i, ++slot) {
+    n_fuzz_set(afl, slot->cksum, slot->hits);
+  }
+
+  keys = ck_alloc((afl->queued_items + 1) * sizeof(*keys));
+  for (i = 0; i < afl->queued_items; ++i) {
+    keys[i].hash = entry_input_hash(afl, afl->queue_buf[i]);
+    keys[i].id = i;
+  }
+
+  qsort(keys, afl->queued_items, sizeof(*keys), key_cmp);
+
+  e = (struct checkpoint_entry *)slot;
+  for (i = 0; i < hdr[cur].queued_items; ++i, ++e) {
+    struct queue_entry *q;
+
+    key.hash = e->input_hash;
+    found = bsearch(&key, keys, afl->queued_items, sizeof(*keys), key_cmp);
+    if (!found) { continue; }
+
+    q = afl->queue_buf[found->id];
+    if (q->len != e->len) { continue; }
+
+    if (e->was_fuzzed && !q->was_fuzzed && !q->disabled) {
+      --afl->pending_not_fuzzed;
+    }
+
+    q->handicap = e->handicap;
+    q->depth = e->depth;
+    q->stats_mutated = e->stats_mutated;
+    q->fuzz_level = e->fuzz_level;
+    q->was_fuzzed = e->was_fuzzed;
+    q->passed_det = e->passed_det;
+    q->colorized = e->colorized;
+    q->trim_done = e->trim_done;
+    ++matched;
+  }
+
+  ck_free(keys);
+
+  hits = (u32 *)e;
+  for (i = 0; i < hdr[cur].extras_cnt; ++i, ++hits) {
+    if (i < afl->extras_cnt) { afl->extras[i].hit_cnt = *hits; }
+  }
+
+  for (i = 0; i < hdr[cur].a_extras_cnt; ++i, ++hits) {
+    if (i < afl->a_extras_cnt) { afl->a_extras[i].hit_cnt = *hits; }
+  }
+
+  afl->checkpoint_seq = hdr[cur].seq + 1;
+  afl->reinit_table = 1;
+  ck_free(buf[cur]);
+
+  OKF("Resumed checkpoint %llu, %u of %u queue entries matched.", hdr[cur].seq,
+      matched, afl->queued_items);
+}
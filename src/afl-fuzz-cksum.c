@@ -0,0 +1,415 @@
+/*
+ * This implements AFL_CHECKSUM_FIXUP: input-to-state first runs a few
+ * copies of a queue entry with a byte changed through cmplog. An operand
+ * pair of which one value is stored in the input and the other one is a
+ * checksum of a range of it (CRC32, CRC32C, Adler32 or the internet
+ * checksum) marks a checksum field. Before a mutation of the entry is run
+ * its fields are recomputed, so the target gets past the check without
+ * having to be patched.
+ *
+ */
+
+#include "afl-fuzz.h"
+#include "cmplog.h"
+
+/* Reflected CRC tables, slicing by 8 for the fixups that run for every
+   exec, and the index of each first table entry by its top byte to step
+   backwards while looking for a range. */
+
+static u32 crc_tab[2][8][256];
+static u8  crc_rev[2][256];
+static u8  crc_ready;
+
+static void crc_init(void) {
+  static const u32 poly[2] = {0xedb88320, 0x82f63b78};
+  u32              a, i, j, c;
+
+  for (a = 0; a < 2; ++a) {
+    for (i = 0; i < 256; ++i) {
+      c = i;
+      for (j = 0; j < 8; ++j) {
+        c = (c >> 1) ^ (c & 1 ? poly[a] : 0);
+      }
+
+      crc_tab[a][0][i] = c;
+      crc_rev[a][c >> 24] = i;
+    }
+
+    for (i = 0; i < 256; ++i) {
+      for (j = 1; j < 8; ++j) {
+        c = crc_tab[a][j - 1][i];
+        crc_tab[a][j][i] = (c >> 8) ^ crc_tab[a][0][c & 0xff];
+      }
+    }
+  }
+
+  crc_ready = 1;
+}
+
+static u32 crc_update(u32 (*t)[256], u32 c, const u8 *p, u32 n) {
+  u32 x, y;
+
+  while (n >= 8) {
+    x = c ^ (p[0] | p[1] << 8 | p[2] << 16 | (u32)p[3] << 24);
+    y = p[4] | p[5] << 8 | p[6] << 16 | (u32)p[7] << 24;
+    c = t[7][x & 0xff] ^ t[6][(x >> 8) & 0xff] ^ t[5][(x >> 16) & 0xff] ^
+        t[4][x >> 24] ^ t[3][y & 0xff] ^ t[2][(y >> 8) & 0xff] ^
+        t[1][(y >> 16) & 0xff] ^ t[0][y >> 24];
+    p += 8;
+    n -= 8;
+  }
+
+  while (n--) {
+    c = (c >> 8) ^ t[0][(c ^ *p++) & 0xff];
+  }
+
+  return c;
+}
+
+#define ADLER_MOD 65521
+#define ADLER_NMAX 5552 /* bytes before the sums may overflow */
+
+struct cksum_st {
+  u32 a, b, n;
+};
+
+static void cksum_start(u8 algo, struct cksum_st *s) {
+  s->a = algo == CKSUM_ADLER32 ? 1 : algo == CKSUM_INET ? 0 : 0xffffffff;
+  s->b = 0;
+  s->n = 0;
+}
+
+static void cksum_update(u8 algo, struct cksum_st *s, const u8 *p, u32 n) {
+  u32 i, k;
+
+  switch (algo) {
+    case CKSUM_CRC32:
+    case CKSUM_CRC32C:
+      s->a = crc_update(crc_tab[algo], s->a, p, n);
+      break;
+
+    case CKSUM_ADLER32:
+      for (i = 0; i < n; i += k) {
+        for (k = 0; k < MIN(n - i, (u32)ADLER_NMAX); ++k) {
+          s->a += p[i + k];
+          s->b += s->a;
+        }
+
+        s->a %= ADLER_MOD;
+        s->b %= ADLER_MOD;
+      }
+
+      break;
+
+    default:
+      /* big endian 16 bit words, the odd byte of a range is the high one */
+      for (i = 0; i < n; ++i) {
+        s->a += (s->n + i) & 1 ? p[i] : p[i] << 8;
+      }
+
+      s->a = (s->a & 0xffff) + (s->a >> 16);
+      break;
+  }
+
+  s->n += n;
+}
+
+static u32 cksum_final(u8 algo, struct cksum_st *s) {
+  switch (algo) {
+    case CKSUM_CRC32:
+    case CKSUM_CRC32C:
+      return ~s->a;
+
+    case CKSUM_ADLER32:
+      return s->b << 16 | s->a;
+
+    default: {
+      u32 a = (s->a & 0xffff) + (s->a >> 16);
+      return ~((a & 0xffff) + (a >> 16)) & 0xffff;
+    }
+  }
+}
+
+static u32 cksum_swap(u32 v, u32 w) {
+  return w == 4 ? __builtin_bswap32(v) : __builtin_bswap16(v);
+}
+
+static u32 cksum_read(u8 *p, u32 w, u8 be) {
+  u32 v = 0, i;
+
+  for (i = 0; i < w; ++i) {
+    v |= (u32)p[be ? w - 1 - i : i] << (i << 3);
+  }
+
+  return v;
+}
+
+/* The checksum f stands for over buf, ending at end. */
+
+static u32 cksum_calc(struct cksum_fix *f, u8 *buf, u32 end) {
+  static const u8 zero[4];
+  struct cksum_st s;
+
+  cksum_start(f->algo, &s);
+
+  if (f->off >= f->start && f->off < end) {
+    cksum_update(f->algo, &s, buf + f->start, f->off - f->start);
+    cksum_update(f->algo, &s, zero, f->width);
+    cksum_update(f->algo, &s, buf + f->off + f->width,
+                 end - f->off - f->width);
+
+  } else {
+    cksum_update(f->algo, &s, buf + f->start, end - f->start);
+  }
+
+  return cksum_final(f->algo, &s);
+}
+
+/* Look for the range of buf the checksum t (or its byte swapped t2) is
+   taken of for the field f, and fill in the range and swap of f. CRCs and
+   Adler32 cover data next to the field: the bytes right before it, found
+   by stepping backwards from t to the initial state, or the bytes from up
+   to CKSUM_GAP after it on. The internet checksum covers the field itself,
+   starting up to CKSUM_GAP before it. */
+
+static u8 cksum_search(struct cksum_fix *f, u8 *buf, u32 len, u32 t, u32 t2) {
+  struct cksum_st s;
+  u32             i, e, v, lo, hi;
+  u8              k;
+
+  if (f->algo == CKSUM_INET) {
+    lo = f->off > CKSUM_GAP ? f->off - CKSUM_GAP : 0;
+
+    for (i = f->off + 1; i-- > lo;) {
+      if ((f->off - i) & 1) { continue; }
+
+      cksum_start(f->algo, &s);
+      cksum_update(f->algo, &s, buf + i, f->off - i);
+      cksum_update(f->algo, &s, (u8 *)"\0\0", 2);
+
+      for (e = f->off + 2; e <= len; ++e) {
+        if (e > f->off + 2) { cksum_update(f->algo, &s, buf + e - 1, 1); }
+        if (e != len && ((e - i) & 1 || e - i > CKSUM_GAP)) { continue; }
+
+        v = cksum_final(f->algo, &s);
+        if (v == t || v == t2) {
+          f->start = i;
+          f->end = e == len ? 0 : e;
+          f->swap = v != t;
+          return 1;
+        }
+      }
+    }
+
+    return 0;
+  }
+
+  for (k = 0; k < 2; ++k) {
+    u32 a, b;
+
+    v = k ? t2 : t;
+
+    if (f->algo == CKSUM_ADLER32) {
+      a = v & 0xffff;
+      b = v >> 16;
+      if (a >= ADLER_MOD || b >= ADLER_MOD) { continue; }
+
+      for (i = f->off; i-- > 0;) {
+        b = (b + ADLER_MOD - a) % ADLER_MOD;
+        a = (a + ADLER_MOD - buf[i]) % ADLER_MOD;
+        if (a == 1 && !b) { break; }
+      }
+
+    } else {
+      a = ~v;
+
+      for (i = f->off; i-- > 0;) {
+        u8 idx = crc_rev[f->algo][a >> 24];
+        a = (a ^ crc_tab[f->algo][0][idx]) << 8 | (idx ^ buf[i]);
+        if (a == 0xffffffff) { break; }
+      }
+    }
+
+    if (i != (u32)-1) {
+      f->start = i;
+      f->end = f->off;
+      f->swap = k;
+      return 1;
+    }
+  }
+
+  hi = MIN(len, f->off + f->width + CKSUM_GAP);
+
+  for (i = f->off + f->width; i < hi; ++i) {
+    cksum_start(f->algo, &s);
+
+    for (e = i; e < len; ++e) {
+      cksum_update(f->algo, &s, buf + e, 1);
+      v = cksum_final(f->algo, &s);
+
+      if (v == t || v == t2) {
+        f->start = i;
+        f->end = e + 1 == len ? 0 : e + 1;
+        f->swap = v != t;
+        return 1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/* Whether the value stored in buf is compared to a checksum computed of
+   it, if so add the field to the queue entry. */
+
+static void cksum_field(struct queue_entry *q, u8 *buf, u32 len, u64 stored,
+                        u64 computed) {
+  struct cksum_fix f;
+  u32              i, j, w, hits = 0;
+  u8               be;
+
+  w = (stored | computed) <= 0xffff       ? 2
+      : (stored | computed) <= 0xffffffff ? 4
+                                          : 0;
+  if (!w || len < w) { return; }
+
+  for (i = 0; i <= len - w; ++i) {
+    for (be = 0; be < 2; ++be) {
+      if (cksum_read(buf + i, w, be) != stored) { continue; }
+      if (++hits > CKSUM_HITS || q->cksum_cnt >= CKSUM_FIX_MAX) { return; }
+
+      for (j = 0; j < q->cksum_cnt; ++j) {
+        if (i < q->cksum[j].off + q->cksum[j].width &&
+            q->cksum[j].off < i + w) {
+          break;
+        }
+      }
+
+      if (j < q->cksum_cnt) { break; }
+
+      memset(&f, 0, sizeof(f));
+      f.off = i;
+      f.width = w;
+      f.be = be;
+
+      for (f.algo = w == 2 ? CKSUM_INET : 0;
+           f.algo < (w == 2 ? CKSUM_ALGOS : CKSUM_INET); ++f.algo) {
+        if (cksum_search(&f, buf, len, computed,
+                         cksum_swap(computed, w))) {
+          q->cksum = ck_realloc(q->cksum,
+                                (q->cksum_cnt + 1) * sizeof(struct cksum_fix));
+          q->cksum[q->cksum_cnt++] = f;
+          break;
+        }
+      }
+
+      if (f.algo != (w == 2 ? CKSUM_ALGOS : CKSUM_INET)) { break; }
+    }
+  }
+}
+
+static u32 cksum_sort_len;
+
+static int cksum_cmp(const void *a, const void *b) {
+  const struct cksum_fix *x = a, *y = b;
+  u32 lx = (x->end ? x->end : cksum_sort_len) - x->start,
+      ly = (y->end ? y->end : cksum_sort_len) - y->start;
+
+  return lx < ly ? -1 : lx > ly;
+}
+
+/* Add the checksum fields of the current queue entry found in map, the
+   comparisons the cmplog run of buf logged. buf is the input of the entry
+   with a byte changed, the runtime does not log equal operands, so only a
+   checksum that no longer matches shows up. */
+
+void cksum_detect(afl_state_t *afl, struct cmp_map *map, u8 *buf, u32 len) {
+  struct queue_entry  *q = afl->queue_cur;
+  struct cmp_operands *o;
+  u32                  k, i, hits;
+
+  if (unlikely(!crc_ready)) { crc_init(); }
+
+  for (k = 0; k < afl->cmplog_map_w; ++k) {
+    struct cmp_header *h = &map->headers[k];
+
+    if (!h->hits || h->type != CMP_TYPE_INS || SHAPE_BYTES(h->shape) < 2 ||
+        SHAPE_BYTES(h->shape) > 8) {
+      continue;
+    }
+
+    o = cmp_map_row(map, afl->cmplog_map_w, afl->cmplog_map_h, k);
+    hits = MIN((u32)h->hits, afl->cmplog_map_h);
+
+    for (i = 0; i < hits; ++i) {
+      if (o[i].v0 == o[i].v1 || (i && o[i].v0 == o[i - 1].v0 &&
+                                 o[i].v1 == o[i - 1].v1)) {
+        continue;
+      }
+
+      cksum_field(q, buf, len, o[i].v0, o[i].v1);
+      cksum_field(q, buf, len, o[i].v1, o[i].v0);
+    }
+  }
+
+  /* a field inside of the range of another one has to be fixed first */
+
+  cksum_sort_len = len;
+  if (q->cksum_cnt > 1) {
+    qsort(q->cksum, q->cksum_cnt, sizeof(struct cksum_fix), cksum_cmp);
+  }
+
+#ifdef _DEBUG
+  for (i = 0; i < q->cksum_cnt; ++i) {
+    fprintf(stderr, "CKSUM algo=%u off=%u width=%u be=%u swap=%u %u-%u\n",
+            q->cksum[i].algo, q->cksum[i].off, q->cksum[i].width,
+            q->cksum[i].be, q->cksum[i].swap, q->cksum[i].start,
+            q->cksum[i].end);
+  }
+
+#endif
+}
+
+/* Recompute the checksum fields of the current queue entry in buf, one of
+   its mutations of len bytes. Fields or ranges that do not fit into buf any
+   more are skipped. Returns whether buf changed. */
+
+u8 cksum_fixup(afl_state_t *afl, u8 *buf, u32 len) {
+  struct queue_entry *q = afl->queue_cur;
+  struct cksum_fix   *f;
+  u32                 i, j, v, end;
+  u8                  changed = 0;
+
+  for (i = 0; i < q->cksum_cnt; ++i) {
+    f = &q->cksum[i];
+    end = f->end ? f->end : len;
+
+    if (f->off + f->width > len || f->start >= end || end > len) { continue; }
+
+    v = cksum_calc(f, buf, end);
+    if (f->swap) { v = cksum_swap(v, f->width); }
+    if (cksum_read(buf + f->off, f->width, f->be) == v) { continue; }
+
+    for (j = 0; j < f->width; ++j) {
+      buf[f->off + (f->be ? f->width - 1 - j : j)] = v >> (j << 3);
+    }
+
+    if (afl->mut_hi) {
+      afl->mut_lo = MIN(afl->mut_lo, f->off);
+      afl->mut_hi = MAX(afl->mut_hi, f->off + f->width);
+    }
+
+    changed = 1;
+  }
+
+  return changed;
+}
+
+/* Forget the checksum fields of q, e.g. because its input changed. */
+
+void cksum_free(struct queue_entry *q) {
+  ck_free(q->cksum);
+  q->cksum = NULL;
+  q->cksum_cnt = 0;
+  q->cksum_done = 0;
+}
@@ -43,18 +43,130 @@ void cmplog_exec_child(afl_forkserver_t *fsrv, char **argv) {
   execv(fsrv->target_path, argv);
 }
 
+/* Ask the cmplog runtime for the cmp_map geometry of AFL_CMPLOG_MAP_W and
+   AFL_CMPLOG_MAP_H and for delta mode, see cmplog.h. */
+
+void cmplog_map_request(afl_state_t *afl) {
+  u32 w = CMP_MAP_W, h = CMP_MAP_H;
+  char buf[32];
+
+  if (afl->afl_env.afl_cmplog_map_w) {
+    w = atoi(afl->afl_env.afl_cmplog_map_w);
+
+    if (w < CMP_MAP_W_MIN || w > CMP_MAP_W || (w & (w - 1))) {
+      FATAL("AFL_CMPLOG_MAP_W must be a power of two between %u and %u",
+            CMP_MAP_W_MIN, CMP_MAP_W);
+    }
+  }
+
+  if (afl->afl_env.afl_cmplog_map_h) {
+    h = atoi(afl->afl_env.afl_cmplog_map_h);
+
+    if (h < CMP_MAP_H_MIN || h > CMP_MAP_H || (h & (h - 1))) {
+      FATAL("AFL_CMPLOG_MAP_H must be a power of two between %u and %u",
+            CMP_MAP_H_MIN, CMP_MAP_H);
+    }
+  }
+
+  afl->cmplog_map_w = w;
+  afl->cmplog_map_h = h;
+
+  snprintf(buf, sizeof(buf), "%u:%u", w, h);
+  setenv(CMPLOG_MAP_ENV_VAR, buf, 1);
+}
+
+/* After the cmplog forkserver is up: a runtime that took the geometry has
+   confirmed it in the delta area, with any other the default one is used. */
+
+void cmplog_map_negotiate(afl_state_t *afl) {
+  u32               w = afl->cmplog_map_w, h = afl->cmplog_map_h;
+  struct cmp_delta *d = cmp_map_delta(afl->shm.cmp_map, w, h);
+
+  if (d->delta == CMPLOG_DELTA_MAGIC && d->geom == CMPLOG_GEOM(w, h)) {
+    if (w != CMP_MAP_W || h != CMP_MAP_H) {
+      OKF("Cmplog map has %u keys with %u hits each (%zu kB).", w, h,
+          CMP_MAP_DELTA_OFF(w, h) >> 10);
+    }
+
+    return;
+  }
+
+  if (w != CMP_MAP_W || h != CMP_MAP_H) {
+    WARNF(
+        "The cmplog binary does not support AFL_CMPLOG_MAP_W/AFL_CMPLOG_MAP_H, "
+        "using the default cmplog map.");
+  }
+
+  afl->cmplog_map_w = CMP_MAP_W;
+  afl->cmplog_map_h = CMP_MAP_H;
+}
+
+/* With -c 0 the main forkserver was started with CMPLOG_SWITCH_ENV_VAR. If
+   the runtime confirmed it, the main forkserver also does the cmplog runs,
+   each one asked for with FS_RUN_CMPLOG. Otherwise it is restarted without
+   the cmplog map and a cmplog forkserver is spawned as before. */
+
+void cmplog_switch_check(afl_state_t *afl) {
+  struct cmp_delta *d =
+      cmp_map_delta(afl->shm.cmp_map, afl->cmplog_map_w, afl->cmplog_map_h);
+
+  if (d->toggle == CMPLOG_SWITCH_MAGIC) {
+    OKF("The target switches cmplog on per run, no cmplog forkserver needed.");
+    cmplog_map_negotiate(afl);
+    return;
+  }
+
+  afl->fsrv.cmplog_switch = false;
+  afl_fsrv_kill(&afl->fsrv);
+  setenv("AFL_NO_AUTODICT", "1", 1);  // loaded already
+  afl_fsrv_start(&afl->fsrv, afl->argv, &afl->stop_soon,
+                 afl->afl_env.afl_debug_child);
+}
+
+/* The forkserver that does the cmplog runs. */
+
+static inline afl_forkserver_t *cmplog_fsrv(afl_state_t *afl) {
+  return afl->fsrv.cmplog_switch ? &afl->fsrv : &afl->cmplog_fsrv;
+}
+
 u8 common_fuzz_cmplog_stuff(afl_state_t *afl, u8 *out_buf, u32 len) {
-  u8  fault;
-  u32 tmp_len = write_to_testcase(afl, (void **)&out_buf, len, 0);
+  if (unlikely(cmplog_run_start(afl, out_buf, len))) { return 1; }
+
+  return cmplog_run_finish(afl);
+}
 
-  if (likely(tmp_len)) {
-    len = tmp_len;
+/* Start the cmplog binary on out_buf and return while it runs. The caller
+   may prepare the next stage meanwhile, but must not run the target or
+   touch the cmp_map before cmplog_run_finish(). Returns 1 if the user wants
+   to quit. */
 
-  } else {
-    len = write_to_testcase(afl, (void **)&out_buf, len, 1);
+u8 cmplog_run_start(afl_state_t *afl, u8 *out_buf, u32 len) {
+  if (unlikely(afl->large.file)) { afl->fsrv.patch = afl->large; }
+
+  u32 tmp_len = write_to_testcase(afl, (void **)&out_buf, len, 0);
+
+  if (unlikely(!tmp_len)) {
+    write_to_testcase(afl, (void **)&out_buf, len, 1);
   }
 
-  fault = fuzz_run_target(afl, &afl->cmplog_fsrv, afl->fsrv.exec_tmout);
+  afl_forkserver_t *fsrv = cmplog_fsrv(afl);
+  u8                stop;
+
+  afl->cmplog_start_us = get_cur_time_us();
+
+  fsrv->cmplog_run = fsrv->cmplog_switch;
+  stop = !fuzz_run_start(afl, fsrv);
+  fsrv->cmplog_run = false;
+
+  return stop;
+}
+
+/* Wait for the run of cmplog_run_start(), returns 1 if the entry is to be
+   abandoned. */
+
+u8 cmplog_run_finish(afl_state_t *afl) {
+  u8 fault = fuzz_run_finish(afl, cmplog_fsrv(afl), afl->fsrv.exec_tmout,
+                             afl->cmplog_start_us);
 
   if (afl->stop_soon) { return 1; }
 
@@ -44,6 +44,112 @@ static int compare_extras_len(const void *e1, const void *e2) {
   return ((struct extra_data *)e1)->len - ((struct extra_data *)e2)->len;
 }
 
+/* descending order */
+
+static int compare_rank_d(const void *r1, const void *r2) {
+  u32 a = *(u32 *)r1, b = *(u32 *)r2;
+
+  return a < b ? 1 : a > b ? -1 : 0;
+}
+
+/* Orders extras by size, then by contents, for dedup_extras(). */
+
+static int compare_extras_data(const void *e1, const void *e2) {
+  const struct extra_data *a = e1, *b = e2;
+
+  if (a->len != b->len) { return a->len < b->len ? -1 : 1; }
+  return memcmp(a->data, b->data, a->len);
+}
+
+/* Helper function for maybe_add_auto(afl, ) */
+
+static inline u8 memcmp_nocase(u8 *m1, u8 *m2, u32 len) {
+  while (len--) {
+    if (tolower(*(m1++)) ^ tolower(*(m2++))) { return 1; }
+  }
+
+  return 0;
+}
+
+/* Case-insensitive token hash, so that the tokens memcmp_nocase() finds equal
+   share a bucket. */
+
+static u32 token_hash(u8 *mem, u32 len) {
+  u32 h = 0x811c9dc5 ^ len;
+
+  while (len--) {
+    h = (h ^ tolower(*(mem++))) * 0x01000193;
+  }
+
+  return h ^ (h >> 15);
+}
+
+/* Empty the index and size it for cnt slots, at a load of one half at most. */
+
+static void token_index_reset(struct token_index *ix, u32 cnt) {
+  u32 buckets = 64;
+
+  while (buckets < cnt * 2) {
+    buckets <<= 1;
+  }
+
+  ix->head = afl_realloc((void **)&ix->head, buckets * sizeof(u32));
+  ix->next = afl_realloc((void **)&ix->next, MAX(cnt, 1U) * sizeof(u32));
+  if (unlikely(!ix->head || !ix->next)) { PFATAL("alloc"); }
+
+  memset(ix->head, 0, buckets * sizeof(u32));
+  ix->mask = buckets - 1;
+}
+
+static void token_index_add(struct token_index *ix, u32 slot, u32 hash) {
+  ix->next[slot] = ix->head[hash & ix->mask];
+  ix->head[hash & ix->mask] = slot + 1;
+}
+
+static void token_index_del(struct token_index *ix, u32 slot, u32 hash) {
+  u32 *link = &ix->head[hash & ix->mask];
+
+  while (*link && *link != slot + 1) {
+    link = &ix->next[*link - 1];
+  }
+
+  if (*link) { *link = ix->next[slot]; }
+}
+
+/* Rebuild the index over extras[], whenever they were added to or sorted. */
+
+static void index_extras(afl_state_t *afl) {
+  u32 i;
+
+  token_index_reset(&afl->extras_idx, afl->extras_cnt);
+
+  for (i = 0; i < afl->extras_cnt; ++i) {
+    token_index_add(&afl->extras_idx, i,
+                    token_hash(afl->extras[i].data, afl->extras[i].len));
+  }
+}
+
+/* Whether mem is among extras[], exactly or ignoring the case. */
+
+static u8 find_extra(afl_state_t *afl, u8 *mem, u32 len, u8 nocase) {
+  u32 s;
+
+  if (!afl->extras_cnt) { return 0; }
+
+  s = afl->extras_idx.head[token_hash(mem, len) & afl->extras_idx.mask];
+
+  for (; s; s = afl->extras_idx.next[s - 1]) {
+    struct extra_data *e = &afl->extras[s - 1];
+
+    if (e->len == len && !(nocase ? memcmp_nocase(e->data, mem, len)
+                                  : memcmp(e->data, mem, len))) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
 /* Read extras from a file, sort by size. */
 
 void load_extras_file(afl_state_t *afl, u8 *fname, u32 *min_len, u32 *max_len,
@@ -61,7 +167,7 @@ void load_extras_file(afl_state_t *afl, u8 *fname, u32 *min_len, u32 *max_len,
 
   while ((lptr = fgets(buf, MAX_LINE, f))) {
     u8 *rptr, *wptr;
-    u32 klen = 0;
+    u32 klen = 0, rank = 0;
 
     ++cur_line;
 
@@ -110,9 +216,11 @@ void load_extras_file(afl_state_t *afl, u8 *fname, u32 *min_len, u32 *max_len,
       }
     }
 
-    /* Skip [number] */
+    /* [number] is the rank of the token, see rank_extras() */
 
     if (*lptr == '[') {
+      rank = strtoul(lptr + 1, NULL, 10);
+
       do {
         ++lptr;
 
@@ -194,6 +302,8 @@ void load_extras_file(afl_state_t *afl, u8 *fname, u32 *min_len, u32 *max_len,
     }
 
     afl->extras[afl->extras_cnt].len = klen;
+    afl->extras[afl->extras_cnt].rank = rank;
+    afl->extras[afl->extras_cnt].top = 0;
 
     if (afl->extras[afl->extras_cnt].len > MAX_DICT_FILE) {
       WARNF(
@@ -223,6 +333,7 @@ static void extras_check_and_sort(afl_state_t *afl, u32 min_len, u32 max_len,
 
   qsort(afl->extras, afl->extras_cnt, sizeof(struct extra_data),
         compare_extras_len);
+  index_extras(afl);
 
   ACTF("Loaded %u extra tokens, size range %s to %s.", afl->extras_cnt,
        stringify_mem_size(val_bufs[0], sizeof(val_bufs[0]), min_len),
@@ -305,6 +416,8 @@ void load_extras(afl_state_t *afl, u8 *dir) {
 
     afl->extras[afl->extras_cnt].data = ck_alloc(st.st_size);
     afl->extras[afl->extras_cnt].len = st.st_size;
+    afl->extras[afl->extras_cnt].rank = 0;
+    afl->extras[afl->extras_cnt].top = 0;
 
     fd = open(fn, O_RDONLY);
 
@@ -323,16 +436,6 @@ void load_extras(afl_state_t *afl, u8 *dir) {
   extras_check_and_sort(afl, min_len, max_len, dir);
 }
 
-/* Helper function for maybe_add_auto(afl, ) */
-
-static inline u8 memcmp_nocase(u8 *m1, u8 *m2, u32 len) {
-  while (len--) {
-    if (tolower(*(m1++)) ^ tolower(*(m2++))) { return 1; }
-  }
-
-  return 0;
-}
-
 /* add an extra/dict/token - no checks performed, no sorting */
 
 static void add_extra_nocheck(afl_state_t *afl, u8 *mem, u32 len) {
@@ -343,6 +446,8 @@ static void add_extra_nocheck(afl_state_t *afl, u8 *mem, u32 len) {
 
   afl->extras[afl->extras_cnt].data = ck_alloc(len);
   afl->extras[afl->extras_cnt].len = len;
+  afl->extras[afl->extras_cnt].rank = 0;
+  afl->extras[afl->extras_cnt].top = 0;
   memcpy(afl->extras[afl->extras_cnt].data, mem, len);
   afl->extras_cnt++;
 
@@ -427,54 +532,100 @@ void deunicode_extras(afl_state_t *afl) {
 
   qsort(afl->extras, afl->extras_cnt, sizeof(struct extra_data),
         compare_extras_len);
+  index_extras(afl);
 }
 
 /* Removes duplicates from the loaded extras. This can happen if multiple files
-   are loaded */
+   are loaded, or with dict2file, which writes the tokens of every compiled
+   module. Their ranks add up. Sorting by contents puts the duplicates next to
+   each other, which keeps this O(n log n) for dictionaries of 50k tokens. */
 
 void dedup_extras(afl_state_t *afl) {
   if (afl->extras_cnt < 2) return;
 
-  u32 i, j, orig_cnt = afl->extras_cnt;
+  u32 i, j = 0, orig_cnt = afl->extras_cnt;
 
-  for (i = 0; i < afl->extras_cnt - 1; ++i) {
-    for (j = i + 1; j < afl->extras_cnt; ++j) {
-    restart_dedup:
-
-      // if the goto was used we could be at the end of the list
-      if (j >= afl->extras_cnt || afl->extras[i].len != afl->extras[j].len)
-        break;
-
-      if (memcmp(afl->extras[i].data, afl->extras[j].data,
-                 afl->extras[i].len) == 0) {
-        ck_free(afl->extras[j].data);
-        if (j + 1 < afl->extras_cnt)  // not at the end of the list?
-          memmove((char *)&afl->extras[j], (char *)&afl->extras[j + 1],
-                  (afl->extras_cnt - j - 1) * sizeof(struct extra_data));
-        --afl->extras_cnt;
-        goto restart_dedup;  // restart if several duplicates are in a row
+  qsort(afl->extras, afl->extras_cnt, sizeof(struct extra_data),
+        compare_extras_data);
+
+  for (i = 1; i < afl->extras_cnt; ++i) {
+    if (afl->extras[i].len == afl->extras[j].len &&
+        !memcmp(afl->extras[i].data, afl->extras[j].data,
+                afl->extras[i].len)) {
+      if (afl->extras[i].rank > UINT32_MAX - afl->extras[j].rank) {
+        afl->extras[j].rank = UINT32_MAX;
+
+      } else {
+        afl->extras[j].rank += afl->extras[i].rank;
       }
+
+      ck_free(afl->extras[i].data);
+      continue;
     }
+
+    afl->extras[++j] = afl->extras[i];
   }
 
+  afl->extras_cnt = j + 1;
+
   if (afl->extras_cnt != orig_cnt)
     afl->extras = afl_realloc_exact(
         (void **)&afl->extras, afl->extras_cnt * sizeof(struct extra_data));
+
+  index_extras(afl);
 }
 
-/* Adds a new extra / dict entry. */
-void add_extra(afl_state_t *afl, u8 *mem, u32 len) {
-  u32 i, found = 0;
+/* With a ranked dictionary, as dict2file writes it, the deterministic stages
+   use the AFL_MAX_DET_EXTRAS tokens of the highest rank instead of a random
+   choice, and rand_extra() makes half of the havoc picks among them. Of equal
+   ranks the shorter tokens go first. Called again whenever the extras are
+   sorted anew. */
+
+void rank_extras(afl_state_t *afl) {
+  u32 i, n, min, ranked = 0;
+  u32 *ranks;
+
+  afl->extras_top_cnt = 0;
+
+  for (i = 0; i < afl->extras_cnt; ++i) {
+    afl->extras[i].top = 0;
+    if (afl->extras[i].rank) { ++ranked; }
+  }
+
+  if (!ranked) { return; }
+
+  n = MIN(afl->extras_cnt, afl->max_det_extras);
+  ranks = ck_alloc(afl->extras_cnt * sizeof(u32));
+
+  for (i = 0; i < afl->extras_cnt; ++i) {
+    ranks[i] = afl->extras[i].rank;
+  }
+
+  qsort(ranks, afl->extras_cnt, sizeof(u32), compare_rank_d);
+  min = ranks[n - 1];
+  ck_free(ranks);
+
+  afl->extras_top = afl_realloc((void **)&afl->extras_top, n * sizeof(u32));
+  if (unlikely(!afl->extras_top)) { PFATAL("alloc"); }
 
-  for (i = 0; i < afl->extras_cnt; i++) {
-    if (afl->extras[i].len == len) {
-      if (memcmp(afl->extras[i].data, mem, len) == 0) return;
-      found = 1;
+  for (i = 0; i < afl->extras_cnt; ++i) {
+    if (afl->extras[i].rank > min) {
+      afl->extras[i].top = 1;
+      afl->extras_top[afl->extras_top_cnt++] = i;
+    }
+  }
 
-    } else {
-      if (found) break;
+  for (i = 0; i < afl->extras_cnt && afl->extras_top_cnt < n; ++i) {
+    if (afl->extras[i].rank == min) {
+      afl->extras[i].top = 1;
+      afl->extras_top[afl->extras_top_cnt++] = i;
     }
   }
+}
+
+/* Adds a new extra / dict entry. */
+void add_extra(afl_state_t *afl, u8 *mem, u32 len) {
+  if (find_extra(afl, mem, len, 0)) { return; }
 
   if (len > MAX_DICT_FILE) {
     u8 val_bufs[2][STRINGIFY_VAL_SIZE_MAX];
@@ -491,6 +642,81 @@ void add_extra(afl_state_t *afl, u8 *mem, u32 len) {
 
   qsort(afl->extras, afl->extras_cnt, sizeof(struct extra_data),
         compare_extras_len);
+  index_extras(afl);
+
+  if (afl->extras_top_cnt) { rank_extras(afl); }
+}
+
+/* Adds the tokens of an autodictionary, each a length byte and the token,
+   with one sort of the extras instead of one per token. Returns the number
+   of tokens in dict. */
+
+u32 add_extras_autodict(afl_state_t *afl, u8 *dict, u32 len) {
+  u32 offset = 0, count = 0, old_cnt = afl->extras_cnt;
+
+  while (offset < len && (u8)dict[offset] + offset < len) {
+    u8 *mem = dict + offset + 1;
+    u32 tlen = dict[offset];
+
+    offset += 1 + tlen;
+    ++count;
+
+    /* the index only covers the extras there were before */
+    if (old_cnt && find_extra(afl, mem, tlen, 0)) { continue; }
+
+    if (tlen > MAX_DICT_FILE) {
+      WARNF("Extra '%.*s' is too big (limit is %u), skipping it!", (int)tlen,
+            mem, MAX_DICT_FILE);
+      continue;
+
+    } else if (tlen > 32) {
+      WARNF("Extra '%.*s' is pretty large, consider trimming.", (int)tlen,
+            mem);
+    }
+
+    add_extra_nocheck(afl, mem, tlen);
+  }
+
+  if (afl->extras_cnt != old_cnt) {
+    qsort(afl->extras, afl->extras_cnt, sizeof(struct extra_data),
+          compare_extras_len);
+    index_extras(afl);
+
+    if (afl->extras_top_cnt) { rank_extras(afl); }
+  }
+
+  return count;
+}
+
+struct note_autodict {
+  afl_state_t *afl;
+  u8           found;
+};
+
+static void note_autodict(void *ptr, u32 type, u32 value, u32 flags, u8 *data,
+                          u32 len) {
+  struct note_autodict *n = ptr;
+
+  (void)flags;
+
+  if (type == MAP_NOTE_DICT && value <= len) {
+    u32 count = add_extras_autodict(n->afl, data, value);
+    if (!be_quiet) {
+      ACTF("Loaded %u autodictionary entries from the binary", count);
+    }
+
+    n->found = 1;
+  }
+}
+
+/* Loads the autodictionary an LTO binary keeps in an ELF note, so the
+   forkserver does not have to send it. Returns 1 if there was one. */
+
+u8 load_note_autodict(afl_state_t *afl, u8 *fn) {
+  struct note_autodict n = {afl, 0};
+
+  elf_map_notes(fn, note_autodict, &n);
+  return n.found;
 }
 
 /* Maybe add automatic extra. */
@@ -535,48 +761,66 @@ void maybe_add_auto(afl_state_t *afl, u8 *mem, u32 len) {
   }
 
   /* Reject anything that matches existing extras. Do a case-insensitive
-     match. We optimize by exploiting the fact that extras[] are sorted
-     by size. */
+     match, through the index. */
 
-  for (i = 0; i < afl->extras_cnt; ++i) {
-    if (afl->extras[i].len >= len) { break; }
-  }
+  if (find_extra(afl, mem, len, 1)) { return; }
 
-  for (; i < afl->extras_cnt && afl->extras[i].len == len; ++i) {
-    if (!memcmp_nocase(afl->extras[i].data, mem, len)) { return; }
-  }
+  /* Last but not least, check afl->a_extras[] for matches. */
+
+  struct token_index *ix = &afl->a_extras_idx;
+  u32                 h = token_hash(mem, len), s;
 
-  /* Last but not least, check afl->a_extras[] for matches. There are no
-     guarantees of a particular sort order. */
+  if (unlikely(!ix->head)) { token_index_reset(ix, MAX_AUTO_EXTRAS); }
 
   afl->auto_changed = 1;
+  afl->a_extras_dirty = 1;
 
-  for (i = 0; i < afl->a_extras_cnt; ++i) {
-    if (afl->a_extras[i].len == len &&
-        !memcmp_nocase(afl->a_extras[i].data, mem, len)) {
-      afl->a_extras[i].hit_cnt++;
-      goto sort_a_extras;
+  for (s = ix->head[h & ix->mask]; s; s = ix->next[s - 1]) {
+    if (afl->a_extras[s - 1].len == len &&
+        !memcmp_nocase(afl->a_extras[s - 1].data, mem, len)) {
+      afl->a_extras[s - 1].hit_cnt++;
+      return;
     }
   }
 
   /* At this point, looks like we're dealing with a new entry. So, let's
      append it if we have room. Otherwise, let's randomly evict some other
-     entry from the bottom half of the list. */
+     entry from the bottom half of the list, by use count. That is the order
+     of the last sort; only if the victim has since gained more hits than the
+     last token of the top half is it worth sorting anew first. */
 
   if (afl->a_extras_cnt < MAX_AUTO_EXTRAS) {
-    memcpy(afl->a_extras[afl->a_extras_cnt].data, mem, len);
-    afl->a_extras[afl->a_extras_cnt].len = len;
-    ++afl->a_extras_cnt;
+    i = afl->a_extras_cnt++;
 
   } else {
     i = MAX_AUTO_EXTRAS / 2 + rand_below(afl, (MAX_AUTO_EXTRAS + 1) / 2);
 
-    memcpy(afl->a_extras[i].data, mem, len);
-    afl->a_extras[i].len = len;
+    if (afl->a_extras[i].hit_cnt >
+        afl->a_extras[MAX_AUTO_EXTRAS / 2 - 1].hit_cnt) {
+      sort_auto_extras(afl);
+      afl->a_extras_dirty = 1;
+    }
+
+    token_index_del(ix, i, token_hash(afl->a_extras[i].data,
+                                      afl->a_extras[i].len));
     afl->a_extras[i].hit_cnt = 0;
   }
 
-sort_a_extras:
+  memcpy(afl->a_extras[i].data, mem, len);
+  afl->a_extras[i].len = len;
+  token_index_add(ix, i, h);
+}
+
+/* The auto extras are kept sorted by use count, descending, and the top
+   USE_AUTO_EXTRAS of them by size, for the deterministic stages. As one
+   token's count changes at a time, maybe_add_auto() only marks them for
+   sorting, which then happens here before deterministic use or saving. */
+
+void sort_auto_extras(afl_state_t *afl) {
+  u32 i;
+
+  if (!afl->a_extras_dirty) { return; }
+  afl->a_extras_dirty = 0;
 
   /* First, sort all auto extras by use count, descending order. */
 
@@ -587,6 +831,13 @@ sort_a_extras:
 
   qsort(afl->a_extras, MIN((u32)USE_AUTO_EXTRAS, afl->a_extras_cnt),
         sizeof(struct auto_extra_data), compare_auto_extras_len);
+
+  token_index_reset(&afl->a_extras_idx, MAX_AUTO_EXTRAS);
+
+  for (i = 0; i < afl->a_extras_cnt; ++i) {
+    token_index_add(&afl->a_extras_idx, i,
+                    token_hash(afl->a_extras[i].data, afl->a_extras[i].len));
+  }
 }
 
 /* Save automatically generated extras. */
@@ -597,6 +848,8 @@ void save_auto(afl_state_t *afl) {
   if (!afl->auto_changed) { return; }
   afl->auto_changed = 0;
 
+  sort_auto_extras(afl);
+
   for (i = 0; i < MIN((u32)USE_AUTO_EXTRAS, afl->a_extras_cnt); ++i) {
     u8 *fn =
         alloc_printf("%s/queue/.state/auto_extras/auto_%06u", afl->out_dir, i);
@@ -626,7 +879,11 @@ void load_auto(afl_state_t *afl) {
     fd = open(fn, O_RDONLY);
 
     if (fd < 0) {
-      if (errno != ENOENT) { PFATAL("Unable to open '%s'", fn); }
+      /* ENOTDIR: -i is a tar file */
+      if (errno != ENOENT && errno != ENOTDIR) {
+        PFATAL("Unable to open '%s'", fn);
+      }
+
       ck_free(fn);
       break;
     }
@@ -664,4 +921,9 @@ void destroy_extras(afl_state_t *afl) {
   }
 
   afl_free(afl->extras);
+  afl_free(afl->extras_top);
+  afl_free(afl->extras_idx.head);
+  afl_free(afl->extras_idx.next);
+  afl_free(afl->a_extras_idx.head);
+  afl_free(afl->a_extras_idx.next);
 }
@@ -0,0 +1,160 @@
+/*
+ * This implements AFL_FIELD_HINTS: the harness tells afl-fuzz where the
+ * fields of its input are with __AFL_HINT_FIELD() (see include/fshints.h),
+ * in one extra run per queue entry. Trimming then tries to drop whole
+ * fields, and havoc now and then mutates a field as its type says instead
+ * of a random spot.
+ *
+ */
+
+#include "afl-fuzz.h"
+#include "fshints.h"
+
+static int hint_cmp(const void *a, const void *b) {
+  const struct fs_hint *x = a, *y = b;
+
+  if (x->off != y->off) { return x->off < y->off ? -1 : 1; }
+  if (x->len != y->len) { return x->len > y->len ? -1 : 1; }
+  return 0;
+}
+
+/* Run buf, the input of q, once with hint recording on and keep the hints
+   that fit into it. Nothing happens if q already has its hints. */
+
+void hints_get(afl_state_t *afl, struct queue_entry *q, u8 *buf) {
+  struct fs_hints *h;
+  u32              cnt, i;
+
+  if (!afl->shm_hints || q->hints_done) { return; }
+
+  h = (struct fs_hints *)afl->shm_hints->map;
+  q->hints_done = 1;
+
+  afl->stage_name = "field hints";
+  afl->stage_short = "hints";
+  afl->stage_cur = 0;
+  afl->stage_max = 1;
+
+  h->cnt = 0;
+  h->on = 1;
+  (void)common_fuzz_stuff(afl, buf, q->len);
+  h->on = 0;
+
+  cnt = MIN(h->cnt, (u32)FS_HINTS_MAX);
+  if (!cnt) { return; }
+
+  q->hints = ck_alloc(cnt * sizeof(struct fs_hint));
+
+  for (i = 0; i < cnt; ++i) {
+    struct fs_hint *s = &h->hint[i];
+
+    if (s->off >= q->len || !s->len || s->type >= FS_HINT_TYPES) { continue; }
+
+    q->hints[q->hints_cnt] = *s;
+    q->hints[q->hints_cnt].len = MIN(s->len, q->len - s->off);
+    ++q->hints_cnt;
+  }
+
+  qsort(q->hints, q->hints_cnt, sizeof(struct fs_hint), hint_cmp);
+}
+
+/* Forget the hints of q, e.g. because its input changed. */
+
+void hints_free(struct queue_entry *q) {
+  ck_free(q->hints);
+  q->hints = NULL;
+  q->hints_cnt = 0;
+  q->hints_done = 0;
+}
+
+static u64 hint_read(u8 *p, u32 w, u8 be) {
+  u64 v = 0;
+  u32 i;
+
+  for (i = 0; i < w; ++i) {
+    v |= (u64)p[be ? w - 1 - i : i] << (i << 3);
+  }
+
+  return v;
+}
+
+static void hint_write(u8 *p, u32 w, u8 be, u64 v) {
+  u32 i;
+
+  for (i = 0; i < w; ++i) {
+    p[be ? w - 1 - i : i] = v >> (i << 3);
+  }
+}
+
+/* Mutate a random field of q in buf, the havoc copy of its input that is
+   now len bytes long. Integers get arithmetics and interesting values,
+   lengths also the number of bytes after them, the other fields new
+   contents. Magic values and checksums are left alone. Returns how many
+   bytes changed from *off on, 0 if none. */
+
+u32 hints_havoc(afl_state_t *afl, struct queue_entry *q, u8 *buf, u32 len,
+                u32 *off) {
+  struct fs_hint *h;
+  u32             i;
+
+  if (!q->hints_cnt) { return 0; }
+
+  h = &q->hints[rand_below(afl, q->hints_cnt)];
+
+  if (h->off + h->len > len || h->type == FS_HINT_MAGIC ||
+      h->type == FS_HINT_CKSUM) {
+    return 0;
+  }
+
+  u8 *p = buf + h->off;
+  u8  be = h->type == FS_HINT_INT_BE || h->type == FS_HINT_LEN_BE;
+  u8  is_len = h->type == FS_HINT_LEN || h->type == FS_HINT_LEN_BE;
+  u8  text = h->type == FS_HINT_TEXT;
+
+  if ((be || is_len || h->type == FS_HINT_INT) &&
+      (h->len == 1 || h->len == 2 || h->len == 4 || h->len == 8)) {
+    u64 v = hint_read(p, h->len, be);
+
+    switch (rand_below(afl, is_len ? 4 : 3)) {
+      case 0:
+        v += 1 + rand_below(afl, ARITH_MAX);
+        break;
+      case 1:
+        v -= 1 + rand_below(afl, ARITH_MAX);
+        break;
+      case 2:
+        v = (u64)(s64)interesting_32[rand_below(
+            afl, sizeof(interesting_32) / sizeof(interesting_32[0]))];
+        break;
+      default:
+        v = len - h->off - h->len + rand_below(afl, 3) - 1;
+        break;
+    }
+
+    hint_write(p, h->len, be, v);
+
+  } else {
+    /* blobs, text, and integers of odd widths */
+
+    switch (rand_below(afl, 3)) {
+      case 0:
+        for (i = 0; i < h->len; ++i) {
+          p[i] = text ? 32 + rand_below(afl, 95) : rand_below(afl, 256);
+        }
+
+        break;
+      case 1:
+        memset(p,
+               text ? 32 + rand_below(afl, 95)
+                    : (u8)interesting_8[rand_below(afl, sizeof(interesting_8))],
+               h->len);
+        break;
+      default:
+        p[rand_below(afl, h->len)] ^= 1 + rand_below(afl, 255);
+        break;
+    }
+  }
+
+  *off = h->off;
+  return h->len;
+}
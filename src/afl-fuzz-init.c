@@ -28,6 +28,14 @@
 #include <limits.h>
 #include <string.h>
 #include "cmplog.h"
+#include "fsbatch.h"
+#include "fshints.h"
+#include "fsvirgin.h"
+#include "fsdoorbell.h"
+
+#ifdef __linux__
+  #include <elf.h>
+#endif
 
 #ifdef HAVE_AFFINITY
 
@@ -100,13 +108,63 @@ static u8 bind_cpu(afl_state_t *afl, s32 cpuid) {
   #endif
 }
 
+  #ifdef __linux__
+
+/* Fill sib with the SMT siblings of cpu, itself included, as listed in
+   sysfs. Returns how many there are, 1 if the topology is unknown. */
+
+u32 cpu_siblings(s32 cpu, s32 *sib, u32 max) {
+  u8    fn[PATH_MAX], tmp[MAX_LINE];
+  char *p, *end;
+  FILE *f;
+  u32   n = 0;
+  s32   a, b;
+
+  snprintf(fn, PATH_MAX,
+           "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+
+  if ((f = fopen(fn, "r"))) {
+    if (fgets(tmp, MAX_LINE, f)) {
+      p = (char *)tmp;
+
+      while (n < max) {
+        a = b = strtol(p, &end, 10);
+        if (end == p) { break; }
+
+        if (*end == '-') {
+          p = end + 1;
+          b = strtol(p, &end, 10);
+        }
+
+        for (; a <= b && n < max; ++a) {
+          sib[n++] = a;
+        }
+
+        if (*end != ',') { break; }
+        p = end + 1;
+      }
+    }
+
+    fclose(f);
+  }
+
+  if (!n) { sib[n++] = cpu; }
+  return n;
+}
+
+  #endif
+
 /* Build a list of processes bound to specific cores. Returns -1 if nothing
    can be found. Assumes an upper bound of 4k CPUs. */
 
 void bind_to_free_cpu(afl_state_t *afl) {
   u8  cpu_used[4096] = {0};
   u8  lockfile[PATH_MAX] = "";
-  s32 i;
+  s32 i, pass, found = 0;
+  #ifdef __linux__
+  s32 sib[8];
+  u32 sib_cnt = 1, j;
+  #endif
 
   if (afl->afl_env.afl_no_affinity && !afl->afl_env.afl_try_affinity) {
     if (afl->cpu_to_bind != -1) {
@@ -351,35 +409,67 @@ void bind_to_free_cpu(afl_state_t *afl) {
         "For this platform we do not have free CPU binding code yet. If possible, please supply a PR to https://github.com/AFLplusplus/AFLplusplus"
   #endif
 
+  /* First look for a core none of whose SMT siblings are busy, two
+     instances on the siblings of one core share its caches and execution
+     units. Then take any free CPU. */
+
+  for (pass = 0; pass < 2 && !found; ++pass) {
   #if !defined(__aarch64__) && !defined(__arm__) && !defined(__arm64__)
 
-  for (i = 0; i < afl->cpu_core_count; i++) {
+    for (i = 0; i < afl->cpu_core_count; i++) {
   #else
 
-  /* many ARM devices have performance and efficiency cores, the slower
-     efficiency cores seem to always come first */
+    /* many ARM devices have performance and efficiency cores, the slower
+       efficiency cores seem to always come first */
 
-  for (i = afl->cpu_core_count - 1; i > -1; i--) {
+    for (i = afl->cpu_core_count - 1; i > -1; i--) {
   #endif
 
-    if (cpu_used[i]) { continue; }
+      if (cpu_used[i]) { continue; }
+
+  #ifdef __linux__
+      sib_cnt = cpu_siblings(i, sib, sizeof(sib) / sizeof(sib[0]));
+
+      if (!pass) {
+        for (j = 0; j < sib_cnt; ++j) {
+          if (sib[j] < (s32)sizeof(cpu_used) && cpu_used[sib[j]]) { break; }
+        }
+
+        if (j < sib_cnt) { continue; }
+      }
+
+  #endif
 
-    OKF("Found a free CPU core, try binding to #%u.", i);
+      OKF("Found a free %s, try binding to #%u.",
+          pass ? "CPU thread" : "CPU core", i);
 
-    if (bind_cpu(afl, i)) {
+      if (bind_cpu(afl, i)) {
   #ifdef __linux__
-      if (afl->fsrv.nyx_mode) { afl->fsrv.nyx_bind_cpu_id = i; }
+        if (afl->fsrv.nyx_mode) { afl->fsrv.nyx_bind_cpu_id = i; }
+
+        /* pipelined runs overlap with us, put the forkservers on a sibling
+           which shares our caches */
+
+        if (!pass && afl->afl_env.afl_pipeline && sib_cnt > 1) {
+          afl->fsrv.cpu_bind = sib[0] == i ? sib[1] : sib[0];
+          OKF("AFL_PIPELINE: the target runs on the SMT sibling #%d.",
+              afl->fsrv.cpu_bind);
+        }
+
   #endif
-      /* Success :) */
-      break;
-    }
+        /* Success :) */
+        found = 1;
+        break;
+      }
 
-    WARNF("setaffinity failed to CPU %d, trying next CPU", i);
+      WARNF("setaffinity failed to CPU %d, trying next CPU", i);
+      cpu_used[i] = 1;
+    }
   }
 
   if (lockfile[0]) unlink(lockfile);
 
-  if (i == afl->cpu_core_count || i == -1) {
+  if (!found) {
     SAYF("\n" cLRD "[-] " cRST
          "Uh-oh, looks like all %d CPU cores on your system are allocated to\n"
          "    other instances of afl-fuzz (or similar CPU-locked tasks). "
@@ -410,9 +500,41 @@ static void shuffle_ptrs(afl_state_t *afl, void **ptrs, u32 cnt) {
   }
 }
 
+/* Run the members appended to the tar file of foreign sync iter since the
+   last call, straight from the mapping. */
+
+static void read_foreign_pack(afl_state_t *afl, u32 iter, u8 *foreign_name) {
+  struct foreign_sync *f = &afl->foreign_syncs[iter];
+  u8                  *mem, fault;
+  u32                  len;
+
+  pack_update(f->pack);
+  if (f->pack_done == f->pack->cnt) { return; }
+
+  snprintf(afl->stage_name_buf, STAGE_BUF_SIZE, "foreign sync %u", iter);
+
+  afl->stage_name = afl->stage_name_buf;
+  afl->stage_cur = 0;
+  afl->stage_max = 0;
+
+  for (; f->pack_done < f->pack->cnt && !afl->stop_soon; ++f->pack_done) {
+    struct pack_entry *e = &f->pack->ent[f->pack_done];
+
+    if (!e->len) { continue; }
+
+    mem = f->pack->map + e->off;
+    len = write_to_testcase(afl, (void **)&mem, e->len, 1);
+    fault = fuzz_run_target(afl, &afl->fsrv, afl->fsrv.exec_tmout);
+    afl->syncing_party = foreign_name;
+    afl->queued_imported += save_if_interesting(afl, mem, len, fault);
+    afl->syncing_party = 0;
+  }
+}
+
 /* Read all testcases from foreign input directories, then queue them for
    testing. Called at startup and at sync intervals.
-   Does not descend into subdirectories! */
+   Does not descend into subdirectories! A tar file instead of a directory
+   is only read where the last call stopped. */
 
 void read_foreign_testcases(afl_state_t *afl, int first) {
   if (!afl->foreign_sync_cnt) return;
@@ -445,6 +567,15 @@ void read_foreign_testcases(afl_state_t *afl, int first) {
         snprintf(foreign_name, sizeof(foreign_name), "%s_%u", name, iter);
       }
 
+      if (!afl->foreign_syncs[iter].pack) {
+        afl->foreign_syncs[iter].pack = pack_open(afl->foreign_syncs[iter].dir);
+      }
+
+      if (afl->foreign_syncs[iter].pack) {
+        read_foreign_pack(afl, iter, foreign_name);
+        continue;
+      }
+
       /* We do not use sorting yet and do a more expensive mtime check instead.
          a mtimesort() implementation would be better though. */
 
@@ -502,12 +633,13 @@ void read_foreign_testcases(afl_state_t *afl, int first) {
           continue;
         }
 
-        if (st.st_size > MAX_FILE) {
+        if (st.st_size > afl->max_input) {
           if (first) {
-            WARNF(
-                "Test case '%s' is too big (%s, limit is %s), skipping", fn2,
-                stringify_mem_size(val_buf[0], sizeof(val_buf[0]), st.st_size),
-                stringify_mem_size(val_buf[1], sizeof(val_buf[1]), MAX_FILE));
+            WARNF("Test case '%s' is too big (%s, limit is %s), skipping", fn2,
+                  stringify_mem_size(val_buf[0], sizeof(val_buf[0]),
+                                     st.st_size),
+                  stringify_mem_size(val_buf[1], sizeof(val_buf[1]),
+                                     afl->max_input));
           }
 
           ck_free(fn2);
@@ -576,6 +708,15 @@ void read_testcases(afl_state_t *afl, u8 *directory) {
     }
 
     dir = afl->in_dir;
+    queue_state_load(afl);
+
+    /* a session resumed in place is not streamed, _resume goes away */
+
+    if (!afl->in_place_resume &&
+        ((afl->in_pack = pack_open(dir)) || afl->afl_env.afl_seed_batch)) {
+      seed_stream_open(afl, dir, subdirs);
+      goto all_read;
+    }
   }
 
   ACTF("Scanning '%s'...", dir);
@@ -627,12 +768,19 @@ void read_testcases(afl_state_t *afl, u8 *directory) {
                nl[i]->d_name);
       u8 *fn2 = alloc_printf("%s/%s", dir, nl[i]->d_name);
 
-      u8 passed_det = 0;
+      u8 passed_det = 0, old_flags = queue_state_old(afl, nl[i]->d_name);
 
       if (lstat(fn2, &st) || access(fn2, R_OK)) {
         PFATAL("Unable to access '%s'", fn2);
       }
 
+      /* the queue of a session with AFL_SEED_BATCH has symlinks to seeds */
+
+      if (S_ISLNK(st.st_mode)) {
+        struct stat lst;
+        if (!stat(fn2, &lst) && S_ISREG(lst.st_mode)) { st = lst; }
+      }
+
       /* obviously we want to skip "descending" into . and .. directories,
          however it is a good idea to skip also directories that start with
          a dot */
@@ -650,21 +798,29 @@ void read_testcases(afl_state_t *afl, u8 *directory) {
         goto next_entry;
       }
 
-      if (st.st_size > MAX_FILE) {
+      if (st.st_size > afl->max_input) {
         WARNF("Test case '%s' is too big (%s, limit is %s), partial reading",
               fn2,
               stringify_mem_size(val_buf[0], sizeof(val_buf[0]), st.st_size),
-              stringify_mem_size(val_buf[1], sizeof(val_buf[1]), MAX_FILE));
+              stringify_mem_size(val_buf[1], sizeof(val_buf[1]),
+                                 afl->max_input));
       }
 
       /* Check for metadata that indicates that deterministic fuzzing
          is complete for this entry. We don't want to repeat deterministic
          fuzzing when resuming aborted scans, because it would be pointless
-         and probably very time-consuming. */
+         and probably very time-consuming. Sessions without the .state flags
+         file have marker files. */
+
+      if (afl->state_flags_old) {
+        passed_det = !!(old_flags & STATE_DET_DONE);
 
-      if (!access(dfn, F_OK)) { passed_det = 1; }
+      } else if (!access(dfn, F_OK)) {
+        passed_det = 1;
+      }
 
-      add_to_queue(afl, fn2, st.st_size >= MAX_FILE ? MAX_FILE : st.st_size,
+      add_to_queue(afl, fn2,
+                   st.st_size >= afl->max_input ? afl->max_input : st.st_size,
                    passed_det);
 
       if (unlikely(afl->shm.cmplog_mode)) {
@@ -697,6 +853,8 @@ void read_testcases(afl_state_t *afl, u8 *directory) {
 
   free(nl); /* not tracked */
 
+all_read:
+
   if (!afl->queued_items && directory == NULL) {
     SAYF("\n" cLRD "[-] " cRST
          "Looks like there are no valid test cases in the input directory! The "
@@ -723,13 +881,573 @@ void read_testcases(afl_state_t *afl, u8 *directory) {
   afl->queued_at_start = afl->queued_items;
 }
 
+/* Drop the calibration index of the resumed session. */
+
+static void cal_index_drop(afl_state_t *afl) {
+  if (afl->cal_index_old) {
+    munmap(afl->cal_index_old, afl->cal_index_old_len);
+    afl->cal_index_old = NULL;
+  }
+
+  if (afl->cal_index_old_fd >= 0) {
+    close(afl->cal_index_old_fd);
+    afl->cal_index_old_fd = -1;
+  }
+
+  ck_free(afl->cal_index_off);
+  afl->cal_index_off = NULL;
+}
+
+/* First slot for an input hash in the lookup table of the old index. */
+
+static inline u64 *cal_index_slot(afl_state_t *afl, u64 hash) {
+  return &afl->cal_index_off[hash & afl->cal_index_mask];
+}
+
+/* Enter the record at pos, replacing an older one for the same input. */
+
+static void cal_index_insert(afl_state_t *afl, u64 pos) {
+  struct cal_index_rec *rec =
+      (struct cal_index_rec *)(afl->cal_index_old + pos);
+  u64 *slot;
+
+  for (slot = cal_index_slot(afl, rec->hash); *slot;
+       slot = &afl->cal_index_off[(slot - afl->cal_index_off + 1) &
+                                  afl->cal_index_mask]) {
+    struct cal_index_rec *old =
+        (struct cal_index_rec *)(afl->cal_index_old + *slot - 1);
+
+    if (old->hash == rec->hash && old->len == rec->len) { break; }
+  }
+
+  *slot = pos + 1;
+}
+
+/* The record of the resumed session for entry q if it was calibrated with
+   the content buf, NULL otherwise. */
+
+static struct cal_index_rec *cal_index_find(afl_state_t *afl,
+                                            struct queue_entry *q, u8 *buf) {
+  u64 hash, *slot;
+
+  if (!afl->cal_index_off) { return NULL; }
+
+  hash = hash64(buf, q->len, HASH_CONST);
+
+  for (slot = cal_index_slot(afl, hash); *slot;
+       slot = &afl->cal_index_off[(slot - afl->cal_index_off + 1) &
+                                  afl->cal_index_mask]) {
+    struct cal_index_rec *rec =
+        (struct cal_index_rec *)(afl->cal_index_old + *slot - 1);
+
+    if (rec->hash == hash && rec->len == q->len) { return rec; }
+  }
+
+  return NULL;
+}
+
+/* Run a few entries of the calibration index that showed no variable
+   behavior once and see if they still take the same path. Returns 0 if too
+   many do not, the target changed then. */
+
+static u8 cal_index_check(afl_state_t *afl) {
+  u32 step = MAX(afl->queued_items / CAL_INDEX_SAMPLES, 1U), runs = 0,
+      diffs = 0, id;
+  u32 use_tmout = MAX(afl->fsrv.exec_tmout + CAL_TMOUT_ADD,
+                      afl->fsrv.exec_tmout * CAL_TMOUT_PERC / 100);
+
+  fuzz_fsrv_start(afl);
+
+  for (id = step / 2; id < afl->queued_items && runs < CAL_INDEX_SAMPLES;
+       id += step) {
+    struct queue_entry   *q = afl->queue_buf[id];
+    struct cal_index_rec *rec;
+
+    if (!q || q->disabled || !q->len || q->len > MAX_FILE) { continue; }
+
+    u8 *mem = afl_realloc(AFL_BUF_PARAM(in), q->len);
+    s32 fd = open(q->fname, O_RDONLY);
+    if (fd < 0) { PFATAL("Unable to open '%s'", q->fname); }
+    ck_read(fd, mem, q->len, q->fname);
+    close(fd);
+
+    if (!(rec = cal_index_find(afl, q, mem)) || rec->var_behavior) {
+      continue;
+    }
+
+    (void)write_to_testcase(afl, (void **)&mem, q->len, 1);
+    u8 fault = fuzz_run_target(afl, &afl->fsrv, use_tmout);
+
+    if (afl->stop_soon) { return 0; }
+
+    classify_counts(&afl->fsrv);
+
+    ++runs;
+    if (fault != afl->crash_mode ||
+        hash_trace_bits(&afl->fsrv) != rec->exec_cksum) {
+      ++diffs;
+    }
+  }
+
+  if (!runs || diffs * 8 > runs) {
+    WARNF("%u of %u entries checked differ from the calibration index, "
+          "calibrating all entries.",
+          diffs, runs);
+    return 0;
+  }
+
+  return 1;
+}
+
+/* Map the calibration index of the session we resume and index its records
+   by input. A record cut short by an abort ends it. */
+
+static void cal_index_load(afl_state_t *afl) {
+  struct stat st;
+  u32        *hdr, recs = 0, pass;
+  u64         pos, var_off = 0;
+
+  if (afl->cal_index_old_fd < 0) { return; }
+
+  if (afl->non_instrumented_mode || afl->crash_mode ||
+      fstat(afl->cal_index_old_fd, &st) || st.st_size < 8) {
+    goto drop;
+  }
+
+  afl->cal_index_old_len = st.st_size;
+  afl->cal_index_old = mmap(NULL, afl->cal_index_old_len, PROT_READ,
+                            MAP_PRIVATE, afl->cal_index_old_fd, 0);
+
+  if (afl->cal_index_old == MAP_FAILED) {
+    afl->cal_index_old = NULL;
+    goto drop;
+  }
+
+  hdr = (u32 *)afl->cal_index_old;
+
+  if (hdr[0] != CAL_INDEX_MAGIC || hdr[1] != afl->fsrv.map_size) {
+    WARNF("The calibration index is for another map size, not using it.");
+    goto drop;
+  }
+
+  /* count the records first, then size the table for them */
+
+  for (pass = 0; pass < 2; ++pass) {
+    for (pos = 8;
+         pos + sizeof(struct cal_index_rec) <= afl->cal_index_old_len;) {
+      struct cal_index_rec *rec =
+          (struct cal_index_rec *)(afl->cal_index_old + pos);
+      u64 size = CAL_INDEX_REC_SIZE(rec->cnt);
+
+      if (rec->cnt > afl->fsrv.map_size ||
+          pos + size > afl->cal_index_old_len) {
+        break;
+      }
+
+      if (rec->id == CAL_INDEX_VAR) {
+        var_off = pos + 1;
+
+      } else if (pass) {
+        cal_index_insert(afl, pos);
+
+      } else {
+        ++recs;
+      }
+
+      pos += size;
+    }
+
+    if (!pass) {
+      afl->cal_index_mask = next_pow2(MAX(recs, afl->queued_items) * 2) - 1;
+      afl->cal_index_off = ck_alloc((afl->cal_index_mask + 1) * sizeof(u64));
+    }
+  }
+
+  if (!recs) { goto drop; }
+
+  ACTF("Checking the calibration index we start from...");
+
+  if (!cal_index_check(afl)) { goto drop; }
+
+  /* the variable bytes are ignored from the start, as calibration does */
+
+  if (var_off) {
+    struct cal_index_rec *rec =
+        (struct cal_index_rec *)(afl->cal_index_old + var_off - 1);
+    u32 *offs = (u32 *)(rec + 1), i;
+
+    for (i = 0; i < rec->cnt; ++i) {
+      if (offs[i] < afl->fsrv.map_size) { var_byte_ignore(afl, offs[i]); }
+    }
+
+    afl->var_byte_count = count_bytes(afl, afl->var_bytes);
+    if (afl->cal_index_fd >= 0) {
+      cal_index_write(afl, rec, CAL_INDEX_REC_SIZE(rec->cnt));
+    }
+  }
+
+  return;
+
+drop:
+
+  cal_index_drop(afl);
+}
+
+/* Take what the calibration index says about q instead of calibrating it,
+   if q did not change since. The stored map stands in for its trace. */
+
+static u8 cal_index_take(afl_state_t *afl, struct queue_entry *q, u8 *buf) {
+  struct cal_index_rec *rec = cal_index_find(afl, q, buf);
+  u32                   i;
+
+  if (!rec) { return 0; }
+
+  u32 *offs = (u32 *)(rec + 1);
+  u8  *vals = (u8 *)(offs + rec->cnt);
+
+  for (i = 0; i < rec->cnt; ++i) {
+    if (offs[i] >= afl->fsrv.map_size) { return 0; }
+  }
+
+  memset(afl->fsrv.trace_bits, 0, afl->fsrv.map_size);
+  afl->fsrv.reset_full_map = true;
+
+  for (i = 0; i < rec->cnt; ++i) {
+    afl->fsrv.trace_bits[offs[i]] = vals[i];
+    afl->virgin_bits[offs[i]] &= ~vals[i];
+  }
+
+  afl->bitmap_changed = 1;
+
+  q->exec_us = rec->exec_us;
+  q->exec_cksum = rec->exec_cksum;
+  q->bitmap_size = rec->bitmap_size;
+  q->focus_hits = count_focus_bytes(afl, afl->fsrv.trace_bits);
+  q->handicap = 0;
+  q->cal_failed = 0;
+
+  afl->total_bitmap_size += q->bitmap_size;
+  ++afl->total_bitmap_entries;
+  afl->total_cal_us += q->exec_us * CAL_CYCLES;
+  afl->total_cal_cycles += CAL_CYCLES;
+
+  update_bitmap_score(afl, q);
+
+  if (rec->has_new_cov && !q->has_new_cov) {
+    q->has_new_cov = 1;
+    ++afl->queued_with_cov;
+  }
+
+  if (rec->var_behavior && !q->var_behavior) {
+    mark_as_variable(afl, q);
+    ++afl->queued_variable;
+  }
+
+  if (afl->cal_index_fd >= 0) {
+    cal_index_write(afl, rec, CAL_INDEX_REC_SIZE(rec->cnt));
+  }
+
+  return 1;
+}
+
+/* Start the calibration index of this session. */
+
+static void cal_index_open(afl_state_t *afl) {
+  u32 hdr[2] = {CAL_INDEX_MAGIC, afl->fsrv.map_size};
+  u8 *fn;
+
+  if (afl->non_instrumented_mode) { return; }
+
+  fn = alloc_printf("%s/queue/.state/calibration", afl->out_dir);
+  afl->cal_index_fd =
+      open(fn, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, DEFAULT_PERMISSION);
+  if (afl->cal_index_fd < 0) { PFATAL("Unable to create '%s'", fn); }
+  ck_free(fn);
+
+  cal_index_write(afl, hdr, sizeof(hdr));
+}
+
+/* Hash the target binary into afl->sync_target. Peers and -B coverage
+   states only go by our maps if they are of the very same binary. */
+
+void hash_target(afl_state_t *afl) {
+  struct stat st;
+  s32         fd;
+
+  if (afl->non_instrumented_mode) { return; }
+
+  fd = open(afl->fsrv.target_path, O_RDONLY);
+
+  if (fd >= 0 && !fstat(fd, &st) && st.st_size) {
+    u8 *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (map != MAP_FAILED) {
+      afl->sync_target = hash64(map, st.st_size, HASH_CONST) | 1;
+      munmap(map, st.st_size);
+    }
+  }
+
+  if (fd >= 0) { close(fd); }
+}
+
+/* Start the sync manifest of this session with the entries queued so far.
+   This waits until the map size of the target is known. */
+
+void sync_manifest_open(afl_state_t *afl) {
+  struct sync_manifest_hdr hdr;
+  u8                      *fn;
+  u32                      id = 0, i;
+
+  if (!afl->sync_id) { return; }
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = SYNC_MANIFEST_MAGIC;
+  hdr.map_size = afl->fsrv.map_size;
+  hdr.session = get_cur_time_us() ^ ((u64)getpid() << 44);
+  hdr.target = afl->sync_target;
+
+  fn = alloc_printf("%s/queue/.state/sync_manifest", afl->out_dir);
+  afl->sync_manifest_fd =
+      open(fn, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, DEFAULT_PERMISSION);
+  if (afl->sync_manifest_fd < 0) { PFATAL("Unable to create '%s'", fn); }
+  ck_write(afl->sync_manifest_fd, &hdr, sizeof(hdr), fn);
+  ck_free(fn);
+
+  /* the names pivot_inputs() gave them */
+
+  for (i = 0; i < afl->queued_items; ++i) {
+    struct queue_entry *q = afl->queue_buf[i];
+
+    if (!q || q->disabled) { continue; }
+
+    sync_manifest_add(afl, id++, q->fname, q->len, NULL);
+  }
+}
+
+/* Open and mmap() a file of size bytes in the sync directory that the
+   instances share, and hold a shared flock() on it while we run. If no
+   other instance holds one, *first is set and the file starts over with
+   zeroes; the lock stays exclusive then, so the others wait until the
+   caller has set it up and takes the shared lock. Returns NULL if the file
+   has another size. */
+
+static u8 *shared_file_open(u8 *fn, u64 size, s32 *fd_out, u8 *first) {
+  struct stat st;
+  u8         *map;
+  s32         fd;
+
+  fd = open(fn, O_RDWR | O_CREAT, DEFAULT_PERMISSION);
+  if (fd < 0) { PFATAL("Unable to open '%s'", fn); }
+
+  *first = !flock(fd, LOCK_EX | LOCK_NB);
+
+  if (!*first && flock(fd, LOCK_SH)) { PFATAL("flock() of '%s' failed", fn); }
+
+  if (*first && (ftruncate(fd, 0) || ftruncate(fd, size))) {
+    PFATAL("Unable to resize '%s'", fn);
+  }
+
+  if (fstat(fd, &st)) { PFATAL("fstat() of '%s' failed", fn); }
+
+  if ((u64)st.st_size != size) {
+    close(fd);
+    return NULL;
+  }
+
+  map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) { PFATAL("mmap() of '%s' failed", fn); }
+
+  *fd_out = fd;
+  return map;
+}
+
+/* Attach to the virgin maps the instances of the sync directory share
+   (AFL_SHARED_VIRGIN), or start them over if nobody uses them, and add what
+   the dry run found. */
+
+void shared_virgin_open(afl_state_t *afl) {
+  struct shared_virgin_hdr *hdr;
+  u64                       size, i, words;
+  u64                      *shared, *local;
+  u32                       which;
+  u8                       *fn;
+  s32                       fd;
+  u8                        first;
+
+  if (!afl->afl_env.afl_shared_virgin) { return; }
+
+  if (!afl->sync_id || afl->non_instrumented_mode) {
+    WARNF("AFL_SHARED_VIRGIN needs -M or -S and an instrumented target.");
+    return;
+  }
+
+  size = SHARED_VIRGIN_OFF + 3 * (u64)afl->fsrv.map_size;
+  fn = alloc_printf("%s/.shared_virgin", afl->sync_dir);
+
+  afl->shared_virgin = shared_file_open(fn, size, &fd, &first);
+  hdr = (struct shared_virgin_hdr *)afl->shared_virgin;
+
+  if (first) {
+    memset(afl->shared_virgin + SHARED_VIRGIN_OFF, 255,
+           size - SHARED_VIRGIN_OFF);
+    hdr->magic = SHARED_VIRGIN_MAGIC;
+    hdr->map_size = afl->fsrv.map_size;
+    hdr->target = afl->sync_target;
+
+  } else if (!hdr || hdr->magic != SHARED_VIRGIN_MAGIC ||
+             hdr->map_size != afl->fsrv.map_size ||
+             hdr->target != afl->sync_target) {
+    WARNF("'%s' is in use with another target, not sharing.", fn);
+
+    if (hdr) {
+      munmap(afl->shared_virgin, size);
+      afl->shared_virgin = NULL;
+      close(fd);
+    }
+
+    ck_free(fn);
+    return;
+  }
+
+  /* what we have is known to the host from now on */
+
+  words = afl->fsrv.map_size >> 3;
+
+  for (which = SHARED_VIRGIN_BITS; which <= SHARED_VIRGIN_CRASH; ++which) {
+    shared = (u64 *)SHARED_VIRGIN_MAP(afl, which);
+    local = (u64 *)(which == SHARED_VIRGIN_BITS    ? afl->virgin_bits
+                    : which == SHARED_VIRGIN_TMOUT ? afl->virgin_tmout
+                                                   : afl->virgin_crash);
+
+    for (i = 0; i < words; ++i) {
+      if (~local[i]) {
+        __atomic_fetch_and(shared + i, local[i], __ATOMIC_RELAXED);
+      }
+    }
+  }
+
+  afl->virgin_host = ck_alloc(afl->fsrv.map_size);
+  memcpy(afl->virgin_host, SHARED_VIRGIN_MAP(afl, SHARED_VIRGIN_BITS),
+         afl->fsrv.map_size);
+
+  if (first && flock(fd, LOCK_SH)) { PFATAL("flock() of '%s' failed", fn); }
+
+  afl->shared_virgin_fd = fd;
+
+  OKF("Sharing the virgin maps of '%s'%s.", fn,
+      first ? ", started over" : "");
+  ck_free(fn);
+}
+
+/* Attach to the crash and hang signatures the instances of the sync
+   directory share (AFL_CRASH_DEDUP). */
+
+void crash_sigs_open(afl_state_t *afl) {
+  u8 *fn;
+  u8  first;
+
+  if (!afl->afl_env.afl_crash_dedup) { return; }
+
+  if (!afl->sync_id || afl->non_instrumented_mode) {
+    WARNF("AFL_CRASH_DEDUP needs -M or -S and an instrumented target.");
+    return;
+  }
+
+  fn = alloc_printf("%s/.crash_sigs", afl->sync_dir);
+
+  afl->crash_sigs = (u64 *)shared_file_open(
+      fn, CRASH_SIGS_SLOTS * sizeof(u64), &afl->crash_sigs_fd, &first);
+
+  if (!afl->crash_sigs) {
+    WARNF("'%s' has an unexpected size, not sharing.", fn);
+
+  } else if (first && flock(afl->crash_sigs_fd, LOCK_SH)) {
+    PFATAL("flock() of '%s' failed", fn);
+  }
+
+  ck_free(fn);
+}
+
+/* Calibrate the input queue on the worker forkservers, as many entries at
+   once as there are workers. Returns what calibrate_case() gave for each
+   entry, CAL_FROM_INDEX if it came from the calibration index and
+   CAL_PENDING if it is left to perform_dry_run(). */
+
+static u8 *dry_run_parallel(afl_state_t *afl) {
+  struct queue_entry *qs[FSRV_WORKERS_MAX];
+  u32                 idxs[FSRV_WORKERS_MAX], n = 0, idx, i;
+  u8                  res[FSRV_WORKERS_MAX];
+  u8                 *pre = ck_alloc(afl->queued_items);
+
+  memset(pre, CAL_PENDING, afl->queued_items);
+
+  ACTF("Calibrating %u entries on %u worker forkservers...", afl->queued_items,
+       afl->workers_cnt);
+
+  for (idx = 0; idx <= afl->queued_items; ++idx) {
+    if (idx < afl->queued_items) {
+      struct queue_entry *q = afl->queue_buf[idx];
+      struct fsrv_worker *w = &afl->workers[n];
+      s32                 fd;
+
+      if (!q || q->disabled || !q->len || q->len > MAX_FILE) { continue; }
+
+      fd = open(q->fname, O_RDONLY);
+      if (fd < 0) { PFATAL("Unable to open '%s'", q->fname); }
+
+      w->buf = afl_realloc((void **)&w->buf, q->len);
+      if (unlikely(!w->buf)) { PFATAL("alloc"); }
+      ck_read(fd, w->buf, q->len, q->fname);
+      w->len = q->len;
+
+      close(fd);
+
+      if (cal_index_take(afl, q, w->buf)) {
+        pre[idx] = CAL_FROM_INDEX;
+        continue;
+      }
+
+      qs[n] = q;
+      idxs[n++] = idx;
+
+      if (n < afl->workers_cnt) { continue; }
+    }
+
+    if (!n) { continue; }
+
+    calibrate_workers(afl, qs, res, n);
+    if (afl->stop_soon) { break; }
+
+    for (i = 0; i < n; ++i) {
+      pre[idxs[i]] = res[i];
+    }
+
+    n = 0;
+  }
+
+  return pre;
+}
+
 /* Perform dry run of all test cases to confirm that the app is working as
    expected. This is done only for the initial inputs, and only once. */
 
 void perform_dry_run(afl_state_t *afl) {
   struct queue_entry *q;
-  u32                 cal_failures = 0, idx;
-  u8                 *use_mem;
+  u32                 cal_failures = 0, from_index = 0, idx, read_len = 0;
+  u8                 *use_mem = NULL, *pre = NULL;
+
+  cal_index_open(afl);
+  cal_index_load(afl);
+
+  if (afl->stop_soon) { return; }
+
+  if (afl->workers_cnt && !afl->shm.cmplog_mode && !afl->crash_mode) {
+    pre = dry_run_parallel(afl);
+    if (afl->stop_soon) {
+      ck_free(pre);
+      return;
+    }
+  }
 
   for (idx = 0; idx < afl->queued_items; idx++) {
     q = afl->queue_buf[idx];
@@ -747,20 +1465,48 @@ void perform_dry_run(afl_state_t *afl) {
 
     u8 *fn = strrchr(q->fname, '/') + 1;
 
-    ACTF("Attempting dry run with '%s'...", fn);
+    if (pre && pre[idx] == CAL_FROM_INDEX) {
+      ++from_index;
+      continue;
 
-    fd = open(q->fname, O_RDONLY);
-    if (fd < 0) { PFATAL("Unable to open '%s'", q->fname); }
+    } else if (pre && pre[idx] != CAL_PENDING) {
+      ACTF("Attempting dry run with '%s'...", fn);
+      res = pre[idx];
 
-    u32 read_len = MIN(q->len, (u32)MAX_FILE);
-    use_mem = afl_realloc(AFL_BUF_PARAM(in), read_len);
-    ck_read(fd, use_mem, read_len, q->fname);
+    } else if (unlikely(q->len > MAX_FILE)) {
+      /* AFL_LARGE_INPUTS, run from the mapping of the file */
 
-    close(fd);
+      use_mem = queue_testcase_get(afl, q);
+      read_len = q->len;
 
-    res = calibrate_case(afl, q, use_mem, 0, 1);
+      ACTF("Attempting dry run with '%s'...", fn);
 
-    if (afl->stop_soon) { return; }
+      res = calibrate_case(afl, q, use_mem, 0, 1);
+
+    } else {
+      fd = open(q->fname, O_RDONLY);
+      if (fd < 0) { PFATAL("Unable to open '%s'", q->fname); }
+
+      read_len = MIN(q->len, (u32)MAX_FILE);
+      use_mem = afl_realloc(AFL_BUF_PARAM(in), read_len);
+      ck_read(fd, use_mem, read_len, q->fname);
+
+      close(fd);
+
+      if (read_len == q->len && cal_index_take(afl, q, use_mem)) {
+        ++from_index;
+        continue;
+      }
+
+      ACTF("Attempting dry run with '%s'...", fn);
+
+      res = calibrate_case(afl, q, use_mem, 0, 1);
+    }
+
+    if (afl->stop_soon) {
+      ck_free(pre);
+      return;
+    }
 
     if (res == afl->crash_mode || res == FSRV_RUN_NOBITS) {
       SAYF(cGRA
@@ -1052,6 +1798,14 @@ void perform_dry_run(afl_state_t *afl) {
     }
   }
 
+  if (from_index) {
+    OKF("Took %u of %u entries from the calibration index.", from_index,
+        afl->queued_items);
+  }
+
+  cal_index_drop(afl);
+  ck_free(pre);
+
   if (cal_failures) {
     if (cal_failures == afl->queued_items) {
       FATAL("All test cases time out or crash, giving up!");
@@ -1240,9 +1994,40 @@ void pivot_inputs(afl_state_t *afl) {
 #endif /* ^!SIMPLE_FILES */
     }
 
-    /* Pivot to the new queue entry. */
+    /* Pivot to the new queue entry, with the byte importance map of an
+       earlier run if there is one. */
+
+    if (q->seed_link) {
+      if (symlink(q->fname, nfn)) { PFATAL("Unable to create '%s'", nfn); }
+
+    } else if (q->pack_data) {
+      q->write_seq = write_queue_file(afl, nfn, q->pack_data, q->len);
+      q->pack_data = NULL;
+
+    } else {
+      link_or_copy(q->fname, nfn);
+    }
+
+    u8 *ifn = alloc_printf("%s/.state/byte_importance/%s", afl->in_dir, rsl);
+
+    if (!access(ifn, R_OK)) {
+      u8 *ofn = alloc_printf("%s/queue/.state/byte_importance/%s",
+                             afl->out_dir, strrchr(nfn, '/') + 1);
+      link_or_copy(ifn, ofn);
+      ck_free(ofn);
+    }
+
+    ck_free(ifn);
+
+    /* the custom mutator metadata, also of an earlier run, is taken over
+       below once the entry is in place */
+
+    u8 *mfn = NULL;
+
+    if (unlikely(afl->custom_meta_cnt)) {
+      mfn = alloc_printf("%s/.state/custom_meta/%s", afl->in_dir, rsl);
+    }
 
-    link_or_copy(q->fname, nfn);
     ck_free(q->fname);
     q->fname = nfn;
 
@@ -1254,9 +2039,27 @@ void pivot_inputs(afl_state_t *afl) {
       run_afl_custom_queue_new_entry(afl, q, q->fname, NULL);
     }
 
+    if (unlikely(mfn)) {
+      custom_meta_new(afl, q, NULL, mfn);
+      ck_free(mfn);
+    }
+
     ++id;
   }
 
+  /* the calibration index of the session we resume, read by the dry run */
+
+  if (afl->resuming_fuzz || afl->in_place_resume) {
+    u8 *fn = alloc_printf("%s/.state/calibration", afl->in_dir);
+    afl->cal_index_old_fd = open(fn, O_RDONLY);
+    ck_free(fn);
+  }
+
+  if (afl->state_flags_old) {
+    ck_free(afl->state_flags_old);
+    afl->state_flags_old = NULL;
+  }
+
   if (afl->in_place_resume) { nuke_resume_dir(afl); }
 }
 
@@ -1429,6 +2232,26 @@ void nuke_resume_dir(afl_state_t *afl) {
   if (delete_files(fn, CASE_PREFIX)) { goto dir_cleanup_failed; }
   ck_free(fn);
 
+  fn = alloc_printf("%s/_resume/.state/byte_importance", afl->out_dir);
+  if (delete_files(fn, CASE_PREFIX)) { goto dir_cleanup_failed; }
+  ck_free(fn);
+
+  fn = alloc_printf("%s/_resume/.state/custom_meta", afl->out_dir);
+  if (delete_files(fn, CASE_PREFIX)) { goto dir_cleanup_failed; }
+  ck_free(fn);
+
+  fn = alloc_printf("%s/_resume/.state/calibration", afl->out_dir);
+  if (unlink(fn) && errno != ENOENT) { goto dir_cleanup_failed; }
+  ck_free(fn);
+
+  fn = alloc_printf("%s/_resume/.state/sync_manifest", afl->out_dir);
+  if (unlink(fn) && errno != ENOENT) { goto dir_cleanup_failed; }
+  ck_free(fn);
+
+  fn = alloc_printf("%s/_resume/.state/flags", afl->out_dir);
+  if (unlink(fn) && errno != ENOENT) { goto dir_cleanup_failed; }
+  ck_free(fn);
+
   fn = alloc_printf("%s/_resume/.state", afl->out_dir);
   if (rmdir(fn) && errno != ENOENT) { goto dir_cleanup_failed; }
   ck_free(fn);
@@ -1552,6 +2375,14 @@ static void handle_existing_out_dir(afl_state_t *afl) {
     fn = alloc_printf("%s/.synced", afl->out_dir);
     if (delete_files(fn, NULL)) { goto dir_cleanup_failed; }
     ck_free(fn);
+
+    /* the AFL_QUEUE_STORE of a single instance goes with its queue */
+
+    if (!afl->sync_id) {
+      fn = alloc_printf("%s/.store", afl->out_dir);
+      if (delete_files(fn, NULL)) { goto dir_cleanup_failed; }
+      ck_free(fn);
+    }
   }
 
   /* Next, we need to clean up <afl->out_dir>/queue/.state/ subdirectories: */
@@ -1572,6 +2403,26 @@ static void handle_existing_out_dir(afl_state_t *afl) {
   if (delete_files(fn, CASE_PREFIX)) { goto dir_cleanup_failed; }
   ck_free(fn);
 
+  fn = alloc_printf("%s/queue/.state/byte_importance", afl->out_dir);
+  if (delete_files(fn, CASE_PREFIX)) { goto dir_cleanup_failed; }
+  ck_free(fn);
+
+  fn = alloc_printf("%s/queue/.state/custom_meta", afl->out_dir);
+  if (delete_files(fn, CASE_PREFIX)) { goto dir_cleanup_failed; }
+  ck_free(fn);
+
+  fn = alloc_printf("%s/queue/.state/calibration", afl->out_dir);
+  if (unlink(fn) && errno != ENOENT) { goto dir_cleanup_failed; }
+  ck_free(fn);
+
+  fn = alloc_printf("%s/queue/.state/sync_manifest", afl->out_dir);
+  if (unlink(fn) && errno != ENOENT) { goto dir_cleanup_failed; }
+  ck_free(fn);
+
+  fn = alloc_printf("%s/queue/.state/flags", afl->out_dir);
+  if (unlink(fn) && errno != ENOENT) { goto dir_cleanup_failed; }
+  ck_free(fn);
+
   /* Then, get rid of the .state subdirectory itself (should be empty by now)
      and everything matching <afl->out_dir>/queue/id:*. */
 
@@ -1682,16 +2533,34 @@ static void handle_existing_out_dir(afl_state_t *afl) {
   if (unlink(fn) && errno != ENOENT) { goto dir_cleanup_failed; }
   ck_free(fn);
 
+  fn = alloc_printf("%s/fuzzer_stats.page", afl->out_dir);
+  if (unlink(fn) && errno != ENOENT) { goto dir_cleanup_failed; }
+  ck_free(fn);
+
   if (!afl->in_place_resume) {
     fn = alloc_printf("%s/fuzzer_stats", afl->out_dir);
     if (unlink(fn) && errno != ENOENT) { goto dir_cleanup_failed; }
     ck_free(fn);
   }
 
+  if (!afl->in_place_resume) {
+    fn = alloc_printf("%s/fuzzer_checkpoint.0", afl->out_dir);
+    if (unlink(fn) && errno != ENOENT) { goto dir_cleanup_failed; }
+    ck_free(fn);
+
+    fn = alloc_printf("%s/fuzzer_checkpoint.1", afl->out_dir);
+    if (unlink(fn) && errno != ENOENT) { goto dir_cleanup_failed; }
+    ck_free(fn);
+  }
+
   if (!afl->in_place_resume) {
     fn = alloc_printf("%s/plot_data", afl->out_dir);
     if (unlink(fn) && errno != ENOENT) { goto dir_cleanup_failed; }
     ck_free(fn);
+
+    fn = alloc_printf("%s/plot_data.bin", afl->out_dir);
+    if (unlink(fn) && errno != ENOENT) { goto dir_cleanup_failed; }
+    ck_free(fn);
   }
 
   fn = alloc_printf("%s/queue_data", afl->out_dir);
@@ -1786,6 +2655,15 @@ void setup_dirs_fds(afl_state_t *afl) {
 #endif /* !__sun */
   }
 
+  /* The records of the shared memory segments, see shm_keep(). */
+
+  tmp = alloc_printf("%s/%s", afl->out_dir, SHM_KEEP_DIR);
+  if (mkdir(tmp, 0700) && errno != EEXIST) {
+    PFATAL("Unable to create '%s'", tmp);
+  }
+
+  ck_free(tmp);
+
   if (afl->is_main_node) {
     u8 *x = alloc_printf("%s/is_main_node", afl->out_dir);
     int fd = open(x, O_CREAT | O_RDWR, 0644);
@@ -1807,12 +2685,14 @@ void setup_dirs_fds(afl_state_t *afl) {
   if (mkdir(tmp, 0700)) { PFATAL("Unable to create '%s'", tmp); }
   ck_free(tmp);
 
-  /* Directory for flagging queue entries that went through
-     deterministic fuzzing in the past. */
+  /* With AFL_STATE_DIRS, directory for flagging queue entries that went
+     through deterministic fuzzing in the past. */
 
-  tmp = alloc_printf("%s/queue/.state/deterministic_done/", afl->out_dir);
-  if (mkdir(tmp, 0700)) { PFATAL("Unable to create '%s'", tmp); }
-  ck_free(tmp);
+  if (afl->afl_env.afl_state_dirs) {
+    tmp = alloc_printf("%s/queue/.state/deterministic_done/", afl->out_dir);
+    if (mkdir(tmp, 0700)) { PFATAL("Unable to create '%s'", tmp); }
+    ck_free(tmp);
+  }
 
   /* Directory with the auto-selected dictionary entries. */
 
@@ -1820,15 +2700,28 @@ void setup_dirs_fds(afl_state_t *afl) {
   if (mkdir(tmp, 0700)) { PFATAL("Unable to create '%s'", tmp); }
   ck_free(tmp);
 
-  /* The set of paths currently deemed redundant. */
+  /* With AFL_STATE_DIRS, the set of paths currently deemed redundant and
+     the set of paths showing variable behavior. */
 
-  tmp = alloc_printf("%s/queue/.state/redundant_edges/", afl->out_dir);
+  if (afl->afl_env.afl_state_dirs) {
+    tmp = alloc_printf("%s/queue/.state/redundant_edges/", afl->out_dir);
+    if (mkdir(tmp, 0700)) { PFATAL("Unable to create '%s'", tmp); }
+    ck_free(tmp);
+
+    tmp = alloc_printf("%s/queue/.state/variable_behavior/", afl->out_dir);
+    if (mkdir(tmp, 0700)) { PFATAL("Unable to create '%s'", tmp); }
+    ck_free(tmp);
+  }
+
+  /* What is known about the bytes of each entry. */
+
+  tmp = alloc_printf("%s/queue/.state/byte_importance/", afl->out_dir);
   if (mkdir(tmp, 0700)) { PFATAL("Unable to create '%s'", tmp); }
   ck_free(tmp);
 
-  /* The set of paths showing variable behavior. */
+  /* Metadata the custom mutators keep of each entry. */
 
-  tmp = alloc_printf("%s/queue/.state/variable_behavior/", afl->out_dir);
+  tmp = alloc_printf("%s/queue/.state/custom_meta/", afl->out_dir);
   if (mkdir(tmp, 0700)) { PFATAL("Unable to create '%s'", tmp); }
   ck_free(tmp);
 
@@ -1852,7 +2745,9 @@ void setup_dirs_fds(afl_state_t *afl) {
 
   /* LS :ALL mutaions */
   tmp = alloc_printf("%s/stores", afl->out_dir);
-  if (mkdir(tmp, 0700)) { PFATAL("Unable to create '%s'", tmp); }
+  if (mkdir(tmp, 0700) && errno != EEXIST) {
+    PFATAL("Unable to create '%s'", tmp);
+  }
   ck_free(tmp);
 
   /* All recorded hangs. */
@@ -1915,6 +2810,8 @@ void setup_dirs_fds(afl_state_t *afl) {
 
   fflush(afl->fsrv.plot_file);
 
+  plot_bin_open(afl);
+
 #ifdef INTROSPECTION
 
   tmp = alloc_printf("%s/plot_det_data", afl->out_dir);
@@ -1978,6 +2875,136 @@ void setup_stdio_file(afl_state_t *afl) {
   }
 }
 
+/* Setup a memfd as the output file for @@ (AFL_MEMFD_INPUT). The target
+   inherits the descriptor and opens it as /proc/self/fd/N, and the test cases
+   are updated in place instead of being recreated on disk for every run.
+   Returns 0 if memfds are not available. */
+
+u8 setup_memfd_file(afl_state_t *afl) {
+#ifdef __linux__
+  s32 fd = syscall(SYS_memfd_create, ".cur_input", 0);
+
+  if (fd < 0) { return 0; }
+
+  afl->fsrv.out_fd = fd;
+  afl->fsrv.out_file = alloc_printf("/proc/self/fd/%d", fd);
+  afl->fsrv.use_memfd = true;
+  return 1;
+#else
+  (void)afl;
+  return 0;
+#endif
+}
+
+/* Whether an ELF binary asks for a dynamic loader (PT_INTERP). */
+
+static u8 elf_has_interp(u8 *f_data, u64 f_len) {
+#ifdef __linux__
+  u32 i;
+
+  if (f_len < sizeof(Elf64_Ehdr) || memcmp(f_data, ELFMAG, SELFMAG)) {
+    return 0;
+  }
+
+  if (f_data[EI_CLASS] == ELFCLASS64) {
+    Elf64_Ehdr *eh = (Elf64_Ehdr *)f_data;
+
+    for (i = 0; i < eh->e_phnum; ++i) {
+      u64 off = eh->e_phoff + (u64)i * eh->e_phentsize;
+      if (off + sizeof(Elf64_Phdr) > f_len) { break; }
+      if (((Elf64_Phdr *)(f_data + off))->p_type == PT_INTERP) { return 1; }
+    }
+
+  } else if (f_data[EI_CLASS] == ELFCLASS32) {
+    Elf32_Ehdr *eh = (Elf32_Ehdr *)f_data;
+
+    for (i = 0; i < eh->e_phnum; ++i) {
+      u64 off = eh->e_phoff + (u64)i * eh->e_phentsize;
+      if (off + sizeof(Elf32_Phdr) > f_len) { break; }
+      if (((Elf32_Phdr *)(f_data + off))->p_type == PT_INTERP) { return 1; }
+    }
+  }
+
+#else
+  (void)f_data;
+  (void)f_len;
+#endif
+
+  return 0;
+}
+
+/* AFL_FAUXSRV_TEMPLATE: instead of the faux forkserver doing an execve()
+   per run, preload libfauxsrv.so into the target, which then forks the runs
+   itself at main(), after relocations (LD_BIND_NOW) and constructors. Only
+   for dynamically linked, non-instrumented targets in -n mode, everything
+   else keeps using the faux forkserver. */
+
+void setup_fauxsrv_template(afl_state_t *afl, u8 *own_loc) {
+#ifdef __linux__
+  struct stat st;
+  u8         *f_data, *lib, *preload;
+  s32         fd;
+  u8          dynamic, instrumented;
+
+  if (afl->non_instrumented_mode != 1 || afl->fsrv.qemu_mode ||
+      afl->fsrv.frida_mode || afl->fsrv.cs_mode || afl->fsrv.nyx_mode ||
+      afl->unicorn_mode || afl->use_wine) {
+    WARNF("AFL_FAUXSRV_TEMPLATE only works with -n on native targets.");
+    return;
+  }
+
+  fd = open(afl->fsrv.target_path, O_RDONLY);
+  if (fd < 0) { PFATAL("Unable to open '%s'", afl->fsrv.target_path); }
+  if (fstat(fd, &st) || !st.st_size) {
+    close(fd);
+    return;
+  }
+
+  f_data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (f_data == MAP_FAILED) {
+    PFATAL("Unable to mmap file '%s'", afl->fsrv.target_path);
+  }
+
+  dynamic = elf_has_interp(f_data, st.st_size);
+  instrumented = !!memmem(f_data, st.st_size, SHM_ENV_VAR, strlen(SHM_ENV_VAR));
+  munmap(f_data, st.st_size);
+
+  if (!dynamic) {
+    WARNF("AFL_FAUXSRV_TEMPLATE: target is not dynamically linked, ignored.");
+    return;
+  }
+
+  if (instrumented) {
+    /* its own forkserver would answer the handshake */
+
+    WARNF("AFL_FAUXSRV_TEMPLATE: target is instrumented, ignored.");
+    return;
+  }
+
+  lib = find_afl_binary(own_loc, "libfauxsrv.so");
+
+  if (getenv("LD_PRELOAD")) {
+    preload = alloc_printf("%s:%s", getenv("LD_PRELOAD"), lib);
+
+  } else {
+    preload = ck_strdup(lib);
+  }
+
+  setenv("LD_PRELOAD", preload, 1);
+  setenv("LD_BIND_NOW", "1", 0);
+  ck_free(preload);
+  ck_free(lib);
+
+  afl->fsrv.use_fauxsrv = false;
+  OKF("Forking the target from a template process at main().");
+#else
+  (void)own_loc;
+  WARNF("AFL_FAUXSRV_TEMPLATE is only supported on Linux.");
+#endif
+}
+
 /* Make sure that core dumps don't go to a program. */
 
 void check_crash_handling(void) {
@@ -2336,13 +3363,71 @@ static void handle_skipreq(int sig) {
   afl_states_request_skip();
 }
 
+/* Point the given shared memory variable of the environment to shm. */
+
+static void setenv_shm(const char *name, sharedmem_t *shm) {
+#ifdef USEMMAP
+  setenv(name, shm->g_shm_file_path, 1);
+#else
+  u8 *shm_str = alloc_printf("%d", shm->shm_id);
+  setenv(name, shm_str, 1);
+  ck_free(shm_str);
+#endif
+}
+
+/* AFL_LARGE_INPUTS: queue entries up to the given number of MB, of which
+   fuzz_one() mutates a window and the runs patch it into the rest. The
+   parallel runs and the custom mutators take whole test cases, so they
+   are left out. */
+
+void setup_large_inputs(afl_state_t *afl) {
+  s32 mb = atoi(afl->afl_env.afl_large_inputs);
+  u8  unsupported = afl->custom_mutators_count || afl->afl_env.afl_fsrv_workers;
+
+  if (mb < 2 || mb > 2047) {
+    FATAL("AFL_LARGE_INPUTS must be between 2 and 2047 (MB)");
+  }
+
+#ifdef __linux__
+  if (afl->fsrv.nyx_mode) { unsupported = 1; }
+#endif
+
+  if (unsupported) {
+    WARNF(
+        "AFL_LARGE_INPUTS does not work with custom mutators, "
+        "AFL_FSRV_WORKERS or Nyx mode - ignoring it.");
+    return;
+  }
+
+  if (afl->afl_env.afl_pipeline) {
+    WARNF("AFL_PIPELINE does not work with AFL_LARGE_INPUTS, disabled.");
+    afl->afl_env.afl_pipeline = 0;
+  }
+
+  afl->max_input = (u32)mb << 20;
+  if (afl->max_length == MAX_FILE) { afl->max_length = afl->max_input; }
+
+  OKF("Queue entries up to %d MB, mutated in windows of %u kB.", mb,
+      LARGE_WINDOW >> 10);
+}
+
+/* Record the segments of shm as who.what in the SHM_KEEP_DIR of the output
+   directory: a restart after a crash takes them over in afl_shm_init(),
+   and afl-status -c removes them if there is none. */
+
+void shm_keep(afl_state_t *afl, sharedmem_t *shm, u8 *who, u8 *what) {
+  shm->keep_fn =
+      alloc_printf("%s/%s/%s.%s", afl->out_dir, SHM_KEEP_DIR, who, what);
+}
+
 /* Setup shared map for fuzzing with input via sharedmem */
 
 void setup_testcase_shmem(afl_state_t *afl) {
   afl->shm_fuzz = ck_alloc(sizeof(sharedmem_t));
+  shm_keep(afl, afl->shm_fuzz, "main", "fuzz");
 
   // we need to set the non-instrumented mode to not overwrite the SHM_ENV_VAR
-  u8 *map = afl_shm_init(afl->shm_fuzz, MAX_FILE + sizeof(u32), 1);
+  u8 *map = afl_shm_init(afl->shm_fuzz, afl->max_input + sizeof(u32), 1);
   afl->shm_fuzz->shmemfuzz_mode = 1;
 
   if (!map) { FATAL("BUG: Zero return from afl_shm_init."); }
@@ -2357,6 +3442,360 @@ void setup_testcase_shmem(afl_state_t *afl) {
   afl->fsrv.support_shmem_fuzz = 1;
   afl->fsrv.shmem_fuzz_len = (u32 *)map;
   afl->fsrv.shmem_fuzz = map + sizeof(u32);
+  afl->fsrv.shmem_fuzz_max = afl->max_input;
+
+  /* the slots for pipelined havoc runs, large enough for the temporary map
+     size the target is started with */
+
+  if (afl->afl_env.afl_pipeline) {
+    if (afl->afl_env.afl_fsrv_workers || afl->custom_mutators_count) {
+      WARNF("AFL_PIPELINE does not work with AFL_FSRV_WORKERS or custom "
+            "mutators, disabled.");
+
+    } else {
+      u32 pipe_map_size = MAX(afl->fsrv.map_size, (u32)DEFAULT_SHMEM_SIZE);
+
+      afl->shm_pipe = ck_alloc(sizeof(sharedmem_t));
+      shm_keep(afl, afl->shm_pipe, "main", "pipe");
+
+      map = afl_shm_init(afl->shm_pipe, FS_PIPE_SIZE(pipe_map_size), 1);
+      afl->shm_pipe->shmemfuzz_mode = 1;
+      afl->shm_pipe->pipe_mode = 1;
+
+      if (!map) { FATAL("BUG: Zero return from afl_shm_init."); }
+
+      setenv_shm(SHM_PIPE_ENV_VAR, afl->shm_pipe);
+      afl->fsrv.support_pipeline = 1;
+      afl->fsrv.pipe = (struct fs_pipe *)map;
+      afl->fsrv.pipe->map_size = pipe_map_size;
+    }
+  }
+
+  /* persistent targets can take several testcases per round trip */
+
+  if (!afl->fsrv.persistent_mode) { return; }
+
+  afl->shm_batch = ck_alloc(sizeof(sharedmem_t));
+  shm_keep(afl, afl->shm_batch, "main", "batch");
+
+  map = afl_shm_init(afl->shm_batch, sizeof(struct fs_batch), 1);
+  afl->shm_batch->shmemfuzz_mode = 1;
+  afl->shm_batch->batch_mode = 1;
+
+  if (!map) { FATAL("BUG: Zero return from afl_shm_init."); }
+
+#ifdef USEMMAP
+  setenv(SHM_BATCH_ENV_VAR, afl->shm_batch->g_shm_file_path, 1);
+#else
+  shm_str = alloc_printf("%d", afl->shm_batch->shm_id);
+  setenv(SHM_BATCH_ENV_VAR, shm_str, 1);
+  ck_free(shm_str);
+#endif
+  afl->fsrv.support_batch = 1;
+  afl->fsrv.batch = (struct fs_batch *)map;
+}
+
+/* Setup the shared map the target records field hints in (AFL_FIELD_HINTS).
+   It stays empty for targets that give none. */
+
+void setup_field_hints(afl_state_t *afl) {
+  if (afl->non_instrumented_mode) {
+    WARNF("AFL_FIELD_HINTS needs an instrumented target - ignoring it.");
+    return;
+  }
+
+  afl->shm_hints = ck_alloc(sizeof(sharedmem_t));
+  shm_keep(afl, afl->shm_hints, "main", "hints");
+
+  // we need to set the non-instrumented mode to not overwrite the SHM_ENV_VAR
+  u8 *map = afl_shm_init(afl->shm_hints, sizeof(struct fs_hints), 1);
+  afl->shm_hints->shmemfuzz_mode = 1;
+  afl->shm_hints->hints_mode = 1;
+
+  if (!map) { FATAL("BUG: Zero return from afl_shm_init."); }
+
+  setenv_shm(HINT_SHM_ENV_VAR, afl->shm_hints);
+}
+
+/* Setup the shared copy of the virgin map persistent mode targets check
+   their runs against (AFL_TARGET_NOVELTY). It is sized for the largest map
+   afl-fuzz starts the target with, target_novelty_sync() fills it in. */
+
+void setup_target_novelty(afl_state_t *afl) {
+  struct fs_virgin *v;
+  u32               size = MAX(afl->fsrv.map_size, (u32)DEFAULT_SHMEM_SIZE);
+
+  if (afl->non_instrumented_mode || afl->afl_env.afl_shared_virgin) {
+    WARNF(
+        "AFL_TARGET_NOVELTY needs an instrumented target and does not work "
+        "with AFL_SHARED_VIRGIN - ignoring it.");
+    return;
+  }
+
+  afl->shm_virgin = ck_alloc(sizeof(sharedmem_t));
+  shm_keep(afl, afl->shm_virgin, "main", "virgin");
+
+  // we need to set the non-instrumented mode to not overwrite the SHM_ENV_VAR
+  u8 *map = afl_shm_init(afl->shm_virgin, sizeof(struct fs_virgin) + size, 1);
+  afl->shm_virgin->shmemfuzz_mode = 1;
+  afl->shm_virgin->virgin_mode = 1;
+
+  if (!map) { FATAL("BUG: Zero return from afl_shm_init."); }
+
+  v = (struct fs_virgin *)map;
+  v->size = size;
+  v->map_size = 0;
+  v->verdict = FS_VIRGIN_UNKNOWN;
+
+  setenv_shm(VIRGIN_SHM_ENV_VAR, afl->shm_virgin);
+  afl->fsrv.virgin = v;
+}
+
+#ifdef __linux__
+/* In Nyx mode, a worker is another VM of the target, which the main runner
+   of this instance has written the snapshot for (see the Parent role set up
+   in main()). Its execs run on a thread of its own. */
+
+static void setup_nyx_worker(afl_state_t *afl, afl_forkserver_t *fsrv, u32 i) {
+  fsrv->nyx_mode = 1;
+  fsrv->nyx_handlers = afl->fsrv.nyx_handlers;
+  fsrv->nyx_parent = false;
+  fsrv->nyx_standalone = false;
+  fsrv->nyx_id = afl->fsrv.nyx_id + 1 + i;
+  fsrv->nyx_bind_cpu_id = afl->fsrv.nyx_bind_cpu_id;
+  fsrv->nyx_use_tmp_workdir = false;
+  fsrv->nyx_log_fd = -1;
+  fsrv->out_dir_path = afl->fsrv.out_dir_path;
+  fsrv->target_path = afl->fsrv.target_path;
+  fsrv->out_file = NULL;
+  fsrv->out_fd = -1;
+
+  afl_fsrv_start(fsrv, afl->argv, &afl->stop_soon,
+                 afl->afl_env.afl_debug_child);
+
+  if (fsrv->map_size != afl->fsrv.map_size) {
+    FATAL("Nyx worker %u has a different map size", i);
+  }
+
+  afl_fsrv_nyx_async(fsrv);
+}
+
+#endif
+
+/* The environment and CPU affinity a worker forkserver starts with: it must
+   not pick up the shared memory of the main forkserver, nor inherit the CPU
+   this instance is bound to. worker_env_restore() undoes it. */
+
+static const char *worker_shm_envs[] = {
+    SHM_ENV_VAR,       SHM_FUZZ_ENV_VAR, SHM_BATCH_ENV_VAR, CMPLOG_SHM_ENV_VAR,
+    DIRTY_SHM_ENV_VAR, HINT_SHM_ENV_VAR, VIRGIN_SHM_ENV_VAR};
+
+#define WORKER_SHM_ENVS (sizeof(worker_shm_envs) / sizeof(worker_shm_envs[0]))
+
+static void worker_env_clear(afl_state_t *afl, u8 **saved_envs) {
+  u32 i;
+
+  for (i = 0; i < WORKER_SHM_ENVS; ++i) {
+    u8 *val = getenv(worker_shm_envs[i]);
+    saved_envs[i] = val ? ck_strdup(val) : NULL;
+    unsetenv(worker_shm_envs[i]);
+  }
+
+#if defined(HAVE_AFFINITY) && defined(__linux__)
+  if (afl->cpu_aff >= 0) {
+    cpu_set_t c;
+    CPU_ZERO(&c);
+    for (i = 0; i < (u32)afl->cpu_core_count && i < CPU_SETSIZE; ++i) {
+      CPU_SET(i, &c);
+    }
+
+    sched_setaffinity(0, sizeof(c), &c);
+  }
+
+#else
+  (void)afl;
+#endif
+}
+
+static void worker_env_restore(afl_state_t *afl, u8 **saved_envs) {
+  u32 i;
+
+#if defined(HAVE_AFFINITY) && defined(__linux__)
+  if (afl->cpu_aff >= 0) { bind_cpu(afl, afl->cpu_aff); }
+#else
+  (void)afl;
+#endif
+
+  for (i = 0; i < WORKER_SHM_ENVS; ++i) {
+    if (saved_envs[i]) {
+      setenv(worker_shm_envs[i], saved_envs[i], 1);
+      ck_free(saved_envs[i]);
+    }
+  }
+}
+
+/* Start worker w, a forkserver of the target with its own map and testcase
+   (shared memory or the stdin file out_file), between worker_env_clear()
+   and worker_env_restore(). Its segments are recorded as who.*. */
+
+static void worker_start(afl_state_t *afl, struct fsrv_worker *w, u8 *who,
+                         u8 *out_file) {
+  afl_forkserver_t *fsrv = &w->fsrv;
+
+  fsrv->cs_mode = afl->fsrv.cs_mode;
+  fsrv->qemu_mode = afl->fsrv.qemu_mode;
+  fsrv->frida_mode = afl->fsrv.frida_mode;
+  fsrv->persistent_mode = afl->fsrv.persistent_mode;
+  fsrv->target_path = afl->fsrv.target_path;
+  w->shm.huge_mode = afl->shm.huge_mode;
+  shm_keep(afl, &w->shm, who, "map");
+  fsrv->trace_bits = afl_shm_init(&w->shm, afl->fsrv.map_size, 0);
+  if (!fsrv->trace_bits) { FATAL("BUG: Zero return from afl_shm_init."); }
+
+  if (afl->fsrv.use_shmem_fuzz) {
+    shm_keep(afl, &w->shm_fuzz, who, "fuzz");
+
+    u8 *map = afl_shm_init(&w->shm_fuzz, afl->max_input + sizeof(u32), 1);
+    if (!map) { FATAL("BUG: Zero return from afl_shm_init."); }
+    w->shm_fuzz.shmemfuzz_mode = 1;
+    setenv_shm(SHM_FUZZ_ENV_VAR, &w->shm_fuzz);
+    fsrv->shmem_fuzz_len = (u32 *)map;
+    fsrv->shmem_fuzz = map + sizeof(u32);
+    fsrv->shmem_fuzz_max = afl->max_input;
+    fsrv->out_file = NULL;
+    fsrv->out_fd = -1;
+    ck_free(out_file);
+
+  } else {
+    fsrv->out_file = out_file;
+    unlink(fsrv->out_file); /* Ignore errors */
+    fsrv->out_fd =
+        open(fsrv->out_file, O_RDWR | O_CREAT | O_EXCL, DEFAULT_PERMISSION);
+    if (fsrv->out_fd < 0) { PFATAL("Unable to create '%s'", fsrv->out_file); }
+  }
+
+  afl_fsrv_start(fsrv, afl->argv, &afl->stop_soon,
+                 afl->afl_env.afl_debug_child);
+
+  if (afl->fsrv.use_shmem_fuzz != fsrv->use_shmem_fuzz) {
+    FATAL("Worker forkserver disagrees on shared memory fuzzing");
+  }
+
+  unsetenv(SHM_ENV_VAR);
+  unsetenv(SHM_FUZZ_ENV_VAR);
+}
+
+/* Spawn AFL_FSRV_WORKERS extra forkservers of the target. Each one gets its
+   own coverage map and testcase (shared memory or stdin file), and the
+   havoc stage keeps all of them busy. The results are merged into the one
+   queue of this afl-fuzz instance. */
+
+void setup_fsrv_workers(afl_state_t *afl) {
+  u8  *saved_envs[WORKER_SHM_ENVS], who[16];
+  char *end;
+  long  val = strtol(afl->afl_env.afl_fsrv_workers, &end, 10);
+  u32   cnt, i;
+  u8    nyx = 0;
+
+#ifdef __linux__
+  nyx = afl->fsrv.nyx_mode;
+#endif
+
+  if (end == (char *)afl->afl_env.afl_fsrv_workers || *end || val < 2 ||
+      val > FSRV_WORKERS_MAX) {
+    FATAL("AFL_FSRV_WORKERS must be between 2 and %u, but got %s",
+          FSRV_WORKERS_MAX, afl->afl_env.afl_fsrv_workers);
+  }
+
+  cnt = val;
+
+  if (!afl->fsrv.fsrv_pid) {
+    afl_fsrv_start(&afl->fsrv, afl->argv, &afl->stop_soon,
+                   afl->afl_env.afl_debug_child);
+  }
+
+  if (afl->non_instrumented_mode || afl->custom_mutators_count ||
+      afl->fsrv.use_dirty_lines || afl->fsrv.ipt_mode || afl->fsrv.map_cap ||
+      (!nyx && !afl->fsrv.use_shmem_fuzz && !afl->fsrv.use_stdin)) {
+    WARNF(
+        "AFL_FSRV_WORKERS needs an instrumented target that reads stdin or "
+        "shared memory, without custom mutators, dirty line tracking or "
+        "AFL_MAP_SIZE_MAX - ignoring it.");
+    return;
+  }
+
+  worker_env_clear(afl, saved_envs);
+
+  afl->workers = ck_alloc(cnt * sizeof(struct fsrv_worker));
+
+  for (i = 0; i < cnt; ++i) {
+    struct fsrv_worker *w = &afl->workers[i];
+
+    afl_fsrv_init_dup(&w->fsrv, &afl->fsrv);
+
+#ifdef __linux__
+    if (nyx) {
+      setup_nyx_worker(afl, &w->fsrv, i);
+      continue;
+    }
+
+#endif
+
+    snprintf(who, sizeof(who), "w%u", i);
+    worker_start(afl, w, who,
+                 alloc_printf("%s/.cur_input.w%u", afl->tmp_dir, i));
+  }
+
+  worker_env_restore(afl, saved_envs);
+
+  afl->workers_cnt = cnt;
+  afl->workers_next = 0;
+  OKF("Started %u worker %s.", cnt, nyx ? "Nyx runners" : "forkservers");
+}
+
+/* Spawn the spare forkserver of AFL_HANG_CHECK_ASYNC, which runs timeouts
+   again with hang_tmout while the main one goes on fuzzing, see
+   hang_check_poll(). */
+
+void setup_hang_check(afl_state_t *afl) {
+  u8                *saved_envs[WORKER_SHM_ENVS];
+  struct hang_check *hc;
+  u8                 nyx = 0;
+
+#ifdef __linux__
+  nyx = afl->fsrv.nyx_mode;
+#endif
+
+  if (!afl->fsrv.fsrv_pid) {
+    afl_fsrv_start(&afl->fsrv, afl->argv, &afl->stop_soon,
+                   afl->afl_env.afl_debug_child);
+  }
+
+  if (afl->non_instrumented_mode || afl->custom_mutators_count ||
+      afl->crash_mode || nyx || afl->afl_env.afl_keep_timeouts ||
+      afl->afl_env.afl_large_inputs || afl->fsrv.use_dirty_lines ||
+      afl->fsrv.ipt_mode || afl->fsrv.map_cap ||
+      (!afl->fsrv.use_shmem_fuzz && !afl->fsrv.use_stdin)) {
+    WARNF(
+        "AFL_HANG_CHECK_ASYNC needs an instrumented target that reads stdin "
+        "or shared memory, without custom mutators, -C, Nyx mode, "
+        "AFL_KEEP_TIMEOUTS, AFL_LARGE_INPUTS, dirty line tracking or "
+        "AFL_MAP_SIZE_MAX - ignoring it.");
+    return;
+  }
+
+  worker_env_clear(afl, saved_envs);
+
+  hc = ck_alloc(sizeof(struct hang_check));
+  afl_fsrv_init_dup(&hc->w.fsrv, &afl->fsrv);
+  worker_start(afl, &hc->w, "hang",
+               alloc_printf("%s/.cur_input.hang", afl->tmp_dir));
+
+  worker_env_restore(afl, saved_envs);
+
+  hc->trace = ck_alloc_nozero(afl->fsrv.map_size);
+  afl->hang_check = hc;
+  OKF("Started the forkserver that checks hangs.");
 }
 
 /* Do a PATH search and find target binary to see that it exists and
@@ -2511,7 +3950,8 @@ void check_binary(afl_state_t *afl, u8 *fname) {
 #ifdef __linux__
       !afl->fsrv.nyx_mode &&
 #endif
-      !afl->fsrv.cs_mode && !afl->non_instrumented_mode &&
+      !afl->fsrv.cs_mode && !afl->fsrv.ipt_mode &&
+      !afl->non_instrumented_mode &&
       !afl_memmem(f_data, f_len, SHM_ENV_VAR, strlen(SHM_ENV_VAR) + 1)) {
 
     SAYF("\n" cLRD "[-] " cRST
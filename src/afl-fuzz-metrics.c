@@ -0,0 +1,309 @@
+/*
+ * This implements the AFL_METRICS_PORT endpoint, a thread that serves the
+ * counters of struct afl_metrics over HTTP in the Prometheus text format,
+ * see docs/afl-fuzz_approach.md
+ *
+ */
+
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include "afl-fuzz.h"
+
+#define METRIC_PREFIX "afl_"
+
+struct metrics_buf {
+  char *buf;
+  u32   len;
+};
+
+static void metrics_printf(struct metrics_buf *b, const char *fmt, ...) {
+  va_list ap;
+  s32     n;
+
+  if (b->len >= METRICS_REPLY_MAX) { return; }
+
+  va_start(ap, fmt);
+  n = vsnprintf(b->buf + b->len, METRICS_REPLY_MAX - b->len, fmt, ap);
+  va_end(ap);
+
+  if (n > 0) { b->len += n; }
+  if (b->len > METRICS_REPLY_MAX) { b->len = METRICS_REPLY_MAX; }
+}
+
+static inline u64 metrics_get(u64 *p) {
+  return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+/* Write a histogram of values in us with cumulative buckets in seconds. */
+
+static void metrics_histogram(struct metrics_buf *b, const char *name,
+                              const char *help, u64 *hist, u64 *sum,
+                              u64 base) {
+  u64 cnt = 0;
+  u32 i;
+
+  metrics_printf(b, "# HELP " METRIC_PREFIX "%s %s\n", name, help);
+  metrics_printf(b, "# TYPE " METRIC_PREFIX "%s histogram\n", name);
+
+  for (i = 0; i < METRICS_BUCKETS - 1; ++i) {
+    cnt += metrics_get(hist + i);
+    metrics_printf(b, METRIC_PREFIX "%s_bucket{le=\"%g\"} %llu\n", name,
+                   (double)(base << i) / 1000000, cnt);
+  }
+
+  cnt += metrics_get(hist + i);
+  metrics_printf(b, METRIC_PREFIX "%s_bucket{le=\"+Inf\"} %llu\n", name, cnt);
+  metrics_printf(b, METRIC_PREFIX "%s_sum %g\n", name,
+                 (double)metrics_get(sum) / 1000000);
+  metrics_printf(b, METRIC_PREFIX "%s_count %llu\n", name, cnt);
+}
+
+/* AFL_FSRV_LATENCY: one histogram per phase of a forkserver round trip. */
+
+static void metrics_latency(struct metrics_buf *b, struct fsrv_latency *lat) {
+  const char *name = "fsrv_latency_seconds";
+  u64         cnt, sum;
+  u32         p, i;
+
+  metrics_printf(b,
+                 "# HELP " METRIC_PREFIX
+                 "%s Forkserver round trip phases (AFL_FSRV_LATENCY).\n",
+                 name);
+  metrics_printf(b, "# TYPE " METRIC_PREFIX "%s histogram\n", name);
+
+  for (p = 0; p < FSRV_LAT_NUM; ++p) {
+    cnt = 0;
+
+    for (i = 0; i < FSRV_LAT_BUCKETS - 1; ++i) {
+      cnt += metrics_get(&lat->hist[p][i]);
+      metrics_printf(b,
+                     METRIC_PREFIX "%s_bucket{phase=\"%s\",le=\"%g\"} %llu\n",
+                     name, fsrv_lat_names[p],
+                     (double)((u64)FSRV_LAT_BASE << i) / 1000000000, cnt);
+    }
+
+    cnt += metrics_get(&lat->hist[p][i]);
+    sum = metrics_get(&lat->sum_ns[p]);
+    metrics_printf(b,
+                   METRIC_PREFIX "%s_bucket{phase=\"%s\",le=\"+Inf\"} %llu\n",
+                   name, fsrv_lat_names[p], cnt);
+    metrics_printf(b, METRIC_PREFIX "%s_sum{phase=\"%s\"} %g\n", name,
+                   fsrv_lat_names[p], (double)sum / 1000000000);
+    metrics_printf(b, METRIC_PREFIX "%s_count{phase=\"%s\"} %llu\n", name,
+                   fsrv_lat_names[p], cnt);
+  }
+}
+
+static void metrics_value(struct metrics_buf *b, const char *name,
+                          const char *type, const char *help, u64 val) {
+  metrics_printf(b, "# HELP " METRIC_PREFIX "%s %s\n", name, help);
+  metrics_printf(b, "# TYPE " METRIC_PREFIX "%s %s\n", name, type);
+  metrics_printf(b, METRIC_PREFIX "%s %llu\n", name, val);
+}
+
+static void metrics_format(struct afl_metrics *m, struct metrics_buf *b) {
+  u32 i, n;
+
+  metrics_histogram(b, "exec_duration_seconds", "Duration of target runs.",
+                    m->exec_hist, &m->exec_sum_us, METRICS_EXEC_BASE);
+  metrics_histogram(b, "sync_duration_seconds",
+                    "Duration of syncs with other instances.", m->sync_hist,
+                    &m->sync_sum_us, METRICS_SYNC_BASE);
+
+  metrics_printf(b, "# HELP " METRIC_PREFIX
+                    "stage_execs_total Executions by fuzzing stage.\n");
+  metrics_printf(b, "# TYPE " METRIC_PREFIX "stage_execs_total counter\n");
+
+  n = __atomic_load_n(&m->stages, __ATOMIC_ACQUIRE);
+
+  for (i = 0; i < n; ++i) {
+    metrics_printf(b, METRIC_PREFIX "stage_execs_total{stage=\"%s\"} %llu\n",
+                   m->stage_names[i], metrics_get(m->stage_execs + i));
+  }
+
+  metrics_printf(b, "# HELP " METRIC_PREFIX
+                    "cmplog_seconds_total Time spent in the cmplog stages.\n");
+  metrics_printf(b, "# TYPE " METRIC_PREFIX "cmplog_seconds_total counter\n");
+  metrics_printf(b, METRIC_PREFIX "cmplog_seconds_total %g\n",
+                 (double)metrics_get(&m->cmplog_us) / 1000000);
+
+  metrics_value(b, "cmplog_runs_total", "counter",
+                "Queue entries the cmplog stages ran on.",
+                metrics_get(&m->cmplog_runs));
+  metrics_value(b, "testcase_cache_hits_total", "counter",
+                "Queue entries found in the testcase cache.",
+                metrics_get(&m->cache_hits));
+  metrics_value(b, "testcase_cache_misses_total", "counter",
+                "Queue entries read from disk.",
+                metrics_get(&m->cache_misses));
+  metrics_value(b, "execs_total", "counter", "Target runs.",
+                metrics_get(&m->execs_done));
+  metrics_value(b, "cycles_done", "gauge", "Queue cycles completed.",
+                metrics_get(&m->cycles_done));
+  metrics_value(b, "corpus_count", "gauge", "Queue entries.",
+                metrics_get(&m->corpus_count));
+  metrics_value(b, "saved_crashes", "gauge", "Unique crashes saved.",
+                metrics_get(&m->saved_crashes));
+  metrics_value(b, "saved_hangs", "gauge", "Unique hangs saved.",
+                metrics_get(&m->saved_hangs));
+  metrics_value(b, "edges_found", "gauge", "Map bytes seen.",
+                metrics_get(&m->edges_found));
+
+  if (m->fsrv_latency) { metrics_latency(b, m->fsrv_latency); }
+}
+
+/* The serving thread: answer every connection with the metrics, whatever
+   it asked for. */
+
+static void *metrics_serve(void *arg) {
+  struct afl_metrics *m = (struct afl_metrics *)arg;
+  struct metrics_buf  b;
+  struct timeval      tv = {.tv_sec = 1, .tv_usec = 0};
+  char                req[1024], hdr[128];
+  s32                 sock = m->sock, fd, hdr_len;
+
+  b.buf = ck_alloc(METRICS_REPLY_MAX);
+
+  while (1) {
+    fd = accept(sock, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR) { continue; }
+      break;
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (read(fd, req, sizeof(req)) < 0) {}
+
+    b.len = 0;
+    metrics_format(m, &b);
+
+    hdr_len = snprintf(hdr, sizeof(hdr),
+                       "HTTP/1.0 200 OK\r\n"
+                       "Content-Type: text/plain; version=0.0.4\r\n"
+                       "Content-Length: %u\r\n\r\n",
+                       b.len);
+
+#ifdef MSG_NOSIGNAL
+    if (send(fd, hdr, hdr_len, MSG_NOSIGNAL) == hdr_len) {
+      send(fd, b.buf, b.len, MSG_NOSIGNAL);
+    }
+
+#else
+    if (send(fd, hdr, hdr_len, 0) == hdr_len) { send(fd, b.buf, b.len, 0); }
+#endif
+
+    close(fd);
+  }
+
+  ck_free(b.buf);
+  return NULL;
+}
+
+/* Listen on AFL_METRICS_PORT and start the serving thread. */
+
+void metrics_init(afl_state_t *afl) {
+  struct sockaddr_in addr;
+  pthread_t          thread;
+  sigset_t           all, old;
+  u8                *host = afl->afl_env.afl_metrics_host;
+  s32                port, sock, one = 1;
+
+  if (!afl->afl_env.afl_metrics_port) { return; }
+
+  port = atoi(afl->afl_env.afl_metrics_port);
+  if (port <= 0 || port > 65535) {
+    FATAL("Bad value specified for AFL_METRICS_PORT");
+  }
+
+  if (!host) { host = METRICS_DEFAULT_HOST; }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+    FATAL("AFL_METRICS_HOST must be an IPv4 address");
+  }
+
+  sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (sock < 0) { PFATAL("socket() failed"); }
+
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) ||
+      listen(sock, 16)) {
+    PFATAL("Unable to listen on %s:%d for AFL_METRICS_PORT", host, port);
+  }
+
+  if (fcntl(sock, F_SETFD, FD_CLOEXEC)) { PFATAL("fcntl() failed"); }
+
+  afl->metrics = ck_alloc(sizeof(struct afl_metrics));
+  afl->metrics->fsrv_latency = afl->fsrv.latency;
+  afl->metrics->sock = sock;
+
+  /* the signals stay with the fuzzing thread */
+
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+
+  if (pthread_create(&thread, NULL, metrics_serve, afl->metrics)) {
+    FATAL("Unable to start the AFL_METRICS_PORT thread");
+  }
+
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  pthread_detach(thread);
+
+  OKF("Serving metrics on http://%s:%d/metrics", host, port);
+}
+
+/* Find the stage_execs slot of the stage the fuzzer switched to, the last
+   one takes all stages there is no room for. */
+
+void metrics_stage(afl_state_t *afl) {
+  struct afl_metrics *m = afl->metrics;
+  u8                 *name = afl->stage_short ? afl->stage_short : (u8 *)"none";
+  u8                  clean[METRICS_STAGE_LEN];
+  u32                 i;
+
+  /* label values must not need escaping */
+
+  for (i = 0; i < METRICS_STAGE_LEN - 1 && name[i]; ++i) {
+    clean[i] = isalnum(name[i]) ? name[i] : '_';
+  }
+
+  clean[i] = 0;
+
+  for (i = 0; i < m->stages; ++i) {
+    if (!strcmp((char *)m->stage_names[i], (char *)clean)) { break; }
+  }
+
+  if (i == m->stages) {
+    if (i < METRICS_STAGES) {
+      memcpy(m->stage_names[i], clean, METRICS_STAGE_LEN);
+      __atomic_store_n(&m->stages, i + 1, __ATOMIC_RELEASE);
+
+    } else {
+      i = METRICS_STAGES - 1;
+    }
+  }
+
+  m->stage_cur = i;
+  m->stage_last = afl->stage_short;
+}
+
+/* Copy what the fuzzing loop only counts elsewhere, with every UI update. */
+
+void metrics_publish(afl_state_t *afl, u32 t_bytes) {
+  struct afl_metrics *m = afl->metrics;
+
+  __atomic_store_n(&m->execs_done, afl->fsrv.total_execs, __ATOMIC_RELAXED);
+  __atomic_store_n(&m->cycles_done,
+                   afl->queue_cycle ? (afl->queue_cycle - 1) : 0,
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&m->corpus_count, afl->queued_items, __ATOMIC_RELAXED);
+  __atomic_store_n(&m->saved_crashes, afl->saved_crashes, __ATOMIC_RELAXED);
+  __atomic_store_n(&m->saved_hangs, afl->saved_hangs, __ATOMIC_RELAXED);
+  __atomic_store_n(&m->edges_found, t_bytes, __ATOMIC_RELAXED);
+}
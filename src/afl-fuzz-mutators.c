@@ -56,6 +56,170 @@ void run_afl_custom_queue_new_entry(afl_state_t *afl, struct queue_entry *q,
   }
 }
 
+/* The queue entry metadata of the custom mutators lives in
+   queue/.state/custom_meta/<entry>, as one record per mutator: the u32
+   length of its name, the u32 length of the metadata, the name and the
+   metadata. */
+
+static u8 *custom_meta_path(afl_state_t *afl, struct queue_entry *q) {
+  return alloc_printf("%s/queue/.state/custom_meta/%s", afl->out_dir,
+                      strrchr(q->fname, '/') + 1);
+}
+
+static void custom_meta_load(afl_state_t *afl, struct queue_entry *q,
+                             u8 *fn) {
+  struct stat st;
+  u8         *buf, *p, *end;
+  s32         fd;
+  u32         hdr[2];
+
+  fd = open(fn, O_RDONLY);
+  if (fd < 0) { return; }
+
+  if (fstat(fd, &st) || !st.st_size) {
+    close(fd);
+    return;
+  }
+
+  buf = ck_alloc_nozero(st.st_size);
+  ck_read(fd, buf, st.st_size, fn);
+  close(fd);
+
+  p = buf;
+  end = buf + st.st_size;
+
+  while (end - p >= (s64)sizeof(hdr)) {
+    memcpy(hdr, p, sizeof(hdr));
+    p += sizeof(hdr);
+
+    if ((u64)hdr[0] + hdr[1] > (u64)(end - p)) { break; }
+
+    LIST_FOREACH(&afl->custom_mutator_list, struct custom_mutator, {
+      if (el->afl_custom_queue_meta && !q->custom_meta[el->meta_idx].buf &&
+          strlen(el->name_short) == hdr[0] &&
+          !memcmp(p, el->name_short, hdr[0]) && hdr[1]) {
+        q->custom_meta[el->meta_idx].buf = ck_alloc_nozero(hdr[1]);
+        memcpy(q->custom_meta[el->meta_idx].buf, p + hdr[0], hdr[1]);
+        q->custom_meta[el->meta_idx].len = hdr[1];
+      }
+    });
+
+    p += hdr[0] + hdr[1];
+  }
+
+  ck_free(buf);
+}
+
+static void custom_meta_save(afl_state_t *afl, struct queue_entry *q) {
+  u8 *fn = custom_meta_path(afl, q);
+  s32 fd;
+  u32 hdr[2];
+
+  fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, DEFAULT_PERMISSION);
+  if (fd < 0) { PFATAL("Unable to create '%s'", fn); }
+
+  LIST_FOREACH(&afl->custom_mutator_list, struct custom_mutator, {
+    struct custom_meta *m = &q->custom_meta[el->meta_idx];
+
+    if (el->afl_custom_queue_meta && m->len) {
+      hdr[0] = strlen(el->name_short);
+      hdr[1] = m->len;
+      ck_write(fd, hdr, sizeof(hdr), fn);
+      ck_write(fd, el->name_short, hdr[0], fn);
+      ck_write(fd, m->buf, m->len, fn);
+    }
+  });
+
+  close(fd);
+  ck_free(fn);
+}
+
+/* Have the custom mutators compute the metadata of q that is missing. buf
+   is its input, or NULL to read it from disk. */
+
+static void custom_meta_fill(afl_state_t *afl, struct queue_entry *q,
+                             u8 *buf) {
+  u8 *mem = NULL;
+
+  LIST_FOREACH(&afl->custom_mutator_list, struct custom_mutator, {
+    struct custom_meta *m = &q->custom_meta[el->meta_idx];
+
+    if (el->afl_custom_queue_meta && !m->buf) {
+      u8    *meta = NULL;
+      size_t len;
+
+      if (!buf) {
+        queue_file_wait(afl, q);
+        s32 fd = open(q->fname, O_RDONLY);
+        if (fd < 0) { PFATAL("Unable to open '%s'", q->fname); }
+        buf = mem = ck_alloc_nozero(q->len);
+        ck_read(fd, mem, q->len, q->fname);
+        close(fd);
+      }
+
+      len = el->afl_custom_queue_meta(el->data, q->fname, buf, q->len, &meta);
+
+      if (len && meta) {
+        m->buf = ck_alloc_nozero(len);
+        memcpy(m->buf, meta, len);
+        m->len = len;
+      }
+    }
+  });
+
+  ck_free(mem);
+}
+
+/* Attach the metadata of the custom mutators to the new queue entry q,
+   taking it over from the sidecar file from if there is one. */
+
+void custom_meta_new(afl_state_t *afl, struct queue_entry *q, u8 *buf,
+                     u8 *from) {
+  if (likely(!afl->custom_meta_cnt)) { return; }
+
+  q->custom_meta = ck_alloc(afl->custom_meta_cnt * sizeof(struct custom_meta));
+
+  if (from) { custom_meta_load(afl, q, from); }
+  custom_meta_fill(afl, q, buf);
+  custom_meta_save(afl, q);
+}
+
+/* The input of q changed to buf, e.g. by trimming, so its metadata is
+   computed anew. */
+
+void custom_meta_update(afl_state_t *afl, struct queue_entry *q, u8 *buf) {
+  if (likely(!afl->custom_meta_cnt) || !q->custom_meta) { return; }
+
+  custom_meta_free(afl, q);
+  q->custom_meta = ck_alloc(afl->custom_meta_cnt * sizeof(struct custom_meta));
+
+  custom_meta_fill(afl, q, buf);
+  custom_meta_save(afl, q);
+
+  if (q != afl->queue_cur) { return; }
+
+  LIST_FOREACH(&afl->custom_mutator_list, struct custom_mutator, {
+    if (el->afl_custom_queue_get_meta) {
+      struct custom_meta *m = &q->custom_meta[el->meta_idx];
+
+      (void)el->afl_custom_queue_get_meta(el->data, q->fname, m->buf, m->len);
+    }
+  });
+}
+
+void custom_meta_free(afl_state_t *afl, struct queue_entry *q) {
+  u32 i;
+
+  if (!q->custom_meta) { return; }
+
+  for (i = 0; i < afl->custom_meta_cnt; ++i) {
+    ck_free(q->custom_meta[i].buf);
+  }
+
+  ck_free(q->custom_meta);
+  q->custom_meta = NULL;
+}
+
 void setup_custom_mutators(afl_state_t *afl) {
   /* Try mutator library first */
   struct custom_mutator *mutator;
@@ -63,12 +227,6 @@ void setup_custom_mutators(afl_state_t *afl) {
   u32                    prev_mutator_count = 0;
 
   if (fn) {
-    if (afl->limit_time_sig && afl->limit_time_sig != -1)
-      FATAL(
-          "MOpt and custom mutator are mutually exclusive. We accept pull "
-          "requests that integrates MOpt with the optional mutators "
-          "(custom/redqueen/...).");
-
     u8 *fn_token = (u8 *)strsep((char **)&fn, ";:,");
 
     if (likely(!fn_token)) {
@@ -99,13 +257,6 @@ void setup_custom_mutators(afl_state_t *afl) {
   u8 *module_name = afl->afl_env.afl_python_module;
 
   if (module_name) {
-    if (afl->limit_time_sig) {
-      FATAL(
-          "MOpt and Python mutator are mutually exclusive. We accept pull "
-          "requests that integrates MOpt with the optional mutators "
-          "(custom/redqueen/...).");
-    }
-
     struct custom_mutator *m = load_custom_mutator_py(afl, module_name);
     afl->custom_mutators_count++;
     list_append(&afl->custom_mutator_list, m);
@@ -117,12 +268,44 @@ void setup_custom_mutators(afl_state_t *afl) {
   }
 
 #endif
+
+  if (afl->custom_mutators_count) {
+    LIST_FOREACH(&afl->custom_mutator_list, struct custom_mutator, {
+      if (el->afl_custom_post_process || el->afl_custom_post_process_into) {
+        afl->custom_pp_last = el;
+      }
+    });
+  }
+
+  if (afl->afl_env.afl_post_process_cache && afl->custom_pp_last) {
+    s32 cnt = atoi(afl->afl_env.afl_post_process_cache);
+
+    if (cnt < 1 || cnt > (s32)PP_CACHE_MAX) {
+      FATAL("AFL_POST_PROCESS_CACHE must be between 1 and %u", PP_CACHE_MAX);
+    }
+
+    afl->pp_cache = ck_alloc(sizeof(struct pp_cache) +
+                             cnt * sizeof(struct pp_cache_entry));
+    afl->pp_cache->cnt = cnt;
+  }
 }
 
 void destroy_custom_mutators(afl_state_t *afl) {
+  if (afl->pp_cache) {
+    u32 i;
+
+    for (i = 0; i < afl->pp_cache->cnt; ++i) {
+      afl_free(afl->pp_cache->e[i].buf);
+    }
+
+    ck_free(afl->pp_cache);
+    afl->pp_cache = NULL;
+  }
+
   if (afl->custom_mutators_count) {
     LIST_FOREACH_CLEAR(&afl->custom_mutator_list, struct custom_mutator, {
       if (!el->data) { FATAL("Deintializing NULL mutator"); }
+      if (el->pool) { mutpool_destroy(el->pool); }
       if (el->afl_custom_deinit) el->afl_custom_deinit(el->data);
       if (el->dh) dlclose(el->dh);
 
@@ -181,6 +364,15 @@ struct custom_mutator *load_custom_mutator(afl_state_t *afl, const char *fn) {
     OKF("Found 'afl_custom_mutator'.");
   }
 
+  /* "afl_custom_fuzz_batch", optional */
+  mutator->afl_custom_fuzz_batch = dlsym(dh, "afl_custom_fuzz_batch");
+  if (!mutator->afl_custom_fuzz_batch) {
+    ACTF("optional symbol 'afl_custom_fuzz_batch' not found.");
+
+  } else {
+    OKF("Found 'afl_custom_fuzz_batch'.");
+  }
+
   /* "afl_custom_introspection", optional */
 #ifdef INTROSPECTION
   mutator->afl_custom_introspection = dlsym(dh, "afl_custom_introspection");
@@ -217,6 +409,16 @@ struct custom_mutator *load_custom_mutator(afl_state_t *afl, const char *fn) {
     OKF("Found 'afl_custom_post_process'.");
   }
 
+  /* "afl_custom_post_process_into", optional */
+  mutator->afl_custom_post_process_into =
+      dlsym(dh, "afl_custom_post_process_into");
+  if (!mutator->afl_custom_post_process_into) {
+    ACTF("optional symbol 'afl_custom_post_process_into' not found.");
+
+  } else {
+    OKF("Found 'afl_custom_post_process_into'.");
+  }
+
   u8 notrim = 0;
   /* "afl_custom_init_trim", optional */
   mutator->afl_custom_init_trim = dlsym(dh, "afl_custom_init_trim");
@@ -289,6 +491,25 @@ struct custom_mutator *load_custom_mutator(afl_state_t *afl, const char *fn) {
     OKF("Found 'afl_custom_queue_get'.");
   }
 
+  /* "afl_custom_queue_get_meta", optional */
+  mutator->afl_custom_queue_get_meta = dlsym(dh, "afl_custom_queue_get_meta");
+  if (!mutator->afl_custom_queue_get_meta) {
+    ACTF("optional symbol 'afl_custom_queue_get_meta' not found.");
+
+  } else {
+    OKF("Found 'afl_custom_queue_get_meta'.");
+  }
+
+  /* "afl_custom_queue_meta", optional */
+  mutator->afl_custom_queue_meta = dlsym(dh, "afl_custom_queue_meta");
+  if (!mutator->afl_custom_queue_meta) {
+    ACTF("optional symbol 'afl_custom_queue_meta' not found.");
+
+  } else {
+    OKF("Found 'afl_custom_queue_meta'.");
+    mutator->meta_idx = afl->custom_meta_cnt++;
+  }
+
   /* "afl_custom_splice_optout", optional, never called */
   mutator->afl_custom_splice_optout = dlsym(dh, "afl_custom_splice_optout");
   if (!mutator->afl_custom_splice_optout) {
@@ -299,6 +520,15 @@ struct custom_mutator *load_custom_mutator(afl_state_t *afl, const char *fn) {
     afl->custom_splice_optout = 1;
   }
 
+  /* "afl_custom_thread_safe", optional, never called */
+  mutator->afl_custom_thread_safe = dlsym(dh, "afl_custom_thread_safe");
+  if (!mutator->afl_custom_thread_safe) {
+    ACTF("optional symbol 'afl_custom_thread_safe' not found.");
+
+  } else {
+    OKF("Found 'afl_custom_thread_safe'.");
+  }
+
   /* "afl_custom_fuzz_send", optional */
   mutator->afl_custom_fuzz_send = dlsym(dh, "afl_custom_fuzz_send");
   if (!mutator->afl_custom_fuzz_send) {
@@ -342,6 +572,8 @@ struct custom_mutator *load_custom_mutator(afl_state_t *afl, const char *fn) {
     mutator->data = mutator->afl_custom_init(afl, rand_below(afl, 0xFFFFFFFF));
   }
 
+  mutpool_init(afl, mutator);
+
   mutator->stacked_custom = (mutator && mutator->afl_custom_havoc_mutation);
   mutator->stacked_custom_prob =
       6;  // like one of the default mutations in havoc
@@ -428,7 +660,7 @@ u8 trim_case_custom(afl_state_t *afl, struct queue_entry *q, u8 *in_buf,
         if (afl->stop_soon || fault == FSRV_RUN_ERROR) { goto abort_trimming; }
 
         classify_counts(&afl->fsrv);
-        cksum = hash64(afl->fsrv.trace_bits, afl->fsrv.map_size, HASH_CONST);
+        cksum = hash_trace_bits(&afl->fsrv);
       }
     }
 
@@ -484,23 +716,20 @@ u8 trim_case_custom(afl_state_t *afl, struct queue_entry *q, u8 *in_buf,
      version of the test case. */
 
   if (out_buf) {
-    s32 fd;
-
+    queue_file_wait(afl, q);
     unlink(q->fname); /* ignore errors */
-
-    fd = open(q->fname, O_WRONLY | O_CREAT | O_EXCL, DEFAULT_PERMISSION);
-
-    if (fd < 0) { PFATAL("Unable to create '%s'", q->fname); }
-
-    ck_write(fd, out_buf, out_len, q->fname);
-    close(fd);
+    q->write_seq = write_queue_file(afl, q->fname, out_buf, out_len);
+    q->seed_link = 0;
 
     /* Update the queue's knowledge of length as soon as we write the file.
        We do this here so that exit/error cases that *don't* update the file
        also don't update q->len. */
     q->len = out_len;
 
+    custom_meta_update(afl, q, out_buf);
+
     memcpy(afl->fsrv.trace_bits, afl->clean_trace_custom, afl->fsrv.map_size);
+    afl->fsrv.reset_full_map = true;
     update_bitmap_score(afl, q);
   }
 
@@ -0,0 +1,365 @@
+/*
+ * This implements AFL_CUSTOM_MUTATOR_THREADS: custom mutators that declare
+ * afl_custom_fuzz() thread safe (afl_custom_thread_safe) get a few threads
+ * that call it while the main thread runs the target. Each thread keeps
+ * MUTPOOL_SLOTS mutations ready in a ring of its own, which it alone fills
+ * and the main thread alone empties, so taking a mutation needs no lock.
+ * The locks and condition variables are only for waiting on an empty or
+ * full ring and for handing out a new queue entry.
+ *
+ */
+
+#include "afl-fuzz.h"
+#include <pthread.h>
+
+struct mutpool_slot {
+  u8 *buf;                              /* the mutation                 */
+  u32 size;                             /* allocated size of buf        */
+  u32 len;                              /* length of the mutation       */
+  u32 gen;                              /* generation it was made for   */
+  u8  end;                              /* afl_custom_fuzz() gave up    */
+};
+
+struct mutpool_worker {
+  struct mutpool     *pool;
+  pthread_t           thread;
+  u8                 *in, *add;         /* own copies of the inputs     */
+  u32                 in_size, add_size;
+  u64                 rand;             /* for picking a splice partner */
+  u32                 head, tail;       /* next slot to take / to fill  */
+  struct mutpool_slot slot[MUTPOOL_SLOTS];
+};
+
+struct mutpool {
+  struct custom_mutator *el;
+  pthread_mutex_t        lock;
+  pthread_cond_t         work;          /* a worker may go on           */
+  pthread_cond_t         ready;         /* a mutation was added         */
+  u32                    gen;           /* bumped for each queue entry  */
+  u8                     active, stop;
+  u32                    workers_waiting, main_waiting;
+
+  /* the queue entry the workers mutate, changed under lock */
+  u8 *in, *add[MUTPOOL_SPLICE];
+  u32 in_len, in_size, add_len[MUTPOOL_SPLICE], add_size[MUTPOOL_SPLICE];
+  u32 add_cnt, max_size;
+
+  s32                    cpu_aff, cpu_count;
+  u32                    threads, next; /* next worker to take from     */
+  struct mutpool_worker *taken_w;       /* handed out by mutpool_get()  */
+  struct mutpool_worker *w;
+};
+
+static inline u32 ring_used(struct mutpool_worker *w) {
+  return __atomic_load_n(&w->tail, __ATOMIC_SEQ_CST) -
+         __atomic_load_n(&w->head, __ATOMIC_SEQ_CST);
+}
+
+static void copy_in(u8 **dst, u32 *size, u8 *src, u32 len) {
+  if (len > *size) {
+    *dst = ck_realloc(*dst, len);
+    *size = len;
+  }
+
+  memcpy(*dst, src, len);
+}
+
+static void *mutpool_work(void *arg) {
+  struct mutpool_worker *w = arg;
+  struct mutpool        *p = w->pool;
+  struct mutpool_slot   *s;
+  u32                    gen, len, add_len, max_size;
+  u8                    *out, *add;
+  size_t                 out_len;
+
+#if defined(__linux__) && defined(HAVE_AFFINITY)
+  /* the thread got the core afl-fuzz bound itself to, move it off it */
+
+  if (p->cpu_aff >= 0 && p->cpu_count > 1) {
+    cpu_set_t c;
+    s32       i;
+
+    CPU_ZERO(&c);
+    for (i = 0; i < p->cpu_count; ++i) {
+      if (i != p->cpu_aff) { CPU_SET(i, &c); }
+    }
+
+    pthread_setaffinity_np(pthread_self(), sizeof(c), &c);
+  }
+
+#endif
+
+  while (1) {
+    pthread_mutex_lock(&p->lock);
+
+    /* counted before looking at the ring, see mutpool_release() */
+    __atomic_add_fetch(&p->workers_waiting, 1, __ATOMIC_SEQ_CST);
+
+    while (!p->stop && (!p->active || ring_used(w) == MUTPOOL_SLOTS)) {
+      pthread_cond_wait(&p->work, &p->lock);
+    }
+
+    __atomic_sub_fetch(&p->workers_waiting, 1, __ATOMIC_SEQ_CST);
+
+    if (p->stop) {
+      pthread_mutex_unlock(&p->lock);
+      break;
+    }
+
+    gen = p->gen;
+    len = p->in_len;
+    max_size = p->max_size;
+    copy_in(&w->in, &w->in_size, p->in, len);
+    add = NULL;
+    add_len = 0;
+
+    if (p->add_cnt) {
+      w->rand ^= w->rand << 13;
+      w->rand ^= w->rand >> 7;
+      w->rand ^= w->rand << 17;
+      u32 i = w->rand % p->add_cnt;
+      add_len = p->add_len[i];
+      copy_in(&w->add, &w->add_size, p->add[i], add_len);
+      add = w->add;
+    }
+
+    pthread_mutex_unlock(&p->lock);
+
+    out = NULL;
+    out_len = p->el->afl_custom_fuzz(p->el->data, w->in, len, &out, add,
+                                     add_len, max_size);
+
+    s = &w->slot[w->tail % MUTPOOL_SLOTS];
+    s->gen = gen;
+    s->end = !out;
+    s->len = out ? MIN(out_len, max_size) : 0;
+
+    if (s->len) { copy_in(&s->buf, &s->size, out, s->len); }
+
+    __atomic_store_n(&w->tail, w->tail + 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&p->main_waiting, __ATOMIC_SEQ_CST)) {
+      pthread_mutex_lock(&p->lock);
+      pthread_cond_signal(&p->ready);
+      pthread_mutex_unlock(&p->lock);
+    }
+  }
+
+  return NULL;
+}
+
+/* Start AFL_CUSTOM_MUTATOR_THREADS threads for el if it is thread safe. */
+
+void mutpool_init(afl_state_t *afl, struct custom_mutator *el) {
+  struct mutpool *p;
+  sigset_t        all, old;
+  s32             threads;
+  u32             i;
+
+  if (!afl->afl_env.afl_custom_mutator_threads || !el->afl_custom_fuzz ||
+      el->afl_custom_fuzz_batch) {
+    return;
+  }
+
+  threads = atoi(afl->afl_env.afl_custom_mutator_threads);
+  if (threads < 0 || threads > MUTPOOL_THREADS_MAX) {
+    FATAL("AFL_CUSTOM_MUTATOR_THREADS must be between 0 and %u",
+          MUTPOOL_THREADS_MAX);
+  }
+
+  if (!threads) { return; }
+
+  if (!el->afl_custom_thread_safe) {
+    WARNF(
+        "Custom mutator '%s' is not thread safe, ignoring "
+        "AFL_CUSTOM_MUTATOR_THREADS for it.",
+        el->name);
+    return;
+  }
+
+  p = ck_alloc(sizeof(struct mutpool));
+  p->el = el;
+  p->threads = threads;
+  p->cpu_aff = -1;
+  p->cpu_count = afl->cpu_core_count;
+#ifdef HAVE_AFFINITY
+  p->cpu_aff = afl->cpu_aff;
+#endif
+  p->w = ck_alloc(threads * sizeof(struct mutpool_worker));
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->work, NULL);
+  pthread_cond_init(&p->ready, NULL);
+
+  /* the signals stay with the fuzzing thread */
+
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+
+  for (i = 0; i < p->threads; ++i) {
+    p->w[i].pool = p;
+    p->w[i].rand = (afl->init_seed ^ 0x9e3779b97f4a7c15ULL) + i * 0x2545f491;
+    if (!p->w[i].rand) { p->w[i].rand = 1; }
+
+    if (pthread_create(&p->w[i].thread, NULL, mutpool_work, &p->w[i])) {
+      FATAL("Unable to start the AFL_CUSTOM_MUTATOR_THREADS threads");
+    }
+  }
+
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  el->pool = p;
+  OKF("Running afl_custom_fuzz() of '%s' in %u threads.", el->name,
+      p->threads);
+}
+
+/* Give the slot handed out last back to its worker. */
+
+static void mutpool_release(struct mutpool *p) {
+  struct mutpool_worker *w = p->taken_w;
+
+  if (!w) { return; }
+
+  p->taken_w = NULL;
+  __atomic_store_n(&w->head, w->head + 1, __ATOMIC_SEQ_CST);
+
+  /* a worker counts itself as waiting before it looks at its ring, so
+     either it sees the slot given back or the broadcast reaches it */
+
+  if (__atomic_load_n(&p->workers_waiting, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&p->lock);
+    pthread_cond_broadcast(&p->work);
+    pthread_mutex_unlock(&p->lock);
+  }
+}
+
+/* Have the workers mutate buf, the current queue entry, from now on. The
+   mutations they made of the previous one are dropped. */
+
+void mutpool_start(afl_state_t *afl, struct mutpool *p, u8 *buf, u32 len,
+                   u32 max_size) {
+  u32 i;
+
+  mutpool_release(p);
+
+  pthread_mutex_lock(&p->lock);
+
+  ++p->gen;
+  p->active = 1;
+  p->max_size = max_size;
+  p->in_len = len;
+  copy_in(&p->in, &p->in_size, buf, len);
+
+  p->add_cnt = 0;
+
+  if (likely(!afl->custom_splice_optout &&
+             afl->ready_for_splicing_count > 1)) {
+    for (i = 0; i < MUTPOOL_SPLICE; ++i) {
+      struct queue_entry *q = afl->queue_buf[splice_partner(afl)];
+      u8                 *add = queue_testcase_get(afl, q);
+
+      copy_in(&p->add[i], &p->add_size[i], add, q->len);
+      p->add_len[i] = q->len;
+      ++p->add_cnt;
+    }
+  }
+
+  for (i = 0; i < p->threads; ++i) {
+    __atomic_store_n(&p->w[i].head, __atomic_load_n(&p->w[i].tail,
+                                                    __ATOMIC_SEQ_CST),
+                     __ATOMIC_SEQ_CST);
+  }
+
+  pthread_cond_broadcast(&p->work);
+  pthread_mutex_unlock(&p->lock);
+}
+
+/* Take the next mutation of the current queue entry, waiting for one if
+   none is ready. It stays valid until the next call. Returns NULL if
+   afl_custom_fuzz() gave up on the entry. */
+
+u8 *mutpool_get(struct mutpool *p, u32 *len) {
+  struct mutpool_worker *w;
+  struct mutpool_slot   *s;
+  u32                    i;
+
+  mutpool_release(p);
+
+  while (1) {
+    for (i = 0; i < p->threads; ++i) {
+      w = &p->w[p->next];
+      p->next = (p->next + 1) % p->threads;
+
+      if (!ring_used(w)) { continue; }
+
+      s = &w->slot[w->head % MUTPOOL_SLOTS];
+      p->taken_w = w;
+
+      if (s->gen != p->gen) {
+        mutpool_release(p);
+        continue;
+      }
+
+      if (s->end) {
+        mutpool_release(p);
+        return NULL;
+      }
+
+      *len = s->len;
+      return s->buf;
+    }
+
+    /* all rings are empty, wait for a worker */
+
+    pthread_mutex_lock(&p->lock);
+    __atomic_store_n(&p->main_waiting, 1, __ATOMIC_SEQ_CST);
+
+    for (i = 0; i < p->threads; ++i) {
+      if (ring_used(&p->w[i])) { break; }
+    }
+
+    if (i == p->threads) { pthread_cond_wait(&p->ready, &p->lock); }
+
+    __atomic_store_n(&p->main_waiting, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&p->lock);
+  }
+}
+
+/* The custom mutator stage is over, let the workers rest. */
+
+void mutpool_stop(struct mutpool *p) {
+  mutpool_release(p);
+
+  pthread_mutex_lock(&p->lock);
+  p->active = 0;
+  pthread_mutex_unlock(&p->lock);
+}
+
+void mutpool_destroy(struct mutpool *p) {
+  u32 i, j;
+
+  pthread_mutex_lock(&p->lock);
+  p->stop = 1;
+  pthread_cond_broadcast(&p->work);
+  pthread_mutex_unlock(&p->lock);
+
+  for (i = 0; i < p->threads; ++i) {
+    pthread_join(p->w[i].thread, NULL);
+
+    ck_free(p->w[i].in);
+    ck_free(p->w[i].add);
+    for (j = 0; j < MUTPOOL_SLOTS; ++j) {
+      ck_free(p->w[i].slot[j].buf);
+    }
+  }
+
+  for (i = 0; i < MUTPOOL_SPLICE; ++i) {
+    ck_free(p->add[i]);
+  }
+
+  ck_free(p->in);
+  ck_free(p->w);
+  pthread_mutex_destroy(&p->lock);
+  pthread_cond_destroy(&p->work);
+  pthread_cond_destroy(&p->ready);
+  ck_free(p);
+}
@@ -26,38 +26,524 @@
 #include "afl-fuzz.h"
 #include <string.h>
 #include <limits.h>
+#include <math.h>
 #include "cmplog.h"
 #include "afl-mutations.h"
 
-/* MOpt */
+/* AFL_HAVOC_BANDIT: havoc picks its operators by Thompson sampling. Each
+   operator has a Beta posterior for the chance that an exec it took part in
+   finds a new entry. Every MUT_BANDIT_REBUILD execs a rate is drawn from
+   each posterior and scales the share the operator has in the static
+   mutation array of the mode, and the result goes into an alias table, so
+   a pick stays two random numbers. */
+
+struct mut_bandit {
+  double finds[MUT_MAX], /* Execs with a find, decayed       */
+      tries[MUT_MAX],    /* Execs the operator was in        */
+      total;             /* Sum of tries since the halving   */
+  u64  prob[MUT_MAX];    /* Alias table, scaled to 2^32      */
+  u8   alias[MUT_MAX];
+  u32 *array;            /* Static array the table is from   */
+  u32  execs;            /* Execs since the last rebuild     */
+};
+
+static inline double bandit_uniform(afl_state_t *afl) {
+  return ((u32)rand_next(afl) + 0.5) / 4294967296.0;
+}
+
+/* Marsaglia and Tsang, for shapes of at least 1. */
+
+static double bandit_gamma(afl_state_t *afl, double shape) {
+  double d = shape - 1.0 / 3, c = 1 / sqrt(9 * d), x, v;
+
+  while (1) {
+    do {
+      x = sqrt(-2 * log(bandit_uniform(afl))) *
+          cos(2 * 3.14159265358979 * bandit_uniform(afl));
+      v = 1 + c * x;
+
+    } while (v <= 0);
+
+    v = v * v * v;
+    if (log(bandit_uniform(afl)) < 0.5 * x * x + d - d * v + d * log(v)) {
+      return d * v;
+    }
+  }
+}
 
-static int select_algorithm(afl_state_t *afl, u32 max_algorithm) {
-  int i_puppet, j_puppet = 0, operator_number = max_algorithm;
+/* Vose's alias method, for picks in proportion to w. */
 
-  double range_sele =
-      (double)afl->probability_now[afl->swarm_now][operator_number - 1];
-  double sele = ((double)(rand_below(afl, 10000) * 0.0001 * range_sele));
+static void bandit_alias(struct mut_bandit *b, double *w) {
+  double sum = 0;
+  u32    small[MUT_MAX], large[MUT_MAX], n_small = 0, n_large = 0, i;
+
+  for (i = 0; i < MUT_MAX; ++i) {
+    sum += w[i];
+  }
 
-  for (i_puppet = 0; i_puppet < operator_num; ++i_puppet) {
-    if (unlikely(i_puppet == 0)) {
-      if (sele < afl->probability_now[afl->swarm_now][i_puppet]) { break; }
+  for (i = 0; i < MUT_MAX; ++i) {
+    w[i] = w[i] * MUT_MAX / sum;
+    if (w[i] < 1) {
+      small[n_small++] = i;
 
     } else {
-      if (sele < afl->probability_now[afl->swarm_now][i_puppet]) {
-        j_puppet = 1;
-        break;
+      large[n_large++] = i;
+    }
+  }
+
+  while (n_small && n_large) {
+    u32 s = small[--n_small], l = large[n_large - 1];
+
+    b->prob[s] = w[s] * 4294967296.0;
+    b->alias[s] = l;
+    w[l] -= 1 - w[s];
+    if (w[l] < 1) {
+      --n_large;
+      small[n_small++] = l;
+    }
+  }
+
+  while (n_large) {
+    b->prob[large[--n_large]] = 1ULL << 32;
+  }
+
+  while (n_small) {
+    b->prob[small[--n_small]] = 1ULL << 32;
+  }
+}
+
+static void bandit_rebuild(afl_state_t *afl, struct mut_bandit *b,
+                           u32 *array, u32 array_size) {
+  double w[MUT_MAX], theta[MUT_MAX], mean = 0;
+  u32    i;
+
+  memset(w, 0, sizeof(w));
+  for (i = 0; i < array_size; ++i) {
+    w[array[i]] += 1;
+  }
+
+  for (i = 0; i < MUT_MAX; ++i) {
+    if (!w[i]) { continue; }
+    double x = bandit_gamma(afl, 1 + b->finds[i]);
+    theta[i] = x / (x + bandit_gamma(afl, 1 + b->tries[i] - b->finds[i]));
+    mean += theta[i] * w[i];
+  }
+
+  mean /= array_size;
+
+  /* Every operator of the array keeps a share, so a bad start is undone. */
+
+  for (i = 0; i < MUT_MAX; ++i) {
+    if (!w[i]) { continue; }
+    w[i] *= MAX(theta[i], mean * MUT_BANDIT_FLOOR);
+  }
+
+  bandit_alias(b, w);
+  b->array = array;
+  b->execs = 0;
+}
+
+static inline u32 bandit_pick(afl_state_t *afl, struct mut_bandit *b) {
+  u32 i = rand_below(afl, MUT_MAX);
+  return (u32)rand_next(afl) < b->prob[i] ? i : b->alias[i];
+}
+
+/* Book one exec on the operators in used (a bit per operator). */
+
+static void bandit_reward(struct mut_bandit *b, u64 used, u8 found) {
+  u32 i;
+
+  while (used) {
+    i = __builtin_ctzll(used);
+    used &= used - 1;
+    b->tries[i] += 1;
+    b->finds[i] += found;
+    b->total += 1;
+  }
+
+  if (unlikely(b->total > MUT_BANDIT_WINDOW)) {
+    for (i = 0; i < MUT_MAX; ++i) {
+      b->tries[i] /= 2;
+      b->finds[i] /= 2;
+    }
+
+    b->total /= 2;
+  }
+
+  ++b->execs;
+}
+
+/* AFL_CUSTOM_MUTATOR_BANDIT: before each queue entry a find rate is drawn
+   from the Beta posterior of every custom mutator and of havoc, and each
+   gets the static budget scaled by its rate over the mean rate. Custom
+   mutators with afl_custom_fuzz_count() keep their own count. */
+
+static struct custom_bandit *custom_bandit_get(afl_state_t *afl) {
+  struct custom_bandit *b = afl->custom_bandit;
+  u32                   i = 0, active = 0;
+
+  if (likely(b)) { return b; }
+
+  b = ck_alloc(sizeof(struct custom_bandit) +
+               (afl->custom_mutators_count + 1) * sizeof(struct custom_arm));
+  b->arms = afl->custom_mutators_count + 1;
+
+  LIST_FOREACH(&afl->custom_mutator_list, struct custom_mutator, {
+    b->arm[i].active = (el->afl_custom_fuzz || el->afl_custom_fuzz_batch) &&
+                       !el->afl_custom_fuzz_count;
+    active += b->arm[i].active;
+    ++i;
+  });
+
+  b->arm[i].active = !afl->custom_only;
+  active += b->arm[i].active;
+
+  /* with a single arm there is nothing to share */
+
+  if (active < 2) {
+    for (i = 0; i < b->arms; ++i) {
+      b->arm[i].active = 0;
+    }
+  }
+
+  for (i = 0; i < b->arms; ++i) {
+    b->arm[i].share = 1;
+  }
+
+  return (afl->custom_bandit = b);
+}
+
+static void custom_bandit_draw(afl_state_t *afl, struct custom_bandit *b) {
+  double theta[b->arms], mean = 0;
+  u32    i, active = 0;
+
+  for (i = 0; i < b->arms; ++i) {
+    struct custom_arm *a = &b->arm[i];
+
+    if (!a->active) { continue; }
+    double x = bandit_gamma(afl, 1 + a->finds);
+    theta[i] = x / (x + bandit_gamma(afl, 1 + a->execs - a->finds));
+    mean += theta[i];
+    ++active;
+  }
+
+  if (!active) { return; }
+  mean /= active;
+
+  for (i = 0; i < b->arms; ++i) {
+    if (!b->arm[i].active) { continue; }
+    b->arm[i].share =
+        MIN(MAX(theta[i], mean * MUT_BANDIT_FLOOR) / mean, (double)active);
+  }
+}
+
+static void custom_bandit_reward(struct custom_bandit *b, u32 arm, u64 execs,
+                                 u64 finds) {
+  u32 i;
+
+  b->arm[arm].execs += execs;
+  b->arm[arm].finds += MIN(finds, execs);
+  b->total += execs;
+
+  if (unlikely(b->total > MUT_BANDIT_WINDOW)) {
+    for (i = 0; i < b->arms; ++i) {
+      b->arm[i].execs /= 2;
+      b->arm[i].finds /= 2;
+    }
+
+    b->total /= 2;
+  }
+}
+
+/* AFL_STAGE_BUDGET: every STAGE_BUDGET_PERIOD execs the stage groups fold
+   what they found and ran since the last update into decayed counts. A
+   group whose finds per exec are above the average of all groups gets
+   more of its static budget, one below less, with STAGE_BUDGET_PRIOR execs
+   at the average rate so that a group needs a record first. Havoc, splice
+   and the custom mutators have their length scaled; deterministic fuzzing,
+   redqueen and trimming run for an entry with their budget as the chance,
+   an entry they skip gets them on a later pass. */
+
+static const u8 stage_budget_group[STAGE_NUM_MAX] = {
+
+    [STAGE_FLIP1 ... STAGE_EXTRAS_AI] = BUDGET_DET,
+    [STAGE_HAVOC] = BUDGET_HAVOC,
+    [STAGE_SPLICE] = BUDGET_SPLICE,
+    [STAGE_PYTHON] = BUDGET_CUSTOM,
+    [STAGE_CUSTOM_MUTATOR] = BUDGET_CUSTOM,
+    [STAGE_COLORIZATION] = BUDGET_REDQUEEN,
+    [STAGE_ITS] = BUDGET_REDQUEEN,
+    [STAGE_INF] = BUDGET_DET,
+    [STAGE_QUICK] = BUDGET_DET
+
+};
+
+static struct stage_budget *stage_budget_get(afl_state_t *afl) {
+  struct stage_budget *b = afl->stage_budget;
+  u64 finds[BUDGET_NUM_MAX] = {0}, execs[BUDGET_NUM_MAX] = {0};
+  double rate, all_finds = 0, all_execs = 0;
+  u32    i;
+
+  if (unlikely(!b)) {
+    b = afl->stage_budget = ck_alloc(sizeof(struct stage_budget));
+    for (i = 0; i < BUDGET_NUM_MAX; ++i) {
+      b->share[i] = 1;
+    }
+  }
+
+  if (likely(afl->fsrv.total_execs < b->next)) { return b; }
+
+  b->next = afl->fsrv.total_execs + STAGE_BUDGET_PERIOD;
+
+  for (i = 0; i < STAGE_NUM_MAX; ++i) {
+    finds[stage_budget_group[i]] += afl->stage_finds[i];
+    execs[stage_budget_group[i]] += afl->stage_cycles[i];
+  }
+
+  finds[BUDGET_TRIM] = afl->bytes_trim_in - afl->bytes_trim_out;
+  execs[BUDGET_TRIM] = afl->bytes_trim_in;
+
+  for (i = 0; i < BUDGET_NUM_MAX; ++i) {
+    b->finds[i] *= STAGE_BUDGET_DECAY;
+    b->execs[i] *= STAGE_BUDGET_DECAY;
+    b->finds[i] += finds[i] - b->seen_finds[i];
+    b->execs[i] += execs[i] - b->seen_execs[i];
+    b->seen_finds[i] = finds[i];
+    b->seen_execs[i] = execs[i];
+
+    if (i != BUDGET_TRIM) {
+      all_finds += b->finds[i];
+      all_execs += b->execs[i];
+    }
+  }
+
+  /* nothing found recently, so nothing to go by */
+
+  if (all_finds < 1) { return b; }
+
+  rate = all_finds / all_execs;
+
+  for (i = 0; i < BUDGET_TRIM; ++i) {
+    double r = (b->finds[i] + rate * STAGE_BUDGET_PRIOR) /
+               (b->execs[i] + STAGE_BUDGET_PRIOR);
+
+    b->share[i] = MIN(MAX(r / rate, STAGE_BUDGET_MIN), STAGE_BUDGET_MAX);
+  }
+
+  if (b->execs[BUDGET_TRIM] >= 1) {
+    b->share[BUDGET_TRIM] = MIN(
+        MAX(b->finds[BUDGET_TRIM] / b->execs[BUDGET_TRIM] /
+                STAGE_BUDGET_TRIM_GAIN,
+            STAGE_BUDGET_MIN),
+        1);
+  }
+
+  return b;
+}
+
+/* Whether a stage of fixed length runs for this entry. */
+
+static inline u8 stage_budget_run(afl_state_t *afl, struct stage_budget *b,
+                                  u32 group) {
+  return b->share[group] >= 1 ||
+         rand_below(afl, 1000) < b->share[group] * 1000;
+}
+
+/* MOpt (-L) is a policy of the havoc loop. The stage picks its operators
+   like AFL_HAVOC_BANDIT does, with the share an operator has in the
+   mutation array scaled by its position in the current swarm. Every exec
+   is booked on the operators stacked into it. The pilot phase runs each
+   swarm for period_pilot execs and keeps the best position of every
+   operator, then the core phase runs the fittest swarm for period_core
+   execs, and after that pso_updating() moves all swarms. The swarms and
+   the alias table only change at these boundaries. */
+
+static void mopt_rebuild(afl_state_t *afl, struct mut_bandit *b, u32 *array,
+                         u32 array_size) {
+  double w[MUT_MAX];
+  u32    i;
+
+  memset(w, 0, sizeof(w));
+  for (i = 0; i < array_size; ++i) {
+    w[array[i]] += 1;
+  }
+
+  for (i = 0; i < MUT_MAX; ++i) {
+    w[i] *= afl->x_now[afl->swarm_now][i];
+  }
+
+  bandit_alias(b, w);
+  b->array = array;
+}
+
+/* Book one exec on the operators in used, returns 1 at the end of a
+   period. */
+
+static u8 mopt_reward(afl_state_t *afl, u64 used, u8 found) {
+  u64 *cycles, *finds, *execs;
+  u32  i;
+
+  if (afl->key_module) {
+    cycles = afl->core_operator_cycles_puppet_v2;
+    finds = afl->core_operator_finds_puppet_v2;
+    execs = &afl->tmp_core_time;
+
+  } else {
+    cycles = afl->stage_cycles_puppet_v2[afl->swarm_now];
+    finds = afl->stage_finds_puppet_v2[afl->swarm_now];
+    execs = &afl->tmp_pilot_time;
+  }
+
+  while (used) {
+    i = __builtin_ctzll(used);
+    used &= used - 1;
+    ++cycles[i];
+    finds[i] += found;
+  }
+
+  afl->total_puppet_find += found;
+
+  return ++*execs > (afl->key_module ? period_core : period_pilot);
+}
+
+static void pso_updating(afl_state_t *afl) {
+  afl->g_now++;
+  if (afl->g_now > afl->g_max) { afl->g_now = 0; }
+  afl->w_now =
+      (afl->w_init - afl->w_end) * (afl->g_max - afl->g_now) / (afl->g_max) +
+      afl->w_end;
+  int tmp_swarm, i, j;
+  u64 temp_operator_finds_puppet = 0;
+  for (i = 0; i < operator_num; ++i) {
+    afl->operator_finds_puppet[i] = afl->core_operator_finds_puppet[i];
+
+    for (j = 0; j < swarm_num; ++j) {
+      afl->operator_finds_puppet[i] =
+          afl->operator_finds_puppet[i] + afl->stage_finds_puppet[j][i];
+    }
+
+    temp_operator_finds_puppet =
+        temp_operator_finds_puppet + afl->operator_finds_puppet[i];
+  }
+
+  for (i = 0; i < operator_num; ++i) {
+    if (afl->operator_finds_puppet[i]) {
+      afl->G_best[i] = (double)((double)(afl->operator_finds_puppet[i]) /
+                                (double)(temp_operator_finds_puppet));
+    }
+  }
+
+  for (tmp_swarm = 0; tmp_swarm < swarm_num; ++tmp_swarm) {
+    double x_temp = 0.0;
+    for (i = 0; i < operator_num; ++i) {
+      afl->v_now[tmp_swarm][i] =
+          afl->w_now * afl->v_now[tmp_swarm][i] +
+          RAND_C * (afl->L_best[tmp_swarm][i] - afl->x_now[tmp_swarm][i]) +
+          RAND_C * (afl->G_best[i] - afl->x_now[tmp_swarm][i]);
+      afl->x_now[tmp_swarm][i] += afl->v_now[tmp_swarm][i];
+      if (afl->x_now[tmp_swarm][i] > v_max) {
+        afl->x_now[tmp_swarm][i] = v_max;
+
+      } else if (afl->x_now[tmp_swarm][i] < v_min) {
+        afl->x_now[tmp_swarm][i] = v_min;
+      }
+
+      x_temp += afl->x_now[tmp_swarm][i];
+    }
+
+    for (i = 0; i < operator_num; ++i) {
+      afl->x_now[tmp_swarm][i] = afl->x_now[tmp_swarm][i] / x_temp;
+    }
+  }
+
+  afl->swarm_now = 0;
+  afl->key_module = 0;
+}
+
+/* The end of a period: a pilot swarm gets its fitness and moves on, after
+   the last one the fittest swarm becomes the core, and after the core the
+   swarms are updated. */
+
+static void mopt_epoch(afl_state_t *afl) {
+  s32 i, cur = afl->swarm_now;
+
+  if (afl->key_module) {
+    memcpy(afl->core_operator_finds_puppet, afl->core_operator_finds_puppet_v2,
+           sizeof(afl->core_operator_finds_puppet));
+    memcpy(afl->core_operator_cycles_puppet,
+           afl->core_operator_cycles_puppet_v2,
+           sizeof(afl->core_operator_cycles_puppet));
+    afl->total_pacemaker_time += afl->tmp_core_time;
+    afl->tmp_core_time = 0;
+    afl->temp_puppet_find = afl->total_puppet_find;
+    pso_updating(afl);
+    return;
+  }
+
+  afl->swarm_fitness[cur] =
+      (double)(afl->total_puppet_find - afl->temp_puppet_find) /
+      ((double)(afl->tmp_pilot_time) / afl->period_pilot_tmp);
+
+  for (i = 0; i < operator_num; ++i) {
+    u64 cycles = afl->stage_cycles_puppet_v2[cur][i] -
+                 afl->stage_cycles_puppet[cur][i];
+
+    if (cycles) {
+      double eff = (double)(afl->stage_finds_puppet_v2[cur][i] -
+                            afl->stage_finds_puppet[cur][i]) /
+                   cycles;
+
+      if (afl->eff_best[cur][i] < eff) {
+        afl->eff_best[cur][i] = eff;
+        afl->L_best[cur][i] = afl->x_now[cur][i];
       }
     }
+
+    afl->stage_finds_puppet[cur][i] = afl->stage_finds_puppet_v2[cur][i];
+    afl->stage_cycles_puppet[cur][i] = afl->stage_cycles_puppet_v2[cur][i];
+  }
+
+  afl->total_pacemaker_time += afl->tmp_pilot_time;
+  afl->tmp_pilot_time = 0;
+  afl->temp_puppet_find = afl->total_puppet_find;
+
+  if (++afl->swarm_now < swarm_num) { return; }
+
+  double swarm_eff = 0.0;
+
+  afl->key_module = 1;
+  afl->swarm_now = 0;
+  for (i = 0; i < swarm_num; ++i) {
+    if (afl->swarm_fitness[i] > swarm_eff) {
+      swarm_eff = afl->swarm_fitness[i];
+      afl->swarm_now = i;
+    }
   }
 
-  if ((j_puppet == 1 &&
-       sele < afl->probability_now[afl->swarm_now][i_puppet - 1]) ||
-      (i_puppet + 1 < operator_num &&
-       sele > afl->probability_now[afl->swarm_now][i_puppet + 1])) {
-    FATAL("error select_algorithm");
+  memcpy(afl->core_operator_finds_puppet_v2, afl->core_operator_finds_puppet,
+         sizeof(afl->core_operator_finds_puppet));
+  memcpy(afl->core_operator_cycles_puppet_v2,
+         afl->core_operator_cycles_puppet,
+         sizeof(afl->core_operator_cycles_puppet));
+}
+
+/* -L minutes: the deterministic stages are skipped once nothing was found
+   for that long, and from then on. -L 0 starts there. */
+
+static u8 mopt_pacemaker(afl_state_t *afl) {
+  u64 cur_ms;
+
+  if (likely(afl->key_puppet)) { return 1; }
+
+  cur_ms = get_cur_time();
+  if (afl->last_find_time &&
+      cur_ms - afl->last_find_time >= (u32)afl->limit_time_puppet &&
+      !(afl->last_crash_time &&
+        cur_ms - afl->last_crash_time < (u32)afl->limit_time_puppet)) {
+    afl->key_puppet = 1;
   }
 
-  return i_puppet;
+  return afl->key_puppet;
 }
 
 /* Helper function to see if a particular change (xor_val = old ^ new) could
@@ -257,10 +743,65 @@ static void locate_diffs(u8 *ptr1, u8 *ptr2, u32 len, s32 *first, s32 *last) {
 
 #endif /* !IGNORE_FINDS */
 
+/* AFL_LARGE_INPUTS: of a queue entry longer than MAX_FILE, only a window of
+   LARGE_WINDOW bytes of its mapping is mutated, at the start, where the
+   headers are, every other time and at a random offset otherwise. The runs
+   patch the window into the rest of the entry, see common_fuzz_stuff(), and
+   save_if_interesting() puts the whole input together for a find. Returns
+   the window and sets *len to its length. */
+
+static u8 *large_window(afl_state_t *afl, u8 *in_buf, u32 *len) {
+  u32 win = LARGE_WINDOW, off = 0;
+
+  if (rand_below(afl, 2)) { off = rand_below(afl, *len - win + 1); }
+
+  afl->large = (struct fs_patch){in_buf, *len, off, win, afl->max_input, 0};
+
+  *len = win;
+  return in_buf + off;
+}
+
 /* Take the current entry from the queue, fuzz it for a while. This
    function is a tad too long... returns 0 if fuzzed successfully, 1 if
    skipped or bailed out. */
 
+/* Have the custom mutator el write up to the rest of the stage worth of
+   mutations of buf into the arena at once and run them. *cnt is how many
+   it gave, 0 if it is done with this entry. Returns 1 if it's time to bail
+   out. */
+
+static u8 custom_fuzz_batch(afl_state_t *afl, struct custom_mutator *el,
+                            u8 *buf, u32 len, u8 *add_buf, u32 add_len,
+                            u32 max_size, u32 *cnt) {
+  size_t sizes[CUSTOM_BATCH_MAX], off = 0;
+  u8    *bufs[CUSTOM_BATCH_MAX];
+  u32    lens[CUSTOM_BATCH_MAX], want, n = 0, i;
+
+  u8 *arena = afl_realloc(AFL_BUF_PARAM(custom_batch), CUSTOM_BATCH_ARENA);
+  if (unlikely(!arena)) { PFATAL("alloc"); }
+
+  want = MIN(afl->stage_max - afl->stage_cur, CUSTOM_BATCH_MAX);
+  *cnt = MIN(el->afl_custom_fuzz_batch(el->data, buf, len, add_buf, add_len,
+                                       max_size, arena, CUSTOM_BATCH_ARENA,
+                                       sizes, want),
+             want);
+
+  for (i = 0; i < *cnt; ++i) {
+    if (unlikely(sizes[i] > MIN(max_size, CUSTOM_BATCH_ARENA - off))) {
+      FATAL("Error in custom_fuzz_batch, output %u has %zu bytes", i,
+            sizes[i]);
+    }
+
+    if (sizes[i]) {
+      bufs[n] = arena + off;
+      lens[n++] = sizes[i];
+      off += sizes[i];
+    }
+  }
+
+  return common_fuzz_batch(afl, bufs, lens, n);
+}
+
 u8 fuzz_one_original(afl_state_t *afl) {
   u32 len, temp_len;
   u32 j;
@@ -274,6 +815,13 @@ u8 fuzz_one_original(afl_state_t *afl) {
   u8  a_collect[MAX_AUTO_EXTRA];
   u32 a_len = 0;
 
+  struct custom_bandit *cbandit = NULL;
+  struct stage_budget  *budget = NULL;
+
+  if (unlikely(afl->afl_env.afl_stage_budget)) {
+    budget = stage_budget_get(afl);
+  }
+
 #ifdef IGNORE_FINDS
 
   /* In IGNORE_FINDS mode, skip any entries that weren't in the
@@ -287,35 +835,54 @@ u8 fuzz_one_original(afl_state_t *afl) {
     /* The custom mutator will decide to skip this test case or not. */
 
     LIST_FOREACH(&afl->custom_mutator_list, struct custom_mutator, {
-      if (el->afl_custom_queue_get &&
-          !el->afl_custom_queue_get(el->data, afl->queue_cur->fname)) {
+      if (el->afl_custom_queue_get_meta) {
+        struct custom_meta *m = afl->queue_cur->custom_meta
+                                    ? &afl->queue_cur->custom_meta[el->meta_idx]
+                                    : NULL;
+
+        if (!el->afl_custom_queue_get_meta(el->data, afl->queue_cur->fname,
+                                           m ? m->buf : NULL,
+                                           m ? m->len : 0)) {
+          return 1;
+        }
+
+      } else if (el->afl_custom_queue_get &&
+
+                 !el->afl_custom_queue_get(el->data, afl->queue_cur->fname)) {
         return 1;
       }
     });
   }
 
-  if (likely(afl->pending_favored)) {
-    /* If we have any favored, non-fuzzed new arrivals in the queue,
-       possibly skip to them at the expense of already-fuzzed or non-favored
-       cases. */
+  /* The weight tree draws non-favored entries less often by these odds
+   right away, and pending favored entries are taken before it is drawn
+   from (see queue_weight() and next_pending_favored()). Only the queue
+   walk of -Z still rolls the dice. */
 
-    if ((afl->queue_cur->fuzz_level || !afl->queue_cur->favored) &&
-        likely(rand_below(afl, 100) < SKIP_TO_NEW_PROB)) {
-      return 1;
-    }
+  if (unlikely(afl->old_seed_selection)) {
+    if (likely(afl->pending_favored)) {
+      /* If we have any favored, non-fuzzed new arrivals in the queue,
+         possibly skip to them at the expense of already-fuzzed or
+         non-favored cases. */
+
+      if ((afl->queue_cur->fuzz_level || !afl->queue_cur->favored) &&
+          likely(rand_below(afl, 100) < SKIP_TO_NEW_PROB)) {
+        return 1;
+      }
 
-  } else if (!afl->non_instrumented_mode && !afl->queue_cur->favored &&
+    } else if (!afl->non_instrumented_mode && !afl->queue_cur->favored &&
 
-             afl->queued_items > 10) {
-    /* Otherwise, still possibly skip non-favored cases, albeit less often.
-       The odds of skipping stuff are higher for already-fuzzed inputs and
-       lower for never-fuzzed entries. */
+               afl->queued_items > SKIP_NFAV_MIN_ITEMS) {
+      /* Otherwise, still possibly skip non-favored cases, albeit less
+         often. The odds of skipping stuff are higher for already-fuzzed
+         inputs and lower for never-fuzzed entries. */
 
-    if (afl->queue_cycle > 1 && !afl->queue_cur->fuzz_level) {
-      if (likely(rand_below(afl, 100) < SKIP_NFAV_NEW_PROB)) { return 1; }
+      if (afl->queue_cycle > 1 && !afl->queue_cur->fuzz_level) {
+        if (likely(rand_below(afl, 100) < SKIP_NFAV_NEW_PROB)) { return 1; }
 
-    } else {
-      if (likely(rand_below(afl, 100) < SKIP_NFAV_OLD_PROB)) { return 1; }
+      } else {
+        if (likely(rand_below(afl, 100) < SKIP_NFAV_OLD_PROB)) { return 1; }
+      }
     }
   }
 
@@ -336,7 +903,8 @@ u8 fuzz_one_original(afl_state_t *afl) {
         afl->queue_cur->perf_score, afl->queue_cur->weight,
         afl->queue_cur->favored, afl->queue_cur->was_fuzzed,
         afl->queue_cur->exec_us,
-        likely(afl->n_fuzz) ? afl->n_fuzz[afl->queue_cur->n_fuzz_entry] : 0,
+        likely(afl->n_fuzz) ? n_fuzz_hits(afl, afl->queue_cur->n_fuzz_entry)
+                            : 0,
         afl->queue_cur->bitmap_size, afl->queue_cur->is_ascii, time_tmp);
     fflush(stdout);
   }
@@ -344,9 +912,6 @@ u8 fuzz_one_original(afl_state_t *afl) {
   orig_in = in_buf = queue_testcase_get(afl, afl->queue_cur);
   len = afl->queue_cur->len;
 
-  out_buf = afl_realloc(AFL_BUF_PARAM(out), len);
-  if (unlikely(!out_buf)) { PFATAL("alloc"); }
-
   afl->subseq_tmouts = 0;
 
   afl->cur_depth = afl->queue_cur->depth;
@@ -379,12 +944,17 @@ u8 fuzz_one_original(afl_state_t *afl) {
    * TRIMMING *
    ************/
 
+  if (unlikely(afl->shm_hints)) { hints_get(afl, afl->queue_cur, in_buf); }
+
   if (unlikely(!afl->non_instrumented_mode && !afl->queue_cur->trim_done &&
-               !afl->disable_trim)) {
+               !afl->disable_trim) &&
+      (likely(!budget) || stage_budget_run(afl, budget, BUDGET_TRIM))) {
     u32 old_len = afl->queue_cur->len;
 
+    u8 phase = phase_enter(afl, PHASE_TRIM);
     u8 res = trim_case(afl, afl->queue_cur, in_buf);
     orig_in = in_buf = queue_testcase_get(afl, afl->queue_cur);
+    phase_enter(afl, phase);
 
     if (unlikely(res == FSRV_RUN_ERROR)) {
       FATAL("Unable to execute target application");
@@ -403,8 +973,18 @@ u8 fuzz_one_original(afl_state_t *afl) {
 
     /* maybe current entry is not ready for splicing anymore */
     if (unlikely(len <= 4 && old_len > 4)) --afl->ready_for_splicing_count;
+
+    /* a trimmed input needs its field hints anew */
+    if (unlikely(afl->shm_hints)) { hints_get(afl, afl->queue_cur, in_buf); }
+  }
+
+  if (unlikely(len > MAX_FILE)) {
+    orig_in = in_buf = large_window(afl, in_buf, &len);
   }
 
+  out_buf = afl_realloc(AFL_BUF_PARAM(out), len);
+  if (unlikely(!out_buf)) { PFATAL("alloc"); }
+
   memcpy(out_buf, in_buf, len);
 
   /*********************
@@ -423,7 +1003,8 @@ u8 fuzz_one_original(afl_state_t *afl) {
 
   if (unlikely(afl->shm.cmplog_mode &&
                afl->queue_cur->colorized < afl->cmplog_lvl &&
-               (u32)len <= afl->cmplog_max_filesize)) {
+               (u32)len <= afl->cmplog_max_filesize) &&
+      (likely(!budget) || stage_budget_run(afl, budget, BUDGET_REDQUEEN))) {
     if (unlikely(len < 4)) {
       afl->queue_cur->colorized = CMPLOG_LVL_MAX;
 
@@ -434,9 +1015,18 @@ u8 fuzz_one_original(afl_state_t *afl) {
             afl->fsrv.total_execs % afl->queued_items <= 10)) ||
           get_cur_time() - afl->last_find_time > 250000) {  // 250 seconds
 
-        if (input_to_state_stage(afl, in_buf, out_buf, len)) {
-          goto abandon_entry;
+        u64 its_start_us = unlikely(afl->metrics) ? get_cur_time_us() : 0;
+        u8  phase = phase_enter(afl, PHASE_CMPLOG);
+        u8  its_res = input_to_state_stage(afl, in_buf, out_buf, len);
+        phase_enter(afl, phase);
+
+        if (unlikely(afl->metrics)) {
+          METRICS_ADD(&afl->metrics->cmplog_runs, 1);
+          METRICS_ADD(&afl->metrics->cmplog_us,
+                      get_cur_time_us() - its_start_us);
         }
+
+        if (its_res) { goto abandon_entry; }
       }
     }
   }
@@ -451,7 +1041,13 @@ u8 fuzz_one_original(afl_state_t *afl) {
   u8 is_logged = 0;
 
 #endif
-  if (!afl->skip_deterministic) {
+  /* the MOpt pacemaker, or AFL_STAGE_BUDGET, may leave them out */
+
+  u8 no_det = (afl->limit_time_sig > 0 && mopt_pacemaker(afl)) ||
+              (unlikely(budget) && !afl->skip_deterministic &&
+               !stage_budget_run(afl, budget, BUDGET_DET));
+
+  if (!afl->skip_deterministic && !no_det) {
     if (!skip_deterministic_stage(afl, in_buf, out_buf, len, before_det_time)) {
       goto abandon_entry;
     }
@@ -466,7 +1062,8 @@ u8 fuzz_one_original(afl_state_t *afl) {
   /* if skipdet decide to skip the seed or no interesting bytes found,
      we skip the whole deterministic stage as well */
 
-  if (likely(afl->skip_deterministic) || likely(afl->queue_cur->passed_det) ||
+  if (likely(afl->skip_deterministic) || unlikely(no_det) ||
+      likely(afl->queue_cur->passed_det) ||
       likely(!afl->queue_cur->skipdet_e->quick_eff_bytes) ||
       likely(perf_score <
              (afl->queue_cur->depth * 30 <= afl->havoc_max_mult * 100
@@ -512,7 +1109,7 @@ u8 fuzz_one_original(afl_state_t *afl) {
 
   if (common_fuzz_stuff(afl, out_buf, len)) { goto abandon_entry; }
 
-  prev_cksum = hash64(afl->fsrv.trace_bits, afl->fsrv.map_size, HASH_CONST);
+  prev_cksum = hash_trace_bits(&afl->fsrv);
   _prev_cksum = prev_cksum;
 
   /* Now flip bits. */
@@ -563,7 +1160,7 @@ u8 fuzz_one_original(afl_state_t *afl) {
       */
 
     if (!afl->non_instrumented_mode && (afl->stage_cur & 7) == 7) {
-      u64 cksum = hash64(afl->fsrv.trace_bits, afl->fsrv.map_size, HASH_CONST);
+      u64 cksum = hash_trace_bits(&afl->fsrv);
 
       if (afl->stage_cur == afl->stage_max - 1 && cksum == prev_cksum) {
         /* If at end of file and we are still collecting a string, grab the
@@ -1374,14 +1971,23 @@ skip_interest:
        loop. */
 
     for (j = 0; j < afl->extras_cnt; ++j) {
-      /* Skip extras probabilistically if afl->extras_cnt > AFL_MAX_DET_EXTRAS.
-         Also skip them if there's no room to insert the payload, if the token
-         is redundant, or if its entire span has no bytes set in the effector
+      /* As they are sorted by size, none of the rest fit either. */
+
+      if (afl->extras[j].len > len - i) {
+        afl->stage_max -= afl->extras_cnt - j;
+        break;
+      }
+
+      /* Skip extras probabilistically if afl->extras_cnt > AFL_MAX_DET_EXTRAS,
+         or all but the top ranked ones if the dictionary is ranked. Also skip
+         them if there's no room to insert the payload, if the token is
+         redundant, or if its entire span has no bytes set in the effector
          map. */
 
       if ((afl->extras_cnt > afl->max_det_extras &&
-           rand_below(afl, afl->extras_cnt) >= afl->max_det_extras) ||
-          afl->extras[j].len > len - i ||
+           (afl->extras_top_cnt
+                ? !afl->extras[j].top
+                : rand_below(afl, afl->extras_cnt) >= afl->max_det_extras)) ||
           !memcmp(afl->extras[j].data, out_buf + i, afl->extras[j].len)) {
         --afl->stage_max;
         continue;
@@ -1471,6 +2077,8 @@ skip_user_extras:
 
   if (!afl->a_extras_cnt) { goto skip_extras; }
 
+  sort_auto_extras(afl);
+
   afl->stage_name = "auto extras (over)";
   afl->stage_short = "ext_AO";
   afl->stage_cur = 0;
@@ -1493,9 +2101,13 @@ skip_user_extras:
     for (j = 0; j < min_extra_len; ++j) {
       /* See the comment in the earlier code; extras are sorted by size. */
 
-      if (afl->a_extras[j].len > len - i ||
-          !memcmp(afl->a_extras[j].data, out_buf + i, afl->a_extras[j].len)) {
-        --afl->stage_max;
+      if (afl->a_extras[j].len > len - i) {
+        afl->stage_max -= min_extra_len - j;
+        break;
+      }
+
+      if (!memcmp(afl->a_extras[j].data, out_buf + i, afl->a_extras[j].len)) {
+        --afl->stage_max;
         continue;
       }
 
@@ -1608,12 +2220,21 @@ custom_mutator_stage:
 
   orig_hit_cnt = afl->queued_items + afl->saved_crashes;
 
+  u32 arm = 0;
+
+  if (unlikely(afl->afl_env.afl_custom_mutator_bandit)) {
+    cbandit = custom_bandit_get(afl);
+    custom_bandit_draw(afl, cbandit);
+  }
+
 #ifdef INTROSPECTION
   afl->mutation[0] = 0;
 #endif
 
   LIST_FOREACH(&afl->custom_mutator_list, struct custom_mutator, {
-    if (el->afl_custom_fuzz) {
+    if (el->afl_custom_fuzz || el->afl_custom_fuzz_batch) {
+      u64 arm_hit_cnt = afl->queued_items + afl->saved_crashes;
+
       havoc_queued = afl->queued_items;
 
       afl->current_custom_fuzz = el;
@@ -1622,15 +2243,27 @@ custom_mutator_stage:
       if (el->afl_custom_fuzz_count) {
         afl->stage_max = el->afl_custom_fuzz_count(el->data, out_buf, len);
 
+      } else if (unlikely(cbandit && cbandit->arm[arm].active)) {
+        afl->stage_max = MAX((u32)(saved_max * cbandit->arm[arm].share), 1U);
+
       } else {
         afl->stage_max = saved_max;
       }
 
+      if (unlikely(budget) && !el->afl_custom_fuzz_count) {
+        afl->stage_max =
+            MAX((u32)(afl->stage_max * budget->share[BUDGET_CUSTOM]), 1U);
+      }
+
       has_custom_fuzz = true;
 
       afl->stage_short = el->name_short;
 
       if (afl->stage_max) {
+        if (el->pool) {
+          mutpool_start(afl, el->pool, out_buf, len, max_seed_size);
+        }
+
         for (afl->stage_cur = 0; afl->stage_cur < afl->stage_max;
              ++afl->stage_cur) {
           struct queue_entry *target = NULL;
@@ -1638,18 +2271,14 @@ custom_mutator_stage:
           u8                 *new_buf = NULL;
           u32                 target_len = 0;
 
-          /* check if splicing makes sense yet (enough entries) */
-          if (likely(!afl->custom_splice_optout &&
+          /* check if splicing makes sense yet (enough entries), the threads
+             of a pool have their own splice partners */
+          if (likely(!el->pool && !afl->custom_splice_optout &&
                      afl->ready_for_splicing_count > 1)) {
-            /* Pick a random other queue entry for passing to external API
-               that has the necessary length */
-
-            do {
-              tid = rand_below(afl, afl->queued_items);
-
-            } while (unlikely(tid == afl->current_entry ||
+            /* Pick another queue entry for passing to external API that has
+               the necessary length, see splice_partner() */
 
-                              afl->queue_buf[tid]->len < 4));
+            tid = splice_partner(afl);
 
             target = afl->queue_buf[tid];
             afl->splicing_with = tid;
@@ -1659,42 +2288,80 @@ custom_mutator_stage:
             target_len = target->len;
           }
 
-          u8 *mutated_buf = NULL;
+          if (el->pool) {
+            u32 mutated_len;
+            u8 *mutated_buf = mutpool_get(el->pool, &mutated_len);
 
-          size_t mutated_size =
-              el->afl_custom_fuzz(el->data, out_buf, len, &mutated_buf, new_buf,
-                                  target_len, max_seed_size);
+            if (unlikely(!mutated_buf)) { break; }
 
-          if (unlikely(!mutated_buf)) {
-            // FATAL("Error in custom_fuzz. Size returned: %zu", mutated_size);
-            break;
-          }
+            if (mutated_len &&
+                common_fuzz_stuff(afl, mutated_buf, mutated_len)) {
+              mutpool_stop(el->pool);
+              goto abandon_entry;
+            }
 
-          if (mutated_size > 0) {
-            if (common_fuzz_stuff(afl, mutated_buf, (u32)mutated_size)) {
+          } else if (el->afl_custom_fuzz_batch) {
+            /* the outputs of one call count as that many stage steps */
+
+            u32 cnt;
+
+            if (custom_fuzz_batch(afl, el, out_buf, len, new_buf, target_len,
+                                  max_seed_size, &cnt)) {
               goto abandon_entry;
             }
 
-            if (!el->afl_custom_fuzz_count) {
-              /* If we're finding new stuff, let's run for a bit longer, limits
-                permitting. */
+            if (unlikely(!cnt)) { break; }
+
+            afl->stage_cur += cnt - 1;
+
+          } else {
+            u8 *mutated_buf = NULL;
+
+            size_t mutated_size =
+                el->afl_custom_fuzz(el->data, out_buf, len, &mutated_buf,
+                                    new_buf, target_len, max_seed_size);
+
+            if (unlikely(!mutated_buf)) {
+              // FATAL("Error in custom_fuzz. Size returned: %zu",
+              // mutated_size);
+              break;
+            }
+
+            if (mutated_size > 0 &&
+                common_fuzz_stuff(afl, mutated_buf, (u32)mutated_size)) {
+              goto abandon_entry;
+            }
+          }
 
-              if (afl->queued_items != havoc_queued) {
-                if (perf_score <= afl->havoc_max_mult * 100) {
-                  afl->stage_max *= 2;
-                  perf_score *= 2;
-                }
+          if (!el->afl_custom_fuzz_count) {
+            /* If we're finding new stuff, let's run for a bit longer, limits
+              permitting. */
 
-                havoc_queued = afl->queued_items;
+            if (afl->queued_items != havoc_queued) {
+              if (perf_score <= afl->havoc_max_mult * 100) {
+                afl->stage_max *= 2;
+                perf_score *= 2;
               }
+
+              havoc_queued = afl->queued_items;
             }
           }
 
           /* out_buf may have been changed by the call to custom_fuzz */
-          memcpy(out_buf, in_buf, len);
+          if (!el->pool) { memcpy(out_buf, in_buf, len); }
         }
+
+        if (el->pool) { mutpool_stop(el->pool); }
+      }
+
+      if (unlikely(cbandit)) {
+        custom_bandit_reward(
+            cbandit, arm, afl->stage_cur,
+            afl->queued_items + afl->saved_crashes - arm_hit_cnt);
       }
     }
+
+    ++arm;
   });
 
   afl->current_custom_fuzz = NULL;
@@ -1736,12 +2403,24 @@ havoc_stage:
 
   afl->stage_cur_byte = -1;
 
+  /* With -L -1 MOpt picks the operators of every other stage. */
+
+  u8 mopt = afl->limit_time_sig > 0 ||
+            (afl->limit_time_sig < 0 && rand_below(afl, 2));
+
   /* The havoc stage mutation code is also invoked when splicing files; if the
      splice_cycle variable is set, generate different descriptions and such. */
 
   if (!splice_cycle) {
-    afl->stage_name = "havoc";
-    afl->stage_short = "havoc";
+    if (unlikely(mopt)) {
+      afl->stage_name = afl->key_module ? "MOpt-core-havoc" : "MOpt-havoc";
+      afl->stage_short = afl->key_module ? "MOpt_core_havoc" : "MOpt_havoc";
+
+    } else {
+      afl->stage_name = "havoc";
+      afl->stage_short = "havoc";
+    }
+
     afl->stage_max = ((doing_det ? HAVOC_CYCLES_INIT : HAVOC_CYCLES) *
                       perf_score / afl->havoc_div) >>
                      8;
@@ -1749,12 +2428,25 @@ havoc_stage:
   } else {
     perf_score = orig_perf;
 
-    snprintf(afl->stage_name_buf, STAGE_BUF_SIZE, "splice %u", splice_cycle);
+    snprintf(afl->stage_name_buf, STAGE_BUF_SIZE, "%ssplice %u",
+             !mopt ? "" : afl->key_module ? "MOpt-core-" : "MOpt-",
+             splice_cycle);
     afl->stage_name = afl->stage_name_buf;
-    afl->stage_short = "splice";
+    afl->stage_short = !mopt            ? "splice"
+                       : afl->key_module ? "MOpt_core_splice"
+                                         : "MOpt_splice";
     afl->stage_max = (SPLICE_HAVOC * perf_score / afl->havoc_div) >> 8;
   }
 
+  if (unlikely(cbandit && cbandit->arm[cbandit->arms - 1].active)) {
+    afl->stage_max *= cbandit->arm[cbandit->arms - 1].share;
+  }
+
+  if (unlikely(budget)) {
+    afl->stage_max *=
+        budget->share[splice_cycle ? BUDGET_SPLICE : BUDGET_HAVOC];
+  }
+
   if (unlikely(afl->stage_max < HAVOC_MIN)) { afl->stage_max = HAVOC_MIN; }
 
   temp_len = len;
@@ -1783,6 +2475,47 @@ havoc_stage:
 
   u32 *mutation_array;
   u32  stack_max, rand_max;  // stack_max_pow = afl->havoc_stack_pow2;
+  u64  mut_used = 0;
+
+  /* What havoc changed in out_buf since it was last restored from in_buf:
+     [havoc_lo, havoc_hi), and havoc_hi is UINT32_MAX once the length changed
+     at havoc_lo. Inserts and deletes move the tail in place, and after an
+     exec only this part is copied back, so large inputs cost what was
+     changed instead of their length per mutation. The first restore after
+     the stage setup copies it all. The range is also handed to the
+     forkserver, which then only patches the shared memory testcase. Not
+     with custom mutators (their post processing changes the testcase) or
+     when the runs go through workers or the pipeline. */
+
+  u32 havoc_lo = 0, havoc_hi = UINT32_MAX;
+  u8  havoc_diff = !afl->custom_mutators_count && !afl->workers_cnt &&
+                  !afl->fsrv.use_pipeline &&
+                  !afl->afl_env.afl_shm_full_write;
+
+  /* Finds get what havoc changed of in_buf, to trim only that (see
+     trim_case()), unless a custom mutator post processes the testcase. */
+
+  u8 havoc_inherit = !afl->custom_mutators_count;
+
+  afl->fsrv.shmem_fuzz_diff.base = NULL;
+
+#define HAVOC_TOUCH(_p, _n)                      \
+  do {                                           \
+    u32 _pt = (_p);                              \
+    if (_pt < havoc_lo) { havoc_lo = _pt; }      \
+    if (_pt + (_n) > havoc_hi) {                 \
+      havoc_hi = _pt + (_n);                     \
+    }                                            \
+                                                 \
+  } while (0)
+
+#define HAVOC_SHIFT(_p)                          \
+  do {                                           \
+    u32 _pt = (_p);                              \
+    if (_pt < havoc_lo) { havoc_lo = _pt; }      \
+    havoc_hi = UINT32_MAX;                       \
+                                                 \
+  } while (0)
 
   switch (afl->input_mode) {
     case 1: {  // TEXT
@@ -1855,6 +2588,30 @@ havoc_stage:
 
   // + (afl->extras_cnt ? 2 : 0) + (afl->a_extras_cnt ? 2 : 0);
 
+  struct mut_bandit *bandit = NULL;
+
+  if (unlikely(mopt)) {
+    if (unlikely(!afl->mut_mopt)) {
+      afl->mut_mopt = ck_alloc(sizeof(struct mut_bandit));
+    }
+
+    bandit = afl->mut_mopt;
+    if (bandit->array != mutation_array) {
+      mopt_rebuild(afl, bandit, mutation_array, rand_max);
+    }
+
+  } else if (unlikely(afl->afl_env.afl_havoc_bandit)) {
+    if (unlikely(!afl->mut_bandit)) {
+      afl->mut_bandit = ck_alloc(sizeof(struct mut_bandit));
+    }
+
+    bandit = afl->mut_bandit;
+    if (bandit->array != mutation_array ||
+        bandit->execs >= MUT_BANDIT_REBUILD) {
+      bandit_rebuild(afl, bandit, mutation_array, rand_max);
+    }
+  }
+
   // LS:init mutate_sum
   //  afl->mutate_sum=0;
   for (afl->stage_cur = 0; afl->stage_cur < afl->stage_max; ++afl->stage_cur) {
@@ -1880,6 +2637,7 @@ havoc_stage:
 
             if (likely(new_len > 0 && custom_havoc_buf)) {
               temp_len = new_len;
+              HAVOC_SHIFT(0);
               if (out_buf != custom_havoc_buf) {
                 out_buf = afl_realloc(AFL_BUF_PARAM(out), temp_len);
                 if (unlikely(!afl->out_buf)) { PFATAL("alloc"); }
@@ -1891,16 +2649,30 @@ havoc_stage:
       }
 
     retry_havoc_step: {
-      u32 r = rand_below(afl, rand_max), item;
+      if (unlikely(afl->queue_cur->hints_cnt) &&
+          !rand_below(afl, HINT_HAVOC_CHANCE)) {
+        u32 hint_off, hint_len = hints_havoc(afl, afl->queue_cur, out_buf,
+                                             temp_len, &hint_off);
+
+        if (hint_len) {
+          HAVOC_TOUCH(hint_off, hint_len);
+          continue;
+        }
+      }
+
+      u32 op = unlikely(bandit) ? bandit_pick(afl, bandit)
+                                : mutation_array[rand_below(afl, rand_max)],
+          item;
     //LS:log sample series
-//      fprintf(afl->log_file, "%u ", mutation_array[r]);
+//      fprintf(afl->log_file, "%u ", op);
 
-      switch (mutation_array[r]) {
+      switch (op) {
         case MUT_FLIPBIT: {
           /* Flip a single bit somewhere. Spooky! */
           u8  bit = rand_below(afl, 8);
           u32 off = rand_below(afl, temp_len);
           out_buf[off] ^= 1 << bit;
+          HAVOC_TOUCH(off, 1);
 
 #ifdef INTROSPECTION
           snprintf(afl->m_tmp, sizeof(afl->m_tmp), " FLIP-BIT_%u", bit);
@@ -1917,7 +2689,9 @@ havoc_stage:
           snprintf(afl->m_tmp, sizeof(afl->m_tmp), " INTERESTING8_%u", item);
           strcat(afl->mutation, afl->m_tmp);
 #endif
-          out_buf[rand_below(afl, temp_len)] = interesting_8[item];
+          u32 off = rand_below(afl, temp_len);
+          out_buf[off] = interesting_8[item];
+          HAVOC_TOUCH(off, 1);
           break;
         }
 
@@ -1932,8 +2706,9 @@ havoc_stage:
           strcat(afl->mutation, afl->m_tmp);
 #endif
 
-          *(u16 *)(out_buf + rand_below(afl, temp_len - 1)) =
-              interesting_16[item];
+          u32 off = rand_below(afl, temp_len - 1);
+          *(u16 *)(out_buf + off) = interesting_16[item];
+          HAVOC_TOUCH(off, 2);
 
           break;
         }
@@ -1948,8 +2723,9 @@ havoc_stage:
           snprintf(afl->m_tmp, sizeof(afl->m_tmp), " INTERESTING16BE_%u", item);
           strcat(afl->mutation, afl->m_tmp);
 #endif
-          *(u16 *)(out_buf + rand_below(afl, temp_len - 1)) =
-              SWAP16(interesting_16[item]);
+          u32 off = rand_below(afl, temp_len - 1);
+          *(u16 *)(out_buf + off) = SWAP16(interesting_16[item]);
+          HAVOC_TOUCH(off, 2);
 
           break;
         }
@@ -1965,8 +2741,9 @@ havoc_stage:
           strcat(afl->mutation, afl->m_tmp);
 #endif
 
-          *(u32 *)(out_buf + rand_below(afl, temp_len - 3)) =
-              interesting_32[item];
+          u32 off = rand_below(afl, temp_len - 3);
+          *(u32 *)(out_buf + off) = interesting_32[item];
+          HAVOC_TOUCH(off, 4);
 
           break;
         }
@@ -1981,8 +2758,9 @@ havoc_stage:
           snprintf(afl->m_tmp, sizeof(afl->m_tmp), " INTERESTING32BE_%u", item);
           strcat(afl->mutation, afl->m_tmp);
 #endif
-          *(u32 *)(out_buf + rand_below(afl, temp_len - 3)) =
-              SWAP32(interesting_32[item]);
+          u32 off = rand_below(afl, temp_len - 3);
+          *(u32 *)(out_buf + off) = SWAP32(interesting_32[item]);
+          HAVOC_TOUCH(off, 4);
 
           break;
         }
@@ -1995,7 +2773,9 @@ havoc_stage:
           snprintf(afl->m_tmp, sizeof(afl->m_tmp), " ARITH8-_%u", item);
           strcat(afl->mutation, afl->m_tmp);
 #endif
-          out_buf[rand_below(afl, temp_len)] -= item;
+          u32 off = rand_below(afl, temp_len);
+          out_buf[off] -= item;
+          HAVOC_TOUCH(off, 1);
           break;
         }
 
@@ -2007,7 +2787,9 @@ havoc_stage:
           snprintf(afl->m_tmp, sizeof(afl->m_tmp), " ARITH8+_%u", item);
           strcat(afl->mutation, afl->m_tmp);
 #endif
-          out_buf[rand_below(afl, temp_len)] += item;
+          u32 off = rand_below(afl, temp_len);
+          out_buf[off] += item;
+          HAVOC_TOUCH(off, 1);
           break;
         }
 
@@ -2017,6 +2799,7 @@ havoc_stage:
           if (unlikely(temp_len < 2)) { break; }  // no retry
 
           u32 pos = rand_below(afl, temp_len - 1);
+          HAVOC_TOUCH(pos, 2);
           item = 1 + rand_below(afl, ARITH_MAX);
 
 #ifdef INTROSPECTION
@@ -2034,6 +2817,7 @@ havoc_stage:
           if (unlikely(temp_len < 2)) { break; }  // no retry
 
           u32 pos = rand_below(afl, temp_len - 1);
+          HAVOC_TOUCH(pos, 2);
           u16 num = 1 + rand_below(afl, ARITH_MAX);
 
 #ifdef INTROSPECTION
@@ -2052,6 +2836,7 @@ havoc_stage:
           if (unlikely(temp_len < 2)) { break; }  // no retry
 
           u32 pos = rand_below(afl, temp_len - 1);
+          HAVOC_TOUCH(pos, 2);
           item = 1 + rand_below(afl, ARITH_MAX);
 
 #ifdef INTROSPECTION
@@ -2069,6 +2854,7 @@ havoc_stage:
           if (unlikely(temp_len < 2)) { break; }  // no retry
 
           u32 pos = rand_below(afl, temp_len - 1);
+          HAVOC_TOUCH(pos, 2);
           u16 num = 1 + rand_below(afl, ARITH_MAX);
 
 #ifdef INTROSPECTION
@@ -2087,6 +2873,7 @@ havoc_stage:
           if (unlikely(temp_len < 4)) { break; }  // no retry
 
           u32 pos = rand_below(afl, temp_len - 3);
+          HAVOC_TOUCH(pos, 4);
           item = 1 + rand_below(afl, ARITH_MAX);
 
 #ifdef INTROSPECTION
@@ -2104,6 +2891,7 @@ havoc_stage:
           if (unlikely(temp_len < 4)) { break; }  // no retry
 
           u32 pos = rand_below(afl, temp_len - 3);
+          HAVOC_TOUCH(pos, 4);
           u32 num = 1 + rand_below(afl, ARITH_MAX);
 
 #ifdef INTROSPECTION
@@ -2122,6 +2910,7 @@ havoc_stage:
           if (unlikely(temp_len < 4)) { break; }  // no retry
 
           u32 pos = rand_below(afl, temp_len - 3);
+          HAVOC_TOUCH(pos, 4);
           item = 1 + rand_below(afl, ARITH_MAX);
 
 #ifdef INTROSPECTION
@@ -2139,6 +2928,7 @@ havoc_stage:
           if (unlikely(temp_len < 4)) { break; }  // no retry
 
           u32 pos = rand_below(afl, temp_len - 3);
+          HAVOC_TOUCH(pos, 4);
           u32 num = 1 + rand_below(afl, ARITH_MAX);
 
 #ifdef INTROSPECTION
@@ -2164,6 +2954,7 @@ havoc_stage:
           strcat(afl->mutation, afl->m_tmp);
 #endif
           out_buf[pos] ^= item;
+          HAVOC_TOUCH(pos, 1);
           break;
         }
 
@@ -2180,24 +2971,20 @@ havoc_stage:
                      "COPY", clone_from, clone_to, clone_len);
             strcat(afl->mutation, afl->m_tmp);
 #endif
-            u8 *new_buf =
-                afl_realloc(AFL_BUF_PARAM(out_scratch), temp_len + clone_len);
+            u8 *new_buf = afl_realloc(AFL_BUF_PARAM(out_scratch), clone_len);
             if (unlikely(!new_buf)) { PFATAL("alloc"); }
+            memcpy(new_buf, out_buf + clone_from, clone_len);
 
-            /* Head */
-
-            memcpy(new_buf, out_buf, clone_to);
-
-            /* Inserted part */
-
-            memcpy(new_buf + clone_to, out_buf + clone_from, clone_len);
+            out_buf = afl_realloc(AFL_BUF_PARAM(out), temp_len + clone_len);
+            if (unlikely(!out_buf)) { PFATAL("alloc"); }
 
             /* Tail */
-            memcpy(new_buf + clone_to + clone_len, out_buf + clone_to,
-                   temp_len - clone_to);
+            memmove(out_buf + clone_to + clone_len, out_buf + clone_to,
+                    temp_len - clone_to);
 
-            out_buf = new_buf;
-            afl_swap_bufs(AFL_BUF_PARAM(out), AFL_BUF_PARAM(out_scratch));
+            /* Inserted part */
+            memcpy(out_buf + clone_to, new_buf, clone_len);
+            HAVOC_SHIFT(clone_to);
             temp_len += clone_len;
 
           } else if (unlikely(temp_len < 8)) {
@@ -2225,24 +3012,16 @@ havoc_stage:
                      "FIXED", strat, clone_to, clone_len);
             strcat(afl->mutation, afl->m_tmp);
 #endif
-            u8 *new_buf =
-                afl_realloc(AFL_BUF_PARAM(out_scratch), temp_len + clone_len);
-            if (unlikely(!new_buf)) { PFATAL("alloc"); }
-
-            /* Head */
-
-            memcpy(new_buf, out_buf, clone_to);
-
-            /* Inserted part */
-
-            memset(new_buf + clone_to, item, clone_len);
+            out_buf = afl_realloc(AFL_BUF_PARAM(out), temp_len + clone_len);
+            if (unlikely(!out_buf)) { PFATAL("alloc"); }
 
             /* Tail */
-            memcpy(new_buf + clone_to + clone_len, out_buf + clone_to,
-                   temp_len - clone_to);
+            memmove(out_buf + clone_to + clone_len, out_buf + clone_to,
+                    temp_len - clone_to);
 
-            out_buf = new_buf;
-            afl_swap_bufs(AFL_BUF_PARAM(out), AFL_BUF_PARAM(out_scratch));
+            /* Inserted part */
+            memset(out_buf + clone_to, item, clone_len);
+            HAVOC_SHIFT(clone_to);
             temp_len += clone_len;
 
           } else if (unlikely(temp_len < 8)) {
@@ -2275,6 +3054,7 @@ havoc_stage:
           strcat(afl->mutation, afl->m_tmp);
 #endif
           memmove(out_buf + copy_to, out_buf + copy_from, copy_len);
+          HAVOC_TOUCH(copy_to, copy_len);
 
           break;
         }
@@ -2297,6 +3077,7 @@ havoc_stage:
           strcat(afl->mutation, afl->m_tmp);
 #endif
           memset(out_buf + copy_to, item, copy_len);
+          HAVOC_TOUCH(copy_to, copy_len);
 
           break;
         }
@@ -2308,7 +3089,9 @@ havoc_stage:
           snprintf(afl->m_tmp, sizeof(afl->m_tmp), " BYTEADD_");
           strcat(afl->mutation, afl->m_tmp);
 #endif
-          out_buf[rand_below(afl, temp_len)]++;
+          u32 off = rand_below(afl, temp_len);
+          out_buf[off]++;
+          HAVOC_TOUCH(off, 1);
           break;
         }
 
@@ -2319,7 +3102,9 @@ havoc_stage:
           snprintf(afl->m_tmp, sizeof(afl->m_tmp), " BYTESUB_");
           strcat(afl->mutation, afl->m_tmp);
 #endif
-          out_buf[rand_below(afl, temp_len)]--;
+          u32 off = rand_below(afl, temp_len);
+          out_buf[off]--;
+          HAVOC_TOUCH(off, 1);
           break;
         }
 
@@ -2330,7 +3115,9 @@ havoc_stage:
           snprintf(afl->m_tmp, sizeof(afl->m_tmp), " FLIP8_");
           strcat(afl->mutation, afl->m_tmp);
 #endif
-          out_buf[rand_below(afl, temp_len)] ^= 0xff;
+          u32 off = rand_below(afl, temp_len);
+          out_buf[off] ^= 0xff;
+          HAVOC_TOUCH(off, 1);
           break;
         }
 
@@ -2376,6 +3163,8 @@ havoc_stage:
           /* Switch 2 */
 
           memcpy(out_buf + switch_to, new_buf, switch_len);
+          HAVOC_TOUCH(switch_from, switch_len);
+          HAVOC_TOUCH(switch_to, switch_len);
 
           break;
         }
@@ -2397,6 +3186,7 @@ havoc_stage:
 #endif
           memmove(out_buf + del_from, out_buf + del_from + del_len,
                   temp_len - del_from - del_len);
+          HAVOC_SHIFT(del_from);
 
           temp_len -= del_len;
 
@@ -2428,6 +3218,8 @@ havoc_stage:
             out_buf[off + j] = temp;
           }
 
+          HAVOC_TOUCH(off, len);
+
           break;
         }
 
@@ -2447,6 +3239,7 @@ havoc_stage:
 #endif
           memmove(out_buf + del_from, out_buf + del_from + del_len,
                   temp_len - del_from - del_len);
+          HAVOC_SHIFT(del_from);
 
           temp_len -= del_len;
 
@@ -2467,24 +3260,16 @@ havoc_stage:
                    clone_to);
           strcat(afl->mutation, afl->m_tmp);
 #endif
-          u8 *new_buf =
-              afl_realloc(AFL_BUF_PARAM(out_scratch), temp_len + clone_len);
-          if (unlikely(!new_buf)) { PFATAL("alloc"); }
-
-          /* Head */
-
-          memcpy(new_buf, out_buf, clone_to);
-
-          /* Inserted part */
-
-          memset(new_buf + clone_to, item, clone_len);
+          out_buf = afl_realloc(AFL_BUF_PARAM(out), temp_len + clone_len);
+          if (unlikely(!out_buf)) { PFATAL("alloc"); }
 
           /* Tail */
-          memcpy(new_buf + clone_to + clone_len, out_buf + clone_to,
-                 temp_len - clone_to);
+          memmove(out_buf + clone_to + clone_len, out_buf + clone_to,
+                  temp_len - clone_to);
 
-          out_buf = new_buf;
-          afl_swap_bufs(AFL_BUF_PARAM(out), AFL_BUF_PARAM(out_scratch));
+          /* Inserted part */
+          memset(out_buf + clone_to, item, clone_len);
+          HAVOC_SHIFT(clone_to);
           temp_len += clone_len;
 
           break;
@@ -2583,25 +3368,19 @@ havoc_stage:
 
           if (old_len == new_len) {
             memcpy(out_buf + off, buf, new_len);
+            HAVOC_TOUCH(off, new_len);
 
           } else {
-            u8 *new_buf = afl_realloc(AFL_BUF_PARAM(out_scratch),
-                                      temp_len + new_len - old_len);
-            if (unlikely(!new_buf)) { PFATAL("alloc"); }
-
-            /* Head */
-
-            memcpy(new_buf, out_buf, off);
-
-            /* Inserted part */
-
-            memcpy(new_buf + off, buf, new_len);
+            out_buf =
+                afl_realloc(AFL_BUF_PARAM(out), temp_len + new_len - old_len);
+            if (unlikely(!out_buf)) { PFATAL("alloc"); }
 
             /* Tail */
-            memcpy(new_buf + off + new_len, out_buf + off2, temp_len - off2);
+            memmove(out_buf + off + new_len, out_buf + off2, temp_len - off2);
 
-            out_buf = new_buf;
-            afl_swap_bufs(AFL_BUF_PARAM(out), AFL_BUF_PARAM(out_scratch));
+            /* Inserted part */
+            memcpy(out_buf + off, buf, new_len);
+            HAVOC_SHIFT(off);
             temp_len += (new_len - old_len);
           }
 
@@ -2630,6 +3409,7 @@ havoc_stage:
           char buf[20];
           snprintf(buf, sizeof(buf), "%llu", val);
           memcpy(out_buf + pos, buf, len);
+          HAVOC_TOUCH(pos, len);
 
           break;
         }
@@ -2639,7 +3419,7 @@ havoc_stage:
 
           /* Use the dictionary. */
 
-          u32 use_extra = rand_below(afl, afl->extras_cnt);
+          u32 use_extra = rand_extra(afl);
           u32 extra_len = afl->extras[use_extra].len;
 
           if (unlikely(extra_len > temp_len)) { goto retry_havoc_step; }
@@ -2651,6 +3431,7 @@ havoc_stage:
           strcat(afl->mutation, afl->m_tmp);
 #endif
           memcpy(out_buf + insert_at, afl->extras[use_extra].data, extra_len);
+          HAVOC_TOUCH(insert_at, extra_len);
 
           break;
         }
@@ -2658,7 +3439,7 @@ havoc_stage:
         case MUT_EXTRA_INSERT: {
           if (unlikely(!afl->extras_cnt)) { goto retry_havoc_step; }
 
-          u32 use_extra = rand_below(afl, afl->extras_cnt);
+          u32 use_extra = rand_extra(afl);
           u32 extra_len = afl->extras[use_extra].len;
           if (unlikely(temp_len + extra_len >= MAX_FILE)) {
             goto retry_havoc_step;
@@ -2681,6 +3462,7 @@ havoc_stage:
 
           /* Inserted part */
           memcpy(out_buf + insert_at, ptr, extra_len);
+          HAVOC_SHIFT(insert_at);
           temp_len += extra_len;
 
           break;
@@ -2703,6 +3485,7 @@ havoc_stage:
           strcat(afl->mutation, afl->m_tmp);
 #endif
           memcpy(out_buf + insert_at, afl->a_extras[use_extra].data, extra_len);
+          HAVOC_TOUCH(insert_at, extra_len);
 
           break;
         }
@@ -2733,6 +3516,7 @@ havoc_stage:
 
           /* Inserted part */
           memcpy(out_buf + insert_at, ptr, extra_len);
+          HAVOC_SHIFT(insert_at);
           temp_len += extra_len;
 
           break;
@@ -2743,15 +3527,9 @@ havoc_stage:
             goto retry_havoc_step;
           }
 
-          /* Pick a random queue entry and seek to it. */
-
-          u32 tid;
-          do {
-            tid = rand_below(afl, afl->queued_items);
-
-          } while (unlikely(tid == afl->current_entry ||
+          /* Pick a queue entry and seek to it, see splice_partner(). */
 
-                            afl->queue_buf[tid]->len < 4));
+          u32 tid = splice_partner(afl);
 
           /* Get the testcase for splicing. */
           struct queue_entry *target = afl->queue_buf[tid];
@@ -2775,6 +3553,7 @@ havoc_stage:
           strcat(afl->mutation, afl->m_tmp);
 #endif
           memmove(out_buf + copy_to, new_buf + copy_from, copy_len);
+          HAVOC_TOUCH(copy_to, copy_len);
 
           break;
         }
@@ -2788,15 +3567,9 @@ havoc_stage:
             goto retry_havoc_step;
           }
 
-          /* Pick a random queue entry and seek to it. */
-
-          u32 tid;
-          do {
-            tid = rand_below(afl, afl->queued_items);
-
-          } while (unlikely(tid == afl->current_entry ||
+          /* Pick a queue entry and seek to it, see splice_partner(). */
 
-                            afl->queue_buf[tid]->len < 4));
+          u32 tid = splice_partner(afl);
 
           /* Get the testcase for splicing. */
           struct queue_entry *target = afl->queue_buf[tid];
@@ -2811,34 +3584,28 @@ havoc_stage:
           clone_from = rand_below(afl, new_len - clone_len + 1);
           clone_to = rand_below(afl, temp_len + 1);
 
-          u8 *temp_buf =
-              afl_realloc(AFL_BUF_PARAM(out_scratch), temp_len + clone_len + 1);
-          if (unlikely(!temp_buf)) { PFATAL("alloc"); }
+          out_buf = afl_realloc(AFL_BUF_PARAM(out), temp_len + clone_len + 1);
+          if (unlikely(!out_buf)) { PFATAL("alloc"); }
 
 #ifdef INTROSPECTION
           snprintf(afl->m_tmp, sizeof(afl->m_tmp), " SPLICE-INSERT_%u_%u_%u_%s",
                    clone_from, clone_to, clone_len, target->fname);
           strcat(afl->mutation, afl->m_tmp);
 #endif
-          /* Head */
-
-          memcpy(temp_buf, out_buf, clone_to);
-
-          /* Inserted part */
-
-          memcpy(temp_buf + clone_to, new_buf + clone_from, clone_len);
-
           /* Tail */
-          memcpy(temp_buf + clone_to + clone_len, out_buf + clone_to,
-                 temp_len - clone_to);
+          memmove(out_buf + clone_to + clone_len, out_buf + clone_to,
+                  temp_len - clone_to);
 
-          out_buf = temp_buf;
-          afl_swap_bufs(AFL_BUF_PARAM(out), AFL_BUF_PARAM(out_scratch));
+          /* Inserted part */
+          memcpy(out_buf + clone_to, new_buf + clone_from, clone_len);
+          HAVOC_SHIFT(clone_to);
           temp_len += clone_len;
 
           break;
         }
       }
+
+      mut_used |= 1ULL << op;
     }
     }
 //    fprintf(afl->log_file, "\n");
@@ -2850,14 +3617,81 @@ havoc_stage:
 //    fprintf(afl->log_file,"max:%u,cur:%u\n",afl->stage_max,afl->stage_cur);
 //    fprintf(afl->log_file,"ndm:%u,cur_val:%u\n",afl->mutate_sum,afl->stage_cur_val);
 
-    if (common_fuzz_stuff(afl, out_buf, temp_len)||afl->mutate_sum>afl->ndm_max) { goto abandon_entry; }
+    if (likely(havoc_diff)) {
+      afl->fsrv.write_diff =
+          (struct fs_diff){in_buf, len, MIN(havoc_lo, len), havoc_hi};
+    }
+
+    if (likely(havoc_inherit) && in_buf == orig_in) {
+      afl->mut_lo = havoc_lo;
+      afl->mut_hi = havoc_hi;
+    }
+
+    if (parallel_fuzz_stuff(afl, out_buf, temp_len)||afl->mutate_sum>afl->ndm_max) {
+      afl->fsrv.write_diff.base = NULL;
+      afl->mut_hi = 0;
+
+      if (unlikely(cbandit)) {
+        custom_bandit_reward(cbandit, cbandit->arms - 1, 1,
+                             afl->queued_items != havoc_queued);
+      }
+
+      /* the stage ends early, book what it ran */
+
+      new_hit_cnt = afl->queued_items + afl->saved_crashes;
+      afl->stage_finds[splice_cycle ? STAGE_SPLICE : STAGE_HAVOC] +=
+          new_hit_cnt - orig_hit_cnt;
+      afl->stage_cycles[splice_cycle ? STAGE_SPLICE : STAGE_HAVOC] +=
+          afl->stage_cur + 1;
+
+      goto abandon_entry;
+    }
+
+    afl->fsrv.write_diff.base = NULL;
+    afl->mut_hi = 0;
+
+    if (unlikely(mopt)) {
+      if (unlikely(mopt_reward(afl, mut_used,
+                               afl->queued_items != havoc_queued))) {
+        mopt_epoch(afl);
+        mopt_rebuild(afl, bandit, mutation_array, rand_max);
+      }
+
+      mut_used = 0;
+
+    } else if (unlikely(bandit)) {
+      bandit_reward(bandit, mut_used, afl->queued_items != havoc_queued);
+      mut_used = 0;
+      if (unlikely(bandit->execs >= MUT_BANDIT_REBUILD)) {
+        bandit_rebuild(afl, bandit, mutation_array, rand_max);
+      }
+    }
+
+    if (unlikely(cbandit)) {
+      custom_bandit_reward(cbandit, cbandit->arms - 1, 1,
+                           afl->queued_items != havoc_queued);
+    }
+
     /* out_buf might have been mangled a bit, so let's restore it to its
-       original size and shape. */
+       original size and shape. Post processing may have swapped the buffer
+       in write_to_testcase() and checksum fixups changed bytes havoc did
+       not touch, then all of it is restored. */
 
     out_buf = afl_realloc(AFL_BUF_PARAM(out), len);
     if (unlikely(!out_buf)) { PFATAL("alloc"); }
     temp_len = len;
-    memcpy(out_buf, in_buf, len);
+    if (unlikely(afl->custom_mutators_count || afl->queue_cur->cksum_cnt)) {
+      havoc_lo = 0;
+      havoc_hi = UINT32_MAX;
+    }
+
+    if (havoc_lo < len) {
+      memcpy(out_buf + havoc_lo, in_buf + havoc_lo,
+             MIN(havoc_hi, len) - havoc_lo);
+    }
+
+    havoc_lo = UINT32_MAX;
+    havoc_hi = 0;
 
     /* If we're finding new stuff, let's run for a bit longer, limits
        permitting. */
@@ -2872,6 +3706,11 @@ havoc_stage:
     }
   }
 
+  if (unlikely(afl->workers_cnt || afl->fsrv.use_pipeline) &&
+      flush_fsrv_workers(afl)) {
+    goto abandon_entry;
+  }
+
   new_hit_cnt = afl->queued_items + afl->saved_crashes;
 
   if (!splice_cycle) {
@@ -2903,7 +3742,8 @@ havoc_stage:
 retry_splicing:
 
   if (afl->use_splicing && splice_cycle++ < SPLICE_CYCLES &&
-      afl->ready_for_splicing_count > 1 && afl->queue_cur->len >= 4) {
+      afl->ready_for_splicing_count > 1 && afl->queue_cur->len >= 4 &&
+      !afl->large.file) {
     struct queue_entry *target;
     u32                 tid, split_at;
     u8                 *new_buf;
@@ -2917,14 +3757,9 @@ retry_splicing:
       len = afl->queue_cur->len;
     }
 
-    /* Pick a random queue entry and seek to it. Don't splice with yourself. */
-
-    do {
-      tid = rand_below(afl, afl->queued_items);
-
-    } while (
+    /* Pick a queue entry and seek to it, see splice_partner(). */
 
-        unlikely(tid == afl->current_entry || afl->queue_buf[tid]->len < 4));
+    tid = splice_partner(afl);
 
     /* Get the testcase */
     afl->splicing_with = tid;
@@ -2985,7 +3820,12 @@ retry_splicing:
 /* we are through with this queue entry - for this iteration */
 abandon_entry:
 
+  if (unlikely(afl->workers_cnt || afl->fsrv.use_pipeline)) {
+    flush_fsrv_workers(afl);
+  }
+
   afl->splicing_with = -1;
+  afl->large.file = NULL;
 
   /* Update afl->pending_not_fuzzed count if we made it through the calibration
      cycle and have not seen this entry before. */
@@ -2994,11 +3834,8 @@ abandon_entry:
       !afl->queue_cur->was_fuzzed && !afl->queue_cur->disabled) {
     --afl->pending_not_fuzzed;
     afl->queue_cur->was_fuzzed = 1;
-    afl->reinit_table = 1;
-    if (afl->queue_cur->favored) {
-      --afl->pending_favored;
-      afl->smallest_favored = -1;
-    }
+    update_queue_weight(afl, afl->queue_cur);
+    if (afl->queue_cur->favored) { --afl->pending_favored; }
   }
 
   ++afl->queue_cur->fuzz_level;
@@ -3006,2427 +3843,32 @@ abandon_entry:
   return ret_val;
 
 #undef FLIP_BIT
+#undef HAVOC_TOUCH
+#undef HAVOC_SHIFT
 }
 
-/* MOpt mode */
-static u8 mopt_common_fuzzing(afl_state_t *afl, MOpt_globals_t MOpt_globals) {
-  if (!MOpt_globals.is_pilot_mode) {
-    if (swarm_num == 1) {
-      afl->key_module = 2;
-      return 0;
-    }
-  }
-
-  u32 len, temp_len;
-  u32 i;
-  u32 j;
-  u8 *in_buf, *out_buf, *orig_in, *ex_tmp, *eff_map = 0;
-  u64 havoc_queued = 0, orig_hit_cnt, new_hit_cnt = 0, cur_ms_lv, prev_cksum,
-      _prev_cksum;
-  u32 splice_cycle = 0, perf_score = 100, orig_perf, eff_cnt = 1;
-
-  u8 ret_val = 1, doing_det = 0;
-
-  u8  a_collect[MAX_AUTO_EXTRA];
-  u32 a_len = 0;
-
-#ifdef IGNORE_FINDS
-
-  /* In IGNORE_FINDS mode, skip any entries that weren't in the
-     initial data set. */
-
-  if (afl->queue_cur->depth > 1) return 1;
-
-#else
-
-  if (likely(afl->pending_favored)) {
-    /* If we have any favored, non-fuzzed new arrivals in the queue,
-       possibly skip to them at the expense of already-fuzzed or non-favored
-       cases. */
-
-    if ((afl->queue_cur->fuzz_level || !afl->queue_cur->favored) &&
-        rand_below(afl, 100) < SKIP_TO_NEW_PROB) {
-      return 1;
-    }
-
-  } else if (!afl->non_instrumented_mode && !afl->queue_cur->favored &&
-
-             afl->queued_items > 10) {
-    /* Otherwise, still possibly skip non-favored cases, albeit less often.
-       The odds of skipping stuff are higher for already-fuzzed inputs and
-       lower for never-fuzzed entries. */
-
-    if (afl->queue_cycle > 1 && !afl->queue_cur->fuzz_level) {
-      if (likely(rand_below(afl, 100) < SKIP_NFAV_NEW_PROB)) { return 1; }
-
-    } else {
-      if (likely(rand_below(afl, 100) < SKIP_NFAV_OLD_PROB)) { return 1; }
-    }
-  }
-
-#endif /* ^IGNORE_FINDS */
-
-  if (afl->not_on_tty) {
-    ACTF("Fuzzing test case #%u (%u total, %llu crashes saved)...",
-         afl->current_entry, afl->queued_items, afl->saved_crashes);
-    fflush(stdout);
-  }
-
-  /* Map the test case into memory. */
-  orig_in = in_buf = queue_testcase_get(afl, afl->queue_cur);
-  len = afl->queue_cur->len;
-
-  out_buf = afl_realloc(AFL_BUF_PARAM(out), len);
-  if (unlikely(!out_buf)) { PFATAL("alloc"); }
-
-  afl->subseq_tmouts = 0;
-
-  afl->cur_depth = afl->queue_cur->depth;
-
-  /*******************************************
-   * CALIBRATION (only if failed earlier on) *
-   *******************************************/
-
-  if (unlikely(afl->queue_cur->cal_failed)) {
-    u8 res = FSRV_RUN_TMOUT;
-
-    if (afl->queue_cur->cal_failed < CAL_CHANCES) {
-      afl->queue_cur->exec_cksum = 0;
+/* The entry point for the mutator. MOpt (-L) is a policy of the havoc
+   stage of fuzz_one_original(). */
+u8 fuzz_one(afl_state_t *afl) {
+  u8 ret_val, phase = phase_enter(afl, PHASE_MUTATE);
 
-      res =
-          calibrate_case(afl, afl->queue_cur, in_buf, afl->queue_cycle - 1, 0);
+#ifdef _AFL_DOCUMENT_MUTATIONS
 
-      if (res == FSRV_RUN_ERROR) {
-        FATAL("Unable to execute target application");
-      }
-    }
+  u8 path_buf[PATH_MAX];
+  if (afl->do_document == 0) {
+    snprintf(path_buf, PATH_MAX, "%s/mutations", afl->out_dir);
+    afl->do_document = mkdir(path_buf, 0700);  // if it exists we do not care
+    afl->do_document = 1;
 
-    if (afl->stop_soon || res != afl->crash_mode) {
-      ++afl->cur_skipped_items;
-      goto abandon_entry;
-    }
+  } else {
+    afl->do_document = 2;
+    afl->stop_soon = 2;
   }
 
-  /************
-   * TRIMMING *
-   ************/
-
-  if (unlikely(!afl->non_instrumented_mode && !afl->queue_cur->trim_done &&
-               !afl->disable_trim)) {
-    u32 old_len = afl->queue_cur->len;
-
-    u8 res = trim_case(afl, afl->queue_cur, in_buf);
-    orig_in = in_buf = queue_testcase_get(afl, afl->queue_cur);
-
-    if (unlikely(res == FSRV_RUN_ERROR)) {
-      FATAL("Unable to execute target application");
-    }
-
-    if (unlikely(afl->stop_soon)) {
-      ++afl->cur_skipped_items;
-      goto abandon_entry;
-    }
-
-    /* Don't retry trimming, even if it failed. */
-
-    afl->queue_cur->trim_done = 1;
-
-    len = afl->queue_cur->len;
-
-    /* maybe current entry is not ready for splicing anymore */
-    if (unlikely(len <= 4 && old_len > 4)) --afl->ready_for_splicing_count;
-  }
+#endif
 
-  memcpy(out_buf, in_buf, len);
+  ret_val = fuzz_one_original(afl);
 
-  /*********************
-   * PERFORMANCE SCORE *
-   *********************/
-
-  if (likely(!afl->old_seed_selection))
-    orig_perf = perf_score = afl->queue_cur->perf_score;
-  else
-    orig_perf = perf_score = calculate_score(afl, afl->queue_cur);
-
-  if (unlikely(perf_score <= 0 && afl->active_items > 1)) {
-    goto abandon_entry;
-  }
-
-  if (unlikely(afl->shm.cmplog_mode &&
-               afl->queue_cur->colorized < afl->cmplog_lvl &&
-               (u32)len <= afl->cmplog_max_filesize)) {
-    if (unlikely(len < 4)) {
-      afl->queue_cur->colorized = CMPLOG_LVL_MAX;
-
-    } else {
-      if (afl->cmplog_lvl == 3 ||
-          (afl->cmplog_lvl == 2 && afl->queue_cur->tc_ref) ||
-          !(afl->fsrv.total_execs % afl->queued_items) ||
-          get_cur_time() - afl->last_find_time > 300000) {  // 300 seconds
-
-        if (input_to_state_stage(afl, in_buf, out_buf, len)) {
-          goto abandon_entry;
-        }
-      }
-    }
-  }
-
-  /* Go to pacemker fuzzing if MOpt is doing well */
-
-  cur_ms_lv = get_cur_time();
-  if (!(afl->key_puppet == 0 &&
-        ((cur_ms_lv - afl->last_find_time < (u32)afl->limit_time_puppet) ||
-         (afl->last_crash_time != 0 &&
-          cur_ms_lv - afl->last_crash_time < (u32)afl->limit_time_puppet) ||
-         afl->last_find_time == 0))) {
-    afl->key_puppet = 1;
-    goto pacemaker_fuzzing;
-  }
-
-  /* Skip right away if -d is given, if we have done deterministic fuzzing on
-     this entry ourselves (was_fuzzed), or if it has gone through deterministic
-     testing in earlier, resumed runs (passed_det). */
-
-  if (likely(afl->skip_deterministic || afl->queue_cur->was_fuzzed ||
-             afl->queue_cur->passed_det)) {
-    goto havoc_stage;
-  }
-
-  /* Skip deterministic fuzzing if exec path checksum puts this out of scope
-     for this main instance. */
-
-  if (unlikely(afl->main_node_max &&
-               (afl->queue_cur->exec_cksum % afl->main_node_max) !=
-                   afl->main_node_id - 1)) {
-    goto havoc_stage;
-  }
-
-  doing_det = 1;
-
-  /*********************************************
-   * SIMPLE BITFLIP (+dictionary construction) *
-   *********************************************/
-
-#define FLIP_BIT(_ar, _b)                   \
-  do {                                      \
-    u8 *_arf = (u8 *)(_ar);                 \
-    u32 _bf = (_b);                         \
-    _arf[(_bf) >> 3] ^= (128 >> ((_bf)&7)); \
-                                            \
-  } while (0)
-
-  /* Single walking bit. */
-
-  afl->stage_short = "flip1";
-  afl->stage_max = len << 3;
-  afl->stage_name = "bitflip 1/1";
-
-  afl->stage_val_type = STAGE_VAL_NONE;
-
-  orig_hit_cnt = afl->queued_items + afl->saved_crashes;
-
-  /* Get a clean cksum. */
-
-  if (common_fuzz_stuff(afl, out_buf, len)) { goto abandon_entry; }
-
-  prev_cksum = hash64(afl->fsrv.trace_bits, afl->fsrv.map_size, HASH_CONST);
-  _prev_cksum = prev_cksum;
-
-  /* Now flip bits. */
-
-  for (afl->stage_cur = 0; afl->stage_cur < afl->stage_max; ++afl->stage_cur) {
-    afl->stage_cur_byte = afl->stage_cur >> 3;
-
-    FLIP_BIT(out_buf, afl->stage_cur);
-
-#ifdef INTROSPECTION
-    snprintf(afl->mutation, sizeof(afl->mutation), "%s MOPT_FLIP_BIT1-%u",
-             afl->queue_cur->fname, afl->stage_cur);
-#endif
-    if (common_fuzz_stuff(afl, out_buf, len)) { goto abandon_entry; }
-
-    FLIP_BIT(out_buf, afl->stage_cur);
-
-    /* While flipping the least significant bit in every byte, pull of an extra
-       trick to detect possible syntax tokens. In essence, the idea is that if
-       you have a binary blob like this:
-
-       xxxxxxxxIHDRxxxxxxxx
-
-       ...and changing the leading and trailing bytes causes variable or no
-       changes in program flow, but touching any character in the "IHDR" string
-       always produces the same, distinctive path, it's highly likely that
-       "IHDR" is an atomically-checked magic value of special significance to
-       the fuzzed format.
-
-       We do this here, rather than as a separate stage, because it's a nice
-       way to keep the operation approximately "free" (i.e., no extra execs).
-
-       Empirically, performing the check when flipping the least significant bit
-       is advantageous, compared to doing it at the time of more disruptive
-       changes, where the program flow may be affected in more violent ways.
-
-       The caveat is that we won't generate dictionaries in the -d mode or -S
-       mode - but that's probably a fair trade-off.
-
-       This won't work particularly well with paths that exhibit variable
-       behavior, but fails gracefully, so we'll carry out the checks anyway.
-
-      */
-
-    if (!afl->non_instrumented_mode && (afl->stage_cur & 7) == 7) {
-      u64 cksum = hash64(afl->fsrv.trace_bits, afl->fsrv.map_size, HASH_CONST);
-
-      if (afl->stage_cur == afl->stage_max - 1 && cksum == prev_cksum) {
-        /* If at end of file and we are still collecting a string, grab the
-           final character and force output. */
-
-        if (a_len < MAX_AUTO_EXTRA) {
-          a_collect[a_len] = out_buf[afl->stage_cur >> 3];
-        }
-
-        ++a_len;
-
-        if (a_len >= MIN_AUTO_EXTRA && a_len <= MAX_AUTO_EXTRA) {
-          maybe_add_auto(afl, a_collect, a_len);
-        }
-
-      } else if (cksum != prev_cksum) {
-        /* Otherwise, if the checksum has changed, see if we have something
-           worthwhile queued up, and collect that if the answer is yes. */
-
-        if (a_len >= MIN_AUTO_EXTRA && a_len <= MAX_AUTO_EXTRA) {
-          maybe_add_auto(afl, a_collect, a_len);
-        }
-
-        a_len = 0;
-        prev_cksum = cksum;
-      }
-
-      /* Continue collecting string, but only if the bit flip actually made
-         any difference - we don't want no-op tokens. */
-
-      if (cksum != _prev_cksum) {
-        if (a_len < MAX_AUTO_EXTRA) {
-          a_collect[a_len] = out_buf[afl->stage_cur >> 3];
-        }
-
-        ++a_len;
-      }
-
-    } /* if (afl->stage_cur & 7) == 7 */
-
-  } /* for afl->stage_cur */
-
-  new_hit_cnt = afl->queued_items + afl->saved_crashes;
-
-  afl->stage_finds[STAGE_FLIP1] += new_hit_cnt - orig_hit_cnt;
-  afl->stage_cycles[STAGE_FLIP1] += afl->stage_max;
-#ifdef INTROSPECTION
-  afl->queue_cur->stats_mutated += afl->stage_max;
-#endif
-
-  /* Two walking bits. */
-
-  afl->stage_name = "bitflip 2/1";
-  afl->stage_short = "flip2";
-  afl->stage_max = (len << 3) - 1;
-
-  orig_hit_cnt = new_hit_cnt;
-
-  for (afl->stage_cur = 0; afl->stage_cur < afl->stage_max; ++afl->stage_cur) {
-    afl->stage_cur_byte = afl->stage_cur >> 3;
-
-    FLIP_BIT(out_buf, afl->stage_cur);
-    FLIP_BIT(out_buf, afl->stage_cur + 1);
-
-#ifdef INTROSPECTION
-    snprintf(afl->mutation, sizeof(afl->mutation), "%s MOPT_FLIP_BIT2-%u",
-             afl->queue_cur->fname, afl->stage_cur);
-#endif
-    if (common_fuzz_stuff(afl, out_buf, len)) { goto abandon_entry; }
-
-    FLIP_BIT(out_buf, afl->stage_cur);
-    FLIP_BIT(out_buf, afl->stage_cur + 1);
-
-  } /* for afl->stage_cur */
-
-  new_hit_cnt = afl->queued_items + afl->saved_crashes;
-
-  afl->stage_finds[STAGE_FLIP2] += new_hit_cnt - orig_hit_cnt;
-  afl->stage_cycles[STAGE_FLIP2] += afl->stage_max;
-#ifdef INTROSPECTION
-  afl->queue_cur->stats_mutated += afl->stage_max;
-#endif
-
-  /* Four walking bits. */
-
-  afl->stage_name = "bitflip 4/1";
-  afl->stage_short = "flip4";
-  afl->stage_max = (len << 3) - 3;
-
-  orig_hit_cnt = new_hit_cnt;
-
-  for (afl->stage_cur = 0; afl->stage_cur < afl->stage_max; ++afl->stage_cur) {
-    afl->stage_cur_byte = afl->stage_cur >> 3;
-
-    FLIP_BIT(out_buf, afl->stage_cur);
-    FLIP_BIT(out_buf, afl->stage_cur + 1);
-    FLIP_BIT(out_buf, afl->stage_cur + 2);
-    FLIP_BIT(out_buf, afl->stage_cur + 3);
-
-#ifdef INTROSPECTION
-    snprintf(afl->mutation, sizeof(afl->mutation), "%s MOPT_FLIP_BIT4-%u",
-             afl->queue_cur->fname, afl->stage_cur);
-#endif
-    if (common_fuzz_stuff(afl, out_buf, len)) { goto abandon_entry; }
-
-    FLIP_BIT(out_buf, afl->stage_cur);
-    FLIP_BIT(out_buf, afl->stage_cur + 1);
-    FLIP_BIT(out_buf, afl->stage_cur + 2);
-    FLIP_BIT(out_buf, afl->stage_cur + 3);
-
-  } /* for afl->stage_cur */
-
-  new_hit_cnt = afl->queued_items + afl->saved_crashes;
-
-  afl->stage_finds[STAGE_FLIP4] += new_hit_cnt - orig_hit_cnt;
-  afl->stage_cycles[STAGE_FLIP4] += afl->stage_max;
-#ifdef INTROSPECTION
-  afl->queue_cur->stats_mutated += afl->stage_max;
-#endif
-
-  /* Effector map setup. These macros calculate:
-
-     EFF_APOS      - position of a particular file offset in the map.
-     EFF_ALEN      - length of a map with a particular number of bytes.
-     EFF_SPAN_ALEN - map span for a sequence of bytes.
-
-   */
-
-#define EFF_APOS(_p) ((_p) >> EFF_MAP_SCALE2)
-#define EFF_REM(_x) ((_x) & ((1 << EFF_MAP_SCALE2) - 1))
-#define EFF_ALEN(_l) (EFF_APOS(_l) + !!EFF_REM(_l))
-#define EFF_SPAN_ALEN(_p, _l) (EFF_APOS((_p) + (_l)-1) - EFF_APOS(_p) + 1)
-
-  /* Initialize effector map for the next step (see comments below). Always
-         flag first and last byte as doing something. */
-
-  eff_map = afl_realloc(AFL_BUF_PARAM(eff), EFF_ALEN(len));
-  if (unlikely(!eff_map)) { PFATAL("alloc"); }
-  memset(eff_map, 0, EFF_ALEN(len));
-  eff_map[0] = 1;
-
-  if (EFF_APOS(len - 1) != 0) {
-    eff_map[EFF_APOS(len - 1)] = 1;
-    ++eff_cnt;
-  }
-
-  /* Walking byte. */
-
-  afl->stage_name = "bitflip 8/8";
-  afl->stage_short = "flip8";
-  afl->stage_max = len;
-
-  orig_hit_cnt = new_hit_cnt;
-  prev_cksum = _prev_cksum;
-
-  for (afl->stage_cur = 0; afl->stage_cur < afl->stage_max; ++afl->stage_cur) {
-    afl->stage_cur_byte = afl->stage_cur;
-
-    out_buf[afl->stage_cur] ^= 0xFF;
-
-#ifdef INTROSPECTION
-    snprintf(afl->mutation, sizeof(afl->mutation), "%s MOPT_FLIP_BIT8-%u",
-             afl->queue_cur->fname, afl->stage_cur);
-#endif
-    if (common_fuzz_stuff(afl, out_buf, len)) { goto abandon_entry; }
-
-    /* We also use this stage to pull off a simple trick: we identify
-       bytes that seem to have no effect on the current execution path
-       even when fully flipped - and we skip them during more expensive
-       deterministic stages, such as arithmetics or known ints. */
-
-    if (!eff_map[EFF_APOS(afl->stage_cur)]) {
-      u64 cksum;
-
-      /* If in non-instrumented mode or if the file is very short, just flag
-         everything without wasting time on checksums. */
-
-      if (!afl->non_instrumented_mode && len >= EFF_MIN_LEN) {
-        cksum = hash64(afl->fsrv.trace_bits, afl->fsrv.map_size, HASH_CONST);
-
-      } else {
-        cksum = ~prev_cksum;
-      }
-
-      if (cksum != prev_cksum) {
-        eff_map[EFF_APOS(afl->stage_cur)] = 1;
-        ++eff_cnt;
-      }
-    }
-
-    out_buf[afl->stage_cur] ^= 0xFF;
-
-  } /* for afl->stage_cur */
-
-  /* If the effector map is more than EFF_MAX_PERC dense, just flag the
-     whole thing as worth fuzzing, since we wouldn't be saving much time
-     anyway. */
-
-  if (eff_cnt != (u32)EFF_ALEN(len) &&
-      eff_cnt * 100 / EFF_ALEN(len) > EFF_MAX_PERC) {
-    memset(eff_map, 1, EFF_ALEN(len));
-
-    afl->blocks_eff_select += EFF_ALEN(len);
-
-  } else {
-    afl->blocks_eff_select += eff_cnt;
-  }
-
-  afl->blocks_eff_total += EFF_ALEN(len);
-
-  new_hit_cnt = afl->queued_items + afl->saved_crashes;
-
-  afl->stage_finds[STAGE_FLIP8] += new_hit_cnt - orig_hit_cnt;
-  afl->stage_cycles[STAGE_FLIP8] += afl->stage_max;
-#ifdef INTROSPECTION
-  afl->queue_cur->stats_mutated += afl->stage_max;
-#endif
-
-  /* Two walking bytes. */
-
-  if (len < 2) { goto skip_bitflip; }
-
-  afl->stage_name = "bitflip 16/8";
-  afl->stage_short = "flip16";
-  afl->stage_cur = 0;
-  afl->stage_max = len - 1;
-
-  orig_hit_cnt = new_hit_cnt;
-
-  for (i = 0; i < len - 1; ++i) {
-    /* Let's consult the effector map... */
-
-    if (!eff_map[EFF_APOS(i)] && !eff_map[EFF_APOS(i + 1)]) {
-      --afl->stage_max;
-      continue;
-    }
-
-    afl->stage_cur_byte = i;
-
-    *(u16 *)(out_buf + i) ^= 0xFFFF;
-
-#ifdef INTROSPECTION
-    snprintf(afl->mutation, sizeof(afl->mutation), "%s MOPT_FLIP_BIT16-%u",
-             afl->queue_cur->fname, afl->stage_cur);
-#endif
-    if (common_fuzz_stuff(afl, out_buf, len)) { goto abandon_entry; }
-    ++afl->stage_cur;
-
-    *(u16 *)(out_buf + i) ^= 0xFFFF;
-
-  } /* for i = 0; i < len */
-
-  new_hit_cnt = afl->queued_items + afl->saved_crashes;
-
-  afl->stage_finds[STAGE_FLIP16] += new_hit_cnt - orig_hit_cnt;
-  afl->stage_cycles[STAGE_FLIP16] += afl->stage_max;
-#ifdef INTROSPECTION
-  afl->queue_cur->stats_mutated += afl->stage_max;
-#endif
-
-  if (len < 4) { goto skip_bitflip; }
-
-  /* Four walking bytes. */
-
-  afl->stage_name = "bitflip 32/8";
-  afl->stage_short = "flip32";
-  afl->stage_cur = 0;
-  afl->stage_max = len - 3;
-
-  orig_hit_cnt = new_hit_cnt;
-
-  for (i = 0; i < len - 3; ++i) {
-    /* Let's consult the effector map... */
-    if (!eff_map[EFF_APOS(i)] && !eff_map[EFF_APOS(i + 1)] &&
-        !eff_map[EFF_APOS(i + 2)] && !eff_map[EFF_APOS(i + 3)]) {
-      --afl->stage_max;
-      continue;
-    }
-
-    afl->stage_cur_byte = i;
-
-    *(u32 *)(out_buf + i) ^= 0xFFFFFFFF;
-
-#ifdef INTROSPECTION
-    snprintf(afl->mutation, sizeof(afl->mutation), "%s MOPT_FLIP_BIT32-%u",
-             afl->queue_cur->fname, afl->stage_cur);
-#endif
-    if (common_fuzz_stuff(afl, out_buf, len)) { goto abandon_entry; }
-    ++afl->stage_cur;
-
-    *(u32 *)(out_buf + i) ^= 0xFFFFFFFF;
-
-  } /* for i = 0; i < len - 3 */
-
-  new_hit_cnt = afl->queued_items + afl->saved_crashes;
-
-  afl->stage_finds[STAGE_FLIP32] += new_hit_cnt - orig_hit_cnt;
-  afl->stage_cycles[STAGE_FLIP32] += afl->stage_max;
-#ifdef INTROSPECTION
-  afl->queue_cur->stats_mutated += afl->stage_max;
-#endif
-
-skip_bitflip:
-
-  if (afl->no_arith) { goto skip_arith; }
-
-  /**********************
-   * ARITHMETIC INC/DEC *
-   **********************/
-
-  /* 8-bit arithmetics. */
-
-  afl->stage_name = "arith 8/8";
-  afl->stage_short = "arith8";
-  afl->stage_cur = 0;
-  afl->stage_max = 2 * len * ARITH_MAX;
-
-  afl->stage_val_type = STAGE_VAL_LE;
-
-  orig_hit_cnt = new_hit_cnt;
-
-  for (i = 0; i < (u32)len; ++i) {
-    u8 orig = out_buf[i];
-
-    /* Let's consult the effector map... */
-
-    if (!eff_map[EFF_APOS(i)]) {
-      afl->stage_max -= 2 * ARITH_MAX;
-      continue;
-    }
-
-    afl->stage_cur_byte = i;
-
-    for (j = 1; j <= ARITH_MAX; ++j) {
-      u8 r = orig ^ (orig + j);
-
-      /* Do arithmetic operations only if the result couldn't be a product
-         of a bitflip. */
-
-      if (!could_be_bitflip(r)) {
-        afl->stage_cur_val = j;
-        out_buf[i] = orig + j;
-
-#ifdef INTROSPECTION
-        snprintf(afl->mutation, sizeof(afl->mutation), "%s MOPT_ARITH8+-%u-%u",
-                 afl->queue_cur->fname, i, j);
-#endif
-        if (common_fuzz_stuff(afl, out_buf, len)) { goto abandon_entry; }
-        ++afl->stage_cur;
-
-      } else {
-        --afl->stage_max;
-      }
-
-      r = orig ^ (orig - j);
-
-      if (!could_be_bitflip(r)) {
-        afl->stage_cur_val = -j;
-        out_buf[i] = orig - j;
-
-#ifdef INTROSPECTION
-        snprintf(afl->mutation, sizeof(afl->mutation), "%s MOPT_ARITH8_-%u-%u",
-                 afl->queue_cur->fname, i, j);
-#endif
-        if (common_fuzz_stuff(afl, out_buf, len)) { goto abandon_entry; }
-        ++afl->stage_cur;
-
-      } else {
-        --afl->stage_max;
-      }
-
-      out_buf[i] = orig;
-    }
-
-  } /* for i = 0; i < len */
-
-  new_hit_cnt = afl->queued_items + afl->saved_crashes;
-
-  afl->stage_finds[STAGE_ARITH8] += new_hit_cnt - orig_hit_cnt;
-  afl->stage_cycles[STAGE_ARITH8] += afl->stage_max;
-#ifdef INTROSPECTION
-  afl->queue_cur->stats_mutated += afl->stage_max;
-#endif
-
-  /* 16-bit arithmetics, both endians. */
-
-  if (len < 2) { goto skip_arith; }
-
-  afl->stage_name = "arith 16/8";
-  afl->stage_short = "arith16";
-  afl->stage_cur = 0;
-  afl->stage_max = 4 * (len - 1) * ARITH_MAX;
-
-  orig_hit_cnt = new_hit_cnt;
-
-  for (i = 0; i < len - 1; ++i) {
-    u16 orig = *(u16 *)(out_buf + i);
-
-    /* Let's consult the effector map... */
-
-    if (!eff_map[EFF_APOS(i)] && !eff_map[EFF_APOS(i + 1)]) {
-      afl->stage_max -= 4 * ARITH_MAX;
-      continue;
-    }
-
-    afl->stage_cur_byte = i;
-
-    for (j = 1; j <= ARITH_MAX; ++j) {
-      u16 r1 = orig ^ (orig + j), r2 = orig ^ (orig - j),
-          r3 = orig ^ SWAP16(SWAP16(orig) + j),
-          r4 = orig ^ SWAP16(SWAP16(orig) - j);
-
-      /* Try little endian addition and subtraction first. Do it only
-         if the operation would affect more than one byte (hence the
-         & 0xff overflow checks) and if it couldn't be a product of
-         a bitflip. */
-
-      afl->stage_val_type = STAGE_VAL_LE;
-
-      if ((orig & 0xff) + j > 0xff && !could_be_bitflip(r1)) {
-        afl->stage_cur_val = j;
-        *(u16 *)(out_buf + i) = orig + j;
-
-#ifdef INTROSPECTION
-        snprintf(afl->mutation, sizeof(afl->mutation), "%s MOPT_ARITH16+-%u-%u",
-                 afl->queue_cur->fname, i, j);
-#endif
-        if (common_fuzz_stuff(afl, out_buf, len)) { goto abandon_entry; }
-        ++afl->stage_cur;
-
-      } else {
-        --afl->stage_max;
-      }
-
-      if ((orig & 0xff) < j && !could_be_bitflip(r2)) {
-        afl->stage_cur_val = -j;
-        *(u16 *)(out_buf + i) = orig - j;
-
-#ifdef INTROSPECTION
-        snprintf(afl->mutation, sizeof(afl->mutation), "%s MOPT_ARITH16_-%u-%u",
-                 afl->queue_cur->fname, i, j);
-#endif
-        if (common_fuzz_stuff(afl, out_buf, len)) { goto abandon_entry; }
-        ++afl->stage_cur;
-
-      } else {
-        --afl->stage_max;
-      }
-
-      /* Big endian comes next. Same deal. */
-
-      afl->stage_val_type = STAGE_VAL_BE;
-
-      if ((orig >> 8) + j > 0xff && !could_be_bitflip(r3)) {
-        afl->stage_cur_val = j;
-        *(u16 *)(out_buf + i) = SWAP16(SWAP16(orig) + j);
-
-#ifdef INTROSPECTION
-        snprintf(afl->mutation, sizeof(afl->mutation),
-                 "%s MOPT_ARITH16+BE-%u-%u", afl->queue_cur->fname, i, j);
-#endif
-        if (common_fuzz_stuff(afl, out_buf, len)) { goto abandon_entry; }
-        ++afl->stage_cur;
-
-      } else {
-        --afl->stage_max;
-      }
-
-      if ((orig >> 8) < j && !could_be_bitflip(r4)) {
-        afl->stage_cur_val = -j;
-        *(u16 *)(out_buf + i) = SWAP16(SWAP16(orig) - j);
-
-#ifdef INTROSPECTION
-        snprintf(afl->mutation, sizeof(afl->mutation),
-                 "%s MOPT_ARITH16_BE+%u+%u", afl->queue_cur->fname, i, j);
-#endif
-        if (common_fuzz_stuff(afl, out_buf, len)) { goto abandon_entry; }
-        ++afl->stage_cur;
-
-      } else {
-        --afl->stage_max;
-      }
-
-      *(u16 *)(out_buf + i) = orig;
-    }
-
-  } /* for i = 0; i < len - 1 */
-
-  new_hit_cnt = afl->queued_items + afl->saved_crashes;
-
-  afl->stage_finds[STAGE_ARITH16] += new_hit_cnt - orig_hit_cnt;
-  afl->stage_cycles[STAGE_ARITH16] += afl->stage_max;
-#ifdef INTROSPECTION
-  afl->queue_cur->stats_mutated += afl->stage_max;
-#endif
-
-  /* 32-bit arithmetics, both endians. */
-
-  if (len < 4) { goto skip_arith; }
-
-  afl->stage_name = "arith 32/8";
-  afl->stage_short = "arith32";
-  afl->stage_cur = 0;
-  afl->stage_max = 4 * (len - 3) * ARITH_MAX;
-
-  orig_hit_cnt = new_hit_cnt;
-
-  for (i = 0; i < len - 3; ++i) {
-    u32 orig = *(u32 *)(out_buf + i);
-
-    /* Let's consult the effector map... */
-
-    if (!eff_map[EFF_APOS(i)] && !eff_map[EFF_APOS(i + 1)] &&
-        !eff_map[EFF_APOS(i + 2)] && !eff_map[EFF_APOS(i + 3)]) {
-      afl->stage_max -= 4 * ARITH_MAX;
-      continue;
-    }
-
-    afl->stage_cur_byte = i;
-
-    for (j = 1; j <= ARITH_MAX; ++j) {
-      u32 r1 = orig ^ (orig + j), r2 = orig ^ (orig - j),
-          r3 = orig ^ SWAP32(SWAP32(orig) + j),
-          r4 = orig ^ SWAP32(SWAP32(orig) - j);
-
-      /* Little endian first. Same deal as with 16-bit: we only want to
-         try if the operation would have effect on more than two bytes. */
-
-      afl->stage_val_type = STAGE_VAL_LE;
-
-      if ((orig & 0xffff) + j > 0xffff && !could_be_bitflip(r1)) {
-        afl->stage_cur_val = j;
-        *(u32 *)(out_buf + i) = orig + j;
-
-#ifdef INTROSPECTION
-        snprintf(afl->mutation, sizeof(afl->mutation), "%s MOPT_ARITH32+-%u-%u",
-                 afl->queue_cur->fname, i, j);
-#endif
-        if (common_fuzz_stuff(afl, out_buf, len)) { goto abandon_entry; }
-        ++afl->stage_cur;
-
-      } else {
-        --afl->stage_max;
-      }
-
-      if ((orig & 0xffff) < j && !could_be_bitflip(r2)) {
-        afl->stage_cur_val = -j;
-        *(u32 *)(out_buf + i) = orig - j;
-
-#ifdef INTROSPECTION
-        snprintf(afl->mutation, sizeof(afl->mutation), "%s MOPT_ARITH32_-%u-%u",
-                 afl->queue_cur->fname, i, j);
-#endif
-        if (common_fuzz_stuff(afl, out_buf, len)) { goto abandon_entry; }
-        ++afl->stage_cur;
-
-      } else {
-        --afl->stage_max;
-      }
-
-      /* Big endian next. */
-
-      afl->stage_val_type = STAGE_VAL_BE;
-
-      if ((SWAP32(orig) & 0xffff) + j > 0xffff && !could_be_bitflip(r3)) {
-        afl->stage_cur_val = j;
-        *(u32 *)(out_buf + i) = SWAP32(SWAP32(orig) + j);
-
-#ifdef INTROSPECTION
-        snprintf(afl->mutation, sizeof(afl->mutation),
-                 "%s MOPT_ARITH32+BE-%u-%u", afl->queue_cur->fname, i, j);
-#endif
-        if (common_fuzz_stuff(afl, out_buf, len)) { goto abandon_entry; }
-        ++afl->stage_cur;
-
-      } else {
-        --afl->stage_max;
-      }
-
-      if ((SWAP32(orig) & 0xffff) < j && !could_be_bitflip(r4)) {
-        afl->stage_cur_val = -j;
-        *(u32 *)(out_buf + i) = SWAP32(SWAP32(orig) - j);
-
-#ifdef INTROSPECTION
-        snprintf(afl->mutation, sizeof(afl->mutation),
-                 "%s MOPT_ARITH32_BE-%u-%u", afl->queue_cur->fname, i, j);
-#endif
-        if (common_fuzz_stuff(afl, out_buf, len)) { goto abandon_entry; }
-        ++afl->stage_cur;
-
-      } else {
-        --afl->stage_max;
-      }
-
-      *(u32 *)(out_buf + i) = orig;
-    }
-
-  } /* for i = 0; i < len - 3 */
-
-  new_hit_cnt = afl->queued_items + afl->saved_crashes;
-
-  afl->stage_finds[STAGE_ARITH32] += new_hit_cnt - orig_hit_cnt;
-  afl->stage_cycles[STAGE_ARITH32] += afl->stage_max;
-#ifdef INTROSPECTION
-  afl->queue_cur->stats_mutated += afl->stage_max;
-#endif
-
-skip_arith:
-
-  /**********************
-   * INTERESTING VALUES *
-   **********************/
-
-  afl->stage_name = "interest 8/8";
-  afl->stage_short = "int8";
-  afl->stage_cur = 0;
-  afl->stage_max = len * sizeof(interesting_8);
-
-  afl->stage_val_type = STAGE_VAL_LE;
-
-  orig_hit_cnt = new_hit_cnt;
-
-  /* Setting 8-bit integers. */
-
-  for (i = 0; i < (u32)len; ++i) {
-    u8 orig = out_buf[i];
-
-    /* Let's consult the effector map... */
-
-    if (!eff_map[EFF_APOS(i)]) {
-      afl->stage_max -= sizeof(interesting_8);
-      continue;
-    }
-
-    afl->stage_cur_byte = i;
-
-    for (j = 0; j < sizeof(interesting_8); ++j) {
-      /* Skip if the value could be a product of bitflips or arithmetics. */
-
-      if (could_be_bitflip(orig ^ (u8)interesting_8[j]) ||
-          could_be_arith(orig, (u8)interesting_8[j], 1)) {
-        --afl->stage_max;
-        continue;
-      }
-
-      afl->stage_cur_val = interesting_8[j];
-      out_buf[i] = interesting_8[j];
-
-#ifdef INTROSPECTION
-      snprintf(afl->mutation, sizeof(afl->mutation),
-               "%s MOPT_INTERESTING8-%u-%u", afl->queue_cur->fname, i, j);
-#endif
-      if (common_fuzz_stuff(afl, out_buf, len)) { goto abandon_entry; }
-
-      out_buf[i] = orig;
-      ++afl->stage_cur;
-    }
-
-  } /* for i = 0; i < len */
-
-  new_hit_cnt = afl->queued_items + afl->saved_crashes;
-
-  afl->stage_finds[STAGE_INTEREST8] += new_hit_cnt - orig_hit_cnt;
-  afl->stage_cycles[STAGE_INTEREST8] += afl->stage_max;
-#ifdef INTROSPECTION
-  afl->queue_cur->stats_mutated += afl->stage_max;
-#endif
-
-  /* Setting 16-bit integers, both endians. */
-
-  if (afl->no_arith || len < 2) { goto skip_interest; }
-
-  afl->stage_name = "interest 16/8";
-  afl->stage_short = "int16";
-  afl->stage_cur = 0;
-  afl->stage_max = 2 * (len - 1) * (sizeof(interesting_16) >> 1);
-
-  orig_hit_cnt = new_hit_cnt;
-
-  for (i = 0; i < len - 1; ++i) {
-    u16 orig = *(u16 *)(out_buf + i);
-
-    /* Let's consult the effector map... */
-
-    if (!eff_map[EFF_APOS(i)] && !eff_map[EFF_APOS(i + 1)]) {
-      afl->stage_max -= sizeof(interesting_16);
-      continue;
-    }
-
-    afl->stage_cur_byte = i;
-
-    for (j = 0; j < sizeof(interesting_16) / 2; ++j) {
-      afl->stage_cur_val = interesting_16[j];
-
-      /* Skip if this could be a product of a bitflip, arithmetics,
-         or single-byte interesting value insertion. */
-
-      if (!could_be_bitflip(orig ^ (u16)interesting_16[j]) &&
-          !could_be_arith(orig, (u16)interesting_16[j], 2) &&
-          !could_be_interest(orig, (u16)interesting_16[j], 2, 0)) {
-        afl->stage_val_type = STAGE_VAL_LE;
-
-        *(u16 *)(out_buf + i) = interesting_16[j];
-
-#ifdef INTROSPECTION
-        snprintf(afl->mutation, sizeof(afl->mutation),
-                 "%s MOPT_INTERESTING16-%u-%u", afl->queue_cur->fname, i, j);
-#endif
-        if (common_fuzz_stuff(afl, out_buf, len)) { goto abandon_entry; }
-        ++afl->stage_cur;
-
-      } else {
-        --afl->stage_max;
-      }
-
-      if ((u16)interesting_16[j] != SWAP16(interesting_16[j]) &&
-          !could_be_bitflip(orig ^ SWAP16(interesting_16[j])) &&
-          !could_be_arith(orig, SWAP16(interesting_16[j]), 2) &&
-          !could_be_interest(orig, SWAP16(interesting_16[j]), 2, 1)) {
-        afl->stage_val_type = STAGE_VAL_BE;
-
-#ifdef INTROSPECTION
-        snprintf(afl->mutation, sizeof(afl->mutation),
-                 "%s MOPT_INTERESTING16BE-%u-%u", afl->queue_cur->fname, i, j);
-#endif
-        *(u16 *)(out_buf + i) = SWAP16(interesting_16[j]);
-        if (common_fuzz_stuff(afl, out_buf, len)) { goto abandon_entry; }
-        ++afl->stage_cur;
-
-      } else {
-        --afl->stage_max;
-      }
-    }
-
-    *(u16 *)(out_buf + i) = orig;
-
-  } /* for i = 0; i < len - 1 */
-
-  new_hit_cnt = afl->queued_items + afl->saved_crashes;
-
-  afl->stage_finds[STAGE_INTEREST16] += new_hit_cnt - orig_hit_cnt;
-  afl->stage_cycles[STAGE_INTEREST16] += afl->stage_max;
-#ifdef INTROSPECTION
-  afl->queue_cur->stats_mutated += afl->stage_max;
-#endif
-
-  if (len < 4) { goto skip_interest; }
-
-  /* Setting 32-bit integers, both endians. */
-
-  afl->stage_name = "interest 32/8";
-  afl->stage_short = "int32";
-  afl->stage_cur = 0;
-  afl->stage_max = 2 * (len - 3) * (sizeof(interesting_32) >> 2);
-
-  orig_hit_cnt = new_hit_cnt;
-
-  for (i = 0; i < len - 3; ++i) {
-    u32 orig = *(u32 *)(out_buf + i);
-
-    /* Let's consult the effector map... */
-
-    if (!eff_map[EFF_APOS(i)] && !eff_map[EFF_APOS(i + 1)] &&
-        !eff_map[EFF_APOS(i + 2)] && !eff_map[EFF_APOS(i + 3)]) {
-      afl->stage_max -= sizeof(interesting_32) >> 1;
-      continue;
-    }
-
-    afl->stage_cur_byte = i;
-
-    for (j = 0; j < sizeof(interesting_32) / 4; ++j) {
-      afl->stage_cur_val = interesting_32[j];
-
-      /* Skip if this could be a product of a bitflip, arithmetics,
-         or word interesting value insertion. */
-
-      if (!could_be_bitflip(orig ^ (u32)interesting_32[j]) &&
-          !could_be_arith(orig, interesting_32[j], 4) &&
-          !could_be_interest(orig, interesting_32[j], 4, 0)) {
-        afl->stage_val_type = STAGE_VAL_LE;
-
-        *(u32 *)(out_buf + i) = interesting_32[j];
-
-#ifdef INTROSPECTION
-        snprintf(afl->mutation, sizeof(afl->mutation),
-                 "%s MOPT_INTERESTING32-%u-%u", afl->queue_cur->fname, i, j);
-#endif
-        if (common_fuzz_stuff(afl, out_buf, len)) { goto abandon_entry; }
-        ++afl->stage_cur;
-
-      } else {
-        --afl->stage_max;
-      }
-
-      if ((u32)interesting_32[j] != SWAP32(interesting_32[j]) &&
-          !could_be_bitflip(orig ^ SWAP32(interesting_32[j])) &&
-          !could_be_arith(orig, SWAP32(interesting_32[j]), 4) &&
-          !could_be_interest(orig, SWAP32(interesting_32[j]), 4, 1)) {
-        afl->stage_val_type = STAGE_VAL_BE;
-
-#ifdef INTROSPECTION
-        snprintf(afl->mutation, sizeof(afl->mutation),
-                 "%s MOPT_INTERESTING32BE-%u-%u", afl->queue_cur->fname, i, j);
-#endif
-        *(u32 *)(out_buf + i) = SWAP32(interesting_32[j]);
-        if (common_fuzz_stuff(afl, out_buf, len)) { goto abandon_entry; }
-        ++afl->stage_cur;
-
-      } else {
-        --afl->stage_max;
-      }
-    }
-
-    *(u32 *)(out_buf + i) = orig;
-
-  } /* for i = 0; i < len - 3 */
-
-  new_hit_cnt = afl->queued_items + afl->saved_crashes;
-
-  afl->stage_finds[STAGE_INTEREST32] += new_hit_cnt - orig_hit_cnt;
-  afl->stage_cycles[STAGE_INTEREST32] += afl->stage_max;
-#ifdef INTROSPECTION
-  afl->queue_cur->stats_mutated += afl->stage_max;
-#endif
-
-skip_interest:
-
-  /********************
-   * DICTIONARY STUFF *
-   ********************/
-
-  if (!afl->extras_cnt) { goto skip_user_extras; }
-
-  /* Overwrite with user-supplied extras. */
-
-  afl->stage_name = "user extras (over)";
-  afl->stage_short = "ext_UO";
-  afl->stage_cur = 0;
-  afl->stage_max = afl->extras_cnt * len;
-
-  afl->stage_val_type = STAGE_VAL_NONE;
-
-  orig_hit_cnt = new_hit_cnt;
-
-  for (i = 0; i < (u32)len; ++i) {
-    u32 last_len = 0;
-
-    afl->stage_cur_byte = i;
-
-    /* Extras are sorted by size, from smallest to largest. This means
-       that we don't have to worry about restoring the buffer in
-       between writes at a particular offset determined by the outer
-       loop. */
-
-    for (j = 0; j < afl->extras_cnt; ++j) {
-      /* Skip extras probabilistically if afl->extras_cnt > AFL_MAX_DET_EXTRAS.
-         Also skip them if there's no room to insert the payload, if the token
-         is redundant, or if its entire span has no bytes set in the effector
-         map. */
-
-      if ((afl->extras_cnt > afl->max_det_extras &&
-           rand_below(afl, afl->extras_cnt) >= afl->max_det_extras) ||
-          afl->extras[j].len > len - i ||
-          !memcmp(afl->extras[j].data, out_buf + i, afl->extras[j].len) ||
-          !memchr(eff_map + EFF_APOS(i), 1,
-                  EFF_SPAN_ALEN(i, afl->extras[j].len))) {
-        --afl->stage_max;
-        continue;
-      }
-
-      last_len = afl->extras[j].len;
-      memcpy(out_buf + i, afl->extras[j].data, last_len);
-
-#ifdef INTROSPECTION
-      snprintf(afl->mutation, sizeof(afl->mutation),
-               "%s MOPT_EXTRAS_overwrite-%u-%u", afl->queue_cur->fname, i, j);
-#endif
-
-      if (common_fuzz_stuff(afl, out_buf, len)) { goto abandon_entry; }
-
-      ++afl->stage_cur;
-    }
-
-    /* Restore all the clobbered memory. */
-    memcpy(out_buf + i, in_buf + i, last_len);
-
-  } /* for i = 0; i < len */
-
-  new_hit_cnt = afl->queued_items + afl->saved_crashes;
-
-  afl->stage_finds[STAGE_EXTRAS_UO] += new_hit_cnt - orig_hit_cnt;
-  afl->stage_cycles[STAGE_EXTRAS_UO] += afl->stage_max;
-#ifdef INTROSPECTION
-  afl->queue_cur->stats_mutated += afl->stage_max;
-#endif
-
-  /* Insertion of user-supplied extras. */
-
-  afl->stage_name = "user extras (insert)";
-  afl->stage_short = "ext_UI";
-  afl->stage_cur = 0;
-  afl->stage_max = afl->extras_cnt * (len + 1);
-
-  orig_hit_cnt = new_hit_cnt;
-
-  ex_tmp = afl_realloc(AFL_BUF_PARAM(ex), len + MAX_DICT_FILE);
-  if (unlikely(!ex_tmp)) { PFATAL("alloc"); }
-
-  for (i = 0; i <= (u32)len; ++i) {
-    afl->stage_cur_byte = i;
-
-    for (j = 0; j < afl->extras_cnt; ++j) {
-      if (len + afl->extras[j].len > MAX_FILE) {
-        --afl->stage_max;
-        continue;
-      }
-
-      /* Insert token */
-      memcpy(ex_tmp + i, afl->extras[j].data, afl->extras[j].len);
-
-      /* Copy tail */
-      memcpy(ex_tmp + i + afl->extras[j].len, out_buf + i, len - i);
-
-#ifdef INTROSPECTION
-      snprintf(afl->mutation, sizeof(afl->mutation),
-               "%s MOPT_EXTRAS_insert-%u-%u", afl->queue_cur->fname, i, j);
-#endif
-
-      if (common_fuzz_stuff(afl, ex_tmp, len + afl->extras[j].len)) {
-        goto abandon_entry;
-      }
-
-      ++afl->stage_cur;
-    }
-
-    /* Copy head */
-    ex_tmp[i] = out_buf[i];
-
-  } /* for i = 0; i <= len */
-
-  new_hit_cnt = afl->queued_items + afl->saved_crashes;
-
-  afl->stage_finds[STAGE_EXTRAS_UI] += new_hit_cnt - orig_hit_cnt;
-  afl->stage_cycles[STAGE_EXTRAS_UI] += afl->stage_max;
-#ifdef INTROSPECTION
-  afl->queue_cur->stats_mutated += afl->stage_max;
-#endif
-
-skip_user_extras:
-
-  if (!afl->a_extras_cnt) { goto skip_extras; }
-
-  afl->stage_name = "auto extras (over)";
-  afl->stage_short = "ext_AO";
-  afl->stage_cur = 0;
-  afl->stage_max = MIN(afl->a_extras_cnt, (u32)USE_AUTO_EXTRAS) * len;
-
-  afl->stage_val_type = STAGE_VAL_NONE;
-
-  orig_hit_cnt = new_hit_cnt;
-
-  for (i = 0; i < (u32)len; ++i) {
-    u32 last_len = 0;
-
-    afl->stage_cur_byte = i;
-
-    u32 min_extra_len = MIN(afl->a_extras_cnt, (u32)USE_AUTO_EXTRAS);
-    for (j = 0; j < min_extra_len; ++j) {
-      /* See the comment in the earlier code; extras are sorted by size. */
-
-      if ((afl->a_extras[j].len) > (len - i) ||
-          !memcmp(afl->a_extras[j].data, out_buf + i, afl->a_extras[j].len) ||
-          !memchr(eff_map + EFF_APOS(i), 1,
-                  EFF_SPAN_ALEN(i, afl->a_extras[j].len))) {
-        --afl->stage_max;
-        continue;
-      }
-
-      last_len = afl->a_extras[j].len;
-      memcpy(out_buf + i, afl->a_extras[j].data, last_len);
-
-#ifdef INTROSPECTION
-      snprintf(afl->mutation, sizeof(afl->mutation),
-               "%s MOPT_AUTO_EXTRAS_overwrite-%u-%u", afl->queue_cur->fname, i,
-               j);
-#endif
-
-      if (common_fuzz_stuff(afl, out_buf, len)) { goto abandon_entry; }
-
-      ++afl->stage_cur;
-    }
-
-    /* Restore all the clobbered memory. */
-    memcpy(out_buf + i, in_buf + i, last_len);
-
-  } /* for i = 0; i < len */
-
-  new_hit_cnt = afl->queued_items + afl->saved_crashes;
-
-  afl->stage_finds[STAGE_EXTRAS_AO] += new_hit_cnt - orig_hit_cnt;
-  afl->stage_cycles[STAGE_EXTRAS_AO] += afl->stage_max;
-#ifdef INTROSPECTION
-  afl->queue_cur->stats_mutated += afl->stage_max;
-#endif
-
-  /* Insertion of auto extras. */
-
-  afl->stage_name = "auto extras (insert)";
-  afl->stage_short = "ext_AI";
-  afl->stage_cur = 0;
-  afl->stage_max = afl->a_extras_cnt * (len + 1);
-
-  orig_hit_cnt = new_hit_cnt;
-
-  ex_tmp = afl_realloc(AFL_BUF_PARAM(ex), len + MAX_DICT_FILE);
-  if (unlikely(!ex_tmp)) { PFATAL("alloc"); }
-
-  for (i = 0; i <= (u32)len; ++i) {
-    afl->stage_cur_byte = i;
-
-    for (j = 0; j < afl->a_extras_cnt; ++j) {
-      if (len + afl->a_extras[j].len > MAX_FILE) {
-        --afl->stage_max;
-        continue;
-      }
-
-      /* Insert token */
-      memcpy(ex_tmp + i, afl->a_extras[j].data, afl->a_extras[j].len);
-
-      /* Copy tail */
-      memcpy(ex_tmp + i + afl->a_extras[j].len, out_buf + i, len - i);
-
-#ifdef INTROSPECTION
-      snprintf(afl->mutation, sizeof(afl->mutation),
-               "%s MOPT_AUTO_EXTRAS_insert-%u-%u", afl->queue_cur->fname, i, j);
-#endif
-
-      if (common_fuzz_stuff(afl, ex_tmp, len + afl->a_extras[j].len)) {
-        goto abandon_entry;
-      }
-
-      ++afl->stage_cur;
-    }
-
-    /* Copy head */
-    ex_tmp[i] = out_buf[i];
-
-  } /* for i = 0; i <= len */
-
-  new_hit_cnt = afl->queued_items + afl->saved_crashes;
-
-  afl->stage_finds[STAGE_EXTRAS_AI] += new_hit_cnt - orig_hit_cnt;
-  afl->stage_cycles[STAGE_EXTRAS_AI] += afl->stage_max;
-#ifdef INTROSPECTION
-  afl->queue_cur->stats_mutated += afl->stage_max;
-#endif
-
-skip_extras:
-
-  /* If we made this to here without jumping to havoc_stage or abandon_entry,
-     we're properly done with deterministic steps and can mark it as such
-     in the .state/ directory. */
-
-  if (!afl->queue_cur->passed_det) { mark_as_det_done(afl, afl->queue_cur); }
-
-  /****************
-   * RANDOM HAVOC *
-   ****************/
-
-havoc_stage:
-pacemaker_fuzzing:
-
-  afl->stage_cur_byte = -1;
-
-  /* The havoc stage mutation code is also invoked when splicing files; if the
-     splice_cycle variable is set, generate different descriptions and such. */
-
-  if (!splice_cycle) {
-    afl->stage_name = MOpt_globals.havoc_stagename;
-    afl->stage_short = MOpt_globals.havoc_stagenameshort;
-    afl->stage_max = ((doing_det ? HAVOC_CYCLES_INIT : HAVOC_CYCLES) *
-                      perf_score / afl->havoc_div) >>
-                     7;
-
-  } else {
-    perf_score = orig_perf;
-
-    snprintf(afl->stage_name_buf, STAGE_BUF_SIZE,
-             MOpt_globals.splice_stageformat, splice_cycle);
-    afl->stage_name = afl->stage_name_buf;
-    afl->stage_short = MOpt_globals.splice_stagenameshort;
-    afl->stage_max = (SPLICE_HAVOC * perf_score / afl->havoc_div) >> 8;
-  }
-
-  s32 temp_len_puppet;
-
-  // for (; afl->swarm_now < swarm_num; ++afl->swarm_now)
-  {
-    if (afl->key_puppet == 1) {
-      if (unlikely(afl->orig_hit_cnt_puppet == 0)) {
-        afl->orig_hit_cnt_puppet = afl->queued_items + afl->saved_crashes;
-        afl->last_limit_time_start = get_cur_time();
-        afl->SPLICE_CYCLES_puppet =
-            (rand_below(
-                 afl, SPLICE_CYCLES_puppet_up - SPLICE_CYCLES_puppet_low + 1) +
-             SPLICE_CYCLES_puppet_low);
-      }
-
-    } /* if afl->key_puppet == 1 */
-
-    {
-#ifndef IGNORE_FINDS
-    havoc_stage_puppet:
-#endif
-
-      afl->stage_cur_byte = -1;
-
-      /* The havoc stage mutation code is also invoked when splicing files; if
-         the splice_cycle variable is set, generate different descriptions and
-         such. */
-
-      if (!splice_cycle) {
-        afl->stage_name = MOpt_globals.havoc_stagename;
-        afl->stage_short = MOpt_globals.havoc_stagenameshort;
-        afl->stage_max = (doing_det ? HAVOC_CYCLES_INIT : HAVOC_CYCLES) *
-                         perf_score / afl->havoc_div / 100;
-
-      } else {
-        perf_score = orig_perf;
-        snprintf(afl->stage_name_buf, STAGE_BUF_SIZE,
-                 MOpt_globals.splice_stageformat, splice_cycle);
-        afl->stage_name = afl->stage_name_buf;
-        afl->stage_short = MOpt_globals.splice_stagenameshort;
-        afl->stage_max = SPLICE_HAVOC * perf_score / afl->havoc_div / 100;
-      }
-
-      if (afl->stage_max < HAVOC_MIN) { afl->stage_max = HAVOC_MIN; }
-
-      temp_len = len;
-
-      orig_hit_cnt = afl->queued_items + afl->saved_crashes;
-
-      havoc_queued = afl->queued_items;
-
-      u32 r_max, r;
-
-      r_max = 16 + ((afl->extras_cnt + afl->a_extras_cnt) ? 2 : 0);
-
-      if (unlikely(afl->expand_havoc && afl->ready_for_splicing_count > 1)) {
-        /* add expensive havoc cases here, they are activated after a full
-           cycle without any finds happened */
-
-        ++r_max;
-      }
-
-      for (afl->stage_cur = 0; afl->stage_cur < afl->stage_max;
-           ++afl->stage_cur) {
-        u32 use_stacking = 1 << (1 + rand_below(afl, afl->havoc_stack_pow2));
-
-        afl->stage_cur_val = use_stacking;
-
-        for (i = 0; i < operator_num; ++i) {
-          MOpt_globals.cycles_v3[i] = MOpt_globals.cycles_v2[i];
-        }
-
-#ifdef INTROSPECTION
-        snprintf(afl->mutation, sizeof(afl->mutation), "%s MOPT_HAVOC-%u",
-                 afl->queue_cur->fname, use_stacking);
-#endif
-
-        for (i = 0; i < use_stacking; ++i) {
-          switch (r = (select_algorithm(afl, r_max))) {
-            case 0:
-              /* Flip a single bit somewhere. Spooky! */
-              FLIP_BIT(out_buf, rand_below(afl, temp_len << 3));
-              MOpt_globals.cycles_v2[STAGE_FLIP1]++;
-#ifdef INTROSPECTION
-              snprintf(afl->m_tmp, sizeof(afl->m_tmp), " FLIP_BIT1");
-              strcat(afl->mutation, afl->m_tmp);
-#endif
-              break;
-
-            case 1:
-              if (temp_len < 2) { break; }
-              temp_len_puppet = rand_below(afl, (temp_len << 3) - 1);
-              FLIP_BIT(out_buf, temp_len_puppet);
-              FLIP_BIT(out_buf, temp_len_puppet + 1);
-              MOpt_globals.cycles_v2[STAGE_FLIP2]++;
-#ifdef INTROSPECTION
-              snprintf(afl->m_tmp, sizeof(afl->m_tmp), " FLIP_BIT2");
-              strcat(afl->mutation, afl->m_tmp);
-#endif
-              break;
-
-            case 2:
-              if (temp_len < 2) { break; }
-              temp_len_puppet = rand_below(afl, (temp_len << 3) - 3);
-              FLIP_BIT(out_buf, temp_len_puppet);
-              FLIP_BIT(out_buf, temp_len_puppet + 1);
-              FLIP_BIT(out_buf, temp_len_puppet + 2);
-              FLIP_BIT(out_buf, temp_len_puppet + 3);
-              MOpt_globals.cycles_v2[STAGE_FLIP4]++;
-#ifdef INTROSPECTION
-              snprintf(afl->m_tmp, sizeof(afl->m_tmp), " FLIP_BIT4");
-              strcat(afl->mutation, afl->m_tmp);
-#endif
-              break;
-
-            case 3:
-              if (temp_len < 4) { break; }
-              out_buf[rand_below(afl, temp_len)] ^= 0xFF;
-              MOpt_globals.cycles_v2[STAGE_FLIP8]++;
-#ifdef INTROSPECTION
-              snprintf(afl->m_tmp, sizeof(afl->m_tmp), " FLIP_BIT8");
-              strcat(afl->mutation, afl->m_tmp);
-#endif
-              break;
-
-            case 4:
-              if (temp_len < 8) { break; }
-              *(u16 *)(out_buf + rand_below(afl, temp_len - 1)) ^= 0xFFFF;
-              MOpt_globals.cycles_v2[STAGE_FLIP16]++;
-#ifdef INTROSPECTION
-              snprintf(afl->m_tmp, sizeof(afl->m_tmp), " FLIP_BIT16");
-              strcat(afl->mutation, afl->m_tmp);
-#endif
-              break;
-
-            case 5:
-              if (temp_len < 8) { break; }
-              *(u32 *)(out_buf + rand_below(afl, temp_len - 3)) ^= 0xFFFFFFFF;
-              MOpt_globals.cycles_v2[STAGE_FLIP32]++;
-#ifdef INTROSPECTION
-              snprintf(afl->m_tmp, sizeof(afl->m_tmp), " FLIP_BIT32");
-              strcat(afl->mutation, afl->m_tmp);
-#endif
-              break;
-
-            case 6:
-              out_buf[rand_below(afl, temp_len)] -=
-                  1 + rand_below(afl, ARITH_MAX);
-              out_buf[rand_below(afl, temp_len)] +=
-                  1 + rand_below(afl, ARITH_MAX);
-              MOpt_globals.cycles_v2[STAGE_ARITH8]++;
-#ifdef INTROSPECTION
-              snprintf(afl->m_tmp, sizeof(afl->m_tmp), " ARITH8");
-              strcat(afl->mutation, afl->m_tmp);
-#endif
-              break;
-
-            case 7:
-              /* Randomly subtract from word, random endian. */
-              if (temp_len < 8) { break; }
-              if (rand_below(afl, 2)) {
-                u32 pos = rand_below(afl, temp_len - 1);
-                *(u16 *)(out_buf + pos) -= 1 + rand_below(afl, ARITH_MAX);
-#ifdef INTROSPECTION
-                snprintf(afl->m_tmp, sizeof(afl->m_tmp), " ARITH16-%u", pos);
-                strcat(afl->mutation, afl->m_tmp);
-#endif
-
-              } else {
-                u32 pos = rand_below(afl, temp_len - 1);
-                u16 num = 1 + rand_below(afl, ARITH_MAX);
-#ifdef INTROSPECTION
-                snprintf(afl->m_tmp, sizeof(afl->m_tmp), " ARITH16BE-%u-%u",
-                         pos, num);
-                strcat(afl->mutation, afl->m_tmp);
-#endif
-                *(u16 *)(out_buf + pos) =
-                    SWAP16(SWAP16(*(u16 *)(out_buf + pos)) - num);
-              }
-
-              /* Randomly add to word, random endian. */
-              if (rand_below(afl, 2)) {
-                u32 pos = rand_below(afl, temp_len - 1);
-#ifdef INTROSPECTION
-                snprintf(afl->m_tmp, sizeof(afl->m_tmp), " ARITH16+-%u", pos);
-                strcat(afl->mutation, afl->m_tmp);
-#endif
-                *(u16 *)(out_buf + pos) += 1 + rand_below(afl, ARITH_MAX);
-
-              } else {
-                u32 pos = rand_below(afl, temp_len - 1);
-                u16 num = 1 + rand_below(afl, ARITH_MAX);
-#ifdef INTROSPECTION
-                snprintf(afl->m_tmp, sizeof(afl->m_tmp), " ARITH16BE+-%u-%u",
-                         pos, num);
-                strcat(afl->mutation, afl->m_tmp);
-#endif
-                *(u16 *)(out_buf + pos) =
-                    SWAP16(SWAP16(*(u16 *)(out_buf + pos)) + num);
-              }
-
-              MOpt_globals.cycles_v2[STAGE_ARITH16]++;
-              break;
-
-            case 8:
-              /* Randomly subtract from dword, random endian. */
-              if (temp_len < 8) { break; }
-              if (rand_below(afl, 2)) {
-                u32 pos = rand_below(afl, temp_len - 3);
-#ifdef INTROSPECTION
-                snprintf(afl->m_tmp, sizeof(afl->m_tmp), " ARITH32_-%u", pos);
-                strcat(afl->mutation, afl->m_tmp);
-#endif
-                *(u32 *)(out_buf + pos) -= 1 + rand_below(afl, ARITH_MAX);
-
-              } else {
-                u32 pos = rand_below(afl, temp_len - 3);
-                u32 num = 1 + rand_below(afl, ARITH_MAX);
-#ifdef INTROSPECTION
-                snprintf(afl->m_tmp, sizeof(afl->m_tmp), " ARITH32BE_-%u-%u",
-                         pos, num);
-                strcat(afl->mutation, afl->m_tmp);
-#endif
-                *(u32 *)(out_buf + pos) =
-                    SWAP32(SWAP32(*(u32 *)(out_buf + pos)) - num);
-              }
-
-              /* Randomly add to dword, random endian. */
-              // if (temp_len < 4) break;
-              if (rand_below(afl, 2)) {
-                u32 pos = rand_below(afl, temp_len - 3);
-#ifdef INTROSPECTION
-                snprintf(afl->m_tmp, sizeof(afl->m_tmp), " ARITH32+-%u", pos);
-                strcat(afl->mutation, afl->m_tmp);
-#endif
-                *(u32 *)(out_buf + pos) += 1 + rand_below(afl, ARITH_MAX);
-
-              } else {
-                u32 pos = rand_below(afl, temp_len - 3);
-                u32 num = 1 + rand_below(afl, ARITH_MAX);
-#ifdef INTROSPECTION
-                snprintf(afl->m_tmp, sizeof(afl->m_tmp), " ARITH32BE+-%u-%u",
-                         pos, num);
-                strcat(afl->mutation, afl->m_tmp);
-#endif
-                *(u32 *)(out_buf + pos) =
-                    SWAP32(SWAP32(*(u32 *)(out_buf + pos)) + num);
-              }
-
-              MOpt_globals.cycles_v2[STAGE_ARITH32]++;
-              break;
-
-            case 9:
-              /* Set byte to interesting value. */
-              if (temp_len < 4) { break; }
-              out_buf[rand_below(afl, temp_len)] =
-                  interesting_8[rand_below(afl, sizeof(interesting_8))];
-              MOpt_globals.cycles_v2[STAGE_INTEREST8]++;
-#ifdef INTROSPECTION
-              snprintf(afl->m_tmp, sizeof(afl->m_tmp), " INTERESTING8");
-              strcat(afl->mutation, afl->m_tmp);
-#endif
-              break;
-
-            case 10:
-              /* Set word to interesting value, randomly choosing endian. */
-              if (temp_len < 8) { break; }
-              if (rand_below(afl, 2)) {
-#ifdef INTROSPECTION
-                snprintf(afl->m_tmp, sizeof(afl->m_tmp), " INTERESTING16");
-                strcat(afl->mutation, afl->m_tmp);
-#endif
-                *(u16 *)(out_buf + rand_below(afl, temp_len - 1)) =
-                    interesting_16[rand_below(afl,
-                                              sizeof(interesting_16) >> 1)];
-
-              } else {
-#ifdef INTROSPECTION
-                snprintf(afl->m_tmp, sizeof(afl->m_tmp), " INTERESTING16BE");
-                strcat(afl->mutation, afl->m_tmp);
-#endif
-                *(u16 *)(out_buf + rand_below(afl, temp_len - 1)) =
-                    SWAP16(interesting_16[rand_below(
-                        afl, sizeof(interesting_16) >> 1)]);
-              }
-
-              MOpt_globals.cycles_v2[STAGE_INTEREST16]++;
-              break;
-
-            case 11:
-              /* Set dword to interesting value, randomly choosing endian. */
-
-              if (temp_len < 8) { break; }
-
-              if (rand_below(afl, 2)) {
-#ifdef INTROSPECTION
-                snprintf(afl->m_tmp, sizeof(afl->m_tmp), " INTERESTING32");
-                strcat(afl->mutation, afl->m_tmp);
-#endif
-                *(u32 *)(out_buf + rand_below(afl, temp_len - 3)) =
-                    interesting_32[rand_below(afl,
-                                              sizeof(interesting_32) >> 2)];
-
-              } else {
-#ifdef INTROSPECTION
-                snprintf(afl->m_tmp, sizeof(afl->m_tmp), " INTERESTING32BE");
-                strcat(afl->mutation, afl->m_tmp);
-#endif
-                *(u32 *)(out_buf + rand_below(afl, temp_len - 3)) =
-                    SWAP32(interesting_32[rand_below(
-                        afl, sizeof(interesting_32) >> 2)]);
-              }
-
-              MOpt_globals.cycles_v2[STAGE_INTEREST32]++;
-              break;
-
-            case 12:
-
-              /* Just set a random byte to a random value. Because,
-                 why not. We use XOR with 1-255 to eliminate the
-                 possibility of a no-op. */
-
-              out_buf[rand_below(afl, temp_len)] ^= 1 + rand_below(afl, 255);
-              MOpt_globals.cycles_v2[STAGE_RANDOMBYTE]++;
-#ifdef INTROSPECTION
-              snprintf(afl->m_tmp, sizeof(afl->m_tmp), " RAND8");
-              strcat(afl->mutation, afl->m_tmp);
-#endif
-              break;
-
-            case 13: {
-              /* Delete bytes. We're making this a bit more likely
-                 than insertion (the next option) in hopes of keeping
-                 files reasonably small. */
-
-              u32 del_from, del_len;
-
-              if (temp_len < 2) { break; }
-
-              /* Don't delete too much. */
-
-              del_len = choose_block_len(afl, temp_len - 1);
-
-              del_from = rand_below(afl, temp_len - del_len + 1);
-
-#ifdef INTROSPECTION
-              snprintf(afl->m_tmp, sizeof(afl->m_tmp), " DEL-%u%u", del_from,
-                       del_len);
-              strcat(afl->mutation, afl->m_tmp);
-#endif
-              memmove(out_buf + del_from, out_buf + del_from + del_len,
-                      temp_len - del_from - del_len);
-
-              temp_len -= del_len;
-              MOpt_globals.cycles_v2[STAGE_DELETEBYTE]++;
-              break;
-            }
-
-            case 14:
-
-              if (temp_len + HAVOC_BLK_XL < MAX_FILE) {
-                /* Clone bytes (75%) or insert a block of constant bytes (25%).
-                 */
-
-                u8  actually_clone = rand_below(afl, 4);
-                u32 clone_from, clone_to, clone_len;
-                u8 *new_buf;
-
-                if (likely(actually_clone)) {
-                  clone_len = choose_block_len(afl, temp_len);
-                  clone_from = rand_below(afl, temp_len - clone_len + 1);
-
-                } else {
-                  clone_len = choose_block_len(afl, HAVOC_BLK_XL);
-                  clone_from = 0;
-                }
-
-                clone_to = rand_below(afl, temp_len);
-
-#ifdef INTROSPECTION
-                snprintf(afl->m_tmp, sizeof(afl->m_tmp), " CLONE_%s-%u-%u-%u",
-                         actually_clone ? "clone" : "insert", clone_from,
-                         clone_to, clone_len);
-                strcat(afl->mutation, afl->m_tmp);
-#endif
-                new_buf = afl_realloc(AFL_BUF_PARAM(out_scratch),
-                                      temp_len + clone_len);
-                if (unlikely(!new_buf)) { PFATAL("alloc"); }
-
-                /* Head */
-
-                memcpy(new_buf, out_buf, clone_to);
-
-                /* Inserted part */
-
-                if (actually_clone) {
-                  memcpy(new_buf + clone_to, out_buf + clone_from, clone_len);
-
-                } else {
-                  memset(new_buf + clone_to,
-                         rand_below(afl, 2)
-                             ? rand_below(afl, 256)
-                             : out_buf[rand_below(afl, temp_len)],
-                         clone_len);
-                }
-
-                /* Tail */
-                memcpy(new_buf + clone_to + clone_len, out_buf + clone_to,
-                       temp_len - clone_to);
-
-                out_buf = new_buf;
-                afl_swap_bufs(AFL_BUF_PARAM(out), AFL_BUF_PARAM(out_scratch));
-                temp_len += clone_len;
-                MOpt_globals.cycles_v2[STAGE_Clone75]++;
-              }
-
-              break;
-
-            case 15: {
-              /* Overwrite bytes with a randomly selected chunk (75%) or fixed
-                 bytes (25%). */
-
-              u32 copy_from, copy_to, copy_len;
-
-              if (temp_len < 2) { break; }
-
-              copy_len = choose_block_len(afl, temp_len - 1);
-
-              copy_from = rand_below(afl, temp_len - copy_len + 1);
-              copy_to = rand_below(afl, temp_len - copy_len + 1);
-
-              if (likely(rand_below(afl, 4))) {
-                if (likely(copy_from != copy_to)) {
-#ifdef INTROSPECTION
-                  snprintf(afl->m_tmp, sizeof(afl->m_tmp),
-                           " OVERWRITE_COPY-%u-%u-%u", copy_from, copy_to,
-                           copy_len);
-                  strcat(afl->mutation, afl->m_tmp);
-#endif
-                  memmove(out_buf + copy_to, out_buf + copy_from, copy_len);
-                }
-
-              } else {
-#ifdef INTROSPECTION
-                snprintf(afl->m_tmp, sizeof(afl->m_tmp),
-                         " OVERWRITE_FIXED-%u-%u-%u", copy_from, copy_to,
-                         copy_len);
-                strcat(afl->mutation, afl->m_tmp);
-#endif
-                memset(out_buf + copy_to,
-                       rand_below(afl, 2) ? rand_below(afl, 256)
-                                          : out_buf[rand_below(afl, temp_len)],
-                       copy_len);
-              }
-
-              MOpt_globals.cycles_v2[STAGE_OverWrite75]++;
-              break;
-
-            } /* case 15 */
-
-            default: {
-              /* Values 16 and 17 can be selected only if there are any extras
-                 present in the dictionaries. */
-
-              r -= 16;
-
-              if (r == 0 && (afl->extras_cnt || afl->a_extras_cnt)) {
-                /* Overwrite bytes with an extra. */
-
-                if (!afl->extras_cnt ||
-                    (afl->a_extras_cnt && rand_below(afl, 2))) {
-                  /* No user-specified extras or odds in our favor. Let's use an
-                    auto-detected one. */
-
-                  u32 use_extra = rand_below(afl, afl->a_extras_cnt);
-                  u32 extra_len = afl->a_extras[use_extra].len;
-
-                  if (extra_len > (u32)temp_len) break;
-
-                  u32 insert_at = rand_below(afl, temp_len - extra_len + 1);
-#ifdef INTROSPECTION
-                  snprintf(afl->m_tmp, sizeof(afl->m_tmp),
-                           " AUTO_EXTRA_OVERWRITE-%u-%u", insert_at, extra_len);
-                  strcat(afl->mutation, afl->m_tmp);
-#endif
-                  memcpy(out_buf + insert_at, afl->a_extras[use_extra].data,
-                         extra_len);
-
-                } else {
-                  /* No auto extras or odds in our favor. Use the dictionary. */
-
-                  u32 use_extra = rand_below(afl, afl->extras_cnt);
-                  u32 extra_len = afl->extras[use_extra].len;
-
-                  if (extra_len > (u32)temp_len) break;
-
-                  u32 insert_at = rand_below(afl, temp_len - extra_len + 1);
-#ifdef INTROSPECTION
-                  snprintf(afl->m_tmp, sizeof(afl->m_tmp),
-                           " EXTRA_OVERWRITE-%u-%u", insert_at, extra_len);
-                  strcat(afl->mutation, afl->m_tmp);
-#endif
-                  memcpy(out_buf + insert_at, afl->extras[use_extra].data,
-                         extra_len);
-                }
-
-                MOpt_globals.cycles_v2[STAGE_OverWriteExtra]++;
-
-                break;
-
-              }
-
-              /* Insert an extra. */
-
-              else if (r == 1 && (afl->extras_cnt || afl->a_extras_cnt)) {
-                u32 use_extra, extra_len,
-                    insert_at = rand_below(afl, temp_len + 1);
-                u8 *ptr;
-
-                /* Insert an extra. Do the same dice-rolling stuff as for the
-                  previous case. */
-
-                if (!afl->extras_cnt ||
-                    (afl->a_extras_cnt && rand_below(afl, 2))) {
-                  use_extra = rand_below(afl, afl->a_extras_cnt);
-                  extra_len = afl->a_extras[use_extra].len;
-                  ptr = afl->a_extras[use_extra].data;
-#ifdef INTROSPECTION
-                  snprintf(afl->m_tmp, sizeof(afl->m_tmp),
-                           " AUTO_EXTRA_INSERT-%u-%u", insert_at, extra_len);
-                  strcat(afl->mutation, afl->m_tmp);
-#endif
-
-                } else {
-                  use_extra = rand_below(afl, afl->extras_cnt);
-                  extra_len = afl->extras[use_extra].len;
-                  ptr = afl->extras[use_extra].data;
-#ifdef INTROSPECTION
-                  snprintf(afl->m_tmp, sizeof(afl->m_tmp),
-                           " EXTRA_INSERT-%u-%u", insert_at, extra_len);
-                  strcat(afl->mutation, afl->m_tmp);
-#endif
-                }
-
-                if (temp_len + extra_len >= MAX_FILE) break;
-
-                out_buf = afl_realloc(AFL_BUF_PARAM(out), temp_len + extra_len);
-                if (unlikely(!out_buf)) { PFATAL("alloc"); }
-
-                /* Tail */
-                memmove(out_buf + insert_at + extra_len, out_buf + insert_at,
-                        temp_len - insert_at);
-
-                /* Inserted part */
-                memcpy(out_buf + insert_at, ptr, extra_len);
-
-                temp_len += extra_len;
-                MOpt_globals.cycles_v2[STAGE_InsertExtra]++;
-                break;
-
-              } else {
-                if (unlikely(afl->ready_for_splicing_count < 2)) break;
-
-                u32 tid;
-                do {
-                  tid = rand_below(afl, afl->queued_items);
-
-                } while (tid == afl->current_entry ||
-
-                         afl->queue_buf[tid]->len < 4);
-
-                /* Get the testcase for splicing. */
-                struct queue_entry *target = afl->queue_buf[tid];
-                u32                 new_len = target->len;
-                u8                 *new_buf = queue_testcase_get(afl, target);
-
-                if ((temp_len >= 2 && rand_below(afl, 2)) ||
-                    temp_len + HAVOC_BLK_XL >= MAX_FILE) {
-                  /* overwrite mode */
-
-                  u32 copy_from, copy_to, copy_len;
-
-                  copy_len = choose_block_len(afl, new_len - 1);
-                  if (copy_len > temp_len) copy_len = temp_len;
-
-                  copy_from = rand_below(afl, new_len - copy_len + 1);
-                  copy_to = rand_below(afl, temp_len - copy_len + 1);
-
-#ifdef INTROSPECTION
-                  snprintf(afl->m_tmp, sizeof(afl->m_tmp),
-                           " SPLICE_OVERWRITE-%u-%u-%u-%s", copy_from, copy_to,
-                           copy_len, target->fname);
-                  strcat(afl->mutation, afl->m_tmp);
-#endif
-                  memmove(out_buf + copy_to, new_buf + copy_from, copy_len);
-
-                } else {
-                  /* insert mode */
-
-                  u32 clone_from, clone_to, clone_len;
-
-                  clone_len = choose_block_len(afl, new_len);
-                  clone_from = rand_below(afl, new_len - clone_len + 1);
-                  clone_to = rand_below(afl, temp_len + 1);
-
-                  u8 *temp_buf = afl_realloc(AFL_BUF_PARAM(out_scratch),
-                                             temp_len + clone_len + 1);
-                  if (unlikely(!temp_buf)) { PFATAL("alloc"); }
-
-#ifdef INTROSPECTION
-                  snprintf(afl->m_tmp, sizeof(afl->m_tmp),
-                           " SPLICE_INSERT-%u-%u-%u-%s", clone_from, clone_to,
-                           clone_len, target->fname);
-                  strcat(afl->mutation, afl->m_tmp);
-#endif
-                  /* Head */
-
-                  memcpy(temp_buf, out_buf, clone_to);
-
-                  /* Inserted part */
-
-                  memcpy(temp_buf + clone_to, new_buf + clone_from, clone_len);
-
-                  /* Tail */
-                  memcpy(temp_buf + clone_to + clone_len, out_buf + clone_to,
-                         temp_len - clone_to);
-
-                  out_buf = temp_buf;
-                  afl_swap_bufs(AFL_BUF_PARAM(out), AFL_BUF_PARAM(out_scratch));
-                  temp_len += clone_len;
-                }
-
-                MOpt_globals.cycles_v2[STAGE_Splice]++;
-                break;
-              }
-
-            }  // end of default:
-
-          } /* switch select_algorithm() */
-
-        } /* for i=0; i < use_stacking */
-
-        ++*MOpt_globals.pTime;
-
-        u64 temp_total_found = afl->queued_items + afl->saved_crashes;
-
-        if (common_fuzz_stuff(afl, out_buf, temp_len)) {
-          goto abandon_entry_puppet;
-        }
-
-        /* out_buf might have been mangled a bit, so let's restore it to its
-           original size and shape. */
-
-        out_buf = afl_realloc(AFL_BUF_PARAM(out), len);
-        if (unlikely(!out_buf)) { PFATAL("alloc"); }
-        temp_len = len;
-        memcpy(out_buf, in_buf, len);
-
-        /* If we're finding new stuff, let's run for a bit longer, limits
-           permitting. */
-
-        if (afl->queued_items != havoc_queued) {
-          if (perf_score <= afl->havoc_max_mult * 100) {
-            afl->stage_max *= 2;
-            perf_score *= 2;
-          }
-
-          havoc_queued = afl->queued_items;
-        }
-
-        if (unlikely(afl->queued_items + afl->saved_crashes >
-                     temp_total_found)) {
-          u64 temp_temp_puppet =
-              afl->queued_items + afl->saved_crashes - temp_total_found;
-          afl->total_puppet_find = afl->total_puppet_find + temp_temp_puppet;
-
-          if (MOpt_globals.is_pilot_mode) {
-            for (i = 0; i < operator_num; ++i) {
-              if (MOpt_globals.cycles_v2[i] > MOpt_globals.cycles_v3[i]) {
-                MOpt_globals.finds_v2[i] += temp_temp_puppet;
-              }
-            }
-
-          } else {
-            for (i = 0; i < operator_num; i++) {
-              if (afl->core_operator_cycles_puppet_v2[i] >
-                  afl->core_operator_cycles_puppet_v3[i])
-
-                afl->core_operator_finds_puppet_v2[i] += temp_temp_puppet;
-            }
-          }
-
-        } /* if */
-
-      } /* for (afl->stage_cur = 0; afl->stage_cur < afl->stage_max;
-
-           ++afl->stage_cur) { */
-
-      new_hit_cnt = afl->queued_items + afl->saved_crashes;
-
-      if (MOpt_globals.is_pilot_mode) {
-        if (!splice_cycle) {
-          afl->stage_finds[STAGE_HAVOC] += new_hit_cnt - orig_hit_cnt;
-          afl->stage_cycles[STAGE_HAVOC] += afl->stage_max;
-#ifdef INTROSPECTION
-          afl->queue_cur->stats_mutated += afl->stage_max;
-#endif
-
-        } else {
-          afl->stage_finds[STAGE_SPLICE] += new_hit_cnt - orig_hit_cnt;
-          afl->stage_cycles[STAGE_SPLICE] += afl->stage_max;
-#ifdef INTROSPECTION
-          afl->queue_cur->stats_mutated += afl->stage_max;
-#endif
-        }
-      }
-
-#ifndef IGNORE_FINDS
-
-      /************
-       * SPLICING *
-       ************/
-
-    retry_splicing_puppet:
-
-      if (afl->use_splicing &&
-          splice_cycle++ < (u32)afl->SPLICE_CYCLES_puppet &&
-          afl->ready_for_splicing_count > 1 && afl->queue_cur->len >= 4) {
-        struct queue_entry *target;
-        u32                 tid, split_at;
-        u8                 *new_buf;
-        s32                 f_diff, l_diff;
-
-        /* First of all, if we've modified in_buf for havoc, let's clean that
-           up... */
-
-        if (in_buf != orig_in) {
-          in_buf = orig_in;
-          len = afl->queue_cur->len;
-        }
-
-        /* Pick a random queue entry and seek to it. Don't splice with yourself.
-         */
-
-        do {
-          tid = rand_below(afl, afl->queued_items);
-
-        } while (tid == afl->current_entry || afl->queue_buf[tid]->len < 4);
-
-        afl->splicing_with = tid;
-        target = afl->queue_buf[tid];
-
-        /* Read the testcase into a new buffer. */
-        new_buf = queue_testcase_get(afl, target);
-
-        /* Find a suitable splicin g location, somewhere between the first and
-           the last differing byte. Bail out if the difference is just a single
-           byte or so. */
-
-        locate_diffs(in_buf, new_buf, MIN(len, target->len), &f_diff, &l_diff);
-
-        if (f_diff < 0 || l_diff < 2 || f_diff == l_diff) {
-          goto retry_splicing_puppet;
-        }
-
-        /* Split somewhere between the first and last differing byte. */
-
-        split_at = f_diff + rand_below(afl, l_diff - f_diff);
-
-        /* Do the thing. */
-
-        len = target->len;
-        afl->in_scratch_buf = afl_realloc(AFL_BUF_PARAM(in_scratch), len);
-        memcpy(afl->in_scratch_buf, in_buf, split_at);
-        memcpy(afl->in_scratch_buf + split_at, new_buf, len - split_at);
-        in_buf = afl->in_scratch_buf;
-        afl_swap_bufs(AFL_BUF_PARAM(in), AFL_BUF_PARAM(in_scratch));
-
-        out_buf = afl_realloc(AFL_BUF_PARAM(out), len);
-        if (unlikely(!out_buf)) { PFATAL("alloc"); }
-        memcpy(out_buf, in_buf, len);
-
-        goto havoc_stage_puppet;
-
-      } /* if splice_cycle */
-
-#endif /* !IGNORE_FINDS */
-
-      ret_val = 0;
-
-    abandon_entry:
-    abandon_entry_puppet:
-
-      if ((s64)splice_cycle >= afl->SPLICE_CYCLES_puppet) {
-        afl->SPLICE_CYCLES_puppet =
-            (rand_below(
-                 afl, SPLICE_CYCLES_puppet_up - SPLICE_CYCLES_puppet_low + 1) +
-             SPLICE_CYCLES_puppet_low);
-      }
-
-      afl->splicing_with = -1;
-
-      /* Update afl->pending_not_fuzzed count if we made it through the
-         calibration cycle and have not seen this entry before. */
-      /*
-        // TODO FIXME: I think we need this plus need an -L -1 check
-        if (!afl->stop_soon && !afl->queue_cur->cal_failed &&
-            (afl->queue_cur->was_fuzzed == 0 || afl->queue_cur->fuzz_level == 0)
-        && !afl->queue_cur->disabled) {
-
-          if (!afl->queue_cur->was_fuzzed) {
-
-            --afl->pending_not_fuzzed;
-            afl->queue_cur->was_fuzzed = 1;
-            afl->reinit_table = 1
-            if (afl->queue_cur->favored) {
-
-              --afl->pending_favored;
-              afl->smallest_favored = -1;
-
-            }
-
-          }
-
-        }
-
-      */
-
-      orig_in = NULL;
-
-      if (afl->key_puppet == 1) {
-        if (unlikely(
-                afl->queued_items + afl->saved_crashes >
-                ((afl->queued_items + afl->saved_crashes) * limit_time_bound +
-                 afl->orig_hit_cnt_puppet))) {
-          afl->key_puppet = 0;
-          afl->orig_hit_cnt_puppet = 0;
-          afl->last_limit_time_start = 0;
-        }
-      }
-
-      if (unlikely(*MOpt_globals.pTime > MOpt_globals.period)) {
-        afl->total_pacemaker_time += *MOpt_globals.pTime;
-        *MOpt_globals.pTime = 0;
-        new_hit_cnt = afl->queued_items + afl->saved_crashes;
-
-        if (MOpt_globals.is_pilot_mode) {
-          afl->swarm_fitness[afl->swarm_now] =
-              (double)(afl->total_puppet_find - afl->temp_puppet_find) /
-              ((double)(afl->tmp_pilot_time) / afl->period_pilot_tmp);
-        }
-
-        afl->temp_puppet_find = afl->total_puppet_find;
-        for (i = 0; i < operator_num; ++i) {
-          if (MOpt_globals.is_pilot_mode) {
-            double temp_eff = 0.0;
-
-            if (MOpt_globals.cycles_v2[i] > MOpt_globals.cycles[i]) {
-              temp_eff =
-                  (double)(MOpt_globals.finds_v2[i] - MOpt_globals.finds[i]) /
-                  (double)(MOpt_globals.cycles_v2[i] - MOpt_globals.cycles[i]);
-            }
-
-            if (afl->eff_best[afl->swarm_now][i] < temp_eff) {
-              afl->eff_best[afl->swarm_now][i] = temp_eff;
-              afl->L_best[afl->swarm_now][i] = afl->x_now[afl->swarm_now][i];
-            }
-          }
-
-          MOpt_globals.finds[i] = MOpt_globals.finds_v2[i];
-          MOpt_globals.cycles[i] = MOpt_globals.cycles_v2[i];
-
-        } /* for i = 0; i < operator_num */
-
-        if (MOpt_globals.is_pilot_mode) {
-          afl->swarm_now = afl->swarm_now + 1;
-          if (afl->swarm_now == swarm_num) {
-            afl->key_module = 1;
-            for (i = 0; i < operator_num; ++i) {
-              afl->core_operator_cycles_puppet_v2[i] =
-                  afl->core_operator_cycles_puppet[i];
-              afl->core_operator_cycles_puppet_v3[i] =
-                  afl->core_operator_cycles_puppet[i];
-              afl->core_operator_finds_puppet_v2[i] =
-                  afl->core_operator_finds_puppet[i];
-            }
-
-            double swarm_eff = 0.0;
-            afl->swarm_now = 0;
-            for (i = 0; i < swarm_num; ++i) {
-              if (afl->swarm_fitness[i] > swarm_eff) {
-                swarm_eff = afl->swarm_fitness[i];
-                afl->swarm_now = i;
-              }
-            }
-
-            if (afl->swarm_now < 0 || afl->swarm_now > swarm_num - 1) {
-              PFATAL("swarm_now error number  %d", afl->swarm_now);
-            }
-
-          } /* if afl->swarm_now == swarm_num */
-
-          /* adjust pointers dependent on 'afl->swarm_now' */
-          afl->mopt_globals_pilot.finds =
-              afl->stage_finds_puppet[afl->swarm_now];
-          afl->mopt_globals_pilot.finds_v2 =
-              afl->stage_finds_puppet_v2[afl->swarm_now];
-          afl->mopt_globals_pilot.cycles =
-              afl->stage_cycles_puppet[afl->swarm_now];
-          afl->mopt_globals_pilot.cycles_v2 =
-              afl->stage_cycles_puppet_v2[afl->swarm_now];
-          afl->mopt_globals_pilot.cycles_v3 =
-              afl->stage_cycles_puppet_v3[afl->swarm_now];
-
-        } else {
-          for (i = 0; i < operator_num; i++) {
-            afl->core_operator_finds_puppet[i] =
-                afl->core_operator_finds_puppet_v2[i];
-            afl->core_operator_cycles_puppet[i] =
-                afl->core_operator_cycles_puppet_v2[i];
-          }
-
-          afl->key_module = 2;
-
-          afl->old_hit_count = new_hit_cnt;
-
-        } /* if pilot_mode */
-
-      } /* if (unlikely(*MOpt_globals.pTime > MOpt_globals.period)) */
-
-    } /* block */
-
-  } /* block */
-
-  ++afl->queue_cur->fuzz_level;
+  phase_enter(afl, phase);
   return ret_val;
 }
-
-#undef FLIP_BIT
-
-u8 core_fuzzing(afl_state_t *afl) {
-  return mopt_common_fuzzing(afl, afl->mopt_globals_core);
-}
-
-u8 pilot_fuzzing(afl_state_t *afl) {
-  return mopt_common_fuzzing(afl, afl->mopt_globals_pilot);
-}
-
-void pso_updating(afl_state_t *afl) {
-  afl->g_now++;
-  if (afl->g_now > afl->g_max) { afl->g_now = 0; }
-  afl->w_now =
-      (afl->w_init - afl->w_end) * (afl->g_max - afl->g_now) / (afl->g_max) +
-      afl->w_end;
-  int tmp_swarm, i, j;
-  u64 temp_operator_finds_puppet = 0;
-  for (i = 0; i < operator_num; ++i) {
-    afl->operator_finds_puppet[i] = afl->core_operator_finds_puppet[i];
-
-    for (j = 0; j < swarm_num; ++j) {
-      afl->operator_finds_puppet[i] =
-          afl->operator_finds_puppet[i] + afl->stage_finds_puppet[j][i];
-    }
-
-    temp_operator_finds_puppet =
-        temp_operator_finds_puppet + afl->operator_finds_puppet[i];
-  }
-
-  for (i = 0; i < operator_num; ++i) {
-    if (afl->operator_finds_puppet[i]) {
-      afl->G_best[i] = (double)((double)(afl->operator_finds_puppet[i]) /
-                                (double)(temp_operator_finds_puppet));
-    }
-  }
-
-  for (tmp_swarm = 0; tmp_swarm < swarm_num; ++tmp_swarm) {
-    double x_temp = 0.0;
-    for (i = 0; i < operator_num; ++i) {
-      afl->probability_now[tmp_swarm][i] = 0.0;
-      afl->v_now[tmp_swarm][i] =
-          afl->w_now * afl->v_now[tmp_swarm][i] +
-          RAND_C * (afl->L_best[tmp_swarm][i] - afl->x_now[tmp_swarm][i]) +
-          RAND_C * (afl->G_best[i] - afl->x_now[tmp_swarm][i]);
-      afl->x_now[tmp_swarm][i] += afl->v_now[tmp_swarm][i];
-      if (afl->x_now[tmp_swarm][i] > v_max) {
-        afl->x_now[tmp_swarm][i] = v_max;
-
-      } else if (afl->x_now[tmp_swarm][i] < v_min) {
-        afl->x_now[tmp_swarm][i] = v_min;
-      }
-
-      x_temp += afl->x_now[tmp_swarm][i];
-    }
-
-    for (i = 0; i < operator_num; ++i) {
-      afl->x_now[tmp_swarm][i] = afl->x_now[tmp_swarm][i] / x_temp;
-      if (likely(i != 0)) {
-        afl->probability_now[tmp_swarm][i] =
-            afl->probability_now[tmp_swarm][i - 1] + afl->x_now[tmp_swarm][i];
-
-      } else {
-        afl->probability_now[tmp_swarm][i] = afl->x_now[tmp_swarm][i];
-      }
-    }
-
-    if (afl->probability_now[tmp_swarm][operator_num - 1] < 0.99 ||
-        afl->probability_now[tmp_swarm][operator_num - 1] > 1.01) {
-      FATAL("ERROR probability");
-    }
-  }
-
-  afl->swarm_now = 0;
-  afl->key_module = 0;
-}
-
-/* The entry point for the mutator, choosing the default mutator, and/or MOpt
-   depending on the configuration. */
-u8 fuzz_one(afl_state_t *afl) {
-  int key_val_lv_1 = -1, key_val_lv_2 = -1;
-
-#ifdef _AFL_DOCUMENT_MUTATIONS
-
-  u8 path_buf[PATH_MAX];
-  if (afl->do_document == 0) {
-    snprintf(path_buf, PATH_MAX, "%s/mutations", afl->out_dir);
-    afl->do_document = mkdir(path_buf, 0700);  // if it exists we do not care
-    afl->do_document = 1;
-
-  } else {
-    afl->do_document = 2;
-    afl->stop_soon = 2;
-  }
-
-#endif
-
-  /*
-     -L command line paramter => limit_time_sig value
-       limit_time_sig == 0 then run the default mutator
-       limit_time_sig  > 0 then run MOpt
-       limit_time_sig  < 0 both are run
-  */
-
-  if (afl->limit_time_sig <= 0) { key_val_lv_1 = fuzz_one_original(afl); }
-
-  if (afl->limit_time_sig != 0) {
-    if (afl->key_module == 0) {
-      key_val_lv_2 = pilot_fuzzing(afl);
-
-    } else if (afl->key_module == 1) {
-      key_val_lv_2 = core_fuzzing(afl);
-
-    } else if (afl->key_module == 2) {
-      pso_updating(afl);
-    }
-  }
-
-  if (unlikely(key_val_lv_1 == -1)) { key_val_lv_1 = 0; }
-  if (likely(key_val_lv_2 == -1)) { key_val_lv_2 = 0; }
-
-  return (key_val_lv_1 | key_val_lv_2);
-}
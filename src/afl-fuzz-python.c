@@ -127,6 +127,160 @@ static size_t fuzz_py(void *py_mutator, u8 *buf, size_t buf_size, u8 **out_buf,
   }
 }
 
+  #if PY_MAJOR_VERSION >= 3
+
+/* A memoryview over the size bytes at ptr, the one in *view if it is over
+   them already. */
+
+static PyObject *py_view(PyObject **view, u8 **view_ptr, size_t *view_size,
+                         u8 *ptr, size_t size, int flags) {
+  if (!*view || *view_ptr != ptr || *view_size != size) {
+    Py_XDECREF(*view);
+    *view = PyMemoryView_FromMemory(ptr ? (char *)ptr : "", size, flags);
+    if (!*view) { FATAL("Failed to convert arguments"); }
+
+    *view_ptr = ptr;
+    *view_size = size;
+  }
+
+  return *view;
+}
+
+/* The python fuzz_into(buf, add_buf, out) gets memoryviews over the buffers
+   of afl-fuzz and writes the mutated output into out, a view over fuzz_buf,
+   so no data is converted or copied. The views are reused as long as they
+   are over the same memory, and only valid during the call. */
+
+static size_t fuzz_into_py(void *py_mutator, u8 *buf, size_t buf_size,
+                           u8 **out_buf, u8 *add_buf, size_t add_buf_size,
+                           size_t max_size) {
+  py_mutator_t *py = (py_mutator_t *)py_mutator;
+  PyObject     *py_value;
+  size_t        mutated_size;
+
+  if (py->fuzz_size < max_size) {
+    py->fuzz_buf = afl_realloc(BUF_PARAMS(fuzz), max_size);
+    if (unlikely(!py->fuzz_buf)) { PFATAL("alloc"); }
+    py->fuzz_size = max_size;
+  }
+
+  py_value = PyObject_CallFunctionObjArgs(
+      py->py_functions[PY_FUNC_FUZZ_INTO],
+      py_view(&py->in_view, &py->in_ptr, &py->in_size, buf, buf_size,
+              PyBUF_READ),
+      py_view(&py->add_view, &py->add_ptr, &py->add_size, add_buf,
+              add_buf_size, PyBUF_READ),
+      py_view(&py->out_view, &py->out_ptr, &py->out_size, py->fuzz_buf,
+              max_size, PyBUF_WRITE),
+      NULL);
+
+  if (py_value == NULL) {
+    PyErr_Print();
+    FATAL("python custom fuzz_into: call failed");
+  }
+
+  mutated_size = PyLong_AsSize_t(py_value);
+  Py_DECREF(py_value);
+
+  if (mutated_size == (size_t)-1 && PyErr_Occurred()) {
+    PyErr_Print();
+    FATAL("Python mutator fuzz_into() should return the output size");
+  }
+
+  *out_buf = py->fuzz_buf;
+  return MIN(mutated_size, max_size);
+}
+
+  #endif
+
+/* One call of the python fuzz_batch() for up to max_cnt mutations, so
+   building the arguments and calling into python is paid once per batch.
+   It returns a list of bytes or bytearrays, which are copied into the
+   arena as long as they fit. */
+
+static u32 fuzz_batch_py(void *py_mutator, u8 *buf, size_t buf_size,
+                         u8 *add_buf, size_t add_buf_size, size_t max_size,
+                         u8 *arena, size_t arena_size, size_t *sizes,
+                         u32 max_cnt) {
+  PyObject     *py_args, *py_value, *py_list;
+  py_mutator_t *py = (py_mutator_t *)py_mutator;
+  size_t        off = 0, size;
+  char         *bytes;
+  u32           cnt, i;
+
+  py_args = PyTuple_New(4);
+
+  /* buf */
+  py_value = PyByteArray_FromStringAndSize(buf, buf_size);
+  if (!py_value) {
+    Py_DECREF(py_args);
+    FATAL("Failed to convert arguments");
+  }
+
+  PyTuple_SetItem(py_args, 0, py_value);
+
+  /* add_buf */
+  py_value = PyByteArray_FromStringAndSize(add_buf, add_buf_size);
+  if (!py_value) {
+    Py_DECREF(py_args);
+    FATAL("Failed to convert arguments");
+  }
+
+  PyTuple_SetItem(py_args, 1, py_value);
+
+  /* max_size and max_cnt */
+  py_value = PyLong_FromSize_t(max_size);
+  if (!py_value) {
+    Py_DECREF(py_args);
+    FATAL("Failed to convert arguments");
+  }
+
+  PyTuple_SetItem(py_args, 2, py_value);
+
+  py_value = PyLong_FromUnsignedLong(max_cnt);
+  if (!py_value) {
+    Py_DECREF(py_args);
+    FATAL("Failed to convert arguments");
+  }
+
+  PyTuple_SetItem(py_args, 3, py_value);
+
+  py_value = PyObject_CallObject(py->py_functions[PY_FUNC_FUZZ_BATCH], py_args);
+
+  Py_DECREF(py_args);
+
+  if (py_value == NULL) {
+    PyErr_Print();
+    FATAL("python custom fuzz_batch: call failed");
+  }
+
+  py_list = PySequence_Fast(py_value, "fuzz_batch() should return a list");
+  Py_DECREF(py_value);
+  if (!py_list) {
+    PyErr_Print();
+    FATAL("Python mutator fuzz_batch() should return a list");
+  }
+
+  cnt = MIN((u32)PySequence_Fast_GET_SIZE(py_list), max_cnt);
+
+  for (i = 0; i < cnt; ++i) {
+    if (!py_bytes(PySequence_Fast_GET_ITEM(py_list, i), &bytes, &size)) {
+      FATAL(
+          "Python mutator fuzz_batch() should return bytearrays or bytes");
+    }
+
+    size = MIN(size, max_size);
+    if (size > arena_size - off) { break; }
+
+    memcpy(arena + off, bytes, size);
+    sizes[i] = size;
+    off += size;
+  }
+
+  Py_DECREF(py_list);
+  return i;
+}
+
 static const char *custom_describe_py(void  *py_mutator,
                                       size_t max_description_len) {
   PyObject *py_args, *py_value;
@@ -196,6 +350,10 @@ static py_mutator_t *init_py_module(afl_state_t *afl, u8 *module_name) {
     py_functions[PY_FUNC_FUZZ] = PyObject_GetAttrString(py_module, "fuzz");
     if (!py_functions[PY_FUNC_FUZZ])
       py_functions[PY_FUNC_FUZZ] = PyObject_GetAttrString(py_module, "mutate");
+    py_functions[PY_FUNC_FUZZ_BATCH] =
+        PyObject_GetAttrString(py_module, "fuzz_batch");
+    py_functions[PY_FUNC_FUZZ_INTO] =
+        PyObject_GetAttrString(py_module, "fuzz_into");
     py_functions[PY_FUNC_DESCRIBE] =
         PyObject_GetAttrString(py_module, "describe");
     py_functions[PY_FUNC_FUZZ_COUNT] =
@@ -258,6 +416,10 @@ void finalize_py_module(void *py_mutator) {
       Py_XDECREF(py->py_functions[i]);
     }
 
+    Py_XDECREF(py->in_view);
+    Py_XDECREF(py->add_view);
+    Py_XDECREF(py->out_view);
+
     Py_DECREF(py->py_module);
   }
 
@@ -351,6 +513,17 @@ struct custom_mutator *load_custom_mutator_py(afl_state_t *afl,
 
   if (py_functions[PY_FUNC_FUZZ]) { mutator->afl_custom_fuzz = fuzz_py; }
 
+  #if PY_MAJOR_VERSION >= 3
+  if (py_functions[PY_FUNC_FUZZ_INTO]) {
+    mutator->afl_custom_fuzz = fuzz_into_py;
+  }
+
+  #endif
+
+  if (py_functions[PY_FUNC_FUZZ_BATCH]) {
+    mutator->afl_custom_fuzz_batch = fuzz_batch_py;
+  }
+
   if (py_functions[PY_FUNC_DESCRIBE]) {
     mutator->afl_custom_describe = custom_describe_py;
   }
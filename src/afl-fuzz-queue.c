@@ -23,6 +23,7 @@
  */
 
 #include "afl-fuzz.h"
+#include "analysis.h"
 #include <limits.h>
 #include <ctype.h>
 #include <math.h>
@@ -39,19 +40,52 @@ void run_afl_custom_queue_new_entry(afl_state_t *afl, struct queue_entry *q,
 
 #endif
 
-/* select next queue entry based on alias algo - fast! */
+/* The selection weights of the queue entries are kept in a Fenwick tree,
+   so drawing an entry as well as changing or appending a weight is
+   O(log n). weight_leaf[] holds the weights themselves. */
+
+static double weight_prefix(afl_state_t *afl, u32 i) {
+  double sum = 0;
+
+  for (; i; i -= i & -i) {
+    sum += afl->weight_tree[i];
+  }
+
+  return sum;
+}
+
+static void weight_add(afl_state_t *afl, u32 i, double delta) {
+  for (++i; i <= afl->weight_items; i += i & -i) {
+    afl->weight_tree[i] += delta;
+  }
+}
+
+/* select next queue entry based on the weight tree - fast! */
 
 inline u32 select_next_queue_entry(afl_state_t *afl) {
-  u32    s = rand_below(afl, afl->queued_items);
-  double p = rand_next_percent(afl);
+  u32    n = afl->weight_items, pos = 0, step;
+  double r = rand_next_percent(afl) * weight_prefix(afl, n);
+
+  if (unlikely(!(r > 0))) { return rand_below(afl, afl->queued_items); }
+
+  for (step = 1; (step << 1) <= n; step <<= 1) {}
 
-  /*
-  fprintf(stderr, "select: p=%f s=%u ... p < prob[s]=%f ? s=%u : alias[%u]=%u"
-  " ==> %u\n", p, s, afl->alias_probability[s], s, s, afl->alias_table[s], p <
-  afl->alias_probability[s] ? s : afl->alias_table[s]);
-  */
+  for (; step; step >>= 1) {
+    if (pos + step <= n && afl->weight_tree[pos + step] <= r) {
+      pos += step;
+      r -= afl->weight_tree[pos];
+    }
+  }
 
-  return (p < afl->alias_probability[s] ? s : afl->alias_table[s]);
+  return pos < n ? pos : n - 1;
+}
+
+/* With AFL_PC_FILTER_FOCUS, entries weigh up to FOCUS_BOOST times more by
+   the share of their coverage that lies in the focus set. */
+
+static inline double focus_factor(struct queue_entry *q) {
+  if (!q->bitmap_size) { return 1; }
+  return 1 + (double)(FOCUS_BOOST - 1) * q->focus_hits / q->bitmap_size;
 }
 
 double compute_weight(afl_state_t *afl, struct queue_entry *q,
@@ -60,7 +94,7 @@ double compute_weight(afl_state_t *afl, struct queue_entry *q,
   double weight = 1.0;
 
   if (likely(afl->schedule >= FAST && afl->schedule <= RARE)) {
-    u32 hits = afl->n_fuzz[q->n_fuzz_entry];
+    u32 hits = n_fuzz_hits(afl, q->n_fuzz_entry);
     if (likely(hits)) { weight /= (log10(hits) + 1); }
   }
 
@@ -72,33 +106,61 @@ double compute_weight(afl_state_t *afl, struct queue_entry *q,
   if (unlikely(q->favored)) { weight *= 5; }
   if (unlikely(!q->was_fuzzed)) { weight *= 2; }
   if (unlikely(q->fs_redundant)) { weight *= 0.8; }
+  if (unlikely(afl->fsrv.focus_end)) { weight *= focus_factor(q); }
 
   return weight;
 }
 
-/* create the alias table that allows weighted random selection - expensive */
+/* Selection weight of one entry, with the queue averages of the last full
+   rebuild. Entries the sync plan gives us weigh more. */
 
-void create_alias_table(afl_state_t *afl) {
-  u32    n = afl->queued_items, i = 0, nSmall = 0, nLarge = n - 1;
-  double sum = 0;
+static double queue_weight(afl_state_t *afl, struct queue_entry *q) {
+  double w;
 
-  double *P = (double *)afl_realloc(AFL_BUF_PARAM(out), n * sizeof(double));
-  u32 *Small = (int *)afl_realloc(AFL_BUF_PARAM(out_scratch), n * sizeof(u32));
-  u32 *Large = (int *)afl_realloc(AFL_BUF_PARAM(in_scratch), n * sizeof(u32));
+  if (unlikely(q->disabled)) { return 0; }
 
-  afl->alias_table =
-      (u32 *)afl_realloc((void **)&afl->alias_table, n * sizeof(u32));
-  afl->alias_probability = (double *)afl_realloc(
-      (void **)&afl->alias_probability, n * sizeof(double));
+  q->perf_score = calculate_score(afl, q);
+
+  if (likely(afl->schedule < RARE)) {
+    q->weight = compute_weight(afl, q, afl->weight_avg[0], afl->weight_avg[1],
+                               afl->weight_avg[2]);
+    w = q->weight;
 
-  if (!P || !Small || !Large || !afl->alias_table || !afl->alias_probability) {
-    FATAL("could not acquire memory for alias table");
+  } else {
+    w = q->perf_score;
   }
 
-  memset((void *)afl->alias_probability, 0, n * sizeof(double));
-  memset((void *)afl->alias_table, 0, n * sizeof(u32));
-  memset((void *)Small, 0, n * sizeof(u32));
-  memset((void *)Large, 0, n * sizeof(u32));
+  if (unlikely(q->plan_share)) { w *= afl->sync_plan_boost; }
+
+  /* fuzz_one() used to skip most non-favored entries it was given, they are
+     drawn that much less often instead */
+
+  if (!q->favored && !afl->non_instrumented_mode &&
+      afl->queued_items > SKIP_NFAV_MIN_ITEMS) {
+    if (afl->queue_cycle > 1 && !q->fuzz_level) {
+      w *= (100 - SKIP_NFAV_NEW_PROB) / 100.0;
+
+    } else {
+      w *= (100 - SKIP_NFAV_OLD_PROB) / 100.0;
+    }
+  }
+
+  return w;
+}
+
+/* Recompute all weights and rebuild the weight tree - expensive */
+
+void create_weight_tree(afl_state_t *afl) {
+  u32 n = afl->queued_items, i;
+
+  afl->weight_tree = (double *)afl_realloc((void **)&afl->weight_tree,
+                                           (n + 1) * sizeof(double));
+  afl->weight_leaf =
+      (double *)afl_realloc((void **)&afl->weight_leaf, n * sizeof(double));
+
+  if (!afl->weight_tree || !afl->weight_leaf) {
+    FATAL("could not acquire memory for the queue weight tree");
+  }
 
   if (likely(afl->schedule < RARE)) {
     double avg_exec_us = 0.0;
@@ -118,163 +180,219 @@ void create_alias_table(afl_state_t *afl) {
       }
     }
 
-    avg_exec_us /= active;
-    avg_bitmap_size /= active;
-    avg_top_size /= active;
+    afl->weight_avg[0] = avg_exec_us / active;
+    afl->weight_avg[1] = avg_bitmap_size / active;
+    afl->weight_avg[2] = avg_top_size / active;
+  }
 
-    for (i = 0; i < n; i++) {
-      struct queue_entry *q = afl->queue_buf[i];
+  for (i = 0; i < n; i++) {
+    afl->weight_leaf[i] = queue_weight(afl, afl->queue_buf[i]);
+  }
 
-      if (likely(!q->disabled)) {
-        q->weight =
-            compute_weight(afl, q, avg_exec_us, avg_bitmap_size, avg_top_size);
-        q->perf_score = calculate_score(afl, q);
-        sum += q->weight;
-      }
+  if (unlikely(afl->schedule == MMOPT) && afl->queued_discovered) {
+    u32 cnt = afl->queued_discovered >= 5 ? 5 : afl->queued_discovered;
+
+    for (i = n - cnt; i < n; i++) {
+      afl->queue_buf[i]->weight *= 2.0;
+      afl->weight_leaf[i] *= 2.0;
     }
+  }
 
-    if (unlikely(afl->schedule == MMOPT) && afl->queued_discovered) {
-      u32 cnt = afl->queued_discovered >= 5 ? 5 : afl->queued_discovered;
+  /* Linear time Fenwick tree construction. */
 
-      for (i = n - cnt; i < n; i++) {
-        struct queue_entry *q = afl->queue_buf[i];
+  afl->weight_tree[0] = 0;
+  memcpy(afl->weight_tree + 1, afl->weight_leaf, n * sizeof(double));
 
-        if (likely(!q->disabled)) { q->weight *= 2.0; }
-      }
-    }
+  for (i = 1; i <= n; i++) {
+    u32 up = i + (i & -i);
+    if (up <= n) { afl->weight_tree[up] += afl->weight_tree[i]; }
+  }
 
-    for (i = 0; i < n; i++) {
-      // weight is always 0 for disabled entries
-      if (unlikely(afl->queue_buf[i]->disabled)) {
-        P[i] = 0;
+  afl->weight_items = n;
+  afl->weight_updates = 0;
+  afl->reinit_table = 0;
+}
 
-      } else {
-        P[i] = (afl->queue_buf[i]->weight * n) / sum;
-      }
-    }
+/* Change the weight of a single entry, e.g. because it got fuzzed or its
+   favored state changed. Weights of the other entries may go stale, so
+   after enough of these updates everything is recomputed. */
 
-  } else {
-    for (i = 0; i < n; i++) {
-      struct queue_entry *q = afl->queue_buf[i];
+void update_queue_weight(afl_state_t *afl, struct queue_entry *q) {
+  if (unlikely(afl->old_seed_selection || q->id >= afl->weight_items)) {
+    return;
+  }
 
-      if (likely(!q->disabled)) {
-        q->perf_score = calculate_score(afl, q);
-        sum += q->perf_score;
-      }
-    }
+  if (unlikely(afl->schedule == MMOPT ||
+               ++afl->weight_updates > afl->weight_items / WEIGHT_STALE_DIV)) {
+    afl->reinit_table = 1;
+    return;
+  }
 
-    for (i = 0; i < n; i++) {
-      // perf_score is always 0 for disabled entries
-      if (unlikely(afl->queue_buf[i]->disabled)) {
-        P[i] = 0;
+  double w = queue_weight(afl, q);
 
-      } else {
-        P[i] = (afl->queue_buf[i]->perf_score * n) / sum;
-      }
-    }
+  weight_add(afl, q->id, w - afl->weight_leaf[q->id]);
+  afl->weight_leaf[q->id] = w;
+}
+
+/* Bring the weight tree up to date before drawing an entry: new entries are
+   appended in O(log n) each, a full rebuild is only done when requested
+   via reinit_table or when too many weights went stale. */
+
+void update_weight_tree(afl_state_t *afl) {
+  u32 n = afl->queued_items, i;
+
+  afl->weight_updates += n - afl->weight_items;
+
+  if (unlikely(afl->reinit_table ||
+               afl->weight_items <= SKIP_NFAV_MIN_ITEMS ||
+               afl->schedule == MMOPT ||
+               afl->weight_updates > afl->weight_items / WEIGHT_STALE_DIV)) {
+    create_weight_tree(afl);
+    return;
+  }
+
+  afl->weight_tree = (double *)afl_realloc((void **)&afl->weight_tree,
+                                           (n + 1) * sizeof(double));
+  afl->weight_leaf =
+      (double *)afl_realloc((void **)&afl->weight_leaf, n * sizeof(double));
+
+  if (!afl->weight_tree || !afl->weight_leaf) {
+    FATAL("could not acquire memory for the queue weight tree");
   }
 
-  // Done collecting weightings in P, now create the arrays.
+  for (i = afl->weight_items; i < n; i++) {
+    u32 pos = i + 1;
 
-  for (s32 j = (s32)(n - 1); j >= 0; j--) {
-    if (P[j] < 1) {
-      Small[nSmall++] = (u32)j;
+    afl->weight_leaf[i] = queue_weight(afl, afl->queue_buf[i]);
 
-    } else {
-      Large[nLarge--] = (u32)j;
-    }
+    /* tree[pos] covers the leaves (pos - lowbit(pos), pos]. */
+    afl->weight_tree[pos] = afl->weight_leaf[i] + weight_prefix(afl, pos - 1) -
+                            weight_prefix(afl, pos - (pos & -pos));
+    afl->weight_items = pos;
   }
+}
 
-  while (nSmall && nLarge != n - 1) {
-    u32 small = Small[--nSmall];
-    u32 large = Large[++nLarge];
+/* The flags of the queue entries are kept in queue/.state/flags, a
+   STATE_FLAGS_MAGIC and then a byte per entry id, which is mmap()ed and
+   grows by STATE_FLAGS_CHUNK entries. With AFL_STATE_DIRS the marker files
+   in the .state/ subdirectories are created as well. */
 
-    afl->alias_probability[small] = P[small];
-    afl->alias_table[small] = large;
+static void queue_state_set(afl_state_t *afl, struct queue_entry *q, u8 flag,
+                            u8 on) {
+  if (unlikely(q->id >= afl->state_flags_cnt)) {
+    u32 cnt = (q->id / STATE_FLAGS_CHUNK + 1) * STATE_FLAGS_CHUNK;
 
-    P[large] = P[large] - (1 - P[small]);
+    if (afl->state_flags_fd < 0) {
+      u8 *fn = alloc_printf("%s/queue/.state/flags", afl->out_dir);
 
-    if (P[large] < 1) {
-      Small[nSmall++] = large;
+      afl->state_flags_fd =
+          open(fn, O_RDWR | O_CREAT | O_TRUNC, DEFAULT_PERMISSION);
+      if (afl->state_flags_fd < 0) { PFATAL("Unable to create '%s'", fn); }
+      ck_free(fn);
+    }
 
-    } else {
-      Large[nLarge--] = large;
+    if (afl->state_flags) {
+      munmap(afl->state_flags - sizeof(u32),
+             sizeof(u32) + afl->state_flags_cnt);
     }
+
+    if (ftruncate(afl->state_flags_fd, sizeof(u32) + cnt)) {
+      PFATAL("ftruncate() of queue/.state/flags failed");
+    }
+
+    u8 *map = mmap(NULL, sizeof(u32) + cnt, PROT_READ | PROT_WRITE,
+                   MAP_SHARED, afl->state_flags_fd, 0);
+    if (map == MAP_FAILED) { PFATAL("mmap() of queue/.state/flags failed"); }
+
+    *(u32 *)map = STATE_FLAGS_MAGIC;
+    afl->state_flags = map + sizeof(u32);
+    afl->state_flags_cnt = cnt;
   }
 
-  while (nSmall) {
-    afl->alias_probability[Small[--nSmall]] = 1;
+  if (on) {
+    afl->state_flags[q->id] |= flag;
+
+  } else {
+    afl->state_flags[q->id] &= ~flag;
   }
+}
+
+/* Read the flags of the session we resume, from the .state/ of in_dir. */
+
+void queue_state_load(afl_state_t *afl) {
+  struct stat st;
+  u8         *fn = alloc_printf("%s/.state/flags", afl->in_dir);
+  s32         fd = open(fn, O_RDONLY);
+  u32         magic = 0;
 
-  while (nLarge != n - 1) {
-    afl->alias_probability[Large[++nLarge]] = 1;
+  ck_free(fn);
+
+  if (fd < 0) { return; }
+
+  if (!fstat(fd, &st) && st.st_size > (off_t)sizeof(u32) &&
+      read(fd, &magic, sizeof(u32)) == sizeof(u32) &&
+      magic == STATE_FLAGS_MAGIC) {
+    afl->state_flags_old_cnt = st.st_size - sizeof(u32);
+    afl->state_flags_old = ck_alloc_nozero(afl->state_flags_old_cnt);
+    ck_read(fd, afl->state_flags_old, afl->state_flags_old_cnt,
+            ".state/flags");
   }
 
-  afl->reinit_table = 0;
+  close(fd);
+}
 
-  /*
-  #ifdef INTROSPECTION
-    u8 fn[PATH_MAX];
-    snprintf(fn, PATH_MAX, "%s/introspection_corpus.txt", afl->out_dir);
-    FILE *f = fopen(fn, "a");
-    if (f) {
-
-      for (i = 0; i < n; i++) {
-
-        struct queue_entry *q = afl->queue_buf[i];
-        fprintf(
-            f,
-            "entry=%u name=%s favored=%s variable=%s disabled=%s len=%u "
-            "exec_us=%u "
-            "bitmap_size=%u bitsmap_size=%u tops=%u weight=%f perf_score=%f\n",
-            i, q->fname, q->favored ? "true" : "false",
-            q->var_behavior ? "true" : "false", q->disabled ? "true" : "false",
-            q->len, (u32)q->exec_us, q->bitmap_size, q->bitsmap_size, q->tc_ref,
-            q->weight, q->perf_score);
+/* The flags the session we resume had for its queue file name, 0 if it is
+   not one or there are none. */
 
-      }
+u8 queue_state_old(afl_state_t *afl, u8 *name) {
+  u32 id;
 
-      fprintf(f, "\n");
-      fclose(f);
+  if (!afl->state_flags_old) { return 0; }
+  if (strncmp(name, CASE_PREFIX, strlen(CASE_PREFIX))) { return 0; }
 
-    }
+  id = atoi(name + strlen(CASE_PREFIX));
 
-  #endif
-  */
-  /*
-  fprintf(stderr, "  entry  alias  probability  perf_score   weight
-  filename\n"); for (i = 0; i < n; ++i) fprintf(stderr, "  %5u  %5u  %11u
-  %0.9f  %0.9f  %s\n", i, afl->alias_table[i], afl->alias_probability[i],
-  afl->queue_buf[i]->perf_score, afl->queue_buf[i]->weight,
-            afl->queue_buf[i]->fname);
-  */
+  return id < afl->state_flags_old_cnt ? afl->state_flags_old[id] : 0;
 }
 
 /* Mark deterministic checks as done for a particular queue entry. We use the
-   .state file to avoid repeating deterministic fuzzing when resuming aborted
-   scans. */
+   .state flags to avoid repeating deterministic fuzzing when resuming
+   aborted scans. */
 
 void mark_as_det_done(afl_state_t *afl, struct queue_entry *q) {
   char fn[PATH_MAX];
   s32  fd;
 
+  queue_state_set(afl, q, STATE_DET_DONE, 1);
+  q->passed_det = 1;
+
+  if (likely(!afl->afl_env.afl_state_dirs)) { return; }
+
   snprintf(fn, PATH_MAX, "%s/queue/.state/deterministic_done/%s", afl->out_dir,
            strrchr((char *)q->fname, '/') + 1);
 
-  fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, DEFAULT_PERMISSION);
-  if (fd < 0) { PFATAL("Unable to create '%s'", fn); }
-  close(fd);
+  if (afl->writer) {
+    writer_create(afl->writer, fn, NULL, 0);
 
-  q->passed_det = 1;
+  } else {
+    fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, DEFAULT_PERMISSION);
+    if (fd < 0) { PFATAL("Unable to create '%s'", fn); }
+    close(fd);
+  }
 }
 
-/* Mark as variable. Create symlinks if possible to make it easier to examine
-   the files. */
+/* Mark as variable. With AFL_STATE_DIRS, create symlinks if possible to make
+   it easier to examine the files. */
 
 void mark_as_variable(afl_state_t *afl, struct queue_entry *q) {
   char fn[PATH_MAX];
   char ldest[PATH_MAX];
 
+  queue_state_set(afl, q, STATE_VARIABLE, 1);
+  q->var_behavior = 1;
+
+  if (likely(!afl->afl_env.afl_state_dirs)) { return; }
+
   char *fn_name = strrchr((char *)q->fname, '/') + 1;
 
   sprintf(ldest, "../../%s", fn_name);
@@ -285,8 +403,169 @@ void mark_as_variable(afl_state_t *afl, struct queue_entry *q) {
     if (fd < 0) { PFATAL("Unable to create '%s'", fn); }
     close(fd);
   }
+}
 
-  q->var_behavior = 1;
+/* On disk a byte importance map is this header and a flag byte per input
+   byte. The checksum of the input tells a stale map from a trimmed entry
+   apart. */
+
+struct byte_imp_hdr {
+  u32 magic, len;
+  u64 cksum;
+};
+
+#define BYTE_IMP_MAGIC 0x41465062
+
+static void byte_imp_path(afl_state_t *afl, struct queue_entry *q, u8 *fn) {
+  snprintf(fn, PATH_MAX, "%s/queue/.state/byte_importance/%s", afl->out_dir,
+           strrchr((char *)q->fname, '/') + 1);
+}
+
+/* Index the afl-analyze exports in AFL_ANALYZE_DIR by their header. */
+
+void load_analyses(afl_state_t *afl) {
+  struct analysis_hdr hdr;
+  struct dirent      *de;
+  DIR                *d;
+  u8                 *fn;
+  s32                 fd;
+
+  if (!afl->afl_env.afl_analyze_dir) { return; }
+
+  d = opendir(afl->afl_env.afl_analyze_dir);
+  if (!d) { PFATAL("Unable to open '%s'", afl->afl_env.afl_analyze_dir); }
+
+  while ((de = readdir(d))) {
+    if (de->d_name[0] == '.') { continue; }
+
+    fn = alloc_printf("%s/%s", afl->afl_env.afl_analyze_dir, de->d_name);
+    fd = open(fn, O_RDONLY);
+
+    if (fd < 0 || read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        hdr.magic != ANALYSIS_MAGIC) {
+      if (fd >= 0) { close(fd); }
+      WARNF("'%s' is not an afl-analyze export, ignoring.", fn);
+      ck_free(fn);
+      continue;
+    }
+
+    close(fd);
+
+    afl->analyses = ck_realloc(afl->analyses, (afl->analyses_cnt + 1) *
+                                                  sizeof(struct analysis_ref));
+    afl->analyses[afl->analyses_cnt].cksum = hdr.cksum;
+    afl->analyses[afl->analyses_cnt].len = hdr.len;
+    afl->analyses[afl->analyses_cnt++].fname = fn;
+  }
+
+  closedir(d);
+
+  OKF("Loaded %u afl-analyze export%s.", afl->analyses_cnt,
+      afl->analyses_cnt == 1 ? "" : "s");
+}
+
+/* Make the byte importance map of q from an export of its contents. */
+
+static void byte_imp_import(afl_state_t *afl, struct queue_entry *q, u8 *buf) {
+  struct analysis_hdr hdr;
+  u64                 cksum = hash64(buf, q->len, HASH_CONST);
+  u32                 i, j;
+  s32                 fd;
+
+  for (i = 0; i < afl->analyses_cnt; ++i) {
+    if (afl->analyses[i].len == q->len && afl->analyses[i].cksum == cksum) {
+      break;
+    }
+  }
+
+  if (i == afl->analyses_cnt) { return; }
+
+  fd = open(afl->analyses[i].fname, O_RDONLY);
+  if (fd < 0) { return; }
+
+  if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+      read(fd, q->byte_imp, q->len) != (ssize_t)q->len) {
+    memset(q->byte_imp, 0, q->len);
+    close(fd);
+    return;
+  }
+
+  close(fd);
+
+  for (j = 0; j < q->len; ++j) {
+    q->byte_imp[j] = (q->byte_imp[j] & 0x0f) == RESP_NONE
+                         ? BYTE_IMP_SEEN | BYTE_IMP_NEUTRAL
+                         : BYTE_IMP_SEEN;
+  }
+
+  byte_imp_save(afl, q, buf);
+}
+
+/* The byte importance map of q, whose input is buf. Loaded from an earlier
+   run if there is one, or made from an afl-analyze export, otherwise nothing
+   is known yet. */
+
+u8 *byte_imp_get(afl_state_t *afl, struct queue_entry *q, u8 *buf) {
+  struct byte_imp_hdr hdr;
+  char                fn[PATH_MAX];
+  s32                 fd;
+
+  if (likely(q->byte_imp)) { return q->byte_imp; }
+
+  q->byte_imp = ck_alloc(q->len);
+
+  byte_imp_path(afl, q, fn);
+  fd = open(fn, O_RDONLY);
+
+  if (fd < 0) {
+    if (afl->analyses_cnt) { byte_imp_import(afl, q, buf); }
+    return q->byte_imp;
+  }
+
+  if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+      hdr.magic != BYTE_IMP_MAGIC || hdr.len != q->len ||
+      hdr.cksum != hash64(buf, q->len, HASH_CONST) ||
+      read(fd, q->byte_imp, q->len) != (ssize_t)q->len) {
+    memset(q->byte_imp, 0, q->len);
+  }
+
+  close(fd);
+
+  return q->byte_imp;
+}
+
+/* Was every byte of q tested? */
+
+u8 byte_imp_complete(struct queue_entry *q) {
+  u32 i;
+
+  if (!q->byte_imp) { return 0; }
+
+  for (i = 0; i < q->len; ++i) {
+    if (!(q->byte_imp[i] & BYTE_IMP_SEEN)) { return 0; }
+  }
+
+  return 1;
+}
+
+/* Write the byte importance map of q, whose input is buf. */
+
+void byte_imp_save(afl_state_t *afl, struct queue_entry *q, u8 *buf) {
+  struct byte_imp_hdr hdr = {BYTE_IMP_MAGIC, q->len, 0};
+  char                fn[PATH_MAX];
+  s32                 fd;
+
+  if (!q->byte_imp) { return; }
+
+  hdr.cksum = hash64(buf, q->len, HASH_CONST);
+
+  byte_imp_path(afl, q, fn);
+  unlink(fn); /* Ignore errors, it may be linked from a resumed run */
+  fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, DEFAULT_PERMISSION);
+  if (fd < 0) { PFATAL("Unable to create '%s'", fn); }
+  ck_write(fd, (u8 *)&hdr, sizeof(hdr), fn);
+  ck_write(fd, q->byte_imp, q->len, fn);
+  close(fd);
 }
 
 /* Mark / unmark as redundant (edge-only). This is not used for restoring state,
@@ -298,11 +577,22 @@ void mark_as_redundant(afl_state_t *afl, struct queue_entry *q, u8 state) {
   char fn[PATH_MAX];
 
   q->fs_redundant = state;
+  queue_state_set(afl, q, STATE_REDUNDANT, state);
+
+  if (likely(!afl->afl_env.afl_state_dirs)) { return; }
 
   sprintf(fn, "%s/queue/.state/redundant_edges/%s", afl->out_dir,
           strrchr((char *)q->fname, '/') + 1);
 
-  if (state) {
+  if (afl->writer) {
+    if (state) {
+      writer_create(afl->writer, fn, NULL, 0);
+
+    } else {
+      writer_unlink(afl->writer, fn);
+    }
+
+  } else if (state) {
     s32 fd;
 
     fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, DEFAULT_PERMISSION);
@@ -400,6 +690,7 @@ static u8 check_if_text(afl_state_t *afl, struct queue_entry *q) {
   ssize_t comp;
 
   if (len >= MAX_FILE) len = MAX_FILE - 1;
+  queue_file_wait(afl, q);
   if ((fd = open((char *)q->fname, O_RDONLY)) < 0) return 0;
   buf = (u8 *)afl_realloc(AFL_BUF_PARAM(in_scratch), len + 1);
   comp = read(fd, buf, len);
@@ -486,20 +777,122 @@ static u8 check_if_text(afl_state_t *afl, struct queue_entry *q) {
   return 0;
 }
 
+/* Set up the content addressed store of AFL_QUEUE_STORE: .store in the sync
+   directory, or in the output directory without -M/-S. Queue files become
+   hard links to blobs named by hash and length there, so the instances that
+   share the store keep one copy, and one inode, of every content. */
+
+void queue_store_init(afl_state_t *afl) {
+  if (!afl->afl_env.afl_queue_store) { return; }
+
+  if (afl->no_unlink) {
+    WARNF("AFL_QUEUE_STORE does not work with -N, not using it.");
+    return;
+  }
+
+  afl->queue_store =
+      alloc_printf("%s/.store", afl->sync_id ? afl->sync_dir : afl->out_dir);
+
+  if (mkdir(afl->queue_store, 0700) && errno != EEXIST) {
+    PFATAL("Unable to create '%s'", afl->queue_store);
+  }
+}
+
+/* Link fn to the blob of mem, adding the blob if it is new. Returns 0 if fn
+   exists now. Blobs are never written once they are linked, queue files
+   that change are unlinked first (trim_case() etc.). */
+
+static u8 queue_store_link(afl_state_t *afl, u8 *fn, u8 *mem, u32 len) {
+  u8  blob[PATH_MAX], tmp[PATH_MAX];
+  u64 hash = hash64(mem, len, HASH_CONST);
+  s32 fd;
+
+  snprintf(blob, sizeof(blob), "%s/%016llx-%u", afl->queue_store, hash, len);
+
+  if (!link(blob, fn)) { return 0; }
+  if (errno != ENOENT) { return 1; }
+
+  snprintf(tmp, sizeof(tmp), "%s/.tmp-%d", afl->queue_store, getpid());
+  unlink(tmp); /* ignore errors */
+
+  fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, DEFAULT_PERMISSION);
+  if (fd < 0) { return 1; }
+
+  ck_write(fd, mem, len, tmp);
+  close(fd);
+
+  /* another instance may have added it meanwhile */
+
+  if (link(tmp, blob) && errno != EEXIST) {
+    unlink(tmp);
+    return 1;
+  }
+
+  unlink(tmp);
+
+  return !!link(blob, fn);
+}
+
+/* Write a new queue file, through the store if there is one. Returns the
+   writer job writing it with AFL_ASYNC_WRITES, else 0. */
+
+u64 write_queue_file(afl_state_t *afl, u8 *fn, u8 *mem, u32 len) {
+  s32 fd;
+
+  if (afl->queue_store && !queue_store_link(afl, fn, mem, len)) { return 0; }
+
+  if (afl->writer) { return writer_create(afl->writer, fn, mem, len); }
+
+  fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, DEFAULT_PERMISSION);
+  if (unlikely(fd < 0)) { PFATAL("Unable to create '%s'", fn); }
+  ck_write(fd, mem, len, fn);
+  close(fd);
+  return 0;
+}
+
+/* A zeroed entry for the next id. Entries are never freed one by one, so
+   they are carved from slabs of QUEUE_SLAB in id order; the first entry of
+   a slab is where it starts. The cache line alignment of the entries keeps
+   their scheduling fields in one line. */
+
+static struct queue_entry *queue_entry_alloc(afl_state_t *afl) {
+  u32   slot = afl->queued_items % QUEUE_SLAB;
+  void *slab;
+
+  if (slot) { return afl->queue_buf[afl->queued_items - slot] + slot; }
+
+  if (posix_memalign(&slab, __alignof__(struct queue_entry),
+                     QUEUE_SLAB * sizeof(struct queue_entry))) {
+    PFATAL("alloc");
+  }
+
+  memset(slab, 0, QUEUE_SLAB * sizeof(struct queue_entry));
+  return (struct queue_entry *)slab;
+}
+
 /* Append new test case to the queue. */
 
 void add_to_queue(afl_state_t *afl, u8 *fname, u32 len, u8 passed_det) {
-  struct queue_entry *q =
-      (struct queue_entry *)ck_alloc(sizeof(struct queue_entry));
+  struct queue_entry *q = queue_entry_alloc(afl);
 
   q->fname = fname;
   q->len = len;
+  q->write_seq = afl->queue_write_seq;
+  afl->queue_write_seq = 0;
   q->depth = afl->cur_depth + 1;
   q->passed_det = passed_det;
-  q->trace_mini = NULL;
+  q->trace_mini = 0;
   q->testcase_buf = NULL;
   q->mother = afl->queue_cur;
 
+  /* A havoc find shares the bytes around what havoc changed with its trimmed
+     mother, trim_case() does not try to remove them again. */
+
+  if (afl->mut_hi && afl->queue_cur && afl->queue_cur->trim_done) {
+    q->trim_pre = MIN(afl->mut_lo, len);
+    q->trim_suf = afl->mut_hi < len ? len - afl->mut_hi : 0;
+  }
+
 #ifdef INTROSPECTION
   q->bitsmap_size = afl->bitsmap_size;
 #endif
@@ -513,7 +906,9 @@ void add_to_queue(afl_state_t *afl, u8 *fname, u32 len, u8 passed_det) {
     afl->queue = afl->queue_top = q;
   }
 
-  if (likely(q->len > 4)) { ++afl->ready_for_splicing_count; }
+  if (likely(q->len > 4 && q->len <= MAX_FILE)) {
+    ++afl->ready_for_splicing_count;
+  }
 
   ++afl->queued_items;
   ++afl->active_items;
@@ -544,6 +939,7 @@ void add_to_queue(afl_state_t *afl, u8 *fname, u32 len, u8 passed_det) {
   if (afl->custom_mutators_count) {
     /* At the initialization stage, queue_cur is NULL */
     if (afl->queue_cur && !afl->syncing_party) {
+      queue_file_wait(afl, q);
       run_afl_custom_queue_new_entry(afl, q, fname, afl->queue_cur->fname);
     }
   }
@@ -561,12 +957,23 @@ void add_to_queue(afl_state_t *afl, u8 *fname, u32 len, u8 passed_det) {
 void destroy_queue(afl_state_t *afl) {
   u32 i;
 
+  if (afl->state_flags) {
+    munmap(afl->state_flags - sizeof(u32), sizeof(u32) + afl->state_flags_cnt);
+    afl->state_flags = NULL;
+  }
+
+  if (afl->state_flags_fd >= 0) {
+    close(afl->state_flags_fd);
+    afl->state_flags_fd = -1;
+  }
+
   for (i = 0; i < afl->queued_items; i++) {
     struct queue_entry *q;
 
     q = afl->queue_buf[i];
     ck_free(q->fname);
-    ck_free(q->trace_mini);
+    if (q->testcase_buf) { free(q->testcase_buf); }
+    if (q->large_map) { munmap(q->large_map, q->len); }
     if (q->skipdet_e) {
       if (q->skipdet_e->done_inf_map) ck_free(q->skipdet_e->done_inf_map);
       if (q->skipdet_e->skip_eff_map) ck_free(q->skipdet_e->skip_eff_map);
@@ -574,8 +981,235 @@ void destroy_queue(afl_state_t *afl) {
       ck_free(q->skipdet_e);
     }
 
-    ck_free(q);
+    if (q->byte_imp) { ck_free(q->byte_imp); }
+    if (q->hints) { ck_free(q->hints); }
+    if (q->cksum) { ck_free(q->cksum); }
+    custom_meta_free(afl, q);
+  }
+
+  for (i = 0; i < afl->queued_items; i += QUEUE_SLAB) {
+    free(afl->queue_buf[i]);
+  }
+
+  for (i = 0; i < TESTCASE_CLASSES; i++) {
+    while (afl->q_testcase_pool[i]) {
+      u8 *buf = afl->q_testcase_pool[i];
+      afl->q_testcase_pool[i] = *(u8 **)buf;
+      free(buf);
+    }
+  }
+}
+
+/* The trace_mini bitmaps of the queue entries live in slots of an arena
+   file which is mmap()ed MAP_SHARED, so the kernel can write cold ones back
+   and page them in again on demand instead of them pinning RAM. The file is
+   unlinked right after creation. Slots are addressed by index as the arena
+   moves when it grows. */
+
+inline u8 *get_trace_mini(afl_state_t *afl, struct queue_entry *q) {
+  if (!q->trace_mini) { return NULL; }
+
+  return afl->trace_mini_arena +
+         (size_t)(q->trace_mini - 1) * afl->trace_mini_len;
+}
+
+static void grow_trace_mini_arena(afl_state_t *afl) {
+  u32 slots = afl->trace_mini_slots ? afl->trace_mini_slots << 1
+                                    : TRACE_MINI_ARENA_SLOTS;
+
+  if (afl->trace_mini_fd < 0) {
+    u8 *fn = alloc_printf("%s/.trace_mini", afl->out_dir);
+
+    afl->trace_mini_fd =
+        open(fn, O_RDWR | O_CREAT | O_TRUNC, DEFAULT_PERMISSION);
+    if (afl->trace_mini_fd < 0) { PFATAL("Unable to create '%s'", fn); }
+    unlink(fn); /* Ignore errors */
+    ck_free(fn);
+
+    afl->trace_mini_len = afl->fsrv.map_size >> 3;
+  }
+
+  if (afl->trace_mini_arena) {
+    munmap(afl->trace_mini_arena,
+           (size_t)afl->trace_mini_slots * afl->trace_mini_len);
+  }
+
+  if (ftruncate(afl->trace_mini_fd, (off_t)slots * afl->trace_mini_len)) {
+    PFATAL("ftruncate() of the trace_mini arena failed");
+  }
+
+  afl->trace_mini_arena =
+      mmap(NULL, (size_t)slots * afl->trace_mini_len, PROT_READ | PROT_WRITE,
+           MAP_SHARED, afl->trace_mini_fd, 0);
+  if (afl->trace_mini_arena == MAP_FAILED) {
+    PFATAL("mmap() of the trace_mini arena failed");
+  }
+
+  afl->trace_mini_slots = slots;
+}
+
+/* Widen the slots to a map that grew (map_grow()), the bits of the new map
+   bytes are clear. The slots move back to front, so none is overwritten
+   before it moved. */
+
+void resize_trace_mini_arena(afl_state_t *afl) {
+  u32 len = afl->fsrv.map_size >> 3, old = afl->trace_mini_len, slot;
+
+  if (!afl->trace_mini_arena || len <= old) { return; }
+
+  munmap(afl->trace_mini_arena, (size_t)afl->trace_mini_slots * old);
+
+  if (ftruncate(afl->trace_mini_fd, (off_t)afl->trace_mini_slots * len)) {
+    PFATAL("ftruncate() of the trace_mini arena failed");
+  }
+
+  afl->trace_mini_arena =
+      mmap(NULL, (size_t)afl->trace_mini_slots * len, PROT_READ | PROT_WRITE,
+           MAP_SHARED, afl->trace_mini_fd, 0);
+  if (afl->trace_mini_arena == MAP_FAILED) {
+    PFATAL("mmap() of the trace_mini arena failed");
+  }
+
+  for (slot = afl->trace_mini_used; slot--;) {
+    u8 *mini = afl->trace_mini_arena + (size_t)slot * len;
+
+    memmove(mini, afl->trace_mini_arena + (size_t)slot * old, old);
+    memset(mini + old, 0, len - old);
+  }
+
+  afl->trace_mini_len = len;
+}
+
+/* Give q a trace_mini slot with the minimized current trace. */
+
+static void alloc_trace_mini(afl_state_t *afl, struct queue_entry *q) {
+  u32 slot;
+  u8 *mini;
+
+  if (afl->trace_mini_free_cnt) {
+    slot = afl->trace_mini_free[--afl->trace_mini_free_cnt];
+    mini = afl->trace_mini_arena + (size_t)slot * afl->trace_mini_len;
+    memset(mini, 0, afl->trace_mini_len);
+
+  } else {
+    if (unlikely(afl->trace_mini_used == afl->trace_mini_slots)) {
+      grow_trace_mini_arena(afl);
+    }
+
+    slot = afl->trace_mini_used++;
+    mini = afl->trace_mini_arena + (size_t)slot * afl->trace_mini_len;
+  }
+
+  minimize_bits(afl, mini, afl->fsrv.trace_bits);
+  q->trace_mini = slot + 1;
+}
+
+static void free_trace_mini(afl_state_t *afl, struct queue_entry *q) {
+  if (!q->trace_mini) { return; }
+
+  if (!afl_realloc((void **)&afl->trace_mini_free,
+                   (afl->trace_mini_free_cnt + 1) * sizeof(u32))) {
+    PFATAL("alloc");
+  }
+
+  afl->trace_mini_free[afl->trace_mini_free_cnt++] = q->trace_mini - 1;
+  q->trace_mini = 0;
+}
+
+void destroy_trace_mini_arena(afl_state_t *afl) {
+  if (afl->trace_mini_arena) {
+    munmap(afl->trace_mini_arena,
+           (size_t)afl->trace_mini_slots * afl->trace_mini_len);
+    afl->trace_mini_arena = NULL;
+  }
+
+  if (afl->trace_mini_fd >= 0) {
+    close(afl->trace_mini_fd);
+    afl->trace_mini_fd = -1;
+  }
+
+  afl_free(afl->trace_mini_free);
+  afl->trace_mini_free = NULL;
+}
+
+/* Path frequencies for the FAST..RARE schedules. Only the frequencies of
+   queued paths are ever read, so n_fuzz holds just those, keyed by their
+   full trace checksum (open addressing, linear probing). Hits of paths that
+   are not in the table are dropped. */
+
+void n_fuzz_init(afl_state_t *afl) {
+  afl->n_fuzz_size = N_FUZZ_SIZE_INIT;
+  afl->n_fuzz_count = 0;
+  afl->n_fuzz = ck_alloc(afl->n_fuzz_size * sizeof(struct n_fuzz_slot));
+}
+
+static inline struct n_fuzz_slot *n_fuzz_find(afl_state_t *afl, u64 cksum) {
+  u32 mask = afl->n_fuzz_size - 1;
+  u32 i = (u32)cksum & mask;
+
+  while (afl->n_fuzz[i].cksum && afl->n_fuzz[i].cksum != cksum) {
+    i = (i + 1) & mask;
   }
+
+  return &afl->n_fuzz[i];
+}
+
+static void n_fuzz_grow(afl_state_t *afl) {
+  struct n_fuzz_slot *old = afl->n_fuzz;
+  u32                 i, old_size = afl->n_fuzz_size;
+
+  afl->n_fuzz_size <<= 1;
+  afl->n_fuzz = ck_alloc(afl->n_fuzz_size * sizeof(struct n_fuzz_slot));
+
+  for (i = 0; i < old_size; ++i) {
+    if (old[i].cksum) { *n_fuzz_find(afl, old[i].cksum) = old[i]; }
+  }
+
+  ck_free(old);
+}
+
+/* A new queue entry took this path: (re)start counting its hits at 1. */
+
+void n_fuzz_add(afl_state_t *afl, u64 cksum) {
+  if (unlikely(!cksum)) { return; }
+
+  if (unlikely((afl->n_fuzz_count + 1) * 4 > afl->n_fuzz_size * 3)) {
+    n_fuzz_grow(afl);
+  }
+
+  struct n_fuzz_slot *slot = n_fuzz_find(afl, cksum);
+
+  if (!slot->cksum) {
+    slot->cksum = cksum;
+    ++afl->n_fuzz_count;
+  }
+
+  slot->hits = 1;
+}
+
+/* Saturated increment for a queued path. */
+
+void n_fuzz_hit(afl_state_t *afl, u64 cksum) {
+  struct n_fuzz_slot *slot = n_fuzz_find(afl, cksum);
+
+  if (likely(slot->cksum) && likely(slot->hits < 0xFFFFFFFF)) { slot->hits++; }
+}
+
+/* Restore the hits of a queued path, for checkpoint_load(). */
+
+void n_fuzz_set(afl_state_t *afl, u64 cksum, u32 hits) {
+  struct n_fuzz_slot *slot;
+
+  if (unlikely(!cksum)) { return; }
+
+  slot = n_fuzz_find(afl, cksum);
+  if (slot->cksum) { slot->hits = hits; }
+}
+
+u32 n_fuzz_hits(afl_state_t *afl, u64 cksum) {
+  if (unlikely(!cksum)) { return 0; }
+
+  return n_fuzz_find(afl, cksum)->hits;
 }
 
 /* When we bump into a new path, we call this to see if the path appears
@@ -598,7 +1232,7 @@ void update_bitmap_score(afl_state_t *afl, struct queue_entry *q) {
     fuzz_p2 = 0;  // Skip the fuzz_p2 comparison
 
   } else if (unlikely(afl->schedule == RARE)) {
-    fuzz_p2 = next_pow2(afl->n_fuzz[q->n_fuzz_entry]);
+    fuzz_p2 = next_pow2(n_fuzz_hits(afl, q->n_fuzz_entry));
 
   } else {
     fuzz_p2 = q->fuzz_level;
@@ -625,7 +1259,7 @@ void update_bitmap_score(afl_state_t *afl, struct queue_entry *q) {
 
         } else if (unlikely(afl->schedule == RARE)) {
           top_rated_fuzz_p2 =
-              next_pow2(afl->n_fuzz[afl->top_rated[i]->n_fuzz_entry]);
+              next_pow2(n_fuzz_hits(afl, afl->top_rated[i]->n_fuzz_entry));
 
         } else {
           top_rated_fuzz_p2 = afl->top_rated[i]->fuzz_level;
@@ -647,9 +1281,16 @@ void update_bitmap_score(afl_state_t *afl, struct queue_entry *q) {
            previous winner, discard its afl->fsrv.trace_bits[] if necessary. */
 
         if (!--afl->top_rated[i]->tc_ref) {
-          ck_free(afl->top_rated[i]->trace_mini);
-          afl->top_rated[i]->trace_mini = 0;
+          free_trace_mini(afl, afl->top_rated[i]);
         }
+
+      } else if (unlikely(afl->afl_env.afl_splice_cover)) {
+        afl->cover_edges =
+            afl_realloc((void **)&afl->cover_edges,
+                        (afl->cover_edges_cnt + 1) * sizeof(u32));
+        if (unlikely(!afl->cover_edges)) { PFATAL("alloc"); }
+
+        afl->cover_edges[afl->cover_edges_cnt++] = i;
       }
 
       /* Insert ourselves as the new winner. */
@@ -657,79 +1298,226 @@ void update_bitmap_score(afl_state_t *afl, struct queue_entry *q) {
       afl->top_rated[i] = q;
       ++q->tc_ref;
 
-      if (!q->trace_mini) {
-        u32 len = (afl->fsrv.map_size >> 3);
-        q->trace_mini = (u8 *)ck_alloc(len);
-        minimize_bits(afl, q->trace_mini, afl->fsrv.trace_bits);
-      }
+      if (!q->trace_mini) { alloc_trace_mini(afl, q); }
 
+      if (i < afl->cull_from) { afl->cull_from = i; }
       afl->score_changed = 1;
     }
   }
 }
 
+/* Picks the queue entry to splice the current one with. With
+   AFL_SPLICE_COVER that is the top_rated[] winner of a random edge the
+   current entry does not cover, so the splice has something to bring in:
+   top_rated[] already maps every edge to an entry holding it, and
+   cover_edges[] lists the edges that have one. Otherwise, or if no such
+   entry turns up in SPLICE_COVER_TRIES edges, it is a random one. Never the
+   current entry itself, never one shorter than 4 bytes and never a large
+   one (AFL_LARGE_INPUTS). */
+
+u32 splice_partner(afl_state_t *afl) {
+  u32 tid, i;
+
+  if (unlikely(afl->afl_env.afl_splice_cover) && afl->cover_edges_cnt) {
+    u8 *mini = get_trace_mini(afl, afl->queue_cur);
+
+    for (i = 0; i < SPLICE_COVER_TRIES; ++i) {
+      u32 e = afl->cover_edges[rand_below(afl, afl->cover_edges_cnt)];
+      struct queue_entry *q = afl->top_rated[e];
+
+      if (mini && (mini[e >> 3] & (1 << (e & 7)))) { continue; }
+      if (q->id == afl->current_entry || q->len < 4 || q->len > MAX_FILE) {
+        continue;
+      }
+
+      return q->id;
+    }
+  }
+
+  do {
+    tid = rand_below(afl, afl->queued_items);
+
+  } while (unlikely(tid == afl->current_entry || afl->queue_buf[tid]->len < 4 ||
+                    afl->queue_buf[tid]->len > MAX_FILE));
+
+  return tid;
+}
+
 /* The second part of the mechanism discussed above is a routine that
    goes over afl->top_rated[] entries, and then sequentially grabs winners for
-   previously-unseen bytes (temp_v) and marks them as favored, at least
-   until the next run. The favored entries are given more air time during
-   all fuzzing steps. */
+   previously-unseen bytes and marks them as favored, at least until the next
+   run. The favored entries are given more air time during all fuzzing
+   steps.
+
+   The greedy pass is incremental: its choices for the map bytes before
+   cull_from depend only on top_rated[] entries that did not change, so they
+   are kept and the pass resumes at cull_from. cull_cover[] remembers for
+   every byte which choice covered it, entries only record bytes behind
+   their own, so the suffix starting at cull_from can be reset on its own. */
+
+static int pending_fav_cmp(const void *a, const void *b) {
+  u64 x = *(const u64 *)a, y = *(const u64 *)b;
+  return x < y ? -1 : x > y;
+}
 
 void cull_queue(afl_state_t *afl) {
   if (likely(!afl->score_changed || afl->non_instrumented_mode)) { return; }
 
-  u32 len = (afl->fsrv.map_size >> 3);
-  u32 i;
-  u8 *temp_v = afl->map_tmp_buf;
+  u32  map_size = afl->fsrv.map_size, len = (map_size >> 3);
+  u32  from = afl->cull_from, i, j;
+  u32 *cover = afl->cull_cover;
 
   afl->score_changed = 0;
+  afl->cull_from = map_size;
 
-  memset(temp_v, 255, len);
+  if (unlikely(!cover)) {
+    cover = afl->cull_cover = ck_alloc(map_size * sizeof(u32));
+    from = 0;
+  }
 
-  afl->queued_favored = 0;
-  afl->pending_favored = 0;
+  /* Forget all choices made at or after from. */
 
   for (i = 0; i < afl->queued_items; i++) {
-    afl->queue_buf[i]->favored = 0;
+    struct queue_entry *q = afl->queue_buf[i];
+
+    if (q->favored && q->fav_idx >= from) { q->favored = 0; }
+  }
+
+  for (i = from; i < map_size; ++i) {
+    if (cover[i] >= from) { cover[i] = CULL_UNCOVERED; }
   }
 
-  /* Let's see if anything in the bitmap isn't captured in temp_v.
-     If yes, and if it has a afl->top_rated[] contender, let's use it. */
+  /* Let's see if anything in the bitmap isn't covered yet. If yes, and if it
+     has a afl->top_rated[] contender, let's use it. */
 
-  afl->smallest_favored = -1;
+  for (i = from; i < map_size; ++i) {
+    struct queue_entry *q = afl->top_rated[i];
 
-  for (i = 0; i < afl->fsrv.map_size; ++i) {
-    if (afl->top_rated[i] && (temp_v[i >> 3] & (1 << (i & 7)))) {
-      u32 j = len;
+    if (!q || cover[i] != CULL_UNCOVERED) { continue; }
 
-      /* Remove all bits belonging to the current entry from temp_v. */
+    u8 *mini = get_trace_mini(afl, q);
 
-      while (j--) {
-        if (afl->top_rated[i]->trace_mini[j]) {
-          temp_v[j] &= ~afl->top_rated[i]->trace_mini[j];
-        }
-      }
+    /* Mark the bytes of the current entry that are still ahead as covered. */
 
-      if (!afl->top_rated[i]->favored) {
-        afl->top_rated[i]->favored = 1;
-        ++afl->queued_favored;
+    for (j = (i >> 3); j < len; ++j) {
+      if (!mini[j]) { continue; }
 
-        if (!afl->top_rated[i]->was_fuzzed) {
-          ++afl->pending_favored;
-          if (unlikely(afl->smallest_favored < 0)) {
-            afl->smallest_favored = (s64)afl->top_rated[i]->id;
-          }
+      for (u32 b = 0; b < 8; ++b) {
+        u32 k = (j << 3) + b;
+        if ((mini[j] & (1 << b)) && k > i && cover[k] == CULL_UNCOVERED) {
+          cover[k] = i;
         }
       }
     }
+
+    if (!q->favored) {
+      q->favored = 1;
+      q->fav_idx = i;
+    }
   }
 
+  afl->queued_favored = 0;
+  afl->pending_favored = 0;
+  afl->pending_fav_pos = 0;
+
   for (i = 0; i < afl->queued_items; i++) {
-    if (likely(!afl->queue_buf[i]->disabled)) {
-      mark_as_redundant(afl, afl->queue_buf[i], !afl->queue_buf[i]->favored);
+    struct queue_entry *q = afl->queue_buf[i];
+
+    if (q->favored) {
+      ++afl->queued_favored;
+
+      if (!q->was_fuzzed) {
+        u32 n = afl->pending_favored++;
+
+        afl->pending_fav = afl_realloc((void **)&afl->pending_fav,
+                                       (n + 1) * sizeof(u64));
+        if (unlikely(!afl->pending_fav)) { PFATAL("alloc"); }
+
+        afl->pending_fav[n] = ((u64)q->fav_idx << 32) | q->id;
+      }
+    }
+
+    if (likely(!q->disabled) && q->fs_redundant == q->favored) {
+      /* The favored state flipped. */
+      mark_as_redundant(afl, q, !q->favored);
+      update_queue_weight(afl, q);
     }
   }
 
-  afl->reinit_table = 1;
+  afl->pending_fav_cnt = afl->pending_favored;
+  qsort(afl->pending_fav, afl->pending_fav_cnt, sizeof(u64), pending_fav_cmp);
+}
+
+/* The next favored entry that was not fuzzed yet, the one favored for the
+   smallest map byte first, or -1 if there is none left. */
+
+s64 next_pending_favored(afl_state_t *afl) {
+  while (afl->pending_fav_pos < afl->pending_fav_cnt) {
+    struct queue_entry *q =
+        afl->queue_buf[(u32)afl->pending_fav[afl->pending_fav_pos]];
+
+    if (q->favored && !q->was_fuzzed && !q->disabled) { return q->id; }
+
+    ++afl->pending_fav_pos;
+  }
+
+  return -1;
+}
+
+/* Book one fuzz_one() run on q for the ENERGY schedule: the time it took,
+   the execs it did and what it found. Old records are halved so the rates
+   follow what fuzzing an entry brings now. */
+
+void energy_account(afl_state_t *afl, struct queue_entry *q, u64 us,
+                    u64 execs, u32 finds) {
+  q->fuzz_us += us;
+  q->fuzz_execs += execs;
+  q->fuzz_finds += finds;
+
+  if (unlikely(q->fuzz_us > ENERGY_WINDOW_US)) {
+    q->fuzz_us >>= 1;
+    q->fuzz_execs >>= 1;
+    q->fuzz_finds >>= 1;
+  }
+
+  afl->energy_us += us;
+  afl->energy_execs += execs;
+  afl->energy_finds += finds;
+
+  if (unlikely(afl->energy_us > ENERGY_WINDOW_US * 16)) {
+    afl->energy_us >>= 1;
+    afl->energy_execs >>= 1;
+    afl->energy_finds >>= 1;
+  }
+}
+
+/* ENERGY: how many finds fuzzing q is expected to bring per second of CPU
+   time, relative to the queue average. Until q was fuzzed for a while its
+   find rate leans on a prior from the rarity of its path, the cost is what
+   its execs took in fuzz_one() (or its calibration time before that). */
+
+static double energy_factor(afl_state_t *afl, struct queue_entry *q,
+                            u32 avg_exec_us) {
+  double avg_rate, avg_cost, prior, rate, cost;
+  u32    hits = n_fuzz_hits(afl, q->n_fuzz_entry);
+
+  avg_rate = (afl->energy_finds + 1.0) / (afl->energy_us + ENERGY_PRIOR_US);
+  prior = avg_rate * 2 * ENERGY_RARE_HITS / (hits + ENERGY_RARE_HITS);
+  rate = (q->fuzz_finds + prior * ENERGY_PRIOR_US) /
+         (q->fuzz_us + ENERGY_PRIOR_US);
+
+  if (q->fuzz_execs && afl->energy_execs) {
+    cost = (double)q->fuzz_us / q->fuzz_execs;
+    avg_cost = (double)afl->energy_us / afl->energy_execs;
+
+  } else {
+    cost = q->exec_us;
+    avg_cost = avg_exec_us;
+  }
+
+  if (unlikely(cost <= 0 || avg_cost <= 0)) { return rate / avg_rate; }
+
+  return (rate / avg_rate) * (avg_cost / cost);
 }
 
 /* Calculate case desirability score to adjust the length of havoc fuzzing.
@@ -757,7 +1545,7 @@ u32 calculate_score(afl_state_t *afl, struct queue_entry *q) {
   // Longer execution time means longer work on the input, the deeper in
   // coverage, the better the fuzzing, right? -mh
 
-  if (likely(afl->schedule < RARE) && likely(!afl->fixed_seed)) {
+  if (likely(afl->schedule < ENERGY) && likely(!afl->fixed_seed)) {
     if (q->exec_us * 0.1 > avg_exec_us) {
       perf_score = 10;
 
@@ -861,7 +1649,8 @@ u32 calculate_score(afl_state_t *afl, struct queue_entry *q) {
       u32 i;
       for (i = 0; i < afl->queued_items; i++) {
         if (likely(!afl->queue_buf[i]->disabled)) {
-          fuzz_mu += log2(afl->n_fuzz[afl->queue_buf[i]->n_fuzz_entry]);
+          fuzz_mu +=
+              log2(n_fuzz_hits(afl, afl->queue_buf[i]->n_fuzz_entry));
           n_items++;
         }
       }
@@ -870,7 +1659,7 @@ u32 calculate_score(afl_state_t *afl, struct queue_entry *q) {
 
       fuzz_mu = fuzz_mu / n_items;
 
-      if (log2(afl->n_fuzz[q->n_fuzz_entry]) > fuzz_mu) {
+      if (log2(n_fuzz_hits(afl, q->n_fuzz_entry)) > fuzz_mu) {
         /* Never skip favourites */
         if (!q->favored) factor = 0;
 
@@ -883,7 +1672,7 @@ u32 calculate_score(afl_state_t *afl, struct queue_entry *q) {
       // Don't modify unfuzzed seeds
       if (!q->fuzz_level) break;
 
-      switch ((u32)log2(afl->n_fuzz[q->n_fuzz_entry])) {
+      switch ((u32)log2(n_fuzz_hits(afl, q->n_fuzz_entry))) {
         case 0 ... 1:
           factor = 4;
           break;
@@ -920,15 +1709,15 @@ u32 calculate_score(afl_state_t *afl, struct queue_entry *q) {
       // Don't modify perf_score for unfuzzed seeds
       if (!q->fuzz_level) break;
 
-      factor = q->fuzz_level / (afl->n_fuzz[q->n_fuzz_entry] + 1);
+      factor = q->fuzz_level / (n_fuzz_hits(afl, q->n_fuzz_entry) + 1);
       break;
 
     case QUAD:
       // Don't modify perf_score for unfuzzed seeds
       if (!q->fuzz_level) break;
 
-      factor =
-          q->fuzz_level * q->fuzz_level / (afl->n_fuzz[q->n_fuzz_entry] + 1);
+      factor = q->fuzz_level * q->fuzz_level /
+               (n_fuzz_hits(afl, q->n_fuzz_entry) + 1);
       break;
 
     case MMOPT:
@@ -946,6 +1735,11 @@ u32 calculate_score(afl_state_t *afl, struct queue_entry *q) {
 
       break;
 
+    case ENERGY:
+      factor = energy_factor(afl, q, avg_exec_us);
+      if (q->favored && factor < 1) { factor = 1; }
+      break;
+
     case RARE:
 
       // increase the score for every bitmap byte for which this entry
@@ -953,7 +1747,7 @@ u32 calculate_score(afl_state_t *afl, struct queue_entry *q) {
       perf_score += (q->tc_ref * 10);
       // the more often fuzz result paths are equal to this queue entry,
       // reduce its value
-      perf_score *= (1 - (double)((double)afl->n_fuzz[q->n_fuzz_entry] /
+      perf_score *= (1 - (double)((double)n_fuzz_hits(afl, q->n_fuzz_entry) /
                                   (double)afl->fsrv.total_execs));
 
       break;
@@ -962,7 +1756,7 @@ u32 calculate_score(afl_state_t *afl, struct queue_entry *q) {
       PFATAL("Unknown Power Schedule");
   }
 
-  if (unlikely(afl->schedule >= EXPLOIT && afl->schedule <= QUAD)) {
+  if (unlikely(afl->schedule >= EXPLOIT && afl->schedule <= ENERGY)) {
     if (factor > MAX_FACTOR) { factor = MAX_FACTOR; }
     perf_score *= factor / POWER_BETA;
   }
@@ -976,6 +1770,8 @@ u32 calculate_score(afl_state_t *afl, struct queue_entry *q) {
     perf_score = 1;
   }
 
+  if (unlikely(afl->fsrv.focus_end)) { perf_score *= focus_factor(q); }
+
   /* Make sure that we don't go over limit. */
 
   if (perf_score > afl->havoc_max_mult * 100) {
@@ -985,22 +1781,147 @@ u32 calculate_score(afl_state_t *afl, struct queue_entry *q) {
   return perf_score;
 }
 
+/* The testcase cache keeps its buffers in size classes of powers of two and
+   recycles released ones on per class free lists (the link lives in the
+   first bytes of the free buffer). q_testcase_cache_size is the size of all
+   buffers in use, which together with the pooled ones never exceeds
+   q_testcase_max_cache_size. The cached entries are kept dense in
+   q_testcase_cache and evicted in CLOCK order: an entry that was hit since
+   the hand last passed it gets a second chance. */
+
+static inline u32 testcase_class(u32 len) {
+  if (len <= (1U << TESTCASE_MIN_SHIFT)) { return 0; }
+  return 32 - __builtin_clz(len - 1) - TESTCASE_MIN_SHIFT;
+}
+
+static inline void testcase_chunk_put(afl_state_t *afl, u8 *buf, u32 cls) {
+  u64 size = 1ULL << (cls + TESTCASE_MIN_SHIFT);
+
+  *(u8 **)buf = afl->q_testcase_pool[cls];
+  afl->q_testcase_pool[cls] = buf;
+  afl->q_testcase_pool_size += size;
+  afl->q_testcase_cache_size -= size;
+}
+
+/* Evicts one cached testcase that is neither queue_cur nor keep, returns 0
+   if there is none. */
+
+static u32 testcase_evict(afl_state_t *afl, struct queue_entry *keep) {
+  u32 steps = 2 * afl->q_testcase_cache_count;
+
+  while (steps--) {
+    if (unlikely(afl->q_testcase_clock >= afl->q_testcase_cache_count)) {
+      afl->q_testcase_clock = 0;
+    }
+
+    struct queue_entry *q = afl->q_testcase_cache[afl->q_testcase_clock];
+
+    if (unlikely(q == afl->queue_cur || q == keep)) {
+      ++afl->q_testcase_clock;
+
+    } else if (q->testcase_ref) {
+      q->testcase_ref = 0;
+      ++afl->q_testcase_clock;
+
+    } else {
+      testcase_chunk_put(afl, q->testcase_buf, testcase_class(q->len));
+      q->testcase_buf = NULL;
+      afl->q_testcase_cache[afl->q_testcase_clock] =
+          afl->q_testcase_cache[--afl->q_testcase_cache_count];
+      ++afl->q_testcase_evictions;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* Returns a buffer of size class cls. Makes room by releasing pooled buffers
+   of other classes first, largest first, and only once the pool is empty by
+   evicting (if allowed), otherwise it returns NULL. An evicted buffer goes to
+   the pool and is reused or released on the next round. If even eviction
+   cannot make room the limit is exceeded for this buffer. */
+
+static u8 *testcase_chunk_get(afl_state_t *afl, u32 cls,
+                              struct queue_entry *keep, u32 may_evict) {
+  u64 size = 1ULL << (cls + TESTCASE_MIN_SHIFT);
+  u8 *buf;
+
+  while (1) {
+    if (afl->q_testcase_pool[cls]) {
+      buf = afl->q_testcase_pool[cls];
+      afl->q_testcase_pool[cls] = *(u8 **)buf;
+      afl->q_testcase_pool_size -= size;
+      break;
+    }
+
+    if (afl->q_testcase_cache_size + afl->q_testcase_pool_size + size <=
+        afl->q_testcase_max_cache_size) {
+      buf = (u8 *)malloc(size);
+      if (unlikely(!buf)) { PFATAL("Unable to malloc %llu bytes", size); }
+      break;
+    }
+
+    if (afl->q_testcase_pool_size) {
+      u32 i = TESTCASE_CLASSES;
+      while (!afl->q_testcase_pool[--i]) {}
+
+      u8 *old = afl->q_testcase_pool[i];
+      afl->q_testcase_pool[i] = *(u8 **)old;
+      afl->q_testcase_pool_size -= 1ULL << (i + TESTCASE_MIN_SHIFT);
+      free(old);
+      continue;
+    }
+
+    if (!may_evict) { return NULL; }
+
+    if (!testcase_evict(afl, keep)) {
+      buf = (u8 *)malloc(size);
+      if (unlikely(!buf)) { PFATAL("Unable to malloc %llu bytes", size); }
+      break;
+    }
+  }
+
+  afl->q_testcase_cache_size += size;
+  return buf;
+}
+
+/* Moves a cached testcase to a buffer of the size class of its new length,
+   keeping the first copy_len bytes. */
+
+static void testcase_resize(afl_state_t *afl, struct queue_entry *q,
+                            u32 old_len, u32 copy_len) {
+  u32 old_cls = testcase_class(old_len), cls = testcase_class(q->len);
+
+  if (likely(cls == old_cls)) { return; }
+
+  u8 *buf = testcase_chunk_get(afl, cls, q, 1);
+  if (copy_len) { memcpy(buf, q->testcase_buf, copy_len); }
+  testcase_chunk_put(afl, q->testcase_buf, old_cls);
+  q->testcase_buf = buf;
+}
+
+/* Registers q as cached */
+
+static inline void testcase_cache_add(afl_state_t *afl, struct queue_entry *q,
+                                      u8 *buf) {
+  q->testcase_buf = buf;
+  q->testcase_ref = 0;
+  afl->q_testcase_cache[afl->q_testcase_cache_count++] = q;
+}
+
 /* after a custom trim we need to reload the testcase from disk */
 
 inline void queue_testcase_retake(afl_state_t *afl, struct queue_entry *q,
                                   u32 old_len) {
+  q->input_hash = 0;
+
   if (likely(q->testcase_buf)) {
     u32 len = q->len;
 
-    if (len != old_len) {
-      afl->q_testcase_cache_size = afl->q_testcase_cache_size + len - old_len;
-      q->testcase_buf = (u8 *)realloc(q->testcase_buf, len);
-
-      if (unlikely(!q->testcase_buf)) {
-        PFATAL("Unable to malloc '%s' with len %u", (char *)q->fname, len);
-      }
-    }
+    if (len != old_len) { testcase_resize(afl, q, old_len, 0); }
 
+    queue_file_wait(afl, q);
     int fd = open((char *)q->fname, O_RDONLY);
 
     if (unlikely(fd < 0)) { PFATAL("Unable to open '%s'", (char *)q->fname); }
@@ -1014,28 +1935,49 @@ inline void queue_testcase_retake(afl_state_t *afl, struct queue_entry *q,
 
 inline void queue_testcase_retake_mem(afl_state_t *afl, struct queue_entry *q,
                                       u8 *in, u32 len, u32 old_len) {
+  q->input_hash = 0;
+
   if (likely(q->testcase_buf)) {
     u32 is_same = in == q->testcase_buf;
 
     if (likely(len != old_len)) {
-      u8 *ptr = (u8 *)realloc(q->testcase_buf, len);
-
-      if (likely(ptr)) {
-        q->testcase_buf = ptr;
-        afl->q_testcase_cache_size = afl->q_testcase_cache_size + len - old_len;
-      }
+      testcase_resize(afl, q, old_len,
+                      is_same ? (len < old_len ? len : old_len) : 0);
     }
 
     if (unlikely(!is_same)) { memcpy(q->testcase_buf, in, len); }
   }
 }
 
+/* Inputs longer than MAX_FILE (AFL_LARGE_INPUTS) are not read into the
+   cache but mapped, once, and stay mapped: fuzz_one() only takes a window
+   of them, and their files do not change as they are never trimmed. */
+
+static u8 *testcase_map(afl_state_t *afl, struct queue_entry *q) {
+  if (likely(q->large_map)) { return q->large_map; }
+
+  queue_file_wait(afl, q);
+  int fd = open((char *)q->fname, O_RDONLY);
+
+  if (unlikely(fd < 0)) { PFATAL("Unable to open '%s'", (char *)q->fname); }
+
+  q->large_map = mmap(NULL, q->len, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (unlikely(q->large_map == MAP_FAILED)) {
+    PFATAL("Unable to mmap '%s'", (char *)q->fname);
+  }
+
+  close(fd);
+  return q->large_map;
+}
+
 /* Returns the testcase buf from the file behind this queue entry.
   Increases the refcount. */
 
 inline u8 *queue_testcase_get(afl_state_t *afl, struct queue_entry *q) {
   u32 len = q->len;
 
+  if (unlikely(len > MAX_FILE)) { return testcase_map(afl, q); }
+
   /* first handle if no testcase cache is configured */
 
   if (unlikely(!afl->q_testcase_max_cache_size)) {
@@ -1052,6 +1994,7 @@ inline u8 *queue_testcase_get(afl_state_t *afl, struct queue_entry *q) {
       PFATAL("Unable to malloc '%s' with len %u", (char *)q->fname, len);
     }
 
+    queue_file_wait(afl, q);
     int fd = open((char *)q->fname, O_RDONLY);
 
     if (unlikely(fd < 0)) { PFATAL("Unable to open '%s'", (char *)q->fname); }
@@ -1063,151 +2006,79 @@ inline u8 *queue_testcase_get(afl_state_t *afl, struct queue_entry *q) {
 
   /* now handle the testcase cache */
 
-  if (unlikely(!q->testcase_buf)) {
-    /* Buf not cached, let's load it */
-    u32        tid = afl->q_testcase_max_cache_count;
-    static u32 do_once = 0;  // because even threaded we would want this. WIP
-
-    while (unlikely(
-        afl->q_testcase_cache_size + len >= afl->q_testcase_max_cache_size ||
-        afl->q_testcase_cache_count >= afl->q_testcase_max_cache_entries - 1)) {
-      /* We want a max number of entries to the cache that we learn.
-         Very simple: once the cache is filled by size - that is the max. */
-
-      if (unlikely(afl->q_testcase_cache_size + len >=
-                       afl->q_testcase_max_cache_size &&
-                   (afl->q_testcase_cache_count <
-                        afl->q_testcase_max_cache_entries &&
-                    afl->q_testcase_max_cache_count <
-                        afl->q_testcase_max_cache_entries) &&
-                   !do_once)) {
-        if (afl->q_testcase_max_cache_count > afl->q_testcase_cache_count) {
-          afl->q_testcase_max_cache_entries =
-              afl->q_testcase_max_cache_count + 1;
-
-        } else {
-          afl->q_testcase_max_cache_entries = afl->q_testcase_cache_count + 1;
-        }
-
-        do_once = 1;
-        // release unneeded memory
-        afl->q_testcase_cache = (struct queue_entry **)ck_realloc(
-            afl->q_testcase_cache,
-            (afl->q_testcase_max_cache_entries + 1) * sizeof(size_t));
-      }
-
-      /* Cache full. We neet to evict one or more to map one.
-         Get a random one which is not in use */
-
-      do {
-        // if the cache (MB) is not enough for the queue then this gets
-        // undesirable because q_testcase_max_cache_count grows sometimes
-        // although the number of items in the cache will not change hence
-        // more and more loops
-        tid = rand_below(afl, afl->q_testcase_max_cache_count);
+  if (likely(q->testcase_buf)) {
+    q->testcase_ref = 1;
+    if (unlikely(afl->metrics)) { METRICS_ADD(&afl->metrics->cache_hits, 1); }
+    return q->testcase_buf;
+  }
 
-      } while (afl->q_testcase_cache[tid] == NULL ||
+  /* Buf not cached, let's load it */
 
-               afl->q_testcase_cache[tid] == afl->queue_cur);
+  if (unlikely(afl->metrics)) { METRICS_ADD(&afl->metrics->cache_misses, 1); }
 
-      struct queue_entry *old_cached = afl->q_testcase_cache[tid];
-      free(old_cached->testcase_buf);
-      old_cached->testcase_buf = NULL;
-      afl->q_testcase_cache_size -= old_cached->len;
-      afl->q_testcase_cache[tid] = NULL;
-      --afl->q_testcase_cache_count;
-      ++afl->q_testcase_evictions;
-      if (tid < afl->q_testcase_smallest_free)
-        afl->q_testcase_smallest_free = tid;
-    }
+  if (unlikely(afl->q_testcase_cache_count >=
+               afl->q_testcase_max_cache_entries)) {
+    testcase_evict(afl, q);
+  }
 
-    if (unlikely(tid >= afl->q_testcase_max_cache_entries)) {
-      // uh we were full, so now we have to search from start
-      tid = afl->q_testcase_smallest_free;
-    }
+  u8 *buf = testcase_chunk_get(afl, testcase_class(len), q, 1);
 
-    // we need this while loop in case there were ever previous evictions but
-    // not in this call.
-    while (unlikely(afl->q_testcase_cache[tid] != NULL))
-      ++tid;
+  /* Map the test case into memory. */
 
-    /* Map the test case into memory. */
+  queue_file_wait(afl, q);
+  int fd = open((char *)q->fname, O_RDONLY);
 
-    int fd = open((char *)q->fname, O_RDONLY);
+  if (unlikely(fd < 0)) { PFATAL("Unable to open '%s'", (char *)q->fname); }
 
-    if (unlikely(fd < 0)) { PFATAL("Unable to open '%s'", (char *)q->fname); }
+  ck_read(fd, buf, len, q->fname);
+  close(fd);
 
-    q->testcase_buf = (u8 *)malloc(len);
+  /* Register testcase as cached */
+  testcase_cache_add(afl, q, buf);
 
-    if (unlikely(!q->testcase_buf)) {
-      PFATAL("Unable to malloc '%s' with len %u", (char *)q->fname, len);
-    }
+  return buf;
+}
 
-    ck_read(fd, q->testcase_buf, len, q->fname);
-    close(fd);
+/* The main loop draws the entry after the current one ahead of time and
+   calls this on it, so that a cold or network backed disk reads the file
+   while the current one is fuzzed instead of stalling queue_testcase_get().
+   Files still in the writer were written just now and are skipped. */
 
-    /* Register testcase as cached */
-    afl->q_testcase_cache[tid] = q;
-    afl->q_testcase_cache_size += len;
-    ++afl->q_testcase_cache_count;
-    if (likely(tid >= afl->q_testcase_max_cache_count)) {
-      afl->q_testcase_max_cache_count = tid + 1;
+void queue_testcase_prefetch(afl_state_t *afl, struct queue_entry *q) {
+  (void)afl;
 
-    } else if (unlikely(tid == afl->q_testcase_smallest_free)) {
-      afl->q_testcase_smallest_free = tid + 1;
-    }
+#ifdef POSIX_FADV_WILLNEED
+  if (q->testcase_buf || q->large_map || q->pack_data || q->write_seq) {
+    return;
   }
 
-  return q->testcase_buf;
+  int fd = open((char *)q->fname, O_RDONLY);
+  if (unlikely(fd < 0)) { return; }
+
+  posix_fadvise(fd, 0, q->len, POSIX_FADV_WILLNEED);
+  close(fd);
+#else
+  (void)q;
+#endif
 }
 
 /* Adds the new queue entry to the cache. */
 
 inline void queue_testcase_store_mem(afl_state_t *afl, struct queue_entry *q,
                                      u8 *mem) {
-  u32 len = q->len;
-
-  if (unlikely(afl->q_testcase_cache_size + len >=
-                   afl->q_testcase_max_cache_size ||
-               afl->q_testcase_cache_count >=
-                   afl->q_testcase_max_cache_entries - 1)) {
+  if (unlikely(afl->q_testcase_cache_count >=
+                   afl->q_testcase_max_cache_entries ||
+               q->len > MAX_FILE)) {
     // no space? will be loaded regularly later.
     return;
   }
 
-  u32 tid;
-
-  if (unlikely(afl->q_testcase_max_cache_count >=
-               afl->q_testcase_max_cache_entries)) {
-    // uh we were full, so now we have to search from start
-    tid = afl->q_testcase_smallest_free;
-
-  } else {
-    tid = afl->q_testcase_max_cache_count;
-  }
+  u8 *buf = testcase_chunk_get(afl, testcase_class(q->len), q, 0);
 
-  while (unlikely(afl->q_testcase_cache[tid] != NULL))
-    ++tid;
+  if (unlikely(!buf)) { return; }
 
-  /* Map the test case into memory. */
-
-  q->testcase_buf = (u8 *)malloc(len);
-
-  if (unlikely(!q->testcase_buf)) {
-    PFATAL("Unable to malloc '%s' with len %u", (char *)q->fname, len);
-  }
-
-  memcpy(q->testcase_buf, mem, len);
+  memcpy(buf, mem, q->len);
 
   /* Register testcase as cached */
-  afl->q_testcase_cache[tid] = q;
-  afl->q_testcase_cache_size += len;
-  ++afl->q_testcase_cache_count;
-
-  if (likely(tid >= afl->q_testcase_max_cache_count)) {
-    afl->q_testcase_max_cache_count = tid + 1;
-
-  } else if (unlikely(tid == afl->q_testcase_smallest_free)) {
-    afl->q_testcase_smallest_free = tid + 1;
-  }
+  testcase_cache_add(afl, q, buf);
 }
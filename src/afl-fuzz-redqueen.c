@@ -27,6 +27,7 @@
 #include <limits.h>
 #include "afl-fuzz.h"
 #include "cmplog.h"
+#include "fsbatch.h"
 
 // #define _DEBUG
 // #define CMPLOG_INTROSPECTION
@@ -73,6 +74,47 @@ enum {
 
 #define DICT_ADD_STRATEGY DICT_ADD_FOUND_SAME
 
+/* the log row of key in a cmp_map of the negotiated geometry */
+static inline struct cmp_operands *cmp_row(afl_state_t *afl,
+                                           struct cmp_map *map, u32 key) {
+  return cmp_map_row(map, afl->cmplog_map_w, afl->cmplog_map_h, key);
+}
+
+/* Operand pairs that input-to-state went through, for any queue entry, are
+   skipped for CMPLOG_SOLVED_CYCLES queue cycles. cmplog_solved[] is a direct
+   mapped cache of fingerprints of the level, the key, its shape and the
+   operands of the original input, whether they led to a find or not. */
+
+static inline u64 cmplog_pair_fp(afl_state_t *afl, struct cmp_map *map,
+                                 u32 key, u32 i, u32 lvl) {
+  struct cmp_header *h = &map->headers[key];
+  u8                *o = (u8 *)cmp_row(afl, map, key);
+  u32                size = h->type == CMP_TYPE_INS
+                                ? sizeof(struct cmp_operands)
+                            : h->type == CMP_TYPE_SWITCH
+                                ? sizeof(u64)
+                                : sizeof(struct cmpfn_operands);
+
+  return hash64(o + i * size, size,
+                ((u64)lvl << 40) | ((u64)key << 8) | h->shape) |
+         1;
+}
+
+static inline u8 cmplog_is_solved(afl_state_t *afl, u64 fp) {
+  struct cmplog_solved *s =
+      &afl->cmplog_solved[fp & (CMPLOG_SOLVED_SIZE - 1)];
+
+  return s->fp == fp && s->cycle + CMPLOG_SOLVED_CYCLES > afl->queue_cycle;
+}
+
+static inline void cmplog_set_solved(afl_state_t *afl, u64 fp) {
+  struct cmplog_solved *s =
+      &afl->cmplog_solved[fp & (CMPLOG_SOLVED_SIZE - 1)];
+
+  s->fp = fp;
+  s->cycle = afl->queue_cycle;
+}
+
 struct range {
   u32           start;
   u32           end;
@@ -81,7 +123,41 @@ struct range {
   u8            ok;
 };
 
-static u32 hshape;
+/* The tainted offsets of the colorized input bucketed by their byte value,
+   each bucket in ascending order, with the end of the taint region of each
+   offset. Without LVL3 an operand can only be patched in where the input
+   byte equals the first byte of one of its encodings. */
+struct its_index {
+  u32  start[257];
+  u32 *pos;
+  u32 *end;
+};
+
+/* Walks the offsets for up to 8 byte values in ascending order. */
+struct its_iter {
+  struct its_index *ix;
+  u32               cur[8];
+  u32               stop[8];
+  u32               cnt;
+};
+
+/* The ascii number at an offset of the colorized input as strntoll() and
+   strntoull() read it, with the length of its text. LVL3 transform solving
+   tries it for every operand at every offset, but it only depends on the
+   input, so it is parsed once per offset and stage. */
+struct its_num {
+  long long          num;
+  unsigned long long unum;
+  u32                end;
+  u8                 state;
+};
+
+#define ITS_NUM_DONE 1
+#define ITS_NUM_S 2
+#define ITS_NUM_U 4
+
+static u32             hshape;
+static struct its_num *its_nums;
 static u64 screen_update;
 static u64 last_update;
 
@@ -148,7 +224,148 @@ static void dump_file(char *path, char *name, u32 counter, u8 *buf, u32 len) {
 static u8 get_exec_checksum(afl_state_t *afl, u8 *buf, u32 len, u64 *cksum) {
   if (unlikely(common_fuzz_stuff(afl, buf, len))) { return 1; }
 
-  *cksum = hash64(afl->fsrv.trace_bits, afl->fsrv.map_size, HASH_CONST);
+  *cksum = hash_trace_bits(&afl->fsrv);
+
+  return 0;
+}
+
+/* Checksum of the coverage of testcase idx of the last batch, taken from its
+   map deltas. Only comparable with other batch checksums. */
+
+static u64 get_batch_checksum(afl_state_t *afl, u32 idx) {
+  struct fs_batch *b = afl->fsrv.batch;
+  u32              start = idx ? b->delta_end[idx - 1] : 0;
+
+  return hash64((u8 *)(b->delta + start),
+                (b->delta_end[idx] - start) * sizeof(struct fs_batch_delta),
+                HASH_CONST);
+}
+
+/* Keep the colorized range rng if the path stayed the same, otherwise
+   restore it and split it into halves to be tried again. Returns the new
+   head of the range list. */
+
+static struct range *colorize_range(struct range *ranges, struct range *rng,
+                                    u8 *buf, u8 *backup, u8 *changed,
+                                    u8 same) {
+  u32 s = 1 + rng->end - rng->start;
+
+  if (same) {
+    memcpy(buf + rng->start, changed + rng->start, s);
+    rng->ok = 1;
+    return ranges;
+  }
+
+  memcpy(buf + rng->start, backup + rng->start, s);
+
+  if (s > 1) {  // to not add 0 size ranges
+
+    ranges = add_range(ranges, rng->start, rng->start - 1 + s / 2);
+    ranges = add_range(ranges, rng->start + s / 2, rng->end);
+  }
+
+  if (ranges == rng) {
+    ranges = rng->next;
+    if (ranges) { ranges->prev = NULL; }
+
+  } else if (rng->next) {
+    rng->prev->next = rng->next;
+    rng->next->prev = rng->prev;
+
+  } else {
+    if (rng->prev) { rng->prev->next = NULL; }
+  }
+
+  ck_free(rng);
+
+  return ranges;
+}
+
+/* One colorization round with testcase batches (FS_OPT_BATCH): the biggest
+   untested ranges are each colorized on their own on top of buf and run
+   back to back, then the results are applied. If processing a result ran
+   the target again (calibration of a new path, a timeout retry), the maps
+   of the rest of the batch are gone and their ranges are tried again in the
+   next round. */
+
+static u8 colorize_batch(afl_state_t *afl, struct range **ranges, u8 *buf,
+                         u32 len, u8 *backup, u8 *changed, u64 exec_cksum) {
+  struct fs_batch *b = afl->fsrv.batch;
+  struct range    *cand[FS_BATCH_MAX], *rng;
+  u8               same[FS_BATCH_MAX];
+  u32              cnt = 0, done, i, s;
+  u64              start_us, run_us, execs;
+  u8               res, fault, phase;
+
+  while (cnt < FS_BATCH_MAX && afl->stage_cur + cnt < afl->stage_max &&
+         (rng = pop_biggest_range(ranges)) != NULL) {
+    s = 1 + rng->end - rng->start;
+
+    memcpy(buf + rng->start, changed + rng->start, s);
+    u32 added = afl_fsrv_batch_add(&afl->fsrv, buf, len);
+    memcpy(buf + rng->start, backup + rng->start, s);
+
+    if (!added) { break; }
+
+    rng->ok = 3;  // queued, so pop_biggest_range() skips it
+    cand[cnt++] = rng;
+  }
+
+  start_us = get_cur_time_us();
+  phase = phase_enter(afl, PHASE_TARGET);
+  res = afl_fsrv_run_batch(&afl->fsrv, afl->fsrv.exec_tmout, &afl->stop_soon);
+  phase_enter(afl, phase);
+  run_us = get_cur_time_us() - start_us;
+
+  done = afl->fsrv.batch_done;
+  execs = afl->fsrv.total_execs;
+
+  for (i = 0; i < done; ++i) {
+    rng = cand[i];
+    s = 1 + rng->end - rng->start;
+    fault = i + 1 < done ? FSRV_RUN_OK : res;
+
+    /* the target times all but the last one */
+
+    u64 us = run_us;
+    if (i < b->done) {
+      us = b->us[i];
+      run_us = run_us > us ? run_us - us : 0;
+    }
+
+    /* same path and not much slower, as in colorization() */
+    same[i] = get_batch_checksum(afl, i) == exec_cksum &&
+              (likely(us <= 3 * afl->queue_cur->exec_us) ||
+               unlikely(afl->fixed_seed));
+
+    afl_fsrv_batch_trace(&afl->fsrv, i);
+
+    memcpy(buf + rng->start, changed + rng->start, s);
+    u8 bail = common_fuzz_result(afl, buf, len, fault);
+    memcpy(buf + rng->start, backup + rng->start, s);
+
+    ++afl->stage_cur;
+
+    if (unlikely(bail)) { return 1; }
+
+    if (unlikely(afl->fsrv.total_execs != execs)) {
+      ++i;
+      break;
+    }
+
+    if (unlikely(afl->stage_cur % screen_update == 0)) { show_stats(afl); };
+  }
+
+  done = i;
+
+  for (i = 0; i < cnt; ++i) {
+    if (i < done) {
+      *ranges = colorize_range(*ranges, cand[i], buf, backup, changed, same[i]);
+
+    } else {
+      cand[i]->ok = 0;
+    }
+  }
 
   return 0;
 }
@@ -253,6 +470,75 @@ static void type_replace(afl_state_t *afl, u8 *buf, u32 len) {
   }
 }
 
+/* Run buf for colorization and get its checksum, with testcase batches from
+   the map deltas. */
+
+static u8 colorize_cksum(afl_state_t *afl, u8 *buf, u32 len, u8 use_batch,
+                         u64 *cksum) {
+  if (use_batch) {
+    afl_fsrv_batch_add(&afl->fsrv, buf, len);
+    u8 phase = phase_enter(afl, PHASE_TARGET);
+    u8 fault =
+        afl_fsrv_run_batch(&afl->fsrv, afl->fsrv.exec_tmout, &afl->stop_soon);
+    phase_enter(afl, phase);
+    *cksum = get_batch_checksum(afl, 0);
+    return common_fuzz_result(afl, buf, len, fault);
+  }
+
+  return get_exec_checksum(afl, buf, len, cksum);
+}
+
+/* If the byte importance map knows every byte of the entry, colorize all
+   neutral bytes at once. If the path holds, they become the colorized
+   ranges and nothing else needs to be tried. Returns 1 if the target asks
+   to bail out. */
+
+static u8 colorize_known(afl_state_t *afl, struct range **ranges, u8 *buf,
+                         u32 len, u8 *backup, u8 *changed, u8 *byte_imp,
+                         u8 use_batch, u64 exec_cksum) {
+  u32 i, neutral = 0;
+  u64 cksum = 0;
+
+  if (!byte_imp_complete(afl->queue_cur)) { return 0; }
+
+  for (i = 0; i < len; ++i) {
+    if (byte_imp[i] & BYTE_IMP_NEUTRAL) {
+      buf[i] = changed[i];
+      ++neutral;
+    }
+  }
+
+  if (!neutral) { return 0; }
+
+  ++afl->stage_cur;
+  if (unlikely(colorize_cksum(afl, buf, len, use_batch, &cksum))) { return 1; }
+
+  if (cksum != exec_cksum) {
+    memcpy(buf, backup, len);
+    return 0;
+  }
+
+  while (*ranges) {
+    struct range *r = *ranges;
+    *ranges = r->next;
+    ck_free(r);
+  }
+
+  for (i = 0; i < len; ++i) {
+    if (byte_imp[i] & BYTE_IMP_NEUTRAL) {
+      u32 start = i;
+      while (i + 1 < len && (byte_imp[i + 1] & BYTE_IMP_NEUTRAL)) {
+        ++i;
+      }
+
+      *ranges = add_range(*ranges, start, i);
+      (*ranges)->ok = 1;
+    }
+  }
+
+  return 0;
+}
+
 static u8 colorization(afl_state_t *afl, u8 *buf, u32 len,
                        struct tainted **taints) {
   struct range   *ranges = add_range(NULL, 0, len - 1), *rng;
@@ -272,9 +558,19 @@ static u8 colorization(afl_state_t *afl, u8 *buf, u32 len,
   afl->stage_max = (len << 1);
   afl->stage_cur = 0;
 
+  /* big inputs would keep colorization busy for minutes, cap it by the time
+     the target runs for it */
+  if (likely(!afl->fixed_seed)) {
+    u64 cap = CMPLOG_COLORIZE_US / MAX(afl->queue_cur->exec_us, 1U);
+    afl->stage_max = MIN(afl->stage_max, MAX(cap, CMPLOG_COLORIZE_MIN));
+  }
+
+  /* testcase batches compare checksums of the map deltas */
+  u8 use_batch = afl->fsrv.use_batch && !afl->custom_mutators_count;
+
   // in colorization we do not classify counts, hence we have to calculate
   // the original checksum.
-  if (unlikely(get_exec_checksum(afl, buf, len, &exec_cksum))) {
+  if (unlikely(colorize_cksum(afl, buf, len, use_batch, &exec_cksum))) {
     goto checksum_fail;
   }
 
@@ -287,7 +583,23 @@ static u8 colorization(afl_state_t *afl, u8 *buf, u32 len,
     type_replace(afl, changed, len);
   }
 
-  while ((rng = pop_biggest_range(&ranges)) != NULL &&
+  u8 *byte_imp = byte_imp_get(afl, afl->queue_cur, backup);
+
+  if (unlikely(colorize_known(afl, &ranges, buf, len, backup, changed,
+                              byte_imp, use_batch, exec_cksum))) {
+    goto checksum_fail;
+  }
+
+  while (use_batch && ranges && afl->stage_cur < afl->stage_max) {
+    if (unlikely(colorize_batch(afl, &ranges, buf, len, backup, changed,
+                                exec_cksum))) {
+      goto checksum_fail;
+    }
+
+    if (!pop_biggest_range(&ranges)) { break; }
+  }
+
+  while (!use_batch && (rng = pop_biggest_range(&ranges)) != NULL &&
          afl->stage_cur < afl->stage_max) {
     u32 s = 1 + rng->end - rng->start;
 
@@ -304,42 +616,34 @@ static u8 colorization(afl_state_t *afl, u8 *buf, u32 len,
     /* Discard if the mutations change the path or if it is too decremental
       in speed - how could the same path have a much different speed
       though ...*/
-    if (cksum != exec_cksum ||
-        (unlikely(stop_us - start_us > 3 * afl->queue_cur->exec_us) &&
-         likely(!afl->fixed_seed))) {
-      memcpy(buf + rng->start, backup + rng->start, s);
+    ranges = colorize_range(
+        ranges, rng, buf, backup, changed,
+        cksum == exec_cksum &&
+            (likely(stop_us - start_us <= 3 * afl->queue_cur->exec_us) ||
+             unlikely(afl->fixed_seed)));
 
-      if (s > 1) {  // to not add 0 size ranges
-
-        ranges = add_range(ranges, rng->start, rng->start - 1 + s / 2);
-        ranges = add_range(ranges, rng->start + s / 2, rng->end);
-      }
+    if (unlikely(++afl->stage_cur % screen_update == 0)) { show_stats(afl); };
+  }
 
-      if (ranges == rng) {
-        ranges = rng->next;
-        if (ranges) { ranges->prev = NULL; }
+  /* keep what was found for the skipdet inference and later runs, a cut
+     short colorization only knows the neutral ranges */
 
-      } else if (rng->next) {
-        rng->prev->next = rng->next;
-        rng->next->prev = rng->prev;
+  u8 complete = 1;
 
-      } else {
-        if (rng->prev) { rng->prev->next = NULL; }
-      }
+  for (rng = ranges; rng; rng = rng->next) {
+    if (!rng->ok) { complete = 0; }
+  }
 
-      free(rng);
+  if (complete) { memset(byte_imp, BYTE_IMP_SEEN, len); }
 
-    } else {
-      rng->ok = 1;
+  for (rng = ranges; rng; rng = rng->next) {
+    if (rng->ok) {
+      memset(byte_imp + rng->start, BYTE_IMP_SEEN | BYTE_IMP_NEUTRAL,
+             1 + rng->end - rng->start);
     }
-
-    if (unlikely(++afl->stage_cur % screen_update == 0)) { show_stats(afl); };
   }
 
-  rng = ranges;
-  while (rng) {
-    rng = rng->next;
-  }
+  byte_imp_save(afl, afl->queue_cur, backup);
 
   u32 i = 1;
   u32 positions = 0;
@@ -537,6 +841,28 @@ static int strntoull(const char *str, size_t sz, char **end, int base,
   return 0;
 }
 
+static struct its_num *its_num_at(u8 *buf, u32 idx, u32 len) {
+  struct its_num *n = &its_nums[idx];
+  u8             *endptr = &buf[idx];
+
+  if (likely(n->state)) { return n; }
+
+  n->state = ITS_NUM_DONE;
+
+  if (strntoll(&buf[idx], len - idx, (char **)&endptr, 0, &n->num)) {
+    if (!strntoull(&buf[idx], len - idx, (char **)&endptr, 0, &n->unum)) {
+      n->state |= ITS_NUM_U;
+    }
+
+  } else {
+    n->state |= ITS_NUM_S;
+  }
+
+  n->end = endptr - &buf[idx];
+
+  return n;
+}
+
 static u8 hex_table_up[16] = {'0', '1', '2', '3', '4', '5', '6', '7',
                               '8', '9', 'A', 'B', 'C', 'D', 'E', 'F'};
 static u8 hex_table_low[16] = {'0', '1', '2', '3', '4', '5', '6', '7',
@@ -717,27 +1043,15 @@ static u8 cmp_extend_encoding(afl_state_t *afl, struct cmp_header *h,
 
   //  reverse atoi()/strnu?toll() is expensive, so we only to it in lvl 3
   if (afl->cmplog_enable_transform && (lvl & LVL3)) {
-    u8                *endptr;
-    u8                 use_num = 0, use_unum = 0;
-    unsigned long long unum = 0;
-    long long          num = 0;
-
-    // if (afl->queue_cur->is_ascii) {
-
     // we first check if our input are ascii numbers that are transformed to
     // an integer and used for comparison:
 
-    endptr = buf_8;
-    if (strntoll(buf_8, len - idx, (char **)&endptr, 0, &num)) {
-      if (!strntoull(buf_8, len - idx, (char **)&endptr, 0, &unum)) {
-        use_unum = 1;
-      }
-
-    } else {
-      use_num = 1;
-    }
-
-    //}
+    struct its_num    *n = its_num_at(buf, idx, len);
+    u8                 use_num = (n->state & ITS_NUM_S) != 0;
+    u8                 use_unum = (n->state & ITS_NUM_U) != 0;
+    unsigned long long unum = use_unum ? n->unum : 0;
+    long long          num = use_num ? n->num : 0;
+    u8                *endptr = buf_8 + n->end;
 
 #ifdef _DEBUG
     if (idx == 0)
@@ -1541,13 +1855,97 @@ static void try_to_add_to_dictN(afl_state_t *afl, u128 v, u8 size) {
 
 #define SWAPA(_x) ((_x & 0xf8) + ((_x & 7) ^ 0x07))
 
+static void its_index_build(afl_state_t *afl, struct its_index *ix, u8 *buf,
+                            struct tainted *taint) {
+  struct tainted *t = taint;
+  u32             fill[256], total = 0, i, b;
+
+  memset(ix->start, 0, sizeof(ix->start));
+
+  while (t->next) {
+    t = t->next;
+  }
+
+  for (; t; t = t->prev) {
+    for (i = t->pos; i < t->pos + t->len; ++i) {
+      ++ix->start[buf[i] + 1];
+    }
+
+    total += t->len;
+  }
+
+  for (b = 0; b < 256; ++b) {
+    ix->start[b + 1] += ix->start[b];
+    fill[b] = ix->start[b];
+  }
+
+  ix->pos = afl_realloc((void **)&afl->its_index_buf,
+                        (total << 1) * sizeof(u32) + 1);
+  if (unlikely(!ix->pos)) { PFATAL("alloc"); }
+  ix->end = ix->pos + total;
+
+  /* the tail of the taint list has the lowest offset */
+
+  for (t = taint; t->next; t = t->next) {}
+
+  for (; t; t = t->prev) {
+    for (i = t->pos; i < t->pos + t->len; ++i) {
+      b = fill[buf[i]]++;
+      ix->pos[b] = i;
+      ix->end[b] = t->pos + t->len;
+    }
+  }
+}
+
+static void its_iter_init(struct its_iter *it, struct its_index *ix,
+                          u8 *bytes, u32 cnt) {
+  u32 i, j;
+
+  it->ix = ix;
+  it->cnt = 0;
+
+  for (i = 0; i < cnt; ++i) {
+    for (j = 0; j < i && bytes[j] != bytes[i]; ++j) {}
+
+    if (j < i || ix->start[bytes[i]] == ix->start[bytes[i] + 1]) { continue; }
+
+    it->cur[it->cnt] = ix->start[bytes[i]];
+    it->stop[it->cnt] = ix->start[bytes[i] + 1];
+    ++it->cnt;
+  }
+}
+
+/* Next candidate offset and the taint length there, 0 when done. */
+
+static inline u32 its_iter_next(struct its_iter *it, u32 *idx,
+                                u32 *taint_len) {
+  u32 i, best = 0, best_pos = UINT_MAX;
+
+  for (i = 0; i < it->cnt; ++i) {
+    if (it->cur[i] < it->stop[i] && it->ix->pos[it->cur[i]] < best_pos) {
+      best_pos = it->ix->pos[it->cur[i]];
+      best = i;
+    }
+  }
+
+  if (best_pos == UINT_MAX) { return 0; }
+
+  *idx = best_pos;
+  *taint_len = it->ix->end[it->cur[best]] - best_pos;
+  ++it->cur[best];
+
+  return 1;
+}
+
 static u8 cmp_fuzz(afl_state_t *afl, u32 key, u8 *orig_buf, u8 *buf, u8 *cbuf,
-                   u32 len, u32 lvl, struct tainted *taint) {
+                   u32 len, u32 lvl, struct tainted *taint,
+                   struct its_index *ix) {
   struct cmp_header *h = &afl->shm.cmp_map->headers[key];
   struct tainted    *t;
   u32                i, j, idx, taint_len, loggeds;
   u32                have_taint = 1;
   u8                 status = 0, found_one = 0;
+  u64                fp;
 
   /* loop cmps are useless, detect and ignore them */
 #ifdef WORD_SIZE_64
@@ -1561,8 +1959,11 @@ static u8 cmp_fuzz(afl_state_t *afl, u32 key, u8 *orig_buf, u8 *buf, u8 *cbuf,
 
   hshape = SHAPE_BYTES(h->shape);
 
-  if (h->hits > CMP_MAP_H) {
-    loggeds = CMP_MAP_H;
+  struct cmp_operands *row = cmp_row(afl, afl->shm.cmp_map, key);
+  struct cmp_operands *orig_row = cmp_row(afl, afl->orig_cmp_map, key);
+
+  if (h->hits > afl->cmplog_map_h) {
+    loggeds = afl->cmplog_map_h;
 
   } else {
     loggeds = h->hits;
@@ -1584,7 +1985,7 @@ static u8 cmp_fuzz(afl_state_t *afl, u32 key, u8 *orig_buf, u8 *buf, u8 *cbuf,
   if (hshape < 2) { return 0; }
 
   for (i = 0; i < loggeds; ++i) {
-    struct cmp_operands *o = &afl->shm.cmp_map->log[key][i];
+    struct cmp_operands *o = &row[i];
 
     // loop detection code
     if (i == 0) {
@@ -1602,16 +2003,18 @@ static u8 cmp_fuzz(afl_state_t *afl, u32 key, u8 *orig_buf, u8 *buf, u8 *cbuf,
       s_v1 = o->v1;
     }
 
-    struct cmp_operands *orig_o = &afl->orig_cmp_map->log[key][i];
+    struct cmp_operands *orig_o = &orig_row[i];
 
     // opt not in the paper
     for (j = 0; j < i; ++j) {
-      if (afl->shm.cmp_map->log[key][j].v0 == o->v0 &&
-          afl->shm.cmp_map->log[key][j].v1 == o->v1) {
+      if (row[j].v0 == o->v0 && row[j].v1 == o->v1) {
         goto cmp_fuzz_next_iter;
       }
     }
 
+    fp = cmplog_pair_fp(afl, afl->orig_cmp_map, key, i, lvl);
+    if (cmplog_is_solved(afl, fp)) { goto cmp_fuzz_next_iter; }
+
 #ifdef _DEBUG
     fprintf(stderr, "Handling: %llx->%llx vs %llx->%llx attr=%u shape=%u\n",
             orig_o->v0, o->v0, orig_o->v1, o->v1, h->attribute, hshape);
@@ -1632,8 +2035,32 @@ static u8 cmp_fuzz(afl_state_t *afl, u32 key, u8 *orig_buf, u8 *buf, u8 *cbuf,
 
 #endif
 
+    /* the encodings cmp_extend_encoding() tries start with byte 0, 1, 3 or
+       7 of an operand, depending on the shape */
+    struct its_iter it;
+    u8 use_ix = ix && !is_n;
+
+    if (use_ix) {
+      u8  first[8];
+      u32 cnt = 0;
+
+      for (j = 0; j < 2; ++j) {
+        u64 v = j ? o->v1 : o->v0;
+
+        first[cnt++] = v;
+        if (hshape >= 2) { first[cnt++] = v >> 8; }
+        if (hshape >= 4) { first[cnt++] = v >> 24; }
+        if (hshape >= 8) { first[cnt++] = v >> 56; }
+      }
+
+      its_iter_init(&it, ix, first, cnt);
+    }
+
     for (idx = 0; idx < len; ++idx) {
-      if (have_taint) {
+      if (use_ix) {
+        if (!its_iter_next(&it, &idx, &taint_len)) { break; }
+
+      } else if (have_taint) {
         if (!t || idx < t->pos) {
           continue;
 
@@ -1762,6 +2189,8 @@ static u8 cmp_fuzz(afl_state_t *afl, u32 key, u8 *orig_buf, u8 *buf, u8 *cbuf,
       }
     }
 
+    cmplog_set_solved(afl, fp);
+
   cmp_fuzz_next_iter:
     afl->stage_cur++;
   }
@@ -1780,6 +2209,133 @@ static u8 cmp_fuzz(afl_state_t *afl, u32 key, u8 *orig_buf, u8 *buf, u8 *cbuf,
   return 0;
 }
 
+/* Case i of the table of a CMP_TYPE_SWITCH key. */
+
+static inline u64 switch_case(u8 *cases, u32 i, u32 size) {
+  u16 v16;
+  u32 v32;
+  u64 v64;
+
+  switch (size) {
+    case 2:
+      memcpy(&v16, cases + i * 2, 2);
+      return v16;
+    case 4:
+      memcpy(&v32, cases + i * 4, 4);
+      return v32;
+    default:
+      memcpy(&v64, cases + i * 8, 8);
+      return v64;
+  }
+}
+
+/* A switch, logged as CMP_TYPE_SWITCH: every case is an equality compare
+   with the switch value, so each case is tried like the constant operand
+   of cmp_fuzz(), for each value that the colorization changed. */
+
+static u8 switch_fuzz(afl_state_t *afl, u32 key, u8 *orig_buf, u8 *buf,
+                      u8 *cbuf, u32 len, u32 lvl, struct tainted *taint,
+                      struct its_index *ix) {
+  struct cmp_header *h = &afl->shm.cmp_map->headers[key];
+  u32                w = afl->cmplog_map_w, rows = afl->cmplog_map_h;
+  u64               *val = cmp_map_slots(afl->shm.cmp_map, w, rows, key);
+  u64               *orig_val = cmp_map_slots(afl->orig_cmp_map, w, rows, key);
+  u8                *cases = (u8 *)(val + rows);
+  struct tainted    *t, *tail = taint;
+  struct its_iter    it;
+  u32                i, j, c, idx, taint_len, loggeds, cnt;
+  u8                 status, found_one = 0, first[4], n = 0;
+  u64                fp, v;
+
+  hshape = SHAPE_BYTES(h->shape);
+  if (hshape != 2 && hshape != 4 && hshape != 8) { return 0; }
+
+  loggeds = MIN((u32)h->hits, afl->cmplog_map_h);
+  cnt = MIN((u32)h->id, CMP_SWITCH_CASES(afl->cmplog_map_h, hshape));
+
+  while (tail->next) {
+    tail = tail->next;
+  }
+
+  for (i = 0; i < loggeds; ++i) {
+    for (j = 0; j < i && val[j] != val[i]; ++j) {}
+    if (j < i) { goto switch_fuzz_next_iter; }
+
+    fp = cmplog_pair_fp(afl, afl->orig_cmp_map, key, i, lvl);
+    if (cmplog_is_solved(afl, fp)) { goto switch_fuzz_next_iter; }
+
+    if (val[i] == orig_val[i] && !(lvl & LVL3)) {
+      cmplog_set_solved(afl, fp);
+      goto switch_fuzz_next_iter;
+    }
+
+    /* the first bytes of the encodings cmp_extend_encoding() looks for */
+    if (ix) {
+      n = 0;
+      first[n++] = val[i];
+      first[n++] = val[i] >> 8;
+      if (hshape >= 4) { first[n++] = val[i] >> 24; }
+      if (hshape >= 8) { first[n++] = val[i] >> 56; }
+    }
+
+    for (c = 0; c < cnt; ++c) {
+      v = switch_case(cases, c, hshape);
+      if (v == orig_val[i]) { continue; }
+
+      if (ix) { its_iter_init(&it, ix, first, n); }
+      t = tail;
+
+      for (idx = 0; idx < len; ++idx) {
+        if (ix) {
+          if (!its_iter_next(&it, &idx, &taint_len)) { break; }
+
+        } else {
+          if (!t || idx < t->pos) { continue; }
+
+          taint_len = t->pos + t->len - idx;
+          if (idx == t->pos + t->len - 1) { t = t->prev; }
+        }
+
+        status = 0;
+        if (unlikely(cmp_extend_encoding(afl, h, val[i], v, orig_val[i], v,
+                                         h->attribute, idx, taint_len,
+                                         orig_buf, buf, cbuf, len, 1, lvl,
+                                         &status))) {
+          return 1;
+        }
+
+        if (status == 1) {
+          found_one = 1;
+          break;
+        }
+      }
+    }
+
+    cmplog_set_solved(afl, fp);
+
+  switch_fuzz_next_iter:
+    afl->stage_cur++;
+  }
+
+  // the cases are constants, learn them as cmp_fuzz() does
+  if (!found_one || afl->queue_cur->is_ascii) {
+    for (c = 0; c < cnt; ++c) {
+      v = switch_case(cases, c, hshape);
+      if (!found_one || check_if_text_buf((u8 *)&v, hshape) == hshape) {
+        try_to_add_to_dict(afl, v, hshape);
+      }
+    }
+  }
+
+  if (!found_one && afl->pass_stats[key].faileds < 0xff) {
+    afl->pass_stats[key].faileds++;
+  }
+
+  if (afl->pass_stats[key].total < 0xff) { afl->pass_stats[key].total++; }
+
+  return 0;
+}
+
 static u8 rtn_extend_encoding(afl_state_t *afl, u8 entry,
                               struct cmpfn_operands *o,
                               struct cmpfn_operands *orig_o, u32 idx,
@@ -2196,29 +2752,33 @@ static u8 rtn_extend_encoding(afl_state_t *afl, u8 entry,
 }
 
 static u8 rtn_fuzz(afl_state_t *afl, u32 key, u8 *orig_buf, u8 *buf, u8 *cbuf,
-                   u32 len, u8 lvl, struct tainted *taint) {
+                   u32 len, u8 lvl, struct tainted *taint,
+                   struct its_index *ix) {
   struct tainted    *t;
   struct cmp_header *h = &afl->shm.cmp_map->headers[key];
   u32                i, idx, have_taint = 1, taint_len, loggeds;
   u8                 status = 0, found_one = 0;
+  u64                fp;
 
   hshape = SHAPE_BYTES(h->shape);
 
   if (hshape < 2) { return 0; }
 
-  if (h->hits > CMP_MAP_RTN_H) {
-    loggeds = CMP_MAP_RTN_H;
+  if (h->hits > afl->cmplog_map_h / 2) {
+    loggeds = afl->cmplog_map_h / 2;
 
   } else {
     loggeds = h->hits;
   }
 
-  for (i = 0; i < loggeds; ++i) {
-    struct cmpfn_operands *o =
-        &((struct cmpfn_operands *)afl->shm.cmp_map->log[key])[i];
+  struct cmpfn_operands *row =
+      (struct cmpfn_operands *)cmp_row(afl, afl->shm.cmp_map, key);
+  struct cmpfn_operands *orig_row =
+      (struct cmpfn_operands *)cmp_row(afl, afl->orig_cmp_map, key);
 
-    struct cmpfn_operands *orig_o =
-        &((struct cmpfn_operands *)afl->orig_cmp_map->log[key])[i];
+  for (i = 0; i < loggeds; ++i) {
+    struct cmpfn_operands *o = &row[i];
+    struct cmpfn_operands *orig_o = &orig_row[i];
 
     /*
         // opt not in the paper
@@ -2235,6 +2795,9 @@ static u8 rtn_fuzz(afl_state_t *afl, u32 key, u8 *orig_buf, u8 *buf, u8 *cbuf,
 
     */
 
+    fp = cmplog_pair_fp(afl, afl->orig_cmp_map, key, i, lvl);
+    if (cmplog_is_solved(afl, fp)) { goto rtn_fuzz_next_iter; }
+
 #ifdef _DEBUG
     u32                j;
     struct cmp_header *hh = &afl->orig_cmp_map->headers[key];
@@ -2260,8 +2823,19 @@ static u8 rtn_fuzz(afl_state_t *afl, u32 key, u8 *orig_buf, u8 *buf, u8 *cbuf,
       t = t->next;
     }
 
+    /* without LVL3 only direct matches of the operands are tried */
+    struct its_iter it;
+
+    if (ix) {
+      u8 first[2] = {o->v0[0], o->v1[0]};
+      its_iter_init(&it, ix, first, 2);
+    }
+
     for (idx = 0; idx < len; ++idx) {
-      if (have_taint) {
+      if (ix) {
+        if (!its_iter_next(&it, &idx, &taint_len)) { break; }
+
+      } else if (have_taint) {
         if (!t || idx < t->pos) {
           continue;
 
@@ -2353,7 +2927,9 @@ static u8 rtn_fuzz(afl_state_t *afl, u32 key, u8 *orig_buf, u8 *buf, u8 *cbuf,
       //}
     }
 
-    // rtn_fuzz_next_iter:
+    cmplog_set_solved(afl, fp);
+
+  rtn_fuzz_next_iter:
     afl->stage_cur++;
   }
 
@@ -2369,10 +2945,351 @@ static u8 rtn_fuzz(afl_state_t *afl, u32 key, u8 *orig_buf, u8 *buf, u8 *cbuf,
 ///// Input to State stage
 
 // afl->queue_cur->exec_cksum
+/* Cmplog delta mode, see struct cmp_map: as long as the shared map and
+   orig_cmp_map are all zero outside of the keys in the touched list only
+   these are reset, copied and scanned. Until the runtime announces the mode,
+   or after the list overflowed, the whole maps are used. */
+
+static inline struct cmp_delta *cmplog_delta_area(afl_state_t *afl) {
+  return cmp_map_delta(afl->shm.cmp_map, afl->cmplog_map_w, afl->cmplog_map_h);
+}
+
+static inline u8 cmplog_delta_ok(afl_state_t *afl) {
+  return afl->cmplog_delta &&
+         cmplog_delta_area(afl)->touched_cnt <= afl->cmplog_map_w;
+}
+
+/* Clear the maps for the cmplog run of orig_buf. */
+
+static void cmplog_clear(afl_state_t *afl) {
+  struct cmp_map   *m = afl->shm.cmp_map, *o;
+  struct cmp_delta *d = cmplog_delta_area(afl);
+  u32               i, k, w = afl->cmplog_map_w, h = afl->cmplog_map_h;
+  size_t            row_size = h * sizeof(struct cmp_operands);
+
+  if (unlikely(!afl->orig_cmp_map)) {
+    afl->orig_cmp_map = ck_alloc_nozero(CMP_MAP_DELTA_OFF(w, h));
+  }
+
+  o = afl->orig_cmp_map;
+
+  if (likely(cmplog_delta_ok(afl))) {
+    for (i = 0; i < d->touched_cnt; ++i) {
+      k = d->touched[i] & (w - 1);
+      memset(&m->headers[k], 0, sizeof(struct cmp_header));
+      memset(cmp_row(afl, m, k), 0, row_size);
+
+      if (i < afl->cmplog_orig_cnt) {
+        memset(&o->headers[k], 0, sizeof(struct cmp_header));
+        memset(cmp_row(afl, o, k), 0, row_size);
+      }
+    }
+
+  } else {
+    memset(m, 0, CMP_MAP_DELTA_OFF(w, h));
+    afl->cmplog_delta = d->delta == CMPLOG_DELTA_MAGIC;
+
+    if (afl->cmplog_delta) { memset(o, 0, CMP_MAP_DELTA_OFF(w, h)); }
+  }
+
+  d->touched_cnt = 0;
+  afl->cmplog_orig_cnt = 0;
+}
+
+/* Keep the cmplog data of orig_buf and reset the headers for the run of the
+   colorized input. */
+
+static void cmplog_save_orig(afl_state_t *afl) {
+  struct cmp_map   *m = afl->shm.cmp_map, *o = afl->orig_cmp_map;
+  struct cmp_delta *d = cmplog_delta_area(afl);
+  u32               i, k, w = afl->cmplog_map_w, h = afl->cmplog_map_h;
+
+  if (likely(cmplog_delta_ok(afl))) {
+    for (i = 0; i < d->touched_cnt; ++i) {
+      k = d->touched[i] & (w - 1);
+      o->headers[k] = m->headers[k];
+      memcpy(cmp_row(afl, o, k), cmp_row(afl, m, k),
+             h * sizeof(struct cmp_operands));
+    }
+
+    for (i = 0; i < d->touched_cnt; ++i) {
+      k = d->touched[i] & (w - 1);
+      memset(&m->headers[k], 0, sizeof(struct cmp_header));
+    }
+
+    afl->cmplog_orig_cnt = d->touched_cnt;
+
+  } else {
+    memcpy(o, m, CMP_MAP_DELTA_OFF(w, h));
+    memset(m->headers, 0, sizeof(struct cmp_header) * w);
+    afl->cmplog_delta = 0;
+  }
+}
+
+static int cmplog_key_cmp(const void *a, const void *b) {
+  u32 x = *(const u32 *)a, y = *(const u32 *)b;
+  return x < y ? -1 : x > y;
+}
+
+/* The keys the run of the colorized input logged, in ascending order like a
+   scan of the whole map. keys is set to NULL if all keys have to be scanned.
+ */
+
+static u32 cmplog_keys(afl_state_t *afl, u32 **keys) {
+  struct cmp_delta *d = cmplog_delta_area(afl);
+  u32               i, n = 0, uniq = 0, w = afl->cmplog_map_w;
+
+  if (unlikely(!cmplog_delta_ok(afl))) {
+    *keys = NULL;
+    return w;
+  }
+
+  u32 *k = afl_realloc((void **)&afl->cmplog_keys, w * sizeof(u32));
+  if (unlikely(!k)) { PFATAL("alloc"); }
+
+  for (i = afl->cmplog_orig_cnt; i < d->touched_cnt; ++i) {
+    k[n++] = d->touched[i] & (w - 1);
+  }
+
+  qsort(k, n, sizeof(u32), cmplog_key_cmp);
+
+  for (i = 0; i < n; ++i) {
+    if (!uniq || k[uniq - 1] != k[i]) { k[uniq++] = k[i]; }
+  }
+
+  *keys = k;
+  return uniq;
+}
+
+/* Does the cmplog run of orig_buf have any operand pair that is not solved
+   yet? */
+
+static u8 cmplog_unsolved(afl_state_t *afl, u32 lvl) {
+  struct cmp_map   *m = afl->shm.cmp_map;
+  struct cmp_delta *d = cmplog_delta_area(afl);
+  u32 i, j, k, n, loggeds, delta = cmplog_delta_ok(afl);
+
+  n = delta ? d->touched_cnt : afl->cmplog_map_w;
+
+  for (j = 0; j < n; ++j) {
+    k = delta ? d->touched[j] & (afl->cmplog_map_w - 1) : j;
+
+    if (!m->headers[k].hits || afl->pass_stats[k].faileds >= CMPLOG_FAIL_MAX ||
+        afl->pass_stats[k].total >= CMPLOG_FAIL_MAX) {
+      continue;
+    }
+
+    /* see the rtn_fuzz() condition in input_to_state_stage() */
+    if (m->headers[k].type == CMP_TYPE_RTN && !(lvl & LVL1) &&
+        !((lvl & LVL3) && afl->cmplog_enable_transform)) {
+      continue;
+    }
+
+    loggeds = MIN((u32)m->headers[k].hits,
+                  m->headers[k].type == CMP_TYPE_RTN ? afl->cmplog_map_h >> 1
+                                                     : afl->cmplog_map_h);
+
+    for (i = 0; i < loggeds; ++i) {
+      if (!cmplog_is_solved(afl, cmplog_pair_fp(afl, m, k, i, lvl))) {
+        return 1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/* AFL_CHECKSUM_FIXUP: a valid checksum is not logged, so run a few copies
+   of orig_buf with one byte changed each through cmplog and look for the
+   checksums that failed. The fields found so far are already fixed in the
+   later copies, the others may show up there. Returns 1 if the entry is to
+   be abandoned. */
+
+static u8 cksum_stage(afl_state_t *afl, u8 *orig_buf, u32 len) {
+  u8 *buf;
+  u32 i, probes = MIN(len, (u32)CKSUM_PROBES);
+  u8  r = 0;
+
+  afl->queue_cur->cksum_done = 1;
+  if (!probes) { return 0; }
+
+  buf = ck_alloc_nozero(len);
+
+  afl->stage_name = "checksums";
+  afl->stage_short = "cksum";
+  afl->stage_cur = 0;
+  afl->stage_max = probes;
+
+  for (i = 0; i < probes; ++i) {
+    memcpy(buf, orig_buf, len);
+    buf[(u64)len * (2 * i + 1) / (2 * probes)] ^= 0xff;
+
+    cmplog_clear(afl);
+    if (unlikely(common_fuzz_cmplog_stuff(afl, buf, len))) {
+      r = 1;
+      break;
+    }
+
+    cksum_detect(afl, afl->shm.cmp_map, buf, len);
+    ++afl->stage_cur;
+  }
+
+  ck_free(buf);
+  return r;
+}
+
+/* The colorization of a queue entry, kept for its next input-to-state stage
+   in a cache of AFL_CMPLOG_CACHE_SIZE MB. The colorized input differs from
+   the entry only in the taint ranges, so only their bytes are kept, after
+   the ranges. The least recently used ones go first when the cache is
+   full, their entries are colorized again. */
+
+struct cmplog_color {
+  struct queue_entry  *q;
+  struct cmplog_color *prev, *next; /* most recently used first       */
+  u32                  len;         /* of the input                   */
+  u32                  cnt;         /* taint ranges                   */
+  u64                  size;        /* bytes taken                    */
+  u32                  data[];      /* cnt pos, len pairs, the bytes  */
+};
+
+static void taint_free(struct tainted *taint) {
+  struct tainted *t;
+
+  while (taint) {
+    t = taint->next;
+    ck_free(taint);
+    taint = t;
+  }
+}
+
+static void color_unlink(afl_state_t *afl, struct cmplog_color *c) {
+  if (c->prev) {
+    c->prev->next = c->next;
+
+  } else {
+    afl->cmplog_lru = c->next;
+  }
+
+  if (c->next) {
+    c->next->prev = c->prev;
+
+  } else {
+    afl->cmplog_lru_tail = c->prev;
+  }
+}
+
+static void color_link(afl_state_t *afl, struct cmplog_color *c) {
+  c->prev = NULL;
+  c->next = afl->cmplog_lru;
+
+  if (c->next) {
+    c->next->prev = c;
+
+  } else {
+    afl->cmplog_lru_tail = c;
+  }
+
+  afl->cmplog_lru = c;
+}
+
+static void color_drop(afl_state_t *afl, struct cmplog_color *c) {
+  color_unlink(afl, c);
+  c->q->cmplog_color = NULL;
+  afl->cmplog_cache_size -= c->size;
+  ck_free(c);
+}
+
+/* Keep the colorized input buf of the current entry and its taint. */
+
+static void color_store(afl_state_t *afl, u8 *buf, u32 len,
+                        struct tainted *taint) {
+  struct cmplog_color *c;
+  struct tainted      *t;
+  u32                  cnt = 0, i = 0;
+  u64                  size = sizeof(struct cmplog_color);
+  u8                  *bytes;
+
+  for (t = taint; t; t = t->next) {
+    size += 2 * sizeof(u32) + t->len;
+    ++cnt;
+  }
+
+  if (size > afl->cmplog_cache_max) { return; }
+
+  while (afl->cmplog_cache_size + size > afl->cmplog_cache_max) {
+    color_drop(afl, afl->cmplog_lru_tail);
+  }
+
+  c = ck_alloc_nozero(size);
+  c->q = afl->queue_cur;
+  c->len = len;
+  c->cnt = cnt;
+  c->size = size;
+  bytes = (u8 *)(c->data + 2 * cnt);
+
+  for (t = taint; t; t = t->next) {
+    c->data[i++] = t->pos;
+    c->data[i++] = t->len;
+    memcpy(bytes, buf + t->pos, t->len);
+    bytes += t->len;
+  }
+
+  afl->queue_cur->cmplog_color = c;
+  afl->cmplog_cache_size += size;
+  color_link(afl, c);
+}
+
+/* Patch the kept colorization of the current entry into buf, which holds
+   the entry, and return its taint, in the order colorization() gave it.
+   NULL if there is none. */
+
+static struct tainted *color_load(afl_state_t *afl, u8 *buf, u32 len) {
+  struct cmplog_color *c = afl->queue_cur->cmplog_color;
+  struct tainted      *taint = NULL, *last = NULL, *t;
+  u8                  *bytes;
+  u32                  i;
+
+  if (!c) { return NULL; }
+
+  if (c->len != len) {
+    color_drop(afl, c);
+    return NULL;
+  }
+
+  bytes = (u8 *)(c->data + 2 * c->cnt);
+
+  for (i = 0; i < c->cnt; ++i) {
+    t = ck_alloc_nozero(sizeof(struct tainted));
+    t->pos = c->data[2 * i];
+    t->len = c->data[2 * i + 1];
+    t->next = NULL;
+    t->prev = last;
+    memcpy(buf + t->pos, bytes, t->len);
+    bytes += t->len;
+
+    if (last) {
+      last->next = t;
+
+    } else {
+      taint = t;
+    }
+
+    last = t;
+  }
+
+  color_unlink(afl, c);
+  color_link(afl, c);
+
+  return taint;
+}
+
 u8 input_to_state_stage(afl_state_t *afl, u8 *orig_buf, u8 *buf, u32 len) {
-  u8 r = 1;
+  u8 r = 1, colorized = 0;
   if (unlikely(!afl->pass_stats)) {
     afl->pass_stats = ck_alloc(sizeof(struct afl_pass_stat) * CMP_MAP_W);
+    afl->cmplog_solved =
+        ck_alloc(sizeof(struct cmplog_solved) * CMPLOG_SOLVED_SIZE);
   }
 
   struct tainted *taint = NULL;
@@ -2388,7 +3305,47 @@ u8 input_to_state_stage(afl_state_t *afl, u8 *orig_buf, u8 *buf, u32 len) {
     screen_update = 100000;
   }
 
-  if (!afl->queue_cur->taint || !afl->queue_cur->cmplog_colorinput) {
+#if defined(_DEBUG) || defined(CMPLOG_INTROSPECTION)
+  u64 start_time = get_cur_time();
+  u32 cmp_locations = 0;
+#endif
+
+  u32 lvl = (afl->queue_cur->colorized ? 0 : LVL1) +
+            (afl->cmplog_lvl == CMPLOG_LVL_MAX ? LVL3 : 0);
+
+  // Generate the cmplog data of the input first, if input-to-state went
+  // through all of it already for other entries there is no need to
+  // colorize
+
+  // the checksum fields found in a window of a large input would not fit
+  // the next one
+
+  if (unlikely(afl->afl_env.afl_checksum_fixup) && !afl->large.file &&
+      !afl->queue_cur->cksum_done && cksum_stage(afl, orig_buf, len)) {
+    return 1;
+  }
+
+  // manually clear the cmp_map
+  cmplog_clear(afl);
+  if (unlikely(common_fuzz_cmplog_stuff(afl, orig_buf, len))) {
+    afl->queue_cur->colorized = CMPLOG_LVL_MAX;
+    if (afl->queue_cur->cmplog_color) {
+      color_drop(afl, afl->queue_cur->cmplog_color);
+    }
+
+    return 1;
+  }
+
+  if (!cmplog_unsolved(afl, lvl)) {
+#ifdef _DEBUG
+    fprintf(stderr, "ALL SOLVED\n");
+#endif
+    return 0;
+  }
+
+  cmplog_save_orig(afl);
+
+  if (!(taint = color_load(afl, buf, len))) {
     if (unlikely(colorization(afl, buf, len, &taint))) { return 1; }
 
     // no taint? still try, create a dummy to prevent again colorization
@@ -2408,9 +3365,7 @@ u8 input_to_state_stage(afl_state_t *afl, u8 *orig_buf, u8 *buf, u32 len) {
 
 #endif
 
-  } else {
-    buf = afl->queue_cur->cmplog_colorinput;
-    taint = afl->queue_cur->taint;
+    colorized = 1;
   }
 
   struct tainted *t = taint;
@@ -2422,42 +3377,8 @@ u8 input_to_state_stage(afl_state_t *afl, u8 *orig_buf, u8 *buf, u32 len) {
     t = t->next;
   }
 
-#if defined(_DEBUG) || defined(CMPLOG_INTROSPECTION)
-  u64 start_time = get_cur_time();
-  u32 cmp_locations = 0;
-#endif
-
-  // Generate the cmplog data
-
-  // manually clear the full cmp_map
-  memset(afl->shm.cmp_map, 0, sizeof(struct cmp_map));
-  if (unlikely(common_fuzz_cmplog_stuff(afl, orig_buf, len))) {
-    afl->queue_cur->colorized = CMPLOG_LVL_MAX;
-    while (taint) {
-      t = taint->next;
-      ck_free(taint);
-      taint = t;
-    }
-
-    return 1;
-  }
-
-  if (unlikely(!afl->orig_cmp_map)) {
-    afl->orig_cmp_map = ck_alloc_nozero(sizeof(struct cmp_map));
-  }
-
-  memcpy(afl->orig_cmp_map, afl->shm.cmp_map, sizeof(struct cmp_map));
-  memset(afl->shm.cmp_map->headers, 0, sizeof(struct cmp_header) * CMP_MAP_W);
-  if (unlikely(common_fuzz_cmplog_stuff(afl, buf, len))) {
-    afl->queue_cur->colorized = CMPLOG_LVL_MAX;
-    while (taint) {
-      t = taint->next;
-      ck_free(taint);
-      taint = t;
-    }
-
-    return 1;
-  }
+  // the cmplog binary runs the colorized input while we set up the stage
+  u8 cmplog_quit = cmplog_run_start(afl, buf, len);
 
 #ifdef _DEBUG
   dump("ORIG", orig_buf, len);
@@ -2475,20 +3396,41 @@ u8 input_to_state_stage(afl_state_t *afl, u8 *orig_buf, u8 *buf, u32 len) {
   afl->stage_max = 0;
   afl->stage_cur = 0;
 
-  u32 lvl = (afl->queue_cur->colorized ? 0 : LVL1) +
-            (afl->cmplog_lvl == CMPLOG_LVL_MAX ? LVL3 : 0);
 
 #ifdef CMPLOG_COMBINE
   u8 *cbuf = afl_realloc((void **)&afl->in_scratch_buf, len + 128);
   memcpy(cbuf, orig_buf, len);
-  u8 *virgin_backup = afl_realloc((void **)&afl->ex_buf, afl->shm.map_size);
-  memcpy(virgin_backup, afl->virgin_bits, afl->shm.map_size);
+  u8 *virgin_backup = afl_realloc((void **)&afl->ex_buf, afl->fsrv.map_size);
+  memcpy(virgin_backup, afl->virgin_bits, afl->fsrv.map_size);
 #else
   u8 *cbuf = NULL;
 #endif
 
-  u32 k;
-  for (k = 0; k < CMP_MAP_W; ++k) {
+  /* LVL3 also tries transformed values at every offset */
+  struct its_index  index;
+  struct its_index *ix = NULL;
+
+  if (!(lvl & LVL3)) {
+    its_index_build(afl, &index, buf, taint);
+    ix = &index;
+
+  } else if (afl->cmplog_enable_transform) {
+    its_nums = afl_realloc((void **)&afl->its_num_buf,
+                           len * sizeof(struct its_num));
+    if (unlikely(!its_nums)) { PFATAL("alloc"); }
+    memset(its_nums, 0, len * sizeof(struct its_num));
+  }
+
+  if (unlikely(cmplog_quit || cmplog_run_finish(afl))) {
+    afl->queue_cur->colorized = CMPLOG_LVL_MAX;
+    taint_free(taint);
+    return 1;
+  }
+
+  u32 *keys, keys_cnt = cmplog_keys(afl, &keys), j, k;
+
+  for (j = 0; j < keys_cnt; ++j) {
+    k = keys ? keys[j] : j;
     if (!afl->shm.cmp_map->headers[k].hits) { continue; }
 
     if (afl->pass_stats[k].faileds >= CMPLOG_FAIL_MAX ||
@@ -2500,19 +3442,20 @@ u8 input_to_state_stage(afl_state_t *afl, u8 *orig_buf, u8 *buf, u32 len) {
       afl->shm.cmp_map->headers[k].hits = 0;  // ignore this cmp
     }
 
-    if (afl->shm.cmp_map->headers[k].type == CMP_TYPE_INS) {
+    if (afl->shm.cmp_map->headers[k].type != CMP_TYPE_RTN) {
       // fprintf(stderr, "INS %u\n", k);
       afl->stage_max +=
-          MIN((u32)(afl->shm.cmp_map->headers[k].hits), (u32)CMP_MAP_H);
+          MIN((u32)(afl->shm.cmp_map->headers[k].hits), afl->cmplog_map_h);
 
     } else {
       // fprintf(stderr, "RTN %u\n", k);
       afl->stage_max +=
-          MIN((u32)(afl->shm.cmp_map->headers[k].hits), (u32)CMP_MAP_RTN_H);
+          MIN((u32)(afl->shm.cmp_map->headers[k].hits), afl->cmplog_map_h >> 1);
     }
   }
 
-  for (k = 0; k < CMP_MAP_W; ++k) {
+  for (j = 0; j < keys_cnt; ++j) {
+    k = keys ? keys[j] : j;
     if (!afl->shm.cmp_map->headers[k].hits) { continue; }
 
 #if defined(_DEBUG) || defined(CMPLOG_INTROSPECTION)
@@ -2520,12 +3463,20 @@ u8 input_to_state_stage(afl_state_t *afl, u8 *orig_buf, u8 *buf, u32 len) {
 #endif
 
     if (afl->shm.cmp_map->headers[k].type == CMP_TYPE_INS) {
-      if (unlikely(cmp_fuzz(afl, k, orig_buf, buf, cbuf, len, lvl, taint))) {
+      if (unlikely(cmp_fuzz(afl, k, orig_buf, buf, cbuf, len, lvl, taint,
+                            afl->cmplog_enable_scale ? NULL : ix))) {
+        goto exit_its;
+      }
+
+    } else if (afl->shm.cmp_map->headers[k].type == CMP_TYPE_SWITCH) {
+      if (unlikely(switch_fuzz(afl, k, orig_buf, buf, cbuf, len, lvl, taint,
+                               afl->cmplog_enable_scale ? NULL : ix))) {
         goto exit_its;
       }
 
     } else if ((lvl & LVL1) || ((lvl & LVL3) && afl->cmplog_enable_transform)) {
-      if (unlikely(rtn_fuzz(afl, k, orig_buf, buf, cbuf, len, lvl, taint))) {
+      if (unlikely(rtn_fuzz(afl, k, orig_buf, buf, cbuf, len, lvl, taint,
+                            ix))) {
         goto exit_its;
       }
     }
@@ -2538,37 +3489,29 @@ exit_its:
   if (afl->cmplog_lvl == CMPLOG_LVL_MAX) {
     afl->queue_cur->colorized = CMPLOG_LVL_MAX;
 
-    if (afl->queue_cur->cmplog_colorinput) {
-      ck_free(afl->queue_cur->cmplog_colorinput);
+    if (afl->queue_cur->cmplog_color) {
+      color_drop(afl, afl->queue_cur->cmplog_color);
     }
 
-    while (taint) {
-      t = taint->next;
-      ck_free(taint);
-      taint = t;
-    }
+  } else if (likely(!afl->large.file)) {
+    /* the taint of a window of a large input is of that window only, the
+       next window is colorized anew */
 
-    afl->queue_cur->taint = NULL;
-
-  } else {
     afl->queue_cur->colorized = LVL2;
 
-    if (!afl->queue_cur->taint) { afl->queue_cur->taint = taint; }
-
-    if (!afl->queue_cur->cmplog_colorinput) {
-      afl->queue_cur->cmplog_colorinput = ck_alloc_nozero(len);
-      memcpy(afl->queue_cur->cmplog_colorinput, buf, len);
-      memcpy(buf, orig_buf, len);
-    }
+    if (colorized) { color_store(afl, buf, len, taint); }
   }
 
+  taint_free(taint);
+  memcpy(buf, orig_buf, len);
+
 #ifdef CMPLOG_COMBINE
   if (afl->queued_items + afl->saved_crashes > orig_hit_cnt + 1) {
     // copy the current virgin bits so we can recover the information
-    u8 *virgin_save = afl_realloc((void **)&afl->eff_buf, afl->shm.map_size);
-    memcpy(virgin_save, afl->virgin_bits, afl->shm.map_size);
+    u8 *virgin_save = afl_realloc((void **)&afl->eff_buf, afl->fsrv.map_size);
+    memcpy(virgin_save, afl->virgin_bits, afl->fsrv.map_size);
     // reset virgin bits to the backup previous to redqueen
-    memcpy(afl->virgin_bits, virgin_backup, afl->shm.map_size);
+    memcpy(afl->virgin_bits, virgin_backup, afl->fsrv.map_size);
 
     u8 status = 0;
     its_fuzz(afl, cbuf, len, &status);
@@ -2578,7 +3521,7 @@ exit_its:
     u64 *v = (u64 *)afl->virgin_bits;
     u64 *s = (u64 *)virgin_save;
     u32  i;
-    for (i = 0; i < (afl->shm.map_size >> 3); i++) {
+    for (i = 0; i < (afl->fsrv.map_size >> 3); i++) {
       v[i] &= s[i];
     }
 
@@ -2586,7 +3529,7 @@ exit_its:
     u32 *v = (u32 *)afl->virgin_bits;
     u32 *s = (u32 *)virgin_save;
     u32  i;
-    for (i = 0; i < (afl->shm.map_size >> 2); i++) {
+    for (i = 0; i < (afl->fsrv.map_size >> 2); i++) {
       v[i] &= s[i];
     }
 
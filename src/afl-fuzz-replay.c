@@ -0,0 +1,335 @@
+/*
+ * This implements AFL_RECORD and AFL_REPLAY, which repeat a fuzzing session
+ * so that two builds of afl-fuzz can be timed on the same work.
+ *
+ * With a fixed seed (-s, which AFL_RECORD implies) the mutations and queue
+ * selections only depend on what the session sees from outside: the test
+ * cases synced from other instances, and the switch to the exploitation
+ * strategy after a time without finds. AFL_RECORD writes them to a text
+ * log, together with the seed and every queue entry picked for fuzz_one()
+ * as a check, and keeps a copy of every synced test case in the directory
+ * <log>.d. AFL_REPLAY starts from the same seed, does not sync or switch by
+ * the clock, but imports the copies and switches where the log says, and
+ * stops after the last pick.
+ *
+ * Points are the two places of the main loop where a sync can happen, both
+ * runs pass them in the same order. Each pick is checked against the log
+ * (entry, execs and queue size before it). On the first difference, e.g.
+ * from a run that timed out only in one of them, the replay says so and
+ * goes on with the recorded entry.
+ *
+ */
+
+#include "afl-fuzz.h"
+
+#define REPLAY_VERSION 1
+
+enum {
+
+  /* 00 */ REPLAY_PICK,
+  /* 01 */ REPLAY_SYNC,
+  /* 02 */ REPLAY_MODE
+
+};
+
+struct replay_event {
+  u64 at;    /* pick: its number, else the point */
+  u64 execs; /* pick: total execs before it      */
+  u32 entry, queued;
+  u32 file, id; /* sync: the copy and syncing_case  */
+  u8 *party;
+  u8  type;
+};
+
+struct replay_log {
+  FILE                *f;   /* AFL_RECORD: the log              */
+  u8                  *dir; /* copies of the synced test cases  */
+  struct replay_event *ev;  /* AFL_REPLAY: the log              */
+  u32                  ev_cnt, ev_cur;
+  u64                  picks, point, files;
+  u64                  diverged;       /* 1 + the picks before it differed */
+  u64                  start_us;       /* when the first pick was made     */
+  u64                  end_execs, end_picks;
+  u32                  end_queued;
+  u8                   replaying;
+};
+
+static void replay_load(afl_state_t *afl, u8 *fn) {
+  struct replay_log   *r = afl->replay;
+  struct replay_event *e;
+  FILE                *f = fopen(fn, "r");
+  char                 line[PATH_MAX + 128], party[256];
+  unsigned long long   a, b;
+  unsigned int         c, d, version = 0;
+  long long            seed = 0;
+  u32                  size = 0, lineno = 0, seeded = 0;
+
+  if (!f) { PFATAL("Unable to open '%s'", fn); }
+
+  while (fgets(line, sizeof(line), f)) {
+    ++lineno;
+
+    if (!version) {
+      if (sscanf(line, "# afl-fuzz replay log %u", &version) != 1 ||
+          version != REPLAY_VERSION) {
+        FATAL("'%s' is not a replay log of this afl-fuzz version", fn);
+      }
+
+      continue;
+    }
+
+    if (r->ev_cnt == size) {
+      size = size ? size * 2 : 1024;
+      r->ev = ck_realloc(r->ev, size * sizeof(struct replay_event));
+    }
+
+    e = &r->ev[r->ev_cnt];
+
+    if (sscanf(line, "pick %llu %u %llu %u", &a, &c, &b, &d) == 4) {
+      e->type = REPLAY_PICK;
+      e->at = a;
+      e->entry = c;
+      e->execs = b;
+      e->queued = d;
+      ++r->ev_cnt;
+
+    } else if (sscanf(line, "sync %llu %255s %u %u", &a, party, &c, &d) ==
+               4) {
+      e->type = REPLAY_SYNC;
+      e->at = a;
+      e->party = ck_strdup(party);
+      e->id = c;
+      e->file = d;
+      ++r->ev_cnt;
+
+    } else if (sscanf(line, "mode %llu", &a) == 1) {
+      e->type = REPLAY_MODE;
+      e->at = a;
+      ++r->ev_cnt;
+
+    } else if (sscanf(line, "seed %lld", &seed) == 1) {
+      seeded = 1;
+
+    } else if (sscanf(line, "end %llu %llu %u", &a, &b, &c) == 3) {
+      r->end_picks = a;
+      r->end_execs = b;
+      r->end_queued = c;
+
+    } else {
+      FATAL("Bad line %u in the replay log '%s'", lineno, fn);
+    }
+  }
+
+  fclose(f);
+
+  if (!seeded) { FATAL("The replay log '%s' has no seed", fn); }
+
+  rand_set_seed(afl, seed);
+  afl->fixed_seed = 1;
+}
+
+void replay_init(afl_state_t *afl) {
+  struct replay_log *r;
+  u8                *fn = afl->afl_env.afl_record;
+
+  if (!fn && !afl->afl_env.afl_replay) { return; }
+
+  if (fn && afl->afl_env.afl_replay) {
+    FATAL("AFL_RECORD and AFL_REPLAY are mutually exclusive");
+  }
+
+  r = afl->replay = ck_alloc(sizeof(struct replay_log));
+
+  if (fn) {
+    r->dir = alloc_printf("%s.d", fn);
+
+    if (mkdir(r->dir, 0700) && errno != EEXIST) {
+      PFATAL("Unable to create '%s'", r->dir);
+    }
+
+    r->f = fopen(fn, "w");
+    if (!r->f) { PFATAL("Unable to create '%s'", fn); }
+
+    afl->fixed_seed = 1;
+    fprintf(r->f, "# afl-fuzz replay log %u\nseed %lld\n", REPLAY_VERSION,
+            (long long)afl->init_seed);
+    OKF("Recording the session to '%s'", fn);
+
+  } else {
+    fn = afl->afl_env.afl_replay;
+    r->dir = alloc_printf("%s.d", fn);
+    replay_load(afl, fn);
+
+    /* these come from the log */
+    afl->switch_fuzz_mode = 0;
+    r->replaying = 1;
+    OKF("Replaying the session recorded in '%s'", fn);
+  }
+}
+
+static void replay_diverged(afl_state_t *afl) {
+  struct replay_log *r = afl->replay;
+
+  if (r->diverged) { return; }
+
+  r->diverged = r->picks + 1;
+  WARNF("The replay differs from the recording after %llu picks.", r->picks);
+}
+
+/* Run a recorded copy of a synced test case like sync_one() did. */
+
+static void replay_import(afl_state_t *afl, struct replay_event *e) {
+  struct replay_log *r = afl->replay;
+  u8                *fn = alloc_printf("%s/%06u", r->dir, e->file);
+  u8                 phase = phase_enter(afl, PHASE_SYNC);
+  u8                 fault;
+  s32                fd = open(fn, O_RDONLY);
+  struct stat        st;
+
+  if (fd < 0 || fstat(fd, &st)) { PFATAL("Unable to open '%s'", fn); }
+
+  u8 *buf = ck_alloc_nozero(st.st_size), *mem = buf;
+  ck_read(fd, buf, st.st_size, fn);
+  close(fd);
+
+  afl->stage_name = "replay sync";
+  afl->stage_cur = afl->stage_max = 0;
+
+  (void)write_to_testcase(afl, (void **)&mem, st.st_size, 1);
+  fault = fuzz_run_target(afl, &afl->fsrv, afl->fsrv.exec_tmout);
+
+  if (!afl->stop_soon) {
+    afl->syncing_party = e->party;
+    afl->syncing_case = e->id;
+    afl->queued_imported += save_if_interesting(afl, mem, st.st_size, fault);
+    afl->syncing_party = 0;
+  }
+
+  ck_free(buf);
+  ck_free(fn);
+  phase_enter(afl, phase);
+}
+
+/* The main loop is at a place where it may sync. */
+
+void replay_point(afl_state_t *afl) {
+  struct replay_log   *r = afl->replay;
+  struct replay_event *e;
+
+  ++r->point;
+
+  if (!r->replaying) { return; }
+
+  while (r->ev_cur < r->ev_cnt && r->ev[r->ev_cur].type != REPLAY_PICK &&
+         r->ev[r->ev_cur].at <= r->point && !afl->stop_soon) {
+    e = &r->ev[r->ev_cur++];
+
+    if (e->at != r->point) { replay_diverged(afl); }
+
+    if (e->type == REPLAY_MODE) {
+      afl->fuzz_mode = 1;
+
+    } else {
+      replay_import(afl, e);
+    }
+  }
+}
+
+/* afl->current_entry is about to be fuzzed. Returns 1 when the replay is
+   done. */
+
+u8 replay_pick(afl_state_t *afl) {
+  struct replay_log   *r = afl->replay;
+  struct replay_event *e;
+
+  if (!r->picks) { r->start_us = get_cur_time_us(); }
+
+  if (!r->replaying) {
+    fprintf(r->f, "pick %llu %u %llu %u\n", r->picks++, afl->current_entry,
+            afl->fsrv.total_execs, afl->queued_items);
+    return 0;
+  }
+
+  /* syncs the replay did not get to */
+
+  while (r->ev_cur < r->ev_cnt && r->ev[r->ev_cur].type != REPLAY_PICK) {
+    replay_diverged(afl);
+    ++r->ev_cur;
+  }
+
+  if (r->ev_cur >= r->ev_cnt) {
+    afl->stop_soon = 2;
+    return 1;
+  }
+
+  e = &r->ev[r->ev_cur++];
+
+  if (e->entry != afl->current_entry || e->execs != afl->fsrv.total_execs ||
+      e->queued != afl->queued_items) {
+    replay_diverged(afl);
+
+    if (e->entry < afl->queued_items) {
+      afl->current_entry = e->entry;
+      afl->queue_cur = afl->queue_buf[e->entry];
+    }
+  }
+
+  ++r->picks;
+  return 0;
+}
+
+/* The main loop switched to the exploitation strategy. */
+
+void replay_mode(afl_state_t *afl) {
+  struct replay_log *r = afl->replay;
+
+  if (!r->replaying) { fprintf(r->f, "mode %llu\n", r->point); }
+}
+
+/* sync_one() is about to run a test case of party. */
+
+void replay_record_sync(afl_state_t *afl, u8 *party, u8 *mem, u32 len) {
+  struct replay_log *r = afl->replay;
+  u8                *fn;
+  s32                fd;
+
+  if (r->replaying || !r->f) { return; }
+
+  fn = alloc_printf("%s/%06llu", r->dir, r->files);
+  fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, DEFAULT_PERMISSION);
+  if (fd < 0) { PFATAL("Unable to create '%s'", fn); }
+  ck_write(fd, mem, len, fn);
+  close(fd);
+  ck_free(fn);
+
+  fprintf(r->f, "sync %llu %s %u %llu\n", r->point, party, afl->syncing_case,
+          r->files++);
+}
+
+void replay_done(afl_state_t *afl) {
+  struct replay_log *r = afl->replay;
+  u64                us = r->picks ? get_cur_time_us() - r->start_us : 0;
+
+  if (!r->replaying) {
+    if (!r->f) { return; }
+    fprintf(r->f, "end %llu %llu %u\n", r->picks, afl->fsrv.total_execs,
+            afl->queued_items);
+    fclose(r->f);
+    r->f = NULL;
+    return;
+  }
+
+  OKF("Replayed %llu of %llu picks in %0.02f s: %llu execs (%llu recorded), "
+      "%0.02f execs/s, %u queue entries (%u recorded).",
+      r->picks, r->end_picks, (double)us / 1000000, afl->fsrv.total_execs,
+      r->end_execs, us ? (double)afl->fsrv.total_execs * 1000000 / us : 0.0,
+      afl->queued_items, r->end_queued);
+
+  if (r->diverged) {
+    WARNF("The replay differed from the recording after %llu picks.",
+          r->diverged - 1);
+
+  } else {
+    OKF("The replay did the recorded work up to the last pick.");
+  }
+}
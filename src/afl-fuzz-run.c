@@ -28,16 +28,206 @@
 #include <sys/time.h>
 #include <signal.h>
 #include <limits.h>
+#include <poll.h>
 #if !defined NAME_MAX
   #define NAME_MAX _XOPEN_NAME_MAX
 #endif
 
 #include "cmplog.h"
+#include "fsbatch.h"
+#include "fshints.h"
+#include "fsdoorbell.h"
 
 #ifdef PROFILING
 u64 time_spent_working = 0;
 #endif
 
+/* The result of a worker forkserver or of a pipelined run is processed on
+   its map in place, swap the main forkserver's map back in before it runs
+   again. */
+
+static inline void fsrv_main_map(afl_state_t *afl) {
+  if (unlikely(afl->saved_main_map)) {
+    afl->fsrv.trace_bits = afl->saved_main_map;
+    afl->saved_main_map = NULL;
+  }
+}
+
+/* A target switched from buckets to hit counts (AFL_LLVM_BUCKETED_COUNTS).
+   The maps of all forkservers are taken alike, so the others switch too. A
+   run still going on elsewhere may get its buckets taken as counts once. */
+
+static void buckets_lost(afl_state_t *afl) {
+  u32 i;
+
+  afl->buckets_lost = 1;
+  afl_fsrv_buckets_off(&afl->fsrv);
+
+  for (i = 0; i < afl->workers_cnt; ++i) {
+    afl_fsrv_buckets_off(&afl->workers[i].fsrv);
+  }
+
+  if (afl->hang_check) { afl_fsrv_buckets_off(&afl->hang_check->w.fsrv); }
+
+  if (afl->afl_env.afl_no_ui) {
+    OKF("A library without AFL_LLVM_BUCKETED_COUNTS turned the buckets off.");
+  }
+}
+
+static inline void buckets_check(afl_state_t *afl, afl_forkserver_t *fsrv) {
+  if (unlikely(fsrv->buckets_lost) && !afl->buckets_lost &&
+      fsrv != &afl->cmplog_fsrv) {
+    buckets_lost(afl);
+  }
+}
+
+/* Wait for the pipelined run (AFL_PIPELINE) and keep its result until it is
+   processed. */
+
+static void pipe_finish(afl_state_t *afl) {
+  u32 slot = afl->pipe_running - 1;
+  u64 elapsed_ms = (get_cur_time_us() - afl->pipe_start_us) / 1000;
+  u32 timeout = afl->fsrv.exec_tmout;
+  u8 *main_map = afl->fsrv.trace_bits;
+
+  /* the run went on while we processed the one before */
+
+  timeout = elapsed_ms < timeout ? timeout - elapsed_ms : 1;
+  afl->fsrv.trace_bits = FS_PIPE_MAP(afl->fsrv.pipe, slot);
+  u8 phase = phase_enter(afl, PHASE_TARGET);
+  afl->pipe_fault[slot] =
+      afl_fsrv_run_finish(&afl->fsrv, timeout, &afl->stop_soon);
+  phase_enter(afl, phase);
+  buckets_check(afl, &afl->fsrv);
+  afl->fsrv.trace_bits = main_map;
+  afl->pipe_running = 0;
+  afl->pipe_done = slot + 1;
+}
+
+/* Get the main forkserver and its map back before running it directly. */
+
+static inline void fsrv_main_ready(afl_state_t *afl) {
+  fsrv_main_map(afl);
+  if (unlikely(afl->pipe_running)) { pipe_finish(afl); }
+}
+
+/* Count a run for AFL_METRICS_PORT. */
+
+static inline void metrics_run(afl_state_t *afl, u64 start_us) {
+  struct afl_metrics *m = afl->metrics;
+
+  metrics_observe(m->exec_hist, &m->exec_sum_us, get_cur_time_us() - start_us,
+                  METRICS_EXEC_BASE);
+
+  if (unlikely(afl->stage_short != m->stage_last)) { metrics_stage(afl); }
+  METRICS_ADD(m->stage_execs + m->stage_cur, 1);
+}
+
+/* Log bucket of an exec time and the longest time in a bucket. */
+
+static inline u32 tmout_bucket(u64 us) {
+  u32 msb, i;
+
+  if (us < (1 << TMOUT_HIST_BITS)) { return (u32)us; }
+
+  msb = 63 - __builtin_clzll(us);
+  i = ((msb - TMOUT_HIST_BITS + 1) << TMOUT_HIST_BITS) +
+      ((us >> (msb - TMOUT_HIST_BITS)) & ((1 << TMOUT_HIST_BITS) - 1));
+
+  return i < TMOUT_HIST_BUCKETS ? i : TMOUT_HIST_BUCKETS - 1;
+}
+
+static u64 tmout_bucket_top(u32 i) {
+  u32 msb = (i >> TMOUT_HIST_BITS) + TMOUT_HIST_BITS - 1;
+  u64 low;
+
+  if (i < (1 << TMOUT_HIST_BITS)) { return i; }
+
+  low = (u64)((1 << TMOUT_HIST_BITS) + (i & ((1 << TMOUT_HIST_BITS) - 1)))
+        << (msb - TMOUT_HIST_BITS);
+  return low + (1ULL << (msb - TMOUT_HIST_BITS)) - 1;
+}
+
+/* Set exec_tmout to a multiple of a high percentile of the exec times seen,
+   and halve the counts so that older runs fade out. It is raised at once but
+   only lowered by half at most each time. */
+
+void tmout_adapt(afl_state_t *afl) {
+  struct tmout_hist *h = afl->tmout_hist;
+  u64                total = 0, seen = 0, us = 0;
+  u32                i, tmout;
+
+  h->runs = 0;
+
+  for (i = 0; i < TMOUT_HIST_BUCKETS; ++i) {
+    total += h->bucket[i];
+  }
+
+  if (!total) { return; }
+
+  for (i = 0; i < TMOUT_HIST_BUCKETS; ++i) {
+    seen += h->bucket[i];
+    if (seen * 1000 >= total * TMOUT_ADAPT_PERMILLE) {
+      us = tmout_bucket_top(i);
+      break;
+    }
+  }
+
+  for (i = 0; i < TMOUT_HIST_BUCKETS; ++i) {
+    h->bucket[i] >>= 1;
+  }
+
+  tmout = us * TMOUT_ADAPT_MULT / 1000;
+  tmout = (tmout + EXEC_TM_ROUND) / EXEC_TM_ROUND * EXEC_TM_ROUND;
+  tmout = MAX(tmout, afl->fsrv.exec_tmout / 2);
+  tmout = MIN(tmout, MAX(EXEC_TIMEOUT, afl->hang_tmout));
+
+  afl->fsrv.exec_tmout = tmout;
+}
+
+/* Count a run for AFL_ADAPTIVE_TIMEOUT. Runs that time out say nothing about
+   how long they would have taken, so they are kept out of the histogram; the
+   ones that finish when save_if_interesting() tries again with hang_tmout
+   go in with that time, a timeout that tight cut them short. */
+
+static inline void tmout_run(afl_state_t *afl, afl_forkserver_t *fsrv,
+                             u32 timeout, fsrv_run_result_t res,
+                             u64 start_us) {
+  struct tmout_hist *h = afl->tmout_hist;
+
+  if (fsrv != &afl->fsrv &&
+      (!afl->hang_check || fsrv != &afl->hang_check->w.fsrv)) {
+    return;
+  }
+
+  if (timeout == afl->fsrv.exec_tmout) {
+    if (res == FSRV_RUN_TMOUT) {
+      ++h->tmouts;
+      return;
+    }
+
+  } else if (timeout == afl->hang_tmout && res != FSRV_RUN_TMOUT) {
+    ++h->slow;
+
+  } else {
+    return;
+  }
+
+  ++h->bucket[tmout_bucket(get_cur_time_us() - start_us)];
+
+  if (unlikely(++h->runs >= TMOUT_ADAPT_RUNS)) { tmout_adapt(afl); }
+}
+
+/* A child that loaded an instrumented library asks for a larger map
+   (AFL_MAP_SIZE_MAX), see map_grow(). */
+
+static inline void map_grow_check(afl_state_t *afl, afl_forkserver_t *fsrv) {
+  if (unlikely(fsrv->map_cap) && fsrv->doorbell &&
+      unlikely(fsrv->doorbell->map_grow > fsrv->real_map_size)) {
+    map_grow(afl, fsrv->doorbell->map_grow);
+  }
+}
+
 /* Execute target application, monitoring for timeouts. Return status
    information. The called program will update afl->fsrv->trace_bits. */
 
@@ -55,7 +245,30 @@ fuzz_run_target(afl_state_t *afl, afl_forkserver_t *fsrv, u32 timeout) {
 
 #endif
 
+  fsrv_main_ready(afl);
+
+  u64 start_us =
+      unlikely(afl->metrics || afl->tmout_hist) ? get_cur_time_us() : 0;
+
+  u8                phase = phase_enter(afl, PHASE_TARGET);
   fsrv_run_result_t res = afl_fsrv_run_target(fsrv, timeout, &afl->stop_soon);
+  phase_enter(afl, phase);
+
+  if (unlikely(afl->metrics)) { metrics_run(afl, start_us); }
+  if (unlikely(afl->tmout_hist)) {
+    tmout_run(afl, fsrv, timeout, res, start_us);
+  }
+
+  map_grow_check(afl, fsrv);
+  buckets_check(afl, fsrv);
+
+  /* the loop count tuning needs to know which iteration comes next */
+
+  if (unlikely(afl->loop_tune_cnt) && fsrv == &afl->fsrv) {
+    afl->fsrv.doorbell->loop_cnt = afl->loop_tune_cnt;
+    afl->loop_tune_next =
+        fsrv->child_pid > 0 ? afl->fsrv.doorbell->loop_iter : 0;
+  }
 
   /* If post_run() function is defined in custom mutator, the function will be
      called each time after AFL++ executes the target program. */
@@ -76,6 +289,113 @@ fuzz_run_target(afl_state_t *afl, afl_forkserver_t *fsrv, u32 timeout) {
   return res;
 }
 
+/* Like fuzz_run_target(), but return as soon as the target runs, so the
+   caller can do other work meanwhile. Returns 0 if the user wants to quit. */
+
+u8 fuzz_run_start(afl_state_t *afl, afl_forkserver_t *fsrv) {
+  fsrv_main_ready(afl);
+
+  return afl_fsrv_run_start(fsrv, &afl->stop_soon);
+}
+
+/* Wait for the run of fuzz_run_start() that began at start_us, timeout
+   counts from then. */
+
+fsrv_run_result_t fuzz_run_finish(afl_state_t *afl, afl_forkserver_t *fsrv,
+                                  u32 timeout, u64 start_us) {
+  u64 elapsed_ms = (get_cur_time_us() - start_us) / 1000;
+  u32 full_timeout = timeout;
+
+  timeout = elapsed_ms < timeout ? timeout - elapsed_ms : 1;
+
+  u8                phase = phase_enter(afl, PHASE_TARGET);
+  fsrv_run_result_t res = afl_fsrv_run_finish(fsrv, timeout, &afl->stop_soon);
+  phase_enter(afl, phase);
+
+  if (unlikely(afl->metrics)) { metrics_run(afl, start_us); }
+  if (unlikely(afl->tmout_hist)) {
+    tmout_run(afl, fsrv, full_timeout, res, start_us);
+  }
+
+  map_grow_check(afl, fsrv);
+  buckets_check(afl, fsrv);
+
+  if (unlikely(afl->custom_mutators_count)) {
+    LIST_FOREACH(&afl->custom_mutator_list, struct custom_mutator, {
+      if (unlikely(el->afl_custom_post_run)) {
+        el->afl_custom_post_run(el->data);
+      }
+    });
+  }
+
+  return res;
+}
+
+/* Run mem through the post processing of the custom mutators. Returns the
+   result and sets *size to its length, 0 if a post processor dropped the
+   test case. If dst is set, a post_process_into() that comes last writes
+   its output there, MAX_FILE bytes at most. With AFL_POST_PROCESS_CACHE an
+   input that was processed before is taken from the cache. */
+
+static u8 *custom_post_process(afl_state_t *afl, u8 *mem, ssize_t *size,
+                               u8 *dst) {
+  struct pp_cache_entry *c = NULL;
+  u64                    key = 0;
+
+  if (unlikely(afl->pp_cache)) {
+    key = hash64(mem, *size, HASH_CONST) ^ *size;
+    c = &afl->pp_cache->e[key % afl->pp_cache->cnt];
+
+    if (c->buf && c->key == key) {
+      ++afl->pp_cache->hits;
+      *size = c->len;
+      return c->buf;
+    }
+
+    ++afl->pp_cache->misses;
+  }
+
+  LIST_FOREACH(&afl->custom_mutator_list, struct custom_mutator, {
+    u8 *new_buf = NULL;
+
+    if (el->afl_custom_post_process_into) {
+      new_buf = el == afl->custom_pp_last && dst
+                    ? dst
+                    : afl_realloc((void **)&el->post_process_buf, MAX_FILE);
+      if (unlikely(!new_buf)) { PFATAL("alloc"); }
+
+      *size = el->afl_custom_post_process_into(el->data, mem, *size, new_buf,
+                                               MAX_FILE);
+      if (unlikely(*size > MAX_FILE)) {
+        FATAL("Custom post_process_into returned %zd bytes, more than %u",
+              *size, (u32)MAX_FILE);
+      }
+
+    } else if (el->afl_custom_post_process) {
+      *size = el->afl_custom_post_process(el->data, mem, *size, &new_buf);
+
+    } else {
+      continue;
+    }
+
+    if (unlikely(!new_buf || *size <= 0)) {
+      *size = 0;
+      return mem;
+    }
+
+    mem = new_buf;
+  });
+
+  if (unlikely(c)) {
+    if (unlikely(!afl_realloc((void **)&c->buf, *size))) { PFATAL("alloc"); }
+    memcpy(c->buf, mem, *size);
+    c->key = key;
+    c->len = *size;
+  }
+
+  return mem;
+}
+
 /* Write modified data to file for testing. If afl->fsrv.out_file is set, the
    old file is unlinked and a new one is created. Otherwise, afl->fsrv.out_fd is
    rewound and truncated. */
@@ -84,38 +404,76 @@ u32 __attribute__((hot))
 write_to_testcase(afl_state_t *afl, void **mem, u32 len, u32 fix) {
   u8 sent = 0;
 
+  /* the write_diff does not know about the fixed checksums */
+  if (unlikely(afl->queue_cur && afl->queue_cur->cksum_cnt) && !fix &&
+      cksum_fixup(afl, *mem, len)) {
+    afl->fsrv.write_diff.base = NULL;
+  }
+
   if (unlikely(afl->custom_mutators_count)) {
     ssize_t new_size = len;
     u8     *new_mem = *mem;
     u8     *new_buf = NULL;
+    u8     *shm = NULL;
 
-    LIST_FOREACH(&afl->custom_mutator_list, struct custom_mutator, {
-      if (el->afl_custom_post_process) {
-        new_size =
-            el->afl_custom_post_process(el->data, new_mem, new_size, &new_buf);
+    /* a post_process_into() that comes last can write straight into the
+       shared memory test case */
 
-        if (unlikely(!new_buf || new_size <= 0)) {
-          new_size = 0;
-          new_buf = new_mem;
-          // FATAL("Custom_post_process failed (ret: %lu)", (long
-          // unsigned)new_size);
+    if (afl->fsrv.use_shmem_fuzz && afl->custom_pp_last &&
+        afl->custom_pp_last->afl_custom_post_process_into &&
+        !afl->fsrv.persistent_record) {
+      shm = afl->fsrv.shmem_fuzz;
 
-        } else {
-          new_mem = new_buf;
-        }
-      }
-    });
+#ifdef __linux__
+      if (afl->fsrv.nyx_mode) { shm = NULL; }
+#endif
+
+      LIST_FOREACH(&afl->custom_mutator_list, struct custom_mutator, {
+        if (el->afl_custom_fuzz_send) { shm = NULL; }
+      });
+    }
+
+    if (afl->custom_pp_last) {
+      new_mem = custom_post_process(afl, new_mem, &new_size, shm);
+    }
 
     if (unlikely(!new_size)) {
       // perform dummy runs (fix = 1), but skip all others
       if (fix) {
         new_size = len;
+        new_mem = *mem;
 
       } else {
         return 0;
       }
     }
 
+    if (new_mem == shm) {
+      /* already in place, only the length and the diff state are left */
+
+      if (unlikely(new_size < afl->min_length && !fix)) {
+        new_size = afl->min_length;
+
+      } else if (unlikely(new_size > afl->max_length)) {
+        new_size = afl->max_length;
+      }
+
+      *afl->fsrv.shmem_fuzz_len = new_size;
+      afl->fsrv.shmem_fuzz_diff.base = NULL;
+      afl->fsrv.write_diff.base = NULL;
+
+      if (likely(!afl->afl_env.afl_post_process_keep_original)) {
+        new_buf = afl_realloc(AFL_BUF_PARAM(out_scratch), new_size);
+        if (unlikely(!new_buf)) { PFATAL("alloc"); }
+        memcpy(new_buf, shm, new_size);
+        *mem = new_buf;
+        afl_swap_bufs(AFL_BUF_PARAM(out), AFL_BUF_PARAM(out_scratch));
+        len = new_size;
+      }
+
+      return len;
+    }
+
     if (unlikely(new_size < afl->min_length && !fix)) {
       new_size = afl->min_length;
 
@@ -210,47 +568,30 @@ static void write_with_gap(afl_state_t *afl, u8 *mem, u32 len, u32 skip_at,
 
   bool post_process_skipped = true;
 
-  if (unlikely(afl->custom_mutators_count)) {
-    u8 *new_buf = NULL;
-    new_mem = mem_trimmed;
-
-    LIST_FOREACH(&afl->custom_mutator_list, struct custom_mutator, {
-      if (el->afl_custom_post_process) {
-        // We copy into the mem_trimmed only if we actually have custom mutators
-        // *with* post_processing installed
-
-        if (post_process_skipped) {
-          if (skip_at) { memcpy(mem_trimmed, (u8 *)mem, skip_at); }
-
-          if (tail_len) {
-            memcpy(mem_trimmed + skip_at, (u8 *)mem + skip_at + skip_len,
-                   tail_len);
-          }
-
-          post_process_skipped = false;
-        }
+  if (unlikely(afl->custom_pp_last)) {
+    // We copy into the mem_trimmed only if we actually have custom mutators
+    // *with* post_processing installed
 
-        new_size =
-            el->afl_custom_post_process(el->data, new_mem, new_size, &new_buf);
+    if (skip_at) { memcpy(mem_trimmed, (u8 *)mem, skip_at); }
 
-        if (unlikely(!new_buf && new_size <= 0)) {
-          new_size = 0;
-          new_buf = new_mem;
-          // FATAL("Custom_post_process failed (ret: %lu)", (long
-          // unsigned)new_size);
+    if (tail_len) {
+      memcpy(mem_trimmed + skip_at, (u8 *)mem + skip_at + skip_len, tail_len);
+    }
 
-        } else {
-          new_mem = new_buf;
-        }
-      }
-    });
+    post_process_skipped = false;
+    new_mem = custom_post_process(
+        afl, mem_trimmed, &new_size,
+        afl->fsrv.use_shmem_fuzz ? afl->fsrv.shmem_fuzz : NULL);
   }
 
   if (likely(afl->fsrv.use_shmem_fuzz)) {
     if (!post_process_skipped) {
-      // If we did post_processing, copy directly from the new_mem buffer
+      // If we did post_processing, copy directly from the new_mem buffer,
+      // unless post_process_into() wrote it there already
 
-      memcpy(afl->fsrv.shmem_fuzz, new_mem, new_size);
+      if (new_mem != afl->fsrv.shmem_fuzz) {
+        memcpy(afl->fsrv.shmem_fuzz, new_mem, new_size);
+      }
 
     } else {
       memcpy(afl->fsrv.shmem_fuzz, mem, skip_at);
@@ -260,6 +601,7 @@ static void write_with_gap(afl_state_t *afl, u8 *mem, u32 len, u32 skip_at,
     }
 
     *afl->fsrv.shmem_fuzz_len = new_size;
+    afl->fsrv.shmem_fuzz_diff.base = NULL;
 
 #ifdef _DEBUG
     if (afl->debug) {
@@ -280,7 +622,7 @@ static void write_with_gap(afl_state_t *afl, u8 *mem, u32 len, u32 skip_at,
 
     return;
 
-  } else if (unlikely(!afl->fsrv.use_stdin)) {
+  } else if (unlikely(!afl->fsrv.use_stdin && !afl->fsrv.use_memfd)) {
     if (unlikely(afl->no_unlink)) {
       fd = open(afl->fsrv.out_file, O_WRONLY | O_CREAT | O_TRUNC,
                 DEFAULT_PERMISSION);
@@ -306,7 +648,7 @@ static void write_with_gap(afl_state_t *afl, u8 *mem, u32 len, u32 skip_at,
     ck_write(fd, mem + skip_at + skip_len, tail_len, afl->fsrv.out_file);
   }
 
-  if (afl->fsrv.use_stdin) {
+  if (afl->fsrv.use_stdin || afl->fsrv.use_memfd) {
     if (ftruncate(fd, new_size)) { PFATAL("ftruncate() failed"); }
     lseek(fd, 0, SEEK_SET);
 
@@ -315,173 +657,181 @@ static void write_with_gap(afl_state_t *afl, u8 *mem, u32 len, u32 skip_at,
   }
 }
 
-/* Calibrate a new test case. This is done when processing the input directory
-   to warn about flaky or otherwise problematic test cases early on; and when
-   new paths are discovered to detect variable behavior and so on. */
+/* Start the main forkserver if it is not up yet, and drop the shared memory
+   testcase and batch transports if it turned them down. */
 
-u8 calibrate_case(afl_state_t *afl, struct queue_entry *q, u8 *use_mem,
-                  u32 handicap, u8 from_queue) {
-  u8 fault = 0, new_bits = 0, var_detected = 0, hnb = 0,
-     first_run = (q->exec_cksum == 0);
-  u64 start_us, stop_us, diff_us;
-  s32 old_sc = afl->stage_cur, old_sm = afl->stage_max;
-  u32 use_tmout = afl->fsrv.exec_tmout;
-  u8 *old_sn = afl->stage_name;
+void fuzz_fsrv_start(afl_state_t *afl) {
+  if (afl->fsrv.fsrv_pid) { return; }
 
-  if (unlikely(afl->shm.cmplog_mode)) { q->exec_cksum = 0; }
+  if (afl->fsrv.cmplog_binary &&
+      afl->fsrv.init_child_func != cmplog_exec_child) {
+    FATAL("BUG in afl-fuzz detected. Cmplog mode not set correctly.");
+  }
 
-  /* Be a bit more generous about timeouts when resuming sessions, or when
-     trying to calibrate already-added finds. This helps avoid trouble due
-     to intermittent latency. */
+  afl_fsrv_start(&afl->fsrv, afl->argv, &afl->stop_soon,
+                 afl->afl_env.afl_debug_child);
 
-  if (!from_queue || afl->resuming_fuzz) {
-    use_tmout = MAX(afl->fsrv.exec_tmout + CAL_TMOUT_ADD,
-                    afl->fsrv.exec_tmout * CAL_TMOUT_PERC / 100);
+  if (afl->fsrv.support_shmem_fuzz && !afl->fsrv.use_shmem_fuzz) {
+    afl_shm_deinit(afl->shm_fuzz);
+    ck_free(afl->shm_fuzz);
+    afl->shm_fuzz = NULL;
+    afl->fsrv.support_shmem_fuzz = 0;
+    afl->fsrv.shmem_fuzz = NULL;
   }
 
-  ++q->cal_failed;
+  if (afl->fsrv.support_batch && !afl->fsrv.use_batch) {
+    afl_shm_deinit(afl->shm_batch);
+    ck_free(afl->shm_batch);
+    afl->shm_batch = NULL;
+    afl->fsrv.support_batch = 0;
+    afl->fsrv.batch = NULL;
+  }
+}
 
-  afl->stage_name = "calibration";
-  afl->stage_max = afl->afl_env.afl_cal_fast ? CAL_CYCLES_FAST : CAL_CYCLES;
+/* Append a record to the calibration index. If that fails the index is
+   given up, a resume then calibrates what is missing. */
 
-  /* Make sure the forkserver is up before we do anything, and let's not
-     count its spin-up time toward binary calibration. */
+void cal_index_write(afl_state_t *afl, void *rec, u32 size) {
+  if (unlikely(write(afl->cal_index_fd, rec, size) != (ssize_t)size)) {
+    WARNF("Unable to write the calibration index, no longer updating it.");
+    close(afl->cal_index_fd);
+    afl->cal_index_fd = -1;
+  }
+}
 
-  if (!afl->fsrv.fsrv_pid) {
-    if (afl->fsrv.cmplog_binary &&
-        afl->fsrv.init_child_func != cmplog_exec_child) {
-      FATAL("BUG in afl-fuzz detected. Cmplog mode not set correctly.");
-    }
+/* Store rec with the nonzero bytes of map. */
 
-    afl_fsrv_start(&afl->fsrv, afl->argv, &afl->stop_soon,
-                   afl->afl_env.afl_debug_child);
+static void cal_index_put(afl_state_t *afl, struct cal_index_rec *rec,
+                          u8 *map) {
+  u32 i, j = 0, cnt = 0, map_size = afl->fsrv.map_size;
 
-    if (afl->fsrv.support_shmem_fuzz && !afl->fsrv.use_shmem_fuzz) {
-      afl_shm_deinit(afl->shm_fuzz);
-      ck_free(afl->shm_fuzz);
-      afl->shm_fuzz = NULL;
-      afl->fsrv.support_shmem_fuzz = 0;
-      afl->fsrv.shmem_fuzz = NULL;
-    }
+  for (i = 0; i < map_size; ++i) {
+    if (map[i]) { ++cnt; }
   }
 
-  /* we need a dummy run if this is LTO + cmplog */
-  if (unlikely(afl->shm.cmplog_mode)) {
-    (void)write_to_testcase(afl, (void **)&use_mem, q->len, 1);
-
-    fault = fuzz_run_target(afl, &afl->fsrv, use_tmout);
-
-    /* afl->stop_soon is set by the handler for Ctrl+C. When it's pressed,
-       we want to bail out quickly. */
+  u32 size = CAL_INDEX_REC_SIZE(cnt);
+  u8 *buf = afl_realloc(AFL_BUF_PARAM(cal_index), size);
+  if (unlikely(!buf)) { PFATAL("alloc"); }
 
-    if (afl->stop_soon || fault != afl->crash_mode) { goto abort_calibration; }
+  u32 *offs = (u32 *)(buf + sizeof(struct cal_index_rec));
+  u8  *vals = (u8 *)(offs + cnt);
 
-    if (!afl->non_instrumented_mode && !afl->stage_cur &&
-        !count_bytes(afl, afl->fsrv.trace_bits)) {
-      fault = FSRV_RUN_NOINST;
-      goto abort_calibration;
-    }
+  rec->cnt = cnt;
+  memcpy(buf, rec, sizeof(struct cal_index_rec));
 
-#ifdef INTROSPECTION
-    if (unlikely(!q->bitsmap_size)) q->bitsmap_size = afl->bitsmap_size;
-#endif
+  for (i = 0; i < map_size; ++i) {
+    if (map[i]) { offs[j++] = i; }
   }
 
-  if (q->exec_cksum) {
-    memcpy(afl->first_trace, afl->fsrv.trace_bits, afl->fsrv.map_size);
-    hnb = has_new_bits(afl, afl->virgin_bits);
-    if (hnb > new_bits) { new_bits = hnb; }
+  for (j = 0; j < cnt; ++j) {
+    vals[j] = map[offs[j]];
   }
 
-  start_us = get_cur_time_us();
+  memset(vals + cnt, 0, size - ((u8 *)(vals + cnt) - buf));
 
-  for (afl->stage_cur = 0; afl->stage_cur < afl->stage_max; ++afl->stage_cur) {
-    if (unlikely(afl->debug)) {
-      DEBUGF("calibration stage %d/%d\n", afl->stage_cur + 1, afl->stage_max);
-    }
+  cal_index_write(afl, buf, size);
+}
 
-    u64 cksum;
+/* Record what calibrating q with content buf found, the map of its last run
+   is still in trace_bits. */
 
-    (void)write_to_testcase(afl, (void **)&use_mem, q->len, 1);
+void cal_index_add(afl_state_t *afl, struct queue_entry *q, u8 *buf) {
+  struct cal_index_rec rec;
 
-    fault = fuzz_run_target(afl, &afl->fsrv, use_tmout);
+  if (likely(afl->cal_index_fd < 0)) { return; }
 
-    /* afl->stop_soon is set by the handler for Ctrl+C. When it's pressed,
-       we want to bail out quickly. */
+  memset(&rec, 0, sizeof(rec));
+  rec.id = q->id;
+  rec.len = q->len;
+  rec.hash = hash64(buf, q->len, HASH_CONST);
+  rec.exec_cksum = q->exec_cksum;
+  rec.exec_us = q->exec_us;
+  rec.bitmap_size = q->bitmap_size;
+  rec.var_behavior = q->var_behavior;
+  rec.has_new_cov = q->has_new_cov;
 
-    if (afl->stop_soon || fault != afl->crash_mode) { goto abort_calibration; }
+  cal_index_put(afl, &rec, afl->fsrv.trace_bits);
+}
 
-    if (!afl->non_instrumented_mode && !afl->stage_cur &&
-        !count_bytes(afl, afl->fsrv.trace_bits)) {
-      fault = FSRV_RUN_NOINST;
-      goto abort_calibration;
-    }
+/* The same for the set of variable map bytes. */
 
-#ifdef INTROSPECTION
-    if (unlikely(!q->bitsmap_size)) q->bitsmap_size = afl->bitsmap_size;
-#endif
+static void cal_index_add_var(afl_state_t *afl) {
+  struct cal_index_rec rec;
 
-    classify_counts(&afl->fsrv);
-    cksum = hash64(afl->fsrv.trace_bits, afl->fsrv.map_size, HASH_CONST);
-    if (q->exec_cksum != cksum) {
-      hnb = has_new_bits(afl, afl->virgin_bits);
-      if (hnb > new_bits) { new_bits = hnb; }
-
-      if (q->exec_cksum) {
-        u32 i;
-
-        for (i = 0; i < afl->fsrv.map_size; ++i) {
-          if (unlikely(!afl->var_bytes[i]) &&
-              unlikely(afl->first_trace[i] != afl->fsrv.trace_bits[i])) {
-            afl->var_bytes[i] = 1;
-            // ignore the variable edge by setting it to fully discovered
-            afl->virgin_bits[i] = 0;
-          }
-        }
+  if (likely(afl->cal_index_fd < 0)) { return; }
 
-        if (unlikely(!var_detected && !afl->afl_env.afl_no_warn_instability)) {
-          // note: from_queue seems to only be set during initialization
-          if (afl->afl_env.afl_no_ui || from_queue) {
-            WARNF("instability detected during calibration");
+  memset(&rec, 0, sizeof(rec));
+  rec.id = CAL_INDEX_VAR;
 
-          } else if (afl->debug) {
-            DEBUGF("instability detected during calibration\n");
-          }
-        }
+  cal_index_put(afl, &rec, afl->var_bytes);
+}
 
-        var_detected = 1;
-        afl->stage_max =
-            afl->afl_env.afl_cal_fast ? CAL_CYCLES : CAL_CYCLES_LONG;
+/* Take in the map of a calibration run of q from trace_bits. first_trace has
+   the map of its first run. Returns 1 if the run took another path than
+   that one, calibration then needs more cycles. */
 
-      } else {
-        q->exec_cksum = cksum;
-        memcpy(afl->first_trace, afl->fsrv.trace_bits, afl->fsrv.map_size);
-      }
+static u8 cal_run_check(afl_state_t *afl, struct queue_entry *q,
+                        u8 *first_trace, u8 *new_bits, u8 *var_detected,
+                        u8 from_queue) {
+  u64 cksum;
+  u8  hnb;
+
+  classify_counts(&afl->fsrv);
+  cksum = hash_trace_bits(&afl->fsrv);
+  if (q->exec_cksum == cksum) { return 0; }
+
+  hnb = has_new_bits(afl, afl->virgin_bits);
+  if (hnb > *new_bits) { *new_bits = hnb; }
+
+  if (!q->exec_cksum) {
+    q->exec_cksum = cksum;
+    memcpy(first_trace, afl->fsrv.trace_bits, afl->fsrv.map_size);
+    return 0;
+  }
+
+  u32 i;
+
+  for (i = 0; i < afl->fsrv.map_size; ++i) {
+    if (unlikely(!afl->var_bytes[i]) &&
+        unlikely(first_trace[i] != afl->fsrv.trace_bits[i])) {
+      var_byte_ignore(afl, i);
     }
   }
 
-  if (unlikely(afl->fixed_seed)) {
-    diff_us = (u64)(afl->fsrv.exec_tmout - 1) * (u64)afl->stage_max;
+  if (unlikely(!*var_detected && !afl->afl_env.afl_no_warn_instability)) {
+    // note: from_queue seems to only be set during initialization
+    if (afl->afl_env.afl_no_ui || from_queue) {
+      WARNF("instability detected during calibration");
 
-  } else {
-    stop_us = get_cur_time_us();
-    diff_us = stop_us - start_us;
-    if (unlikely(!diff_us)) { ++diff_us; }
+    } else if (afl->debug) {
+      DEBUGF("instability detected during calibration\n");
+    }
   }
 
+  *var_detected = 1;
+  return 1;
+}
+
+/* Store the results of calibrating q, stage_max runs took diff_us and the
+   map of the last one is in trace_bits. Returns the fault to report. */
+
+static u8 cal_results(afl_state_t *afl, struct queue_entry *q, u64 diff_us,
+                      u32 stage_max, u32 handicap, u8 first_run, u8 new_bits,
+                      u8 fault) {
   afl->total_cal_us += diff_us;
-  afl->total_cal_cycles += afl->stage_max;
+  afl->total_cal_cycles += stage_max;
 
   /* OK, let's collect some stats about the performance of this test case.
      This is used for fuzzing air time calculations in calculate_score(). */
 
-  if (unlikely(!afl->stage_max)) {
+  if (unlikely(!stage_max)) {
     // Pretty sure this cannot happen, yet scan-build complains.
     FATAL("BUG: stage_max should not be 0 here! Please report this condition.");
   }
 
-  q->exec_us = diff_us / afl->stage_max;
+  q->exec_us = diff_us / stage_max;
   q->bitmap_size = count_bytes(afl, afl->fsrv.trace_bits);
+  q->focus_hits = count_focus_bytes(afl, afl->fsrv.trace_bits);
   q->handicap = handicap;
   q->cal_failed = 0;
 
@@ -498,8 +848,14 @@ u8 calibrate_case(afl_state_t *afl, struct queue_entry *q, u8 *use_mem,
     fault = FSRV_RUN_NOBITS;
   }
 
-abort_calibration:
+  return fault;
+}
+
+/* What is left to do after calibrating q with content mem, whether it went
+   through or was aborted. */
 
+static void cal_wrap_up(afl_state_t *afl, struct queue_entry *q, u8 *mem,
+                        u8 new_bits, u8 var_detected, u8 calibrated) {
   if (new_bits == 2 && !q->has_new_cov) {
     q->has_new_cov = 1;
     ++afl->queued_with_cov;
@@ -509,22 +865,863 @@ abort_calibration:
 
   if (var_detected) {
     afl->var_byte_count = count_bytes(afl, afl->var_bytes);
+    target_novelty_sync(afl);
 
     if (!q->var_behavior) {
       mark_as_variable(afl, q);
       ++afl->queued_variable;
     }
+
+    cal_index_add_var(afl);
+  }
+
+  if (calibrated) {
+    afl->cal_stable = var_detected ? 0 : afl->cal_stable + 1;
+    cal_index_add(afl, q, mem);
+  }
+}
+
+/* Whether the calibration of a test case can stop after runs runs: on a
+   target that has been stable for CAL_STABLE_STREAK calibrations, runs
+   that all took the same path say enough. A run that differs escalates to
+   CAL_CYCLES_LONG as before, and resets the streak. */
+
+static inline u8 cal_early_stop(afl_state_t *afl, u32 runs, u8 var_detected) {
+  return !var_detected && runs >= CAL_CYCLES_EARLY &&
+         afl->cal_stable >= CAL_STABLE_STREAK;
+}
+
+/* Calibrate a new test case. This is done when processing the input directory
+   to warn about flaky or otherwise problematic test cases early on; and when
+   new paths are discovered to detect variable behavior and so on. */
+
+u8 calibrate_case(afl_state_t *afl, struct queue_entry *q, u8 *use_mem,
+                  u32 handicap, u8 from_queue) {
+  u8 fault = 0, new_bits = 0, var_detected = 0, hnb = 0,
+     first_run = (q->exec_cksum == 0);
+  u64 start_us, stop_us, diff_us;
+  s32 old_sc = afl->stage_cur, old_sm = afl->stage_max;
+  u32 use_tmout = afl->fsrv.exec_tmout;
+  u32 batch_pos = 0, batch_cnt = 0;
+  u8  batch_fault = 0, calibrated = 0;
+  u8 *old_sn = afl->stage_name, *orig_mem = use_mem;
+  u8  phase = phase_enter(afl, PHASE_CALIBRATE);
+
+  fsrv_main_ready(afl);
+
+  if (unlikely(afl->shm.cmplog_mode)) { q->exec_cksum = 0; }
+
+  /* Be a bit more generous about timeouts when resuming sessions, or when
+     trying to calibrate already-added finds. This helps avoid trouble due
+     to intermittent latency. */
+
+  if (!from_queue || afl->resuming_fuzz) {
+    use_tmout = MAX(afl->fsrv.exec_tmout + CAL_TMOUT_ADD,
+                    afl->fsrv.exec_tmout * CAL_TMOUT_PERC / 100);
   }
 
+  ++q->cal_failed;
+
+  afl->stage_name = "calibration";
+  afl->stage_max = afl->afl_env.afl_cal_fast ? CAL_CYCLES_FAST : CAL_CYCLES;
+
+  /* Make sure the forkserver is up before we do anything, and let's not
+     count its spin-up time toward binary calibration. */
+
+  fuzz_fsrv_start(afl);
+
+  /* we need a dummy run if this is LTO + cmplog */
+  if (unlikely(afl->shm.cmplog_mode)) {
+    (void)write_to_testcase(afl, (void **)&use_mem, q->len, 1);
+
+    fault = fuzz_run_target(afl, &afl->fsrv, use_tmout);
+
+    /* afl->stop_soon is set by the handler for Ctrl+C. When it's pressed,
+       we want to bail out quickly. */
+
+    if (afl->stop_soon || fault != afl->crash_mode) { goto abort_calibration; }
+
+    if (!afl->non_instrumented_mode && !afl->stage_cur &&
+        !count_bytes(afl, afl->fsrv.trace_bits)) {
+      fault = FSRV_RUN_NOINST;
+      goto abort_calibration;
+    }
+
+#ifdef INTROSPECTION
+    if (unlikely(!q->bitsmap_size)) q->bitsmap_size = afl->bitsmap_size;
+#endif
+  }
+
+  if (q->exec_cksum) {
+    memcpy(afl->first_trace, afl->fsrv.trace_bits, afl->fsrv.map_size);
+    hnb = has_new_bits(afl, afl->virgin_bits);
+    if (hnb > new_bits) { new_bits = hnb; }
+  }
+
+  start_us = get_cur_time_us();
+
+  for (afl->stage_cur = 0; afl->stage_cur < afl->stage_max; ++afl->stage_cur) {
+    if (unlikely(afl->debug)) {
+      DEBUGF("calibration stage %d/%d\n", afl->stage_cur + 1, afl->stage_max);
+    }
+
+    if (afl->fsrv.use_batch && !afl->custom_mutators_count) {
+      /* Run the remaining cycles back to back in one batch and then take
+         their maps one by one. */
+
+      if (batch_pos == batch_cnt) {
+        u32 want = afl->stage_max - afl->stage_cur;
+
+        (void)write_to_testcase(afl, (void **)&use_mem, q->len, 1);
+
+        while (want-- && afl_fsrv_batch_add(&afl->fsrv, afl->fsrv.shmem_fuzz,
+                                            *afl->fsrv.shmem_fuzz_len)) {}
+
+        u8 phase = phase_enter(afl, PHASE_TARGET);
+        batch_fault =
+            afl_fsrv_run_batch(&afl->fsrv, use_tmout, &afl->stop_soon);
+        phase_enter(afl, phase);
+        batch_cnt = afl->fsrv.batch_done;
+        batch_pos = 0;
+      }
+
+      afl_fsrv_batch_trace(&afl->fsrv, batch_pos);
+      fault = ++batch_pos < batch_cnt ? FSRV_RUN_OK : batch_fault;
+
+    } else {
+      (void)write_to_testcase(afl, (void **)&use_mem, q->len, 1);
+
+      fault = fuzz_run_target(afl, &afl->fsrv, use_tmout);
+    }
+
+    /* afl->stop_soon is set by the handler for Ctrl+C. When it's pressed,
+       we want to bail out quickly. */
+
+    if (afl->stop_soon || fault != afl->crash_mode) { goto abort_calibration; }
+
+    if (!afl->non_instrumented_mode && !afl->stage_cur &&
+        !count_bytes(afl, afl->fsrv.trace_bits)) {
+      fault = FSRV_RUN_NOINST;
+      goto abort_calibration;
+    }
+
+#ifdef INTROSPECTION
+    if (unlikely(!q->bitsmap_size)) q->bitsmap_size = afl->bitsmap_size;
+#endif
+
+    if (cal_run_check(afl, q, afl->first_trace, &new_bits, &var_detected,
+                      from_queue)) {
+      afl->stage_max =
+          afl->afl_env.afl_cal_fast ? CAL_CYCLES : CAL_CYCLES_LONG;
+
+    } else if (!batch_cnt &&
+               cal_early_stop(afl, afl->stage_cur + 1, var_detected)) {
+      afl->stage_max = afl->stage_cur + 1;
+    }
+  }
+
+  if (unlikely(afl->fixed_seed)) {
+    diff_us = (u64)(afl->fsrv.exec_tmout - 1) * (u64)afl->stage_max;
+
+  } else {
+    stop_us = get_cur_time_us();
+    diff_us = stop_us - start_us;
+    if (unlikely(!diff_us)) { ++diff_us; }
+  }
+
+  fault = cal_results(afl, q, diff_us, afl->stage_max, handicap, first_run,
+                      new_bits, fault);
+  calibrated = 1;
+
+abort_calibration:
+
+  cal_wrap_up(afl, q, orig_mem, new_bits, var_detected, calibrated);
+
   afl->stage_name = old_sn;
   afl->stage_cur = old_sc;
   afl->stage_max = old_sm;
 
   if (!first_run) { show_stats(afl); }
 
+  phase_enter(afl, phase);
   return fault;
 }
 
+/* The calibration of a queue entry on a worker forkserver. */
+
+struct cal_job {
+  struct queue_entry *q;
+  u64                 start_us, /* when its current run started     */
+      done_us,                  /* and when that one finished       */
+      run_us;                   /* time all its runs took so far    */
+  u32 stage_cur, stage_max;
+  u8  new_bits, var_detected, first_run, running;
+};
+
+/* Note when the runs of the jobs finish. The results are only read once all
+   are done or their time is up, but the time taken is known this way. */
+
+static void cal_jobs_wait(afl_state_t *afl, struct cal_job *jobs, u32 n,
+                          u32 tmout) {
+  struct pollfd pfd[FSRV_WORKERS_MAX];
+  u32           idx[FSRV_WORKERS_MAX], cnt, i;
+
+  while (!afl->stop_soon) {
+    u64 now = get_cur_time_us(), deadline = 0;
+
+    for (cnt = i = 0; i < n; ++i) {
+      afl_forkserver_t *fsrv = &afl->workers[i].fsrv;
+
+      if (!jobs[i].running || jobs[i].done_us || fsrv->use_doorbell) {
+        continue;
+      }
+
+      pfd[cnt].fd = fsrv->fsrv_st_fd;
+      pfd[cnt].events = POLLIN;
+      idx[cnt++] = i;
+
+      u64 end = jobs[i].start_us + tmout * 1000ULL;
+      if (!deadline || end < deadline) { deadline = end; }
+    }
+
+    if (!cnt || now >= deadline) { return; }
+
+    int ret = poll(pfd, cnt, (deadline - now + 999) / 1000);
+    if (ret < 0 && errno != EINTR) { PFATAL("poll() failed"); }
+    if (ret < 0) { continue; }
+
+    now = get_cur_time_us();
+
+    for (i = 0; i < cnt; ++i) {
+      if (pfd[i].revents) { jobs[idx[i]].done_us = now; }
+    }
+  }
+}
+
+/* Calibrate qs[0..n-1], entries that were not run yet, at the same time,
+   qs[i] on worker forkserver i that has its content in its buf. Each round starts the next run of every entry
+   and then takes in the maps in order, so the outcome does not depend on
+   which run finishes first. res[i] gets what calibrate_case() would have
+   returned, or CAL_PENDING if calibrate_case() is to see to the entry, as
+   it is done for crashes and timeouts. */
+
+void calibrate_workers(afl_state_t *afl, struct queue_entry **qs, u8 *res,
+                       u32 n) {
+  struct cal_job jobs[FSRV_WORKERS_MAX];
+  u32            use_tmout = afl->fsrv.exec_tmout, active = n, i;
+
+  if (afl->resuming_fuzz) {
+    use_tmout = MAX(afl->fsrv.exec_tmout + CAL_TMOUT_ADD,
+                    afl->fsrv.exec_tmout * CAL_TMOUT_PERC / 100);
+  }
+
+  memset(jobs, 0, sizeof(jobs));
+
+  for (i = 0; i < n; ++i) {
+    struct fsrv_worker *w = &afl->workers[i];
+
+    w->cal_trace = afl_realloc((void **)&w->cal_trace, afl->fsrv.map_size);
+    if (unlikely(!w->cal_trace)) { PFATAL("alloc"); }
+
+    jobs[i].q = qs[i];
+    jobs[i].first_run = !qs[i]->exec_cksum;
+    jobs[i].stage_max = afl->afl_env.afl_cal_fast ? CAL_CYCLES_FAST : CAL_CYCLES;
+    ++qs[i]->cal_failed;
+    res[i] = CAL_PENDING;
+  }
+
+  while (active) {
+    for (i = 0; i < n; ++i) {
+      struct fsrv_worker *w = &afl->workers[i];
+
+      if (!jobs[i].q) { continue; }
+
+      afl_fsrv_write_to_testcase(&w->fsrv, w->buf, w->len);
+      w->fsrv.exec_tmout = use_tmout;
+      jobs[i].start_us = get_cur_time_us();
+      jobs[i].done_us = 0;
+      if (!afl_fsrv_run_start(&w->fsrv, &afl->stop_soon)) { return; }
+      jobs[i].running = 1;
+    }
+
+    cal_jobs_wait(afl, jobs, n, use_tmout);
+
+    for (i = 0; i < n; ++i) {
+      struct fsrv_worker *w = &afl->workers[i];
+      struct cal_job     *job = &jobs[i];
+      struct queue_entry *q = job->q;
+
+      if (!q) { continue; }
+
+      u64 elapsed_ms = (get_cur_time_us() - job->start_us) / 1000;
+      u32 timeout = elapsed_ms < use_tmout ? use_tmout - elapsed_ms : 1;
+      u8  phase = phase_enter(afl, PHASE_TARGET);
+      u8  fault = afl_fsrv_run_finish(&w->fsrv, timeout, &afl->stop_soon);
+
+      phase_enter(afl, phase);
+      buckets_check(afl, &w->fsrv);
+      job->running = 0;
+      job->run_us +=
+          (job->done_us ? job->done_us : get_cur_time_us()) - job->start_us;
+      ++afl->fsrv.total_execs;
+
+      if (afl->stop_soon) { return; }
+
+      afl->saved_main_map = afl->fsrv.trace_bits;
+      afl->fsrv.trace_bits = w->fsrv.trace_bits;
+      afl->fsrv.last_kill_signal = w->fsrv.last_kill_signal;
+
+      if (fault != afl->crash_mode) {
+        /* calibrate_case() runs it again and speaks up */
+
+        if (job->first_run) { q->exec_cksum = 0; }
+        --q->cal_failed;
+        cal_wrap_up(afl, q, w->buf, job->new_bits, job->var_detected, 0);
+        job->q = NULL;
+
+      } else if (!afl->non_instrumented_mode && !job->stage_cur &&
+                 !count_bytes(afl, afl->fsrv.trace_bits)) {
+        res[i] = FSRV_RUN_NOINST;
+        job->q = NULL;
+
+      } else {
+        if (cal_run_check(afl, q, w->cal_trace, &job->new_bits,
+                          &job->var_detected, 1)) {
+          job->stage_max =
+              afl->afl_env.afl_cal_fast ? CAL_CYCLES : CAL_CYCLES_LONG;
+
+        } else if (cal_early_stop(afl, job->stage_cur + 1,
+                                  job->var_detected)) {
+          job->stage_max = job->stage_cur + 1;
+        }
+
+        if (++job->stage_cur >= job->stage_max) {
+          u64 diff_us = job->run_us ? job->run_us : 1;
+
+          if (unlikely(afl->fixed_seed)) {
+            diff_us = (u64)(afl->fsrv.exec_tmout - 1) * (u64)job->stage_max;
+          }
+
+          res[i] = cal_results(afl, q, diff_us, job->stage_max, 0,
+                               job->first_run, job->new_bits, fault);
+          cal_wrap_up(afl, q, w->buf, job->new_bits, job->var_detected, 1);
+          job->q = NULL;
+        }
+      }
+
+      fsrv_main_map(afl);
+      if (!job->q) { --active; }
+    }
+  }
+}
+
+/* Append the queue entry id, stored in fn with len bytes, to the sync
+   manifest, with the classified map trace of its run if there was one. */
+
+void sync_manifest_add(afl_state_t *afl, u32 id, u8 *fn, u32 len,
+                       u8 *trace) {
+  struct sync_rec *rec;
+  u8              *name = strrchr(fn, '/'), *buf;
+  u32              name_len, size, cnt = 0, i, j = 0;
+
+  if (likely(afl->sync_manifest_fd < 0)) { return; }
+
+  if (trace) {
+    for (i = 0; i < afl->fsrv.map_size; ++i) {
+      if (trace[i]) { ++cnt; }
+    }
+
+    if (cnt > SYNC_MANIFEST_MAX_CNT) { cnt = 0; }
+  }
+
+  name = name ? name + 1 : fn;
+  name_len = MIN(strlen(name), (size_t)NAME_MAX);
+  size = SYNC_REC_SIZE(name_len, cnt);
+
+  buf = afl_realloc(AFL_BUF_PARAM(sync_manifest), size);
+  if (unlikely(!buf)) { PFATAL("alloc"); }
+  memset(buf, 0, size);
+
+  rec = (struct sync_rec *)buf;
+  rec->id = id;
+  rec->len = len;
+  rec->name_len = name_len;
+  rec->cnt = cnt;
+
+  if (cnt) {
+    u32 *offs = (u32 *)(buf + sizeof(struct sync_rec));
+    u8  *vals = (u8 *)(offs + cnt);
+
+    rec->exec_cksum = hash_trace(trace, afl->fsrv.map_size);
+
+    for (i = 0; i < afl->fsrv.map_size; ++i) {
+      if (trace[i]) {
+        offs[j] = i;
+        vals[j++] = trace[i];
+      }
+    }
+  }
+
+  memcpy(buf + sizeof(struct sync_rec) + cnt * 5, name, name_len);
+  rec->cksum = hash64(buf + sizeof(u64), size - sizeof(u64), HASH_CONST);
+
+  /* one write() per record, so peers see whole records or none */
+
+  if (unlikely(write(afl->sync_manifest_fd, buf, size) != (ssize_t)size)) {
+    WARNF("Unable to write the sync manifest, no longer updating it.");
+    close(afl->sync_manifest_fd);
+    afl->sync_manifest_fd = -1;
+  }
+}
+
+/* Run the test case path of the peer party and keep it if it is
+   interesting. Returns 1 if it's time to bail out. */
+
+static u8 sync_one(afl_state_t *afl, u8 *party, u8 *path) {
+  s32         fd;
+  struct stat st;
+
+  /* Allow this to fail in case the other fuzzer is resuming or so... */
+
+  fd = open(path, O_RDONLY);
+
+  if (fd < 0) { return 0; }
+
+  if (fstat(fd, &st)) { WARNF("fstat() failed"); }
+
+  /* Ignore zero-sized or oversized files. */
+
+  if (st.st_size && st.st_size <= afl->max_input) {
+    u8  fault;
+    u8 *mem = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (mem == MAP_FAILED) { PFATAL("Unable to mmap '%s'", path); }
+
+    if (unlikely(afl->replay)) {
+      replay_record_sync(afl, party, mem, st.st_size);
+    }
+
+    /* See what happens. We rely on save_if_interesting() to catch major
+       errors and save the test case. */
+
+    (void)write_to_testcase(afl, (void **)&mem, st.st_size, 1);
+
+    fault = fuzz_run_target(afl, &afl->fsrv, afl->fsrv.exec_tmout);
+
+    if (afl->stop_soon) {
+      munmap(mem, st.st_size);
+      close(fd);
+      return 1;
+    }
+
+    /* the peer may have kept custom mutator metadata for its entry */
+
+    if (unlikely(afl->custom_meta_cnt)) {
+      u8 *name = strrchr(path, '/');
+      afl->syncing_meta = alloc_printf("%.*s/.state/custom_meta%s",
+                                       (int)(name - path), path, name);
+    }
+
+    afl->syncing_party = party;
+    afl->queued_imported += save_if_interesting(afl, mem, st.st_size, fault);
+    afl->syncing_party = 0;
+
+    ck_free(afl->syncing_meta);
+    afl->syncing_meta = NULL;
+
+    munmap(mem, st.st_size);
+  }
+
+  close(fd);
+  return 0;
+}
+
+/* Whether the map bytes of rec, a record of a manifest for our target,
+   would add anything to virgin_bits. If not, running the entry is of no
+   use. */
+
+static u8 sync_rec_is_new(afl_state_t *afl, struct sync_rec *rec) {
+  u32 *offs = (u32 *)(rec + 1);
+  u8  *vals = (u8 *)(offs + rec->cnt);
+  u32  i;
+
+  for (i = 0; i < rec->cnt; ++i) {
+    if (unlikely(offs[i] >= afl->fsrv.map_size) ||
+        (afl->virgin_bits[offs[i]] & vals[i])) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* Sync the entries of party that are new since pos, going by the sync
+   manifest in its queue directory qd_path. Returns 0 if there is no usable
+   manifest, the queue directory is listed then. */
+
+static u8 sync_manifest(afl_state_t *afl, u8 *party, u8 *qd_path,
+                        struct sync_pos *pos) {
+  struct sync_manifest_hdr *hdr;
+  struct stat               st;
+  u8                        path[PATH_MAX + 1 + NAME_MAX];
+  u8                       *map;
+  u64                       off, len;
+  s32                       fd;
+  u8                        ret = 0, same_target;
+
+  snprintf(path, sizeof(path), "%s/.state/sync_manifest", qd_path);
+  fd = open(path, O_RDONLY);
+  if (fd < 0) { return 0; }
+
+  if (fstat(fd, &st) || st.st_size < (s64)sizeof(*hdr)) {
+    close(fd);
+    return 0;
+  }
+
+  len = st.st_size;
+  map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) { return 0; }
+
+  hdr = (struct sync_manifest_hdr *)map;
+  if (hdr->magic != SYNC_MANIFEST_MAGIC) { goto unmap; }
+
+  same_target = afl->sync_target && hdr->target == afl->sync_target &&
+                hdr->map_size == afl->fsrv.map_size && !afl->crash_mode;
+
+  /* a new session of the peer starts its manifest over */
+
+  if (hdr->session != pos->session || pos->off < sizeof(*hdr) ||
+      pos->off > len) {
+    pos->session = hdr->session;
+    pos->off = sizeof(*hdr);
+  }
+
+  off = pos->off;
+
+  while (off + sizeof(struct sync_rec) <= len) {
+    struct sync_rec *rec = (struct sync_rec *)(map + off);
+    u64              size = SYNC_REC_SIZE(rec->name_len, rec->cnt);
+
+    if (rec->name_len > NAME_MAX || rec->cnt > SYNC_MANIFEST_MAX_CNT) {
+      goto unmap;
+    }
+    if (off + size > len) { break; }  // still being written
+
+    if (rec->cksum !=
+        hash64(map + off + sizeof(u64), size - sizeof(u64), HASH_CONST)) {
+      /* not a record that was written in one piece, list the directory */
+
+      goto unmap;
+    }
+
+    if (rec->id >= pos->next_id) {
+      afl->syncing_case = rec->id;
+      pos->next_id = rec->id + 1;
+
+      if (rec->cnt && same_target && !sync_rec_is_new(afl, rec)) {
+        /* count the path as the run would have */
+
+        if (afl->schedule >= FAST && afl->schedule <= RARE) {
+          n_fuzz_hit(afl, rec->exec_cksum);
+        }
+
+        ++afl->sync_skipped;
+
+      } else if (rec->len && rec->len <= MAX_FILE) {
+        snprintf(path, sizeof(path), "%s/%.*s", qd_path, (int)rec->name_len,
+                 map + off + sizeof(struct sync_rec) + rec->cnt * 5);
+        if (sync_one(afl, party, path)) { break; }
+      }
+    }
+
+    off += size;
+  }
+
+  pos->off = off;
+  ret = 1;
+
+unmap:
+  munmap(map, len);
+  return ret;
+}
+
+/* Sync the entries of party by listing its queue directory qd_path, for
+   peers that keep no sync manifest. */
+
+static void sync_scan(afl_state_t *afl, u8 *party, u8 *qd_path,
+                      struct sync_pos *pos) {
+  struct dirent **namelist = NULL;
+  u8              path[PATH_MAX + 1 + NAME_MAX];
+  int             m = 0, n, o;
+
+  n = scandir(qd_path, &namelist, NULL, alphasort);
+
+  if (n < 1) {
+    if (namelist) free(namelist);
+    return;
+  }
+
+  /* For every file queued by this fuzzer, parse ID and see if we have
+     looked at it before; exec a test case if not. */
+
+  u8 entry[12];
+  sprintf(entry, "id:%06u", pos->next_id);
+
+  while (m < n) {
+    if (strncmp(namelist[m]->d_name, entry, 9)) {
+      m++;
+
+    } else {
+      break;
+    }
+  }
+
+  for (o = m; o < n; o++) {
+    snprintf(path, sizeof(path), "%s/%s", qd_path, namelist[o]->d_name);
+    afl->syncing_case = pos->next_id;
+    pos->next_id++;
+
+    if (sync_one(afl, party, path)) { break; }
+  }
+
+  for (m = 0; m < n; m++)
+    free(namelist[m]);
+  free(namelist);
+}
+
+struct sync_plan_item {
+  double weight;
+  u64    cksum;
+};
+
+static int sync_plan_by_name(const void *a, const void *b) {
+  return strcmp(*(u8 **)a, *(u8 **)b);
+}
+
+static int sync_plan_by_weight(const void *a, const void *b) {
+  double x = ((struct sync_plan_item *)a)->weight,
+         y = ((struct sync_plan_item *)b)->weight;
+
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static int sync_plan_by_cksum(const void *a, const void *b) {
+  u64 x = ((struct sync_plan_slot *)a)->cksum,
+      y = ((struct sync_plan_slot *)b)->cksum;
+
+  return x < y ? -1 : x > y;
+}
+
+/* As the main node, split the queue among the secondary nodes that are
+   alive and write it to sync_plan (AFL_SYNC_PLAN). */
+
+static void sync_plan_write(afl_state_t *afl) {
+  struct sync_plan_hdr   hdr;
+  struct sync_plan_item *items;
+  struct sync_plan_slot *slots;
+  struct dirent         *sd_ent;
+  struct stat            st;
+  DIR                   *sd;
+  double                *load;
+  u8                   **names = NULL, *names_buf, *fn, *tmp;
+  u32                    nodes = 0, cnt = 0, names_len = 0, i, j, best;
+  u64                    now = get_cur_time() / 1000;
+  s32                    fd;
+
+  sd = opendir(afl->sync_dir);
+  if (!sd) { return; }
+
+  while ((sd_ent = readdir(sd))) {
+    if (sd_ent->d_name[0] == '.' || !strcmp(afl->sync_id, sd_ent->d_name)) {
+      continue;
+    }
+
+    fn = alloc_printf("%s/%s/fuzzer_stats", afl->sync_dir, sd_ent->d_name);
+
+    if (!stat(fn, &st) && (u64)st.st_mtime + SYNC_PLAN_ALIVE_SEC >= now) {
+      names = ck_realloc(names, (nodes + 1) * sizeof(u8 *));
+      names[nodes++] = ck_strdup(sd_ent->d_name);
+      names_len += strlen(sd_ent->d_name) + 1;
+    }
+
+    ck_free(fn);
+  }
+
+  closedir(sd);
+
+  fn = alloc_printf("%s/sync_plan", afl->out_dir);
+
+  if (!nodes) {
+    unlink(fn);
+    ck_free(fn);
+    return;
+  }
+
+  qsort(names, nodes, sizeof(u8 *), sync_plan_by_name);
+
+  names_len = (names_len + 7) & ~7;
+  names_buf = ck_alloc(names_len);
+
+  for (i = 0, j = 0; i < nodes; ++i) {
+    u32 len = strlen(names[i]) + 1;
+
+    memcpy(names_buf + j, names[i], len);
+    j += len;
+    ck_free(names[i]);
+  }
+
+  ck_free(names);
+
+  /* heaviest first, each to the node with the least weight so far */
+
+  items = ck_alloc((afl->queued_items + 1) * sizeof(*items));
+
+  for (i = 0; i < afl->queued_items; ++i) {
+    struct queue_entry *q = afl->queue_buf[i];
+
+    if (q->disabled || !q->exec_cksum) { continue; }
+
+    items[cnt].weight = i < afl->weight_items ? afl->weight_leaf[i] : 1;
+    items[cnt++].cksum = q->exec_cksum;
+  }
+
+  qsort(items, cnt, sizeof(*items), sync_plan_by_weight);
+
+  load = ck_alloc(nodes * sizeof(double));
+  slots = ck_alloc((cnt + 1) * sizeof(*slots));
+
+  for (i = 0; i < cnt; ++i) {
+    for (best = 0, j = 1; j < nodes; ++j) {
+      if (load[j] < load[best]) { best = j; }
+    }
+
+    load[best] += items[i].weight;
+    slots[i].cksum = items[i].cksum;
+    slots[i].node = best;
+  }
+
+  qsort(slots, cnt, sizeof(*slots), sync_plan_by_cksum);
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = SYNC_PLAN_MAGIC;
+  hdr.nodes = nodes;
+  hdr.target = afl->sync_target;
+  hdr.names_len = names_len;
+  hdr.cnt = cnt;
+
+  /* secondaries must never see it half written */
+
+  tmp = alloc_printf("%s/.sync_plan.tmp", afl->out_dir);
+  fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, DEFAULT_PERMISSION);
+  if (fd < 0) { PFATAL("Unable to create '%s'", tmp); }
+
+  ck_write(fd, &hdr, sizeof(hdr), tmp);
+  ck_write(fd, names_buf, names_len, tmp);
+  ck_write(fd, slots, cnt * sizeof(*slots), tmp);
+  close(fd);
+
+  if (rename(tmp, fn)) { PFATAL("Unable to rename '%s'", tmp); }
+
+  ck_free(tmp);
+  ck_free(fn);
+  ck_free(names_buf);
+  ck_free(items);
+  ck_free(load);
+  ck_free(slots);
+}
+
+/* As a secondary node, mark the queue entries the sync_plan of the main
+   node gives us, and weigh them so that about SYNC_PLAN_PREFER percent of
+   the selections go to them. */
+
+static void sync_plan_read(afl_state_t *afl, u8 *main_name) {
+  struct sync_plan_hdr  *hdr;
+  struct sync_plan_slot *slots = NULL;
+  struct stat            st;
+  u8                    *fn, *buf = NULL, *names;
+  u32                    i, me, share = 0;
+  s32                    fd, node = -1;
+  double                 boost = 1;
+  u8                     changed = 0;
+
+  fn = alloc_printf("%s/%s/sync_plan", afl->sync_dir, main_name);
+  fd = open(fn, O_RDONLY);
+  ck_free(fn);
+
+  if (fd >= 0 && !fstat(fd, &st) && st.st_size >= (s64)sizeof(*hdr)) {
+    buf = ck_alloc(st.st_size);
+
+    if (read(fd, buf, st.st_size) != st.st_size) {
+      ck_free(buf);
+      buf = NULL;
+    }
+  }
+
+  if (fd >= 0) { close(fd); }
+
+  hdr = (struct sync_plan_hdr *)buf;
+
+  if (buf && hdr->magic == SYNC_PLAN_MAGIC &&
+      hdr->target == afl->sync_target && hdr->nodes && !(hdr->names_len % 8) &&
+      (u64)st.st_size == sizeof(*hdr) + (u64)hdr->names_len +
+                             (u64)hdr->cnt * sizeof(*slots)) {
+    names = buf + sizeof(*hdr);
+    slots = (struct sync_plan_slot *)(names + hdr->names_len);
+
+    for (i = 0, me = 0; i < hdr->names_len && me < hdr->nodes; ++me) {
+      u8 *name = names + i;
+
+      if (!memchr(name, 0, hdr->names_len - i)) { break; }
+      if (!strcmp(name, afl->sync_id)) { node = me; }
+
+      i += strlen(name) + 1;
+    }
+
+    if (hdr->nodes > 1) {
+      boost = (double)(hdr->nodes - 1) * SYNC_PLAN_PREFER /
+              (100 - SYNC_PLAN_PREFER);
+    }
+  }
+
+  for (i = 0; i < afl->queued_items; ++i) {
+    struct queue_entry *q = afl->queue_buf[i];
+    u8                  mine = 0;
+
+    if (node >= 0) {
+      u32 lo = 0, hi = hdr->cnt;
+
+      while (lo < hi) {
+        u32 mid = lo + (hi - lo) / 2;
+
+        if (slots[mid].cksum < q->exec_cksum) {
+          lo = mid + 1;
+
+        } else {
+          hi = mid;
+        }
+      }
+
+      mine = lo < hdr->cnt && slots[lo].cksum == q->exec_cksum &&
+             slots[lo].node == (u32)node;
+    }
+
+    if (q->plan_share != mine) {
+      q->plan_share = mine;
+      changed = 1;
+    }
+
+    share += mine;
+  }
+
+  if (changed || boost != afl->sync_plan_boost) { afl->reinit_table = 1; }
+
+  afl->sync_plan_boost = boost;
+  afl->sync_plan_share = share;
+
+  ck_free(buf);
+}
+
 /* Grab interesting test cases from other fuzzers. */
 
 void sync_fuzzers(afl_state_t *afl) {
@@ -532,6 +1729,15 @@ void sync_fuzzers(afl_state_t *afl) {
   struct dirent *sd_ent;
   u32            sync_cnt = 0, synced = 0, entries = 0;
   u8             path[PATH_MAX + 1 + NAME_MAX];
+  u8             main_name[NAME_MAX + 1] = "";
+  u64            start_us = unlikely(afl->metrics) ? get_cur_time_us() : 0;
+  u8             phase;
+
+  /* AFL_REPLAY imports what was synced when it was recorded instead */
+
+  if (unlikely(afl->afl_env.afl_replay)) { return; }
+
+  phase = phase_enter(afl, PHASE_SYNC);
 
   sd = opendir(afl->sync_dir);
   if (!sd) { PFATAL("Unable to open '%s'", afl->sync_dir); }
@@ -543,8 +1749,9 @@ void sync_fuzzers(afl_state_t *afl) {
    */
 
   while ((sd_ent = readdir(sd))) {
-    u8  qd_synced_path[PATH_MAX], qd_path[PATH_MAX];
-    u32 min_accept = 0, next_min_accept = 0;
+    u8              qd_synced_path[PATH_MAX], qd_path[PATH_MAX];
+    struct sync_pos pos, last;
+    struct stat     st;
 
     s32 id_fd;
 
@@ -560,6 +1767,10 @@ void sync_fuzzers(afl_state_t *afl) {
     if (likely(afl->is_secondary_node)) {
       sprintf(qd_path, "%s/%s/is_main_node", afl->sync_dir, sd_ent->d_name);
       int res = access(qd_path, F_OK);
+      if (res == 0) {
+        snprintf(main_name, sizeof(main_name), "%s", sd_ent->d_name);
+      }
+
       if (unlikely(afl->is_main_node)) {  // an elected temporary main node
 
         if (likely(res == 0)) {  // there is another main node? downgrade.
@@ -587,17 +1798,10 @@ void sync_fuzzers(afl_state_t *afl) {
 
     sprintf(qd_path, "%s/%s/queue", afl->sync_dir, sd_ent->d_name);
 
-    struct dirent **namelist = NULL;
-    int             m = 0, n, o;
-
-    n = scandir(qd_path, &namelist, NULL, alphasort);
-
-    if (n < 1) {
-      if (namelist) free(namelist);
-      continue;
-    }
+    if (stat(qd_path, &st) || !S_ISDIR(st.st_mode)) { continue; }
 
-    /* Retrieve the ID of the last seen test case. */
+    /* Retrieve the ID of the last seen test case, and how far the manifest
+       was read. */
 
     sprintf(qd_synced_path, "%s/.synced/%s", afl->out_dir, sd_ent->d_name);
 
@@ -605,11 +1809,13 @@ void sync_fuzzers(afl_state_t *afl) {
 
     if (id_fd < 0) { PFATAL("Unable to create '%s'", qd_synced_path); }
 
-    if (read(id_fd, &min_accept, sizeof(u32)) == sizeof(u32)) {
-      next_min_accept = min_accept;
-      lseek(id_fd, 0, SEEK_SET);
+    memset(&pos, 0, sizeof(pos));
+    if (read(id_fd, &pos, sizeof(pos)) < (ssize_t)sizeof(u32)) {
+      memset(&pos, 0, sizeof(pos));
     }
 
+    last = pos;
+
     /* Show stats */
 
     snprintf(afl->stage_name_buf, STAGE_BUF_SIZE, "sync %u", ++sync_cnt);
@@ -618,75 +1824,16 @@ void sync_fuzzers(afl_state_t *afl) {
     afl->stage_cur = 0;
     afl->stage_max = 0;
 
-    /* For every file queued by this fuzzer, parse ID and see if we have
-       looked at it before; exec a test case if not. */
-
-    u8 entry[12];
-    sprintf(entry, "id:%06u", next_min_accept);
-
-    while (m < n) {
-      if (strncmp(namelist[m]->d_name, entry, 9)) {
-        m++;
-
-      } else {
-        break;
-      }
+    if (!sync_manifest(afl, sd_ent->d_name, qd_path, &pos)) {
+      sync_scan(afl, sd_ent->d_name, qd_path, &pos);
     }
 
-    if (m >= n) { goto close_sync; }  // nothing new
-
-    for (o = m; o < n; o++) {
-      s32         fd;
-      struct stat st;
-
-      snprintf(path, sizeof(path), "%s/%s", qd_path, namelist[o]->d_name);
-      afl->syncing_case = next_min_accept;
-      next_min_accept++;
-
-      /* Allow this to fail in case the other fuzzer is resuming or so... */
-
-      fd = open(path, O_RDONLY);
-
-      if (fd < 0) { continue; }
-
-      if (fstat(fd, &st)) { WARNF("fstat() failed"); }
-
-      /* Ignore zero-sized or oversized files. */
-
-      if (st.st_size && st.st_size <= MAX_FILE) {
-        u8  fault;
-        u8 *mem = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-
-        if (mem == MAP_FAILED) { PFATAL("Unable to mmap '%s'", path); }
-
-        /* See what happens. We rely on save_if_interesting() to catch major
-           errors and save the test case. */
-
-        (void)write_to_testcase(afl, (void **)&mem, st.st_size, 1);
-
-        fault = fuzz_run_target(afl, &afl->fsrv, afl->fsrv.exec_tmout);
-
-        if (afl->stop_soon) { goto close_sync; }
-
-        afl->syncing_party = sd_ent->d_name;
-        afl->queued_imported +=
-            save_if_interesting(afl, mem, st.st_size, fault);
-        afl->syncing_party = 0;
-
-        munmap(mem, st.st_size);
-      }
-
-      close(fd);
+    if (!afl->stop_soon && memcmp(&pos, &last, sizeof(pos))) {
+      lseek(id_fd, 0, SEEK_SET);
+      ck_write(id_fd, &pos, sizeof(pos), qd_synced_path);
     }
 
-    ck_write(id_fd, &next_min_accept, sizeof(u32), qd_synced_path);
-
-  close_sync:
     close(id_fd);
-    if (n > 0)
-      for (m = 0; m < n; m++)
-        free(namelist[m]);
-    free(namelist);
   }
 
   closedir(sd);
@@ -707,17 +1854,114 @@ void sync_fuzzers(afl_state_t *afl) {
 
   if (afl->foreign_sync_cnt) read_foreign_testcases(afl, 0);
 
+  if (unlikely(afl->afl_env.afl_sync_plan)) {
+    if (afl->is_main_node) {
+      sync_plan_write(afl);
+
+    } else if (main_name[0]) {
+      sync_plan_read(afl, main_name);
+    }
+  }
+
   afl->last_sync_time = get_cur_time();
   afl->last_sync_cycle = afl->queue_cycle;
+
+  if (unlikely(afl->metrics)) {
+    metrics_observe(afl->metrics->sync_hist, &afl->metrics->sync_sum_us,
+                    get_cur_time_us() - start_us, METRICS_SYNC_BASE);
+  }
+
+  phase_enter(afl, phase);
 }
 
 /* Trim all new test cases to save cycles when doing deterministic checks. The
    trimmer uses power-of-two increments somewhere between 1/16 and 1/1024 of
    file size, to keep the stage short and sweet. */
 
+/* Did the trim of the mother of q already keep the n bytes at pos? A havoc
+   find starts with the bytes before and after what havoc changed of its
+   trimmed mother (see add_to_queue()), those were not removable there. */
+
+static inline u8 trim_inherited(struct queue_entry *q, u32 pos, u32 n) {
+  return pos + n <= q->trim_pre || pos >= q->len - q->trim_suf;
+}
+
+/* Remove the n bytes at pos from in_buf, the input of q. */
+
+static void trim_remove(struct queue_entry *q, u8 *in_buf, u32 pos, u32 n) {
+  memmove(in_buf + pos, in_buf + pos + n, q->len - pos - n);
+
+  q->trim_pre = MIN(q->trim_pre, pos);
+  q->trim_suf = MIN(q->trim_suf, q->len - pos - n);
+  q->len -= n;
+}
+
+/* Try removing the chunks of remove_len bytes at *remove_pos onwards in one
+   testcase batch (FS_OPT_BATCH), as if each was the only change. The first
+   one that keeps the trace is removed and *remove_pos stays, the others are
+   tried again with the new input. Otherwise *remove_pos moves past all of
+   them. Returns whether one was removed. */
+
+static u8 trim_batch(afl_state_t *afl, struct queue_entry *q, u8 *in_buf,
+                     u32 *remove_pos, u32 remove_len, u8 *fault) {
+  u32 pos[FS_BATCH_MAX], cnt = 0, p = *remove_pos, done, i;
+  u64 cksum;
+
+  u8 *buf = afl_realloc(AFL_BUF_PARAM(out_scratch), q->len);
+  if (unlikely(!buf)) { PFATAL("alloc"); }
+
+  fsrv_main_ready(afl);
+
+  for (; p < q->len && cnt < FS_BATCH_MAX; p += remove_len) {
+    u32 n = MIN(remove_len, q->len - p);
+
+    if (trim_inherited(q, p, n)) { continue; }
+
+    memcpy(buf, in_buf, p);
+    memcpy(buf + p, in_buf + p + n, q->len - p - n);
+    if (!afl_fsrv_batch_add(&afl->fsrv, buf, q->len - n)) { break; }
+
+    pos[cnt++] = p;
+  }
+
+  if (!cnt) {
+    *remove_pos = p;
+    return 0;
+  }
+
+  u8 phase = phase_enter(afl, PHASE_TARGET);
+  *fault = afl_fsrv_run_batch(&afl->fsrv, afl->fsrv.exec_tmout, &afl->stop_soon);
+  phase_enter(afl, phase);
+  if (afl->stop_soon || *fault == FSRV_RUN_ERROR) { return 0; }
+
+  done = afl->fsrv.batch_done;
+
+  for (i = 0; i < done; ++i) {
+    afl_fsrv_batch_trace(&afl->fsrv, i);
+
+    ++afl->trim_execs;
+    ++afl->stage_cur;
+    classify_counts(&afl->fsrv);
+    cksum = hash_trace_bits(&afl->fsrv);
+
+    if (cksum == q->exec_cksum) {
+      trim_remove(q, in_buf, pos[i], MIN(remove_len, q->len - pos[i]));
+      *remove_pos = pos[i];
+      return 1;
+    }
+  }
+
+  *remove_pos = done == cnt ? p : pos[done - 1] + remove_len;
+  return 0;
+}
+
 u8 trim_case(afl_state_t *afl, struct queue_entry *q, u8 *in_buf) {
   u32 orig_len = q->len;
 
+  /* large inputs (AFL_LARGE_INPUTS) stay as they are, their file is mapped */
+
+  if (unlikely(orig_len > MAX_FILE)) { return 0; }
+
   /* Custom mutator trimmer */
   if (afl->custom_mutators_count) {
     u8   trimmed_case = 0;
@@ -734,24 +1978,73 @@ u8 trim_case(afl_state_t *afl, struct queue_entry *q, u8 *in_buf) {
       queue_testcase_retake(afl, q, orig_len);
     }
 
-    if (custom_trimmed) return trimmed_case;
-  }
+    if (custom_trimmed) return trimmed_case;
+  }
+
+  u8  needs_write = 0, fault = 0,
+     use_batch = afl->fsrv.use_batch && !afl->custom_mutators_count;
+  u32 trim_exec = 0;
+  u32 remove_len;
+  u32 len_p2;
+
+  u8 val_bufs[2][STRINGIFY_VAL_SIZE_MAX];
+
+  /* Although the trimmer will be less useful when variable behavior is
+     detected, it will still work to some extent, so we don't check for
+     this. */
+
+  if (unlikely(q->len < 5)) { return 0; }
+
+  afl->stage_name = afl->stage_name_buf;
+  afl->bytes_trim_in += q->len;
+
+  /* With field hints, first try to drop whole fields. They are tried back to
+     front so that the offsets of the ones still to come stay valid, and a
+     field that reaches into one dropped already is not tried. */
+
+  if (unlikely(q->hints_cnt)) {
+    u32 limit = q->len, i = q->hints_cnt;
+
+    sprintf(afl->stage_name_buf, "trim fields");
+
+    afl->stage_cur = 0;
+    afl->stage_max = q->hints_cnt;
+
+    while (i--) {
+      struct fs_hint *h = &q->hints[i];
+      u64             cksum;
+
+      ++afl->stage_cur;
+      if (h->off + h->len > limit || h->len >= q->len ||
+          trim_inherited(q, h->off, h->len)) {
+        continue;
+      }
+
+      write_with_gap(afl, in_buf, q->len, h->off, h->len);
+
+      fault = fuzz_run_target(afl, &afl->fsrv, afl->fsrv.exec_tmout);
+
+      if (afl->stop_soon || fault == FSRV_RUN_ERROR) { goto abort_trimming; }
 
-  u8  needs_write = 0, fault = 0;
-  u32 trim_exec = 0;
-  u32 remove_len;
-  u32 len_p2;
+      ++afl->trim_execs;
+      classify_counts(&afl->fsrv);
+      cksum = hash_trace_bits(&afl->fsrv);
 
-  u8 val_bufs[2][STRINGIFY_VAL_SIZE_MAX];
+      if (cksum == q->exec_cksum) {
+        trim_remove(q, in_buf, h->off, h->len);
+        limit = h->off;
 
-  /* Although the trimmer will be less useful when variable behavior is
-     detected, it will still work to some extent, so we don't check for
-     this. */
+        if (!needs_write) {
+          needs_write = 1;
+          memcpy(afl->clean_trace, afl->fsrv.trace_bits, afl->fsrv.map_size);
+        }
+      }
 
-  if (unlikely(q->len < 5)) { return 0; }
+      if (!(trim_exec++ % afl->stats_update_freq)) { show_stats(afl); }
+    }
 
-  afl->stage_name = afl->stage_name_buf;
-  afl->bytes_trim_in += q->len;
+    if (unlikely(q->len < 5)) { goto trimming_done; }
+  }
 
   /* Select initial chunk len, starting with large steps. */
 
@@ -776,6 +2069,28 @@ u8 trim_case(afl_state_t *afl, struct queue_entry *q, u8 *in_buf) {
       u32 trim_avail = MIN(remove_len, q->len - remove_pos);
       u64 cksum;
 
+      if (trim_inherited(q, remove_pos, trim_avail)) {
+        remove_pos += remove_len;
+        ++afl->stage_cur;
+        continue;
+      }
+
+      if (use_batch) {
+        if (trim_batch(afl, q, in_buf, &remove_pos, remove_len, &fault)) {
+          len_p2 = next_pow2(q->len);
+
+          if (!needs_write) {
+            needs_write = 1;
+            memcpy(afl->clean_trace, afl->fsrv.trace_bits, afl->fsrv.map_size);
+          }
+        }
+
+        if (afl->stop_soon || fault == FSRV_RUN_ERROR) { goto abort_trimming; }
+
+        if (!(trim_exec++ % afl->stats_update_freq)) { show_stats(afl); }
+        continue;
+      }
+
       write_with_gap(afl, in_buf, q->len, remove_pos, trim_avail);
 
       fault = fuzz_run_target(afl, &afl->fsrv, afl->fsrv.exec_tmout);
@@ -787,7 +2102,7 @@ u8 trim_case(afl_state_t *afl, struct queue_entry *q, u8 *in_buf) {
 
       ++afl->trim_execs;
       classify_counts(&afl->fsrv);
-      cksum = hash64(afl->fsrv.trace_bits, afl->fsrv.map_size, HASH_CONST);
+      cksum = hash_trace_bits(&afl->fsrv);
 
       /* If the deletion had no impact on the trace, make it permanent. This
          isn't perfect for variable-path inputs, but we're just making a
@@ -795,14 +2110,9 @@ u8 trim_case(afl_state_t *afl, struct queue_entry *q, u8 *in_buf) {
          negatives every now and then. */
 
       if (cksum == q->exec_cksum) {
-        u32 move_tail = q->len - remove_pos - trim_avail;
-
-        q->len -= trim_avail;
+        trim_remove(q, in_buf, remove_pos, trim_avail);
         len_p2 = next_pow2(q->len);
 
-        memmove(in_buf + remove_pos, in_buf + remove_pos + trim_avail,
-                move_tail);
-
         /* Let's save a clean trace, which will be needed by
            update_bitmap_score once we're done with the trimming stuff. */
 
@@ -824,13 +2134,19 @@ u8 trim_case(afl_state_t *afl, struct queue_entry *q, u8 *in_buf) {
     remove_len >>= 1;
   }
 
+trimming_done:
+
   /* If we have made changes to in_buf, we also need to update the on-disk
      version of the test case. */
 
   if (needs_write) {
     s32 fd;
 
-    if (unlikely(afl->no_unlink)) {
+    queue_file_wait(afl, q);
+
+    /* a streamed seed is replaced, never written through its symlink */
+
+    if (unlikely(afl->no_unlink) && !q->seed_link) {
       fd = open(q->fname, O_WRONLY | O_CREAT | O_TRUNC, DEFAULT_PERMISSION);
 
       if (fd < 0) { PFATAL("Unable to create '%s'", q->fname); }
@@ -841,20 +2157,33 @@ u8 trim_case(afl_state_t *afl, struct queue_entry *q, u8 *in_buf) {
         if (result > 0) written += result;
       }
 
+      close(fd);
+
     } else {
       unlink(q->fname); /* ignore errors */
-      fd = open(q->fname, O_WRONLY | O_CREAT | O_EXCL, DEFAULT_PERMISSION);
+      q->write_seq = write_queue_file(afl, q->fname, in_buf, q->len);
+      q->seed_link = 0;
+    }
 
-      if (fd < 0) { PFATAL("Unable to create '%s'", q->fname); }
+    memcpy(afl->fsrv.trace_bits, afl->clean_trace, afl->fsrv.map_size);
+    afl->fsrv.reset_full_map = true;
 
-      ck_write(fd, in_buf, q->len, q->fname);
-    }
+    custom_meta_update(afl, q, in_buf);
 
-    close(fd);
+    /* in_buf may be moved by the testcase cache below */
+    cal_index_add(afl, q, in_buf);
 
     queue_testcase_retake_mem(afl, q, in_buf, q->len, orig_len);
 
-    memcpy(afl->fsrv.trace_bits, afl->clean_trace, afl->fsrv.map_size);
+    /* what was known about the bytes is of no use for the new input */
+    if (q->byte_imp) {
+      ck_free(q->byte_imp);
+      q->byte_imp = NULL;
+    }
+
+    if (q->hints) { hints_free(q); }
+    if (q->cksum_done) { cksum_free(q); }
+
     update_bitmap_score(afl, q);
   }
 
@@ -864,20 +2193,11 @@ abort_trimming:
   return fault;
 }
 
-/* Write a modified test case, run program, process results. Handle
-   error conditions, returning 1 if it's time to bail out. This is
-   a helper function for fuzz_one(). */
+/* Process the result of running out_buf. Handle error conditions, returning 1
+   if it's time to bail out. */
 
 u8 __attribute__((hot))
-common_fuzz_stuff(afl_state_t *afl, u8 *out_buf, u32 len) {
-  u8 fault;
-
-  if (unlikely(len = write_to_testcase(afl, (void **)&out_buf, len, 0)) == 0) {
-    return 0;
-  }
-
-  fault = fuzz_run_target(afl, &afl->fsrv, afl->fsrv.exec_tmout);
-
+common_fuzz_result(afl_state_t *afl, u8 *out_buf, u32 len, u8 fault) {
   if (afl->stop_soon) { return 1; }
 
   if (fault == FSRV_RUN_TMOUT) {
@@ -901,7 +2221,11 @@ common_fuzz_stuff(afl_state_t *afl, u8 *out_buf, u32 len) {
 
   /* This handles FAULT_ERROR for us: */
 
+  u8 phase = phase_enter(afl, PHASE_POSTPROC);
   afl->queued_discovered += save_if_interesting(afl, out_buf, len, fault);
+  phase_enter(afl, phase);
+
+  if (unlikely(afl->hang_check)) { hang_check_poll(afl); }
 
   if (!(afl->stage_cur % afl->stats_update_freq) ||
       afl->stage_cur + 1 == afl->stage_max) {
@@ -910,3 +2234,497 @@ common_fuzz_stuff(afl_state_t *afl, u8 *out_buf, u32 len) {
 
   return 0;
 }
+
+/* Look after the spare forkserver of AFL_HANG_CHECK_ASYNC: once the suspect
+   it runs is done, or out of time, hand the outcome to hang_check_done() and
+   start the next one. Unless wait is set this returns at once while the run
+   goes on. The run is waited for without stop_soon, it ends within
+   hang_tmout anyway, and the status of the spare forkserver is always read
+   so that the suspects of a stopping instance can still be run. */
+
+static void hang_check_step(afl_state_t *afl, u8 wait) {
+  static volatile u8  no_stop;
+  struct hang_check  *hc = afl->hang_check;
+  struct fsrv_worker *w = &hc->w;
+  u64                 elapsed_ms;
+  u32                 timeout;
+  u8                  fault, phase;
+
+  if (likely(!hc->cnt)) { return; }
+
+  if (w->busy) {
+    elapsed_ms = (get_cur_time_us() - w->start_us) / 1000;
+
+    if (!wait && elapsed_ms < afl->hang_tmout &&
+        !afl_fsrv_run_done(&w->fsrv)) {
+      return;
+    }
+
+    timeout = elapsed_ms < afl->hang_tmout ? afl->hang_tmout - elapsed_ms : 1;
+    phase = phase_enter(afl, PHASE_TARGET);
+    fault = afl_fsrv_run_finish(&w->fsrv, timeout, &no_stop);
+    phase_enter(afl, phase);
+    buckets_check(afl, &w->fsrv);
+    w->busy = 0;
+    ++afl->fsrv.total_execs;
+
+    if (unlikely(afl->tmout_hist)) {
+      tmout_run(afl, &w->fsrv, afl->hang_tmout, fault, w->start_us);
+    }
+
+    hang_check_done(afl, &hc->q[hc->head], fault);
+
+    hc->head = (hc->head + 1) % HANG_CHECK_QUEUE;
+    if (!--hc->cnt) { return; }
+  }
+
+  afl_fsrv_write_to_testcase(&w->fsrv, hc->q[hc->head].buf,
+                             hc->q[hc->head].len);
+  w->fsrv.exec_tmout = afl->hang_tmout;
+  w->start_us = get_cur_time_us();
+  if (!afl_fsrv_run_start(&w->fsrv, &afl->stop_soon)) { return; }
+  w->busy = 1;
+}
+
+/* Between execs, see hang_check_step(). */
+
+void hang_check_poll(afl_state_t *afl) {
+  hang_check_step(afl, 0);
+}
+
+/* When fuzzing stops: run the suspects still queued or running, so that
+   their hangs are saved too. */
+
+void hang_check_drain(afl_state_t *afl) {
+  struct hang_check *hc = afl->hang_check;
+
+  if (hc->cnt && !hc->w.busy) { hang_check_step(afl, 0); }
+
+  while (hc->cnt && hc->w.busy) {
+    hang_check_step(afl, 1);
+  }
+}
+
+/* Persistent loop count tuning (AFL_PERSISTENT_TUNE). Now and then a stable
+   queue entry is run as the last iteration of a persistent child and then as
+   the first one of the next child. If the coverage differs, the target leaked
+   state from earlier iterations and the loop count is halved, otherwise it
+   is doubled after LOOP_TUNE_CLEAN clean checks, staying below the lowest
+   count that ever leaked. */
+
+static void loop_tune_set(afl_state_t *afl, u32 cnt) {
+  afl->loop_tune_cnt = cnt;
+  afl->fsrv.doorbell->loop_cnt = cnt;
+
+  for (u32 i = 0; i < afl->workers_cnt; ++i) {
+    if (afl->workers[i].fsrv.use_doorbell) {
+      afl->workers[i].fsrv.doorbell->loop_cnt = cnt;
+    }
+  }
+}
+
+/* Pick the reference input, 0 if there is none (yet). */
+
+static u8 loop_tune_init(afl_state_t *afl) {
+  struct queue_entry *q = NULL;
+  u32                 i;
+  s32                 fd;
+
+  if (!afl->fsrv.doorbell->loop_max) { return 0; }
+
+  for (i = 0; i < afl->queued_items; ++i) {
+    q = afl->queue_buf[i];
+    if (!q->var_behavior && !q->disabled && q->len) { break; }
+  }
+
+  if (i == afl->queued_items) { return 0; }
+
+  queue_file_wait(afl, q);
+  fd = open(q->fname, O_RDONLY);
+  if (fd < 0) { PFATAL("Unable to open '%s'", q->fname); }
+  afl->loop_tune_buf = ck_alloc(q->len);
+  ck_read(fd, afl->loop_tune_buf, q->len, q->fname);
+  close(fd);
+
+  afl->loop_tune_len = q->len;
+  afl->loop_tune_next = 0;
+  loop_tune_set(afl, afl->fsrv.doorbell->loop_max);
+
+  return 1;
+}
+
+/* Run the reference input, returns the result and the trace checksum. */
+
+static u8 loop_tune_run(afl_state_t *afl, u64 *cksum) {
+  u8 fault;
+
+  afl_fsrv_write_to_testcase(&afl->fsrv, afl->loop_tune_buf,
+                             afl->loop_tune_len);
+  fault = fuzz_run_target(afl, &afl->fsrv, afl->fsrv.exec_tmout);
+
+  classify_counts(&afl->fsrv);
+  *cksum = hash_trace_bits(&afl->fsrv);
+
+  return fault;
+}
+
+static void loop_tune(afl_state_t *afl) {
+  u64 deep, fresh;
+  u8  deep_fault;
+  u32 deep_iter;
+
+  afl->loop_tune_at = afl->fsrv.total_execs + LOOP_TUNE_INTERVAL;
+
+  if (unlikely(!afl->loop_tune_cnt)) {
+    if (!loop_tune_init(afl)) { return; }
+  }
+
+  /* wait for the last iteration of the current child */
+
+  if (afl->loop_tune_next + 1 < afl->loop_tune_cnt) {
+    afl->loop_tune_at = afl->fsrv.total_execs + 1;
+    return;
+  }
+
+  /* the runs must have been the last and the first one of a child */
+
+  deep_fault = loop_tune_run(afl, &deep);
+  deep_iter = afl->fsrv.doorbell->loop_iter;
+
+  if (loop_tune_run(afl, &fresh) != FSRV_RUN_OK ||
+      afl->fsrv.doorbell->loop_iter != 1 ||
+      (deep_fault == FSRV_RUN_OK && deep_iter != afl->loop_tune_cnt) ||
+      afl->stop_soon) {
+    return;
+  }
+
+  if (afl->loop_tune_cksum && fresh != afl->loop_tune_cksum) {
+    /* the reference input is not deterministic after all, give up */
+
+    loop_tune_set(afl, 0);
+    afl->afl_env.afl_persistent_tune = 0;
+    return;
+  }
+
+  afl->loop_tune_cksum = fresh;
+
+  if (deep_fault != FSRV_RUN_OK || deep != fresh) {
+    ++afl->state_leaks;
+    afl->loop_tune_bad = afl->loop_tune_cnt;
+    afl->loop_tune_clean = 0;
+    loop_tune_set(afl, MAX(afl->loop_tune_cnt / 2, 1U));
+
+  } else if (++afl->loop_tune_clean >= LOOP_TUNE_CLEAN) {
+    u64 cnt = (u64)afl->loop_tune_cnt * 2;
+
+    if (afl->loop_tune_bad && cnt >= afl->loop_tune_bad) {
+      cnt = ((u64)afl->loop_tune_cnt + afl->loop_tune_bad) / 2;
+    }
+
+    afl->loop_tune_clean = 0;
+    if (cnt > afl->loop_tune_cnt && cnt <= LOOP_TUNE_MAX) {
+      loop_tune_set(afl, cnt);
+    }
+  }
+}
+
+/* If AFL_PC_FILTER_FILE changed since the last look, have the forkservers
+   that can reload it do so with their next run. Coverage that was already
+   found is kept, the new filter only changes what is found from now on. */
+
+void pc_filter_check(afl_state_t *afl) {
+  struct stat st;
+  u32         i;
+
+  if (!afl->afl_env.afl_pc_filter_file ||
+      stat(afl->afl_env.afl_pc_filter_file, &st) || !st.st_size) {
+    return;
+  }
+
+  if ((u64)st.st_mtime == afl->pc_filter_mtime &&
+      (u64)st.st_size == afl->pc_filter_size &&
+      (u64)st.st_ino == afl->pc_filter_ino) {
+    return;
+  }
+
+  /* the first look is at the file the forkservers started with */
+
+  if (afl->pc_filter_size) {
+    if (afl->afl_env.afl_no_ui) {
+      ACTF("AFL_PC_FILTER_FILE changed, reloading it.");
+    }
+
+    afl->fsrv.pc_filter_reload = afl->fsrv.pc_filter_reloadable;
+    afl->cmplog_fsrv.pc_filter_reload = afl->cmplog_fsrv.pc_filter_reloadable;
+
+    for (i = 0; i < afl->workers_cnt; ++i) {
+      afl->workers[i].fsrv.pc_filter_reload =
+          afl->workers[i].fsrv.pc_filter_reloadable;
+    }
+  }
+
+  afl->pc_filter_mtime = st.st_mtime;
+  afl->pc_filter_size = st.st_size;
+  afl->pc_filter_ino = st.st_ino;
+}
+
+/* Write a modified test case, run program, process results. Handle
+   error conditions, returning 1 if it's time to bail out. This is
+   a helper function for fuzz_one(). */
+
+u8 __attribute__((hot))
+common_fuzz_stuff(afl_state_t *afl, u8 *out_buf, u32 len) {
+  u8 fault;
+
+  if (unlikely(afl->afl_env.afl_persistent_tune &&
+               afl->fsrv.total_execs >= afl->loop_tune_at)) {
+    loop_tune(afl);
+  }
+
+  /* out_buf is the window of a large input, see large_window() */
+
+  if (unlikely(afl->large.file)) { afl->fsrv.patch = afl->large; }
+
+  if (unlikely(len = write_to_testcase(afl, (void **)&out_buf, len, 0)) == 0) {
+    return 0;
+  }
+
+  fault = fuzz_run_target(afl, &afl->fsrv, afl->fsrv.exec_tmout);
+
+  return common_fuzz_result(afl, out_buf, len, fault);
+}
+
+/* Run the cnt test cases in bufs and process their results as
+   common_fuzz_stuff() does, in testcase batches (FS_OPT_BATCH) if the target
+   supports them and no custom mutator post processes or sends the test
+   cases. If processing a result ran the target again (calibration of a new
+   path, a timeout retry), the maps of the rest of the batch are gone and
+   those test cases are run again. Returns 1 if it's time to bail out. */
+
+u8 common_fuzz_batch(afl_state_t *afl, u8 **bufs, u32 *lens, u32 cnt) {
+  u32 i = 0, start, done, j;
+  u8  batch = afl->fsrv.use_batch, res, phase;
+  u64 execs;
+
+  LIST_FOREACH(&afl->custom_mutator_list, struct custom_mutator, {
+    if (el->afl_custom_post_process || el->afl_custom_fuzz_send) { batch = 0; }
+  });
+
+  while (i < cnt) {
+    /* too short ones are padded by write_to_testcase() */
+
+    if (!batch || lens[i] < afl->min_length) {
+      if (common_fuzz_stuff(afl, bufs[i], lens[i])) { return 1; }
+      ++i;
+      continue;
+    }
+
+    fsrv_main_ready(afl);
+
+    for (start = i; i < cnt && lens[i] >= afl->min_length; ++i) {
+      lens[i] = MIN(lens[i], afl->max_length);
+      if (!afl_fsrv_batch_add(&afl->fsrv, bufs[i], lens[i])) { break; }
+    }
+
+    phase = phase_enter(afl, PHASE_TARGET);
+    res = afl_fsrv_run_batch(&afl->fsrv, afl->fsrv.exec_tmout, &afl->stop_soon);
+    phase_enter(afl, phase);
+    done = afl->fsrv.batch_done;
+    execs = afl->fsrv.total_execs;
+
+    for (j = 0; j < done; ++j) {
+      afl_fsrv_batch_trace(&afl->fsrv, j);
+
+      if (common_fuzz_result(afl, bufs[start + j], lens[start + j],
+                             j + 1 < done ? FSRV_RUN_OK : res)) {
+        return 1;
+      }
+
+      if (unlikely(afl->fsrv.total_execs != execs)) {
+        ++j;
+        break;
+      }
+    }
+
+    i = start + j;
+  }
+
+  return 0;
+}
+
+/* Wait for the exec of a worker forkserver and process its result as if it
+   had run on the main forkserver. */
+
+static u8 fsrv_worker_finish(afl_state_t *afl, struct fsrv_worker *w) {
+  u64 elapsed_ms = (get_cur_time_us() - w->start_us) / 1000;
+  u32 timeout = afl->fsrv.exec_tmout;
+  u8  fault, ret, phase;
+
+  /* the exec was running while we waited for the others */
+
+  timeout = elapsed_ms < timeout ? timeout - elapsed_ms : 1;
+  phase = phase_enter(afl, PHASE_TARGET);
+  fault = afl_fsrv_run_finish(&w->fsrv, timeout, &afl->stop_soon);
+  phase_enter(afl, phase);
+  buckets_check(afl, &w->fsrv);
+  w->busy = 0;
+
+  afl->saved_main_map = afl->fsrv.trace_bits;
+  afl->fsrv.trace_bits = w->fsrv.trace_bits;
+  afl->fsrv.last_kill_signal = w->fsrv.last_kill_signal;
+  ++afl->fsrv.total_execs;
+
+#ifdef __linux__
+  afl->result_nyx_runner = w->fsrv.nyx_runner;
+#endif
+
+  afl->mut_lo = w->mut_lo;
+  afl->mut_hi = w->mut_hi;
+  ret = common_fuzz_result(afl, w->buf, w->len, fault);
+  afl->mut_hi = 0;
+  afl->result_nyx_runner = NULL;
+  fsrv_main_map(afl);
+
+  return ret;
+}
+
+/* Process the result of the pipelined run that finished last. */
+
+static u8 pipe_process(afl_state_t *afl) {
+  struct fs_pipe *pipe = afl->fsrv.pipe;
+  u32             slot = afl->pipe_done - 1;
+  u8              ret;
+
+  afl->pipe_done = 0;
+  afl->saved_main_map = afl->fsrv.trace_bits;
+  afl->fsrv.trace_bits = FS_PIPE_MAP(pipe, slot);
+
+  afl->mut_lo = afl->pipe_mut_lo[slot];
+  afl->mut_hi = afl->pipe_mut_hi[slot];
+  ret = common_fuzz_result(afl, pipe->data[slot], pipe->len[slot],
+                           afl->pipe_fault[slot]);
+  afl->mut_hi = 0;
+  fsrv_main_map(afl);
+
+  return ret;
+}
+
+/* Like common_fuzz_stuff(), but return before the target finished running
+   the test case: it goes to the next worker forkserver (AFL_FSRV_WORKERS),
+   or to the next pipeline slot of the main one (AFL_PIPELINE) while the
+   result of the previous test case is processed. Results are processed once
+   the worker or slot is needed again or by flush_fsrv_workers(), so a bail
+   out refers to an earlier test case. */
+
+u8 __attribute__((hot))
+parallel_fuzz_stuff(afl_state_t *afl, u8 *out_buf, u32 len) {
+  if (likely(!afl->workers_cnt)) {
+    if (likely(!afl->fsrv.use_pipeline)) {
+      return common_fuzz_stuff(afl, out_buf, len);
+    }
+
+    if (unlikely(afl->queue_cur && afl->queue_cur->cksum_cnt)) {
+      (void)cksum_fixup(afl, out_buf, len);
+    }
+
+    struct fs_pipe *pipe = afl->fsrv.pipe;
+    u32             slot = afl->pipe_next;
+    u8              ret = 0;
+
+    if (afl->pipe_running) { pipe_finish(afl); }
+    if (afl->stop_soon) { return 1; }
+
+    if (unlikely(len < afl->min_length)) {
+      len = afl->min_length;
+
+    } else if (unlikely(len > afl->max_length)) {
+      len = afl->max_length;
+    }
+
+    /* the slot's last result was processed, the target copies the test case
+       to its own buffer and records into the slot's map */
+
+    memcpy(pipe->data[slot], out_buf, len);
+    pipe->len[slot] = len;
+    afl->pipe_mut_lo[slot] = afl->mut_lo;
+    afl->pipe_mut_hi[slot] = afl->mut_hi;
+
+    afl->fsrv.pipe_slot = slot + 1;
+    afl->saved_main_map = afl->fsrv.trace_bits;
+    afl->fsrv.trace_bits = FS_PIPE_MAP(pipe, slot);
+    afl->pipe_start_us = get_cur_time_us();
+
+    if (!afl_fsrv_run_start(&afl->fsrv, &afl->stop_soon)) { ret = 1; }
+
+    afl->fsrv.pipe_slot = 0;
+    fsrv_main_map(afl);
+    if (ret) { return ret; }
+
+    afl->pipe_running = slot + 1;
+    afl->pipe_next = slot ^ 1;
+
+    if (afl->pipe_done) { ret = pipe_process(afl); }
+
+    return ret;
+  }
+
+  struct fsrv_worker *w = &afl->workers[afl->workers_next];
+  u32                 mut_lo, mut_hi;
+  u8                  ret = 0;
+
+  if (unlikely(afl->queue_cur && afl->queue_cur->cksum_cnt)) {
+    (void)cksum_fixup(afl, out_buf, len);
+  }
+
+  mut_lo = afl->mut_lo;
+  mut_hi = afl->mut_hi;
+
+  if (w->busy) { ret = fsrv_worker_finish(afl, w); }
+  if (afl->stop_soon) { return 1; }
+
+  if (unlikely(len < afl->min_length)) {
+    len = afl->min_length;
+
+  } else if (unlikely(len > afl->max_length)) {
+    len = afl->max_length;
+  }
+
+  w->buf = afl_realloc((void **)&w->buf, len);
+  if (unlikely(!w->buf)) { PFATAL("alloc"); }
+  memcpy(w->buf, out_buf, len);
+  w->len = len;
+  w->mut_lo = mut_lo;
+  w->mut_hi = mut_hi;
+
+  afl_fsrv_write_to_testcase(&w->fsrv, w->buf, len);
+  w->fsrv.exec_tmout = afl->fsrv.exec_tmout;
+  w->start_us = get_cur_time_us();
+  if (!afl_fsrv_run_start(&w->fsrv, &afl->stop_soon)) { return 1; }
+  w->busy = 1;
+
+  if (++afl->workers_next == afl->workers_cnt) { afl->workers_next = 0; }
+
+  return ret;
+}
+
+/* Process the results of all outstanding worker execs or pipelined runs,
+   oldest first. Returns 1 if any of them asks to bail out. */
+
+u8 flush_fsrv_workers(afl_state_t *afl) {
+  u32 i, idx = afl->workers_next;
+  u8  ret = 0;
+
+  if (afl->fsrv.use_pipeline) {
+    if (afl->pipe_done) { ret = pipe_process(afl); }
+    if (afl->pipe_running) { pipe_finish(afl); }
+    if (afl->pipe_done) { ret |= pipe_process(afl); }
+  }
+
+  for (i = 0; i < afl->workers_cnt; ++i) {
+    struct fsrv_worker *w = &afl->workers[idx];
+    if (w->busy) { ret |= fsrv_worker_finish(afl, w); }
+    if (++idx == afl->workers_cnt) { idx = 0; }
+  }
+
+  return ret;
+}
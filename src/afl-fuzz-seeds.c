@@ -0,0 +1,240 @@
+/*
+ * This implements AFL_SEED_BATCH: instead of a scandir() of the whole input
+ * directory and a link or copy of every file into the queue before the
+ * first exec, the directory is walked with readdir() as fuzzing goes. The
+ * first batch of seeds is the initial queue, every later one is run like
+ * the test cases of a peer and only the seeds with new coverage are kept.
+ * Kept seeds are not copied: their queue entry is a symlink to the
+ * original, which trim_case() replaces by a file of its own before it
+ * writes the trimmed version.
+ *
+ * A tar file as -i is read through here as well, in one batch of all its
+ * members without AFL_SEED_BATCH. Its seeds are run from the mapping and
+ * only written to the queue when they are kept.
+ *
+ */
+
+#include "afl-fuzz.h"
+#include <dirent.h>
+
+struct seed_stream {
+  u32  batch;                           /* seeds per call               */
+  u32  depth;                           /* directories open             */
+  u8   subdirs;                         /* descend into subdirectories  */
+  DIR *dir[SEED_STREAM_DEPTH];
+  u8  *path[SEED_STREAM_DEPTH];
+  u64  read, kept;                      /* seeds run, seeds queued      */
+
+  struct pack *pack;                    /* afl->in_pack, or NULL        */
+  u32          pack_idx;                /* next member                  */
+};
+
+/* Returns the absolute path of the next seed and its length in *len, or
+   NULL when all were read. Seeds that vanish meanwhile are skipped. *data
+   gets the contents of a member of a pack, else NULL. */
+
+static u8 *seed_stream_next(struct seed_stream *s, u32 *len, u8 **data) {
+  struct dirent *de;
+  struct stat    st;
+  u8            *fn;
+
+  *data = NULL;
+
+  while (s->pack && s->pack_idx < s->pack->cnt) {
+    struct pack_entry *e = &s->pack->ent[s->pack_idx++];
+
+    fn = alloc_printf("%s/%s", s->pack->fn, e->name);
+
+    if (!e->len || strstr(fn, "/README.txt")) {
+      ck_free(fn);
+      continue;
+    }
+
+    *len = e->len;
+    *data = s->pack->map + e->off;
+    return fn;
+  }
+
+  while (s->depth) {
+    if (!(de = readdir(s->dir[s->depth - 1]))) {
+      --s->depth;
+      closedir(s->dir[s->depth]);
+      ck_free(s->path[s->depth]);
+      continue;
+    }
+
+    if (de->d_name[0] == '.') { continue; }
+
+    fn = alloc_printf("%s/%s", s->path[s->depth - 1], de->d_name);
+
+    if (lstat(fn, &st)) {
+      ck_free(fn);
+      continue;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+      DIR *d = NULL;
+
+      if (s->subdirs && s->depth < SEED_STREAM_DEPTH) { d = opendir(fn); }
+
+      if (d) {
+        s->dir[s->depth] = d;
+        s->path[s->depth++] = fn;
+
+      } else {
+        ck_free(fn);
+      }
+
+      continue;
+    }
+
+    if (!S_ISREG(st.st_mode) || !st.st_size || strstr(fn, "/README.txt")) {
+      ck_free(fn);
+      continue;
+    }
+
+    *len = st.st_size >= MAX_FILE ? MAX_FILE : st.st_size;
+    return fn;
+  }
+
+  return NULL;
+}
+
+static void seed_stream_close(afl_state_t *afl) {
+  struct seed_stream *s = afl->seed_stream;
+
+  while (s->depth) {
+    --s->depth;
+    closedir(s->dir[s->depth]);
+    ck_free(s->path[s->depth]);
+  }
+
+  ck_free(s);
+  afl->seed_stream = NULL;
+}
+
+/* Start walking dir and queue the first batch of seeds, for read_testcases()
+   with AFL_SEED_BATCH. */
+
+void seed_stream_open(afl_state_t *afl, u8 *dir, u8 subdirs) {
+  struct seed_stream *s;
+  u8                 *base, *fn, *data;
+  u32                 len, i;
+  s32                 batch = 0;
+
+  if (afl->afl_env.afl_seed_batch &&
+      (batch = atoi(afl->afl_env.afl_seed_batch)) <= 0) {
+    FATAL("AFL_SEED_BATCH must be a number above 0");
+  }
+
+  s = ck_alloc(sizeof(struct seed_stream));
+  s->batch = batch ? (u32)batch : UINT32_MAX;
+  s->subdirs = subdirs;
+  afl->seed_stream = s;
+
+  if (afl->in_pack) {
+    s->pack = afl->in_pack;
+
+  } else {
+    /* the queue entries are symlinks, so they need absolute paths */
+
+    if (!(base = realpath(dir, NULL))) { PFATAL("Unable to open '%s'", dir); }
+
+    s->path[0] = ck_strdup(base);
+    free(base);
+
+    if (!(s->dir[0] = opendir(s->path[0]))) {
+      PFATAL("Unable to open '%s'", s->path[0]);
+    }
+
+    s->depth = 1;
+  }
+
+  if (batch) {
+    ACTF("Streaming seeds from '%s' in batches of %u...", dir, s->batch);
+
+  } else {
+    ACTF("Reading the %u members of '%s'...", s->pack->cnt, dir);
+  }
+
+  for (i = 0; i < s->batch && (fn = seed_stream_next(s, &len, &data)); ++i) {
+    add_to_queue(afl, fn, len, 0);
+    afl->queue_top->seed_link = !data;
+    afl->queue_top->pack_data = data;
+    ++s->read;
+    ++s->kept;
+
+    /* as read_testcases() does it */
+
+    if (unlikely(afl->shm.cmplog_mode)) {
+      if (afl->cmplog_lvl == 1) {
+        if (afl->cmplog_max_filesize < len) { afl->cmplog_max_filesize = len; }
+
+      } else if (afl->cmplog_lvl == 2) {
+        if (!afl->cmplog_max_filesize || afl->cmplog_max_filesize > len) {
+          afl->cmplog_max_filesize = len;
+        }
+      }
+    }
+  }
+
+  if (i < s->batch) { seed_stream_close(afl); }
+}
+
+/* Run the next batch of seeds and keep those with new coverage. */
+
+void seed_stream_ingest(afl_state_t *afl) {
+  struct seed_stream *s = afl->seed_stream;
+  u8                 *fn, *map, *mem, *data, fault;
+  u32                 len, i;
+  s32                 fd = -1;
+
+  afl->stage_name = "seed import";
+  afl->stage_short = "seeds";
+
+  for (i = 0; i < s->batch && !afl->stop_soon; ++i) {
+    if (!(fn = seed_stream_next(s, &len, &data))) {
+      if (afl->afl_env.afl_no_ui) {
+        OKF("All %llu seeds are read, %llu of them are in the queue.", s->read,
+            s->kept);
+      }
+
+      seed_stream_close(afl);
+      return;
+    }
+
+    if (data) {
+      mem = data;
+      map = NULL;
+
+    } else {
+      fd = open(fn, O_RDONLY);
+
+      if (fd < 0) {
+        ck_free(fn);
+        continue;
+      }
+
+      mem = map = mmap(0, len, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map == MAP_FAILED) { PFATAL("Unable to mmap '%s'", fn); }
+    }
+
+    (void)write_to_testcase(afl, (void **)&mem, len, 1);
+
+    fault = fuzz_run_target(afl, &afl->fsrv, afl->fsrv.exec_tmout);
+
+    if (!afl->stop_soon) {
+      afl->seed_ref = fn;
+      s->kept += save_if_interesting(afl, mem, len, fault);
+      afl->seed_ref = NULL;
+      ++s->read;
+    }
+
+    if (map) {
+      munmap(map, len);
+      close(fd);
+    }
+
+    ck_free(fn);
+  }
+}
@@ -31,7 +31,8 @@ u8 should_det_fuzz(afl_state_t *afl, struct queue_entry *q) {
   }
 
   if (!q->favored || q->passed_det) return 0;
-  if (!q->trace_mini) return 0;
+  u8 *trace_mini = get_trace_mini(afl, q);
+  if (!trace_mini) return 0;
 
   if (!afl->skipdet_g->last_cov_undet)
     afl->skipdet_g->last_cov_undet = get_cur_time();
@@ -46,7 +47,7 @@ u8 should_det_fuzz(afl_state_t *afl, struct queue_entry *q) {
   u32 new_det_bits = 0;
 
   for (u32 i = 0; i < afl->fsrv.map_size; i++) {
-    if (unlikely(q->trace_mini[i >> 3] & (1 << (i & 7)))) {
+    if (unlikely(trace_mini[i >> 3] & (1 << (i & 7)))) {
       if (!afl->skipdet_g->virgin_det_bits[i]) { new_det_bits++; }
     }
   }
@@ -59,7 +60,7 @@ u8 should_det_fuzz(afl_state_t *afl, struct queue_entry *q) {
     q->skipdet_e->undet_bits = new_det_bits;
 
     for (u32 i = 0; i < afl->fsrv.map_size; i++) {
-      if (unlikely(q->trace_mini[i >> 3] & (1 << (i & 7)))) {
+      if (unlikely(trace_mini[i >> 3] & (1 << (i & 7)))) {
         if (!afl->skipdet_g->virgin_det_bits[i])
           afl->skipdet_g->virgin_det_bits[i] = 1;
       }
@@ -99,9 +100,26 @@ u8 skip_deterministic_stage(afl_state_t *afl, u8 *orig_buf, u8 *out_buf,
   u8 *inf_eff_map = (u8 *)ck_alloc(sizeof(u8) * len);
   memset(inf_eff_map, 1, sizeof(u8) * len);
 
+  u64 prev_cksum = 0;
+
+  /* colorization or an earlier run may know the neutral bytes already */
+
+  u8 *byte_imp = byte_imp_get(afl, afl->queue_cur, orig_buf);
+
+  if (byte_imp_complete(afl->queue_cur)) {
+    for (u32 i = 0; i < len; ++i) {
+      if (byte_imp[i] & BYTE_IMP_NEUTRAL) {
+        inf_eff_map[i] = 0;
+        afl->skipdet_g->inf_prof->inf_skipped_bytes += 1;
+      }
+    }
+
+    goto inference_done;
+  }
+
   if (common_fuzz_stuff(afl, orig_buf, len)) { return 0; }
 
-  u64 prev_cksum = hash64(afl->fsrv.trace_bits, afl->fsrv.map_size, HASH_CONST);
+  prev_cksum = hash_trace_bits(&afl->fsrv);
   u64 _prev_cksum = prev_cksum;
 
   if (MINIMAL_BLOCK_SIZE * 8 < len) {
@@ -128,8 +146,7 @@ u8 skip_deterministic_stage(afl_state_t *afl, u8 *orig_buf, u8 *out_buf,
 
         flip_range(out_buf, pos, flip_block_size);
 
-        u64 cksum =
-            hash64(afl->fsrv.trace_bits, afl->fsrv.map_size, HASH_CONST);
+        u64 cksum = hash_trace_bits(&afl->fsrv);
 
         // printf("Now trying range %d with %d, %s.\n", pos, cur_block_size,
         //     (cksum == prev_cksum) ? (u8*)"Yes" : (u8*) "Not");
@@ -156,6 +173,7 @@ u8 skip_deterministic_stage(afl_state_t *afl, u8 *orig_buf, u8 *out_buf,
                                : (len - pos - 1);
 
         memset(inf_eff_map + pos, 0, cur_skip_len);
+        memset(byte_imp + pos, BYTE_IMP_SEEN | BYTE_IMP_NEUTRAL, cur_skip_len);
 
         afl->skipdet_g->inf_prof->inf_skipped_bytes += cur_skip_len;
 
@@ -166,6 +184,12 @@ u8 skip_deterministic_stage(afl_state_t *afl, u8 *orig_buf, u8 *out_buf,
     afl->skipdet_g->inf_prof->inf_execs_cost +=
         (afl->fsrv.total_execs - pre_inf_exec);
     afl->skipdet_g->inf_prof->inf_time_cost += (get_cur_time() - pre_inf_time);
+
+    for (u32 i = 0; i < len; ++i) {
+      byte_imp[i] |= BYTE_IMP_SEEN;
+    }
+
+    byte_imp_save(afl, afl->queue_cur, orig_buf);
     // PFATAL("Done, now have %d bytes skipped, with exec %lld, time %lld.\n",
     // afl->inf_skipped_bytes, afl->inf_execs_cost, afl->inf_time_cost);
 
@@ -173,6 +197,8 @@ u8 skip_deterministic_stage(afl_state_t *afl, u8 *orig_buf, u8 *out_buf,
 
     memset(inf_eff_map, 1, len);
 
+inference_done:
+
   new_hit_cnt = afl->queued_items + afl->saved_crashes;
 
   afl->stage_finds[STAGE_INF] += new_hit_cnt - orig_hit_cnt;
@@ -232,7 +258,7 @@ u8 skip_deterministic_stage(afl_state_t *afl, u8 *orig_buf, u8 *out_buf,
 
     // clean exec cksum
     if (common_fuzz_stuff(afl, out_buf, len)) { return 0; }
-    prev_cksum = hash64(afl->fsrv.trace_bits, afl->fsrv.map_size, HASH_CONST);
+    prev_cksum = hash_trace_bits(&afl->fsrv);
   }
 
   do {
@@ -264,8 +290,7 @@ u8 skip_deterministic_stage(afl_state_t *afl, u8 *orig_buf, u8 *out_buf,
       out_buf[afl->stage_cur_byte] = orig;
 
       if (fuzz_nearby) {
-        if (prev_cksum ==
-            hash64(afl->fsrv.trace_bits, afl->fsrv.map_size, HASH_CONST)) {
+        if (prev_cksum == hash_trace_bits(&afl->fsrv)) {
           non_eff_bytes[afl->stage_cur_byte] = 1;
         }
       }
@@ -329,5 +354,7 @@ cleanup_skipdet:
     afl->queue_cur->skipdet_e->continue_inf = 1;
   }
 
+  ck_free(inf_eff_map);
+
   return 1;
 }
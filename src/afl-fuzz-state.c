@@ -27,46 +27,15 @@
 #include <limits.h>
 #include "afl-fuzz.h"
 #include "envs.h"
+#include "cmplog.h"
 
 s8  interesting_8[] = {INTERESTING_8};
 s16 interesting_16[] = {INTERESTING_8, INTERESTING_16};
 s32 interesting_32[] = {INTERESTING_8, INTERESTING_16, INTERESTING_32};
 
-char *power_names[POWER_SCHEDULES_NUM] = {"explore", "mmopt", "exploit",
-                                          "fast",    "coe",   "lin",
-                                          "quad",    "rare",  "seek"};
-
-/* Initialize MOpt "globals" for this afl state */
-
-static void init_mopt_globals(afl_state_t *afl) {
-  MOpt_globals_t *core = &afl->mopt_globals_core;
-  core->finds = afl->core_operator_finds_puppet;
-  core->finds_v2 = afl->core_operator_finds_puppet_v2;
-  core->cycles = afl->core_operator_cycles_puppet;
-  core->cycles_v2 = afl->core_operator_cycles_puppet_v2;
-  core->cycles_v3 = afl->core_operator_cycles_puppet_v3;
-  core->is_pilot_mode = 0;
-  core->pTime = &afl->tmp_core_time;
-  core->period = period_core;
-  core->havoc_stagename = "MOpt-core-havoc";
-  core->splice_stageformat = "MOpt-core-splice %u";
-  core->havoc_stagenameshort = "MOpt_core_havoc";
-  core->splice_stagenameshort = "MOpt_core_splice";
-
-  MOpt_globals_t *pilot = &afl->mopt_globals_pilot;
-  pilot->finds = afl->stage_finds_puppet[0];
-  pilot->finds_v2 = afl->stage_finds_puppet_v2[0];
-  pilot->cycles = afl->stage_cycles_puppet[0];
-  pilot->cycles_v2 = afl->stage_cycles_puppet_v2[0];
-  pilot->cycles_v3 = afl->stage_cycles_puppet_v3[0];
-  pilot->is_pilot_mode = 1;
-  pilot->pTime = &afl->tmp_pilot_time;
-  pilot->period = period_pilot;
-  pilot->havoc_stagename = "MOpt-havoc";
-  pilot->splice_stageformat = "MOpt-splice %u";
-  pilot->havoc_stagenameshort = "MOpt_havoc";
-  pilot->splice_stagenameshort = "MOpt_splice";
-}
+char *power_names[POWER_SCHEDULES_NUM] = {
+    "explore", "mmopt", "exploit", "fast", "coe",
+    "lin",     "quad",  "energy",  "rare", "seek"};
 
 /* A global pointer to all instances is needed (for now) for signals to arrive
  */
@@ -102,8 +71,11 @@ void afl_state_init(afl_state_t *afl, uint32_t map_size) {
   afl->skip_deterministic = 1;
   afl->sync_time = SYNC_TIME;
   afl->cmplog_lvl = 2;
+  afl->cmplog_map_w = CMP_MAP_W;
+  afl->cmplog_map_h = CMP_MAP_H;
   afl->min_length = 1;
   afl->max_length = MAX_FILE;
+  afl->max_input = MAX_FILE;
   afl->switch_fuzz_mode = STRATEGY_SWITCH_TIME * 1000;
 #ifndef NO_SPLICING
   afl->use_splicing = 1;
@@ -125,11 +97,20 @@ void afl_state_init(afl_state_t *afl, uint32_t map_size) {
   afl->first_trace = ck_alloc(map_size);
   afl->map_tmp_buf = ck_alloc(map_size);
 
+  afl->trace_mini_fd = -1;
+  afl->state_flags_fd = -1;
+  afl->cal_index_fd = -1;
+  afl->cal_index_old_fd = -1;
+  afl->sync_manifest_fd = -1;
+  afl->shared_virgin_fd = -1;
+  afl->crash_sigs_fd = -1;
+  afl->phase_last = phase_clock();
+
   afl->fsrv.use_stdin = 1;
   afl->fsrv.map_size = map_size;
   // afl_state_t is not available in forkserver.c
   afl->fsrv.afl_ptr = (void *)afl;
-  afl->fsrv.add_extra_func = (void (*)(void *, u8 *, u32)) & add_extra;
+  afl->fsrv.add_dict_func = (u32(*)(void *, u8 *, u32)) & add_extras_autodict;
   afl->fsrv.exec_tmout = EXEC_TIMEOUT;
   afl->fsrv.mem_limit = MEM_LIMIT;
   afl->fsrv.dev_urandom_fd = -1;
@@ -145,7 +126,6 @@ void afl_state_init(afl_state_t *afl, uint32_t map_size) {
   afl->havoc_prof =
       (struct havoc_profile *)ck_alloc(sizeof(struct havoc_profile));
 
-  init_mopt_globals(afl);
 
   list_append(&afl_states, afl);
 }
@@ -258,12 +238,138 @@ void read_afl_environment(afl_state_t *afl, char **envp) {
             afl->afl_env.afl_final_sync =
                 get_afl_env(afl_environment_variables[i]) ? 1 : 0;
 
+          } else if (!strncmp(env, "AFL_SHARED_VIRGIN",
+
+                              afl_environment_variable_len)) {
+            afl->afl_env.afl_shared_virgin =
+                get_afl_env(afl_environment_variables[i]) ? 1 : 0;
+
+          } else if (!strncmp(env, "AFL_SHM_FULL_WRITE",
+
+                              afl_environment_variable_len)) {
+            afl->afl_env.afl_shm_full_write =
+                get_afl_env(afl_environment_variables[i]) ? 1 : 0;
+
+          } else if (!strncmp(env, "AFL_SPLICE_COVER",
+
+                              afl_environment_variable_len)) {
+            afl->afl_env.afl_splice_cover =
+                get_afl_env(afl_environment_variables[i]) ? 1 : 0;
+
+          } else if (!strncmp(env, "AFL_SYNC_PLAN",
+
+                              afl_environment_variable_len)) {
+            afl->afl_env.afl_sync_plan =
+                get_afl_env(afl_environment_variables[i]) ? 1 : 0;
+
+          } else if (!strncmp(env, "AFL_QUEUE_STORE",
+
+                              afl_environment_variable_len)) {
+            afl->afl_env.afl_queue_store =
+                get_afl_env(afl_environment_variables[i]) ? 1 : 0;
+
+          } else if (!strncmp(env, "AFL_CRASH_DEDUP",
+
+                              afl_environment_variable_len)) {
+            afl->afl_env.afl_crash_dedup =
+                get_afl_env(afl_environment_variables[i]) ? 1 : 0;
+
+          } else if (!strncmp(env, "AFL_PIPELINE",
+
+                              afl_environment_variable_len)) {
+            afl->afl_env.afl_pipeline =
+                get_afl_env(afl_environment_variables[i]) ? 1 : 0;
+
+          } else if (!strncmp(env, "AFL_ASYNC_WRITES",
+
+                              afl_environment_variable_len)) {
+            afl->afl_env.afl_async_writes =
+                get_afl_env(afl_environment_variables[i]) ? 1 : 0;
+
+          } else if (!strncmp(env, "AFL_STATE_DIRS",
+
+                              afl_environment_variable_len)) {
+            afl->afl_env.afl_state_dirs =
+                get_afl_env(afl_environment_variables[i]) ? 1 : 0;
+
+          } else if (!strncmp(env, "AFL_FSRV_LATENCY",
+
+                              afl_environment_variable_len)) {
+            afl->afl_env.afl_fsrv_latency =
+                get_afl_env(afl_environment_variables[i]) ? 1 : 0;
+
+          } else if (!strncmp(env, "AFL_PERSISTENT_TUNE",
+
+                              afl_environment_variable_len)) {
+            afl->afl_env.afl_persistent_tune =
+                get_afl_env(afl_environment_variables[i]) ? 1 : 0;
+
+          } else if (!strncmp(env, "AFL_SHM_HUGEPAGES",
+
+                              afl_environment_variable_len)) {
+            afl->afl_env.afl_shm_hugepages =
+                get_afl_env(afl_environment_variables[i]) ? 1 : 0;
+
+          } else if (!strncmp(env, "AFL_FAUXSRV_TEMPLATE",
+
+                              afl_environment_variable_len)) {
+            afl->afl_env.afl_fauxsrv_template =
+                get_afl_env(afl_environment_variables[i]) ? 1 : 0;
+
+          } else if (!strncmp(env, "AFL_MEMFD_INPUT",
+
+                              afl_environment_variable_len)) {
+            afl->afl_env.afl_memfd_input =
+                get_afl_env(afl_environment_variables[i]) ? 1 : 0;
+
           } else if (!strncmp(env, "AFL_CUSTOM_MUTATOR_ONLY",
 
                               afl_environment_variable_len)) {
             afl->afl_env.afl_custom_mutator_only =
                 get_afl_env(afl_environment_variables[i]) ? 1 : 0;
 
+          } else if (!strncmp(env, "AFL_CMPLOG_CACHE_SIZE",
+
+                              afl_environment_variable_len)) {
+            afl->afl_env.afl_cmplog_cache_size =
+                (u8 *)get_afl_env(afl_environment_variables[i]);
+
+          } else if (!strncmp(env, "AFL_CMPLOG_MAP_W",
+
+                              afl_environment_variable_len)) {
+            afl->afl_env.afl_cmplog_map_w =
+                (u8 *)get_afl_env(afl_environment_variables[i]);
+
+          } else if (!strncmp(env, "AFL_CMPLOG_MAP_H",
+
+                              afl_environment_variable_len)) {
+            afl->afl_env.afl_cmplog_map_h =
+                (u8 *)get_afl_env(afl_environment_variables[i]);
+
+          } else if (!strncmp(env, "AFL_ADAPTIVE_TIMEOUT",
+
+                              afl_environment_variable_len)) {
+            afl->afl_env.afl_adaptive_timeout =
+                get_afl_env(afl_environment_variables[i]) ? 1 : 0;
+
+          } else if (!strncmp(env, "AFL_HAVOC_BANDIT",
+
+                              afl_environment_variable_len)) {
+            afl->afl_env.afl_havoc_bandit =
+                get_afl_env(afl_environment_variables[i]) ? 1 : 0;
+
+          } else if (!strncmp(env, "AFL_STAGE_BUDGET",
+
+                              afl_environment_variable_len)) {
+            afl->afl_env.afl_stage_budget =
+                get_afl_env(afl_environment_variables[i]) ? 1 : 0;
+
+          } else if (!strncmp(env, "AFL_CHECKSUM_FIXUP",
+
+                              afl_environment_variable_len)) {
+            afl->afl_env.afl_checksum_fixup =
+                get_afl_env(afl_environment_variables[i]) ? 1 : 0;
+
           } else if (!strncmp(env, "AFL_CMPLOG_ONLY_NEW",
 
                               afl_environment_variable_len)) {
@@ -366,18 +472,42 @@ void read_afl_environment(afl_state_t *afl, char **envp) {
             afl->afl_env.afl_cal_fast =
                 get_afl_env(afl_environment_variables[i]) ? 1 : 0;
 
+          } else if (!strncmp(env, "AFL_FIELD_HINTS",
+
+                              afl_environment_variable_len)) {
+            afl->afl_env.afl_field_hints =
+                get_afl_env(afl_environment_variables[i]) ? 1 : 0;
+
+          } else if (!strncmp(env, "AFL_TARGET_NOVELTY",
+
+                              afl_environment_variable_len)) {
+            afl->afl_env.afl_target_novelty =
+                get_afl_env(afl_environment_variables[i]) ? 1 : 0;
+
           } else if (!strncmp(env, "AFL_FAST_CAL",
 
                               afl_environment_variable_len)) {
             afl->afl_env.afl_cal_fast =
                 get_afl_env(afl_environment_variables[i]) ? 1 : 0;
 
+          } else if (!strncmp(env, "AFL_STATS_PAGE",
+
+                              afl_environment_variable_len)) {
+            afl->afl_env.afl_stats_page =
+                get_afl_env(afl_environment_variables[i]) ? 1 : 0;
+
           } else if (!strncmp(env, "AFL_STATSD",
 
                               afl_environment_variable_len)) {
             afl->afl_env.afl_statsd =
                 get_afl_env(afl_environment_variables[i]) ? 1 : 0;
 
+          } else if (!strncmp(env, "AFL_POST_PROCESS_CACHE",
+
+                              afl_environment_variable_len)) {
+            afl->afl_env.afl_post_process_cache =
+                (u8 *)get_afl_env(afl_environment_variables[i]);
+
           } else if (!strncmp(env, "AFL_POST_PROCESS_KEEP_ORIGINAL",
 
                               afl_environment_variable_len)) {
@@ -430,12 +560,114 @@ void read_afl_environment(afl_state_t *afl, char **envp) {
             afl->afl_env.afl_testcache_size =
                 (u8 *)get_afl_env(afl_environment_variables[i]);
 
+          } else if (!strncmp(env, "AFL_FSRV_WORKERS",
+
+                              afl_environment_variable_len)) {
+            afl->afl_env.afl_fsrv_workers =
+                (u8 *)get_afl_env(afl_environment_variables[i]);
+
+          } else if (!strncmp(env, "AFL_INTEL_PT",
+
+                              afl_environment_variable_len)) {
+            afl->afl_env.afl_intel_pt =
+                get_afl_env(afl_environment_variables[i]) ? 1 : 0;
+
+          } else if (!strncmp(env, "AFL_INTEL_PT_THREADS",
+
+                              afl_environment_variable_len)) {
+            afl->afl_env.afl_intel_pt_threads =
+                (u8 *)get_afl_env(afl_environment_variables[i]);
+
           } else if (!strncmp(env, "AFL_TESTCACHE_ENTRIES",
 
                               afl_environment_variable_len)) {
             afl->afl_env.afl_testcache_entries =
                 (u8 *)get_afl_env(afl_environment_variables[i]);
 
+          } else if (!strncmp(env, "AFL_PC_FILTER_FILE",
+
+                              afl_environment_variable_len)) {
+            afl->afl_env.afl_pc_filter_file =
+                (u8 *)get_afl_env(afl_environment_variables[i]);
+
+          } else if (!strncmp(env, "AFL_ANALYZE_DIR",
+
+                              afl_environment_variable_len)) {
+            afl->afl_env.afl_analyze_dir =
+                (u8 *)get_afl_env(afl_environment_variables[i]);
+
+          } else if (!strncmp(env, "AFL_METRICS_HOST",
+
+                              afl_environment_variable_len)) {
+            afl->afl_env.afl_metrics_host =
+                (u8 *)get_afl_env(afl_environment_variables[i]);
+
+          } else if (!strncmp(env, "AFL_HANG_CHECK_ASYNC",
+
+                              afl_environment_variable_len)) {
+            afl->afl_env.afl_hang_check_async =
+                get_afl_env(afl_environment_variables[i]) ? 1 : 0;
+
+          } else if (!strncmp(env, "AFL_HANG_WATCHDOG",
+
+                              afl_environment_variable_len)) {
+            afl->afl_env.afl_hang_watchdog =
+                (u8 *)get_afl_env(afl_environment_variables[i]);
+
+          } else if (!strncmp(env, "AFL_RECORD",
+
+                              afl_environment_variable_len)) {
+            afl->afl_env.afl_record =
+                (u8 *)get_afl_env(afl_environment_variables[i]);
+
+          } else if (!strncmp(env, "AFL_REPLAY",
+
+                              afl_environment_variable_len)) {
+            afl->afl_env.afl_replay =
+                (u8 *)get_afl_env(afl_environment_variables[i]);
+
+          } else if (!strncmp(env, "AFL_CHECKPOINT",
+
+                              afl_environment_variable_len)) {
+            afl->afl_env.afl_checkpoint =
+                (u8 *)get_afl_env(afl_environment_variables[i]);
+
+          } else if (!strncmp(env, "AFL_CUSTOM_MUTATOR_BANDIT",
+
+                              afl_environment_variable_len)) {
+            afl->afl_env.afl_custom_mutator_bandit =
+                get_afl_env(afl_environment_variables[i]) ? 1 : 0;
+
+          } else if (!strncmp(env, "AFL_CUSTOM_MUTATOR_THREADS",
+
+                              afl_environment_variable_len)) {
+            afl->afl_env.afl_custom_mutator_threads =
+                (u8 *)get_afl_env(afl_environment_variables[i]);
+
+          } else if (!strncmp(env, "AFL_METRICS_PORT",
+
+                              afl_environment_variable_len)) {
+            afl->afl_env.afl_metrics_port =
+                (u8 *)get_afl_env(afl_environment_variables[i]);
+
+          } else if (!strncmp(env, "AFL_MAP_SIZE_MAX",
+
+                              afl_environment_variable_len)) {
+            afl->afl_env.afl_map_size_max =
+                (u8 *)get_afl_env(afl_environment_variables[i]);
+
+          } else if (!strncmp(env, "AFL_LARGE_INPUTS",
+
+                              afl_environment_variable_len)) {
+            afl->afl_env.afl_large_inputs =
+                (u8 *)get_afl_env(afl_environment_variables[i]);
+
+          } else if (!strncmp(env, "AFL_SEED_BATCH",
+
+                              afl_environment_variable_len)) {
+            afl->afl_env.afl_seed_batch =
+                (u8 *)get_afl_env(afl_environment_variables[i]);
+
           } else if (!strncmp(env, "AFL_STATSD_HOST",
 
                               afl_environment_variable_len)) {
@@ -604,28 +836,53 @@ void read_afl_environment(afl_state_t *afl, char **envp) {
 
 void afl_state_deinit(afl_state_t *afl) {
   if (afl->in_place_resume) { ck_free(afl->in_dir); }
+  if (afl->in_pack) { pack_close(afl->in_pack); }
+
+  for (u32 i = 0; i < afl->foreign_sync_cnt; ++i) {
+    if (afl->foreign_syncs[i].pack) { pack_close(afl->foreign_syncs[i].pack); }
+  }
+
   if (afl->sync_id) { ck_free(afl->out_dir); }
   if (afl->pass_stats) { ck_free(afl->pass_stats); }
+  if (afl->cmplog_solved) { ck_free(afl->cmplog_solved); }
   if (afl->orig_cmp_map) { ck_free(afl->orig_cmp_map); }
   if (afl->cmplog_binary) { ck_free(afl->cmplog_binary); }
 
+  ck_free(afl->loop_tune_buf);
   afl_free(afl->queue_buf);
+  afl_free(afl->weight_tree);
+  afl_free(afl->weight_leaf);
   afl_free(afl->out_buf);
   afl_free(afl->out_scratch_buf);
+  afl_free(afl->custom_batch_buf);
   afl_free(afl->eff_buf);
   afl_free(afl->in_buf);
   afl_free(afl->in_scratch_buf);
+  afl_free(afl->large_buf);
   afl_free(afl->ex_buf);
+  afl_free(afl->its_index_buf);
+  afl_free(afl->its_num_buf);
+  afl_free(afl->cal_index_buf);
+  afl_free(afl->sync_manifest_buf);
+  afl_free(afl->cmplog_keys);
 
   ck_free(afl->virgin_bits);
   ck_free(afl->virgin_tmout);
   ck_free(afl->virgin_crash);
+  ck_free(afl->virgin_host);
+  ck_free(afl->queue_store);
   ck_free(afl->var_bytes);
   ck_free(afl->top_rated);
+  afl_free(afl->cover_edges);
   ck_free(afl->clean_trace);
   ck_free(afl->clean_trace_custom);
   ck_free(afl->first_trace);
   ck_free(afl->map_tmp_buf);
+  ck_free(afl->cull_cover);
+  afl_free(afl->pending_fav);
+  ck_free(afl->n_fuzz);
+  destroy_trace_mini_arena(afl);
+  ck_free(afl->path_bloom);
 
   list_remove(&afl_states, afl);
 }
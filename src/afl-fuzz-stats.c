@@ -27,6 +27,27 @@
 #include "envs.h"
 #include <limits.h>
 
+static const char *phase_names[PHASE_NUM_MAX] = {
+    "other", "target", "postproc", "mutate",
+    "sync",  "trim",   "calibrate", "cmplog"};
+
+/* The share of the run time each phase took so far, in percent. */
+
+static void phase_shares(afl_state_t *afl, double *pct) {
+  u64 total = 0;
+  u32 i;
+
+  phase_enter(afl, afl->phase);
+
+  for (i = 0; i < PHASE_NUM_MAX; ++i) {
+    total += afl->phase_ticks[i];
+  }
+
+  for (i = 0; i < PHASE_NUM_MAX; ++i) {
+    pct[i] = total ? (double)afl->phase_ticks[i] * 100 / total : 0;
+  }
+}
+
 static char fuzzing_state[4][12] = {"started :-)", "in progress", "final phase",
                                     "finished..."};
 
@@ -286,10 +307,20 @@ void write_stats_file(afl_state_t *afl, u32 t_bytes, double bitmap_cvg,
       "testcache_size    : %llu\n"
       "testcache_count   : %u\n"
       "testcache_evict   : %u\n"
+      "n_fuzz_entries    : %u\n"
+      "n_fuzz_mem        : %llu\n"
+      "persistent_loop   : %u\n"
+      "state_leaks       : %u\n"
+      "sync_skipped      : %llu\n"
+      "shared_skipped    : %llu\n"
+      "plan_share        : %u\n"
+      "crash_dups        : %llu\n"
+      "hang_dups         : %llu\n"
+      "tmouts_cut_short  : %llu\n"
       "afl_banner        : %s\n"
       "afl_version       : " VERSION
       "\n"
-      "target_mode       : %s%s%s%s%s%s%s%s%s%s\n"
+      "target_mode       : %s%s%s%s%s%s%s%s%s%s%s\n"
       "command_line      : %s\n",
       (afl->start_time - afl->prev_run_time) / 1000, cur_time / 1000,
       runtime / 1000, (u32)getpid(),
@@ -323,21 +354,93 @@ void write_stats_file(afl_state_t *afl, u32 t_bytes, double bitmap_cvg,
 #endif
       t_bytes, afl->fsrv.real_map_size, afl->var_byte_count, afl->expand_havoc,
       afl->a_extras_cnt, afl->q_testcase_cache_size,
-      afl->q_testcase_cache_count, afl->q_testcase_evictions, afl->use_banner,
+      afl->q_testcase_cache_count, afl->q_testcase_evictions,
+      afl->n_fuzz_count,
+      (u64)afl->n_fuzz_size * sizeof(struct n_fuzz_slot),
+      afl->loop_tune_cnt, afl->state_leaks, afl->sync_skipped,
+      afl->shared_skipped, afl->sync_plan_share, afl->crash_dups,
+      afl->hang_dups, afl->tmout_hist ? afl->tmout_hist->slow : 0,
+      afl->use_banner,
       afl->unicorn_mode ? "unicorn" : "", afl->fsrv.qemu_mode ? "qemu " : "",
       afl->fsrv.cs_mode ? "coresight" : "",
+      afl->fsrv.ipt_mode ? "intel_pt " : "",
       afl->non_instrumented_mode ? " non_instrumented " : "",
       afl->no_forkserver ? "no_fsrv " : "", afl->crash_mode ? "crash " : "",
       afl->persistent_mode ? "persistent " : "",
       afl->shmem_testcase_mode ? "shmem_testcase " : "",
       afl->deferred_mode ? "deferred " : "",
       (afl->unicorn_mode || afl->fsrv.qemu_mode || afl->fsrv.cs_mode ||
-       afl->non_instrumented_mode || afl->no_forkserver || afl->crash_mode ||
+       afl->fsrv.ipt_mode || afl->non_instrumented_mode ||
+       afl->no_forkserver || afl->crash_mode ||
        afl->persistent_mode || afl->deferred_mode)
           ? ""
           : "default",
       afl->orig_cmdline);
 
+  /* finds/execs and budget share of each custom mutator and havoc */
+
+  if (afl->custom_bandit) {
+    struct custom_bandit *b = afl->custom_bandit;
+    u32                   i = 0;
+
+    fprintf(f, "custom_bandit     :");
+    LIST_FOREACH(&afl->custom_mutator_list, struct custom_mutator, {
+      fprintf(f, " %s=%.0f/%.0f@%.2f", el->name_short, b->arm[i].finds,
+              b->arm[i].execs, b->arm[i].share);
+      ++i;
+    });
+    fprintf(f, " havoc=%.0f/%.0f@%.2f\n", b->arm[i].finds, b->arm[i].execs,
+            b->arm[i].share);
+  }
+
+  if (afl->stage_budget) {
+    static const char *names[BUDGET_NUM_MAX] = {
+        "det", "havoc", "splice", "redqueen", "custom", "trim"};
+    struct stage_budget *b = afl->stage_budget;
+
+    fprintf(f, "stage_budget      :");
+    for (u32 i = 0; i < BUDGET_NUM_MAX; ++i) {
+      fprintf(f, " %s=%.0f/%.0f@%.2f", names[i], b->finds[i], b->execs[i],
+              b->share[i]);
+    }
+
+    fprintf(f, "\n");
+  }
+
+  if (afl->pp_cache) {
+    fprintf(f, "pp_cache_hits     : %llu/%llu\n", afl->pp_cache->hits,
+            afl->pp_cache->hits + afl->pp_cache->misses);
+  }
+
+  /* where the run time went */
+
+  double pct[PHASE_NUM_MAX];
+  phase_shares(afl, pct);
+
+  for (u32 i = 0; i < PHASE_NUM_MAX; ++i) {
+    fprintf(f, "time_%-12s : %0.02f%%\n", phase_names[i], pct[i]);
+  }
+
+  /* AFL_FSRV_LATENCY, the percentiles are bucket bounds */
+
+  if (afl->fsrv.latency) {
+    struct fsrv_latency *lat = afl->fsrv.latency;
+
+    for (u32 p = 0; p < FSRV_LAT_NUM; ++p) {
+      u64 n = 0;
+      for (u32 i = 0; i < FSRV_LAT_BUCKETS; ++i) {
+        n += lat->hist[p][i];
+      }
+
+      fprintf(f,
+              "fsrv_lat_%-8s : n=%llu avg_us=%0.02f p50_us=%llu p99_us=%llu\n",
+              fsrv_lat_names[p], n,
+              n ? (double)lat->sum_ns[p] / n / 1000 : 0.0,
+              afl_fsrv_lat_quantile(lat, p, 0.5),
+              afl_fsrv_lat_quantile(lat, p, 0.99));
+    }
+  }
+
   /* ignore errors */
 
   if (afl->debug) {
@@ -389,6 +492,70 @@ void write_queue_stats(afl_state_t *afl) {
 
 #endif
 
+/* Merge the plot_data.bin buckets a and b into dst, which may be a. */
+
+static void plot_bin_merge(struct plot_bin_slot *dst, struct plot_bin_slot *a,
+                           struct plot_bin_slot *b) {
+  struct plot_bin_slot m;
+  u32                  i;
+
+  if (!b->samples) {
+    m = *a;
+
+  } else if (!a->samples) {
+    m = *b;
+
+  } else {
+    m.samples = a->samples + b->samples;
+    m.time = b->time;
+    m.eps_sum = a->eps_sum + b->eps_sum;
+
+    for (i = 0; i < PLOT_FIELDS; ++i) {
+      m.min[i] = MIN(a->min[i], b->min[i]);
+      m.max[i] = MAX(a->max[i], b->max[i]);
+    }
+  }
+
+  *dst = m;
+}
+
+/* Add a plot update to its bucket of plot_data.bin, first merging pairs of
+   buckets until the run time fits. */
+
+static void plot_bin_update(afl_state_t *afl, double *v) {
+  struct plot_bin_hdr  *h = afl->plot_bin;
+  struct plot_bin_slot *s = (struct plot_bin_slot *)(h + 1), *b;
+  u32 t = (afl->prev_run_time + get_cur_time() - afl->start_time) / 1000, i;
+
+  __atomic_store_n(&h->seq, h->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  while (t / h->width >= h->slots) {
+    for (i = 0; i < h->slots / 2; ++i) {
+      plot_bin_merge(&s[i], &s[2 * i], &s[2 * i + 1]);
+    }
+
+    memset(&s[h->slots / 2], 0, (h->slots / 2) * sizeof(*s));
+    h->width *= 2;
+    h->used = (h->used + 1) / 2;
+  }
+
+  b = &s[t / h->width];
+
+  for (i = 0; i < PLOT_FIELDS; ++i) {
+    if (!b->samples || v[i] < b->min[i]) { b->min[i] = v[i]; }
+    if (!b->samples || v[i] > b->max[i]) { b->max[i] = v[i]; }
+  }
+
+  ++b->samples;
+  b->time = t;
+  b->eps_sum += v[PLOT_EPS];
+  h->used = MAX(h->used, t / h->width + 1);
+  h->start_time = afl->start_time - afl->prev_run_time;
+
+  __atomic_store_n(&h->seq, h->seq + 1, __ATOMIC_RELEASE);
+}
+
 /* Update the plot file if there is a reason to. */
 
 void maybe_update_plot_file(afl_state_t *afl, u32 t_bytes, double bitmap_cvg,
@@ -435,6 +602,130 @@ void maybe_update_plot_file(afl_state_t *afl, u32 t_bytes, double bitmap_cvg,
           afl->plot_prev_ed, t_bytes); /* ignore errors */
 
   fflush(afl->fsrv.plot_file);
+
+  if (likely(afl->plot_bin)) {
+    double v[PLOT_FIELDS] = {
+
+        [PLOT_CYCLES] = afl->queue_cycle - 1,
+        [PLOT_CUR_ITEM] = afl->current_entry,
+        [PLOT_CORPUS] = afl->queued_items,
+        [PLOT_PENDING] = afl->pending_not_fuzzed,
+        [PLOT_FAVS] = afl->pending_favored,
+        [PLOT_CVG] = bitmap_cvg,
+        [PLOT_CRASHES] = afl->saved_crashes,
+        [PLOT_HANGS] = afl->saved_hangs,
+        [PLOT_DEPTH] = afl->max_depth,
+        [PLOT_EPS] = eps,
+        [PLOT_EXECS] = afl->plot_prev_ed,
+        [PLOT_EDGES] = t_bytes
+
+    };
+
+    plot_bin_update(afl, v);
+  }
+}
+
+/* Map fuzzer_stats.page for AFL_STATS_PAGE, see struct stats_page. */
+
+void stats_page_open(afl_state_t *afl) {
+  u8 *fn;
+  s32 fd;
+
+  if (!afl->afl_env.afl_stats_page) { return; }
+
+  fn = alloc_printf("%s/fuzzer_stats.page", afl->out_dir);
+  fd = open(fn, O_RDWR | O_CREAT | O_TRUNC, DEFAULT_PERMISSION);
+  if (fd < 0) { PFATAL("Unable to create '%s'", fn); }
+
+  if (ftruncate(fd, STATS_PAGE_SIZE)) { PFATAL("Unable to resize '%s'", fn); }
+
+  afl->stats_page = mmap(NULL, STATS_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, fd, 0);
+  if (afl->stats_page == MAP_FAILED) { PFATAL("mmap() of '%s' failed", fn); }
+
+  close(fd);
+  ck_free(fn);
+
+  afl->stats_page->magic = STATS_PAGE_MAGIC;
+  afl->stats_page->version = STATS_PAGE_VERSION;
+  afl->stats_page->fuzzer_pid = (u32)getpid();
+}
+
+/* Map plot_data.bin, see struct plot_bin_hdr. A run resumed in place goes
+   on with the buckets of the file if it has the same layout. */
+
+void plot_bin_open(afl_state_t *afl) {
+  u8         *fn = alloc_printf("%s/plot_data.bin", afl->out_dir);
+  u64         size = PLOT_BIN_SIZE(PLOT_BIN_SLOTS);
+  struct stat st;
+  s32         fd;
+
+  fd = open(fn, O_RDWR | O_CREAT | (afl->in_place_resume ? 0 : O_TRUNC),
+            DEFAULT_PERMISSION);
+  if (fd < 0) { PFATAL("Unable to create '%s'", fn); }
+
+  if (fstat(fd, &st)) { PFATAL("fstat() of '%s' failed", fn); }
+  if (ftruncate(fd, size)) { PFATAL("Unable to resize '%s'", fn); }
+
+  afl->plot_bin = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (afl->plot_bin == MAP_FAILED) { PFATAL("mmap() of '%s' failed", fn); }
+
+  close(fd);
+  ck_free(fn);
+
+  if ((u64)st.st_size != size || afl->plot_bin->magic != PLOT_BIN_MAGIC ||
+      afl->plot_bin->version != PLOT_BIN_VERSION ||
+      afl->plot_bin->slots != PLOT_BIN_SLOTS || afl->plot_bin->seq & 1) {
+    memset(afl->plot_bin, 0, size);
+    afl->plot_bin->magic = PLOT_BIN_MAGIC;
+    afl->plot_bin->version = PLOT_BIN_VERSION;
+    afl->plot_bin->slots = PLOT_BIN_SLOTS;
+    afl->plot_bin->width = PLOT_BIN_WIDTH;
+  }
+}
+
+/* Rewrite the stats page in place, a seqlock write. */
+
+static void stats_page_update(afl_state_t *afl, u32 t_bytes,
+                              double bitmap_cvg, double stability,
+                              double eps) {
+  struct stats_page *p = afl->stats_page;
+  u64                cur_time = get_cur_time();
+  u32                seq = p->seq;
+
+  __atomic_store_n(&p->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  p->start_time = afl->start_time - afl->prev_run_time;
+  p->last_update = cur_time;
+  p->run_time = afl->prev_run_time + cur_time - afl->start_time;
+  p->cycles_done = afl->queue_cycle ? (afl->queue_cycle - 1) : 0;
+  p->cycles_wo_finds = afl->cycles_wo_finds;
+  p->execs_done = afl->fsrv.total_execs;
+  p->saved_crashes = afl->saved_crashes;
+  p->saved_hangs = afl->saved_hangs;
+  p->last_find = afl->last_find_time;
+  p->last_crash = afl->last_crash_time;
+  p->last_hang = afl->last_hang_time;
+  p->corpus_count = afl->queued_items;
+  p->corpus_favored = afl->queued_favored;
+  p->corpus_found = afl->queued_discovered;
+  p->corpus_imported = afl->queued_imported;
+  p->corpus_variable = afl->queued_variable;
+  p->max_depth = afl->max_depth;
+  p->cur_item = afl->current_entry;
+  p->pending_favs = afl->pending_favored;
+  p->pending_total = afl->pending_not_fuzzed;
+  p->edges_found = t_bytes;
+  p->total_edges = afl->fsrv.real_map_size;
+  p->var_byte_count = afl->var_byte_count;
+  p->exec_timeout = afl->fsrv.exec_tmout;
+  p->slowest_exec_ms = afl->slowest_exec_ms;
+  p->execs_per_sec = eps;
+  p->stability = stability;
+  p->bitmap_cvg = bitmap_cvg;
+
+  __atomic_store_n(&p->seq, seq + 2, __ATOMIC_RELEASE);
 }
 
 /* Log deterministic stage efficiency */
@@ -596,6 +887,13 @@ void show_stats_normal(afl_state_t *afl) {
     stab_ratio = 100;
   }
 
+  if (unlikely(afl->stats_page)) {
+    stats_page_update(afl, t_bytes, t_byte_ratio, stab_ratio,
+                      afl->stats_avg_exec);
+  }
+
+  if (unlikely(afl->metrics)) { metrics_publish(afl, t_bytes); }
+
   /* Roughly every minute, update fuzzer stats and save auto tokens. */
 
   if (unlikely(
@@ -609,6 +907,12 @@ void show_stats_normal(afl_state_t *afl) {
     write_bitmap(afl);
   }
 
+  if (unlikely(afl->fsrv.pc_filter_reloadable &&
+               cur_ms - afl->pc_filter_last_ms > PC_FILTER_CHECK_SEC * 1000)) {
+    afl->pc_filter_last_ms = cur_ms;
+    pc_filter_check(afl);
+  }
+
   if (unlikely(afl->afl_env.afl_statsd)) {
     if (unlikely(afl->force_ui_update || cur_ms - afl->statsd_last_send_ms >
                                              STATSD_UPDATE_SEC * 1000)) {
@@ -1211,6 +1515,17 @@ void show_stats_normal(afl_state_t *afl) {
        u_stringify_int(IB(0), afl->stored_num));
   SAYF(bV bSTOP "sample cycles : " cRST "%-6s" bSTG SP20 SP10 bV "\n",
        u_stringify_int(IB(0), afl->sample_num));
+
+  double pct[PHASE_NUM_MAX];
+  phase_shares(afl, pct);
+
+  sprintf(tmp, "%0.1f%%, post %0.1f%%, mutate %0.1f%%", pct[PHASE_TARGET],
+          pct[PHASE_POSTPROC], pct[PHASE_MUTATE]);
+  SAYF(bV bSTOP "  time target : " cRST "%-36s" bSTG bV "\n", tmp);
+  sprintf(tmp, "cal %0.0f%%, trim %0.0f%%, rq %0.0f%%, sync %0.0f%%",
+          pct[PHASE_CALIBRATE], pct[PHASE_TRIM], pct[PHASE_CMPLOG],
+          pct[PHASE_SYNC]);
+  SAYF(bV bSTOP "    time misc : " cRST "%-36s" bSTG bV "\n", tmp);
   //
   SAYF(SET_G1 bSTG bLB bH cCYA bSTOP " strategy:" cPIN
                                      " %s " bSTG bH10 cCYA bSTOP " state:" cPIN
@@ -1320,6 +1635,13 @@ void show_stats_pizza(afl_state_t *afl) {
     stab_ratio = 100;
   }
 
+  if (unlikely(afl->stats_page)) {
+    stats_page_update(afl, t_bytes, t_byte_ratio, stab_ratio,
+                      afl->stats_avg_exec);
+  }
+
+  if (unlikely(afl->metrics)) { metrics_publish(afl, t_bytes); }
+
   /* Roughly every minute, update fuzzer stats and save auto tokens. */
 
   if (unlikely(!afl->non_instrumented_mode &&
@@ -1332,6 +1654,12 @@ void show_stats_pizza(afl_state_t *afl) {
     write_bitmap(afl);
   }
 
+  if (unlikely(afl->fsrv.pc_filter_reloadable &&
+               cur_ms - afl->pc_filter_last_ms > PC_FILTER_CHECK_SEC * 1000)) {
+    afl->pc_filter_last_ms = cur_ms;
+    pc_filter_check(afl);
+  }
+
   if (unlikely(afl->afl_env.afl_statsd)) {
     if (unlikely(afl->force_ui_update || cur_ms - afl->statsd_last_send_ms >
                                              STATSD_UPDATE_SEC * 1000)) {
@@ -2048,6 +2376,8 @@ void show_init_stats(afl_state_t *afl) {
       stringify_int(IB(0), min_us), stringify_int(IB(1), max_us),
       stringify_int(IB(2), avg_us));
 
+  u8 auto_tmout = afl->timeout_given != 1;
+
   if (afl->timeout_given == 3) {
     ACTF("Applying timeout settings from resumed session (%u ms).",
          afl->fsrv.exec_tmout);
@@ -2099,6 +2429,15 @@ void show_init_stats(afl_state_t *afl) {
     afl->hang_tmout = MIN((u32)EXEC_TIMEOUT, afl->fsrv.exec_tmout * 2 + 100);
   }
 
+  if (afl->afl_env.afl_adaptive_timeout) {
+    if (auto_tmout) {
+      afl->tmout_hist = ck_alloc(sizeof(struct tmout_hist));
+
+    } else {
+      WARNF("AFL_ADAPTIVE_TIMEOUT has no effect with -t");
+    }
+  }
+
   OKF("All set and ready to roll!");
 #undef IB
 }
@@ -0,0 +1,590 @@
+/*
+ * This implements -j: afl-fuzz starts that many instances of itself on the
+ * same -i, -o and target instead of fuzzing, one -M main and -S
+ * secondaries with the variations docs/fuzzing_in_depth.md recommends, and
+ * pins them with -b to one thread of every physical core node by node
+ * before the SMT siblings. Then it supervises them: instances that die are
+ * restarted, those whose fuzzer_stats are not updated any more are killed
+ * and restarted. Every check, a busy loop like afl-gotcpu's runs on the
+ * CPU of each instance for SUPERVISE_PROBE_MS: next to the instance alone
+ * it gets half of the CPU, 200% preemption, with any other load on it
+ * more. While the CPUs of most instances are overbooked, the last
+ * secondaries are parked, and started again once their CPU is available.
+ *
+ */
+
+#include "afl-fuzz.h"
+#include <dirent.h>
+#include <sched.h>
+#include <sys/wait.h>
+
+enum {
+
+  /* 00 */ SV_RUN,                       /* running or to be restarted  */
+  /* 01 */ SV_PARKED,                    /* stopped for the CPU load    */
+  /* 02 */ SV_DONE,                      /* exited by itself            */
+  /* 03 */ SV_FAILED                     /* gave up restarting it       */
+
+};
+
+struct sv_opt {
+  u8    opt;
+  char *arg;
+};
+
+struct sv_inst {
+  u8     name[64];
+  char **argv;
+  u8     state, is_main;
+  u8     trim_off;                       /* AFL_DISABLE_TRIM            */
+  u8     killed;                         /* stopped by us for a stall   */
+  u8     fuzzing;                        /* wrote stats since its start */
+  u8     resumable;                      /* fuzzed before, resume it    */
+  pid_t  pid;                            /* 0 when not running          */
+  s32    cpu;                            /* -b, -1 when not pinned      */
+  u32    quick_exits;                    /* early exits in a row        */
+  u64    start_ms, seen_ms, kill_ms;
+  time_t stats_mtime;
+  pid_t  probe_pid;
+  u32    probe;                          /* preemption of its CPU, in % */
+};
+
+static volatile sig_atomic_t sv_stop;
+
+static void sv_handle_stop(int sig) {
+  (void)sig;
+  sv_stop = 1;
+}
+
+static void sv_push(char ***v, u32 *n, char *s) {
+  *v = ck_realloc(*v, (*n + 1) * sizeof(char *));
+  (*v)[(*n)++] = s;
+}
+
+#ifdef __linux__
+
+/* The NUMA node of cpu, from the nodeN link in its sysfs directory. */
+
+static s32 sv_cpu_node(s32 cpu) {
+  u8             fn[PATH_MAX];
+  DIR           *d;
+  struct dirent *de;
+  s32            node = 0;
+
+  snprintf(fn, PATH_MAX, "/sys/devices/system/cpu/cpu%d", cpu);
+  if (!(d = opendir(fn))) { return 0; }
+
+  while ((de = readdir(d))) {
+    if (!strncmp(de->d_name, "node", 4) && isdigit(de->d_name[4])) {
+      node = atoi(de->d_name + 4);
+      break;
+    }
+  }
+
+  closedir(d);
+  return node;
+}
+
+/* Fill order with the CPUs to pin to: the first thread of every physical
+   core node by node, then the other SMT siblings. Returns their count. */
+
+static u32 sv_cpu_order(s32 *order, u32 max) {
+  s32 cnt = sysconf(_SC_NPROCESSORS_ONLN), cpu, sib[8];
+  u32 n = 0, i, j, sib_cnt;
+  u64 key, *keys;
+
+  if (cnt <= 0) { return 0; }
+  if ((u32)cnt > max) { cnt = max; }
+
+  keys = ck_alloc(cnt * sizeof(u64));
+
+  for (cpu = 0; cpu < cnt; ++cpu) {
+    sib_cnt = cpu_siblings(cpu, sib, sizeof(sib) / sizeof(sib[0]));
+
+    for (j = 0; j < sib_cnt && sib[j] != cpu; ++j) {}
+
+    /* sibling rank, node, cpu */
+
+    key = ((u64)(j < sib_cnt ? j : 0) << 48) |
+          ((u64)sv_cpu_node(cpu) << 24) | (u64)cpu;
+
+    for (i = n; i && keys[i - 1] > key; --i) {
+      keys[i] = keys[i - 1];
+    }
+
+    keys[i] = key;
+    ++n;
+  }
+
+  for (i = 0; i < n; ++i) {
+    order[i] = keys[i] & 0xffffff;
+  }
+
+  ck_free(keys);
+  return n;
+}
+
+/* Measure the preemption on cpu in a child, which exits with it in tens
+   of percent. */
+
+static pid_t sv_probe(s32 cpu) {
+  cpu_set_t c;
+  pid_t     pid = fork();
+
+  if (pid) { return pid; }
+
+  CPU_ZERO(&c);
+  CPU_SET(cpu, &c);
+  if (sched_setaffinity(0, sizeof(c), &c)) { _exit(0); }
+
+  _exit(MIN(measure_preemption(SUPERVISE_PROBE_MS) / 10, 255U));
+}
+
+#endif
+
+static void sv_start(afl_state_t *afl, struct sv_inst *in, u8 resume) {
+  u8         *log, fn[PATH_MAX];
+  struct stat st;
+  pid_t       pid;
+
+  /* stats from an earlier run do not count */
+
+  snprintf(fn, PATH_MAX, "%s/%s/fuzzer_stats", afl->out_dir, in->name);
+  in->stats_mtime = stat(fn, &st) ? 0 : st.st_mtime;
+  in->fuzzing = 0;
+
+  log = alloc_printf("%s/.supervise/%s.log", afl->out_dir, in->name);
+  pid = fork();
+
+  if (pid < 0) { PFATAL("fork() failed"); }
+
+  if (!pid) {
+    s32 fd = open(log, O_WRONLY | O_CREAT | O_APPEND, DEFAULT_PERMISSION);
+
+    if (fd >= 0) {
+      dup2(fd, 1);
+      dup2(fd, 2);
+      close(fd);
+    }
+
+    setenv("AFL_NO_UI", "1", 1);
+    if (in->is_main) { setenv("AFL_FINAL_SYNC", "1", 0); }
+    if (in->trim_off) { setenv("AFL_DISABLE_TRIM", "1", 0); }
+    if (resume) { setenv("AFL_AUTORESUME", "1", 1); }
+
+    execvp(in->argv[0], in->argv);
+    PFATAL("Unable to execute '%s'", in->argv[0]);
+  }
+
+  ck_free(log);
+
+  in->pid = pid;
+  in->start_ms = in->seen_ms = get_cur_time();
+  in->kill_ms = 0;
+  in->killed = 0;
+}
+
+/* Collect the exited instances and restart those that did not finish. */
+
+static void sv_reap(afl_state_t *afl, struct sv_inst *inst, u32 n) {
+  struct sv_inst *in;
+  pid_t           pid;
+  s32             status;
+  u32             i;
+
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    for (i = 0; i < n && inst[i].pid != pid; ++i) {}
+    if (i == n) { continue; }
+
+    in = &inst[i];
+    in->pid = 0;
+
+    if (sv_stop || in->state != SV_RUN) { continue; }
+
+    if (WIFEXITED(status) && !WEXITSTATUS(status) && !in->killed) {
+      OKF("Instance %s is done.", in->name);
+      in->state = SV_DONE;
+      continue;
+    }
+
+    if (get_cur_time() - in->start_ms < SUPERVISE_QUICK_SEC * 1000) {
+      ++in->quick_exits;
+
+    } else {
+      in->quick_exits = 0;
+    }
+
+    if (in->quick_exits >= SUPERVISE_QUICK_EXITS) {
+      WARNF("Instance %s exits right after its start, giving up on it (see %s"
+            "/.supervise/%s.log).",
+            in->name, afl->out_dir, in->name);
+      in->state = SV_FAILED;
+      continue;
+    }
+
+    if (in->killed) {
+      WARNF("Instance %s stalled, restarting it.", in->name);
+
+    } else if (WIFSIGNALED(status)) {
+      WARNF("Instance %s died with signal %d, restarting it.", in->name,
+            WTERMSIG(status));
+
+    } else {
+      WARNF("Instance %s exited with %d, restarting it.", in->name,
+            WEXITSTATUS(status));
+    }
+
+    sv_start(afl, in, in->resumable);
+  }
+}
+
+/* Kill the instances whose fuzzer_stats were not updated for too long. */
+
+static void sv_check_stalls(afl_state_t *afl, struct sv_inst *inst, u32 n) {
+  struct sv_inst *in;
+  struct stat     st;
+  u8              fn[PATH_MAX];
+  u64             now = get_cur_time();
+  u32             i;
+
+  for (i = 0; i < n; ++i) {
+    in = &inst[i];
+    if (!in->pid) { continue; }
+
+    if (in->kill_ms) {
+      if (now - in->kill_ms > SUPERVISE_KILL_SEC * 1000) {
+        kill(in->pid, SIGKILL);
+      }
+
+      continue;
+    }
+
+    snprintf(fn, PATH_MAX, "%s/%s/fuzzer_stats", afl->out_dir, in->name);
+
+    if (!stat(fn, &st) && st.st_mtime != in->stats_mtime) {
+      in->stats_mtime = st.st_mtime;
+      in->seen_ms = now;
+      in->fuzzing = in->resumable = 1;
+
+    } else if (in->state == SV_RUN && in->fuzzing &&
+               now - in->seen_ms > SUPERVISE_STALL_SEC * 1000) {
+      in->killed = 1;
+      in->kill_ms = now;
+      kill(in->pid, SIGTERM);
+    }
+  }
+}
+
+#ifdef __linux__
+
+/* Park the last secondary while the CPUs of most instances are overbooked
+   as afl-gotcpu rates them, start it again once its CPU is available. */
+
+static void sv_check_cpu(afl_state_t *afl, struct sv_inst *inst, u32 n,
+                         u32 *busy, u32 *idle) {
+  struct sv_inst *in;
+  s32             status, parked = -1;
+  u32             i, running = 0, overbooked = 0;
+
+  /* the CPUs of the running instances and of the first parked one */
+
+  for (i = 0; i < n; ++i) {
+    in = &inst[i];
+    in->probe_pid = -1;
+
+    if (in->cpu < 0) { continue; }
+
+    if (in->pid && in->state == SV_RUN) {
+      in->probe_pid = sv_probe(in->cpu);
+
+    } else if (parked < 0 && !in->pid && in->state == SV_PARKED) {
+      in->probe_pid = sv_probe(in->cpu);
+      parked = i;
+    }
+  }
+
+  for (i = 0; i < n; ++i) {
+    in = &inst[i];
+    in->probe = 0;
+
+    if (in->probe_pid <= 0 ||
+        waitpid(in->probe_pid, &status, 0) != in->probe_pid) {
+      continue;
+    }
+
+    in->probe = WIFEXITED(status) ? WEXITSTATUS(status) * 10 : 0;
+
+    if ((s32)i != parked && in->probe) {
+      ++running;
+      if (in->probe >= CTEST_OVERBOOKED) { ++overbooked; }
+    }
+  }
+
+  if (running && overbooked * 2 > running) {
+    ++*busy;
+
+  } else {
+    *busy = 0;
+  }
+
+  if (parked >= 0 && inst[parked].probe &&
+      inst[parked].probe < CTEST_AVAILABLE) {
+    ++*idle;
+
+  } else {
+    *idle = 0;
+  }
+
+  if (*busy >= SUPERVISE_PARK_CHECKS) {
+    *busy = 0;
+
+    for (i = n - 1; i; --i) {
+      in = &inst[i];
+      if (!in->pid || in->state != SV_RUN) { continue; }
+
+      WARNF("The CPUs are overbooked (%u%% on #%d), parking instance %s.",
+            in->probe, in->cpu, in->name);
+      in->state = SV_PARKED;
+      in->kill_ms = get_cur_time();
+      kill(in->pid, SIGTERM);
+      break;
+    }
+  }
+
+  if (*idle >= SUPERVISE_RESUME_CHECKS) {
+    *idle = 0;
+    in = &inst[parked];
+
+    OKF("CPU #%d is available again (%u%%), resuming instance %s.", in->cpu,
+        in->probe, in->name);
+    in->state = SV_RUN;
+    sv_start(afl, in, in->resumable);
+  }
+}
+
+#endif
+
+/* Start afl->supervise_cnt instances with the options of argv up to
+   opt_end, as getopt() parsed them with opts, and supervise them until all
+   are done or we are stopped. Does not return. */
+
+void supervise(afl_state_t *afl, int argc, char **argv, int opt_end,
+               const char *opts) {
+  static char *sched[] = {"explore", "coe",    "lin",  "quad",
+                          "exploit", "energy", "rare", "fast"};
+
+  struct sv_opt  *opt = NULL;
+  struct sv_inst *inst, *in;
+  struct sigaction sa;
+  u32              n = afl->supervise_cnt, opt_cnt = 0, cpu_cnt = 0;
+  u32              cmplog_cnt = 0, busy = 0, idle = 0, i, j, s, vn;
+  s32              cpu[4096];
+  u8               has[256] = {0}, host[64], cmplog, *dir;
+  char            *p, *o, **v;
+  u64              last_check = 0;
+
+  if (afl->sync_id) { FATAL("-j starts its own -M and -S instances"); }
+  if (afl->cpu_to_bind != -1) { FATAL("-j pins the instances itself"); }
+
+  /* the options, split up one per argument, without -j */
+
+  for (i = 1; i < (u32)opt_end; ++i) {
+    if (!strcmp(argv[i], "--")) { break; }
+
+    for (p = argv[i] + 1; *p; ++p) {
+      has[(u8)*p] = 1;
+
+      if (*p != 'j') {
+        opt = ck_realloc(opt, (opt_cnt + 1) * sizeof(struct sv_opt));
+        opt[opt_cnt].opt = *p;
+        opt[opt_cnt].arg = NULL;
+      }
+
+      if ((o = strchr(opts, *p)) && o[1] == ':') {
+        if (*p != 'j') { opt[opt_cnt].arg = p[1] ? p + 1 : argv[i + 1]; }
+        if (!p[1]) { ++i; }
+        if (*p != 'j') { ++opt_cnt; }
+        break;
+      }
+
+      if (*p != 'j') { ++opt_cnt; }
+    }
+  }
+
+#ifdef __linux__
+  if (!afl->afl_env.afl_no_affinity) {
+    cpu_cnt = sv_cpu_order(cpu, sizeof(cpu) / sizeof(cpu[0]));
+
+    if (n > cpu_cnt) {
+      FATAL("-j %u is more than the %u CPUs, set AFL_NO_AFFINITY to run them "
+            "unpinned",
+            n, cpu_cnt);
+    }
+  }
+
+#endif
+
+  if (gethostname((char *)host, sizeof(host))) { strcpy(host, "host"); }
+  host[sizeof(host) - 1] = 0;
+
+  inst = ck_alloc(n * sizeof(struct sv_inst));
+
+  for (i = 0; i < n; ++i) {
+    in = &inst[i];
+    v = NULL;
+    vn = 0;
+    s = i % 10;
+    cmplog = 0;
+
+    sv_push(&v, &vn, argv[0]);
+
+    if (!i) {
+      snprintf(in->name, sizeof(in->name), "main-%s", host);
+      in->is_main = 1;
+      sv_push(&v, &vn, "-M");
+
+    } else {
+      snprintf(in->name, sizeof(in->name), "variant%u", i);
+      sv_push(&v, &vn, "-S");
+    }
+
+    sv_push(&v, &vn, in->name);
+
+    in->cpu = cpu_cnt ? cpu[i] : -1;
+
+    if (in->cpu >= 0) {
+      sv_push(&v, &vn, "-b");
+      sv_push(&v, &vn, alloc_printf("%d", in->cpu));
+    }
+
+    /* the mix of docs/fuzzing_in_depth.md for the secondaries, options
+       the user gave are left alone */
+
+    if (i) {
+      if (!has['p']) {
+        sv_push(&v, &vn, "-p");
+        sv_push(&v, &vn, sched[(i - 1) % (sizeof(sched) / sizeof(sched[0]))]);
+      }
+
+      if (!has['P'] && s >= 1 && s <= 6) {
+        sv_push(&v, &vn, "-P");
+        sv_push(&v, &vn, s <= 4 ? "explore" : "exploit");
+      }
+
+      if (!has['L'] && s == 7) {
+        sv_push(&v, &vn, "-L");
+        sv_push(&v, &vn, "0");
+      }
+
+      if (!has['Z'] && s == 8) { sv_push(&v, &vn, "-Z"); }
+
+      if (!has['a'] && s >= 2 && s % 3 != 1) {
+        sv_push(&v, &vn, "-a");
+        sv_push(&v, &vn, s % 3 == 2 ? "ascii" : "binary");
+      }
+
+      in->trim_off = s % 5 < 3;
+
+      /* 30% of the secondaries use the -c binary, one in five of them
+         follows transformations */
+
+      if (has['c'] && s % 3 == 1) {
+        cmplog = 1;
+
+        if (!has['l']) {
+          sv_push(&v, &vn, "-l");
+          sv_push(&v, &vn, cmplog_cnt % 5 ? "2" : "2AT");
+        }
+
+        ++cmplog_cnt;
+      }
+    }
+
+    for (j = 0; j < opt_cnt; ++j) {
+      if (i && opt[j].opt == 'c' && !cmplog) { continue; }
+      if (i && opt[j].opt == 'a' && s % 3 == 1) { continue; }
+
+      sv_push(&v, &vn, alloc_printf("-%c", opt[j].opt));
+      if (opt[j].arg) { sv_push(&v, &vn, opt[j].arg); }
+    }
+
+    sv_push(&v, &vn, "--");
+
+    for (j = opt_end; j < (u32)argc; ++j) {
+      sv_push(&v, &vn, argv[j]);
+    }
+
+    sv_push(&v, &vn, NULL);
+    in->argv = v;
+  }
+
+  dir = alloc_printf("%s/.supervise", afl->out_dir);
+
+  if ((mkdir(afl->out_dir, 0700) && errno != EEXIST) ||
+      (mkdir(dir, 0700) && errno != EEXIST)) {
+    PFATAL("Unable to create '%s'", dir);
+  }
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = sv_handle_stop;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGHUP, &sa, NULL);
+
+  ACTF("Starting %u instances, their output goes to %s/...", n, dir);
+
+  for (i = 0; i < n; ++i) {
+    in = &inst[i];
+
+    SAYF("    %-20s", in->name);
+    for (j = 1; in->argv[j] && strcmp(in->argv[j], "--"); ++j) {
+      SAYF(" %s", in->argv[j]);
+    }
+
+    SAYF("%s\n", in->trim_off ? " (AFL_DISABLE_TRIM)" : "");
+
+    sv_start(afl, in, 0);
+
+    /* the main node creates the sync structure first */
+
+    if (!i && n > 1) { sleep(1); }
+  }
+
+  while (!sv_stop) {
+    sleep(1);
+    sv_reap(afl, inst, n);
+
+    for (i = 0; i < n && !inst[i].pid && inst[i].state != SV_RUN; ++i) {}
+    if (i == n) { break; }
+
+    if (get_cur_time() - last_check < SUPERVISE_CHECK_SEC * 1000) { continue; }
+    last_check = get_cur_time();
+
+    sv_check_stalls(afl, inst, n);
+#ifdef __linux__
+    sv_check_cpu(afl, inst, n, &busy, &idle);
+#endif
+  }
+
+  if (sv_stop) { ACTF("Stopping the instances..."); }
+
+  for (i = 0; i < n; ++i) {
+    if (inst[i].pid) { kill(inst[i].pid, SIGTERM); }
+  }
+
+  for (j = 0; j < SUPERVISE_KILL_SEC * 10; ++j) {
+    sv_reap(afl, inst, n);
+    for (i = 0; i < n && !inst[i].pid; ++i) {}
+    if (i == n) { break; }
+    usleep(100000);
+  }
+
+  for (i = 0; i < n; ++i) {
+    if (inst[i].pid) { kill(inst[i].pid, SIGKILL); }
+  }
+
+  while (waitpid(-1, NULL, 0) > 0) {}
+
+  OKF("All instances are stopped, see %s for their output.", dir);
+  exit(0);
+}
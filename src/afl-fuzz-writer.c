@@ -0,0 +1,235 @@
+/*
+ * This implements AFL_ASYNC_WRITES: the queue, crash and hang files and the
+ * markers under queue/.state are created and removed by a thread of its
+ * own, so a burst of finds on a busy disk does not stall the fuzz loop in
+ * open(), write() and unlink(). The jobs are done strictly in the order
+ * they were submitted, so a marker that is created and removed again ends
+ * up removed. Every job gets a sequence number and writer_wait() waits
+ * until the job with a given one is done; a queue entry keeps that of its
+ * file in write_seq, see queue_file_wait(). The buffers of the slots are
+ * only allocated and freed by the main thread.
+ *
+ */
+
+#include "afl-fuzz.h"
+#include <pthread.h>
+
+enum {
+
+  /* 00 */ WRITER_CREATE,                /* O_EXCL create, write buf    */
+  /* 01 */ WRITER_UNLINK                 /* remove the file             */
+
+};
+
+struct writer_job {
+  u8  op;
+  u8  fn[PATH_MAX];
+  u8 *buf;                               /* contents, kept for reuse    */
+  u32 len, size;
+};
+
+struct writer {
+  pthread_t       thread;
+  pthread_mutex_t lock;
+  pthread_cond_t  work;                  /* a job was submitted         */
+  pthread_cond_t  done;                  /* a job was done              */
+  u64             submitted, finished;   /* sequence numbers            */
+  u8              stop, main_waiting;
+
+  s32 err;                               /* errno of the first failure  */
+  u8  err_fn[PATH_MAX];
+
+  struct writer_job job[WRITER_JOBS];
+};
+
+static void writer_do(struct writer *w, struct writer_job *j) {
+  s32 fd;
+
+  if (j->op == WRITER_UNLINK) {
+    if (!unlink(j->fn)) { return; }
+
+  } else {
+    fd = open(j->fn, O_WRONLY | O_CREAT | O_EXCL, DEFAULT_PERMISSION);
+
+    if (fd >= 0) {
+      u32 written = 0;
+
+      while (written < j->len) {
+        ssize_t res = write(fd, j->buf + written, j->len - written);
+        if (res <= 0) { break; }
+        written += res;
+      }
+
+      close(fd);
+      if (written == j->len) { return; }
+    }
+  }
+
+  /* the main thread reports it, exiting here would race its cleanup */
+
+  pthread_mutex_lock(&w->lock);
+
+  if (!w->err) {
+    w->err = errno ? errno : EIO;
+    memcpy(w->err_fn, j->fn, PATH_MAX);
+  }
+
+  pthread_mutex_unlock(&w->lock);
+}
+
+static void *writer_work(void *arg) {
+  struct writer *w = arg;
+  u64            seq;
+
+  while (1) {
+    pthread_mutex_lock(&w->lock);
+
+    while (w->finished == w->submitted && !w->stop) {
+      pthread_cond_wait(&w->work, &w->lock);
+    }
+
+    if (w->finished == w->submitted) {
+      pthread_mutex_unlock(&w->lock);
+      break;
+    }
+
+    seq = w->finished + 1;
+    pthread_mutex_unlock(&w->lock);
+
+    writer_do(w, &w->job[(seq - 1) % WRITER_JOBS]);
+
+    pthread_mutex_lock(&w->lock);
+    w->finished = seq;
+    if (w->main_waiting) { pthread_cond_signal(&w->done); }
+    pthread_mutex_unlock(&w->lock);
+  }
+
+  return NULL;
+}
+
+static void writer_check(struct writer *w) {
+  s32 err;
+
+  pthread_mutex_lock(&w->lock);
+  err = w->err;
+  pthread_mutex_unlock(&w->lock);
+
+  if (unlikely(err)) {
+    errno = err;
+    PFATAL("Unable to write '%s'", w->err_fn);
+  }
+}
+
+/* Returns the next free slot, waiting while all are taken. */
+
+static struct writer_job *writer_slot(struct writer *w) {
+  pthread_mutex_lock(&w->lock);
+
+  while (w->submitted - w->finished >= WRITER_JOBS) {
+    w->main_waiting = 1;
+    pthread_cond_wait(&w->done, &w->lock);
+  }
+
+  w->main_waiting = 0;
+  pthread_mutex_unlock(&w->lock);
+
+  writer_check(w);
+
+  return &w->job[w->submitted % WRITER_JOBS];
+}
+
+static u64 writer_submit(struct writer *w) {
+  u64 seq;
+
+  pthread_mutex_lock(&w->lock);
+  seq = ++w->submitted;
+  pthread_cond_signal(&w->work);
+  pthread_mutex_unlock(&w->lock);
+
+  return seq;
+}
+
+void writer_init(afl_state_t *afl) {
+  if (!afl->afl_env.afl_async_writes) { return; }
+
+  struct writer *w = ck_alloc(sizeof(struct writer));
+
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->work, NULL);
+  pthread_cond_init(&w->done, NULL);
+
+  if (pthread_create(&w->thread, NULL, writer_work, w)) {
+    PFATAL("pthread_create() failed");
+  }
+
+  afl->writer = w;
+}
+
+/* Creates fn with the len bytes at buf, which are copied. Returns the
+   sequence number of the job. */
+
+u64 writer_create(struct writer *w, u8 *fn, u8 *buf, u32 len) {
+  struct writer_job *j = writer_slot(w);
+
+  if (len > j->size) {
+    j->buf = ck_realloc(j->buf, len);
+    j->size = len;
+  }
+
+  if (len) { memcpy(j->buf, buf, len); }
+  j->len = len;
+  j->op = WRITER_CREATE;
+  strncpy((char *)j->fn, (char *)fn, PATH_MAX - 1);
+  j->fn[PATH_MAX - 1] = 0;
+
+  return writer_submit(w);
+}
+
+u64 writer_unlink(struct writer *w, u8 *fn) {
+  struct writer_job *j = writer_slot(w);
+
+  j->op = WRITER_UNLINK;
+  strncpy((char *)j->fn, (char *)fn, PATH_MAX - 1);
+  j->fn[PATH_MAX - 1] = 0;
+
+  return writer_submit(w);
+}
+
+/* Waits until the job seq and so all before it are done. */
+
+void writer_wait(struct writer *w, u64 seq) {
+  pthread_mutex_lock(&w->lock);
+
+  while (w->finished < seq) {
+    w->main_waiting = 1;
+    pthread_cond_wait(&w->done, &w->lock);
+  }
+
+  w->main_waiting = 0;
+  pthread_mutex_unlock(&w->lock);
+
+  writer_check(w);
+}
+
+/* Finishes all jobs and stops the thread. */
+
+void writer_destroy(struct writer *w) {
+  u32 i;
+
+  pthread_mutex_lock(&w->lock);
+  w->stop = 1;
+  pthread_cond_signal(&w->work);
+  pthread_mutex_unlock(&w->lock);
+
+  pthread_join(w->thread, NULL);
+  writer_check(w);
+
+  for (i = 0; i < WRITER_JOBS; ++i) {
+    if (w->job[i].buf) { ck_free(w->job[i].buf); }
+  }
+
+  pthread_mutex_destroy(&w->lock);
+  pthread_cond_destroy(&w->work);
+  pthread_cond_destroy(&w->done);
+  ck_free(w);
+}
@@ -26,8 +26,15 @@
 #include "afl-fuzz.h"
 #include "cmplog.h"
 #include "common.h"
+#include "injections.h"
 #include <limits.h>
 #include <stdlib.h>
+
+/* The getopt() options, -j passes them on to its instances. */
+
+#define AFL_FUZZ_OPTS \
+  "+a:Ab:B:c:CdDe:E:f:F:g:G:hi:I:j:l:L:m:M:nNo:Op:P:QRs:S:t:T:UV:WXx:YZ"
+
 #ifndef USEMMAP
   #include <sys/mman.h>
   #include <sys/stat.h>
@@ -111,7 +118,7 @@ static void usage(u8 *argv0, int more_help) {
       "Required parameters:\n"
       "  -i dir        - input directory with test cases (or '-' to resume, "
       "also see \n"
-      "                  AFL_AUTORESUME)\n"
+      "                  AFL_AUTORESUME), or an uncompressed tar file\n"
       "  -o dir        - output directory for fuzzer findings\n\n"
 
       "Execution control settings:\n"
@@ -125,7 +132,8 @@ static void usage(u8 *argv0, int more_help) {
       "  -p schedule   - power schedules compute a seed's performance score:\n"
       "                  explore(default), fast, exploit, seek, rare, mmopt, "
       "coe, lin\n"
-      "                  quad -- see docs/FAQ.md for more information\n"
+      "                  quad, energy -- see docs/FAQ.md for more "
+      "information\n"
       "  -f file       - location read by the fuzzed program (default: stdin "
       "or @@)\n"
       "  -t msec       - timeout for each run (auto-scaled, default %u ms). "
@@ -160,7 +168,7 @@ static void usage(u8 *argv0, int more_help) {
       "entering the\n"
       "                  pacemaker mode (minutes of no new finds). 0 = "
       "immediately,\n"
-      "                  -1 = immediately and together with normal mutation.\n"
+      "                  -1 = MOpt picks in every other havoc stage only.\n"
       "                  Note: this option is usually not very effective\n"
       "  -c program    - enable CmpLog by specifying a binary compiled for "
       "it.\n"
@@ -195,9 +203,8 @@ static void usage(u8 *argv0, int more_help) {
       "  -M/-S id      - distributed mode (-M sets -Z and disables trimming)\n"
       "                  see docs/fuzzing_in_depth.md#c-using-multiple-cores\n"
       "                  for effective recommendations for parallel fuzzing.\n"
-      "  -F path       - sync to a foreign fuzzer queue directory (requires "
-      "-M, can\n"
-      "                  be specified up to %u times)\n"
+      "  -F path       - sync to a foreign fuzzer queue directory or tar file\n"
+      "                  (requires -M, can be specified up to %u times)\n"
       // "  -d            - skip deterministic fuzzing in -M mode\n"
       "  -T text       - text banner to show on the screen\n"
       "  -I command    - execute this command/script when a new crash is "
@@ -207,6 +214,9 @@ static void usage(u8 *argv0, int more_help) {
       "  -C            - crash exploration mode (the peruvian rabbit thing)\n"
       "  -b cpu_id     - bind the fuzzing process to the specified CPU core "
       "(0-...)\n"
+      "  -j count      - start and supervise this many -M/-S instances with "
+      "the\n"
+      "                  recommended variations, one per CPU core\n"
       "  -e ext        - file extension for the fuzz test input file (if "
       "needed)\n"
       "\n",
@@ -236,13 +246,27 @@ static void usage(u8 *argv0, int more_help) {
       "              (must contain abort_on_error=1 and symbolize=0)\n"
       "MSAN_OPTIONS: custom settings for MSAN\n"
       "              (must contain exitcode="STRINGIFY(MSAN_ERROR)" and symbolize=0)\n"
+      "AFL_ADAPTIVE_TIMEOUT: keep adjusting the auto-detected timeout to the exec\n"
+      "                      times while fuzzing\n"
+      "AFL_ASYNC_WRITES: write queue, crash and hang files from a thread\n"
       "AFL_AUTORESUME: resume fuzzing if directory specified by -o already exists\n"
       "AFL_BENCH_JUST_ONE: run the target just once\n"
       "AFL_BENCH_UNTIL_CRASH: exit soon when the first crashing input has been found\n"
+      "AFL_CHECKPOINT: save the scheduling state every n seconds and pick it up\n"
+      "                when resuming (fuzzer_checkpoint.0/1 in -o)\n"
+      "AFL_CHECKSUM_FIXUP: find checksum fields with cmplog and recompute them\n"
+      "                    after each mutation\n"
+      "AFL_CMPLOG_CACHE_SIZE: MB of colorized inputs kept for reuse (default: 64)\n"
+      "AFL_CMPLOG_MAP_W/AFL_CMPLOG_MAP_H: cmplog map keys / logged hits per key\n"
+      "                  (powers of two, default 65536 and 32)\n"
       "AFL_CMPLOG_ONLY_NEW: do not run cmplog on initial testcases (good for resumes!)\n"
       "AFL_CRASH_EXITCODE: optional child exit code to be interpreted as crash\n"
+      "AFL_CUSTOM_MUTATOR_BANDIT: share the execs between the custom mutators and\n"
+      "                           havoc by what they found\n"
       "AFL_CUSTOM_MUTATOR_LIBRARY: lib with afl_custom_fuzz() to mutate inputs\n"
       "AFL_CUSTOM_MUTATOR_ONLY: avoid AFL++'s internal mutators\n"
+      "AFL_CUSTOM_MUTATOR_THREADS: run the afl_custom_fuzz() of thread safe custom\n"
+      "                            mutators in this many threads\n"
       "AFL_CYCLE_SCHEDULES: after completing a cycle, switch to a different -p schedule\n"
       "AFL_DEBUG: extra debugging output for Python mode trimming\n"
       "AFL_DEBUG_CHILD: do not suppress stdout/stderr from target\n"
@@ -254,9 +278,19 @@ static void usage(u8 *argv0, int more_help) {
       "AFL_EXPAND_HAVOC_NOW: immediately enable expand havoc mode (default: after 60\n"
       "                      minutes and a cycle without finds)\n"
       "AFL_FAST_CAL: limit the calibration stage to three cycles for speedup\n"
+      "AFL_FAUXSRV_TEMPLATE: -n: fork dynamic targets from a template process at\n"
+      "                      main() instead of an execve() per run (Linux)\n"
+      "AFL_FIELD_HINTS: use the field boundaries the harness gives with\n"
+      "                 __AFL_HINT_FIELD() in trimming and havoc\n"
       "AFL_FORCE_UI: force showing the status screen (for virtual consoles)\n"
       "AFL_FORKSRV_INIT_TMOUT: time spent waiting for forkserver during startup (in ms)\n"
+      "AFL_FSRV_LATENCY: record where the time of each forkserver round trip goes\n"
+      "AFL_HANG_CHECK_ASYNC: confirm timeouts with the hang timeout on a spare\n"
+      "                      forkserver while fuzzing goes on\n"
       "AFL_HANG_TMOUT: override timeout value (in milliseconds)\n"
+      "AFL_HANG_WATCHDOG: soft[,idle] ms of CPU time after which runs that touch\n"
+      "                   no new map entries for idle ms are timeouts\n"
+      "AFL_HAVOC_BANDIT: pick the havoc operators by what their execs found\n"
       "AFL_I_DONT_CARE_ABOUT_MISSING_CRASHES: don't warn about core dump handlers\n"
       "AFL_IGNORE_PROBLEMS: do not abort fuzzing if an incorrect setup is detected\n"
       "AFL_IGNORE_PROBLEMS_COVERAGE: if set in addition to AFL_IGNORE_PROBLEMS - also\n"
@@ -267,6 +301,8 @@ static void usage(u8 *argv0, int more_help) {
       "AFL_IGNORE_UNKNOWN_ENVS: don't warn on unknown env vars\n"
       "AFL_IMPORT_FIRST: sync and import test cases from other fuzzer instances first\n"
       "AFL_INPUT_LEN_MIN/AFL_INPUT_LEN_MAX: like -g/-G set min/max fuzz length produced\n"
+      "AFL_INTEL_PT: coverage of non-instrumented targets from Intel PT traces (Linux)\n"
+      "AFL_INTEL_PT_THREADS: number of threads that decode the traces (default: 1)\n"
       "AFL_PIZZA_MODE: 1 - enforce pizza mode, -1 - disable for April 1st,\n"
       "                0 (default) - activate on April 1st\n"
       "AFL_KILL_SIGNAL: Signal ID delivered to child processes on timeout, etc.\n"
@@ -276,9 +312,15 @@ static void usage(u8 *argv0, int more_help) {
       "                             set, that value will be used.\n"
       "AFL_MAP_SIZE: the shared memory size for that target. must be >= the size\n"
       "              the target was compiled for\n"
+      "AFL_MAP_SIZE_MAX: leave room in the shared map up to this size for the\n"
+      "                  coverage of instrumented libraries loaded after the\n"
+      "                  forkserver is up, the map then grows during fuzzing\n"
+      "AFL_LARGE_INPUTS: take queue entries up to this many MB, mutated in\n"
+      "                  windows that the runs patch into the rest of them\n"
       "AFL_MAX_DET_EXTRAS: if more entries are in the dictionary list than this value\n"
       "                    then they are randomly selected instead all of them being\n"
       "                    used. Defaults to 200.\n"
+      "AFL_MEMFD_INPUT: pass test cases for @@ in a memfd instead of a file (Linux)\n"
       "AFL_NO_AFFINITY: do not check for an unused cpu core to use for fuzzing\n"
       "AFL_TRY_AFFINITY: try to bind to an unused core, but don't fail if unsuccessful\n"
       "AFL_NO_ARITH: skip arithmetic mutations in deterministic stage\n"
@@ -300,17 +342,35 @@ static void usage(u8 *argv0, int more_help) {
       "AFL_PATH: path to AFL support binaries\n"
       "AFL_PYTHON_MODULE: mutate and trim inputs with the specified Python module\n"
       "AFL_QUIET: suppress forkserver status messages\n"
+      "AFL_RECORD: record the session to this log, to repeat it with AFL_REPLAY\n"
+      "AFL_REPLAY: repeat the session recorded in this log (for benchmarking)\n"
 
       PERSISTENT_MSG
 
+      "AFL_POST_PROCESS_CACHE: keep the post processed test cases of this many inputs\n"
       "AFL_POST_PROCESS_KEEP_ORIGINAL: save the file as it was prior post-processing to\n"
       "                                the queue, but execute the post-processed one\n"
       "AFL_PRELOAD: LD_PRELOAD / DYLD_INSERT_LIBRARIES settings for target\n"
       "AFL_TARGET_ENV: pass extra environment variables to target\n"
+      "AFL_TARGET_NOVELTY: persistent targets check their coverage against a copy\n"
+      "                    of the virgin map themselves\n"
+      "AFL_SHM_FULL_WRITE: copy the whole shared memory testcase on every exec\n"
+      "                    (for targets that change their input)\n"
+      "AFL_SHM_HUGEPAGES: back the coverage and cmplog maps with huge pages\n"
+      "AFL_SEED_BATCH: read the input directory n seeds at a time while\n"
+      "                fuzzing, link the kept ones instead of copying them\n"
       "AFL_SHUFFLE_QUEUE: reorder the input queue randomly on startup\n"
       "AFL_SKIP_BIN_CHECK: skip afl compatibility checks, also disables auto map size\n"
       "AFL_SKIP_CPUFREQ: do not warn about variable cpu clocking\n"
       //"AFL_SKIP_CRASHES: during initial dry run do not terminate for crashing inputs\n"
+      "AFL_SPLICE_COVER: splice with entries that cover edges the current one\n"
+      "                  does not\n"
+      "AFL_STAGE_BUDGET: give the stages budget by what their recent execs found\n"
+      "AFL_STATE_DIRS: also flag queue entries with files in queue/.state/\n"
+      "AFL_STATS_PAGE: keep the main fuzzer_stats numbers in a binary page that\n"
+      "                is updated in place (fuzzer_stats.page in -o)\n"
+      "AFL_METRICS_PORT: serve Prometheus metrics over HTTP on this port\n"
+      "AFL_METRICS_HOST: address to serve them on (default: 127.0.0.1)\n"
       "AFL_STATSD: enables StatsD metrics collection\n"
       "AFL_STATSD_HOST: change default statsd host (default 127.0.0.1)\n"
       "AFL_STATSD_PORT: change default statsd port (default: 8125)\n"
@@ -318,12 +378,26 @@ static void usage(u8 *argv0, int more_help) {
       "                        suported formats: dogstatsd, librato, signalfx, influxdb\n"
       "AFL_SYNC_TIME: sync time between fuzzing instances (in minutes)\n"
       "AFL_FINAL_SYNC: sync a final time when exiting (will delay the exit!)\n"
+      "AFL_SHARED_VIRGIN: share the virgin maps with the instances of the sync\n"
+      "                   directory, own finds they have are not queued\n"
+      "AFL_CRASH_DEDUP: do not save crashes and hangs that another instance of\n"
+      "                 the sync directory saved already\n"
+      "AFL_QUEUE_STORE: keep queue files as hard links to one copy of every\n"
+      "                 content in the .store directory of -o\n"
+      "AFL_SYNC_PLAN: the main node splits the queue among the secondaries,\n"
+      "               which prefer their share (set it on all of them)\n"
       "AFL_NO_CRASH_README: do not create a README in the crashes directory\n"
       "AFL_TESTCACHE_SIZE: use a cache for testcases, improves performance (in MB)\n"
       "AFL_TMPDIR: directory to use for input file generation (ramdisk recommended)\n"
+      "AFL_USERSPACE_SNAPSHOT: snapshot forking targets without the snapshot lkm\n"
       "AFL_EARLY_FORKSERVER: force an early forkserver in an afl-clang-fast/\n"
       "                      afl-clang-lto/afl-gcc-fast target\n"
       "AFL_PERSISTENT: enforce persistent mode (if __AFL_LOOP is in a shared lib)\n"
+      "AFL_PERSISTENT_TUNE: tune the __AFL_LOOP() count to the largest one without state leaks\n"
+      "AFL_PC_FILTER_FILE: the coverage filter of a CODE_COVERAGE target, reloaded\n"
+      "                    when it changes (see utils/dynamic_covfilter)\n"
+      "AFL_ANALYZE_DIR: afl-analyze -o exports, used as the byte importance map\n"
+      "                 of entries with the same contents\n"
       "AFL_DEFER_FORKSRV: enforced deferred forkserver (__AFL_INIT is in a shared lib)\n"
       "AFL_FUZZER_STATS_UPDATE_INTERVAL: interval to update fuzzer_stats file in\n"
       "                                  seconds (default: 60, minimum: 1)\n"
@@ -434,6 +508,37 @@ static void fasan_check_afl_preload(char *afl_preload) {
   OKF("Found ASAN DSO: %s", first_preload);
 }
 
+/* AFL_MAP_SIZE_MAX: the main shared map is created with room for the
+   guards of instrumented libraries the target only loads in its children,
+   see map_grow(). */
+
+static void setup_map_cap(afl_state_t *afl) {
+  s32 cap = atoi(afl->afl_env.afl_map_size_max);
+
+  if (cap < 64 || cap > (1 << 29)) {
+    FATAL("AFL_MAP_SIZE_MAX must be between 64 and %u", 1U << 29);
+  }
+
+#ifdef __linux__
+  if (afl->non_instrumented_mode || afl->fsrv.qemu_mode || afl->unicorn_mode ||
+      afl->fsrv.frida_mode || afl->fsrv.cs_mode || afl->fsrv.ipt_mode ||
+      afl->fsrv.nyx_mode || afl->afl_env.afl_shared_virgin) {
+    WARNF(
+        "AFL_MAP_SIZE_MAX needs an instrumented target and does not work "
+        "with AFL_SHARED_VIRGIN - ignoring it.");
+    return;
+  }
+
+  afl->fsrv.map_cap = (cap + 63) & ~63;
+#else
+  WARNF("AFL_MAP_SIZE_MAX is only supported on Linux - ignoring it.");
+#endif
+}
+
+static u32 shm_map_size(afl_state_t *afl, u32 map_size) {
+  return MAX(map_size, afl->fsrv.map_cap);
+}
+
 /* Main entry point */
 
 int main(int argc, char **argv_orig, char **envp) {
@@ -495,11 +600,18 @@ int main(int argc, char **argv_orig, char **envp) {
 
   afl->shmem_testcase_mode = 1;  // we always try to perform shmem fuzzing
 
-  // still available: HjJkKqruvwz
-  while ((opt = getopt(argc, argv,
-                       "+a:Ab:B:c:CdDe:E:f:F:g:G:hi:I:l:L:m:M:nNo:Op:P:QRs:S:t:"
-                       "T:UV:WXx:YZ")) > 0) {
+  // still available: HJkKqruvwz
+  while ((opt = getopt(argc, argv, AFL_FUZZ_OPTS)) > 0) {
     switch (opt) {
+      case 'j':
+
+        if (sscanf(optarg, "%u", &afl->supervise_cnt) < 1 ||
+            !afl->supervise_cnt) {
+          FATAL("Bad syntax used for -j");
+        }
+
+        break;
+
       case 'a':
 
         if (!stricmp(optarg, "text") || !stricmp(optarg, "ascii") ||
@@ -612,6 +724,9 @@ int main(int argc, char **argv_orig, char **envp) {
         } else if (!stricmp(optarg, "mopt") || !stricmp(optarg, "mmopt")) {
           afl->schedule = MMOPT;
 
+        } else if (!stricmp(optarg, "energy")) {
+          afl->schedule = ENERGY;
+
         } else if (!stricmp(optarg, "rare")) {
           afl->schedule = RARE;
 
@@ -1108,7 +1223,6 @@ int main(int argc, char **argv_orig, char **envp) {
 
           for (j = 0; j < operator_num; ++j) {
             afl->stage_finds_puppet[tmp_swarm][j] = 0;
-            afl->probability_now[tmp_swarm][j] = 0.0;
             afl->x_now[tmp_swarm][j] =
                 ((double)(random() % 7000) * 0.0001 + 0.1);
             total_puppet_temp += afl->x_now[tmp_swarm][j];
@@ -1130,7 +1244,6 @@ int main(int argc, char **argv_orig, char **envp) {
           double x_temp = 0.0;
 
           for (j = 0; j < operator_num; ++j) {
-            afl->probability_now[tmp_swarm][j] = 0.0;
             afl->v_now[tmp_swarm][j] =
                 afl->w_now * afl->v_now[tmp_swarm][j] +
                 RAND_C *
@@ -1151,19 +1264,6 @@ int main(int argc, char **argv_orig, char **envp) {
 
           for (j = 0; j < operator_num; ++j) {
             afl->x_now[tmp_swarm][j] = afl->x_now[tmp_swarm][j] / x_temp;
-            if (likely(j != 0)) {
-              afl->probability_now[tmp_swarm][j] =
-                  afl->probability_now[tmp_swarm][j - 1] +
-                  afl->x_now[tmp_swarm][j];
-
-            } else {
-              afl->probability_now[tmp_swarm][j] = afl->x_now[tmp_swarm][j];
-            }
-          }
-
-          if (afl->probability_now[tmp_swarm][operator_num - 1] < 0.99 ||
-              afl->probability_now[tmp_swarm][operator_num - 1] > 1.01) {
-            FATAL("ERROR probability");
           }
         }
 
@@ -1172,7 +1272,6 @@ int main(int argc, char **argv_orig, char **envp) {
           afl->core_operator_finds_puppet_v2[j] = 0;
           afl->core_operator_cycles_puppet[j] = 0;
           afl->core_operator_cycles_puppet_v2[j] = 0;
-          afl->core_operator_cycles_puppet_v3[j] = 0;
         }
 
         WARNF(
@@ -1237,6 +1336,10 @@ int main(int argc, char **argv_orig, char **envp) {
     usage(argv[0], show_help);
   }
 
+  if (afl->supervise_cnt) {
+    supervise(afl, argc, argv, optind, AFL_FUZZ_OPTS);
+  }
+
   if (unlikely(afl->afl_env.afl_persistent_record)) {
   #ifdef AFL_PERSISTENT_RECORD
 
@@ -1278,6 +1381,8 @@ int main(int argc, char **argv_orig, char **envp) {
     afl->skip_deterministic = 1;
   }
 
+  replay_init(afl);
+
   if (afl->fixed_seed) {
     OKF("Running with fixed seed: %u", (u32)afl->init_seed);
   }
@@ -1344,6 +1449,18 @@ int main(int argc, char **argv_orig, char **envp) {
         afl->fsrv.nyx_id = nyx_id;
       }
     }
+
+    /* the runners of AFL_FSRV_WORKERS load the snapshot this one writes */
+
+    if (afl->afl_env.afl_fsrv_workers) {
+      if (afl->fsrv.nyx_standalone) {
+        afl->fsrv.nyx_standalone = false;
+
+      } else {
+        WARNF("AFL_FSRV_WORKERS needs Nyx mode -X, ignoring it for -Y.");
+        afl->afl_env.afl_fsrv_workers = NULL;
+      }
+    }
   }
 
   #endif
@@ -1368,6 +1485,29 @@ int main(int argc, char **argv_orig, char **envp) {
     if (afl->unicorn_mode) { FATAL("-U and -n are mutually exclusive"); }
   }
 
+  if (afl->afl_env.afl_intel_pt) {
+  #ifdef __linux__
+    if (afl->non_instrumented_mode || afl->fsrv.qemu_mode ||
+        afl->fsrv.frida_mode || afl->fsrv.cs_mode || afl->unicorn_mode ||
+        afl->fsrv.nyx_mode) {
+      FATAL("AFL_INTEL_PT does not go with -n, -Q, -O, -A, -U or -X");
+    }
+
+    if (afl->cmplog_binary) { FATAL("AFL_INTEL_PT does not support -c"); }
+
+    afl->fsrv.ipt_mode = 1;
+    if (afl->afl_env.afl_intel_pt_threads) {
+      afl->fsrv.ipt_threads = atoi(afl->afl_env.afl_intel_pt_threads);
+    }
+
+    afl_fsrv_ipt_setup(&afl->fsrv);
+    OKF("Using Intel PT coverage with %u decode thread(s).",
+        afl->fsrv.ipt_threads);
+  #else
+    FATAL("AFL_INTEL_PT is only supported on Linux");
+  #endif
+  }
+
   setenv("__AFL_OUT_DIR", afl->out_dir, 1);
 
   if (get_afl_env("AFL_DISABLE_TRIM")) { afl->disable_trim = 1; }
@@ -1382,6 +1522,15 @@ int main(int argc, char **argv_orig, char **envp) {
 
   if (afl->shm.cmplog_mode && strcmp("0", afl->cmplog_binary) == 0) {
     afl->cmplog_binary = strdup(argv[optind]);
+
+    /* the target itself may do the cmplog runs, see cmplog_switch_check() */
+    afl->fsrv.cmplog_switch = !afl->fsrv.qemu_mode && !afl->fsrv.frida_mode &&
+                              !afl->fsrv.cs_mode && !afl->unicorn_mode &&
+                              !afl->non_instrumented_mode &&
+                              !afl->afl_env.afl_skip_bin_check;
+  #ifdef __linux__
+    if (afl->fsrv.nyx_mode) { afl->fsrv.cmplog_switch = false; }
+  #endif
   }
 
   if (strchr(argv[optind], '/') == NULL && !afl->unicorn_mode) {
@@ -1412,6 +1561,9 @@ int main(int argc, char **argv_orig, char **envp) {
     case MMOPT:
       OKF("Using modified MOpt power schedule (MMOPT)");
       break;
+    case ENERGY:
+      OKF("Using finds per CPU second power schedule (ENERGY)");
+      break;
     case RARE:
       OKF("Using rare edge focus power schedule (RARE)");
       break;
@@ -1430,7 +1582,8 @@ int main(int argc, char **argv_orig, char **envp) {
 
   /* Dynamically allocate memory for AFLFast schedules */
   if (afl->schedule >= FAST && afl->schedule <= RARE) {
-    afl->n_fuzz = ck_alloc(N_FUZZ_SIZE * sizeof(u32));
+    n_fuzz_init(afl);
+    afl->path_bloom = ck_alloc((1U << PATH_BLOOM_POW2) >> 3);
   }
 
   if (get_afl_env("AFL_NO_FORKSRV")) { afl->no_forkserver = 1; }
@@ -1452,6 +1605,12 @@ int main(int argc, char **argv_orig, char **envp) {
     afl->hang_tmout = (u32)hang_tmout;
   }
 
+  if (afl->afl_env.afl_checkpoint) {
+    s32 checkpoint = atoi(afl->afl_env.afl_checkpoint);
+    if (checkpoint < 1) { FATAL("Invalid value for AFL_CHECKPOINT"); }
+    afl->checkpoint_ms = (u64)checkpoint * 1000;
+  }
+
   if (afl->afl_env.afl_exit_on_time) {
     u64 exit_on_time = atoi(afl->afl_env.afl_exit_on_time);
     afl->exit_on_time = (u64)exit_on_time * 1000;
@@ -1466,6 +1625,14 @@ int main(int argc, char **argv_orig, char **envp) {
     afl->max_det_extras = MAX_DET_EXTRAS;
   }
 
+  afl->cmplog_cache_max = (u64)CMPLOG_CACHE_SIZE * 1048576;
+
+  if (afl->afl_env.afl_cmplog_cache_size) {
+    s32 mb = atoi(afl->afl_env.afl_cmplog_cache_size);
+    if (mb < 0) { FATAL("Invalid value for AFL_CMPLOG_CACHE_SIZE"); }
+    afl->cmplog_cache_max = (u64)mb * 1048576;
+  }
+
   if (afl->afl_env.afl_testcache_size) {
     afl->q_testcase_max_cache_size =
         (u64)atoi(afl->afl_env.afl_testcache_size) * 1048576;
@@ -1494,6 +1661,10 @@ int main(int argc, char **argv_orig, char **envp) {
                                         : 1 + ((2 * MAX_FILE) / 1048576));
 
   } else {
+    if (afl->q_testcase_max_cache_entries < 2) {
+      FATAL("AFL_TESTCACHE_ENTRIES must be set to 2 or more");
+    }
+
     OKF("Enabled testcache with %llu MB",
         afl->q_testcase_max_cache_size / 1048576);
   }
@@ -1521,6 +1692,21 @@ int main(int argc, char **argv_orig, char **envp) {
     afl->fsrv.crash_exitcode = (u8)exitcode;
   }
 
+  if (afl->afl_env.afl_hang_watchdog) {
+    u32 soft_ms = 0, idle_ms = HANG_WATCHDOG_IDLE;
+    u8  buf[32];
+
+    if (sscanf(afl->afl_env.afl_hang_watchdog, "%u,%u", &soft_ms, &idle_ms) <
+            1 ||
+        !soft_ms || !idle_ms) {
+      FATAL("Invalid value for AFL_HANG_WATCHDOG, expected soft[,idle] ms");
+    }
+
+    snprintf(buf, sizeof(buf), "%u,%u", soft_ms, idle_ms);
+    setenv(HANG_WATCHDOG_ENV_VAR, buf, 1);
+    afl->fsrv.hang_watchdog = true;
+  }
+
   if (afl->non_instrumented_mode == 2 && afl->no_forkserver) {
     FATAL("AFL_DUMB_FORKSRV and AFL_NO_FORKSRV are mutually exclusive");
   }
@@ -1531,17 +1717,23 @@ int main(int argc, char **argv_orig, char **envp) {
     OKF("Adding injection tokens to dictionary.");
     if (getenv("AFL_LLVM_INJECTIONS_ALL") ||
         getenv("AFL_LLVM_INJECTIONS_SQL")) {
-      add_extra(afl, "'\"\"'", 4);
+      for (u32 i = 0; i < INJECTION_CNT(injection_sql); ++i) {
+        add_extra(afl, (u8 *)injection_sql[i].str, injection_sql[i].len);
+      }
     }
 
     if (getenv("AFL_LLVM_INJECTIONS_ALL") ||
         getenv("AFL_LLVM_INJECTIONS_LDAP")) {
-      add_extra(afl, "*)(1=*))(|", 10);
+      for (u32 i = 0; i < INJECTION_CNT(injection_ldap); ++i) {
+        add_extra(afl, (u8 *)injection_ldap[i].str, injection_ldap[i].len);
+      }
     }
 
     if (getenv("AFL_LLVM_INJECTIONS_ALL") ||
         getenv("AFL_LLVM_INJECTIONS_XSS")) {
-      add_extra(afl, "1\"><\"", 5);
+      for (u32 i = 0; i < INJECTION_CNT(injection_xss); ++i) {
+        add_extra(afl, (u8 *)injection_xss[i].str, injection_xss[i].len);
+      }
     }
   }
 
@@ -1555,7 +1747,8 @@ int main(int argc, char **argv_orig, char **envp) {
   afl_realloc(AFL_BUF_PARAM(eff), min_alloc);
   afl_realloc(AFL_BUF_PARAM(ex), min_alloc);
 
-  afl->fsrv.use_fauxsrv = afl->non_instrumented_mode == 1 || afl->no_forkserver;
+  afl->fsrv.use_fauxsrv = afl->non_instrumented_mode == 1 ||
+                          afl->no_forkserver || afl->fsrv.ipt_mode;
 
   #ifdef __linux__
   if (!afl->fsrv.nyx_mode) {
@@ -1653,6 +1846,15 @@ int main(int argc, char **argv_orig, char **envp) {
   atexit(at_exit);
 
   setup_dirs_fds(afl);
+  queue_store_init(afl);
+  stats_page_open(afl);
+
+  if (afl->afl_env.afl_fsrv_latency) {
+    afl->fsrv.latency = ck_alloc(sizeof(struct fsrv_latency));
+  }
+
+  metrics_init(afl);
+  writer_init(afl);
 
   #ifdef HAVE_AFFINITY
   bind_to_free_cpu(afl);
@@ -1678,6 +1880,7 @@ int main(int argc, char **argv_orig, char **envp) {
   #endif
 
   init_count_class16();
+  init_classify_kernel();
 
   if (afl->is_main_node && check_main_node_exists(afl) == 1) {
     WARNF("it is wasteful to run more than one main node!");
@@ -1753,27 +1956,15 @@ int main(int argc, char **argv_orig, char **envp) {
     afl->skip_deterministic = 1;
   }
 
-  if (afl->limit_time_sig > 0 && afl->custom_mutators_count) {
-    if (afl->custom_only) {
-      FATAL("Custom mutators are incompatible with MOpt (-L)");
-    }
-
-    u32 custom_fuzz = 0;
-    LIST_FOREACH(&afl->custom_mutator_list, struct custom_mutator, {
-      if (el->afl_custom_fuzz) { custom_fuzz = 1; }
-    });
-
-    if (custom_fuzz) {
-      WARNF("afl_custom_fuzz is incompatible with MOpt (-L)");
-    }
-  }
-
   write_setup_file(afl, argc, argv);
 
   setup_cmdline_file(afl, argv + optind);
 
+  if (afl->afl_env.afl_large_inputs) { setup_large_inputs(afl); }
+
   read_testcases(afl, NULL);
   // read_foreign_testcases(afl, 1); for the moment dont do this
+  load_analyses(afl);
   OKF("Loaded a total of %u seeds.", afl->queued_items);
 
   pivot_inputs(afl);
@@ -1815,7 +2006,19 @@ int main(int argc, char **argv_orig, char **envp) {
         afl->fsrv.use_stdin = 0;
         default_output = 0;
 
-        if (afl->file_extension) {
+        if (afl->afl_env.afl_memfd_input) {
+          if (afl->file_extension) {
+            WARNF("AFL_MEMFD_INPUT does not support -e, using a file.");
+
+          } else if (!setup_memfd_file(afl)) {
+            WARNF("AFL_MEMFD_INPUT: memfd_create() failed, using a file.");
+          }
+        }
+
+        if (afl->fsrv.use_memfd) {
+          /* out_file is /proc/self/fd/N, see setup_memfd_file() */
+
+        } else if (afl->file_extension) {
           afl->fsrv.out_file = alloc_printf("%s/.cur_input.%s", afl->tmp_dir,
                                             afl->file_extension);
 
@@ -1847,6 +2050,10 @@ int main(int argc, char **argv_orig, char **envp) {
 
   check_binary(afl, argv[optind]);
 
+  if (afl->afl_env.afl_fauxsrv_template) {
+    setup_fauxsrv_template(afl, argv[0]);
+  }
+
   #ifdef AFL_PERSISTENT_RECORD
   if (unlikely(afl->fsrv.persistent_record)) {
     if (!getenv(PERSIST_ENV_VAR)) {
@@ -1861,6 +2068,12 @@ int main(int argc, char **argv_orig, char **envp) {
   #endif
 
   if (afl->shmem_testcase_mode) { setup_testcase_shmem(afl); }
+  if (afl->afl_env.afl_field_hints) { setup_field_hints(afl); }
+  if (afl->afl_env.afl_target_novelty) { setup_target_novelty(afl); }
+
+  if (afl->afl_env.afl_checksum_fixup && !afl->cmplog_binary) {
+    WARNF("AFL_CHECKSUM_FIXUP needs cmplog (-c), it is ignored.");
+  }
 
   afl->start_time = get_cur_time();
 
@@ -1883,37 +2096,64 @@ int main(int argc, char **argv_orig, char **envp) {
   }
 
   if (afl->non_instrumented_mode || afl->fsrv.qemu_mode ||
-      afl->fsrv.frida_mode || afl->fsrv.cs_mode || afl->unicorn_mode) {
-    u32 old_map_size = map_size;
+      afl->fsrv.frida_mode || afl->fsrv.cs_mode || afl->fsrv.ipt_mode ||
+      afl->unicorn_mode) {
+    grow_maps(afl, map_size, MAP_SIZE);
     map_size = afl->fsrv.real_map_size = afl->fsrv.map_size = MAP_SIZE;
-    afl->virgin_bits = ck_realloc(afl->virgin_bits, map_size);
-    afl->virgin_tmout = ck_realloc(afl->virgin_tmout, map_size);
-    afl->virgin_crash = ck_realloc(afl->virgin_crash, map_size);
-    afl->var_bytes = ck_realloc(afl->var_bytes, map_size);
-    afl->top_rated = ck_realloc(afl->top_rated, map_size * sizeof(void *));
-    afl->clean_trace = ck_realloc(afl->clean_trace, map_size);
-    afl->clean_trace_custom = ck_realloc(afl->clean_trace_custom, map_size);
-    afl->first_trace = ck_realloc(afl->first_trace, map_size);
-    afl->map_tmp_buf = ck_realloc(afl->map_tmp_buf, map_size);
-
-    if (old_map_size < map_size) {
-      memset(afl->var_bytes + old_map_size, 0, map_size - old_map_size);
-      memset(afl->top_rated + old_map_size, 0, map_size - old_map_size);
-      memset(afl->clean_trace + old_map_size, 0, map_size - old_map_size);
-      memset(afl->clean_trace_custom + old_map_size, 0,
-             map_size - old_map_size);
-      memset(afl->first_trace + old_map_size, 0, map_size - old_map_size);
-      memset(afl->map_tmp_buf + old_map_size, 0, map_size - old_map_size);
+
+  } else if (!afl->afl_env.afl_skip_bin_check) {
+    /* A map the binaries say they need is set up now, not after a first
+       start of the target that would only tell us this. */
+
+    u32 predicted = predict_map_size(afl->fsrv.target_path, NULL);
+
+    if (afl->cmplog_binary) {
+      predicted =
+          MAX(predicted, predict_map_size(afl->cmplog_binary, NULL));
+    }
+
+    if (predicted > map_size) {
+      OKF("Map size of %u bytes predicted from the binary.", predicted);
+      grow_maps(afl, map_size, predicted);
+      map_size = afl->fsrv.map_size = predicted;
+
+      char vbuf[16];
+      snprintf(vbuf, sizeof(vbuf), "%u", map_size);
+      setenv("AFL_MAP_SIZE", vbuf, 1);
+    }
+
+    /* the same for the autodictionary, the forkserver need not send it */
+    if (!getenv("AFL_NO_AUTODICT") &&
+        load_note_autodict(afl, afl->fsrv.target_path)) {
+      setenv("AFL_NO_AUTODICT", "1", 1);  // loaded already
     }
   }
 
+  if (afl->afl_env.afl_map_size_max) { setup_map_cap(afl); }
+
   afl->argv = use_argv;
+  afl->shm.dirty_mode = !afl->non_instrumented_mode;
+  afl->shm.huge_mode = afl->afl_env.afl_shm_hugepages;
+  shm_keep(afl, &afl->shm, "main", "map");
   afl->fsrv.trace_bits =
-      afl_shm_init(&afl->shm, afl->fsrv.map_size, afl->non_instrumented_mode);
+      afl_shm_init(&afl->shm, shm_map_size(afl, afl->fsrv.map_size),
+                   afl->non_instrumented_mode);
+  afl->fsrv.dirty_lines = afl->shm.dirty_map;
+
+  if (afl->shm.huge_mode) {
+    if (afl->shm.huge_maps) {
+      OKF("%d shared map(s) are backed by huge pages.", afl->shm.huge_maps);
+
+    } else {
+      WARNF(
+          "AFL_SHM_HUGEPAGES: no hugetlb pages available (see "
+          "vm.nr_hugepages), only asking for transparent huge pages.");
+    }
+  }
 
   if (!afl->non_instrumented_mode && !afl->fsrv.qemu_mode &&
       !afl->unicorn_mode && !afl->fsrv.frida_mode && !afl->fsrv.cs_mode &&
-      !afl->afl_env.afl_skip_bin_check) {
+      !afl->fsrv.ipt_mode && !afl->afl_env.afl_skip_bin_check) {
     if (map_size <= DEFAULT_SHMEM_SIZE) {
       afl->fsrv.map_size = DEFAULT_SHMEM_SIZE;  // dummy temporary value
       char vbuf[16];
@@ -1921,6 +2161,8 @@ int main(int argc, char **argv_orig, char **envp) {
       setenv("AFL_MAP_SIZE", vbuf, 1);
     }
 
+    if (afl->fsrv.cmplog_switch) { cmplog_map_request(afl); }
+
     u32 new_map_size = afl_fsrv_get_mapsize(
         &afl->fsrv, afl->argv, &afl->stop_soon, afl->afl_env.afl_debug_child);
 
@@ -1928,44 +2170,28 @@ int main(int argc, char **argv_orig, char **envp) {
     if (map_size < new_map_size) {
       OKF("Re-initializing maps to %u bytes", new_map_size);
 
-      u32 old_map_size = map_size;
-      afl->virgin_bits = ck_realloc(afl->virgin_bits, new_map_size);
-      afl->virgin_tmout = ck_realloc(afl->virgin_tmout, new_map_size);
-      afl->virgin_crash = ck_realloc(afl->virgin_crash, new_map_size);
-      afl->var_bytes = ck_realloc(afl->var_bytes, new_map_size);
-      afl->top_rated =
-          ck_realloc(afl->top_rated, new_map_size * sizeof(void *));
-      afl->clean_trace = ck_realloc(afl->clean_trace, new_map_size);
-      afl->clean_trace_custom =
-          ck_realloc(afl->clean_trace_custom, new_map_size);
-      afl->first_trace = ck_realloc(afl->first_trace, new_map_size);
-      afl->map_tmp_buf = ck_realloc(afl->map_tmp_buf, new_map_size);
-
-      if (old_map_size < new_map_size) {
-        memset(afl->var_bytes + old_map_size, 0, new_map_size - old_map_size);
-        memset(afl->top_rated + old_map_size, 0, new_map_size - old_map_size);
-        memset(afl->clean_trace + old_map_size, 0, new_map_size - old_map_size);
-        memset(afl->clean_trace_custom + old_map_size, 0,
-               new_map_size - old_map_size);
-        memset(afl->first_trace + old_map_size, 0, new_map_size - old_map_size);
-        memset(afl->map_tmp_buf + old_map_size, 0, new_map_size - old_map_size);
-      }
+      grow_maps(afl, map_size, new_map_size);
 
       afl_fsrv_kill(&afl->fsrv);
       afl_shm_deinit(&afl->shm);
       afl->fsrv.map_size = new_map_size;
       afl->fsrv.trace_bits =
-          afl_shm_init(&afl->shm, new_map_size, afl->non_instrumented_mode);
+          afl_shm_init(&afl->shm, shm_map_size(afl, new_map_size),
+                       afl->non_instrumented_mode);
+      afl->fsrv.dirty_lines = afl->shm.dirty_map;
       setenv("AFL_NO_AUTODICT", "1", 1);  // loaded already
       afl_fsrv_start(&afl->fsrv, afl->argv, &afl->stop_soon,
                      afl->afl_env.afl_debug_child);
 
       map_size = new_map_size;
     }
+
+    if (afl->fsrv.cmplog_switch) { cmplog_switch_check(afl); }
   }
 
-  if (afl->cmplog_binary) {
+  if (afl->cmplog_binary && !afl->fsrv.cmplog_switch) {
     ACTF("Spawning cmplog forkserver");
+    cmplog_map_request(afl);
     afl_fsrv_init_dup(&afl->cmplog_fsrv, &afl->fsrv);
     // TODO: this is semi-nice
     afl->cmplog_fsrv.trace_bits = afl->fsrv.trace_bits;
@@ -1975,6 +2201,7 @@ int main(int argc, char **argv_orig, char **envp) {
     afl->cmplog_fsrv.cmplog_binary = afl->cmplog_binary;
     afl->cmplog_fsrv.target_path = afl->fsrv.target_path;
     afl->cmplog_fsrv.init_child_func = cmplog_exec_child;
+    afl->cmplog_fsrv.map_cap = afl->fsrv.map_cap;
 
     if ((map_size <= DEFAULT_SHMEM_SIZE ||
          afl->cmplog_fsrv.map_size < map_size) &&
@@ -1995,28 +2222,7 @@ int main(int argc, char **argv_orig, char **envp) {
     if (map_size < new_map_size) {
       OKF("Re-initializing maps to %u bytes due cmplog", new_map_size);
 
-      u32 old_map_size = map_size;
-      afl->virgin_bits = ck_realloc(afl->virgin_bits, new_map_size);
-      afl->virgin_tmout = ck_realloc(afl->virgin_tmout, new_map_size);
-      afl->virgin_crash = ck_realloc(afl->virgin_crash, new_map_size);
-      afl->var_bytes = ck_realloc(afl->var_bytes, new_map_size);
-      afl->top_rated =
-          ck_realloc(afl->top_rated, new_map_size * sizeof(void *));
-      afl->clean_trace = ck_realloc(afl->clean_trace, new_map_size);
-      afl->clean_trace_custom =
-          ck_realloc(afl->clean_trace_custom, new_map_size);
-      afl->first_trace = ck_realloc(afl->first_trace, new_map_size);
-      afl->map_tmp_buf = ck_realloc(afl->map_tmp_buf, new_map_size);
-
-      if (old_map_size < new_map_size) {
-        memset(afl->var_bytes + old_map_size, 0, new_map_size - old_map_size);
-        memset(afl->top_rated + old_map_size, 0, new_map_size - old_map_size);
-        memset(afl->clean_trace + old_map_size, 0, new_map_size - old_map_size);
-        memset(afl->clean_trace_custom + old_map_size, 0,
-               new_map_size - old_map_size);
-        memset(afl->first_trace + old_map_size, 0, new_map_size - old_map_size);
-        memset(afl->map_tmp_buf + old_map_size, 0, new_map_size - old_map_size);
-      }
+      grow_maps(afl, map_size, new_map_size);
 
       afl_fsrv_kill(&afl->fsrv);
       afl_fsrv_kill(&afl->cmplog_fsrv);
@@ -2027,7 +2233,9 @@ int main(int argc, char **argv_orig, char **envp) {
 
       setenv("AFL_NO_AUTODICT", "1", 1);  // loaded already
       afl->fsrv.trace_bits =
-          afl_shm_init(&afl->shm, new_map_size, afl->non_instrumented_mode);
+          afl_shm_init(&afl->shm, shm_map_size(afl, new_map_size),
+                       afl->non_instrumented_mode);
+      afl->fsrv.dirty_lines = afl->shm.dirty_map;
       afl->cmplog_fsrv.trace_bits = afl->fsrv.trace_bits;
       afl_fsrv_start(&afl->fsrv, afl->argv, &afl->stop_soon,
                      afl->afl_env.afl_debug_child);
@@ -2036,8 +2244,10 @@ int main(int argc, char **argv_orig, char **envp) {
     }
 
     OKF("Cmplog forkserver successfully started");
+    cmplog_map_negotiate(afl);
   }
 
+  select_map_kernels(afl);
   load_auto(afl);
 
   if (extras_dir_cnt) {
@@ -2047,9 +2257,10 @@ int main(int argc, char **argv_orig, char **envp) {
   }
 
   if (afl->fsrv.out_file && afl->fsrv.use_shmem_fuzz) {
-    unlink(afl->fsrv.out_file);
+    if (!afl->fsrv.use_memfd) { unlink(afl->fsrv.out_file); }
     afl->fsrv.out_file = NULL;
     afl->fsrv.use_stdin = 0;
+    afl->fsrv.use_memfd = false;
     close(afl->fsrv.out_fd);
     afl->fsrv.out_fd = -1;
 
@@ -2060,22 +2271,38 @@ int main(int argc, char **argv_orig, char **envp) {
     }
   }
 
+  if (afl->afl_env.afl_fsrv_workers) { setup_fsrv_workers(afl); }
+  if (afl->afl_env.afl_hang_check_async) { setup_hang_check(afl); }
+
+  if (afl->afl_env.afl_persistent_tune &&
+      (!afl->persistent_mode || !afl->fsrv.use_doorbell)) {
+    WARNF(
+        "AFL_PERSISTENT_TUNE needs a persistent mode target built with afl-cc "
+        "on Linux - ignoring it.");
+    afl->afl_env.afl_persistent_tune = 0;
+  }
+
   deunicode_extras(afl);
   dedup_extras(afl);
+  rank_extras(afl);
   if (afl->extras_cnt) { OKF("Loaded a total of %u extras.", afl->extras_cnt); }
+  if (afl->extras_top_cnt && afl->extras_cnt > afl->max_det_extras) {
+    OKF("Ranked dictionary, the deterministic stages use the top %u tokens.",
+        afl->extras_top_cnt);
+  }
+
+  hash_target(afl);
 
   // after we have the correct bitmap size we can read the bitmap -B option
   // and set the virgin maps
-  if (afl->in_bitmap) {
-    read_bitmap(afl->in_bitmap, afl->virgin_bits, afl->fsrv.map_size);
-
-  } else {
-    memset(afl->virgin_bits, 255, map_size);
-  }
-
+  memset(afl->virgin_bits, 255, map_size);
   memset(afl->virgin_tmout, 255, map_size);
   memset(afl->virgin_crash, 255, map_size);
 
+  if (afl->in_bitmap) { load_bitmap(afl); }
+
+  sync_manifest_open(afl);
+
   if (likely(!afl->afl_env.afl_no_startup_calibration)) {
     perform_dry_run(afl);
 
@@ -2084,6 +2311,10 @@ int main(int argc, char **argv_orig, char **envp) {
     usleep(1000);
   }
 
+  shared_virgin_open(afl);
+  crash_sigs_open(afl);
+  target_novelty_sync(afl);
+
   if (afl->q_testcase_max_cache_entries) {
     afl->q_testcase_cache =
         ck_alloc(afl->q_testcase_max_cache_entries * sizeof(size_t));
@@ -2129,8 +2360,11 @@ int main(int argc, char **argv_orig, char **envp) {
   afl->start_time = get_cur_time();
   if (afl->in_place_resume || afl->afl_env.afl_autoresume) {
     load_stats_file(afl);
+    if (afl->checkpoint_ms) { checkpoint_load(afl); }
   }
 
+  afl->checkpoint_last = get_cur_time();
+
   if (!afl->non_instrumented_mode) { write_stats_file(afl, 0, 0, 0, 0); }
   maybe_update_plot_file(afl, 0, 0, 0);
   save_auto(afl);
@@ -2171,6 +2405,8 @@ int main(int argc, char **argv_orig, char **envp) {
     if (unlikely((!afl->old_seed_selection &&
                   runs_in_current_cycle > afl->queued_items) ||
                  (afl->old_seed_selection && !afl->queue_cur))) {
+      if (unlikely(afl->replay)) { replay_point(afl); }
+
       if (unlikely((afl->last_sync_cycle < afl->queue_cycle ||
                     (!afl->queue_cycle && afl->afl_env.afl_import_first)) &&
                    afl->sync_id)) {
@@ -2183,6 +2419,9 @@ int main(int argc, char **argv_orig, char **envp) {
 
       ++afl->queue_cycle;
       runs_in_current_cycle = (u32)-1;
+
+      /* never fuzzed entries weigh more from the second cycle on */
+      if (afl->queue_cycle == 2) { afl->reinit_table = 1; }
       afl->cur_skipped_items = 0;
 
       // 1st april fool joke - enable pizza mode
@@ -2337,6 +2576,9 @@ int main(int argc, char **argv_orig, char **envp) {
             afl->schedule = QUAD;
             break;
           case QUAD:
+            afl->schedule = ENERGY;
+            break;
+          case ENERGY:
             afl->schedule = RARE;
             break;
           case RARE:
@@ -2359,8 +2601,11 @@ int main(int argc, char **argv_orig, char **envp) {
 
     do {
       if (likely(!afl->old_seed_selection)) {
-        if (likely(afl->pending_favored && afl->smallest_favored >= 0)) {
-          afl->current_entry = afl->smallest_favored;
+        s64 fav;
+
+        if (likely(afl->pending_favored) &&
+            (fav = next_pending_favored(afl)) >= 0) {
+          afl->current_entry = fav;
 
           /*
 
@@ -2386,24 +2631,50 @@ int main(int argc, char **argv_orig, char **envp) {
         } else {
           if (unlikely(prev_queued_items < afl->queued_items ||
                        afl->reinit_table)) {
-            // we have new queue entries since the last run, recreate alias
-            // table
+            // we have new queue entries since the last run, update the
+            // weight tree
             prev_queued_items = afl->queued_items;
-            create_alias_table(afl);
+            update_weight_tree(afl);
+            afl->queue_next = NULL;
           }
 
-          do {
-            afl->current_entry = select_next_queue_entry(afl);
+          if (likely(afl->queue_next) && likely(!afl->queue_next->disabled)) {
+            afl->current_entry = afl->queue_next->id;
 
-          } while (unlikely(afl->current_entry >= afl->queued_items));
+          } else {
+            do {
+              afl->current_entry = select_next_queue_entry(afl);
+
+            } while (unlikely(afl->current_entry >= afl->queued_items));
+          }
 
           afl->queue_cur = afl->queue_buf[afl->current_entry];
+
+          /* draw the next pick now and have its file read meanwhile */
+
+          u32 next = select_next_queue_entry(afl);
+          afl->queue_next = NULL;
+
+          if (likely(next < afl->queued_items)) {
+            afl->queue_next = afl->queue_buf[next];
+            queue_testcase_prefetch(afl, afl->queue_next);
+          }
         }
       }
+
+      if (unlikely(afl->replay) && replay_pick(afl)) { break; }
+
       //LS:log file
       afl->mutate_sum = 0;
+      struct queue_entry *fuzz_q = afl->queue_cur;
+      u64                 fuzz_start = get_cur_time_us();
+      u64                 fuzz_execs = afl->fsrv.total_execs;
+      u32                 fuzz_finds = afl->queued_discovered;
 //      fprintf(afl->log_file, "%s ", afl->queue_cur->fname);
       skipped_fuzz = fuzz_one(afl);
+      energy_account(afl, fuzz_q, get_cur_time_us() - fuzz_start,
+                     afl->fsrv.total_execs - fuzz_execs,
+                     afl->queued_discovered - fuzz_finds);
 //      fprintf(afl->log_file, "\n");
   #ifdef INTROSPECTION
       ++afl->queue_cur->stats_selected;
@@ -2433,6 +2704,16 @@ int main(int argc, char **argv_orig, char **envp) {
 
       if (unlikely(!afl->stop_soon && exit_1)) { afl->stop_soon = 2; }
 
+      if (unlikely(afl->checkpoint_ms &&
+                   get_cur_time() - afl->checkpoint_last >=
+                       afl->checkpoint_ms)) {
+        checkpoint_write(afl);
+      }
+
+      if (unlikely(afl->seed_stream) && !afl->stop_soon) {
+        seed_stream_ingest(afl);
+      }
+
       if (unlikely(afl->old_seed_selection)) {
         while (++afl->current_entry < afl->queued_items &&
                afl->queue_buf[afl->current_entry]->disabled) {};
@@ -2450,6 +2731,8 @@ int main(int argc, char **argv_orig, char **envp) {
 
     u64 cur_time = get_cur_time();
 
+    if (unlikely(afl->replay)) { replay_point(afl); }
+
     if (likely(afl->switch_fuzz_mode && afl->fuzz_mode == 0 &&
                !afl->non_instrumented_mode) &&
         unlikely(cur_time > (likely(afl->last_find_time) ? afl->last_find_time
@@ -2463,6 +2746,7 @@ int main(int argc, char **argv_orig, char **envp) {
       }
 
       afl->fuzz_mode = 1;
+      if (unlikely(afl->replay)) { replay_mode(afl); }
     }
 
     if (likely(!afl->stop_soon && afl->sync_id)) {
@@ -2489,11 +2773,20 @@ int main(int argc, char **argv_orig, char **envp) {
 
 stop_fuzzing:
 
+  if (afl->hang_check) { hang_check_drain(afl); }
+
   afl->force_ui_update = 1;  // ensure the screen is reprinted
   afl->stop_soon = 1;        // ensure everything is written
   show_stats(afl);           // print the screen one last time
+  if (afl->writer) {
+    writer_destroy(afl->writer);
+    afl->writer = NULL;
+  }
+
   write_bitmap(afl);
   save_auto(afl);
+  if (afl->checkpoint_ms) { checkpoint_write(afl); }
+  if (afl->replay) { replay_done(afl); }
 
   if (afl->pizza_is_served) {
     SAYF(CURSOR_SHOW cLRD "\n\n+++ Baking aborted %s +++\n" cRST,
@@ -2558,6 +2851,10 @@ stop_fuzzing:
   if (frida_afl_preload) { ck_free(frida_afl_preload); }
 
   fclose(afl->fsrv.plot_file);
+  if (afl->cal_index_fd >= 0) { close(afl->cal_index_fd); }
+  if (afl->sync_manifest_fd >= 0) { close(afl->sync_manifest_fd); }
+  if (afl->shared_virgin_fd >= 0) { close(afl->shared_virgin_fd); }
+  if (afl->crash_sigs_fd >= 0) { close(afl->crash_sigs_fd); }
 
   #ifdef INTROSPECTION
   fclose(afl->fsrv.det_plot_file);
@@ -2573,10 +2870,84 @@ stop_fuzzing:
     ck_free(afl->shm_fuzz);
   }
 
+  if (afl->shm_batch) {
+    afl_shm_deinit(afl->shm_batch);
+    ck_free(afl->shm_batch);
+  }
+
+  if (afl->shm_pipe) {
+    afl_shm_deinit(afl->shm_pipe);
+    ck_free(afl->shm_pipe);
+  }
+
+  if (afl->shm_hints) {
+    afl_shm_deinit(afl->shm_hints);
+    ck_free(afl->shm_hints);
+  }
+
+  if (afl->shm_virgin) {
+    afl_shm_deinit(afl->shm_virgin);
+    ck_free(afl->shm_virgin);
+  }
+
+  for (u32 i = 0; i < afl->workers_cnt; ++i) {
+    struct fsrv_worker *w = &afl->workers[i];
+    u8                  nyx = 0;
+
+    afl_fsrv_deinit(&w->fsrv);
+
+  #ifdef __linux__
+    nyx = w->fsrv.nyx_mode;
+  #endif
+
+    /* a Nyx runner has its own map and testcase */
+
+    if (!nyx) {
+      afl_shm_deinit(&w->shm);
+      if (w->fsrv.use_shmem_fuzz) {
+        afl_shm_deinit(&w->shm_fuzz);
+
+      } else {
+        close(w->fsrv.out_fd);
+        (void)unlink(w->fsrv.out_file);
+        ck_free(w->fsrv.out_file);
+      }
+    }
+
+    afl_free(w->buf);
+    afl_free(w->cal_trace);
+  }
+
+  ck_free(afl->workers);
+
+  if (afl->hang_check) {
+    struct hang_check *hc = afl->hang_check;
+
+    afl_fsrv_deinit(&hc->w.fsrv);
+    afl_shm_deinit(&hc->w.shm);
+    if (hc->w.fsrv.use_shmem_fuzz) {
+      afl_shm_deinit(&hc->w.shm_fuzz);
+
+    } else {
+      close(hc->w.fsrv.out_fd);
+      (void)unlink(hc->w.fsrv.out_file);
+      ck_free(hc->w.fsrv.out_file);
+    }
+
+    for (u32 i = 0; i < HANG_CHECK_QUEUE; ++i) {
+      afl_free(hc->q[i].buf);
+      ck_free(hc->q[i].trace);
+    }
+
+    ck_free(hc->trace);
+    ck_free(hc);
+  }
+
   afl_fsrv_deinit(&afl->fsrv);
 
   /* remove tmpfile */
-  if (afl->tmp_dir != NULL && !afl->in_place_resume && afl->fsrv.out_file) {
+  if (afl->tmp_dir != NULL && !afl->in_place_resume && afl->fsrv.out_file &&
+      !afl->fsrv.use_memfd) {
     (void)unlink(afl->fsrv.out_file);
   }
 
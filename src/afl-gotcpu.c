@@ -72,56 +72,6 @@
   #endif
 #endif /* __linux__ || __FreeBSD__ || __NetBSD__ || __APPLE__ */
 
-/* Get CPU usage in microseconds. */
-
-static u64 get_cpu_usage_us(void) {
-  struct rusage u;
-
-  getrusage(RUSAGE_SELF, &u);
-
-  return (u.ru_utime.tv_sec * 1000000ULL) + u.ru_utime.tv_usec +
-         (u.ru_stime.tv_sec * 1000000ULL) + u.ru_stime.tv_usec;
-}
-
-/* Measure preemption rate. */
-
-static u32 measure_preemption(u32 target_ms) {
-  volatile u32 v1, v2 = 0;
-
-  u64 st_t, en_t, st_c, en_c, real_delta, slice_delta;
-  // s32 loop_repeats = 0;
-
-  st_t = get_cur_time_us();
-  st_c = get_cpu_usage_us();
-
-repeat_loop:
-
-  v1 = CTEST_BUSY_CYCLES;
-
-  while (v1--) {
-    v2++;
-  }
-
-  sched_yield();
-
-  en_t = get_cur_time_us();
-
-  if (en_t - st_t < target_ms * 1000) {
-    // loop_repeats++;
-    goto repeat_loop;
-  }
-
-  /* Let's see what percentage of this time we actually had a chance to
-     run, and how much time was spent in the penalty box. */
-
-  en_c = get_cpu_usage_us();
-
-  real_delta = (en_t - st_t) / 1000;
-  slice_delta = (en_c - st_c) / 1000;
-
-  return real_delta * 100 / slice_delta;
-}
-
 /* Do the benchmark thing. */
 
 int main(int argc, char **argv) {
@@ -213,11 +163,11 @@ int main(int argc, char **argv) {
 
       util_perc = measure_preemption(CTEST_CORE_TRG_MS);
 
-      if (util_perc < 110) {
+      if (util_perc < CTEST_AVAILABLE) {
         SAYF("    Core #%u: " cLGN "AVAILABLE" cRST "(%u%%)\n", i, util_perc);
         exit(0);
 
-      } else if (util_perc < 250) {
+      } else if (util_perc < CTEST_OVERBOOKED) {
         SAYF("    Core #%u: " cYEL "CAUTION " cRST "(%u%%)\n", i, util_perc);
         exit(1);
       }
@@ -6,6 +6,25 @@
 #include "xxhash.h"
 #undef XXH_INLINE_ALL
 
+/* Expand rand_seed into the lane states with splitmix64. */
+
+static void rand_seed_lanes(afl_state_t *afl) {
+  u64 x = afl->rand_seed[0] ^ ((u64)afl->rand_seed[1] << 32) ^
+          ((u64)afl->rand_seed[2] << 16);
+  u32 i, l;
+
+  for (l = 0; l < RAND_LANES; ++l) {
+    for (i = 0; i < 4; ++i) {
+      u64 z = (x += 0x9e3779b97f4a7c15);
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+      afl->rand_lane[i][l] = z ^ (z >> 31);
+    }
+  }
+
+  afl->rand_left = 0;
+}
+
 void rand_set_seed(afl_state_t *afl, s64 init_seed) {
   afl->init_seed = init_seed;
   afl->rand_seed[0] =
@@ -13,37 +32,65 @@ void rand_set_seed(afl_state_t *afl, s64 init_seed) {
   afl->rand_seed[1] = afl->rand_seed[0] ^ 0x1234567890abcdef;
   afl->rand_seed[2] = (afl->rand_seed[0] & 0x1234567890abcdef) ^
                       (afl->rand_seed[1] | 0xfedcba9876543210);
+  rand_seed_lanes(afl);
 }
 
 #define ROTL(d, lrot) ((d << (lrot)) | (d >> (8 * sizeof(d) - (lrot))))
 
-#ifdef WORD_SIZE_64
-// romuDuoJr
-inline AFL_RAND_RETURN rand_next(afl_state_t *afl) {
-  AFL_RAND_RETURN xp = afl->rand_seed[0];
-  afl->rand_seed[0] = 15241094284759029579u * afl->rand_seed[1];
-  afl->rand_seed[1] = afl->rand_seed[1] - xp;
-  afl->rand_seed[1] = ROTL(afl->rand_seed[1], 27);
-  return xp;
-}
+/* xoshiro256** in RAND_LANES independent lanes. The state is kept by word
+   over the lanes, so each step of the inner loop is one vector operation
+   where the compiler has them. Reseeds from /dev/urandom every RESEED_RNG
+   words unless the seed was fixed or /dev/urandom is not open yet. */
 
-#else
-// RomuTrio32
-inline AFL_RAND_RETURN rand_next(afl_state_t *afl) {
-  AFL_RAND_RETURN xp = afl->rand_seed[0], yp = afl->rand_seed[1],
-                  zp = afl->rand_seed[2];
-  afl->rand_seed[0] = 3323815723u * zp;
-  afl->rand_seed[1] = yp - xp;
-  afl->rand_seed[1] = ROTL(afl->rand_seed[1], 6);
-  afl->rand_seed[2] = zp - yp;
-  afl->rand_seed[2] = ROTL(afl->rand_seed[2], 22);
-  return xp;
-}
+void rand_fill(afl_state_t *afl) {
+  u32 i, l;
 
-#endif
+  if (unlikely(afl->rand_cnt < RAND_BLOCK_WORDS)) {
+    if (likely(!afl->fixed_seed && afl->fsrv.dev_urandom_fd >= 0)) {
+      ck_read(afl->fsrv.dev_urandom_fd, &afl->rand_seed,
+              sizeof(afl->rand_seed), "/dev/urandom");
+      rand_seed_lanes(afl);
+    }
+
+    afl->rand_cnt = (RESEED_RNG / 2) + (afl->rand_seed[1] % RESEED_RNG);
+  }
+
+  afl->rand_cnt -= RAND_BLOCK_WORDS;
+
+  /* a local copy, so the compiler knows the block does not alias it */
+
+  u64 s[4][RAND_LANES];
+  memcpy(s, afl->rand_lane, sizeof(s));
+
+  for (i = 0; i < RAND_BLOCK_WORDS; i += RAND_LANES) {
+    for (l = 0; l < RAND_LANES; ++l) {
+      u64 r = s[1][l] + (s[1][l] << 2); /* * 5 */
+      u64 t = s[1][l] << 17;
+
+      r = ROTL(r, 7);
+      afl->rand_block[i + l] = r + (r << 3); /* * 9 */
+
+      s[2][l] ^= s[0][l];
+      s[3][l] ^= s[1][l];
+      s[1][l] ^= s[2][l];
+      s[0][l] ^= s[3][l];
+      s[2][l] ^= t;
+      s[3][l] = ROTL(s[3][l], 45);
+    }
+  }
+
+  memcpy(afl->rand_lane, s, sizeof(s));
+  afl->rand_left = RAND_BLOCK_WORDS;
+}
 
 #undef ROTL
 
+/* our RNG wrapper, the next word of the block */
+
+AFL_RAND_RETURN rand_next(afl_state_t *afl) {
+  return (AFL_RAND_RETURN)rand_word(afl);
+}
+
 /* returns a double between 0.000000000 and 1.000000000 */
 
 inline double rand_next_percent(afl_state_t *afl) {
@@ -47,6 +47,7 @@
 #include <signal.h>
 #include <dirent.h>
 #include <fcntl.h>
+#include <limits.h>
 
 #include <sys/wait.h>
 #include <sys/time.h>
@@ -55,6 +56,11 @@
 #include <sys/resource.h>
 #include <sys/mman.h>
 
+#ifdef __linux__
+  #include <sys/syscall.h>
+  #include <linux/mempolicy.h>
+#endif
+
 #ifndef USEMMAP
   #include <sys/ipc.h>
   #include <sys/shm.h>
@@ -62,12 +68,294 @@
 
 static list_t shm_list = {.element_prealloc_count = 0};
 
+/* With huge_mode set, ask for transparent huge pages for a mapping of the
+   trace or cmplog map. This is the fallback when no hugetlb pages are
+   reserved, it depends on /sys/kernel/mm/transparent_hugepage/shmem_enabled
+   and is a no-op for mappings that already are hugetlb. */
+
+static void shm_advise_huge(sharedmem_t *shm, void *map, size_t size) {
+#ifdef MADV_HUGEPAGE
+  if (shm->huge_mode) { madvise(map, size, MADV_HUGEPAGE); }
+#else
+  (void)shm;
+  (void)map;
+  (void)size;
+#endif
+}
+
+/* On hosts with more than one memory node, prefer the node of the CPU
+   afl-fuzz is bound to for the pages of a map. Which node a page lands on
+   otherwise depends on who touches it first, and the target, a worker
+   forkserver or a numactl policy may be elsewhere. Processes that are not
+   bound to a single CPU, e.g. afl-showmap, are left alone. */
+
+static void shm_bind_local(void *map, size_t size) {
+#if defined(__linux__) && defined(SYS_mbind) && defined(SYS_getcpu)
+  static s32 multi_node = -1;
+  u64        mask[1024 / 64], node_mask;
+  u32        cpu, node, cnt = 0;
+  long       len, i;
+
+  if (multi_node < 0) {
+    u8  tmp[64] = "";
+    s32 fd = open("/sys/devices/system/node/online", O_RDONLY);
+
+    multi_node = 0;
+    if (fd >= 0) {
+      if (read(fd, tmp, sizeof(tmp) - 1) > 0) {
+        multi_node = strchr((char *)tmp, '-') || strchr((char *)tmp, ',');
+      }
+
+      close(fd);
+    }
+  }
+
+  if (!multi_node) { return; }
+
+  len = syscall(SYS_sched_getaffinity, 0, sizeof(mask), mask);
+  for (i = 0; i < len / 8; ++i) {
+    cnt += __builtin_popcountll(mask[i]);
+  }
+
+  if (cnt != 1 || syscall(SYS_getcpu, &cpu, &node, NULL) || node >= 64) {
+    return;
+  }
+
+  node_mask = 1ULL << node;
+  syscall(SYS_mbind, map, size, MPOL_PREFERRED, &node_mask,
+          sizeof(node_mask) * 8 + 1, 0); /* a hint, ignore errors */
+#else
+  (void)map;
+  (void)size;
+#endif
+}
+
+/* The segments of a sharedmem_t with keep_fn set are recorded in that
+   file, one line each: the kind (map, cmp_map, dirty_map), the SysV id or
+   POSIX name, the size and, for SysV, the pid that created it and whether
+   it is hugetlb. A crash of the owner leaks them only until the next
+   afl_shm_init() with that keep_fn, which takes them over if they still
+   fit and removes them otherwise, or until afl_shm_reclaim(). */
+
+enum {
+
+  /* 00 */ SHM_KEPT_MAP,
+  /* 01 */ SHM_KEPT_CMPLOG,
+  /* 02 */ SHM_KEPT_DIRTY,
+  /* 03 */ SHM_KEPT_CNT
+
+};
+
+static const char shm_kept_kind[SHM_KEPT_CNT] = {'m', 'c', 'd'};
+
+struct shm_kept {
+  char   name[64];                      /* SysV id or POSIX name, or "" */
+  size_t size;
+  s32    cpid;
+  u8     huge, reused;
+};
+
+static void shm_kept_read(u8 *fn, struct shm_kept *kept) {
+  struct shm_kept k;
+  FILE           *f;
+  char            line[128], kind;
+  u32             huge, i;
+
+  memset(kept, 0, SHM_KEPT_CNT * sizeof(*kept));
+  if (!fn || !(f = fopen((char *)fn, "r"))) { return; }
+
+  while (fgets(line, sizeof(line), f)) {
+    memset(&k, 0, sizeof(k));
+
+    if (sscanf(line, "%c %63s %zu %d %u", &kind, k.name, &k.size, &k.cpid,
+               &huge) != 5) {
+      continue;
+    }
+
+    k.huge = !!huge;
+
+    for (i = 0; i < SHM_KEPT_CNT; ++i) {
+      if (kind == shm_kept_kind[i]) { kept[i] = k; }
+    }
+  }
+
+  fclose(f);
+}
+
+static void shm_kept_write(sharedmem_t *shm, struct shm_kept *kept) {
+  FILE *f;
+  u32   i;
+
+  if (!shm->keep_fn) { return; }
+
+  if (!(f = fopen((char *)shm->keep_fn, "w"))) {
+    WARNF("Unable to record the shared memory in '%s'", shm->keep_fn);
+    return;
+  }
+
+  for (i = 0; i < SHM_KEPT_CNT; ++i) {
+    if (kept[i].name[0]) {
+      fprintf(f, "%c %s %zu %d %u\n", shm_kept_kind[i], kept[i].name,
+              kept[i].size, kept[i].cpid, kept[i].huge);
+    }
+  }
+
+  fclose(f);
+}
+
+#ifdef USEMMAP
+/* Open the kept segment k if it is still there and ours. */
+
+static s32 shm_kept_open(struct shm_kept *k, struct stat *st) {
+  s32 fd;
+
+  if (!k->name[0]) { return -1; }
+
+  fd = shm_open(k->name, O_RDWR, DEFAULT_PERMISSION);
+  if (fd < 0) { return -1; }
+
+  if (fstat(fd, st) || st->st_uid != geteuid()) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+/* Remove the kept segment k and forget it, returns whether there was one. */
+
+static u8 shm_drop(struct shm_kept *k) {
+  struct stat st;
+  s32         fd = shm_kept_open(k, &st);
+  u8          ret = 0;
+
+  if (fd >= 0) {
+    close(fd);
+    ret = !shm_unlink(k->name);
+  }
+
+  k->name[0] = 0;
+  k->reused = 0;
+  return ret;
+}
+
+/* Take over the kept segment k for a segment of size bytes, with its name
+   in path. Returns its fd, or -1 if there is none that fits. */
+
+static s32 shm_reuse(struct shm_kept *k, char *path, size_t size) {
+  struct stat st;
+  s32         fd = shm_kept_open(k, &st);
+
+  if (fd >= 0 && (size_t)st.st_size == size) {
+    snprintf(path, L_tmpnam, "%s", k->name);
+    k->reused = 1;
+    return fd;
+  }
+
+  if (fd >= 0) { close(fd); }
+  shm_drop(k);
+  return -1;
+}
+
+/* Note the new segment path of size bytes in k. */
+
+static void shm_kept_set(struct shm_kept *k, char *path, size_t size) {
+  snprintf(k->name, sizeof(k->name), "%s", path);
+  k->size = size;
+  k->cpid = 0;
+  k->huge = 0;
+}
+
+#else
+/* Whether the kept segment k is still there and ours: a SysV id that
+   came up again is another segment. */
+
+static u8 shm_kept_ours(struct shm_kept *k, struct shmid_ds *ds) {
+  return k->name[0] && !shmctl(atoi(k->name), IPC_STAT, ds) &&
+         ds->shm_perm.uid == geteuid() && ds->shm_cpid == k->cpid;
+}
+
+/* Remove the kept segment k and forget it, returns whether there was one.
+   A target that is still attached keeps it until it exits. */
+
+static u8 shm_drop(struct shm_kept *k) {
+  struct shmid_ds ds;
+  u8              ret = 0;
+
+  if (shm_kept_ours(k, &ds)) { ret = !shmctl(atoi(k->name), IPC_RMID, NULL); }
+
+  k->name[0] = 0;
+  k->reused = 0;
+  return ret;
+}
+
+/* Create a SysV segment for the trace or cmplog map, from the hugetlb pool
+   (vm.nr_hugepages) if huge is set and pages are available. A target
+   attaches it the same way in both cases. The kept segment k is taken
+   over instead if it fits and nothing is attached to it. */
+
+static s32 shm_get(sharedmem_t *shm, size_t size, struct shm_kept *k,
+                   u8 huge) {
+  struct shmid_ds ds;
+  s32             id = -1;
+
+  if (shm_kept_ours(k, &ds) && ds.shm_segsz == size && !ds.shm_nattch) {
+    shm->huge_maps += k->huge;
+    k->reused = 1;
+    return atoi(k->name);
+  }
+
+  shm_drop(k);
+  k->huge = 0;
+
+  #ifdef SHM_HUGETLB
+  if (huge) {
+    id = shmget(IPC_PRIVATE, size,
+                IPC_CREAT | IPC_EXCL | SHM_HUGETLB | DEFAULT_PERMISSION);
+
+    if (id >= 0) {
+      ++shm->huge_maps;
+      k->huge = 1;
+    }
+  }
+
+  #else
+  (void)huge;
+  #endif
+
+  if (id < 0) {
+    id = shmget(IPC_PRIVATE, size, IPC_CREAT | IPC_EXCL | DEFAULT_PERMISSION);
+  }
+
+  if (id >= 0) {
+    snprintf(k->name, sizeof(k->name), "%d", id);
+    k->size = size;
+    k->cpid = getpid();
+  }
+
+  return id;
+}
+
+#endif
+
 /* Get rid of shared memory. */
 
 void afl_shm_deinit(sharedmem_t *shm) {
   if (shm == NULL) { return; }
   list_remove(&shm_list, shm);
-  if (shm->shmemfuzz_mode) {
+  if (shm->batch_mode) {
+    unsetenv(SHM_BATCH_ENV_VAR);
+
+  } else if (shm->pipe_mode) {
+    unsetenv(SHM_PIPE_ENV_VAR);
+
+  } else if (shm->hints_mode) {
+    unsetenv(HINT_SHM_ENV_VAR);
+
+  } else if (shm->virgin_mode) {
+    unsetenv(VIRGIN_SHM_ENV_VAR);
+
+  } else if (shm->shmemfuzz_mode) {
     unsetenv(SHM_FUZZ_ENV_VAR);
 
   } else {
@@ -109,12 +397,39 @@ void afl_shm_deinit(sharedmem_t *shm) {
     }
   }
 
+  if (shm->dirty_mode) {
+    unsetenv(DIRTY_SHM_ENV_VAR);
+
+    if (shm->dirty_map != NULL) {
+      munmap(shm->dirty_map, shm->dirty_size);
+      shm->dirty_map = NULL;
+    }
+
+    if (shm->dirty_g_shm_fd != -1) {
+      close(shm->dirty_g_shm_fd);
+      shm->dirty_g_shm_fd = -1;
+    }
+
+    if (shm->dirty_g_shm_file_path[0]) {
+      shm_unlink(shm->dirty_g_shm_file_path);
+      shm->dirty_g_shm_file_path[0] = 0;
+    }
+  }
+
 #else
   shmctl(shm->shm_id, IPC_RMID, NULL);
   if (shm->cmplog_mode) { shmctl(shm->cmplog_shm_id, IPC_RMID, NULL); }
+  if (shm->dirty_mode) {
+    unsetenv(DIRTY_SHM_ENV_VAR);
+    shmctl(shm->dirty_shm_id, IPC_RMID, NULL);
+  }
+
 #endif
 
+  if (shm->keep_fn) { unlink((char *)shm->keep_fn); }
+
   shm->map = NULL;
+  shm->dirty_map = NULL;
 }
 
 /* Configure shared memory.
@@ -123,15 +438,25 @@ void afl_shm_deinit(sharedmem_t *shm) {
 
 u8 *afl_shm_init(sharedmem_t *shm, size_t map_size,
                  unsigned char non_instrumented_mode) {
+  struct shm_kept kept[SHM_KEPT_CNT];
+
   shm->map_size = 0;
 
   shm->map = NULL;
   shm->cmp_map = NULL;
+  shm->dirty_map = NULL;
+  shm->dirty_size = DIRTY_LINES_SIZE(map_size);
+  shm->huge_maps = 0;
+
+  shm_kept_read(shm->keep_fn, kept);
+  if (!shm->cmplog_mode) { shm_drop(&kept[SHM_KEPT_CMPLOG]); }
+  if (!shm->dirty_mode) { shm_drop(&kept[SHM_KEPT_DIRTY]); }
 
 #ifdef USEMMAP
 
   shm->g_shm_fd = -1;
   shm->cmplog_g_shm_fd = -1;
+  shm->dirty_g_shm_fd = -1;
 
   const int shmflags = O_RDWR | O_EXCL;
 
@@ -141,7 +466,12 @@ u8 *afl_shm_init(sharedmem_t *shm, size_t map_size,
   thanks to f*cking glibc we can not use tmpnam securely, it generates a
   security warning that cannot be suppressed
   so we do this worse workaround */
-  snprintf(shm->g_shm_file_path, L_tmpnam, "/afl_%d_%ld", getpid(), random());
+  shm->g_shm_fd =
+      shm_reuse(&kept[SHM_KEPT_MAP], shm->g_shm_file_path, map_size);
+  if (shm->g_shm_fd == -1) {
+    snprintf(shm->g_shm_file_path, L_tmpnam, "/afl_%d_%ld", getpid(),
+             random());
+  }
 
   #ifdef SHM_LARGEPAGE_ALLOC_DEFAULT
   /* trying to get large memory segment optimised and monitorable separately as
@@ -172,6 +502,10 @@ u8 *afl_shm_init(sharedmem_t *shm, size_t map_size,
 
   if (shm->g_shm_fd == -1) { PFATAL("shm_open() failed"); }
 
+  if (!kept[SHM_KEPT_MAP].reused) {
+    shm_kept_set(&kept[SHM_KEPT_MAP], shm->g_shm_file_path, map_size);
+  }
+
   /* configure the size of the shared memory segment */
   if (ftruncate(shm->g_shm_fd, map_size)) {
     PFATAL("setup_shm(): ftruncate() failed");
@@ -197,15 +531,26 @@ u8 *afl_shm_init(sharedmem_t *shm, size_t map_size,
 
   if (shm->map == (void *)-1 || !shm->map) PFATAL("mmap() failed");
 
+  shm_advise_huge(shm, shm->map, map_size);
+  shm_bind_local(shm->map, map_size);
+
   if (shm->cmplog_mode) {
-    snprintf(shm->cmplog_g_shm_file_path, L_tmpnam, "/afl_cmplog_%d_%ld",
-             getpid(), random());
+    shm->cmplog_g_shm_fd = shm_reuse(&kept[SHM_KEPT_CMPLOG],
+                                     shm->cmplog_g_shm_file_path, map_size);
+
+    if (shm->cmplog_g_shm_fd == -1) {
+      snprintf(shm->cmplog_g_shm_file_path, L_tmpnam, "/afl_cmplog_%d_%ld",
+               getpid(), random());
 
-    /* create the shared memory segment as if it was a file */
-    shm->cmplog_g_shm_fd =
-        shm_open(shm->cmplog_g_shm_file_path, O_CREAT | O_RDWR | O_EXCL,
-                 DEFAULT_PERMISSION);
-    if (shm->cmplog_g_shm_fd == -1) { PFATAL("shm_open() failed"); }
+      /* create the shared memory segment as if it was a file */
+      shm->cmplog_g_shm_fd =
+          shm_open(shm->cmplog_g_shm_file_path, O_CREAT | O_RDWR | O_EXCL,
+                   DEFAULT_PERMISSION);
+      if (shm->cmplog_g_shm_fd == -1) { PFATAL("shm_open() failed"); }
+
+      shm_kept_set(&kept[SHM_KEPT_CMPLOG], shm->cmplog_g_shm_file_path,
+                   map_size);
+    }
 
     /* configure the size of the shared memory segment */
     if (ftruncate(shm->cmplog_g_shm_fd, map_size)) {
@@ -233,6 +578,47 @@ u8 *afl_shm_init(sharedmem_t *shm, size_t map_size,
 
     if (shm->cmp_map == (void *)-1 || !shm->cmp_map)
       PFATAL("cmplog mmap() failed");
+
+    shm_advise_huge(shm, shm->cmp_map, map_size);
+    shm_bind_local(shm->cmp_map, map_size);
+  }
+
+  if (shm->dirty_mode) {
+    shm->dirty_g_shm_fd =
+        shm_reuse(&kept[SHM_KEPT_DIRTY], shm->dirty_g_shm_file_path,
+                  shm->dirty_size);
+
+    if (shm->dirty_g_shm_fd == -1) {
+      snprintf(shm->dirty_g_shm_file_path, L_tmpnam, "/afl_dirty_%d_%ld",
+               getpid(), random());
+
+      shm->dirty_g_shm_fd =
+          shm_open(shm->dirty_g_shm_file_path, O_CREAT | O_RDWR | O_EXCL,
+                   DEFAULT_PERMISSION);
+      if (shm->dirty_g_shm_fd == -1) { PFATAL("shm_open() failed"); }
+
+      shm_kept_set(&kept[SHM_KEPT_DIRTY], shm->dirty_g_shm_file_path,
+                   shm->dirty_size);
+    }
+
+    if (ftruncate(shm->dirty_g_shm_fd, shm->dirty_size)) {
+      PFATAL("setup_shm(): dirty ftruncate() failed");
+    }
+
+    shm->dirty_map = mmap(0, shm->dirty_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED, shm->dirty_g_shm_fd, 0);
+    if (shm->dirty_map == MAP_FAILED) {
+      close(shm->dirty_g_shm_fd);
+      shm->dirty_g_shm_fd = -1;
+      shm_unlink(shm->dirty_g_shm_file_path);
+      shm->dirty_g_shm_file_path[0] = 0;
+      PFATAL("mmap() failed");
+    }
+
+    if (!non_instrumented_mode)
+      setenv(DIRTY_SHM_ENV_VAR, shm->dirty_g_shm_file_path, 1);
+
+    shm_bind_local(shm->dirty_map, shm->dirty_size);
   }
 
 #else
@@ -240,16 +626,15 @@ u8 *afl_shm_init(sharedmem_t *shm, size_t map_size,
 
   // for qemu+unicorn we have to increase by 8 to account for potential
   // compcov map overwrite
-  shm->shm_id =
-      shmget(IPC_PRIVATE, map_size == MAP_SIZE ? map_size + 8 : map_size,
-             IPC_CREAT | IPC_EXCL | DEFAULT_PERMISSION);
+  shm->shm_id = shm_get(shm, map_size == MAP_SIZE ? map_size + 8 : map_size,
+                        &kept[SHM_KEPT_MAP], shm->huge_mode);
   if (shm->shm_id < 0) {
     PFATAL("shmget() failed, try running afl-system-config");
   }
 
   if (shm->cmplog_mode) {
-    shm->cmplog_shm_id = shmget(IPC_PRIVATE, sizeof(struct cmp_map),
-                                IPC_CREAT | IPC_EXCL | DEFAULT_PERMISSION);
+    shm->cmplog_shm_id = shm_get(shm, sizeof(struct cmp_map),
+                                 &kept[SHM_KEPT_CMPLOG], shm->huge_mode);
 
     if (shm->cmplog_shm_id < 0) {
       shmctl(shm->shm_id, IPC_RMID, NULL);  // do not leak shmem
@@ -257,6 +642,17 @@ u8 *afl_shm_init(sharedmem_t *shm, size_t map_size,
     }
   }
 
+  if (shm->dirty_mode) {
+    shm->dirty_shm_id =
+        shm_get(shm, shm->dirty_size, &kept[SHM_KEPT_DIRTY], 0);
+
+    if (shm->dirty_shm_id < 0) {
+      shmctl(shm->shm_id, IPC_RMID, NULL);  // do not leak shmem
+      if (shm->cmplog_mode) { shmctl(shm->cmplog_shm_id, IPC_RMID, NULL); }
+      PFATAL("shmget() failed, try running afl-system-config");
+    }
+  }
+
   if (!non_instrumented_mode) {
     shm_str = alloc_printf("%d", shm->shm_id);
 
@@ -278,6 +674,14 @@ u8 *afl_shm_init(sharedmem_t *shm, size_t map_size,
     ck_free(shm_str);
   }
 
+  if (shm->dirty_mode && !non_instrumented_mode) {
+    shm_str = alloc_printf("%d", shm->dirty_shm_id);
+
+    setenv(DIRTY_SHM_ENV_VAR, shm_str, 1);
+
+    ck_free(shm_str);
+  }
+
   shm->map = shmat(shm->shm_id, NULL, 0);
 
   if (shm->map == (void *)-1 || !shm->map) {
@@ -287,9 +691,16 @@ u8 *afl_shm_init(sharedmem_t *shm, size_t map_size,
       shmctl(shm->cmplog_shm_id, IPC_RMID, NULL);  // do not leak shmem
     }
 
+    if (shm->dirty_mode) {
+      shmctl(shm->dirty_shm_id, IPC_RMID, NULL);  // do not leak shmem
+    }
+
     PFATAL("shmat() failed");
   }
 
+  shm_advise_huge(shm, shm->map, map_size);
+  shm_bind_local(shm->map, map_size);
+
   if (shm->cmplog_mode) {
     shm->cmp_map = shmat(shm->cmplog_shm_id, NULL, 0);
 
@@ -298,14 +709,88 @@ u8 *afl_shm_init(sharedmem_t *shm, size_t map_size,
 
       shmctl(shm->cmplog_shm_id, IPC_RMID, NULL);  // do not leak shmem
 
+      if (shm->dirty_mode) {
+        shmctl(shm->dirty_shm_id, IPC_RMID, NULL);  // do not leak shmem
+      }
+
       PFATAL("shmat() failed");
     }
+
+    shm_advise_huge(shm, shm->cmp_map, sizeof(struct cmp_map));
+    shm_bind_local(shm->cmp_map, sizeof(struct cmp_map));
+  }
+
+  if (shm->dirty_mode) {
+    shm->dirty_map = shmat(shm->dirty_shm_id, NULL, 0);
+
+    if (shm->dirty_map == (void *)-1 || !shm->dirty_map) {
+      shmctl(shm->shm_id, IPC_RMID, NULL);  // do not leak shmem
+
+      if (shm->cmplog_mode) {
+        shmctl(shm->cmplog_shm_id, IPC_RMID, NULL);  // do not leak shmem
+      }
+
+      shmctl(shm->dirty_shm_id, IPC_RMID, NULL);  // do not leak shmem
+
+      PFATAL("shmat() failed");
+    }
+
+    shm_bind_local(shm->dirty_map, shm->dirty_size);
   }
 
 #endif
 
+  /* segments taken over from an earlier run start out clean, too */
+
+  if (kept[SHM_KEPT_MAP].reused) {
+    memset(shm->map, 0, kept[SHM_KEPT_MAP].size);
+  }
+
+  if (kept[SHM_KEPT_CMPLOG].reused) {
+    memset(shm->cmp_map, 0, kept[SHM_KEPT_CMPLOG].size);
+  }
+
+  if (kept[SHM_KEPT_DIRTY].reused) {
+    memset(shm->dirty_map, 0, kept[SHM_KEPT_DIRTY].size);
+  }
+
+  shm_kept_write(shm, kept);
+
   shm->map_size = map_size;
   list_append(&shm_list, shm);
 
   return shm->map;
 }
+
+/* Remove the segments recorded in the files of dir, the SHM_KEEP_DIR of an
+   output directory whose afl-fuzz is gone, and the files. Returns the
+   number of segments removed and adds their size to *bytes. */
+
+u32 afl_shm_reclaim(u8 *dir, u64 *bytes) {
+  struct shm_kept kept[SHM_KEPT_CNT];
+  DIR            *d = opendir((char *)dir);
+  struct dirent  *de;
+  char            fn[PATH_MAX];
+  u32             cnt = 0, i;
+
+  if (!d) { return 0; }
+
+  while ((de = readdir(d))) {
+    if (de->d_name[0] == '.') { continue; }
+
+    snprintf(fn, sizeof(fn), "%s/%s", dir, de->d_name);
+    shm_kept_read((u8 *)fn, kept);
+
+    for (i = 0; i < SHM_KEPT_CNT; ++i) {
+      if (shm_drop(&kept[i])) {
+        *bytes += kept[i].size;
+        ++cnt;
+      }
+    }
+
+    unlink(fn);
+  }
+
+  closedir(d);
+  return cnt;
+}
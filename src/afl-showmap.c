@@ -85,6 +85,85 @@ static u32 in_len; /* Input data length                 */
 
 static u32 map_size = MAP_SIZE, timed_out = 0;
 
+/* -j: the number of workers, each with its own forkserver, which take every
+   jobs-th input from the scan and append their maps to the packed output */
+
+static u32  jobs, worker_id, tc_id;
+static s32  packed_fd = -1;
+static u8  *packed_buf;
+static u32 *worker_stats; /* shared: done, exit flag, from the index */
+
+#define PACKED_MAGIC 0x50464c41 /* "ALFP" */
+#define PACKED_VERSION 2
+
+/* The packed output starts with the header, then has a record per input, in
+   the order the workers finish them. The path follows the record, padded
+   with zeroes to a multiple of four bytes, then the u32 index of each map
+   byte that is set and then the u8 values. */
+
+struct packed_header {
+  u32 magic;
+  u32 version;
+  u64 target; /* target_key() with -K, 0 otherwise */
+
+};
+
+struct packed_record {
+  u32 id;       /* input number, in the order of the scan */
+  u16 name_len; /* length of the path that follows        */
+  u8  status;   /* 0 ok, 1 timed out, 2 crashed           */
+  u8  reserved;
+  u32 edges; /* number of map bytes that are set       */
+  u32 size;  /* input length                           */
+  u64 hash;  /* hash64() of the input                  */
+
+};
+
+/* -K: the packed output of an earlier run, for the same target and options,
+   lets the workers take the map of any input with the same contents from
+   there instead of running it. */
+
+static u8  *index_file;
+static u8 **index_tbl; /* records by input hash, open addressing */
+static u32  index_mask;
+static u64  in_hash;
+
+/* -M: the directory the minimized corpus goes to, made from the packed
+   output once the workers are done. */
+
+static u8  *cmin_dir;
+static bool cmin_keep_packed; /* -o was given */
+
+/* -i can be a tar file, whose members are run from the mapping. The id of
+   their packed records is the member number. */
+
+static struct pack *in_pack;
+
+struct cmin_input {
+  u8  *name, *idx, *val; /* path, u32 indexes and values, unaligned */
+  u32  id, edges;
+  u64  size;
+  bool chosen;
+};
+
+/* A tuple is a map byte and the bucket its classified count is in. */
+
+static const u8 tuple_bucket[256] = {[1] = 0,  [2] = 1,  [3] = 2,
+                                     [4] = 3,  [8] = 4,  [16] = 5,
+                                     [32] = 6, [128] = 7};
+
+static u32 *tuple_cnt;
+
+/* -P: the raw hit counts of every edge summed over the inputs, and how many
+   inputs hit it. The counters of the target are 8 bits wide, so an edge that
+   runs more than 255 times in one input wraps around there and is counted
+   short; the number of inputs is exact. */
+
+static u8  *hot_file;
+static u64 *hot_hits;
+static u32 *hot_inputs;
+static u8  *func_ids; /* -F: AFL_LLVM_DOCUMENT_IDS file */
+
 static bool quiet_mode, /* Hide non-essential messages?      */
     edges_only,         /* Ignore hit counts?                */
     raw_instr_output,   /* Do not apply AFL filters          */
@@ -155,6 +234,15 @@ void update_bitmap_score(afl_state_t *afl, struct queue_entry *q) {
   (void)q;
 }
 
+void mutpool_init(afl_state_t *afl, struct custom_mutator *el) {
+  (void)afl;
+  (void)el;
+}
+
+void mutpool_destroy(struct mutpool *p) {
+  (void)p;
+}
+
 fsrv_run_result_t fuzz_run_target(afl_state_t *afl, afl_forkserver_t *fsrv,
                                   u32 i) {
   (void)afl;
@@ -177,7 +265,7 @@ void classify_counts(afl_forkserver_t *fsrv) {
 
   } else if (!raw_instr_output) {
     while (i--) {
-      *mem = map[*mem];
+      *mem = map[fsrv->bucketed_counts ? bucket_count(*mem) : *mem];
       mem++;
     }
   }
@@ -293,6 +381,526 @@ static u32 write_results_to_file(afl_forkserver_t *fsrv, u8 *outfile) {
   return ret;
 }
 
+/* Append the map of one input to the packed output, in one write() to the
+   O_APPEND descriptor so that the records of the workers do not mix. */
+
+static u32 write_results_packed(afl_forkserver_t *fsrv, u8 *name) {
+  struct packed_record *rec;
+  u32                   i, len, name_len = strlen(name), *idx;
+  u8                   *val;
+
+  u8 cco = !!getenv("AFL_CMIN_CRASHES_ONLY"),
+     caa = !!getenv("AFL_CMIN_ALLOW_ANY");
+
+  if (name_len > 0xffff) { name_len = 0xffff; }
+
+  if (!packed_buf) {
+    packed_buf = ck_alloc(sizeof(struct packed_record) + 0xffff + 3 +
+                          map_size * (sizeof(u32) + 1));
+  }
+
+  rec = (struct packed_record *)packed_buf;
+  rec->id = tc_id - 1;
+  rec->name_len = name_len;
+  rec->status = fsrv->last_run_timed_out ? 1 : child_crashed ? 2 : 0;
+  rec->edges = 0;
+  rec->size = in_len;
+  rec->hash = in_hash;
+
+  memcpy(packed_buf + sizeof(*rec), name, name_len);
+  memset(packed_buf + sizeof(*rec) + name_len, 0, 3);
+  idx = (u32 *)(packed_buf + sizeof(*rec) + ((name_len + 3) & ~3));
+
+  if (!cmin_mode ||
+      (!fsrv->last_run_timed_out && (caa || child_crashed == cco))) {
+    for (i = 0; i < map_size; i++) {
+      if (!fsrv->trace_bits[i]) { continue; }
+
+      idx[rec->edges++] = i;
+
+      total += fsrv->trace_bits[i];
+      if (highest < fsrv->trace_bits[i]) { highest = fsrv->trace_bits[i]; }
+    }
+  }
+
+  val = (u8 *)(idx + rec->edges);
+
+  for (i = 0; i < rec->edges; i++) {
+    val[i] = fsrv->trace_bits[idx[i]];
+  }
+
+  len = val + rec->edges - packed_buf;
+  ck_write(packed_fd, packed_buf, len, out_file);
+
+  ++worker_stats[worker_id * 3];
+
+  return rec->edges;
+}
+
+static inline u32 cmin_tuple(struct cmin_input *in, u32 i) {
+  u32 idx;
+
+  memcpy(&idx, in->idx + i * sizeof(u32), sizeof(u32));
+  return (idx << 3) | tuple_bucket[in->val[i]];
+}
+
+/* Smallest first, as afl-cmin has it: by size, then by path backwards. */
+
+static int cmin_input_cmp(const void *a, const void *b) {
+  const struct cmin_input *x = a, *y = b;
+
+  if (x->size != y->size) { return x->size < y->size ? -1 : 1; }
+  return strcmp((char *)y->name, (char *)x->name);
+}
+
+/* Rarest first, then by tuple. */
+
+static int cmin_tuple_cmp(const void *a, const void *b) {
+  u32 x = *(const u32 *)a, y = *(const u32 *)b;
+
+  if (tuple_cnt[x] != tuple_cnt[y]) {
+    return tuple_cnt[x] < tuple_cnt[y] ? -1 : 1;
+  }
+
+  return x < y ? -1 : x > y;
+}
+
+static void cmin_link_or_copy(u8 *old_path, u8 *new_path) {
+  s32 i = link(old_path, new_path);
+  s32 sfd, dfd;
+  u8 *tmp;
+
+  if (!i) { return; }
+
+  sfd = open(old_path, O_RDONLY);
+  if (sfd < 0) { PFATAL("Unable to open '%s'", old_path); }
+
+  dfd = open(new_path, O_WRONLY | O_CREAT | O_EXCL, DEFAULT_PERMISSION);
+  if (dfd < 0) { PFATAL("Unable to create '%s'", new_path); }
+
+  tmp = ck_alloc(64 * 1024);
+
+  while ((i = read(sfd, tmp, 64 * 1024)) > 0) {
+    ck_write(dfd, tmp, i, new_path);
+  }
+
+  if (i < 0) { PFATAL("read() failed"); }
+
+  ck_free(tmp);
+  close(sfd);
+  close(dfd);
+}
+
+/* Map a packed file, NULL if it is not one. With target, it has to be for
+   that target. */
+
+static u8 *packed_map(u8 *fn, u64 *len, u64 *target) {
+  struct packed_header hdr;
+  struct stat          st;
+  u8                  *buf;
+  s32                  fd = open(fn, O_RDONLY);
+
+  if (fd < 0) { return NULL; }
+
+  if (fstat(fd, &st) || st.st_size < (off_t)sizeof(hdr)) {
+    close(fd);
+    return NULL;
+  }
+
+  *len = st.st_size;
+  buf = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (buf == MAP_FAILED) { PFATAL("mmap() failed"); }
+
+  memcpy(&hdr, buf, sizeof(hdr));
+
+  if (hdr.magic != PACKED_MAGIC || hdr.version != PACKED_VERSION ||
+      (target && hdr.target != *target)) {
+    munmap(buf, *len);
+    return NULL;
+  }
+
+  return buf;
+}
+
+/* The length of the record at off, 0 if it runs past len. */
+
+static u64 packed_record_len(u8 *buf, u64 len, u64 off) {
+  struct packed_record rec;
+  u64                  rec_len;
+
+  if (len - off < sizeof(rec)) { return 0; }
+
+  memcpy(&rec, buf + off, sizeof(rec));
+  rec_len = sizeof(rec) + ((rec.name_len + 3) & ~3) + rec.edges * 5ULL;
+
+  return rec_len <= len - off ? rec_len : 0;
+}
+
+/* What the maps depend on besides the input: the target binary, its
+   arguments and the options that change the maps. */
+
+static u64 target_key(afl_forkserver_t *fsrv, char **argv) {
+  struct stat st;
+  u8         *path = find_binary(argv[0]), *map;
+  u64         key;
+  s32         fd, i;
+
+  u8 opts[] = {edges_only,
+               cmin_mode,
+               !!getenv("AFL_CMIN_CRASHES_ONLY"),
+               !!getenv("AFL_CMIN_ALLOW_ANY"),
+               fsrv->qemu_mode,
+               fsrv->frida_mode,
+               fsrv->cs_mode};
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st)) { PFATAL("Unable to open '%s'", path); }
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) { PFATAL("mmap() failed"); }
+
+  key = hash64(map, st.st_size, HASH_CONST);
+  munmap(map, st.st_size);
+  close(fd);
+  ck_free(path);
+
+  for (i = 1; argv[i]; ++i) {
+    key = hash64(argv[i], strlen(argv[i]) + 1, key);
+  }
+
+  key = hash64(opts, sizeof(opts), key);
+
+  return key ? key : 1;
+}
+
+/* Put the records of the -K file from an earlier run into index_tbl, if it
+   was made for the same target. The mapping outlives the unlink() of the
+   file in start_workers(). Timeouts are run again. */
+
+static void load_index(u64 target) {
+  struct packed_record rec;
+  u64                  len, off, rec_len;
+  u32                  n = 0, slots = 16, slot;
+  u8                  *buf;
+
+  if (access(index_file, F_OK)) { return; }
+
+  if (!(buf = packed_map(index_file, &len, &target))) {
+    WARNF("'%s' is not for this target and these options, tracing all inputs",
+          index_file);
+    return;
+  }
+
+  for (off = sizeof(struct packed_header); off < len; off += rec_len, ++n) {
+    if (!(rec_len = packed_record_len(buf, len, off))) {
+      WARNF("'%s' is truncated, tracing all inputs", index_file);
+      munmap(buf, len);
+      return;
+    }
+  }
+
+  while (slots < n * 2) {
+    slots <<= 1;
+  }
+
+  index_tbl = ck_alloc(slots * sizeof(u8 *));
+  index_mask = slots - 1;
+
+  for (off = sizeof(struct packed_header); off < len; off += rec_len) {
+    rec_len = packed_record_len(buf, len, off);
+    memcpy(&rec, buf + off, sizeof(rec));
+
+    if (rec.status == 1) { continue; }
+
+    for (slot = rec.hash & index_mask; index_tbl[slot];
+         slot = (slot + 1) & index_mask) {}
+
+    index_tbl[slot] = buf + off;
+  }
+
+  if (!quiet_mode) { OKF("Loaded %u maps from '%s'.", n, index_file); }
+}
+
+/* Hash the input and, with -K, take its map from the index if it is there,
+   as if the target had run. */
+
+static bool load_cached_map(afl_forkserver_t *fsrv) {
+  struct packed_record rec;
+  u8                  *r, *idx, *val;
+  u32                  i, pos, slot;
+
+  in_hash = hash64(in_data, in_len, HASH_CONST);
+
+  if (!index_tbl) { return false; }
+
+  for (slot = in_hash & index_mask; (r = index_tbl[slot]);
+       slot = (slot + 1) & index_mask) {
+    memcpy(&rec, r, sizeof(rec));
+    if (rec.hash == in_hash && rec.size == in_len) { break; }
+  }
+
+  if (!r) { return false; }
+
+  idx = r + sizeof(rec) + ((rec.name_len + 3) & ~3);
+  val = idx + rec.edges * sizeof(u32);
+
+  memset(fsrv->trace_bits, 0, map_size);
+
+  for (i = 0; i < rec.edges; ++i) {
+    memcpy(&pos, idx + i * sizeof(u32), sizeof(u32));
+    if (pos >= map_size) { return false; }
+    fsrv->trace_bits[pos] = val[i];
+  }
+
+  fsrv->last_run_timed_out = 0;
+  child_crashed = rec.status == 2;
+  ++worker_stats[worker_id * 3 + 2];
+
+  return true;
+}
+
+/* Minimize the corpus from the packed output: every tuple, rarest first,
+   brings in the smallest input that has it, which covers all its other
+   tuples as well. This is what afl-cmin does with its trace files, here
+   the tuples stay in the mapped file and a bitset tracks the covered ones. */
+
+static void minimize_corpus(void) {
+  struct cmin_input   *in;
+  struct packed_record rec;
+  u32                  i, j, n = 0, max_idx = 0, ignored = 0, tuples = 0;
+  u32                  chosen = 0, *best, *order, key;
+  u64                  len, off, rec_len, key_space, *covered;
+  u8                  *buf, *fn, *base;
+
+  if (!(buf = packed_map(out_file, &len, NULL))) {
+    FATAL("Corrupt packed file '%s'", out_file);
+  }
+
+  /* the first pass counts the records and checks them */
+
+  for (off = sizeof(struct packed_header); off < len; off += rec_len, ++n) {
+    if (!(rec_len = packed_record_len(buf, len, off))) {
+      FATAL("Corrupt packed file '%s'", out_file);
+    }
+  }
+
+  in = ck_alloc(sizeof(struct cmin_input) * (n ? n : 1));
+
+  for (off = sizeof(struct packed_header), i = 0; i < n; ++i) {
+    memcpy(&rec, buf + off, sizeof(rec));
+
+    in[i].name = ck_alloc(rec.name_len + 1);
+    memcpy(in[i].name, buf + off + sizeof(rec), rec.name_len);
+    in[i].id = rec.id;
+    in[i].idx = buf + off + sizeof(rec) + ((rec.name_len + 3) & ~3);
+    in[i].val = in[i].idx + rec.edges * sizeof(u32);
+    in[i].edges = rec.edges;
+    off = in[i].val + rec.edges - buf;
+
+    /* the workers leave the maps of inputs to ignore empty */
+
+    if (!rec.edges) {
+      ++ignored;
+      continue;
+    }
+
+    in[i].size = rec.size;
+
+    for (j = 0; j < rec.edges; ++j) {
+      if (cmin_tuple(in + i, j) >> 3 > max_idx) {
+        max_idx = cmin_tuple(in + i, j) >> 3;
+      }
+    }
+  }
+
+  if (ignored && !quiet_mode) {
+    WARNF("%u input files crashed, timed out or had no coverage, ignored.",
+          ignored);
+  }
+
+  if (ignored == n) { FATAL("No input file with coverage"); }
+
+  key_space = ((u64)max_idx + 1) << 3;
+  if (key_space > 0xffffffffULL) { FATAL("Map too large for -M"); }
+
+  qsort(in, n, sizeof(struct cmin_input), cmin_input_cmp);
+
+  /* register the smallest input for each tuple and count the inputs */
+
+  best = ck_alloc(key_space * sizeof(u32));
+  tuple_cnt = ck_alloc(key_space * sizeof(u32));
+  covered = ck_alloc(((key_space + 63) >> 6) * sizeof(u64));
+
+  for (i = 0; i < n; ++i) {
+    for (j = 0; j < in[i].edges; ++j) {
+      key = cmin_tuple(in + i, j);
+      if (!tuple_cnt[key]++) {
+        best[key] = i;
+        ++tuples;
+      }
+    }
+  }
+
+  order = ck_alloc(tuples * sizeof(u32));
+
+  for (key = 0, j = 0; j < tuples; ++key) {
+    if (tuple_cnt[key]) { order[j++] = key; }
+  }
+
+  qsort(order, tuples, sizeof(u32), cmin_tuple_cmp);
+
+  /* from rare to frequent tuples, take the best input of each that is not
+     covered yet */
+
+  for (j = 0; j < tuples; ++j) {
+    struct cmin_input *b;
+
+    key = order[j];
+    if (covered[key >> 6] & (1ULL << (key & 63))) { continue; }
+
+    b = in + best[key];
+    b->chosen = true;
+    ++chosen;
+
+    for (i = 0; i < b->edges; ++i) {
+      key = cmin_tuple(b, i);
+      covered[key >> 6] |= 1ULL << (key & 63);
+    }
+  }
+
+  for (i = 0; i < n; ++i) {
+    if (!in[i].chosen) { continue; }
+
+    base = strrchr(in[i].name, '/');
+    base = base ? base + 1 : in[i].name;
+
+    /* inputs from different directories can have the same name */
+
+    fn = alloc_printf("%s/%s", cmin_dir, base);
+    if (!access(fn, F_OK)) {
+      ck_free(fn);
+      fn = alloc_printf("%s/%s,%u", cmin_dir, base, i);
+    }
+
+    if (in_pack) {
+      struct pack_entry *e = &in_pack->ent[in[i].id];
+      s32                fd;
+
+      fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, DEFAULT_PERMISSION);
+      if (fd < 0) { PFATAL("Unable to create '%s'", fn); }
+      ck_write(fd, in_pack->map + e->off, e->len, fn);
+      close(fd);
+
+    } else {
+      cmin_link_or_copy(in[i].name, fn);
+    }
+
+    ck_free(fn);
+  }
+
+  if (!quiet_mode) {
+    OKF("Found %u unique tuples across %u input files.", tuples, n);
+    if (chosen == 1) {
+      WARNF("All test cases had the same traces, check syntax!");
+    }
+
+    OKF("Narrowed down to %u files, saved in '%s'.", chosen, cmin_dir);
+  }
+
+  for (i = 0; i < n; ++i) {
+    ck_free(in[i].name);
+  }
+
+  ck_free(order);
+  ck_free(covered);
+  ck_free(tuple_cnt);
+  ck_free(best);
+  ck_free(in);
+  munmap(buf, len);
+}
+
+/* Start the -j workers, which go on with the rest of main(), and wait for
+   them in the parent. */
+
+static void start_workers(u64 target) {
+  u32   i, done = 0, cached = 0;
+  s32   status;
+  pid_t pid;
+
+  struct packed_header hdr = {PACKED_MAGIC, PACKED_VERSION, target};
+
+  if (index_file) { load_index(target); }
+
+  unlink(out_file); /* Ignore errors */
+  packed_fd = open(out_file, O_WRONLY | O_CREAT | O_EXCL, DEFAULT_PERMISSION);
+  if (packed_fd < 0) { PFATAL("Unable to create '%s'", out_file); }
+  ck_write(packed_fd, &hdr, sizeof(hdr), out_file);
+  close(packed_fd);
+
+  worker_stats = mmap(NULL, jobs * 3 * sizeof(u32), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (worker_stats == MAP_FAILED) { PFATAL("mmap() failed"); }
+
+  if (!quiet_mode) {
+    ACTF("Starting %u workers, writing to '%s'...", jobs, out_file);
+  }
+
+  fflush(stdout);
+
+  for (i = 0; i < jobs; ++i) {
+    pid = fork();
+    if (pid < 0) { PFATAL("fork() failed"); }
+
+    if (!pid) {
+      worker_id = i;
+      quiet_mode = true;
+      if (i) { be_quiet = true; }
+
+      packed_fd = open(out_file, O_WRONLY | O_APPEND);
+      if (packed_fd < 0) { PFATAL("Unable to open '%s'", out_file); }
+
+      if (at_file) { at_file = alloc_printf("%s.%u", at_file, i); }
+      return;
+    }
+  }
+
+  while (done < jobs) {
+    if (waitpid(-1, &status, 0) < 0) {
+      if (errno == EINTR) { continue; }
+      PFATAL("waitpid() failed");
+    }
+
+    ++done;
+  }
+
+  if (stop_soon) { FATAL("Aborted by user"); }
+
+  for (i = 0, done = 0; i < jobs; ++i) {
+    if (!worker_stats[i * 3 + 1]) { FATAL("Worker %u failed", i); }
+    done += worker_stats[i * 3];
+    cached += worker_stats[i * 3 + 2];
+  }
+
+  if (!done) { FATAL("could not read input testcases"); }
+
+  if (!quiet_mode) {
+    OKF("Processed %u input files with %u workers into '%s'.", done, jobs,
+        out_file);
+    if (index_file) { OKF("Took the maps of %u of them from there.", cached); }
+  }
+
+  if (cmin_dir) {
+    minimize_corpus();
+    if (!cmin_keep_packed && !get_afl_env("AFL_KEEP_TRACES")) {
+      unlink(out_file);
+    }
+  }
+
+  exit(0);
+}
+
 void pre_afl_fsrv_write_to_testcase(afl_forkserver_t *fsrv, u8 *mem, u32 len) {
   static u8 buf[MAX_FILE];
   u32       sent = 0;
@@ -335,6 +943,108 @@ void pre_afl_fsrv_write_to_testcase(afl_forkserver_t *fsrv, u8 *mem, u32 len) {
   if (likely(!sent)) { afl_fsrv_write_to_testcase(fsrv, mem, len); }
 }
 
+/* -P: add the counters of the last run, before they are classified. The map
+   size is a multiple of 64, zero words are skipped. */
+
+static void hot_add(afl_forkserver_t *fsrv) {
+  u64 *words = (u64 *)fsrv->trace_bits;
+  u8  *bytes;
+  u32  i, j;
+
+  for (i = 0; i < map_size / 8; ++i) {
+    if (likely(!words[i])) { continue; }
+
+    bytes = (u8 *)(words + i);
+
+    for (j = 0; j < 8; ++j) {
+      if (bytes[j]) {
+        hot_hits[i * 8 + j] += bytes[j];
+        ++hot_inputs[i * 8 + j];
+      }
+    }
+  }
+}
+
+static int hot_cmp(const void *a, const void *b) {
+  u32 x = *(u32 *)a, y = *(u32 *)b;
+
+  if (hot_hits[x] != hot_hits[y]) { return hot_hits[x] < hot_hits[y] ? 1 : -1; }
+  return x < y ? -1 : x > y;
+}
+
+/* -F with -P: the "function:block" of every edge of the document file, as
+   AFL_LLVM_ALWAYS_HIT takes them, or just the function for builds that do
+   not document the blocks. */
+
+static u8 **hot_names(void) {
+  FILE *f = fopen(func_ids, "r");
+  u8  **names = ck_alloc(map_size * sizeof(u8 *));
+  u8    line[4096], *func, *id, *block;
+  u32   idx;
+
+  if (!f) { PFATAL("Unable to open '%s'", func_ids); }
+
+  while (fgets(line, sizeof(line), f)) {
+    func = (u8 *)strstr(line, " Function=");
+    id = (u8 *)strstr(line, " edgeID=");
+    if (!func || !id || id < func) { continue; }
+
+    block = (u8 *)strstr(id, " Block=");
+    *id = 0;
+    idx = atoi(id + 8);
+    if (idx >= map_size || names[idx]) { continue; }
+
+    names[idx] = block ? alloc_printf("%s:%u", func + 10, atoi(block + 7))
+                       : ck_strdup(func + 10);
+  }
+
+  fclose(f);
+  return names;
+}
+
+/* -P: write "edge hits inputs [function:block]" lines, the most hits
+   first. */
+
+static void hot_write(void) {
+  u32  *edges = ck_alloc(map_size * sizeof(u32));
+  u8  **names = func_ids ? hot_names() : NULL;
+  u32   i, cnt = 0;
+  FILE *f = create_ffile(hot_file);
+
+  for (i = 0; i < map_size; ++i) {
+    if (hot_inputs[i]) { edges[cnt++] = i; }
+  }
+
+  qsort(edges, cnt, sizeof(u32), hot_cmp);
+
+  fprintf(f, "# edge hits inputs%s, over %llu inputs\n",
+          names ? " function:block" : "", fsrv->total_execs);
+
+  for (i = 0; i < cnt; ++i) {
+    fprintf(f, "%u %llu %u", edges[i], hot_hits[edges[i]],
+            hot_inputs[edges[i]]);
+    if (names) { fprintf(f, " %s", names[edges[i]] ? names[edges[i]] : (u8 *)"?"); }
+    fputc('\n', f);
+  }
+
+  fclose(f);
+
+  if (names) {
+    for (i = 0; i < map_size; ++i) {
+      ck_free(names[i]);
+    }
+
+    ck_free(names);
+  }
+
+  if (!be_quiet) {
+    OKF("Hit counts of %u edges written to '%s', the hottest first.", cnt,
+        hot_file);
+  }
+
+  ck_free(edges);
+}
+
 /* Execute target application. */
 
 static void showmap_run_target_forkserver(afl_forkserver_t *fsrv, u8 *mem,
@@ -356,6 +1066,8 @@ static void showmap_run_target_forkserver(afl_forkserver_t *fsrv, u8 *mem,
     have_coverage = false;
   }
 
+  if (hot_hits) { hot_add(fsrv); }
+
   if (!no_classify) { classify_counts(fsrv); }
 
   if (!quiet_mode) { SAYF(cRST "-- Program output ends --\n"); }
@@ -689,6 +1401,11 @@ u32 execute_testcases(u8 *dir) {
 
     free(nl[i]);
 
+    if (jobs && tc_id++ % jobs != worker_id) {
+      ++done;
+      continue;
+    }
+
     if (read_file(fn2)) {
       if (wait_for_gdb) {
         fprintf(stderr, "exec: gdb -p %d\n", fsrv->child_pid);
@@ -696,7 +1413,10 @@ u32 execute_testcases(u8 *dir) {
         kill(0, SIGSTOP);
       }
 
-      showmap_run_target_forkserver(fsrv, in_data, in_len);
+      if (!jobs || !load_cached_map(fsrv)) {
+        showmap_run_target_forkserver(fsrv, in_data, in_len);
+      }
+
       ck_free(in_data);
       ++done;
 
@@ -704,6 +1424,8 @@ u32 execute_testcases(u8 *dir) {
 
       if (collect_coverage)
         analyze_results(fsrv);
+      else if (jobs)
+        tcnt = write_results_packed(fsrv, fn2);
       else
         tcnt = write_results_to_file(fsrv, outfile);
     }
@@ -767,6 +1489,8 @@ u32 execute_testcases_filelist(u8 *fn) {
       snprintf(outfile, sizeof(outfile), "%s/%s", out_file, fn3);
     }
 
+    if (jobs && tc_id++ % jobs != worker_id) { continue; }
+
     if (read_file(fn2)) {
       if (wait_for_gdb) {
         fprintf(stderr, "exec: gdb -p %d\n", fsrv->child_pid);
@@ -774,13 +1498,18 @@ u32 execute_testcases_filelist(u8 *fn) {
         kill(0, SIGSTOP);
       }
 
-      showmap_run_target_forkserver(fsrv, in_data, in_len);
+      if (!jobs || !load_cached_map(fsrv)) {
+        showmap_run_target_forkserver(fsrv, in_data, in_len);
+      }
+
       ck_free(in_data);
 
       if (child_crashed && debug) { WARNF("crashed: %s", fn2); }
 
       if (collect_coverage)
         analyze_results(fsrv);
+      else if (jobs)
+        tcnt = write_results_packed(fsrv, fn2);
       else
         tcnt = write_results_to_file(fsrv, outfile);
     }
@@ -789,8 +1518,321 @@ u32 execute_testcases_filelist(u8 *fn) {
   return done;
 }
 
+/* Run the members of the -i tar file, like execute_testcases() the files of
+   a directory. */
+
+static u32 execute_testcases_pack(void) {
+  u32 i, done = 0;
+  u8 *fn;
+
+  if (!be_quiet) {
+    ACTF("Reading %u members from '%s'...", in_pack->cnt, in_pack->fn);
+  }
+
+  for (i = 0; i < in_pack->cnt; ++i) {
+    struct pack_entry *e = &in_pack->ent[i];
+
+    if (!e->len) { continue; }
+
+    fn = alloc_printf("%s/%s", in_pack->fn, e->name);
+
+    if (!collect_coverage) {
+      snprintf(outfile, sizeof(outfile), "%s/%s", out_file,
+               strrchr(fn, '/') + 1);
+    }
+
+    tc_id = i;
+
+    if (jobs && tc_id++ % jobs != worker_id) {
+      ++done;
+      ck_free(fn);
+      continue;
+    }
+
+    if (print_filenames) {
+      SAYF("Processing %s\n", fn);
+      fflush(stdout);
+    }
+
+    in_data = in_pack->map + e->off;
+    in_len = e->len;
+
+    if (wait_for_gdb) {
+      fprintf(stderr, "exec: gdb -p %d\n", fsrv->child_pid);
+      fprintf(stderr, "exec: kill -CONT %d\n", getpid());
+      kill(0, SIGSTOP);
+    }
+
+    if (!jobs || !load_cached_map(fsrv)) {
+      showmap_run_target_forkserver(fsrv, in_data, in_len);
+    }
+
+    in_data = NULL;
+    ++done;
+
+    if (child_crashed && debug) { WARNF("crashed: %s", fn); }
+
+    if (collect_coverage)
+      analyze_results(fsrv);
+    else if (jobs)
+      tcnt = write_results_packed(fsrv, fn);
+    else
+      tcnt = write_results_to_file(fsrv, outfile);
+
+    ck_free(fn);
+  }
+
+  return done;
+}
+
 /* Show banner. */
 
+/* -u/-d: combine maps without running anything. A map is a fuzz_bitmap of
+   afl-fuzz (the virgin bits, 0xff where nothing was seen), the text output
+   of -o or -C, or a packed file of -j, which counts as the union of its
+   records. Every map byte becomes the highest count class seen there, as
+   in the text output, or 1 with -e. */
+
+static u8 comb_mode; /* 'u' union, 'd' first minus the others */
+
+/* The human count class of the highest bucket bit of a virgin map byte. */
+
+static inline u8 virgin_class(u8 v) {
+  v = ~v;
+  return v ? 32 - __builtin_clz(v) : 0;
+}
+
+/* Grow a map to at least size bytes, zeroing the new part. */
+
+static void comb_grow(u8 **map, u32 *size, u32 new_size) {
+  if (new_size <= *size) { return; }
+
+  *map = ck_realloc(*map, new_size);
+  memset(*map + *size, 0, new_size - *size);
+  *size = new_size;
+}
+
+static void comb_set(u8 **map, u32 *size, u32 idx, u8 val) {
+  if (idx >= FS_OPT_MAX_MAPSIZE) { FATAL("Map index %u out of range", idx); }
+
+  if (idx >= *size) {
+    comb_grow(map, size,
+              MAX((idx + 64) & ~63U, MIN(*size * 2, FS_OPT_MAX_MAPSIZE)));
+  }
+
+  if (edges_only && val) { val = 1; }
+  if ((*map)[idx] < val) { (*map)[idx] = val; }
+}
+
+/* Read one map in any of the formats, sized to a multiple of 64. */
+
+static u8 *comb_read_map(u8 *fn, u32 *size) {
+  struct packed_record rec;
+  struct stat          st;
+  u8                  *buf, *map = NULL, *p, *end;
+  u64                  len, off, rec_len;
+  u32                  i, idx, val;
+  s32                  fd;
+
+  *size = 0;
+
+  if ((buf = packed_map(fn, &len, NULL))) {
+    for (off = sizeof(struct packed_header);
+         (rec_len = packed_record_len(buf, len, off)); off += rec_len) {
+      memcpy(&rec, buf + off, sizeof(rec));
+      p = buf + off + sizeof(rec) + ((rec.name_len + 3) & ~3);
+
+      for (i = 0; i < rec.edges; ++i) {
+        memcpy(&idx, p + i * sizeof(u32), sizeof(u32));
+        comb_set(&map, size, idx, p[rec.edges * sizeof(u32) + i]);
+      }
+    }
+
+    if (off != len) { WARNF("'%s' is truncated", fn); }
+    munmap(buf, len);
+    return map;
+  }
+
+  fd = open(fn, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st)) { PFATAL("Unable to open '%s'", fn); }
+  if (!st.st_size) { FATAL("'%s' is empty", fn); }
+
+  buf = ck_alloc_nozero(st.st_size + 1);
+  ck_read(fd, buf, st.st_size, fn);
+  close(fd);
+  buf[st.st_size] = 0;
+
+  if (sscanf(buf, "%u:%u", &idx, &val) == 2) {
+    /* the text output, one idx:val line per map byte that is set */
+
+    for (p = buf, end = buf + st.st_size; p < end; ++p) {
+      if (sscanf(p, "%u:%u", &idx, &val) != 2 || val > 255) {
+        FATAL("'%s' has a line that is not a map entry", fn);
+      }
+
+      comb_set(&map, size, idx, val);
+      if (!(p = memchr(p, '\n', end - p))) { break; }
+    }
+
+  } else {
+    if ((u64)st.st_size > FS_OPT_MAX_MAPSIZE) {
+      FATAL("'%s' is not a map", fn);
+    }
+
+    *size = (st.st_size + 63) & ~63;
+    map = ck_alloc(*size);
+
+    for (i = 0; i < st.st_size; ++i) {
+      map[i] = virgin_class(buf[i]);
+      if (edges_only && map[i]) { map[i] = 1; }
+    }
+  }
+
+  ck_free(buf);
+  return map;
+}
+
+/* dst gets the higher class of both, byte by byte. */
+
+static void comb_union(u8 *dst, u8 *src, u32 len) {
+  u32 i;
+
+  for (i = 0; i < len; ++i) {
+    dst[i] = dst[i] > src[i] ? dst[i] : src[i];
+  }
+}
+
+/* dst loses every byte that is set in src, a word at a time: the top bit
+   of each byte of m says whether that byte of src is set. */
+
+static void comb_diff(u8 *dst, u8 *src, u32 len) {
+  u64 *d = (u64 *)dst, *s = (u64 *)src, m;
+  u32  i;
+
+  for (i = 0; i < len / 8; ++i) {
+    m = (((s[i] & 0x7f7f7f7f7f7f7f7fULL) + 0x7f7f7f7f7f7f7f7fULL) | s[i]) &
+        0x8080808080808080ULL;
+    d[i] &= ~((m >> 7) * 0xff);
+  }
+}
+
+/* -F: for every function of the document file, how many of its edges the
+   combined map has, as "module function covered edges" lines. Consecutive
+   lines for the same function are one function. */
+
+static void comb_functions(u8 *map, u32 size, u8 *fn_out) {
+  FILE *in = fopen(func_ids, "r"), *out;
+  u8    line[4096], cur[4096] = "", *mod, *func, *id, *e = NULL;
+  u32   idx, covered = 0, edges = 0, funcs = 0, hit = 0;
+
+  if (!in) { PFATAL("Unable to open '%s'", func_ids); }
+  out = create_ffile(fn_out);
+
+  while (1) {
+    u8 more = !!fgets(line, sizeof(line), in);
+
+    mod = more ? (u8 *)strstr(line, "ModuleID=") : NULL;
+    func = more ? (u8 *)strstr(line, " Function=") : NULL;
+    id = more ? (u8 *)strstr(line, " edgeID=") : NULL;
+
+    if (more && (!mod || !func || !id || func < mod || id < func)) {
+      continue;
+    }
+
+    if (more) {
+      *func = 0;
+      *id = 0;
+      func += 10;
+      mod += 9;
+      idx = atoi(id + 8);
+      e = alloc_printf("%s %s", mod, func);
+    }
+
+    if (!more || strcmp(e, cur)) {
+      if (edges) {
+        fprintf(out, "%s %u %u\n", cur, covered, edges);
+        ++funcs;
+        if (covered) { ++hit; }
+      }
+
+      if (!more) { break; }
+
+      snprintf(cur, sizeof(cur), "%s", e);
+      covered = edges = 0;
+    }
+
+    ck_free(e);
+
+    ++edges;
+    if (idx < size && map[idx]) { ++covered; }
+  }
+
+  fclose(in);
+  fclose(out);
+
+  if (!quiet_mode) {
+    OKF("%u of %u functions covered, per function in '%s'.", hit, funcs,
+        fn_out);
+  }
+}
+
+static void combine_maps(char **files, u32 cnt) {
+  u8 *map, *other, *fn_out;
+  u32 size, other_size, i, edges = 0;
+
+  if (!cnt) { FATAL("-%c needs at least one map file", comb_mode); }
+  if (!out_file) { FATAL("-%c needs -o", comb_mode); }
+
+  map = comb_read_map(files[0], &size);
+
+  for (i = 1; i < cnt; ++i) {
+    other = comb_read_map(files[i], &other_size);
+
+    if (comb_mode == 'u') {
+      comb_grow(&map, &size, other_size);
+      comb_union(map, other, other_size);
+
+    } else {
+      comb_diff(map, other, MIN(size, other_size));
+    }
+
+    ck_free(other);
+  }
+
+  /* write it as a run of the target would */
+
+  fsrv->trace_bits = map;
+  map_size = size;
+  tcnt = write_results_to_file(fsrv, out_file);
+
+  for (i = 0; i < size; ++i) {
+    if (map[i]) { ++edges; }
+  }
+
+  if (!quiet_mode) {
+    if (comb_mode == 'u') {
+      OKF("Union of %u map%s: %u edges in '%s'.", cnt, cnt == 1 ? "" : "s",
+          edges, out_file);
+
+    } else {
+      OKF("%u edges of '%s' are in none of the other %u map%s, in '%s'.",
+          edges, files[0], cnt - 1, cnt == 2 ? "" : "s", out_file);
+    }
+  }
+
+  if (func_ids) {
+    if (!strcmp(out_file, "-") || !strncmp(out_file, "/dev/", 5)) {
+      FATAL("-F needs a regular file for -o");
+    }
+
+    fn_out = alloc_printf("%s.functions", out_file);
+    comb_functions(map, size, fn_out);
+    ck_free(fn_out);
+  }
+
+  ck_free(map);
+}
+
 static void show_banner(void) {
   SAYF(cCYA "afl-showmap" VERSION cRST " by Michal Zalewski\n");
 }
@@ -825,13 +1867,35 @@ static void usage(u8 *argv0) {
       "Other settings:\n"
       "  -i dir     - process all files below this directory, must be combined "
       "with -o.\n"
+      "               It can also be an uncompressed tar file.\n"
       "               With -C, -o is a file, without -C it must be a "
       "directory\n"
       "               and each bitmap will be written there individually.\n"
       "  -I filelist - alternatively to -i, -I is a list of files\n"
+      "  -j jobs    - with -i/-I, run that many forkservers in parallel and "
+      "write\n"
+      "               all maps to the single packed file -o\n"
+      "  -M dir     - with -i/-I, minimize the corpus into dir like afl-cmin "
+      "does,\n"
+      "               -j sets the parallel tracing, -o keeps the packed maps\n"
+      "  -K file    - with -j or -M, instead of -o: take the maps of inputs "
+      "that\n"
+      "               are in file from an earlier run, then update it\n"
       "  -C         - collect coverage, writes all edges to -o and gives a "
       "summary\n"
       "               Must be combined with -i.\n"
+      "  -u         - run nothing, write the union of the maps given instead "
+      "of a\n"
+      "               target to -o: fuzz_bitmap files, -o/-C or -j outputs\n"
+      "  -d         - like -u, the edges of the first map none of the others "
+      "has\n"
+      "  -F file    - with -u/-d, the covered edges per function of an\n"
+      "               AFL_LLVM_DOCUMENT_IDS file, written to <-o>.functions\n"
+      "  -P file    - with -i/-I, sum the raw hit counts of every edge over "
+      "all\n"
+      "               inputs and write them to file, the hottest first (with "
+      "-F\n"
+      "               named by function:block)\n"
       "  -q         - sink program's output and don't show messages\n"
       "  -e         - show edge coverage only, ignore hit counts\n"
       "  -r         - show real tuple values instead of AFL filter values\n"
@@ -901,7 +1965,8 @@ int main(int argc, char **argv_orig, char **envp) {
 
   if (getenv("AFL_QUIET") != NULL) { be_quiet = true; }
 
-  while ((opt = getopt(argc, argv, "+i:I:o:f:m:t:AeqCZOH:QUWbcrshXY")) > 0) {
+  while ((opt = getopt(argc, argv, "+i:I:j:K:M:o:f:m:t:AeqCZOH:QUWbcrshXYudF:P:")) >
+         0) {
     switch (opt) {
       case 's':
         no_classify = true;
@@ -922,6 +1987,39 @@ int main(int argc, char **argv_orig, char **envp) {
         in_filelist = optarg;
         break;
 
+      case 'j':
+        if (jobs) { FATAL("Multiple -j options not supported"); }
+        jobs = atoi(optarg);
+        if (jobs < 1 || jobs > 1024) { FATAL("Bad value for -j"); }
+        break;
+
+      case 'K':
+        if (index_file) { FATAL("Multiple -K options not supported"); }
+        index_file = optarg;
+        break;
+
+      case 'u':
+      case 'd':
+        if (comb_mode) { FATAL("Multiple -u/-d options not supported"); }
+        comb_mode = opt;
+        break;
+
+      case 'F':
+        if (func_ids) { FATAL("Multiple -F options not supported"); }
+        func_ids = optarg;
+        break;
+
+      case 'P':
+        if (hot_file) { FATAL("Multiple -P options not supported"); }
+        hot_file = optarg;
+        break;
+
+      case 'M':
+        if (cmin_dir) { FATAL("Multiple -M options not supported"); }
+        cmin_dir = optarg;
+        cmin_mode = true;
+        break;
+
       case 'o':
 
         if (out_file) { FATAL("Multiple -o options not supported"); }
@@ -1126,15 +2224,89 @@ int main(int argc, char **argv_orig, char **envp) {
     }
   }
 
-  if (optind == argc || !out_file) { usage(argv[0]); }
+  if (comb_mode) {
+    if (in_dir || in_filelist || jobs || cmin_dir || index_file ||
+        collect_coverage || hot_file) {
+      FATAL("-%c cannot be combined with -i, -I, -j, -M, -K, -C or -P",
+            comb_mode);
+    }
+
+    combine_maps(argv + optind, argc - optind);
+    exit(0);
+  }
+
+  if (func_ids && !hot_file) { FATAL("-F needs -u, -d or -P"); }
+
+  if (hot_file) {
+    if (!in_dir && !in_filelist) { FATAL("-P needs -i or -I"); }
+    if (jobs || cmin_dir) { FATAL("-P cannot be combined with -j or -M"); }
+  }
+
+  if (optind == argc || (!out_file && !cmin_dir && !index_file)) {
+    usage(argv[0]);
+  }
 
   if (in_dir && in_filelist) { FATAL("you can only specify either -i or -I"); }
 
+  if (index_file) {
+    if (out_file) { FATAL("-K takes the place of -o"); }
+    if (!jobs && !cmin_dir) { FATAL("-K needs -j or -M"); }
+    out_file = index_file;
+  }
+
+  if (cmin_dir) {
+    DIR           *d;
+    struct dirent *de;
+
+    if (!in_dir && !in_filelist) { FATAL("-M needs -i or -I"); }
+    if (collect_coverage || binary_mode || raw_instr_output || no_classify) {
+      FATAL("-M cannot be combined with -C, -b, -r or -s");
+    }
+
+    if (mkdir(cmin_dir, 0700) && errno != EEXIST) {
+      PFATAL("cannot create output directory %s", cmin_dir);
+    }
+
+    if (!(d = opendir(cmin_dir))) { PFATAL("Unable to open '%s'", cmin_dir); }
+
+    while ((de = readdir(d))) {
+      if (de->d_name[0] != '.') {
+        FATAL("directory '%s' exists and is not empty - delete it first.",
+              cmin_dir);
+      }
+    }
+
+    closedir(d);
+
+    if (out_file) {
+      cmin_keep_packed = true;
+
+    } else {
+      out_file = alloc_printf("%s/.afl-cmin.packed", cmin_dir);
+    }
+
+    if (!jobs) { jobs = 1; }
+  }
+
   if (in_dir || in_filelist) {
     if (!out_file && !collect_coverage)
       FATAL("for -i/-I you need to specify either -C and/or -o");
   }
 
+  if (jobs) {
+    if (!in_dir && !in_filelist) { FATAL("-j needs -i or -I"); }
+    if (collect_coverage || binary_mode) {
+      FATAL("-j cannot be combined with -C or -b");
+    }
+
+#ifdef __linux__
+    if (fsrv->nyx_mode) { FATAL("-j is not supported in Nyx mode"); }
+#endif
+    if (!strcmp(out_file, "-") || !strncmp(out_file, "/dev/", 5)) {
+      FATAL("-j needs a regular file for -o");
+    }
+  }
+
   if (fsrv->qemu_mode && !mem_limit_given) { fsrv->mem_limit = MEM_LIMIT_QEMU; }
   if (unicorn_mode && !mem_limit_given) { fsrv->mem_limit = MEM_LIMIT_UNICORN; }
 
@@ -1161,6 +2333,12 @@ int main(int argc, char **argv_orig, char **envp) {
 
   set_up_environment(fsrv, argv);
 
+  if (in_dir) { in_pack = pack_open(in_dir); }
+
+  if (jobs) {
+    start_workers(index_file ? target_key(fsrv, argv + optind) : 0);
+  }
+
 #ifdef __linux__
   if (!fsrv->nyx_mode) {
     fsrv->target_path = find_binary(argv[optind]);
@@ -1173,6 +2351,15 @@ int main(int argc, char **argv_orig, char **envp) {
   fsrv->target_path = find_binary(argv[optind]);
 #endif
 
+  /* sized for what the binary says it needs, so there is no restart for it */
+  u32 predicted = predict_map_size(fsrv->target_path, NULL);
+  if (predicted > map_size) {
+    map_size = predicted;
+    u8 *vbuf = alloc_printf("%u", map_size);
+    setenv("AFL_MAP_SIZE", vbuf, 1);
+    ck_free(vbuf);
+  }
+
   fsrv->trace_bits = afl_shm_init(&shm, map_size, 0);
 
   if (!quiet_mode) {
@@ -1375,7 +2562,7 @@ int main(int argc, char **argv_orig, char **envp) {
     if (in_filelist) {
       if (!be_quiet) ACTF("Reading from file list '%s'...", in_filelist);
 
-    } else {
+    } else if (!in_pack) {
       // if a queue subdirectory exists switch to that
       dn = alloc_printf("%s/queue", in_dir);
 
@@ -1390,7 +2577,10 @@ int main(int argc, char **argv_orig, char **envp) {
       if (!be_quiet) ACTF("Reading from directory '%s'...", in_dir);
     }
 
-    if (!collect_coverage) {
+    if (jobs) {
+      /* the packed output, made by start_workers() */
+
+    } else if (!collect_coverage) {
       if (!(dir_out = opendir(out_file))) {
         if (mkdir(out_file, 0700)) {
           PFATAL("cannot create output directory %s", out_file);
@@ -1421,7 +2611,17 @@ int main(int argc, char **argv_orig, char **envp) {
     if (fsrv->support_shmem_fuzz && !fsrv->use_shmem_fuzz)
       shm_fuzz = deinit_shmem(fsrv, shm_fuzz);
 
-    if (in_dir) {
+    if (hot_file) {
+      hot_hits = ck_alloc(map_size * sizeof(u64));
+      hot_inputs = ck_alloc(map_size * sizeof(u32));
+    }
+
+    if (in_pack) {
+      if (execute_testcases_pack() == 0) {
+        FATAL("could not read input testcases from %s", in_dir);
+      }
+
+    } else if (in_dir) {
       if (execute_testcases(in_dir) == 0) {
         FATAL("could not read input testcases from %s", in_dir);
       }
@@ -1434,6 +2634,12 @@ int main(int argc, char **argv_orig, char **envp) {
 
     if (!quiet_mode) { OKF("Processed %llu input files.", fsrv->total_execs); }
 
+    if (hot_file) {
+      hot_write();
+      ck_free(hot_hits);
+      ck_free(hot_inputs);
+    }
+
     if (dir_out) { closedir(dir_out); }
 
     if (collect_coverage) {
@@ -1498,6 +2704,11 @@ int main(int argc, char **argv_orig, char **envp) {
 
   afl_fsrv_deinit(fsrv);
 
+  if (jobs) {
+    worker_stats[worker_id * 3 + 1] = 1;
+    exit(0);
+  }
+
   if (stdin_file) { ck_free(stdin_file); }
   if (collect_coverage) { free(coverage_map); }
 
@@ -0,0 +1,841 @@
+/*
+   american fuzzy lop++ - status check tool
+   ----------------------------------------
+
+   Originally written by Michal Zalewski
+
+   Now maintained by Marc Heuse <mh@mh-sec.de>,
+                     Heiko Eißfeldt <heiko.eissfeldt@hexco.de>,
+                     Andrea Fioraldi <andreafioraldi@gmail.com>,
+                     Dominik Maier <mail@dmnk.co>
+
+   Copyright 2015 Google Inc. All rights reserved.
+   Copyright 2019-2024 AFLplusplus Project. All rights reserved.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at:
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+   Sums up the instances of a sync directory like afl-whatsup, in one
+   process: the numbers are taken from the binary stats page of an instance
+   (AFL_STATS_PAGE) if it has one and from its fuzzer_stats otherwise. With
+   -w the summary is redone every few seconds, keeping the stats pages open.
+   -p writes the plot_data.bin of the instances as plot_data for afl-plot.
+   -c removes the shared memory segments that instances which are not
+   running any more left behind.
+
+ */
+
+#define AFL_MAIN
+
+#include "config.h"
+#include "types.h"
+#include "debug.h"
+#include "alloc-inl.h"
+#include "common.h"
+#include "afl-fuzz.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* An instance of the sync directory. The stats page stays open across the
+   rounds of -w; it is read with pread() rather than mapped, so a page that
+   a restarting instance recreates only reads short for a moment. */
+
+struct instance {
+  u8 *name;                             /* its directory in the sync dir */
+  s32 page_fd;                          /* fuzzer_stats.page, or -1      */
+  u8  seen;                             /* still there in this round?    */
+};
+
+enum {
+
+  /* 00 */ INST_ALIVE,
+  /* 01 */ INST_STARTING,
+  /* 02 */ INST_DEAD
+
+};
+
+static struct instance *inst;
+static u32              inst_cnt;
+
+static u8 *sync_dir;
+static u8  process_dead, minimal_only, no_color, summary_only, plot_mode,
+    clean_mode;
+static u32 watch_secs;
+
+static volatile u8 stop_soon;
+
+#define COL(c) (no_color ? "" : (c))
+
+/* The lines of fuzzer_stats that fill the stats page, for the instances
+   without one. Times are in seconds there and in milliseconds in the page,
+   percentages carry a '%'. */
+
+enum {
+
+  /* 00 */ STAT_U32,
+  /* 01 */ STAT_U64,
+  /* 02 */ STAT_MS,
+  /* 03 */ STAT_DOUBLE
+
+};
+
+#define STAT_FIELD(name, type) \
+  { #name, offsetof(struct stats_page, name), type }
+
+static const struct {
+  const char *key;
+  u32         off, type;
+} stat_fields[] = {
+
+    STAT_FIELD(start_time, STAT_MS),
+    STAT_FIELD(last_update, STAT_MS),
+    STAT_FIELD(run_time, STAT_MS),
+    STAT_FIELD(fuzzer_pid, STAT_U32),
+    STAT_FIELD(cycles_done, STAT_U64),
+    STAT_FIELD(cycles_wo_finds, STAT_U64),
+    STAT_FIELD(execs_done, STAT_U64),
+    STAT_FIELD(execs_per_sec, STAT_DOUBLE),
+    STAT_FIELD(corpus_count, STAT_U32),
+    STAT_FIELD(corpus_favored, STAT_U32),
+    STAT_FIELD(corpus_found, STAT_U32),
+    STAT_FIELD(corpus_imported, STAT_U32),
+    STAT_FIELD(corpus_variable, STAT_U32),
+    STAT_FIELD(max_depth, STAT_U32),
+    STAT_FIELD(cur_item, STAT_U32),
+    STAT_FIELD(pending_favs, STAT_U32),
+    STAT_FIELD(pending_total, STAT_U32),
+    STAT_FIELD(stability, STAT_DOUBLE),
+    STAT_FIELD(bitmap_cvg, STAT_DOUBLE),
+    STAT_FIELD(saved_crashes, STAT_U64),
+    STAT_FIELD(saved_hangs, STAT_U64),
+    STAT_FIELD(last_find, STAT_MS),
+    STAT_FIELD(last_crash, STAT_MS),
+    STAT_FIELD(last_hang, STAT_MS),
+    STAT_FIELD(exec_timeout, STAT_U32),
+    STAT_FIELD(slowest_exec_ms, STAT_U32),
+    STAT_FIELD(edges_found, STAT_U32),
+    STAT_FIELD(total_edges, STAT_U32),
+    STAT_FIELD(var_byte_count, STAT_U32),
+
+};
+
+static void handle_stop_sig(int sig) {
+  (void)sig;
+  stop_soon = 1;
+}
+
+static int cmp_instance(const void *a, const void *b) {
+  return strcmp((char *)((struct instance *)a)->name,
+                (char *)((struct instance *)b)->name);
+}
+
+/* Open the stats page of the instance in dir, -1 if it has none. */
+
+static s32 page_open(u8 *dir) {
+  u8 fn[PATH_MAX];
+
+  snprintf(fn, sizeof(fn), "%s/%s/fuzzer_stats.page", sync_dir, dir);
+  return open(fn, O_RDONLY);
+}
+
+/* Copy the stats page of fd to p, a seqlock read: the copy counts if seq
+   was even and the same before and after. Returns 0 if the page is not
+   (or not yet) one of this version. */
+
+static u8 page_read(s32 fd, struct stats_page *p) {
+  u32 tries, seq;
+
+  for (tries = 0; tries < 100; ++tries) {
+    if (pread(fd, p, sizeof(*p), 0) != (ssize_t)sizeof(*p)) { return 0; }
+
+    if (p->magic != STATS_PAGE_MAGIC || p->version != STATS_PAGE_VERSION) {
+      return 0;
+    }
+
+    if (p->seq & 1) {
+      usleep(100);
+      continue;
+    }
+
+    if (pread(fd, &seq, sizeof(seq), offsetof(struct stats_page, seq)) ==
+            (ssize_t)sizeof(seq) &&
+        seq == p->seq) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* Fill p from the fuzzer_stats of the instance in dir. Returns 0 if there
+   is no such file. */
+
+static u8 stats_read(u8 *dir, struct stats_page *p) {
+  u8     fn[PATH_MAX], buf[8192], *line, *next, *val;
+  s32    fd;
+  ssize_t len;
+  u32    i;
+
+  snprintf(fn, sizeof(fn), "%s/%s/fuzzer_stats", sync_dir, dir);
+  fd = open(fn, O_RDONLY);
+  if (fd < 0) { return 0; }
+
+  len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (len <= 0) { return 0; }
+  buf[len] = 0;
+
+  memset(p, 0, sizeof(*p));
+
+  for (line = buf; line && *line; line = next) {
+    next = strchr(line, '\n');
+    if (next) { *next++ = 0; }
+
+    val = strchr(line, ':');
+    if (!val) { continue; }
+
+    for (i = 0; i < sizeof(stat_fields) / sizeof(stat_fields[0]); ++i) {
+      u32   klen = strlen(stat_fields[i].key);
+      void *dst = (u8 *)p + stat_fields[i].off;
+
+      if (strncmp(line, stat_fields[i].key, klen) || line[klen] != ' ') {
+        continue;
+      }
+
+      switch (stat_fields[i].type) {
+        case STAT_U32:
+          *(u32 *)dst = strtoul(val + 1, NULL, 10);
+          break;
+        case STAT_U64:
+          *(u64 *)dst = strtoull(val + 1, NULL, 10);
+          break;
+        case STAT_MS:
+          *(u64 *)dst = strtoull(val + 1, NULL, 10) * 1000;
+          break;
+        case STAT_DOUBLE:
+          *(double *)dst = strtod(val + 1, NULL);
+          break;
+      }
+
+      break;
+    }
+  }
+
+  return 1;
+}
+
+/* Whether dir of the sync directory is an afl-fuzz output directory. */
+
+static u8 is_instance(u8 *dir) {
+  u8          fn[PATH_MAX];
+  struct stat st;
+
+  snprintf(fn, sizeof(fn), "%s/%s/fuzzer_setup", sync_dir, dir);
+  return !stat(fn, &st);
+}
+
+/* Bring inst up to date with the directories of the sync directory. The
+   list is kept sorted by name; instances that are gone are dropped. */
+
+static void scan_instances(void) {
+  DIR            *d = opendir(sync_dir);
+  struct dirent  *de;
+  struct instance key, *in;
+  u32             i, j, old_cnt = inst_cnt;
+
+  if (!d) { PFATAL("Unable to open '%s'", sync_dir); }
+
+  for (i = 0; i < inst_cnt; ++i) {
+    inst[i].seen = 0;
+  }
+
+  while ((de = readdir(d))) {
+    if (de->d_name[0] == '.' || !is_instance(de->d_name)) { continue; }
+
+    key.name = de->d_name;
+    in = bsearch(&key, inst, old_cnt, sizeof(*inst), cmp_instance);
+
+    if (!in) {
+      inst = ck_realloc(inst, (inst_cnt + 1) * sizeof(*inst));
+      in = &inst[inst_cnt++];
+      in->name = ck_strdup(de->d_name);
+      in->page_fd = -1;
+    }
+
+    /* the page appears once the instance is up */
+
+    if (in->page_fd < 0) { in->page_fd = page_open(in->name); }
+    in->seen = 1;
+  }
+
+  closedir(d);
+
+  for (i = j = 0; i < inst_cnt; ++i) {
+    if (inst[i].seen) {
+      inst[j++] = inst[i];
+      continue;
+    }
+
+    if (inst[i].page_fd >= 0) { close(inst[i].page_fd); }
+    ck_free(inst[i].name);
+  }
+
+  inst_cnt = j;
+  qsort(inst, inst_cnt, sizeof(*inst), cmp_instance);
+}
+
+/* The state of an instance: without stats it is starting, and it is dead
+   (or running on another machine) if its process is gone. */
+
+static u8 instance_state(struct stats_page *p, u8 have) {
+  if (!have || !p->fuzzer_pid) { return INST_STARTING; }
+
+  if (kill(p->fuzzer_pid, 0) && errno == ESRCH) { return INST_DEAD; }
+
+  return INST_ALIVE;
+}
+
+static void show_instance(struct instance *in, struct stats_page *p,
+                          u8 state, u64 cur_ms) {
+  u8 tbuf[64];
+  u32 pct = p->corpus_count ? p->cur_item * 100 / p->corpus_count : 0;
+
+  SAYF(">>> %s (%llu days, %llu hrs) fuzzer PID: %u <<<\n\n", in->name,
+       p->run_time / 1000 / 86400, (p->run_time / 1000 / 3600) % 24,
+       p->fuzzer_pid);
+
+  if (state == INST_STARTING) {
+    SAYF("  Instance is still starting up, skipping.\n\n");
+    return;
+  }
+
+  if (state == INST_DEAD) {
+    SAYF("  Instance is dead or running remotely, skipping.\n\n");
+    if (!process_dead) { return; }
+  }
+
+  if (p->execs_per_sec < 1) {
+    SAYF("  %sno data yet, 0 execs/sec%s\n", COL(cYEL), COL(cRST));
+
+  } else if (p->execs_per_sec < 100) {
+    SAYF("  %sslow execution, %.0f execs/sec%s\n", COL(cLRD),
+         p->execs_per_sec, COL(cRST));
+  }
+
+  SAYF("  last_find       : %s\n",
+       stringify_time_diff(tbuf, sizeof(tbuf), cur_ms, p->last_find));
+  SAYF("  last_crash      : %s\n",
+       stringify_time_diff(tbuf, sizeof(tbuf), cur_ms, p->last_crash));
+
+  if (!minimal_only) {
+    SAYF("  last_hang       : %s\n",
+         stringify_time_diff(tbuf, sizeof(tbuf), cur_ms, p->last_hang));
+    SAYF("  cycles_wo_finds : %s%llu%s\n",
+         COL(p->cycles_wo_finds > 50   ? cLRD
+             : p->cycles_wo_finds > 10 ? cYEL
+                                       : ""),
+         p->cycles_wo_finds, COL(cRST));
+  }
+
+  SAYF("  coverage        : %0.02f%%\n", p->bitmap_cvg);
+  SAYF("  cycles %llu, speed %.0f execs/sec, items %u/%u (%u%%)\n",
+       p->cycles_done + 1, p->execs_per_sec, p->cur_item, p->corpus_count,
+       pct);
+
+  if (p->saved_crashes) {
+    SAYF("  pending %u/%u, stability %0.02f%%, %scrashes saved %llu (!)%s\n",
+         p->pending_favs, p->pending_total, p->stability, COL(cLRD),
+         p->saved_crashes, COL(cRST));
+
+  } else {
+    SAYF("  pending %u/%u, stability %0.02f%%, no crashes yet\n",
+         p->pending_favs, p->pending_total, p->stability);
+  }
+
+  SAYF("\n");
+}
+
+/* One round: read every instance and print the details and the summary. */
+
+static void show_status(void) {
+  struct stats_page p;
+  u64               start_us = get_cur_time_us(), cur_ms = get_cur_time();
+  u64               execs = 0, crashes = 0, hangs = 0, run_time = 0;
+  u64               last_find = 0, pfav = 0, pending = 0;
+  double            eps = 0, cvg = 0;
+  u32               cnt = 0, starting = 0, dead = 0, pages = 0, i;
+  u8                wcop[256] = "", tbuf[64], ibuf[STRINGIFY_VAL_SIZE_MAX];
+  u32               wcop_len = 0;
+
+  scan_instances();
+
+  if (watch_secs && isatty(1)) { SAYF(TERM_CLEAR); }
+
+  if (!summary_only) { SAYF("Individual fuzzers\n==================\n\n"); }
+
+  for (i = 0; i < inst_cnt; ++i) {
+    struct instance *in = &inst[i];
+    u8               have = 0, state;
+
+    if (in->page_fd >= 0 && page_read(in->page_fd, &p)) {
+      have = 1;
+      ++pages;
+    }
+
+    if (!have) { have = stats_read(in->name, &p); }
+    if (!have) { memset(&p, 0, sizeof(p)); }
+
+    state = instance_state(&p, have);
+    if (!summary_only) { show_instance(in, &p, state, cur_ms); }
+
+    if (state == INST_STARTING) {
+      ++starting;
+      continue;
+    }
+
+    if (state == INST_DEAD) {
+      ++dead;
+      if (!process_dead) { continue; }
+    }
+
+    ++cnt;
+
+    run_time += p.run_time;
+    execs += p.execs_done;
+    eps += p.execs_per_sec;
+    crashes += p.saved_crashes;
+    hangs += p.saved_hangs;
+    pfav += p.pending_favs;
+    pending += p.pending_total;
+    if (p.bitmap_cvg > cvg) { cvg = p.bitmap_cvg; }
+    if (p.last_find > last_find) { last_find = p.last_find; }
+
+    if (wcop_len < sizeof(wcop) - 24) {
+      wcop_len += snprintf(wcop + wcop_len, sizeof(wcop) - wcop_len, "%s%llu",
+                           wcop_len ? "/" : "", p.cycles_wo_finds);
+    }
+  }
+
+  SAYF("Summary stats\n=============\n\n");
+  SAYF("       Fuzzers alive : %u\n", process_dead ? cnt - dead : cnt);
+
+  if (starting) { SAYF("         Starting up : %u\n", starting); }
+
+  if (dead) {
+    SAYF("      Dead or remote : %u (%s stats)\n", dead,
+         process_dead ? "included in" : "excluded from");
+  }
+
+  SAYF("      Total run time : %s\n",
+       stringify_time_diff(tbuf, sizeof(tbuf), cur_ms, cur_ms - run_time));
+
+  if (!minimal_only) {
+    SAYF("         Total execs : %s\n",
+         stringify_int(ibuf, sizeof(ibuf), execs));
+    SAYF("    Cumulative speed : %.0f execs/sec\n", eps);
+  }
+
+  if (cnt) { SAYF("       Average speed : %.0f execs/sec\n", eps / cnt); }
+
+  if (!minimal_only) {
+    SAYF("       Pending items : %llu faves, %llu total\n", pfav, pending);
+  }
+
+  if (cnt > 1 || (cnt && minimal_only)) {
+    SAYF("  Pending per fuzzer : %llu faves, %llu total (on average)\n",
+         pfav / cnt, pending / cnt);
+  }
+
+  SAYF("    Coverage reached : %0.02f%%\n", cvg);
+  SAYF("       Crashes saved : %llu\n", crashes);
+
+  if (!minimal_only) {
+    SAYF("         Hangs saved : %llu\n", hangs);
+    SAYF("Cycles without finds : %s\n",
+         wcop_len ? wcop : (u8 *)"not available");
+  }
+
+  SAYF("  Time without finds : %s\n",
+       stringify_time_diff(tbuf, sizeof(tbuf), cur_ms, last_find));
+
+  if (!minimal_only) {
+    SAYF("             Read in : %.1f ms (%u of %u from stats pages)\n",
+         (get_cur_time_us() - start_us) / 1000.0, pages, inst_cnt);
+  }
+
+  SAYF("\n");
+}
+
+/* Read the plot_data.bin in dir, with the seqlock of the writer. Returns
+   NULL if there is none of this version. */
+
+static struct plot_bin_hdr *plot_bin_read(u8 *dir) {
+  struct plot_bin_hdr  h, *b = NULL;
+  u8                   fn[PATH_MAX];
+  u32                  tries, seq;
+  s32                  fd;
+
+  snprintf(fn, sizeof(fn), "%s/plot_data.bin", dir);
+  fd = open(fn, O_RDONLY);
+  if (fd < 0) { return NULL; }
+
+  for (tries = 0; tries < 100; ++tries) {
+    if (pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) ||
+        h.magic != PLOT_BIN_MAGIC || h.version != PLOT_BIN_VERSION ||
+        !h.slots || !h.width || h.used > h.slots) {
+      break;
+    }
+
+    if (h.seq & 1) {
+      usleep(100);
+      continue;
+    }
+
+    b = ck_realloc(b, PLOT_BIN_SIZE(h.slots));
+
+    if (pread(fd, b, PLOT_BIN_SIZE(h.slots), 0) !=
+            (ssize_t)PLOT_BIN_SIZE(h.slots) ||
+        pread(fd, &seq, sizeof(seq), offsetof(struct plot_bin_hdr, seq)) !=
+            (ssize_t)sizeof(seq)) {
+      break;
+    }
+
+    if (seq == h.seq && b->seq == h.seq && b->slots == h.slots) {
+      close(fd);
+      return b;
+    }
+  }
+
+  close(fd);
+  ck_free(b);
+  return NULL;
+}
+
+/* Whether a field adds up over the instances; the others take the
+   biggest value. */
+
+static u8 plot_sums(u32 f) {
+  return f == PLOT_CORPUS || f == PLOT_PENDING || f == PLOT_FAVS ||
+         f == PLOT_CRASHES || f == PLOT_HANGS || f == PLOT_EPS ||
+         f == PLOT_EXECS;
+}
+
+/* Write the cnt plot_data.bin files in bins as plot_data text to stdout,
+   in buckets of the widest of them, aligned on wall clock time. In a bucket
+   without updates an instance counts with its last values, and with no
+   speed once it has stopped. Two columns more than in plot_data have the
+   lowest and highest execs/sec in the bucket. */
+
+static void plot_merge(struct plot_bin_hdr **bins, u32 cnt) {
+  u64     base = ~0ULL, end = 0, n, g;
+  u32     width = 0, i, j, f;
+  double *tot, cur[PLOT_FIELDS + 2];
+  u8     *active;
+
+  for (i = 0; i < cnt; ++i) {
+    struct plot_bin_slot *s = (struct plot_bin_slot *)(bins[i] + 1);
+    u64                   start = bins[i]->start_time / 1000;
+
+    for (j = bins[i]->used; j && !s[j - 1].samples; --j) {}
+    if (!j) { continue; }
+
+    base = MIN(base, start);
+    end = MAX(end, start + s[j - 1].time);
+    width = MAX(width, bins[i]->width);
+  }
+
+  if (!width) { FATAL("No plot data found, let the instances run longer."); }
+
+  n = (end - base) / width + 1;
+  tot = ck_alloc(n * (PLOT_FIELDS + 2) * sizeof(double));
+  active = ck_alloc(n);
+
+  for (i = 0; i < cnt; ++i) {
+    struct plot_bin_slot *s = (struct plot_bin_slot *)(bins[i] + 1);
+    u64                   start = bins[i]->start_time / 1000;
+    u8                    started = 0;
+
+    for (g = j = 0; g < n; ++g) {
+      u64    until = base + (g + 1) * width;
+      u32    samples = 0;
+      double eps_sum = 0;
+
+      for (; j < bins[i]->used && start + s[j].time < until; ++j) {
+        if (!s[j].samples) { continue; }
+
+        for (f = 0; f < PLOT_FIELDS; ++f) {
+          if (!samples || s[j].max[f] > cur[f]) { cur[f] = s[j].max[f]; }
+        }
+
+        if (!samples || s[j].min[PLOT_EPS] < cur[PLOT_FIELDS]) {
+          cur[PLOT_FIELDS] = s[j].min[PLOT_EPS];
+        }
+
+        if (!samples || s[j].max[PLOT_EPS] > cur[PLOT_FIELDS + 1]) {
+          cur[PLOT_FIELDS + 1] = s[j].max[PLOT_EPS];
+        }
+
+        samples += s[j].samples;
+        eps_sum += s[j].eps_sum;
+      }
+
+      if (samples) {
+        cur[PLOT_EPS] = eps_sum / samples;
+        started = 1;
+
+      } else if (started && j >= bins[i]->used) {
+        cur[PLOT_EPS] = cur[PLOT_FIELDS] = cur[PLOT_FIELDS + 1] = 0;
+      }
+
+      if (!started) { continue; }
+
+      active[g] = 1;
+
+      for (f = 0; f < PLOT_FIELDS + 2; ++f) {
+        double *t = &tot[g * (PLOT_FIELDS + 2) + f];
+
+        if (f >= PLOT_FIELDS || plot_sums(f)) {
+          *t += cur[f];
+
+        } else if (cur[f] > *t) {
+          *t = cur[f];
+        }
+      }
+    }
+  }
+
+  printf(
+      "# relative_time, cycles_done, cur_item, corpus_count, "
+      "pending_total, pending_favs, map_size, saved_crashes, "
+      "saved_hangs, max_depth, execs_per_sec, total_execs, edges_found, "
+      "execs_per_sec_min, execs_per_sec_max\n");
+
+  for (g = 0; g < n; ++g) {
+    double *t = &tot[g * (PLOT_FIELDS + 2)];
+
+    if (!active[g]) { continue; }
+
+    printf(
+        "%llu, %llu, %u, %u, %u, %u, %0.02f%%, %llu, %llu, %u, %0.02f, "
+        "%llu, %u, %0.02f, %0.02f\n",
+        g * width, (u64)t[PLOT_CYCLES], (u32)t[PLOT_CUR_ITEM],
+        (u32)t[PLOT_CORPUS], (u32)t[PLOT_PENDING], (u32)t[PLOT_FAVS],
+        t[PLOT_CVG], (u64)t[PLOT_CRASHES], (u64)t[PLOT_HANGS],
+        (u32)t[PLOT_DEPTH], t[PLOT_EPS], (u64)t[PLOT_EXECS],
+        (u32)t[PLOT_EDGES], t[PLOT_FIELDS], t[PLOT_FIELDS + 1]);
+  }
+
+  ck_free(tot);
+  ck_free(active);
+}
+
+/* -p: the plot data of the instance in sync_dir, or of all instances of
+   the sync directory, merged. */
+
+static void show_plot(void) {
+  struct plot_bin_hdr **bins = NULL;
+  u8                    fn[PATH_MAX];
+  u32                   cnt = 0, i;
+
+  bins = ck_alloc(sizeof(*bins));
+  bins[0] = plot_bin_read(sync_dir);
+
+  if (bins[0]) {
+    cnt = 1;
+
+  } else {
+    scan_instances();
+    bins = ck_realloc(bins, (inst_cnt + 1) * sizeof(*bins));
+
+    for (i = 0; i < inst_cnt; ++i) {
+      snprintf(fn, sizeof(fn), "%s/%s", sync_dir, inst[i].name);
+      if ((bins[cnt] = plot_bin_read(fn))) { ++cnt; }
+    }
+  }
+
+  if (!cnt) { FATAL("No plot_data.bin found in '%s'", sync_dir); }
+
+  plot_merge(bins, cnt);
+
+  for (i = 0; i < cnt; ++i) {
+    ck_free(bins[i]);
+  }
+
+  ck_free(bins);
+}
+
+/* Remove the segments recorded in the output directory dir if no afl-fuzz
+   holds its lock. Returns the number of segments. */
+
+static u32 clean_instance(u8 *dir, u64 *bytes) {
+  u8  fn[PATH_MAX];
+  s32 fd = open(dir, O_RDONLY);
+  u32 cnt;
+
+  if (fd < 0) { return 0; }
+
+  if (flock(fd, LOCK_EX | LOCK_NB)) {
+    close(fd);
+    return 0;
+  }
+
+  snprintf(fn, sizeof(fn), "%s/%s", dir, SHM_KEEP_DIR);
+  cnt = afl_shm_reclaim(fn, bytes);
+
+  close(fd);
+  return cnt;
+}
+
+/* -c: clean up after the instances in sync_dir that are gone, or after the
+   one whose output directory sync_dir is. */
+
+static void clean_shm(void) {
+  u8  fn[PATH_MAX], size[STRINGIFY_VAL_SIZE_MAX];
+  u32 cnt = 0, i;
+  u64 bytes = 0;
+
+  snprintf(fn, sizeof(fn), "%s/%s", sync_dir, SHM_KEEP_DIR);
+
+  if (!access(fn, F_OK)) {
+    cnt = clean_instance(sync_dir, &bytes);
+
+  } else {
+    scan_instances();
+
+    for (i = 0; i < inst_cnt; ++i) {
+      snprintf(fn, sizeof(fn), "%s/%s", sync_dir, inst[i].name);
+      cnt += clean_instance(fn, &bytes);
+    }
+  }
+
+  OKF("Removed %u shared memory segment(s), %s.", cnt,
+      stringify_mem_size(size, sizeof(size), bytes));
+}
+
+/* Display usage hints. */
+
+static void usage(u8 *argv0) {
+  SAYF(
+      "\n%s [ options ] sync_dir\n\n"
+
+      "Options:\n"
+      "  -d            - include dead fuzzer stats\n"
+      "  -m            - just show minimal stats\n"
+      "  -n            - no color output\n"
+      "  -s            - skip details and output summary results only\n"
+      "  -w secs       - show the status again every secs seconds\n"
+      "  -p            - write the plot data of the instances, merged, in\n"
+      "                  the plot_data format for afl-plot (also takes the\n"
+      "                  output directory of one instance)\n"
+      "  -c            - remove the shared memory segments of instances that\n"
+      "                  are not running any more (also takes the output\n"
+      "                  directory of one instance)\n\n"
+
+      "The numbers of an instance are read from its fuzzer_stats.page if it\n"
+      "runs with AFL_STATS_PAGE, from its fuzzer_stats otherwise.\n\n"
+
+      "For additional help, consult %s/README.md.\n\n",
+
+      argv0, doc_path);
+
+  exit(1);
+}
+
+/* Main entry point */
+
+int main(int argc, char **argv) {
+  s32         opt;
+  struct stat st;
+  u8          fn[PATH_MAX];
+
+  doc_path = access(DOC_PATH, F_OK) ? (u8 *)"docs" : (u8 *)DOC_PATH;
+
+  while ((opt = getopt(argc, argv, "+cdmnpsw:h")) > 0) {
+    switch (opt) {
+      case 'c':
+        clean_mode = 1;
+        break;
+
+      case 'd':
+        process_dead = 1;
+        break;
+
+      case 'm':
+        minimal_only = 1;
+        break;
+
+      case 'n':
+        no_color = 1;
+        break;
+
+      case 'p':
+        plot_mode = 1;
+        break;
+
+      case 's':
+        summary_only = 1;
+        break;
+
+      case 'w':
+        watch_secs = atoi(optarg);
+        if (!watch_secs) { FATAL("Bad value of -w"); }
+        break;
+
+      case 'h':
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  if (optind != argc - 1) { usage(argv[0]); }
+
+  if (!isatty(1)) { no_color = 1; }
+
+  sync_dir = argv[optind];
+
+  if (stat(sync_dir, &st) || !S_ISDIR(st.st_mode)) {
+    FATAL("'%s' is not a directory", sync_dir);
+  }
+
+  if (plot_mode) {
+    show_plot();
+    return 0;
+  }
+
+  if (clean_mode) {
+    clean_shm();
+    return 0;
+  }
+
+  snprintf(fn, sizeof(fn), "%s/queue", sync_dir);
+
+  if (!access(fn, F_OK)) {
+    FATAL("'%s' is the output directory of one instance, not a sync dir",
+          sync_dir);
+  }
+
+  signal(SIGINT, handle_stop_sig);
+  signal(SIGTERM, handle_stop_sig);
+
+  do {
+    show_status();
+    if (watch_secs) { sleep(watch_secs); }
+  } while (watch_secs && !stop_soon);
+
+  return 0;
+}
@@ -39,6 +39,7 @@
 #include "common.h"
 
 #include <stdio.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
@@ -50,6 +51,7 @@
 #include <limits.h>
 
 #include <sys/wait.h>
+#include <sys/mman.h>
 #include <sys/time.h>
 #ifndef USEMMAP
   #include <sys/shm.h>
@@ -71,10 +73,15 @@ static u32 in_len,  /* Input data length                 */
     missed_paths,   /* Misses due to exec path diffs     */
     map_size = MAP_SIZE;
 
-static u64 orig_cksum; /* Original checksum                 */
+static u64 orig_cksum, /* Original checksum                 */
+    orig_sig;          /* Original crash signature          */
+
+static u32 sig_frames; /* Frames in the signature, 0 = off  */
+static u8 *sig_prefix; /* Where targets write their reports */
 
 static u8 crash_mode, /* Crash-centric mode?               */
     hang_mode,        /* Minimize as long as it hangs      */
+    ddmin_mode,       /* Reduce to chunks first (-d)?      */
     exit_crash,       /* Treat non-zero exit as crash?     */
     edges_only,       /* Ignore hit counts?                */
     exact_mode,       /* Require path match for crashes?   */
@@ -88,6 +95,20 @@ static afl_forkserver_t *fsrv;
 static sharedmem_t       shm;
 static sharedmem_t      *shm_fuzz;
 
+/* The candidates of minimize(), one at a time or, with -j, as many as there
+   are workers. A worker has a forkserver of its own and runs the candidate
+   in its slot of the shared buffer when it gets the length through its
+   pipe. The main process only makes candidates. */
+
+static u32  jobs, batch = 1, worker_id, slot_len;
+static u8  *cand_bufs;          /* one slot of slot_len per candidate */
+static u32 *cand_len, *cand_pos;
+static s32 *job_cmd, *job_res;  /* main process ends of the pipes     */
+static u64 *job_stats;          /* shared: execs and misses by worker */
+static u8   is_worker;
+
+#define CAND(n) (cand_bufs + (u64)(n)*slot_len)
+
 /*
  * forkserver section
  */
@@ -152,7 +173,8 @@ static void classify_counts(afl_forkserver_t *fsrv) {
 
   } else {
     while (i--) {
-      *mem = count_class_lookup[*mem];
+      *mem = count_class_lookup[fsrv->bucketed_counts ? bucket_count(*mem)
+                                                      : *mem];
       mem++;
     }
   }
@@ -223,6 +245,21 @@ static s32 write_to_file(u8 *path, u8 *mem, u32 len) {
   return ret;
 }
 
+/* The signature of the crash of the last run (AFL_TMIN_SIGNATURE), from
+   the first report the target wrote to sig_prefix.<pid>. Sanitizers write
+   their reports there through log_path, afl-compiler-rt writes the faulting
+   PC in the same format when no sanitizer handles the signal. */
+
+static u64 crash_signature(afl_forkserver_t *fsrv) {
+  u8  sig[1024];
+  u8 *report = crash_report_read(sig_prefix, fsrv->last_child_pid);
+  u32 len = crash_report_signature(report, fsrv->last_kill_signal, sig_frames,
+                                   sig, sizeof(sig));
+
+  ck_free(report);
+  return hash64(sig, len, HASH_CONST);
+}
+
 /* Execute target application. Returns 0 if the changes are a dud, or
    1 if they should be kept. */
 
@@ -236,6 +273,7 @@ static u8 tmin_run_target(afl_forkserver_t *fsrv, u8 *mem, u32 len,
   if (ret == FSRV_RUN_ERROR) { FATAL("Couldn't run child"); }
 
   if (stop_soon) {
+    if (is_worker) { exit(1); }
     SAYF(cRST cLRD "\n+++ Minimization aborted by user +++\n" cRST);
     close(write_to_file(output_file, in_data, in_len));
     exit(1);
@@ -270,6 +308,17 @@ static u8 tmin_run_target(afl_forkserver_t *fsrv, u8 *mem, u32 len,
     if (first_run) { crash_mode = 1; }
 
     if (crash_mode) {
+      if (sig_frames) {
+        u64 sig = crash_signature(fsrv);
+
+        if (first_run) { orig_sig = sig; }
+
+        if (sig != orig_sig) {
+          missed_crashes++;
+          return 0;
+        }
+      }
+
       if (!exact_mode) { return 1; }
 
     } else {
@@ -298,17 +347,121 @@ static u8 tmin_run_target(afl_forkserver_t *fsrv, u8 *mem, u32 len,
   return 0;
 }
 
+/* Run the first n candidates and return the first one that is to be kept,
+   n if none is. All of them run, so what comes after is discarded when an
+   earlier one is kept: the caller goes on from there as the serial loop
+   would. */
+
+static u32 run_candidates(afl_forkserver_t *fsrv, u32 n) {
+  u32 i, first = n;
+  u8  res;
+
+  if (!jobs) { return tmin_run_target(fsrv, CAND(0), cand_len[0], 0) ? 0 : 1; }
+
+  for (i = 0; i < n; ++i) {
+    ck_write(job_cmd[i], &cand_len[i], sizeof(u32), "worker pipe");
+  }
+
+  for (i = 0; i < n; ++i) {
+    if (read(job_res[i], &res, 1) != 1) {
+      if (stop_soon) {
+        SAYF(cRST cLRD "\n+++ Minimization aborted by user +++\n" cRST);
+        close(write_to_file(output_file, in_data, in_len));
+        exit(1);
+      }
+
+      FATAL("Worker %u failed", i);
+    }
+
+    if (res && first == n) { first = i; }
+  }
+
+  return first;
+}
+
+/* Keep only one chunk (subset) or remove one chunk (!subset), the first
+   that works is kept. Returns whether one was. */
+
+static u8 ddmin_chunks(afl_forkserver_t *fsrv, u32 chunk, u8 subset) {
+  u32 pos = 0, n, first, use_len;
+
+  while (pos < in_len) {
+    for (n = 0; n < batch && pos < in_len; ++n, pos += chunk) {
+      use_len = MIN(chunk, in_len - pos);
+
+      if (subset) {
+        memcpy(CAND(n), in_data + pos, use_len);
+        cand_len[n] = use_len;
+
+      } else {
+        memcpy(CAND(n), in_data, pos);
+        memcpy(CAND(n) + pos, in_data + pos + use_len, in_len - pos - use_len);
+        cand_len[n] = in_len - use_len;
+      }
+    }
+
+    first = run_candidates(fsrv, n);
+
+    if (first < n) {
+      memcpy(in_data, CAND(first), cand_len[first]);
+      in_len = cand_len[first];
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
 /* Actually minimize! */
 
 static void minimize(afl_forkserver_t *fsrv) {
   static u32 alpha_map[256];
 
-  u8 *tmp_buf = ck_alloc_nozero(in_len);
   u32 orig_len = in_len, stage_o_len;
 
   u32 del_len, set_len, del_pos, set_pos, i, alpha_size, cur_pass = 0;
   u32 syms_removed, alpha_del0 = 0, alpha_del1, alpha_del2, alpha_d_total = 0;
-  u8  changed_any, prev_del;
+  u32 n, first, pos, chunks;
+  u8  changed_any, prev_del, pd;
+
+  if (!jobs) {
+    slot_len = in_len;
+    cand_bufs = ck_alloc_nozero(in_len);
+    cand_len = ck_alloc(sizeof(u32));
+    cand_pos = ck_alloc(sizeof(u32));
+  }
+
+  /*************************
+   * CHUNK REDUCTION (-d)  *
+   *************************/
+
+  /* Delta debugging down to the granularity block deletion starts at: try
+     to keep only one of n chunks, then to remove one, and only split
+     further when neither worked. On large inputs, this takes most of the
+     data away in a few execs before the other stages go over all of it. */
+
+  if (ddmin_mode) {
+    stage_o_len = in_len;
+    chunks = 2;
+
+    ACTF(cBRI "Stage #D: " cRST "Reducing to subsets of chunks...");
+
+    while (chunks <= TRIM_START_STEPS && chunks <= in_len) {
+      u32 chunk = (in_len + chunks - 1) / chunks;
+
+      if (ddmin_chunks(fsrv, chunk, 1)) {
+        chunks = 2;
+
+      } else if (chunks > 2 && ddmin_chunks(fsrv, chunk, 0)) {
+        --chunks;
+
+      } else {
+        chunks *= 2;
+      }
+    }
+
+    OKF("Chunk reduction complete, %u bytes deleted.", stage_o_len - in_len);
+  }
 
   /***********************
    * BLOCK NORMALIZATION *
@@ -322,27 +475,34 @@ static void minimize(afl_forkserver_t *fsrv) {
   ACTF(cBRI "Stage #0: " cRST "One-time block normalization...");
 
   while (set_pos < in_len) {
-    u32 use_len = MIN(set_len, in_len - set_pos);
+    for (n = 0, pos = set_pos; n < batch && pos < in_len; pos += set_len) {
+      u32 use_len = MIN(set_len, in_len - pos);
+
+      for (i = 0; i < use_len; i++) {
+        if (in_data[pos + i] != '0') { break; }
+      }
 
-    for (i = 0; i < use_len; i++) {
-      if (in_data[set_pos + i] != '0') { break; }
+      if (i != use_len) {
+        memcpy(CAND(n), in_data, in_len);
+        memset(CAND(n) + pos, '0', use_len);
+        cand_len[n] = in_len;
+        cand_pos[n++] = pos;
+      }
     }
 
-    if (i != use_len) {
-      memcpy(tmp_buf, in_data, in_len);
-      memset(tmp_buf + set_pos, '0', use_len);
+    set_pos = pos;
+    if (!n) { break; }
 
-      u8 res;
-      res = tmin_run_target(fsrv, tmp_buf, in_len, 0);
+    first = run_candidates(fsrv, n);
 
-      if (res) {
-        memset(in_data + set_pos, '0', use_len);
-        /*        changed_any = 1; value is not used */
-        alpha_del0 += use_len;
-      }
-    }
+    if (first < n) {
+      u32 use_len = MIN(set_len, in_len - cand_pos[first]);
 
-    set_pos += set_len;
+      memset(in_data + cand_pos[first], '0', use_len);
+      /*        changed_any = 1; value is not used */
+      alpha_del0 += use_len;
+      set_pos = cand_pos[first] + set_len;
+    }
   }
 
   alpha_d_total += alpha_del0;
@@ -374,42 +534,51 @@ next_del_blksize:
        in_len);
 
   while (del_pos < in_len) {
-    u8  res;
     s32 tail_len;
 
-    tail_len = in_len - del_pos - del_len;
-    if (tail_len < 0) { tail_len = 0; }
+    /* Queue up the deletions the serial loop would try if all of them
+       failed. */
 
-    /* If we have processed at least one full block (initially, prev_del == 1),
-       and we did so without deleting the previous one, and we aren't at the
-       very end of the buffer (tail_len > 0), and the current block is the same
-       as the previous one... skip this step as a no-op. */
+    for (n = 0, pos = del_pos, pd = prev_del; n < batch && pos < in_len;
+         pos += del_len) {
+      tail_len = in_len - pos - del_len;
+      if (tail_len < 0) { tail_len = 0; }
 
-    if (!prev_del && tail_len &&
-        !memcmp(in_data + del_pos - del_len, in_data + del_pos, del_len)) {
-      del_pos += del_len;
-      continue;
-    }
+      /* If we have processed at least one full block (initially, prev_del ==
+         1), and we did so without deleting the previous one, and we aren't at
+         the very end of the buffer (tail_len > 0), and the current block is
+         the same as the previous one... skip this step as a no-op. */
 
-    prev_del = 0;
+      if (!pd && tail_len &&
+          !memcmp(in_data + pos - del_len, in_data + pos, del_len)) {
+        continue;
+      }
+
+      pd = 0;
+
+      /* Head */
+      memcpy(CAND(n), in_data, pos);
 
-    /* Head */
-    memcpy(tmp_buf, in_data, del_pos);
+      /* Tail */
+      memcpy(CAND(n) + pos, in_data + pos + del_len, tail_len);
 
-    /* Tail */
-    memcpy(tmp_buf + del_pos, in_data + del_pos + del_len, tail_len);
+      cand_len[n] = pos + tail_len;
+      cand_pos[n++] = pos;
+    }
+
+    del_pos = pos;
+    prev_del = 0;
+    if (!n) { break; }
 
-    res = tmin_run_target(fsrv, tmp_buf, del_pos + tail_len, 0);
+    first = run_candidates(fsrv, n);
 
-    if (res) {
-      memcpy(in_data, tmp_buf, del_pos + tail_len);
+    if (first < n) {
+      memcpy(in_data, CAND(first), cand_len[first]);
       prev_del = 1;
-      in_len = del_pos + tail_len;
+      in_len = cand_len[first];
+      del_pos = cand_pos[first];
 
       changed_any = 1;
-
-    } else {
-      del_pos += del_len;
     }
   }
 
@@ -445,25 +614,34 @@ next_del_blksize:
   ACTF(cBRI "Stage #2: " cRST "Minimizing symbols (%u code point%s)...",
        alpha_size, alpha_size == 1 ? "" : "s");
 
-  for (i = 0; i < 256; i++) {
-    u32 r;
-    u8  res;
+  i = 0;
 
-    if (i == '0' || !alpha_map[i]) { continue; }
+  while (i < 256) {
+    for (n = 0; n < batch && i < 256; i++) {
+      u32 r;
 
-    memcpy(tmp_buf, in_data, in_len);
+      if (i == '0' || !alpha_map[i]) { continue; }
 
-    for (r = 0; r < in_len; r++) {
-      if (tmp_buf[r] == i) { tmp_buf[r] = '0'; }
+      memcpy(CAND(n), in_data, in_len);
+
+      for (r = 0; r < in_len; r++) {
+        if (CAND(n)[r] == i) { CAND(n)[r] = '0'; }
+      }
+
+      cand_len[n] = in_len;
+      cand_pos[n++] = i;
     }
 
-    res = tmin_run_target(fsrv, tmp_buf, in_len, 0);
+    if (!n) { break; }
 
-    if (res) {
-      memcpy(in_data, tmp_buf, in_len);
+    first = run_candidates(fsrv, n);
+
+    if (first < n) {
+      memcpy(in_data, CAND(first), in_len);
       syms_removed++;
-      alpha_del1 += alpha_map[i];
+      alpha_del1 += alpha_map[cand_pos[first]];
       changed_any = 1;
+      i = cand_pos[first] + 1;
     }
   }
 
@@ -481,23 +659,40 @@ next_del_blksize:
 
   ACTF(cBRI "Stage #3: " cRST "Character minimization...");
 
-  memcpy(tmp_buf, in_data, in_len);
+  /* the slots stay copies of in_data but for the byte each one tries */
 
-  for (i = 0; i < in_len; i++) {
-    u8 res, orig = tmp_buf[i];
+  for (n = 0; n < batch; ++n) {
+    memcpy(CAND(n), in_data, in_len);
+    cand_len[n] = in_len;
+  }
+
+  i = 0;
+
+  while (i < in_len) {
+    for (n = 0; n < batch && i < in_len; i++) {
+      if (in_data[i] == '0') { continue; }
+
+      CAND(n)[i] = '0';
+      cand_pos[n++] = i;
+    }
 
-    if (orig == '0') { continue; }
-    tmp_buf[i] = '0';
+    if (!n) { break; }
 
-    res = tmin_run_target(fsrv, tmp_buf, in_len, 0);
+    first = run_candidates(fsrv, n);
 
-    if (res) {
-      in_data[i] = '0';
+    for (pos = 0; pos < n; ++pos) {
+      CAND(pos)[cand_pos[pos]] = in_data[cand_pos[pos]];
+    }
+
+    if (first < n) {
+      for (pos = 0; pos < batch; ++pos) {
+        CAND(pos)[cand_pos[first]] = '0';
+      }
+
+      in_data[cand_pos[first]] = '0';
       alpha_del2++;
       changed_any = 1;
-
-    } else {
-      tmp_buf[i] = orig;
+      i = cand_pos[first] + 1;
     }
   }
 
@@ -510,7 +705,20 @@ next_del_blksize:
 
 finalize_all:
 
-  if (tmp_buf) { ck_free(tmp_buf); }
+  if (!jobs) {
+    ck_free(cand_bufs);
+    ck_free(cand_len);
+    ck_free(cand_pos);
+  }
+
+  /* the workers count what they ran */
+
+  for (i = 0; i < jobs; ++i) {
+    fsrv->total_execs += job_stats[i * 4];
+    missed_hangs += job_stats[i * 4 + 1];
+    missed_crashes += job_stats[i * 4 + 2];
+    missed_paths += job_stats[i * 4 + 3];
+  }
 
   if (hang_mode) {
     SAYF("\n" cGRA "     File size reduced by : " cRST
@@ -589,6 +797,13 @@ static void set_up_environment(afl_forkserver_t *fsrv, char **argv) {
 
   set_sanitizer_defaults();
 
+  /* Where the sanitizers and afl-compiler-rt write crash reports. */
+
+  if (sig_frames) {
+    sig_prefix = alloc_printf("%s.sig", out_file);
+    crash_report_setup(sig_prefix);
+  }
+
   if (get_afl_env("AFL_PRELOAD")) {
     if (fsrv->qemu_mode) {
       /* afl-qemu-trace takes care of converting AFL_PRELOAD. */
@@ -648,6 +863,125 @@ static void setup_signal_handlers(void) {
   sigaction(SIGTERM, &sa, NULL);
 }
 
+/* Fork the -j workers, which go on with the rest of main() and end up in
+   serve_candidates(). The main process waits until they are ready, then
+   minimizes and exits. Called with the input read. */
+
+static void start_workers(void) {
+  u32   i, j;
+  s32   cmd[2], res[2], null_fd;
+  u8    ready;
+  pid_t pid;
+
+  slot_len = in_len;
+  batch = jobs;
+
+  cand_bufs = mmap(NULL, (u64)jobs * slot_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  job_stats = mmap(NULL, jobs * 4 * sizeof(u64), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+  if (cand_bufs == MAP_FAILED || job_stats == MAP_FAILED) {
+    PFATAL("mmap() failed");
+  }
+
+  cand_len = ck_alloc(jobs * sizeof(u32));
+  cand_pos = ck_alloc(jobs * sizeof(u32));
+  job_cmd = ck_alloc(jobs * sizeof(s32));
+  job_res = ck_alloc(jobs * sizeof(s32));
+
+  ACTF("Starting %u workers...", jobs);
+
+  for (i = 0; i < jobs; ++i) {
+    if (pipe(cmd) || pipe(res)) { PFATAL("pipe() failed"); }
+
+    fflush(stdout);
+    fflush(stderr);
+
+    pid = fork();
+    if (pid < 0) { PFATAL("fork() failed"); }
+
+    if (!pid) {
+      worker_id = i;
+      is_worker = 1;
+
+      for (j = 0; j < i; ++j) {
+        close(job_cmd[j]);
+        close(job_res[j]);
+      }
+
+      close(cmd[1]);
+      close(res[0]);
+      job_cmd[0] = cmd[0];
+      job_res[0] = res[1];
+
+      /* the others would say the same as the first one */
+
+      if (i) {
+        null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd < 0) { PFATAL("Unable to open /dev/null"); }
+        dup2(null_fd, 2);
+        close(null_fd);
+      }
+
+      if (out_file) { out_file = alloc_printf("%s.%u", out_file, i); }
+      return;
+    }
+
+    close(cmd[0]);
+    close(res[1]);
+    job_cmd[i] = cmd[1];
+    job_res[i] = res[0];
+  }
+
+  for (i = 0; i < jobs; ++i) {
+    if (read(job_res[i], &ready, 1) != 1) {
+      if (stop_soon) { FATAL("Aborted by user"); }
+      FATAL("Worker %u failed", i);
+    }
+  }
+
+  minimize(fsrv);
+
+  ACTF("Writing output to '%s'...", output_file);
+
+  close(write_to_file(output_file, in_data, in_len));
+
+  for (i = 0; i < jobs; ++i) {
+    close(job_cmd[i]);
+  }
+
+  while (wait(NULL) > 0 || errno == EINTR) {}
+
+  OKF("We're done here. Have a nice day!\n");
+
+  exit(0);
+}
+
+/* The loop of a worker: run the candidate in the slot whenever its length
+   comes in, until the main process is done. */
+
+static void serve_candidates(afl_forkserver_t *fsrv) {
+  u8 *slot = CAND(worker_id), res = 1;
+  u32 len;
+
+  job_stats[worker_id * 4] = fsrv->total_execs;
+  ck_write(job_res[0], &res, 1, "worker pipe");
+
+  while (read(job_cmd[0], &len, sizeof(u32)) == sizeof(u32)) {
+    res = tmin_run_target(fsrv, slot, len, 0);
+
+    job_stats[worker_id * 4] = fsrv->total_execs;
+    job_stats[worker_id * 4 + 1] = missed_hangs;
+    job_stats[worker_id * 4 + 2] = missed_crashes;
+    job_stats[worker_id * 4 + 3] = missed_paths;
+
+    ck_write(job_res[0], &res, 1, "worker pipe");
+  }
+
+  exit(stop_soon ? 1 : 0);
+}
+
 /* Display usage hints. */
 
 static void usage(u8 *argv0) {
@@ -684,6 +1018,9 @@ static void usage(u8 *argv0) {
       "  -e            - solve for edge coverage only, ignore hit counts\n"
       "  -x            - treat non-zero exit codes as crashes\n\n"
       "  -H            - minimize a hang (hang mode)\n"
+      "  -d            - first reduce to subsets and complements of chunks "
+      "(ddmin)\n"
+      "  -j jobs       - run that many forkservers in parallel\n"
 
       "For additional tips, please consult %s/README.md.\n\n"
 
@@ -699,6 +1036,8 @@ static void usage(u8 *argv0) {
       "              the target was compiled for\n"
       "AFL_PRELOAD:  LD_PRELOAD / DYLD_INSERT_LIBRARIES settings for target\n"
       "AFL_TMIN_EXACT: require execution paths to match for crashing inputs\n"
+      "AFL_TMIN_SIGNATURE: require the same crash: signal, error kind and the\n"
+      "                    first frames of the report (default: 3 frames)\n"
       "AFL_NO_FORKSRV: run target via execve instead of using the forkserver\n"
       "ASAN_OPTIONS: custom settings for ASAN\n"
       "              (must contain abort_on_error=1 and symbolize=0)\n"
@@ -730,7 +1069,7 @@ int main(int argc, char **argv_orig, char **envp) {
 
   SAYF(cCYA "afl-tmin" VERSION cRST " by Michal Zalewski\n");
 
-  while ((opt = getopt(argc, argv, "+i:o:f:m:t:B:xeAOQUWXYHh")) > 0) {
+  while ((opt = getopt(argc, argv, "+i:o:f:m:t:B:j:dxeAOQUWXYHh")) > 0) {
     switch (opt) {
       case 'i':
 
@@ -761,6 +1100,19 @@ int main(int argc, char **argv_orig, char **envp) {
         edges_only = 1;
         break;
 
+      case 'd':
+
+        ddmin_mode = 1;
+        break;
+
+      case 'j':
+
+        if (jobs) { FATAL("Multiple -j options not supported"); }
+        jobs = atoi(optarg);
+        if (jobs < 1 || jobs > 256) { FATAL("Bad value for -j"); }
+        if (jobs == 1) { jobs = 0; }
+        break;
+
       case 'x':
 
         if (exit_crash) { FATAL("Multiple -x options not supported"); }
@@ -948,6 +1300,24 @@ int main(int argc, char **argv_orig, char **envp) {
   atexit(at_exit_handler);
   setup_signal_handlers();
 
+  if (get_afl_env("AFL_TMIN_SIGNATURE")) {
+    s32 frames = atoi(get_afl_env("AFL_TMIN_SIGNATURE"));
+    sig_frames = frames > 0 ? frames : 3;
+  }
+
+  if (hang_mode && sig_frames) {
+    SAYF("AFL_TMIN_SIGNATURE only applies to crashes, ignoring.\n");
+    sig_frames = 0;
+  }
+
+  if (jobs) {
+#ifdef __linux__
+    if (fsrv->nyx_mode) { FATAL("-j is not supported in Nyx mode"); }
+#endif
+    read_initial_file();
+    start_workers();
+  }
+
   set_up_environment(fsrv, argv);
 
 #ifdef __linux__
@@ -962,6 +1332,15 @@ int main(int argc, char **argv_orig, char **envp) {
   fsrv->target_path = find_binary(argv[optind]);
 #endif
 
+  /* sized for what the binary says it needs, so there is no restart for it */
+  u32 predicted = predict_map_size(fsrv->target_path, NULL);
+  if (predicted > map_size) {
+    map_size = predicted;
+    u8 *vbuf = alloc_printf("%u", map_size);
+    setenv("AFL_MAP_SIZE", vbuf, 1);
+    ck_free(vbuf);
+  }
+
   fsrv->trace_bits = afl_shm_init(&shm, map_size, 0);
   detect_file_args(argv + optind, out_file, &fsrv->use_stdin);
   signal(SIGALRM, kill_child);
@@ -1053,7 +1432,7 @@ int main(int argc, char **argv_orig, char **envp) {
   fsrv->shmem_fuzz_len = (u32 *)map;
   fsrv->shmem_fuzz = map + sizeof(u32);
 
-  read_initial_file();
+  if (!in_data) { read_initial_file(); }
 
 #ifdef __linux__
   if (!fsrv->nyx_mode) { (void)check_binary_signatures(fsrv->target_path); }
@@ -1062,7 +1441,13 @@ int main(int argc, char **argv_orig, char **envp) {
 #endif
 
   if (!fsrv->qemu_mode && !unicorn_mode) {
-    fsrv->map_size = 4194304;  // dummy temporary value
+    if (map_size > 4194304) {
+      fsrv->map_size = map_size;
+
+    } else {
+      fsrv->map_size = 4194304;  // dummy temporary value
+    }
+
     u32 new_map_size =
         afl_fsrv_get_mapsize(fsrv, use_argv, &stop_soon,
                              (get_afl_env("AFL_DEBUG_CHILD") ||
@@ -1131,11 +1516,13 @@ int main(int argc, char **argv_orig, char **envp) {
     if (!anything_set(fsrv)) { FATAL("No instrumentation detected."); }
 
   } else {
-    OKF("Program exits with a signal, minimizing in " cMGN "%scrash" cRST
+    OKF("Program exits with a signal, minimizing in " cMGN "%s%scrash" cRST
         " mode.",
-        exact_mode ? "EXACT " : "");
+        exact_mode ? "EXACT " : "", sig_frames ? "SIGNATURE " : "");
   }
 
+  if (is_worker) { serve_candidates(fsrv); }
+
   minimize(fsrv);
 
   ACTF("Writing output to '%s'...", output_file);
@@ -0,0 +1,1069 @@
+/*
+   american fuzzy lop++ - crash triage
+   -----------------------------------
+
+   Originally written by Michal Zalewski
+
+   Now maintained by Marc Heuse <mh@mh-sec.de>,
+                     Heiko Eißfeldt <heiko.eissfeldt@hexco.de>,
+                     Andrea Fioraldi <andreafioraldi@gmail.com>,
+                     Dominik Maier <mail@dmnk.co>
+
+   Copyright 2016, 2017 Google Inc. All rights reserved.
+   Copyright 2019-2024 AFLplusplus Project. All rights reserved.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at:
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+   Re-runs a directory of crashing inputs, usually against a sanitizer or
+   debug build of the target, and sorts them into buckets of the same crash
+   signature: the signal, the kind of error and the first frames of the
+   stack of the crash report, as AFL_TMIN_SIGNATURE of afl-tmin uses it.
+   The results are cached in the output directory, so a second run only
+   runs the inputs that are new.
+
+ */
+
+#define AFL_MAIN
+
+#include "config.h"
+#include "types.h"
+#include "debug.h"
+#include "alloc-inl.h"
+#include "hash.h"
+#include "sharedmem.h"
+#include "common.h"
+#include "forkserver.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+
+#define TRIAGE_SIG_LEN 512 /* Longest signature kept            */
+
+/* What a run of an input showed. */
+
+enum {
+
+  /* 00 */ TRIAGE_PENDING,
+  /* 01 */ TRIAGE_CRASH,
+  /* 02 */ TRIAGE_HANG,
+  /* 03 */ TRIAGE_NONE
+
+};
+
+static const u8 status_chr[] = "?CHN";
+
+/* The inputs and their results, in memory shared with the workers of -j.
+   Each of them has a forkserver of its own and takes the next pending
+   input from work until there are none left; the buckets are made by the
+   main process once all are done. */
+
+struct triage_entry {
+  u8 *fname;               /* path of the input                 */
+  u32 len;                 /* its length                        */
+  u64 in_cksum;            /* hash64() of its contents          */
+  u64 sig_cksum;           /* hash64() of sig                   */
+  u8  status;              /* TRIAGE_*                          */
+  u8  sig[TRIAGE_SIG_LEN]; /* the crash signature, as text      */
+};
+
+struct triage_work {
+  u32 next; /* next pending input to run         */
+};
+
+static u8 *in_dir,  /* Directory with the crashes (-i)   */
+    *out_dir,       /* Output directory (-o)             */
+    *sig_prefix,    /* Where the reports are written     */
+    *target_path;
+
+static u32 in_cnt,             /* Inputs found in in_dir            */
+    pending_cnt,               /* Inputs to run                     */
+    *pending,                  /* Their indices in entries          */
+    jobs,                      /* Workers (-j)                      */
+    sig_frames = 3,            /* Frames in a signature (-n)        */
+    exec_tmout = EXEC_TIMEOUT; /* Exec timeout (ms)                 */
+
+static u64 mem_limit = MEM_LIMIT, /* Memory limit (MB)                 */
+    target_key;                   /* The target and the settings       */
+
+static struct triage_entry *entries;
+static struct triage_work  *work;
+static pid_t               *workers;
+static u8                   is_worker;
+
+static volatile u8 stop_soon; /* Ctrl-C pressed?                   */
+
+static u8 symbolize;
+static u8 frida_mode;
+static u8 qemu_mode;
+static u8 cs_mode;
+
+static afl_forkserver_t fsrv = {0}; /* The forkserver                    */
+
+static void kill_child() {
+  if (fsrv.child_pid > 0) {
+    kill(fsrv.child_pid, fsrv.child_kill_signal);
+    fsrv.child_pid = -1;
+  }
+}
+
+/* Get rid of temp files (atexit handler). */
+
+static void at_exit_handler(void) {
+  if (fsrv.out_file) { unlink(fsrv.out_file); } /* Ignore errors */
+}
+
+/* Read a whole file, NULL if it cannot be read. */
+
+static u8 *read_file(u8 *fn, u32 *len) {
+  struct stat st;
+  s32         fd = open(fn, O_RDONLY);
+  u8         *buf;
+
+  if (fd < 0) { return NULL; }
+
+  if (fstat(fd, &st) || st.st_size >= TMIN_MAX_FILE) {
+    close(fd);
+    return NULL;
+  }
+
+  buf = ck_alloc_nozero(st.st_size + 1);
+  ck_read(fd, buf, st.st_size, fn);
+  close(fd);
+
+  buf[st.st_size] = 0;
+  *len = st.st_size;
+  return buf;
+}
+
+/* Collect the inputs of in_dir and hash their contents. */
+
+static void read_inputs(void) {
+  struct dirent **nl;
+  struct stat     st;
+  s32             nl_cnt, i;
+  u8             *fn, *data;
+
+  ACTF("Scanning '%s'...", in_dir);
+
+  /* We use scandir() + alphasort() rather than readdir() because otherwise,
+     the ordering of the buckets would vary between runs. */
+
+  nl_cnt = scandir(in_dir, &nl, NULL, alphasort);
+  if (nl_cnt < 0) { PFATAL("Unable to open '%s'", in_dir); }
+
+  entries = mmap(NULL, (size_t)(nl_cnt + 1) * sizeof(struct triage_entry),
+                 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (entries == MAP_FAILED) { PFATAL("mmap() failed"); }
+
+  for (i = 0; i < nl_cnt; ++i) {
+    fn = alloc_printf("%s/%s", in_dir, nl[i]->d_name);
+
+    if (lstat(fn, &st) || !S_ISREG(st.st_mode) || !st.st_size ||
+        nl[i]->d_name[0] == '.' || !strcmp(nl[i]->d_name, "README.txt")) {
+      ck_free(fn);
+      continue;
+    }
+
+    data = read_file(fn, &entries[in_cnt].len);
+    if (!data) {
+      WARNF("Unable to read '%s', skipping", fn);
+      ck_free(fn);
+      continue;
+    }
+
+    entries[in_cnt].in_cksum = hash64(data, entries[in_cnt].len, HASH_CONST);
+    entries[in_cnt++].fname = fn;
+    ck_free(data);
+  }
+
+  for (i = 0; i < nl_cnt; ++i) {
+    free(nl[i]); /* not tracked */
+  }
+
+  free(nl); /* not tracked */
+
+  if (!in_cnt) { FATAL("No inputs found in '%s'", in_dir); }
+
+  OKF("Found %u input%s.", in_cnt, in_cnt == 1 ? "" : "s");
+}
+
+/* The target and everything that changes the signatures: a cache made with
+   another key is ignored. */
+
+static void make_target_key(char **argv) {
+  struct stat st;
+  u8         *key;
+
+  if (stat(fsrv.target_path, &st)) {
+    PFATAL("Unable to stat '%s'", fsrv.target_path);
+  }
+
+  key = alloc_printf("%s %llu %llu %u %u", fsrv.target_path, (u64)st.st_size,
+                     (u64)st.st_mtime, sig_frames, symbolize);
+  target_key = hash64(key, strlen(key), HASH_CONST);
+  ck_free(key);
+
+  while (*argv) {
+    target_key ^= hash64(*argv, strlen(*argv), HASH_CONST);
+    target_key = (target_key << 7) | (target_key >> 57);
+    ++argv;
+  }
+}
+
+/* The cache is a line per input: the hash of its contents, its status, the
+   hash of its signature and the signature. */
+
+static int cmp_entry_cksum(const void *a, const void *b) {
+  const struct triage_entry *x = a, *y = b;
+
+  return x->in_cksum < y->in_cksum ? -1 : x->in_cksum > y->in_cksum;
+}
+
+static void read_cache(void) {
+  struct triage_entry *cache = NULL, *c, key;
+  u32                  cnt = 0, len, i, used = 0;
+  u8                  *fn = alloc_printf("%s/.triage_cache", out_dir);
+  u8                  *buf = read_file(fn, &len), *line, *eol, *p;
+  u64                  tk;
+
+  ck_free(fn);
+
+  pending = ck_alloc(in_cnt * sizeof(u32));
+
+  if (buf && (sscanf(buf, "# afl-triage %llx", &tk) != 1 || tk != target_key)) {
+    WARNF("The target or its settings changed, not using the cache.");
+    ck_free(buf);
+    buf = NULL;
+  }
+
+  for (line = buf; line && *line; ++line) {
+    if (*line == '\n') { ++cnt; }
+  }
+
+  if (cnt) { cache = ck_alloc(cnt * sizeof(struct triage_entry)); }
+  cnt = 0;
+
+  for (line = buf; line && *line; line = *eol ? eol + 1 : eol) {
+    eol = strchr(line, '\n');
+    if (!eol) { eol = line + strlen(line); }
+    if (*line == '#') { continue; }
+
+    c = &cache[cnt];
+
+    if (sscanf(line, "%llx %c %llx", &c->in_cksum, &c->status,
+               &c->sig_cksum) != 3 ||
+        !(p = memchr(line, ' ', eol - line)) ||
+        !(p = memchr(p + 1, ' ', eol - p - 1)) ||
+        !(p = memchr(p + 1, ' ', eol - p - 1)) ||
+        !strchr("CHN", c->status)) {
+      continue;
+    }
+
+    c->status = strchr(status_chr, c->status) - (char *)status_chr;
+
+    ++p;
+    len = MIN((u32)(eol - p), (u32)TRIAGE_SIG_LEN - 1);
+    memcpy(c->sig, p, len);
+    c->sig[len] = 0;
+    ++cnt;
+  }
+
+  if (cnt) { qsort(cache, cnt, sizeof(struct triage_entry), cmp_entry_cksum); }
+
+  for (i = 0; i < in_cnt; ++i) {
+    key.in_cksum = entries[i].in_cksum;
+    c = cnt ? bsearch(&key, cache, cnt, sizeof(struct triage_entry),
+                      cmp_entry_cksum)
+            : NULL;
+
+    if (c) {
+      entries[i].status = c->status;
+      entries[i].sig_cksum = c->sig_cksum;
+      memcpy(entries[i].sig, c->sig, TRIAGE_SIG_LEN);
+      ++used;
+
+    } else {
+      pending[pending_cnt++] = i;
+    }
+  }
+
+  if (used) {
+    OKF("Took %u result%s from the cache.", used, used == 1 ? "" : "s");
+  }
+
+  ck_free(cache);
+  ck_free(buf);
+}
+
+static void write_cache(void) {
+  u8   *fn = alloc_printf("%s/.triage_cache", out_dir);
+  FILE *f = create_ffile(fn);
+  u32   i;
+
+  fprintf(f, "# afl-triage %016llx\n", target_key);
+
+  for (i = 0; i < in_cnt; ++i) {
+    struct triage_entry *e = &entries[i];
+
+    if (e->status == TRIAGE_PENDING) { continue; }
+    fprintf(f, "%016llx %c %016llx %s\n", e->in_cksum, status_chr[e->status],
+            e->sig_cksum, e->sig);
+  }
+
+  fclose(f);
+  ck_free(fn);
+}
+
+/* Run one input and store what it did. The report is kept in
+   out_dir/reports, by the hash of the contents. */
+
+static void triage_run_target(struct triage_entry *e) {
+  fsrv_run_result_t ret;
+  u8               *data = read_file(e->fname, &e->len), *report, *fn;
+  s32               fd;
+
+  if (!data) { PFATAL("Unable to read '%s'", e->fname); }
+
+  afl_fsrv_write_to_testcase(&fsrv, data, e->len);
+  ret = afl_fsrv_run_target(&fsrv, exec_tmout, &stop_soon);
+  ck_free(data);
+
+  if (ret == FSRV_RUN_ERROR) { FATAL("Error in forkserver"); }
+
+  if (stop_soon) {
+    SAYF(cRST cLRD "\n+++ Triage aborted by user +++\n" cRST);
+    exit(1);
+  }
+
+  report = crash_report_read(sig_prefix, fsrv.last_child_pid);
+
+  if (fsrv.last_run_timed_out) {
+    e->status = TRIAGE_HANG;
+
+  } else if (ret == FSRV_RUN_CRASH) {
+    e->status = TRIAGE_CRASH;
+    crash_report_signature(report, fsrv.last_kill_signal, sig_frames, e->sig,
+                           TRIAGE_SIG_LEN);
+    e->sig_cksum = hash64(e->sig, strlen(e->sig), HASH_CONST);
+
+    if (report) {
+      fn = alloc_printf("%s/reports/%016llx.txt", out_dir, e->in_cksum);
+      fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, DEFAULT_PERMISSION);
+      if (fd < 0) { PFATAL("Unable to create '%s'", fn); }
+      ck_write(fd, report, strlen(report), fn);
+      close(fd);
+      ck_free(fn);
+    }
+
+  } else {
+    e->status = TRIAGE_NONE;
+  }
+
+  ck_free(report);
+}
+
+/* Run the pending inputs, shared with the workers. */
+
+static void triage(void) {
+  u32 i, done = 0;
+  int status;
+
+  while ((i = __sync_fetch_and_add(&work->next, 1)) < pending_cnt) {
+    triage_run_target(&entries[pending[i]]);
+
+    if (!is_worker && !(++done % 100)) {
+      ACTF("Ran %u of %u inputs...", MIN(work->next, pending_cnt),
+           pending_cnt);
+    }
+  }
+
+  if (is_worker) {
+    afl_fsrv_deinit(&fsrv);
+    exit(0);
+  }
+
+  for (i = 1; i < jobs; ++i) {
+    if (waitpid(workers[i], &status, 0) < 0 || !WIFEXITED(status) ||
+        WEXITSTATUS(status)) {
+      FATAL("Worker %u failed", i);
+    }
+  }
+}
+
+/* Buckets: crashes by signature, then by size. */
+
+static int cmp_entry_sig(const void *a, const void *b) {
+  const struct triage_entry *x = a, *y = b;
+
+  if (x->status != y->status) { return x->status < y->status ? -1 : 1; }
+  if (x->sig_cksum != y->sig_cksum) {
+    return x->sig_cksum < y->sig_cksum ? -1 : 1;
+  }
+
+  if (x->len != y->len) { return x->len < y->len ? -1 : 1; }
+  return strcmp(x->fname, y->fname);
+}
+
+struct triage_bucket {
+  u32 first, cnt;
+};
+
+static int cmp_bucket(const void *a, const void *b) {
+  const struct triage_bucket *x = a, *y = b;
+
+  if (x->cnt != y->cnt) { return x->cnt > y->cnt ? -1 : 1; }
+  return x->first < y->first ? -1 : 1;
+}
+
+/* Remove the buckets of an earlier run. */
+
+static void remove_buckets(u8 *dir) {
+  struct dirent *de, *de2;
+  DIR           *d = opendir(dir), *d2;
+  u8            *sub, *fn;
+
+  if (!d) { return; }
+
+  while ((de = readdir(d))) {
+    if (de->d_name[0] == '.') { continue; }
+
+    sub = alloc_printf("%s/%s", dir, de->d_name);
+
+    if ((d2 = opendir(sub))) {
+      while ((de2 = readdir(d2))) {
+        if (de2->d_name[0] == '.') { continue; }
+        fn = alloc_printf("%s/%s", sub, de2->d_name);
+        if (unlink(fn)) { PFATAL("Unable to delete '%s'", fn); }
+        ck_free(fn);
+      }
+
+      closedir(d2);
+    }
+
+    if (rmdir(sub)) { PFATAL("Unable to delete '%s'", sub); }
+    ck_free(sub);
+  }
+
+  closedir(d);
+}
+
+static void write_buckets(void) {
+  struct triage_bucket *buckets = NULL;
+  struct triage_entry  *e;
+  u32  i, b, bucket_cnt = 0, crashes = 0, hangs = 0, none = 0;
+  u8  *dir = alloc_printf("%s/buckets", out_dir), *sub, *fn, *src, *name;
+  FILE *f;
+
+  remove_buckets(dir);
+  if (mkdir(dir, 0700) && errno != EEXIST) {
+    PFATAL("Unable to create '%s'", dir);
+  }
+
+  qsort(entries, in_cnt, sizeof(struct triage_entry), cmp_entry_sig);
+
+  for (i = 0; i < in_cnt; ++i) {
+    e = &entries[i];
+
+    switch (e->status) {
+      case TRIAGE_CRASH:
+        ++crashes;
+        break;
+      case TRIAGE_HANG:
+        ++hangs;
+        continue;
+      default:
+        ++none;
+        continue;
+    }
+
+    if (!bucket_cnt ||
+        e->sig_cksum != entries[buckets[bucket_cnt - 1].first].sig_cksum) {
+      buckets = ck_realloc(buckets, (bucket_cnt + 1) * sizeof(*buckets));
+      buckets[bucket_cnt].first = i;
+      buckets[bucket_cnt++].cnt = 0;
+
+      /* the report of the smallest input of the bucket */
+
+      sub = alloc_printf("%s/%016llx", dir, e->sig_cksum);
+      if (mkdir(sub, 0700)) { PFATAL("Unable to create '%s'", sub); }
+
+      fn = alloc_printf("%s/reports/%016llx.txt", out_dir, e->in_cksum);
+      src = alloc_printf("../../reports/%016llx.txt", e->in_cksum);
+
+      if (!access(fn, F_OK)) {
+        ck_free(fn);
+        fn = alloc_printf("%s/report.txt", sub);
+        if (symlink(src, fn)) { PFATAL("Unable to create '%s'", fn); }
+      }
+
+      ck_free(src);
+      ck_free(fn);
+      ck_free(sub);
+    }
+
+    ++buckets[bucket_cnt - 1].cnt;
+
+    name = strrchr(e->fname, '/') + 1;
+    fn = alloc_printf("%s/%016llx/%s", dir, e->sig_cksum, name);
+    src = realpath(e->fname, NULL);
+    if (!src || symlink(src, fn)) { PFATAL("Unable to create '%s'", fn); }
+    free(src); /* not tracked */
+    ck_free(fn);
+  }
+
+  if (bucket_cnt) {
+    qsort(buckets, bucket_cnt, sizeof(*buckets), cmp_bucket);
+  }
+
+  /* the summary, the biggest buckets first */
+
+  fn = alloc_printf("%s/triage.txt", out_dir);
+  f = create_ffile(fn);
+
+  fprintf(f,
+          "# %u inputs: %u crashes in %u buckets, %u hangs, %u without a "
+          "crash\n# bucket count smallest signature\n",
+          in_cnt, crashes, bucket_cnt, hangs, none);
+
+  for (b = 0; b < bucket_cnt; ++b) {
+    e = &entries[buckets[b].first];
+    fprintf(f, "%016llx %u %s %s\n", e->sig_cksum, buckets[b].cnt,
+            strrchr(e->fname, '/') + 1, e->sig);
+  }
+
+  for (i = 0; i < in_cnt; ++i) {
+    if (entries[i].status == TRIAGE_HANG) {
+      fprintf(f, "hang - %s\n", strrchr(entries[i].fname, '/') + 1);
+
+    } else if (entries[i].status == TRIAGE_NONE) {
+      fprintf(f, "none - %s\n", strrchr(entries[i].fname, '/') + 1);
+    }
+  }
+
+  fclose(f);
+
+  OKF("%u crash%s in " cBRI "%u" cRST " bucket%s, %u hang%s, %u without a "
+      "crash.",
+      crashes, crashes == 1 ? "" : "es", bucket_cnt, bucket_cnt == 1 ? "" : "s",
+      hangs, hangs == 1 ? "" : "s", none);
+  OKF("Summary written to '%s'.", fn);
+
+  ck_free(fn);
+  ck_free(buckets);
+  ck_free(dir);
+}
+
+/* Fork the workers of -j, which go on from here as the main process does,
+   each with a forkserver of its own. */
+
+static void start_workers(void) {
+  u32   i;
+  s32   null_fd;
+  pid_t pid;
+
+  work = mmap(NULL, sizeof(struct triage_work), PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+  if (work == MAP_FAILED) { PFATAL("mmap() failed"); }
+
+  if (jobs > pending_cnt) { jobs = pending_cnt; }
+
+  if (jobs > 1) {
+    ACTF("Starting %u workers...", jobs - 1);
+    workers = ck_alloc(jobs * sizeof(pid_t));
+  }
+
+  for (i = 1; i < jobs; ++i) {
+    fflush(stdout);
+    fflush(stderr);
+
+    pid = fork();
+    if (pid < 0) { PFATAL("fork() failed"); }
+
+    if (!pid) {
+      is_worker = 1;
+
+      /* they would only say the same as the main process */
+
+      null_fd = open("/dev/null", O_WRONLY);
+      if (null_fd < 0) { PFATAL("Unable to open /dev/null"); }
+      dup2(null_fd, 1);
+      close(null_fd);
+
+      if (fsrv.out_file) {
+        fsrv.out_file = alloc_printf("%s.%u", fsrv.out_file, i);
+      }
+
+      return;
+    }
+
+    workers[i] = pid;
+  }
+}
+
+/* Handle Ctrl-C and the like. */
+
+static void handle_stop_sig(int sig) {
+  (void)sig;
+  stop_soon = 1;
+
+  afl_fsrv_killall();
+}
+
+/* Do basic preparations - persistent fds, filenames, etc. */
+
+static void set_up_environment(char **argv) {
+  u8   *x;
+  char *afl_preload;
+  char *frida_afl_preload = NULL;
+  static const char *san_opts[] = {"ASAN_OPTIONS", "UBSAN_OPTIONS",
+                                   "MSAN_OPTIONS", NULL};
+  u32 i;
+
+  fsrv.dev_null_fd = open("/dev/null", O_RDWR);
+  if (fsrv.dev_null_fd < 0) { PFATAL("Unable to open /dev/null"); }
+
+  if (!fsrv.out_file) {
+    fsrv.out_file =
+        alloc_printf("%s/.afl-triage-temp-%u", out_dir, (u32)getpid());
+  }
+
+  unlink(fsrv.out_file);
+  fsrv.out_fd =
+      open(fsrv.out_file, O_RDWR | O_CREAT | O_EXCL, DEFAULT_PERMISSION);
+
+  if (fsrv.out_fd < 0) { PFATAL("Unable to create '%s'", fsrv.out_file); }
+
+  /* Set sane defaults... */
+  x = get_afl_env("MSAN_OPTIONS");
+
+  if (x) {
+    if (!strstr(x, "exit_code=" STRINGIFY(MSAN_ERROR))) {
+      FATAL("Custom MSAN_OPTIONS set without exit_code=" STRINGIFY(
+          MSAN_ERROR) " - please fix!");
+    }
+  }
+
+  set_sanitizer_defaults();
+
+  /* -s: function names and source locations in the reports */
+
+  for (i = 0; symbolize && san_opts[i]; ++i) {
+    x = getenv(san_opts[i]);
+    x = alloc_printf("%s%ssymbolize=1", x ? x : (u8 *)"",
+                     x && *x && x[strlen(x) - 1] != ':' ? ":" : "");
+    setenv(san_opts[i], x, 1);
+    ck_free(x);
+  }
+
+  crash_report_setup(sig_prefix);
+
+  if (get_afl_env("AFL_PRELOAD")) {
+    if (qemu_mode) {
+      /* afl-qemu-trace takes care of converting AFL_PRELOAD. */
+
+    } else if (frida_mode) {
+      afl_preload = getenv("AFL_PRELOAD");
+      u8 *frida_binary = find_afl_binary(argv[0], "afl-frida-trace.so");
+      if (afl_preload) {
+        frida_afl_preload = alloc_printf("%s:%s", afl_preload, frida_binary);
+
+      } else {
+        frida_afl_preload = alloc_printf("%s", frida_binary);
+      }
+
+      ck_free(frida_binary);
+
+      setenv("LD_PRELOAD", frida_afl_preload, 1);
+      setenv("DYLD_INSERT_LIBRARIES", frida_afl_preload, 1);
+
+    } else {
+      /* CoreSight mode uses the default behavior. */
+
+      setenv("LD_PRELOAD", getenv("AFL_PRELOAD"), 1);
+      setenv("DYLD_INSERT_LIBRARIES", getenv("AFL_PRELOAD"), 1);
+    }
+
+  } else if (frida_mode) {
+    u8 *frida_binary = find_afl_binary(argv[0], "afl-frida-trace.so");
+    setenv("LD_PRELOAD", frida_binary, 1);
+    setenv("DYLD_INSERT_LIBRARIES", frida_binary, 1);
+    ck_free(frida_binary);
+  }
+
+  if (frida_afl_preload) { ck_free(frida_afl_preload); }
+}
+
+/* Setup signal handlers, duh. */
+
+static void setup_signal_handlers(void) {
+  struct sigaction sa;
+
+  sa.sa_handler = NULL;
+#ifdef SA_RESTART
+  sa.sa_flags = SA_RESTART;
+#else
+  sa.sa_flags = 0;
+#endif
+  sa.sa_sigaction = NULL;
+
+  sigemptyset(&sa.sa_mask);
+
+  /* Various ways of saying "stop". */
+
+  sa.sa_handler = handle_stop_sig;
+  sigaction(SIGHUP, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+}
+
+/* Display usage hints. */
+
+static void usage(u8 *argv0) {
+  SAYF(
+      "\n%s [ options ] -- /path/to/target_app [ ... ]\n\n"
+
+      "Required parameters:\n"
+
+      "  -i dir        - directory with the crashing inputs\n"
+      "  -o dir        - output directory for the buckets and the cache\n\n"
+
+      "Execution control settings:\n"
+
+      "  -f file       - input file read by the tested program (stdin)\n"
+      "  -t msec       - timeout for each run (%u ms)\n"
+      "  -m megs       - memory limit for child process (%u MB)\n"
+#if defined(__linux__) && defined(__aarch64__)
+      "  -A            - use binary-only instrumentation (ARM CoreSight mode)\n"
+#endif
+      "  -O            - use binary-only instrumentation (FRIDA mode)\n"
+#if defined(__linux__)
+      "  -Q            - use binary-only instrumentation (QEMU mode)\n"
+      "  -U            - use unicorn-based instrumentation (Unicorn mode)\n"
+      "  -W            - use qemu-based instrumentation with Wine (Wine "
+      "mode)\n"
+#endif
+      "\n"
+
+      "Triage settings:\n"
+
+      "  -j jobs       - run that many forkservers in parallel\n"
+      "  -n frames     - stack frames in a crash signature (3)\n"
+      "  -s            - have the sanitizers symbolize their reports\n\n"
+
+      "For additional tips, please consult %s/README.md.\n\n"
+
+      "Environment variables used:\n"
+      "ASAN_OPTIONS: custom settings for ASAN\n"
+      "              (must contain abort_on_error=1)\n"
+      "MSAN_OPTIONS: custom settings for MSAN\n"
+      "              (must contain exitcode="STRINGIFY(MSAN_ERROR)")\n"
+      "AFL_KILL_SIGNAL: Signal ID delivered to child processes on timeout, etc.\n"
+      "                 (default: SIGKILL)\n"
+      "AFL_FORK_SERVER_KILL_SIGNAL: Kill signal for the fork server on termination\n"
+      "                             (default: SIGTERM). If unset and AFL_KILL_SIGNAL is\n"
+      "                             set, that value will be used.\n"
+      "AFL_MAP_SIZE: the shared memory size for that target. must be >= the size\n"
+      "              the target was compiled for\n"
+      "AFL_NO_FORKSRV: run target via execve instead of using the forkserver\n"
+      "AFL_PRELOAD: LD_PRELOAD / DYLD_INSERT_LIBRARIES settings for target\n"
+      , argv0, EXEC_TIMEOUT, MEM_LIMIT, doc_path);
+
+  exit(1);
+}
+
+/* Main entry point */
+
+int main(int argc, char **argv_orig, char **envp) {
+  s32    opt;
+  u8     mem_limit_given = 0, timeout_given = 0, unicorn_mode = 0, use_wine = 0;
+  char **use_argv;
+  char **argv = argv_cpy_dup(argc, argv_orig);
+  u8    *fn;
+
+  doc_path = access(DOC_PATH, F_OK) ? "docs" : DOC_PATH;
+
+  SAYF(cCYA "afl-triage" VERSION cRST " by Michal Zalewski\n");
+
+  afl_fsrv_init(&fsrv);
+
+  while ((opt = getopt(argc, argv, "+i:o:f:m:t:j:n:sAOQUWh")) > 0) {
+    switch (opt) {
+      case 'i':
+
+        if (in_dir) { FATAL("Multiple -i options not supported"); }
+        in_dir = optarg;
+        break;
+
+      case 'o':
+
+        if (out_dir) { FATAL("Multiple -o options not supported"); }
+        out_dir = optarg;
+        break;
+
+      case 'f':
+
+        if (fsrv.out_file) { FATAL("Multiple -f options not supported"); }
+        fsrv.use_stdin = 0;
+        fsrv.out_file = ck_strdup(optarg);
+        break;
+
+      case 'j':
+
+        if (jobs) { FATAL("Multiple -j options not supported"); }
+        jobs = atoi(optarg);
+        if (jobs < 1 || jobs > 256) { FATAL("Bad value for -j"); }
+        break;
+
+      case 'n':
+
+        sig_frames = atoi(optarg);
+        if (sig_frames < 1 || sig_frames > 64) { FATAL("Bad value for -n"); }
+        break;
+
+      case 's':
+
+        symbolize = 1;
+        break;
+
+      case 'm': {
+        u8 suffix = 'M';
+
+        if (mem_limit_given) { FATAL("Multiple -m options not supported"); }
+        mem_limit_given = 1;
+
+        if (!optarg) { FATAL("Wrong usage of -m"); }
+
+        if (!strcmp(optarg, "none")) {
+          mem_limit = 0;
+          fsrv.mem_limit = 0;
+          break;
+        }
+
+        if (sscanf(optarg, "%llu%c", &mem_limit, &suffix) < 1 ||
+            optarg[0] == '-') {
+          FATAL("Bad syntax used for -m");
+        }
+
+        switch (suffix) {
+          case 'T':
+            mem_limit *= 1024 * 1024;
+            break;
+          case 'G':
+            mem_limit *= 1024;
+            break;
+          case 'k':
+            mem_limit /= 1024;
+            break;
+          case 'M':
+            break;
+
+          default:
+            FATAL("Unsupported suffix or bad syntax for -m");
+        }
+
+        if (mem_limit < 5) { FATAL("Dangerously low value of -m"); }
+
+        if (sizeof(rlim_t) == 4 && mem_limit > 2000) {
+          FATAL("Value of -m out of range on 32-bit systems");
+        }
+
+        fsrv.mem_limit = mem_limit;
+
+      }
+
+      break;
+
+      case 't':
+
+        if (timeout_given) { FATAL("Multiple -t options not supported"); }
+        timeout_given = 1;
+
+        if (!optarg) { FATAL("Wrong usage of -t"); }
+
+        exec_tmout = atoi(optarg);
+
+        if (exec_tmout < 10 || optarg[0] == '-') {
+          FATAL("Dangerously low value of -t");
+        }
+
+        fsrv.exec_tmout = exec_tmout;
+
+        break;
+
+      case 'A': /* CoreSight mode */
+
+#if !defined(__aarch64__) || !defined(__linux__)
+        FATAL("-A option is not supported on this platform");
+#endif
+
+        if (cs_mode) { FATAL("Multiple -A options not supported"); }
+
+        cs_mode = 1;
+        fsrv.cs_mode = cs_mode;
+        break;
+
+      case 'O': /* FRIDA mode */
+
+        if (frida_mode) { FATAL("Multiple -O options not supported"); }
+
+        frida_mode = 1;
+        fsrv.frida_mode = frida_mode;
+        setenv("AFL_FRIDA_INST_SEED", "1", 1);
+
+        break;
+
+      case 'Q':
+
+        if (qemu_mode) { FATAL("Multiple -Q options not supported"); }
+        if (!mem_limit_given) { mem_limit = MEM_LIMIT_QEMU; }
+
+        qemu_mode = 1;
+        fsrv.mem_limit = mem_limit;
+        fsrv.qemu_mode = qemu_mode;
+        break;
+
+      case 'U':
+
+        if (unicorn_mode) { FATAL("Multiple -U options not supported"); }
+        if (!mem_limit_given) { mem_limit = MEM_LIMIT_UNICORN; }
+
+        unicorn_mode = 1;
+        fsrv.mem_limit = mem_limit;
+        break;
+
+      case 'W': /* Wine+QEMU mode */
+
+        if (use_wine) { FATAL("Multiple -W options not supported"); }
+        qemu_mode = 1;
+        use_wine = 1;
+
+        if (!mem_limit_given) { mem_limit = 0; }
+        fsrv.qemu_mode = qemu_mode;
+        fsrv.mem_limit = mem_limit;
+
+        break;
+
+      case 'h':
+        usage(argv[0]);
+        return -1;
+        break;
+
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  if (optind == argc || !in_dir || !out_dir) { usage(argv[0]); }
+
+  fsrv.map_size = get_map_size();
+
+  check_environment_vars(envp);
+
+  if (getenv("AFL_NO_FORKSRV")) { /* if set, use the fauxserver */
+    fsrv.use_fauxsrv = true;
+  }
+
+  sharedmem_t shm = {0};
+
+  /* initialize cmplog_mode */
+  shm.cmplog_mode = 0;
+
+  if (mkdir(out_dir, 0700) && errno != EEXIST) {
+    PFATAL("Unable to create '%s'", out_dir);
+  }
+
+  fn = alloc_printf("%s/reports", out_dir);
+  if (mkdir(fn, 0700) && errno != EEXIST) {
+    PFATAL("Unable to create '%s'", fn);
+  }
+  ck_free(fn);
+
+  sig_prefix = alloc_printf("%s/.report", out_dir);
+  fsrv.target_path = find_binary(argv[optind]);
+
+  make_target_key(argv + optind);
+  read_inputs();
+  read_cache();
+
+  if (pending_cnt) {
+    atexit(at_exit_handler);
+    setup_signal_handlers();
+
+    start_workers();
+    set_up_environment(argv);
+
+    fsrv.trace_bits = afl_shm_init(&shm, fsrv.map_size, 0);
+    detect_file_args(argv + optind, fsrv.out_file, &fsrv.use_stdin);
+    signal(SIGALRM, kill_child);
+
+    if (qemu_mode) {
+      if (use_wine) {
+        use_argv =
+            get_wine_argv(argv[0], &target_path, argc - optind, argv + optind);
+
+      } else {
+        use_argv =
+            get_qemu_argv(argv[0], &target_path, argc - optind, argv + optind);
+      }
+
+    } else if (cs_mode) {
+      use_argv =
+          get_cs_argv(argv[0], &target_path, argc - optind, argv + optind);
+
+    } else {
+      use_argv = argv + optind;
+    }
+
+    if (getenv("AFL_FORKSRV_INIT_TMOUT")) {
+      s32 forksrv_init_tmout = atoi(getenv("AFL_FORKSRV_INIT_TMOUT"));
+      if (forksrv_init_tmout < 1) {
+        FATAL("Bad value specified for AFL_FORKSRV_INIT_TMOUT");
+      }
+
+      fsrv.init_tmout = (u32)forksrv_init_tmout;
+    }
+
+    configure_afl_kill_signals(
+        &fsrv, NULL, NULL,
+        (fsrv.qemu_mode || unicorn_mode) ? SIGKILL : SIGTERM);
+
+    if (!is_worker) {
+      ACTF("Running %u input%s (mem limit = %llu MB, timeout = %u ms)...",
+           pending_cnt, pending_cnt == 1 ? "" : "s", mem_limit, exec_tmout);
+    }
+
+    afl_fsrv_start(&fsrv, use_argv, &stop_soon, false);
+    triage();
+
+    afl_shm_deinit(&shm);
+    afl_fsrv_deinit(&fsrv);
+  }
+
+  write_cache();
+  write_buckets();
+
+  OKF("We're done here. Have a nice day!\n");
+
+  if (fsrv.target_path) { ck_free(fsrv.target_path); }
+
+  exit(0);
+}
+
@@ -0,0 +1,504 @@
+/*
+   american fuzzy lop++ - hot path microbenchmarks
+   -----------------------------------------------
+
+   Copyright 2019-2024 AFLplusplus Project. All rights reserved.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at:
+
+     https://www.apache.org/licenses/LICENSE-2.0
+
+   benchmark/benchmark.py measures execs/s of a whole fuzzing run, which is
+   mostly the target and the kernel. This times what afl-fuzz itself does
+   around each exec instead: the bitmap functions on a synthetic trace with
+   map_size bytes of which density are hit, hash64(), rand_below(), every
+   havoc mutation of afl_mutate() on its own, and the queue upkeep
+   (weight tree and cull_queue()) over a synthetic queue.
+
+   The results are appended to benchmark-results.jsonl in the format of
+   benchmark.py, with a "microbench" object in place of "targets", so that
+   regressions of afl-fuzz's own per exec cost can be told apart from the
+   target's speed. See benchmark/README.md.
+
+ */
+
+#include "afl-fuzz.h"
+#include "afl-mutations.h"
+
+#include <getopt.h>
+#include <sys/utsname.h>
+#include <time.h>
+
+#define MB_QUEUE_SIZE 1000
+#define MB_INPUT_LEN 1024
+#define MB_BUDGET_MS 200
+
+static afl_state_t *afl;
+static u8          *trace, *simple, *input, *orig;
+static u32          input_len, splice_len, max_len;
+static volatile u64 sink;
+
+static u64 ns_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* A trace with density of the map_size bytes hit, most of them once, some
+   of them a lot, like the counters of a real run. */
+
+static void fill_trace(u8 *mem, u32 map_size, double density) {
+  u32 i;
+
+  memset(mem, 0, map_size);
+
+  for (i = 0; i < map_size; ++i) {
+    if (rand_next_percent(afl) >= density) { continue; }
+
+    switch (rand_below(afl, 4)) {
+      case 0:
+      case 1:
+        mem[i] = 1;
+        break;
+      case 2:
+        mem[i] = 2 + rand_below(afl, 8);
+        break;
+      default:
+        mem[i] = 1 + rand_below(afl, 255);
+        break;
+    }
+  }
+}
+
+static void run_classify_counts(u64 n) {
+  while (n--) {
+    classify_counts(&afl->fsrv);
+  }
+}
+
+static void run_has_new_bits(u64 n) {
+  while (n--) {
+    sink += has_new_bits(afl, afl->virgin_bits);
+  }
+}
+
+static void run_simplify_trace(u64 n) {
+  while (n--) {
+    simplify_trace(afl, simple);
+  }
+}
+
+static void run_count_bytes(u64 n) {
+  while (n--) {
+    sink += count_bytes(afl, afl->fsrv.trace_bits);
+  }
+}
+
+static void run_hash64(u64 n) {
+  while (n--) {
+    sink += hash64(afl->fsrv.trace_bits, afl->fsrv.map_size, HASH_CONST);
+  }
+}
+
+static void run_rand_below(u64 n) {
+  while (n--) {
+    sink += rand_below(afl, 1000);
+  }
+}
+
+static void run_create_weight_tree(u64 n) {
+  while (n--) {
+    create_weight_tree(afl);
+  }
+}
+
+static void run_select_next_queue_entry(u64 n) {
+  while (n--) {
+    sink += select_next_queue_entry(afl);
+  }
+}
+
+/* The whole greedy pass, as after a new top_rated[] winner for byte 0. */
+
+static void run_cull_queue(u64 n) {
+  while (n--) {
+    afl->score_changed = 1;
+    afl->cull_from = 0;
+    cull_queue(afl);
+  }
+}
+
+/* One havoc step at a time with whatever op the strategy array was filled
+   with. The input is put back once inserts or deletes moved it far from
+   its original length. */
+
+static void run_afl_mutate(u64 n) {
+  u32 len = input_len;
+
+  while (n--) {
+    len = afl_mutate(afl, input, len, 1, false, true, orig, splice_len,
+                     max_len);
+
+    if (unlikely(len < input_len / 2 || len > input_len * 2)) {
+      memcpy(input, orig, input_len);
+      len = input_len;
+    }
+  }
+
+  memcpy(input, orig, input_len);
+}
+
+/* ns per call of fn, doubling the calls until they take budget_ms. */
+
+static double bench(void (*fn)(u64), u32 budget_ms) {
+  u64 n = 1, start, took;
+
+  while (1) {
+    start = ns_now();
+    fn(n);
+    took = ns_now() - start;
+
+    if (took >= (u64)budget_ms * 1000000ULL || n >= (1ULL << 40)) {
+      return (double)took / n;
+    }
+
+    n <<= 1;
+  }
+}
+
+static void build_queue(u32 queue_size, double density, u8 *out_dir) {
+  u32  i, map_size = afl->fsrv.map_size;
+  char fn[PATH_MAX];
+
+  snprintf(fn, sizeof(fn), "%s/queue", out_dir);
+  if (mkdir(fn, 0700)) { PFATAL("Unable to create '%s'", fn); }
+  snprintf(fn, sizeof(fn), "%s/queue/.state", out_dir);
+  if (mkdir(fn, 0700)) { PFATAL("Unable to create '%s'", fn); }
+
+  afl->out_dir = out_dir;
+  afl->fsrv.trace_bits = ck_alloc(map_size);
+
+  for (i = 0; i < queue_size; ++i) {
+    add_to_queue(afl, alloc_printf("%s/queue/id:%06u", out_dir, i),
+                 1 + rand_below(afl, MB_INPUT_LEN), 0);
+
+    struct queue_entry *q = afl->queue_buf[i];
+
+    /* each entry covers a share of the map and a byte of its own */
+
+    fill_trace(afl->fsrv.trace_bits, map_size, density / 4);
+    afl->fsrv.trace_bits[rand_below(afl, map_size)] = 1;
+    classify_counts(&afl->fsrv);
+
+    q->exec_us = 50 + rand_below(afl, 1000);
+    q->bitmap_size = count_bytes(afl, afl->fsrv.trace_bits) + 1;
+    q->was_fuzzed = rand_below(afl, 2);
+
+    afl->total_cal_us += q->exec_us;
+    afl->total_cal_cycles += 1;
+    afl->total_bitmap_size += q->bitmap_size;
+    afl->total_bitmap_entries += 1;
+
+    update_bitmap_score(afl, q);
+  }
+
+  cull_queue(afl);
+  create_weight_tree(afl);
+}
+
+static void remove_out_dir(u8 *out_dir) {
+  char fn[PATH_MAX];
+
+  snprintf(fn, sizeof(fn), "%s/queue/.state/flags", out_dir);
+  unlink(fn);
+  snprintf(fn, sizeof(fn), "%s/queue/.state", out_dir);
+  rmdir(fn);
+  snprintf(fn, sizeof(fn), "%s/queue", out_dir);
+  rmdir(fn);
+  rmdir((char *)out_dir);
+}
+
+/* The first value of a "key : value" line of /proc/cpuinfo, or the largest
+   one if max is set. */
+
+static double cpuinfo(const char *key, u8 *str, size_t len, u8 max) {
+  FILE  *f = fopen("/proc/cpuinfo", "r");
+  char   line[256], *val;
+  double best = 0;
+
+  if (str) { str[0] = 0; }
+  if (!f) { return 0; }
+
+  while (fgets(line, sizeof(line), f)) {
+    if (strncmp(line, key, strlen(key)) || !(val = strchr(line, ':'))) {
+      continue;
+    }
+
+    val += 1 + (val[1] == ' ');
+    val[strcspn(val, "\n")] = 0;
+
+    if (str) {
+      snprintf((char *)str, len, "%s", val);
+      break;
+    }
+
+    if (atof(val) > best) { best = atof(val); }
+    if (!max) { break; }
+  }
+
+  fclose(f);
+  return best;
+}
+
+static u8 file_has(const char *fn, const char *what) {
+  char buf[4096];
+  s32  fd = open(fn, O_RDONLY);
+  s32  len;
+
+  if (fd < 0) { return 0; }
+  len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (len <= 0) { return 0; }
+  buf[len] = 0;
+
+  return !!strstr(buf, what);
+}
+
+static void json_str(FILE *f, const char *s) {
+  fputc('"', f);
+
+  for (; *s; ++s) {
+    if (*s == '"' || *s == '\\') {
+      fprintf(f, "\\%c", *s);
+    } else if ((u8)*s < 0x20) {
+      fprintf(f, "\\u%04x", (u8)*s);
+    } else {
+      fputc(*s, f);
+    }
+  }
+
+  fputc('"', f);
+}
+
+static const char *mut_names[MUT_MAX] = {
+    "flipbit",          "interesting8",     "interesting16",
+    "interesting16be",  "interesting32",    "interesting32be",
+    "arith8_",          "arith8",           "arith16_",
+    "arith16be_",       "arith16",          "arith16be",
+    "arith32_",         "arith32be_",       "arith32",
+    "arith32be",        "rand8",            "clone_copy",
+    "clone_fixed",      "overwrite_copy",   "overwrite_fixed",
+    "byteadd",          "bytesub",          "flip8",
+    "switch",           "del",              "shuffle",
+    "delone",           "insertone",        "asciinum",
+    "insertasciinum",   "extra_overwrite",  "extra_insert",
+    "auto_extra_overwrite", "auto_extra_insert", "splice_overwrite",
+    "splice_insert"};
+
+struct result {
+  char   name[64];
+  double ns;
+
+};
+
+static void usage(u8 *argv0) {
+  SAYF(
+      "\n%s [ options ]\n\n"
+
+      "  -m size    - map size in bytes (default: %u)\n"
+      "  -d density - share of the map hit per run, 0..1 (default: 0.05)\n"
+      "  -q entries - entries of the synthetic queue (default: %u)\n"
+      "  -l len     - length of the input to mutate (default: %u)\n"
+      "  -t msec    - time spent on each function (default: %u)\n"
+      "  -s seed    - random seed (default: 0)\n"
+      "  -c text    - comment for the results\n"
+      "  -o file    - append the results to file\n"
+      "               (default: benchmark-results.jsonl, - for none)\n\n",
+      argv0, MAP_SIZE, MB_QUEUE_SIZE, MB_INPUT_LEN, MB_BUDGET_MS);
+
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  u32            map_size = MAP_SIZE, queue_size = MB_QUEUE_SIZE;
+  u32            budget_ms = MB_BUDGET_MS, i, j, res_cnt = 0;
+  double         density = 0.05;
+  s64            seed = 0;
+  u8            *comment = (u8 *)"", *out_file = (u8 *)"benchmark-results.jsonl";
+  u8             cpu_model[256], out_dir[] = "/tmp/.afl-microbench-XXXXXX";
+  u32            saved[MUT_STRATEGY_ARRAY_SIZE];
+  struct result  res[16 + MUT_MAX];
+  struct utsname uts;
+  s32            opt;
+
+  input_len = MB_INPUT_LEN;
+
+  while ((opt = getopt(argc, argv, "m:d:q:l:t:s:c:o:h")) > 0) {
+    switch (opt) {
+      case 'm':
+        map_size = strtoul(optarg, NULL, 0);
+        if (map_size < 64 || map_size % 64) {
+          FATAL("-m needs a multiple of 64");
+        }
+
+        break;
+      case 'd':
+        density = atof(optarg);
+        if (density <= 0 || density > 1) { FATAL("-d needs 0 < density <= 1"); }
+        break;
+      case 'q':
+        queue_size = strtoul(optarg, NULL, 0);
+        if (!queue_size) { FATAL("-q needs at least one entry"); }
+        break;
+      case 'l':
+        input_len = strtoul(optarg, NULL, 0);
+        if (input_len < 16) { FATAL("-l needs at least 16 bytes"); }
+        break;
+      case 't':
+        budget_ms = strtoul(optarg, NULL, 0);
+        break;
+      case 's':
+        seed = strtoll(optarg, NULL, 0);
+        break;
+      case 'c':
+        comment = (u8 *)optarg;
+        break;
+      case 'o':
+        out_file = (u8 *)optarg;
+        break;
+      default:
+        usage((u8 *)argv[0]);
+    }
+  }
+
+  afl = calloc(1, sizeof(afl_state_t));
+  if (!afl) { PFATAL("calloc"); }
+
+  afl_state_init(afl, map_size);
+  afl->fsrv.real_map_size = map_size;
+  init_classify_kernel();
+  select_map_kernels(afl);
+  afl->fixed_seed = 1;  // same maps and queue for the same seed
+  rand_set_seed(afl, seed);
+
+  /* the bitmap functions: one trace, seen before as in most runs */
+
+  trace = ck_alloc(map_size);
+  simple = ck_alloc(map_size);
+  fill_trace(trace, map_size, density);
+
+  if (!mkdtemp((char *)out_dir)) { PFATAL("mkdtemp"); }
+  build_queue(queue_size, density, out_dir);
+
+  memcpy(afl->fsrv.trace_bits, trace, map_size);
+  memcpy(simple, trace, map_size);
+  memset(afl->virgin_bits, 255, map_size);
+  classify_counts(&afl->fsrv);
+  has_new_bits(afl, afl->virgin_bits);
+
+#define BENCH(fn)                                                    \
+  do {                                                               \
+    snprintf(res[res_cnt].name, sizeof(res[res_cnt].name), "%s", #fn); \
+    res[res_cnt++].ns = bench(run_##fn, budget_ms);                  \
+  } while (0)
+
+  BENCH(classify_counts);
+  BENCH(has_new_bits);
+  BENCH(simplify_trace);
+  BENCH(count_bytes);
+  BENCH(hash64);
+  BENCH(rand_below);
+  BENCH(create_weight_tree);
+  BENCH(select_next_queue_entry);
+  BENCH(cull_queue);
+
+  /* afl_mutate: an input with some ASCII numbers, a dictionary and a
+     splice partner, so that no op has to fall back to another one */
+
+  max_len = input_len * 3 + HAVOC_BLK_XL;
+  input = ck_alloc(max_len);
+  orig = ck_alloc(max_len);
+  splice_len = input_len;
+
+  for (i = 0; i < input_len; ++i) {
+    input[i] = i % 16 ? rand_below(afl, 256) : '0' + rand_below(afl, 10);
+  }
+
+  memcpy(orig, input, input_len);
+
+  afl->max_det_extras = MAX_DET_EXTRAS;
+  add_extra(afl, (u8 *)"GET ", 4);
+  add_extra(afl, (u8 *)"Content-Length", 14);
+  add_extra(afl, (u8 *)"\xff\xd8\xff\xe0", 4);
+  maybe_add_auto(afl, (u8 *)"IHDR", 4);
+  maybe_add_auto(afl, (u8 *)"<html>", 6);
+
+  memcpy(saved, mutation_strategy_exploration_binary, sizeof(saved));
+
+  for (i = 0; i < MUT_MAX; ++i) {
+    for (j = 0; j < MUT_STRATEGY_ARRAY_SIZE; ++j) {
+      mutation_strategy_exploration_binary[j] = i;
+    }
+
+    snprintf(res[res_cnt].name, sizeof(res[res_cnt].name), "afl_mutate_%s",
+             mut_names[i]);
+    res[res_cnt++].ns = bench(run_afl_mutate, budget_ms);
+  }
+
+  memcpy(mutation_strategy_exploration_binary, saved, sizeof(saved));
+
+  snprintf(res[res_cnt].name, sizeof(res[res_cnt].name), "afl_mutate");
+  res[res_cnt++].ns = bench(run_afl_mutate, budget_ms);
+
+  remove_out_dir(out_dir);
+
+  SAYF(cCYA "afl-microbench" VERSION cRST
+            " map_size %u, density %.3f, queue %u, input %u bytes\n\n",
+       map_size, density, queue_size, input_len);
+
+  for (i = 0; i < res_cnt; ++i) {
+    SAYF("  %-32s %12.2f ns\n", res[i].name, res[i].ns);
+  }
+
+  if (!strcmp((char *)out_file, "-")) { return 0; }
+
+  FILE *f = fopen((char *)out_file, "a");
+  if (!f) { PFATAL("Unable to open '%s'", out_file); }
+
+  uname(&uts);
+  cpuinfo("model name", cpu_model, sizeof(cpu_model), 0);
+
+  fprintf(f,
+          "{\"config\": {\"afl_persistent_config\": %s, "
+          "\"afl_system_config\": %s, \"afl_version\": \"%s\", \"comment\": ",
+          file_has("/proc/cmdline", "mitigations=off") ? "true" : "false",
+          file_has("/proc/sys/kernel/randomize_va_space", "0") ? "true"
+                                                               : "false",
+          VERSION);
+  json_str(f, (char *)comment);
+  fprintf(f, ", \"compiler\": ");
+  json_str(f, __VERSION__);
+  fprintf(f, ", \"target_arch\": ");
+  json_str(f, uts.machine);
+  fprintf(f,
+          "}, \"hardware\": {\"cpu_fastest_core_mhz\": %.3f, \"cpu_model\": ",
+          cpuinfo("cpu MHz", NULL, 0, 1));
+  json_str(f, (char *)cpu_model);
+  fprintf(f,
+          ", \"cpu_threads\": %ld}, \"microbench\": {\"density\": %g, "
+          "\"input_len\": %u, \"map_size\": %u, \"ns_per_op\": {",
+          sysconf(_SC_NPROCESSORS_ONLN), density, input_len, map_size);
+
+  for (i = 0; i < res_cnt; ++i) {
+    fprintf(f, "%s\"%s\": %.2f", i ? ", " : "", res[i].name, res[i].ns);
+  }
+
+  fprintf(f, "}, \"queue_size\": %u}}\n", queue_size);
+  fclose(f);
+
+  OKF("Results have been appended to %s.", out_file);
+  return 0;
+}
@@ -0,0 +1,254 @@
+#!/usr/bin/env python3
+# Part of the aflplusplus project, requires Python 3.8+.
+#
+# Throughput regression check: builds the test-instr harnesses and the compcov and cmplog test targets in every
+# instrumentation mode that is available (PCGUARD, LTO, cmplog, FRIDA, QEMU), fuzzes each of them for a fixed time
+# with a fixed seed and compares execs/s and the share of time afl-fuzz spent outside the target with the last
+# baseline of this CPU in benchmark/benchmark-results.jsonl. Exits with 1 if a run regressed beyond the thresholds,
+# with 2 if nothing could be run. --save appends the results as the new baseline.
+import argparse, json, os, platform, shutil, statistics, subprocess, sys
+from dataclasses import asdict, dataclass, field
+from pathlib import Path
+from typing import Dict, List, Optional
+
+blue = lambda text: f"\033[1;94m{text}\033[0m";
+gray = lambda text: f"\033[1;90m{text}\033[0m"
+green = lambda text: f"\033[0;32m{text}\033[0m";
+red = lambda text: f"\033[0;31m{text}\033[0m"
+yellow = lambda text: f"\033[0;33m{text}\033[0m"
+
+root = Path(__file__).resolve().parent.parent
+
+
+@dataclass
+class Mode:
+    name: str
+    needs: str  # file in the AFL++ directory the mode cannot work without
+    cc: Optional[str]  # compiler in the AFL++ directory, None for a plain cc build of a binary-only mode
+    cc_env: Dict[str, str] = field(default_factory=dict)
+    fuzz_args: List[str] = field(default_factory=list)
+    cmplog: bool = False  # fuzz with -c and a second, AFL_LLVM_CMPLOG=1 build
+
+
+@dataclass
+class Target:
+    name: str
+    source: Path
+    binary_only: bool  # also works without afl-cc, for FRIDA and QEMU
+
+
+@dataclass
+class Result:
+    execs_per_sec: float  # the median of the runs
+    overhead: float  # 100 - time_target, averaged over the runs
+    shares: Dict[str, float]  # the time_* shares of fuzzer_stats, averaged over the runs
+    runs: int
+
+
+all_modes = [
+    Mode("pcguard", "SanitizerCoveragePCGUARD.so", "afl-clang-fast", {"AFL_LLVM_INSTRUMENT": "PCGUARD"}),
+    Mode("lto", "SanitizerCoverageLTO.so", "afl-clang-lto"),
+    Mode("cmplog", "cmplog-routines-pass.so", "afl-clang-fast", cmplog=True),
+    Mode("frida", "afl-frida-trace.so", None, fuzz_args=["-O"]),
+    Mode("qemu", "afl-qemu-trace", None, fuzz_args=["-Q"]),
+]
+all_targets = [
+    Target("test-instr", root / "test-instr.c", True),
+    Target("test-instr-persist-shmem", root / "utils/persistent_mode/test-instr.c", False),
+    Target("test-compcov", root / "test/test-compcov.c", True),
+    Target("test-cmplog", root / "test/test-cmplog.c", False),
+]
+env_vars = {
+    "AFL_DISABLE_TRIM": "1", "AFL_I_DONT_CARE_ABOUT_MISSING_CRASHES": "1", "AFL_FAST_CAL": "1", "AFL_NO_UI": "1",
+    "AFL_SKIP_CPUFREQ": "1", "AFL_TRY_AFFINITY": "1", "AFL_PATH": str(root), "PATH": os.environ["PATH"],
+}
+
+parser = argparse.ArgumentParser(formatter_class=argparse.ArgumentDefaultsHelpFormatter)
+parser.add_argument("-b", "--basedir", help="directory to use for temp files", type=str,
+                    default="/tmp/aflpp-perf-regression")
+parser.add_argument("-d", "--debug", help="show verbose debugging output", action="store_true")
+parser.add_argument("-r", "--runs", help="runs per target, the median execs/s counts", type=int, default=3)
+parser.add_argument("-s", "--seconds", help="duration of each run", type=int, default=10)
+parser.add_argument("--seed", help="afl-fuzz -s seed of each run", type=int, default=123)
+parser.add_argument("-m", "--mode", help="pick modes (default: all that are built)", action="append",
+                    choices=[m.name for m in all_modes])
+parser.add_argument("-t", "--target", help="pick targets (default: all)", action="append",
+                    choices=[t.name for t in all_targets])
+parser.add_argument("--threshold", help="execs/s drop in percent that counts as a regression", type=float,
+                    default=10.0)
+parser.add_argument("--overhead-threshold",
+                    help="growth in percentage points of the afl-fuzz share of the time that counts as a regression",
+                    type=float, default=5.0)
+parser.add_argument("--results", help="the benchmark results with the baselines", type=str,
+                    default=str(root / "benchmark/benchmark-results.jsonl"))
+parser.add_argument("--save", help="append the results to --results as the new baseline", action="store_true")
+parser.add_argument("-c", "--comment", help="add a comment about your setup", type=str, default="")
+args = parser.parse_args()
+
+debug = lambda text: args.debug and print(blue(text))
+
+
+def run_command(cmd: List[str], env: Dict[str, str]) -> subprocess.CompletedProcess:
+    debug(f"Launching command: {cmd} with env {env}")
+    p = subprocess.run(cmd, env=env, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    debug(f"Output: {p.stdout.decode(errors='replace')} {p.stderr.decode(errors='replace')}")
+    return p
+
+
+def colon_values(filename: Path) -> Dict[str, str]:
+    """Return the 'key : value' lines of a file such as fuzzer_stats."""
+    with open(filename, "r") as fh:
+        kv_pairs = (line.split(": ", 1) for line in fh if ": " in line)
+        return {k.rstrip(): v.strip() for k, v in kv_pairs}
+
+
+def cpu_model() -> str:
+    try:
+        return colon_values(Path("/proc/cpuinfo")).get("model name", "")
+    except OSError:
+        return platform.processor()
+
+
+def compile_target(mode: Mode, target: Target, binary: Path, cmplog: bool = False) -> bool:
+    if mode.cc:
+        cmd = [str(root / mode.cc)]
+        env = {**env_vars, **mode.cc_env, **({"AFL_LLVM_CMPLOG": "1"} if cmplog else {})}
+    else:
+        cmd = [os.environ.get("CC", "cc")]
+        env = dict(os.environ)
+    p = run_command(cmd + ["-O2", "-o", str(binary), str(target.source)], env)
+    if p.returncode != 0:
+        print(yellow(f" [-] {mode.name}: compiling {target.name} failed: "
+                     f"{p.stdout.decode(errors='replace')}{p.stderr.decode(errors='replace')}"))
+    return p.returncode == 0
+
+
+def run_fuzzer(mode: Mode, binary: Path, cmplog_binary: Optional[Path], outdir: Path) -> Optional[Dict[str, str]]:
+    """One fixed-duration, fixed-seed campaign, returns the fuzzer_stats."""
+    shutil.rmtree(outdir, ignore_errors=True)
+    cmd = [str(root / "afl-fuzz"), "-i", f"{args.basedir}/in", "-o", str(outdir), "-s", str(args.seed), "-V",
+           str(args.seconds)] + mode.fuzz_args + (["-c", str(cmplog_binary)] if cmplog_binary else []) + [
+              "--", str(binary)]
+    p = run_command(cmd, env_vars)
+    stats = outdir / "default/fuzzer_stats"
+    if not stats.exists():
+        print(red(f"failed:\n{p.stdout.decode(errors='replace')}{p.stderr.decode(errors='replace')}"))
+        return None
+    return colon_values(stats)
+
+
+def measure(mode: Mode, target: Target) -> Optional[Result]:
+    binary = Path(args.basedir) / f"{target.name}.{mode.name}"
+    cmplog_binary = Path(args.basedir) / f"{target.name}.{mode.name}.cmplog" if mode.cmplog else None
+    if not compile_target(mode, target, binary) or (
+            cmplog_binary and not compile_target(mode, target, cmplog_binary, True)):
+        return None
+    execs: List[float] = []
+    shares: List[Dict[str, float]] = []
+    for run_idx in range(0, args.runs):
+        print(gray(f" [*] {mode.name} {target.name} run {run_idx + 1} of {args.runs}, execs/s: "), end="", flush=True)
+        stats = run_fuzzer(mode, binary, cmplog_binary, Path(args.basedir) / f"out-{mode.name}-{target.name}")
+        if stats is None:
+            return None
+        execs.append(float(stats["execs_per_sec"]))
+        shares.append({k: float(v[:-1]) for k, v in stats.items() if k.startswith("time_") and v.endswith("%")})
+        print(green(execs[-1]))
+    avg = {k: round(sum(s.get(k, 0.0) for s in shares) / len(shares), 2) for k in shares[0]}
+    return Result(execs_per_sec=round(statistics.median(execs), 2),
+                  overhead=round(100.0 - avg.get("time_target", 0.0), 2), shares=avg, runs=args.runs)
+
+
+def read_records(filename: str) -> List[dict]:
+    """All records of the results file; the older ones are pretty-printed over several lines."""
+    records: List[dict] = []
+    try:
+        text = Path(filename).read_text()
+    except OSError:
+        return records
+    decoder, pos = json.JSONDecoder(), 0
+    while True:
+        while pos < len(text) and text[pos].isspace():
+            pos += 1
+        if pos >= len(text):
+            return records
+        record, pos = decoder.raw_decode(text, pos)
+        records.append(record)
+
+
+def find_baseline(records: List[dict], cpu: str, key: str) -> Optional[dict]:
+    """The last result for key of a regression run on this CPU with the same duration and seed."""
+    for record in reversed(records):
+        config = record.get("config") or {}
+        if "regression" in record and (record.get("hardware") or {}).get("cpu_model") == cpu and \
+                config.get("seconds") == args.seconds and config.get("seed") == args.seed and \
+                key in record["regression"]:
+            return record["regression"][key]
+    return None
+
+
+def main() -> None:
+    if not os.access(root / "afl-fuzz", os.X_OK):
+        sys.exit(red(" [*] Compile AFL++ first, afl-fuzz is missing."))
+    Path(f"{args.basedir}/in").mkdir(exist_ok=True, parents=True)
+    with open(f"{args.basedir}/in/in", "wb") as seed:
+        seed.write(b"0123456789abcdef")
+
+    modes = [m for m in all_modes if not args.mode or m.name in args.mode]
+    targets = [t for t in all_targets if not args.target or t.name in args.target]
+    results: Dict[str, Result] = {}
+    for mode in modes:
+        if not (root / mode.needs).exists():
+            print(yellow(f" [-] {mode.name} is not compiled, skipping it ({mode.needs} is missing)."))
+            continue
+        for target in targets:
+            if mode.cc is None and not target.binary_only:
+                continue
+            result = measure(mode, target)
+            if result:
+                results[f"{mode.name}/{target.name}"] = result
+
+    if not results:
+        print(red(" [!] No mode could be run, nothing was measured."))
+        sys.exit(2)
+
+    cpu = cpu_model()
+    records = read_records(args.results)
+    regressions = 0
+    print(" [*] mode/target                      | execs/s      | baseline     | change  | afl-fuzz time | baseline")
+    for key, result in results.items():
+        base = find_baseline(records, cpu, key)
+        if base is None:
+            print(f"     {key:34} | {result.execs_per_sec:12.2f} | {'-':>12} | {'-':>7} | "
+                  f"{result.overhead:12.2f}% | -")
+            continue
+        change = (result.execs_per_sec / base["execs_per_sec"] - 1) * 100 if base["execs_per_sec"] else 0.0
+        bad = change < -args.threshold or result.overhead > base["overhead"] + args.overhead_threshold
+        regressions += bad
+        line = f"     {key:34} | {result.execs_per_sec:12.2f} | {base['execs_per_sec']:12.2f} | " \
+               f"{change:+6.1f}% | {result.overhead:12.2f}% | {base['overhead']:.2f}%"
+        print(red(line) if bad else line)
+
+    if args.save:
+        record = {
+            "config": {"afl_version": "", "comment": args.comment, "seconds": args.seconds, "seed": args.seed},
+            "hardware": {"cpu_model": cpu, "cpu_threads": os.cpu_count()},
+            "regression": {k: asdict(v) for k, v in results.items()},
+        }
+        stats = Path(args.basedir) / f"out-{next(iter(results)).replace('/', '-')}" / "default/fuzzer_stats"
+        if stats.exists():
+            record["config"]["afl_version"] = colon_values(stats).get("afl_version", "")
+        with open(args.results, "a") as jsonfile:
+            json.dump(record, jsonfile, sort_keys=True)
+            jsonfile.write("\n")
+        print(blue(f" [*] Results have been written to {args.results} as the new baseline."))
+
+    shutil.rmtree(args.basedir, ignore_errors=True)
+    if regressions:
+        print(red(f" [!] {regressions} of {len(results)} runs regressed by more than {args.threshold}% execs/s or "
+                  f"{args.overhead_threshold} points of afl-fuzz time."))
+        sys.exit(1)
+    print(green(f" [+] No regression in {len(results)} runs."))
+
+
+if __name__ == "__main__":
+    main()
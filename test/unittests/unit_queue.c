@@ -0,0 +1,544 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <assert.h>
+#include <cmocka.h>
+#include <math.h>
+/* cmocka < 1.0 didn't support these features we need */
+#ifndef assert_ptr_equal
+  #define assert_ptr_equal(a, b)                                      \
+    _assert_int_equal(cast_ptr_to_largest_integral_type(a),           \
+                      cast_ptr_to_largest_integral_type(b), __FILE__, \
+                      __LINE__)
+  #define CMUnitTest UnitTest
+  #define cmocka_unit_test unit_test
+  #define cmocka_run_group_tests(t, setup, teardown) run_tests(t)
+#endif
+
+extern void mock_assert(const int result, const char *const expression,
+                        const char *const file, const int line);
+#undef assert
+#define assert(expression) \
+  mock_assert((int)(expression), #expression, __FILE__, __LINE__);
+
+#include "afl-fuzz.h"
+
+/* remap exit -> assert, then use cmocka's mock_assert
+    (compile with `--wrap=exit`) */
+extern void exit(int status);
+extern void __real_exit(int status);
+void        __wrap_exit(int status);
+void        __wrap_exit(int status) {
+  (void)status;
+  assert(0);
+}
+
+/* ignore all printfs */
+#undef printf
+extern int printf(const char *format, ...);
+extern int __real_printf(const char *format, ...);
+int        __wrap_printf(const char *format, ...);
+int        __wrap_printf(const char *format, ...) {
+  (void)format;
+  return 1;
+}
+
+/* afl-fuzz-queue.c is linked on its own, these are the bits of the rest of
+   afl-fuzz it calls */
+
+void minimize_bits(afl_state_t *afl, u8 *dst, u8 *src) {
+  u32 i;
+
+  for (i = 0; i < afl->fsrv.map_size; ++i) {
+    if (src[i]) { dst[i >> 3] |= 1 << (i & 7); }
+  }
+}
+
+void run_afl_custom_queue_new_entry(afl_state_t *afl, struct queue_entry *q,
+                                    u8 *a, u8 *b) {
+  (void)afl;
+  (void)q;
+  (void)a;
+  (void)b;
+}
+
+void custom_meta_free(afl_state_t *afl, struct queue_entry *q) {
+  (void)afl;
+  (void)q;
+}
+
+u64 writer_create(struct writer *w, u8 *fn, u8 *mem, u32 len) {
+  (void)w;
+  (void)fn;
+  (void)mem;
+  (void)len;
+  return 0;
+}
+
+u64 writer_unlink(struct writer *w, u8 *fn) {
+  (void)w;
+  (void)fn;
+  return 0;
+}
+
+void writer_wait(struct writer *w, u64 seq) {
+  (void)w;
+  (void)seq;
+}
+
+/* An empty queue, with an out_dir for the files the queue code keeps
+   there. SEEK weighs entries by perf_score alone, which does not
+   depend on the queue averages of the last rebuild, so incremental and
+   full builds of the weight tree have to agree exactly. */
+
+static afl_state_t *queue_new(u32 map_size) {
+  afl_state_t *afl = ck_alloc(sizeof(afl_state_t));
+  u8          *dir;
+
+  afl->fsrv.map_size = map_size;
+  afl->fsrv.trace_bits = ck_alloc(map_size);
+  afl->top_rated = ck_alloc(map_size * sizeof(struct queue_entry *));
+  afl->havoc_max_mult = HAVOC_MAX_MULT;
+  afl->schedule = SEEK;
+  afl->total_bitmap_size = 100;
+  afl->total_bitmap_entries = 1;
+  afl->trace_mini_fd = -1;
+  afl->state_flags_fd = -1;
+  afl->fixed_seed = 1;
+  rand_set_seed(afl, 1337);
+  n_fuzz_init(afl);
+
+  afl->out_dir = ck_strdup((u8 *)"/tmp/unit_queue.XXXXXX");
+  if (!mkdtemp((char *)afl->out_dir)) { PFATAL("mkdtemp"); }
+
+  dir = alloc_printf("%s/queue", afl->out_dir);
+  if (mkdir((char *)dir, 0700)) { PFATAL("mkdir"); }
+  ck_free(dir);
+  dir = alloc_printf("%s/queue/.state", afl->out_dir);
+  if (mkdir((char *)dir, 0700)) { PFATAL("mkdir"); }
+  ck_free(dir);
+
+  return afl;
+}
+
+static struct queue_entry *queue_add(afl_state_t *afl) {
+  struct queue_entry *q = ck_alloc(sizeof(struct queue_entry));
+
+  q->id = afl->queued_items;
+  q->len = 1 + rand_below(afl, 1024);
+  q->exec_us = 100;
+  q->bitmap_size = 10 + rand_below(afl, 400);
+  q->depth = rand_below(afl, 30);
+  q->fname = alloc_printf("%s/queue/id:%06u", afl->out_dir, q->id);
+
+  afl->queue_buf = afl_realloc((void **)&afl->queue_buf,
+                               (afl->queued_items + 1) * sizeof(void *));
+  if (!afl->queue_buf) { PFATAL("alloc"); }
+  afl->queue_buf[afl->queued_items++] = q;
+
+  return q;
+}
+
+static void queue_free(afl_state_t *afl) {
+  u8 *fn;
+  u32 i;
+
+  for (i = 0; i < afl->queued_items; ++i) {
+    ck_free(afl->queue_buf[i]->fname);
+    ck_free(afl->queue_buf[i]);
+  }
+
+  destroy_trace_mini_arena(afl);
+  if (afl->state_flags_fd >= 0) { close(afl->state_flags_fd); }
+
+  fn = alloc_printf("%s/queue/.state/flags", afl->out_dir);
+  unlink((char *)fn);
+  ck_free(fn);
+  fn = alloc_printf("%s/queue/.state", afl->out_dir);
+  rmdir((char *)fn);
+  ck_free(fn);
+  fn = alloc_printf("%s/queue", afl->out_dir);
+  rmdir((char *)fn);
+  ck_free(fn);
+  rmdir((char *)afl->out_dir);
+
+  afl_free(afl->queue_buf);
+  afl_free(afl->weight_tree);
+  afl_free(afl->weight_leaf);
+  afl_free(afl->pending_fav);
+  ck_free(afl->n_fuzz);
+  ck_free(afl->cull_cover);
+  ck_free(afl->top_rated);
+  ck_free(afl->fsrv.trace_bits);
+  ck_free(afl->out_dir);
+  ck_free(afl);
+}
+
+/* The tree as create_weight_tree() builds it from scratch. */
+
+static void assert_tree_rebuilt(afl_state_t *afl) {
+  u32     n = afl->weight_items, i;
+  double *tree = ck_alloc((n + 1) * sizeof(double));
+
+  memcpy(tree, afl->weight_tree, (n + 1) * sizeof(double));
+  create_weight_tree(afl);
+  assert_int_equal(afl->weight_items, n);
+
+  for (i = 1; i <= n; ++i) {
+    assert_true(fabs(tree[i] - afl->weight_tree[i]) <=
+                1e-9 * fabs(afl->weight_tree[i]));
+  }
+
+  ck_free(tree);
+}
+
+static void test_weight_tree(void **state) {
+  (void)state;
+
+  afl_state_t *afl = queue_new(1024);
+  u32          i;
+
+  for (i = 0; i < 200; ++i) {
+    queue_add(afl);
+  }
+
+  create_weight_tree(afl);
+
+  /* appended in place while under the staleness limit */
+
+  for (i = 0; i < 10; ++i) {
+    queue_add(afl);
+  }
+
+  update_weight_tree(afl);
+  assert_int_equal(afl->weight_items, afl->queued_items);
+  assert_int_equal(afl->weight_updates, 10);
+  assert_tree_rebuilt(afl);
+
+  /* weights changed in place */
+
+  for (i = 0; i < 10; ++i) {
+    struct queue_entry *q = afl->queue_buf[rand_below(afl, afl->queued_items)];
+
+    q->favored = !q->favored;
+    q->depth = rand_below(afl, 30);
+    update_queue_weight(afl, q);
+  }
+
+  assert_false(afl->reinit_table);
+  assert_tree_rebuilt(afl);
+
+  /* one more than the limit and the next update_weight_tree() rebuilds */
+
+  for (i = 0; i < afl->weight_items / WEIGHT_STALE_DIV; ++i) {
+    update_queue_weight(afl, afl->queue_buf[i]);
+  }
+
+  assert_false(afl->reinit_table);
+  update_queue_weight(afl, afl->queue_buf[i]);
+  assert_true(afl->reinit_table);
+  update_weight_tree(afl);
+  assert_false(afl->reinit_table);
+  assert_int_equal(afl->weight_updates, 0);
+
+  queue_free(afl);
+}
+
+static void test_weight_disabled(void **state) {
+  (void)state;
+
+  afl_state_t *afl = queue_new(1024);
+  u32          i;
+
+  for (i = 0; i < 300; ++i) {
+    queue_add(afl)->disabled = !(i % 3);
+  }
+
+  create_weight_tree(afl);
+
+  /* one disabled in place, and the last ones appended disabled */
+
+  afl->queue_buf[1]->disabled = 1;
+  update_queue_weight(afl, afl->queue_buf[1]);
+
+  for (i = 0; i < 4; ++i) {
+    queue_add(afl)->disabled = 1;
+  }
+
+  update_weight_tree(afl);
+
+  for (i = 0; i < 100000; ++i) {
+    u32 id = select_next_queue_entry(afl);
+
+    assert_true(id < afl->queued_items);
+    assert_false(afl->queue_buf[id]->disabled);
+  }
+
+  queue_free(afl);
+}
+
+static void test_weight_frequencies(void **state) {
+  (void)state;
+
+  afl_state_t *afl = queue_new(1024);
+  u32          cnt[64] = {0}, draws = 400000, i;
+  double       sum = 0;
+
+  for (i = 0; i < 60; ++i) {
+    queue_add(afl);
+  }
+
+  create_weight_tree(afl);
+
+  for (i = 0; i < 4; ++i) {
+    queue_add(afl);
+  }
+
+  update_weight_tree(afl);
+  assert_int_equal(afl->weight_updates, 4);
+
+  for (i = 0; i < draws; ++i) {
+    ++cnt[select_next_queue_entry(afl)];
+  }
+
+  for (i = 0; i < 64; ++i) {
+    sum += afl->weight_leaf[i];
+  }
+
+  /* within five standard deviations of the binomial */
+
+  for (i = 0; i < 64; ++i) {
+    double p = afl->weight_leaf[i] / sum;
+
+    assert_true(fabs(cnt[i] - draws * p) <=
+                5 * sqrt(draws * p * (1 - p)) + 1);
+  }
+
+  queue_free(afl);
+}
+
+/* The favored set of the full greedy pass over the map, as cull_queue()
+   made it before it became incremental. */
+
+static void cull_full(afl_state_t *afl, u8 *want) {
+  u32 len = afl->fsrv.map_size >> 3, i, j;
+  u8 *temp_v = ck_alloc(len);
+
+  memset(temp_v, 255, len);
+  memset(want, 0, afl->queued_items);
+
+  for (i = 0; i < afl->fsrv.map_size; ++i) {
+    struct queue_entry *q = afl->top_rated[i];
+
+    if (q && (temp_v[i >> 3] & (1 << (i & 7)))) {
+      u8 *mini = get_trace_mini(afl, q);
+
+      for (j = 0; j < len; ++j) {
+        temp_v[j] &= ~mini[j];
+      }
+
+      want[q->id] = 1;
+    }
+  }
+
+  ck_free(temp_v);
+}
+
+static void test_cull_incremental(void **state) {
+  (void)state;
+
+  afl_state_t *afl = queue_new(1024);
+  u8           want[600];
+  u32          i, j, culls = 0;
+
+  for (i = 0; i < 600; ++i) {
+    struct queue_entry *q = queue_add(afl);
+    u32                 base = rand_below(afl, 1024);
+    u32                 favored = 0;
+
+    /* mostly edges close to each other, like paths sharing most of them */
+
+    memset(afl->fsrv.trace_bits, 0, afl->fsrv.map_size);
+
+    for (j = 1 + rand_below(afl, 24); j; --j) {
+      afl->fsrv.trace_bits[(base + rand_below(afl, 64)) % 1024] = 1;
+    }
+
+    afl->fsrv.trace_bits[rand_below(afl, 1024)] = 1;
+    update_bitmap_score(afl, q);
+
+    /* a few new entries between two culls at times */
+
+    if (rand_below(afl, 3)) { continue; }
+
+    cull_queue(afl);
+    cull_full(afl, want);
+    ++culls;
+
+    for (j = 0; j < afl->queued_items; ++j) {
+      struct queue_entry *e = afl->queue_buf[j];
+
+      assert_int_equal(e->favored, want[j]);
+      favored += e->favored;
+    }
+
+    assert_int_equal(afl->queued_favored, favored);
+  }
+
+  assert_true(culls > 100);
+
+  queue_free(afl);
+}
+
+/* A miss that finds the limit reached with buffers pooled releases those
+   before it evicts any cached entry. */
+
+static void test_testcase_pool(void **state) {
+  (void)state;
+
+  afl_state_t *afl = queue_new(1024);
+  u8           mem[2048] = {0};
+  u32          i;
+  s32          fd;
+
+  afl->q_testcase_max_cache_size = 5120;
+  afl->q_testcase_max_cache_entries = 16;
+  afl->q_testcase_cache = ck_alloc(16 * sizeof(struct queue_entry *));
+
+  /* three entries of 1k, the last trimmed to 64 bytes leaves 1k pooled */
+
+  for (i = 0; i < 3; ++i) {
+    struct queue_entry *q = queue_add(afl);
+
+    q->len = 1024;
+    queue_testcase_store_mem(afl, q, mem);
+  }
+
+  afl->queue_buf[2]->len = 64;
+  queue_testcase_retake_mem(afl, afl->queue_buf[2],
+                            afl->queue_buf[2]->testcase_buf, 64, 1024);
+
+  assert_int_equal(afl->q_testcase_cache_count, 3);
+  assert_int_equal(afl->q_testcase_cache_size, 2112);
+  assert_int_equal(afl->q_testcase_pool_size, 1024);
+
+  /* a 2k miss does not fit next to the pooled buffer, but without it */
+
+  struct queue_entry *q = queue_add(afl);
+
+  q->len = 2048;
+  fd = open((char *)q->fname, O_WRONLY | O_CREAT | O_EXCL, 0600);
+  assert_true(fd >= 0);
+  ck_write(fd, mem, q->len, q->fname);
+  close(fd);
+
+  assert_non_null(queue_testcase_get(afl, q));
+  assert_int_equal(afl->q_testcase_evictions, 0);
+  assert_int_equal(afl->q_testcase_cache_count, 4);
+  assert_int_equal(afl->q_testcase_pool_size, 0);
+  assert_int_equal(afl->q_testcase_cache_size, 4160);
+
+  for (i = 0; i < afl->queued_items; ++i) {
+    assert_non_null(afl->queue_buf[i]->testcase_buf);
+    free(afl->queue_buf[i]->testcase_buf);
+  }
+
+  unlink((char *)q->fname);
+  ck_free(afl->q_testcase_cache);
+  queue_free(afl);
+}
+
+/* Keys that all start probing at the same slot. */
+
+static void test_n_fuzz_collisions(void **state) {
+  (void)state;
+
+  afl_state_t *afl = ck_alloc(sizeof(afl_state_t));
+  u64          miss = (1000ULL << 32) | 7;
+  u32          i, j;
+
+  n_fuzz_init(afl);
+
+  for (i = 0; i < 100; ++i) {
+    n_fuzz_add(afl, ((u64)(i + 1) << 32) | 7);
+  }
+
+  for (i = 0; i < 100; ++i) {
+    for (j = 0; j < i; ++j) {
+      n_fuzz_hit(afl, ((u64)(i + 1) << 32) | 7);
+    }
+  }
+
+  for (i = 0; i < 100; ++i) {
+    assert_int_equal(n_fuzz_hits(afl, ((u64)(i + 1) << 32) | 7), i + 1);
+  }
+
+  /* paths that are not queued are neither counted nor added */
+
+  n_fuzz_hit(afl, miss);
+  n_fuzz_set(afl, miss, 5);
+  assert_int_equal(n_fuzz_hits(afl, miss), 0);
+  n_fuzz_add(afl, 0);
+  assert_int_equal(n_fuzz_hits(afl, 0), 0);
+  assert_int_equal(afl->n_fuzz_count, 100);
+
+  /* a new entry on a known path starts over, hits saturate */
+
+  n_fuzz_add(afl, (50ULL << 32) | 7);
+  assert_int_equal(n_fuzz_hits(afl, (50ULL << 32) | 7), 1);
+  n_fuzz_set(afl, (60ULL << 32) | 7, 0xFFFFFFFF);
+  n_fuzz_hit(afl, (60ULL << 32) | 7);
+  assert_int_equal(n_fuzz_hits(afl, (60ULL << 32) | 7), 0xFFFFFFFF);
+  assert_int_equal(afl->n_fuzz_count, 100);
+
+  ck_free(afl->n_fuzz);
+  ck_free(afl);
+}
+
+static void test_n_fuzz_grow(void **state) {
+  (void)state;
+
+  afl_state_t *afl = ck_alloc(sizeof(afl_state_t));
+  u32          cnt = 3 * N_FUZZ_SIZE_INIT, i;
+
+  n_fuzz_init(afl);
+
+  for (i = 0; i < cnt; ++i) {
+    u64 cksum = hash64((u8 *)&i, sizeof(i), HASH_CONST);
+
+    n_fuzz_add(afl, cksum);
+    n_fuzz_set(afl, cksum, i + 1);
+  }
+
+  assert_int_equal(afl->n_fuzz_count, cnt);
+  assert_int_equal(afl->n_fuzz_size & (afl->n_fuzz_size - 1), 0);
+  assert_true((u64)afl->n_fuzz_count * 4 <= (u64)afl->n_fuzz_size * 3);
+
+  for (i = 0; i < cnt; ++i) {
+    u64 cksum = hash64((u8 *)&i, sizeof(i), HASH_CONST);
+
+    assert_int_equal(n_fuzz_hits(afl, cksum), i + 1);
+  }
+
+  ck_free(afl->n_fuzz);
+  ck_free(afl);
+}
+
+int main(int argc, char **argv) {
+  (void)argc;
+  (void)argv;
+
+  const struct CMUnitTest tests[] = {cmocka_unit_test(test_weight_tree),
+                                     cmocka_unit_test(test_weight_disabled),
+                                     cmocka_unit_test(test_weight_frequencies),
+                                     cmocka_unit_test(test_cull_incremental),
+                                     cmocka_unit_test(test_testcase_pool),
+                                     cmocka_unit_test(test_n_fuzz_collisions),
+                                     cmocka_unit_test(test_n_fuzz_grow)};
+
+  // return cmocka_run_group_tests (tests, setup, teardown);
+  __real_exit(cmocka_run_group_tests(tests, NULL, NULL));
+
+  // fake return for dumb compilers
+  return 0;
+}
@@ -49,6 +49,7 @@ static void test_rand_0(void **state) {
   (void)state;
 
   afl_state_t afl = {0};
+  afl.fixed_seed = 1;  // fd 0 is not /dev/urandom
   rand_set_seed(&afl, 0);
 
   /* give this one chance to retry */
@@ -70,12 +71,57 @@ static void test_rand_below(void **state) {
   assert_int_equal(rand_below(&afl, 1), 0);
 }
 
+/* The block generator is RAND_LANES scalar xoshiro256** side by side,
+   each block handed out from the top down */
+static u64 xoshiro_next(u64 *s) {
+  u64 r = s[1] * 5, t = s[1] << 17;
+
+  r = ((r << 7) | (r >> 57)) * 9;
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = (s[3] << 45) | (s[3] >> 19);
+  return r;
+}
+
+static void test_rand_block(void **state) {
+  (void)state;
+
+  static afl_state_t afl;
+  u64                lane[RAND_LANES][4], want[RAND_BLOCK_WORDS];
+  u32                b, i, l;
+
+  afl.fixed_seed = 1;
+  rand_set_seed(&afl, 1337);
+
+  for (l = 0; l < RAND_LANES; ++l) {
+    for (i = 0; i < 4; ++i) {
+      lane[l][i] = afl.rand_lane[i][l];
+    }
+  }
+
+  for (b = 0; b < 3; ++b) {
+    for (i = 0; i < RAND_BLOCK_WORDS; i += RAND_LANES) {
+      for (l = 0; l < RAND_LANES; ++l) {
+        want[i + l] = xoshiro_next(lane[l]);
+      }
+    }
+
+    for (i = RAND_BLOCK_WORDS; i > 0; --i) {
+      assert_int_equal(rand_next(&afl), (AFL_RAND_RETURN)want[i - 1]);
+    }
+  }
+}
+
 int main(int argc, char **argv) {
   (void)argc;
   (void)argv;
 
   const struct CMUnitTest tests[] = {cmocka_unit_test(test_rand_0),
-                                     cmocka_unit_test(test_rand_below)};
+                                     cmocka_unit_test(test_rand_below),
+                                     cmocka_unit_test(test_rand_block)};
 
   // return cmocka_run_group_tests (tests, setup, teardown);
   __real_exit(cmocka_run_group_tests(tests, NULL, NULL));
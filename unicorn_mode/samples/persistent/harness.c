@@ -6,6 +6,7 @@
    the argv buffer (handed in as first parameter), and executes 'main()'.
    Any crashes during emulation will automatically be handled by the afl-fuzz()
    function.
+   Between runs, only the guest pages written to are reset, see snapshot.h.
 
    Run under AFL as follows:
 
@@ -33,6 +34,8 @@
 #include <unicorn/unicorn.h>
 #include <unicornafl/unicornafl.h>
 
+#include "snapshot.h"
+
 // Path to the file containing the binary to emulate
 #define BINARY_FILE ("persistent_target_x86_64")
 
@@ -142,6 +145,9 @@ static bool place_input_callback(uc_engine *uc, char *input, size_t input_len,
 #endif
 
   // For persistent mode, we have to set up stack and memory each time.
+  // Only the pages the last run wrote to are copied back.
+  snapshot_restore(data);
+
   uc_reg_write(uc, UC_X86_REG_RIP,
                &CODE_ADDRESS);  // Set the instruction pointer back
   // Set up the function parameters accordingly RSI, RDI (see calling
@@ -262,6 +268,12 @@ int main(int argc, char **argv, char **envp) {
   uc_hook_add(uc, &strlen_hook, UC_HOOK_CODE, hook_strlen, NULL,
               strlen_hook_pos, strlen_hook_pos);
 
+  // Remember the writable memory as it is now, to reset it after each run
+  snapshot_t *snap = snapshot_new(uc);
+  snapshot_add(snap, BASE_ADDRESS, pad(len));
+  snapshot_add(snap, STACK_ADDRESS - STACK_SIZE, STACK_SIZE);
+  snapshot_take(snap);
+
   printf("Starting to fuzz :)\n");
   fflush(stdout);
 
@@ -279,7 +291,7 @@ int main(int argc, char **argv, char **envp) {
       false,  // true, if the optional callback should be run also for
               // non-crashes
       1000,   // For persistent mode: How many rounds to run
-      NULL    // additional data pointer
+      snap    // additional data pointer
   );
   switch (afl_ret) {
     case UC_AFL_RET_ERROR:
@@ -292,5 +304,6 @@ int main(int argc, char **argv, char **envp) {
     default:
       break;
   }
+  snapshot_free(snap);
   return 0;
 }
@@ -0,0 +1,219 @@
+/*
+   Dirty page snapshots for unicornafl persistent harnesses.
+
+   Resetting the guest with uc_mem_write() for every region after each run
+   makes harnesses with large RAM images spend most of their time copying
+   memory that was never touched. Instead, register the writable regions
+   once with snapshot_add(), call snapshot_take() when the guest is set up,
+   and snapshot_restore() at the start of each place_input callback. A
+   UC_HOOK_MEM_WRITE hook on each region marks the pages the guest wrote to,
+   and only these are copied back, together with the registers.
+
+   Writes done by the harness itself with uc_mem_write() are not seen by the
+   hook, so the input buffer - which the harness rewrites every round anyway
+   - does not need to be registered. Only register regions the guest writes
+   to, every write inside them costs a hook call.
+
+   Usage:
+
+     snapshot_t *snap = snapshot_new(uc);
+     snapshot_add(snap, RAM_ADDRESS, RAM_SIZE);
+     snapshot_add(snap, STACK_ADDRESS, STACK_SIZE);
+     snapshot_take(snap);
+     ...
+     static bool place_input_callback(uc_engine *uc, char *input,
+                                      size_t input_len,
+                                      uint32_t persistent_round, void *data) {
+       snapshot_restore(data);
+       ...
+     }
+*/
+
+#ifndef _UNICORNAFL_SNAPSHOT_H
+#define _UNICORNAFL_SNAPSHOT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unicorn/unicorn.h>
+
+#define SNAPSHOT_PAGE_SIZE 0x1000
+#define SNAPSHOT_REGIONS_MAX 16
+
+typedef struct snapshot_region {
+  uint64_t addr;
+  size_t   size;
+  uint8_t *copy;   // the contents at snapshot_take()
+  uint8_t *dirty;  // one byte per page, set while the page is in the list
+  uc_hook  hook;
+} snapshot_region_t;
+
+typedef struct snapshot {
+  uc_engine        *uc;
+  uc_context       *ctx;
+  snapshot_region_t regions[SNAPSHOT_REGIONS_MAX];
+  uint32_t          region_cnt;
+  uint64_t         *list;  // guest addresses of the dirty pages
+  size_t            list_cnt, list_size;
+} snapshot_t;
+
+static void snapshot_fatal(const char *what, uc_err err) {
+  fprintf(stderr, "snapshot: %s failed: %s\n", what, uc_strerror(err));
+  exit(1);
+}
+
+static void snapshot_mark(snapshot_t *snap, snapshot_region_t *r,
+                          uint64_t page) {
+  uint64_t idx = (page - r->addr) / SNAPSHOT_PAGE_SIZE;
+
+  if (r->dirty[idx]) return;
+  r->dirty[idx] = 1;
+
+  if (snap->list_cnt == snap->list_size) {
+    snap->list_size = snap->list_size ? snap->list_size * 2 : 64;
+    snap->list = realloc(snap->list, snap->list_size * sizeof(uint64_t));
+    if (!snap->list) {
+      perror("snapshot: realloc");
+      exit(1);
+    }
+  }
+
+  snap->list[snap->list_cnt++] = page;
+}
+
+static void snapshot_hook_write(uc_engine *uc, uc_mem_type type,
+                                uint64_t address, int size, int64_t value,
+                                void *user_data) {
+  snapshot_t        *snap = user_data;
+  snapshot_region_t *r;
+  uint64_t           mask = ~(uint64_t)(SNAPSHOT_PAGE_SIZE - 1);
+  uint64_t           first = address & mask;
+  uint64_t           last = (address + size - 1) & mask;
+  uint32_t           i;
+
+  // The hook only fires inside a region, but a write may straddle two.
+  for (; first <= last; first += SNAPSHOT_PAGE_SIZE) {
+    for (i = 0; i < snap->region_cnt; i++) {
+      r = &snap->regions[i];
+      if (first >= r->addr && first - r->addr < r->size) {
+        snapshot_mark(snap, r, first);
+        break;
+      }
+    }
+  }
+}
+
+static snapshot_t *snapshot_new(uc_engine *uc) {
+  snapshot_t *snap = calloc(1, sizeof(snapshot_t));
+  uc_err      err;
+
+  if (!snap) {
+    perror("snapshot: calloc");
+    exit(1);
+  }
+
+  snap->uc = uc;
+  err = uc_context_alloc(uc, &snap->ctx);
+  if (err != UC_ERR_OK) snapshot_fatal("uc_context_alloc", err);
+  return snap;
+}
+
+/* Track writes to the page aligned, mapped range [addr, addr + size). */
+static void snapshot_add(snapshot_t *snap, uint64_t addr, size_t size) {
+  snapshot_region_t *r;
+  uc_err             err;
+
+  if (snap->region_cnt == SNAPSHOT_REGIONS_MAX) {
+    fprintf(stderr, "snapshot: too many regions (max %d)\n",
+            SNAPSHOT_REGIONS_MAX);
+    exit(1);
+  }
+
+  if ((addr | size) & (SNAPSHOT_PAGE_SIZE - 1) || !size) {
+    fprintf(stderr, "snapshot: region 0x%llx+0x%zx is not page aligned\n",
+            (unsigned long long)addr, size);
+    exit(1);
+  }
+
+  r = &snap->regions[snap->region_cnt++];
+  r->addr = addr;
+  r->size = size;
+  r->copy = malloc(size);
+  r->dirty = calloc(size / SNAPSHOT_PAGE_SIZE, 1);
+  if (!r->copy || !r->dirty) {
+    perror("snapshot: malloc");
+    exit(1);
+  }
+
+  err = uc_hook_add(snap->uc, &r->hook, UC_HOOK_MEM_WRITE, snapshot_hook_write,
+                    snap, addr, addr + size - 1);
+  if (err != UC_ERR_OK) snapshot_fatal("uc_hook_add", err);
+}
+
+/* Save the registers and the contents of all regions. */
+static void snapshot_take(snapshot_t *snap) {
+  snapshot_region_t *r;
+  uint32_t           i;
+  uc_err             err;
+
+  err = uc_context_save(snap->uc, snap->ctx);
+  if (err != UC_ERR_OK) snapshot_fatal("uc_context_save", err);
+
+  for (i = 0; i < snap->region_cnt; i++) {
+    r = &snap->regions[i];
+    err = uc_mem_read(snap->uc, r->addr, r->copy, r->size);
+    if (err != UC_ERR_OK) snapshot_fatal("uc_mem_read", err);
+    memset(r->dirty, 0, r->size / SNAPSHOT_PAGE_SIZE);
+  }
+
+  snap->list_cnt = 0;
+}
+
+/* Copy back the pages written to since the last take or restore, and the
+   registers. Returns the number of pages restored. */
+static size_t snapshot_restore(snapshot_t *snap) {
+  snapshot_region_t *r;
+  uint64_t           page;
+  size_t             cnt = snap->list_cnt, n;
+  uint32_t           i;
+  uc_err             err;
+
+  for (n = 0; n < cnt; n++) {
+    page = snap->list[n];
+
+    for (i = 0; i < snap->region_cnt; i++) {
+      r = &snap->regions[i];
+      if (page >= r->addr && page - r->addr < r->size) break;
+    }
+
+    r->dirty[(page - r->addr) / SNAPSHOT_PAGE_SIZE] = 0;
+    err = uc_mem_write(snap->uc, page, r->copy + (page - r->addr),
+                       SNAPSHOT_PAGE_SIZE);
+    if (err != UC_ERR_OK) snapshot_fatal("uc_mem_write", err);
+  }
+
+  snap->list_cnt = 0;
+
+  err = uc_context_restore(snap->uc, snap->ctx);
+  if (err != UC_ERR_OK) snapshot_fatal("uc_context_restore", err);
+
+  return cnt;
+}
+
+static void snapshot_free(snapshot_t *snap) {
+  uint32_t i;
+
+  for (i = 0; i < snap->region_cnt; i++) {
+    uc_hook_del(snap->uc, snap->regions[i].hook);
+    free(snap->regions[i].copy);
+    free(snap->regions[i].dirty);
+  }
+
+  uc_context_free(snap->ctx);
+  free(snap->list);
+  free(snap);
+}
+
+#endif
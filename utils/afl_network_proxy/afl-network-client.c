@@ -20,6 +20,8 @@
 #include "config.h"
 #include "types.h"
 #include "debug.h"
+#include "fsbatch.h"
+#include "afl-network-proxy.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -32,6 +34,7 @@
 
 #include <netinet/in.h>
 #include <netinet/ip6.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/mman.h>
 #ifndef USEMMAP
@@ -45,6 +48,8 @@
 
 #ifdef USE_DEFLATE
   #include <libdeflate.h>
+struct libdeflate_compressor   *compressor;
+struct libdeflate_decompressor *decompressor;
 #endif
 
 u8 *__afl_area_ptr;
@@ -55,6 +60,32 @@ u32 __afl_map_size = MAP_SIZE;
 __thread u32 __afl_map_size = MAP_SIZE;
 #endif
 
+/* Testcases from shared memory, and with that whole batches of them
+   (FS_OPT_BATCH) which we send to the server in one go. */
+
+static u32             *__afl_fuzz_len;
+static u8              *__afl_fuzz_ptr;
+static struct fs_batch *__afl_batch;
+
+/* Like a persistent mode target, so that afl-fuzz offers us the above */
+
+static volatile const char *persist_sig __attribute__((used)) = PERSIST_SIG;
+
+/* The request to send, and the deltas of a result. */
+
+static u8 *req;
+static u32 req_len, req_size;
+static u8 *zbuf;
+static u32 zbuf_size;
+
+static void *grow(void *buf, u32 *size, u32 need) {
+  if (need <= *size) return buf;
+  *size = need + need / 2;
+  if ((buf = realloc(buf, *size)) == NULL)
+    PFATAL("can not allocate %u memory", *size);
+  return buf;
+}
+
 /* Error reporting to forkserver controller */
 
 void send_forkserver_error(int error) {
@@ -68,12 +99,6 @@ void send_forkserver_error(int error) {
 
 static void __afl_map_shm(void) {
   char *id_str = getenv(SHM_ENV_VAR);
-  char *ptr;
-
-  if ((ptr = getenv("AFL_MAP_SIZE")) != NULL) {
-    u32 val = atoi(ptr);
-    if (val > 0) __afl_map_size = val;
-  }
 
   if (__afl_map_size > MAP_SIZE) {
     if (__afl_map_size > FS_OPT_MAX_MAPSIZE) {
@@ -140,56 +165,201 @@ static void __afl_map_shm(void) {
   }
 }
 
+/* Map one of the other shared memory areas afl-fuzz passes, NULL if that
+   fails. */
+
+static u8 *__afl_map_shm_extra(char *id_str, u32 size) {
+  u8 *map;
+
+#ifdef USEMMAP
+  int shm_fd = shm_open(id_str, O_RDWR, 0600);
+  if (shm_fd == -1) return NULL;
+
+  map = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+  close(shm_fd);
+  if (map == MAP_FAILED) return NULL;
+#else
+  (void)size;
+  map = shmat(atoi(id_str), NULL, 0);
+  if (map == (void *)-1) return NULL;
+#endif
+
+  return map;
+}
+
 /* Fork server logic. */
 
 static void __afl_start_forkserver(void) {
-  u8  tmp[4] = {0, 0, 0, 0};
-  u32 status = 0;
+  u8    tmp[4] = {0, 0, 0, 0};
+  u32   status = 0, reply;
+  char *fuzz_id = getenv(SHM_FUZZ_ENV_VAR);
+  char *batch_id = getenv(SHM_BATCH_ENV_VAR);
+  u8   *map;
 
   if (__afl_map_size <= FS_OPT_MAX_MAPSIZE)
     status |= (FS_OPT_SET_MAPSIZE(__afl_map_size) | FS_OPT_MAPSIZE);
+  if (fuzz_id) {
+    status |= FS_OPT_SHDMEM_FUZZ;
+    if (batch_id) status |= FS_OPT_BATCH;
+  }
+
   if (status) status |= (FS_OPT_ENABLED);
   memcpy(tmp, &status, 4);
 
   /* Phone home and tell the parent that we're OK. */
 
   if (write(FORKSRV_FD + 1, tmp, 4) != 4) return;
+
+  if (!fuzz_id) return;
+
+  if (read(FORKSRV_FD, &reply, 4) != 4) exit(1);
+
+  if ((reply & (FS_OPT_ENABLED | FS_OPT_SHDMEM_FUZZ)) !=
+      (FS_OPT_ENABLED | FS_OPT_SHDMEM_FUZZ))
+    return;
+
+  if ((map = __afl_map_shm_extra(fuzz_id, MAX_FILE + sizeof(u32))) == NULL) {
+    send_forkserver_error(FS_ERROR_SHM_OPEN);
+    exit(1);
+  }
+
+  __afl_fuzz_len = (u32 *)map;
+  __afl_fuzz_ptr = map + sizeof(u32);
+
+  /* without it afl-fuzz just sees the first testcase of each batch done */
+  if ((reply & FS_OPT_BATCH) == FS_OPT_BATCH)
+    __afl_batch = (struct fs_batch *)__afl_map_shm_extra(
+        batch_id, sizeof(struct fs_batch));
+
+  fprintf(stderr, "Using shared memory testcases%s\n",
+          __afl_batch ? " and batches" : "");
 }
 
-static u32 __afl_next_testcase(u8 *buf, u32 max_len) {
+/* Wait for afl-fuzz to start a run, returns the number of testcases in it or
+   0 if afl-fuzz is gone. */
+
+static u32 __afl_next_round(void) {
   s32 status, res = 0x0fffffff;  // res is a dummy pid
 
   /* Wait for parent by reading from the pipe. Abort if read fails. */
   if (read(FORKSRV_FD, &status, 4) != 4) return 0;
 
-  /* we have a testcase - read it */
-  status = read(0, buf, max_len);
-
   /* report that we are starting the target */
   if (write(FORKSRV_FD + 1, &res, 4) != 4) return 0;
 
-  if (status < 1)
-    return 0;
+  if (__afl_batch && __afl_batch->count)
+    return MIN(__afl_batch->count, FS_BATCH_MAX);
   else
-    return status;
+    return 1;
 }
 
 static void __afl_end_testcase(int status) {
   if (write(FORKSRV_FD + 1, &status, 4) != 4) exit(1);
 }
 
-/* you just need to modify the while() loop in this main() */
+/* Append a testcase to the request. */
 
-int main(int argc, char *argv[]) {
-  u8             *interface, *buf, *ptr;
-  s32             s = -1;
-  struct addrinfo hints, *hres, *aip;
-  u32            *lenptr, max_len = 65536;
+static void add_testcase(u8 *buf, u32 len) {
+  req = grow(req, &req_size, req_len + 8 + len);
+
+#if defined(USE_DEFLATE) && defined(COMPRESS_TESTCASES)
+  // we only compress the testcase if it does not fit in the TCP packet
+  if (len > 1500 - 20 - 32 - 4) {
+    u32 clen = (u32)libdeflate_deflate_compress(compressor, buf, len,
+                                                req + req_len + 8, len);
+    if (clen) {
+      // set highest byte to signify compression
+      u32 hdr[2] = {len | NETPROXY_COMPRESSED, clen};
+      memcpy(req + req_len, hdr, 8);
+      req_len += 8 + clen;
+      return;
+    }
+  }
+
+#endif
+
+  memcpy(req + req_len, &len, 4);
+  memcpy(req + req_len + 4, buf, len);
+  req_len += 4 + len;
+}
+
+/* Receive the results of a request. In a batch all but the last one go to
+   its deltas, as long as there is room to spare for a full map, the last one
+   goes to the map, which afl-fuzz cleared before the run. Results after the
+   one we hand to afl-fuzz are dropped, afl-fuzz runs these testcases again.
+   Returns the status of the last one. */
+
+static s32 recv_results(int s, u32 count) {
+  struct fs_batch       *b = __afl_batch;
+  struct netproxy_result res;
+  u32  words = __afl_map_size >> 2, room = ((__afl_map_size + 63) >> 6) << 4;
+  u32 *map = (u32 *)__afl_area_ptr, *pairs, i, j;
+  s32  status = 0;
+  u8   done = 0;
+
+  for (i = 0;; ++i) {
+    if (netproxy_recv(s, &res, sizeof(res))) FATAL("did not receive a result");
+    if (i >= count || res.words > words || res.wire > res.words * 8)
+      FATAL("received an invalid result (%u/%u: %u, %u)", i, count, res.words,
+            res.wire);
+
+    zbuf = grow(zbuf, &zbuf_size, res.words * 8 + res.wire);
+    pairs = (u32 *)zbuf;
+
+    if (res.wire == res.words * 8) {
+      if (netproxy_recv(s, pairs, res.wire))
+        FATAL("did not receive coverage data");
+
+    } else {
 #ifdef USE_DEFLATE
-  u8    *buf2;
-  u32   *lenptr1, *lenptr2, buf2_len, compress_len;
-  size_t decompress_len;
+      size_t decompress_len;
+
+      if (netproxy_recv(s, zbuf + res.words * 8, res.wire))
+        FATAL("did not receive coverage data");
+
+      if (libdeflate_deflate_decompress(decompressor, zbuf + res.words * 8,
+                                        res.wire, pairs, res.words * 8,
+                                        &decompress_len) !=
+              LIBDEFLATE_SUCCESS ||
+          decompress_len != res.words * 8)
+        FATAL("decompression failed");
+#else
+      FATAL(
+          "Received compressed data but not compiled with compression support");
 #endif
+    }
+
+    for (j = 0; j < res.words; ++j)
+      if (pairs[j * 2] >= words) FATAL("received an invalid map index");
+
+    if (!done) {
+      if (!res.last && b && b->deltas + res.words + room <= FS_BATCH_DELTAS) {
+        memcpy(&b->delta[b->deltas], pairs, res.words * 8);
+        b->deltas += res.words;
+        b->delta_end[i] = b->deltas;
+        b->us[i] = res.us;
+        b->done = i + 1;
+
+      } else {
+        for (j = 0; j < res.words; ++j)
+          map[pairs[j * 2]] = pairs[j * 2 + 1];
+        status = res.status;
+        done = 1;
+      }
+    }
+
+    if (res.last) break;
+  }
+
+  return status;
+}
+
+int main(int argc, char *argv[]) {
+  u8             *interface, *buf;
+  s32             s = -1, len;
+  struct addrinfo hints, *hres, *aip;
+  u32             max_len = 65536, count, i, hello[2];
+  int             on = 1;
 
   if (argc < 3 || argc > 4) {
     printf("Syntax: %s host port [max-input-size]\n\n", argv[0]);
@@ -199,9 +369,7 @@ int main(int argc, char *argv[]) {
         "\"%%\"\n");
     printf("The max-input-size default is %u.\n", max_len);
     printf(
-        "The default map size is %u and can be changed with setting "
-        "AFL_MAP_SIZE.\n",
-        __afl_map_size);
+        "The map size is the one of the target of afl-network-server.\n");
     exit(-1);
   }
 
@@ -212,21 +380,8 @@ int main(int argc, char *argv[]) {
       FATAL("max-input-size may not be negative or larger than 2GB: %s",
             argv[3]);
 
-  if ((ptr = getenv("AFL_MAP_SIZE")) != NULL)
-    if ((__afl_map_size = atoi(ptr)) < 8)
-      FATAL("illegal map size, may not be < 8 or >= 2^30: %s", ptr);
-
-  if ((buf = malloc(max_len + 4)) == NULL)
-    PFATAL("can not allocate %u memory", max_len + 4);
-  lenptr = (u32 *)buf;
-
-#ifdef USE_DEFLATE
-  buf2_len = (max_len > __afl_map_size ? max_len : __afl_map_size);
-  if ((buf2 = malloc(buf2_len + 8)) == NULL)
-    PFATAL("can not allocate %u memory", buf2_len + 8);
-  lenptr1 = (u32 *)buf2;
-  lenptr2 = (u32 *)(buf2 + 4);
-#endif
+  if ((buf = malloc(max_len)) == NULL)
+    PFATAL("can not allocate %u memory", max_len);
 
   memset(&hints, 0, sizeof(hints));
   hints.ai_socktype = SOCK_STREAM;
@@ -259,14 +414,16 @@ int main(int argc, char *argv[]) {
 
 #endif
 
+      /* requests and results are small, do not wait to fill up packets */
+      if (setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0)
+        WARNF("could not set TCP_NODELAY on socket");
+
       if (connect(s, aip->ai_addr, aip->ai_addrlen) == -1) s = -1;
     }
   }
 
 #ifdef USE_DEFLATE
-  struct libdeflate_compressor *compressor;
   compressor = libdeflate_alloc_compressor(1);
-  struct libdeflate_decompressor *decompressor;
   decompressor = libdeflate_alloc_decompressor();
   fprintf(stderr, "Compiled with compression support\n");
 #endif
@@ -276,98 +433,51 @@ int main(int argc, char *argv[]) {
   else
     fprintf(stderr, "Connected to target tcp://%s:%s\n", argv[1], argv[2]);
 
+  hello[0] = NETPROXY_MAGIC;
+  if (netproxy_send(s, hello, 4) || netproxy_recv(s, hello, 8) ||
+      hello[0] != NETPROXY_MAGIC)
+    FATAL("afl-network-server does not speak our protocol, is it the same "
+          "version?");
+
+  /* tell afl-fuzz the map size of the target, not the one it tries us with */
+  if ((__afl_map_size = hello[1]) < 8 || __afl_map_size >= (1U << 30))
+    FATAL("illegal map size, may not be < 8 or >= 2^30: %u", __afl_map_size);
+
   /* we initialize the shared memory map and start the forkserver */
   __afl_map_shm();
   __afl_start_forkserver();
 
-  int i = 1, j, status, ret, received;
+  while ((count = __afl_next_round()) > 0) {
+    req_len = 0;
+    req = grow(req, &req_size, 4);
+    memcpy(req, &count, 4);
+    req_len = 4;
 
-  // fprintf(stderr, "Waiting for first testcase\n");
-  while ((*lenptr = __afl_next_testcase(buf + 4, max_len)) > 0) {
-    // fprintf(stderr, "Sending testcase with len %u\n", *lenptr);
-#ifdef USE_DEFLATE
-  #ifdef COMPRESS_TESTCASES
-    // we only compress the testcase if it does not fit in the TCP packet
-    if (*lenptr > 1500 - 20 - 32 - 4) {
-      // set highest byte to signify compression
-      *lenptr1 = (*lenptr | 0xff000000);
-      *lenptr2 = (u32)libdeflate_deflate_compress(compressor, buf + 4, *lenptr,
-                                                  buf2 + 8, buf2_len);
-      if (send(s, buf2, *lenptr2 + 8, 0) != *lenptr2 + 8)
-        PFATAL("sending test data failed");
-      // fprintf(stderr, "COMPRESS (%u->%u):\n", *lenptr, *lenptr2);
-      // for (u32 i = 0; i < *lenptr; i++)
-      //  fprintf(stderr, "%02x", buf[i + 4]);
-      // fprintf(stderr, "\n");
-      // for (u32 i = 0; i < *lenptr2; i++)
-      //  fprintf(stderr, "%02x", buf2[i + 8]);
-      // fprintf(stderr, "\n");
+    if (__afl_fuzz_ptr) {
+      add_testcase(__afl_fuzz_ptr, MIN(*__afl_fuzz_len, (u32)MAX_FILE));
 
     } else {
-  #endif
-#endif
-      if (send(s, buf, *lenptr + 4, 0) != *lenptr + 4)
-        PFATAL("sending test data failed");
-#ifdef USE_DEFLATE
-  #ifdef COMPRESS_TESTCASES
-      // fprintf(stderr, "unCOMPRESS (%u)\n", *lenptr);
+      if ((len = read(0, buf, max_len)) < 0) break;
+      add_testcase(buf, len);
     }
 
-  #endif
-#endif
+    for (i = 1; i < count; ++i)
+      add_testcase(__afl_batch->data + __afl_batch->off[i],
+                   __afl_batch->len[i]);
 
-    received = 0;
-    while (received < 4 &&
-           (ret = recv(s, &status + received, 4 - received, 0)) > 0)
-      received += ret;
-    if (received != 4)
-      FATAL("did not receive waitpid data (%d, %d)", received, ret);
-    // fprintf(stderr, "Received status\n");
-
-    received = 0;
-#ifdef USE_DEFLATE
-    while (received < 4 &&
-           (ret = recv(s, &compress_len + received, 4 - received, 0)) > 0)
-      received += ret;
-    if (received != 4)
-      FATAL("did not receive compress_len (%d, %d)", received, ret);
-    // fprintf(stderr, "Received status\n");
-
-    received = 0;
-    while (received < compress_len &&
-           (ret = recv(s, buf2 + received, buf2_len - received, 0)) > 0)
-      received += ret;
-    if (received != compress_len)
-      FATAL("did not receive coverage data (%d, %d)", received, ret);
-
-    if (libdeflate_deflate_decompress(decompressor, buf2, compress_len,
-                                      __afl_area_ptr, __afl_map_size,
-                                      &decompress_len) != LIBDEFLATE_SUCCESS ||
-        decompress_len != __afl_map_size)
-      FATAL("decompression failed");
-      // fprintf(stderr, "DECOMPRESS (%u->%u): ", compress_len, decompress_len);
-      // for (u32 i = 0; i < __afl_map_size; i++) fprintf(stderr, "%02x",
-      // __afl_area_ptr[i]); fprintf(stderr, "\n");
-#else
-    while (received < __afl_map_size &&
-           (ret = recv(s, __afl_area_ptr + received, __afl_map_size - received,
-                       0)) > 0)
-      received += ret;
-    if (received != __afl_map_size)
-      FATAL("did not receive coverage data (%d, %d)", received, ret);
-#endif
-    // fprintf(stderr, "Received coverage\n");
+    /* the whole batch in one go, this is one round trip instead of count */
+    if (netproxy_send(s, req, req_len)) PFATAL("sending test data failed");
 
     /* report the test case is done and wait for the next */
-    __afl_end_testcase(status);
-    // fprintf(stderr, "Waiting for next testcase %d\n", ++i);
+    __afl_end_testcase(recv_results(s, count));
   }
 
 #ifdef USE_DEFLATE
   libdeflate_free_compressor(compressor);
   libdeflate_free_decompressor(decompressor);
-  free(buf2);
 #endif
+  free(zbuf);
+  free(req);
   free(buf);
 
   return 0;
@@ -0,0 +1,93 @@
+/*
+   american fuzzy lop++ - afl-network-proxy protocol
+   -------------------------------------------------
+
+   Written by Marc Heuse <mh@mh-sec.de>
+
+   Copyright 2019-2024 AFLplusplus Project. All rights reserved.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at:
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+   Wire format shared by afl-network-client and afl-network-server.
+
+   After connecting the client sends NETPROXY_MAGIC and the server answers
+   with the same value, so that mismatched builds fail right away, and the
+   map size of its target, which the client reports to afl-fuzz.
+
+   A request carries one or more testcases, all of a FS_OPT_BATCH batch at
+   once, so that a batch costs one round trip instead of one per testcase:
+
+     u32 count
+     count times: u32 len, u8 data[len]
+              or: u32 len | NETPROXY_COMPRESSED, u32 clen, u8 deflated[clen]
+
+   The server runs them in order and sends a result for each as soon as it
+   is done. It stops after the first one which did not run fine, that one's
+   result has last set, and the client reports it to afl-fuzz:
+
+     struct netproxy_result, u8 deltas[wire]
+
+   The coverage map is sent as the non-zero 32 bit words only, as pairs of
+   u32 word index and u32 value, in the same layout as struct fs_batch_delta.
+   If wire is smaller than words * 8 the pairs are deflated.
+
+*/
+
+#ifndef _AFL_NETWORK_PROXY_H
+#define _AFL_NETWORK_PROXY_H
+
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "types.h"
+
+#define NETPROXY_MAGIC 0x41464c02 /* "AFL" and the protocol version */
+#define NETPROXY_COMPRESSED 0xff000000
+
+/* Deltas smaller than this are not worth deflating */
+#define NETPROXY_DEFLATE_MIN 512
+
+struct netproxy_result {
+  u32 status;                             /* waitpid() status           */
+  u32 us;                                 /* run time in microseconds   */
+  u32 words;                              /* non-zero map words         */
+  u32 wire;                               /* bytes of deltas that follow */
+  u32 last;                               /* no more results follow     */
+
+};
+
+static inline int netproxy_send(int s, const void *buf, u32 len) {
+  const u8 *ptr = buf;
+  ssize_t   ret;
+
+  while (len) {
+    ret = send(s, ptr, len, 0);
+    if (ret < 0 && errno == EINTR) continue;
+    if (ret <= 0) return -1;
+    ptr += ret;
+    len -= ret;
+  }
+
+  return 0;
+}
+
+static inline int netproxy_recv(int s, void *buf, u32 len) {
+  u8     *ptr = buf;
+  ssize_t ret;
+
+  while (len) {
+    ret = recv(s, ptr, len, 0);
+    if (ret < 0 && errno == EINTR) continue;
+    if (ret <= 0) return -1;
+    ptr += ret;
+    len -= ret;
+  }
+
+  return 0;
+}
+
+#endif
@@ -32,6 +32,7 @@
 #include "forkserver.h"
 #include "sharedmem.h"
 #include "common.h"
+#include "afl-network-proxy.h"
 
 #include <stdio.h>
 #include <unistd.h>
@@ -50,6 +51,7 @@
 #include <sys/resource.h>
 #include <netinet/in.h>
 #include <netinet/ip6.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/mman.h>
 #ifndef USEMMAP
@@ -62,6 +64,7 @@
   #include <libdeflate.h>
 struct libdeflate_compressor   *compressor;
 struct libdeflate_decompressor *decompressor;
+static u8                      *zbuf; /* Deflated deltas    */
 #endif
 
 static u8 *in_file, /* Minimizer input test case         */
@@ -69,9 +72,8 @@ static u8 *in_file, /* Minimizer input test case         */
 
 static u8 *in_data; /* Input data for trimming           */
 static u8 *buf2;
+static u8 *send_buf; /* Result and deltas to send         */
 
-static s32 in_len;
-static s32 buf2_len;
 static u32 map_size = MAP_SIZE;
 
 static volatile u8 stop_soon; /* Ctrl-C pressed?                   */
@@ -231,7 +233,10 @@ static void usage(u8 *argv0) {
 
       "Required parameters:\n"
 
-      "  -i port       - the port to listen for the client to connect to\n\n"
+      "  -i port       - the port to listen for the client to connect to\n"
+      "  -c count      - serve up to count clients at once, each with its "
+      "own\n"
+      "                  instance of the target (1)\n\n"
 
       "Execution control settings:\n"
 
@@ -258,83 +263,147 @@ static void usage(u8 *argv0) {
   exit(1);
 }
 
-int recv_testcase(int s, void **buf) {
-  u32    size;
-  s32    ret;
-  size_t received;
-
-  received = 0;
-  while (received < 4 && (ret = recv(s, &size + received, 4 - received, 0)) > 0)
-    received += ret;
-  if (received != 4) FATAL("did not receive size information");
-  if (size == 0) FATAL("did not receive valid size information");
-  // fprintf(stderr, "received size information of %d\n", size);
-
-  if ((size & 0xff000000) != 0xff000000) {
-    *buf = afl_realloc(buf, size);
-    if (unlikely(!*buf)) { PFATAL("Alloc"); }
-    received = 0;
-    // fprintf(stderr, "unCOMPRESS (%u)\n", size);
-    while (received < size &&
-           (ret = recv(s, ((char *)*buf) + received, size - received, 0)) > 0)
-      received += ret;
+/* Receive one testcase and append it to in_data at offset off. Returns its
+   length. */
+
+static u32 recv_testcase(int s, u32 off) {
+  u32 size;
+
+  if (netproxy_recv(s, &size, 4)) FATAL("did not receive size information");
+
+  if ((size & NETPROXY_COMPRESSED) != NETPROXY_COMPRESSED) {
+    in_data = afl_realloc((void **)&in_data, off + size);
+    if (unlikely(!in_data)) { PFATAL("Alloc"); }
+    if (netproxy_recv(s, in_data + off, size))
+      FATAL("did not receive testcase data");
 
   } else {
 #ifdef USE_DEFLATE
-    u32 clen;
-    size -= 0xff000000;
-    *buf = afl_realloc(buf, size);
-    if (unlikely(!*buf)) { PFATAL("Alloc"); }
-    received = 0;
-    while (received < 4 &&
-           (ret = recv(s, &clen + received, 4 - received, 0)) > 0)
-      received += ret;
-    if (received != 4) FATAL("did not receive clen1 information");
-    // fprintf(stderr, "received clen information of %d\n", clen);
+    u32    clen;
+    size_t received;
+
+    size -= NETPROXY_COMPRESSED;
+    in_data = afl_realloc((void **)&in_data, off + size);
+    if (unlikely(!in_data)) { PFATAL("Alloc"); }
+
+    if (netproxy_recv(s, &clen, 4)) FATAL("did not receive clen information");
     if (clen < 1)
       FATAL("did not receive valid compressed len information: %u", clen);
+
     buf2 = afl_realloc((void **)&buf2, clen);
-    buf2_len = clen;
     if (unlikely(!buf2)) { PFATAL("Alloc"); }
-    received = 0;
-    while (received < clen &&
-           (ret = recv(s, buf2 + received, clen - received, 0)) > 0)
-      received += ret;
-    if (received != clen) FATAL("did not receive compressed information");
-    if (libdeflate_deflate_decompress(decompressor, buf2, clen, (char *)*buf,
-                                      size, &received) != LIBDEFLATE_SUCCESS)
+    if (netproxy_recv(s, buf2, clen))
+      FATAL("did not receive compressed information");
+
+    if (libdeflate_deflate_decompress(decompressor, buf2, clen, in_data + off,
+                                      size, &received) != LIBDEFLATE_SUCCESS ||
+        received != size)
       FATAL("decompression failed");
-      // fprintf(stderr, "DECOMPRESS (%u->%u):\n", clen, received);
-      // for (u32 i = 0; i < clen; i++) fprintf(stderr, "%02x", buf2[i]);
-      // fprintf(stderr, "\n");
-      // for (u32 i = 0; i < received; i++) fprintf(stderr, "%02x",
-      // ((u8*)(*buf))[i]); fprintf(stderr, "\n");
 #else
     FATAL("Received compressed data but not compiled with compression support");
 #endif
   }
 
-  // fprintf(stderr, "receiving testcase %p %p max %u\n", buf, *buf, *max_len);
-  if (received != size)
-    FATAL("did not receive testcase data %lu != %u, %d", received, size, ret);
-  // fprintf(stderr, "received testcase\n");
   return size;
 }
 
+/* Send the result of the last run, with the non-zero words of the map. */
+
+static void send_result(afl_forkserver_t *fsrv, int s, u32 us, u32 last) {
+  struct netproxy_result *res;
+  u32                     words = fsrv->map_size >> 2, i, cnt = 0;
+  u32                    *map = (u32 *)fsrv->trace_bits, *pairs;
+
+  send_buf = afl_realloc((void **)&send_buf,
+                         sizeof(struct netproxy_result) + words * 8);
+  if (unlikely(!send_buf)) { PFATAL("Alloc"); }
+
+  res = (struct netproxy_result *)send_buf;
+  pairs = (u32 *)(send_buf + sizeof(struct netproxy_result));
+
+  for (i = 0; i < words; ++i) {
+    if (map[i]) {
+      pairs[cnt * 2] = i;
+      pairs[cnt * 2 + 1] = map[i];
+      ++cnt;
+    }
+  }
+
+  res->status = fsrv->child_status;
+  res->us = us;
+  res->words = cnt;
+  res->wire = cnt * 8;
+  res->last = last;
+
+#ifdef USE_DEFLATE
+  if (res->wire >= NETPROXY_DEFLATE_MIN) {
+    zbuf = afl_realloc((void **)&zbuf, res->wire);
+    if (unlikely(!zbuf)) { PFATAL("Alloc"); }
+
+    size_t clen = libdeflate_deflate_compress(compressor, pairs, res->wire,
+                                              zbuf, res->wire);
+    if (clen && clen < res->wire) {
+      memcpy(pairs, zbuf, clen);
+      res->wire = clen;
+    }
+  }
+
+#endif
+
+  if (netproxy_send(s, send_buf, sizeof(struct netproxy_result) + res->wire))
+    FATAL("could not send data");
+}
+
+/* Serve up to max clients at once, each by a forked copy of ourselves which
+   starts its own target, with its own maps and input file. Only returns in
+   these copies, with the connection they serve. */
+
+static s32 fork_per_client(s32 sock, u32 max, s32 port) {
+  u32   active = 0;
+  s32   s;
+  pid_t pid;
+
+  fprintf(stderr,
+          "Waiting for up to %u incoming connections from afl-network-client "
+          "on port %d ...\n",
+          max, port);
+
+  while (1) {
+    while (active && waitpid(-1, NULL, active < max ? WNOHANG : 0) > 0)
+      --active;
+
+    if ((s = accept(sock, NULL, NULL)) < 0) {
+      if (errno == EINTR) continue;
+      PFATAL("accept() failed");
+    }
+
+    if ((pid = fork()) < 0) { PFATAL("fork() failed"); }
+
+    if (!pid) {
+      close(sock);
+      return s;
+    }
+
+    close(s);
+    ++active;
+    fprintf(stderr, "Received connection, serving it in process %d ...\n",
+            pid);
+  }
+}
+
 /* Main entry point */
 
 int main(int argc, char **argv_orig, char **envp) {
-  s32    opt, s, sock, on = 1, port = -1;
+  s32    opt, s = -1, sock, on = 1, port = -1;
+  u32    max_clients = 1, hello[2], count, total, i, off[FS_BATCH_MAX],
+      len[FS_BATCH_MAX];
+  u64    start_us;
   u8     mem_limit_given = 0, timeout_given = 0, unicorn_mode = 0, use_wine = 0;
   char **use_argv;
   struct sockaddr_in6 serveraddr, clientaddr;
   int                 addrlen = sizeof(clientaddr);
   char                str[INET6_ADDRSTRLEN];
   char              **argv = argv_cpy_dup(argc, argv_orig);
-  u8                 *send_buf;
-#ifdef USE_DEFLATE
-  u32 *lenptr;
-#endif
 
   afl_forkserver_t  fsrv_var = {0};
   afl_forkserver_t *fsrv = &fsrv_var;
@@ -342,9 +411,7 @@ int main(int argc, char **argv_orig, char **envp) {
   map_size = get_map_size();
   fsrv->map_size = map_size;
 
-  if ((send_buf = malloc(map_size + 4)) == NULL) PFATAL("malloc");
-
-  while ((opt = getopt(argc, argv, "+i:f:m:t:QUWh")) > 0) {
+  while ((opt = getopt(argc, argv, "+i:c:f:m:t:QUWh")) > 0) {
     switch (opt) {
       case 'i':
 
@@ -354,6 +421,13 @@ int main(int argc, char **argv_orig, char **envp) {
           FATAL("invalid port definition, must be between 1-65535: %s", optarg);
         break;
 
+      case 'c':
+
+        max_clients = atoi(optarg);
+        if (max_clients < 1 || max_clients > 1024)
+          FATAL("invalid client count, must be between 1-1024: %s", optarg);
+        break;
+
       case 'f':
 
         if (out_file) { FATAL("Multiple -f options not supported"); }
@@ -459,34 +533,8 @@ int main(int argc, char **argv_orig, char **envp) {
 
   if (optind == argc || port < 1) { usage(argv[0]); }
 
-  check_environment_vars(envp);
-
-  sharedmem_t shm = {0};
-  fsrv->trace_bits = afl_shm_init(&shm, map_size, 0);
-
-  in_data = afl_realloc((void **)&in_data, 65536);
-  if (unlikely(!in_data)) { PFATAL("Alloc"); }
-
-  atexit(at_exit_handler);
-  setup_signal_handlers();
-
-  set_up_environment(fsrv);
-
-  fsrv->target_path = find_binary(argv[optind]);
-  detect_file_args(argv + optind, out_file, &fsrv->use_stdin);
-
-  if (fsrv->qemu_mode) {
-    if (use_wine) {
-      use_argv = get_wine_argv(argv[0], &fsrv->target_path, argc - optind,
-                               argv + optind);
-
-    } else {
-      use_argv = get_qemu_argv(argv[0], &fsrv->target_path, argc - optind,
-                               argv + optind);
-    }
-
-  } else {
-    use_argv = argv + optind;
+  if (max_clients > 1 && out_file) {
+    FATAL("-f can not be used with -c, every client needs its own input file");
   }
 
   if ((sock = socket(AF_INET6, SOCK_STREAM, 0)) < 0) PFATAL("socket() failed");
@@ -518,7 +566,40 @@ int main(int argc, char **argv_orig, char **envp) {
   if (bind(sock, (struct sockaddr *)&serveraddr, sizeof(serveraddr)) < 0)
     PFATAL("bind() failed");
 
-  if (listen(sock, 1) < 0) { PFATAL("listen() failed"); }
+  if (listen(sock, max_clients) < 0) { PFATAL("listen() failed"); }
+
+  /* more than one client, this only returns in the process serving one */
+  if (max_clients > 1) { s = fork_per_client(sock, max_clients, port); }
+
+  check_environment_vars(envp);
+
+  sharedmem_t shm = {0};
+  fsrv->trace_bits = afl_shm_init(&shm, map_size, 0);
+
+  in_data = afl_realloc((void **)&in_data, 65536);
+  if (unlikely(!in_data)) { PFATAL("Alloc"); }
+
+  atexit(at_exit_handler);
+  setup_signal_handlers();
+
+  set_up_environment(fsrv);
+
+  fsrv->target_path = find_binary(argv[optind]);
+  detect_file_args(argv + optind, out_file, &fsrv->use_stdin);
+
+  if (fsrv->qemu_mode) {
+    if (use_wine) {
+      use_argv = get_wine_argv(argv[0], &fsrv->target_path, argc - optind,
+                               argv + optind);
+
+    } else {
+      use_argv = get_qemu_argv(argv[0], &fsrv->target_path, argc - optind,
+                               argv + optind);
+    }
+
+  } else {
+    use_argv = argv + optind;
+  }
 
   afl_fsrv_start(
       fsrv, use_argv, &stop_soon,
@@ -529,20 +610,18 @@ int main(int argc, char **argv_orig, char **envp) {
 #ifdef USE_DEFLATE
   compressor = libdeflate_alloc_compressor(1);
   decompressor = libdeflate_alloc_decompressor();
-  buf2 = afl_realloc((void **)&buf2, map_size + 16);
-  buf2_len = map_size + 16;
-  if (unlikely(!buf2)) { PFATAL("alloc"); }
-  lenptr = (u32 *)(buf2 + 4);
   fprintf(stderr, "Compiled with compression support\n");
 #endif
 
-  fprintf(stderr,
-          "Waiting for incoming connection from afl-network-client on port %d "
-          "...\n",
-          port);
+  if (s < 0) {
+    fprintf(stderr,
+            "Waiting for incoming connection from afl-network-client on port "
+            "%d ...\n",
+            port);
 
-  if ((s = accept(sock, NULL, NULL)) < 0) { PFATAL("accept() failed"); }
-  fprintf(stderr, "Received connection, starting ...\n");
+    if ((s = accept(sock, NULL, NULL)) < 0) { PFATAL("accept() failed"); }
+    fprintf(stderr, "Received connection, starting ...\n");
+  }
 
 #ifdef SO_PRIORITY
   priority = 7;
@@ -554,28 +633,37 @@ int main(int argc, char **argv_orig, char **envp) {
 
 #endif
 
-  while ((in_len = recv_testcase(s, (void **)&in_data)) > 0) {
-    // fprintf(stderr, "received %u\n", in_len);
-    (void)run_target(fsrv, use_argv, in_data, in_len, 1);
+  /* requests and results are small, do not wait to fill up packets */
+  if (setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (char *)&on, sizeof(on)) < 0) {
+    WARNF("setsockopt(TCP_NODELAY) failed");
+  }
 
-    memcpy(send_buf + 4, fsrv->trace_bits, fsrv->map_size);
+  if (netproxy_recv(s, &hello[0], 4) || hello[0] != NETPROXY_MAGIC)
+    FATAL("client does not speak our protocol, is it the same version?");
+  hello[1] = fsrv->map_size;
+  if (netproxy_send(s, hello, 8)) FATAL("could not send data");
 
-#ifdef USE_DEFLATE
-    memcpy(buf2, &fsrv->child_status, 4);
-    *lenptr = (u32)libdeflate_deflate_compress(
-        compressor, send_buf + 4, fsrv->map_size, buf2 + 8, buf2_len - 8);
-    // fprintf(stderr, "COMPRESS (%u->%u): ", fsrv->map_size, *lenptr);
-    // for (u32 i = 0; i < fsrv->map_size; i++) fprintf(stderr, "%02x",
-    // fsrv->trace_bits[i]); fprintf(stderr, "\n");
-    if (send(s, buf2, *lenptr + 8, 0) != 8 + *lenptr)
-      FATAL("could not send data");
-#else
-    memcpy(send_buf, &fsrv->child_status, 4);
-    if (send(s, send_buf, fsrv->map_size + 4, 0) != 4 + fsrv->map_size)
-      FATAL("could not send data");
-#endif
+  /* Take all testcases of a request, then run them one after the other and
+     send each result straight away. A testcase that did not run fine ends
+     the request, the client hands its result to afl-fuzz. */
+
+  while (!netproxy_recv(s, &count, 4)) {
+    if (count < 1 || count > FS_BATCH_MAX)
+      FATAL("did not receive a valid testcase count: %u", count);
 
-    // fprintf(stderr, "sent result\n");
+    for (i = 0, total = 0; i < count; ++i) {
+      off[i] = total;
+      len[i] = recv_testcase(s, total);
+      total += len[i];
+    }
+
+    for (i = 0; i < count; ++i) {
+      start_us = get_cur_time_us();
+      u8  ret = run_target(fsrv, use_argv, in_data + off[i], len[i], 1);
+      u32 us = (u32)MIN(get_cur_time_us() - start_us, 0xffffffffULL);
+      send_result(fsrv, s, us, i + 1 == count || ret != FSRV_RUN_OK);
+      if (ret != FSRV_RUN_OK) break;
+    }
   }
 
   unlink(out_file);
@@ -586,8 +674,10 @@ int main(int argc, char **argv_orig, char **envp) {
   afl_fsrv_deinit(fsrv);
   if (fsrv->target_path) { ck_free(fsrv->target_path); }
   afl_free(in_data);
+  afl_free(send_buf);
 #if USE_DEFLATE
   afl_free(buf2);
+  afl_free(zbuf);
   libdeflate_free_compressor(compressor);
   libdeflate_free_decompressor(decompressor);
 #endif
@@ -0,0 +1,187 @@
+/*
+   american fuzzy lop++ - network sync wire format
+   -----------------------------------------------
+
+   Copyright 2019-2024 AFLplusplus Project. All rights reserved.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at:
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Shared by afl-sync-broker and afl-sync-client. Every message is a struct
+   sync_net_msg followed by len bytes:
+
+     SYNC_NET_PUSH  client -> broker: entries to add to the log
+     SYNC_NET_ACK   broker -> client: the push is in the log
+     SYNC_NET_PULL  client -> broker: struct sync_net_pull and the node name
+     SYNC_NET_DATA  broker -> client: struct sync_net_data and the entries
+                    of other nodes that follow the offset asked for
+
+   An entry is one queue entry of one afl-fuzz instance: a struct
+   sync_net_entry, the node and instance names padded to 8 bytes, the
+   record of the sync manifest of the instance (with the map bytes of its
+   path) and the content of the test case, padded to 8 bytes. The broker
+   keeps the entries as they come in an append-only log, the offsets are
+   offsets in that log.
+
+ */
+
+#ifndef _AFL_NETWORK_SYNC_H
+#define _AFL_NETWORK_SYNC_H
+
+#include "afl-fuzz.h"
+
+#include <sys/socket.h>
+
+#define SYNC_NET_MAGIC 0x41464c6e
+#define SYNC_NET_PORT "4747"
+
+/* Most bytes sent in one SYNC_NET_PUSH or SYNC_NET_DATA message, an entry
+   always fits. */
+
+#define SYNC_NET_CHUNK (4 * MAX_FILE)
+
+/* Seconds a peer may stall a message before the connection is dropped. */
+
+#define SYNC_NET_TIMEOUT 30
+
+enum {
+
+  SYNC_NET_PUSH = 1,
+  SYNC_NET_ACK,
+  SYNC_NET_PULL,
+  SYNC_NET_DATA
+
+};
+
+struct sync_net_msg {
+  u32 magic, type, len;
+};
+
+struct sync_net_pull {
+  u64 session, off;            /* log session and offset read up to */
+};
+
+struct sync_net_data {
+  u64 session, off;            /* log session, offset after entries */
+  u32 more, pad;               /* more entries left after these     */
+};
+
+struct sync_net_hdr {
+  u32 magic, pad;
+  u64 session;                 /* stamp of the log                  */
+};
+
+struct sync_net_entry {
+  u32 size;                    /* whole entry, padded               */
+  u32 content_len;             /* length of the test case           */
+  u64 target;                  /* manifest header of the instance   */
+  u32 map_size;
+  u8  node_len, inst_len;      /* lengths of the names that follow  */
+  u8  is_main, pad;            /* the instance is a main node       */
+};
+
+#define SYNC_NET_ALIGN(x) (((u64)(x) + 7) & ~(u64)7)
+#define SYNC_NET_NAMES(e) \
+  SYNC_NET_ALIGN(sizeof(struct sync_net_entry) + (e)->node_len + (e)->inst_len)
+
+/* The manifest record in entry e, and where its test case starts. */
+
+static inline struct sync_rec *sync_net_rec(struct sync_net_entry *e) {
+  return (struct sync_rec *)((u8 *)e + SYNC_NET_NAMES(e));
+}
+
+static inline u8 *sync_net_content(struct sync_net_entry *e) {
+  struct sync_rec *rec = sync_net_rec(e);
+  return (u8 *)rec + SYNC_REC_SIZE(rec->name_len, rec->cnt);
+}
+
+/* Whether the entry at buf with avail bytes left is complete and sane. */
+
+static inline u8 sync_net_entry_ok(u8 *buf, u64 avail) {
+  struct sync_net_entry *e = (struct sync_net_entry *)buf;
+  struct sync_rec       *rec;
+  u64                    need;
+
+  if (avail < sizeof(*e) || e->size > avail || e->size % 8 ||
+      !e->node_len || !e->inst_len || e->content_len > MAX_FILE) {
+    return 0;
+  }
+
+  need = SYNC_NET_NAMES(e) + sizeof(*rec);
+  if (need > e->size) { return 0; }
+
+  rec = sync_net_rec(e);
+  if (rec->name_len > NAME_MAX || !rec->name_len ||
+      rec->cnt > SYNC_MANIFEST_MAX_CNT) {
+    return 0;
+  }
+
+  need = SYNC_NET_NAMES(e) + SYNC_REC_SIZE(rec->name_len, rec->cnt) +
+         SYNC_NET_ALIGN(e->content_len);
+  return need == e->size;
+}
+
+/* Send or receive exactly len bytes, 0 if the peer went away. SIGPIPE has
+   to be ignored. */
+
+static inline u8 sync_net_write(s32 fd, void *buf, u64 len) {
+  u8 *p = buf;
+
+  while (len) {
+    ssize_t ret = send(fd, p, len, 0);
+    if (ret < 0 && errno == EINTR) { continue; }
+    if (ret <= 0) { return 0; }
+    p += ret;
+    len -= ret;
+  }
+
+  return 1;
+}
+
+static inline u8 sync_net_read(s32 fd, void *buf, u64 len) {
+  u8 *p = buf;
+
+  while (len) {
+    ssize_t ret = recv(fd, p, len, 0);
+    if (ret < 0 && errno == EINTR) { continue; }
+    if (ret <= 0) { return 0; }
+    p += ret;
+    len -= ret;
+  }
+
+  return 1;
+}
+
+static inline u8 sync_net_send(s32 fd, u32 type, void *hdr, u32 hdr_len,
+                               void *data, u32 data_len) {
+  struct sync_net_msg msg = {SYNC_NET_MAGIC, type, hdr_len + data_len};
+
+  return sync_net_write(fd, &msg, sizeof(msg)) &&
+         sync_net_write(fd, hdr, hdr_len) && sync_net_write(fd, data, data_len);
+}
+
+/* Receive the header of a message of type; its length goes to len. */
+
+static inline u8 sync_net_expect(s32 fd, u32 type, u32 *len) {
+  struct sync_net_msg msg;
+
+  if (!sync_net_read(fd, &msg, sizeof(msg)) || msg.magic != SYNC_NET_MAGIC ||
+      msg.type != type || msg.len > SYNC_NET_CHUNK + 4096) {
+    return 0;
+  }
+
+  *len = msg.len;
+  return 1;
+}
+
+static inline void sync_net_timeouts(s32 fd) {
+  struct timeval tv = {SYNC_NET_TIMEOUT, 0};
+
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+#endif                                            /* !_AFL_NETWORK_SYNC_H */
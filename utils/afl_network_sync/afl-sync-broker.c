@@ -0,0 +1,306 @@
+/*
+   american fuzzy lop++ - network sync broker
+   ------------------------------------------
+
+   Copyright 2019-2024 AFLplusplus Project. All rights reserved.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at:
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Keeps the queue entries that the afl-sync-client of every node pushes in
+   one append-only log, and hands each client the entries of the other
+   nodes from the offset it got to. See afl-network-sync.h for the wire
+   format and README.md for how to use it.
+
+ */
+
+#define AFL_MAIN
+
+#include "afl-network-sync.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <netdb.h>
+
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+static s32 log_fd = -1;
+static u64 log_len, session;
+static u8 *in_buf, *out_buf;
+
+static volatile u8 stop_soon;
+
+static void handle_stop_sig(int sig) {
+  (void)sig;
+  stop_soon = 1;
+}
+
+/* Open the log in dir, or start it. */
+
+static void open_log(u8 *dir) {
+  struct sync_net_hdr hdr;
+  u8                  fn[PATH_MAX];
+  struct stat         st;
+  struct timeval      tv;
+
+  snprintf(fn, sizeof(fn), "%s/sync.log", dir);
+  log_fd = open(fn, O_RDWR | O_CREAT | O_APPEND, DEFAULT_PERMISSION);
+  if (log_fd < 0) { PFATAL("Unable to open '%s'", fn); }
+  if (fstat(log_fd, &st)) { PFATAL("fstat() failed"); }
+
+  if (st.st_size < (s64)sizeof(hdr)) {
+    gettimeofday(&tv, NULL);
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = SYNC_NET_MAGIC;
+    hdr.session = ((u64)tv.tv_sec * 1000000 + tv.tv_usec) ^
+                  ((u64)getpid() << 44);
+
+    if (ftruncate(log_fd, 0) ||
+        write(log_fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr)) {
+      PFATAL("Unable to write '%s'", fn);
+    }
+
+    log_len = sizeof(hdr);
+
+  } else {
+    if (pread(log_fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr) ||
+        hdr.magic != SYNC_NET_MAGIC) {
+      FATAL("'%s' is not a sync log", fn);
+    }
+
+    /* drop what an interrupted push left at the end */
+
+    log_len = sizeof(hdr);
+
+    while (log_len + sizeof(struct sync_net_entry) <= (u64)st.st_size) {
+      struct sync_net_entry e;
+
+      if (pread(log_fd, &e, sizeof(e), log_len) != (ssize_t)sizeof(e) ||
+          e.size < sizeof(e) || e.size % 8 ||
+          log_len + e.size > (u64)st.st_size) {
+        break;
+      }
+
+      log_len += e.size;
+    }
+
+    if (log_len != (u64)st.st_size && ftruncate(log_fd, log_len)) {
+      PFATAL("Unable to truncate '%s'", fn);
+    }
+  }
+
+  session = hdr.session;
+}
+
+/* Add the entries of a push of len bytes to the log. */
+
+static u8 handle_push(s32 fd, u32 len) {
+  u64 pos = 0;
+
+  if (!sync_net_read(fd, in_buf, len)) { return 0; }
+
+  while (pos < len) {
+    if (!sync_net_entry_ok(in_buf + pos, len - pos)) {
+      WARNF("Dropping a malformed push.");
+      return 0;
+    }
+
+    pos += ((struct sync_net_entry *)(in_buf + pos))->size;
+  }
+
+  if (write(log_fd, in_buf, len) != (ssize_t)len) {
+    PFATAL("Unable to write the sync log");
+  }
+
+  log_len += len;
+
+  return sync_net_send(fd, SYNC_NET_ACK, NULL, 0, NULL, 0);
+}
+
+/* Send the entries that follow the offset of the pull and that are not of
+   the node that asks. */
+
+static u8 handle_pull(s32 fd, u32 len) {
+  struct sync_net_pull pull;
+  struct sync_net_data data;
+  u8                   node[256];
+  u32                  node_len, got, pos = 0, out = 0;
+
+  if (len < sizeof(pull) || len - sizeof(pull) >= sizeof(node) ||
+      !sync_net_read(fd, &pull, sizeof(pull)) ||
+      !sync_net_read(fd, node, len - sizeof(pull))) {
+    return 0;
+  }
+
+  node_len = len - sizeof(pull);
+
+  if (pull.session != session || pull.off < sizeof(struct sync_net_hdr) ||
+      pull.off > log_len) {
+    pull.off = sizeof(struct sync_net_hdr);
+  }
+
+  got = MIN(log_len - pull.off, (u64)SYNC_NET_CHUNK);
+  if (got && pread(log_fd, in_buf, got, pull.off) != (ssize_t)got) {
+    PFATAL("Unable to read the sync log");
+  }
+
+  while (sync_net_entry_ok(in_buf + pos, got - pos)) {
+    struct sync_net_entry *e = (struct sync_net_entry *)(in_buf + pos);
+
+    if (e->node_len != node_len ||
+        memcmp((u8 *)(e + 1), node, node_len)) {
+      memcpy(out_buf + out, e, e->size);
+      out += e->size;
+    }
+
+    pos += e->size;
+  }
+
+  memset(&data, 0, sizeof(data));
+  data.session = session;
+  data.off = pull.off + pos;
+  data.more = data.off < log_len;
+
+  return sync_net_send(fd, SYNC_NET_DATA, &data, sizeof(data), out_buf, out);
+}
+
+/* Serve one client until it is done. */
+
+static void serve(s32 fd) {
+  struct sync_net_msg msg;
+
+  sync_net_timeouts(fd);
+
+  while (!stop_soon && sync_net_read(fd, &msg, sizeof(msg))) {
+    u8 ok = 0;
+
+    if (msg.magic == SYNC_NET_MAGIC && msg.len <= SYNC_NET_CHUNK + 4096) {
+      if (msg.type == SYNC_NET_PUSH) {
+        ok = handle_push(fd, msg.len);
+
+      } else if (msg.type == SYNC_NET_PULL) {
+        ok = handle_pull(fd, msg.len);
+      }
+    }
+
+    if (!ok) { break; }
+  }
+
+  close(fd);
+}
+
+static void usage(u8 *argv0) {
+  SAYF(
+      "\n%s [ options ]\n\n"
+
+      "  -p port  - port to listen on (default: " SYNC_NET_PORT
+      ")\n"
+      "  -d dir   - directory with the sync log (default: .)\n\n"
+
+      "Collects the queue entries of the afl-sync-client instances and passes\n"
+      "them on to the others.\n\n",
+      argv0);
+
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  struct addrinfo  hints, *res, *ai;
+  struct sigaction sa;
+  u8              *port = SYNC_NET_PORT, *dir = ".";
+  s32              opt, sock = -1, one = 1;
+
+  while ((opt = getopt(argc, argv, "p:d:h")) > 0) {
+    switch (opt) {
+      case 'p':
+        port = optarg;
+        break;
+
+      case 'd':
+        dir = optarg;
+        break;
+
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  if (optind != argc) { usage(argv[0]); }
+
+  /* no SA_RESTART, so a signal gets us out of accept() */
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handle_stop_sig;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  open_log(dir);
+
+  in_buf = ck_alloc(SYNC_NET_CHUNK + 4096);
+  out_buf = ck_alloc(SYNC_NET_CHUNK);
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+
+  if ((opt = getaddrinfo(NULL, port, &hints, &res))) {
+    FATAL("getaddrinfo() failed: %s", gai_strerror(opt));
+  }
+
+  /* prefer IPv6, it takes IPv4 clients too */
+
+  for (ai = res; ai; ai = ai->ai_next) {
+    if (ai->ai_family == AF_INET6) { break; }
+  }
+
+  if (!ai) { ai = res; }
+
+  sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+  if (sock < 0) { PFATAL("socket() failed"); }
+
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  if (ai->ai_family == AF_INET6) {
+    s32 zero = 0;
+    setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+  }
+
+  if (bind(sock, ai->ai_addr, ai->ai_addrlen)) { PFATAL("bind() failed"); }
+  if (listen(sock, 64)) { PFATAL("listen() failed"); }
+
+  freeaddrinfo(res);
+
+  OKF("Listening on port %s, the log has %llu bytes.", port, log_len);
+
+  while (!stop_soon) {
+    s32 fd = accept(sock, NULL, NULL);
+
+    if (fd < 0) {
+      if (errno == EINTR) { continue; }
+      PFATAL("accept() failed");
+    }
+
+    serve(fd);
+  }
+
+  close(sock);
+  close(log_fd);
+  ck_free(in_buf);
+  ck_free(out_buf);
+
+  OKF("Done.");
+  return 0;
+}
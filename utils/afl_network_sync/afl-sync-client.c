@@ -0,0 +1,570 @@
+/*
+   american fuzzy lop++ - network sync client
+   ------------------------------------------
+
+   Copyright 2019-2024 AFLplusplus Project. All rights reserved.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at:
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Runs next to the afl-fuzz instances of one node that share a sync
+   directory. It reads the sync manifests of the instances from where it
+   stopped, pushes their new queue entries to afl-sync-broker, and pulls
+   the entries of the other nodes into <node>@<instance> directories with a
+   sync manifest of their own, where sync_fuzzers() picks them up like
+   those of a local instance. See README.md.
+
+ */
+
+#define AFL_MAIN
+
+#include "afl-network-sync.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <netdb.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+/* How far the manifest of a local instance was pushed. */
+
+struct inst_pos {
+  u8  name[NAME_MAX + 1];
+  u64 session, off;
+};
+
+static u8 *sync_dir, *node, *broker_host, *broker_port = SYNC_NET_PORT;
+
+static struct inst_pos *insts;
+static u32              insts_cnt;
+static u64              broker_session, broker_off;
+
+static u8 *push_buf, *pull_buf;
+static u32 push_len;
+
+static volatile u8 stop_soon;
+
+static void handle_stop_sig(int sig) {
+  (void)sig;
+  stop_soon = 1;
+}
+
+/* Names that come from the broker end up in paths. */
+
+static u8 name_ok(u8 *name, u32 len) {
+  u32 i;
+
+  if (!len || name[0] == '.') { return 0; }
+
+  for (i = 0; i < len; ++i) {
+    if (name[i] == '/' || !name[i]) { return 0; }
+  }
+
+  return 1;
+}
+
+static struct inst_pos *inst_find(u8 *name) {
+  u32 i;
+
+  for (i = 0; i < insts_cnt; ++i) {
+    if (!strcmp(insts[i].name, name)) { return &insts[i]; }
+  }
+
+  insts = ck_realloc(insts, (insts_cnt + 1) * sizeof(struct inst_pos));
+  memset(&insts[insts_cnt], 0, sizeof(struct inst_pos));
+  snprintf(insts[insts_cnt].name, sizeof(insts[0].name), "%s", name);
+
+  return &insts[insts_cnt++];
+}
+
+/* The state file: where the broker log was read up to and how far each
+   local manifest was pushed. */
+
+static void load_state(void) {
+  u8    fn[PATH_MAX], line[NAME_MAX + 64], name[NAME_MAX + 1];
+  u64   session, off;
+  FILE *f;
+
+  snprintf(fn, sizeof(fn), "%s/.afl-sync-client", sync_dir);
+  if (!(f = fopen(fn, "r"))) { return; }
+
+  while (fgets(line, sizeof(line), f)) {
+    if (sscanf(line, "%255s %llx %llu", name, &session, &off) != 3) {
+      continue;
+    }
+
+    if (!strcmp(name, "@broker")) {
+      broker_session = session;
+      broker_off = off;
+
+    } else {
+      struct inst_pos *p = inst_find(name);
+      p->session = session;
+      p->off = off;
+    }
+  }
+
+  fclose(f);
+}
+
+static void save_state(void) {
+  u8    fn[PATH_MAX], tmp[PATH_MAX + 8];
+  FILE *f;
+  u32   i;
+
+  snprintf(fn, sizeof(fn), "%s/.afl-sync-client", sync_dir);
+  snprintf(tmp, sizeof(tmp), "%s.tmp", fn);
+  if (!(f = fopen(tmp, "w"))) { PFATAL("Unable to create '%s'", tmp); }
+
+  fprintf(f, "@broker %llx %llu\n", broker_session, broker_off);
+
+  for (i = 0; i < insts_cnt; ++i) {
+    fprintf(f, "%s %llx %llu\n", insts[i].name, insts[i].session,
+            insts[i].off);
+  }
+
+  if (fclose(f) || rename(tmp, fn)) { PFATAL("Unable to write '%s'", fn); }
+}
+
+static s32 broker_connect(void) {
+  struct addrinfo hints, *res, *ai;
+  s32             fd = -1, err;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  if ((err = getaddrinfo(broker_host, broker_port, &hints, &res))) {
+    WARNF("Unable to resolve '%s': %s", broker_host, gai_strerror(err));
+    return -1;
+  }
+
+  for (ai = res; ai; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0) { continue; }
+
+    sync_net_timeouts(fd);
+    if (!connect(fd, ai->ai_addr, ai->ai_addrlen)) { break; }
+
+    close(fd);
+    fd = -1;
+  }
+
+  freeaddrinfo(res);
+
+  if (fd < 0) { WARNF("Unable to connect to %s:%s", broker_host, broker_port); }
+
+  return fd;
+}
+
+/* Send what is in push_buf and wait until the broker has it. */
+
+static u8 push_flush(s32 fd) {
+  u32 len;
+  u8  ok;
+
+  if (!push_len) { return 1; }
+
+  ok = sync_net_send(fd, SYNC_NET_PUSH, NULL, 0, push_buf, push_len) &&
+       sync_net_expect(fd, SYNC_NET_ACK, &len) && !len;
+  push_len = 0;
+
+  return ok;
+}
+
+/* Push the entries that inst, a local instance, added to its manifest since
+   the last time. Returns 0 if the connection broke. */
+
+static u8 push_inst(s32 fd, u8 *inst) {
+  struct sync_manifest_hdr *hdr;
+  struct inst_pos          *pos;
+  struct stat               st;
+  u8                        path[PATH_MAX + NAME_MAX + 2], *map;
+  u64                       len, off, done;
+  u8                        is_main, ok = 1;
+  s32                       mfd;
+
+  snprintf(path, sizeof(path), "%s/%s/queue/.state/sync_manifest", sync_dir,
+           inst);
+  if ((mfd = open(path, O_RDONLY)) < 0) { return 1; }
+
+  if (fstat(mfd, &st) || st.st_size < (s64)sizeof(*hdr)) {
+    close(mfd);
+    return 1;
+  }
+
+  len = st.st_size;
+  map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, mfd, 0);
+  close(mfd);
+  if (map == MAP_FAILED) { return 1; }
+
+  hdr = (struct sync_manifest_hdr *)map;
+  pos = inst_find(inst);
+
+  if (hdr->magic != SYNC_MANIFEST_MAGIC) { goto unmap; }
+
+  if (hdr->session != pos->session || pos->off < sizeof(*hdr) ||
+      pos->off > len) {
+    pos->session = hdr->session;
+    pos->off = sizeof(*hdr);
+  }
+
+  snprintf(path, sizeof(path), "%s/%s/is_main_node", sync_dir, inst);
+  is_main = !access(path, F_OK);
+
+  off = done = pos->off;
+
+  while (off + sizeof(struct sync_rec) <= len) {
+    struct sync_rec       *rec = (struct sync_rec *)(map + off);
+    struct sync_net_entry *e;
+    u64                    rec_size = SYNC_REC_SIZE(rec->name_len, rec->cnt);
+    u64                    size;
+    u8                    *name;
+    s32                    tfd;
+
+    if (rec->name_len > NAME_MAX || rec->cnt > SYNC_MANIFEST_MAX_CNT ||
+        off + rec_size > len ||
+        rec->cksum != hash64(map + off + sizeof(u64), rec_size - sizeof(u64),
+                             HASH_CONST)) {
+      break;
+    }
+
+    name = (u8 *)(rec + 1) + rec->cnt * 5;
+    snprintf(path, sizeof(path), "%s/%s/queue/%.*s", sync_dir, inst,
+             (int)rec->name_len, name);
+    off += rec_size;
+
+    /* entries that are gone or unusable need not be pushed */
+
+    if ((tfd = open(path, O_RDONLY)) < 0) {
+      done = off;
+      continue;
+    }
+
+    if (fstat(tfd, &st) || !st.st_size || st.st_size > MAX_FILE) {
+      close(tfd);
+      done = off;
+      continue;
+    }
+
+    size = SYNC_NET_ALIGN(sizeof(*e) + strlen(node) + strlen(inst)) +
+           rec_size + SYNC_NET_ALIGN(st.st_size);
+
+    if (push_len + size > SYNC_NET_CHUNK) {
+      if (!(ok = push_flush(fd))) {
+        close(tfd);
+        goto unmap;
+      }
+
+      pos->off = done;
+    }
+
+    e = (struct sync_net_entry *)(push_buf + push_len);
+    memset(e, 0, size);
+    e->size = size;
+    e->content_len = st.st_size;
+    e->target = hdr->target;
+    e->map_size = hdr->map_size;
+    e->node_len = strlen(node);
+    e->inst_len = strlen(inst);
+    e->is_main = is_main;
+    memcpy((u8 *)(e + 1), node, e->node_len);
+    memcpy((u8 *)(e + 1) + e->node_len, inst, e->inst_len);
+    memcpy(sync_net_rec(e), rec, rec_size);
+
+    if (read(tfd, sync_net_content(e), st.st_size) != st.st_size) {
+      close(tfd);
+      done = off;
+      continue;
+    }
+
+    close(tfd);
+    push_len += size;
+    done = off;
+  }
+
+  if ((ok = push_flush(fd))) { pos->off = done; }
+
+unmap:
+  munmap(map, len);
+  return ok;
+}
+
+/* Open the manifest of the mirror in dir for entry e, and start it over if
+   it is for another target. */
+
+static s32 mirror_manifest(u8 *dir, struct sync_net_entry *e) {
+  struct sync_manifest_hdr hdr;
+  struct timeval           tv;
+  u8                       fn[PATH_MAX + 32];
+  s32                      fd;
+
+  snprintf(fn, sizeof(fn), "%s/queue/.state/sync_manifest", dir);
+  fd = open(fn, O_RDWR | O_CREAT | O_APPEND, DEFAULT_PERMISSION);
+  if (fd < 0) { PFATAL("Unable to open '%s'", fn); }
+
+  if (pread(fd, &hdr, sizeof(hdr), 0) == (ssize_t)sizeof(hdr) &&
+      hdr.magic == SYNC_MANIFEST_MAGIC && hdr.target == e->target &&
+      hdr.map_size == e->map_size) {
+    return fd;
+  }
+
+  gettimeofday(&tv, NULL);
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = SYNC_MANIFEST_MAGIC;
+  hdr.map_size = e->map_size;
+  hdr.session = ((u64)tv.tv_sec * 1000000 + tv.tv_usec) ^ ((u64)getpid() << 44);
+  hdr.target = e->target;
+
+  if (ftruncate(fd, 0) ||
+      write(fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr)) {
+    PFATAL("Unable to write '%s'", fn);
+  }
+
+  return fd;
+}
+
+/* Put entry e of a remote instance into its mirror directory, the test
+   case first, so the manifest record only shows up once it is there. */
+
+static void mirror_entry(struct sync_net_entry *e) {
+  struct sync_rec *rec = sync_net_rec(e);
+  u8              *n = (u8 *)(e + 1), *inst = n + e->node_len;
+  u8              *name = (u8 *)(rec + 1) + rec->cnt * 5;
+  u8               dir[PATH_MAX], fn[PATH_MAX + NAME_MAX + 2],
+      tmp[PATH_MAX + 32];
+  s32              fd;
+
+  if (!name_ok(n, e->node_len) || !name_ok(inst, e->inst_len) ||
+      !name_ok(name, rec->name_len)) {
+    WARNF("Skipping an entry with a bad name from the broker.");
+    return;
+  }
+
+  snprintf(dir, sizeof(dir), "%s/%.*s@%.*s", sync_dir, (int)e->node_len, n,
+           (int)e->inst_len, inst);
+  if (mkdir(dir, 0700) && errno != EEXIST) {
+    PFATAL("Unable to create '%s'", dir);
+  }
+
+  snprintf(fn, sizeof(fn), "%s/queue", dir);
+  if (mkdir(fn, 0700) && errno != EEXIST) { PFATAL("Unable to create '%s'", fn); }
+
+  snprintf(fn, sizeof(fn), "%s/queue/.state", dir);
+  if (mkdir(fn, 0700) && errno != EEXIST) { PFATAL("Unable to create '%s'", fn); }
+
+  snprintf(fn, sizeof(fn), "%s/queue/%.*s", dir, (int)rec->name_len, name);
+
+  if (access(fn, F_OK)) {
+    snprintf(tmp, sizeof(tmp), "%s/queue/.state/.incoming", dir);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, DEFAULT_PERMISSION);
+    if (fd < 0) { PFATAL("Unable to create '%s'", tmp); }
+    ck_write(fd, sync_net_content(e), e->content_len, tmp);
+    close(fd);
+    if (rename(tmp, fn)) { PFATAL("Unable to create '%s'", fn); }
+  }
+
+  fd = mirror_manifest(dir, e);
+  ck_write(fd, rec, SYNC_REC_SIZE(rec->name_len, rec->cnt), "sync manifest");
+  close(fd);
+
+  snprintf(fn, sizeof(fn), "%s/is_main_node", dir);
+
+  if (e->is_main) {
+    fd = open(fn, O_CREAT | O_RDWR, DEFAULT_PERMISSION);
+    if (fd >= 0) { close(fd); }
+
+  } else {
+    unlink(fn);
+  }
+}
+
+/* Pull the entries of the other nodes until there are no more. Returns the
+   number of entries, or -1 if the connection broke. */
+
+static s32 pull(s32 fd) {
+  struct sync_net_pull req;
+  struct sync_net_data data;
+  s32                  cnt = 0;
+  u32                  len, pos;
+
+  while (!stop_soon) {
+    req.session = broker_session;
+    req.off = broker_off;
+
+    if (!sync_net_send(fd, SYNC_NET_PULL, &req, sizeof(req), node,
+                       strlen(node)) ||
+        !sync_net_expect(fd, SYNC_NET_DATA, &len) || len < sizeof(data) ||
+        !sync_net_read(fd, &data, sizeof(data)) ||
+        !sync_net_read(fd, pull_buf, len - sizeof(data))) {
+      return -1;
+    }
+
+    len -= sizeof(data);
+
+    for (pos = 0; sync_net_entry_ok(pull_buf + pos, len - pos);) {
+      struct sync_net_entry *e = (struct sync_net_entry *)(pull_buf + pos);
+
+      mirror_entry(e);
+      pos += e->size;
+      ++cnt;
+    }
+
+    if (data.session == broker_session && data.off <= broker_off) { break; }
+
+    broker_session = data.session;
+    broker_off = data.off;
+
+    if (!data.more) { break; }
+  }
+
+  return cnt;
+}
+
+/* One round: push what is new here, pull what is new elsewhere. */
+
+static void sync_round(void) {
+  struct dirent *de;
+  DIR           *d;
+  s32            fd = broker_connect(), cnt;
+
+  if (fd < 0) { return; }
+
+  if (!(d = opendir(sync_dir))) { PFATAL("Unable to open '%s'", sync_dir); }
+
+  while ((de = readdir(d)) && !stop_soon) {
+    /* skip dot files and the mirrors of remote instances */
+
+    if (de->d_name[0] == '.' || strchr(de->d_name, '@') ||
+        strlen(de->d_name) > 64) {
+      continue;
+    }
+
+    if (!push_inst(fd, de->d_name)) {
+      WARNF("Lost the connection to the broker while pushing.");
+      closedir(d);
+      close(fd);
+      save_state();
+      return;
+    }
+  }
+
+  closedir(d);
+
+  if ((cnt = pull(fd)) < 0) {
+    WARNF("Lost the connection to the broker while pulling.");
+
+  } else if (cnt) {
+    OKF("Pulled %d entries of other nodes.", cnt);
+  }
+
+  close(fd);
+  save_state();
+}
+
+static void usage(u8 *argv0) {
+  SAYF(
+      "\n%s [ options ] -s sync_dir -b host[:port]\n\n"
+
+      "  -s dir   - the -o directory of the afl-fuzz instances of this node\n"
+      "  -b host  - afl-sync-broker to use (default port: " SYNC_NET_PORT
+      ")\n"
+      "  -n name  - name of this node (default: the host name)\n"
+      "  -i secs  - seconds between syncs (default: 60)\n"
+      "  -1       - sync once and exit\n\n",
+      argv0);
+
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  u8  host[256], *c, once = 0;
+  u32 interval = 60;
+  s32 opt;
+
+  while ((opt = getopt(argc, argv, "s:b:n:i:1h")) > 0) {
+    switch (opt) {
+      case 's':
+        sync_dir = optarg;
+        break;
+
+      case 'b':
+        broker_host = ck_strdup(optarg);
+        break;
+
+      case 'n':
+        node = optarg;
+        break;
+
+      case 'i':
+        interval = atoi(optarg);
+        if (!interval) { FATAL("Bad value for -i"); }
+        break;
+
+      case '1':
+        once = 1;
+        break;
+
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  if (optind != argc || !sync_dir || !broker_host) { usage(argv[0]); }
+
+  /* host:port, [v6 address]:port */
+
+  if (broker_host[0] == '[' && (c = strchr(broker_host, ']'))) {
+    *c = 0;
+    if (c[1] == ':') { broker_port = c + 2; }
+    ++broker_host;
+
+  } else if ((c = strrchr(broker_host, ':')) &&
+             c == (u8 *)strchr(broker_host, ':')) {
+    *c = 0;
+    broker_port = c + 1;
+  }
+
+  if (!node) {
+    if (gethostname(host, sizeof(host) - 1)) { PFATAL("gethostname() failed"); }
+    host[sizeof(host) - 1] = 0;
+    node = host;
+  }
+
+  if (!name_ok(node, strlen(node)) || strchr(node, '@') ||
+      strlen(node) > 64) {
+    FATAL("Bad node name '%s'", node);
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGINT, handle_stop_sig);
+  signal(SIGTERM, handle_stop_sig);
+
+  push_buf = ck_alloc(SYNC_NET_CHUNK);
+  pull_buf = ck_alloc(SYNC_NET_CHUNK + 4096);
+
+  load_state();
+
+  while (!stop_soon) {
+    sync_round();
+    if (once) { break; }
+    sleep(interval);
+  }
+
+  ck_free(push_buf);
+  ck_free(pull_buf);
+
+  return 0;
+}
@@ -0,0 +1,69 @@
+#!/usr/bin/env python3
+#
+# Writes an AFL_LLVM_ALWAYS_HIT list: the blocks that every input of a corpus
+# hits the same, see README.md
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at:
+#
+#   https://www.apache.org/licenses/LICENSE-2.0
+
+import os
+import re
+import sys
+
+if len(sys.argv) != 3:
+    print("Usage: %s document_ids_file showmap_dir"
+          % os.path.basename(sys.argv[0]))
+    sys.exit(1)
+
+doc_file, map_dir = sys.argv[1], sys.argv[2]
+
+# edge ID -> (function, block) from AFL_LLVM_DOCUMENT_IDS
+blocks = {}
+doc_re = re.compile(r"Function=(\S+) edgeID=(\d+) Block=(\d+)")
+
+with open(doc_file) as f:
+    for line in f:
+        m = doc_re.search(line)
+        if m:
+            blocks[int(m.group(2))] = (m.group(1), int(m.group(3)))
+
+if not blocks:
+    print("Error: no edges with a block in %s, is the build too old?" % doc_file)
+    sys.exit(1)
+
+# edges with the same value in all maps
+always = None
+maps = 0
+
+for name in sorted(os.listdir(map_dir)):
+    path = os.path.join(map_dir, name)
+    if not os.path.isfile(path):
+        continue
+
+    cur = {}
+    with open(path) as f:
+        for line in f:
+            edge, _, value = line.strip().partition(":")
+            if value:
+                cur[int(edge)] = value
+
+    if always is None:
+        always = cur
+    else:
+        always = {e: v for e, v in always.items() if cur.get(e) == v}
+
+    maps += 1
+
+if not maps:
+    print("Error: no afl-showmap output in %s" % map_dir)
+    sys.exit(1)
+
+print("# %u of %u documented edges are hit the same by all %u inputs"
+      % (len([e for e in always if e in blocks]), len(blocks), maps))
+
+for edge in sorted(always):
+    if edge in blocks:
+        print("%s:%u" % blocks[edge])
@@ -34,12 +34,25 @@
    to preserver argv[0]. buf is a pointer to a buffer containing
    the input data for the current test case being processed defined as:
    unsigned char *buf = __AFL_FUZZ_TESTCASE_BUF;
+
+   Better, use AFL_INIT_ARGV_PERSISTENT_LEN(buf, len) or
+   AFL_INIT_SET0_PERSISTENT_LEN("prog_name", buf, len) at the start of
+   each __AFL_LOOP() iteration, with len = __AFL_FUZZ_TESTCASE_LEN. These
+   split the testcase in place, without copying it, and never look past its
+   end, which need not be NUL terminated. Only an unterminated last
+   parameter is copied. argv[argc] is NULL.
+
+   All persistent variants reset the getopt() state before they return, so
+   that getopt() starts over with the new argv. If the target keeps other
+   option state in globals, point afl_argv_reset_hook to a function that
+   resets it, it is called right after.
 */
 
 #ifndef _HAVE_ARGV_FUZZ_INL
 #define _HAVE_ARGV_FUZZ_INL
 
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #define AFL_INIT_ARGV()          \
@@ -70,9 +83,43 @@
                                                              \
   } while (0)
 
+#define AFL_INIT_ARGV_PERSISTENT_LEN(persistent_buff, persistent_len)  \
+  do {                                                                 \
+    argv = afl_init_argv_persistent_len(&argc, persistent_buff,        \
+                                        persistent_len);               \
+                                                                       \
+  } while (0)
+
+#define AFL_INIT_SET0_PERSISTENT_LEN(_p, persistent_buff, persistent_len) \
+  do {                                                                    \
+    argv = afl_init_argv_persistent_len(&argc, persistent_buff,           \
+                                        persistent_len);                  \
+    argv[0] = (_p);                                                       \
+    if (!argc) argc = 1;                                                  \
+                                                                          \
+  } while (0)
+
 #define MAX_CMDLINE_LEN 100000
 #define MAX_CMDLINE_PAR 50000
 
+static void (*afl_argv_reset_hook)(void);
+
+/* Make the next getopt() call start over. glibc and musl reinitialize
+   everything, including the position inside grouped short options, when
+   optind is 0, the BSDs have optreset for that. */
+
+static void afl_argv_reset(void) {
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || \
+    defined(__OpenBSD__) || defined(__DragonFly__)
+  optreset = 1;
+  optind = 1;
+#else
+  optind = 0;
+#endif
+
+  if (afl_argv_reset_hook) afl_argv_reset_hook();
+}
+
 static char **afl_init_argv(int *argc) {
   static char  in_buf[MAX_CMDLINE_LEN];
   static char *ret[MAX_CMDLINE_PAR];
@@ -107,7 +154,7 @@ static char **afl_init_argv_persistent(int           *argc,
   unsigned char *ptr = persistent_buff;
   int            rc = 0;
 
-  while (*ptr && rc < MAX_CMDLINE_PAR) {
+  while (*ptr && rc < MAX_CMDLINE_PAR - 1) {
     ret[rc] = (char *)ptr;
     if (ret[rc][0] == 0x02 && !ret[rc][1]) ret[rc]++;
     rc++;
@@ -117,7 +164,47 @@ static char **afl_init_argv_persistent(int           *argc,
     ptr++;
   }
 
+  ret[rc] = NULL;
+  *argc = rc;
+  afl_argv_reset();
+
+  return ret;
+}
+
+static char **afl_init_argv_persistent_len(int           *argc,
+                                           unsigned char *persistent_buff,
+                                           size_t         persistent_len) {
+  static char  tail[MAX_CMDLINE_LEN];
+  static char *ret[MAX_CMDLINE_PAR];
+
+  char *ptr = (char *)persistent_buff;
+  char *end = ptr + persistent_len;
+  char *nul;
+  int   rc = 0;
+
+  while (ptr < end && *ptr && rc < MAX_CMDLINE_PAR - 1) {
+    nul = memchr(ptr, 0, end - ptr);
+
+    if (!nul) {
+      size_t num = end - ptr;
+
+      if (num > MAX_CMDLINE_LEN - 1) num = MAX_CMDLINE_LEN - 1;
+      memcpy(tail, ptr, num);
+      tail[num] = '\0';
+      ptr = tail;
+      nul = end - 1;
+    }
+
+    ret[rc] = ptr;
+    if (ret[rc][0] == 0x02 && !ret[rc][1]) ret[rc]++;
+    rc++;
+
+    ptr = nul + 1;
+  }
+
+  ret[rc] = NULL;
   *argc = rc;
+  afl_argv_reset();
 
   return ret;
 }
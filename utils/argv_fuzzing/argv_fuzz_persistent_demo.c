@@ -30,8 +30,9 @@ int main(int argc, char **argv) {
     // Check that the length of the test case is at least 8 bytes
     if (len < 8) continue;
 
-    // Initialize the command line arguments using the testcase buffer
-    AFL_INIT_ARGV_PERSISTENT(buf);
+    /* Initialize the command line arguments using the testcase buffer, this
+       also resets getopt() for the new argv */
+    AFL_INIT_ARGV_PERSISTENT_LEN(buf, len);
 
     /* Check if the first argument is "XYZ" and the second argument is "TEST2"
        If so, call the "abort" function to terminate the program.
@@ -18,6 +18,62 @@
 #include <stdio.h>
 #include <unistd.h>
 #include "argv-fuzz-inl.h"
+#include "config.h"
+
+/* AFL_ARGVFUZZ_LOOP: for targets built with afl-cc, call main() over and
+   over in persistent mode, with argv taken from the shared memory testcase
+   each time, instead of one fork per testcase. */
+
+static int (*orig_main)(int, char **, char **);
+static unsigned int loop_cnt;
+
+static int (*afl_persistent_loop)(unsigned int);
+static unsigned char **afl_fuzz_ptr;
+static unsigned int  **afl_fuzz_len;
+
+static int persistent_init(void) {
+  char *ptr = getenv("AFL_ARGVFUZZ_LOOP");
+  int  *sharedmem_fuzzing;
+
+  if (!ptr || (loop_cnt = atoi(ptr)) == 0) { return 0; }
+
+  afl_persistent_loop = dlsym(RTLD_DEFAULT, "__afl_persistent_loop");
+  afl_fuzz_ptr = dlsym(RTLD_DEFAULT, "__afl_fuzz_ptr");
+  afl_fuzz_len = dlsym(RTLD_DEFAULT, "__afl_fuzz_len");
+  sharedmem_fuzzing = dlsym(RTLD_DEFAULT, "__afl_sharedmem_fuzzing");
+
+  if (!afl_persistent_loop || !afl_fuzz_ptr || !afl_fuzz_len ||
+      !sharedmem_fuzzing) {
+    fprintf(stderr,
+            "Warning: AFL_ARGVFUZZ_LOOP needs a target built with afl-cc, "
+            "falling back to stdin\n");
+    return 0;
+  }
+
+  /* The target's constructors, which start the forkserver, have not run
+     yet and pick these up. */
+
+  *sharedmem_fuzzing = 1;
+  setenv(PERSIST_ENV_VAR, "1", 1);
+  return 1;
+}
+
+static int persistent_main(int argc, char **argv, char **envp) {
+  int ret = 0;
+
+  while (afl_persistent_loop(loop_cnt)) {
+    /* Outside of afl-fuzz there is no shared memory, run stdin once */
+    if (!*afl_fuzz_ptr) {
+      argv = afl_init_argv(&argc);
+      return orig_main(argc, argv, envp);
+    }
+
+    argv = afl_init_argv_persistent_len(&argc, *afl_fuzz_ptr, **afl_fuzz_len);
+    ret = orig_main(argc, argv, envp);
+  }
+
+  return ret;
+}
 
 int __libc_start_main(int (*main)(int, char **, char **), int argc, char **argv,
                       void (*init)(void), void (*fini)(void),
@@ -28,9 +84,6 @@ int __libc_start_main(int (*main)(int, char **, char **), int argc, char **argv,
   int    sub_argc;
   char **sub_argv;
 
-  (void)argc;
-  (void)argv;
-
   orig = dlsym(RTLD_NEXT, __func__);
 
   if (!orig) {
@@ -38,6 +91,11 @@ int __libc_start_main(int (*main)(int, char **, char **), int argc, char **argv,
     exit(EXIT_FAILURE);
   }
 
+  if (persistent_init()) {
+    orig_main = main;
+    return orig(persistent_main, argc, argv, init, fini, rtld_fini, stack_end);
+  }
+
   sub_argv = afl_init_argv(&sub_argc);
 
   return orig(main, sub_argc, sub_argv, init, fini, rtld_fini, stack_end);
@@ -21,6 +21,9 @@
 # (e.g., from ports). You can set GDB=/some/path to point to it if
 # necessary.
 #
+# afl-triage does the same without gdb for large numbers of crashes, and
+# sorts them into buckets of the same crash.
+#
 
 echo "crash triage utility for afl-fuzz by Michal Zalewski"
 echo
@@ -0,0 +1,399 @@
+/*
+
+   american fuzzy lop++ - find the place for the deferred forkserver
+   -----------------------------------------------------------------
+
+   Copyright 2019-2024 AFLplusplus Project. All rights reserved.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at:
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   This Linux-only LD_PRELOAD library measures how the startup CPU time of a
+   target splits up until it first touches its input, records the call chain
+   of that access and suggests an AFL_LLVM_DEFER_AT value for afl-cc from it.
+   See README.md for more info.
+
+ */
+
+#ifndef _GNU_SOURCE
+  #define _GNU_SOURCE
+#endif
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/auxv.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "../../include/types.h"
+
+#ifndef __linux__
+  #error "Sorry, this library is Linux-only."
+#endif
+
+#define MAX_FRAMES 64
+
+static u64         ctor_ns, main_ns;
+static int         prog_argc;
+static char      **prog_argv;
+static const char *input;
+static u8          done;
+static void       *exe_base, *own_base;
+
+static u32   threads;
+static void *thread_chain[MAX_FRAMES];
+static int   thread_depth;
+
+static int (*real_main)(int, char **, char **);
+
+static u64 cpu_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Get the next definition of a function we wrap, or bail out. */
+
+static void *next_sym(const char *name) {
+  void *p = dlsym(RTLD_NEXT, name);
+
+  if (!p) {
+    fprintf(stderr, "[defer-profile] %s() not found\n", name);
+    _exit(1);
+  }
+
+  return p;
+}
+
+/* Whether path is the input: AFL_DEFER_PROFILE_INPUT, or else any argument
+   of the program. */
+
+static int same_file(const char *a, const char *b) {
+  struct stat sa, sb;
+
+  if (!strcmp(a, b)) { return 1; }
+  if (stat(a, &sa) || stat(b, &sb)) { return 0; }
+
+  return sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+static int is_input(const char *path) {
+  int i;
+
+  if (done || !path) { return 0; }
+  if (input) { return same_file(path, input); }
+
+  for (i = 1; i < prog_argc; ++i) {
+    if (prog_argv[i][0] != '-' && same_file(path, prog_argv[i])) { return 1; }
+  }
+
+  return 0;
+}
+
+/* Reads from stdin count unless AFL_DEFER_PROFILE_INPUT names a file. */
+
+static int is_input_fd(int fd) {
+  return !done && fd == 0 && (!input || !strcmp(input, "-"));
+}
+
+/* Describe a frame, returns its symbol name or NULL. */
+
+static const char *frame_name(void *addr, u8 *in_exe) {
+  Dl_info info;
+
+  *in_exe = 0;
+  if (!dladdr(addr, &info)) { return NULL; }
+  *in_exe = info.dli_fbase == exe_base;
+
+  return info.dli_saddr ? info.dli_sname : NULL;
+}
+
+/* Print a call chain and the suggestion for it: the innermost function of
+   the program, and what it called there. The frames of this library are
+   skipped, which, for the suggestion, stand for the wrapped function. */
+
+static void chain(int fd, void **frames, int n, const char *wrapped) {
+  const char *inner = NULL, *callee = NULL, *prev = wrapped;
+  Dl_info     info;
+  int         i;
+
+  while (n && dladdr(frames[0], &info) && info.dli_fbase == own_base) {
+    ++frames;
+    --n;
+  }
+
+  for (i = 0; i < n; ++i) {
+    u8          in_exe;
+    const char *name = frame_name(frames[i], &in_exe);
+
+    if (dladdr(frames[i], &info)) {
+      dprintf(fd, "[defer-profile]   #%-2d %s+0x%lx (%s)\n", i,
+              name ? name : "?",
+              (unsigned long)((u8 *)frames[i] -
+                              (u8 *)(name ? info.dli_saddr : info.dli_fbase)),
+              info.dli_fname);
+
+    } else {
+      dprintf(fd, "[defer-profile]   #%-2d %p\n", i, frames[i]);
+    }
+
+    if (in_exe && !inner) {
+      inner = name ? name : "?";
+      callee = prev;
+    }
+
+    prev = name;
+  }
+
+  if (!inner) {
+    dprintf(fd, "[defer-profile] no frame of the program found\n");
+
+  } else if (!strcmp(inner, "?")) {
+    dprintf(fd,
+            "[defer-profile] no symbol names for the program, link the "
+            "profiling build with -rdynamic\n");
+
+  } else if (callee) {
+    dprintf(fd, "[defer-profile] suggested: AFL_LLVM_DEFER_AT=%s:%s\n", inner,
+            callee);
+
+  } else {
+    dprintf(fd, "[defer-profile] suggested: AFL_LLVM_DEFER_AT=%s\n", inner);
+  }
+}
+
+static void report(const char *how, const char *what) {
+  void *frames[MAX_FRAMES];
+  u64   now = cpu_ns(), total;
+  int   n, fd = 2;
+  char *out = getenv("AFL_DEFER_PROFILE_OUT");
+
+  done = 1;
+  n = backtrace(frames, MAX_FRAMES);
+  total = now ? now : 1;
+
+  if (out) {
+    fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) { fd = 2; }
+  }
+
+  dprintf(fd, "[defer-profile] first input access: %s(%s)\n", how, what);
+  dprintf(fd,
+          "[defer-profile] cpu time until then: %llu us\n"
+          "[defer-profile]   loader and library constructors: %llu us (%u%%)\n"
+          "[defer-profile]   program constructors: %llu us (%u%%)\n"
+          "[defer-profile]   main() until the input access: %llu us (%u%%)\n",
+          now / 1000, ctor_ns / 1000, (u32)(ctor_ns * 100 / total),
+          main_ns ? (main_ns - ctor_ns) / 1000 : 0,
+          main_ns ? (u32)((main_ns - ctor_ns) * 100 / total) : 0,
+          main_ns ? (now - main_ns) / 1000 : 0,
+          main_ns ? (u32)((now - main_ns) * 100 / total) : 0);
+
+  if (threads) {
+    /* the forkserver only takes the calling thread into its children */
+
+    dprintf(fd,
+            "[defer-profile] %u thread(s) were started before, the "
+            "forkserver must start before the first one:\n",
+            threads);
+    chain(fd, thread_chain, thread_depth, "pthread_create");
+
+  } else {
+    dprintf(fd, "[defer-profile] call chain:\n");
+    chain(fd, frames, n, how);
+  }
+
+  if (fd != 2) { close(fd); }
+
+  if (getenv("AFL_DEFER_PROFILE_EXIT")) { _exit(0); }
+}
+
+/* Note the start of main(), after all constructors of the program ran. */
+
+static int profile_main(int argc, char **argv, char **envp) {
+  main_ns = cpu_ns();
+  return real_main(argc, argv, envp);
+}
+
+int __libc_start_main(int (*main)(int, char **, char **), int argc,
+                      char **argv, void (*init)(void), void (*fini)(void),
+                      void (*rtld_fini)(void), void *stack_end) {
+  int (*start)(int (*)(int, char **, char **), int, char **, void (*)(void),
+               void (*)(void), void (*)(void), void *) =
+      next_sym("__libc_start_main");
+
+  real_main = main;
+  return start(profile_main, argc, argv, init, fini, rtld_fini, stack_end);
+}
+
+__attribute__((constructor)) static void init(int argc, char **argv) {
+  Dl_info info;
+
+  ctor_ns = cpu_ns();
+  prog_argc = argc;
+  prog_argv = argv;
+  input = getenv("AFL_DEFER_PROFILE_INPUT");
+
+  if (dladdr((void *)getauxval(AT_ENTRY), &info)) {
+    exe_base = info.dli_fbase;
+  }
+
+  if (dladdr((void *)init, &info)) { own_base = info.dli_fbase; }
+}
+
+/* The wrapped functions. */
+
+#define OPEN_MODE(flags, mode)                       \
+  do {                                               \
+    if ((flags) & (O_CREAT | O_TMPFILE)) {           \
+      va_list ap;                                    \
+      va_start(ap, flags);                           \
+      mode = va_arg(ap, int);                        \
+      va_end(ap);                                    \
+    }                                                \
+                                                     \
+  } while (0)
+
+int open(const char *path, int flags, ...) {
+  static int (*f)(const char *, int, ...);
+  int mode = 0;
+
+  OPEN_MODE(flags, mode);
+  if (!f) { f = next_sym("open"); }
+  if (is_input(path)) { report("open", path); }
+  return f(path, flags, mode);
+}
+
+int open64(const char *path, int flags, ...) {
+  static int (*f)(const char *, int, ...);
+  int mode = 0;
+
+  OPEN_MODE(flags, mode);
+  if (!f) { f = next_sym("open64"); }
+  if (is_input(path)) { report("open64", path); }
+  return f(path, flags, mode);
+}
+
+int openat(int dirfd, const char *path, int flags, ...) {
+  static int (*f)(int, const char *, int, ...);
+  int mode = 0;
+
+  OPEN_MODE(flags, mode);
+  if (!f) { f = next_sym("openat"); }
+  if (is_input(path)) { report("openat", path); }
+  return f(dirfd, path, flags, mode);
+}
+
+int openat64(int dirfd, const char *path, int flags, ...) {
+  static int (*f)(int, const char *, int, ...);
+  int mode = 0;
+
+  OPEN_MODE(flags, mode);
+  if (!f) { f = next_sym("openat64"); }
+  if (is_input(path)) { report("openat64", path); }
+  return f(dirfd, path, flags, mode);
+}
+
+FILE *fopen(const char *path, const char *how) {
+  static FILE *(*f)(const char *, const char *);
+
+  if (!f) { f = next_sym("fopen"); }
+  if (is_input(path)) { report("fopen", path); }
+  return f(path, how);
+}
+
+FILE *fopen64(const char *path, const char *how) {
+  static FILE *(*f)(const char *, const char *);
+
+  if (!f) { f = next_sym("fopen64"); }
+  if (is_input(path)) { report("fopen64", path); }
+  return f(path, how);
+}
+
+ssize_t read(int fd, void *buf, size_t len) {
+  static ssize_t (*f)(int, void *, size_t);
+
+  if (!f) { f = next_sym("read"); }
+  if (is_input_fd(fd)) { report("read", "stdin"); }
+  return f(fd, buf, len);
+}
+
+size_t fread(void *buf, size_t size, size_t n, FILE *stream) {
+  static size_t (*f)(void *, size_t, size_t, FILE *);
+
+  if (!f) { f = next_sym("fread"); }
+  if (is_input_fd(fileno(stream))) { report("fread", "stdin"); }
+  return f(buf, size, n, stream);
+}
+
+char *fgets(char *buf, int len, FILE *stream) {
+  static char *(*f)(char *, int, FILE *);
+
+  if (!f) { f = next_sym("fgets"); }
+  if (is_input_fd(fileno(stream))) { report("fgets", "stdin"); }
+  return f(buf, len, stream);
+}
+
+int fgetc(FILE *stream) {
+  static int (*f)(FILE *);
+
+  if (!f) { f = next_sym("fgetc"); }
+  if (is_input_fd(fileno(stream))) { report("fgetc", "stdin"); }
+  return f(stream);
+}
+
+int getc(FILE *stream) {
+  static int (*f)(FILE *);
+
+  if (!f) { f = next_sym("getc"); }
+  if (is_input_fd(fileno(stream))) { report("getc", "stdin"); }
+  return f(stream);
+}
+
+int getchar(void) {
+  static int (*f)(void);
+
+  if (!f) { f = next_sym("getchar"); }
+  if (is_input_fd(0)) { report("getchar", "stdin"); }
+  return f();
+}
+
+ssize_t getdelim(char **line, size_t *len, int delim, FILE *stream) {
+  static ssize_t (*f)(char **, size_t *, int, FILE *);
+
+  if (!f) { f = next_sym("getdelim"); }
+  if (is_input_fd(fileno(stream))) { report("getdelim", "stdin"); }
+  return f(line, len, delim, stream);
+}
+
+ssize_t getline(char **line, size_t *len, FILE *stream) {
+  static ssize_t (*f)(char **, size_t *, FILE *);
+
+  if (!f) { f = next_sym("getline"); }
+  if (is_input_fd(fileno(stream))) { report("getline", "stdin"); }
+  return f(line, len, stream);
+}
+
+int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+                   void *(*start)(void *), void *arg) {
+  static int (*f)(pthread_t *, const pthread_attr_t *, void *(*)(void *),
+                  void *);
+
+  if (!f) { f = next_sym("pthread_create"); }
+  if (!done && !threads++) {
+    thread_depth = backtrace(thread_chain, MAX_FRAMES);
+  }
+
+  return f(thread, attr, start, arg);
+}
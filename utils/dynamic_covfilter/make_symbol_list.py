@@ -6,14 +6,79 @@
 
 import json
 import os
+import re
+import struct
 import sys
 import subprocess
 
+# The binary format that the AFL runtime maps in place, see FilterPCHeader
+# in afl-compiler-rt.o.c: a header, a table of modules, the sorted ranges of
+# every module, and the module names.
+MAGIC = b"AFLPCF1\0"
+HEADER = struct.Struct("<8sII")
+MODULE = struct.Struct("<QQII32s")
+RANGE = struct.Struct("<QQ")
+
+
+def pack(outfile, listfiles):
+    modules = {}
+
+    for listfile in listfiles:
+        with open(listfile) as f:
+            for line in f:
+                cols = line.rstrip("\r\n").split("\t")
+                if len(cols) < 3:
+                    continue
+                start = int(cols[0], 16)
+                build_id = cols[5] if len(cols) > 5 and cols[5] != "-" else ""
+                ranges = modules.setdefault((cols[2], build_id), [])
+                ranges.append([start, start + int(cols[1])])
+
+    entries = []
+    for key, ranges in sorted(modules.items()):
+        # Sorted and without overlaps, as the runtime expects it.
+        ranges.sort()
+        merged = []
+        for r in ranges:
+            if merged and r[0] <= merged[-1][1]:
+                merged[-1][1] = max(merged[-1][1], r[1])
+            else:
+                merged.append(r)
+        entries.append((key, merged))
+
+    ranges_off = HEADER.size + MODULE.size * len(entries)
+    names_off = ranges_off + RANGE.size * sum(len(m) for _, m in entries)
+    table = body = names = b""
+
+    for (name, build_id), merged in entries:
+        bid = bytes.fromhex(build_id)[:32]
+        table += MODULE.pack(ranges_off + len(body), len(merged),
+                             names_off + len(names), len(bid), bid)
+        body += b"".join(RANGE.pack(s, e) for s, e in merged)
+        names += name.encode("utf-8") + b"\0"
+
+    with open(outfile, "wb") as f:
+        f.write(HEADER.pack(MAGIC, len(entries), 0) + table + body + names)
+
+
+def build_id(binfile):
+    output = subprocess.check_output(["readelf", "-n", binfile]).decode("utf-8")
+    match = re.search(r"Build ID: ([0-9a-fA-F]+)", output)
+    return match.group(1) if match else "-"
+
+
+if len(sys.argv) >= 4 and sys.argv[1] == "--pack":
+    pack(sys.argv[2], sys.argv[3:])
+    sys.exit(0)
+
 if len(sys.argv) != 2:
     print("Usage: %s binfile" % os.path.basename(sys.argv[0]))
+    print("       %s --pack outfile listfile [listfile ...]" %
+          os.path.basename(sys.argv[0]))
     sys.exit(1)
 
 binfile = sys.argv[1]
+binfile_id = build_id(binfile)
 
 addr2len = {}
 addrs = []
@@ -68,6 +133,7 @@ for line in output:
             addr2len[output["Address"]],
             os.path.basename(output["ModuleName"]),
             output["Symbol"][0]["FileName"],
-            output["Symbol"][0]["FunctionName"]
+            output["Symbol"][0]["FunctionName"],
+            binfile_id
         ]
         print("\t".join(final_output))
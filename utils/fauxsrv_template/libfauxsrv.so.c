@@ -0,0 +1,136 @@
+/*
+
+   american fuzzy lop++ - template process for non-instrumented targets
+   --------------------------------------------------------------------
+
+   Copyright 2019-2024 AFLplusplus Project. All rights reserved.
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at:
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   afl-fuzz -n preloads this library into dynamically linked targets when
+   AFL_FAUXSRV_TEMPLATE is set. Instead of afl-fuzz's faux forkserver doing
+   an execve() - and the dynamic loader all its relocations - for every
+   run, the target stops at main(), after the loader (run with LD_BIND_NOW)
+   and all constructors are done, and forks its runs from there. It speaks
+   the same protocol on FORKSRV_FD as the faux forkserver.
+
+ */
+
+#ifndef _GNU_SOURCE
+  #define _GNU_SOURCE
+#endif
+#include <malloc.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "../../include/config.h"
+#include "../../include/types.h"
+
+#ifndef __linux__
+  #error "Sorry, this library is Linux-only."
+#endif
+
+#ifndef MADV_POPULATE_READ
+  #define MADV_POPULATE_READ 22
+#endif
+
+static int (*real_main)(int, char **, char **);
+
+/* Warm up the file backed, read-only mappings of the process (code and
+   constants of the program and of each library), so the runs fault them in
+   from the page cache. Writable mappings are left alone, pre-faulting them
+   would only give fork() more page tables to copy. */
+
+static void prefault(void) {
+  FILE *f = fopen("/proc/self/maps", "r");
+  char  line[4096];
+
+  if (!f) { return; }
+
+  while (fgets(line, sizeof(line), f)) {
+    unsigned long start, end, inode;
+    char          perms[8];
+
+    if (sscanf(line, "%lx-%lx %7s %*s %*s %lu", &start, &end, perms, &inode) !=
+            4 ||
+        !inode || perms[0] != 'r' || perms[1] == 'w') {
+      continue;
+    }
+
+    if (madvise((void *)start, end - start, MADV_POPULATE_READ)) {
+      madvise((void *)start, end - start, MADV_WILLNEED);
+    }
+  }
+
+  fclose(f);
+}
+
+/* The template: announce ourselves, then fork a run for every request. */
+
+static void template_loop(void) {
+  u32   tmp = 0, was_killed;
+  s32   status;
+  pid_t child_pid;
+  void (*old_sigchld_handler)(int) = signal(SIGCHLD, SIG_DFL);
+
+  prefault();
+
+  /* give the free heap back, it need not be copied for each run */
+
+  malloc_trim(0);
+
+  if (write(FORKSRV_FD + 1, &tmp, 4) != 4) { return; }
+
+  while (1) {
+    if (read(FORKSRV_FD, &was_killed, 4) != 4) { _exit(0); }
+
+    child_pid = fork();
+
+    if (child_pid < 0) { _exit(1); }
+
+    if (!child_pid) {
+      signal(SIGCHLD, old_sigchld_handler);
+      close(FORKSRV_FD);
+      close(FORKSRV_FD + 1);
+      return;
+    }
+
+    if (write(FORKSRV_FD + 1, &child_pid, 4) != 4) { _exit(0); }
+
+    if (waitpid(child_pid, &status, 0) < 0) { _exit(1); }
+
+    if (write(FORKSRV_FD + 1, &status, 4) != 4) { _exit(1); }
+  }
+}
+
+static int template_main(int argc, char **argv, char **envp) {
+  /* only the process started by afl-fuzz becomes the template */
+
+  if (getenv("AFL_FAUXSRV_TEMPLATE") && fcntl(FORKSRV_FD, F_GETFD) != -1) {
+    template_loop();
+  }
+
+  return real_main(argc, argv, envp);
+}
+
+int __libc_start_main(int (*main)(int, char **, char **), int argc,
+                      char **argv, void (*init)(void), void (*fini)(void),
+                      void (*rtld_fini)(void), void *stack_end) {
+  int (*start)(int (*)(int, char **, char **), int, char **, void (*)(void),
+               void (*)(void), void (*)(void), void *) =
+      dlsym(RTLD_NEXT, "__libc_start_main");
+
+  real_main = main;
+  return start(template_main, argc, argv, init, fini, rtld_fini, stack_end);
+}
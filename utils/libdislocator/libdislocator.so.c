@@ -27,6 +27,7 @@
 #include <string.h>
 #include <limits.h>
 #include <errno.h>
+#include <sched.h>
 #include <sys/mman.h>
 
 #ifdef __APPLE__
@@ -97,6 +98,16 @@ typedef struct {
 
 #define SUPER_PAGE_SIZE 1 << 21
 
+/* Pooled mode (AFL_LD_POOL): freed mappings wait in a quarantine of
+   POOL_QUARANTINE frees, then those of up to POOL_MAX_PAGES pages (plus the
+   guard page) are kept per size class for reuse, the rest is unmapped
+   POOL_UNMAP_BATCH at a time. */
+
+#define POOL_MAX_PAGES 16
+#define POOL_CLASS_SLOTS 64
+#define POOL_QUARANTINE 1024
+#define POOL_UNMAP_BATCH 64
+
 /* Error / message handling: */
 
 #define DEBUGF(_x...)                 \
@@ -153,6 +164,112 @@ static _Atomic size_t total_mem; /* Currently allocated mem          */
 static __thread u32 call_depth; /* To avoid recursion via fprintf() */
 static u32          alloc_canary;
 
+/* A mapping: pages for the buffer and its metadata, then the guard page. */
+
+struct pool_slot {
+  u8    *base;
+  size_t pages;
+};
+
+static u8 pool;                           /* AFL_LD_POOL set?           */
+static volatile u8 pool_lock;
+
+static struct pool_slot pool_quarantine[POOL_QUARANTINE];
+static u32              pool_quarantine_next, pool_quarantine_cnt;
+
+static struct pool_slot pool_class[POOL_MAX_PAGES][POOL_CLASS_SLOTS];
+static u32              pool_class_cnt[POOL_MAX_PAGES];
+
+static struct pool_slot pool_unmap[POOL_UNMAP_BATCH];
+static u32              pool_unmap_cnt;
+
+#define POOL_LOCK()                                           \
+  do {                                                        \
+    while (__atomic_test_and_set(&pool_lock, __ATOMIC_ACQUIRE)) \
+      sched_yield();                                          \
+                                                              \
+  } while (0)
+
+#define POOL_UNLOCK() __atomic_clear(&pool_lock, __ATOMIC_RELEASE)
+
+/* Take a mapping of this many pages kept for reuse, NULL if there is none. */
+
+static u8 *pool_get(size_t pages) {
+  u8 *ret = NULL;
+
+  if (pages > POOL_MAX_PAGES) return NULL;
+
+  POOL_LOCK();
+  if (pool_class_cnt[pages - 1])
+    ret = pool_class[pages - 1][--pool_class_cnt[pages - 1]].base;
+  POOL_UNLOCK();
+
+  return ret;
+}
+
+/* Unmap a batch of mappings, those next to each other (mmap() tends to hand
+   them out that way) with a single munmap(). */
+
+static void pool_unmap_batch(struct pool_slot *batch, u32 cnt) {
+  u32 i, j;
+
+  for (i = 1; i < cnt; ++i) {
+    struct pool_slot tmp = batch[i];
+    for (j = i; j && batch[j - 1].base > tmp.base; --j)
+      batch[j] = batch[j - 1];
+    batch[j] = tmp;
+  }
+
+  for (i = 0; i < cnt; i = j) {
+    u8 *end = batch[i].base + (batch[i].pages + 1) * PAGE_SIZE;
+
+    for (j = i + 1; j < cnt && batch[j].base == end; ++j)
+      end += (batch[j].pages + 1) * PAGE_SIZE;
+
+    if (munmap(batch[i].base, end - batch[i].base))
+      DEBUGF("munmap() failed when releasing memory");
+  }
+}
+
+/* Put a freed (PROT_NONE) mapping into quarantine, and the one it pushes out
+   up for reuse or unmapping. */
+
+static void pool_put(u8 *base, size_t pages) {
+  struct pool_slot old, batch[POOL_UNMAP_BATCH];
+  u32              cnt = 0;
+
+  POOL_LOCK();
+
+  if (pool_quarantine_cnt < POOL_QUARANTINE) {
+    pool_quarantine[(pool_quarantine_next + pool_quarantine_cnt++) %
+                    POOL_QUARANTINE] = (struct pool_slot){base, pages};
+    POOL_UNLOCK();
+    return;
+  }
+
+  old = pool_quarantine[pool_quarantine_next];
+  pool_quarantine[pool_quarantine_next] = (struct pool_slot){base, pages};
+  pool_quarantine_next = (pool_quarantine_next + 1) % POOL_QUARANTINE;
+
+  if (old.pages <= POOL_MAX_PAGES &&
+      pool_class_cnt[old.pages - 1] < POOL_CLASS_SLOTS) {
+    pool_class[old.pages - 1][pool_class_cnt[old.pages - 1]++] = old;
+
+  } else {
+    pool_unmap[pool_unmap_cnt++] = old;
+
+    if (pool_unmap_cnt == POOL_UNMAP_BATCH) {
+      memcpy(batch, pool_unmap, sizeof(pool_unmap));
+      cnt = pool_unmap_cnt;
+      pool_unmap_cnt = 0;
+    }
+  }
+
+  POOL_UNLOCK();
+
+  if (cnt) pool_unmap_batch(batch, cnt);
+}
+
 /* This is the main alloc function. It allocates one page more than necessary,
    sets that tailing page to PROT_NONE, and then increments the return address
    so that it is right-aligned to that boundary. Since it always uses mmap(),
@@ -182,6 +299,18 @@ static void *__dislocator_alloc(size_t len) {
 
   base = NULL;
   tlen = (1 + PG_COUNT(rlen + 8)) * PAGE_SIZE;
+
+  /* A reused mapping just needs its pages (not the guard page) accessible
+     again. Unlike a new one, it is not zeroed. */
+
+  if (pool && (ret = pool_get(PG_COUNT(rlen + 8)))) {
+    if (mprotect(ret, PG_COUNT(rlen + 8) * PAGE_SIZE, PROT_READ | PROT_WRITE))
+      FATAL("mprotect() failed when reusing memory");
+
+    memset(ret, 0, PG_COUNT(rlen + 8) * PAGE_SIZE);
+    goto got_mapping;
+  }
+
   protflags = PROT_READ | PROT_WRITE;
   flags = MAP_PRIVATE | MAP_ANONYMOUS;
   fd = -1;
@@ -253,6 +382,8 @@ static void *__dislocator_alloc(size_t len) {
   if (mprotect(ret + PG_COUNT(rlen + 8) * PAGE_SIZE, PAGE_SIZE, PROT_NONE))
     FATAL("mprotect() failed when allocating memory");
 
+got_mapping:
+
   /* Offset the return pointer so that it's right-aligned to the page
      boundary. */
 
@@ -355,9 +486,10 @@ void free(void *ptr) {
   if (mprotect(ptr_ - 8, PG_COUNT(len + 8) * PAGE_SIZE, PROT_NONE))
     FATAL("mprotect() failed when freeing memory");
 
-  ptr = ptr_;
+  /* Keep the mapping; this is wasteful, but prevents ptr reuse. Unless
+     pooled, then it is reused (or unmapped) POOL_QUARANTINE frees later. */
 
-  /* Keep the mapping; this is wasteful, but prevents ptr reuse. */
+  if (pool) pool_put(ptr_ - 8, PG_COUNT(len + 8));
 }
 
 /* Realloc is pretty straightforward, too. We forcibly reallocate the buffer,
@@ -504,6 +636,7 @@ __attribute__((constructor)) void __dislocator_init(void) {
   hard_fail = !!getenv("AFL_LD_HARD_FAIL");
   no_calloc_over = !!getenv("AFL_LD_NO_CALLOC_OVER");
   align_allocations = !!getenv("AFL_ALIGNED_ALLOC");
+  pool = !!getenv("AFL_LD_POOL");
 }
 
 /* NetBSD fault handler specific api subset */
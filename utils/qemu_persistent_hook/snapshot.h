@@ -0,0 +1,331 @@
+/*
+   Dirty page snapshots of guest memory for QEMU persistent hooks.
+
+   AFL_QEMU_PERSISTENT_GPR only resets the registers, so a persistent loop
+   around a function that changes globals runs every iteration on whatever
+   the previous ones left behind, and AFL_QEMU_PERSISTENT_MEM copies back
+   all writable guest pages each time. Instead, register the regions that
+   leak state once with snapshot_add() or snapshot_add_image(), call
+   snapshot_take() in the first call of afl_persistent_hook() and
+   snapshot_restore() in all later ones. Only the pages written to since
+   then are copied back.
+
+   The guest runs in the address space of QEMU, so the pages written to are
+   found with the soft-dirty bits of the kernel: snapshot_take() and
+   snapshot_restore() clear them (/proc/self/clear_refs) and the next
+   restore reads them back from /proc/self/pagemap. That costs a walk of
+   the page tables of the whole process, which for small regions is slower
+   than comparing every page with its copy, so below SNAPSHOT_SOFT_DIRTY_MIN
+   bytes or without soft-dirty support in the kernel the pages are compared
+   instead.
+
+   Only the registered memory goes back to its state at the snapshot: the
+   heap, mappings and files the guest got since are not undone, a global
+   pointing to a block the iteration freed is left dangling. Register
+   .data/.bss, not the heap.
+
+   Usage:
+
+     #include "snapshot.h"
+
+     void afl_persistent_hook(struct x86_64_regs *regs, uint64_t guest_base,
+                              uint8_t *input_buf, uint32_t input_buf_len) {
+       static snapshot_t *snap;
+
+       if (!snap) {
+         snap = snapshot_new(guest_base);
+         snapshot_add_image(snap, "/path/to/target");  // its .data and .bss
+         snapshot_add(snap, 0x4a0000, 0x2000);          // guest addresses
+         snapshot_take(snap);
+       } else {
+         snapshot_restore(snap);
+       }
+       ...
+     }
+
+   snapshot_restore_range() restores just a part of the registered memory,
+   e.g. the one table that actually matters for a target, and leaves the
+   rest as the iterations left it.
+*/
+
+#ifndef _QEMU_PERSISTENT_SNAPSHOT_H
+#define _QEMU_PERSISTENT_SNAPSHOT_H
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define SNAPSHOT_REGIONS_MAX 32
+#define SNAPSHOT_SOFT_DIRTY_MIN (1024 * 1024)
+#define SNAPSHOT_PM_SOFT_DIRTY (1ULL << 55)
+
+typedef struct snapshot_region {
+  uint8_t *host;  // where the guest memory is in our address space
+  size_t   size;
+  uint8_t *copy;  // the contents at snapshot_take()
+
+} snapshot_region_t;
+
+typedef struct snapshot {
+  uint64_t          guest_base;
+  snapshot_region_t regions[SNAPSHOT_REGIONS_MAX];
+  uint32_t          region_cnt;
+  size_t            total, page_size;
+  int               clear_fd, pagemap_fd;  // -1 unless soft-dirty is used
+  uint64_t         *pm;                    // pagemap entries of a region
+  size_t            pm_size;
+  volatile uint8_t *probe;                 // a page to check the bits on
+
+} snapshot_t;
+
+static void snapshot_die(const char *what) {
+  perror(what);
+  exit(1);
+}
+
+static snapshot_t *snapshot_new(uint64_t guest_base) {
+  snapshot_t *snap = calloc(1, sizeof(snapshot_t));
+
+  if (!snap) snapshot_die("snapshot: calloc");
+
+  snap->guest_base = guest_base;
+  snap->page_size = sysconf(_SC_PAGESIZE);
+  snap->clear_fd = snap->pagemap_fd = -1;
+  return snap;
+}
+
+static void snapshot_add_host(snapshot_t *snap, uint8_t *host, size_t size) {
+  snapshot_region_t *r;
+
+  if (!size) return;
+
+  if (snap->region_cnt == SNAPSHOT_REGIONS_MAX) {
+    fprintf(stderr, "snapshot: too many regions (max %d)\n",
+            SNAPSHOT_REGIONS_MAX);
+    exit(1);
+  }
+
+  r = &snap->regions[snap->region_cnt++];
+  r->host = host;
+  r->size = size;
+  r->copy = malloc(size);
+  if (!r->copy) snapshot_die("snapshot: malloc");
+
+  snap->total += size;
+}
+
+/* Snapshot the guest memory [addr, addr + size). */
+static void snapshot_add(snapshot_t *snap, uint64_t addr, size_t size) {
+  snapshot_add_host(snap, (uint8_t *)(uintptr_t)(addr + snap->guest_base),
+                    size);
+}
+
+/* Snapshot the writable segments of the guest binary or library at path,
+   and the anonymous mapping right after each of them, which is its .bss.
+   Returns the number of mappings added. */
+static uint32_t snapshot_add_image(snapshot_t *snap, const char *path) {
+  char               real[PATH_MAX], line[PATH_MAX + 128], perms[8];
+  unsigned long long start, end, last_end = 0;
+  uint32_t           cnt = 0;
+  int                name;
+  FILE              *f;
+
+  if (!realpath(path, real)) snapshot_die("snapshot: realpath");
+  if (!(f = fopen("/proc/self/maps", "r"))) snapshot_die("snapshot: maps");
+
+  while (fgets(line, sizeof(line), f)) {
+    line[strcspn(line, "\n")] = 0;
+    name = 0;
+    if (sscanf(line, "%llx-%llx %7s %*s %*s %*s %n", &start, &end, perms,
+               &name) < 3)
+      continue;
+
+    if (name && !strcmp(line + name, real)) {
+      if (perms[1] == 'w') {
+        snapshot_add_host(snap, (uint8_t *)(uintptr_t)start, end - start);
+        ++cnt;
+      }
+
+      last_end = end;
+      continue;
+    }
+
+    if (!line[name] && start == last_end && perms[1] == 'w') {
+      snapshot_add_host(snap, (uint8_t *)(uintptr_t)start, end - start);
+      ++cnt;
+    }
+
+    last_end = 0;
+  }
+
+  fclose(f);
+  return cnt;
+}
+
+static int snapshot_clear_dirty(snapshot_t *snap) {
+  return pwrite(snap->clear_fd, "4", 1, 0) == 1 ? 0 : -1;
+}
+
+/* Kernels without CONFIG_MEM_SOFT_DIRTY take the clear_refs request but
+   never set the bit, see whether a page we write to gets it. */
+static int snapshot_soft_dirty_works(snapshot_t *snap) {
+  uint64_t entry = 0;
+
+  snap->probe = mmap(NULL, snap->page_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (snap->probe == MAP_FAILED) return 0;
+
+  snap->probe[0] = 1;
+  if (snapshot_clear_dirty(snap)) return 0;
+  snap->probe[0] = 2;
+
+  if (pread(snap->pagemap_fd, &entry, sizeof(entry),
+            (uintptr_t)snap->probe / snap->page_size * sizeof(entry)) !=
+      sizeof(entry))
+    return 0;
+
+  return !!(entry & SNAPSHOT_PM_SOFT_DIRTY);
+}
+
+/* Save the contents of all regions. */
+static void snapshot_take(snapshot_t *snap) {
+  snapshot_region_t *r;
+  uint32_t           i;
+
+  if (snap->total >= SNAPSHOT_SOFT_DIRTY_MIN && !snap->probe) {
+    snap->clear_fd = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+    snap->pagemap_fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+
+    if (snap->clear_fd < 0 || snap->pagemap_fd < 0 ||
+        !snapshot_soft_dirty_works(snap)) {
+      if (snap->clear_fd >= 0) close(snap->clear_fd);
+      if (snap->pagemap_fd >= 0) close(snap->pagemap_fd);
+      snap->clear_fd = snap->pagemap_fd = -1;
+    }
+  }
+
+  for (i = 0; i < snap->region_cnt; i++) {
+    r = &snap->regions[i];
+    memcpy(r->copy, r->host, r->size);
+  }
+
+  if (snap->clear_fd >= 0 && snapshot_clear_dirty(snap))
+    snapshot_die("snapshot: clear_refs");
+}
+
+/* The pagemap entries of the pages spanning [host, host + size). */
+static uint64_t *snapshot_pagemap(snapshot_t *snap, uint8_t *host,
+                                  size_t size, uintptr_t *first) {
+  size_t  pages;
+  ssize_t len;
+
+  *first = (uintptr_t)host / snap->page_size;
+  pages = ((uintptr_t)host + size - 1) / snap->page_size - *first + 1;
+
+  if (pages > snap->pm_size) {
+    snap->pm = realloc(snap->pm, pages * sizeof(uint64_t));
+    if (!snap->pm) snapshot_die("snapshot: realloc");
+    snap->pm_size = pages;
+  }
+
+  len = pread(snap->pagemap_fd, snap->pm, pages * sizeof(uint64_t),
+              *first * sizeof(uint64_t));
+  if (len != (ssize_t)(pages * sizeof(uint64_t)))
+    snapshot_die("snapshot: pagemap");
+
+  return snap->pm;
+}
+
+/* Copy back the changed pages of [host, host + size) of region r. */
+static size_t snapshot_restore_part(snapshot_t *snap, snapshot_region_t *r,
+                                    uint8_t *host, size_t size) {
+  uint8_t  *end = host + size, *next, *copy;
+  uint64_t *pm = NULL;
+  uintptr_t first = 0;
+  size_t    cnt = 0, len;
+
+  if (snap->pagemap_fd >= 0) pm = snapshot_pagemap(snap, host, size, &first);
+
+  for (; host < end; host = next) {
+    next = (uint8_t *)(((uintptr_t)host / snap->page_size + 1) *
+                       snap->page_size);
+    if (next > end) next = end;
+
+    len = next - host;
+    copy = r->copy + (host - r->host);
+
+    if (pm) {
+      if (!(pm[(uintptr_t)host / snap->page_size - first] &
+            SNAPSHOT_PM_SOFT_DIRTY))
+        continue;
+
+    } else if (!memcmp(host, copy, len)) {
+      continue;
+    }
+
+    memcpy(host, copy, len);
+    ++cnt;
+  }
+
+  return cnt;
+}
+
+/* Copy back the pages written to since the last take or restore. Returns
+   the number of pages restored. */
+static size_t snapshot_restore(snapshot_t *snap) {
+  snapshot_region_t *r;
+  size_t             cnt = 0;
+  uint32_t           i;
+
+  for (i = 0; i < snap->region_cnt; i++) {
+    r = &snap->regions[i];
+    cnt += snapshot_restore_part(snap, r, r->host, r->size);
+  }
+
+  if (snap->clear_fd >= 0 && snapshot_clear_dirty(snap))
+    snapshot_die("snapshot: clear_refs");
+
+  return cnt;
+}
+
+/* Like snapshot_restore(), but only for the registered memory within the
+   guest range [addr, addr + size). The soft-dirty bits are not cleared, so
+   the pages of the other regions are still found by the next restore. */
+static size_t snapshot_restore_range(snapshot_t *snap, uint64_t addr,
+                                     size_t size) {
+  uint8_t           *start = (uint8_t *)(uintptr_t)(addr + snap->guest_base);
+  uint8_t           *end = start + size, *s, *e;
+  snapshot_region_t *r;
+  size_t             cnt = 0;
+  uint32_t           i;
+
+  for (i = 0; i < snap->region_cnt; i++) {
+    r = &snap->regions[i];
+    s = start > r->host ? start : r->host;
+    e = end < r->host + r->size ? end : r->host + r->size;
+    if (s < e) cnt += snapshot_restore_part(snap, r, s, e - s);
+  }
+
+  return cnt;
+}
+
+static void snapshot_free(snapshot_t *snap) {
+  uint32_t i;
+
+  for (i = 0; i < snap->region_cnt; i++)
+    free(snap->regions[i].copy);
+
+  if (snap->clear_fd >= 0) close(snap->clear_fd);
+  if (snap->pagemap_fd >= 0) close(snap->pagemap_fd);
+  if (snap->probe && snap->probe != MAP_FAILED)
+    munmap((void *)snap->probe, snap->page_size);
+  free(snap->pm);
+  free(snap);
+}
+
+#endif
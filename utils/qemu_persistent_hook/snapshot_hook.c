@@ -0,0 +1,108 @@
+/*
+   A persistent hook that puts globals back between iterations, see
+   snapshot.h. Use it as is with
+
+     AFL_QEMU_PERSISTENT_HOOK=/path/to/snapshot_hook.so
+
+   and it takes a snapshot of the writable segments of the target binary
+   (its .data and .bss) at the first iteration and restores the pages
+   written to at every other. AFL_QEMU_SNAPSHOT_RANGES=0xaaaa-0xbbbb,...
+   snapshots these guest ranges instead, e.g. the writable segments of a
+   library as shown by AFL_QEMU_DEBUG_MAPS=1.
+
+   It does not touch the registers or the input, use AFL_QEMU_PERSISTENT_GPR
+   and let the target read its input as before.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "snapshot.h"
+
+static snapshot_t *snap;
+
+/* afl-fuzz starts QEMU as: afl-qemu-trace -- target args... */
+static int target_path(char *buf, size_t len) {
+  size_t n;
+  char  *arg, *end;
+  FILE  *f = fopen("/proc/self/cmdline", "r");
+
+  if (!f) return -1;
+  n = fread(buf, 1, len - 1, f);
+  fclose(f);
+  buf[n] = 0;
+  end = buf + n;
+
+  for (arg = buf + strlen(buf) + 1; arg < end; arg += strlen(arg) + 1) {
+    if (strcmp(arg, "--")) continue;
+    arg += strlen(arg) + 1;
+    if (arg >= end) return -1;
+    memmove(buf, arg, strlen(arg) + 1);
+    return 0;
+  }
+
+  /* run by hand: afl-qemu-trace target args... */
+  arg = buf + strlen(buf) + 1;
+  if (arg >= end) return -1;
+  memmove(buf, arg, strlen(arg) + 1);
+  return 0;
+}
+
+static void add_ranges(char *ranges) {
+  unsigned long long start, end;
+  char              *range;
+
+  for (range = strtok(ranges, ","); range; range = strtok(NULL, ",")) {
+    if (sscanf(range, "%llx-%llx", &start, &end) != 2 || end <= start) {
+      fprintf(stderr, "snapshot_hook: bad range '%s'\n", range);
+      exit(1);
+    }
+
+    snapshot_add(snap, start, end - start);
+  }
+}
+
+/* The regs are not used, so any arch will do. */
+void afl_persistent_hook(void *regs, uint64_t guest_base, uint8_t *input_buf,
+                         uint32_t input_buf_len) {
+  char *ranges;
+  char  path[4096];
+
+  (void)regs;
+  (void)input_buf;
+  (void)input_buf_len;
+
+  if (snap) {
+    snapshot_restore(snap);
+    return;
+  }
+
+  snap = snapshot_new(guest_base);
+
+  if ((ranges = getenv("AFL_QEMU_SNAPSHOT_RANGES"))) {
+    ranges = strdup(ranges);
+    add_ranges(ranges);
+    free(ranges);
+
+  } else if (target_path(path, sizeof(path)) ||
+             !snapshot_add_image(snap, path)) {
+    fprintf(stderr,
+            "snapshot_hook: no writable segments of the target found, set "
+            "AFL_QEMU_SNAPSHOT_RANGES\n");
+    exit(1);
+  }
+
+  snapshot_take(snap);
+
+  if (getenv("AFL_DEBUG"))
+    fprintf(stderr, "snapshot_hook: %u regions, %zu bytes, %s\n",
+            snap->region_cnt, snap->total,
+            snap->clear_fd >= 0 ? "soft-dirty bits" : "compared pages");
+}
+
+int afl_persistent_hook_init(void) {
+  // 0: the target reads its input itself, input_buf stays NULL
+  return 0;
+}
@@ -4,6 +4,11 @@
  *
  * It is packaged in afl++ to have it at hand if needed
  *
+ * With AFL_SOCKETFUZZ_LOOP=n and a target built with afl-cc it runs the
+ * target in persistent mode instead: every accept() starts the next of n
+ * iterations of the persistent loop and returns a connection which delivers
+ * the testcase, see README.md.
+ *
  */
 
 #define _GNU_SOURCE
@@ -23,6 +28,9 @@
 #include <errno.h>
 #include <stdio.h>
 #include <poll.h>
+#include <sys/uio.h>
+
+#include "config.h"
 // #include "logging.h" // switched from preeny_info() to fprintf(stderr, "Info:
 // "
 
@@ -31,9 +39,185 @@
 //
 int (*original_close)(int);
 int (*original_dup2)(int, int);
+ssize_t (*original_write)(int, const void *, size_t);
+ssize_t (*original_send)(int, const void *, size_t, int);
+ssize_t (*original_sendto)(int, const void *, size_t, int,
+                           const struct sockaddr *, socklen_t);
+ssize_t (*original_sendmsg)(int, const struct msghdr *, int);
+ssize_t (*original_writev)(int, const struct iovec *, int);
+int (*original_setsockopt)(int, int, int, const void *, socklen_t);
+
+//
+// persistent mode, the afl-cc runtime exports these
+//
+#define SF_FDS_MAX 4096
+#define SF_FDS_GAP 64
+
+static unsigned int   loop_cnt;
+static int (*afl_persistent_loop)(unsigned int);
+static void (*afl_manual_init)(void);
+static unsigned char **afl_fuzz_ptr;
+static unsigned int  **afl_fuzz_len;
+static unsigned char  *stdin_buf;
+static int             conn_fd = -1;
+static unsigned char   fds_open[SF_FDS_MAX / 8];
+static int             fds_max;
+
+static void persistent_init(void) {
+  char *ptr = getenv("AFL_SOCKETFUZZ_LOOP");
+  int  *sharedmem_fuzzing;
+
+  if (!ptr || (loop_cnt = atoi(ptr)) == 0) { return; }
+
+  afl_persistent_loop = dlsym(RTLD_DEFAULT, "__afl_persistent_loop");
+  afl_manual_init = dlsym(RTLD_DEFAULT, "__afl_manual_init");
+  afl_fuzz_ptr = dlsym(RTLD_DEFAULT, "__afl_fuzz_ptr");
+  afl_fuzz_len = dlsym(RTLD_DEFAULT, "__afl_fuzz_len");
+  sharedmem_fuzzing = dlsym(RTLD_DEFAULT, "__afl_sharedmem_fuzzing");
+
+  if (!afl_persistent_loop || !afl_manual_init || !afl_fuzz_ptr ||
+      !afl_fuzz_len || !sharedmem_fuzzing) {
+    fprintf(stderr,
+            "Warning: AFL_SOCKETFUZZ_LOOP needs a target built with afl-cc, "
+            "falling back to stdin\n");
+    loop_cnt = 0;
+    return;
+  }
+
+  /* Before the runtime's constructors look at these: we take the testcases
+     from shared memory, loop in accept() and start the forkserver there, once
+     the target is ready to take connections. */
+
+  *sharedmem_fuzzing = 1;
+  setenv(PERSIST_ENV_VAR, "1", 1);
+  setenv(DEFER_ENV_VAR, "1", 1);
+}
+
 __attribute__((constructor)) void preeny_desock_dup_orig() {
   original_close = dlsym(RTLD_NEXT, "close");
   original_dup2 = dlsym(RTLD_NEXT, "dup2");
+  original_write = dlsym(RTLD_NEXT, "write");
+  original_send = dlsym(RTLD_NEXT, "send");
+  original_sendto = dlsym(RTLD_NEXT, "sendto");
+  original_sendmsg = dlsym(RTLD_NEXT, "sendmsg");
+  original_writev = dlsym(RTLD_NEXT, "writev");
+  original_setsockopt = dlsym(RTLD_NEXT, "setsockopt");
+  persistent_init();
+}
+
+/* Remember which fds are open when the loop starts. */
+
+static void fds_snapshot(void) {
+  int fd;
+
+  for (fd = 0; fd < SF_FDS_MAX; fd++) {
+    if (fcntl(fd, F_GETFD) != -1) {
+      fds_open[fd / 8] |= 1 << (fd % 8);
+      fds_max = fd;
+    }
+  }
+}
+
+/* Close what the last iteration left open, i.e. everything that was not
+   open when the loop started. fds are handed out lowest first, so these sit
+   among or right above the ones that were, we stop looking after a gap. */
+
+static void fds_reset(void) {
+  int fd, gap = 0;
+
+  for (fd = 3; fd < SF_FDS_MAX && gap < SF_FDS_GAP; fd++) {
+    if (fd <= fds_max && (fds_open[fd / 8] & (1 << (fd % 8)))) { continue; }
+
+    if (fcntl(fd, F_GETFD) == -1) {
+      if (fd > fds_max) { gap++; }
+      continue;
+    }
+
+    gap = 0;
+    original_close(fd);
+  }
+
+  conn_fd = -1;
+}
+
+/* The testcase, from shared memory or, outside of afl-fuzz, stdin. */
+
+static unsigned char *testcase(unsigned int *len) {
+  ssize_t ret;
+
+  if (*afl_fuzz_ptr) {
+    *len = **afl_fuzz_len;
+    return *afl_fuzz_ptr;
+  }
+
+  if (!stdin_buf && !(stdin_buf = malloc(MAX_FILE))) {
+    perror("malloc");
+    exit(1);
+  }
+
+  *len = 0;
+  while (*len < MAX_FILE &&
+         (ret = read(0, stdin_buf + *len, MAX_FILE - *len)) > 0) {
+    *len += ret;
+  }
+
+  return stdin_buf;
+}
+
+/* Start the next iteration and return a connection that reads the testcase
+   and then EOF. It is one end of a socketpair, so that poll(), epoll and
+   friends work on it as usual, what the target sends to it is dropped. */
+
+static int persistent_accept(void) {
+  static int     first = 1;
+  static int     warned;
+  unsigned char *buf;
+  unsigned int   len, done = 0;
+  int            sp[2], size;
+  ssize_t        ret;
+
+  if (first) {
+    first = 0;
+    fds_snapshot();
+    afl_manual_init();
+
+  } else {
+    fds_reset();
+  }
+
+  if (!afl_persistent_loop(loop_cnt)) { exit(0); }
+
+  buf = testcase(&len);
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp) < 0) {
+    perror("socketpair");
+    exit(1);
+  }
+
+  size = len + 4096;
+  original_setsockopt(sp[1], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+  original_setsockopt(sp[0], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  fcntl(sp[1], F_SETFL, O_NONBLOCK);
+
+  while (done < len &&
+         (ret = original_write(sp[1], buf + done, len - done)) > 0) {
+    done += ret;
+  }
+
+  if (done < len && !warned) {
+    fprintf(stderr,
+            "Warning: testcases are cut off at %u bytes, raise "
+            "net.core.wmem_max\n",
+            done);
+    warned = 1;
+  }
+
+  /* the other end stays open until the next iteration, so writes do not
+     fail with EPIPE */
+  shutdown(sp[1], SHUT_WR);
+
+  conn_fd = sp[0];
+  return conn_fd;
 }
 
 int close(int sockfd) {
@@ -42,10 +226,50 @@ int close(int sockfd) {
     return 0;
 
   } else {
+    if (sockfd == conn_fd) { conn_fd = -1; }
     return original_close(sockfd);
   }
 }
 
+ssize_t write(int fd, const void *buf, size_t count) {
+  if (fd == conn_fd && fd != -1) { return count; }
+  return original_write(fd, buf, count);
+}
+
+ssize_t send(int sockfd, const void *buf, size_t len, int flags) {
+  if (sockfd == conn_fd && sockfd != -1) { return len; }
+  return original_send(sockfd, buf, len, flags);
+}
+
+ssize_t sendto(int sockfd, const void *buf, size_t len, int flags,
+               const struct sockaddr *dest_addr, socklen_t addrlen) {
+  if (sockfd == conn_fd && sockfd != -1) { return len; }
+  return original_sendto(sockfd, buf, len, flags, dest_addr, addrlen);
+}
+
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt) {
+  ssize_t len = 0;
+  int     i;
+
+  if (fd == conn_fd && fd != -1) {
+    for (i = 0; i < iovcnt; i++) {
+      len += iov[i].iov_len;
+    }
+
+    return len;
+  }
+
+  return original_writev(fd, iov, iovcnt);
+}
+
+ssize_t sendmsg(int sockfd, const struct msghdr *msg, int flags) {
+  if (sockfd == conn_fd && sockfd != -1) {
+    return writev(sockfd, msg->msg_iov, msg->msg_iovlen);
+  }
+
+  return original_sendmsg(sockfd, msg, flags);
+}
+
 int dup2(int old, int new) {
   if (new <= 2) {
     fprintf(stderr, "Info: Disabling dup from %d to %d\n", old, new);
@@ -60,10 +284,20 @@ int accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen) {
   (void)sockfd;
   (void)addr;
   (void)addrlen;
+  if (loop_cnt) { return persistent_accept(); }
   fprintf(stderr, "Info: Emulating accept on %d\n", sockfd);
   return 0;
 }
 
+int accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen,
+            int flags) {
+  int fd = accept(sockfd, addr, addrlen);
+
+  if (fd > 0 && (flags & SOCK_NONBLOCK)) { fcntl(fd, F_SETFL, O_NONBLOCK); }
+  if (fd > 0 && (flags & SOCK_CLOEXEC)) { fcntl(fd, F_SETFD, FD_CLOEXEC); }
+  return fd;
+}
+
 int bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
   (void)sockfd;
   (void)addr;
@@ -74,8 +308,22 @@ int bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
 }
 
 int listen(int sockfd, int backlog) {
-  (void)sockfd;
+  int sp[2], flags;
+
   (void)backlog;
+
+  /* Targets that wait for the listening socket to become readable before
+     they accept() find it always is: it is replaced by a socketpair with a
+     byte waiting that nobody reads. */
+
+  if (loop_cnt && socketpair(AF_UNIX, SOCK_STREAM, 0, sp) == 0) {
+    flags = fcntl(sockfd, F_GETFL);
+    original_write(sp[1], "", 1);
+    original_dup2(sp[0], sockfd);
+    original_close(sp[0]);
+    if (flags != -1) { fcntl(sockfd, F_SETFL, flags); }
+  }
+
   return 0;
 }
 